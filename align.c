@@ -44,9 +44,14 @@
 #include <sched.h>
 #include <limits.h>
 #include <sys/resource.h>
+#include <pthread.h>
 
 #include "imio.h"
 #include "dt.h"
+#include "metrics.h"
+#include "exchange.h"
+#include "gpu_forces.h"
+#include "prefetch.h"
 
 #define DEBUG	0
 #define PDEBUG	0
@@ -56,6 +61,13 @@
 #define CONSTRAINED	(1.0e+30)
 #define UNSPECIFIED	(1.0e+30)
 #define MAX_LABEL_LENGTH	255
+#define OUTPUT_TOKEN_TAG	100
+#define MIGRATION_TAG		101
+#define GRID_TILE_TAG		102
+#define GRID_REDUCE_BYTES	(16 * 1024 * 1024)
+#define COMPACT_BLOCK		256	/* springs whose energy -compact_springs
+					   sums in float */
+
 #define QUOTE(str)		#str
 #define EXPAND_AND_QUOTE(str)	QUOTE(str)
 
@@ -109,6 +121,12 @@ typedef struct Image
   Node *nodes;          /* nodes in the image at current level */
   Node *initialNodes;   /* the initial node positions for the current step;
 			   used only if recovery from a fold is necessary */
+  Point *velocity;      /* the last step taken by each node; used only
+			   with -momentum */
+  Point *direction;     /* the search direction of each node; used only
+			   with -cg */
+  Point *lineForce;     /* the force on each node at the start of the
+			   current line search; used only with -cg */
   Point **absolutePositions;
                         /* absolute positions at each level for each node */
   Point **initialPositions;
@@ -123,6 +141,28 @@ typedef struct Image
   float kFactor;        /* factor to be applied to spring constants for
 			   intra-image springs of this image */
   int marked;		/* true if we have marked this image as near a fold */
+  int nextOwned;	/* next image owned by this process (-1 if none) */
+  Point *foldCheckPos;	/* node positions when last found free of folds */
+  int foldCheckN;	/* number of those positions (0 if none) */
+  float foldMargin;	/* how far (in L1 distance) every node may move
+			   from those positions without a fold appearing */
+  int pinned;		/* true if this image was aligned by the previous
+			   chunk, and is fixed at its output (see -chunk) */
+  int settled;		/* true if this image and its neighbors converged
+			   at a coarser level, so that it is only
+			   interpolated to the finer ones (see -settle) */
+  float *exchanged;	/* with -compress_exchange, the positions (x and
+			   y of each node) as last exchanged, which is
+			   what the receivers of the image hold */
+  int nExchanged;	/* number of floats in exchanged */
+  unsigned char *encoded; /* the positions of an owned image encoded for
+			   the current exchange */
+  int nEncoded;		/* number of bytes in encoded */
+  int encodedAt;	/* the exchange encoded was made for */
+  double energy;	/* energy of the absolute and intra-image springs
+			   at the last force computation */
+  double cost;		/* with -rebalance, the seconds spent on those
+			   forces since the start of the level */
 } Image;
 
 typedef struct IntraImageMap
@@ -134,6 +174,8 @@ typedef struct IntraImageMap
   int *nSprings;        /* number of springs at each level */
   struct IntraImageSpring **springs;
                         /* array of springs at each level */
+  int packedFor;        /* process this model was last packed for by
+			   MigrateImages (-1 if none) */
 } IntraImageMap;
 
 typedef struct IntraImageSpring
@@ -157,6 +199,25 @@ typedef struct InterImageMap
   struct InterImageStrip **strips;     /* all strips at each level */
   int *nSprings;         /* number of springs at each level */
   struct InterImageSpring **springs;  /* all springs at each level */
+
+  /* the springs of one level unpacked into separate arrays
+     for the force loop */
+  int decodedLevel;      /* level of the decoded springs (-1 if none) */
+  int decodedVersion;    /* springsVersion when they were decoded */
+  int nDecoded;          /* number of decoded springs */
+  int decodedSize;       /* allocated length of the decoded arrays */
+  int *index0;           /* node index in image0 of each spring */
+  int *index1;           /* node index in image1 of each spring */
+  float *offsetX;        /* pixel offset added to the image1 node */
+  float *offsetY;
+  float *weight;         /* spring constant (0.0 to 1.0) */
+  short *dx, *dy;        /* with -compact_springs, the offsets and */
+  unsigned char *kq;     /*   constants kept in their packed units
+			    instead of offsetX, offsetY, and weight */
+  double energy;         /* energy of the springs at the last force
+			    computation */
+  double cost;           /* with -rebalance, the seconds spent on those
+			    forces since the start of the level */
 } InterImageMap;
 
 typedef struct InterImageStrip
@@ -202,6 +263,61 @@ typedef struct SpringForce
   float force;
 } SpringForce;
 
+typedef struct CheckpointState
+{
+  int step;              /* step and iteration at which to resume */
+  int iter;
+  float dampingFactor;
+  int outputRequestedIter;
+  int terminationRequestedIter;
+  int refinementRequestedIter;
+  double epochInitialTotalEnergy;
+  double epochFinalTotalEnergy;
+  double prevTotalEnergy;
+  double totalEnergy;
+  double deltaEnergy;
+  time_t lastOutput;
+  int nDecrease;
+  int nIncrease;
+  float globalMaxF;
+  int prevReducedIter;
+  int reducePending;
+  double reduceOut[2];
+  int foldRecoveryCount;
+  float outputGridScale;
+  float outputGridOffsetX, outputGridOffsetY;
+} CheckpointState;
+
+typedef struct PendingMap
+{
+  char fn[PATH_MAX];     /* file to write the map to */
+  MapElement *map;
+  int level;
+  int nx, ny;
+  char *imageName;
+} PendingMap;
+
+typedef struct ForceThread
+{
+  pthread_t thread;
+  int t;                 /* index of this thread */
+  int phase;             /* 0 = absolute and intra-image forces,
+			    1 = inter-image forces,
+			    2 = add the buffered inter-image forces
+			        into the nodes */
+  int level;
+  double energy;         /* energy accumulated by this thread */
+  float *f;              /* inter-image forces (x and y for each node)
+			    accumulated by this thread */
+} ForceThread;
+
+typedef struct Package
+{
+  unsigned char *data;   /* the state being sent to one process */
+  size_t n;              /* bytes used */
+  size_t size;           /* bytes allocated */
+} Package;
+
 
 int p;      /* rank of this process */
 int np;     /* number of processes in this run */
@@ -211,6 +327,9 @@ int params[12];
 float fParams[5];
 char imagesName[PATH_MAX];
 char imageListName[PATH_MAX];
+char imageManifestName[PATH_MAX];	/* if nonempty, the manifest
+					   caching the image sizes (see
+					   ScanImageSizes) */
 char mapListName[PATH_MAX];
 char mapsName[PATH_MAX];
 char initialMapsName[PATH_MAX];
@@ -235,23 +354,97 @@ int outputGridSequence = 0;
 int outputGridLabel = 1;
 int outputFoldMaps = 0;
 char outputSpringsName[PATH_MAX];
+char outputStatsName[PATH_MAX];	/* prefix of the per-image convergence
+				   statistics written every epoch */
+int outputHeatMaps = 0;		/* also write a force magnitude image of
+				   each image every epoch */
+FILE *statsFile = NULL;
 char constraintName[PATH_MAX];
 int nFixedImages = 0;
 char **fixedImages = 0;
 int showConstraints = 0;
 int epochIterations = 512;
+float momentum = 0.0;	/* fraction of each node's previous step that is
+			   carried into the next one */
+int conjugateGradient = 0;	/* relax by nonlinear conjugate gradients
+				   instead of damped steps */
+int nThreads = 1;	/* threads computing forces in each process */
+ForceThread *forceThreads = NULL;
+int *forceOffset = NULL;/* index of the first node of each image in the
+			   thread force buffers (-1 if not touched by any
+			   map) */
+int nForceNodes = 0;
+int forceBufferNodes = 0;
+int gpuForces = 0;	/* compute the forces and moves on a GPU */
+int compactSprings = 0;	/* decode the inter-image springs into 13
+			   rather than 20 bytes each, and sum their
+			   energy in float within blocks of
+			   COMPACT_BLOCK springs */
+int readAhead = 0;	/* number of maps to read in the background
+			   ahead of the one being turned into springs */
+int *gpuOffset = NULL;	/* index of the first GPU node of each image
+			   (-1 if not held on the GPU); the owned
+			   images come first */
+int nGpuNodes = 0;
+int nGpuOwnedNodes = 0;
+int gpuSpringsVersion = -1;	/* springsVersion of the springs on the GPU */
+int gpuHostStale = 0;	/* the GPU has moved the owned nodes since they
+			   were last copied back */
+int gpuDeviceStale = 0;	/* the owned nodes have been moved on the CPU
+			   since they were last copied to the GPU */
+float *gpuXY = NULL;	/* positions being copied to or from the GPU */
 
 int nImages = 0;
 Image *images = 0;
 int *imageHashTable = 0;
 IntraImageMap **mapHashTable = 0;
-int myFirstImage, myLastImage;
+int myFirstImage;	/* first image owned by this process (-1 if none);
+			   the others follow through Image.nextOwned */
+int nMyImages;
+int partition = 0;	/* assign images to processes by partitioning
+			   the graph of maps instead of by ranges */
+int planOnly = 0;	/* only report what the alignment would take
+			   (see -plan) */
+char checkpointName[PATH_MAX];	/* prefix of the checkpoint files, one per
+				   process (or "" if none) */
+int checkpointInterval = 4096;	/* iterations between checkpoints */
+int restart = 0;		/* 1 if resuming from the checkpoint files */
+FILE *checkpointFile = NULL;	/* checkpoint being restored */
+int outputWriters = 0;		/* if positive, the number of processes that
+				   may write output maps at the same time;
+				   otherwise each process writes its maps
+				   in the background */
+int mapLevels = 0;		/* coarser copies stored with each output
+				   map */
+PendingMap *pendingMaps = NULL;	/* maps handed over to the writer */
+int nPendingMaps = 0;
+int pendingMapsSize = 0;
+pthread_t mapWriter;
+int mapWriterRunning = 0;
+char springCacheName[PATH_MAX];	/* prefix of the per-process files caching
+				   the inter-image springs (or "" if none) */
+char modelCacheName[PATH_MAX];	/* prefix of the files caching the
+				   intra-image springs of each model
+				   (or "" if none) */
+char updateName[PATH_MAX];	/* prefix of the previous output maps when
+				   only re-aligning around changed maps
+				   (or "" if not) */
+int updateRadius = 2;		/* how many maps away from a changed map
+				   images are still relaxed */
+int chunkIndex = -1;		/* with -chunk, the z-chunk of the image list
+				   to align (or -1 to align all images) */
+int chunkSize = 0;		/* images in each chunk */
+int chunkOverlap = 0;		/* images each chunk shares with the previous
+				   one; the first half of them are pinned to
+				   its output, and the rest aligned again */
 
 int *nConstraints = 0;
 double **constraints = 0;
 double **constrainingCoeff = 0;
 
 int nMaps = 0;
+int springsVersion = 0;	/* incremented whenever the inter-image springs
+			   change, so that decoded copies are refreshed */
 InterImageMap *maps = 0;
 int mapsSize = 0;
 int mapsPos = 0;
@@ -260,6 +453,84 @@ int nPhases;
 CommPhase *commPhases;
 int bufferSize = 0;
 float *buffer = 0;
+int overlapCommunication = 0;	/* exchange positions with nonblocking
+				   messages while intra-image forces
+				   are computed */
+int exchangePending = 0;	/* 1 if an exchange has been started but
+				   not finished */
+Exchange *positionExchange = NULL;	/* the exchange of the positions
+					   themselves, planned for each
+					   level */
+float *exchangeBuffer = NULL;	/* a separate area for every message of
+				   the nonblocking exchange */
+MPI_Request *exchangeRequests = NULL;
+float compressQuantum = 0.0;	/* with -compress_exchange q, the positions
+				   are exchanged as changes since the last
+				   exchange, in multiples of q pixels
+				   (0 to send the floats themselves) */
+int fullExchangeInterval = 100;	/* exchanges between those that send the
+				   floats themselves, when compressing */
+int nPositionExchanges = 0;	/* exchanges since the last full one */
+int nEncodings = 0;		/* times the sent positions were encoded */
+unsigned char *compressBuffer = NULL;	/* a message of encoded positions */
+int hierarchicalCommunication = 0;	/* exchange positions through a
+					   shared area on each node, with
+					   only one process per node sending
+					   to the other nodes */
+MPI_Comm nodeComm = MPI_COMM_NULL;	/* the processes on this node */
+MPI_Comm leaderComm = MPI_COMM_NULL;	/* the first process of each node
+					   (MPI_COMM_NULL on the others) */
+int nodeRank = 0;		/* rank of this process within its node */
+int nNodes = 1;			/* number of nodes */
+int myNode = 0;			/* rank of this node's leader in leaderComm */
+int *processNode = NULL;	/* the node of each process */
+MPI_Win nodeWin;		/* window holding nodePositions */
+float *nodePositions = NULL;	/* the node's shared area for positions;
+				   it has two halves used on alternate
+				   exchanges, so that a process may write the
+				   next positions while another still reads
+				   the previous ones */
+int nodeAreaSize = 0;		/* floats in each half */
+int nodeParity = 0;		/* the half used by the next exchange */
+int nNodeImages = 0;		/* images in the shared area */
+int *nodeImages = NULL;		/* the images in the shared area, that is,
+				   those that some process on the node owns
+				   and another process needs, or that some
+				   process on the node needs from another
+				   node */
+int *nodeOffset = NULL;		/* offset of each image in a half of the
+				   shared area at the current level
+				   (-1 if not there) */
+int *nodeFloats = NULL;		/* floats of each image in the shared area
+				   at the current level */
+int *nodeSendStart = NULL;	/* start in nodeSendImages of the images the
+				   leader sends to each node */
+int *nodeSendImages = NULL;
+int *nodeReceiveStart = NULL;	/* start in nodeReceiveImages of the images
+				   the leader receives from each node */
+int *nodeReceiveImages = NULL;
+int *nodeSendFloats = NULL;	/* start in nodeBuffer of the message to and
+				   from each node at the current level; the
+				   sends follow the receives */
+int *nodeReceiveFloats = NULL;
+float *nodeBuffer = NULL;
+MPI_Request *nodeRequests = NULL;
+int nExchangeRequests = 0;
+int reduceInterval = 1;		/* iterations between global reductions of
+				   the maximum force and total energy */
+MPI_Op maxSumOp;		/* maximum of even, sum of odd elements */
+double reduceIn[8];		/* local maximum force and energy, followed
+				   with -cg by the maximum direction length,
+				   force . direction, maximum force length,
+				   force . force, and force . line force */
+double reduceOut[8];		/* the global values of reduceIn */
+MPI_Request reduceRequest;
+int reducePending = 0;		/* 1 if reduceRequest is in progress */
+int timing = 0;			/* 1 if process 0 should report the time
+				   it spends in the force loop of each
+				   step, and how the time of the
+				   iterations splits into computation,
+				   position exchange and reductions */
 
 FILE *logFile = 0;
 float kAbsolute = 0.0;
@@ -279,6 +550,7 @@ int nSteps = 0;
 Step *steps = NULL;
 
 int foldRecovery = 0;
+int localFoldRecovery = 0;	/* on a fold, restore only the images near it */
 int foldRecoveryCount = 0;
 int foldDetected = 0;
 int minImageWithFold = -1;
@@ -291,6 +563,20 @@ float foldAbsoluteX = 0.0;
 float foldAbsoluteY = 0.0;
 float foldRadius = 32.0;
 
+float settleThreshold = 0.0;	/* images whose energy changes by less than
+				   this fraction over a level, as do all
+				   their neighbors', are frozen at the finer
+				   levels (0.0 if none are) */
+int settleLevel = -1;		/* the level whose starting energies are in
+				   settleEnergy */
+double *settleEnergy = NULL;
+
+float rebalanceThreshold = 0.0;	/* at each level boundary, the images are
+				   reassigned if the busiest process had
+				   more than this fraction of work over the
+				   average at the previous level (0.0 if
+				   they never are) */
+
 int minimizeArea = 0;
 
 int fontWidth, fontHeight;
@@ -397,7 +683,14 @@ void OutputSprings (char *name,
 		    int level,
 		    float scale, float offsetX, float offsetY,
 		    char *focusImage, int focusDepth);
+int LabelBounds (int i, int level, float scale, float offsetX, float offsetY,
+		 int *pMinX, int *pMaxX, int *pMinY, int *pMaxY,
+		 int *pLabelWidth, int *pLabelHeight);
+void CompositeGridTiles (unsigned char *combinedGrid,
+			 int gridWidth, int gridHeight,
+			 unsigned char *tile, int *bounds);
 void OutputFoldMaps (int level, int iter);
+void OutputStats (int step, int iter, int level);
 void hsv_to_rgb (unsigned char* r, unsigned char *g, unsigned char *b,
 		 float h, float s, float v);
 void DrawLine(unsigned char *img, float px0, float py0, float px1, float py1,
@@ -407,6 +700,50 @@ void UpdateDeltas (int level, int iter);
 void RefinePositions (int prevLevel, int level);
 void PlanCommunications (int level);
 void CommunicatePositions (int level);
+void StartPositionExchange ();
+void FinishPositionExchange ();
+void PackPositions (int its, float *v);
+void UnpackPositions (int its, float *v);
+void EncodeSentPositions ();
+void EncodePositions (int its, int full);
+unsigned char *DecodePositions (unsigned char *b, int its);
+void SetUpNodeExchange ();
+void PlanNodeExchange (int level);
+void ExchangeNodePositions ();
+void ExchangeAllPositions (int level);
+void ImageEnergies (int level, double *e);
+void SettleImages (int level);
+void RebalanceImages (int prevLevel, int level);
+void MigrateImages (int *owners, int level);
+int CompareMaps (const void *m0, const void *m1);
+void Pack (Package *pk, void *v, size_t n);
+unsigned char *Unpack (unsigned char *b, void *v, size_t n);
+void PackPointLevels (Package *pk, Point **pts, int i, int level);
+unsigned char *UnpackPointLevels (unsigned char *b, Point ***pPts, int i,
+				  int level);
+InterImageMap *NewMap (char *name, int image0, int image1, float k);
+void LinkMapImages (InterImageMap *m);
+void BuildCommPhases ();
+void FreeCommPhases ();
+void FreeNodeExchange ();
+void MaxSum (void *in, void *inout, int *len, MPI_Datatype *type);
+void WaitForReduction ();
+void DecodeSprings (InterImageMap *m, int level);
+void WriteCheckpoint (CheckpointState *cs, int level);
+void OpenCheckpoint (CheckpointState *cs);
+void RestoreCheckpoint (int level);
+void SelectUpdatedImages (char *mapNames, int *frozen);
+void SpringCacheKey (int i, long *key);
+int ReadSpringCache ();
+void WriteSpringCache ();
+void ModelCacheKey (IntraImageMap *iim, long *key);
+int ReadModelCache (IntraImageMap *iim, int width, int height);
+void WriteModelCache (IntraImageMap *iim, int width, int height);
+void *WriteMaps (void *arg);
+void WaitForMapWriter ();
+void PartitionImages (char *mapNames, float *mapParams, int *owners);
+void PlanAlignment (char *mapNames);
+int FindImage (char *name);
 unsigned int Hash (char *s);
 unsigned int HashMap (char *s, int nx, int ny);
 int CreateDirectories (char *fn);
@@ -416,6 +753,9 @@ int Extrapolate (float *prx, float *pry, float *prc,
 		 int ix, int iy, float arrx, float arry,
 		 MapElement* map, int mw, int mh, float threshold);
 void RecoverFromFold (int level);
+int RowMayFold (Node *nodes, int nx, int ny, int y, float *margin);
+void FoldCorners (Node *c, Node *h, Node *v, int n, float sign,
+		  int *fold, float *margin);
 double PerpDist (double x1, double y1, double x2, double y2, double s);
 void PointProjectionOnLine (Point p0, Point p1, Point q, Point *proj);
 double Angle (double x0, double y0,
@@ -432,6 +772,13 @@ int CompareSpringForces (const void *p0, const void *p1);
 void ConstrainNodes (int imageNum, Node *nodes, int nx, int ny, int factor,
 		     int nConstraints, double *constraints,
 		     double *coeff);
+void ImageForces (int i, int level, double *pEnergy);
+void MapForces (int i, int level, double *pEnergy, float *f);
+void RunForceThreads (int level, int phase, double *pEnergy);
+void GpuLoadStep (int level);
+void GpuUploadNodes (int owned);
+void GpuDownloadNodes (int all);
+void *ForceThreadMain (void *arg);
 
 
 int
@@ -462,22 +809,16 @@ main (int argc, char **argv)
   int iter;
   float deltaX, deltaY;
   float nomD;
-  float d;
   float force;
-  float kdx, kdy;
   float dampingFactor;
   MPI_Status status;
   int nDecrease;
   int nIncrease;
-  float forceOverD;
-  float dfx, dfy;
   unsigned char red, green, blue;
   float angle;
   float mag;
   int nNodes;
-  int nFloats;
   Node *p00, *p10, *p01, *p11;
-  float kIntraThisImage;
   struct stat sb;
   int ixv, iyv;
   int ind;
@@ -489,8 +830,41 @@ main (int argc, char **argv)
   float consX, consY;
   float maxF;
   float globalMaxF;
+  float refMaxF;
+  int reduced;
+  int reducedIter, prevReducedIter;
+  int span;
+  int preferred;
+  int *owners;
+  CheckpointState cs;
+  Point *velocity;
+  Point *direction, *lineForce;
+  int nReduce;
+  float fx, fy;
+  double fd, ff, fl;
+  double maxD, maxRawF;
+  double slope;
+  double beta;
+  double alpha;
+  double cgStep;
+  double cgStartEnergy, cgStartSlope, cgStartForce;
+  double cgLow, cgLowSlope, cgHigh, cgHighSlope;
+  double cgPrevAlpha, cgPrevSlope;
+  double cgLineAlpha, cgLineSlope;
+  int cgRestart;
+  int cgNewLine;
+  int cgSteepest;
+  int cgTrials;
   char hostName[256];
   double basis;
+  double forceStart, forceSeconds;
+  double stepStart, timerStart;
+  double exchangeSeconds, reduceSeconds, iterationSeconds;
+  double timingIn[4], timingMax[4], timingSum[4];
+  int gpuIteration;
+  double intraEnergy, interEnergy;
+  float gpuMaxF;
+  int startIter;
   float maxStepX, maxStepY;
   int nx, ny, nz;
   int level;
@@ -518,6 +892,7 @@ main (int argc, char **argv)
   char *modelNames;
   char line[LINE_LENGTH];
   int nItems;
+  int listIndex;
   char imageName[PATH_MAX];
   int imageNameLen;
   int width, height;
@@ -543,7 +918,6 @@ main (int argc, char **argv)
   int mFactor;
   int stripsSize;
   int springsSize;
-  int springsPos;
   int prevX, prevY;
   int irrx, irry;
   int firstInStrip;
@@ -551,41 +925,23 @@ main (int argc, char **argv)
   InterImageStrip *strip;
   InterImageSpring *s;
   int fixedImageNameSize;
-  Node *nodes0, *nodes1;
   Point *ipt;
   double cost, sint;
-  Node *nodes;
-  int phase;
-  int op;
   int y0;
   int nx1, ny1;
-  CommPhase *cp;
-  int separation;
-  int mp;
-  int *phaseCount;
-  int *globalPhaseCount;
   int outputRequestedIter;
   int terminationRequestedIter;
   int refinementRequestedIter;
   int controlFlag;
   Point *mpts;
   float *mptsc;
-  int ns;
   int *pnStrips;
   InterImageStrip **pStrips;
   int *pnSprings;
   InterImageSpring **pSprings;
-  int nStrips;
-  InterImageStrip *strips;
-  InterImageSpring *springs;
   int mx, my;
   IntraImageSpring **piSprings;
   MapElement *initialMap;
-  int nSprings;
-  IntraImageSpring *iSprings;
-  float msk;
-  float sk;
-  int sme;
   int prevLevel;
   int step;
   cpu_set_t cpumask;
@@ -716,6 +1072,11 @@ main (int argc, char **argv)
     Error("Could not do MPI_Comm_size\n");
   if (MPI_Comm_rank(MPI_COMM_WORLD, &p) != MPI_SUCCESS)
     Error("Could not do MPI_Comm_rank\n");
+  if (MPI_Op_create(MaxSum, 1, &maxSumOp) != MPI_SUCCESS)
+    Error("Could not do MPI_Op_create\n");
+  MetricsInit("align");
+  MetricsSetProcess(p);
+  MetricsPhase(METRICS_READ);
   //  if (MPI_Errhandler_set(MPI_COMM_WORLD, MPI_ERRORS_RETURN) != MPI_SUCCESS)
   //    Error("Could not set MPI_ERRORS_RETURN.\n");
 
@@ -740,6 +1101,7 @@ main (int argc, char **argv)
       error = 0;
       imagesName[0] = '\0';
       imageListName[0] = '\0';
+      imageManifestName[0] = '\0';
       mapListName[0] = '\0';
       mapsName[0] = '\0';
       initialMapsName[0] = '\0';
@@ -751,7 +1113,12 @@ main (int argc, char **argv)
       outputGridName[0] = '\0';
       outputGridFocusImage[0] = '\0';
       outputSpringsName[0] = '\0';
+      outputStatsName[0] = '\0';
       constraintName[0] = '\0';
+      checkpointName[0] = '\0';
+      updateName[0] = '\0';
+      springCacheName[0] = '\0';
+      modelCacheName[0] = '\0';
       schedule[0] = '\0';
 
       for (i = 0; i < argc; ++i)
@@ -775,6 +1142,15 @@ main (int argc, char **argv)
 	      }
 	    strcpy(imageListName, argv[i]);
 	  }
+	else if (strcmp(argv[i], "-manifest") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(imageManifestName, argv[i]);
+	  }
 	else if (strcmp(argv[i], "-map_list") == 0)
 	  {
 	    if (++i == argc)
@@ -900,6 +1276,17 @@ main (int argc, char **argv)
 	      }
 	    strcpy(outputSpringsName, argv[i]);
 	  }	    
+	else if (strcmp(argv[i], "-output_stats") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(outputStatsName, argv[i]);
+	  }
+	else if (strcmp(argv[i], "-heat_maps") == 0)
+	  outputHeatMaps = 1;
 	else if (strcmp(argv[i], "-fixed") == 0)
 	  {
 	    if (++i == argc)
@@ -939,6 +1326,26 @@ main (int argc, char **argv)
 		break;
 	      }
 	  }
+	else if (strcmp(argv[i], "-settle") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%f", &settleThreshold) != 1 ||
+		settleThreshold < 0.0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-rebalance") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%f", &rebalanceThreshold) != 1 ||
+		rebalanceThreshold <= 0.0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
 	else if (strcmp(argv[i], "-fold_radius") == 0)
 	  {
 	    if (++i == argc ||
@@ -950,8 +1357,176 @@ main (int argc, char **argv)
 	  }
 	else if (strcmp(argv[i], "-minimize_area") == 0)
 	  minimizeArea = 1;
+	else if (strcmp(argv[i], "-overlap") == 0)
+	  overlapCommunication = 1;
+	else if (strcmp(argv[i], "-hierarchical") == 0)
+	  hierarchicalCommunication = 1;
+	else if (strcmp(argv[i], "-partition") == 0)
+	  partition = 1;
+	else if (strcmp(argv[i], "-plan") == 0)
+	  planOnly = 1;
+	else if (strcmp(argv[i], "-checkpoint") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(checkpointName, argv[i]);
+	  }
+	else if (strcmp(argv[i], "-checkpoint_interval") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &checkpointInterval) != 1 ||
+		checkpointInterval < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-restart") == 0)
+	  restart = 1;
+	else if (strcmp(argv[i], "-cg") == 0)
+	  conjugateGradient = 1;
+	else if (strcmp(argv[i], "-momentum") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%f", &momentum) != 1 ||
+		momentum < 0.0 || momentum >= 1.0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-output_writers") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &outputWriters) != 1 ||
+		outputWriters < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-map_levels") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &mapLevels) != 1 ||
+		mapLevels < 0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-spring_cache") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(springCacheName, argv[i]);
+	  }
+	else if (strcmp(argv[i], "-model_cache") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(modelCacheName, argv[i]);
+	  }
+	else if (strcmp(argv[i], "-update") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(updateName, argv[i]);
+	  }
+	else if (strcmp(argv[i], "-chunk") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d,%d,%d", &chunkIndex, &chunkSize,
+		       &chunkOverlap) != 3 ||
+		chunkIndex < 0 || chunkOverlap < 1 ||
+		chunkSize <= chunkOverlap)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-update_radius") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &updateRadius) != 1 ||
+		updateRadius < 0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-compress_exchange") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%f", &compressQuantum) != 1 ||
+		compressQuantum <= 0.0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-full_exchange_interval") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &fullExchangeInterval) != 1 ||
+		fullExchangeInterval < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-reduce_interval") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &reduceInterval) != 1 ||
+		reduceInterval < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
 	else if (strcmp(argv[i], "-output_fold_maps") == 0)
 	  outputFoldMaps = 1;
+	else if (strcmp(argv[i], "-local_fold_recovery") == 0)
+	  localFoldRecovery = 1;
+	else if (strcmp(argv[i], "-timing") == 0)
+	  timing = 1;
+	else if (strcmp(argv[i], "-threads") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &nThreads) != 1 ||
+		nThreads < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-gpu") == 0)
+	  gpuForces = 1;
+	else if (strcmp(argv[i], "-compact_springs") == 0)
+	  compactSprings = 1;
+	else if (strcmp(argv[i], "-read_ahead") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &readAhead) != 1 ||
+		readAhead < 0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
 	else
 	  {
 	    fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
@@ -965,6 +1540,7 @@ main (int argc, char **argv)
 
 	  fprintf(stderr, "Usage: align\n");
 	  fprintf(stderr, "              -image_list images_file\n");
+	  fprintf(stderr, "              [-manifest image_manifest_file]\n");
 	  fprintf(stderr, "              -map_list maps_file\n");
 	  fprintf(stderr, "              -output output_prefix\n");
 	  fprintf(stderr, "              -schedule schedule_file\n");
@@ -976,8 +1552,74 @@ main (int argc, char **argv)
 	  fprintf(stderr, "              [-constraints constraints_prefix]\n");
 	  fprintf(stderr, "              [-fold_recovery count]\n");
 	  fprintf(stderr, "              [-output_fold_maps]\n");
+	  fprintf(stderr, "              [-output_stats stats_prefix]\n");
+	  fprintf(stderr, "              [-heat_maps]\n");
+	  fprintf(stderr, "              [-local_fold_recovery]\n");
+	  fprintf(stderr, "              [-settle energy_change_fraction]\n");
+	  fprintf(stderr, "              [-threads number_of_threads]\n");
+	  fprintf(stderr, "              [-gpu]\n");
+	  fprintf(stderr, "              [-compact_springs]\n");
+	  fprintf(stderr, "              [-read_ahead number_of_maps]\n");
+	  fprintf(stderr, "              [-overlap]\n");
+	  fprintf(stderr, "              [-hierarchical]\n");
+	  fprintf(stderr, "              [-compress_exchange quantum_in_pixels]\n");
+	  fprintf(stderr, "              [-full_exchange_interval exchanges]\n");
+	  fprintf(stderr, "              [-reduce_interval iterations]\n");
+	  fprintf(stderr, "              [-timing]\n");
+	  fprintf(stderr, "              [-partition]\n");
+	  fprintf(stderr, "              [-rebalance imbalance_fraction]\n");
+	  fprintf(stderr, "              [-plan]\n");
+	  fprintf(stderr, "              [-checkpoint checkpoint_prefix]\n");
+	  fprintf(stderr, "              [-checkpoint_interval iterations]\n");
+	  fprintf(stderr, "              [-restart]\n");
+	  fprintf(stderr, "              [-momentum fraction]\n");
+	  fprintf(stderr, "              [-cg]\n");
+	  fprintf(stderr, "              [-update previous_output_prefix]\n");
+	  fprintf(stderr, "              [-spring_cache cache_prefix]\n");
+	  fprintf(stderr, "              [-model_cache cache_prefix]\n");
+	  fprintf(stderr, "              [-output_writers number_of_processes]\n");
+	  fprintf(stderr, "              [-map_levels coarser_levels_per_map]\n");
+	  fprintf(stderr, "              [-update_radius maps]\n");
+	  fprintf(stderr, "              [-chunk index,size,overlap]\n");
+	  fprintf(stderr, "   where -chunk aligns only the chunk given; the chunks are run\n");
+	  fprintf(stderr, "         one align per chunk, in order from 0, with the same\n");
+	  fprintf(stderr, "         -output, which stitches them: each chunk pins the first\n");
+	  fprintf(stderr, "         half of its overlap images at the previous chunk's\n");
+	  fprintf(stderr, "         output maps, and aligns the rest of them again;\n");
+	  fprintf(stderr, "         the -fixed images must all be in chunk 0\n");
 	  exit(1);
 	}
+      if (restart && checkpointName[0] == '\0')
+	Error("-restart requires -checkpoint to name the checkpoint files.\n");
+      if (updateName[0] != '\0')
+	{
+	  /* start from the previous output */
+	  if (initialMapsName[0] != '\0')
+	    Error("-update and -initial_maps cannot both be specified.\n");
+	  strcpy(initialMapsName, updateName);
+	}
+      if (conjugateGradient)
+	{
+	  /* the line searches need the dot products of every
+	     iteration, which only the CPU force loop computes */
+	  if (momentum > 0.0)
+	    Error("-cg and -momentum cannot both be specified.\n");
+	  if (gpuForces)
+	    Error("-cg and -gpu cannot both be specified.\n");
+	  if (reduceInterval != 1)
+	    Error("-cg requires a -reduce_interval of 1.\n");
+	}
+      if (chunkIndex >= 0)
+	{
+	  /* the chunks are placed into one frame by their pinned images,
+	     so the output has to be left in that frame */
+	  if (updateName[0] != '\0')
+	    Error("-chunk and -update cannot both be specified.\n");
+	  if (minimizeArea)
+	    Error("-chunk and -minimize_area cannot both be specified.\n");
+	  if (outputName[0] == '\0')
+	    Error("-chunk requires -output.\n");
+	}
       
       /* images_file contains one line for each image to be aligned:
             image_name rotation scale tx ty [map_file]
@@ -1057,6 +1699,17 @@ main (int argc, char **argv)
       if (nSteps == 0)
 	Error("At least one step must be listed in schedule file %s\n",
 	      schedule);
+
+      /* an update begins from the previous solution, so only the
+	 steps at the finest level are needed */
+      if (updateName[0] != '\0')
+	{
+	  j = 0;
+	  for (i = 0; i < nSteps; ++i)
+	    if (steps[i].level == steps[nSteps-1].level)
+	      steps[j++] = steps[i];
+	  nSteps = j;
+	}
     }
 
   /* broadcast the info */
@@ -1079,16 +1732,58 @@ main (int argc, char **argv)
       MPI_Bcast(&outputGridFocusY, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(outputGridFocusImage, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(outputSpringsName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(outputStatsName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&outputHeatMaps, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(constraintName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&nFixedImages, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&nSteps, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&foldRecovery, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&localFoldRecovery, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&foldRadius, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&settleThreshold, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&minimizeArea, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&outputFoldMaps, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&nThreads, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&gpuForces, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&compactSprings, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&readAhead, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&overlapCommunication, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&hierarchicalCommunication, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&compressQuantum, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&fullExchangeInterval, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&reduceInterval, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&timing, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&partition, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&rebalanceThreshold, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&planOnly, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(checkpointName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&checkpointInterval, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&restart, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&momentum, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&conjugateGradient, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(updateName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(springCacheName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(modelCacheName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&outputWriters, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&mapLevels, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&updateRadius, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&chunkIndex, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&chunkSize, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&chunkOverlap, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&fontWidth, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&fontHeight, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
     Error("Broadcast of parameters failed.\n");
+  SetMapLevels(mapLevels);
+  if (hierarchicalCommunication && overlapCommunication)
+    {
+      Log("-overlap is not used with -hierarchical\n");
+      overlapCommunication = 0;
+    }
+  if (hierarchicalCommunication && compressQuantum > 0.0)
+    {
+      Log("-compress_exchange is not used with -hierarchical\n");
+      compressQuantum = 0.0;
+    }
 
   if (p != 0)
     {
@@ -1119,6 +1814,14 @@ main (int argc, char **argv)
 
   if (p == 0)
     {
+      /* read the sizes of the images that the list does not give
+	 all at once, so that ReadImageSize below need not open them
+	 one after another */
+      if (imageManifestName[0] != '\0')
+	SetImageManifest(imageManifestName);
+      if (!ScanImageList(imageListName, imagesName, "", msg))
+	Error("%s", msg);
+
       /* read the images file */
       f = fopen(imageListName, "r");
       if (f == NULL)
@@ -1133,10 +1836,26 @@ main (int argc, char **argv)
       modelNamesSize = 0;
       modelNamesPos = 0;
       modelNames = 0;
+      listIndex = -1;
       while (fgets(line, LINE_LENGTH, f) != NULL)
 	{
 	  if (line[0] == '\0' || line[0] == '#')
 	    continue;
+	  /* with -chunk, chunk c holds the images from
+	     c * (size - overlap) on */
+	  ++listIndex;
+	  /* the later chunks take their frame from chunk 0 through
+	     their pinned images, so only chunk 0 may hold fixed ones */
+	  if (chunkIndex >= 0 && listIndex >= chunkSize &&
+	      sscanf(line, "%s", imageName) == 1)
+	    for (j = 0; j < nFixedImages; ++j)
+	      if (strcmp(imageName, fixedImages[j]) == 0)
+		Error("Fixed image %s is not in chunk 0; with -chunk, only images of chunk 0 can be fixed.\n",
+		      imageName);
+	  if (chunkIndex >= 0 &&
+	      (listIndex < chunkIndex * (chunkSize - chunkOverlap) ||
+	       listIndex >= chunkIndex * (chunkSize - chunkOverlap) + chunkSize))
+	    continue;
 	  width = -1;
 	  height = -1;
 	  rotation = 0.0;
@@ -1195,6 +1914,13 @@ main (int argc, char **argv)
 	  ++nImages;
 	}
       fclose(f);
+      if (nImages == 0)
+	Error("No images to align in %s\n", imageListName);
+      if (chunkIndex >= 0)
+	Log("Aligning chunk %d: images %d to %d of %d, the first %d pinned\n",
+	    chunkIndex, chunkIndex * (chunkSize - chunkOverlap),
+	    chunkIndex * (chunkSize - chunkOverlap) + nImages - 1,
+	    listIndex + 1, chunkIndex > 0 ? (chunkOverlap + 1) / 2 : 0);
 
       imageParamsSize = imageParamsPos;
       imageParams = (float *) realloc(imageParams, imageParamsSize * sizeof(float));
@@ -1251,7 +1977,11 @@ main (int argc, char **argv)
       images[i].tx = imageParams[7*i+4];
       images[i].ty = imageParams[7*i+5];
       images[i].kFactor = imageParams[7*i+6];
-      images[i].fixed = 0;
+      /* the last images of the previous chunk were aligned without
+	 their neighbors in this one, so only the first half of the
+	 overlap are pinned, and the rest are aligned again */
+      images[i].pinned = chunkIndex > 0 && i < (chunkOverlap + 1) / 2;
+      images[i].fixed = images[i].pinned;
       images[i].owner = -1;
       images[i].needed = 0;
       images[i].sendTo = NULL;
@@ -1259,10 +1989,24 @@ main (int argc, char **argv)
       images[i].ny = (images[i].height + startFactor - 1) / startFactor + 1;
       images[i].nodes = 0;
       images[i].initialNodes = 0;
+      images[i].velocity = NULL;
+      images[i].direction = NULL;
+      images[i].lineForce = NULL;
       images[i].absolutePositions = 0;
       images[i].initialPositions = 0;
       images[i].mask = 0;
       images[i].marked = 0;
+      images[i].settled = 0;
+      images[i].foldCheckPos = NULL;
+      images[i].foldCheckN = 0;
+      images[i].exchanged = NULL;
+      images[i].nExchanged = 0;
+      images[i].encoded = NULL;
+      images[i].nEncoded = 0;
+      images[i].encodedAt = -1;
+      images[i].energy = 0.0;
+      images[i].cost = 0.0;
+      images[i].nextOwned = -1;
       images[i].modelName = &modelNames[modelNamesPos];
       modelNamesPos += strlen(&modelNames[modelNamesPos]) + 1;
       images[i].map = 0;
@@ -1272,26 +2016,9 @@ main (int argc, char **argv)
     }
   free(imageParams);
 
-  for (i = 0; i < np; ++i)
-    {
-      firstImage = (i * nImages) / np;
-      lastImage = ((i+1) * nImages / np) - 1;
-      for (j = firstImage; j <= lastImage; ++j)
-	{
-	  images[j].owner = i;
-	  images[j].needed = 0;
-	  if (i == p)
-	    {
-	      images[j].sendTo = (unsigned char *)
-		malloc((np + 7) >> 3);
-	      memset(images[j].sendTo, 0,
-		     (np + 7) >> 3);
-	    }
-	}
-    }
-  myFirstImage = (p * nImages) / np;
-  myLastImage = ((p+1) * nImages / np) - 1;
-  for (i = 0; i < nFixedImages; ++i)
+  /* a later chunk is held in the frame of chunk 0 by its pinned
+     images alone */
+  for (i = 0; chunkIndex <= 0 && i < nFixedImages; ++i)
     {
       hv = Hash(fixedImages[i]) % nImages ;
       for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
@@ -1305,9 +2032,6 @@ main (int argc, char **argv)
 	      fixedImages[i]);
     }
 
-  Log("On node %d first = %d last = %d (nz = %d)\n",
-      p, myFirstImage, myLastImage, nImages);
-
   /* set trigger and termination files */
   sprintf(triggerName, "%strigger", outputName);
   sprintf(termName, "%sterm", outputName);
@@ -1334,6 +2058,10 @@ main (int argc, char **argv)
 	    Error("Malformed line in %s:\n%s\n", mapListName, line);
 	  if (nItems == 3)
 	    weight = 1.0;
+	  /* a chunk only has the maps among its own images */
+	  if (chunkIndex >= 0 &&
+	      (FindImage(imageName0) < 0 || FindImage(imageName1) < 0))
+	    continue;
 
 	  imageNameLen0 = strlen(imageName0);
 	  imageNameLen1 = strlen(imageName1);
@@ -1381,31 +2109,65 @@ main (int argc, char **argv)
       MPI_Bcast(mapNames, mapNamesSize, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
     Error("Broadcast of mapParams and mapNames failed.\n");
 
-  Log("Going to initialize the commPhases array\n");
-  /* initialize the commPhases array */
-  commPhases = (CommPhase*) malloc(2 * np * sizeof(CommPhase));
-  for (i = 0; i < 2 * np; ++i)
+  /* when updating, freeze the images far from the changed maps */
+  if (updateName[0] != '\0')
     {
-      cp = &(commPhases[i]);
-      separation = i >> 1;
-      if (separation == 0)
-	cp->otherProcess = -1;
-      else if (((p / separation) ^ i) & 1)
-	cp->otherProcess = p - separation;
-      else
-	cp->otherProcess = p + separation;
-      if (cp->otherProcess < 0 || cp->otherProcess >= np)
-	cp->otherProcess = -1;
-      cp->nSendImages = 0;
-      cp->sendImages = NULL;
-      cp->nSends = 0;
-      cp->nImagesToSend = NULL;
-      cp->nReceiveImages = 0;
-      cp->receiveImages = NULL;
-      cp->nReceives = 0;
-      cp->floatsToReceive = NULL;
-      cp->nImagesToReceive = NULL;
+      owners = (int *) malloc(nImages * sizeof(int));
+      if (p == 0)
+	SelectUpdatedImages(mapNames, owners);
+      if (MPI_Bcast(owners, nImages, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+	Error("Broadcast of frozen images failed.\n");
+      for (j = 0; j < nImages; ++j)
+	if (owners[j])
+	  images[j].fixed = 1;
+      free(owners);
+    }
+
+  /* assign the images to processes, by default in contiguous ranges */
+  for (i = 0; i < np; ++i)
+    {
+      firstImage = (i * nImages) / np;
+      lastImage = ((i+1) * nImages / np) - 1;
+      for (j = firstImage; j <= lastImage; ++j)
+	images[j].owner = i;
+    }
+  if (partition)
+    {
+      owners = (int *) malloc(nImages * sizeof(int));
+      if (p == 0)
+	PartitionImages(mapNames, mapParams, owners);
+      if (MPI_Bcast(owners, nImages, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+	Error("Broadcast of image owners failed.\n");
+      for (j = 0; j < nImages; ++j)
+	images[j].owner = owners[j];
+      free(owners);
+    }
+
+  /* with -plan, stop once the images are assigned */
+  if (planOnly)
+    {
+      if (p == 0)
+	PlanAlignment(mapNames);
+      MetricsClose();
+      MPI_Finalize();
+      fclose(logFile);
+      return(0);
+    }
+  myFirstImage = -1;
+  nMyImages = 0;
+  for (j = nImages - 1; j >= 0; --j)
+    {
+      images[j].needed = 0;
+      if (images[j].owner != p)
+	continue;
+      images[j].sendTo = (unsigned char *) malloc((np + 7) >> 3);
+      memset(images[j].sendTo, 0, (np + 7) >> 3);
+      images[j].nextOwned = myFirstImage;
+      myFirstImage = j;
+      ++nMyImages;
     }
+  Log("On node %d owning %d images from %d (nz = %d)\n",
+      p, nMyImages, myFirstImage, nImages);
 
   if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
     Error("MPI_Barrier after cpi failed.\n");
@@ -1441,7 +2203,7 @@ main (int argc, char **argv)
 	if (strcmp(images[j].name, imageName0) == 0)
 	  {
 	    image0 = j;
-	    if (j >= myFirstImage && j <= myLastImage)
+	    if (images[j].owner == p)
 	      found = 1;
 	    break;
 	  }
@@ -1456,134 +2218,29 @@ main (int argc, char **argv)
 	if (strcmp(images[j].name, imageName1) == 0)
 	  {
 	    image1 = j;
-	    if (j >= myFirstImage && j <= myLastImage)
+	    if (images[j].owner == p)
 	      found = 1;
 	    break;
 	  }
       if (image1 < 0)
 	Error("Could not find destination image for map %s\n", pairName);
 
-      if (found)
-	{
-	  images[image0].needed = 1;
-	  images[image1].needed = 1;
+      /* in an update, the springs between two frozen images would
+	 only add a constant to the energy */
+      if (updateName[0] != '\0' &&
+	  images[image0].fixed && images[image1].fixed)
+	found = 0;
 
-	  /* create map table entry */
-	  if (mapsPos >= mapsSize)
-	    {
-	      mapsSize = (mapsSize > 0) ? mapsSize * 2 : 1024;
-	      maps = (InterImageMap *) realloc(maps, mapsSize *
-					       sizeof(InterImageMap));
-	    }
-	  m = &(maps[mapsPos]);
-	  m->name = (char *) malloc(pairNameLen+1);
-	  strcpy(m->name, pairName);
-	  m->image0 = image0;
-	  m->image1 = image1;
-	  m->energyFactor = (image0 >= myFirstImage &&
-			     image0 <= myLastImage) ? 1.0 : 0.0;
-	  m->k = weight;
-	  m->nStrips = (int *) malloc(nLevels * sizeof(int));
-	  memset(m->nStrips, 0, nLevels * sizeof(int));
-	  m->strips = (InterImageStrip**)
-	    malloc(nLevels * sizeof(InterImageStrip*));
-	  memset(m->strips, 0, nLevels * sizeof(InterImageStrip*));
-	  m->nSprings = (int *) malloc(nLevels * sizeof(int));
-	  memset(m->nSprings, 0, nLevels * sizeof(int));
-	  m->springs = (InterImageSpring**)
-	    malloc(nLevels * sizeof(InterImageSpring*));
-	  memset(m->springs, 0, nLevels * sizeof(InterImageSpring*));
-
-	  if (images[image0].owner != images[image1].owner)
-	    {
-	      if (images[image0].owner == p)
-		{
-		  op = images[image1].owner;
-		  images[image0].sendTo[op >> 3] |= 0x80 >> (op & 7);
-		}
-	      else
-		{
-		  op = images[image0].owner;
-		  images[image1].sendTo[op >> 3] |= 0x80 >> (op & 7);
-		}
-	    }
-	  ++mapsPos;
-	}
+      if (found)
+	LinkMapImages(NewMap(pairName, image0, image1, weight));
     }
   nMaps = mapsPos;
   maps = (InterImageMap *) realloc(maps, nMaps * sizeof(InterImageMap));
+  mapsSize = nMaps;
 
-  /* construct the list of images to be sent and received
-     at each communication phase */
-  Log("Constructing list of images to be sent and received\n");
-  for (i = 0; i < nImages; ++i)
-    if (images[i].owner == p)
-      {
-	for (op = 0; op < np; ++op)
-	  if (images[i].sendTo[op >> 3] & (0x80 >> (op & 7)))
-	    {
-	      separation = abs(op - p);
-	      mp = p;
-	      if (op < mp)
-		mp = op;
-	      phase = 2 * separation + ((mp / separation) & 1);
-	      cp = &(commPhases[phase]);
-	      ++(cp->nSendImages);
-	      cp->sendImages = (int *) realloc(cp->sendImages,
-					       cp->nSendImages * sizeof(int));
-	      cp->sendImages[cp->nSendImages-1] = i;
-	    }
-	nFloats = ((images[i].width + endFactor - 1) / endFactor + 1) *
-	  ((images[i].height + endFactor - 1) / endFactor + 1) * 2;
-	if (nFloats > bufferSize)
-	  bufferSize = nFloats;
-      }
-    else if (images[i].needed)
-      {
-	op = images[i].owner;
-	separation = abs(op - p);
-	mp = p;
-	if (op < mp)
-	  mp = op;
-	phase = 2 * separation + ((mp / separation) & 1);
-	cp = &(commPhases[phase]);
-	++(cp->nReceiveImages);
-	cp->receiveImages = (int *) realloc(cp->receiveImages,
-					    cp->nReceiveImages * sizeof(int));
-	cp->receiveImages[cp->nReceiveImages-1] = i;
-	nFloats = ((images[i].width + endFactor - 1) / endFactor + 1) *
-	  ((images[i].height + endFactor - 1) / endFactor + 1) * 2;
-	if (nFloats > bufferSize)
-	  bufferSize = nFloats;
-      }
-  if (bufferSize < 4096*1024)
-    bufferSize = 4096*1024;
-  buffer = (float *) malloc(bufferSize * sizeof(float));
-  
-  /* eliminate unnecessary phases */
-  Log("Eliminating unnecessary phases\n");
-  phaseCount = (int *) malloc(2 * np * sizeof(int));
-  memset(phaseCount, 0, 2 * np * sizeof(int));
-  globalPhaseCount = (int *) malloc(2 * np * sizeof(int));
-  for (phase = 0; phase < 2 * np; ++phase)
-    {
-      phaseCount[phase] += commPhases[phase].nSendImages;
-      phaseCount[phase] += commPhases[phase].nReceiveImages;
-    }
-  if (MPI_Allreduce(phaseCount, globalPhaseCount, 2 * np,
-		    MPI_INT, MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
-    Error("MPI_Allreduce failed.\n");
-  j = 0;
-  for (i = 0; i < 2 * np; ++i)
-    if (globalPhaseCount[i] > 0 && i != j)
-      {
-	memcpy(&commPhases[j], &commPhases[i], sizeof(CommPhase));
-	++j;
-      }
-  nPhases = j;
-  commPhases = (CommPhase *) realloc(commPhases, nPhases * sizeof(CommPhase));
-  free(phaseCount);
-  free(globalPhaseCount);
+  BuildCommPhases();
+  if (hierarchicalCommunication)
+    SetUpNodeExchange();
 
   /* initialize the models that are needed */
   Log("Initializing models\n");
@@ -1620,195 +2277,202 @@ main (int argc, char **argv)
 	  // iim->ny = 0;
 	  iim->next = mapHashTable[hv];
 	  mapHashTable[hv] = iim;
-	  if (iim->name[0] != '\0')
-	    {
-	      /* read the map from a file */
-	      sprintf(fn, "%s%s.map", modelsName, iim->name);
-	      Log("Going to read map %s\n", fn);
-	      if (!ReadMap(fn, &modelMap, &mLevel,
-			   &mw, &mh, &mxMin, &myMin,
-			   imName0, imName1,
-			   msg))
-		Error("Could not read map %s:\n  error: %s\n",
-		      fn, msg);
-	      Log("Finished reading map %s\n", fn);
-	    }
 	  iim->nSprings = (int *) malloc(nLevels * sizeof(int));
 	  memset(iim->nSprings, 0, nLevels * sizeof(int));
 	  iim->springs = (IntraImageSpring**)
 	    malloc(nLevels * sizeof(IntraImageSpring*));
 	  memset(iim->springs, 0, nLevels * sizeof(IntraImageSpring*));
-	  for (level = startLevel; level >= endLevel; --level)
+	  iim->packedFor = -1;
+	  if (modelCacheName[0] == '\0' ||
+	      !ReadModelCache(iim, images[i].width, images[i].height))
 	    {
-	      factor = 1 << level;
-	      nx = (images[i].width + factor - 1) / factor + 1;
-	      ny = (images[i].height + factor - 1) / factor + 1;
-	      mpts = (Point*) malloc(nx * ny * sizeof(Point));
-	      mptsc = (float*) malloc(nx * ny * sizeof(float));
-	      pnSprings = &(iim->nSprings[startLevel - level]);
-	      piSprings = &(iim->springs[startLevel - level]);
-	      if (iim->name[0] == '\0')
-		/* use the identity map */
-		for (y = 0; y < ny; ++y)
-		  for (x = 0; x < nx; ++x)
+	      if (iim->name[0] != '\0')
+		{
+		  /* read the map from a file */
+		  sprintf(fn, "%s%s.map", modelsName, iim->name);
+		  Log("Going to read map %s\n", fn);
+		  if (!ReadMap(fn, &modelMap, &mLevel,
+			       &mw, &mh, &mxMin, &myMin,
+			       imName0, imName1,
+			       msg))
+		    Error("Could not read map %s:\n  error: %s\n",
+			  fn, msg);
+		  Log("Finished reading map %s\n", fn);
+		}
+	      for (level = startLevel; level >= endLevel; --level)
+		{
+		  factor = 1 << level;
+		  nx = (images[i].width + factor - 1) / factor + 1;
+		  ny = (images[i].height + factor - 1) / factor + 1;
+		  mpts = (Point*) malloc(nx * ny * sizeof(Point));
+		  mptsc = (float*) malloc(nx * ny * sizeof(float));
+		  pnSprings = &(iim->nSprings[startLevel - level]);
+		  piSprings = &(iim->springs[startLevel - level]);
+		  if (iim->name[0] == '\0')
+		    /* use the identity map */
+		    for (y = 0; y < ny; ++y)
+		      for (x = 0; x < nx; ++x)
+			{
+			  mpts[y*nx+x].x = x;
+			  mpts[y*nx+x].y = y;
+			  mptsc[y*nx+x] = 1.0;
+			}
+		  else
 		    {
-		      mpts[y*nx+x].x = x;
-		      mpts[y*nx+x].y = y;
-		      mptsc[y*nx+x] = 1.0;
+		      scale = ((double) factor) / (1 << mLevel);
+		      threshold = scale;
+    #if PDEBUG
+		      poix = (int) floor(poixv / factor + 0.5);
+		      poiy = (int) floor(poiyv / factor + 0.5);
+		      Log("level = %d poixv = %f factor = %d poix = %d\n",
+			  level, poixv, factor, poix);
+    #endif
+		      for (y = 0; y < ny; ++y)
+			for (x = 0; x < nx; ++x)
+			  {
+			    xv = scale * x;
+			    yv = scale * y;
+			    ixv = (int) floor(xv);
+			    iyv = (int) floor(yv);
+			    rrx = xv - ixv;
+			    rry = yv - iyv;
+			    ixv -= mxMin;
+			    iyv -= myMin;
+			    if (ixv >= 0 && ixv < mw-1 &&
+				iyv >= 0 && iyv < mh-1 &&
+				modelMap[iyv*mw+ixv].c > 0.0 &&
+				modelMap[(iyv+1)*mw+ixv].c > 0.0 &&
+				modelMap[iyv*mw+ixv+1].c > 0.0 &&
+				modelMap[(iyv+1)*mw+ixv+1].c > 0.0)
+			      {
+				rx00 = modelMap[iyv*mw+ixv].x;
+				ry00 = modelMap[iyv*mw+ixv].y;
+				rc00 = modelMap[iyv*mw+ixv].c;
+				rx01 = modelMap[(iyv+1)*mw+ixv].x;
+				ry01 = modelMap[(iyv+1)*mw+ixv].y;
+				rc01 = modelMap[(iyv+1)*mw+ixv].c;
+				rx10 = modelMap[iyv*mw+ixv+1].x;
+				ry10 = modelMap[iyv*mw+ixv+1].y;
+				rc10 = modelMap[iyv*mw+ixv+1].c;
+				rx11 = modelMap[(iyv+1)*mw+ixv+1].x;
+				ry11 = modelMap[(iyv+1)*mw+ixv+1].y;
+				rc11 = modelMap[(iyv+1)*mw+ixv+1].c;
+				rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+				  - rx10 * rrx * (rry - 1.0) 
+				  - rx01 * (rrx - 1.0) * rry
+				  + rx11 * rrx * rry;
+				ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+				  - ry10 * rrx * (rry - 1.0) 
+				  - ry01 * (rrx - 1.0) * rry
+				  + ry11 * rrx * rry;
+				rc = rc00;
+				if (rc01 < rc)
+				  rc = rc01;
+				if (rc10 < rc)
+				  rc = rc10;
+				if (rc11 < rc)
+				  rc = rc11;
+				if (rc < 0.0)
+				  Error("rc is negative! %f\n", rc);
+    #if DEBUG
+    #if PDEBUG
+			    if (i == ioi && x == poix && y == poiy)
+    #endif
+			      Log("rx = %f ry = %f rc = %f scale = %f\n",
+				  rx, ry, rc, scale);
+    #endif
+			      }
+			    else
+			      {
+    #if DEBUG
+    #if PDEBUG
+			    if (i == ioi && x == poix && y == poiy)
+    #endif
+			      Log("extrapolating\n");
+    #endif
+				if (!Extrapolate(&rx, &ry, &rc,
+						 ixv, iyv, rrx, rry,
+						 modelMap, mw, mh, threshold))
+				  {
+				    rx = 0.0;
+				    ry = 0.0;
+				    rc = 0.0;
+				  }
+			      }
+			    mpts[y*nx+x].x = rx / scale;
+			    mpts[y*nx+x].y = ry / scale;
+			    mptsc[y*nx+x] = rc;
+    #if DEBUG
+    #if PDEBUG
+			    if (i == ioi && x == poix && y == poiy)
+    #endif
+			      Log("iim pts (%lu) %d %d = %f %f  ixv = %d iyv = %d rrx = %f rry = %f\n",
+				  mpts, x, y,
+				  mpts[y*nx+x].x,
+				  mpts[y*nx+x].y,
+				  ixv, iyv, rrx, rry);
+    #endif
+			  }
 		    }
-	      else
-		{
-		  scale = ((double) factor) / (1 << mLevel);
-		  threshold = scale;
-#if PDEBUG
-		  poix = (int) floor(poixv / factor + 0.5);
-		  poiy = (int) floor(poiyv / factor + 0.5);
-		  Log("level = %d poixv = %f factor = %d poix = %d\n",
-		      level, poixv, factor, poix);
-#endif
+		  // creates the springs at this level
+		  *pnSprings = (ny - 1) * (nx - 1) * 4 +
+		    (ny - 1) + (nx - 1);
+		  *piSprings = (IntraImageSpring*) malloc(*pnSprings *
+							  sizeof(IntraImageSpring));
+		  iis = *piSprings;
 		  for (y = 0; y < ny; ++y)
 		    for (x = 0; x < nx; ++x)
 		      {
-			xv = scale * x;
-			yv = scale * y;
-			ixv = (int) floor(xv);
-			iyv = (int) floor(yv);
-			rrx = xv - ixv;
-			rry = yv - iyv;
-			ixv -= mxMin;
-			iyv -= myMin;
-			if (ixv >= 0 && ixv < mw-1 &&
-			    iyv >= 0 && iyv < mh-1 &&
-			    modelMap[iyv*mw+ixv].c > 0.0 &&
-			    modelMap[(iyv+1)*mw+ixv].c > 0.0 &&
-			    modelMap[iyv*mw+ixv+1].c > 0.0 &&
-			    modelMap[(iyv+1)*mw+ixv+1].c > 0.0)
+			if (x < nx-1 && y > 0)
 			  {
-			    rx00 = modelMap[iyv*mw+ixv].x;
-			    ry00 = modelMap[iyv*mw+ixv].y;
-			    rc00 = modelMap[iyv*mw+ixv].c;
-			    rx01 = modelMap[(iyv+1)*mw+ixv].x;
-			    ry01 = modelMap[(iyv+1)*mw+ixv].y;
-			    rc01 = modelMap[(iyv+1)*mw+ixv].c;
-			    rx10 = modelMap[iyv*mw+ixv+1].x;
-			    ry10 = modelMap[iyv*mw+ixv+1].y;
-			    rc10 = modelMap[iyv*mw+ixv+1].c;
-			    rx11 = modelMap[(iyv+1)*mw+ixv+1].x;
-			    ry11 = modelMap[(iyv+1)*mw+ixv+1].y;
-			    rc11 = modelMap[(iyv+1)*mw+ixv+1].c;
-			    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-			      - rx10 * rrx * (rry - 1.0) 
-			      - rx01 * (rrx - 1.0) * rry
-			      + rx11 * rrx * rry;
-			    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-			      - ry10 * rrx * (rry - 1.0) 
-			      - ry01 * (rrx - 1.0) * rry
-			      + ry11 * rrx * rry;
-			    rc = rc00;
-			    if (rc01 < rc)
-			      rc = rc01;
-			    if (rc10 < rc)
-			      rc = rc10;
-			    if (rc11 < rc)
-			      rc = rc11;
-			    if (rc < 0.0)
-			      Error("rc is negative! %f\n", rc);
-#if DEBUG
-#if PDEBUG
-			if (i == ioi && x == poix && y == poiy)
-#endif
-			  Log("rx = %f ry = %f rc = %f scale = %f\n",
-			      rx, ry, rc, scale);
-#endif
+			    iis->index0 = y*nx+x;
+			    iis->index1 = (y-1)*nx+x+1;
+			    ++iis;
 			  }
-			else
+			if (x < nx-1)
 			  {
-#if DEBUG
-#if PDEBUG
-			if (i == ioi && x == poix && y == poiy)
-#endif
-			  Log("extrapolating\n");
-#endif
-			    if (!Extrapolate(&rx, &ry, &rc,
-					     ixv, iyv, rrx, rry,
-					     modelMap, mw, mh, threshold))
-			      {
-				rx = 0.0;
-				ry = 0.0;
-				rc = 0.0;
-			      }
+			    iis->index0 = y*nx+x;
+			    iis->index1 = y*nx+x+1;
+			    ++iis;
+			  }
+			if (x < nx-1 && y < ny-1)
+			  {
+			    iis->index0 = y*nx+x;
+			    iis->index1 = (y+1)*nx+x+1;
+			    ++iis;
+			  }
+			if (y < ny-1)
+			  {
+			    iis->index0 = y*nx+x;
+			    iis->index1 = (y+1)*nx+x;
+			    ++iis;
 			  }
-			mpts[y*nx+x].x = rx / scale;
-			mpts[y*nx+x].y = ry / scale;
-			mptsc[y*nx+x] = rc;
-#if DEBUG
-#if PDEBUG
-			if (i == ioi && x == poix && y == poiy)
-#endif
-			  Log("iim pts (%lu) %d %d = %f %f  ixv = %d iyv = %d rrx = %f rry = %f\n",
-			      mpts, x, y,
-			      mpts[y*nx+x].x,
-			      mpts[y*nx+x].y,
-			      ixv, iyv, rrx, rry);
-#endif
-		      }
-		}
-	      // creates the springs at this level
-	      *pnSprings = (ny - 1) * (nx - 1) * 4 +
-		(ny - 1) + (nx - 1);
-	      *piSprings = (IntraImageSpring*) malloc(*pnSprings *
-						      sizeof(IntraImageSpring));
-	      iis = *piSprings;
-	      for (y = 0; y < ny; ++y)
-		for (x = 0; x < nx; ++x)
-		  {
-		    if (x < nx-1 && y > 0)
-		      {
-			iis->index0 = y*nx+x;
-			iis->index1 = (y-1)*nx+x+1;
-			++iis;
-		      }
-		    if (x < nx-1)
-		      {
-			iis->index0 = y*nx+x;
-			iis->index1 = y*nx+x+1;
-			++iis;
-		      }
-		    if (x < nx-1 && y < ny-1)
-		      {
-			iis->index0 = y*nx+x;
-			iis->index1 = (y+1)*nx+x+1;
-			++iis;
-		      }
-		    if (y < ny-1)
-		      {
-			iis->index0 = y*nx+x;
-			iis->index1 = (y+1)*nx+x;
-			++iis;
 		      }
-		  }
 
-	      iis = *piSprings;
-	      for (j = 0; j < *pnSprings; ++j)
+		  iis = *piSprings;
+		  for (j = 0; j < *pnSprings; ++j)
+		    {
+		      iis->nomD = hypot(mpts[iis->index0].x -
+					mpts[iis->index1].x,
+					mpts[iis->index0].y -
+					mpts[iis->index1].y);
+		      iis->k = mptsc[iis->index0] < mptsc[iis->index1] ?
+			mptsc[iis->index0] : mptsc[iis->index1];
+		      ++iis;
+		    }
+		  if (level == startLevel)
+		    iim->points = mpts;
+		  else
+		    free(mpts);
+		  free(mptsc);
+		}
+	      if (modelMap != NULL)
 		{
-		  iis->nomD = hypot(mpts[iis->index0].x -
-				    mpts[iis->index1].x,
-				    mpts[iis->index0].y -
-				    mpts[iis->index1].y);
-		  iis->k = mptsc[iis->index0] < mptsc[iis->index1] ?
-		    mptsc[iis->index0] : mptsc[iis->index1];
-		  ++iis;
+		  free(modelMap);
+		  modelMap = NULL;
 		}
-	      if (level == startLevel)
-		iim->points = mpts;
-	      else
-		free(mpts);
-	      free(mptsc);
-	    }
-	  if (modelMap != NULL)
-	    {
-	      free(modelMap);
-	      modelMap = NULL;
+	      if (modelCacheName[0] != '\0')
+		WriteModelCache(iim, images[i].width, images[i].height);
 	    }
 	}
       images[i].map = iim;
@@ -2051,14 +2715,24 @@ main (int argc, char **argv)
       // compute the initial positions
       images[i].initialPositions = (Point **) malloc(nLevels * sizeof(Point *));
       memset(images[i].initialPositions, 0, nLevels * sizeof(Point*));
-      if (initialMapsName[0] != '\0')
+      if (initialMapsName[0] != '\0' || images[i].pinned)
 	{
-	  sprintf(fn, "%s%s.map", initialMapsName, images[i].name);
-	  if (!ReadMap(fn, &map, &mLevel,
-		       &mw, &mh, &mxMin, &myMin,
-		       imName0, imName1,
-		       msg))
+	  /* a pinned image starts, and stays, at the output
+	     of the previous chunk */
+	  sprintf(fn, "%s%s.map",
+		  images[i].pinned ? outputName : initialMapsName,
+		  images[i].name);
+	  /* only the start level of a free image comes from the map */
+	  if (!ReadMapLevel(fn, &map,
+			    images[i].fixed ? endLevel : startLevel,
+			    &mLevel,
+			    &mw, &mh, &mxMin, &myMin,
+			    imName0, imName1,
+			    msg))
 	    {
+	      if (images[i].pinned)
+		Error("Could not read %s to pin image %s to the previous chunk:\n  error: %s\n",
+		      fn, images[i].name, msg);
 	      Log("WARNING: Could not open %s so will not use initial map.\n",
 		  fn);
 	      goto computeInitialPositionsFromConstraints;
@@ -2097,7 +2771,8 @@ main (int argc, char **argv)
 		    mask[iyv*mbpl+(ixv >> 3)] |= 0x80 >> (ixv & 7);
 		}
 	  dist = (float *) malloc(dny * dnx * sizeof(float));
-	  computeDistance(CHESSBOARD_DISTANCE, dnx, dny, mask, dist);
+	  computeDistanceThreaded(CHESSBOARD_DISTANCE, dnx, dny, mask, dist,
+				  nThreads);
 
 	  for (level = startLevel;
 	       images[i].fixed ? (level >= endLevel) : (level == startLevel);
@@ -2151,6 +2826,20 @@ main (int argc, char **argv)
 		      rry = yv - iyv;
 		      ixv -= mxMin;
 		      iyv -= myMin;
+
+		      /* a point on the last column or row of the map is
+			 interpolated from the cell before it, rather than
+			 extrapolated */
+		      if (ixv == mw-1 && ixv > 0 && rrx == 0.0)
+			{
+			  --ixv;
+			  rrx = 1.0;
+			}
+		      if (iyv == mh-1 && iyv > 0 && rry == 0.0)
+			{
+			  --iyv;
+			  rry = 1.0;
+			}
 		      if (ixv >= 0 && ixv < mw-1 &&
 			  iyv >= 0 && iyv < mh-1 &&
 			  map[iyv*mw+ixv].c > 0.0 &&
@@ -2307,10 +2996,26 @@ main (int argc, char **argv)
   Log("Initializing maps\n");
   /* initialize the maps that are needed */
   map = NULL;
+  if (springCacheName[0] != '\0' && ReadSpringCache())
+    goto mapsInitialized;
+  /* with -read_ahead, the next readAhead maps are read by background
+     threads while the springs of this one are made; what they read is
+     held outside any budget, so there are never more than readAhead
+     of them waiting */
+  if (readAhead > 0 &&
+      !StartPrefetching(readAhead < 4 ? readAhead : 4, (size_t) -1))
+    Error("Could not start read-ahead threads\n");
+  METRICS_RANGE_BEGIN("align springs");
   for (i = 0; i < nMaps; ++i)
     {
+      if (readAhead > 0)
+	for (j = i; j < nMaps && j <= i + readAhead; ++j)
+	  {
+	    sprintf(fn, "%s%s.map", mapsName, maps[j].name);
+	    PrefetchMapLevel(fn, endLevel);
+	  }
       sprintf(fn, "%s%s.map", mapsName, maps[i].name);
-      if (!ReadMap(fn, &map, &mLevel,
+      if (!TakeMap(fn, endLevel, &map, &mLevel,
 		   &mw, &mh, &mxMin, &myMin,
 		   imName0, imName1,
 		   msg))
@@ -2373,7 +3078,8 @@ main (int argc, char **argv)
 	  m->name, count1, count2, mw, mh, mw * mh, dnx * dny,
 	  dnx, dny, mxMin, myMin);
       dist = (float *) malloc(dny * dnx * sizeof(float));
-      computeDistance(CHESSBOARD_DISTANCE, dnx, dny, mask, dist);
+      computeDistanceThreaded(CHESSBOARD_DISTANCE, dnx, dny, mask, dist,
+			      nThreads);
 #if 1
       if (strcmp(m->name, "z033_z034") == 0 ||
 	  strcmp(m->name, "z034_z035") == 0)
@@ -2629,6 +3335,7 @@ main (int argc, char **argv)
 	    }
 	  Log("For map %s at level %d, count1 = %d  count2 = %d  total = %d\n",
 	      m->name, level, count1, count2, nx * ny);
+	  ++springsVersion;
 	  if (*pnStrips != 0)
 	    *pStrips = (InterImageStrip*)
 	      realloc(*pStrips, *pnStrips * sizeof(InterImageStrip));
@@ -2643,9 +3350,13 @@ main (int argc, char **argv)
 	}
       free(dist);
       free(mask);
+      free(map);
+      map = NULL;
     }
-  free(map);
-  map = NULL;
+  METRICS_RANGE_END();
+  if (springCacheName[0] != '\0')
+    WriteSpringCache();
+ mapsInitialized:
 
   /* compute absolute positions if needed */
   for (step = 0; step < nSteps; ++step)
@@ -2657,7 +3368,7 @@ main (int argc, char **argv)
       if (kAbsolute == 0.0)
 	continue;
       factor = 1 << level;
-      for (i = myFirstImage; i <= myLastImage; ++i)
+      for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
 	{
 	  if (images[i].absolutePositions == NULL)
 	    {
@@ -2675,7 +3386,7 @@ main (int argc, char **argv)
 	    }
 	}
     }
-  for (i = myFirstImage; i <= myLastImage; ++i)
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
       if (images[i].absolutePositions == NULL)
 	continue;
@@ -2683,10 +3394,10 @@ main (int argc, char **argv)
       /* read in absolute positions map */
       map = NULL;
       sprintf(fn, "%s%s.map", absoluteMapsName, images[i].name);
-      if (!ReadMap(fn, &map, &mLevel,
-		   &mw, &mh, &mxMin, &myMin,
-		   imName0, imName1,
-		   msg))
+      if (!ReadMapLevel(fn, &map, endLevel, &mLevel,
+			&mw, &mh, &mxMin, &myMin,
+			imName0, imName1,
+			msg))
 	{
 	  Log("WARNING: Could not open %s so will not use absolute map.\n",
 	      fn);
@@ -2728,7 +3439,8 @@ main (int argc, char **argv)
 		mask[iyv*mbpl+(ixv >> 3)] |= 0x80 >> (ixv & 7);
 	    }
       dist = (float *) malloc(dny * dnx * sizeof(float));
-      computeDistance(CHESSBOARD_DISTANCE, dnx, dny, mask, dist);
+      computeDistanceThreaded(CHESSBOARD_DISTANCE, dnx, dny, mask, dist,
+			      nThreads);
 
       for (level = startLevel; level >= endLevel; --level)
 	{
@@ -2843,26 +3555,53 @@ main (int argc, char **argv)
       map = NULL;
     }
 
+  if (restart)
+    OpenCheckpoint(&cs);
+
+  if (gpuForces && !GpuForcesInit(msg))
+    {
+      Log("WARNING: computing forces on the CPU, as the GPU can not be used:\n  %s",
+	  msg);
+      gpuForces = 0;
+    }
+
+  MetricsEmit("setup", 0);
+  MetricsPhase(METRICS_COMPUTE);
+
   prevLevel = -1;
   for (step = 0; step < nSteps; ++step)
     {
       level = steps[step].level;
+      METRICS_MARK("align step");
       if (p == 0)
 	Log("Starting iterations for step %d (level %d)\n", step, level);
+      MetricsGauge("step", step);
+      MetricsGauge("level", level);
 
       if (level != prevLevel)
 	{
 	  if (prevLevel >= 0)
-	    RefinePositions(prevLevel, level);
+	    {
+	      if (settleThreshold > 0.0 && settleLevel == prevLevel)
+		SettleImages(prevLevel);
+	      RefinePositions(prevLevel, level);
+	      if (rebalanceThreshold > 0.0 && np > 1 && !restart)
+		RebalanceImages(prevLevel, level);
+	    }
 	  PlanCommunications(level);
 	  prevLevel = level;
 	}
 
+      /* the steps before the checkpoint only need to bring the
+	 nodes to the right level; the positions are restored below */
+      if (restart && step < cs.step)
+	continue;
+
       if (foldRecovery > 0)
 	{
 	  // make a backup copy of the point positions in case
 	  //   we have to restart this step
-	  for (i = myFirstImage; i <= myLastImage; ++i)
+	  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
 	    {
 	      nx = images[i].nx;
 	      ny = images[i].ny;
@@ -2902,18 +3641,159 @@ main (int argc, char **argv)
       nDecrease = 0;
       nIncrease = 0;
       foldDetected = 0;
-      for (iter = 0; ; ++iter)
+      globalMaxF = 0.0;
+      prevReducedIter = -1;
+      if (momentum > 0.0)
+	for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+	  {
+	    nNodes = images[i].nx * images[i].ny;
+	    images[i].velocity = (Point *) realloc(images[i].velocity,
+						   nNodes * sizeof(Point));
+	    memset(images[i].velocity, 0, nNodes * sizeof(Point));
+	  }
+      if (conjugateGradient)
+	for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+	  {
+	    nNodes = images[i].nx * images[i].ny;
+	    images[i].direction = (Point *) realloc(images[i].direction,
+						    nNodes * sizeof(Point));
+	    images[i].lineForce = (Point *) realloc(images[i].lineForce,
+						    nNodes * sizeof(Point));
+	    memset(images[i].direction, 0, nNodes * sizeof(Point));
+	    memset(images[i].lineForce, 0, nNodes * sizeof(Point));
+	  }
+      cgRestart = 1;
+      cgStep = 0.0;
+      cgLineAlpha = 0.0;
+      cgLineSlope = 0.0;
+      iter = 0;
+      if (restart)
+	{
+	  RestoreCheckpoint(level);
+	  iter = cs.iter;
+	  dampingFactor = cs.dampingFactor;
+	  outputRequestedIter = cs.outputRequestedIter;
+	  terminationRequestedIter = cs.terminationRequestedIter;
+	  refinementRequestedIter = cs.refinementRequestedIter;
+	  epochInitialTotalEnergy = cs.epochInitialTotalEnergy;
+	  epochFinalTotalEnergy = cs.epochFinalTotalEnergy;
+	  prevTotalEnergy = cs.prevTotalEnergy;
+	  totalEnergy = cs.totalEnergy;
+	  deltaEnergy = cs.deltaEnergy;
+	  lastOutput = cs.lastOutput;
+	  nDecrease = cs.nDecrease;
+	  nIncrease = cs.nIncrease;
+	  globalMaxF = cs.globalMaxF;
+	  prevReducedIter = cs.prevReducedIter;
+	  outputGridScale = cs.outputGridScale;
+	  outputGridOffsetX = cs.outputGridOffsetX;
+	  outputGridOffsetY = cs.outputGridOffsetY;
+	  restart = 0;
+	  Log("Resuming step %d at iteration %d\n", step, iter);
+	}
+      startIter = iter;
+      forceSeconds = 0.0;
+      exchangeSeconds = 0.0;
+      reduceSeconds = 0.0;
+      iterationSeconds = 0.0;
+      stepStart = MPI_Wtime();
+      timerStart = stepStart;
+      if (settleThreshold > 0.0 && settleLevel != level)
+	{
+	  if (settleEnergy == NULL)
+	    settleEnergy = (double *) malloc(nImages * sizeof(double));
+	  ImageEnergies(level, settleEnergy);
+	  settleLevel = level;
+	}
+      if (gpuForces)
+	GpuLoadStep(level);
+      for (; ; ++iter)
 	{
 #if DEBUG
 	  Log("Starting iteration %d\n", iter);
 #endif
-	  CommunicatePositions(level);
+	  MetricsCount("iterations", 1);
+	  MetricsGauge("iteration", iter);
+	  /* the nodes moved on the GPU are brought back for the
+	     iterations that check, save, or draw them */
+	  if (gpuHostStale &&
+	      (iter % epochIterations == 0 ||
+	       (checkpointName[0] != '\0' && iter % checkpointInterval == 0) ||
+	       (outputGridName[0] != '\0' && outputGridInterval > 0 &&
+		iter % outputGridInterval == 0) ||
+	       (outputSpringsName[0] != '\0' && step == 6 &&
+		iter % 100 == 0)))
+	    GpuDownloadNodes(1);
+
+	  /* save the state of the relaxation periodically */
+	  if (checkpointName[0] != '\0' &&
+	      iter % checkpointInterval == 0)
+	    {
+	      cs.step = step;
+	      cs.iter = iter;
+	      cs.dampingFactor = dampingFactor;
+	      cs.outputRequestedIter = outputRequestedIter;
+	      cs.terminationRequestedIter = terminationRequestedIter;
+	      cs.refinementRequestedIter = refinementRequestedIter;
+	      cs.epochInitialTotalEnergy = epochInitialTotalEnergy;
+	      cs.epochFinalTotalEnergy = epochFinalTotalEnergy;
+	      cs.prevTotalEnergy = prevTotalEnergy;
+	      cs.totalEnergy = totalEnergy;
+	      cs.deltaEnergy = deltaEnergy;
+	      cs.lastOutput = lastOutput;
+	      cs.nDecrease = nDecrease;
+	      cs.nIncrease = nIncrease;
+	      cs.globalMaxF = globalMaxF;
+	      cs.prevReducedIter = prevReducedIter;
+	      cs.outputGridScale = outputGridScale;
+	      cs.outputGridOffsetX = outputGridOffsetX;
+	      cs.outputGridOffsetY = outputGridOffsetY;
+	      WriteCheckpoint(&cs, level);
+	    }
+
+	  /* with -cg, the step along the search direction chosen on the
+	     previous iteration is only taken now, so that the iterations
+	     that end the step or write output leave the nodes at a point
+	     whose energy is known */
+	  if (cgStep != 0.0)
+	    {
+	      for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+		{
+		  if (images[i].fixed || images[i].settled)
+		    continue;
+		  nNodes = images[i].nx * images[i].ny;
+		  node = images[i].nodes;
+		  direction = images[i].direction;
+		  for (k = 0; k < nNodes; ++k, ++node)
+		    {
+		      if (node->x > 0.5 * UNSPECIFIED)
+			continue;
+		      node->x += cgStep * direction[k].x;
+		      node->y += cgStep * direction[k].y;
+		    }
+		}
+	      cgStep = 0.0;
+	    }
+
+	  MetricsPhase(METRICS_COMMUNICATE);
+	  if (timing)
+	    timerStart = MPI_Wtime();
+	  if (hierarchicalCommunication)
+	    ExchangeNodePositions();
+	  else if (overlapCommunication)
+	    StartPositionExchange();
+	  else
+	    CommunicatePositions(level);
+	  if (timing)
+	    exchangeSeconds += MPI_Wtime() - timerStart;
+	  MetricsPhase(METRICS_COMPUTE);
 
 	  /* output the grids if requested */
 	  if (outputGridName[0] != '\0' &&
 	      outputGridInterval > 0 &&
 	      iter % outputGridInterval == 0)
 	    {
+	      FinishPositionExchange();
 	      sprintf(gridName, "%sstep%.2d.i%.6d.pnm",
 		      outputGridName, step, iter);
 	      if (iter == 0)
@@ -2937,6 +3817,7 @@ main (int argc, char **argv)
 	  /* check for folds periodically */
 	  if (iter % epochIterations == 0)
 	    {
+	      FinishPositionExchange();
 	      if (CheckForFolds(level, iter))
 		{
 		  foldDetected = 1;
@@ -2978,13 +3859,20 @@ main (int argc, char **argv)
 		}
 	    }
 		
-	  /* update all deltas periodically */
+	  /* update all deltas periodically; as this changes the springs,
+	     any line search of -cg starts again */
 	  if (iter % epochIterations == 0)
-	    UpdateDeltas(level, iter);
+	    {
+	      UpdateDeltas(level, iter);
+	      cgRestart = 1;
+	    }
+	  if (gpuForces && gpuSpringsVersion != springsVersion)
+	    GpuLoadStep(level);
 
 	  if (outputSpringsName[0] != '\0' &&
 	      step == 6 && (iter % 100) == 0)
 	    {
+	      FinishPositionExchange();
 	      GetGridScale(&outputGridScale,
 			   &outputGridOffsetX, &outputGridOffsetY,
 			   outputGridWidth, outputGridHeight,
@@ -3003,294 +3891,477 @@ main (int argc, char **argv)
 	    }
 
 	  /* update all forces, also computing energy */
-	  energy = 0.0;
-	  basis = energy;
-	  for (i = myFirstImage; i <= myLastImage; ++i)
+	  if (timing)
+	    forceStart = MPI_Wtime();
+	  /* the iterations whose forces are output as statistics
+	     compute them on the CPU */
+	  gpuIteration = gpuForces &&
+	    (outputStatsName[0] == '\0' || iter % epochIterations != 0);
+	  if (gpuIteration)
 	    {
-	      nx = images[i].nx;
-	      ny = images[i].ny;
-#if PDEBUG
-	      poix = (int) floor(poixv / factor + 0.5);
-	      poiy = (int) floor(poiyv / factor + 0.5);
-#endif
-	      if (images[i].absolutePositions != NULL)
+	      MetricsPhase(METRICS_COMMUNICATE);
+	      if (timing)
+		timerStart = MPI_Wtime();
+	      FinishPositionExchange();
+	      if (timing)
+		exchangeSeconds += MPI_Wtime() - timerStart;
+	      MetricsPhase(METRICS_COMPUTE);
+	      if (gpuDeviceStale)
+		GpuUploadNodes(1);
+	      GpuUploadNodes(0);
+	      METRICS_RANGE_BEGIN("align GPU forces");
+	      if (!GpuForcesCompute(kAbsolute, kIntra, kInter,
+				    &intraEnergy, &interEnergy, &gpuMaxF, msg))
+		Error("%s", msg);
+	      METRICS_RANGE_END();
+	      energy = intraEnergy + interEnergy;
+	      if (isinf(energy) || isnan(energy))
+		abort();
+	      if (p == 0 && iter % 100 == 0)
 		{
-		  /* compute absolute location forces */
-		  node = images[i].nodes;
-		  absPos = images[i].absolutePositions[startLevel - level];
-		  for (y = 0; y < ny; ++y)
-		    for (x = 0; x < nx; ++x, ++node, ++absPos)
-		      {
-			if (node->x > 0.5 * UNSPECIFIED)
-			  continue;
-			if (absPos->x < 0.5 * UNSPECIFIED)
-			  deltaX = absPos->x - node->x;
-			else
-			  deltaX = 0.0;
-			if (absPos->y < 0.5 * UNSPECIFIED)
-			  deltaY = absPos->y - node->y;
-			else
-			  deltaY = 0;
-			if (node->fx < 0.5 * CONSTRAINED)
-			  node->fx = kAbsolute * deltaX;
-			if (node->fy < 0.5 * CONSTRAINED)
-			  node->fy = kAbsolute * deltaY;
-			energy += kAbsolute * (deltaX * deltaX + deltaY * deltaY);
-			if (isinf(energy) || isnan(energy))
-			  abort();
-			//			if (x == 0 && y == 0)
-			//			  Log("ENERGY COMP %f %f %f %f %f %f %f %f\n",
-			//			      kAbsolute, deltaX, deltaY, absPos->x, absPos->y,
-			//			      node->x, node->y, energy);
-		      }
+		  Log("intra-energy = %f  (kIntra = %f)\n", intraEnergy, kIntra);
+		  Log("energy = %f basis = %f\n", intraEnergy, 0.0);
+		  Log("inter-energy = %f  (kInter = %f)\n", interEnergy, kInter);
 		}
+	      maxF = dampingFactor * gpuMaxF;
+	    }
+	  else
+	    {
+	      energy = 0.0;
+	      basis = energy;
+	      METRICS_RANGE_BEGIN("align intra-image forces");
+	      if (nThreads > 1)
+		RunForceThreads(level, 0, &energy);
 	      else
+		for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+		  ImageForces(i, level, &energy);
+	      METRICS_RANGE_END();
+	      if (p == 0 && iter % 100 == 0)
 		{
-		  /* zero all forces */
-		  node = images[i].nodes;
-		  for (y = 0; y < ny; ++y)
-		    for (x = 0; x < nx; ++x, ++node)
-		      {
-			if (node->fx < 0.5 * CONSTRAINED)
-			  node->fx = 0.0;
-			if (node->fy < 0.5 * CONSTRAINED)
-			  node->fy = 0.0;
-		      }
+		  Log("intra-energy = %f  (kIntra = %f)\n", energy - basis, kIntra);
+		  Log("energy = %f basis = %f\n", energy, basis);
 		}
-
-	      /* add in intra-section forces */
-	      kIntraThisImage = kIntra * images[i].kFactor;
-	      iim = images[i].map;
-	      nodes = images[i].nodes;
-	      nSprings = iim->nSprings[startLevel - level];
-	      iSprings = iim->springs[startLevel - level];
-	      for (k = 0; k < nSprings; ++k)
+	      //      nodes0 = images[0].nodes;
+	      //      nx = images[0].nx;
+	      //      if (iter == 0)
+	      //        Log("PTEST %f %f\n", nodes[2*nx].x, nodes[2*nx].y);
+
+	      /* add in inter-image forces (one spring method) */
+	      MetricsPhase(METRICS_COMMUNICATE);
+	      if (timing)
+		timerStart = MPI_Wtime();
+	      FinishPositionExchange();
+	      if (timing)
+		exchangeSeconds += MPI_Wtime() - timerStart;
+	      MetricsPhase(METRICS_COMPUTE);
+	      basis = energy;
+	      METRICS_RANGE_BEGIN("align inter-image forces");
+	      if (nThreads > 1)
+		RunForceThreads(level, 1, &energy);
+	      else
+		for (i = 0; i < nMaps; ++i)
+		  MapForces(i, level, &energy, NULL);
+	      METRICS_RANGE_END();
+	      if (p == 0 && iter % 100 == 0)
+		Log("inter-energy = %f  (kInter = %f)\n", energy - basis, kInter);
+
+	      maxF = 0.0;
+	      for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
 		{
-		  iis = &(iSprings[k]);
-		  if (nodes[iis->index0].x > 0.5 * UNSPECIFIED ||
-		      nodes[iis->index1].x > 0.5 * UNSPECIFIED)
+		  if (images[i].fixed || images[i].settled)
 		    continue;
-		  deltaX = nodes[iis->index1].x - nodes[iis->index0].x;
-		  deltaY = nodes[iis->index1].y - nodes[iis->index0].y;
-		  d = sqrt(deltaX * deltaX + deltaY * deltaY);
-		  sk = kIntraThisImage * iis->k;
-		  force = sk * (d - iis->nomD);
-		  energy += force * (d - iis->nomD);
-		  if (isinf(energy) || isnan(energy))
-		    abort();
-		  if (d != 0.0)
+		  nNodes = images[i].nx * images[i].ny;
+		  node = images[i].nodes;
+		  for (k = 0; k < nNodes; ++k, ++node)
 		    {
-		      forceOverD = force / d;
-		      dfx = forceOverD * deltaX;
-		      dfy = forceOverD * deltaY;
-		      nodes[iis->index0].fx += dfx;
-		      nodes[iis->index0].fy += dfy;
-		      nodes[iis->index1].fx -= dfx;
-		      nodes[iis->index1].fy -= dfy;
+		      if (node->x > 0.5 * UNSPECIFIED)
+			continue;
+		      if (node->fx < 0.5 * CONSTRAINED)
+			if (node->fy < 0.5 * CONSTRAINED)
+			  force = dampingFactor * hypot(node->fx, node->fy);
+			else
+			  force = dampingFactor * fabsf(node->fx);
+		      else 
+			if (node->fy < 0.5 * CONSTRAINED)
+			  force = dampingFactor * fabsf(node->fy);
+			else
+			  continue;
+		      if (force > maxF)
+			maxF = force;
 		    }
-#if DEBUG
-#if PDEBUG
-		  if (i == ioi &&
-		      (iis->index0 % images[i].nx == poix &&
-		       iis->index0 / images[i].nx == poiy ||
-		       iis->index1 % images[i].nx == poix &&
-		       iis->index1 / images[i].nx == poiy))
-#endif
-		    Log("intraforce: %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) dist %f nom %f force (%f %f)\n",
-		      i, iis->index0 % images[i].nx, iis->index0 / images[i].nx,
-		      i, iis->index1 % images[i].nx, iis->index1 / images[i].nx,
-		      nodes[iis->index0].x, nodes[iis->index0].y,
-		      nodes[iis->index1].x, nodes[iis->index1].y,
-		      d, iis->nomD,
-		      d != 0.0 ? dfx : 1000000000.0,
-		      d != 0.0 ? dfy : 1000000000.0);
-#endif
 		}
 	    }
-	  if (p == 0 && iter % 100 == 0)
-	    {
-	      Log("intra-energy = %f  (kIntra = %f)\n", energy - basis, kIntra);
-	      Log("energy = %f basis = %f\n", energy, basis);
-	    }
-	  //	  nodes0 = images[0].nodes;
-	  //	  nx = images[0].nx;
-	  //	  if (iter == 0)
-	  //	    Log("PTEST %f %f\n", nodes[2*nx].x, nodes[2*nx].y);
-
-	  /* add in inter-image forces (one spring method) */
-	  basis = energy;
-	  for (i = 0; i < nMaps; ++i)
+	  if (timing)
+	    forceSeconds += MPI_Wtime() - forceStart;
+
+	  /* the line search of -cg needs the slope of the energy along
+	     the search direction, and the Polak-Ribiere update needs the
+	     forces against those at the start of the line; constrained
+	     and clamped coordinates do not take part */
+	  if (conjugateGradient)
 	    {
-	      m = &maps[i];
-	      msk = kInter * m->k;
-	      if (msk == 0.0)
-		continue;
-	      sme = m->energyFactor != 0.0;
-	      nStrips = m->nStrips[startLevel - level];
-	      strips = m->strips[startLevel - level];
-	      springs = m->springs[startLevel - level];
-	      nodes0 = images[m->image0].nodes;
-	      if (nodes0 == NULL)
-		abort();
-	      nodes1 = images[m->image1].nodes;
-	      nx = images[m->image0].nx;
-	      nx1 = images[m->image1].nx;
-	      springsPos = 0;
-	      for (j = 0; j < nStrips; ++j)
+	      fd = 0.0;
+	      ff = 0.0;
+	      fl = 0.0;
+	      maxD = 0.0;
+	      maxRawF = 0.0;
+	      for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
 		{
-		  if (nodes0 == NULL)
-		    abort();
-		  strip = &(strips[j]);
-		  ns = strip->nSprings;
-		  x = strip->x0;
-		  y = strip->y0;
-		  irx = strip->x1;
-		  iry = strip->y1;
-		  for (k = 0; k < ns; ++k, ++x)
+		  if (images[i].fixed || images[i].settled)
+		    continue;
+		  nNodes = images[i].nx * images[i].ny;
+		  node = images[i].nodes;
+		  direction = images[i].direction;
+		  lineForce = images[i].lineForce;
+		  for (k = 0; k < nNodes; ++k, ++node)
 		    {
-		      s = &(springs[springsPos++]);
-		      irx += ((s->dxy1) >> 4) - 8;
-		      iry += ((s->dxy1) & 0xf) - 8;
-		      if (nodes0[y*nx+x].x > 0.5 * UNSPECIFIED ||
-			  nodes1[iry*nx1+irx].x > 0.5 * UNSPECIFIED)
+		      if (node->x > 0.5 * UNSPECIFIED)
 			continue;
-		      xv = nodes1[iry*nx1+irx].x + 0.00005 * s->dx;
-		      yv = nodes1[iry*nx1+irx].y + 0.00005 * s->dy;
-		      deltaX = xv - nodes0[y*nx + x].x;
-		      deltaY = yv - nodes0[y*nx + x].y;
-		      sk = (s->k / 255.0) * msk;
-		      kdx = sk * deltaX;
-		      kdy = sk * deltaY;
-#if DEBUG
-#if PDEBUG
-		      if (m->image0 == ioi && x == poix && y == poiy ||
-			  m->image1 == ioi && irx == poix && iry == poiy)
-#endif
-		      Log("interforce %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) (%d %d) (%f %f) (%f %f) (%f %f)\n",
-			  m->image0, x, y,
-			  m->image1, irx, iry,
-			  nodes0[y*nx+x].x, nodes0[y*nx+x].y,
-			  xv, yv,
-			  irx, iry,
-			  nodes1[iry*nx1+irx].x, nodes1[iry*nx1+irx].y,
-			  0.00005 * s->dx, 0.00005 * s->dy,
-			  kdx, kdy);
-#endif
-		      if (nodes0 == NULL)
-			abort();
-		      nodes0[y*nx + x].fx += kdx;
-		      nodes0[y*nx + x].fy += kdy;
-		      if (sme)
-			energy += sk * (deltaX * deltaX + deltaY * deltaY);
-		      if (isinf(energy) || isnan(energy))
-			abort();
-		      nodes1[iry*nx1 + irx].fx -= kdx;
-		      nodes1[iry*nx1 + irx].fy -= kdy;
+		      fx = node->fx < 0.5 * CONSTRAINED && !steps[step].clampX ?
+			node->fx : 0.0;
+		      fy = node->fy < 0.5 * CONSTRAINED && !steps[step].clampY ?
+			node->fy : 0.0;
+		      fd += fx * direction[k].x + fy * direction[k].y;
+		      ff += fx * fx + fy * fy;
+		      fl += fx * lineForce[k].x + fy * lineForce[k].y;
+		      force = hypot(fx, fy);
+		      if (force > maxRawF)
+			maxRawF = force;
+		      force = hypot(direction[k].x, direction[k].y);
+		      if (force > maxD)
+			maxD = force;
 		    }
 		}
 	    }
-	  if (p == 0 && iter % 100 == 0)
-	    Log("inter-energy = %f  (kInter = %f)\n", energy - basis, kInter);
 
-	  maxF = 0.0;
-	  for (i = myFirstImage; i <= myLastImage; ++i)
+	  if (outputStatsName[0] != '\0' && iter % epochIterations == 0)
+	    OutputStats(step, iter, level);
+
+	  /* find global maximum force and total energy; with a
+	     reduction interval above 1, the reduction started on
+	     one iteration is only waited for on the next one */
+	  MetricsPhase(METRICS_COMMUNICATE);
+	  if (timing)
+	    timerStart = MPI_Wtime();
+	  reduced = 0;
+	  if (reduceInterval == 1 || iter == 0)
 	    {
-	      if (images[i].fixed)
-		continue;
-	      nNodes = images[i].nx * images[i].ny;
-	      node = images[i].nodes;
-	      for (k = 0; k < nNodes; ++k, ++node)
+	      WaitForReduction();
+	      reduceIn[0] = maxF;
+	      reduceIn[1] = energy;
+	      nReduce = 2;
+	      if (conjugateGradient)
 		{
-		  if (node->x > 0.5 * UNSPECIFIED)
-		    continue;
-		  if (node->fx < 0.5 * CONSTRAINED)
-		    if (node->fy < 0.5 * CONSTRAINED)
-		      force = dampingFactor * hypot(node->fx, node->fy);
-		    else
-		      force = dampingFactor * fabsf(node->fx);
-		  else 
-		    if (node->fy < 0.5 * CONSTRAINED)
-		      force = dampingFactor * fabsf(node->fy);
-		    else
-		      continue;
-		  if (force > maxF)
-		    maxF = force;
+		  reduceIn[2] = maxD;
+		  reduceIn[3] = fd;
+		  reduceIn[4] = maxRawF;
+		  reduceIn[5] = ff;
+		  reduceIn[6] = 0.0;
+		  reduceIn[7] = fl;
+		  nReduce = 8;
 		}
+	      if (MPI_Allreduce(reduceIn, reduceOut, nReduce, MPI_DOUBLE,
+				maxSumOp, MPI_COMM_WORLD) != MPI_SUCCESS)
+		Error("Could not find global maximum force and energy\n");
+	      reduced = 1;
+	      reducedIter = iter;
 	    }
-
-	  /* find global maximum */
-	  if (MPI_Allreduce(&maxF, &globalMaxF, 1, MPI_FLOAT, MPI_MAX,
-			    MPI_COMM_WORLD) != MPI_SUCCESS)
-	    Error("Could not find global maximum force\n");
-
-	  /* update all positions */
-	  if (globalMaxF > 0.5)
-	    scale = dampingFactor * 0.5 / globalMaxF;
-	  else
-	    scale = dampingFactor;
-	  //	  printf("df = %f scale = %f msx = %f msy = %f\n",
-	  //		 dampingFactor, scale, maxStepX, maxStepY);
-	  if (steps[step].clampX)
-	    maxStepX = 0.0;
-	  else
-	    maxStepX = 0.1 * factor;
-	  if (steps[step].clampY)
-	    maxStepY = 0.0;
 	  else
-	    maxStepY = 0.1 * factor;
-	  for (i = myFirstImage; i <= myLastImage; ++i)
 	    {
-	      if (images[i].fixed)
-		continue;
-	      nNodes = images[i].nx * images[i].ny;
-	      node = images[i].nodes;
-	      for (k = 0; k < nNodes; ++k, ++node)
+	      if (reducePending)
 		{
-		  if (node->x > 0.5 * UNSPECIFIED)
-		    continue;
-		  if (node->fx < 0.5 * CONSTRAINED)
+		  WaitForReduction();
+		  reduced = 1;
+		  reducedIter = iter - 1;
+		}
+	      if (iter % reduceInterval == 0)
+		{
+		  reduceIn[0] = maxF;
+		  reduceIn[1] = energy;
+		  if (MPI_Iallreduce(reduceIn, reduceOut, 2, MPI_DOUBLE,
+				     maxSumOp, MPI_COMM_WORLD,
+				     &reduceRequest) != MPI_SUCCESS)
+		    Error("Could not start reduction of force and energy\n");
+		  reducePending = 1;
+		}
+	    }
+	  if (timing)
+	    reduceSeconds += MPI_Wtime() - timerStart;
+	  MetricsPhase(METRICS_COMPUTE);
+	  if (reduced)
+	    {
+	      globalMaxF = reduceOut[0];
+	      totalEnergy = reduceOut[1];
+	      span = reducedIter - prevReducedIter;
+	      prevReducedIter = reducedIter;
+	      MetricsGauge("energy", totalEnergy);
+	      MetricsGauge("max_force", globalMaxF);
+	    }
+
+	  /* with -cg, each iteration evaluates one trial point of a
+	     secant line search along the current direction; once the
+	     energy has dropped and its slope has fallen to a tenth of
+	     that at the start of the line, the next line starts along
+	     the Polak-Ribiere direction, and a line search that finds
+	     no lower energy restarts along the forces alone, or ends
+	     the step if it already was along them */
+	  cgNewLine = 0;
+	  if (conjugateGradient)
+	    {
+	      maxD = reduceOut[2];
+	      fd = reduceOut[3];
+	      maxRawF = reduceOut[4];
+	      ff = reduceOut[5];
+	      fl = reduceOut[7];
+	      slope = -fd;
+	      if (cgRestart)
+		cgNewLine = 1;
+	      else
+		{
+		  ++cgTrials;
+		  if (totalEnergy <= cgStartEnergy &&
+		      fabs(slope) <= 0.1 * fabs(cgStartSlope))
+		    {
+		      cgNewLine = 1;
+		      cgLineAlpha = alpha;
+		      cgLineSlope = cgStartSlope;
+		    }
+		  else
 		    {
-		      deltaX = scale * node->fx;
-		      if (deltaX > maxStepX)
-			deltaX = maxStepX;
-		      else if (deltaX < -maxStepX)
-			deltaX = -maxStepX;
-		      node->x += deltaX;
+		      if (totalEnergy > cgStartEnergy || slope > 0.0)
+			{
+			  cgHigh = alpha;
+			  cgHighSlope = slope;
+			}
+		      else
+			{
+			  cgLow = alpha;
+			  cgLowSlope = slope;
+			}
+		      if (cgTrials >= 20 ||
+			  (cgHigh >= 0.0 && (cgHigh - cgLow) * maxD < 0.00001))
+			{
+			  if (totalEnergy < cgStartEnergy)
+			    {
+			      cgNewLine = 1;
+			      cgLineAlpha = alpha;
+			      cgLineSlope = cgStartSlope;
+			    }
+			  else if (cgSteepest)
+			    {
+			      Log("Line search found no lower energy... ending iterations for this step.\n");
+			      goto finalFoldCheck;
+			    }
+			  else
+			    {
+			      cgRestart = 1;
+			      cgNewLine = 1;
+			    }
+			}
+		    }
+		}
 
+	      if (cgNewLine)
+		{
+		  if (cgRestart)
+		    beta = 0.0;
+		  else
+		    {
+		      beta = (ff - fl) / cgStartForce;
+		      if (beta < 0.0)
+			beta = 0.0;
 		    }
-		  if (node->fy < 0.5 * CONSTRAINED)
+		  if (ff + beta * fd <= 0.0)
+		    beta = 0.0;
+		  if (ff <= 0.0)
 		    {
-		      deltaY = scale * node->fy;
-		      if (deltaY > maxStepY)
-			deltaY = maxStepY;
-		      else if (deltaY < -maxStepY)
-			deltaY = -maxStepY;
-		      node->y += deltaY;
+		      Log("All forces are zero... ending iterations for this step.\n");
+		      goto finalFoldCheck;
+		    }
+		  cgSteepest = beta == 0.0;
+		  cgStartEnergy = totalEnergy;
+		  cgStartSlope = -(ff + beta * fd);
+		  cgStartForce = ff;
+		  maxD = maxRawF + beta * maxD;
+
+		  /* the first trial expects the same change of energy as
+		     the previous line gave */
+		  if (cgLineAlpha > 0.0)
+		    alpha = cgLineAlpha * cgLineSlope / cgStartSlope;
+		  else
+		    alpha = dampingFactor;
+		  if (alpha * maxD > 0.1 * factor)
+		    alpha = 0.1 * factor / maxD;
+		  cgLow = 0.0;
+		  cgLowSlope = cgStartSlope;
+		  cgHigh = -1.0;
+		  cgHighSlope = 0.0;
+		  cgPrevAlpha = 0.0;
+		  cgPrevSlope = cgStartSlope;
+		  cgTrials = 0;
+		  cgRestart = 0;
+		  cgStep = alpha;
+		}
+	      else
+		{
+		  if (cgHigh < 0.0)
+		    {
+		      /* not yet bracketed, so extrapolate the slope
+			 to zero, going at most 4 times as far */
+		      if (slope > cgPrevSlope)
+			cgStep = alpha - slope * (alpha - cgPrevAlpha) /
+			  (slope - cgPrevSlope);
+		      else
+			cgStep = 4.0 * alpha;
+		      if (cgStep > 4.0 * alpha)
+			cgStep = 4.0 * alpha;
+		      if (cgStep < 1.5 * alpha)
+			cgStep = 1.5 * alpha;
+		      if ((cgStep - alpha) * maxD > 0.1 * factor)
+			cgStep = alpha + 0.1 * factor / maxD;
 		    }
+		  else if (cgHighSlope > 0.0)
+		    {
+		      /* interpolate the slope to zero within the
+			 bracket, keeping clear of its ends */
+		      cgStep = cgLow - cgLowSlope * (cgHigh - cgLow) /
+			(cgHighSlope - cgLowSlope);
+		      if (cgStep < cgLow + 0.1 * (cgHigh - cgLow))
+			cgStep = cgLow + 0.1 * (cgHigh - cgLow);
+		      if (cgStep > cgHigh - 0.1 * (cgHigh - cgLow))
+			cgStep = cgHigh - 0.1 * (cgHigh - cgLow);
+		    }
+		  else
+		    cgStep = 0.5 * (cgLow + cgHigh);
+		  cgPrevAlpha = alpha;
+		  cgPrevSlope = slope;
+		  cgStep -= alpha;
+		  alpha += cgStep;
+		}
+	    }
+
+	  /* update all positions; between reductions the last known
+	     global maximum force is used unless this process has a
+	     larger one */
+	  refMaxF = globalMaxF;
+	  if (maxF > refMaxF)
+	    refMaxF = maxF;
+	  if (refMaxF > 0.5)
+	    scale = dampingFactor * 0.5 / refMaxF;
+	  else
+	    scale = dampingFactor;
+	  //	  printf("df = %f scale = %f msx = %f msy = %f\n",
+	  //		 dampingFactor, scale, maxStepX, maxStepY);
+	  if (steps[step].clampX)
+	    maxStepX = 0.0;
+	  else
+	    maxStepX = 0.1 * factor;
+	  if (steps[step].clampY)
+	    maxStepY = 0.0;
+	  else
+	    maxStepY = 0.1 * factor;
+	  METRICS_RANGE_BEGIN("align move");
+	  if (gpuIteration)
+	    {
+	      if (!GpuForcesMove(scale, momentum, maxStepX, maxStepY, msg))
+		Error("%s", msg);
+	      GpuDownloadNodes(0);
+	    }
+	  else if (conjugateGradient)
+	    {
+	      /* a new line starts from the forces here; the step along
+		 it is taken at the start of the next iteration */
+	      if (cgNewLine)
+		for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+		  {
+		    if (images[i].fixed || images[i].settled)
+		      continue;
+		    nNodes = images[i].nx * images[i].ny;
+		    node = images[i].nodes;
+		    direction = images[i].direction;
+		    lineForce = images[i].lineForce;
+		    for (k = 0; k < nNodes; ++k, ++node)
+		      {
+			if (node->x > 0.5 * UNSPECIFIED)
+			  continue;
+			fx = node->fx < 0.5 * CONSTRAINED && !steps[step].clampX ?
+			  node->fx : 0.0;
+			fy = node->fy < 0.5 * CONSTRAINED && !steps[step].clampY ?
+			  node->fy : 0.0;
+			direction[k].x = fx + beta * direction[k].x;
+			direction[k].y = fy + beta * direction[k].y;
+			lineForce[k].x = fx;
+			lineForce[k].y = fy;
+		      }
+		  }
+	    }
+	  else
+	    {
+	      if (gpuForces)
+		gpuDeviceStale = 1;
+	      for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+		{
+		  if (images[i].fixed || images[i].settled)
+		    continue;
+		  nNodes = images[i].nx * images[i].ny;
+		  node = images[i].nodes;
+		  velocity = images[i].velocity;
+		  for (k = 0; k < nNodes; ++k, ++node)
+		    {
+		      if (node->x > 0.5 * UNSPECIFIED)
+			continue;
+		      if (node->fx < 0.5 * CONSTRAINED)
+			{
+			  deltaX = scale * node->fx;
+			  if (momentum > 0.0)
+			    deltaX += momentum * velocity[k].x;
+			  if (deltaX > maxStepX)
+			    deltaX = maxStepX;
+			  else if (deltaX < -maxStepX)
+			    deltaX = -maxStepX;
+			  node->x += deltaX;
+			  if (momentum > 0.0)
+			    velocity[k].x = deltaX;
+			}
+		      if (node->fy < 0.5 * CONSTRAINED)
+			{
+			  deltaY = scale * node->fy;
+			  if (momentum > 0.0)
+			    deltaY += momentum * velocity[k].y;
+			  if (deltaY > maxStepY)
+			    deltaY = maxStepY;
+			  else if (deltaY < -maxStepY)
+			    deltaY = -maxStepY;
+			  node->y += deltaY;
+			  if (momentum > 0.0)
+			    velocity[k].y = deltaY;
+			}
 #if DEBUG
 #if PDEBUG
-		  if (i == ioi && k % images[i].nx == poix &&
-		      k / images[i].nx == poiy)
+		      if (i == ioi && k % images[i].nx == poix &&
+			  k / images[i].nx == poiy)
 #endif
-		  Log("moving point %d(%d,%d) at (%f %f) by (%f %f) to (%f %f) force (%f %f)\n",
-		      i, k % images[i].nx, k / images[i].nx,
-		      node->x - deltaX, node->y - deltaY,
-		      deltaX, deltaY,
-		      node->x, node->y,
-		      node->fx, node->fy);
+		      Log("moving point %d(%d,%d) at (%f %f) by (%f %f) to (%f %f) force (%f %f)\n",
+			  i, k % images[i].nx, k / images[i].nx,
+			  node->x - deltaX, node->y - deltaY,
+			  deltaX, deltaY,
+			  node->x, node->y,
+			  node->fx, node->fy);
 #endif
+		    }
 		}
 	    }
+	  METRICS_RANGE_END();
 
-	  if (MPI_Allreduce(&energy, &totalEnergy, 1, MPI_DOUBLE,
-			    MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
-	    Error("Could not sum up energies.\n");
 	  /*	  if (p == 0 && (iter % 1000) == 999) */
 	  if (p == 0 && iter % 100 == 0)
 	    Log("After %d iterations, total energy is %f  (df = %f mgf = %f)\n",
 		iter, totalEnergy, dampingFactor, globalMaxF);
-	  deltaEnergy = totalEnergy - prevTotalEnergy;
-	  prevTotalEnergy = totalEnergy;
+	  if (reduced)
+	    {
+	      deltaEnergy = totalEnergy - prevTotalEnergy;
+	      prevTotalEnergy = totalEnergy;
+	    }
 	  if (iter % epochIterations == 0)
 	    epochInitialTotalEnergy = totalEnergy;
 
@@ -3336,8 +4407,31 @@ main (int argc, char **argv)
 		refinementRequestedIter = iter;
 	    }
 
-	  if (deltaEnergy > 0.0)
+	  /* the damping is adapted each time a new total energy is known,
+	     as though it had changed steadily over the span of iterations
+	     since the previous one */
+	  preferred = 0;
+	  if (conjugateGradient)
+	    {
+	      /* -cg does not use the damping; the start of each line is
+		 the lowest energy found so far */
+	      preferred = cgNewLine;
+	    }
+	  else if (reduced && deltaEnergy > 0.0)
 	    {
+	      /* the accumulated steps overshot, so start them
+		 again from rest */
+	      if (momentum > 0.0)
+		{
+		  if (gpuHostStale)
+		    GpuDownloadNodes(1);
+		  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+		    memset(images[i].velocity, 0,
+			   images[i].nx * images[i].ny * sizeof(Point));
+		  if (gpuForces)
+		    gpuDeviceStale = 1;
+		}
+
 	      nDecrease = 0;
 	      ++nIncrease;
 	      if (nIncrease > 1000 ||
@@ -3356,12 +4450,17 @@ main (int argc, char **argv)
 		    }
 		}
 	    }
-	  else
+	  else if (reduced)
 	    {
-	      ++nDecrease;
+	      for (k = 0; k < span; ++k)
+		{
+		  ++nDecrease;
+		  if (nDecrease == 32)
+		    preferred = 1;
+		  if (fixedDamping == 0.0 && dampingFactor < 0.5)
+		    dampingFactor *= 1.01;
+		}
 	      nIncrease = 0;
-	      if (fixedDamping == 0.0 && dampingFactor < 0.5)
-		dampingFactor *= 1.01;
 	    }
 
 	  /* 32 is chosen as a preferred time to output or terminate because,
@@ -3370,22 +4469,28 @@ main (int argc, char **argv)
 	     between instabilities is about 70, and we want to output/terminate
 	     when the state is not near an instability */
 	  if (outputRequestedIter >= 0 &&
-	      (nDecrease == 32 || iter > outputRequestedIter + 128))
+	      (preferred || iter > outputRequestedIter + 128))
 	    {
+	      if (gpuHostStale)
+		GpuDownloadNodes(1);
+	      MetricsPhase(METRICS_WRITE);
 	      Output(level, iter+1);
+	      MetricsPhase(METRICS_COMPUTE);
 	      outputRequestedIter = -1;
 	    }
 	  if (terminationRequestedIter >= 0 &&
-	      (nDecrease == 32 || iter > terminationRequestedIter + 128))
+	      (preferred || iter > terminationRequestedIter + 128))
 	    break;
 	  if (refinementRequestedIter >= 0 &&
-	      (nDecrease == 32 || iter > refinementRequestedIter + 128))
+	      (preferred || iter > refinementRequestedIter + 128))
 	    Log("Refinement (requested at iter %d, nDecrease = %d)\n",
 		refinementRequestedIter, nDecrease);
 	  else
 	    continue;
 
 	finalFoldCheck:
+	  if (gpuHostStale)
+	    GpuDownloadNodes(1);
 	  if (CheckForFolds(level, iter))
 	    {
 	      foldDetected = 1;
@@ -3426,6 +4531,16 @@ main (int argc, char **argv)
 	    }
 	  break;
 	}
+      if (timing)
+	timerStart = MPI_Wtime();
+      WaitForReduction();
+      if (timing)
+	{
+	  reduceSeconds += MPI_Wtime() - timerStart;
+	  iterationSeconds = MPI_Wtime() - stepStart;
+	}
+      if (gpuHostStale)
+	GpuDownloadNodes(1);
 
       if (foldDetected)
 	{
@@ -3436,6 +4551,44 @@ main (int argc, char **argv)
 
       if (p == 0)
 	Log("Finished alignment at step %d (level %d).\n", step, level);
+      if (timing)
+	{
+	  /* the time of the iterations on each process splits into
+	     the exchange of positions (including the waits for
+	     overlapped exchanges to finish), the reductions of force
+	     and energy, and everything else, which is counted as
+	     computation; process 0 reports the maximum and mean over
+	     the processes of each */
+	  timingIn[0] = iterationSeconds;
+	  timingIn[1] = iterationSeconds - exchangeSeconds - reduceSeconds;
+	  timingIn[2] = exchangeSeconds;
+	  timingIn[3] = reduceSeconds;
+	  if (MPI_Reduce(timingIn, timingMax, 4, MPI_DOUBLE, MPI_MAX,
+			 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+	      MPI_Reduce(timingIn, timingSum, 4, MPI_DOUBLE, MPI_SUM,
+			 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+	    Error("Could not gather timing of step %d\n", step);
+	}
+      if (p == 0 && timing)
+	{
+	  /* the iterations of this step, not counting any done before a
+	     restart */
+	  k = iter + 1 - startIter;
+	  Log("Step %d: %d iterations, %.3f s in the force loop (%.1f us per iteration)\n",
+	      step, k, forceSeconds, k > 0 ? 1.0e6 * forceSeconds / k : 0.0);
+	  Log("Step %d: %.3f s in the iterations; %.3f s computing, %.3f s exchanging positions, %.3f s in reductions (maximum over %d processes)\n",
+	      step, timingMax[0], timingMax[1], timingMax[2], timingMax[3],
+	      np);
+	  printf("timing: step %d level %d iterations %d force_seconds %.6f us_per_iteration %.3f"
+		 " processes %d iteration_seconds %.6f compute_seconds %.6f exchange_seconds %.6f reduce_seconds %.6f"
+		 " mean_iteration_seconds %.6f mean_compute_seconds %.6f mean_exchange_seconds %.6f mean_reduce_seconds %.6f\n",
+		 step, level, k, forceSeconds,
+		 k > 0 ? 1.0e6 * forceSeconds / k : 0.0,
+		 np, timingMax[0], timingMax[1], timingMax[2], timingMax[3],
+		 timingSum[0] / np, timingSum[1] / np,
+		 timingSum[2] / np, timingSum[3] / np);
+	  fflush(stdout);
+	}
       
       if (terminationRequestedIter >= 0)
 	break;
@@ -3444,7 +4597,9 @@ main (int argc, char **argv)
 	  (outputIncremental || step == nSteps-1))
 	{
 	  Log("OUTPUTTING SECTIONS\n");
+	  MetricsPhase(METRICS_WRITE);
 	  Output(level, -1);
+	  MetricsPhase(METRICS_COMPUTE);
 	}
 
       if (outputGridName[0] != '\0' &&
@@ -3473,9 +4628,21 @@ main (int argc, char **argv)
 		     outputGridFocusImage, outputGridFocusDepth,
 		     outputGridLabel);
 	}
+      MetricsEmit("step", step);
     }
+  METRICS_MARK(NULL);
 
+  MetricsPhase(METRICS_WRITE);
+  WaitForMapWriter();
   Log("FINALIZING\n");
+  if (hierarchicalCommunication)
+    {
+      MPI_Win_unlock_all(nodeWin);
+      MPI_Win_free(&nodeWin);
+    }
+  if (gpuForces)
+    GpuForcesFinish();
+  MetricsClose();
   MPI_Finalize();
   fclose(logFile);
   return(0);
@@ -3486,13 +4653,11 @@ Output (int level, int iter)
 {
   int x, y;
   int i;
-  char fn[PATH_MAX];
   char dirName[PATH_MAX];
   Node *nodes;
   Node *node;
   int nx, ny;
   MapElement *map;
-  char msg[PATH_MAX+256];
   double a[6];
   int nPts;
   Point *pts;
@@ -3515,13 +4680,15 @@ Output (int level, int iter)
   int upperLeftCorner;
   double upperLeftDistance;
   Point corners[4];
+  PendingMap *pm;
+  int token = 0;
 
   if (minimizeArea)
     {
       /* determine the transformation to apply to reduce the output area */
       cumulativeHullPts = NULL;
       nCumulativeHullPts = 0;
-      for (i = myFirstImage; i <= myLastImage; ++i)
+      for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
 	{
 	  nx = images[i].nx;
 	  ny = images[i].ny;
@@ -3681,18 +4848,21 @@ Output (int level, int iter)
   else
     sprintf(dirName, "%sl%.2di%.6d",
 	    outputName, level, iter);
-  for (i = myFirstImage; i <= myLastImage; ++i)
+
+  /* the maps of the previous output must be written before
+     their entries are reused */
+  WaitForMapWriter();
+  nPendingMaps = 0;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
       nx = images[i].nx;
       ny = images[i].ny;
       Log("Going to output section %s  nx = %d ny = %d\n",
 	  images[i].name, nx, ny);
 
-      if (outputName[0] != '\0')
+      /* a pinned image keeps the output of the previous chunk */
+      if (outputName[0] != '\0' && !images[i].pinned)
 	{
-	  sprintf(fn, "%s/%s.map", dirName, images[i].name);
-	  if (!CreateDirectories(fn))
-	    Error("Could not create directories for %s\n", fn);
 	  map = malloc(nx * ny * sizeof(MapElement));
 	  node = images[i].nodes;
 	  for (y = 0; y < ny; ++y)
@@ -3712,12 +4882,78 @@ Output (int level, int iter)
 		  }
 		++node;
 	      }
-	  if (!WriteMap(fn, map, level, nx, ny, 0, 0, images[i].name, "align",
-			UncompressedMap, msg))
-	    Error("Could not write map file %s: %s\n", fn, msg);
-	  free(map);
+	  if (nPendingMaps >= pendingMapsSize)
+	    {
+	      pendingMapsSize = (pendingMapsSize > 0) ?
+		2 * pendingMapsSize : 16;
+	      pendingMaps = (PendingMap *) realloc(pendingMaps,
+						   pendingMapsSize *
+						   sizeof(PendingMap));
+	    }
+	  pm = &pendingMaps[nPendingMaps++];
+	  sprintf(pm->fn, "%s/%s.map", dirName, images[i].name);
+	  pm->map = map;
+	  pm->level = level;
+	  pm->nx = nx;
+	  pm->ny = ny;
+	  pm->imageName = images[i].name;
 	}
     }
+  if (nPendingMaps == 0)
+    return;
+
+  if (outputWriters > 0)
+    {
+      /* the processes write in turn, outputWriters at a time */
+      if (p >= outputWriters &&
+	  MPI_Recv(&token, 1, MPI_INT, p - outputWriters, OUTPUT_TOKEN_TAG,
+		   MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+	Error("Could not receive output token\n");
+      WriteMaps(NULL);
+      if (p + outputWriters < np &&
+	  MPI_Send(&token, 1, MPI_INT, p + outputWriters, OUTPUT_TOKEN_TAG,
+		   MPI_COMM_WORLD) != MPI_SUCCESS)
+	Error("Could not send output token\n");
+    }
+  else
+    {
+      /* let the relaxation continue while the maps are written */
+      if (pthread_create(&mapWriter, NULL, WriteMaps, NULL) != 0)
+	Error("Could not create map writer thread.\n");
+      mapWriterRunning = 1;
+    }
+}
+
+/* WriteMaps writes out the maps handed over by Output; it either runs
+   in the background map writer thread or is called directly */
+void *
+WriteMaps (void *arg)
+{
+  int i;
+  char msg[PATH_MAX+256];
+  PendingMap *pm;
+
+  for (i = 0; i < nPendingMaps; ++i)
+    {
+      pm = &pendingMaps[i];
+      if (!CreateDirectories(pm->fn))
+	Error("Could not create directories for %s\n", pm->fn);
+      if (!WriteMap(pm->fn, pm->map, pm->level, pm->nx, pm->ny, 0, 0,
+		    pm->imageName, "align", AlignedMap, msg))
+	Error("Could not write map file %s: %s\n", pm->fn, msg);
+      free(pm->map);
+      pm->map = NULL;
+    }
+  return(NULL);
+}
+
+void
+WaitForMapWriter ()
+{
+  if (!mapWriterRunning)
+    return;
+  pthread_join(mapWriter, NULL);
+  mapWriterRunning = 0;
 }
 
 void
@@ -3821,7 +5057,7 @@ GetGridScale (float *pScale,
 	Error("Could not find focus image %s\n", outputGridFocusImage);
     }
   else
-    for (i = myFirstImage; i <= myLastImage; ++i)
+    for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
       {
 	nx = images[i].nx;
 	ny = images[i].ny;
@@ -3887,6 +5123,9 @@ OutputGrid (char *name,
   int dx, dy;
   int xp, yp;
   unsigned char *grid, *combinedGrid;
+  int bounds[4];
+  int tw, th;
+  float px, py;
   int factor;
   MapElement *map;
   char msg[PATH_MAX+256];
@@ -3908,12 +5147,14 @@ OutputGrid (char *name,
   float xv, yv;
   int ixv, iyv;
   float bMinX, bMaxX, bMinY, bMaxY;
-  int code;
+  int pos;
   int fIndex;
-  float avgX, avgY;
-  int count;
   char *lbl;
   int labelWidth, labelHeight;
+  int colSpan, rowSpan;
+  int *colN, *colIndex, *rowN, *rowIndex;
+  float *colWeight, *rowWeight;
+  int fRow;
 
   Log("OutputGrid called to generate %s\n", name);
   factor = 1 << level;
@@ -3929,9 +5170,92 @@ OutputGrid (char *name,
 	  }
     }
 
-  n = gridWidth * gridHeight * 3;
-  grid = (unsigned char *) malloc(n);
-  combinedGrid = (unsigned char *) malloc(n);
+  /* each process only draws into the tile of the grid that its images
+     and their labels can reach: bounds holds its first and last
+     columns and rows (empty if the last are below the first) */
+  bounds[0] = gridWidth;
+  bounds[1] = -1;
+  bounds[2] = gridHeight;
+  bounds[3] = -1;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      if (label &&
+	  LabelBounds(i, level, scale, offsetX, offsetY,
+		      &labelMinX, &labelMaxX, &labelMinY, &labelMaxY,
+		      &labelWidth, &labelHeight))
+	{
+	  if (labelMinX < bounds[0])
+	    bounds[0] = labelMinX;
+	  if (labelMaxX > bounds[1])
+	    bounds[1] = labelMaxX;
+	  if (labelMinY < bounds[2])
+	    bounds[2] = labelMinY;
+	  if (labelMaxY > bounds[3])
+	    bounds[3] = labelMaxY;
+	}
+      if (focusDepth >= 0 && fIndex >= 0 &&
+	  abs(i - fIndex) > outputGridFocusDepth)
+	continue;
+      n = images[i].nx * images[i].ny;
+      node = images[i].nodes;
+      for (k = 0; k < n; ++k, ++node)
+	{
+	  if (node->x > 0.5 * UNSPECIFIED)
+	    continue;
+	  /* the lines start at the floor of the node's pixel, and the
+	     constraint marks around its truncation */
+	  px = scale * factor * node->x + offsetX;
+	  py = scale * factor * node->y + offsetY;
+	  if (px < -2.0)
+	    px = -2.0;
+	  else if (px > gridWidth + 2.0)
+	    px = gridWidth + 2.0;
+	  if (py < -2.0)
+	    py = -2.0;
+	  else if (py > gridHeight + 2.0)
+	    py = gridHeight + 2.0;
+	  ix = (int) floor(px);
+	  iy = (int) floor(py);
+	  if (ix < bounds[0])
+	    bounds[0] = ix;
+	  if (iy < bounds[2])
+	    bounds[2] = iy;
+	  ix = (int) px;
+	  iy = (int) py;
+	  if (ix - 1 < bounds[0])
+	    bounds[0] = ix - 1;
+	  if (ix + 1 > bounds[1])
+	    bounds[1] = ix + 1;
+	  if (iy - 1 < bounds[2])
+	    bounds[2] = iy - 1;
+	  if (iy + 1 > bounds[3])
+	    bounds[3] = iy + 1;
+	}
+    }
+  if (bounds[0] < 0)
+    bounds[0] = 0;
+  if (bounds[1] >= gridWidth)
+    bounds[1] = gridWidth - 1;
+  if (bounds[2] < 0)
+    bounds[2] = 0;
+  if (bounds[3] >= gridHeight)
+    bounds[3] = gridHeight - 1;
+  tw = bounds[1] >= bounds[0] ? bounds[1] - bounds[0] + 1 : 0;
+  th = bounds[3] >= bounds[2] ? bounds[3] - bounds[2] + 1 : 0;
+  if (tw == 0 || th == 0)
+    {
+      tw = 0;
+      th = 0;
+      bounds[1] = bounds[0] - 1;
+      bounds[3] = bounds[2] - 1;
+    }
+
+  n = tw * th * 3;
+  grid = (unsigned char *) malloc(n + 1);
+  combinedGrid = (p == 0) ?
+    (unsigned char *) malloc(gridWidth * gridHeight * 3) : NULL;
+  if (grid == NULL || (p == 0 && combinedGrid == NULL))
+    Error("Could not allocate grid image\n");
   memset(grid, 255, n);
 
   bMinX = -offsetX / scale / factor;
@@ -3943,41 +5267,18 @@ OutputGrid (char *name,
   if (label)
     {
       srand48(384983L);
-      for (i = 0; i <= myLastImage; ++i)
+      for (i = 0; i < nImages; ++i)
 	{
 	  hue = 6.0 * drand48();
-	  if (i < myFirstImage)
+	  if (images[i].owner != p)
 	    continue;
 	  hsv_to_rgb(&r, &g, &b, hue, 0.5, 1.0);
-	  nx = images[i].nx;
-	  ny = images[i].ny;
-	  node = images[i].nodes;
-	  avgX = 0.0;
-	  avgY = 0.0;
-	  count = 0;
-	  for (y = 0; y < ny; ++y)
-	    for (x = 0; x < nx; ++x, ++node)
-	      if (node->x < 0.5 * UNSPECIFIED)
-		{
-		  avgX += node->x;
-		  avgY += node->y;
-		  ++count;
-		}
-	  if (count == 0)
-	    continue;
-	  avgX = avgX * factor / count;
-	  avgY = avgY * factor / count;
-
 	  lbl = images[i].name;
 	  len = strlen(lbl);
-	  labelWidth = (int) floor(scale * (nx * factor * 0.2) / len + 0.5);
-	  labelHeight = (int) floor(labelWidth * 1.7 + 0.5);
-	  if (labelWidth < 5)
+	  if (!LabelBounds(i, level, scale, offsetX, offsetY,
+			   &labelMinX, &labelMaxX, &labelMinY, &labelMaxY,
+			   &labelWidth, &labelHeight))
 	    continue;
-	  labelMinX = ((int) floor(scale * avgX + offsetX + 0.5)) - len * labelWidth / 2;
-	  labelMaxX = ((int) floor(scale * avgX + offsetX + 0.5)) + (len * labelWidth + 1)/ 2;
-	  labelMinY = ((int) floor(scale * avgY + offsetY + 0.5)) - labelHeight / 2;
-	  labelMaxY = ((int) floor(scale * avgY + offsetY + 0.5)) + (labelHeight + 1) / 2;
 	  if (labelMinX >= gridWidth ||
 	      labelMaxX < 0 ||
 	      labelMinY >= gridHeight ||
@@ -3986,6 +5287,67 @@ OutputGrid (char *name,
 	  Log("label bounds for image %s: %d %d %d %d\n",
 	      lbl, labelMinX, labelMaxX, labelMinY, labelMaxY);
 
+	  /* the font pixels that each column and row of a character cell
+	     covers, and their weights, are the same for every character
+	     of the label, so find them once */
+	  colSpan = fontWidth / labelWidth + 3;
+	  rowSpan = fontHeight / labelHeight + 3;
+	  colN = (int *) malloc(labelWidth * sizeof(int));
+	  colIndex = (int *) malloc(labelWidth * colSpan * sizeof(int));
+	  colWeight = (float *) malloc(labelWidth * colSpan * sizeof(float));
+	  rowN = (int *) malloc(labelHeight * sizeof(int));
+	  rowIndex = (int *) malloc(labelHeight * rowSpan * sizeof(int));
+	  rowWeight = (float *) malloc(labelHeight * rowSpan * sizeof(float));
+	  if (colN == NULL || colIndex == NULL || colWeight == NULL ||
+	      rowN == NULL || rowIndex == NULL || rowWeight == NULL)
+	    Error("Could not allocate label weights\n");
+	  for (dx = 0; dx < labelWidth; ++dx)
+	    {
+	      sx = ((float) dx) / labelWidth * fontWidth;
+	      ex = ((float) (dx+1)) / labelWidth * fontWidth;
+	      isx = (int) floor(sx);
+	      iex = (int) floor(ex);
+	      if (iex >= fontWidth)
+		iex = fontWidth-1;
+	      n = 0;
+	      for (ix = isx; ix <= iex && n < colSpan; ++ix)
+		{
+		  wx = 1.0;
+		  if (ix == isx)
+		    wx -= sx - isx;
+		  if (ix == iex)
+		    wx -= iex + 1.0 - ex;
+		  if (wx == 0.0)
+		    continue;
+		  colIndex[dx * colSpan + n] = ix;
+		  colWeight[dx * colSpan + n] = wx;
+		  ++n;
+		}
+	      colN[dx] = n;
+	    }
+	  for (dy = 0; dy < labelHeight; ++dy)
+	    {
+	      sy = ((float) dy) / labelHeight * fontHeight;
+	      ey = ((float) (dy+1)) / labelHeight * fontHeight;
+	      isy = (int) floor(sy);
+	      iey = (int) floor(ey);
+	      n = 0;
+	      for (iy = isy; iy <= iey && n < rowSpan; ++iy)
+		{
+		  wy = 1.0;
+		  if (iy == isy)
+		    wy -= sy - isy;
+		  if (iy == iey)
+		    wy -= iey + 1.0 - ey;
+		  if (wy == 0.0)
+		    continue;
+		  rowIndex[dy * rowSpan + n] = iy;
+		  rowWeight[dy * rowSpan + n] = wy;
+		  ++n;
+		}
+	      rowN[dy] = n;
+	    }
+
 	  for (j = 0; j < len; ++j)
 	    {
 	      ci = lbl[j] - 32;
@@ -4000,39 +5362,22 @@ OutputGrid (char *name,
 		  y = labelMinY + dy;
 		  if (y < 0 || y >= gridHeight)
 		    continue;
-		  sy = ((float) dy) / labelHeight * fontHeight;
-		  ey = ((float) (dy+1)) / labelHeight * fontHeight;
-		  isy = (int) floor(sy);
-		  iey = (int) floor(ey);
 		  for (dx = 0; dx < labelWidth; ++dx)
 		    {
 		      x = charMinX + dx;
 		      if (x < 0 || x >= gridWidth)
 			continue;
-		      sx = ((float) dx) / labelWidth * fontWidth;
-		      ex = ((float) (dx+1)) / labelWidth * fontWidth;
-		      isx = (int) floor(sx);
-		      iex = (int) floor(ex);
-		      if (iex >= fontWidth)
-			iex = fontWidth-1;
 		      ws = 0.0;
 		      v = 0.0;
-		      for (iy = isy; iy <= iey; ++iy)
+		      for (iy = 0; iy < rowN[dy]; ++iy)
 			{
-			  wy = 1.0;
-			  if (iy == isy)
-			    wy -= sy - isy;
-			  if (iy == iey)
-			    wy -= iey + 1.0 - ey;
-			  for (ix = isx; ix <= iex; ++ix)
+			  wy = rowWeight[dy * rowSpan + iy];
+			  fRow = (ci * fontHeight + rowIndex[dy * rowSpan + iy]) * fontWidth;
+			  for (ix = 0; ix < colN[dx]; ++ix)
 			    {
-			      wx = 1.0;
-			      if (ix == isx)
-				wx -= sx - isx;
-			      if (ix == iex)
-				wx -= iex + 1.0 - ex;
+			      wx = colWeight[dx * colSpan + ix];
 			      ws += wx * wy;
-			      v += wx * wy * font[(ci * fontHeight + iy) * fontWidth + ix];
+			      v += wx * wy * font[fRow + colIndex[dx * colSpan + ix]];
 			    }
 			}
 		      if (ws == 0.0)
@@ -4043,24 +5388,31 @@ OutputGrid (char *name,
 			  irv = 255 - (((255 - r) * (255 - ilv)) >> 8);
 			  igv = 255 - (((255 - g) * (255 - ilv)) >> 8);
 			  ibv = 255 - (((255 - b) * (255 - ilv)) >> 8);
-			  if (irv < grid[3*(y * gridWidth + x)])
-			    grid[3*(y * gridWidth + x)] = irv;
-			  if (igv < grid[3*(y * gridWidth + x) + 1])
-			    grid[3*(y * gridWidth + x) + 1] = igv;
-			  if (ibv < grid[3*(y * gridWidth + x) + 2])
-			    grid[3*(y * gridWidth + x) + 2] = ibv;
+			  pos = 3 * ((y - bounds[2]) * tw + x - bounds[0]);
+			  if (irv < grid[pos])
+			    grid[pos] = irv;
+			  if (igv < grid[pos + 1])
+			    grid[pos + 1] = igv;
+			  if (ibv < grid[pos + 2])
+			    grid[pos + 2] = ibv;
 			}
 		    }
 		}
 	    }
+	  free(colN);
+	  free(colIndex);
+	  free(colWeight);
+	  free(rowN);
+	  free(rowIndex);
+	  free(rowWeight);
 	}
     }
 
   srand48(384983L);
-  for (i = 0; i <= myLastImage; ++i)
+  for (i = 0; i < nImages; ++i)
     {
       hue = 6.0 * drand48();
-      if (i < myFirstImage)
+      if (images[i].owner != p)
 	continue;
       hsv_to_rgb(&r, &g, &b, hue, 1.0, 1.0);
       if (focusDepth >= 0 && fIndex >= 0 &&
@@ -4131,11 +5483,11 @@ OutputGrid (char *name,
 #endif
 
 		    DrawLine(grid,
-			     scale * factor * node[y*nx+x].x + offsetX,
-			     scale * factor * node[y*nx+x].y + offsetY,
-			     scale * factor * node[yp*nx+xp].x + offsetX,
-			     scale * factor * node[yp*nx+xp].y + offsetY,
-			     gridWidth, gridHeight,
+			     scale * factor * node[y*nx+x].x + offsetX - bounds[0],
+			     scale * factor * node[y*nx+x].y + offsetY - bounds[2],
+			     scale * factor * node[yp*nx+xp].x + offsetX - bounds[0],
+			     scale * factor * node[yp*nx+xp].y + offsetY - bounds[2],
+			     tw, th,
 			     r, g, b);
 		  }
 	      }
@@ -4159,19 +5511,18 @@ OutputGrid (char *name,
 		      if (xp >= 0 && xp < gridWidth &&
 			  yp >= 0 && yp < gridHeight)
 			{
-			  grid[3*(yp * gridWidth + xp)] = 0;
-			  grid[3*(yp * gridWidth + xp) + 1] = 0;
-			  grid[3*(yp * gridWidth + xp) + 2] = 0;
+			  pos = 3 * ((yp - bounds[2]) * tw + xp - bounds[0]);
+			  grid[pos] = 0;
+			  grid[pos + 1] = 0;
+			  grid[pos + 2] = 0;
 			}
 		    }
 	      }
 	  }
     }
 
-  if ((code = MPI_Allreduce(grid, combinedGrid, n, MPI_UNSIGNED_CHAR,
-			    MPI_MIN, MPI_COMM_WORLD)) != MPI_SUCCESS)
-    Error("MPI_reduce of grid image failed: %d\n", code);
-  
+  CompositeGridTiles(combinedGrid, gridWidth, gridHeight, grid, bounds);
+
   if (p == 0)
     {
       if (!CreateDirectories(name))
@@ -4180,6 +5531,7 @@ OutputGrid (char *name,
       if (f == NULL)
 	Error("Could not open output grid file %s\n", name);
       fprintf(f, "P6\n%d %d\n%d\n", gridWidth, gridHeight, 255);
+      n = gridWidth * gridHeight * 3;
       if (fwrite(combinedGrid, sizeof(unsigned char), n, f) != n)
 	Error("Could not write to grid file %s\n", name);
       fclose(f);
@@ -4189,6 +5541,184 @@ OutputGrid (char *name,
   ++outputGridSequence;
 }
 
+/* LabelBounds sets the first and last columns and rows of the label
+   OutputGrid paints at the center of image i, and the size of each of
+   its characters; it returns 0 if the image has no label */
+int
+LabelBounds (int i, int level, float scale, float offsetX, float offsetY,
+	     int *pMinX, int *pMaxX, int *pMinY, int *pMaxY,
+	     int *pLabelWidth, int *pLabelHeight)
+{
+  int x, y;
+  int nx, ny;
+  int factor;
+  int len;
+  int labelWidth, labelHeight;
+  int count;
+  float avgX, avgY;
+  Node *node;
+
+  factor = 1 << level;
+  nx = images[i].nx;
+  ny = images[i].ny;
+  node = images[i].nodes;
+  avgX = 0.0;
+  avgY = 0.0;
+  count = 0;
+  for (y = 0; y < ny; ++y)
+    for (x = 0; x < nx; ++x, ++node)
+      if (node->x < 0.5 * UNSPECIFIED)
+	{
+	  avgX += node->x;
+	  avgY += node->y;
+	  ++count;
+	}
+  if (count == 0)
+    return(0);
+  avgX = avgX * factor / count;
+  avgY = avgY * factor / count;
+
+  len = strlen(images[i].name);
+  labelWidth = (int) floor(scale * (nx * factor * 0.2) / len + 0.5);
+  labelHeight = (int) floor(labelWidth * 1.7 + 0.5);
+  if (labelWidth < 5)
+    return(0);
+  *pMinX = ((int) floor(scale * avgX + offsetX + 0.5)) - len * labelWidth / 2;
+  *pMaxX = ((int) floor(scale * avgX + offsetX + 0.5)) + (len * labelWidth + 1)/ 2;
+  *pMinY = ((int) floor(scale * avgY + offsetY + 0.5)) - labelHeight / 2;
+  *pMaxY = ((int) floor(scale * avgY + offsetY + 0.5)) + (labelHeight + 1) / 2;
+  *pLabelWidth = labelWidth;
+  *pLabelHeight = labelHeight;
+  return(1);
+}
+
+/* CompositeGridTiles combines the tiles drawn by OutputGrid, each
+   given by its bounds (first and last column, first and last row), into
+   combinedGrid on process 0, keeping the darker of overlapping pixels.
+   When the tiles together cover less than the grid they are sent to
+   process 0; otherwise the grid is reduced a band of rows at a time,
+   each process filling its bands from its tile.  Either way messages
+   are kept to about GRID_REDUCE_BYTES. */
+void
+CompositeGridTiles (unsigned char *combinedGrid,
+		    int gridWidth, int gridHeight,
+		    unsigned char *tile, int *bounds)
+{
+  int x, y;
+  int op;
+  int tw, th;
+  int y0, rows;
+  int rowsPerBand;
+  int code;
+  int *allBounds;
+  int *b;
+  double area;
+  unsigned char *band;
+  unsigned char *t, *c;
+
+  allBounds = (int *) malloc(4 * np * sizeof(int));
+  if (MPI_Allgather(bounds, 4, MPI_INT, allBounds, 4, MPI_INT,
+		    MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not gather grid tile bounds\n");
+  area = 0.0;
+  for (op = 0; op < np; ++op)
+    {
+      b = &allBounds[4*op];
+      if (b[1] >= b[0] && b[3] >= b[2])
+	area += (double) (b[1] - b[0] + 1) * (b[3] - b[2] + 1);
+    }
+  tw = bounds[1] - bounds[0] + 1;
+  th = bounds[3] - bounds[2] + 1;
+
+  if (area > (double) gridWidth * gridHeight)
+    {
+      rowsPerBand = GRID_REDUCE_BYTES / (3 * gridWidth);
+      if (rowsPerBand < 1)
+	rowsPerBand = 1;
+      band = (unsigned char *) malloc(3 * rowsPerBand * gridWidth);
+      for (y0 = 0; y0 < gridHeight; y0 += rowsPerBand)
+	{
+	  rows = (gridHeight - y0 < rowsPerBand) ? gridHeight - y0 :
+	    rowsPerBand;
+	  memset(band, 255, 3 * rows * gridWidth);
+	  if (tw > 0)
+	    for (y = 0; y < rows; ++y)
+	      if (y0 + y >= bounds[2] && y0 + y <= bounds[3])
+		memcpy(&band[3 * (y * gridWidth + bounds[0])],
+		       &tile[3 * (y0 + y - bounds[2]) * tw],
+		       3 * tw);
+	  if ((code = MPI_Reduce(band,
+				 (p == 0) ?
+				 &combinedGrid[3 * y0 * gridWidth] : NULL,
+				 3 * rows * gridWidth, MPI_UNSIGNED_CHAR,
+				 MPI_MIN, 0, MPI_COMM_WORLD)) != MPI_SUCCESS)
+	    Error("MPI_reduce of grid image failed: %d\n", code);
+	}
+      free(band);
+      free(allBounds);
+      return;
+    }
+
+  if (p != 0)
+    {
+      rowsPerBand = (tw > 0) ? GRID_REDUCE_BYTES / (3 * tw) : 1;
+      if (rowsPerBand < 1)
+	rowsPerBand = 1;
+      for (y0 = 0; y0 < th; y0 += rowsPerBand)
+	{
+	  rows = (th - y0 < rowsPerBand) ? th - y0 : rowsPerBand;
+	  if (MPI_Send(&tile[3 * y0 * tw], 3 * rows * tw, MPI_UNSIGNED_CHAR,
+		       0, GRID_TILE_TAG, MPI_COMM_WORLD) != MPI_SUCCESS)
+	    Error("Could not send grid tile\n");
+	}
+      free(allBounds);
+      return;
+    }
+
+  memset(combinedGrid, 255, 3 * gridWidth * gridHeight);
+  band = NULL;
+  for (op = 0; op < np; ++op)
+    {
+      b = &allBounds[4*op];
+      tw = b[1] - b[0] + 1;
+      th = b[3] - b[2] + 1;
+      if (tw <= 0 || th <= 0)
+	continue;
+      rowsPerBand = GRID_REDUCE_BYTES / (3 * tw);
+      if (rowsPerBand < 1)
+	rowsPerBand = 1;
+      if (op != 0)
+	band = (unsigned char *) realloc(band, 3 * rowsPerBand * tw);
+      for (y0 = 0; y0 < th; y0 += rowsPerBand)
+	{
+	  rows = (th - y0 < rowsPerBand) ? th - y0 : rowsPerBand;
+	  if (op == 0)
+	    t = &tile[3 * y0 * tw];
+	  else
+	    {
+	      if (MPI_Recv(band, 3 * rows * tw, MPI_UNSIGNED_CHAR, op,
+			   GRID_TILE_TAG, MPI_COMM_WORLD,
+			   MPI_STATUS_IGNORE) != MPI_SUCCESS)
+		Error("Could not receive grid tile from process %d\n", op);
+	      t = band;
+	    }
+	  for (y = 0; y < rows; ++y, t += 3 * tw)
+	    {
+	      c = &combinedGrid[3 * ((b[2] + y0 + y) * gridWidth + b[0])];
+	      /* the combined grid is still blank where the first tile
+		 goes, so that one is just copied */
+	      if (op == 0)
+		memcpy(c, t, 3 * tw);
+	      else
+		for (x = 0; x < 3 * tw; ++x)
+		  c[x] = (t[x] < c[x]) ? t[x] : c[x];
+	    }
+	}
+    }
+  free(band);
+  free(allBounds);
+}
+
 void
 OutputSprings (char *name,
 	       int step, int iter,
@@ -4263,7 +5793,7 @@ OutputSprings (char *name,
   bMinY = -offsetY / scale / factor;
   bMaxY = (outHeight - offsetY) / scale / factor;
 
-  for (i = myFirstImage; i <= myLastImage; ++i)
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
       memset(out, 255, n);
 
@@ -4499,6 +6029,116 @@ OutputSprings (char *name,
   free(out);
 }
 
+/* OutputStats appends a line for each unfixed image owned by this
+   process to its statistics file: the number of nodes, the largest
+   and root-mean-square forces on them, and the energy of the image's
+   own springs and of half of each map it is in; with -heat_maps, the
+   magnitude of the force on each node is also written as a pixel of
+   an image, scaled so that the largest force on any image is 255 */
+void
+OutputStats (int step, int iter, int level)
+{
+  int i, k;
+  int n;
+  int nNodes;
+  Node *node;
+  double *interEnergy;
+  float force;
+  float maxF;
+  float sumF2;
+  float localMaxF, globalF;
+  unsigned char *heat;
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+
+  if (statsFile == NULL)
+    {
+      sprintf(fn, "%sstats.%d.csv", outputStatsName, p);
+      if (!CreateDirectories(fn))
+	Error("Could not create directories for %s\n", fn);
+      statsFile = fopen(fn, "w");
+      if (statsFile == NULL)
+	Error("Could not open statistics file %s\n", fn);
+      fprintf(statsFile, "step,iter,image,nodes,max_force,rms_force,intra_energy,inter_energy\n");
+    }
+
+  interEnergy = (double *) malloc(nImages * sizeof(double));
+  if (interEnergy == NULL)
+    Error("Could not allocate energy table.\n");
+  memset(interEnergy, 0, nImages * sizeof(double));
+  for (i = 0; i < nMaps; ++i)
+    {
+      interEnergy[maps[i].image0] += 0.5 * maps[i].energy;
+      interEnergy[maps[i].image1] += 0.5 * maps[i].energy;
+    }
+
+  localMaxF = 0.0;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      if (images[i].fixed || images[i].settled)
+	continue;
+      nNodes = images[i].nx * images[i].ny;
+      node = images[i].nodes;
+      n = 0;
+      maxF = 0.0;
+      sumF2 = 0.0;
+      for (k = 0; k < nNodes; ++k, ++node)
+	{
+	  if (node->x > 0.5 * UNSPECIFIED)
+	    continue;
+	  force = hypot(node->fx < 0.5 * CONSTRAINED ? node->fx : 0.0,
+			node->fy < 0.5 * CONSTRAINED ? node->fy : 0.0);
+	  if (force > maxF)
+	    maxF = force;
+	  sumF2 += force * force;
+	  ++n;
+	}
+      if (maxF > localMaxF)
+	localMaxF = maxF;
+      fprintf(statsFile, "%d,%d,%s,%d,%g,%g,%g,%g\n",
+	      step, iter, images[i].name, n, maxF,
+	      n > 0 ? sqrt(sumF2 / n) : 0.0,
+	      images[i].energy, interEnergy[i]);
+    }
+  fflush(statsFile);
+  free(interEnergy);
+
+  if (!outputHeatMaps)
+    return;
+  if (MPI_Allreduce(&localMaxF, &globalF, 1, MPI_FLOAT, MPI_MAX,
+		    MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not find global maximum force for heat maps\n");
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      if (images[i].fixed || images[i].settled)
+	continue;
+      nNodes = images[i].nx * images[i].ny;
+      heat = (unsigned char *) malloc(nNodes);
+      if (heat == NULL)
+	Error("Could not allocate heat map.\n");
+      node = images[i].nodes;
+      for (k = 0; k < nNodes; ++k, ++node)
+	{
+	  if (node->x > 0.5 * UNSPECIFIED || globalF == 0.0)
+	    {
+	      heat[k] = 0;
+	      continue;
+	    }
+	  force = hypot(node->fx < 0.5 * CONSTRAINED ? node->fx : 0.0,
+			node->fy < 0.5 * CONSTRAINED ? node->fy : 0.0);
+	  heat[k] = (unsigned char) (255.0 * force / globalF + 0.5);
+	}
+      sprintf(fn, "%s%s.s%.2d.i%.6d.pgm",
+	      outputStatsName, images[i].name, step, iter);
+      if (!CreateDirectories(fn))
+	Error("Could not create directories for %s\n", fn);
+      if (!WriteImage(fn, heat, images[i].nx, images[i].ny,
+		      UncompressedImage, msg))
+	Error("Could not write heat map %s:\n%s\n", fn, msg);
+      free(heat);
+    }
+}
+
 void OutputFoldMaps (int level, int iter)
 {
   int i, j, k, q, r;
@@ -4543,7 +6183,7 @@ void OutputFoldMaps (int level, int iter)
   xMax = foldAbsoluteX + 8.0;
   yMin = foldAbsoluteY - 8.0;
   yMax = foldAbsoluteY + 8.0;
-  for (i = myFirstImage; i <= myLastImage; ++i)
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
       /* only output images within a given distance of fold */
       if (abs(i - foldImage) > 3)
@@ -4910,6 +6550,9 @@ DrawLine(unsigned char *img, float px0, float py0, float px1, float py1,
   int yStep;
   int x, y;
   int dx, dy;
+  int xEnd;
+  int majorSize, minorSize;
+  long long t, m;
   float dist;
   float hue;
   unsigned char *p;
@@ -4949,8 +6592,29 @@ DrawLine(unsigned char *img, float px0, float py0, float px1, float py1,
     yStep = 1;
   else
     yStep = -1;
-  for (x = x0; x <= x1; ++x)
+
+  /* only the part of the line over the image is walked; the walk
+     starts at its first column there with the y and error that
+     stepping to it would have reached */
+  majorSize = steep ? imageHeight : imageWidth;
+  minorSize = steep ? imageWidth : imageHeight;
+  if (x1 < 0 || x0 >= majorSize ||
+      (y0 < 0 && y1 < 0) || (y0 >= minorSize && y1 >= minorSize))
+    return;
+  xEnd = (x1 < majorSize) ? x1 : majorSize - 1;
+  x = x0;
+  if (x < 0)
     {
+      t = error + (long long) (-x) * dy;
+      m = (t > 0) ? (t + dx - 1) / dx : 0;
+      y += (int) m * yStep;
+      error = (int) (t - m * dx);
+      x = 0;
+    }
+  for (; x <= xEnd; ++x)
+    {
+      if (yStep > 0 ? y >= minorSize : y < 0)
+	break;
       if (steep)
 	{
 	  if (y >= 0 && y < imageWidth &&
@@ -4982,611 +6646,4062 @@ DrawLine(unsigned char *img, float px0, float py0, float px1, float py1,
     }
 }
 
+/* ImageForces sets the forces on the nodes of image i to the absolute
+   location forces (or zero), then adds in the intra-image spring forces;
+   the energy of those springs is added to *pEnergy */
 void
-UpdateDeltas (int level, int iter)
+ImageForces (int i, int level, double *pEnergy)
 {
-  InterImageMap *m;
-  int i, j, k;
-  int x, y;
-  float rrx, rry;
-  Node *nodes1;
-  float rx00, rx01, rx10, rx11;
-  float ry00, ry01, ry10, ry11;
-  float rx, ry;
+  int x, y, k;
   int nx, ny;
-  int irx, iry;
-  int ix, iy;
-  int nx1, ny1;
-  InterImageSpring *s;
-  InterImageStrip *strip;
+  Node *node;
+  Node *nodes;
+  Point *absPos;
   float deltaX, deltaY;
-  int springsPos;
-  int ns;
-  int nStrips;
-  InterImageStrip *strips;
-  InterImageSpring *springs;
-  int dx, dy;
   float d;
-  float w, tw;
-  float trx, try;
-  int irxp, iryp;
-  float rrxp, rryp;
+  float force;
+  float forceOverD;
+  float dfx, dfy;
+  float sk;
+  float kIntraThisImage;
+  double energy;
+  IntraImageMap *iim;
+  IntraImageSpring *iis;
+  int nSprings;
+  IntraImageSpring *iSprings;
+  double start;
+
+  start = 0.0;
+  if (rebalanceThreshold > 0.0)
+    start = MPI_Wtime();
+  energy = *pEnergy;
+  nx = images[i].nx;
+  ny = images[i].ny;
+#if PDEBUG
+  poix = (int) floor(poixv / factor + 0.5);
+  poiy = (int) floor(poiyv / factor + 0.5);
+#endif
+  if (images[i].absolutePositions != NULL)
+    {
+      /* compute absolute location forces */
+      node = images[i].nodes;
+      absPos = images[i].absolutePositions[startLevel - level];
+      for (y = 0; y < ny; ++y)
+	for (x = 0; x < nx; ++x, ++node, ++absPos)
+	  {
+	    if (node->x > 0.5 * UNSPECIFIED)
+	      continue;
+	    if (absPos->x < 0.5 * UNSPECIFIED)
+	      deltaX = absPos->x - node->x;
+	    else
+	      deltaX = 0.0;
+	    if (absPos->y < 0.5 * UNSPECIFIED)
+	      deltaY = absPos->y - node->y;
+	    else
+	      deltaY = 0;
+	    if (node->fx < 0.5 * CONSTRAINED)
+	      node->fx = kAbsolute * deltaX;
+	    if (node->fy < 0.5 * CONSTRAINED)
+	      node->fy = kAbsolute * deltaY;
+	    energy += kAbsolute * (deltaX * deltaX + deltaY * deltaY);
+	    if (isinf(energy) || isnan(energy))
+	      abort();
+	    //                      if (x == 0 && y == 0)
+	    //                        Log("ENERGY COMP %f %f %f %f %f %f %f %f\n",
+	    //                            kAbsolute, deltaX, deltaY, absPos->x, absPos->y,
+	    //                            node->x, node->y, energy);
+	  }
+    }
+  else
+    {
+      /* zero all forces */
+      node = images[i].nodes;
+      for (y = 0; y < ny; ++y)
+	for (x = 0; x < nx; ++x, ++node)
+	  {
+	    if (node->fx < 0.5 * CONSTRAINED)
+	      node->fx = 0.0;
+	    if (node->fy < 0.5 * CONSTRAINED)
+	      node->fy = 0.0;
+	  }
+    }
 
-  for (i = 0; i < nMaps; ++i)
+  /* the intra-image springs of an image frozen by -update
+     or settled would only add a constant to the energy */
+  if ((updateName[0] != '\0' && images[i].fixed) || images[i].settled)
     {
-      m = &maps[i];
-      nx1 = images[m->image1].nx;
-      ny1 = images[m->image1].ny;
-      nodes1 = images[m->image1].nodes;
+      images[i].energy = energy - *pEnergy;
+      *pEnergy = energy;
+      if (rebalanceThreshold > 0.0)
+	images[i].cost += MPI_Wtime() - start;
+      return;
+    }
 
-      springsPos = 0;
-      nStrips = m->nStrips[startLevel - level];
-      strips = m->strips[startLevel - level];
-      springs = m->springs[startLevel - level];
-      for (j = 0; j < nStrips; ++j)
+  /* add in intra-section forces */
+  kIntraThisImage = kIntra * images[i].kFactor;
+  iim = images[i].map;
+  nodes = images[i].nodes;
+  nSprings = iim->nSprings[startLevel - level];
+  iSprings = iim->springs[startLevel - level];
+  for (k = 0; k < nSprings; ++k)
+    {
+      iis = &(iSprings[k]);
+      if (nodes[iis->index0].x > 0.5 * UNSPECIFIED ||
+	  nodes[iis->index1].x > 0.5 * UNSPECIFIED)
+	continue;
+      deltaX = nodes[iis->index1].x - nodes[iis->index0].x;
+      deltaY = nodes[iis->index1].y - nodes[iis->index0].y;
+      d = sqrt(deltaX * deltaX + deltaY * deltaY);
+      sk = kIntraThisImage * iis->k;
+      force = sk * (d - iis->nomD);
+      energy += force * (d - iis->nomD);
+      if (isinf(energy) || isnan(energy))
+	abort();
+      if (d != 0.0)
 	{
-	  strip = &(strips[j]);
-	  ns = strip->nSprings;
-	  x = strip->x0;
-	  y = strip->y0;
-	  ix = strip->x1;
-	  iy = strip->y1;
-	  for (k = 0; k < ns; ++k)
+	  forceOverD = force / d;
+	  dfx = forceOverD * deltaX;
+	  dfy = forceOverD * deltaY;
+	  nodes[iis->index0].fx += dfx;
+	  nodes[iis->index0].fy += dfy;
+	  nodes[iis->index1].fx -= dfx;
+	  nodes[iis->index1].fy -= dfy;
+	}
+#if DEBUG
+#if PDEBUG
+      if (i == ioi &&
+	  (iis->index0 % images[i].nx == poix &&
+	   iis->index0 / images[i].nx == poiy ||
+	   iis->index1 % images[i].nx == poix &&
+	   iis->index1 / images[i].nx == poiy))
+#endif
+	Log("intraforce: %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) dist %f nom %f force (%f %f)\n",
+	  i, iis->index0 % images[i].nx, iis->index0 / images[i].nx,
+	  i, iis->index1 % images[i].nx, iis->index1 / images[i].nx,
+	  nodes[iis->index0].x, nodes[iis->index0].y,
+	  nodes[iis->index1].x, nodes[iis->index1].y,
+	  d, iis->nomD,
+	  d != 0.0 ? dfx : 1000000000.0,
+	  d != 0.0 ? dfy : 1000000000.0);
+#endif
+    }
+  images[i].energy = energy - *pEnergy;
+  *pEnergy = energy;
+  if (rebalanceThreshold > 0.0)
+    images[i].cost += MPI_Wtime() - start;
+}
+
+/* MapForces adds the forces of the springs of inter-image map i to the
+   nodes of the two images, or, if f is not NULL, to the force buffer f
+   (laid out by forceOffset); the energy of those springs is added to
+   *pEnergy */
+void
+MapForces (int i, int level, double *pEnergy, float *f)
+{
+  int k;
+  int n;
+  int i0, i1;
+  int stride0, stride1;
+  int *index0, *index1;
+  float msk;
+  float sk;
+  float xv, yv;
+  float deltaX, deltaY;
+  float kdx, kdy;
+  float *offsetX, *offsetY, *weight;
+  float *f0, *f1;
+  short *dx, *dy;
+  unsigned char *kq;
+  int kEnd;
+  float oScale, kScale;
+  float e;
+  double energy;
+  double start;
+  InterImageMap *m;
+  Node *nodes0, *nodes1;
+
+  m = &maps[i];
+  m->energy = 0.0;
+  msk = kInter * m->k;
+  if (msk == 0.0 ||
+      (images[m->image0].settled && images[m->image1].settled))
+    return;
+  start = 0.0;
+  if (rebalanceThreshold > 0.0)
+    start = MPI_Wtime();
+  if (m->decodedLevel != level || m->decodedVersion != springsVersion)
+    DecodeSprings(m, level);
+  nodes0 = images[m->image0].nodes;
+  if (nodes0 == NULL)
+    abort();
+  nodes1 = images[m->image1].nodes;
+
+  /* the forces go either directly into the nodes or into
+     the (x, y) pairs of the thread's buffer */
+  if (f == NULL)
+    {
+      f0 = &(nodes0[0].fx);
+      f1 = &(nodes1[0].fx);
+      stride0 = stride1 = sizeof(Node) / sizeof(float);
+    }
+  else
+    {
+      f0 = &f[2 * forceOffset[m->image0]];
+      f1 = &f[2 * forceOffset[m->image1]];
+      stride0 = stride1 = 2;
+    }
+
+  n = m->nDecoded;
+  index0 = m->index0;
+  index1 = m->index1;
+  energy = 0.0;
+  if (compactSprings)
+    {
+      /* the same loop on the packed offsets and constants; the energy
+	 of each block is summed in float, and only the block sums in
+	 double */
+      dx = m->dx;
+      dy = m->dy;
+      kq = m->kq;
+      oScale = 0.00005;
+      kScale = msk / 255.0;
+      for (k = 0; k < n; k = kEnd)
+	{
+	  kEnd = k + COMPACT_BLOCK < n ? k + COMPACT_BLOCK : n;
+	  e = 0.0;
+	  for (; k < kEnd; ++k)
 	    {
-	      s = &(springs[springsPos++]);
-	      ix += ((s->dxy1) >> 4) - 8;
-	      iy += ((s->dxy1) & 0xf) - 8;
-	      rrx = s->irrx / 20000.0;
-	      rry = s->irry / 20000.0;
-	      irx = ix;
-	      iry = iy;
-	      if (rrx < 0.0)
-		{
-		  --irx;
-		  rrx += 1.0;
-		}
-	      if (rry < 0.0)
-		{
-		  --iry;
-		  rry += 1.0;
-		}
-	      if (irx >= 0 && irx < nx1-1 &&
-		  iry >= 0 && iry < ny1-1 &&
-		  (rx00 = nodes1[iry*nx1 + irx].x) <= 0.5 * UNSPECIFIED &&
-		  (rx01 = nodes1[(iry+1)*nx1+irx].x) <= 0.5 * UNSPECIFIED &&
-		  (rx10 = nodes1[iry*nx1 + irx+1].x) <= 0.5 * UNSPECIFIED &&
-		  (rx11 = nodes1[(iry+1)*nx1+irx+1].x) <= 0.5 * UNSPECIFIED)
-		{
-		  rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-		    - rx10 * rrx * (rry - 1.0) 
-		    - rx01 * (rrx - 1.0) * rry
-		    + rx11 * rrx * rry;
-		  ry00 = nodes1[iry*nx1 + irx].y;
-		  ry01 = nodes1[(iry+1)*nx1+irx].y;
-		  ry10 = nodes1[iry*nx1 + irx+1].y;
-		  ry11 = nodes1[(iry+1)*nx1+irx+1].y;
-		  ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-		    - ry10 * rrx * (rry - 1.0) 
-		    - ry01 * (rrx - 1.0) * rry
-		    + ry11 * rrx * rry;
-		}
-	      else
-		{
-		  // need to extrapolate
-		  tw = 0.0;
-		  trx = 0.0;
-		  try = 0.0;
-		  for (dy = -1; dy <= 1; ++dy)
-		    {
-		      iryp = iry + dy;
-		      if (iryp < 0 || iryp >= ny1-1)
-			continue;
-		      rryp = rry - dy;
-		      for (dx = -1; dx <= 1; ++dx)
-			{
-			  if (dx == 0 && dy == 0)
-			    continue;
-			  irxp = irx + dx;
-			  if (irxp < 0 || irxp >= nx1-1)
-			    continue;
-			  rrxp = rrx - dx;
-			  rx00 = nodes1[iryp*nx1 + irxp].x;
-			  rx01 = nodes1[(iryp+1)*nx1+irxp].x;
-			  rx10 = nodes1[iryp*nx1 + irxp+1].x;
-			  rx11 = nodes1[(iryp+1)*nx1+irxp+1].x;
-			  ry00 = nodes1[iryp*nx1 + irxp].y;
-			  ry01 = nodes1[(iryp+1)*nx1+irxp].y;
-			  ry10 = nodes1[iryp*nx1 + irxp+1].y;
-			  ry11 = nodes1[(iryp+1)*nx1+irxp+1].y;
-			  if (rx00 > 0.5 * UNSPECIFIED ||
-			      rx01 > 0.5 * UNSPECIFIED ||
-			      rx10 > 0.5 * UNSPECIFIED ||
-			      rx11 > 0.5 * UNSPECIFIED)
-			    continue;
-			  rx = rx00 * (rrxp - 1.0) * (rryp - 1.0)
-			    - rx10 * rrxp * (rryp - 1.0) 
-			    - rx01 * (rrxp - 1.0) * rryp
-			    + rx11 * rrxp * rryp;
-			  ry = ry00 * (rrxp - 1.0) * (rryp - 1.0)
-			    - ry10 * rrxp * (rryp - 1.0) 
-			    - ry01 * (rrxp - 1.0) * rryp
-			    + ry11 * rrxp * rryp;
-			  if (dy < 0)
-			    {
-			      if (dx < 0)
-				d = hypot(rrxp - 1.0, rryp - 1.0);
-			      else if (dx == 0)
-				d = rryp - 1.0;
-			      else
-				d = hypot(-rrxp, rryp - 1.0);
-			    }
-			  else if (dy == 0)
-			    {
-			      if (dx < 0)
-				d = rrxp - 1.0;
-			      else
-				d = -rrxp;
-			    }
-			  else
-			    {
-			      if (dx < 0)
-				d = hypot(rrxp - 1.0, -rryp);
-			      else if (dx == 0)
-				d = -rryp;
-			      else
-				d = hypot(-rrxp, -rryp);
-			    }
-			  if (d < 0.000001)
-			    w = 1000000.0;
-			  else
-			    w = 1.0 / d;
-			  trx += w * rx;
-			  try += w * ry;
-			  tw += w;
-		      }
-		    }
-		  if (tw == 0.0)
-		    {
-		      s->dx = 0;
-		      s->dy = 0;
-		      s->k = 0;
-		      continue;
-		    }
-		  rx = trx / tw;
-		  ry = try / tw;
-		}
-	      deltaX = 20000.0 * (rx - nodes1[iy*nx1+ix].x) + 0.5;
-	      deltaY = 20000.0 * (ry - nodes1[iy*nx1+ix].y) + 0.5;
-	      if (deltaX >= -32768.0 && deltaX < 32768.0 &&
-		  deltaY >= -32768.0 && deltaY < 32768.0)
-		{
-		  s->dx = (int) floor(deltaX);
-		  s->dy = (int) floor(deltaY);
-		}
-	      else
-		{
-		  s->dx = 0;
-		  s->dy = 0;
-		  s->k = 0;
-		}
+	      i0 = index0[k];
+	      i1 = index1[k];
+	      if (nodes0[i0].x > 0.5 * UNSPECIFIED ||
+		  nodes1[i1].x > 0.5 * UNSPECIFIED)
+		continue;
+	      deltaX = nodes1[i1].x + oScale * dx[k] - nodes0[i0].x;
+	      deltaY = nodes1[i1].y + oScale * dy[k] - nodes0[i0].y;
+	      sk = kScale * kq[k];
+	      kdx = sk * deltaX;
+	      kdy = sk * deltaY;
+	      f0[stride0 * i0] += kdx;
+	      f0[stride0 * i0 + 1] += kdy;
+	      f1[stride1 * i1] -= kdx;
+	      f1[stride1 * i1 + 1] -= kdy;
+	      e += sk * (deltaX * deltaX + deltaY * deltaY);
 	    }
+	  energy += e;
 	}
+      n = 0;
+    }
+  offsetX = m->offsetX;
+  offsetY = m->offsetY;
+  weight = m->weight;
+  for (k = 0; k < n; ++k)
+    {
+      i0 = index0[k];
+      i1 = index1[k];
+      if (nodes0[i0].x > 0.5 * UNSPECIFIED ||
+	  nodes1[i1].x > 0.5 * UNSPECIFIED)
+	continue;
+      xv = nodes1[i1].x + offsetX[k];
+      yv = nodes1[i1].y + offsetY[k];
+      deltaX = xv - nodes0[i0].x;
+      deltaY = yv - nodes0[i0].y;
+      sk = weight[k] * msk;
+      kdx = sk * deltaX;
+      kdy = sk * deltaY;
+      f0[stride0 * i0] += kdx;
+      f0[stride0 * i0 + 1] += kdy;
+      f1[stride1 * i1] -= kdx;
+      f1[stride1 * i1 + 1] -= kdy;
+      energy += sk * (deltaX * deltaX + deltaY * deltaY);
     }
+  if (isinf(energy) || isnan(energy))
+    abort();
+  m->energy = energy;
+  if (m->energyFactor != 0.0)
+    *pEnergy += energy;
+  if (rebalanceThreshold > 0.0)
+    m->cost += MPI_Wtime() - start;
 }
 
+/* DecodeSprings unpacks the strips and springs of map m at the given
+   level into the node index, offset, and weight arrays used by
+   MapForces, or with -compact_springs into the node index arrays and
+   the packed offsets and constants; springs with no strength are
+   left out */
 void
-RefinePositions (int prevLevel, int level)
+DecodeSprings (InterImageMap *m, int level)
 {
-  int i;
-  int factor1;
-  int nx, ny;
-  int nx1, ny1;
+  int j, k;
   int x, y;
-  float xv, yv;
-  int ixv, iyv;
-  float rrx, rry;
-  float rx00, rx01, rx10, rx11;
-  float ry00, ry01, ry10, ry11;
-  float rx, ry;
-  Node *nodes, *nodes1;
-  float dFactor;
-  int eFactor;
-  int rFactor;
-  unsigned char *imask;
-  int rnx, rny;
-  int imbpl;
-  int valid;
-  int ix, iy;
-  int count;
-  MapElement *initialMap;
-  int mLevel;
-  int mw, mh;
-  int mxMin, myMin;
-  double scale;
-  Node *node;
-  char imName0[PATH_MAX], imName1[PATH_MAX];
-  char msg[PATH_MAX+256];
+  int irx, iry;
+  int nx, nx1;
+  int ns;
+  int nStrips;
+  int nSprings;
+  int springsPos;
+  InterImageStrip *strip;
+  InterImageStrip *strips;
+  InterImageSpring *s;
+  InterImageSpring *springs;
+
+  nStrips = m->nStrips[startLevel - level];
+  nSprings = m->nSprings[startLevel - level];
+  strips = m->strips[startLevel - level];
+  springs = m->springs[startLevel - level];
+  if (nSprings > m->decodedSize)
+    {
+      m->index0 = (int *) realloc(m->index0, nSprings * sizeof(int));
+      m->index1 = (int *) realloc(m->index1, nSprings * sizeof(int));
+      if (compactSprings)
+	{
+	  m->dx = (short *) realloc(m->dx, nSprings * sizeof(short));
+	  m->dy = (short *) realloc(m->dy, nSprings * sizeof(short));
+	  m->kq = (unsigned char *) realloc(m->kq, nSprings);
+	  if (m->dx == NULL || m->dy == NULL || m->kq == NULL)
+	    Error("Could not allocate decoded springs for map %s\n", m->name);
+	}
+      else
+	{
+	  m->offsetX = (float *) realloc(m->offsetX, nSprings * sizeof(float));
+	  m->offsetY = (float *) realloc(m->offsetY, nSprings * sizeof(float));
+	  m->weight = (float *) realloc(m->weight, nSprings * sizeof(float));
+	  if (m->offsetX == NULL || m->offsetY == NULL || m->weight == NULL)
+	    Error("Could not allocate decoded springs for map %s\n", m->name);
+	}
+      if (m->index0 == NULL || m->index1 == NULL)
+	Error("Could not allocate decoded springs for map %s\n", m->name);
+      m->decodedSize = nSprings;
+    }
+  nx = images[m->image0].nx;
+  nx1 = images[m->image1].nx;
+  m->nDecoded = 0;
+  springsPos = 0;
+  for (j = 0; j < nStrips; ++j)
+    {
+      strip = &(strips[j]);
+      ns = strip->nSprings;
+      x = strip->x0;
+      y = strip->y0;
+      irx = strip->x1;
+      iry = strip->y1;
+      for (k = 0; k < ns; ++k, ++x)
+	{
+	  s = &(springs[springsPos++]);
+	  irx += ((s->dxy1) >> 4) - 8;
+	  iry += ((s->dxy1) & 0xf) - 8;
+	  if (s->k == 0)
+	    continue;
+	  m->index0[m->nDecoded] = y * nx + x;
+	  m->index1[m->nDecoded] = iry * nx1 + irx;
+	  if (compactSprings)
+	    {
+	      m->dx[m->nDecoded] = s->dx;
+	      m->dy[m->nDecoded] = s->dy;
+	      m->kq[m->nDecoded] = s->k;
+	    }
+	  else
+	    {
+	      m->offsetX[m->nDecoded] = 0.00005 * s->dx;
+	      m->offsetY[m->nDecoded] = 0.00005 * s->dy;
+	      m->weight[m->nDecoded] = s->k / 255.0;
+	    }
+	  ++m->nDecoded;
+	}
+    }
+  m->decodedLevel = level;
+  m->decodedVersion = springsVersion;
+}
+
+/* WriteCheckpoint saves the state of the relaxation at the top of an
+   iteration: the scalar state in cs, the owner of every image (which
+   -rebalance may have changed), the nodes of the images this process
+   owns, and the current deltas of its inter-image springs.  Each process
+   writes its own file, and the files only replace the previous checkpoint
+   once every process has finished writing. */
+void
+WriteCheckpoint (CheckpointState *cs, int level)
+{
   char fn[PATH_MAX];
-  Point *initialPos;
+  char tmpFn[PATH_MAX];
+  FILE *f;
+  int i;
+  int n;
+  int ok;
+
+  /* a reduction still in progress is completed now, but is
+     left pending for the iteration that expects it */
+  if (reducePending &&
+      MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+    Error("Could not complete reduction of force and energy\n");
+  cs->reducePending = reducePending;
+  cs->reduceOut[0] = reduceOut[0];
+  cs->reduceOut[1] = reduceOut[1];
+  cs->foldRecoveryCount = foldRecoveryCount;
+
+  sprintf(fn, "%s.%d", checkpointName, p);
+  sprintf(tmpFn, "%s.tmp", fn);
+  f = fopen(tmpFn, "w");
+  if (f == NULL)
+    Error("Could not open checkpoint file %s for writing\n", tmpFn);
+  ok = fprintf(f, "C2 %d %d %d %d %d\n", np, p, nImages,
+	       nMyImages, nMaps) > 0;
+  ok = ok && fwrite(cs, sizeof(CheckpointState), 1, f) == 1;
+  for (i = 0; ok && i < nImages; ++i)
+    ok = fwrite(&(images[i].owner), sizeof(int), 1, f) == 1;
+  for (i = myFirstImage; ok && i >= 0; i = images[i].nextOwned)
+    {
+      n = images[i].nx * images[i].ny;
+      ok = fwrite(images[i].nodes, sizeof(Node), n, f) == n;
+      if (ok && foldRecovery > 0)
+	ok = fwrite(images[i].initialNodes, sizeof(Node), n, f) == n;
+      if (ok && momentum > 0.0)
+	ok = fwrite(images[i].velocity, sizeof(Point), n, f) == n;
+    }
+  for (i = 0; ok && i < nMaps; ++i)
+    {
+      n = maps[i].nSprings[startLevel - level];
+      ok = fwrite(maps[i].springs[startLevel - level],
+		  sizeof(InterImageSpring), n, f) == n;
+    }
+  if (fclose(f) != 0 || !ok)
+    Error("Could not write checkpoint file %s\n", tmpFn);
 
-  factor1 = 1 << level;
-  dFactor = 1 << (prevLevel - level);
-  eFactor = 1 << endLevel;
-  rFactor = factor1 / eFactor;
+  if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("MPI_Barrier after checkpoint failed.\n");
+  if (rename(tmpFn, fn) != 0)
+    Error("Could not rename checkpoint file %s to %s\n", tmpFn, fn);
+  Log("Wrote checkpoint for step %d iteration %d\n", cs->step, cs->iter);
+}
+
+/* OpenCheckpoint reads the scalar state from this process's checkpoint
+   file and checks that every process is resuming at the same point;
+   the images are first given to the owners they had when the
+   checkpoint was written.  The rest of the file is read by
+   RestoreCheckpoint once the nodes have been brought to the
+   checkpoint's level. */
+void
+OpenCheckpoint (CheckpointState *cs)
+{
+  char fn[PATH_MAX];
+  int i;
+  int cNp, cP, cImages, cMyImages, cMaps;
+  int where[2], lowest[2], highest[2];
+  int same;
+  int *owners, *owners0;
+
+  sprintf(fn, "%s.%d", checkpointName, p);
+  checkpointFile = fopen(fn, "r");
+  if (checkpointFile == NULL)
+    Error("Could not open checkpoint file %s for reading\n", fn);
+  if (fscanf(checkpointFile, "C2 %d %d %d %d %d", &cNp, &cP,
+	     &cImages, &cMyImages, &cMaps) != 5 ||
+      fgetc(checkpointFile) != '\n' ||
+      fread(cs, sizeof(CheckpointState), 1, checkpointFile) != 1)
+    Error("Checkpoint file %s is malformed\n", fn);
+  if (cNp != np || cP != p || cImages != nImages)
+    Error("Checkpoint file %s was written by a different configuration (%d processes, %d images)\n",
+	  fn, cNp, cImages);
+  owners = (int *) malloc(nImages * sizeof(int));
+  owners0 = (int *) malloc(nImages * sizeof(int));
+  if (fread(owners, sizeof(int), nImages, checkpointFile) != nImages)
+    Error("Checkpoint file %s is malformed\n", fn);
   for (i = 0; i < nImages; ++i)
+    if (owners[i] < 0 || owners[i] >= np)
+      Error("Checkpoint file %s gives image %s to process %d\n",
+	    fn, images[i].name, owners[i]);
+  memcpy(owners0, owners, nImages * sizeof(int));
+  if (MPI_Bcast(owners0, nImages, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Broadcast of image owners failed.\n");
+  same = memcmp(owners, owners0, nImages * sizeof(int)) == 0;
+  if (MPI_Allreduce(MPI_IN_PLACE, &same, 1, MPI_INT, MPI_MIN,
+		    MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not compare checkpoints of the processes\n");
+  if (!same)
+    Error("The checkpoint files do not agree on the owners of the images.\n");
+  MigrateImages(owners, startLevel);
+  free(owners);
+  free(owners0);
+  if (cMyImages != nMyImages || cMaps != nMaps)
+    Error("Checkpoint file %s was written by a different configuration (%d processes, %d images, %d maps)\n",
+	  fn, cNp, cMyImages, cMaps);
+
+  where[0] = cs->step;
+  where[1] = cs->iter;
+  if (MPI_Allreduce(where, lowest, 2, MPI_INT, MPI_MIN,
+		    MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Allreduce(where, highest, 2, MPI_INT, MPI_MAX,
+		    MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not compare checkpoints of the processes\n");
+  if (lowest[0] != highest[0] || lowest[1] != highest[1])
+    Error("The checkpoint files do not all stop at the same iteration.\n");
+  if (cs->step < 0 || cs->step >= nSteps)
+    Error("Checkpoint file %s names step %d but the schedule has %d steps\n",
+	  fn, cs->step, nSteps);
+
+  reducePending = cs->reducePending;
+  reduceRequest = MPI_REQUEST_NULL;
+  reduceOut[0] = cs->reduceOut[0];
+  reduceOut[1] = cs->reduceOut[1];
+  foldRecoveryCount = cs->foldRecoveryCount;
+  Log("Restarting from checkpoint %s at step %d iteration %d\n",
+      fn, cs->step, cs->iter);
+}
+
+void
+RestoreCheckpoint (int level)
+{
+  int i;
+  int n;
+
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
-      if (images[i].owner != p && !images[i].needed)
-	continue;
-      nx = images[i].nx;
-      ny = images[i].ny;
-      nx1 = (images[i].width + factor1 - 1) / factor1 + 1;
-      ny1 = (images[i].height + factor1 - 1) / factor1 + 1;
-      images[i].nx = nx1;
-      images[i].ny = ny1;
-      nodes = images[i].nodes;
-      nodes1 = (Node*) malloc(nx1 * ny1 * sizeof(Node));
-      images[i].nodes = nodes1;
-      if (images[i].owner != p)
+      n = images[i].nx * images[i].ny;
+      if (fread(images[i].nodes, sizeof(Node), n, checkpointFile) != n ||
+	  (foldRecovery > 0 &&
+	   fread(images[i].initialNodes, sizeof(Node), n,
+		 checkpointFile) != n) ||
+	  (momentum > 0.0 &&
+	   fread(images[i].velocity, sizeof(Point), n,
+		 checkpointFile) != n))
+	Error("Could not read nodes of image %s from checkpoint\n",
+	      images[i].name);
+    }
+  for (i = 0; i < nMaps; ++i)
+    {
+      n = maps[i].nSprings[startLevel - level];
+      if (fread(maps[i].springs[startLevel - level],
+		sizeof(InterImageSpring), n, checkpointFile) != n)
+	Error("Could not read springs of map %s from checkpoint\n",
+	      maps[i].name);
+    }
+  ++springsVersion;
+  fclose(checkpointFile);
+  checkpointFile = NULL;
+}
+
+/* SelectUpdatedImages finds the maps that are newer than the previous
+   output maps of the images they connect, and sets frozen[i] for every
+   image that is more than updateRadius maps away from all of them;
+   an image without a previous output map counts as changed */
+void
+SelectUpdatedImages (char *mapNames, int *frozen)
+{
+  int i, k;
+  int d;
+  int pos;
+  int nChanged, nRelaxed;
+  int *i0, *i1;
+  int *dist;
+  time_t *outputTime;
+  time_t t;
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  outputTime = (time_t *) malloc(nImages * sizeof(time_t));
+  dist = (int *) malloc(nImages * sizeof(int));
+  for (i = 0; i < nImages; ++i)
+    {
+      dist[i] = -1;
+      sprintf(fn, "%s%s.map", updateName, images[i].name);
+      if (stat(fn, &sb) == 0)
+	outputTime[i] = sb.st_mtime;
+      else
 	{
-	  memset(nodes1, 0, nx1 * ny1 * sizeof(Node));
-	  free(nodes);
+	  Log("No previous output %s, so image %s will be relaxed\n",
+	      fn, images[i].name);
+	  outputTime[i] = 0;
+	  dist[i] = 0;
+	}
+    }
+
+  i0 = (int *) malloc(nMaps * sizeof(int));
+  i1 = (int *) malloc(nMaps * sizeof(int));
+  nChanged = 0;
+  pos = 0;
+  for (k = 0; k < nMaps; ++k)
+    {
+      i0[k] = FindImage(&mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      i1[k] = FindImage(&mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      sprintf(fn, "%s%s.map", mapsName, &mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      if (i0[k] < 0 || i1[k] < 0)
+	continue;
+      if (stat(fn, &sb) != 0)
+	Error("Could not stat map %s\n", fn);
+      t = outputTime[i0[k]] < outputTime[i1[k]] ?
+	outputTime[i0[k]] : outputTime[i1[k]];
+      if ((dist[i0[k]] == 0 && dist[i1[k]] == 0) || sb.st_mtime <= t)
+	continue;
+      Log("Map %s has changed since the previous output\n", fn);
+      dist[i0[k]] = 0;
+      dist[i1[k]] = 0;
+      ++nChanged;
+    }
+
+  /* grow the neighborhood one map at a time */
+  for (d = 1; d <= updateRadius; ++d)
+    for (k = 0; k < nMaps; ++k)
+      {
+	if (i0[k] < 0 || i1[k] < 0)
 	  continue;
+	if (dist[i0[k]] == d - 1 && dist[i1[k]] < 0)
+	  dist[i1[k]] = d;
+	else if (dist[i1[k]] == d - 1 && dist[i0[k]] < 0)
+	  dist[i0[k]] = d;
+      }
+
+  nRelaxed = 0;
+  for (i = 0; i < nImages; ++i)
+    {
+      frozen[i] = dist[i] < 0;
+      if (!frozen[i])
+	++nRelaxed;
+    }
+  Log("%d maps have changed; relaxing %d of %d images\n",
+      nChanged, nRelaxed, nImages);
+
+  free(outputTime);
+  free(dist);
+  free(i0);
+  free(i1);
+}
+
+#define SPRING_CACHE_KEY_LENGTH	7
+
+/* SpringCacheKey describes everything the springs of map i are built
+   from: the map file, the mask of its source image, and the sizes of
+   the two images */
+void
+SpringCacheKey (int i, long *key)
+{
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  memset(key, 0, SPRING_CACHE_KEY_LENGTH * sizeof(long));
+  sprintf(fn, "%s%s.map", mapsName, maps[i].name);
+  if (stat(fn, &sb) == 0)
+    {
+      key[0] = sb.st_mtime;
+      key[1] = sb.st_size;
+    }
+  if (masksName[0] != '\0')
+    {
+      sprintf(fn, "%s%s", masksName, images[maps[i].image0].name);
+      if (stat(fn, &sb) == 0)
+	key[2] = sb.st_mtime;
+    }
+  key[3] = images[maps[i].image0].width;
+  key[4] = images[maps[i].image0].height;
+  key[5] = images[maps[i].image1].width;
+  key[6] = images[maps[i].image1].height;
+}
+
+/* ReadSpringCache loads the strips and springs of every map of this
+   process at every level from its spring cache file; it returns 0,
+   leaving the maps without springs, if the file is missing or was
+   built from different maps, masks, or levels */
+int
+ReadSpringCache ()
+{
+  char fn[PATH_MAX];
+  char name[PATH_MAX];
+  FILE *f;
+  int i, j;
+  int n;
+  int cMaps, cStartLevel, cEndLevel;
+  int len;
+  int ok;
+  long key[SPRING_CACHE_KEY_LENGTH];
+  long cKey[SPRING_CACHE_KEY_LENGTH];
+  InterImageMap *m;
+
+  sprintf(fn, "%s.%d", springCacheName, p);
+  f = fopen(fn, "r");
+  if (f == NULL)
+    {
+      Log("No spring cache %s; building the springs from the maps\n", fn);
+      return(0);
+    }
+  ok = fscanf(f, "S1 %d %d %d", &cMaps, &cStartLevel, &cEndLevel) == 3 &&
+    fgetc(f) == '\n' &&
+    cMaps == nMaps && cStartLevel == startLevel && cEndLevel == endLevel;
+  for (i = 0; ok && i < nMaps; ++i)
+    {
+      m = &maps[i];
+      SpringCacheKey(i, key);
+      ok = fread(&len, sizeof(int), 1, f) == 1 &&
+	len > 0 && len <= PATH_MAX &&
+	fread(name, 1, len, f) == len &&
+	name[len-1] == '\0' && strcmp(name, m->name) == 0 &&
+	fread(cKey, sizeof(long), SPRING_CACHE_KEY_LENGTH, f) ==
+	SPRING_CACHE_KEY_LENGTH &&
+	memcmp(key, cKey, SPRING_CACHE_KEY_LENGTH * sizeof(long)) == 0;
+      for (j = 0; ok && j < nLevels; ++j)
+	{
+	  ok = fread(&(m->nStrips[j]), sizeof(int), 1, f) == 1 &&
+	    fread(&(m->nSprings[j]), sizeof(int), 1, f) == 1 &&
+	    m->nStrips[j] >= 0 && m->nSprings[j] >= 0;
+	  if (!ok)
+	    break;
+	  n = m->nStrips[j];
+	  m->strips[j] = (InterImageStrip *)
+	    malloc((n > 0 ? n : 1) * sizeof(InterImageStrip));
+	  ok = fread(m->strips[j], sizeof(InterImageStrip), n, f) == n;
+	  n = m->nSprings[j];
+	  m->springs[j] = (InterImageSpring *)
+	    malloc((n > 0 ? n : 1) * sizeof(InterImageSpring));
+	  ok = ok && fread(m->springs[j], sizeof(InterImageSpring), n, f) == n;
 	}
+    }
+  fclose(f);
 
-      for (y = 0; y < ny1; ++y)
-	for (x = 0; x < nx1; ++x)
+  if (!ok)
+    {
+      Log("Spring cache %s is out of date; building the springs from the maps\n",
+	  fn);
+      for (i = 0; i < nMaps; ++i)
+	for (j = 0; j < nLevels; ++j)
 	  {
-	    nodes1[y * nx1 + x].x = UNSPECIFIED;
-	    nodes1[y * nx1 + x].y = UNSPECIFIED;
-	    nodes1[y * nx1 + x].fx = 0.0;
-	    nodes1[y * nx1 + x].fy = 0.0;
+	    free(maps[i].strips[j]);
+	    free(maps[i].springs[j]);
+	    maps[i].strips[j] = NULL;
+	    maps[i].springs[j] = NULL;
+	    maps[i].nStrips[j] = 0;
+	    maps[i].nSprings[j] = 0;
 	  }
+      return(0);
+    }
+  ++springsVersion;
+  Log("Read the springs of %d maps from spring cache %s\n", nMaps, fn);
+  return(1);
+}
 
-      // mark the valid map nodes
-      rnx = (images[i].width + eFactor - 1) / eFactor;
-      rny = (images[i].height + eFactor - 1) / eFactor;
-      imbpl = (rnx + 7) >> 3;
-      imask = images[i].mask;
-      for (y = 0; y < ny1; ++y)
-	for (x = 0; x < nx1; ++x)
-	  {
-	    valid = (imask == NULL);
-	    for (iy = 0; !valid && iy < rFactor; ++iy)
-	      {
-		iyv = y * rFactor + iy;
-		if (iyv >= rny)
-		  break;
-		for (ix = 0; ix < rFactor; ++ix)
-		  {
-		    ixv = x * rFactor + ix;
-		    if (ixv >= rnx)
-		      break;
-		    if (imask[iyv * imbpl + (ixv >> 3)] & (0x80 >> (ixv & 7)))
-		      {
-			valid = 1;
-			break;
-		      }
-		  }
-	      }
-	    if (valid)
-	      {
-		nodes1[y * nx1 + x].x = 0.0;
-		nodes1[y * nx1 + x].y = 0.0;
-		if (x < nx1 - 1)
-		  {
-		    nodes1[y * nx1 + x + 1].x = 0.0;
-		    nodes1[y * nx1 + x + 1].y = 0.0;
-		  }
-		if (y < ny1 - 1)
-		  {
-		    nodes1[(y + 1) * nx1 + x].x = 0.0;
-		    nodes1[(y + 1) * nx1 + x].y = 0.0;
-		  }
-		if (x < nx1 - 1 && y < ny1 - 1)
-		  {
-		    nodes1[(y + 1) * nx1 + x + 1].x = 0.0;
-		    nodes1[(y + 1) * nx1 + x + 1].y = 0.0;
-		  }
-	      }
-	  }
+void
+WriteSpringCache ()
+{
+  char fn[PATH_MAX];
+  char tmpFn[PATH_MAX];
+  FILE *f;
+  int i, j;
+  int n;
+  int len;
+  int ok;
+  long key[SPRING_CACHE_KEY_LENGTH];
+  InterImageMap *m;
 
-      if (nConstraints[i] > 0)
-	ConstrainNodes(i,
-		       nodes1, nx1, ny1, factor1,
-		       nConstraints[i],
-		       constraints[i],
-		       constrainingCoeff[i]);
-      
-      if (images[i].fixed && images[i].initialPositions[startLevel - level] != 0)
+  sprintf(fn, "%s.%d", springCacheName, p);
+  sprintf(tmpFn, "%s.tmp", fn);
+  f = fopen(tmpFn, "w");
+  if (f == NULL)
+    {
+      Log("WARNING: Could not open spring cache %s for writing\n", tmpFn);
+      return;
+    }
+  ok = fprintf(f, "S1 %d %d %d\n", nMaps, startLevel, endLevel) > 0;
+  for (i = 0; ok && i < nMaps; ++i)
+    {
+      m = &maps[i];
+      SpringCacheKey(i, key);
+      len = strlen(m->name) + 1;
+      ok = fwrite(&len, sizeof(int), 1, f) == 1 &&
+	fwrite(m->name, 1, len, f) == len &&
+	fwrite(key, sizeof(long), SPRING_CACHE_KEY_LENGTH, f) ==
+	SPRING_CACHE_KEY_LENGTH;
+      for (j = 0; ok && j < nLevels; ++j)
 	{
-	  node = images[i].nodes;
-	  initialPos = images[i].initialPositions[startLevel - level];
-	  for (y = 0; y < ny1; ++y)
-	    for (x = 0; x < nx1; ++x, ++node, ++initialPos)
-	      {
-		if (node->x > 0.5 * UNSPECIFIED)
-		  continue;
-		if (node->fx < 0.5 * CONSTRAINED)
-		  node->x = initialPos->x;
-		if (node->fy < 0.5 * CONSTRAINED)
-		  node->y = initialPos->y;
-	      }
-	  continue;
+	  n = m->nStrips[j];
+	  ok = fwrite(&(m->nStrips[j]), sizeof(int), 1, f) == 1 &&
+	    fwrite(&(m->nSprings[j]), sizeof(int), 1, f) == 1 &&
+	    fwrite(m->strips[j], sizeof(InterImageStrip), n, f) == n &&
+	    fwrite(m->springs[j], sizeof(InterImageSpring),
+		   m->nSprings[j], f) == m->nSprings[j];
+	}
+    }
+  if (fclose(f) != 0 || !ok || rename(tmpFn, fn) != 0)
+    {
+      Log("WARNING: Could not write spring cache %s\n", fn);
+      unlink(tmpFn);
+      return;
+    }
+  Log("Wrote the springs of %d maps to spring cache %s\n", nMaps, fn);
+}
+
+#define MODEL_CACHE_KEY_LENGTH	6
+
+/* ModelCacheKey describes everything the intra-image springs of a
+   model are built from: its map file (if it is not the uniform
+   model), its size at the end level, and the levels */
+void
+ModelCacheKey (IntraImageMap *iim, long *key)
+{
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  memset(key, 0, MODEL_CACHE_KEY_LENGTH * sizeof(long));
+  if (iim->name[0] != '\0')
+    {
+      sprintf(fn, "%s%s.map", modelsName, iim->name);
+      if (stat(fn, &sb) == 0)
+	{
+	  key[0] = sb.st_mtime;
+	  key[1] = sb.st_size;
+	}
+    }
+  key[2] = iim->nx;
+  key[3] = iim->ny;
+  key[4] = startLevel;
+  key[5] = endLevel;
+}
+
+/* ReadModelCache loads the points and the springs at every level of
+   model iim, for an image of the given size, from its model cache
+   file; it returns 0, leaving the model without springs, if the file
+   is missing or was built from a different model map or levels.
+   The file is shared by every process and every image with the same
+   model and size. */
+int
+ReadModelCache (IntraImageMap *iim, int width, int height)
+{
+  char fn[PATH_MAX];
+  FILE *f;
+  int j;
+  int n;
+  int nx, ny;
+  int ok;
+  long key[MODEL_CACHE_KEY_LENGTH];
+  long cKey[MODEL_CACHE_KEY_LENGTH];
+
+  sprintf(fn, "%s%s.%dx%d.iim", modelCacheName,
+	  iim->name[0] != '\0' ? iim->name : "_uniform", iim->nx, iim->ny);
+  f = fopen(fn, "r");
+  if (f == NULL)
+    return(0);
+  ModelCacheKey(iim, key);
+  nx = (width + startFactor - 1) / startFactor + 1;
+  ny = (height + startFactor - 1) / startFactor + 1;
+  iim->points = (Point *) malloc(nx * ny * sizeof(Point));
+  ok = fgetc(f) == 'M' && fgetc(f) == '1' && fgetc(f) == '\n' &&
+    fread(cKey, sizeof(long), MODEL_CACHE_KEY_LENGTH, f) ==
+    MODEL_CACHE_KEY_LENGTH &&
+    memcmp(key, cKey, MODEL_CACHE_KEY_LENGTH * sizeof(long)) == 0 &&
+    fread(iim->points, sizeof(Point), nx * ny, f) == nx * ny;
+  for (j = 0; ok && j < nLevels; ++j)
+    {
+      ok = fread(&(iim->nSprings[j]), sizeof(int), 1, f) == 1 &&
+	iim->nSprings[j] >= 0;
+      if (!ok)
+	break;
+      n = iim->nSprings[j];
+      iim->springs[j] = (IntraImageSpring *)
+	malloc((n > 0 ? n : 1) * sizeof(IntraImageSpring));
+      ok = fread(iim->springs[j], sizeof(IntraImageSpring), n, f) == n;
+    }
+  fclose(f);
+
+  if (!ok)
+    {
+      Log("Model cache %s is out of date; building the model\n", fn);
+      free(iim->points);
+      iim->points = NULL;
+      for (j = 0; j < nLevels; ++j)
+	{
+	  free(iim->springs[j]);
+	  iim->springs[j] = NULL;
+	  iim->nSprings[j] = 0;
+	}
+      return(0);
+    }
+  Log("Read model %s from model cache %s\n", iim->name, fn);
+  return(1);
+}
+
+void
+WriteModelCache (IntraImageMap *iim, int width, int height)
+{
+  char fn[PATH_MAX];
+  char tmpFn[PATH_MAX];
+  FILE *f;
+  int j;
+  int nx, ny;
+  int ok;
+  long key[MODEL_CACHE_KEY_LENGTH];
+
+  sprintf(fn, "%s%s.%dx%d.iim", modelCacheName,
+	  iim->name[0] != '\0' ? iim->name : "_uniform", iim->nx, iim->ny);
+  /* several processes may build the same model at once, so each
+     writes its own temporary file and the last rename wins */
+  sprintf(tmpFn, "%s.%d.tmp", fn, p);
+  f = fopen(tmpFn, "w");
+  if (f == NULL)
+    {
+      Log("WARNING: Could not open model cache %s for writing\n", tmpFn);
+      return;
+    }
+  ModelCacheKey(iim, key);
+  nx = (width + startFactor - 1) / startFactor + 1;
+  ny = (height + startFactor - 1) / startFactor + 1;
+  ok = fprintf(f, "M1\n") > 0 &&
+    fwrite(key, sizeof(long), MODEL_CACHE_KEY_LENGTH, f) ==
+    MODEL_CACHE_KEY_LENGTH &&
+    fwrite(iim->points, sizeof(Point), nx * ny, f) == nx * ny;
+  for (j = 0; ok && j < nLevels; ++j)
+    ok = fwrite(&(iim->nSprings[j]), sizeof(int), 1, f) == 1 &&
+      fwrite(iim->springs[j], sizeof(IntraImageSpring),
+	     iim->nSprings[j], f) == iim->nSprings[j];
+  if (fclose(f) != 0 || !ok || rename(tmpFn, fn) != 0)
+    {
+      Log("WARNING: Could not write model cache %s\n", fn);
+      unlink(tmpFn);
+      return;
+    }
+  Log("Wrote model %s to model cache %s\n", iim->name, fn);
+}
+
+/* RunForceThreads does one phase of the force computation (see
+   ForceThread) on nThreads threads, adding the energy they find
+   to *pEnergy; the inter-image phase is given a private force buffer
+   per thread, and so is followed by a phase that adds those buffers
+   into the nodes */
+void
+RunForceThreads (int level, int phase, double *pEnergy)
+{
+  int i, t;
+  ForceThread *ft;
+
+  if (forceThreads == NULL)
+    {
+      forceThreads = (ForceThread *) malloc(nThreads * sizeof(ForceThread));
+      forceOffset = (int *) malloc(nImages * sizeof(int));
+      if (forceThreads == NULL || forceOffset == NULL)
+	Error("Could not allocate force thread tables.\n");
+      for (t = 0; t < nThreads; ++t)
+	forceThreads[t].f = NULL;
+    }
+  if (phase == 1)
+    {
+      /* lay out the nodes of the images touched by the maps */
+      for (i = 0; i < nImages; ++i)
+	forceOffset[i] = -1;
+      for (i = 0; i < nMaps; ++i)
+	{
+	  forceOffset[maps[i].image0] = 0;
+	  forceOffset[maps[i].image1] = 0;
+	}
+      nForceNodes = 0;
+      for (i = 0; i < nImages; ++i)
+	if (forceOffset[i] >= 0)
+	  {
+	    forceOffset[i] = nForceNodes;
+	    nForceNodes += images[i].nx * images[i].ny;
+	  }
+      if (nForceNodes > forceBufferNodes)
+	{
+	  for (t = 0; t < nThreads; ++t)
+	    {
+	      forceThreads[t].f = (float *) realloc(forceThreads[t].f,
+						    2 * nForceNodes *
+						    sizeof(float));
+	      if (forceThreads[t].f == NULL)
+		Error("Could not allocate force buffer of %d nodes.\n",
+		      nForceNodes);
+	    }
+	  forceBufferNodes = nForceNodes;
+	}
+    }
+
+  /* the inter-image phase is followed by the phase that adds the
+     buffers into the nodes */
+  for (;;)
+    {
+      for (t = 0; t < nThreads; ++t)
+	{
+	  ft = &forceThreads[t];
+	  ft->t = t;
+	  ft->phase = phase;
+	  ft->level = level;
+	  ft->energy = 0.0;
+	  if (pthread_create(&(ft->thread), NULL, ForceThreadMain, ft) != 0)
+	    Error("Could not create force thread.\n");
+	}
+      for (t = 0; t < nThreads; ++t)
+	{
+	  pthread_join(forceThreads[t].thread, NULL);
+	  *pEnergy += forceThreads[t].energy;
+	}
+      if (isinf(*pEnergy) || isnan(*pEnergy))
+	abort();
+      if (phase != 1)
+	break;
+      phase = 2;
+    }
+}
+
+void *
+ForceThreadMain (void *arg)
+{
+  ForceThread *ft = (ForceThread *) arg;
+  int i, j, k;
+  int n;
+  Node *nodes;
+  float *f;
+
+  switch (ft->phase)
+    {
+    case 0:
+      for (i = myFirstImage, n = 0; i >= 0; i = images[i].nextOwned, ++n)
+	if (n % nThreads == ft->t)
+	  ImageForces(i, ft->level, &(ft->energy));
+      break;
+
+    case 1:
+      memset(ft->f, 0, 2 * nForceNodes * sizeof(float));
+      for (i = ft->t; i < nMaps; i += nThreads)
+	MapForces(i, ft->level, &(ft->energy), ft->f);
+      break;
+
+    case 2:
+      for (i = ft->t; i < nImages; i += nThreads)
+	{
+	  if (forceOffset[i] < 0)
+	    continue;
+	  nodes = images[i].nodes;
+	  n = images[i].nx * images[i].ny;
+	  for (j = 0; j < nThreads; ++j)
+	    {
+	      f = &(forceThreads[j].f[2 * forceOffset[i]]);
+	      for (k = 0; k < n; ++k)
+		{
+		  nodes[k].fx += f[2*k];
+		  nodes[k].fy += f[2*k+1];
+		}
+	    }
+	}
+      break;
+    }
+  return(NULL);
+}
+
+/* GpuLoadStep lays out the nodes this process holds on the GPU, those
+   of its owned images first and then those of the other images it
+   needs, and copies them there with the absolute and intra-image
+   springs of the owned images and the springs of its inter-image maps
+   at the given level; it is done at the start of each step and
+   whenever the inter-image springs change */
+void
+GpuLoadStep (int level)
+{
+  int i, j, k;
+  int n, nn;
+  int o;
+  int nIntra, nInter;
+  int nSprings;
+  unsigned char *flags;
+  float *absXY;
+  float *velocity;
+  float kFactor;
+  Node *node;
+  Point *absPos;
+  IntraImageSpring *iis;
+  InterImageMap *m;
+  GpuIntraSpring *intra;
+  GpuInterSpring *inter;
+  char msg[PATH_MAX+256];
+
+  if (gpuOffset == NULL)
+    gpuOffset = (int *) malloc(nImages * sizeof(int));
+  nn = 0;
+  for (i = 0; i < nImages; ++i)
+    gpuOffset[i] = -1;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      gpuOffset[i] = nn;
+      nn += images[i].nx * images[i].ny;
+    }
+  nGpuOwnedNodes = nn;
+  for (i = 0; i < nImages; ++i)
+    if (images[i].owner != p && images[i].needed && images[i].nodes != NULL)
+      {
+	gpuOffset[i] = nn;
+	nn += images[i].nx * images[i].ny;
+      }
+  nGpuNodes = nn;
+
+  gpuXY = (float *) realloc(gpuXY, 2 * (nn + 1) * sizeof(float));
+  flags = (unsigned char *) malloc(nn + 1);
+  absXY = (float *) malloc(2 * (nn + 1) * sizeof(float));
+  velocity = NULL;
+  if (momentum > 0.0)
+    velocity = (float *) malloc(2 * (nn + 1) * sizeof(float));
+  if (gpuXY == NULL || flags == NULL || absXY == NULL ||
+      (momentum > 0.0 && velocity == NULL))
+    Error("Could not allocate the GPU nodes\n");
+  memset(flags, 0, nn + 1);
+  if (velocity != NULL)
+    memset(velocity, 0, 2 * (nn + 1) * sizeof(float));
+
+  nIntra = 0;
+  for (i = 0; i < nImages; ++i)
+    {
+      o = gpuOffset[i];
+      if (o < 0)
+	continue;
+      n = images[i].nx * images[i].ny;
+      node = images[i].nodes;
+      absPos = NULL;
+      if (images[i].owner == p && images[i].absolutePositions != NULL)
+	absPos = images[i].absolutePositions[startLevel - level];
+      for (k = 0; k < n; ++k, ++node)
+	{
+	  gpuXY[2*(o+k)] = node->x;
+	  gpuXY[2*(o+k)+1] = node->y;
+	  if (images[i].owner != p)
+	    continue;
+	  flags[o+k] = GPU_OWNED;
+	  if (!images[i].fixed && !images[i].settled)
+	    flags[o+k] |= GPU_MOVABLE;
+	  if (node->fx > 0.5 * CONSTRAINED)
+	    flags[o+k] |= GPU_CONSTRAINED_X;
+	  if (node->fy > 0.5 * CONSTRAINED)
+	    flags[o+k] |= GPU_CONSTRAINED_Y;
+	  if (absPos != NULL)
+	    {
+	      flags[o+k] |= GPU_ABSOLUTE;
+	      absXY[2*(o+k)] = absPos[k].x;
+	      absXY[2*(o+k)+1] = absPos[k].y;
+	    }
+	  if (velocity != NULL)
+	    {
+	      velocity[2*(o+k)] = images[i].velocity[k].x;
+	      velocity[2*(o+k)+1] = images[i].velocity[k].y;
+	    }
+	}
+      /* as in ImageForces, frozen and settled images have no
+	 intra-image springs */
+      if (images[i].owner == p &&
+	  !(updateName[0] != '\0' && images[i].fixed) && !images[i].settled)
+	nIntra += images[i].map->nSprings[startLevel - level];
+    }
+
+  intra = (GpuIntraSpring *) malloc((nIntra + 1) * sizeof(GpuIntraSpring));
+  if (intra == NULL)
+    Error("Could not allocate the GPU intra-image springs\n");
+  j = 0;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      if ((updateName[0] != '\0' && images[i].fixed) || images[i].settled)
+	continue;
+      o = gpuOffset[i];
+      kFactor = images[i].kFactor;
+      nSprings = images[i].map->nSprings[startLevel - level];
+      iis = images[i].map->springs[startLevel - level];
+      for (k = 0; k < nSprings; ++k, ++iis, ++j)
+	{
+	  intra[j].index0 = o + iis->index0;
+	  intra[j].index1 = o + iis->index1;
+	  intra[j].nomD = iis->nomD;
+	  intra[j].k = kFactor * iis->k;
+	}
+    }
+
+  /* as in MapForces, the maps with no strength or between two
+     settled images are left out */
+  nInter = 0;
+  for (i = 0; i < nMaps; ++i)
+    {
+      m = &maps[i];
+      if (m->k == 0.0 ||
+	  (images[m->image0].settled && images[m->image1].settled))
+	continue;
+      if (m->decodedLevel != level || m->decodedVersion != springsVersion)
+	DecodeSprings(m, level);
+      nInter += m->nDecoded;
+    }
+  inter = (GpuInterSpring *) malloc((nInter + 1) * sizeof(GpuInterSpring));
+  if (inter == NULL)
+    Error("Could not allocate the GPU inter-image springs\n");
+  j = 0;
+  for (i = 0; i < nMaps; ++i)
+    {
+      m = &maps[i];
+      if (m->k == 0.0 ||
+	  (images[m->image0].settled && images[m->image1].settled))
+	continue;
+      for (k = 0; k < m->nDecoded; ++k, ++j)
+	{
+	  inter[j].index0 = gpuOffset[m->image0] + m->index0[k];
+	  inter[j].index1 = gpuOffset[m->image1] + m->index1[k];
+	  if (compactSprings)
+	    {
+	      inter[j].offsetX = 0.00005 * m->dx[k];
+	      inter[j].offsetY = 0.00005 * m->dy[k];
+	      inter[j].k = (m->kq[k] / 255.0) * m->k;
+	    }
+	  else
+	    {
+	      inter[j].offsetX = m->offsetX[k];
+	      inter[j].offsetY = m->offsetY[k];
+	      inter[j].k = m->weight[k] * m->k;
+	    }
+	  inter[j].energyFactor = m->energyFactor;
+	}
+    }
+
+  if (!GpuForcesLoad(nn, gpuXY, flags, absXY, velocity,
+		     nIntra, intra, nInter, inter, msg))
+    Error("%s", msg);
+  free(flags);
+  free(absXY);
+  free(velocity);
+  free(intra);
+  free(inter);
+  gpuSpringsVersion = springsVersion;
+  gpuHostStale = 0;
+  gpuDeviceStale = 0;
+}
+
+/* GpuUploadNodes copies the positions of the owned nodes, with their
+   last steps, to the GPU if owned is true, and otherwise those of the
+   nodes of the other images, as just received */
+void
+GpuUploadNodes (int owned)
+{
+  int i, k;
+  int n;
+  int o;
+  Node *node;
+  char msg[PATH_MAX+256];
+
+  for (i = 0; i < nImages; ++i)
+    {
+      o = gpuOffset[i];
+      if (o < 0 || (images[i].owner == p) != (owned != 0))
+	continue;
+      n = images[i].nx * images[i].ny;
+      node = images[i].nodes;
+      for (k = 0; k < n; ++k, ++node)
+	{
+	  gpuXY[2*(o+k)] = node->x;
+	  gpuXY[2*(o+k)+1] = node->y;
+	}
+      if (owned)
+	{
+	  if (!GpuForcesUpload(o, n, &gpuXY[2*o],
+			       momentum > 0.0 ?
+			       (float *) images[i].velocity : NULL,
+			       msg))
+	    Error("%s", msg);
+	}
+    }
+  /* the other images lie together after the owned ones */
+  if (!owned &&
+      !GpuForcesUpload(nGpuOwnedNodes, nGpuNodes - nGpuOwnedNodes,
+		       &gpuXY[2*nGpuOwnedNodes], NULL, msg))
+    Error("%s", msg);
+  if (owned)
+    gpuDeviceStale = 0;
+}
+
+/* GpuDownloadNodes copies the positions of the owned nodes moved on the
+   GPU back into the images, with their last steps, if all is true;
+   otherwise only those of the images sent to other processes are, as
+   CommunicatePositions needs */
+void
+GpuDownloadNodes (int all)
+{
+  int i, j, k;
+  int n;
+  int o;
+  int sent;
+  Node *node;
+  char msg[PATH_MAX+256];
+
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      if (images[i].fixed || images[i].settled)
+	continue;
+      if (!all)
+	{
+	  sent = 0;
+	  if (images[i].sendTo != NULL)
+	    for (j = 0; j < (np + 7) >> 3; ++j)
+	      if (images[i].sendTo[j] != 0)
+		sent = 1;
+	  if (!sent)
+	    continue;
+	}
+      o = gpuOffset[i];
+      n = images[i].nx * images[i].ny;
+      if (!GpuForcesDownload(o, n, &gpuXY[2*o],
+			     all && momentum > 0.0 ?
+			     (float *) images[i].velocity : NULL,
+			     msg))
+	Error("%s", msg);
+      node = images[i].nodes;
+      for (k = 0; k < n; ++k, ++node)
+	{
+	  node->x = gpuXY[2*(o+k)];
+	  node->y = gpuXY[2*(o+k)+1];
+	}
+    }
+  gpuHostStale = !all;
+}
+
+void
+UpdateDeltas (int level, int iter)
+{
+  InterImageMap *m;
+  int i, j, k;
+  int x, y;
+  float rrx, rry;
+  Node *nodes1;
+  float rx00, rx01, rx10, rx11;
+  float ry00, ry01, ry10, ry11;
+  float rx, ry;
+  int nx, ny;
+  int irx, iry;
+  int ix, iy;
+  int nx1, ny1;
+  InterImageSpring *s;
+  InterImageStrip *strip;
+  float deltaX, deltaY;
+  int springsPos;
+  int ns;
+  int nStrips;
+  InterImageStrip *strips;
+  InterImageSpring *springs;
+  int dx, dy;
+  float d;
+  float w, tw;
+  float trx, try;
+  int irxp, iryp;
+  float rrxp, rryp;
+
+  ++springsVersion;
+  for (i = 0; i < nMaps; ++i)
+    {
+      m = &maps[i];
+      nx1 = images[m->image1].nx;
+      ny1 = images[m->image1].ny;
+      nodes1 = images[m->image1].nodes;
+
+      springsPos = 0;
+      nStrips = m->nStrips[startLevel - level];
+      strips = m->strips[startLevel - level];
+      springs = m->springs[startLevel - level];
+      for (j = 0; j < nStrips; ++j)
+	{
+	  strip = &(strips[j]);
+	  ns = strip->nSprings;
+	  x = strip->x0;
+	  y = strip->y0;
+	  ix = strip->x1;
+	  iy = strip->y1;
+	  for (k = 0; k < ns; ++k)
+	    {
+	      s = &(springs[springsPos++]);
+	      ix += ((s->dxy1) >> 4) - 8;
+	      iy += ((s->dxy1) & 0xf) - 8;
+	      rrx = s->irrx / 20000.0;
+	      rry = s->irry / 20000.0;
+	      irx = ix;
+	      iry = iy;
+	      if (rrx < 0.0)
+		{
+		  --irx;
+		  rrx += 1.0;
+		}
+	      if (rry < 0.0)
+		{
+		  --iry;
+		  rry += 1.0;
+		}
+	      if (irx >= 0 && irx < nx1-1 &&
+		  iry >= 0 && iry < ny1-1 &&
+		  (rx00 = nodes1[iry*nx1 + irx].x) <= 0.5 * UNSPECIFIED &&
+		  (rx01 = nodes1[(iry+1)*nx1+irx].x) <= 0.5 * UNSPECIFIED &&
+		  (rx10 = nodes1[iry*nx1 + irx+1].x) <= 0.5 * UNSPECIFIED &&
+		  (rx11 = nodes1[(iry+1)*nx1+irx+1].x) <= 0.5 * UNSPECIFIED)
+		{
+		  rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+		    - rx10 * rrx * (rry - 1.0) 
+		    - rx01 * (rrx - 1.0) * rry
+		    + rx11 * rrx * rry;
+		  ry00 = nodes1[iry*nx1 + irx].y;
+		  ry01 = nodes1[(iry+1)*nx1+irx].y;
+		  ry10 = nodes1[iry*nx1 + irx+1].y;
+		  ry11 = nodes1[(iry+1)*nx1+irx+1].y;
+		  ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+		    - ry10 * rrx * (rry - 1.0) 
+		    - ry01 * (rrx - 1.0) * rry
+		    + ry11 * rrx * rry;
+		}
+	      else
+		{
+		  // need to extrapolate
+		  tw = 0.0;
+		  trx = 0.0;
+		  try = 0.0;
+		  for (dy = -1; dy <= 1; ++dy)
+		    {
+		      iryp = iry + dy;
+		      if (iryp < 0 || iryp >= ny1-1)
+			continue;
+		      rryp = rry - dy;
+		      for (dx = -1; dx <= 1; ++dx)
+			{
+			  if (dx == 0 && dy == 0)
+			    continue;
+			  irxp = irx + dx;
+			  if (irxp < 0 || irxp >= nx1-1)
+			    continue;
+			  rrxp = rrx - dx;
+			  rx00 = nodes1[iryp*nx1 + irxp].x;
+			  rx01 = nodes1[(iryp+1)*nx1+irxp].x;
+			  rx10 = nodes1[iryp*nx1 + irxp+1].x;
+			  rx11 = nodes1[(iryp+1)*nx1+irxp+1].x;
+			  ry00 = nodes1[iryp*nx1 + irxp].y;
+			  ry01 = nodes1[(iryp+1)*nx1+irxp].y;
+			  ry10 = nodes1[iryp*nx1 + irxp+1].y;
+			  ry11 = nodes1[(iryp+1)*nx1+irxp+1].y;
+			  if (rx00 > 0.5 * UNSPECIFIED ||
+			      rx01 > 0.5 * UNSPECIFIED ||
+			      rx10 > 0.5 * UNSPECIFIED ||
+			      rx11 > 0.5 * UNSPECIFIED)
+			    continue;
+			  rx = rx00 * (rrxp - 1.0) * (rryp - 1.0)
+			    - rx10 * rrxp * (rryp - 1.0) 
+			    - rx01 * (rrxp - 1.0) * rryp
+			    + rx11 * rrxp * rryp;
+			  ry = ry00 * (rrxp - 1.0) * (rryp - 1.0)
+			    - ry10 * rrxp * (rryp - 1.0) 
+			    - ry01 * (rrxp - 1.0) * rryp
+			    + ry11 * rrxp * rryp;
+			  if (dy < 0)
+			    {
+			      if (dx < 0)
+				d = hypot(rrxp - 1.0, rryp - 1.0);
+			      else if (dx == 0)
+				d = rryp - 1.0;
+			      else
+				d = hypot(-rrxp, rryp - 1.0);
+			    }
+			  else if (dy == 0)
+			    {
+			      if (dx < 0)
+				d = rrxp - 1.0;
+			      else
+				d = -rrxp;
+			    }
+			  else
+			    {
+			      if (dx < 0)
+				d = hypot(rrxp - 1.0, -rryp);
+			      else if (dx == 0)
+				d = -rryp;
+			      else
+				d = hypot(-rrxp, -rryp);
+			    }
+			  if (d < 0.000001)
+			    w = 1000000.0;
+			  else
+			    w = 1.0 / d;
+			  trx += w * rx;
+			  try += w * ry;
+			  tw += w;
+		      }
+		    }
+		  if (tw == 0.0)
+		    {
+		      s->dx = 0;
+		      s->dy = 0;
+		      s->k = 0;
+		      continue;
+		    }
+		  rx = trx / tw;
+		  ry = try / tw;
+		}
+	      deltaX = 20000.0 * (rx - nodes1[iy*nx1+ix].x) + 0.5;
+	      deltaY = 20000.0 * (ry - nodes1[iy*nx1+ix].y) + 0.5;
+	      if (deltaX >= -32768.0 && deltaX < 32768.0 &&
+		  deltaY >= -32768.0 && deltaY < 32768.0)
+		{
+		  s->dx = (int) floor(deltaX);
+		  s->dy = (int) floor(deltaY);
+		}
+	      else
+		{
+		  s->dx = 0;
+		  s->dy = 0;
+		  s->k = 0;
+		}
+	    }
+	}
+    }
+}
+
+void
+RefinePositions (int prevLevel, int level)
+{
+  int i;
+  int factor1;
+  int nx, ny;
+  int nx1, ny1;
+  int x, y;
+  float xv, yv;
+  int ixv, iyv;
+  float rrx, rry;
+  float rx00, rx01, rx10, rx11;
+  float ry00, ry01, ry10, ry11;
+  float rx, ry;
+  Node *nodes, *nodes1;
+  float dFactor;
+  int eFactor;
+  int rFactor;
+  unsigned char *imask;
+  int rnx, rny;
+  int imbpl;
+  int valid;
+  int ix, iy;
+  int count;
+  MapElement *initialMap;
+  int mLevel;
+  int mw, mh;
+  int mxMin, myMin;
+  double scale;
+  Node *node;
+  char imName0[PATH_MAX], imName1[PATH_MAX];
+  char msg[PATH_MAX+256];
+  char fn[PATH_MAX];
+  Point *initialPos;
+
+  factor1 = 1 << level;
+  dFactor = 1 << (prevLevel - level);
+  eFactor = 1 << endLevel;
+  rFactor = factor1 / eFactor;
+  for (i = 0; i < nImages; ++i)
+    {
+      if (images[i].owner != p && !images[i].needed)
+	continue;
+      nx = images[i].nx;
+      ny = images[i].ny;
+      nx1 = (images[i].width + factor1 - 1) / factor1 + 1;
+      ny1 = (images[i].height + factor1 - 1) / factor1 + 1;
+      images[i].nx = nx1;
+      images[i].ny = ny1;
+      nodes = images[i].nodes;
+      nodes1 = (Node*) malloc(nx1 * ny1 * sizeof(Node));
+      images[i].nodes = nodes1;
+      if (images[i].owner != p)
+	{
+	  memset(nodes1, 0, nx1 * ny1 * sizeof(Node));
+	  free(nodes);
+	  continue;
+	}
+
+      for (y = 0; y < ny1; ++y)
+	for (x = 0; x < nx1; ++x)
+	  {
+	    nodes1[y * nx1 + x].x = UNSPECIFIED;
+	    nodes1[y * nx1 + x].y = UNSPECIFIED;
+	    nodes1[y * nx1 + x].fx = 0.0;
+	    nodes1[y * nx1 + x].fy = 0.0;
+	  }
+
+      // mark the valid map nodes
+      rnx = (images[i].width + eFactor - 1) / eFactor;
+      rny = (images[i].height + eFactor - 1) / eFactor;
+      imbpl = (rnx + 7) >> 3;
+      imask = images[i].mask;
+      for (y = 0; y < ny1; ++y)
+	for (x = 0; x < nx1; ++x)
+	  {
+	    valid = (imask == NULL);
+	    for (iy = 0; !valid && iy < rFactor; ++iy)
+	      {
+		iyv = y * rFactor + iy;
+		if (iyv >= rny)
+		  break;
+		for (ix = 0; ix < rFactor; ++ix)
+		  {
+		    ixv = x * rFactor + ix;
+		    if (ixv >= rnx)
+		      break;
+		    if (imask[iyv * imbpl + (ixv >> 3)] & (0x80 >> (ixv & 7)))
+		      {
+			valid = 1;
+			break;
+		      }
+		  }
+	      }
+	    if (valid)
+	      {
+		nodes1[y * nx1 + x].x = 0.0;
+		nodes1[y * nx1 + x].y = 0.0;
+		if (x < nx1 - 1)
+		  {
+		    nodes1[y * nx1 + x + 1].x = 0.0;
+		    nodes1[y * nx1 + x + 1].y = 0.0;
+		  }
+		if (y < ny1 - 1)
+		  {
+		    nodes1[(y + 1) * nx1 + x].x = 0.0;
+		    nodes1[(y + 1) * nx1 + x].y = 0.0;
+		  }
+		if (x < nx1 - 1 && y < ny1 - 1)
+		  {
+		    nodes1[(y + 1) * nx1 + x + 1].x = 0.0;
+		    nodes1[(y + 1) * nx1 + x + 1].y = 0.0;
+		  }
+	      }
+	  }
+
+      if (nConstraints[i] > 0)
+	ConstrainNodes(i,
+		       nodes1, nx1, ny1, factor1,
+		       nConstraints[i],
+		       constraints[i],
+		       constrainingCoeff[i]);
+      
+      if (images[i].fixed && images[i].initialPositions[startLevel - level] != 0)
+	{
+	  node = images[i].nodes;
+	  initialPos = images[i].initialPositions[startLevel - level];
+	  for (y = 0; y < ny1; ++y)
+	    for (x = 0; x < nx1; ++x, ++node, ++initialPos)
+	      {
+		if (node->x > 0.5 * UNSPECIFIED)
+		  continue;
+		if (node->fx < 0.5 * CONSTRAINED)
+		  node->x = initialPos->x;
+		if (node->fy < 0.5 * CONSTRAINED)
+		  node->y = initialPos->y;
+	      }
+	  continue;
+	}
+
+      count = 0;
+      for (y = 0; y < ny1; ++y)
+	for (x = 0; x < nx1; ++x)
+	  {
+	    if (nodes1[y * nx1 + x].x > 0.5 * UNSPECIFIED)
+	      continue;
+	    ++count;
+	    xv = x / dFactor;
+	    yv = y / dFactor;
+	    ixv = (int) floor(xv);
+	    iyv = (int) floor(yv);
+	    rrx = xv - ixv;
+	    rry = yv - iyv;
+	    while (ixv >= nx-1)
+	      {
+		--ixv;
+		rrx += 1.0;
+	      }
+	    while (iyv >= ny-1)
+	      {
+		--iyv;
+		rry += 1.0;
+	      }
+	    rx00 = nodes[iyv * nx + ixv].x;
+	    ry00 = nodes[iyv * nx + ixv].y;
+	    rx01 = nodes[(iyv+1) * nx + ixv].x;
+	    ry01 = nodes[(iyv+1) * nx + ixv].y;
+	    rx10 = nodes[iyv * nx + ixv + 1].x;
+	    ry10 = nodes[iyv * nx + ixv + 1].y;
+	    rx11 = nodes[(iyv+1) * nx + ixv + 1].x;
+	    ry11 = nodes[(iyv+1) * nx + ixv + 1].y;
+	    if (rx00 > 0.5 * UNSPECIFIED ||
+		rx01 > 0.5 * UNSPECIFIED && rry != 0.0 ||
+		rx10 > 0.5 * UNSPECIFIED && rrx != 0.0 ||
+		rx11 > 0.5 * UNSPECIFIED && rrx != 0.0 && rry != 0.0)
+	      Error("RefinePositions: could not interpolate from invalid nodes (image = %s x = %d y = %d nx1 = %d ny1 = %d ixv = %d, iyv = %d nx = %d ny = %d xv = %f yv = %f rrx = %f rry = %f dFactor = %f)\n",
+		    images[i].name, x, y, nx1, ny1,
+		    ixv, iyv, nx, ny,
+		    xv, yv, rrx, rry, dFactor);
+	    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	      - rx10 * rrx * (rry - 1.0) 
+	      - rx01 * (rrx - 1.0) * rry
+	      + rx11 * rrx * rry;
+	    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	      - ry10 * rrx * (rry - 1.0) 
+	      - ry01 * (rrx - 1.0) * rry
+	      + ry11 * rrx * rry;
+
+	    if (nodes1[y * nx1 + x].fx < 0.5 * CONSTRAINED)
+	      nodes1[y * nx1 + x].x = dFactor * rx;
+	    //	    else
+	    //	      Log("Constrained x of (%d %d)\n", x, y);
+	    if (nodes1[y * nx1 + x].fy < 0.5 * CONSTRAINED)
+	      nodes1[y * nx1 + x].y = dFactor * ry;
+	    //	    else
+	    //	      Log("Constrained y of (%d %d)\n", x, y);
+	    //	    Log("Position of (%d %d) set to (%f %f)\n",
+	    //		x, y,
+	    //		nodes1[y * nx1 + x].x,
+	    //		nodes1[y * nx1 + x].y);
+	  }
+      Log("Refined map of image %s (%d of %d nodes valid)\n",
+	  images[i].name, count, nx1*ny1);
+      free(nodes);
+    }
+}
+
+/* NewMap adds an entry, without any springs yet, for the map name
+   from image0 to image1 with spring constant k to the maps table, and
+   returns it; the table is only trimmed to nMaps entries by the caller */
+InterImageMap *
+NewMap (char *name, int image0, int image1, float k)
+{
+  InterImageMap *m;
+
+  if (mapsPos >= mapsSize)
+    {
+      mapsSize = (mapsSize > 0) ? mapsSize * 2 : 1024;
+      maps = (InterImageMap *) realloc(maps, mapsSize *
+				       sizeof(InterImageMap));
+      if (maps == NULL)
+	Error("Could not allocate maps table.\n");
+    }
+  m = &(maps[mapsPos++]);
+  m->name = (char *) malloc(strlen(name)+1);
+  strcpy(m->name, name);
+  m->image0 = image0;
+  m->image1 = image1;
+  m->energyFactor = (images[image0].owner == p) ? 1.0 : 0.0;
+  m->k = k;
+  m->nStrips = (int *) malloc(nLevels * sizeof(int));
+  memset(m->nStrips, 0, nLevels * sizeof(int));
+  m->strips = (InterImageStrip**)
+    malloc(nLevels * sizeof(InterImageStrip*));
+  memset(m->strips, 0, nLevels * sizeof(InterImageStrip*));
+  m->nSprings = (int *) malloc(nLevels * sizeof(int));
+  memset(m->nSprings, 0, nLevels * sizeof(int));
+  m->springs = (InterImageSpring**)
+    malloc(nLevels * sizeof(InterImageSpring*));
+  memset(m->springs, 0, nLevels * sizeof(InterImageSpring*));
+  m->decodedLevel = -1;
+  m->energy = 0.0;
+  m->cost = 0.0;
+  m->decodedVersion = 0;
+  m->nDecoded = 0;
+  m->decodedSize = 0;
+  m->index0 = NULL;
+  m->index1 = NULL;
+  m->offsetX = NULL;
+  m->offsetY = NULL;
+  m->weight = NULL;
+  m->dx = NULL;
+  m->dy = NULL;
+  m->kq = NULL;
+  return(m);
+}
+
+/* LinkMapImages marks both images of map m as needed by this process
+   and, if they belong to different processes, sets the bit of the other
+   owner in the sendTo mask of the one owned here */
+void
+LinkMapImages (InterImageMap *m)
+{
+  int op;
+
+  images[m->image0].needed = 1;
+  images[m->image1].needed = 1;
+  if (images[m->image0].owner == images[m->image1].owner)
+    return;
+  if (images[m->image0].owner == p)
+    {
+      op = images[m->image1].owner;
+      images[m->image0].sendTo[op >> 3] |= 0x80 >> (op & 7);
+    }
+  else
+    {
+      op = images[m->image0].owner;
+      images[m->image1].sendTo[op >> 3] |= 0x80 >> (op & 7);
+    }
+}
+
+/* BuildCommPhases constructs the commPhases array from the owners,
+   sendTo masks and needed flags of the images, leaving out the phases
+   in which no process communicates, and sizes the buffers for the
+   largest image sent or received; it must be called by every process */
+void
+BuildCommPhases ()
+{
+  int i, j;
+  int op, mp;
+  int phase;
+  int separation;
+  int nFloats;
+  int *phaseCount, *globalPhaseCount;
+  CommPhase *cp;
+
+  /* initialize the commPhases array */
+  commPhases = (CommPhase*) malloc(2 * np * sizeof(CommPhase));
+  for (i = 0; i < 2 * np; ++i)
+    {
+      cp = &(commPhases[i]);
+      separation = i >> 1;
+      if (separation == 0)
+	cp->otherProcess = -1;
+      else if (((p / separation) ^ i) & 1)
+	cp->otherProcess = p - separation;
+      else
+	cp->otherProcess = p + separation;
+      if (cp->otherProcess < 0 || cp->otherProcess >= np)
+	cp->otherProcess = -1;
+      cp->nSendImages = 0;
+      cp->sendImages = NULL;
+      cp->nSends = 0;
+      cp->nImagesToSend = NULL;
+      cp->nReceiveImages = 0;
+      cp->receiveImages = NULL;
+      cp->nReceives = 0;
+      cp->floatsToReceive = NULL;
+      cp->nImagesToReceive = NULL;
+    }
+
+  /* construct the list of images to be sent and received
+     at each communication phase */
+  Log("Constructing list of images to be sent and received\n");
+  bufferSize = 0;
+  for (i = 0; i < nImages; ++i)
+    if (images[i].owner == p)
+      {
+	for (op = 0; op < np; ++op)
+	  if (images[i].sendTo[op >> 3] & (0x80 >> (op & 7)))
+	    {
+	      separation = abs(op - p);
+	      mp = p;
+	      if (op < mp)
+		mp = op;
+	      phase = 2 * separation + ((mp / separation) & 1);
+	      cp = &(commPhases[phase]);
+	      ++(cp->nSendImages);
+	      cp->sendImages = (int *) realloc(cp->sendImages,
+					       cp->nSendImages * sizeof(int));
+	      cp->sendImages[cp->nSendImages-1] = i;
+	    }
+	nFloats = ((images[i].width + endFactor - 1) / endFactor + 1) *
+	  ((images[i].height + endFactor - 1) / endFactor + 1) * 2;
+	if (nFloats > bufferSize)
+	  bufferSize = nFloats;
+      }
+    else if (images[i].needed)
+      {
+	op = images[i].owner;
+	separation = abs(op - p);
+	mp = p;
+	if (op < mp)
+	  mp = op;
+	phase = 2 * separation + ((mp / separation) & 1);
+	cp = &(commPhases[phase]);
+	++(cp->nReceiveImages);
+	cp->receiveImages = (int *) realloc(cp->receiveImages,
+					    cp->nReceiveImages * sizeof(int));
+	cp->receiveImages[cp->nReceiveImages-1] = i;
+	nFloats = ((images[i].width + endFactor - 1) / endFactor + 1) *
+	  ((images[i].height + endFactor - 1) / endFactor + 1) * 2;
+	if (nFloats > bufferSize)
+	  bufferSize = nFloats;
+      }
+  if (bufferSize < 4096*1024)
+    bufferSize = 4096*1024;
+  buffer = (float *) realloc(buffer, bufferSize * sizeof(float));
+  if (compressQuantum > 0.0)
+    {
+      /* an encoded image takes at most one byte more than its floats */
+      compressBuffer = (unsigned char *) realloc(compressBuffer,
+						 bufferSize * sizeof(float) +
+						 nImages);
+      if (compressBuffer == NULL)
+	Error("Could not allocate compressed exchange buffer\n");
+    }
+
+  /* eliminate unnecessary phases */
+  Log("Eliminating unnecessary phases\n");
+  phaseCount = (int *) malloc(2 * np * sizeof(int));
+  memset(phaseCount, 0, 2 * np * sizeof(int));
+  globalPhaseCount = (int *) malloc(2 * np * sizeof(int));
+  for (phase = 0; phase < 2 * np; ++phase)
+    {
+      phaseCount[phase] += commPhases[phase].nSendImages;
+      phaseCount[phase] += commPhases[phase].nReceiveImages;
+    }
+  if (MPI_Allreduce(phaseCount, globalPhaseCount, 2 * np,
+		    MPI_INT, MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("MPI_Allreduce failed.\n");
+  j = 0;
+  for (i = 0; i < 2 * np; ++i)
+    if (globalPhaseCount[i] > 0 && i != j)
+      {
+	memcpy(&commPhases[j], &commPhases[i], sizeof(CommPhase));
+	++j;
+      }
+  nPhases = j;
+  commPhases = (CommPhase *) realloc(commPhases, nPhases * sizeof(CommPhase));
+  free(phaseCount);
+  free(globalPhaseCount);
+}
+
+/* FreeCommPhases releases the commPhases array and the plans made
+   for it */
+void
+FreeCommPhases ()
+{
+  int phase;
+  CommPhase *cp;
+
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      cp = &(commPhases[phase]);
+      free(cp->sendImages);
+      free(cp->nImagesToSend);
+      free(cp->receiveImages);
+      free(cp->floatsToReceive);
+      free(cp->nImagesToReceive);
+    }
+  free(commPhases);
+  commPhases = NULL;
+  nPhases = 0;
+}
+
+void
+PlanCommunications (int level)
+{
+  int phase;
+  CommPhase *cp;
+  int bufferPos;
+  int i, j, k;
+  int nFloats;
+  int nMessages;
+  char msg[PATH_MAX+256];
+
+  Log("Planning communication for level %d\n", level);
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      // schedule the communication of positions between processors
+      cp = &(commPhases[phase]);
+
+      // first, the sends
+      cp->nSends = 0;
+      bufferPos = 0;
+      k = 0;
+      for (i = 0; i < cp->nSendImages; ++i)
+	{
+	  j = cp->sendImages[i];
+	  nFloats = images[j].nx * images[j].ny * 2;
+	  if (bufferPos + nFloats > bufferSize)
+	    {
+	      ++(cp->nSends);
+	      cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
+						  cp->nSends * sizeof(int));
+	      cp->nImagesToSend[cp->nSends-1] = k;
+	      Log("In phase %d will send %d images to %d in a message of %d floats\n",
+		  phase, k, cp->otherProcess, bufferPos);
+	      k = 0;
+	      bufferPos = 0;
+	    }
+	  bufferPos += nFloats;
+	  ++k;
+	}
+      if (k > 0)
+	{
+	  ++(cp->nSends);
+	  cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
+					      cp->nSends * sizeof(int));
+	  cp->nImagesToSend[cp->nSends-1] = k;
+	  Log("In phase %d will send %d images to %d in a final message of %d floats\n",
+	      phase, k, cp->otherProcess, bufferPos);
+	}
+
+      // next, the receives
+      cp->nReceives = 0;
+      bufferPos = 0;
+      k = 0;
+      for (i = 0; i < cp->nReceiveImages; ++i)
+	{
+	  j = cp->receiveImages[i];
+	  nFloats = images[j].nx * images[j].ny * 2;
+	  if (bufferPos + nFloats > bufferSize)
+	    {
+	      ++(cp->nReceives);
+	      cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
+						    cp->nReceives * sizeof(int));
+	      cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
+						  cp->nReceives * sizeof(int));
+	      cp->floatsToReceive[cp->nReceives-1] = bufferPos;
+	      cp->nImagesToReceive[cp->nReceives-1] = k;
+	      Log("In phase %d will receive %d images from %d in a message of %d floats\n",
+		  phase, k, cp->otherProcess, bufferPos);
+	      k = 0;
+	      bufferPos = 0;
+	    }
+	  bufferPos += nFloats;
+	  ++k;
+	}
+      if (k > 0)
+	{
+	  ++(cp->nReceives);
+	  cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
+						cp->nReceives * sizeof(int));
+	  cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
+						 cp->nReceives * sizeof(int));
+	  cp->floatsToReceive[cp->nReceives-1] = bufferPos;
+	  cp->nImagesToReceive[cp->nReceives-1] = k;
+	  Log("In phase %d will receive %d images from %d in a final message of %d floats\n",
+	      phase, k, cp->otherProcess, bufferPos);
+	}
+    }
+
+  /* the positions themselves are exchanged with the same processes,
+     but in a single message to each */
+  if (compressQuantum == 0.0)
+    {
+      if (positionExchange == NULL &&
+	  (positionExchange = CreateExchange(MPI_COMM_WORLD, 0)) == NULL)
+	Error("Could not allocate position exchange\n");
+      ResetExchange(positionExchange);
+      for (phase = 0; phase < nPhases; ++phase)
+	{
+	  cp = &(commPhases[phase]);
+	  if (cp->otherProcess < 0)
+	    continue;
+	  for (i = 0; i < cp->nSendImages; ++i)
+	    {
+	      j = cp->sendImages[i];
+	      if (!AddExchangeSend(positionExchange, cp->otherProcess, j,
+				   images[j].nx * images[j].ny * 2))
+		Error("Could not allocate position exchange\n");
+	    }
+	  for (i = 0; i < cp->nReceiveImages; ++i)
+	    {
+	      j = cp->receiveImages[i];
+	      if (!AddExchangeReceive(positionExchange, cp->otherProcess, j,
+				      images[j].nx * images[j].ny * 2))
+		Error("Could not allocate position exchange\n");
+	    }
+	}
+      if (!PlanExchange(positionExchange, msg))
+	Error("%s", msg);
+    }
+  else if (overlapCommunication)
+    {
+      nFloats = 0;
+      nMessages = 0;
+      for (phase = 0; phase < nPhases; ++phase)
+	{
+	  cp = &(commPhases[phase]);
+	  if (cp->otherProcess < 0)
+	    continue;
+	  for (i = 0; i < cp->nSendImages; ++i)
+	    {
+	      j = cp->sendImages[i];
+	      nFloats += images[j].nx * images[j].ny * 2;
+	    }
+	  for (i = 0; i < cp->nReceives; ++i)
+	    nFloats += cp->floatsToReceive[i];
+	  nFloats += cp->nSendImages + cp->nReceiveImages;
+	  nMessages += cp->nSends + cp->nReceives;
+	}
+      exchangeBuffer = (float *) realloc(exchangeBuffer,
+					 (nFloats + 1) * sizeof(float));
+      exchangeRequests = (MPI_Request *) realloc(exchangeRequests,
+						 (nMessages + 1) *
+						 sizeof(MPI_Request));
+      if (exchangeBuffer == NULL || exchangeRequests == NULL)
+	Error("Could not allocate exchange buffers of %d floats\n", nFloats);
+    }
+  if (hierarchicalCommunication)
+    PlanNodeExchange(level);
+  nPositionExchanges = 0;
+}
+
+
+void
+CommunicatePositions (int level)
+{
+  /* communicate image positions to other nodes */
+  //      (min(a,b) / sep) & 1 == 0  : first phase
+  //      (min(a,b) / sep) & 1 == 1  : second phase
+  
+  //	  0-1,2-3,4-5,6-7,8-9,10-11,12-13      0,2,4,6,8,10,12
+  //        1-2,3-4,5-6,7-8,9-10,11-12,13-14   1,3,5,7,9,11,13
+  //      sep 1, 
+
+  //      0-2,1-3,4-6,5-7,8-10,9-11,12-14      0,1,4,5,8,9,12
+  //      2-4,3-5,6-8,7-9,10-12,11-13          2,3,6,7,10,11
+  //      sep 2
+
+  //      0-3,1-4,2-5,6-9,7-10,8-11            0,1,2,6,7,8
+  //      3-6,4-7,5-8,9-12,10-13,11-14         3,4,5,9,10,11
+  
+  //      0-4,1-5,2-6,3-7,8-12,9-13,10-14
+  //      4-8,5-9,6-10,7-11
+
+  //      0-5,1-6,2-7,3-8,4-9
+  //      5-10,6-11,7-12,8-13,9-14
+
+  //      0-6,1-7,2-8,3-9,4-10,5-11
+  //      6-12,7-13,8-14
+
+  //      0-7,1-8,2-9,3-10,4-11,5-12,6-13
+  //      7-14
+
+  //      0-8,1-9,2-10,3-11,4-12,5-13,6-14
+  //      none
+
+  //      0-9,1-10,2-11,3-12,4-13,5-14
+  //      none
+
+  //      0-10,1-11,2-12,3-13,4-14
+  //      none
+
+  //      0-11,1-12,2-13,3-14
+  //      none
+
+  //      0-12,1-13,2-14
+  //      none
+
+  //      0-13,1-14
+  //      none
+
+  //      0-14
+  //      none
+  int phase;
+  int op;
+  int subPhase;
+  int i, j;
+  int jj;
+  int its;
+  MPI_Status status;
+  unsigned char *b;
+
+  /* the positions themselves go through the persistent requests
+     of positionExchange, to all the other processes at once */
+  if (compressQuantum == 0.0)
+    {
+      StartPositionExchange();
+      FinishPositionExchange();
+      return;
+    }
+
+  EncodeSentPositions();
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
+	Error("MPI_Barrier() failed.\n");
+      op = commPhases[phase].otherProcess;
+      if (op < 0)
+	continue;
+      for (subPhase = 0; subPhase < 2; ++subPhase)
+	{
+	  if (subPhase ^ (p < op))
+	    {
+	      /* send */
+	      jj = 0;
+	      for (i = 0; i < commPhases[phase].nSends; ++i)
+		{
+		  b = compressBuffer;
+		  for (j = 0; j < commPhases[phase].nImagesToSend[i];
+		       ++j, ++jj)
+		    {
+		      its = commPhases[phase].sendImages[jj];
+		      memcpy(b, images[its].encoded, images[its].nEncoded);
+		      b += images[its].nEncoded;
+		    }
+		  if (MPI_Send(compressBuffer, b - compressBuffer, MPI_BYTE,
+			       op, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+		    Error("Could not send to process %d\n", op);
+		  MetricsCount("position_bytes_sent", b - compressBuffer);
+		}
+	    }
+	  else
+	    {
+	      /* receive */
+	      jj = 0;
+	      for (i = 0; i < commPhases[phase].nReceives; ++i)
+		{
+		  if (MPI_Recv(compressBuffer,
+			       commPhases[phase].floatsToReceive[i] *
+			       sizeof(float) +
+			       commPhases[phase].nImagesToReceive[i],
+			       MPI_BYTE, op, 0, MPI_COMM_WORLD,
+			       &status) != MPI_SUCCESS)
+		    Error("Could not receive from process %d\n", op);
+		  b = compressBuffer;
+		  for (j = 0; j < commPhases[phase].nImagesToReceive[i];
+		       ++j, ++jj)
+		    b = DecodePositions(b,
+					commPhases[phase].receiveImages[jj]);
+		}
+	    }
+	}
+    }
+  ++nPositionExchanges;
+}
+
+/* StartPositionExchange starts the sends and receives to and from
+   all the other processes at once; the received positions are only
+   stored into the nodes by FinishPositionExchange, and the nodes of
+   the images this process owns may be read, but not moved, until then */
+void
+StartPositionExchange ()
+{
+  int phase;
+  int op;
+  int i, j;
+  int jj;
+  int pos, start;
+  int its;
+  CommPhase *cp;
+  unsigned char *b;
+  char msg[PATH_MAX+256];
+
+  if (compressQuantum == 0.0)
+    {
+      if (!StartExchange(positionExchange, PackPositions, msg))
+	Error("%s", msg);
+      MetricsCount("position_bytes_sent",
+		   positionExchange->nSendFloats * sizeof(float));
+      exchangePending = 1;
+      ++nPositionExchanges;
+      return;
+    }
+
+  /* the encoded positions vary in length, so they are sent with
+     requests of their own; the receive areas come first, in phase
+     order, so that FinishPositionExchange can find them, and each
+     has a float to spare for each image */
+  EncodeSentPositions();
+  pos = 0;
+  nExchangeRequests = 0;
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      cp = &(commPhases[phase]);
+      op = cp->otherProcess;
+      if (op < 0)
+	continue;
+      for (i = 0; i < cp->nReceives; ++i)
+	{
+	  if (MPI_Irecv(&exchangeBuffer[pos],
+			(cp->floatsToReceive[i] + cp->nImagesToReceive[i]) *
+			sizeof(float),
+			MPI_BYTE, op, 0, MPI_COMM_WORLD,
+			&exchangeRequests[nExchangeRequests++]) !=
+	      MPI_SUCCESS)
+	    Error("Could not receive from process %d\n", op);
+	  pos += cp->floatsToReceive[i] + cp->nImagesToReceive[i];
+	}
+    }
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      cp = &(commPhases[phase]);
+      op = cp->otherProcess;
+      if (op < 0)
+	continue;
+      jj = 0;
+      for (i = 0; i < cp->nSends; ++i)
+	{
+	  start = pos;
+	  b = (unsigned char *) &exchangeBuffer[start];
+	  for (j = 0; j < cp->nImagesToSend[i]; ++j, ++jj)
+	    {
+	      its = cp->sendImages[jj];
+	      memcpy(b, images[its].encoded, images[its].nEncoded);
+	      b += images[its].nEncoded;
+	    }
+	  if (MPI_Isend(&exchangeBuffer[start],
+			b - (unsigned char *) &exchangeBuffer[start],
+			MPI_BYTE, op, 0, MPI_COMM_WORLD,
+			&exchangeRequests[nExchangeRequests++]) !=
+	      MPI_SUCCESS)
+	    Error("Could not send to process %d\n", op);
+	  MetricsCount("position_bytes_sent",
+		       b - (unsigned char *) &exchangeBuffer[start]);
+	  pos += (b - (unsigned char *) &exchangeBuffer[start] +
+		  sizeof(float) - 1) / sizeof(float);
+	}
+    }
+  exchangePending = 1;
+  ++nPositionExchanges;
+}
+
+/* FinishPositionExchange waits for the exchange begun by
+   StartPositionExchange, if any, and stores the received positions */
+void
+FinishPositionExchange ()
+{
+  int phase;
+  int i, j;
+  int jj;
+  int pos;
+  CommPhase *cp;
+  unsigned char *b;
+  char msg[PATH_MAX+256];
+
+  if (!exchangePending)
+    return;
+  exchangePending = 0;
+  if (compressQuantum == 0.0)
+    {
+      if (!FinishExchange(positionExchange, UnpackPositions, msg))
+	Error("%s", msg);
+      return;
+    }
+
+  if (MPI_Waitall(nExchangeRequests, exchangeRequests,
+		  MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+    Error("MPI_Waitall() failed.\n");
+  pos = 0;
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      cp = &(commPhases[phase]);
+      if (cp->otherProcess < 0)
+	continue;
+      jj = 0;
+      for (i = 0; i < cp->nReceives; ++i)
+	{
+	  b = (unsigned char *) &exchangeBuffer[pos];
+	  for (j = 0; j < cp->nImagesToReceive[i]; ++j, ++jj)
+	    b = DecodePositions(b, cp->receiveImages[jj]);
+	  pos += cp->floatsToReceive[i] + cp->nImagesToReceive[i];
+	}
+    }
+}
+
+/* PackPositions and UnpackPositions copy the node positions of image
+   its (x and y of each node) to and from the values of an exchange */
+void
+PackPositions (int its, float *v)
+{
+  int k;
+  int nNodes;
+  Node *nodes;
+
+  nNodes = images[its].nx * images[its].ny;
+  nodes = images[its].nodes;
+  for (k = 0; k < nNodes; ++k)
+    {
+      *v++ = nodes[k].x;
+      *v++ = nodes[k].y;
+    }
+}
+
+void
+UnpackPositions (int its, float *v)
+{
+  int k;
+  int nNodes;
+  Node *nodes;
+
+  nNodes = images[its].nx * images[its].ny;
+  nodes = images[its].nodes;
+  for (k = 0; k < nNodes; ++k)
+    {
+      nodes[k].x = *v++;
+      nodes[k].y = *v++;
+    }
+}
+
+/* EncodeSentPositions encodes, for the exchange about to start, the
+   positions of each image this process sends; every fullExchangeInterval
+   exchanges, and whenever the changes do not fit in 16 bits, the floats
+   are sent as they are, so that the positions the receivers hold never
+   drift from the true ones by more than half a quantum */
+void
+EncodeSentPositions ()
+{
+  int phase;
+  int i;
+  int its;
+  int full;
+  CommPhase *cp;
+
+  full = (nPositionExchanges % fullExchangeInterval) == 0;
+  ++nEncodings;
+  for (phase = 0; phase < nPhases; ++phase)
+    {
+      cp = &(commPhases[phase]);
+      if (cp->otherProcess < 0)
+	continue;
+      for (i = 0; i < cp->nSendImages; ++i)
+	{
+	  its = cp->sendImages[i];
+	  if (images[its].encodedAt == nEncodings)
+	    continue;
+	  EncodePositions(its, full);
+	  images[its].encodedAt = nEncodings;
+	}
+    }
+}
+
+/* EncodePositions encodes the positions of image its into its encoded
+   bytes.  The first byte is 0 if the floats follow as they are, and 1
+   if they follow as the changes from exchanged in quanta, each coded
+   as a byte (-127 to 127), as 0x80 and two bytes (little-endian), or,
+   for a run of up to 255 zeros, as 0 and the length of the run;
+   exchanged is updated to what the receivers will then hold. */
+void
+EncodePositions (int its, int full)
+{
+  Image *im;
+  float *ex;
+  unsigned char *b;
+  int n;
+  int k;
+  int zeros;
+  int q;
+  float v;
+
+  im = &images[its];
+  n = 2 * im->nx * im->ny;
+  if (im->nExchanged != n)
+    {
+      im->exchanged = (float *) realloc(im->exchanged, n * sizeof(float));
+      im->encoded = (unsigned char *) realloc(im->encoded,
+					      n * sizeof(float) + 1);
+      if (im->exchanged == NULL || im->encoded == NULL)
+	Error("Could not allocate exchange state of image %s\n", im->name);
+      im->nExchanged = n;
+      full = 1;
+    }
+  ex = im->exchanged;
+
+  if (!full)
+    {
+      b = im->encoded;
+      *b++ = 1;
+      zeros = 0;
+      for (k = 0; k < n; ++k)
+	{
+	  v = (k & 1) ? im->nodes[k >> 1].y : im->nodes[k >> 1].x;
+	  q = (int) floor((v - ex[k]) / compressQuantum + 0.5);
+	  if (q < -32768 || q > 32767 ||
+	      b - im->encoded + 5 > n * sizeof(float))
+	    {
+	      /* not worth encoding */
+	      full = 1;
+	      break;
+	    }
+	  if (q == 0)
+	    {
+	      if (++zeros == 255)
+		{
+		  *b++ = 0;
+		  *b++ = zeros;
+		  zeros = 0;
+		}
+	      continue;
+	    }
+	  if (zeros > 0)
+	    {
+	      *b++ = 0;
+	      *b++ = zeros;
+	      zeros = 0;
+	    }
+	  if (q >= -127 && q <= 127)
+	    *b++ = (unsigned char) (signed char) q;
+	  else
+	    {
+	      *b++ = 0x80;
+	      *b++ = q & 0xff;
+	      *b++ = (q >> 8) & 0xff;
+	    }
+	  ex[k] += q * compressQuantum;
+	}
+      if (!full && zeros > 0)
+	{
+	  *b++ = 0;
+	  *b++ = zeros;
+	}
+    }
+
+  if (full)
+    {
+      b = im->encoded;
+      *b++ = 0;
+      for (k = 0; k < n; ++k)
+	{
+	  ex[k] = (k & 1) ? im->nodes[k >> 1].y : im->nodes[k >> 1].x;
+	  memcpy(b, &ex[k], sizeof(float));
+	  b += sizeof(float);
+	}
+    }
+  im->nEncoded = b - im->encoded;
+}
+
+/* DecodePositions sets the positions of image its from the bytes
+   encoded by EncodePositions at b, and returns the position after
+   them */
+unsigned char *
+DecodePositions (unsigned char *b, int its)
+{
+  Image *im;
+  float *ex;
+  int n;
+  int k;
+  int q;
+  int run;
+
+  im = &images[its];
+  n = 2 * im->nx * im->ny;
+  if (im->nExchanged != n)
+    {
+      if (*b != 0)
+	Error("Changes to the positions of image %s arrived before the positions\n",
+	      im->name);
+      im->exchanged = (float *) realloc(im->exchanged, n * sizeof(float));
+      if (im->exchanged == NULL)
+	Error("Could not allocate exchange state of image %s\n", im->name);
+      im->nExchanged = n;
+    }
+  ex = im->exchanged;
+
+  if (*b++ == 0)
+    for (k = 0; k < n; ++k)
+      {
+	memcpy(&ex[k], b, sizeof(float));
+	b += sizeof(float);
+      }
+  else
+    for (k = 0; k < n; )
+      {
+	if (*b == 0)
+	  {
+	    run = b[1];
+	    b += 2;
+	    k += run;
+	    continue;
+	  }
+	if (*b == 0x80)
+	  {
+	    q = (short) (b[1] | (b[2] << 8));
+	    b += 3;
+	  }
+	else
+	  q = (signed char) *b++;
+	ex[k++] += q * compressQuantum;
+      }
+
+  for (k = 0; k < n; k += 2)
+    {
+      im->nodes[k >> 1].x = ex[k];
+      im->nodes[k >> 1].y = ex[k+1];
+    }
+  return(b);
+}
+
+/* SetUpNodeExchange groups the processes by node and decides which
+   images are kept in each node's shared position area and which of
+   them each node's leader sends to and receives from the leaders of
+   the other nodes; it must be called by every process, after the
+   sendTo masks and needed flags of the images are known */
+void
+SetUpNodeExchange ()
+{
+  int i, j, k, n;
+  int op;
+  int nodeSize;
+  int nSend, nReceive;
+  int pairs;
+  int maxSize;
+  unsigned char *inNode;
+  int *receiveCount, *sendCount;
+  int *receivePos;
+  MPI_Aint size;
+  int dispUnit;
+  float *base;
+
+  if (MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, p,
+			  MPI_INFO_NULL, &nodeComm) != MPI_SUCCESS ||
+      MPI_Comm_rank(nodeComm, &nodeRank) != MPI_SUCCESS ||
+      MPI_Comm_size(nodeComm, &nodeSize) != MPI_SUCCESS ||
+      MPI_Comm_split(MPI_COMM_WORLD, nodeRank == 0 ? 0 : MPI_UNDEFINED, p,
+		     &leaderComm) != MPI_SUCCESS)
+    Error("Could not create the node communicators\n");
+  if (nodeRank == 0 &&
+      (MPI_Comm_rank(leaderComm, &myNode) != MPI_SUCCESS ||
+       MPI_Comm_size(leaderComm, &nNodes) != MPI_SUCCESS))
+    Error("Could not find the number of nodes\n");
+  processNode = (int *) malloc(np * sizeof(int));
+  if (MPI_Bcast(&myNode, 1, MPI_INT, 0, nodeComm) != MPI_SUCCESS ||
+      MPI_Bcast(&nNodes, 1, MPI_INT, 0, nodeComm) != MPI_SUCCESS ||
+      MPI_Allgather(&myNode, 1, MPI_INT, processNode, 1, MPI_INT,
+		    MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not share the node numbers\n");
+
+  /* the images some process of this node sends or receives */
+  inNode = (unsigned char *) malloc(nImages);
+  memset(inNode, 0, nImages);
+  for (i = 0; i < nImages; ++i)
+    if (images[i].owner == p)
+      {
+	for (op = 0; op < np; ++op)
+	  if (images[i].sendTo[op >> 3] & (0x80 >> (op & 7)))
+	    {
+	      inNode[i] = 1;
+	      break;
+	    }
+      }
+    else if (images[i].needed)
+      inNode[i] = 1;
+  if (MPI_Allreduce(MPI_IN_PLACE, inNode, nImages, MPI_UNSIGNED_CHAR,
+		    MPI_MAX, nodeComm) != MPI_SUCCESS)
+    Error("Could not combine the images of the node\n");
+  nNodeImages = 0;
+  nodeImages = (int *) malloc((nImages + 1) * sizeof(int));
+  nodeOffset = (int *) malloc(nImages * sizeof(int));
+  nodeFloats = (int *) malloc(nImages * sizeof(int));
+  maxSize = 0;
+  for (i = 0; i < nImages; ++i)
+    {
+      nodeOffset[i] = -1;
+      nodeFloats[i] = 0;
+      if (!inNode[i])
+	continue;
+      nodeOffset[i] = 0;
+      nodeImages[nNodeImages++] = i;
+      maxSize += ((images[i].width + endFactor - 1) / endFactor + 1) *
+	((images[i].height + endFactor - 1) / endFactor + 1) * 2;
+    }
+  free(inNode);
+
+  /* the area is only allocated by the leader, and is large enough
+     for the end level */
+  nodeAreaSize = maxSize;
+  if (MPI_Win_allocate_shared(nodeRank == 0 ?
+			      (MPI_Aint) 2 * (maxSize + 1) * sizeof(float) : 0,
+			      sizeof(float), MPI_INFO_NULL, nodeComm,
+			      &base, &nodeWin) != MPI_SUCCESS ||
+      MPI_Win_shared_query(nodeWin, 0, &size, &dispUnit,
+			   &nodePositions) != MPI_SUCCESS ||
+      MPI_Win_lock_all(MPI_MODE_NOCHECK, nodeWin) != MPI_SUCCESS)
+    Error("Could not allocate the shared position area of %d floats\n",
+	  2 * maxSize);
+
+  if (nodeRank != 0)
+    {
+      Log("Node %d has %d processes and shares %d images\n",
+	  myNode, nodeSize, nNodeImages);
+      return;
+    }
+
+  /* the leader receives every image of the area owned on another
+     node from that node's leader, and tells that leader to send it */
+  receiveCount = (int *) malloc(nNodes * sizeof(int));
+  sendCount = (int *) malloc(nNodes * sizeof(int));
+  memset(receiveCount, 0, nNodes * sizeof(int));
+  for (k = 0; k < nNodeImages; ++k)
+    {
+      n = processNode[images[nodeImages[k]].owner];
+      if (n != myNode)
+	++receiveCount[n];
+    }
+  nodeReceiveStart = (int *) malloc((nNodes + 1) * sizeof(int));
+  nodeSendStart = (int *) malloc((nNodes + 1) * sizeof(int));
+  nodeReceiveStart[0] = 0;
+  for (n = 0; n < nNodes; ++n)
+    nodeReceiveStart[n+1] = nodeReceiveStart[n] + receiveCount[n];
+  nReceive = nodeReceiveStart[nNodes];
+  nodeReceiveImages = (int *) malloc((nReceive + 1) * sizeof(int));
+  receivePos = (int *) malloc(nNodes * sizeof(int));
+  memcpy(receivePos, nodeReceiveStart, nNodes * sizeof(int));
+  for (k = 0; k < nNodeImages; ++k)
+    {
+      i = nodeImages[k];
+      n = processNode[images[i].owner];
+      if (n != myNode)
+	nodeReceiveImages[receivePos[n]++] = i;
+    }
+  if (MPI_Alltoall(receiveCount, 1, MPI_INT, sendCount, 1, MPI_INT,
+		   leaderComm) != MPI_SUCCESS)
+    Error("Could not exchange the numbers of images between nodes\n");
+  nodeSendStart[0] = 0;
+  for (n = 0; n < nNodes; ++n)
+    nodeSendStart[n+1] = nodeSendStart[n] + sendCount[n];
+  nSend = nodeSendStart[nNodes];
+  nodeSendImages = (int *) malloc((nSend + 1) * sizeof(int));
+  if (MPI_Alltoallv(nodeReceiveImages, receiveCount, nodeReceiveStart,
+		    MPI_INT, nodeSendImages, sendCount, nodeSendStart,
+		    MPI_INT, leaderComm) != MPI_SUCCESS)
+    Error("Could not exchange the lists of images between nodes\n");
+  for (j = 0; j < nSend; ++j)
+    if (nodeOffset[nodeSendImages[j]] < 0 ||
+	processNode[images[nodeSendImages[j]].owner] != myNode)
+      Error("Node %d was asked for image %s, which it does not share\n",
+	    myNode, images[nodeSendImages[j]].name);
+  pairs = 0;
+  for (n = 0; n < nNodes; ++n)
+    pairs += (sendCount[n] > 0) + (receiveCount[n] > 0);
+  Log("Node %d has %d processes and shares %d images; its leader sends %d and receives %d images in %d messages\n",
+      myNode, nodeSize, nNodeImages, nSend, nReceive, pairs);
+  nodeSendFloats = (int *) malloc((nNodes + 1) * sizeof(int));
+  nodeReceiveFloats = (int *) malloc((nNodes + 1) * sizeof(int));
+  nodeRequests = (MPI_Request *) malloc((2 * nNodes + 1) *
+					sizeof(MPI_Request));
+  free(receiveCount);
+  free(sendCount);
+  free(receivePos);
+}
+
+/* FreeNodeExchange releases what SetUpNodeExchange set up, so that it
+   can be set up again after images have changed hands */
+void
+FreeNodeExchange ()
+{
+  if (MPI_Win_unlock_all(nodeWin) != MPI_SUCCESS ||
+      MPI_Win_free(&nodeWin) != MPI_SUCCESS)
+    Error("Could not free the shared position area\n");
+  nodePositions = NULL;
+  if (leaderComm != MPI_COMM_NULL)
+    MPI_Comm_free(&leaderComm);
+  MPI_Comm_free(&nodeComm);
+  free(processNode);
+  processNode = NULL;
+  free(nodeImages);
+  nodeImages = NULL;
+  free(nodeOffset);
+  nodeOffset = NULL;
+  free(nodeFloats);
+  nodeFloats = NULL;
+  free(nodeReceiveStart);
+  nodeReceiveStart = NULL;
+  free(nodeSendStart);
+  nodeSendStart = NULL;
+  free(nodeReceiveImages);
+  nodeReceiveImages = NULL;
+  free(nodeSendImages);
+  nodeSendImages = NULL;
+  free(nodeSendFloats);
+  nodeSendFloats = NULL;
+  free(nodeReceiveFloats);
+  nodeReceiveFloats = NULL;
+  free(nodeRequests);
+  nodeRequests = NULL;
+  free(nodeBuffer);
+  nodeBuffer = NULL;
+}
+
+/* PlanNodeExchange lays out the shared position area and the leader's
+   messages for the node sizes at the given level */
+void
+PlanNodeExchange (int level)
+{
+  int i, j, k, n;
+  int pos;
+  int lFactor;
+
+  lFactor = 1 << level;
+  pos = 0;
+  for (k = 0; k < nNodeImages; ++k)
+    {
+      i = nodeImages[k];
+      nodeOffset[i] = pos;
+      nodeFloats[i] = ((images[i].width + lFactor - 1) / lFactor + 1) *
+	((images[i].height + lFactor - 1) / lFactor + 1) * 2;
+      pos += nodeFloats[i];
+    }
+  if (pos > nodeAreaSize)
+    Error("Shared position area of %d floats is too small for level %d\n",
+	  nodeAreaSize, level);
+  if (nodeRank != 0)
+    return;
+
+  pos = 0;
+  for (n = 0; n < nNodes; ++n)
+    {
+      nodeReceiveFloats[n] = pos;
+      for (j = nodeReceiveStart[n]; j < nodeReceiveStart[n+1]; ++j)
+	{
+	  pos += nodeFloats[nodeReceiveImages[j]];
+	}
+    }
+  nodeReceiveFloats[nNodes] = pos;
+  for (n = 0; n < nNodes; ++n)
+    {
+      nodeSendFloats[n] = pos;
+      for (j = nodeSendStart[n]; j < nodeSendStart[n+1]; ++j)
+	{
+	  pos += nodeFloats[nodeSendImages[j]];
+	}
+    }
+  nodeSendFloats[nNodes] = pos;
+  nodeBuffer = (float *) realloc(nodeBuffer, (pos + 1) * sizeof(float));
+  if (nodeBuffer == NULL)
+    Error("Could not allocate node exchange buffer of %d floats\n", pos);
+}
+
+/* ExchangeNodePositions gives every process the positions of the
+   images it needs but does not own: each process copies the images
+   it owns into the node's shared area; the leader then sends the
+   ones other nodes need in one message per node, and stores the ones
+   it receives into the area; finally each process copies what it
+   needs out of the area */
+void
+ExchangeNodePositions ()
+{
+  int i, j, k, n;
+  int nNodes1;
+  int nReq;
+  Node *nodes;
+  float *area;
+  float *b;
+
+  area = &nodePositions[nodeParity * (nodeAreaSize + 1)];
+  nodeParity ^= 1;
+  for (k = 0; k < nNodeImages; ++k)
+    {
+      i = nodeImages[k];
+      if (images[i].owner != p)
+	continue;
+      nNodes1 = images[i].nx * images[i].ny;
+      nodes = images[i].nodes;
+      b = &area[nodeOffset[i]];
+      for (j = 0; j < nNodes1; ++j)
+	{
+	  *b++ = nodes[j].x;
+	  *b++ = nodes[j].y;
+	}
+    }
+  MPI_Win_sync(nodeWin);
+  if (MPI_Barrier(nodeComm) != MPI_SUCCESS)
+    Error("MPI_Barrier() failed.\n");
+  MPI_Win_sync(nodeWin);
+
+  if (nodeRank == 0 && nNodes > 1)
+    {
+      nReq = 0;
+      for (n = 0; n < nNodes; ++n)
+	if (nodeReceiveFloats[n+1] > nodeReceiveFloats[n] &&
+	    MPI_Irecv(&nodeBuffer[nodeReceiveFloats[n]],
+		      nodeReceiveFloats[n+1] - nodeReceiveFloats[n],
+		      MPI_FLOAT, n, 0, leaderComm,
+		      &nodeRequests[nReq++]) != MPI_SUCCESS)
+	  Error("Could not receive from node %d\n", n);
+      for (n = 0; n < nNodes; ++n)
+	{
+	  if (nodeSendFloats[n+1] == nodeSendFloats[n])
+	    continue;
+	  b = &nodeBuffer[nodeSendFloats[n]];
+	  for (j = nodeSendStart[n]; j < nodeSendStart[n+1]; ++j)
+	    {
+	      i = nodeSendImages[j];
+	      memcpy(b, &area[nodeOffset[i]], nodeFloats[i] * sizeof(float));
+	      b += nodeFloats[i];
+	    }
+	  if (MPI_Isend(&nodeBuffer[nodeSendFloats[n]],
+			nodeSendFloats[n+1] - nodeSendFloats[n],
+			MPI_FLOAT, n, 0, leaderComm,
+			&nodeRequests[nReq++]) != MPI_SUCCESS)
+	    Error("Could not send to node %d\n", n);
+	}
+      if (MPI_Waitall(nReq, nodeRequests, MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+	Error("MPI_Waitall() failed.\n");
+      b = nodeBuffer;
+      for (j = 0; j < nodeReceiveStart[nNodes]; ++j)
+	{
+	  i = nodeReceiveImages[j];
+	  memcpy(&area[nodeOffset[i]], b, nodeFloats[i] * sizeof(float));
+	  b += nodeFloats[i];
+	}
+      MPI_Win_sync(nodeWin);
+    }
+  if (nNodes > 1)
+    {
+      if (MPI_Barrier(nodeComm) != MPI_SUCCESS)
+	Error("MPI_Barrier() failed.\n");
+      MPI_Win_sync(nodeWin);
+    }
+
+  for (k = 0; k < nNodeImages; ++k)
+    {
+      i = nodeImages[k];
+      if (images[i].owner == p || !images[i].needed)
+	continue;
+      nNodes1 = images[i].nx * images[i].ny;
+      nodes = images[i].nodes;
+      b = &area[nodeOffset[i]];
+      for (j = 0; j < nNodes1; ++j)
+	{
+	  nodes[j].x = *b++;
+	  nodes[j].y = *b++;
+	}
+    }
+}
+
+/* ExchangeAllPositions gives every process the current positions of
+   the images it needs, by whichever exchange the iterations use */
+void
+ExchangeAllPositions (int level)
+{
+  /* these positions are used for more than the next iteration, so
+     compressed positions are brought fully up to date */
+  nPositionExchanges = 0;
+  if (hierarchicalCommunication)
+    ExchangeNodePositions();
+  else if (overlapCommunication)
+    {
+      StartPositionExchange();
+      FinishPositionExchange();
+    }
+  else
+    CommunicatePositions(level);
+}
+
+/* ImageEnergies finds, for every image, the energy of its intra-image
+   springs and of the springs of every map it is part of; every
+   process gets the energies of all images */
+void
+ImageEnergies (int level, double *e)
+{
+  int i, k;
+  double energy;
+
+  ExchangeAllPositions(level);
+  memset(e, 0, nImages * sizeof(double));
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      energy = 0.0;
+      ImageForces(i, level, &energy);
+      e[i] += energy;
+    }
+  /* a map's energy is only counted by the owner of its first image */
+  for (k = 0; k < nMaps; ++k)
+    {
+      energy = 0.0;
+      MapForces(k, level, &energy, NULL);
+      e[maps[k].image0] += energy;
+      e[maps[k].image1] += energy;
+    }
+  if (MPI_Allreduce(MPI_IN_PLACE, e, nImages, MPI_DOUBLE, MPI_SUM,
+		    MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not sum the energies of the images\n");
+}
+
+/* SettleImages compares the energy of each image at the end of the
+   given level to the one at its start, and settles the images that,
+   along with every image they share a map with, changed by less than
+   settleThreshold of their starting energy; settled images are still
+   refined to the finer levels, but no longer move, and the springs
+   among them are no longer computed */
+void
+SettleImages (int level)
+{
+  int i, k;
+  int nSettled, nNewlySettled;
+  double *e;
+  unsigned char *active;
+
+  e = (double *) malloc(nImages * sizeof(double));
+  ImageEnergies(level, e);
+
+  /* every process finds the same images still active */
+  active = (unsigned char *) malloc(nImages);
+  memset(active, 0, nImages);
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    if (!images[i].settled && !images[i].fixed &&
+	fabs(e[i] - settleEnergy[i]) > settleThreshold * settleEnergy[i])
+      active[i] = 1;
+  if (MPI_Allreduce(MPI_IN_PLACE, active, nImages, MPI_UNSIGNED_CHAR,
+		    MPI_MAX, MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not share the active images\n");
+
+  /* and their neighbors are kept active too; as a process only has
+     the maps of the images it owns, the neighbors are also shared */
+  for (k = 0; k < nMaps; ++k)
+    {
+      if (active[maps[k].image0] & 1)
+	active[maps[k].image1] |= 2;
+      if (active[maps[k].image1] & 1)
+	active[maps[k].image0] |= 2;
+    }
+  if (MPI_Allreduce(MPI_IN_PLACE, active, nImages, MPI_UNSIGNED_CHAR,
+		    MPI_BOR, MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not share the active images\n");
+
+  nSettled = 0;
+  nNewlySettled = 0;
+  for (i = 0; i < nImages; ++i)
+    {
+      if (!images[i].settled && !images[i].fixed && !active[i])
+	{
+	  images[i].settled = 1;
+	  ++nNewlySettled;
+	}
+      nSettled += images[i].settled;
+    }
+  if (p == 0)
+    Log("After level %d, %d images settled (%d in all, of %d)\n",
+	level, nNewlySettled, nSettled, nImages);
+  MetricsCount("images_settled", nNewlySettled);
+  free(active);
+  free(e);
+}
+
+/* RebalanceImages is called by every process at the boundary between
+   prevLevel and level, once the nodes have been refined; the work of
+   each image at the new level is estimated from the seconds its forces,
+   and those of its maps, took at prevLevel, scaled by the growth of its
+   nodes and of the maps' springs.  If the busiest process would then
+   have more than rebalanceThreshold over the average, the images, kept
+   in their order by process, are cut into np runs of about equal work,
+   and each run is moved to its process by MigrateImages. */
+void
+RebalanceImages (int prevLevel, int level)
+{
+  int i, k, r;
+  int n0, n1;
+  int pFactor;
+  int nMoved;
+  int *owners;
+  int *start;
+  int *order;
+  double w;
+  double total, before;
+  double maxLoad, newMaxLoad;
+  double *cost, *totalCost;
+  double *load;
+  InterImageMap *m;
+
+  cost = (double *) malloc(nImages * sizeof(double));
+  totalCost = (double *) malloc(nImages * sizeof(double));
+  owners = (int *) malloc(nImages * sizeof(int));
+  if (cost == NULL || totalCost == NULL || owners == NULL)
+    Error("Could not allocate rebalancing tables.\n");
+  memset(cost, 0, nImages * sizeof(double));
+  pFactor = 1 << prevLevel;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      n0 = ((images[i].width + pFactor - 1) / pFactor + 1) *
+	((images[i].height + pFactor - 1) / pFactor + 1);
+      n1 = images[i].nx * images[i].ny;
+      cost[i] += images[i].cost * n1 / n0;
+      images[i].cost = 0.0;
+    }
+  for (k = 0; k < nMaps; ++k)
+    {
+      m = &maps[k];
+      n0 = m->nSprings[startLevel - prevLevel];
+      n1 = m->nSprings[startLevel - level];
+      w = (n0 > 0) ? m->cost * n1 / n0 : 0.0;
+      m->cost = 0.0;
+      /* a map between two images owned here is only computed once,
+	 and one between processes is computed by both */
+      if (images[m->image0].owner == p && images[m->image1].owner == p)
+	{
+	  cost[m->image0] += 0.5 * w;
+	  cost[m->image1] += 0.5 * w;
 	}
+      else if (images[m->image0].owner == p)
+	cost[m->image0] += w;
+      else
+	cost[m->image1] += w;
+    }
+  if (MPI_Reduce(cost, totalCost, nImages, MPI_DOUBLE, MPI_SUM, 0,
+		 MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not gather the work of the images\n");
 
-      count = 0;
-      for (y = 0; y < ny1; ++y)
-	for (x = 0; x < nx1; ++x)
-	  {
-	    if (nodes1[y * nx1 + x].x > 0.5 * UNSPECIFIED)
-	      continue;
-	    ++count;
-	    xv = x / dFactor;
-	    yv = y / dFactor;
-	    ixv = (int) floor(xv);
-	    iyv = (int) floor(yv);
-	    rrx = xv - ixv;
-	    rry = yv - iyv;
-	    while (ixv >= nx-1)
-	      {
-		--ixv;
-		rrx += 1.0;
-	      }
-	    while (iyv >= ny-1)
-	      {
-		--iyv;
-		rry += 1.0;
-	      }
-	    rx00 = nodes[iyv * nx + ixv].x;
-	    ry00 = nodes[iyv * nx + ixv].y;
-	    rx01 = nodes[(iyv+1) * nx + ixv].x;
-	    ry01 = nodes[(iyv+1) * nx + ixv].y;
-	    rx10 = nodes[iyv * nx + ixv + 1].x;
-	    ry10 = nodes[iyv * nx + ixv + 1].y;
-	    rx11 = nodes[(iyv+1) * nx + ixv + 1].x;
-	    ry11 = nodes[(iyv+1) * nx + ixv + 1].y;
-	    if (rx00 > 0.5 * UNSPECIFIED ||
-		rx01 > 0.5 * UNSPECIFIED && rry != 0.0 ||
-		rx10 > 0.5 * UNSPECIFIED && rrx != 0.0 ||
-		rx11 > 0.5 * UNSPECIFIED && rrx != 0.0 && rry != 0.0)
-	      Error("RefinePositions: could not interpolate from invalid nodes (image = %s x = %d y = %d nx1 = %d ny1 = %d ixv = %d, iyv = %d nx = %d ny = %d xv = %f yv = %f rrx = %f rry = %f dFactor = %f)\n",
-		    images[i].name, x, y, nx1, ny1,
-		    ixv, iyv, nx, ny,
-		    xv, yv, rrx, rry, dFactor);
-	    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-	      - rx10 * rrx * (rry - 1.0) 
-	      - rx01 * (rrx - 1.0) * rry
-	      + rx11 * rrx * rry;
-	    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-	      - ry10 * rrx * (rry - 1.0) 
-	      - ry01 * (rrx - 1.0) * rry
-	      + ry11 * rrx * rry;
-
-	    if (nodes1[y * nx1 + x].fx < 0.5 * CONSTRAINED)
-	      nodes1[y * nx1 + x].x = dFactor * rx;
-	    //	    else
-	    //	      Log("Constrained x of (%d %d)\n", x, y);
-	    if (nodes1[y * nx1 + x].fy < 0.5 * CONSTRAINED)
-	      nodes1[y * nx1 + x].y = dFactor * ry;
-	    //	    else
-	    //	      Log("Constrained y of (%d %d)\n", x, y);
-	    //	    Log("Position of (%d %d) set to (%f %f)\n",
-	    //		x, y,
-	    //		nodes1[y * nx1 + x].x,
-	    //		nodes1[y * nx1 + x].y);
-	  }
-      Log("Refined map of image %s (%d of %d nodes valid)\n",
-	  images[i].name, count, nx1*ny1);
-      free(nodes);
+  for (i = 0; i < nImages; ++i)
+    owners[i] = images[i].owner;
+  if (p == 0)
+    {
+      load = (double *) malloc(np * sizeof(double));
+      memset(load, 0, np * sizeof(double));
+      total = 0.0;
+      for (i = 0; i < nImages; ++i)
+	{
+	  load[owners[i]] += totalCost[i];
+	  total += totalCost[i];
+	}
+      maxLoad = 0.0;
+      for (r = 0; r < np; ++r)
+	if (load[r] > maxLoad)
+	  maxLoad = load[r];
+      if (total > 0.0 && maxLoad > (1.0 + rebalanceThreshold) * total / np)
+	{
+	  /* order the images by process, and by index within that */
+	  start = (int *) malloc((np + 1) * sizeof(int));
+	  order = (int *) malloc(nImages * sizeof(int));
+	  memset(start, 0, (np + 1) * sizeof(int));
+	  for (i = 0; i < nImages; ++i)
+	    ++start[owners[i] + 1];
+	  for (r = 0; r < np; ++r)
+	    start[r+1] += start[r];
+	  for (i = 0; i < nImages; ++i)
+	    order[start[owners[i]]++] = i;
+
+	  /* each image goes to the process in whose share of the
+	     total its midpoint falls */
+	  memset(load, 0, np * sizeof(double));
+	  before = 0.0;
+	  for (k = 0; k < nImages; ++k)
+	    {
+	      i = order[k];
+	      r = (int) ((before + 0.5 * totalCost[i]) * np / total);
+	      if (r >= np)
+		r = np - 1;
+	      owners[i] = r;
+	      load[r] += totalCost[i];
+	      before += totalCost[i];
+	    }
+	  newMaxLoad = 0.0;
+	  for (r = 0; r < np; ++r)
+	    if (load[r] > newMaxLoad)
+	      newMaxLoad = load[r];
+	  nMoved = 0;
+	  for (i = 0; i < nImages; ++i)
+	    nMoved += owners[i] != images[i].owner;
+	  if (newMaxLoad < maxLoad)
+	    Log("At level %d the busiest process had %.1f%% more work than the average; moving %d images to bring that to %.1f%%\n",
+		level, 100.0 * (maxLoad * np / total - 1.0), nMoved,
+		100.0 * (newMaxLoad * np / total - 1.0));
+	  else
+	    for (i = 0; i < nImages; ++i)
+	      owners[i] = images[i].owner;
+	  free(start);
+	  free(order);
+	}
+      free(load);
     }
+  if (MPI_Bcast(owners, nImages, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Broadcast of image owners failed.\n");
+  MigrateImages(owners, level);
+  free(owners);
+  free(cost);
+  free(totalCost);
 }
 
+/* MigrateImages gives each image i to process owners[i] at the given
+   level.  The nodes, constraints, mask, and initial and absolute
+   positions of an image that changes hands go from its old owner to its
+   new one, preceded by its model, from this level on, in case the new
+   owner lacks it; each map that a process comes to need, with its
+   springs from this level on, comes from the old owner of its source
+   image, which always holds it, and the maps a process no longer needs
+   are dropped.  The needed flags, sendTo masks and commPhases are then
+   rebuilt; PlanCommunications must be called afterwards.  It must be
+   called by every process, with the same owners. */
 void
-PlanCommunications (int level)
+MigrateImages (int *owners, int level)
 {
-  int phase;
-  CommPhase *cp;
-  int bufferPos;
-  int i, j, k;
-  int nFloats;
+  int i, j, k, l, d, s;
+  int n;
+  int kind;
+  int len;
+  int fresh;
+  int nArrived;
+  int nReq;
+  int factor1;
+  int mx, my;
+  int rnx, rny, imbpl;
+  int image0, image1;
+  unsigned int hv;
+  float weight;
+  int *sendCount, *receiveCount;
+  unsigned char *b, *end;
+  unsigned char **received;
+  char name[PATH_MAX];
+  Package *pk;
+  MPI_Request *requests;
+  IntraImageMap *iim;
+  InterImageMap *m;
 
-  Log("Planning communication for level %d\n", level);
-  for (phase = 0; phase < nPhases; ++phase)
+  for (i = 0; i < nImages; ++i)
+    if (owners[i] != images[i].owner)
+      break;
+  if (i == nImages)
+    return;
+
+  pk = (Package *) malloc(np * sizeof(Package));
+  memset(pk, 0, np * sizeof(Package));
+  factor1 = 1 << level;
+
+  /* the images leaving this process; the model of each is packed
+     the first time it goes to a process */
+  for (i = 0; i < nImages; ++i)
+    for (iim = mapHashTable[i]; iim != NULL; iim = iim->next)
+      iim->packedFor = -1;
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
-      // schedule the communication of positions between processors
-      cp = &(commPhases[phase]);
+      d = owners[i];
+      if (d == p)
+	continue;
+      iim = images[i].map;
+      if (iim->packedFor != d)
+	{
+	  kind = 0;
+	  len = strlen(iim->name);
+	  Pack(&pk[d], &kind, sizeof(int));
+	  Pack(&pk[d], &len, sizeof(int));
+	  Pack(&pk[d], iim->name, len);
+	  Pack(&pk[d], &(iim->nx), sizeof(int));
+	  Pack(&pk[d], &(iim->ny), sizeof(int));
+	  for (l = level; l >= endLevel; --l)
+	    {
+	      n = iim->nSprings[startLevel - l];
+	      Pack(&pk[d], &n, sizeof(int));
+	      Pack(&pk[d], iim->springs[startLevel - l],
+		   n * sizeof(IntraImageSpring));
+	    }
+	  iim->packedFor = d;
+	}
+      kind = 1;
+      Pack(&pk[d], &kind, sizeof(int));
+      Pack(&pk[d], &i, sizeof(int));
+      Pack(&pk[d], images[i].nodes,
+	   images[i].nx * images[i].ny * sizeof(Node));
+      n = nConstraints[i];
+      Pack(&pk[d], &n, sizeof(int));
+      if (n > 0)
+	{
+	  Pack(&pk[d], constraints[i], 4 * n * sizeof(double));
+	  Pack(&pk[d], constrainingCoeff[i], 12 * sizeof(double));
+	}
+      n = images[i].mask != NULL;
+      Pack(&pk[d], &n, sizeof(int));
+      if (n)
+	{
+	  rnx = (images[i].width + endFactor - 1) / endFactor;
+	  rny = (images[i].height + endFactor - 1) / endFactor;
+	  imbpl = (rnx + 7) >> 3;
+	  Pack(&pk[d], images[i].mask, rny * imbpl);
+	}
+      PackPointLevels(&pk[d], images[i].initialPositions, i, level);
+      PackPointLevels(&pk[d], images[i].absolutePositions, i, level);
+    }
 
-      // first, the sends
-      cp->nSends = 0;
-      bufferPos = 0;
-      k = 0;
-      for (i = 0; i < cp->nSendImages; ++i)
+  /* the maps that other processes come to need */
+  for (k = 0; k < nMaps; ++k)
+    {
+      m = &maps[k];
+      if (images[m->image0].owner != p)
+	continue;
+      for (j = 0; j < 2; ++j)
 	{
-	  j = cp->sendImages[i];
-	  nFloats = images[j].nx * images[j].ny * 2;
-	  if (bufferPos + nFloats > bufferSize)
+	  d = owners[j == 0 ? m->image0 : m->image1];
+	  if (d == images[m->image0].owner ||
+	      d == images[m->image1].owner ||
+	      (j == 1 && d == owners[m->image0]))
+	    continue;
+	  kind = 2;
+	  len = strlen(m->name);
+	  Pack(&pk[d], &kind, sizeof(int));
+	  Pack(&pk[d], &(m->image0), sizeof(int));
+	  Pack(&pk[d], &(m->image1), sizeof(int));
+	  Pack(&pk[d], &(m->k), sizeof(float));
+	  Pack(&pk[d], &len, sizeof(int));
+	  Pack(&pk[d], m->name, len);
+	  for (l = level; l >= endLevel; --l)
 	    {
-	      ++(cp->nSends);
-	      cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
-						  cp->nSends * sizeof(int));
-	      cp->nImagesToSend[cp->nSends-1] = k;
-	      Log("In phase %d will send %d images to %d in a message of %d floats\n",
-		  phase, k, cp->otherProcess, bufferPos);
-	      k = 0;
-	      bufferPos = 0;
+	      n = m->nStrips[startLevel - l];
+	      Pack(&pk[d], &n, sizeof(int));
+	      Pack(&pk[d], m->strips[startLevel - l],
+		   n * sizeof(InterImageStrip));
+	      n = m->nSprings[startLevel - l];
+	      Pack(&pk[d], &n, sizeof(int));
+	      Pack(&pk[d], m->springs[startLevel - l],
+		   n * sizeof(InterImageSpring));
 	    }
-	  bufferPos += nFloats;
-	  ++k;
 	}
-      if (k > 0)
+    }
+
+  /* send everything at once */
+  sendCount = (int *) malloc(np * sizeof(int));
+  receiveCount = (int *) malloc(np * sizeof(int));
+  received = (unsigned char **) malloc(np * sizeof(unsigned char *));
+  requests = (MPI_Request *) malloc(2 * np * sizeof(MPI_Request));
+  for (d = 0; d < np; ++d)
+    {
+      if (pk[d].n > INT_MAX)
+	Error("Too much state to move to process %d\n", d);
+      sendCount[d] = pk[d].n;
+    }
+  if (MPI_Alltoall(sendCount, 1, MPI_INT, receiveCount, 1, MPI_INT,
+		   MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("Could not exchange the sizes of the migrating images\n");
+  nReq = 0;
+  for (s = 0; s < np; ++s)
+    {
+      received[s] = NULL;
+      if (receiveCount[s] == 0)
+	continue;
+      received[s] = (unsigned char *) malloc(receiveCount[s]);
+      if (received[s] == NULL)
+	Error("Could not allocate %d bytes for the images from process %d\n",
+	      receiveCount[s], s);
+      if (MPI_Irecv(received[s], receiveCount[s], MPI_BYTE, s,
+		    MIGRATION_TAG, MPI_COMM_WORLD,
+		    &requests[nReq++]) != MPI_SUCCESS)
+	Error("Could not receive from process %d\n", s);
+    }
+  for (d = 0; d < np; ++d)
+    {
+      if (sendCount[d] == 0)
+	continue;
+      if (MPI_Isend(pk[d].data, sendCount[d], MPI_BYTE, d,
+		    MIGRATION_TAG, MPI_COMM_WORLD,
+		    &requests[nReq++]) != MPI_SUCCESS)
+	Error("Could not send to process %d\n", d);
+      MetricsCount("migration_bytes_sent", sendCount[d]);
+    }
+  if (MPI_Waitall(nReq, requests, MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+    Error("MPI_Waitall() failed.\n");
+  for (d = 0; d < np; ++d)
+    free(pk[d].data);
+  free(pk);
+
+  /* drop the state of the images that left */
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
+    {
+      if (owners[i] == p)
+	continue;
+      for (l = 0; images[i].initialPositions != NULL && l < nLevels; ++l)
+	free(images[i].initialPositions[l]);
+      free(images[i].initialPositions);
+      images[i].initialPositions = NULL;
+      for (l = 0; images[i].absolutePositions != NULL && l < nLevels; ++l)
+	free(images[i].absolutePositions[l]);
+      free(images[i].absolutePositions);
+      images[i].absolutePositions = NULL;
+      free(images[i].velocity);
+      images[i].velocity = NULL;
+      free(images[i].direction);
+      images[i].direction = NULL;
+      free(images[i].lineForce);
+      images[i].lineForce = NULL;
+      free(images[i].initialNodes);
+      images[i].initialNodes = NULL;
+      free(images[i].foldCheckPos);
+      images[i].foldCheckPos = NULL;
+      images[i].foldCheckN = 0;
+      free(images[i].encoded);
+      images[i].encoded = NULL;
+      images[i].nEncoded = 0;
+      free(images[i].mask);
+      images[i].mask = NULL;
+      if (nConstraints[i] > 0)
 	{
-	  ++(cp->nSends);
-	  cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
-					      cp->nSends * sizeof(int));
-	  cp->nImagesToSend[cp->nSends-1] = k;
-	  Log("In phase %d will send %d images to %d in a final message of %d floats\n",
-	      phase, k, cp->otherProcess, bufferPos);
+	  free(constraints[i]);
+	  constraints[i] = NULL;
+	  free(constrainingCoeff[i]);
+	  constrainingCoeff[i] = NULL;
+	  nConstraints[i] = 0;
 	}
+    }
 
-      // next, the receives
-      cp->nReceives = 0;
-      bufferPos = 0;
-      k = 0;
-      for (i = 0; i < cp->nReceiveImages; ++i)
+  /* and the maps not needed any more */
+  j = 0;
+  for (k = 0; k < nMaps; ++k)
+    {
+      m = &maps[k];
+      if (owners[m->image0] == p || owners[m->image1] == p)
 	{
-	  j = cp->receiveImages[i];
-	  nFloats = images[j].nx * images[j].ny * 2;
-	  if (bufferPos + nFloats > bufferSize)
+	  if (j != k)
+	    maps[j] = maps[k];
+	  ++j;
+	  continue;
+	}
+      for (l = 0; l < nLevels; ++l)
+	{
+	  free(m->strips[l]);
+	  free(m->springs[l]);
+	}
+      free(m->name);
+      free(m->nStrips);
+      free(m->strips);
+      free(m->nSprings);
+      free(m->springs);
+      free(m->index0);
+      free(m->index1);
+      free(m->offsetX);
+      free(m->offsetY);
+      free(m->weight);
+      free(m->dx);
+      free(m->dy);
+      free(m->kq);
+    }
+  mapsPos = j;
+  mapsSize = nMaps;
+  for (i = 0; i < nImages; ++i)
+    images[i].owner = owners[i];
+
+  /* take in what arrived */
+  nArrived = 0;
+  for (s = 0; s < np; ++s)
+    {
+      if (received[s] == NULL)
+	continue;
+      b = received[s];
+      end = b + receiveCount[s];
+      while (b < end)
+	{
+	  b = Unpack(b, &kind, sizeof(int));
+	  if (kind == 0)
 	    {
-	      ++(cp->nReceives);
-	      cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
-						    cp->nReceives * sizeof(int));
-	      cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
-						  cp->nReceives * sizeof(int));
-	      cp->floatsToReceive[cp->nReceives-1] = bufferPos;
-	      cp->nImagesToReceive[cp->nReceives-1] = k;
-	      Log("In phase %d will receive %d images from %d in a message of %d floats\n",
-		  phase, k, cp->otherProcess, bufferPos);
-	      k = 0;
-	      bufferPos = 0;
+	      b = Unpack(b, &len, sizeof(int));
+	      if (len >= PATH_MAX)
+		Error("Internal error: model name of %d characters from process %d\n",
+		      len, s);
+	      b = Unpack(b, name, len);
+	      name[len] = '\0';
+	      b = Unpack(b, &mx, sizeof(int));
+	      b = Unpack(b, &my, sizeof(int));
+	      hv = HashMap(name, mx, my) % nImages;
+	      for (iim = mapHashTable[hv]; iim != NULL; iim = iim->next)
+		if (strcmp(iim->name, name) == 0 &&
+		    iim->nx == mx && iim->ny == my)
+		  break;
+	      fresh = iim == NULL;
+	      if (fresh)
+		{
+		  iim = (IntraImageMap*) malloc(sizeof(IntraImageMap));
+		  iim->name = (char *) malloc(len + 1);
+		  strcpy(iim->name, name);
+		  iim->nx = mx;
+		  iim->ny = my;
+		  iim->points = NULL;
+		  iim->nSprings = (int *) malloc(nLevels * sizeof(int));
+		  memset(iim->nSprings, 0, nLevels * sizeof(int));
+		  iim->springs = (IntraImageSpring**)
+		    malloc(nLevels * sizeof(IntraImageSpring*));
+		  memset(iim->springs, 0, nLevels * sizeof(IntraImageSpring*));
+		  iim->packedFor = -1;
+		  iim->next = mapHashTable[hv];
+		  mapHashTable[hv] = iim;
+		}
+	      for (l = level; l >= endLevel; --l)
+		{
+		  b = Unpack(b, &n, sizeof(int));
+		  if (!fresh)
+		    {
+		      b = Unpack(b, NULL, n * sizeof(IntraImageSpring));
+		      continue;
+		    }
+		  iim->nSprings[startLevel - l] = n;
+		  iim->springs[startLevel - l] = (IntraImageSpring *)
+		    malloc(n * sizeof(IntraImageSpring));
+		  b = Unpack(b, iim->springs[startLevel - l],
+			     n * sizeof(IntraImageSpring));
+		}
 	    }
-	  bufferPos += nFloats;
-	  ++k;
+	  else if (kind == 1)
+	    {
+	      b = Unpack(b, &i, sizeof(int));
+	      images[i].nx = (images[i].width + factor1 - 1) / factor1 + 1;
+	      images[i].ny = (images[i].height + factor1 - 1) / factor1 + 1;
+	      n = images[i].nx * images[i].ny;
+	      images[i].nodes = (Node *) realloc(images[i].nodes,
+						 n * sizeof(Node));
+	      b = Unpack(b, images[i].nodes, n * sizeof(Node));
+	      b = Unpack(b, &n, sizeof(int));
+	      nConstraints[i] = n;
+	      if (n > 0)
+		{
+		  constraints[i] = (double *) malloc(4 * n * sizeof(double));
+		  b = Unpack(b, constraints[i], 4 * n * sizeof(double));
+		  constrainingCoeff[i] = (double *) malloc(12 * sizeof(double));
+		  b = Unpack(b, constrainingCoeff[i], 12 * sizeof(double));
+		}
+	      free(images[i].mask);
+	      images[i].mask = NULL;
+	      b = Unpack(b, &n, sizeof(int));
+	      if (n)
+		{
+		  rnx = (images[i].width + endFactor - 1) / endFactor;
+		  rny = (images[i].height + endFactor - 1) / endFactor;
+		  imbpl = (rnx + 7) >> 3;
+		  images[i].mask = (unsigned char *) malloc(rny * imbpl);
+		  b = Unpack(b, images[i].mask, rny * imbpl);
+		}
+	      b = UnpackPointLevels(b, &(images[i].initialPositions), i, level);
+	      b = UnpackPointLevels(b, &(images[i].absolutePositions), i, level);
+	      mx = (images[i].width + endFactor - 1) / endFactor + 1;
+	      my = (images[i].height + endFactor - 1) / endFactor + 1;
+	      hv = HashMap(images[i].modelName, mx, my) % nImages;
+	      for (iim = mapHashTable[hv]; iim != NULL; iim = iim->next)
+		if (strcmp(iim->name, images[i].modelName) == 0 &&
+		    iim->nx == mx && iim->ny == my)
+		  break;
+	      if (iim == NULL)
+		Error("Internal error: image %s arrived without its model\n",
+		      images[i].name);
+	      images[i].map = iim;
+	      ++nArrived;
+	    }
+	  else if (kind == 2)
+	    {
+	      b = Unpack(b, &image0, sizeof(int));
+	      b = Unpack(b, &image1, sizeof(int));
+	      b = Unpack(b, &weight, sizeof(float));
+	      b = Unpack(b, &len, sizeof(int));
+	      if (len >= PATH_MAX)
+		Error("Internal error: map name of %d characters from process %d\n",
+		      len, s);
+	      b = Unpack(b, name, len);
+	      name[len] = '\0';
+	      m = NewMap(name, image0, image1, weight);
+	      for (l = level; l >= endLevel; --l)
+		{
+		  b = Unpack(b, &n, sizeof(int));
+		  m->nStrips[startLevel - l] = n;
+		  m->strips[startLevel - l] = (InterImageStrip *)
+		    malloc(n * sizeof(InterImageStrip));
+		  b = Unpack(b, m->strips[startLevel - l],
+			     n * sizeof(InterImageStrip));
+		  b = Unpack(b, &n, sizeof(int));
+		  m->nSprings[startLevel - l] = n;
+		  m->springs[startLevel - l] = (InterImageSpring *)
+		    malloc(n * sizeof(InterImageSpring));
+		  b = Unpack(b, m->springs[startLevel - l],
+			     n * sizeof(InterImageSpring));
+		}
+	    }
+	  else
+	    Error("Internal error: malformed images from process %d\n", s);
 	}
-      if (k > 0)
+      free(received[s]);
+    }
+  nMaps = mapsPos;
+  maps = (InterImageMap *) realloc(maps, nMaps * sizeof(InterImageMap));
+  mapsSize = nMaps;
+
+  /* the maps are put in an order that only depends on which are held,
+     so that a restarted run, which migrates from the initial owners
+     straight to those of its checkpoint, reads their springs back in
+     the order they were written */
+  qsort(maps, nMaps, sizeof(InterImageMap), CompareMaps);
+
+  /* rebuild what depends on the owners */
+  myFirstImage = -1;
+  nMyImages = 0;
+  for (i = nImages - 1; i >= 0; --i)
+    {
+      images[i].needed = 0;
+      images[i].nextOwned = -1;
+      if (images[i].owner != p)
 	{
-	  ++(cp->nReceives);
-	  cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
-						cp->nReceives * sizeof(int));
-	  cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
-						 cp->nReceives * sizeof(int));
-	  cp->floatsToReceive[cp->nReceives-1] = bufferPos;
-	  cp->nImagesToReceive[cp->nReceives-1] = k;
-	  Log("In phase %d will receive %d images from %d in a final message of %d floats\n",
-	      phase, k, cp->otherProcess, bufferPos);
+	  free(images[i].sendTo);
+	  images[i].sendTo = NULL;
+	  continue;
+	}
+      if (images[i].sendTo == NULL)
+	images[i].sendTo = (unsigned char *) malloc((np + 7) >> 3);
+      memset(images[i].sendTo, 0, (np + 7) >> 3);
+      images[i].nextOwned = myFirstImage;
+      myFirstImage = i;
+      ++nMyImages;
+    }
+  for (k = 0; k < nMaps; ++k)
+    {
+      maps[k].energyFactor = (images[maps[k].image0].owner == p) ? 1.0 : 0.0;
+      LinkMapImages(&maps[k]);
+    }
+  for (i = 0; i < nImages; ++i)
+    {
+      if (images[i].owner == p)
+	continue;
+      if (!images[i].needed)
+	{
+	  free(images[i].nodes);
+	  images[i].nodes = NULL;
+	  free(images[i].exchanged);
+	  images[i].exchanged = NULL;
+	  images[i].nExchanged = 0;
+	  free(images[i].mask);
+	  images[i].mask = NULL;
+	  continue;
 	}
+      if (images[i].nodes != NULL)
+	continue;
+      images[i].nx = (images[i].width + factor1 - 1) / factor1 + 1;
+      images[i].ny = (images[i].height + factor1 - 1) / factor1 + 1;
+      n = images[i].nx * images[i].ny;
+      images[i].nodes = (Node *) malloc(n * sizeof(Node));
+      memset(images[i].nodes, 0, n * sizeof(Node));
+    }
+  FreeCommPhases();
+  BuildCommPhases();
+  if (hierarchicalCommunication)
+    {
+      FreeNodeExchange();
+      SetUpNodeExchange();
+    }
+  MetricsCount("images_migrated", nArrived);
+  Log("After migration at level %d, owning %d images (%d arrived) and holding %d maps\n",
+      level, nMyImages, nArrived, nMaps);
+
+  free(sendCount);
+  free(receiveCount);
+  free(received);
+  free(requests);
+}
+
+int
+CompareMaps (const void *m0, const void *m1)
+{
+  const InterImageMap *a = (const InterImageMap *) m0;
+  const InterImageMap *b = (const InterImageMap *) m1;
+
+  if (a->image0 != b->image0)
+    return(a->image0 < b->image0 ? -1 : 1);
+  if (a->image1 != b->image1)
+    return(a->image1 < b->image1 ? -1 : 1);
+  return(strcmp(a->name, b->name));
+}
+
+/* Pack appends n bytes from v to pk */
+void
+Pack (Package *pk, void *v, size_t n)
+{
+  if (n == 0)
+    return;
+  if (pk->n + n > pk->size)
+    {
+      if (pk->size == 0)
+	pk->size = 65536;
+      while (pk->n + n > pk->size)
+	pk->size *= 2;
+      pk->data = (unsigned char *) realloc(pk->data, pk->size);
+      if (pk->data == NULL)
+	Error("Could not allocate %lu bytes of migrating images\n",
+	      (unsigned long) pk->size);
+    }
+  memcpy(pk->data + pk->n, v, n);
+  pk->n += n;
+}
+
+/* Unpack copies n bytes from b into v, or skips them if v is NULL, and
+   returns the position after them */
+unsigned char *
+Unpack (unsigned char *b, void *v, size_t n)
+{
+  if (v != NULL && n > 0)
+    memcpy(v, b, n);
+  return(b + n);
+}
+
+/* PackPointLevels packs pts, the positions at each level of the nodes
+   of image i (or NULL if there are none), from the given level to the
+   end level */
+void
+PackPointLevels (Package *pk, Point **pts, int i, int level)
+{
+  int l;
+  int n;
+  int lFactor;
+
+  n = pts != NULL;
+  Pack(pk, &n, sizeof(int));
+  if (pts == NULL)
+    return;
+  for (l = level; l >= endLevel; --l)
+    {
+      lFactor = 1 << l;
+      if (pts[startLevel - l] == NULL)
+	n = 0;
+      else
+	n = ((images[i].width + lFactor - 1) / lFactor + 1) *
+	  ((images[i].height + lFactor - 1) / lFactor + 1);
+      Pack(pk, &n, sizeof(int));
+      Pack(pk, pts[startLevel - l], n * sizeof(Point));
     }
 }
 
+/* UnpackPointLevels sets *pPts from the positions packed by
+   PackPointLevels at b, and returns the position after them */
+unsigned char *
+UnpackPointLevels (unsigned char *b, Point ***pPts, int i, int level)
+{
+  int l;
+  int n;
+  Point **pts;
+
+  b = Unpack(b, &n, sizeof(int));
+  if (!n)
+    {
+      *pPts = NULL;
+      return(b);
+    }
+  pts = (Point **) malloc(nLevels * sizeof(Point *));
+  memset(pts, 0, nLevels * sizeof(Point *));
+  for (l = level; l >= endLevel; --l)
+    {
+      b = Unpack(b, &n, sizeof(int));
+      if (n == 0)
+	continue;
+      pts[startLevel - l] = (Point *) malloc(n * sizeof(Point));
+      b = Unpack(b, pts[startLevel - l], n * sizeof(Point));
+    }
+  *pPts = pts;
+  return(b);
+}
 
+/* MaxSum is the reduction operation for pairs of doubles that
+   holds the maximum of the first elements and the sum of the second */
 void
-CommunicatePositions (int level)
+MaxSum (void *in, void *inout, int *len, MPI_Datatype *type)
 {
-  /* communicate image positions to other nodes */
-  //      (min(a,b) / sep) & 1 == 0  : first phase
-  //      (min(a,b) / sep) & 1 == 1  : second phase
-  
-  //	  0-1,2-3,4-5,6-7,8-9,10-11,12-13      0,2,4,6,8,10,12
-  //        1-2,3-4,5-6,7-8,9-10,11-12,13-14   1,3,5,7,9,11,13
-  //      sep 1, 
+  double *a = (double *) in;
+  double *b = (double *) inout;
+  int i;
 
-  //      0-2,1-3,4-6,5-7,8-10,9-11,12-14      0,1,4,5,8,9,12
-  //      2-4,3-5,6-8,7-9,10-12,11-13          2,3,6,7,10,11
-  //      sep 2
+  for (i = 0; i + 1 < *len; i += 2)
+    {
+      if (a[i] > b[i])
+	b[i] = a[i];
+      b[i+1] += a[i+1];
+    }
+}
 
-  //      0-3,1-4,2-5,6-9,7-10,8-11            0,1,2,6,7,8
-  //      3-6,4-7,5-8,9-12,10-13,11-14         3,4,5,9,10,11
-  
-  //      0-4,1-5,2-6,3-7,8-12,9-13,10-14
-  //      4-8,5-9,6-10,7-11
+void
+WaitForReduction ()
+{
+  if (!reducePending)
+    return;
+  if (MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+    Error("Could not complete reduction of force and energy\n");
+  reducePending = 0;
+}
 
-  //      0-5,1-6,2-7,3-8,4-9
-  //      5-10,6-11,7-12,8-13,9-14
+/* find the index of the named image, or -1 if it is not in the list */
+/* PlanAlignment reports, for each process, the images it would own
+   and hold, the maps it would build springs for, and an estimate of
+   its peak memory, and the spring evaluations the steps would take
+   at least; the node grids are sized from the image sizes of the
+   image list at each step's level, three intra-image springs are
+   counted per node, and each map is taken to have a spring per node
+   of its source image */
+void
+PlanAlignment (char *mapNames)
+{
+  int i, k, s, r;
+  int pos;
+  int i0, i1;
+  int level;
+  int f;
+  int nOwned, nHeld, nRankMaps;
+  int peakRank;
+  double nodes, levelNodes, mapNodes;
+  double memory, peak;
+  double work;
+  int *map0, *map1;
+  char *held;
+
+  map0 = (int *) malloc(nMaps * sizeof(int));
+  map1 = (int *) malloc(nMaps * sizeof(int));
+  held = (char *) malloc(nImages * sizeof(char));
+  if (map0 == NULL || map1 == NULL || held == NULL)
+    Error("Could not allocate plan arrays.\n");
+  pos = 0;
+  for (k = 0; k < nMaps; ++k)
+    {
+      map0[k] = FindImage(&mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      map1[k] = FindImage(&mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      pos += strlen(&mapNames[pos]) + 1;
+    }
 
-  //      0-6,1-7,2-8,3-9,4-10,5-11
-  //      6-12,7-13,8-14
+  peak = 0.0;
+  peakRank = 0;
+  for (r = 0; r < np; ++r)
+    {
+      memset(held, 0, nImages * sizeof(char));
+      nRankMaps = 0;
+      memory = 0.0;
+      for (k = 0; k < nMaps; ++k)
+	{
+	  i0 = map0[k];
+	  i1 = map1[k];
+	  if (i0 < 0 || i1 < 0 ||
+	      (images[i0].owner != r && images[i1].owner != r))
+	    continue;
+	  held[i0] = 1;
+	  held[i1] = 1;
+	  ++nRankMaps;
 
-  //      0-7,1-8,2-9,3-10,4-11,5-12,6-13
-  //      7-14
+	  /* the springs of every level are kept, and those of the
+	     current level are also decoded for the force loop */
+	  for (level = endLevel; level <= startLevel; ++level)
+	    {
+	      f = 1 << level;
+	      mapNodes = ((double) ((images[i0].width + f - 1) / f + 1)) *
+		((images[i0].height + f - 1) / f + 1);
+	      memory += mapNodes * sizeof(InterImageSpring);
+	      if (level == endLevel)
+		memory += mapNodes * (2 * sizeof(int) + 3 * sizeof(float));
+	    }
+	}
 
-  //      0-8,1-9,2-10,3-11,4-12,5-13,6-14
-  //      none
+      nOwned = 0;
+      nHeld = 0;
+      for (i = 0; i < nImages; ++i)
+	{
+	  /* an owned image keeps its positions and springs at every
+	     level */
+	  if (images[i].owner == r)
+	    {
+	      ++nOwned;
+	      held[i] = 1;
+	      for (level = endLevel; level <= startLevel; ++level)
+		{
+		  f = 1 << level;
+		  levelNodes = ((double) ((images[i].width + f - 1) / f + 1)) *
+		    ((images[i].height + f - 1) / f + 1);
+		  memory += levelNodes * (sizeof(Point) +
+					  3 * sizeof(IntraImageSpring));
+		}
+	    }
+	  if (!held[i])
+	    continue;
+	  ++nHeld;
+	  f = endFactor;
+	  nodes = ((double) ((images[i].width + f - 1) / f + 1)) *
+	    ((images[i].height + f - 1) / f + 1);
+	  memory += nodes * 2 * sizeof(Node);
+	  if (momentum > 0.0)
+	    memory += nodes * sizeof(Point);
+	  if (conjugateGradient)
+	    memory += nodes * 2 * sizeof(Point);
+	}
 
-  //      0-9,1-10,2-11,3-12,4-13,5-14
-  //      none
+      printf("Plan for process %d: %d images owned, %d held, %d maps, peak %.1f MB\n",
+	     r, nOwned, nHeld, nRankMaps, memory / 1000000.0);
+      if (memory > peak)
+	{
+	  peak = memory;
+	  peakRank = r;
+	}
+    }
 
-  //      0-10,1-11,2-12,3-13,4-14
-  //      none
+  /* every step evaluates every spring of its level at least
+     minIter times */
+  work = 0.0;
+  for (s = 0; s < nSteps; ++s)
+    {
+      level = (int) steps[s].level;
+      f = 1 << level;
+      nodes = 0.0;
+      for (i = 0; i < nImages; ++i)
+	nodes += 3.0 * ((images[i].width + f - 1) / f + 1) *
+	  ((images[i].height + f - 1) / f + 1);
+      for (k = 0; k < nMaps; ++k)
+	if (map0[k] >= 0 && map1[k] >= 0)
+	  nodes += ((double) ((images[map0[k]].width + f - 1) / f + 1)) *
+	    ((images[map0[k]].height + f - 1) / f + 1);
+      work += steps[s].minIter * nodes;
+    }
 
-  //      0-11,1-12,2-13,3-14
-  //      none
+  printf("\nPlan: %d images and %d maps on %d process%s, levels %d to %d\n",
+	 nImages, nMaps, np, np > 1 ? "es" : "", startLevel, endLevel);
+  printf("Predicted peak memory per process: %.1f MB (process %d, %d threads)\n",
+	 peak / 1000000.0, peakRank, nThreads);
+  printf("Estimated work: at least %.1f million spring evaluations over %d steps\n",
+	 work / 1000000.0, nSteps);
 
-  //      0-12,1-13,2-14
-  //      none
+  free(map0);
+  free(map1);
+  free(held);
+}
 
-  //      0-13,1-14
-  //      none
+int
+FindImage (char *name)
+{
+  int j;
 
-  //      0-14
-  //      none
-  int phase;
-  int op;
-  int subPhase;
-  int i, j, k;
-  int jj;
-  int bufferPos;
-  int nNodes;
-  int its;
-  Node *nodes;
-  MPI_Status status;
+  for (j = imageHashTable[Hash(name) % nImages]; j >= 0; j = images[j].next)
+    if (strcmp(images[j].name, name) == 0)
+      return(j);
+  return(-1);
+}
 
-  for (phase = 0; phase < nPhases; ++phase)
+/* Assign images to processes so that each process holds about the same
+   number of end-level nodes while as little spring weight as possible
+   crosses between processes.  Each part is grown from its lowest-numbered
+   unassigned image by repeatedly adding the most strongly connected
+   neighbor; the boundary is then refined by moving images to the part
+   they are most connected to whenever that keeps the parts in balance. */
+void
+PartitionImages (char *mapNames, float *mapParams, int *owners)
+{
+  int i, j, k, n;
+  int pos;
+  int i0, i1;
+  int nx0, ny0, nx1, ny1;
+  double *vw;
+  int *degree;
+  int *adjStart;
+  int *adj;
+  double *adjW;
+  int *edge0, *edge1;
+  double *edgeW;
+  int nEdges;
+  double *conn;
+  double *partW;
+  double *partConn;
+  double totalW, remainingW, target, maxW;
+  double best, gain;
+  int bestPart;
+  int pass, nMoves;
+  double cut;
+
+  vw = (double *) malloc(nImages * sizeof(double));
+  degree = (int *) malloc(nImages * sizeof(int));
+  edge0 = (int *) malloc(nMaps * sizeof(int));
+  edge1 = (int *) malloc(nMaps * sizeof(int));
+  edgeW = (double *) malloc(nMaps * sizeof(double));
+  for (i = 0; i < nImages; ++i)
     {
-      if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
-	Error("MPI_Barrier() failed.\n");
-      op = commPhases[phase].otherProcess;
-      if (op < 0)
+      vw[i] = ((images[i].width + endFactor - 1) / endFactor + 1) *
+	((images[i].height + endFactor - 1) / endFactor + 1);
+      degree[i] = 0;
+      owners[i] = -1;
+    }
+
+  /* every map contributes springs in proportion to the smaller of
+     the two images it connects */
+  nEdges = 0;
+  pos = 0;
+  for (k = 0; k < nMaps; ++k)
+    {
+      i0 = FindImage(&mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      i1 = FindImage(&mapNames[pos]);
+      pos += strlen(&mapNames[pos]) + 1;
+      pos += strlen(&mapNames[pos]) + 1;
+      if (i0 < 0 || i1 < 0 || i0 == i1 || mapParams[k] <= 0.0)
 	continue;
-      for (subPhase = 0; subPhase < 2; ++subPhase)
+      nx0 = (images[i0].width + endFactor - 1) / endFactor + 1;
+      ny0 = (images[i0].height + endFactor - 1) / endFactor + 1;
+      nx1 = (images[i1].width + endFactor - 1) / endFactor + 1;
+      ny1 = (images[i1].height + endFactor - 1) / endFactor + 1;
+      edge0[nEdges] = i0;
+      edge1[nEdges] = i1;
+      edgeW[nEdges] = (nx0 * ny0 < nx1 * ny1) ? nx0 * ny0 : nx1 * ny1;
+      vw[i0] += edgeW[nEdges];
+      vw[i1] += edgeW[nEdges];
+      ++degree[i0];
+      ++degree[i1];
+      ++nEdges;
+    }
+
+  /* build the adjacency lists */
+  adjStart = (int *) malloc((nImages + 1) * sizeof(int));
+  adjStart[0] = 0;
+  for (i = 0; i < nImages; ++i)
+    adjStart[i+1] = adjStart[i] + degree[i];
+  adj = (int *) malloc((adjStart[nImages] + 1) * sizeof(int));
+  adjW = (double *) malloc((adjStart[nImages] + 1) * sizeof(double));
+  for (i = 0; i < nImages; ++i)
+    degree[i] = 0;
+  for (k = 0; k < nEdges; ++k)
+    {
+      i0 = edge0[k];
+      i1 = edge1[k];
+      adj[adjStart[i0] + degree[i0]] = i1;
+      adjW[adjStart[i0] + degree[i0]++] = edgeW[k];
+      adj[adjStart[i1] + degree[i1]] = i0;
+      adjW[adjStart[i1] + degree[i1]++] = edgeW[k];
+    }
+
+  /* grow the parts one at a time */
+  totalW = 0.0;
+  for (i = 0; i < nImages; ++i)
+    totalW += vw[i];
+  partW = (double *) malloc(np * sizeof(double));
+  partConn = (double *) malloc(np * sizeof(double));
+  conn = (double *) malloc(nImages * sizeof(double));
+  remainingW = totalW;
+  n = 0;
+  for (k = 0; k < np; ++k)
+    {
+      partW[k] = 0.0;
+      partConn[k] = 0.0;
+      target = remainingW / (np - k);
+      for (i = 0; i < nImages; ++i)
+	conn[i] = 0.0;
+      while (n < nImages && (k == np - 1 || partW[k] < target))
 	{
-	  if (subPhase ^ (p < op))
+	  /* pick the unassigned image most connected to this part,
+	     or else the lowest-numbered one */
+	  j = -1;
+	  best = 0.0;
+	  for (i = 0; i < nImages; ++i)
+	    if (owners[i] < 0 && (j < 0 || conn[i] > best))
+	      {
+		j = i;
+		best = conn[i];
+	      }
+	  if (partW[k] > 0.0 && partW[k] + 0.5 * vw[j] > target)
+	    break;
+	  owners[j] = k;
+	  partW[k] += vw[j];
+	  remainingW -= vw[j];
+	  ++n;
+	  for (i = adjStart[j]; i < adjStart[j+1]; ++i)
+	    conn[adj[i]] += adjW[i];
+	}
+    }
+
+  /* refine the boundary */
+  maxW = 1.03 * totalW / np;
+  for (pass = 0; pass < 8; ++pass)
+    {
+      nMoves = 0;
+      for (j = 0; j < nImages; ++j)
+	{
+	  for (i = adjStart[j]; i < adjStart[j+1]; ++i)
+	    partConn[owners[adj[i]]] += adjW[i];
+	  bestPart = owners[j];
+	  best = partConn[owners[j]];
+	  for (i = adjStart[j]; i < adjStart[j+1]; ++i)
 	    {
-	      /* send */
-	      for (i = 0; i < commPhases[phase].nSends; ++i)
+	      k = owners[adj[i]];
+	      gain = partConn[k] - partConn[owners[j]];
+	      if (gain > 0.0 && partConn[k] > best &&
+		  partW[k] + vw[j] <= maxW &&
+		  partW[owners[j]] - vw[j] > 0.0)
 		{
-		  jj = 0;
-		  bufferPos = 0;
-		  for (j = 0; j < commPhases[phase].nImagesToSend[i]; ++j, ++jj)
-		    {
-		      its = commPhases[phase].sendImages[jj];
-		      nNodes = images[its].nx * images[its].ny;
-		      nodes = images[its].nodes;
-		      for (k = 0; k < nNodes; ++k)
-			{
-			  buffer[bufferPos++] = nodes[k].x;
-			  buffer[bufferPos++] = nodes[k].y;
-			}
-		    }
-		  if (MPI_Send(buffer, bufferPos, MPI_FLOAT,
-			       op, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
-		    Error("Could not send to process %d\n", op);
+		  bestPart = k;
+		  best = partConn[k];
 		}
 	    }
-	  else
+	  for (i = adjStart[j]; i < adjStart[j+1]; ++i)
+	    partConn[owners[adj[i]]] = 0.0;
+	  if (bestPart != owners[j])
 	    {
-	      /* receive */
-	      for (i = 0; i < commPhases[phase].nReceives; ++i)
-		{
-		  if (MPI_Recv(buffer, commPhases[phase].floatsToReceive[i], MPI_FLOAT,
-			       op, 0, MPI_COMM_WORLD, &status) != MPI_SUCCESS)
-		    Error("Could not receive from process %d\n", op);
-		  jj = 0;
-		  bufferPos = 0;
-		  for (j = 0; j < commPhases[phase].nImagesToReceive[i]; ++j, ++jj)
-		    {
-		      its = commPhases[phase].receiveImages[jj];
-		      nNodes = images[its].nx * images[its].ny;
-		      nodes = images[its].nodes;
-		      for (k = 0; k < nNodes; ++k)
-			{
-			  nodes[k].x =  buffer[bufferPos++];
-			  nodes[k].y =  buffer[bufferPos++];
-			}
-		    }
-		}
+	      partW[owners[j]] -= vw[j];
+	      partW[bestPart] += vw[j];
+	      owners[j] = bestPart;
+	      ++nMoves;
 	    }
 	}
+      if (nMoves == 0)
+	break;
     }
+
+  cut = 0.0;
+  for (k = 0; k < nEdges; ++k)
+    if (owners[edge0[k]] != owners[edge1[k]])
+      cut += edgeW[k];
+  Log("Partitioned %d images among %d processes; cut weight %f of %f\n",
+      nImages, np, cut, totalW);
+  for (k = 0; k < np; ++k)
+    Log("  process %d weight %f\n", k, partW[k]);
+
+  free(vw);
+  free(degree);
+  free(edge0);
+  free(edge1);
+  free(edgeW);
+  free(adjStart);
+  free(adj);
+  free(adjW);
+  free(partW);
+  free(partConn);
+  free(conn);
 }
 
 unsigned int
@@ -5689,67 +10804,122 @@ CheckForFolds (int level, int iter)
   float bx, by;
   int ix, iy;
   int processWithFold;
+  int n;
+  Point *pos;
+  float d, maxD;
+  float margin, rowMargin;
 
   foldImage = nImages;
-  for (i = myFirstImage; i <= myLastImage; ++i)
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
       nx = images[i].nx;
       ny = images[i].ny;
       nodes = images[i].nodes;
+      n = nx * ny;
+
+      /* if no node has moved farther than the margin since the map
+	 was last found free of folds, no quad can have turned over */
+      if (images[i].foldCheckN == n)
+	{
+	  pos = images[i].foldCheckPos;
+	  maxD = 0.0;
+	  for (ix = 0; ix < n; ++ix)
+	    {
+	      d = fabsf(nodes[ix].x - pos[ix].x) + fabsf(nodes[ix].y - pos[ix].y);
+	      if (d > maxD)
+		maxD = d;
+	    }
+	  if (maxD < images[i].foldMargin)
+	    {
+	      MetricsCount("fold_checks_skipped", 1);
+	      continue;
+	    }
+	}
+
+      margin = 1.0e+30;
       for (y = 0; y < ny; ++y)
-	for (x = 0; x < nx; ++x)
-	  {
-	    xv = nodes[y * nx + x].x;
-	    if (xv > 0.5 * UNSPECIFIED)
+	{
+	  /* examine the nodes one by one only in a row that may hold
+	     a fold */
+	  if (!RowMayFold(nodes, nx, ny, y, &rowMargin))
+	    {
+	      if (rowMargin < margin)
+		margin = rowMargin;
 	      continue;
-	    yv = nodes[y * nx + x].y;
-	    if (x > 0)
-	      {
-		ax = nodes[y * nx + x - 1].x - xv;
-		ay = nodes[y * nx + x - 1].y - yv;
-		if (y > 0)
-		  {
-		    bx = nodes[(y-1) * nx + x].x - xv;
-		    by = nodes[(y-1) * nx + x].y - yv;
-		    if (ax < 0.5 * UNSPECIFIED &&
-			bx < 0.5 * UNSPECIFIED &&
-			ax * by - ay * bx <= 0.0)
-		      goto foldError;
-		  }
-		if (y < ny - 1)
-		  {
-		    bx = nodes[(y+1) * nx + x].x - xv;
-		    by = nodes[(y+1) * nx + x].y - yv;
-		    if (ax < 0.5 * UNSPECIFIED &&
-			bx < 0.5 * UNSPECIFIED &&
-			ax * by - ay * bx >= 0.0)
-		      goto foldError;
-		  }
-	      }
-	    if (x < nx - 1)
-	      {
-		ax = nodes[y * nx + x + 1].x - xv;
-		ay = nodes[y * nx + x + 1].y - yv;
-		if (y > 0)
-		  {
-		    bx = nodes[(y-1) * nx + x].x - xv;
-		    by = nodes[(y-1) * nx + x].y - yv;
-		    if (ax < 0.5 * UNSPECIFIED &&
-			bx < 0.5 * UNSPECIFIED &&
-			ax * by - ay * bx >= 0.0)
-		      goto foldError;
-		  }
-		if (y < ny - 1)
-		  {
-		    bx = nodes[(y+1) * nx + x].x - xv;
-		    by = nodes[(y+1) * nx + x].y - yv;
-		    if (ax < 0.5 * UNSPECIFIED &&
-			bx < 0.5 * UNSPECIFIED &&
-			ax * by - ay * bx <= 0.0)
-		      goto foldError;
-		  }
-	      }
-	  }
+	    }
+	  for (x = 0; x < nx; ++x)
+	    {
+	      xv = nodes[y * nx + x].x;
+	      if (xv > 0.5 * UNSPECIFIED)
+		continue;
+	      yv = nodes[y * nx + x].y;
+	      if (x > 0)
+		{
+		  ax = nodes[y * nx + x - 1].x - xv;
+		  ay = nodes[y * nx + x - 1].y - yv;
+		  if (y > 0)
+		    {
+		      bx = nodes[(y-1) * nx + x].x - xv;
+		      by = nodes[(y-1) * nx + x].y - yv;
+		      if (ax < 0.5 * UNSPECIFIED &&
+			  bx < 0.5 * UNSPECIFIED &&
+			  ax * by - ay * bx <= 0.0)
+			goto foldError;
+		    }
+		  if (y < ny - 1)
+		    {
+		      bx = nodes[(y+1) * nx + x].x - xv;
+		      by = nodes[(y+1) * nx + x].y - yv;
+		      if (ax < 0.5 * UNSPECIFIED &&
+			  bx < 0.5 * UNSPECIFIED &&
+			  ax * by - ay * bx >= 0.0)
+			goto foldError;
+		    }
+		}
+	      if (x < nx - 1)
+		{
+		  ax = nodes[y * nx + x + 1].x - xv;
+		  ay = nodes[y * nx + x + 1].y - yv;
+		  if (y > 0)
+		    {
+		      bx = nodes[(y-1) * nx + x].x - xv;
+		      by = nodes[(y-1) * nx + x].y - yv;
+		      if (ax < 0.5 * UNSPECIFIED &&
+			  bx < 0.5 * UNSPECIFIED &&
+			  ax * by - ay * bx >= 0.0)
+			goto foldError;
+		    }
+		  if (y < ny - 1)
+		    {
+		      bx = nodes[(y+1) * nx + x].x - xv;
+		      by = nodes[(y+1) * nx + x].y - yv;
+		      if (ax < 0.5 * UNSPECIFIED &&
+			  bx < 0.5 * UNSPECIFIED &&
+			  ax * by - ay * bx <= 0.0)
+			goto foldError;
+		    }
+		}
+	    }
+	  /* the row test and the node test agree, so this is not
+	     reached; if it were, the next check would be a full one */
+	  margin = 0.0;
+	}
+
+      /* remember where the nodes were */
+      if (images[i].foldCheckN != n)
+	{
+	  images[i].foldCheckPos = (Point *) realloc(images[i].foldCheckPos,
+						     n * sizeof(Point));
+	  if (images[i].foldCheckPos == NULL)
+	    Error("Could not allocate fold check positions\n");
+	  images[i].foldCheckN = n;
+	}
+      for (ix = 0; ix < n; ++ix)
+	{
+	  images[i].foldCheckPos[ix].x = nodes[ix].x;
+	  images[i].foldCheckPos[ix].y = nodes[ix].y;
+	}
+      images[i].foldMargin = margin;
     }
   goto globalFoldCheck;
 
@@ -5800,6 +10970,78 @@ CheckForFolds (int level, int iter)
   return(1);
 }
 
+/* RowMayFold returns 1 if some corner of the quads around the nodes
+   of row y is turned over, the same test that CheckForFolds makes
+   node by node but done a whole row at a time without branches;
+   otherwise it returns 0 and sets *margin to the distance the nodes
+   may move before any of those corners can turn over */
+int
+RowMayFold (Node *nodes, int nx, int ny, int y, float *margin)
+{
+  Node *row;
+  int fold;
+
+  row = &nodes[y * nx];
+  fold = 0;
+  *margin = 1.0e+30;
+  if (nx < 2)
+    return(0);
+  if (y > 0)
+    {
+      FoldCorners(row + 1, row, row + 1 - nx, nx - 1, 1.0, &fold, margin);
+      FoldCorners(row, row + 1, row - nx, nx - 1, -1.0, &fold, margin);
+    }
+  if (y < ny - 1)
+    {
+      FoldCorners(row + 1, row, row + 1 + nx, nx - 1, -1.0, &fold, margin);
+      FoldCorners(row, row + 1, row + nx, nx - 1, 1.0, &fold, margin);
+    }
+  return(fold);
+}
+
+/* FoldCorners tests the n corners formed by the nodes c[k] with their
+   neighbors h[k] and v[k]; a corner is turned over if sign times the
+   cross product of h[k]-c[k] and v[k]-c[k] is not positive.  A node
+   moving by d in L1 distance moves an edge by at most 2d, so a corner
+   with cross product C and edges of L1 lengths summing to S cannot
+   turn over while every node moves less than C / (4 S); *margin is
+   lowered to the least of these. */
+void
+FoldCorners (Node *c, Node *h, Node *v, int n, float sign,
+	     int *fold, float *margin)
+{
+  int k;
+  float xv, yv;
+  float ax, ay, bx, by;
+  float cross;
+  float m;
+  float minM;
+  int valid;
+  int bad;
+
+  minM = *margin;
+  bad = 0;
+  for (k = 0; k < n; ++k)
+    {
+      xv = c[k].x;
+      yv = c[k].y;
+      ax = h[k].x - xv;
+      ay = h[k].y - yv;
+      bx = v[k].x - xv;
+      by = v[k].y - yv;
+      valid = (xv <= 0.5 * UNSPECIFIED) &
+	(ax < 0.5 * UNSPECIFIED) & (bx < 0.5 * UNSPECIFIED);
+      cross = sign * (ax * by - ay * bx);
+      bad |= valid & (cross <= 0.0);
+      m = cross / (4.0 * (fabsf(ax) + fabsf(ay) + fabsf(bx) + fabsf(by)));
+      if (valid && m < minM)
+	minM = m;
+    }
+  if (bad)
+    *fold = 1;
+  *margin = minM;
+}
+
 int
 Extrapolate (float *prx, float *pry, float *prc,
 	     int ix, int iy, float arrx, float arry,
@@ -6082,9 +11324,12 @@ RecoverFromFold (int level)
       maps[i].k = 0.0;
   free(worstMapName);
 
-  // restore point positions
-  for (i = myFirstImage; i <= myLastImage; ++i)
+  // restore point positions (with -local_fold_recovery, only those
+  //   of the images near the fold)
+  for (i = myFirstImage; i >= 0; i = images[i].nextOwned)
     {
+      if (localFoldRecovery && !images[i].marked)
+	continue;
       nx = images[i].nx;
       ny = images[i].ny;
       memcpy(images[i].nodes, images[i].initialNodes,
@@ -0,0 +1,99 @@
+/*
+ * aligntk.c -- defines the in-memory entry points of libaligntk that
+ *              are not already provided by its other modules
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aligntk.h"
+
+int
+WarpImage (unsigned char *out, unsigned char *outMask,
+	   int w, int h,
+	   unsigned char *image, unsigned char *mask,
+	   int iw, int ih,
+	   MapElement *map, int mapFactor,
+	   int mw, int mh, int mox, int moy,
+	   char *error)
+{
+  float *fimage;
+  float *warped;
+  unsigned char *valid;
+  size_t i;
+  int x, y;
+  int ok;
+  int v;
+  int obpl;
+
+  fimage = (float *) malloc(((size_t) iw) * ih * sizeof(float));
+  warped = (float *) malloc(((size_t) w) * h * sizeof(float));
+  valid = (unsigned char *) malloc(((size_t) w) * h);
+  if (fimage == NULL || warped == NULL || valid == NULL)
+    {
+      free(fimage);
+      free(warped);
+      free(valid);
+      sprintf(error, "WarpImage: could not allocate %dx%d working images\n",
+	      w, h);
+      return(0);
+    }
+  for (i = 0; i < ((size_t) iw) * ih; ++i)
+    fimage[i] = image[i];
+
+  ok = ComputeWarpedImage(warped, valid, w, h, 0, 0,
+			  fimage, mask, iw, ih, 0, 0,
+			  map, (float) mapFactor, mw, mh, mox, moy);
+  free(fimage);
+  if (!ok)
+    {
+      free(warped);
+      free(valid);
+      sprintf(error, "WarpImage: could not allocate the warping arrays\n");
+      return(0);
+    }
+
+  obpl = (w + 7) >> 3;
+  if (outMask != NULL)
+    memset(outMask, 0, ((size_t) obpl) * h);
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      {
+	i = ((size_t) y) * w + x;
+	if (!valid[i])
+	  {
+	    out[i] = 0;
+	    continue;
+	  }
+	v = (int) (warped[i] + 0.5);
+	if (v < 0)
+	  v = 0;
+	else if (v > 255)
+	  v = 255;
+	out[i] = v;
+	if (outMask != NULL)
+	  outMask[y * obpl + (x >> 3)] |= 0x80 >> (x & 7);
+      }
+  free(warped);
+  free(valid);
+  return(1);
+}
@@ -0,0 +1,51 @@
+//
+// aligntk.h - the C interface of libaligntk, the image, mask, map,
+//             warping and correlation routines that the alignTK
+//             programs are built from, for programs that chain
+//             pipeline stages in one process and keep their data
+//             in memory
+//
+#ifndef ALIGNTK_H
+#define ALIGNTK_H
+
+#include "imio.h"
+#include "invert.h"
+#include "dt.h"
+#include "bitmap.h"
+#include "reduction.h"
+#include "correlation.h"
+#include "metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ALIGNTK_API_VERSION	1
+
+  /* ComputeMapping fits the coefficients of a polynomial of degree d
+     (see compute_mapping.c) */
+  void ComputeMapping (double *a, double *b,
+		       double *fx, double *fy, double *rx, double *ry,
+		       int nopts, int d);
+
+  /* WarpImage renders the iw x ih 8-bit image, as apply_map does,
+     into the w x h 8-bit image out through map, whose mw x mh
+     elements are spaced mapFactor output pixels apart with element
+     (0,0) at (mox, moy) in map units; pixels that do not come from
+     within image (and, if mask is not NULL, within its packed bitmap
+     mask) are set to 0 and, if outMask is not NULL, cleared in the
+     packed bitmap outMask.  It returns 0 and sets error if it runs out
+     of memory. */
+  int WarpImage (unsigned char *out, unsigned char *outMask,
+		 int w, int h,
+		 unsigned char *image, unsigned char *mask,
+		 int iw, int ih,
+		 MapElement *map, int mapFactor,
+		 int mw, int mh, int mox, int moy,
+		 char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ALIGNTK_H */
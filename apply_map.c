@@ -44,13 +44,40 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "imio.h"
 #include "invert.h"
 #include "dt.h"
+#include "par.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "gpu_render.h"
+#include "compose.h"
+#ifdef WEBP_TILES
+#include <webp/encode.h>
+#endif
 
 #define LINE_LENGTH		255
 #define MAX_LABEL_LENGTH	255
+#define CANVAS_BLOCK_SHIFT	6	/* the canvas blocks whose painting
+					   is tracked are 64 pixels across */
+#define CANVAS_BLOCK		(1 << CANVAS_BLOCK_SHIFT)
+#define PLANE_XZ		1	/* values of plane */
+#define PLANE_YZ		2
+#define TILE_TIFF		0	/* values of tileFormat */
+#define TILE_JPEG		1
+#define TILE_WEBP		2
+#define QUAD_EMPTY		0	/* kinds of scan map quads (see
+					   BuildScanMap) */
+#define QUAD_FORWARD		1
+#define QUAD_INVERT		2
+#define SCAN_CELL		8	/* largest edge in output pixels of
+					   the quads of the scan maps */
 #define QUOTE(str)		#str
 #define EXPAND_AND_QUOTE(str)	QUOTE(str)
 
@@ -60,7 +87,11 @@ typedef struct Image
   int next;		/* index of next image in hash bucket */
   char *name;   	/* name of this image */
   int width, height;    /* width and height in pixels */
+  int sw, sh;		/* width and height of the image, mask, and dist
+			   arrays (reduced by sampleFactor) */
   unsigned char *image; /* the image bytes (NULL if not loaded) */
+  int imageMapped;	/* true if image is mapped from the file by
+			   ImageMmap rather than malloc'd */
   unsigned char *mask;  /* the image mask, if present */
   unsigned char *dist;  /* the distance array -- each element holds the distance
 			   from the corresponding image pixel to the closest
@@ -74,30 +105,198 @@ typedef struct Image
   int mw, mh;		/* map width and height */
   int mxMin, myMin;	/* map offset in x and y */
   MapElement *map;      /* map of this image into the final image */
+  int mapAllocated;	/* true if map holds only the part of the map
+			   needed for the current task, in malloc'd
+			   memory, rather than the whole of it mmapped */
   InverseMap *invMap;     /* inverse map that translates points in the final image
 			   into points in this image */
+  MapElement *scanMap;	/* with -forward, the map refined for
+			   scan-conversion (see BuildScanMap) */
+  int scanW, scanH;	/* scan map width and height */
+  int scanFactor;	/* scan map elements per map element */
+  unsigned char *quads;	/* the kind of each quad of the scan map */
+  int *quadRows;	/* the first and last output rows touched by
+			   each row of quads */
+  int nInvertQuads;	/* quads that must be painted through invMap */
   /* intensity map is optional */
   int imapLevel;	/* intensity map level */
   int imapw, imaph;	/* intensity map width and height */
-  MapElement *imap;	/* intensity map */
+  struct IntensityCell *icells;
+			/* the cells of the intensity map */
   MapElement *targetMap;/* map of where pixels from this image ended up
 			   in target image */
+  int transformed;	/* true if the map was computed on a transformed
+			   copy of this image (see -pre_transforms) */
+  double xf[2][3];	/* if so, the transform from points in that copy
+			   to points in this image */
   time_t mtime;         /* the modification time for this image or its map */
+  int rendered;		/* with -append, true if this image was rendered
+			   by an earlier run into the stored extent */
 } Image;
 
+/* the black (x) and white (y) levels at the four corners of a cell of
+   an intensity map, gathered so that a pixel's levels are interpolated
+   from one piece of memory rather than from two rows of the map */
+typedef struct IntensityCell
+{
+  float b00, b01, b10, b11;
+  float w00, w01, w10, w11;
+} IntensityCell;
+
+/* a set of maps composed onto those of -maps */
+typedef struct ChainMap
+{
+  char name[PATH_MAX];	/* prefix of the maps */
+  int invert;		/* if 1, compose with the inverses of the maps */
+} ChainMap;
+
+/* a target map entry recorded by a paint thread */
+typedef struct TargetWrite
+{
+  int tmi;
+  float x, y;
+} TargetWrite;
+
+/* the rows y0..y1 of an image being painted by one thread */
+typedef struct PaintThread
+{
+  pthread_t thread;
+  int index;		/* of the thread, 0 being the one that started
+			   the others */
+  int i;
+  int minY;
+  int pMinX, pMaxX, pMinY, pMaxY;
+  int y0, y1;
+  InverseMap *invMap;	/* private copy (see ShareInverseMap) */
+  MapElement *scanMap;	/* if not NULL, the rows are scan-converted
+			   from its quads (see ScanRow) */
+  int scanW, scanH;
+  int scanFactor;
+  unsigned char *quads;
+  int *quadRows;
+  float mFactor;
+  int mxMin, myMin;
+  int iw, ih;
+  size_t mbpl;
+  unsigned char *image;
+  unsigned char *mask;
+  unsigned char *dist;
+  IntensityCell *icells;
+  float imapFactor;
+  int imapw, imaph;
+  float cx, cy;
+  double (*xf)[3];	/* pre-transform of the image, or NULL */
+  MapElement *targetMap;
+  int targetMapWidth, targetMapHeight;
+  int targetMapSize;
+  int targetMapMask;
+  int *warned;
+  int defer;		/* if 1, record target map writes in targets
+			   instead of making them */
+  int nTargets, maxTargets;
+  TargetWrite *targets;
+} PaintThread;
+
+/* a column of finished tiles waiting to be written out */
+typedef struct TileJob
+{
+  struct TileJob *next;
+  unsigned char *buffer;	/* the out buffer holding the tiles */
+  int *painted;			/* which of the tiles were painted */
+  int col, startRow, endRow;
+  char name[PATH_MAX];
+} TileJob;
+
+/* one level of an image pyramid being accumulated from the output
+   tiles (see -pyramid) */
+typedef struct PyramidLevel {
+  int nCols, nRows;	  /* the number of tiles in this level */
+  int minCol, maxCol;	  /* the tile columns of this level in this task */
+  unsigned int **tiles;	  /* the pixel sums of the tiles in progress */
+  int *count;		  /* the number of finer tiles still to be added */
+} PyramidLevel;
+
+typedef struct Task {
+  /* NOTE: any new fields added to this struct should
+     be also added to PackTask and UnpackTask */
+  int section;		/* index of the output image */
+  int nSections;	/* number of consecutive output images (a slab
+			   of the -volume output) to render */
+  int startCol, endCol;	/* range of tile columns to render */
+} Task;
+
+typedef struct Result {
+  int section;
+  int startCol, endCol;
+  unsigned char *line;	/* with -xz or -yz, the section's line of the
+			   plane */
+  int strips, passes;	/* with -plan, the horizontal strips and the
+			   column passes over them that the task would
+			   take (passes is -1 if it would not fit) */
+  double peak;		/* and its predicted peak memory in bytes */
+} Result;
+
+/* an entry of the -bounds_index file, holding what previewing the
+   map (and the intensity map, if any) of an image found, keyed by
+   the modification times and sizes of those maps */
+typedef struct BoundsEntry {
+  char *name;		/* name of the image */
+  long long mapMtime;	/* modification time and size of its map */
+  long long mapSize;
+  int mw, mh;		/* map width and height */
+  float minX, maxX;	/* bounds of the area the image covers in the */
+  float minY, maxY;	/*   final image */
+  long long imapMtime;	/* modification time and size of its intensity */
+  long long imapSize;	/*   map (-1 if there was none) */
+  int imapw, imaph;	/* intensity map width and height */
+} BoundsEntry;
+
+/* a region of the output listed in the -regions file */
+typedef struct OutputRegion {
+  char name[PATH_MAX];	/* name of the region's output, under -output */
+  int width, height;	/* size of the region */
+  int offsetX, offsetY;	/* and its top-left corner */
+} OutputRegion;
+
 /* GLOBAL VARIABLES */
 int resume = 0;
 char imageListName[PATH_MAX];
+char imageManifestName[PATH_MAX];	/* if nonempty, the manifest
+					   caching the image sizes (see
+					   ScanImageSizes) */
 char imageName[PATH_MAX];
 char imagesName[PATH_MAX];
 char extension[PATH_MAX];
 char masksName[PATH_MAX];
+char distanceCacheName[PATH_MAX];
+char mipmapCacheName[PATH_MAX];
 char fontFileName[PATH_MAX];
 char mapsName[PATH_MAX];
 char imapsName[PATH_MAX];
+int nChain = 0;
+ChainMap *chain = NULL;	/* the maps (from -compose and -inverse_compose)
+			   composed, in order, onto each image's map as it
+			   is loaded */
+char preTransformsName[PATH_MAX];	/* if nonempty, the prefix of the
+					   files holding the transforms
+					   the maps were computed after */
 char outputName[PATH_MAX];
+char outputCommand[PATH_MAX];	/* if nonempty, the command each output
+				   image is piped to (see imio.h) */
 char sourceMapName[PATH_MAX];
 char targetMapsName[PATH_MAX];
+char boundsIndexName[PATH_MAX];
+char appendName[PATH_MAX];	/* if nonempty, the -append file holding
+				   the output extent and the sections
+				   already rendered into it */
+char regionListName[PATH_MAX];
+int nRegions = 0;
+OutputRegion *regions = NULL;	/* the regions of -regions, all rendered
+				   by each task */
+char regionsOutputName[PATH_MAX]; /* -output, under which each region's
+				     output goes */
+int holdImages = 0;		/* images are kept after painting, for
+				   the regions still to be rendered */
 int overlay = 0;
 int blend = 1;
 int margin = -1;
@@ -110,7 +309,14 @@ float whiteValue = 255.0;
 float mapScale = 1.0;
 float imapScale = 1.0;
 float maskScale = 1.0;
-int compress = 0;
+int compress = UncompressedImage;	/* compression method (enum
+					   ImageCompression) for TIFF output */
+int compressionLevel = 0;	/* deflate/zstd level; 0 is the default */
+int tileFormat = TILE_TIFF;	/* format of the -tile output tiles */
+int tileQuality = 90;		/* JPEG or WebP quality of the tiles; -1 is
+				   lossless WebP */
+char *tileExtensions[] = { "tif", "jpg", "webp" };
+char *tileContentTypes[] = { "image/tiff", "image/jpeg", "image/webp" };
 int reductionFactor = 1;
 int sourceMapLevel = 6;
 int targetMapsLevel = 6;
@@ -123,8 +329,44 @@ int nImages = 0;
 Image *images = 0;
 int *imageHashTable = 0;
 unsigned char *canvas = 0;
-unsigned short *weight = 0;
+unsigned short *weight = 0;	/* 65535 less the weight of each pixel,
+				   so that 0 is unpainted */
 size_t canvasSize = 0;
+unsigned char *canvasPainted = NULL; /* for each CANVAS_BLOCK square of
+					the current strip, whether an
+					image or the label may have been
+					painted into it */
+int paintedCols, paintedRows;
+int *tilePainted = NULL;	/* for each row of tiles of out, whether
+				   any of it was painted */
+int skipEmpty = 0;		/* do not write tiles nothing was painted
+				   into */
+int plane = 0;			/* PLANE_XZ or PLANE_YZ to render only that
+				   plane through the sections */
+int planePosition;		/* output y of the XZ plane or x of the
+				   YZ plane */
+int planeLength;		/* pixels in each section's line of it */
+int planeFilled;		/* pixels of the line rendered so far */
+unsigned char *planeLine = NULL; /* the line rendered by this task */
+unsigned char *planeImage = NULL; /* the plane, one row per section */
+int servePort = 0;		/* port to serve tiles on (see ServeTiles) */
+int serving = 0;		/* tiles are being served */
+int residentLimit = 1024;	/* megabytes of images, maps and inverse
+				   maps kept resident while serving */
+int serveMinX, serveMinY;	/* the output being served */
+int serveWidth, serveHeight;
+int serveTw, serveTh;		/* size of the served tiles */
+int serveLevels;		/* number of reduction levels served */
+long *imageUsed = NULL;		/* when each image was last painted */
+long useClock = 0;
+int planOnly = 0;		/* only plan the rendering (see -plan) */
+int planStrips, planPasses;	/* the plan of the last task */
+size_t planPeak;
+int planTasks = 0;		/* the plans received by the master */
+int planTotalStrips = 0;
+int planTotalPasses = 0;
+int planFailed = 0;
+double planMaxPeak = 0.0;
 size_t canvasWidth, canvasHeight;
 size_t oldCanvasWidth = 0;
 int canvasMinX, canvasMinY;
@@ -136,6 +378,9 @@ size_t oWidth, oHeight;
 float range;
 unsigned char *out;
 size_t outWidth, outHeight;
+size_t outSize;
+int streaming = 0;		/* untiled output is written a strip at a time */
+ImageWriter *outWriter = NULL;
 int outMinY;
 int nProcessed = 0;
 size_t imageMem = 0;
@@ -150,29 +395,213 @@ char labelName[MAX_LABEL_LENGTH+1];
 unsigned char *font = 0;
 int fontWidth, fontHeight;
 float cosRot, sinRot;
+int nThreads = 0;
+int readAhead = 0;	/* number of images to read in the background
+			   ahead of the one being painted */
+int prefetching = 0;
+pthread_mutex_t paintMutex = PTHREAD_MUTEX_INITIALIZER;
+int taskColumns = 0;
+int rows, cols;
+int nOutputImages;
+int labelWidth, labelHeight, labelOffsetX, labelOffsetY;
+int renderMinX, renderMaxX;	/* x range of the current task */
+int nWriters = 1;		/* tile writer threads (0 = write in place) */
+int inverseCache = 0;		/* keep built inverse maps next to the maps */
+int forwardRender = 0;		/* paint by scan-converting the map quads
+				   rather than inverting the map at every
+				   pixel */
+int gpuRender = 0;		/* paint on the GPU where it can (implies
+				   forwardRender) */
+int gpuReady = 0;		/* 1 once the GPU is set up, -1 if it can
+				   not be */
+int partialMaps = 0;		/* read only the part of each map that lands
+				   in the area being rendered */
+int mipmap = 0;			/* paint from sources reduced to match
+				   -reduction */
+int sampleFactor = 1;		/* factor by which the source arrays are
+				   reduced */
+int pyramidLevels = 0;		/* levels of image pyramid to write */
+int reducedLevels = 0;		/* reduced-resolution levels to store in
+				   each untiled TIFF output image */
+PyramidLevel *pyramid = NULL;
+int maxOutBuffers = 1;		/* out buffers that may exist at once */
+int volume = 0;			/* write the output images as the z slices
+				   of a chunked volume (see imio.h) */
+int volumeChunk = 128;		/* edge length of the volume chunks */
+int slabFirst = 0;		/* first output image of the current slab */
+int slabSection = 0;		/* output image of the slab being rendered */
+FILE *slabFile = NULL;		/* staging file for the current slab */
+unsigned char *volumeRows = NULL; /* the rows of the current chunk row */
+unsigned char *volumeTile = NULL; /* one z layer of one chunk, or a
+				     whole chunk */
+int volumeRowsHeld = 0;		/* number of rows held in volumeRows */
+int volumeRow = 0;		/* index of the current chunk row */
+int nOutBuffers = 0;
+int writersStarted = 0;
+int writersShutdown = 0;
+int nWritesPending = 0;
+TileJob *firstTileJob = NULL;
+TileJob *lastTileJob = NULL;
+pthread_t *writers = NULL;
+pthread_mutex_t tileMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tileCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t dirMutex = PTHREAD_MUTEX_INITIALIZER;
+Task t;
+Result r;
+int nResults = 0;
 
 #define DIR_HASH_SIZE	8192
 char *dirHash[DIR_HASH_SIZE];
 
+BoundsEntry *boundsIndex = NULL; /* entries read from -bounds_index,
+				    sorted by name */
+int nBoundsEntries = 0;
+BoundsEntry *imageBounds = NULL; /* the entry for each image */
+
+int haveAppendExtent = 0;	/* true if the -append file was read, */
+int appendMinX, appendMaxX;	/*   and gave this output extent */
+int appendMinY, appendMaxY;
+char **appendedNames = NULL;	/* the sections it lists, sorted */
+int nAppendedNames = 0;
+
+int *cellStart = NULL;		/* the images overlapping each cell of
+				   a grid over the output, as ranges of
+				   cellImages (see IndexImages) */
+int *cellImages = NULL;
+int cellSize, cellCols, cellRows;
+int *imageStamp = NULL;		/* stamp of the last region that listed
+				   each image */
+int stamp = 0;
+
 /* FORWARD DECLARATIONS */
+void MasterTask (int argc, char **argv, char **envp);
+void MasterResult ();
+void WorkerContext ();
+void WorkerTask ();
+void StartReadAhead ();
+void PackContext ();
+void UnpackContext ();
+void PackTask ();
+void UnpackTask ();
+void PackResult ();
+void UnpackResult ();
+void RenderSection (int oi, int startCol, int endCol);
+void ReleaseImage (int i);
+MapElement *ComposeChain (int i, MapElement *map, int mLevel, int mw, int mh);
 void PaintImage (int i, int minX, int maxX, int minY, int maxY);
+void PrefetchNewImages (int *list, int n, int *next,
+			int minX, int maxX, int minY, int maxY);
+void IndexImages ();
+void FreeImageIndex ();
+void CellRange (double minX, double maxX, double minY, double maxY,
+		int *cx0, int *cx1, int *cy0, int *cy1);
+int CellIndex (double offset, int n);
+int ImagesInRegion (int minX, int maxX, int minY, int maxY,
+		    int first, int last, int *list);
+int CompareInts (const void *a, const void *b);
+void *PaintThreadMain (void *arg);
+void PaintRows (PaintThread *pt);
+void SetTarget (PaintThread *pt, int tmi, int x, int y);
+int PaintGpu (PaintThread *pt);
+void BuildScanMap (int i);
+void ScanRow (PaintThread *pt, int y, unsigned char *kind,
+	      float *sx, float *sy);
+void ScanTriangle (PaintThread *pt, float ty, MapElement *t0, MapElement *t1,
+		   MapElement *t2, float s0x, float s0y, float s1x, float s1y,
+		   float s2x, float s2y, unsigned char *kind,
+		   float *sx, float *sy);
 void WriteTiles (int col, int startRow, int endRow, char *iName);
+void WriteBand (int nRows, char *iName);
+void StartSlab (int first);
+void AppendVolumeRows (unsigned char *rows, int nRows);
+void FlushVolumeRows ();
+void FinishSlab (int nSections);
+void StartPyramid (int startCol, int endCol);
+size_t PyramidMemory (int nTileRows);
+void AddToPyramid (int lvl, int row, int col,
+		   unsigned char *ucTile, unsigned int *uiTile,
+		   char *iName);
+void FinishPyramid ();
+void PyramidFileName (char *fn, int lvl, int row, int col, char *iName);
+void OutputFileName (char *fn, int col, int row, char *iName);
+int PlanColumns (int oi, size_t *increase, size_t *decrease);
+void ServeTiles (int port);
+void ServeRequest (int c);
+void PaintTile (int oi, int level, int x, int y, char *fn);
+void EvictImages (int keep);
+void SendResponse (int c, char *status, char *type,
+		   unsigned char *body, size_t n);
+int SendAll (int c, unsigned char *p, size_t n);
+void *MapZeroed (size_t bytes);
+void UnmapZeroed (void *p, size_t bytes);
+void ResizeCanvas (size_t oldWidth, int cx, size_t newWidth);
+void MarkPainted (int minX, int maxX, int minY, int maxY);
+int AreaPainted (int minX, int maxX, int minY, int maxY);
+int PaintedBlocks (int minX, int maxX, int minY, int maxY,
+		   int *bx0, int *bx1, int *by0, int *by1);
+void WriteTileColumn (unsigned char *buffer, int *painted,
+		      int col, int startRow, int endRow, char *iName);
+int WriteTile (char *fn, unsigned char *pixels, char *msg);
+int WriteWebpTile (char *fn, unsigned char *pixels, char *msg);
+void *TileWriterMain (void *arg);
+void FlushTiles ();
+unsigned char *AcquireOutBuffer (size_t size);
+void ReleaseOutBuffer (unsigned char *buffer);
+void WorkerFinalize ();
 void Error (char *fmt, ...);
 unsigned int Hash (char *s);
 int CreateDirectories (char *fn);
+time_t MaskTime (int i);
+int OutputDeps (int oi, char *depsName, char *params, char **inputs,
+		char *names);
+int ReadDistance (int i, time_t maskTime);
+void WriteDistance (int i, time_t maskTime);
+void ReduceImage (int i);
+void ReadPreTransform (int i);
+void ReadBoundsIndex ();
+void ReadRegionList ();
+void SelectRegion (int k);
+void RenderRegions (int oi);
+void WriteSizeFile ();
+int LookupBounds (int i, struct stat *mapSb);
+void WriteBoundsIndex ();
+void ReadAppendExtent ();
+void WriteAppendExtent ();
+int CompareNames (const void *a, const void *b);
+int CompareBoundsEntries (const void *a, const void *b);
+void ReduceMask (int i);
+int ReadMipmap (int i);
+void WriteMipmap (int i);
 void PrintUsage ();
 
 int
 main (int argc, char **argv, char **envp)
+{
+  MetricsInit("apply_map");
+  par_process(argc, argv, envp,
+	      (void (*)()) MasterTask, MasterResult,
+	      WorkerContext, WorkerTask, WorkerFinalize,
+	      PackContext, UnpackContext,
+	      PackTask, UnpackTask,
+	      PackResult, UnpackResult);
+  return(0);
+}
+
+
+/* MASTER PROCEDURES */
+
+void
+MasterTask (int argc, char **argv, char **envp)
 {
   int i, j;
   int n;
+  double work;
+  char *cp;
   int error;
   char fn[PATH_MAX];
   MapElement *map;
   int x, y;
   float minX, minY, maxX, maxY;
-  int iMinX, iMinY, iMaxX, iMaxY;
   float xv, yv;
   float spacing;
   float ax, bx, ay, by;
@@ -182,73 +611,66 @@ main (int argc, char **argv, char **envp)
   char imName0[PATH_MAX];
   char imName1[PATH_MAX];
   char msg[PATH_MAX+256];
-  char msg2[PATH_MAX+256];
   FILE *f;
   int imagesSize;
   char line[LINE_LENGTH+1];
   int dir;
   int nItems;
   int width, height;
-  int rows, cols;
   int ixv, iyv;
   float rx, ry;
   float rrx, rry;
   float rx00, rx01, rx10, rx11, ry00, ry01, ry10, ry11;
   float rv;
   cpu_set_t cpumask;
-  int nOutputImages;
-  int startImage, endImage;
   int imapLevel;
   int imapw, imaph;
   int imapXMin, imapYMin;
   char imapName0[PATH_MAX], imapName1[PATH_MAX];
   MapElement *imap;
+  MapElement *cmap;
+  int k;
   int regionWidth, regionHeight, regionOffsetX, regionOffsetY;
-  int labelWidth, labelHeight, labelOffsetX, labelOffsetY;
-  size_t *increase, *decrease;
-  size_t memoryRequired;
-  size_t maxMemoryRequired;
-  int startX, endX;
-  int startY, endY;
-  int tx, ty;
   int tCol;
-  int ix, iy;
   int dx, dy;
-  int cx;
-  int nx, ny;
   int oi;
-  int hs;
-  int hi;
-  int startRow, endRow;
-  int iv;
-  int sum;
-  int offset;
-  int a;
-  int valid;
+  int nTasks;
   struct stat sb;
-  int updateOutput;
-  int labelMinX, labelMaxX, labelMinY, labelMaxY;
-  int charMinX, charMaxX;
-  int ci;
-  float sx, ex, sy, ey;
-  int isx, iex, isy, iey;
-  float v;
-  float wx, wy, ws;
-  int len;
-  int ilv;
+  struct stat imapSb;
+  struct stat chainSb;
+  char **imageFiles;
+  long long scannedTime;
   float rxp, ryp;
+  int cached;
+  int nPreviewed;
+  int nextMap;
+  int *current;
+  char depsName[PATH_MAX];
+  char depsParams[1024];
+  char **depsInputs;
+  char *depsNames;
+  int nDeps;
+  int nCurrent;
 
   error = 0;
   imageListName[0] = '\0';
   imageName[0] = '\0';
+  imageManifestName[0] = '\0';
   imagesName[0] = '\0';
   masksName[0] = '\0';
+  distanceCacheName[0] = '\0';
+  mipmapCacheName[0] = '\0';
   strcpy(fontFileName, EXPAND_AND_QUOTE(FONT_FILE));
   mapsName[0] = '\0';
   imapsName[0] = '\0';
+  preTransformsName[0] = '\0';
   outputName[0] = '\0';
+  outputCommand[0] = '\0';
   sourceMapName[0] = '\0';
   targetMapsName[0] = '\0';
+  boundsIndexName[0] = '\0';
+  appendName[0] = '\0';
+  regionListName[0] = '\0';
   labelName[0] = '\0';
   strcpy(extension, "tif");
   regionWidth = regionHeight = regionOffsetX = regionOffsetY = -1;
@@ -263,6 +685,15 @@ main (int argc, char **argv, char **envp)
 	  }
 	strcpy(imageListName, argv[i]);
       }
+    else if (strcmp(argv[i], "-manifest") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(imageManifestName, argv[i]);
+      }
     else if (strcmp(argv[i], "-image") == 0)
       {
 	if (++i == argc)
@@ -294,6 +725,15 @@ main (int argc, char **argv, char **envp)
 	  }
 	strcpy(masksName, argv[i]);
       }
+    else if (strcmp(argv[i], "-distance_cache") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(distanceCacheName, argv[i]);
+      }
     else if (strcmp(argv[i], "-mask_scale") == 0)
       {
 	if (++i == argc || sscanf(argv[i], "%f", &maskScale) != 1)
@@ -311,6 +751,20 @@ main (int argc, char **argv, char **envp)
 	  }
 	strcpy(mapsName, argv[i]);
       }
+    else if (strcmp(argv[i], "-compose") == 0 ||
+	     strcmp(argv[i], "-inverse_compose") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	chain = (ChainMap *) realloc(chain, (nChain + 1) * sizeof(ChainMap));
+	if (chain == NULL)
+	  Error("Could not allocate map chain\n");
+	strcpy(chain[nChain].name, argv[i]);
+	chain[nChain++].invert = strcmp(argv[i-1], "-inverse_compose") == 0;
+      }
     else if (strcmp(argv[i], "-map_scale") == 0)
       {
 	if (++i == argc || sscanf(argv[i], "%f", &mapScale) != 1)
@@ -336,6 +790,15 @@ main (int argc, char **argv, char **envp)
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-pre_transforms") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(preTransformsName, argv[i]);
+      }
     else if (strcmp(argv[i], "-output") == 0)
       {
 	if (++i == argc)
@@ -395,7 +858,72 @@ main (int argc, char **argv, char **envp)
 	  }
       }
     else if (strcmp(argv[i], "-compress") == 0)
-      compress = 1;
+      compress = HDiffDeflateImage;
+    else if (strcmp(argv[i], "-compression") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	compressionLevel = 0;
+	if ((cp = strchr(argv[i], ':')) != NULL &&
+	    sscanf(cp+1, "%d", &compressionLevel) != 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+	n = (cp != NULL) ? cp - argv[i] : (int) strlen(argv[i]);
+	if (strncmp(argv[i], "none", n) == 0 && n == 4)
+	  compress = UncompressedImage;
+	else if (strncmp(argv[i], "deflate", n) == 0 && n == 7)
+	  compress = HDiffDeflateImage;
+	else if (strncmp(argv[i], "lzw", n) == 0 && n == 3)
+	  compress = HDiffLzwImage;
+	else if (strncmp(argv[i], "zstd", n) == 0 && n == 4)
+	  compress = HDiffZstdImage;
+	else
+	  {
+	    fprintf(stderr, "-compression must be none, deflate, lzw, or zstd, optionally followed by :level\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-tile_format") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	tileQuality = 90;
+	if ((cp = strchr(argv[i], ':')) != NULL &&
+	    strcmp(cp+1, "lossless") != 0 &&
+	    (sscanf(cp+1, "%d", &tileQuality) != 1 ||
+	     tileQuality < 0 || tileQuality > 100))
+	  {
+	    error = 1;
+	    break;
+	  }
+	n = (cp != NULL) ? cp - argv[i] : (int) strlen(argv[i]);
+	if (strncmp(argv[i], "tif", n) == 0 && n == 3 && cp == NULL)
+	  tileFormat = TILE_TIFF;
+	else if (strncmp(argv[i], "jpg", n) == 0 && n == 3 &&
+		 (cp == NULL || strcmp(cp+1, "lossless") != 0))
+	  tileFormat = TILE_JPEG;
+	else if (strncmp(argv[i], "webp", n) == 0 && n == 4)
+	  {
+	    tileFormat = TILE_WEBP;
+	    if (cp != NULL && strcmp(cp+1, "lossless") == 0)
+	      tileQuality = -1;
+	  }
+	else
+	  {
+	    fprintf(stderr, "-tile_format must be tif, jpg[:quality], or webp[:quality|lossless]\n");
+	    error = 1;
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-resume") == 0)
       resume = 1;
     else if (strcmp(argv[i], "-region") == 0)
@@ -408,6 +936,15 @@ main (int argc, char **argv, char **envp)
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-regions") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(regionListName, argv[i]);
+      }
     else if (strcmp(argv[i], "-reduction") == 0)
       {
 	if (++i == argc || sscanf(argv[i], "%d", &reductionFactor) != 1)
@@ -452,6 +989,15 @@ main (int argc, char **argv, char **envp)
       }
     else if (strcmp(argv[i], "-update") == 0)
       update = 1;
+    else if (strcmp(argv[i], "-output_command") == 0)
+      {
+	if (++i == argc || strlen(argv[i]) >= PATH_MAX)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(outputCommand, argv[i]);
+      }
     else if (strcmp(argv[i], "-label") == 0)
       {
 	if (++i == argc)
@@ -499,17 +1045,167 @@ main (int argc, char **argv, char **envp)
 	  }
 	strcpy(fontFileName, argv[i]);
       }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-read_ahead") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &readAhead) != 1 ||
+	    readAhead < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-writers") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nWriters) != 1 ||
+	    nWriters < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-pyramid") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &pyramidLevels) != 1 ||
+	    pyramidLevels < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-reduced_levels") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &reducedLevels) != 1 ||
+	    reducedLevels < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-inverse_cache") == 0)
+      inverseCache = 1;
+    else if (strcmp(argv[i], "-forward") == 0)
+      forwardRender = 1;
+    else if (strcmp(argv[i], "-gpu") == 0)
+      {
+	gpuRender = 1;
+	forwardRender = 1;
+      }
+    else if (strcmp(argv[i], "-skip_empty") == 0)
+      skipEmpty = 1;
+    else if (strcmp(argv[i], "-xz") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &planePosition) != 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+	plane = PLANE_XZ;
+      }
+    else if (strcmp(argv[i], "-yz") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &planePosition) != 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+	plane = PLANE_YZ;
+      }
+    else if (strcmp(argv[i], "-plan") == 0)
+      planOnly = 1;
+    else if (strcmp(argv[i], "-serve") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &servePort) != 1 ||
+	    servePort <= 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-resident") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &residentLimit) != 1 ||
+	    residentLimit < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-bounds_index") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(boundsIndexName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-append") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(appendName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-mipmap") == 0)
+      mipmap = 1;
+    else if (strcmp(argv[i], "-mipmap_cache") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(mipmapCacheName, argv[i]);
+	mipmap = 1;
+      }
+    else if (strcmp(argv[i], "-volume") == 0)
+      volume = 1;
+    else if (strcmp(argv[i], "-volume_chunk") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &volumeChunk) != 1 ||
+	    volumeChunk < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+	volume = 1;
+      }
+    else if (strcmp(argv[i], "-task_columns") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &taskColumns) != 1 ||
+	    taskColumns < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else error = 1;
 
   if (error)
     {
       fprintf(stderr, "Usage: apply_map -image_list list_file -images image_prefix\n");
       fprintf(stderr, "              -maps map_prefix -output file_prefix\n");
+      fprintf(stderr, "              [-manifest image_manifest_file]\n");
+      fprintf(stderr, "              [-compose map_prefix]\n");
+      fprintf(stderr, "              [-inverse_compose map_prefix]\n");
       fprintf(stderr, "              [-map_scale scaling_factor]\n");
       fprintf(stderr, "              [-masks mask_prefix]\n");
       fprintf(stderr, "              [-masks_scale scaling_factor]\n");
+      fprintf(stderr, "              [-distance_cache distance_cache_prefix]\n");
       fprintf(stderr, "              [-imaps imaps_prefix]\n");
       fprintf(stderr, "              [-imap_scale scaling_factor]\n");
+      fprintf(stderr, "              [-pre_transforms transform_prefix]\n");
       fprintf(stderr, "              [-blend]\n");
       fprintf(stderr, "              [-mosaic]\n");
       fprintf(stderr, "              [-margin margin_thickness_in_pixels]\n");
@@ -519,7 +1215,10 @@ main (int argc, char **argv, char **envp)
       fprintf(stderr, "              [-black black_value]\n");
       fprintf(stderr, "              [-white white_value]\n");
       fprintf(stderr, "              [-compress]\n");
+      fprintf(stderr, "              [-compression none|deflate|lzw|zstd[:level]]\n");
+      fprintf(stderr, "              [-tile_format tif|jpg[:quality]|webp[:quality|lossless]]\n");
       fprintf(stderr, "              [-region WxH+X+Y]\n");
+      fprintf(stderr, "              [-regions region_list_file]\n");
       fprintf(stderr, "              [-reduction reduction_factor]\n");
       fprintf(stderr, "              [-resume]\n");
       fprintf(stderr, "              [-rotation CCW_rotation_in_degrees]\n");
@@ -529,10 +1228,38 @@ main (int argc, char **argv, char **envp)
       fprintf(stderr, "              [-target_maps map_name_prefix]\n");
       fprintf(stderr, "              [-target_maps_level level]\n");
       fprintf(stderr, "              [-update]\n");
+      fprintf(stderr, "              [-output_command upload_command_with_%%s]\n");
       fprintf(stderr, "              [-label WxH+Y+Y]\n");
+      fprintf(stderr, "              [-threads number_of_threads]\n");
+      fprintf(stderr, "              [-read_ahead number_of_images]\n");
+      fprintf(stderr, "              [-task_columns tile_columns_per_parallel_task]\n");
+      fprintf(stderr, "              [-writers number_of_tile_writer_threads]\n");
+      fprintf(stderr, "              [-inverse_cache]\n");
+      fprintf(stderr, "              [-forward]\n");
+      fprintf(stderr, "              [-gpu]\n");
+      fprintf(stderr, "              [-skip_empty]\n");
+      fprintf(stderr, "              [-bounds_index index_file]\n");
+      fprintf(stderr, "              [-append extent_file]\n");
+      fprintf(stderr, "              [-pyramid number_of_levels]\n");
+      fprintf(stderr, "              [-reduced_levels number_of_levels]\n");
+      fprintf(stderr, "              [-mipmap]\n");
+      fprintf(stderr, "              [-mipmap_cache mipmap_cache_prefix]\n");
+      fprintf(stderr, "              [-volume]\n");
+      fprintf(stderr, "              [-volume_chunk chunk_edge_length]\n");
+      fprintf(stderr, "              [-xz output_y]\n");
+      fprintf(stderr, "              [-yz output_x]\n");
+      fprintf(stderr, "              [-plan]\n");
+      fprintf(stderr, "              [-serve port]\n");
+      fprintf(stderr, "              [-resident megabytes_of_images_kept_while_serving_or_between_regions]\n");
       exit(1);
     }
 
+  /* with -PAR_PIN=n and no -threads, each worker runs a thread on
+     each cpu of its block, so that a process per node or socket
+     serves them all with one copy of the context and caches */
+  if (nThreads == 0)
+    nThreads = par_pinned_cpus() > 0 ? par_pinned_cpus() : 1;
+
   /* check that at least minimal parameters were supplied */
   if ((imageListName[0] == '\0' && imageName[0] == '\0') ||
       imagesName[0] == '\0' ||
@@ -545,22 +1272,72 @@ main (int argc, char **argv, char **envp)
   range = whiteValue - blackValue;
   if (range == 0.0)
     Error("White value cannot be same as black value\n");
-
-  /* load the font (if necessary) */
-  if (labelWidth > 0)
+  if (pyramidLevels > 0 && (tileWidth <= 0 || tileHeight <= 0))
+    Error("-pyramid requires -tile WxH\n");
+  if (mipmap && targetMapsName[0] != '\0')
+    Error("-mipmap cannot be combined with -target_maps\n");
+  if (nChain > 0 && boundsIndexName[0] != '\0')
+    Error("-compose and -inverse_compose cannot be combined with -bounds_index\n");
+  if (volume && (tileWidth > 0 || tileHeight > 0))
+    Error("-volume cannot be combined with -tile\n");
+  if (reducedLevels > 0 && (volume || tileWidth > 0 || tileHeight > 0))
+    Error("-reduced_levels cannot be combined with -tile or -volume\n");
+  if (outputCommand[0] != '\0' && (volume || update))
+    Error("-output_command cannot be combined with -volume or -update\n");
+  if (plane && (overlay || volume || tileWidth > 0 || tileHeight > 0 ||
+		regionWidth > 0 || reducedLevels > 0 ||
+		sourceMapName[0] != '\0' || targetMapsName[0] != '\0'))
+    Error("-xz and -yz cannot be combined with -overlay, -volume, -tile, -region,\n"
+	  "  -reduced_levels, -source_map or -target_maps\n");
+  if (servePort > 0 && (tileWidth <= 0 || tileHeight <= 0))
+    Error("-serve requires -tile WxH\n");
+  if (tileFormat != TILE_TIFF && (tileWidth <= 0 || tileHeight <= 0))
+    Error("-tile_format requires -tile WxH\n");
+  if (tileFormat == TILE_JPEG && (tileQuality < 70 || tileQuality > 95 ||
+				  tileQuality % 5 != 0))
+    Error("-tile_format jpg quality must be 70, 75, 80, 85, 90 or 95\n");
+#ifndef WEBP_TILES
+  if (tileFormat == TILE_WEBP)
+    Error("apply_map was built without WebP support (see WEBP_TILES_FLAGS in the Makefile)\n");
+#endif
+  if (servePort > 0 &&
+      (overlay || volume || plane || pyramidLevels > 0 || reducedLevels > 0 ||
+       mipmap || sourceMapName[0] != '\0' || targetMapsName[0] != '\0' ||
+       outputCommand[0] != '\0'))
+    Error("-serve cannot be combined with -overlay, -volume, -xz, -yz, -pyramid,\n"
+	  "  -reduced_levels, -mipmap, -source_map, -target_maps or -output_command\n");
+  if (appendName[0] != '\0' &&
+      (overlay || volume || plane || servePort > 0 ||
+       regionListName[0] != '\0'))
+    Error("-append cannot be combined with -overlay, -volume, -xz, -yz, -serve\n"
+	  "  or -regions\n");
+  if (servePort > 0 && par_enabled())
+    Error("-serve must be run as a single process\n");
+  if (planOnly && (volume || plane || servePort > 0))
+    Error("-plan cannot be combined with -volume, -xz, -yz or -serve\n");
+  if (regionListName[0] != '\0' &&
+      (regionWidth > 0 || volume || plane || servePort > 0 || planOnly ||
+       update || pyramidLevels > 0 ||
+       sourceMapName[0] != '\0' || targetMapsName[0] != '\0'))
+    Error("-regions cannot be combined with -region, -volume, -xz, -yz, -serve, -plan,\n"
+	  "  -update, -pyramid, -source_map or -target_maps\n");
+  if (regionListName[0] != '\0')
     {
-      if (!ReadImage(fontFileName, &font, &fontWidth, &fontHeight, -1, -1, -1, -1, msg))
+      ReadRegionList();
+
+      /* the images held from one region to the next count against
+	 -memory while the next is rendered */
+      if (residentLimit > memoryLimit / 2)
 	{
-	  // if we can't find the default font file, try looking in the
-          //   current directory for font.pgm; this is a hack
-	  //   to allow align to run before being formally installed
-	  if (strcmp(fontFileName, EXPAND_AND_QUOTE(FONT_FILE)) != 0 ||
-	      !ReadImage("font.pgm", &font, &fontWidth, &fontHeight,
-			 -1, -1, -1, -1, msg2))
-	    Error("Could not load font: %s\n", msg);
+	  residentLimit = memoryLimit / 2;
+	  printf("Holding at most %d MB of images between regions\n",
+		 residentLimit);
 	}
-      fontHeight = fontHeight / 95;
     }
+  SetImageCompressionLevel(compressionLevel);
+  SetImageOutputCommand(outputCommand);
+  if (mipmap)
+    sampleFactor = reductionFactor;
 
   if (imageName[0] != '\0')
     {
@@ -570,11 +1347,16 @@ main (int argc, char **argv, char **envp)
       images[0].width = -1;
       images[0].height = -1;
       images[0].image = NULL;
+      images[0].imageMapped = 0;
       images[0].mask = NULL;
       images[0].dist = NULL;
       images[0].map = NULL;
+      images[0].mapAllocated = 0;
       images[0].invMap = NULL;
-      images[0].imap = NULL;
+      images[0].scanMap = NULL;
+      images[0].quads = NULL;
+      images[0].quadRows = NULL;
+      images[0].icells = NULL;
       images[0].targetMap = NULL;
       nImages = 1;
       imagesSize = 1;
@@ -607,11 +1389,16 @@ main (int argc, char **argv, char **envp)
 	  images[nImages].width = width;
 	  images[nImages].height = height;
 	  images[nImages].image = NULL;
+	  images[nImages].imageMapped = 0;
 	  images[nImages].mask = NULL;
 	  images[nImages].dist = NULL;
 	  images[nImages].map = NULL;
+	  images[nImages].mapAllocated = 0;
 	  images[nImages].invMap = NULL;
-	  images[nImages].imap = NULL;
+	  images[nImages].scanMap = NULL;
+	  images[nImages].quads = NULL;
+	  images[nImages].quadRows = NULL;
+	  images[nImages].icells = NULL;
 	  images[nImages].targetMap = NULL;
 	  ++nImages;
 	}
@@ -619,31 +1406,79 @@ main (int argc, char **argv, char **envp)
       images = (Image *) realloc(images, nImages * sizeof(Image));
       printf("nImages = %d\n", nImages);
     }
+
+  /* stat the images and read their sizes all at once, rather than
+     one after another below */
+  if (imageManifestName[0] != '\0')
+    SetImageManifest(imageManifestName);
+  imageFiles = (char **) malloc(nImages * sizeof(char *));
+  if (imageFiles == NULL)
+    Error("Could not allocate image file names\n");
   for (i = 0; i < nImages; ++i)
     {
-      /* check that the image exists and get its modification time */
-      /* FIX:  TEMPORARY HACK */
+      imageFiles[i] = (char *) malloc(strlen(imagesName) +
+				      strlen(images[i].name) +
+				      strlen(extension) + 2);
+      if (imageFiles[i] == NULL)
+	Error("Could not allocate image file names\n");
+      sprintf(imageFiles[i], "%s%s.%s", imagesName, images[i].name, extension);
+    }
+  if (!ScanImageSizes(nImages, imageFiles, msg))
+    Error("%s", msg);
+  for (i = 0; i < nImages; ++i)
+    free(imageFiles[i]);
+  free(imageFiles);
+
+  for (i = 0; i < nImages; ++i)
+    {
+      /* check that the image exists and get its modification time
+	 and size, unless the scan found them */
       sprintf(fn, "%s%s.%s", imagesName, images[i].name, extension);
-      if (stat(fn, &sb) != 0)
+      if (LookupImageInfo(fn, &width, &height, &scannedTime))
 	{
-	  sprintf(fn, "%s%s.tif", imagesName, images[i].name);
-	  if (stat(fn, &sb) != 0)
-	    Error("Could not stat file %s\n", fn);
+	  images[i].mtime = (time_t) scannedTime;
+	  if (images[i].width < 0 || images[i].height < 0)
+	    {
+	      images[i].width = width;
+	      images[i].height = height;
+	    }
 	}
-      if (S_ISDIR(sb.st_mode))
-	Error("Image %s is a directory.\n", fn);
-      images[i].mtime = sb.st_mtime;
-
-      /* read the image size */
-      if (images[i].width < 0 || images[i].height < 0)
+      else
 	{
-	  if (!ReadImageSize(fn, &width, &height, msg))
-	    Error("Could not determine image size of %s:\n%s\n", fn, msg);
-	  images[i].width = width;
-	  images[i].height = height;
+	  /* FIX:  TEMPORARY HACK */
+	  if (stat(fn, &sb) != 0)
+	    {
+	      sprintf(fn, "%s%s.tif", imagesName, images[i].name);
+	      if (stat(fn, &sb) != 0)
+		Error("Could not stat file %s\n", fn);
+	    }
+	  if (S_ISDIR(sb.st_mode))
+	    Error("Image %s is a directory.\n", fn);
+	  images[i].mtime = sb.st_mtime;
+
+	  /* read the image size */
+	  if (images[i].width < 0 || images[i].height < 0)
+	    {
+	      if (!ReadImageSize(fn, &width, &height, msg))
+		Error("Could not determine image size of %s:\n%s\n", fn, msg);
+	      images[i].width = width;
+	      images[i].height = height;
+	    }
 	}
+      images[i].sw = (images[i].width + sampleFactor - 1) / sampleFactor;
+      images[i].sh = (images[i].height + sampleFactor - 1) / sampleFactor;
+
+      images[i].transformed = 0;
+      images[i].rendered = 0;
+      if (preTransformsName[0] != '\0')
+	ReadPreTransform(i);
     }
 
+  if (appendName[0] != '\0')
+    ReadAppendExtent();
+  if (boundsIndexName[0] != '\0')
+    ReadBoundsIndex();
+  nPreviewed = 0;
   printf("Previewing maps: ");
   fflush(stdout);
   oMinX = 1000000000;
@@ -655,56 +1490,123 @@ main (int argc, char **argv, char **envp)
   sourceMapFactor = 1 << sourceMapLevel;
   sourceMapMask = sourceMapFactor - 1;
   targetMapsFactor = 1 << targetMapsLevel;
+
+  /* with -read_ahead, the maps to be previewed are read readAhead at
+     a time by the background threads; the bounds index is consulted
+     before a map is read, so it is not read ahead */
+  if (boundsIndexName[0] == '\0')
+    StartReadAhead();
+  nextMap = 0;
+  METRICS_RANGE_BEGIN("apply_map preview");
   for (i = 0; i < nImages; ++i)
     {
+      if (prefetching && boundsIndexName[0] == '\0')
+	for (; nextMap < nImages && nextMap <= i + readAhead; ++nextMap)
+	  if (!images[nextMap].rendered)
+	    {
+	      sprintf(fn, "%s%s.map", mapsName, images[nextMap].name);
+	      PrefetchMap(fn);
+	    }
+
+      /* a section rendered by an earlier -append run is not rendered
+	 again, so its bounds are not needed */
+      if (images[i].rendered)
+	{
+	  images[i].minX = 1000000000.0;
+	  images[i].maxX = -1000000000.0;
+	  images[i].minY = 1000000000.0;
+	  images[i].maxY = -1000000000.0;
+	  images[i].mapBytes = 0;
+	  continue;
+	}
+      for (k = 0; k < nChain; ++k)
+	{
+	  sprintf(fn, "%s%s.map", chain[k].name, images[i].name);
+	  if (stat(fn, &chainSb) != 0)
+	    Error("Could not stat map %s\n", fn);
+	  if (chainSb.st_mtime > images[i].mtime)
+	    images[i].mtime = chainSb.st_mtime;
+	}
       sprintf(fn, "%s%s.map", mapsName, images[i].name);
       if (stat(fn, &sb) != 0)
 	Error("Could not stat map %s\n", fn);
       if (sb.st_mtime > images[i].mtime)
 	images[i].mtime = sb.st_mtime;
-      if (!ReadMap(fn, &map, &mLevel,
-		   &mw, &mh, &mxMin, &myMin,
-		   imName0, imName1,
-		   msg))
-	Error("Could not read map %s:\n  error: %s\n",
-	      fn, msg);
+      if (boundsIndexName[0] != '\0' && LookupBounds(i, &sb))
+	{
+	  mw = imageBounds[i].mw;
+	  mh = imageBounds[i].mh;
+	  minX = imageBounds[i].minX;
+	  maxX = imageBounds[i].maxX;
+	  minY = imageBounds[i].minY;
+	  maxY = imageBounds[i].maxY;
+	  cached = 1;
+	}
+      else
+	{
+	  if (prefetching ?
+	      !TakeMap(fn, -1, &map, &mLevel,
+		       &mw, &mh, &mxMin, &myMin,
+		       imName0, imName1,
+		       msg) :
+	      !MapMmap(fn, &map, &mLevel,
+		       &mw, &mh, &mxMin, &myMin,
+		       imName0, imName1,
+		       msg))
+	    Error("Could not read map %s:\n  error: %s\n",
+		  fn, msg);
+	  if (nChain > 0)
+	    {
+	      cmap = ComposeChain(i, map, mLevel, mw, mh);
+	      if (prefetching)
+		free(map);
+	      else
+		MapMunmap(map, mw, mh);
+	      map = cmap;
+	    }
 
-      spacing = (1 << mLevel) * mapScale;
-      minX = 1000000000;
-      maxX = -1000000000;
-      minY = 1000000000;
-      maxY = -1000000000;
-      for (y = 0; y < mh-1; ++y)
-	for (x = 0; x < mw-1; ++x)
-	  {
-	    if (map[y*mw+x].c == 0.0 ||
-		map[y*mw+x+1].c == 0.0 ||
-		map[(y+1)*mw+x].c == 0.0 ||
-		map[(y+1)*mw+x+1].c == 0.0)
-	      continue;
-	    for (dy = 0; dy < 2; ++dy)
-	      for (dx = 0; dx < 2; ++dx)
-		{
-		  rx = map[(y+dy)*mw+x+dx].x * spacing;
-		  ry = map[(y+dy)*mw+x+dx].y * spacing;
-		  if (rotation != 0.0)
+	  spacing = (1 << mLevel) * mapScale;
+	  minX = 1000000000;
+	  maxX = -1000000000;
+	  minY = 1000000000;
+	  maxY = -1000000000;
+	  for (y = 0; y < mh-1; ++y)
+	    for (x = 0; x < mw-1; ++x)
+	      {
+		if (map[y*mw+x].c == 0.0 ||
+		    map[y*mw+x+1].c == 0.0 ||
+		    map[(y+1)*mw+x].c == 0.0 ||
+		    map[(y+1)*mw+x+1].c == 0.0)
+		  continue;
+		for (dy = 0; dy < 2; ++dy)
+		  for (dx = 0; dx < 2; ++dx)
 		    {
-		      rxp = rx - rotationX;
-		      ryp = ry - rotationY;
-		      rx = cosRot * rxp + sinRot * ryp + rotationX;
-		      ry = -sinRot * rxp + cosRot * ryp + rotationY;
+		      rx = map[(y+dy)*mw+x+dx].x * spacing;
+		      ry = map[(y+dy)*mw+x+dx].y * spacing;
+		      if (rotation != 0.0)
+			{
+			  rxp = rx - rotationX;
+			  ryp = ry - rotationY;
+			  rx = cosRot * rxp + sinRot * ryp + rotationX;
+			  ry = -sinRot * rxp + cosRot * ryp + rotationY;
+			}
+		      if (rx < minX)
+			minX = rx;
+		      if (rx > maxX)
+			maxX = rx;
+		      if (ry < minY)
+			minY = ry;
+		      if (ry > maxY)
+			maxY = ry;
 		    }
-		  if (rx < minX)
-		    minX = rx;
-		  if (rx > maxX)
-		    maxX = rx;
-		  if (ry < minY)
-		    minY = ry;
-		  if (ry > maxY)
-		    maxY = ry;
-		}
-	  }
-      free(map);
+	      }
+	  if (nChain > 0 || prefetching)
+	    free(map);
+	  else
+	    MapMunmap(map, mw, mh);
+	  cached = 0;
+	  ++nPreviewed;
+	}
       images[i].mapBytes = mw * mh * (sizeof(MapElement) + sizeof(InverseMapElement) +
 				      sizeof(unsigned char)) +
 	5 * 5 * sizeof(long long) +
@@ -726,17 +1628,46 @@ main (int argc, char **argv, char **envp)
       if (maxY > oMaxY)
 	oMaxY = (int) ceil(maxY);
 
-      if (imapsName[0] != '\0')
+      if (imapsName[0] != '\0' && cached)
+	images[i].mapBytes += (imageBounds[i].imapw - 1) *
+	  (imageBounds[i].imaph - 1) * sizeof(IntensityCell);
+      else if (imapsName[0] != '\0')
 	{
 	  sprintf(fn, "%s%s.map", imapsName, images[i].name);
-	  if (!ReadMap(fn, &imap, &imapLevel,
+	  if (!MapMmap(fn, &imap, &imapLevel,
 		       &imapw, &imaph, &imapXMin, &imapYMin,
 		       imapName0, imapName1,
 		       msg))
 	    Error("Could not read map %s:\n  error: %s\n",
 		  fn, msg);
-	  images[i].mapBytes += imapw * imaph * sizeof(MapElement);
-	  free(imap);
+	  images[i].mapBytes += (imapw - 1) * (imaph - 1) *
+	    sizeof(IntensityCell);
+	  MapMunmap(imap, imapw, imaph);
+	}
+
+      if (boundsIndexName[0] != '\0' && !cached)
+	{
+	  /* record what was found for the index */
+	  imageBounds[i].name = images[i].name;
+	  imageBounds[i].mapMtime = sb.st_mtime;
+	  imageBounds[i].mapSize = sb.st_size;
+	  imageBounds[i].mw = mw;
+	  imageBounds[i].mh = mh;
+	  imageBounds[i].minX = minX;
+	  imageBounds[i].maxX = maxX;
+	  imageBounds[i].minY = minY;
+	  imageBounds[i].maxY = maxY;
+	  imageBounds[i].imapMtime = -1;
+	  imageBounds[i].imapSize = -1;
+	  imageBounds[i].imapw = 0;
+	  imageBounds[i].imaph = 0;
+	  if (imapsName[0] != '\0' && stat(fn, &imapSb) == 0)
+	    {
+	      imageBounds[i].imapMtime = imapSb.st_mtime;
+	      imageBounds[i].imapSize = imapSb.st_size;
+	      imageBounds[i].imapw = imapw;
+	      imageBounds[i].imaph = imaph;
+	    }
 	}
 
       if (targetMapsName[0] != '\0')
@@ -744,6 +1675,9 @@ main (int argc, char **argv, char **envp)
 	  ((images[i].width + targetMapsFactor - 1) / targetMapsFactor) *
 	  ((images[i].height + targetMapsFactor - 1) / targetMapsFactor) *
 	  sizeof(MapElement);
+      if (forwardRender)
+	images[i].mapBytes += (maxX - minX) * (maxY - minY) /
+	  (SCAN_CELL * SCAN_CELL) * (sizeof(MapElement) + 1);
 
       if ((nProcessed % 50) == 0 && nProcessed != 0)
 	printf(" %d\n    ", nProcessed);
@@ -751,14 +1685,66 @@ main (int argc, char **argv, char **envp)
       fflush(stdout);
       ++nProcessed;
     }
+  METRICS_RANGE_END();
 
   printf("\nAll images previewed.\n");
+  if (boundsIndexName[0] != '\0')
+    {
+      printf("%d of %d maps previewed from the bounds index.\n",
+	     nImages - nPreviewed, nImages);
+      if (nPreviewed > 0)
+	WriteBoundsIndex();
+    }
+  if (haveAppendExtent)
+    {
+      /* the tile grid of the sections already rendered is kept, so
+	 whatever of the new sections falls outside it is cut off */
+      if (oMinX < appendMinX || oMaxX > appendMaxX ||
+	  oMinY < appendMinY || oMaxY > appendMaxY)
+	fprintf(stderr, "Warning: the new sections (%d to %d, %d to %d) extend beyond the\n"
+		"  stored output extent, and will be cut to it\n",
+		oMinX, oMaxX, oMinY, oMaxY);
+      oMinX = appendMinX;
+      oMaxX = appendMaxX;
+      oMinY = appendMinY;
+      oMaxY = appendMaxY;
+    }
+  else if (appendName[0] != '\0')
+    {
+      appendMinX = oMinX;
+      appendMaxX = oMaxX;
+      appendMinY = oMinY;
+      appendMaxY = oMaxY;
+    }
   oWidth = oMaxX - oMinX + 1;
   oHeight = oMaxY - oMinY + 1;
   printf("output width = %zu (%d to %d) output height = %zu (%d to %d)\n\n",
 	 oWidth, oMinX, oMaxX,
 	 oHeight, oMinY, oMaxY);
 
+  /* a plane through the sections is rendered as the region one
+     output pixel thick that it cuts from each of them */
+  if (plane == PLANE_XZ)
+    {
+      if (planePosition < oMinY || planePosition > oMaxY)
+	Error("-xz position %d is outside the output (y = %d to %d)\n",
+	      planePosition, oMinY, oMaxY);
+      regionWidth = oWidth;
+      regionHeight = reductionFactor;
+      regionOffsetX = oMinX;
+      regionOffsetY = planePosition;
+    }
+  else if (plane == PLANE_YZ)
+    {
+      if (planePosition < oMinX || planePosition > oMaxX)
+	Error("-yz position %d is outside the output (x = %d to %d)\n",
+	      planePosition, oMinX, oMaxX);
+      regionWidth = reductionFactor;
+      regionHeight = oHeight;
+      regionOffsetX = planePosition;
+      regionOffsetY = oMinY;
+    }
+
   if (regionWidth > 0)
     {
       oWidth = regionWidth;
@@ -803,763 +1789,1971 @@ main (int argc, char **argv, char **envp)
     printf("Tiling output into %d rows and %d columns\n",
 	   rows, cols);
 
-  increase = (size_t*) malloc(oWidth * sizeof(size_t));
-  decrease = (size_t*) malloc(oWidth * sizeof(size_t));
-  if (increase == 0 || decrease == 0)
-    Error("malloc of increase/decrease failed; errno = %d\n", errno);
+  /* when only part of the output is rendered by each task, it is
+     cheaper to read just the part of each map that lands there; the
+     rotation is applied to the whole map, so this is done only
+     without one */
+  partialMaps = (regionWidth > 0 || cols > 1) && rotation == 0.0 &&
+    nChain == 0 && nRegions == 0;
+  if (pyramidLevels > 0)
+    {
+      /* beyond the level that fits in a single tile, further
+	 levels would only repeat it */
+      for (n = 1; (1 << (n - 1)) < cols || (1 << (n - 1)) < rows; ++n) ;
+      if (pyramidLevels > n)
+	pyramidLevels = n;
+      printf("Output image pyramid will have %d levels.\n", pyramidLevels);
+    }
 
-  for (oi = 0; oi < nOutputImages; ++oi)
+  /* hand out one task for each range of tile columns of each
+     output image; the source map and target maps cover whole
+     output images, so those are never split */
+  if (taskColumns <= 0)
     {
-      if (overlay)
-	{
-	  startImage = 0;
-	  endImage = nImages-1;
-	  if (labelWidth > 0)
-	    strncpy(label, (labelName[0] != '\0') ? labelName : outputName,
-		    MAX_LABEL_LENGTH);
-	}
+      if (!par_enabled())
+	taskColumns = cols;
       else
 	{
-	  startImage = oi;
-	  endImage = oi;
-	  if (labelWidth > 0)
-	    snprintf(label, MAX_LABEL_LENGTH, "%s%s",
-		     labelName, images[oi].name);
-	}
-      if (labelWidth > 0)
-	{
-	  label[MAX_LABEL_LENGTH] = '\0';
-	  labelMinX = labelOffsetX;
-	  labelMaxX = labelMinX + strlen(label) * labelWidth - 1;
-	  labelMinY = labelOffsetY;
-	  labelMaxY = labelMinY + labelHeight - 1;
+	  /* aim for about 4 tasks per worker; the workers may not all
+	     have reported in yet, so count the processes instead */
+	  n = par_processes();
+	  if (n < 2)
+	    n = 2;
+	  n = (4 * (n - 1) + nOutputImages - 1) / nOutputImages;
+	  taskColumns = (cols + n - 1) / n;
 	}
+    }
+  if (pyramidLevels > 1)
+    {
+      /* each task builds whole tiles of the coarsest pyramid level */
+      n = 1 << (pyramidLevels - 1);
+      taskColumns = (taskColumns + n - 1) / n * n;
+    }
+  if (taskColumns > cols ||
+      sourceMapName[0] != '\0' ||
+      targetMapsName[0] != '\0')
+    taskColumns = cols;
+
+  /* with -regions, each task renders every region of an output image,
+     so that the images are loaded once for all the regions they
+     cover */
+  if (nRegions > 0)
+    {
+      taskColumns = cols;
+      printf("Rendering %d regions of each output image\n", nRegions);
+    }
+
+  if (volume)
+    {
+      /* each task renders one slab of output images, one chunk deep */
+      taskColumns = cols;
+      if (!CreateVolume(outputName, (int) tw, (int) th, nOutputImages,
+			volumeChunk, msg))
+	Error("Could not create output volume %s:\n  error: %s\n",
+	      outputName, msg);
+      printf("Output volume of %d x %d x %d bytes will have chunks of %d^3.\n",
+	     (int) tw, (int) th, nOutputImages, volumeChunk);
+    }
+
+  if (servePort > 0)
+    {
+      par_set_context();
+      ServeTiles(servePort);
+      return;
+    }
+
+  if (plane)
+    {
+      planeLength = (int) (tw * th);
+      planeImage = (unsigned char *) malloc(((size_t) planeLength) *
+					    nOutputImages);
+      if (planeImage == NULL)
+	Error("Could not allocate plane image\n");
+      memset(planeImage, 0, ((size_t) planeLength) * nOutputImages);
+    }
 
-      updateOutput = update;
-      if (sourceMapName[0] != '\0')
+  par_set_context();
+
+  /* with -update, an output image is rendered again only if its
+     dependency sidecar shows that the contents of its images, maps
+     or masks, or the settings it was rendered with, have changed;
+     volumes, planes and source maps are always rendered in full */
+  current = NULL;
+  depsInputs = NULL;
+  depsNames = NULL;
+  nCurrent = 0;
+  if (update && !volume && !plane && !planOnly && sourceMapName[0] == '\0')
+    {
+      n = (overlay ? nImages : 1) * (6 + nChain);
+      current = (int *) malloc(nOutputImages * sizeof(int));
+      depsInputs = (char **) malloc(n * sizeof(char *));
+      depsNames = (char *) malloc(((size_t) n) * PATH_MAX);
+      if (current == NULL || depsInputs == NULL || depsNames == NULL)
+	Error("Could not allocate dependency lists\n");
+      for (oi = 0; oi < nOutputImages; ++oi)
 	{
-	  sourceMap = NULL;
-	  sourceMapWidth = (oWidth + sourceMapFactor - 1) / sourceMapFactor;
-	  sourceMapHeight = (oHeight + sourceMapFactor - 1) / sourceMapFactor;
-	  sourceMapSize = sourceMapWidth * sourceMapHeight;
-#if 0
-	  if (updateOutput)
-	    {
-	      // in order to update, we must successfully read in
-	      //   the old source map
-	      if (!ReadMap(sourceMapName, &sourceMap, &oldSourceMapLevel,
-			   &oldSourceMapWidth, &oldSourceMapHeight,
-			   &oldSourceMapMinX, &oldSourceMapMinY,
-			   imName0, imName1,
-			   msg) ||
-		  oldSourceMapLevel != sourceMapLevel ||
-		  oldSourceMapWidth != sourceMapWidth ||
-		  oldSourceMapHeight != sourceMapHeight ||
-		  oldSourceMapMinX != 0 ||
-		  oldSourceMapMinY != 0)
-		updateOutput = 0;
-	    }
-	  if (!updateOutput)
+	  nDeps = OutputDeps(oi, depsName, depsParams, depsInputs, depsNames);
+	  current[oi] = DepsCurrent(depsName, depsParams,
+				    nDeps, depsInputs) == 1;
+	  if (current[oi] && tileWidth < 0 && tileHeight < 0)
 	    {
-#endif
-	      //	      printf("malloc %zu bytes for sourceMap\n",
-	      //		     sourceMapSize * sizeof(MapElement));
-	      sourceMap = (MapElement *) malloc(sourceMapSize * 
-						sizeof(MapElement));
-	      if (sourceMap == 0)
-		Error("malloc of sourceMap failed; errno = %d\n", errno);
-
-	      for (y = 0; y < sourceMapHeight; ++y)
-		for (x = 0; x < sourceMapWidth; ++x)
-		  {
-		    sourceMap[y*sourceMapWidth + x].x = 0.0;
-		    sourceMap[y*sourceMapWidth + x].y = 0.0;
-		    sourceMap[y*sourceMapWidth + x].c = -1.0;
-		  }
-#if 0
+	      OutputFileName(fn, 0, 0, images[oi].name);
+	      current[oi] = stat(fn, &sb) == 0;
 	    }
-#endif
+	  if (current[oi])
+	    ++nCurrent;
 	}
-      else
+      if (nCurrent > 0)
+	printf("Skipping %d of %d output images since up-to-date\n",
+	       nCurrent, nOutputImages);
+    }
+
+  nTasks = 0;
+  for (oi = 0; oi < nOutputImages; oi += t.nSections)
+    {
+      t.nSections = 1;
+      if (volume)
 	{
-	  sourceMapWidth = 0;
-	  sourceMapHeight = 0;
-	  sourceMap = NULL;
+	  t.nSections = volumeChunk;
+	  if (oi + t.nSections > nOutputImages)
+	    t.nSections = nOutputImages - oi;
 	}
-
-      for (hs = 1; ; hs *= 2)
+      if (current != NULL && current[oi])
+	continue;
+      if (images[oi].rendered)
+	continue;
+      for (tCol = 0; tCol < cols; tCol += taskColumns)
 	{
-	  endY = oMinY - 1;
-	  for (hi = 0; hi < hs; ++hi)
-	    {
-	      startY = endY + 1;
-	      if (cols == 1)
-		{
-		  endY = oMinY + (hi + 1) * oHeight / hs - 1;
-		  endY = ((endY - startY + 1) / reductionFactor) *
-		    reductionFactor + startY - 1;
-		  outHeight = rows * th;
-		  outWidth = tw;
-		}
-	      else
-		{
-		  outHeight = ((oHeight / hs + th * reductionFactor - 1) /
-			       (th * reductionFactor)) *
-		    (th * reductionFactor);
-		  if (startY + ((int) outHeight) - 1 > oMaxY)
-		    outHeight = oMaxY - startY + 1;
-		  outWidth = tw;
-		  if (outHeight == 0)
-		    Error("Insufficent memory to construct a single row of tiles.\n");
-		  endY = startY + ((int) outHeight) - 1;
-		}
-	      canvasHeight = endY - startY + 1;
-	      if (canvasHeight < reductionFactor)
-		Error("Insufficent memory to construct a horizontal row\n");
-
-	      memset(increase, 0, oWidth * sizeof(size_t));
-	      memset(decrease, 0, oWidth * sizeof(size_t));
+	  t.section = oi;
+	  t.startCol = tCol;
+	  t.endCol = tCol + taskColumns - 1;
+	  if (t.endCol >= cols)
+	    t.endCol = cols - 1;
+	  par_delegate_task();
+	  ++nTasks;
+	}
+    }
+  par_finish();
+  printf("All %d rendering tasks completed.\n", nTasks);
 
-	      for (i = startImage; i <= endImage; ++i)
-		{
-		  iMinX = (int) floor(images[i].minX);
-		  iMaxX = (int) ceil(images[i].maxX);
-		  iMinY = (int) floor(images[i].minY);
-		  iMaxY = (int) ceil(images[i].maxY);
-		  if (iMinY > endY || iMaxY < startY)
-		    continue;
-		  memoryRequired = images[i].width * images[i].height *
-		    (sizeof(unsigned char) + sizeof(unsigned char)) +
-		    ((images[i].width + 7 ) / 8) * images[i].height +
-		    images[i].mapBytes;
-		  if (iMinX <= oMinX && iMaxX >= oMinX)
-		    increase[0] += memoryRequired;
-		  else if (iMinX <= oMaxX && iMaxX >= oMinX)
-		    increase[iMinX - oMinX] += memoryRequired;
-		  if (iMaxX >= oMinX && iMaxX < oMaxX-1)
-		    decrease[iMaxX - oMinX + 1] += memoryRequired;
-		}
-	      
-	      memoryRequired = 0;
-	      maxMemoryRequired = 0;
-	      for (i = 0; i < oWidth; ++i)
-		{
-		  memoryRequired += increase[i];
-		  memoryRequired -= decrease[i];
-		  if (memoryRequired > maxMemoryRequired)
-		    maxMemoryRequired = memoryRequired;
-		}
-	      maxMemoryRequired += sourceMapWidth * sourceMapHeight *
-		sizeof(MapElement);
-	      maxMemoryRequired += outHeight * outWidth * sizeof(unsigned char);
-	      maxMemoryRequired += 2 * oWidth * sizeof(size_t);
-	      maxMemoryRequired += 2 * reductionFactor * canvasHeight * sizeof(unsigned char);
-	      if (maxMemoryRequired > ((size_t) memoryLimit) * 1000000)
-		break;
-	    }
-	  if (hi >= hs)
-	    break;
+  if (current != NULL)
+    {
+      for (oi = 0; oi < nOutputImages; ++oi)
+	{
+	  if (current[oi] || images[oi].rendered)
+	    continue;
+	  nDeps = OutputDeps(oi, depsName, depsParams, depsInputs, depsNames);
+	  if (!WriteDeps(depsName, depsParams, nDeps, depsInputs))
+	    fprintf(stderr, "Could not write dependency sidecar %s\n",
+		    depsName);
 	}
-      if (hs > 1)
-	printf("Splitting rendering into %d horizontal strips\n", hs);
+      free(current);
+      free(depsInputs);
+      free(depsNames);
+    }
+  if (appendName[0] != '\0' && !planOnly)
+    WriteAppendExtent();
 
-      // do horizontal strips one-at-a-time
-      endY = oMinY - 1;
-      for (hi = 0; hi < hs; ++hi)
+  if (planOnly)
+    {
+      /* the work is measured by the output area each image covers */
+      work = 0.0;
+      for (i = 0; i < nImages; ++i)
 	{
-	  //	  PrintUsage();
+	  minX = images[i].minX > oMinX ? images[i].minX : oMinX;
+	  maxX = images[i].maxX < oMaxX ? images[i].maxX : oMaxX;
+	  minY = images[i].minY > oMinY ? images[i].minY : oMinY;
+	  maxY = images[i].maxY < oMaxY ? images[i].maxY : oMaxY;
+	  if (maxX > minX && maxY > minY)
+	    work += ((double) (maxX - minX)) * (maxY - minY);
+	}
+      n = par_processes();
+      if (n < 2)
+	n = 2;
+      printf("\nPlan: %d tasks, %d horizontal strips and %d column passes in all\n",
+	     planTasks, planTotalStrips, planTotalPasses);
+      printf("Predicted peak memory per worker: %.1f MB (-memory %d MB)\n",
+	     planMaxPeak / 1000000.0, memoryLimit);
+      printf("Tasks per worker with %d worker%s: %.1f\n",
+	     n - 1, n > 2 ? "s" : "", ((double) planTasks) / (n - 1));
+      printf("Estimated work: %.1f megapixels of output to paint\n",
+	     work / 1000000.0);
+      if (planFailed > 0)
+	printf("%d tasks would not fit in -memory %d MB\n",
+	       planFailed, memoryLimit);
+      return;
+    }
 
-	  startY = endY + 1;
-	  if (cols == 1)
-	    {
-	      endY = oMinY + (int) ((hi + 1) * oHeight / hs) - 1;
-	      endY = ((endY - startY + 1) / reductionFactor) *
-		reductionFactor + startY - 1;
-	      outHeight = rows * th;
-	      outWidth = tw;
-	      if (hi == 0)
-		{
-		  //	printf("malloc %zu bytes for out  (cols == 1)\n",
-		  //		 outHeight * outWidth *
-		  //		 sizeof(unsigned char));
-		  out = (unsigned char *) malloc(outHeight * outWidth *
-						 sizeof(unsigned char));
-		  if (out == 0)
-		    Error("malloc of out failed; errno = %d\n", errno);
-		}
-	      outMinY = oMinY;
-	      startRow = 0;
-	      endRow = rows-1;
-	    }
-	  else
-	    {
-	      outHeight = ((oHeight / hs + th * reductionFactor - 1) /
-			   (th * reductionFactor)) *
-		(th * reductionFactor);
-	      if (startY + ((int) outHeight) - 1 > oMaxY)
-		outHeight = oMaxY - startY + 1;
-	      outWidth = tw;
-	      if (outHeight == 0)
-		Error("Insufficent memory to construct a single row of tiles.\n");
-	      endY = startY + outHeight - 1;
-	      //	      printf("malloc %zu bytes for out (cols != 1)\n",
-	      //		     outHeight * outWidth *
-	      //		     sizeof(unsigned char));
-	      out = (unsigned char *) malloc(outHeight * outWidth *
-					     sizeof(unsigned char));
-	      if (out == 0)
-		Error("malloc of out (2) failed; errno = %d\n", errno);
+  if (plane)
+    {
+      if (outputName[strlen(outputName)-1] == '/')
+	sprintf(fn, "%s%s.tif", outputName, plane == PLANE_XZ ? "xz" : "yz");
+      else
+	sprintf(fn, "%s.tif", outputName);
+      printf("Writing %s plane of %d x %d pixels to %s\n",
+	     plane == PLANE_XZ ? "XZ" : "YZ", planeLength, nOutputImages, fn);
+      if (ImageOutputIsLocal() && !CreateDirectories(fn))
+	Error("Could not create directories for output file %s\n", fn);
+      if (!WriteImage(fn, planeImage, planeLength, nOutputImages,
+		      (enum ImageCompression) compress, msg))
+	Error("Could not write output file %s:\n  error: %s\n", fn, msg);
+      free(planeImage);
+      return;
+    }
 
-	      outMinY = startY;
-	      startRow = (startY - oMinY) / (th * reductionFactor);
-	      endRow = (endY - oMinY) / (th * reductionFactor);
-	    }
+  //  PrintUsage();
 
-	  memset(increase, 0, oWidth * sizeof(size_t));
-	  memset(decrease, 0, oWidth * sizeof(size_t));
-	  for (i = startImage; i <= endImage; ++i)
-	    {
-	      iMinX = (int) floor(images[i].minX);
-	      iMaxX = (int) ceil(images[i].maxX);
-	      iMinY = (int) floor(images[i].minY);
-	      iMaxY = (int) ceil(images[i].maxY);
-	      if (iMinY > endY || iMaxY < startY)
-		continue;
-	      memoryRequired = images[i].width * images[i].height *
-		(sizeof(unsigned char) + sizeof(unsigned char)) +
-		((images[i].width + 7 ) / 8) * images[i].height +
-		images[i].mapBytes;
-	      if (iMinX <= oMinX && iMaxX >= oMinX)
-		increase[0] += memoryRequired;
-	      else if (iMinX <= oMaxX && iMaxX >= oMinX)
-		increase[iMinX - oMinX] += memoryRequired;
-	      if (iMaxX >= oMinX && iMaxX < oMaxX-1)
-		decrease[iMaxX - oMinX + 1] += memoryRequired;
-	    }
+  if (nRegions > 0)
+    for (k = 0; k < nRegions; ++k)
+      {
+	SelectRegion(k);
+	WriteSizeFile();
+      }
+  else
+    WriteSizeFile();
+}
 
-	  //	  PrintUsage();
+/* WriteSizeFile writes the size file of the output, giving its tiling,
+   its extent, and its size in output pixels */
+void
+WriteSizeFile ()
+{
+  FILE *f;
+  char fn[PATH_MAX];
+  char staged[PATH_MAX];
+  char msg[PATH_MAX+256];
 
-	  imageMem = 0;
-	  canvasWidth = 0;
-	  canvasHeight = endY - startY + 1;
-	  canvasMinX = oMinX;
-	  canvasMinY = startY;
-	  weightMinX = oMinX;
-	  weightMinY = startY;
-	  tx = 0;
-	  ty = (startY - outMinY) / reductionFactor;
-	  tCol = 0;
-
-	  // render from left to right across the output
-	  startX = oMinX;
-	  do {
-	    //	    PrintUsage();
-	    // see how far we can increase endX while still satisfying
-	    //   memory constraints
-	    endX = startX-1;
-	    memoryRequired = imageMem;
-	    memoryRequired += sourceMapWidth * sourceMapHeight *
-	      sizeof(MapElement);
-	    memoryRequired += outHeight * outWidth * sizeof(unsigned char);
-	    //	    printf("memreq1 = %zu\n", memoryRequired);
-	    memoryRequired += 2 * oWidth * sizeof(size_t);
-	    //	    printf("memreq2 = %zu\n", memoryRequired);
-	    memoryRequired += (startX - canvasMinX) * canvasHeight *
-	      sizeof(unsigned char);
-	    //	    printf("memreq3 = %zu\n", memoryRequired);
-	    if (!overlay)
-	      memoryRequired += images[oi].width * images[oi].height *
-		(sizeof(unsigned char) + sizeof(unsigned char)) +
-		((images[oi].width + 7) / 8) * images[oi].height +
-		images[oi].mapBytes;
-	    //	    printf("memreq4 = %zu   (%d %d %d %d %d %d)\n", memoryRequired,
-	    //		   oi, images[oi].width, images[oi].height, images[oi].mapBytes,
-	    //		   startImage, endImage);
-	    while (memoryRequired < ((size_t) memoryLimit) * 1000000 &&
-		   endX < oMaxX)
-	      {
-		++endX;
-		memoryRequired += canvasHeight *
-		  (sizeof(unsigned char) + sizeof(unsigned short));
-		if (overlay)
-		  {
-		    memoryRequired += increase[endX - oMinX];
-		    memoryRequired -= decrease[endX - oMinX];
-		  }
-	      }
-	    if (memoryRequired >= ((size_t) memoryLimit) * 1000000)
-	      --endX;
-	    if (endX < startX)
-	      Error("Internal error: not enough memory to construct a single pixel column\n%d %d %d %d %zu",
-		    startX, endX, startY, endY, memoryRequired);
-	    if (endX < oMaxX &&
-		endX - canvasMinX + 1 < reductionFactor)
-	      Error("Internal error: not enough memory to construct a column of the output image\n");
-	    printf("Rendering area from x=%d to x=%d, y=%d to y=%d\n",
-		   startX, endX, startY, endY);
-
-	    //	    PrintUsage();
-
-
-	    // resize the canvas
-	    oldCanvasWidth = canvasWidth;
-	    canvasWidth = endX - canvasMinX + 1;
-	    //	    printf("realloc canvas from %zu bytes to %zu bytes\n",
-	    //		   oldCanvasWidth * canvasHeight * sizeof(unsigned char),
-	    //		   canvasWidth * canvasHeight * sizeof(unsigned char));
-	    canvas = (unsigned char *) realloc(canvas, canvasWidth * canvasHeight * sizeof(unsigned char));
-	    weightWidth = endX - startX + 1;
-	    weightHeight = canvasHeight;
-	    //	    printf("malloc %zu bytes for weight\n",
-	    //		   weightWidth * weightHeight * sizeof(unsigned short));
-	    weight = (unsigned short *) malloc(weightWidth * weightHeight * sizeof(unsigned short));
-	    if (weight == 0)
- 	      Error("malloc of weight failed; errno = %d\n", errno);
-	    memset(weight, 0xff, weightWidth * weightHeight * sizeof(unsigned short));
-
-	    // shift any pixels present in the canvas to their new positions
-	    for (y = canvasHeight-1; y >= 0; --y)
-	      {
-		if (oldCanvasWidth > 0)
-		  memmove(&canvas[y*canvasWidth], &canvas[y*oldCanvasWidth],
-			  oldCanvasWidth * sizeof(unsigned char));
-		memset(&canvas[y*canvasWidth+oldCanvasWidth], 0, canvasWidth-oldCanvasWidth);
-	      }
-	    oldCanvasWidth = canvasWidth;
+  printf("\nWriting size file... ");
+  fflush(stdout);
 
-	    //	    PrintUsage();
+  if (strlen(outputName) == 0)
+    strcpy(fn, "size");
+  else if (outputName[strlen(outputName)-1] == '/')
+    sprintf(fn, "%ssize", outputName);
+  else
+    sprintf(fn, "%s.size", outputName);
+  if (!ImageOutputIsLocal() && !StageOutputFile(fn, staged, msg))
+    Error("Could not stage size file %s:\n  error: %s\n", fn, msg);
+  if (nRegions > 0 && ImageOutputIsLocal() && !CreateDirectories(fn))
+    Error("Could not create directories for size file %s\n", fn);
+  f = fopen(ImageOutputIsLocal() ? fn : staged, "w");
+  if (f == NULL)
+    Error("Could not open size file %s for writing.\n", fn);
+  fprintf(f, "%d %d\n%zdx%zd%+d%+d\n%zdx%zd\n",
+	  rows, cols,
+	  oWidth, oHeight, oMinX, oMinY,
+	  oWidth / reductionFactor, oHeight / reductionFactor);
+  fclose(f);
+  if (!ImageOutputIsLocal() && !SendOutputFile(staged, fn, msg))
+    Error("Could not send size file %s:\n  error: %s\n", fn, msg);
+  printf("done.\n");
+  fflush(stdout);
+}
 
-	    // paint the old images
-	    printf("Applying loaded image maps");
-	    fflush(stdout);
-	    nProcessed = 0;
-	    for (i = startImage; i <= endImage; ++i)
-	      if (images[i].minX < startX &&
-		  images[i].maxX >= startX &&
-		  images[i].minY <= endY &&
-		  images[i].maxY >= startY)
-		{
-		  PaintImage(i, startX, endX, startY, endY);
-		  if ((nProcessed % 50) == 0 && nProcessed != 0)
-		    printf(" %d\n    ", nProcessed);
-		  printf(".");
-		  fflush(stdout);
-		  ++nProcessed;
-		}
+void
+MasterResult ()
+{
+  if (planOnly)
+    {
+      printf("Plan for %s columns %d to %d: %d strips, ",
+	     overlay ? outputName : images[r.section].name,
+	     r.startCol + 1, r.endCol + 1, r.strips);
+      if (r.passes < 0)
+	printf("a column would not fit in -memory\n");
+      else
+	printf("%d column passes, peak %.1f MB\n",
+	       r.passes, r.peak / 1000000.0);
+      ++planTasks;
+      planTotalStrips += r.strips;
+      if (r.passes < 0)
+	++planFailed;
+      else
+	planTotalPasses += r.passes;
+      if (r.peak > planMaxPeak)
+	planMaxPeak = r.peak;
+      ++nResults;
+      return;
+    }
+  if (plane)
+    memcpy(&planeImage[((size_t) r.section) * planeLength], r.line,
+	   planeLength);
+  if (nRegions > 0)
+    printf("Rendered %d regions of %s\n", nRegions,
+	   overlay ? outputName : images[r.section].name);
+  else
+    printf("Rendered %s columns %d to %d\n",
+	   overlay ? outputName : images[r.section].name,
+	   r.startCol + 1, r.endCol + 1);
+  fflush(stdout);
+  ++nResults;
+}
 
-	    //	    PrintUsage();
+/* TILE SERVER PROCEDURES */
 
-	    // paint the new images
-	    printf("\nApplying new image maps");
-	    fflush(stdout);
-	    nProcessed = 0;
-	    for (i = startImage; i <= endImage; ++i)
-	      if (images[i].minX >= startX &&
-		  images[i].minX <= endX &&
-		  images[i].minY <= endY &&
-		  images[i].maxY >= startY)
-		{
-		  PaintImage(i, startX, endX, startY, endY);
-		  if ((nProcessed % 50) == 0 && nProcessed != 0)
-		    printf(" %d\n    ", nProcessed);
-		  printf(".");
-		  fflush(stdout);
-		  ++nProcessed;
-		}
+/* ServeTiles answers HTTP requests for single output tiles, of the form
+     GET /<image name>/<level>/<x>/<y>
+   where level is the power of 2 by which the tile is reduced and x and
+   y count tiles from the top-left of the output, starting at 0; each
+   tile is painted when it is first asked for, from images, maps and
+   inverse maps kept resident up to the -resident budget, and stored
+   as <output><image name>/<level>/cXXrYY.tif, which is sent as is
+   until the image's map changes */
+void
+ServeTiles (int port)
+{
+  int s, c;
+  int on;
+  struct sockaddr_in addr;
 
-	    //	    PrintUsage();
+  serveMinX = oMinX;
+  serveMinY = oMinY;
+  serveWidth = (int) oWidth;
+  serveHeight = (int) oHeight;
+  serveTw = (int) tw;
+  serveTh = (int) th;
+  for (serveLevels = 1;
+       (serveTw << (serveLevels - 1)) < serveWidth ||
+	 (serveTh << (serveLevels - 1)) < serveHeight;
+       ++serveLevels) ;
+  imageUsed = (long *) malloc(nImages * sizeof(long));
+  if (imageUsed == NULL)
+    Error("Could not allocate image use table\n");
+  memset(imageUsed, 0, nImages * sizeof(long));
+  serving = 1;
+  partialMaps = 0;
+  tileWidth = -1;
+  tileHeight = -1;
+  signal(SIGPIPE, SIG_IGN);
 
-	    // paint the label if requested
-	    if (labelWidth > 0)
-	      {
-		printf("\nPainting label");
-		fflush(stdout);
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    Error("Could not create socket; errno = %d\n", errno);
+  on = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    Error("Could not bind to port %d; errno = %d\n", port, errno);
+  if (listen(s, 16) != 0)
+    Error("Could not listen on port %d; errno = %d\n", port, errno);
+  printf("Serving %d x %d tiles of %d images, %d levels, on port %d\n",
+	 serveTw, serveTh, nImages, serveLevels, port);
+  fflush(stdout);
 
-		if (labelMinX <= endX &&
-		    labelMaxX >= startX &&
-		    labelMinY <= endY &&
-		    labelMaxY >= startY)
-		  {
-		    len = strlen(label);
-		    for (i = 0; i < len; ++i)
-		      {
-			ci = label[i] - 32;
-			if (ci < 0 || ci > 94)
-			  continue;
-			charMinX = labelMinX + i * labelWidth;
-			charMaxX = charMinX + labelWidth - 1;
-			if (charMinX > endX ||
-			    charMaxX < startX)
-			  continue;
-			for (dy = 0; dy < labelHeight; ++dy)
-			  {
-			    y = labelMinY + dy;
-			    if (y < startY || y > endY)
-			      continue;
-			    sy = ((float) dy) / labelHeight * fontHeight;
-			    ey = ((float) (dy+1)) / labelHeight * fontHeight;
-			    isy = (int) floor(sy);
-			    iey = (int) floor(ey);
-			    for (dx = 0; dx < labelWidth; ++dx)
-			      {
-				x = charMinX + dx;
-				if (x < startX || x > endX)
-				  continue;
-				sx = ((float) dx) / labelWidth * fontWidth;
-				ex = ((float) (dx+1)) / labelWidth * fontWidth;
-				isx = (int) floor(sx);
-				iex = (int) floor(ex);
-				if (iex >= fontWidth)
-				  iex = fontWidth-1;
-				ws = 0.0;
-				v = 0.0;
-				for (iy = isy; iy <= iey; ++iy)
-				  {
-				    wy = 1.0;
-				    if (iy == isy)
-				      wy -= sy - isy;
-				    if (iy == iey)
-				      wy -= iey + 1.0 - ey;
-				    for (ix = isx; ix <= iex; ++ix)
-				      {
-					wx = 1.0;
-					if (ix == isx)
-					  wx -= sx - isx;
-					if (ix == iex)
-					  wx -= iex + 1.0 - ex;
-					ws += wx * wy;
-					v += wx * wy * font[(ci * fontHeight + iy) * fontWidth + ix];
-				      }
-				  }
-				if (ws == 0.0)
-				  Error("Internal error: label weight is 0\n");
-				ilv = (int) floor(v / ws + 0.5);
-				if (ilv != 255)
-				  canvas[(y - startY) * canvasWidth + x - canvasMinX] = 255-ilv;
-			      }
-			  }
-		      }
-		  }
-	      }
-
-	    // transfer to output tile(s)
-	    printf("\nSaving rendered area");
-	    fflush(stdout);
-	    nProcessed = 0;
-	    cx = 0;
-            a = reductionFactor * reductionFactor;
-            offset = a / 2;
-	    ny = canvasHeight / reductionFactor;
-	    for (;;)
-	      {
-		nx = (((int) canvasWidth) - cx) / reductionFactor;
-		if (tw - tx < nx)
-		  nx = tw - tx;
-		if (nx <= 0)
-		  break;
-
-		if (reductionFactor > 1)
-		  for (y = 0; y < ny; ++y)
-		    {
-		      iy = y * reductionFactor;
-		      for (x = 0; x < nx; ++x)
-			{
-			  ix = x * reductionFactor + cx;
-			  sum = 0;
-			  valid = 1;
-			  for (dy = 0; dy < reductionFactor; ++dy)
-			    for (dx = 0; dx < reductionFactor; ++dx)
-			      {
-				iv = canvas[(iy+dy)*canvasWidth + (ix+dx)];
-				if (iv != 0)
-				  sum += iv;
-				else
-				  valid = 0;
-			      }
-			  if (valid)
-			    out[(ty+y)*tw+tx+x] = (sum + offset) / a;
-			  else
-			    out[(ty+y)*tw+tx+x] = 0;
-			}
-		    }
-		else
-		  for (y = 0; y < ny; ++y)
-		    memcpy(&out[(ty+y)*tw+tx],
-			   &canvas[y*canvasWidth + cx],
-			   nx);
-
-		if (hi == hs-1)
-		  {
-		    // last stripe, so blacken tile bottom
-		    for (y = ty+ny; y < outHeight; ++y)
-		      memset(&out[y*tw+tx], 0, nx);
-		  }
-	    
-		cx += nx * reductionFactor;
-		tx += nx;
-		if (endX == oMaxX)
-		  {
-		    // blacken tile right side
-		    if (tw > tx)
-		      for (y = 0; y < outHeight; ++y)
-			memset(&out[y*tw+tx], 0, tw - tx);
-		    tx = tw;
-		  }
-
-		if (tx == tw &&
-		    (cols == 1 && hi == hs-1 ||
-		     cols > 1))
-		  {
-		    WriteTiles(tCol, startRow, endRow,
-			       images[startImage].name);
-		    tx = 0;
-		    ++tCol;
-		  }
-	      }
-	    printf("\n");
-
-	    //	    PrintUsage();
-
-	    // save extra pixel columns
-	    canvasWidth -= cx;
-	    canvasMinX += cx;
-	    if (canvasWidth > 0)
-	      for (y = 0; y < canvasHeight; ++y)
-		memmove(&canvas[y*canvasWidth],
-			&canvas[y*oldCanvasWidth + cx],
-			canvasWidth * sizeof(unsigned char));
-	    //	    printf("realloc canvas from %zu bytes to %zu bytes\n",
-	    //		   oldCanvasWidth * canvasHeight * sizeof(unsigned char),
-	    //		   canvasWidth * canvasHeight * sizeof(unsigned char));
-	    canvas = (unsigned char *)
-	      realloc(canvas,
-		      canvasWidth * canvasHeight * sizeof(unsigned char));
-	    weightMinX += (int) weightWidth;
-
-	    //	    printf("freeing %zu bytes from weight\n",
-	    //		   weightHeight * weightWidth * sizeof(unsigned short));
-	    free(weight);
-
-	    startX = endX + 1;
-
-	    //	    PrintUsage();
-	  } while (startX <= oMaxX);
-
-	  if (cols > 1)
-	    {
-	      //	      printf("freeing %zu bytes from out (cols > 1)\n",
-	      //		     outHeight * outWidth *
-	      //		     sizeof(unsigned char));
-	      free(out);
-	    }
-	}
-
-      //      PrintUsage();
-
-      if (cols == 1)
+  for (;;)
+    {
+      c = accept(s, NULL, NULL);
+      if (c < 0)
 	{
-	  //	  printf("freeing %zu bytes from out (cols == 1)\n",
-	  //		 outHeight * outWidth *
-	  //		 sizeof(unsigned char));
-	  free(out);
+	  if (errno == EINTR)
+	    continue;
+	  Error("accept failed; errno = %d\n", errno);
 	}
+      ServeRequest(c);
+      close(c);
+    }
+}
 
-      if (sourceMap != NULL)
-	{
-	  if (!CreateDirectories(sourceMapName))
-	    Error("Could not create directories for source map file %s\n",
-		  sourceMapName);
-	  if (!WriteMap(sourceMapName, sourceMap, sourceMapLevel,
-			sourceMapWidth, sourceMapHeight,
-			0, 0,
-			mapsName, imageListName,
-			UncompressedMap, msg))
-	    Error("Could not write source map %s:\n%s\n", sourceMapName, msg);
-	  //	  printf("freeing %zu bytes from sourceMap\n",
-	  //		     sourceMapSize * sizeof(MapElement));
-	  free(sourceMap);
-	  sourceMap = NULL;
-	}
+/* ServeRequest reads one request from connection c and answers it */
+void
+ServeRequest (int c)
+{
+  char request[4096];
+  char method[16];
+  char path[PATH_MAX];
+  char fn[PATH_MAX];
+  char mapFn[PATH_MAX];
+  char *slash[3];
+  char *p;
+  int n, k;
+  int oi;
+  int level, x, y;
+  struct stat tileSb, mapSb;
+  FILE *f;
+  unsigned char *body;
+  long size;
+
+  /* only the request line matters, but the headers are read too */
+  n = 0;
+  while (n < sizeof(request) - 1)
+    {
+      k = read(c, &request[n], sizeof(request) - 1 - n);
+      if (k <= 0)
+	break;
+      n += k;
+      request[n] = '\0';
+      if (strstr(request, "\r\n\r\n") != NULL ||
+	  strstr(request, "\n\n") != NULL)
+	break;
+    }
+  request[n] = '\0';
+  if (sscanf(request, "%15s %4095s", method, path) != 2)
+    {
+      SendResponse(c, "400 Bad Request", "text/plain",
+		   (unsigned char *) "bad request\n", 12);
+      return;
     }
+  if (strcmp(method, "GET") != 0)
+    {
+      SendResponse(c, "405 Method Not Allowed", "text/plain",
+		   (unsigned char *) "only GET is supported\n", 22);
+      return;
+    }
+  if ((p = strchr(path, '?')) != NULL)
+    *p = '\0';
+  n = strlen(path);
+  k = strlen(tileExtensions[tileFormat]);
+  if (n > k + 1 && path[n-k-1] == '.' &&
+      strcmp(&path[n-k], tileExtensions[tileFormat]) == 0)
+    path[n-k-1] = '\0';
 
-  //  PrintUsage();
+  /* the image name may itself hold slashes, so the level and tile
+     coordinates are taken from the end */
+  for (k = 2; k >= 0; --k)
+    {
+      slash[k] = strrchr(path, '/');
+      if (slash[k] == NULL || slash[k] == path)
+	break;
+      *slash[k] = '\0';
+    }
+  if (k >= 0 ||
+      sscanf(slash[0] + 1, "%d", &level) != 1 ||
+      sscanf(slash[1] + 1, "%d", &x) != 1 ||
+      sscanf(slash[2] + 1, "%d", &y) != 1)
+    {
+      SendResponse(c, "400 Bad Request", "text/plain",
+		   (unsigned char *) "expected /image/level/x/y\n", 26);
+      return;
+    }
+  for (oi = 0; oi < nImages; ++oi)
+    if (path[0] == '/' && strcmp(images[oi].name, &path[1]) == 0)
+      break;
+  if (oi >= nImages || level < 0 || level >= serveLevels ||
+      x < 0 || ((long) x * serveTw << level) >= serveWidth ||
+      y < 0 || ((long) y * serveTh << level) >= serveHeight)
+    {
+      SendResponse(c, "404 Not Found", "text/plain",
+		   (unsigned char *) "no such tile\n", 13);
+      return;
+    }
 
-  printf("\nWriting size file... ");
-  fflush(stdout);
+  /* a stored tile is good until the map it was painted with changes */
+  sprintf(fn, "%s%s/%d/c%.2dr%.2d.%s", outputName, images[oi].name,
+	  level, x+1, y+1, tileExtensions[tileFormat]);
+  sprintf(mapFn, "%s%s.map", mapsName, images[oi].name);
+  if (stat(fn, &tileSb) != 0 ||
+      (stat(mapFn, &mapSb) == 0 && mapSb.st_mtime > tileSb.st_mtime))
+    PaintTile(oi, level, x, y, fn);
 
-  if (strlen(outputName) == 0)
-    strcpy(fn, "size");
-  else if (outputName[strlen(outputName)-1] == '/')
-    sprintf(fn, "%ssize", outputName);
-  else
-    sprintf(fn, "%s.size", outputName);
-  f = fopen(fn, "w");
+  f = fopen(fn, "rb");
   if (f == NULL)
-    Error("Could not open size file %s for writing.\n", fn);
-  fprintf(f, "%d %d\n%zdx%zd%+d%+d\n%zdx%zd\n",
-	  rows, cols,
-	  oWidth, oHeight, oMinX, oMinY,
-	  oWidth / reductionFactor, oHeight / reductionFactor);
+    {
+      SendResponse(c, "500 Internal Server Error", "text/plain",
+		   (unsigned char *) "tile could not be read\n", 23);
+      return;
+    }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  body = (unsigned char *) malloc(size > 0 ? size : 1);
+  if (body == NULL || fread(body, 1, size, f) != size)
+    {
+      fclose(f);
+      free(body);
+      SendResponse(c, "500 Internal Server Error", "text/plain",
+		   (unsigned char *) "tile could not be read\n", 23);
+      return;
+    }
   fclose(f);
-  printf("done.\n");
+  SendResponse(c, "200 OK", tileContentTypes[tileFormat], body, size);
+  free(body);
+  printf("Served %s level %d tile %d,%d\n", images[oi].name, level, x, y);
   fflush(stdout);
-  return(0);
 }
 
+/* PaintTile paints output tile (x, y) of image oi, reduced by 2^level,
+   into the file fn */
 void
-PaintImage (int i, int minX, int maxX, int minY, int maxY)
+PaintTile (int oi, int level, int x, int y, char *fn)
 {
-  int j;
-  int iw, ih;
-  int x, y;
-  InverseMap *invMap;
-  float xv, yv;
-  int ixv, iyv;
-  float rx, ry;
-  float rrx, rry;
-  float rv, dv;
-  size_t maskBytes;
-  size_t mbpl;
-  unsigned char *mask;
-  unsigned char *dist;
-  float *distance;
-  float dst;
-  int idst;
-  float cx, cy;
-  float offset;
-  float r00, r01, r10, r11;
-  float d00, d01, d10, d11;
-  int nx, ny;
-  int pMinX, pMaxX, pMinY, pMaxY;
-  unsigned char *image;
-  float w;
-  float d, d2;
-  int row, col;
-  int ix, iy;
-  float mFactor;
-  int offsetX, offsetY;
-  int v;
-  size_t newCanvasSize;
-  int mxMin, myMin;
-  char imName0[PATH_MAX];
-  char imName1[PATH_MAX];
+  int scale;
   char msg[PATH_MAX+256];
-  char fn[PATH_MAX];
-  struct stat statBuf;
-  int complete;
-  int iixv, iiyv;
-  float rb00, rb01, rb10, rb11;
-  float rw00, rw01, rw10, rw11;
-  float rb, rw;
-  MapElement *imap;
-  float imapFactor;
-  int imapw, imaph;
-  int imapXMin, imapYMin;
-  char imapName0[PATH_MAX], imapName1[PATH_MAX];
-  float xvi, yvi;
-  int sourceMapMask;
-  int smi;
-  int targetMapSize;
-  MapElement *targetMap;
-  int targetMapWidth, targetMapHeight;
-  int targetMapMask;
-  int tmi;
-  int testX, testY;
-  int mw, mh;
-  MapElement *map;
-  float spacing;
-  float rxp, ryp;
-  unsigned char *imask;
-  size_t imbpl;
-  int warned;
 
-  /* read in map if necessary */
-  if (images[i].map == NULL)
+  scale = 1 << level;
+  reductionFactor = scale;
+  tw = serveTw;
+  th = serveTh;
+  oMinX = serveMinX + x * serveTw * scale;
+  oMinY = serveMinY + y * serveTh * scale;
+  oWidth = tw * scale;
+  oHeight = th * scale;
+  oMaxX = oMinX + ((int) oWidth) - 1;
+  oMaxY = oMinY + ((int) oHeight) - 1;
+  rows = 1;
+  cols = 1;
+
+  planeLength = (int) (tw * th);
+  planeLine = (unsigned char *) realloc(planeLine, planeLength);
+  if (planeLine == NULL)
+    Error("Could not allocate tile\n");
+  memset(planeLine, 0, planeLength);
+  planeFilled = 0;
+  RenderSection(oi, 0, 0);
+  imageUsed[oi] = ++useClock;
+  EvictImages(oi);
+
+  if (!CreateDirectories(fn))
+    Error("Could not create directories for tile %s\n", fn);
+  if (!WriteTile(fn, planeLine, msg))
+    Error("Could not write tile %s:\n  error: %s\n", fn, msg);
+}
+
+/* EvictImages releases the least recently painted images, other than
+   image keep, until those resident fit in the -resident budget */
+void
+EvictImages (int keep)
+{
+  int i, j;
+
+  while (imageMem > ((size_t) residentLimit) * 1000000)
     {
-      sprintf(fn, "%s%s.map", mapsName, images[i].name);
-      if (!ReadMap(fn, &(images[i].map), &(images[i].mLevel),
-		   &(images[i].mw), &(images[i].mh),
-		   &(images[i].mxMin), &(images[i].myMin),
-		   imName0, imName1,
-		   msg))
-	Error("Could not read map %s:\n  error: %s\n",
-	      fn, msg);
-      if (rotation != 0.0)
+      j = -1;
+      for (i = 0; i < nImages; ++i)
+	if (i != keep &&
+	    (images[i].map != NULL || images[i].image != NULL) &&
+	    (j < 0 || imageUsed[i] < imageUsed[j]))
+	  j = i;
+      if (j < 0)
+	break;
+      ReleaseImage(j);
+    }
+}
+
+/* REGION PROCEDURES */
+
+/* ReadRegionList reads the -regions file, which lists one region per
+   line as WxH+X+Y, optionally followed by the name of its output
+   (by default the region as written); each region's output goes
+   under the -output prefix, in a directory of that name */
+void
+ReadRegionList ()
+{
+  FILE *f;
+  char line[LINE_LENGTH+1];
+  char geometry[LINE_LENGTH+1];
+  char name[LINE_LENGTH+1];
+  int nItems;
+  int regionsSize;
+  int i;
+  OutputRegion *rg;
+
+  f = fopen(regionListName, "r");
+  if (f == NULL)
+    Error("Could not open region list %s for reading\n", regionListName);
+  regionsSize = 0;
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      nItems = sscanf(line, "%s%s", geometry, name);
+      if (nItems < 1 || geometry[0] == '#')
+	continue;
+      if (nRegions >= regionsSize)
 	{
-	  map = images[i].map;
-	  spacing = (1 << images[i].mLevel) * mapScale;
-	  mw = images[i].mw;
-	  mh = images[i].mh;
-	  for (y = 0; y < mh; ++y)
-	    for (x = 0; x < mw; ++x)
-	      {
-		rx = map[y*mw+x].x * spacing;
-		ry = map[y*mw+x].y * spacing;
-		rxp = rx - rotationX;
-		ryp = ry - rotationY;
-		rx = cosRot * rxp + sinRot * ryp + rotationX;
-		ry = -sinRot * rxp + cosRot * ryp + rotationY;
-		map[y*mw+x].x = rx / spacing;
-		map[y*mw+x].y = ry / spacing;
-	      }
+	  regionsSize = (regionsSize > 0) ? regionsSize * 2 : 64;
+	  regions = (OutputRegion *) realloc(regions,
+					     regionsSize * sizeof(OutputRegion));
+	  if (regions == NULL)
+	    Error("Could not allocate regions\n");
 	}
+      rg = &regions[nRegions];
+      if (sscanf(geometry, "%dx%d%d%d", &rg->width, &rg->height,
+		 &rg->offsetX, &rg->offsetY) != 4 ||
+	  rg->width <= 0 || rg->height <= 0)
+	Error("Malformed line in %s:\n%s\n", regionListName, line);
+      if (strlen(outputName) + strlen(nItems > 1 ? name : geometry) + 2 >=
+	  PATH_MAX)
+	Error("Output name of region %s is too long\n", geometry);
+      strcpy(rg->name, nItems > 1 ? name : geometry);
+      for (i = 0; i < nRegions; ++i)
+	if (strcmp(regions[i].name, rg->name) == 0)
+	  Error("Region name %s appears more than once in %s\n",
+		rg->name, regionListName);
+      ++nRegions;
+    }
+  fclose(f);
+  if (nRegions == 0)
+    Error("Region list %s lists no regions\n", regionListName);
+  strcpy(regionsOutputName, outputName);
+}
 
-      imageMem += images[i].mapBytes;
+/* SelectRegion makes region k the output being rendered, as -region
+   would, with its output under its own name */
+void
+SelectRegion (int k)
+{
+  OutputRegion *rg;
+
+  rg = &regions[k];
+  if (overlay && tileWidth < 0 && tileHeight < 0)
+    snprintf(outputName, PATH_MAX, "%s%s", regionsOutputName, rg->name);
+  else
+    snprintf(outputName, PATH_MAX, "%s%s/", regionsOutputName, rg->name);
+  oMinX = rg->offsetX;
+  oMinY = rg->offsetY;
+  oWidth = ((rg->width + reductionFactor - 1) / reductionFactor) *
+    reductionFactor;
+  oHeight = ((rg->height + reductionFactor - 1) / reductionFactor) *
+    reductionFactor;
+  oMaxX = oMinX + ((int) oWidth) - 1;
+  oMaxY = oMinY + ((int) oHeight) - 1;
+  if (tileWidth > 0)
+    {
+      cols = (oWidth / reductionFactor + tileWidth - 1) / tileWidth;
+      tw = tileWidth;
     }
-  if (images[i].invMap == NULL)
-    images[i].invMap = InvertMap(images[i].map,
-				 images[i].mw,
-				 images[i].mh);
-	
-  /* read in image if necessary */
-  if (images[i].image == NULL)
+  else
     {
-      sprintf(fn, "%s%s", imagesName, images[i].name);
-      if (!ReadImage(fn, &(images[i].image),
-		     &iw, &ih,
-		     -1, -1, -1, -1,
-		     msg))
-	Error("Could not read image %s:\n  error: %s\n",
-	      fn, msg);
-      if (iw != images[i].width ||
-	  ih != images[i].height)
-	Error("Dimensions of image %s do not match those in images list.\n",
-	      fn);
-      imageMem += images[i].width * images[i].height;
+      cols = 1;
+      tw = oWidth / reductionFactor;
+    }
+  if (tileHeight > 0)
+    {
+      rows = (oHeight / reductionFactor + tileHeight - 1) / tileHeight;
+      th = tileHeight;
+    }
+  else
+    {
+      rows = 1;
+      th = oHeight / reductionFactor;
+    }
 
-      if (targetMapsName[0] != '\0')
-	{
-	  targetMapWidth = (iw + targetMapsFactor - 1) / targetMapsFactor;
-	  targetMapHeight = (ih + targetMapsFactor - 1) / targetMapsFactor;
-	  targetMapSize = targetMapWidth * targetMapHeight;
-	  //	  printf("malloc %zu bytes for targetMap\n",
-	  //		 targetMapSize * sizeof(MapElement));
-	  images[i].targetMap =
-	    (MapElement *) malloc(targetMapSize * sizeof(MapElement));
- 	  if (images[i].targetMap == 0)
- 	    Error("malloc of targetMap failed; errno = %d\n", errno);
-	  memset(images[i].targetMap, 0,
-		 targetMapSize * sizeof(MapElement));
-	}
-      else
-	images[i].targetMap = NULL;
+  /* the cell index is laid over the output being rendered */
+  FreeImageIndex();
+}
+
+/* RenderRegions renders every region of the -regions list from output
+   image oi; an image stays loaded from one region to the next, so
+   that those it covers share it, until the images kept exceed the
+   -resident budget, when the least recently painted are released */
+void
+RenderRegions (int oi)
+{
+  int i, j, k;
+  int n;
+  int startImage, endImage;
+  int *list;
+
+  if (imageUsed == NULL)
+    {
+      imageUsed = (long *) malloc(nImages * sizeof(long));
+      if (imageUsed == NULL)
+	Error("Could not allocate image use table\n");
+      memset(imageUsed, 0, nImages * sizeof(long));
     }
-  targetMapWidth = (images[i].width + targetMapsFactor - 1) / targetMapsFactor;
-  targetMapHeight = (images[i].height + targetMapsFactor - 1) / targetMapsFactor;
-  targetMapSize = targetMapWidth * targetMapHeight;
-  targetMap = images[i].targetMap;
-  targetMapMask = targetMapsFactor - 1;
+  list = (int *) malloc((nImages > 0 ? nImages : 1) * sizeof(int));
+  if (list == NULL)
+    Error("Could not allocate region image list\n");
+  startImage = overlay ? 0 : oi;
+  endImage = overlay ? nImages - 1 : oi;
 
-  /* read in mask if necessary */
-  if (images[i].mask == NULL)
-    if (masksName[0] != '\0')
-      {
-	sprintf(fn, "%s%s", masksName, images[i].name);
-	if (!ReadBitmap(fn, &(images[i].mask),
-			&iw, &ih,
-			-1, -1, -1, -1,
-			msg))
-	  Error("Could not read mask %s:\n  error: %s\n",
+  holdImages = 1;
+  for (k = 0; k < nRegions; ++k)
+    {
+      SelectRegion(k);
+      printf("Rendering region %s (%d of %d)\n", regions[k].name,
+	     k + 1, nRegions);
+      RenderSection(oi, 0, cols - 1);
+
+      /* the tile writers name their files from the output of the
+	 region, so they finish it before the next is selected */
+      FlushTiles();
+
+      n = ImagesInRegion(oMinX, oMaxX, oMinY, oMaxY,
+			 startImage, endImage, list);
+      for (j = 0; j < n; ++j)
+	if (images[i = list[j]].minX <= oMaxX &&
+	    images[i].maxX >= oMinX &&
+	    images[i].minY <= oMaxY &&
+	    images[i].maxY >= oMinY)
+	  imageUsed[i] = ++useClock;
+      EvictImages(-1);
+    }
+  holdImages = 0;
+  for (i = startImage; i <= endImage; ++i)
+    ReleaseImage(i);
+  free(list);
+}
+
+void
+SendResponse (int c, char *status, char *type,
+	      unsigned char *body, size_t n)
+{
+  char header[256];
+
+  sprintf(header, "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+	  "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+	  status, type, n);
+  if (SendAll(c, (unsigned char *) header, strlen(header)))
+    SendAll(c, body, n);
+}
+
+int
+SendAll (int c, unsigned char *p, size_t n)
+{
+  ssize_t k;
+
+  while (n > 0)
+    {
+      k = write(c, p, n);
+      if (k < 0 && errno == EINTR)
+	continue;
+      if (k <= 0)
+	return(0);
+      p += k;
+      n -= k;
+    }
+  return(1);
+}
+
+
+/* WORKER PROCEDURES */
+
+/* StartReadAhead starts the threads that read the maps and images
+   asked for with -read_ahead; what they read is held outside the
+   -memory budget, so there are never more than readAhead of them
+   waiting to be taken */
+void
+StartReadAhead ()
+{
+  if (readAhead > 0 && !prefetching)
+    {
+      if (!StartPrefetching(readAhead < 4 ? readAhead : 4, (size_t) -1))
+	Error("Could not start read-ahead threads\n");
+      prefetching = 1;
+    }
+}
+
+void
+WorkerContext ()
+{
+  char msg[PATH_MAX+256];
+  char msg2[PATH_MAX+256];
+
+  StartReadAhead();
+
+  /* load the font (if necessary) */
+  if (labelWidth > 0 && font == NULL)
+    {
+      if (!ReadImage(fontFileName, &font, &fontWidth, &fontHeight, -1, -1, -1, -1, msg))
+	{
+	  // if we can't find the default font file, try looking in the
+          //   current directory for font.pgm; this is a hack
+	  //   to allow align to run before being formally installed
+	  if (strcmp(fontFileName, EXPAND_AND_QUOTE(FONT_FILE)) != 0 ||
+	      !ReadImage("font.pgm", &font, &fontWidth, &fontHeight,
+			 -1, -1, -1, -1, msg2))
+	    Error("Could not load font: %s\n", msg);
+	}
+      fontHeight = fontHeight / 95;
+    }
+}
+
+void
+WorkerTask ()
+{
+  int oi;
+  char name[64];
+
+  sprintf(name, "section %d", t.section);
+  MetricsName(name);
+  if (volume)
+    {
+      StartSlab(t.section);
+      for (oi = t.section; oi < t.section + t.nSections; ++oi)
+	{
+	  slabSection = oi;
+	  RenderSection(oi, t.startCol, t.endCol);
+	  FlushVolumeRows();
+	  volumeRow = 0;
+	}
+      FinishSlab(t.nSections);
+    }
+  else if (plane)
+    {
+      /* the section's line of the plane is its whole output, which
+	 goes back in the result instead of to a file */
+      planeLength = (int) (tw * th);
+      planeLine = (unsigned char *) realloc(planeLine, planeLength);
+      if (planeLine == NULL)
+	Error("Could not allocate plane line\n");
+      memset(planeLine, 0, planeLength);
+      planeFilled = 0;
+      RenderSection(t.section, t.startCol, t.endCol);
+    }
+  else if (nRegions > 0)
+    RenderRegions(t.section);
+  else
+    RenderSection(t.section, t.startCol, t.endCol);
+  MetricsPhase(METRICS_WRITE);
+  FlushTiles();
+  r.line = planeLine;
+  r.strips = planStrips;
+  r.passes = planPasses;
+  r.peak = (double) planPeak;
+  r.section = t.section;
+  r.startCol = t.startCol;
+  r.endCol = t.endCol;
+}
+
+void
+WorkerFinalize ()
+{
+  int i;
+
+  if (gpuReady > 0)
+    {
+      GpuFinish();
+      gpuReady = 0;
+    }
+
+  /* let the writers finish before the process exits */
+  if (!writersStarted)
+    return;
+  FlushTiles();
+  pthread_mutex_lock(&tileMutex);
+  writersShutdown = 1;
+  pthread_cond_broadcast(&tileCond);
+  pthread_mutex_unlock(&tileMutex);
+  for (i = 0; i < nWriters; ++i)
+    if (pthread_join(writers[i], NULL) != 0)
+      Error("pthread_join failed\n");
+  free(writers);
+  writersStarted = 0;
+}
+
+void
+RenderSection (int oi, int startCol, int endCol)
+{
+  int i;
+  int x, y;
+  int iMinX, iMinY, iMaxX, iMaxY;
+  char msg[PATH_MAX+256];
+  int startImage, endImage;
+  int nextPrefetch;
+  size_t *increase, *decrease;
+  int *region;
+  int nRegion;
+  int k;
+  int n;
+  size_t memoryRequired;
+  size_t maxMemoryRequired;
+  int startX, endX;
+  int startY, endY;
+  int tx, ty;
+  int tCol;
+  int ix, iy;
+  int dx, dy;
+  int cx;
+  int nx, ny;
+  int hs;
+  int hi;
+  int startRow, endRow;
+  int iv;
+  int sum;
+  int offset;
+  int a;
+  int valid;
+  int updateOutput;
+  int labelMinX, labelMaxX, labelMinY, labelMaxY;
+  int charMinX, charMaxX;
+  int ci;
+  float sx, ex, sy, ey;
+  int isx, iex, isy, iey;
+  float v;
+  float wx, wy, ws;
+  int len;
+  int ilv;
+  int prevPhase;
+
+
+  METRICS_MARK("apply_map section");
+  increase = (size_t*) malloc(oWidth * sizeof(size_t));
+  decrease = (size_t*) malloc(oWidth * sizeof(size_t));
+  if (increase == 0 || decrease == 0)
+    Error("malloc of increase/decrease failed; errno = %d\n", errno);
+  region = (int *) malloc((nImages > 0 ? nImages : 1) * sizeof(int));
+  if (region == NULL)
+    Error("malloc of region failed; errno = %d\n", errno);
+  tilePainted = (int *) malloc(rows * sizeof(int));
+  if (tilePainted == NULL)
+    Error("malloc of tilePainted failed; errno = %d\n", errno);
+  memset(tilePainted, 0, rows * sizeof(int));
+
+  /* an untiled output image is streamed out one horizontal strip
+     at a time, in order, from this thread; otherwise, with writer
+     threads, one out buffer can be filled while the others are
+     being written */
+  streaming = (tileWidth < 0 && tileHeight < 0);
+  maxOutBuffers = (nWriters > 0 && !streaming) ? nWriters + 1 : 1;
+
+  renderMinX = oMinX + startCol * ((int) tw) * reductionFactor;
+  if (endCol == cols - 1)
+    renderMaxX = oMaxX;
+  else
+    renderMaxX = oMinX + (endCol + 1) * ((int) tw) * reductionFactor - 1;
+  if (pyramidLevels > 0)
+    StartPyramid(startCol, endCol);
+
+  if (overlay)
+    {
+      startImage = 0;
+      endImage = nImages-1;
+      if (labelWidth > 0)
+	strncpy(label, (labelName[0] != '\0') ? labelName : outputName,
+		MAX_LABEL_LENGTH);
+    }
+  else
+    {
+      startImage = oi;
+      endImage = oi;
+      if (labelWidth > 0)
+	snprintf(label, MAX_LABEL_LENGTH, "%s%s",
+		 labelName, images[oi].name);
+    }
+  if (labelWidth > 0)
+    {
+      label[MAX_LABEL_LENGTH] = '\0';
+      labelMinX = labelOffsetX;
+      labelMaxX = labelMinX + strlen(label) * labelWidth - 1;
+      labelMinY = labelOffsetY;
+      labelMaxY = labelMinY + labelHeight - 1;
+    }
+
+  updateOutput = update;
+  if (sourceMapName[0] != '\0')
+    {
+      sourceMap = NULL;
+      sourceMapWidth = (oWidth + sourceMapFactor - 1) / sourceMapFactor;
+      sourceMapHeight = (oHeight + sourceMapFactor - 1) / sourceMapFactor;
+      sourceMapSize = sourceMapWidth * sourceMapHeight;
+#if 0
+      if (updateOutput)
+	{
+	  // in order to update, we must successfully read in
+	  //   the old source map
+	  if (!ReadMap(sourceMapName, &sourceMap, &oldSourceMapLevel,
+		       &oldSourceMapWidth, &oldSourceMapHeight,
+		       &oldSourceMapMinX, &oldSourceMapMinY,
+		       imName0, imName1,
+		       msg) ||
+	      oldSourceMapLevel != sourceMapLevel ||
+	      oldSourceMapWidth != sourceMapWidth ||
+	      oldSourceMapHeight != sourceMapHeight ||
+	      oldSourceMapMinX != 0 ||
+	      oldSourceMapMinY != 0)
+	    updateOutput = 0;
+	}
+      if (!updateOutput)
+	{
+#endif
+	  //	      printf("malloc %zu bytes for sourceMap\n",
+	  //		     sourceMapSize * sizeof(MapElement));
+	  sourceMap = (MapElement *) malloc(sourceMapSize * 
+					    sizeof(MapElement));
+	  if (sourceMap == 0)
+	    Error("malloc of sourceMap failed; errno = %d\n", errno);
+
+	  for (y = 0; y < sourceMapHeight; ++y)
+	    for (x = 0; x < sourceMapWidth; ++x)
+	      {
+		sourceMap[y*sourceMapWidth + x].x = 0.0;
+		sourceMap[y*sourceMapWidth + x].y = 0.0;
+		sourceMap[y*sourceMapWidth + x].c = -1.0;
+	      }
+#if 0
+	}
+#endif
+    }
+  else
+    {
+      sourceMapWidth = 0;
+      sourceMapHeight = 0;
+      sourceMap = NULL;
+    }
+
+  for (hs = 1; ; hs *= 2)
+    {
+      endY = oMinY - 1;
+      planPasses = 0;
+      planPeak = 0;
+      for (hi = 0; hi < hs; ++hi)
+	{
+	  startY = endY + 1;
+	  if (cols == 1)
+	    {
+	      endY = oMinY + (hi + 1) * oHeight / hs - 1;
+	      endY = ((endY - startY + 1) / reductionFactor) *
+		reductionFactor + startY - 1;
+	      if (streaming)
+		outHeight = (endY - startY + 1) / reductionFactor;
+	      else
+		outHeight = rows * th;
+	      outWidth = tw;
+	    }
+	  else
+	    {
+	      outHeight = ((oHeight / hs + th * reductionFactor - 1) /
+			   (th * reductionFactor)) *
+		(th * reductionFactor);
+	      if (startY + ((int) outHeight) - 1 > oMaxY)
+		outHeight = oMaxY - startY + 1;
+	      outWidth = tw;
+	      if (outHeight == 0)
+		Error("Insufficent memory to construct a single row of tiles.\n");
+	      endY = startY + ((int) outHeight) - 1;
+	    }
+	  canvasHeight = endY - startY + 1;
+	  if (canvasHeight < reductionFactor)
+	    Error("Insufficent memory to construct a horizontal row\n");
+
+	  memset(increase, 0, oWidth * sizeof(size_t));
+	  memset(decrease, 0, oWidth * sizeof(size_t));
+
+	  nRegion = ImagesInRegion(oMinX, oMaxX, startY, endY,
+				   startImage, endImage, region);
+	  for (k = 0; k < nRegion; ++k)
+	    {
+	      i = region[k];
+	      iMinX = (int) floor(images[i].minX);
+	      iMaxX = (int) ceil(images[i].maxX);
+	      iMinY = (int) floor(images[i].minY);
+	      iMaxY = (int) ceil(images[i].maxY);
+	      if (iMinY > endY || iMaxY < startY)
+		continue;
+	      memoryRequired = images[i].sw * images[i].sh *
+		(sizeof(unsigned char) + sizeof(unsigned char)) +
+		((images[i].sw + 7 ) / 8) * images[i].sh +
+		images[i].mapBytes;
+	      if (iMinX <= oMinX && iMaxX >= oMinX)
+		increase[0] += memoryRequired;
+	      else if (iMinX <= oMaxX && iMaxX >= oMinX)
+		increase[iMinX - oMinX] += memoryRequired;
+	      if (iMaxX >= oMinX && iMaxX < oMaxX-1)
+		decrease[iMaxX - oMinX + 1] += memoryRequired;
+	    }
+
+	  memoryRequired = 0;
+	  maxMemoryRequired = 0;
+	  for (i = 0; i < oWidth; ++i)
+	    {
+	      memoryRequired += increase[i];
+	      memoryRequired -= decrease[i];
+	      if (memoryRequired > maxMemoryRequired)
+		maxMemoryRequired = memoryRequired;
+	    }
+	  maxMemoryRequired += sourceMapWidth * sourceMapHeight *
+	    sizeof(MapElement);
+	  maxMemoryRequired += maxOutBuffers * outHeight * outWidth *
+	    sizeof(unsigned char);
+	  if (pyramidLevels > 0)
+	    maxMemoryRequired += PyramidMemory((int) ((outHeight + th - 1) / th));
+	  maxMemoryRequired += 2 * oWidth * sizeof(size_t);
+	  maxMemoryRequired += 2 * reductionFactor * canvasHeight * sizeof(unsigned char);
+	  if (maxMemoryRequired > ((size_t) memoryLimit) * 1000000)
+	    break;
+	  if (planOnly)
+	    {
+	      n = PlanColumns(oi, increase, decrease);
+	      if (n < 0 || planPasses < 0)
+		planPasses = -1;
+	      else
+		planPasses += n;
+	      if (maxMemoryRequired > planPeak)
+		planPeak = maxMemoryRequired;
+	    }
+	}
+      if (hi >= hs)
+	break;
+    }
+  if (hs > 1)
+    printf("Splitting rendering into %d horizontal strips\n", hs);
+
+  /* with -plan, nothing is rendered */
+  if (planOnly)
+    {
+      planStrips = hs;
+      if (pyramidLevels > 0)
+	FinishPyramid();
+      free(sourceMap);
+      sourceMap = NULL;
+      free(increase);
+      free(decrease);
+      free(region);
+      free(tilePainted);
+      tilePainted = NULL;
+      METRICS_MARK(NULL);
+      return;
+    }
+
+  // do horizontal strips one-at-a-time
+  endY = oMinY - 1;
+  for (hi = 0; hi < hs; ++hi)
+    {
+      //	  PrintUsage();
+
+      startY = endY + 1;
+      if (cols == 1)
+	{
+	  endY = oMinY + (int) ((hi + 1) * oHeight / hs) - 1;
+	  endY = ((endY - startY + 1) / reductionFactor) *
+	    reductionFactor + startY - 1;
+	  outWidth = tw;
+	  startRow = 0;
+	  endRow = rows-1;
+	  if (streaming)
+	    {
+	      // only this strip's rows are held; they are appended
+	      //   to the output image once the strip is complete
+	      outHeight = (endY - startY + 1) / reductionFactor;
+	      outSize = outHeight * outWidth;
+	      outMinY = startY;
+	      out = AcquireOutBuffer(outSize);
+	    }
+	  else
+	    {
+	      outHeight = rows * th;
+	      outSize = outHeight * outWidth;
+	      if (hi == 0)
+		{
+		  //	printf("malloc %zu bytes for out  (cols == 1)\n",
+		  //		 outHeight * outWidth *
+		  //		 sizeof(unsigned char));
+		  out = AcquireOutBuffer(outSize);
+		}
+	      outMinY = oMinY;
+	    }
+	}
+      else
+	{
+	  outHeight = ((oHeight / hs + th * reductionFactor - 1) /
+		       (th * reductionFactor)) *
+	    (th * reductionFactor);
+	  if (startY + ((int) outHeight) - 1 > oMaxY)
+	    outHeight = oMaxY - startY + 1;
+	  outWidth = tw;
+	  if (outHeight == 0)
+	    Error("Insufficent memory to construct a single row of tiles.\n");
+	  endY = startY + outHeight - 1;
+	  outMinY = startY;
+	  startRow = (startY - oMinY) / (th * reductionFactor);
+	  endRow = (endY - oMinY) / (th * reductionFactor);
+
+	  // the last strip may end partway through a row of tiles,
+	  //   but whole tiles are written out, so pad it with black
+	  outSize = outHeight * outWidth;
+	  if ((endRow - startRow + 1) * th * tw > outSize)
+	    outSize = (endRow - startRow + 1) * th * tw;
+	  //	      printf("malloc %zu bytes for out (cols != 1)\n",
+	  //		     outSize * sizeof(unsigned char));
+	  out = AcquireOutBuffer(outSize);
+	}
+
+      memset(increase, 0, oWidth * sizeof(size_t));
+      memset(decrease, 0, oWidth * sizeof(size_t));
+      nRegion = ImagesInRegion(oMinX, oMaxX, startY, endY,
+			       startImage, endImage, region);
+      for (k = 0; k < nRegion; ++k)
+	{
+	  i = region[k];
+	  iMinX = (int) floor(images[i].minX);
+	  iMaxX = (int) ceil(images[i].maxX);
+	  iMinY = (int) floor(images[i].minY);
+	  iMaxY = (int) ceil(images[i].maxY);
+	  if (iMinY > endY || iMaxY < startY)
+	    continue;
+	  memoryRequired = images[i].sw * images[i].sh *
+	    (sizeof(unsigned char) + sizeof(unsigned char)) +
+	    ((images[i].sw + 7 ) / 8) * images[i].sh +
+	    images[i].mapBytes;
+	  if (iMinX <= oMinX && iMaxX >= oMinX)
+	    increase[0] += memoryRequired;
+	  else if (iMinX <= oMaxX && iMaxX >= oMinX)
+	    increase[iMinX - oMinX] += memoryRequired;
+	  if (iMaxX >= oMinX && iMaxX < oMaxX-1)
+	    decrease[iMaxX - oMinX + 1] += memoryRequired;
+	}
+
+      //	  PrintUsage();
+
+      if (overlay)
+	{
+	  /* images that start left of this task's columns are painted
+	     with its first columns, so charge them there */
+	  memoryRequired = 0;
+	  for (i = 0; i < renderMinX - oMinX; ++i)
+	    {
+	      memoryRequired += increase[i];
+	      memoryRequired -= decrease[i];
+	    }
+	  increase[renderMinX - oMinX] += memoryRequired;
+	}
+
+      /* the images held between regions are still loaded */
+      if (!holdImages)
+	imageMem = 0;
+      canvasWidth = 0;
+      canvasHeight = endY - startY + 1;
+      canvasMinX = renderMinX;
+      canvasMinY = startY;
+      paintedCols = (renderMaxX - renderMinX + CANVAS_BLOCK) / CANVAS_BLOCK;
+      paintedRows = (canvasHeight + CANVAS_BLOCK - 1) / CANVAS_BLOCK;
+      canvasPainted = (unsigned char *) realloc(canvasPainted,
+						paintedCols * paintedRows);
+      if (canvasPainted == NULL)
+	Error("malloc of canvasPainted failed; errno = %d\n", errno);
+      memset(canvasPainted, 0, paintedCols * paintedRows);
+      if (cols > 1 || streaming)
+	memset(tilePainted, 0, rows * sizeof(int));
+      weightMinX = renderMinX;
+      weightMinY = startY;
+      tx = 0;
+      ty = (startY - outMinY) / reductionFactor;
+      tCol = startCol;
+
+      // render from left to right across the output
+      startX = renderMinX;
+      do {
+	//	    PrintUsage();
+	// see how far we can increase endX while still satisfying
+	//   memory constraints
+	endX = startX-1;
+	memoryRequired = imageMem;
+	memoryRequired += sourceMapWidth * sourceMapHeight *
+	  sizeof(MapElement);
+	memoryRequired += maxOutBuffers * outHeight * outWidth *
+	  sizeof(unsigned char);
+	if (pyramidLevels > 0)
+	  memoryRequired += PyramidMemory((int) ((outHeight + th - 1) / th));
+	//	    printf("memreq1 = %zu\n", memoryRequired);
+	memoryRequired += 2 * oWidth * sizeof(size_t);
+	//	    printf("memreq2 = %zu\n", memoryRequired);
+	memoryRequired += (startX - canvasMinX) * canvasHeight *
+	  sizeof(unsigned char);
+	//	    printf("memreq3 = %zu\n", memoryRequired);
+	if (!overlay)
+	  memoryRequired += images[oi].sw * images[oi].sh *
+	    (sizeof(unsigned char) + sizeof(unsigned char)) +
+	    ((images[oi].sw + 7) / 8) * images[oi].sh +
+	    images[oi].mapBytes;
+	//	    printf("memreq4 = %zu   (%d %d %d %d %d %d)\n", memoryRequired,
+	//		   oi, images[oi].width, images[oi].height, images[oi].mapBytes,
+	//		   startImage, endImage);
+	while (memoryRequired < ((size_t) memoryLimit) * 1000000 &&
+	       endX < renderMaxX)
+	  {
+	    ++endX;
+	    memoryRequired += canvasHeight *
+	      (sizeof(unsigned char) + sizeof(unsigned short));
+	    if (overlay)
+	      {
+		memoryRequired += increase[endX - oMinX];
+		memoryRequired -= decrease[endX - oMinX];
+	      }
+	  }
+	if (memoryRequired >= ((size_t) memoryLimit) * 1000000)
+	  --endX;
+	if (endX < startX)
+	  Error("Internal error: not enough memory to construct a single pixel column\n%d %d %d %d %zu",
+		startX, endX, startY, endY, memoryRequired);
+	if (endX < renderMaxX &&
+	    endX - canvasMinX + 1 < reductionFactor)
+	  Error("Internal error: not enough memory to construct a column of the output image\n");
+	printf("Rendering area from x=%d to x=%d, y=%d to y=%d\n",
+	       startX, endX, startY, endY);
+
+	//	    PrintUsage();
+
+
+	// resize the canvas
+	oldCanvasWidth = canvasWidth;
+	canvasWidth = endX - canvasMinX + 1;
+	//	    printf("realloc canvas from %zu bytes to %zu bytes\n",
+	//		   oldCanvasWidth * canvasHeight * sizeof(unsigned char),
+	//		   canvasWidth * canvasHeight * sizeof(unsigned char));
+	ResizeCanvas(oldCanvasWidth, 0, canvasWidth);
+	weightWidth = endX - startX + 1;
+	weightHeight = canvasHeight;
+	//	    printf("malloc %zu bytes for weight\n",
+	//		   weightWidth * weightHeight * sizeof(unsigned short));
+	weight = (unsigned short *) MapZeroed(weightWidth * weightHeight * sizeof(unsigned short));
+	oldCanvasWidth = canvasWidth;
+
+	//	    PrintUsage();
+
+	// paint the old images
+	printf("Applying loaded image maps");
+	fflush(stdout);
+	nProcessed = 0;
+	nRegion = ImagesInRegion(startX, endX, startY, endY,
+				 startImage, endImage, region);
+	METRICS_RANGE_BEGIN("apply_map paint loaded images");
+	for (k = 0; k < nRegion; ++k)
+	  if (images[i = region[k]].minX < startX &&
+	      images[i].maxX >= startX &&
+	      images[i].minY <= endY &&
+	      images[i].maxY >= startY)
+	    {
+	      PaintImage(i, startX, endX, startY, endY);
+	      if ((nProcessed % 50) == 0 && nProcessed != 0)
+		printf(" %d\n    ", nProcessed);
+	      printf(".");
+	      fflush(stdout);
+	      ++nProcessed;
+	    }
+	METRICS_RANGE_END();
+
+	//	    PrintUsage();
+
+	// paint the new images
+	printf("\nApplying new image maps");
+	fflush(stdout);
+	nProcessed = 0;
+	nextPrefetch = startImage;
+	METRICS_RANGE_BEGIN("apply_map paint new images");
+	for (k = 0; k < nRegion; ++k)
+	  if (images[i = region[k]].minX >= startX &&
+	      images[i].minX <= endX &&
+	      images[i].minY <= endY &&
+	      images[i].maxY >= startY)
+	    {
+	      if (readAhead > 0)
+		PrefetchNewImages(&region[k+1], nRegion - k - 1,
+				  &nextPrefetch,
+				  startX, endX, startY, endY);
+	      PaintImage(i, startX, endX, startY, endY);
+	      if ((nProcessed % 50) == 0 && nProcessed != 0)
+		printf(" %d\n    ", nProcessed);
+	      printf(".");
+	      fflush(stdout);
+	      ++nProcessed;
+	    }
+	METRICS_RANGE_END();
+
+	//	    PrintUsage();
+
+	// paint the label if requested
+	if (labelWidth > 0)
+	  {
+	    printf("\nPainting label");
+	    fflush(stdout);
+
+	    if (labelMinX <= endX &&
+		labelMaxX >= startX &&
+		labelMinY <= endY &&
+		labelMaxY >= startY)
+	      {
+		MarkPainted(labelMinX, labelMaxX, labelMinY, labelMaxY);
+		len = strlen(label);
+		for (i = 0; i < len; ++i)
+		  {
+		    ci = label[i] - 32;
+		    if (ci < 0 || ci > 94)
+		      continue;
+		    charMinX = labelMinX + i * labelWidth;
+		    charMaxX = charMinX + labelWidth - 1;
+		    if (charMinX > endX ||
+			charMaxX < startX)
+		      continue;
+		    for (dy = 0; dy < labelHeight; ++dy)
+		      {
+			y = labelMinY + dy;
+			if (y < startY || y > endY)
+			  continue;
+			sy = ((float) dy) / labelHeight * fontHeight;
+			ey = ((float) (dy+1)) / labelHeight * fontHeight;
+			isy = (int) floor(sy);
+			iey = (int) floor(ey);
+			for (dx = 0; dx < labelWidth; ++dx)
+			  {
+			    x = charMinX + dx;
+			    if (x < startX || x > endX)
+			      continue;
+			    sx = ((float) dx) / labelWidth * fontWidth;
+			    ex = ((float) (dx+1)) / labelWidth * fontWidth;
+			    isx = (int) floor(sx);
+			    iex = (int) floor(ex);
+			    if (iex >= fontWidth)
+			      iex = fontWidth-1;
+			    ws = 0.0;
+			    v = 0.0;
+			    for (iy = isy; iy <= iey; ++iy)
+			      {
+				wy = 1.0;
+				if (iy == isy)
+				  wy -= sy - isy;
+				if (iy == iey)
+				  wy -= iey + 1.0 - ey;
+				for (ix = isx; ix <= iex; ++ix)
+				  {
+				    wx = 1.0;
+				    if (ix == isx)
+				      wx -= sx - isx;
+				    if (ix == iex)
+				      wx -= iex + 1.0 - ex;
+				    ws += wx * wy;
+				    v += wx * wy * font[(ci * fontHeight + iy) * fontWidth + ix];
+				  }
+			      }
+			    if (ws == 0.0)
+			      Error("Internal error: label weight is 0\n");
+			    ilv = (int) floor(v / ws + 0.5);
+			    if (ilv != 255)
+			      canvas[(y - startY) * canvasWidth + x - canvasMinX] = 255-ilv;
+			  }
+		      }
+		  }
+	      }
+	  }
+
+	// transfer to output tile(s)
+	printf("\nSaving rendered area");
+	fflush(stdout);
+	nProcessed = 0;
+	cx = 0;
+	a = reductionFactor * reductionFactor;
+	offset = a / 2;
+	ny = canvasHeight / reductionFactor;
+	for (;;)
+	  {
+	    nx = (((int) canvasWidth) - cx) / reductionFactor;
+	    if (tw - tx < nx)
+	      nx = tw - tx;
+	    if (nx <= 0)
+	      break;
+	    if (out == NULL)
+	      out = AcquireOutBuffer(outSize);
+
+	    for (y = 0; y < ny; ++y)
+	      {
+		iy = y * reductionFactor;
+		// rows of blocks nothing was painted into are black
+		//   without reading the canvas
+		if (!AreaPainted(canvasMinX + cx,
+				 canvasMinX + cx + nx * reductionFactor - 1,
+				 canvasMinY + iy,
+				 canvasMinY + iy + reductionFactor - 1))
+		  {
+		    memset(&out[(ty+y)*tw+tx], 0, nx);
+		    continue;
+		  }
+		if ((ty + y) / th < rows)
+		  tilePainted[(ty + y) / th] = 1;
+		if (reductionFactor > 1)
+		  for (x = 0; x < nx; ++x)
+		    {
+		      ix = x * reductionFactor + cx;
+		      sum = 0;
+		      valid = 1;
+		      for (dy = 0; dy < reductionFactor; ++dy)
+			for (dx = 0; dx < reductionFactor; ++dx)
+			  {
+			    iv = canvas[(iy+dy)*canvasWidth + (ix+dx)];
+			    if (iv != 0)
+			      sum += iv;
+			    else
+			      valid = 0;
+			  }
+		      if (valid)
+			out[(ty+y)*tw+tx+x] = (sum + offset) / a;
+		      else
+			out[(ty+y)*tw+tx+x] = 0;
+		    }
+		else
+		  memcpy(&out[(ty+y)*tw+tx],
+			 &canvas[y*canvasWidth + cx],
+			 nx);
+	      }
+
+	    if (hi == hs-1)
+	      {
+		// last stripe, so blacken tile bottom
+		for (y = ty+ny; y < outHeight; ++y)
+		  memset(&out[y*tw+tx], 0, nx);
+	      }
+
+	    cx += nx * reductionFactor;
+	    tx += nx;
+	    if (endX == oMaxX)
+	      {
+		// blacken tile right side
+		if (tw > tx)
+		  for (y = 0; y < outHeight; ++y)
+		    memset(&out[y*tw+tx], 0, tw - tx);
+		tx = tw;
+	      }
+
+	    if (tx == tw && streaming)
+	      {
+		prevPhase = MetricsPhase(METRICS_WRITE);
+		WriteBand((int) outHeight, images[startImage].name);
+		MetricsPhase(prevPhase);
+		tx = 0;
+	      }
+	    else if (tx == tw &&
+		     (cols == 1 && hi == hs-1 ||
+		      cols > 1))
+	      {
+		prevPhase = MetricsPhase(METRICS_WRITE);
+		WriteTiles(tCol, startRow, endRow,
+			   images[startImage].name);
+		MetricsPhase(prevPhase);
+		tx = 0;
+		++tCol;
+	      }
+	  }
+	printf("\n");
+
+	//	    PrintUsage();
+
+	// save extra pixel columns
+	canvasWidth -= cx;
+	canvasMinX += cx;
+	//	    printf("realloc canvas from %zu bytes to %zu bytes\n",
+	//		   oldCanvasWidth * canvasHeight * sizeof(unsigned char),
+	//		   canvasWidth * canvasHeight * sizeof(unsigned char));
+	ResizeCanvas(oldCanvasWidth, cx, canvasWidth);
+	weightMinX += (int) weightWidth;
+
+	//	    printf("freeing %zu bytes from weight\n",
+	//		   weightHeight * weightWidth * sizeof(unsigned short));
+	UnmapZeroed(weight, weightWidth * weightHeight * sizeof(unsigned short));
+
+	startX = endX + 1;
+
+	//	    PrintUsage();
+      } while (startX <= renderMaxX);
+
+      if (cols > 1 || streaming)
+	{
+	  //	      printf("freeing %zu bytes from out (cols > 1)\n",
+	  //		     outHeight * outWidth *
+	  //		     sizeof(unsigned char));
+	  if (out != NULL)
+	    ReleaseOutBuffer(out);
+	  out = NULL;
+	}
+    }
+
+  //      PrintUsage();
+
+  if (cols == 1)
+    {
+      //	  printf("freeing %zu bytes from out (cols == 1)\n",
+      //		 outHeight * outWidth *
+      //		 sizeof(unsigned char));
+      if (out != NULL)
+	ReleaseOutBuffer(out);
+      out = NULL;
+    }
+  if (outWriter != NULL)
+    {
+      if (!CloseImageWriter(outWriter, msg))
+	Error("Could not finish output image:\n  error: %s\n", msg);
+      outWriter = NULL;
+    }
+
+  if (sourceMap != NULL)
+    {
+      if (!CreateDirectories(sourceMapName))
+	Error("Could not create directories for source map file %s\n",
+	      sourceMapName);
+      if (!WriteMap(sourceMapName, sourceMap, sourceMapLevel,
+		    sourceMapWidth, sourceMapHeight,
+		    0, 0,
+		    mapsName, imageListName,
+		    UncompressedMap, msg))
+	Error("Could not write source map %s:\n%s\n", sourceMapName, msg);
+      //	  printf("freeing %zu bytes from sourceMap\n",
+      //		     sourceMapSize * sizeof(MapElement));
+      free(sourceMap);
+      sourceMap = NULL;
+    }
+
+  if (pyramidLevels > 0)
+    FinishPyramid();
+
+  /* release whatever this task still holds; a served image, or one
+     held for the regions still to be rendered, is kept until
+     EvictImages needs the room */
+  if (!serving && !holdImages)
+    for (i = startImage; i <= endImage; ++i)
+      ReleaseImage(i);
+  free(increase);
+  free(decrease);
+  free(region);
+  free(tilePainted);
+  tilePainted = NULL;
+  free(canvasPainted);
+  canvasPainted = NULL;
+  METRICS_MARK(NULL);
+}
+
+/* PlanColumns counts the passes across the columns of the current
+   strip that rendering it within -memory would take, following the
+   column loop of RenderSection with the memory of the images it
+   paints taken from increase and decrease; it returns -1 if not even
+   one column would fit */
+int
+PlanColumns (int oi, size_t *increase, size_t *decrease)
+{
+  size_t fixed, open, mem, limit;
+  size_t imageBytes;
+  int startX, endX, x;
+  int canvasStart;
+  int passes;
+
+  limit = ((size_t) memoryLimit) * 1000000;
+  fixed = sourceMapWidth * sourceMapHeight * sizeof(MapElement) +
+    maxOutBuffers * outHeight * outWidth * sizeof(unsigned char) +
+    2 * oWidth * sizeof(size_t);
+  if (pyramidLevels > 0)
+    fixed += PyramidMemory((int) ((outHeight + th - 1) / th));
+  imageBytes = 0;
+  if (!overlay)
+    {
+      imageBytes = images[oi].sw * images[oi].sh *
+	(sizeof(unsigned char) + sizeof(unsigned char)) +
+	((images[oi].sw + 7) / 8) * images[oi].sh +
+	images[oi].mapBytes;
+      fixed += imageBytes;
+    }
+
+  /* the images open at a column are those charged left of it */
+  open = 0;
+  if (overlay)
+    for (x = oMinX; x < renderMinX; ++x)
+      open += increase[x - oMinX] - decrease[x - oMinX];
+  passes = 0;
+  canvasStart = renderMinX;
+  for (startX = renderMinX; startX <= renderMaxX; startX = endX + 1)
+    {
+      /* the columns left over from the last pass stay on the canvas */
+      mem = fixed + open + (startX - canvasStart) * canvasHeight *
+	sizeof(unsigned char);
+      endX = startX - 1;
+      while (mem < limit && endX < renderMaxX)
+	{
+	  ++endX;
+	  mem += canvasHeight * (sizeof(unsigned char) + sizeof(unsigned short));
+	  if (overlay)
+	    {
+	      mem += increase[endX - oMinX];
+	      mem -= decrease[endX - oMinX];
+	    }
+	}
+      if (mem >= limit)
+	--endX;
+      if (endX < startX)
+	return(-1);
+      canvasStart += ((endX - canvasStart + 1) / reductionFactor) *
+	reductionFactor;
+      if (overlay)
+	for (x = startX; x <= endX; ++x)
+	  open += increase[x - oMinX] - decrease[x - oMinX];
+      else
+	open = imageBytes;	/* the image stays loaded, and is charged
+				   again, on later passes */
+      ++passes;
+    }
+  return(passes);
+}
+
+/* PrefetchNewImages asks for the next readAhead images of list
+   (which holds n images, in increasing order) that the new-image pass
+   over this area will paint, and that are not in memory, to be read
+   in the background; *next is the first image not yet asked for */
+void
+PrefetchNewImages (int *list, int nList, int *next,
+		   int minX, int maxX, int minY, int maxY)
+{
+  int j, k;
+  int n;
+  char fn[PATH_MAX];
+
+  if (sampleFactor > 1 && mipmapCacheName[0] != '\0')
+    return;
+  n = 0;
+  for (k = 0; k < nList && n < readAhead; ++k)
+    if (images[j = list[k]].minX >= minX &&
+	images[j].minX <= maxX &&
+	images[j].minY <= maxY &&
+	images[j].maxY >= minY &&
+	images[j].image == NULL)
+      {
+	if (j >= *next)
+	  {
+	    sprintf(fn, "%s%s", imagesName, images[j].name);
+	    PrefetchImage(fn, -1, -1, -1, -1);
+	    *next = j + 1;
+	  }
+	++n;
+      }
+}
+
+void
+PaintImage (int i, int minX, int maxX, int minY, int maxY)
+{
+  int j;
+  int iw, ih;
+  int x, y;
+  InverseMap *invMap;
+  float rx, ry;
+  size_t maskBytes;
+  size_t mbpl;
+  unsigned char *mask;
+  unsigned char *dist;
+  float *distance;
+  float dst;
+  int idst;
+  float cx, cy;
+  float offset;
+  int nx, ny;
+  int pMinX, pMaxX, pMinY, pMaxY;
+  unsigned char *image;
+  float d, d2;
+  int row, col;
+  int ix, iy;
+  float mFactor;
+  int offsetX, offsetY;
+  size_t newCanvasSize;
+  int mxMin, myMin;
+  char imName0[PATH_MAX];
+  char imName1[PATH_MAX];
+  char msg[PATH_MAX+256];
+  char fn[PATH_MAX];
+  char invName[PATH_MAX];
+  struct stat statBuf, invStatBuf;
+  time_t maskTime;
+  int complete;
+  MapElement *imap;
+  IntensityCell *icells, *ic;
+  float imapFactor;
+  int imapw, imaph;
+  int imapXMin, imapYMin;
+  char imapName0[PATH_MAX], imapName1[PATH_MAX];
+  int targetMapSize;
+  MapElement *targetMap;
+  int targetMapWidth, targetMapHeight;
+  int targetMapMask;
+  int tmi;
+  int mw, mh;
+  MapElement *map;
+  float spacing;
+  float rxp, ryp;
+  unsigned char *imask;
+  size_t imbpl;
+  int warned;
+  PaintThread pt;
+  PaintThread *pts;
+  int nBands;
+  int k;
+  int prevPhase;
+  int nLevels;
+  int level;
+
+  prevPhase = MetricsPhase(METRICS_READ);
+
+  /* read in map if necessary */
+  if (images[i].map == NULL)
+    {
+      sprintf(fn, "%s%s.map", mapsName, images[i].name);
+      if (partialMaps)
+	{
+	  /* the image is released at the end of the task, so only
+	     the cells landing in its x range (and a pixel to spare)
+	     are needed */
+	  if (!ReadMapTargetRegion(fn, &(images[i].map), &(images[i].mLevel),
+				   &(images[i].mw), &(images[i].mh),
+				   &(images[i].mxMin), &(images[i].myMin),
+				   imName0, imName1,
+				   (renderMinX - 1) / mapScale,
+				   (renderMaxX + 1) / mapScale,
+				   (oMinY - 1) / mapScale,
+				   (oMaxY + 1) / mapScale,
+				   msg))
+	    Error("Could not read map %s:\n  error: %s\n",
+		  fn, msg);
+	  images[i].mapAllocated = (images[i].map != NULL);
+	  if (images[i].map != NULL)
+	    MetricsCount("map_elements_read",
+			 (double) images[i].mw * images[i].mh);
+	}
+      if (images[i].map == NULL && reductionFactor > 1 &&
+	  ReadMapLevels(fn, &nLevels, msg) && nLevels > 0)
+	{
+	  /* a reduced output needs no finer map than its pixels, so
+	     take the coarsest copy stored with the map that is fine
+	     enough */
+	  for (level = 0; (2 << level) <= reductionFactor; ++level) ;
+	  if (!ReadMapLevel(fn, &(images[i].map), level,
+			    &(images[i].mLevel),
+			    &(images[i].mw), &(images[i].mh),
+			    &(images[i].mxMin), &(images[i].myMin),
+			    imName0, imName1,
+			    msg))
+	    Error("Could not read map %s:\n  error: %s\n",
+		  fn, msg);
+	  images[i].mapAllocated = 1;
+	  MetricsCount("map_elements_read",
+		       (double) images[i].mw * images[i].mh);
+	}
+      if (images[i].map == NULL &&
+	  !MapMmap(fn, &(images[i].map), &(images[i].mLevel),
+		   &(images[i].mw), &(images[i].mh),
+		   &(images[i].mxMin), &(images[i].myMin),
+		   imName0, imName1,
+		   msg))
+	Error("Could not read map %s:\n  error: %s\n",
+	      fn, msg);
+      if (nChain > 0)
+	{
+	  /* the chain is composed at the resolution of the image's
+	     map, which it then replaces */
+	  map = ComposeChain(i, images[i].map, images[i].mLevel,
+			     images[i].mw, images[i].mh);
+	  if (images[i].mapAllocated)
+	    free(images[i].map);
+	  else
+	    MapMunmap(images[i].map, images[i].mw, images[i].mh);
+	  images[i].map = map;
+	  images[i].mapAllocated = 1;
+	}
+      if (rotation != 0.0)
+	{
+	  map = images[i].map;
+	  spacing = (1 << images[i].mLevel) * mapScale;
+	  mw = images[i].mw;
+	  mh = images[i].mh;
+	  for (y = 0; y < mh; ++y)
+	    for (x = 0; x < mw; ++x)
+	      {
+		rx = map[y*mw+x].x * spacing;
+		ry = map[y*mw+x].y * spacing;
+		rxp = rx - rotationX;
+		ryp = ry - rotationY;
+		rx = cosRot * rxp + sinRot * ryp + rotationX;
+		ry = -sinRot * rxp + cosRot * ryp + rotationY;
+		map[y*mw+x].x = rx / spacing;
+		map[y*mw+x].y = ry / spacing;
+	      }
+	}
+
+      imageMem += images[i].mapBytes;
+    }
+  if (forwardRender && images[i].scanMap == NULL)
+    BuildScanMap(i);
+  /* with -forward, the inverse is only needed for the quads that
+     can not be scan-converted */
+  if (images[i].invMap == NULL &&
+      (images[i].scanMap == NULL || images[i].nInvertQuads > 0))
+    {
+      /* a cached inverse is only good for the maps as they are on
+	 disk, so not once they have been rotated or cut down */
+      if (inverseCache && rotation == 0.0 && !images[i].mapAllocated)
+	{
+	  sprintf(fn, "%s%s.map", mapsName, images[i].name);
+	  sprintf(invName, "%s%s.inv", mapsName, images[i].name);
+	  if (stat(fn, &statBuf) == 0 && stat(invName, &invStatBuf) == 0 &&
+	      invStatBuf.st_mtime >= statBuf.st_mtime)
+	    images[i].invMap = ReadInverseMap(invName, images[i].map,
+					      images[i].mw, images[i].mh,
+					      msg);
+	}
+      if (images[i].invMap == NULL)
+	{
+	  images[i].invMap = InvertMapThreads(images[i].map,
+					      images[i].mw,
+					      images[i].mh,
+					      nThreads);
+	  if (images[i].invMap == NULL)
+	    Error("Could not invert map for image %s\n", images[i].name);
+	  if (inverseCache && rotation == 0.0 && !images[i].mapAllocated &&
+	      !WriteInverseMap(invName, images[i].invMap, msg))
+	    fprintf(stderr, "Warning: could not save inverse map %s:\n  %s\n",
+		    invName, msg);
+	}
+    }
+	
+  /* read in image if necessary */
+  if (images[i].image == NULL)
+    {
+      if (sampleFactor == 1 || mipmapCacheName[0] == '\0' ||
+	  !ReadMipmap(i))
+	{
+	  sprintf(fn, "%s%s", imagesName, images[i].name);
+	  /* uncompressed images are mapped rather than read, unless
+	     they have been prefetched */
+	  if (!prefetching &&
+	      ImageMmap(fn, &(images[i].image), &iw, &ih, msg))
+	    images[i].imageMapped = 1;
+	  else if (!TakeImage(fn, &(images[i].image),
+			      &iw, &ih,
+			      -1, -1, -1, -1,
+			      msg))
+	    Error("Could not read image %s:\n  error: %s\n",
+		  fn, msg);
+	  if (iw != images[i].width ||
+	      ih != images[i].height)
+	    Error("Dimensions of image %s do not match those in images list.\n",
+		  fn);
+	  MetricsCount("images_read", 1);
+	  if (sampleFactor > 1)
+	    {
+	      MetricsPhase(METRICS_PYRAMID);
+	      ReduceImage(i);
+	      if (mipmapCacheName[0] != '\0')
+		WriteMipmap(i);
+	      MetricsPhase(METRICS_READ);
+	    }
+	}
+      imageMem += images[i].sw * images[i].sh;
+
+      if (targetMapsName[0] != '\0')
+	{
+	  targetMapWidth = (images[i].width + targetMapsFactor - 1) /
+	    targetMapsFactor;
+	  targetMapHeight = (images[i].height + targetMapsFactor - 1) /
+	    targetMapsFactor;
+	  targetMapSize = targetMapWidth * targetMapHeight;
+	  //	  printf("malloc %zu bytes for targetMap\n",
+	  //		 targetMapSize * sizeof(MapElement));
+	  images[i].targetMap =
+	    (MapElement *) malloc(targetMapSize * sizeof(MapElement));
+ 	  if (images[i].targetMap == 0)
+ 	    Error("malloc of targetMap failed; errno = %d\n", errno);
+	  memset(images[i].targetMap, 0,
+		 targetMapSize * sizeof(MapElement));
+	}
+      else
+	images[i].targetMap = NULL;
+    }
+  targetMapWidth = (images[i].width + targetMapsFactor - 1) / targetMapsFactor;
+  targetMapHeight = (images[i].height + targetMapsFactor - 1) / targetMapsFactor;
+  targetMapSize = targetMapWidth * targetMapHeight;
+  targetMap = images[i].targetMap;
+  targetMapMask = targetMapsFactor - 1;
+
+  /* read in mask if necessary */
+  if (images[i].mask == NULL)
+    if (masksName[0] != '\0')
+      {
+	sprintf(fn, "%s%s", masksName, images[i].name);
+	if (!ReadBitmap(fn, &(images[i].mask),
+			&iw, &ih,
+			-1, -1, -1, -1,
+			msg))
+	  Error("Could not read mask %s:\n  error: %s\n",
 		fn, msg);
 	if (maskScale == 1.0 &&
 	    (iw != images[i].width ||
@@ -1576,491 +3770,2990 @@ PaintImage (int i, int minX, int maxX, int minY, int maxY)
 	maskBytes = mbpl * images[i].height;
 	if (maskScale != 1.0)
 	  {
-	    mask = (unsigned char *) malloc(maskBytes);
-	    memset(mask, 0, maskBytes);
-	    imask = images[i].mask;
-	    imbpl = (iw + 7) / 8;
-	    for (y = 0; y < images[i].height; ++y)
+	    mask = (unsigned char *) malloc(maskBytes);
+	    memset(mask, 0, maskBytes);
+	    imask = images[i].mask;
+	    imbpl = (iw + 7) / 8;
+	    for (y = 0; y < images[i].height; ++y)
+	      {
+		iy = (int) floor(y / maskScale + 0.001);
+		for (x = 0; x < images[i].width; ++x)
+		  {
+		    ix = (int) floor(x / maskScale + 0.001);
+		    if (imask[iy*imbpl + (ix >> 3)] & (0x80 >> (ix & 7)))
+		      mask[y*mbpl + (x >> 3)] |= 0x80 >> (x & 7);
+		  }
+	      }
+	    free(images[i].mask);
+	    images[i].mask = mask;
+	  }
+	
+	mask = images[i].mask;
+	for (j = 0; j < maskBytes; ++j)
+	  mask[j] ^= 0xff;
+	if (sampleFactor > 1)
+	  {
+	    ReduceMask(i);
+	    maskBytes = ((images[i].sw + 7) / 8) * images[i].sh;
+	  }
+	imageMem += maskBytes;
+      }
+    else
+      {
+	maskBytes = ((images[i].sw + 7) / 8) * images[i].sh;
+	//	printf("malloc %zu bytes for mask\n", maskBytes);
+	mask = images[i].mask = (unsigned char *) malloc(maskBytes);
+ 	if (mask == 0)
+ 	  Error("malloc of mask failed; errno = %d\n", errno);
+	memset(images[i].mask, 0, maskBytes);
+	imageMem += maskBytes;
+      }
+		
+  /* read in intensity map if necessary, and gather its cells */
+  if (images[i].icells == NULL)
+    if (imapsName[0] != '\0')
+      {
+	sprintf(fn, "%s%s.map", imapsName, images[i].name);
+	if (!MapMmap(fn, &imap, &(images[i].imapLevel),
+		     &(images[i].imapw), &(images[i].imaph),
+		     &imapXMin, &imapYMin,
+		     imapName0, imapName1,
+		     msg))
+	  Error("Could not read map %s:\n  error: %s\n",
+		fn, msg);
+	if (imapXMin != 0 || imapYMin != 0)
+	  Error("Can not handle partial intensity map: %s\n", fn);
+	imapw = images[i].imapw;
+	imaph = images[i].imaph;
+	if (imapw < 2 || imaph < 2)
+	  Error("Intensity map %s is too small (%dx%d)\n", fn, imapw, imaph);
+	ic = (IntensityCell *) malloc((imapw - 1) * (imaph - 1) *
+				      sizeof(IntensityCell));
+	if (ic == NULL)
+	  Error("Could not allocate cells of intensity map %s\n", fn);
+	images[i].icells = ic;
+	for (y = 0; y < imaph - 1; ++y)
+	  for (x = 0; x < imapw - 1; ++x, ++ic)
+	    {
+	      ic->b00 = imap[y*imapw+x].x;
+	      ic->w00 = imap[y*imapw+x].y;
+	      ic->b01 = imap[(y+1)*imapw+x].x;
+	      ic->w01 = imap[(y+1)*imapw+x].y;
+	      ic->b10 = imap[y*imapw+x+1].x;
+	      ic->w10 = imap[y*imapw+x+1].y;
+	      ic->b11 = imap[(y+1)*imapw+x+1].x;
+	      ic->w11 = imap[(y+1)*imapw+x+1].y;
+	    }
+	MapMunmap(imap, imapw, imaph);
+	imageMem += (imapw - 1) * (imaph - 1) * sizeof(IntensityCell);
+      }
+		
+  MetricsPhase(METRICS_COMPUTE);
+
+  /* compute distance table if necessary */
+  if (images[i].dist == NULL)
+    {
+      iw = images[i].sw;
+      ih = images[i].sh;
+      //      printf("malloc %zu bytes for dist\n", iw * ih * sizeof(unsigned char));
+      images[i].dist = (unsigned char*) malloc(iw * ih * sizeof(unsigned char));
+      if (images[i].dist == 0)
+ 	Error("malloc of images[i].dist failed; errno = %d\n", errno);
+      maskTime = MaskTime(i);
+      if (distanceCacheName[0] == '\0' || !ReadDistance(i, maskTime))
+	{
+	  distance = (float*) malloc(iw * ih * sizeof(float));
+	  if (distance == 0)
+	    Error("malloc of distance failed; errno = %d\n", errno);
+	  computeDistanceThreaded(EUCLIDEAN_DISTANCE,
+				  iw, ih, images[i].mask,
+				  distance, nThreads);
+
+	  /* if distance from edge is less, use that */
+	  dist = images[i].dist;
+	  for (y = 0; y < ih; ++y)
+	    for (x = 0; x < iw; ++x)
+	      {
+		dst = distance[y*iw+x];
+		d = x + 1;
+		if (d < dst)
+		  dst = d;
+		d = iw - x;
+		if (d < dst)
+		  dst = d;
+		d = y + 1;
+		if (d < dst)
+		  dst = d;
+		d = ih - y;
+		if (d < dst)
+		  dst = d;
+		idst = (int) floor(64.0 * sampleFactor * dst);
+		if (idst > 255)
+		  idst = 255;
+		else if (idst < 0)
+		  idst = 0;
+		dist[y*iw + x] = idst;
+	      }
+	  free(distance);
+	  if (distanceCacheName[0] != '\0')
+	    WriteDistance(i, maskTime);
+	}
+      imageMem += iw * ih;
+    }
+
+  /* paint the image on the canvas */
+  pMinX = minX;
+  pMaxX = maxX;
+  pMinY = minY;
+  pMaxY = maxY;
+  if (images[i].minX > pMinX)
+    pMinX = images[i].minX;
+  if (images[i].maxX < pMaxX)
+    pMaxX = images[i].maxX;
+  if (images[i].minY > pMinY)
+    pMinY = images[i].minY;
+  if (images[i].maxY < pMaxY)
+    pMaxY = images[i].maxY;
+
+  mFactor = (1 << images[i].mLevel) * mapScale;
+  invMap = images[i].invMap;
+  image = images[i].image;
+  mask = images[i].mask;
+  icells = images[i].icells;
+  if (icells != NULL)
+    {
+      imapFactor = (1 << images[i].imapLevel) * imapScale;
+      imapw = images[i].imapw;
+      imaph = images[i].imaph;
+    }
+  dist = images[i].dist;
+  iw = images[i].sw;
+  ih = images[i].sh;
+  mxMin = images[i].mxMin;
+  myMin = images[i].myMin;
+  //  printf("mxMin = %d myMin = %d\n", mxMin, myMin);
+  cx = (images[i].width - 1) / 2.0;
+  cy = (images[i].height - 1) / 2.0;
+  mbpl = (iw + 7) / 8;
+  offset = -1000000.0;
+  printf("Rendering %s from x=%d to %d y=%d to %d\n",
+	 images[i].name, pMinX, pMaxX, pMinY, pMaxY);
+  warned = 0;
+  pt.i = i;
+  pt.index = 0;
+  pt.minY = minY;
+  pt.pMinX = pMinX;
+  pt.pMaxX = pMaxX;
+  pt.pMinY = pMinY;
+  pt.pMaxY = pMaxY;
+  pt.scanMap = images[i].scanMap;
+  pt.scanW = images[i].scanW;
+  pt.scanH = images[i].scanH;
+  pt.scanFactor = images[i].scanFactor;
+  pt.quads = images[i].quads;
+  pt.quadRows = images[i].quadRows;
+  pt.mFactor = mFactor;
+  pt.mxMin = mxMin;
+  pt.myMin = myMin;
+  pt.iw = iw;
+  pt.ih = ih;
+  pt.mbpl = mbpl;
+  pt.image = image;
+  pt.mask = mask;
+  pt.dist = dist;
+  pt.icells = icells;
+  pt.imapFactor = imapFactor;
+  pt.imapw = imapw;
+  pt.imaph = imaph;
+  pt.cx = cx;
+  pt.cy = cy;
+  pt.xf = images[i].transformed ? images[i].xf : NULL;
+  pt.targetMap = targetMap;
+  pt.targetMapWidth = targetMapWidth;
+  pt.targetMapHeight = targetMapHeight;
+  pt.targetMapSize = targetMapSize;
+  pt.targetMapMask = targetMapMask;
+  pt.warned = &warned;
+  pt.nTargets = 0;
+  pt.maxTargets = 0;
+  pt.targets = NULL;
+
+  nBands = nThreads;
+  if (nBands > pMaxY - pMinY + 1)
+    nBands = pMaxY - pMinY + 1;
+  if (gpuRender && PaintGpu(&pt))
+    ;
+  else if (nBands <= 1)
+    {
+      /* paint directly into the target map */
+      pt.defer = 0;
+      pt.invMap = invMap;
+      pt.y0 = pMinY;
+      pt.y1 = pMaxY;
+      PaintRows(&pt);
+    }
+  else
+    {
+      /* each thread paints a band of rows, and so owns those rows of
+	 the canvas and weight arrays; the target map is indexed by
+	 source pixel, so those writes are recorded and replayed in band
+	 order afterwards to give the same result as a serial pass */
+      pts = (PaintThread *) malloc(nBands * sizeof(PaintThread));
+      if (pts == NULL)
+	Error("Could not allocate paint threads\n");
+      for (j = 0; j < nBands; ++j)
+	{
+	  pts[j] = pt;
+	  pts[j].index = j;
+	  pts[j].defer = (targetMap != NULL);
+	  pts[j].invMap = invMap != NULL ? ShareInverseMap(invMap) : NULL;
+	  pts[j].y0 = pMinY + (int) (((long long) j * (pMaxY - pMinY + 1)) /
+				    nBands);
+	  pts[j].y1 = pMinY + (int) (((long long) (j+1) * (pMaxY - pMinY + 1)) /
+				    nBands) - 1;
+	}
+      for (j = 1; j < nBands; ++j)
+	if (pthread_create(&pts[j].thread, NULL, PaintThreadMain, &pts[j]) != 0)
+	  Error("pthread_create failed\n");
+      PaintRows(&pts[0]);
+      for (j = 1; j < nBands; ++j)
+	if (pthread_join(pts[j].thread, NULL) != 0)
+	  Error("pthread_join failed\n");
+      for (j = 0; j < nBands; ++j)
+	{
+	  for (k = 0; k < pts[j].nTargets; ++k)
+	    {
+	      tmi = pts[j].targets[k].tmi;
+	      targetMap[tmi].x = pts[j].targets[k].x;
+	      targetMap[tmi].y = pts[j].targets[k].y;
+	      targetMap[tmi].c = 1.0;
+	    }
+	  if (pts[j].targets != NULL)
+	    free(pts[j].targets);
+	  if (pts[j].invMap != NULL)
+	    FreeInverseMap(pts[j].invMap);
+	}
+      free(pts);
+    }
+
+  /* free up if no longer required */
+  MetricsPhase(METRICS_WRITE);
+  if (!serving && !holdImages &&
+      (images[i].maxX <= maxX || maxX >= renderMaxX))
+    ReleaseImage(i);
+  MetricsPhase(prevPhase);
+}
+
+/* ComposeChain returns, in newly allocated memory, map (the map of image
+   i, mw x mh at mLevel) composed with the maps of the chain in turn */
+MapElement *
+ComposeChain (int i, MapElement *map, int mLevel, int mw, int mh)
+{
+  MapElement *cmap, *omap, *tmp;
+  MapElement *map2;
+  int mLevel2, mw2, mh2;
+  int mxMin2, myMin2;
+  InverseMap *invMap2;
+  int k;
+  char fn[PATH_MAX];
+  char imName0[PATH_MAX], imName1[PATH_MAX];
+  char msg[PATH_MAX+256];
+
+  omap = (MapElement *) malloc(mw * mh * sizeof(MapElement));
+  cmap = NULL;
+  if (nChain > 1)
+    cmap = (MapElement *) malloc(mw * mh * sizeof(MapElement));
+  if (omap == NULL || (nChain > 1 && cmap == NULL))
+    Error("Could not allocate composed map for image %s\n", images[i].name);
+  for (k = 0; k < nChain; ++k)
+    {
+      sprintf(fn, "%s%s.map", chain[k].name, images[i].name);
+      if (!MapMmap(fn, &map2, &mLevel2, &mw2, &mh2, &mxMin2, &myMin2,
+		   imName0, imName1, msg))
+	Error("Could not read map %s:\n  error: %s\n", fn, msg);
+      invMap2 = NULL;
+      if (chain[k].invert &&
+	  (invMap2 = InvertMapThreads(map2, mw2, mh2, nThreads)) == NULL)
+	Error("Could not invert map %s\n", fn);
+      if (!ComposeMaps(k == 0 ? map : cmap, mLevel, mw, mh,
+		       map2, mLevel2, mw2, mh2, mxMin2, myMin2,
+		       invMap2, nThreads, omap, msg))
+	Error("Could not compose map %s:\n  error: %s\n", fn, msg);
+      if (invMap2 != NULL)
+	FreeInverseMap(invMap2);
+      MapMunmap(map2, mw2, mh2);
+      if (k < nChain - 1)
+	{
+	  tmp = cmap;
+	  cmap = omap;
+	  omap = tmp;
+	}
+    }
+  if (cmap != NULL)
+    free(cmap);
+  return(omap);
+}
+
+/* ReleaseImage frees all data held for image i, first writing out its
+   target map if one was being built */
+void
+ReleaseImage (int i)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  int targetMapWidth, targetMapHeight;
+
+  targetMapWidth = (images[i].width + targetMapsFactor - 1) / targetMapsFactor;
+  targetMapHeight = (images[i].height + targetMapsFactor - 1) / targetMapsFactor;
+  if (images[i].targetMap != NULL)
+    {
+      sprintf(fn, "%s%s.map", targetMapsName, images[i].name);
+      if (!CreateDirectories(fn))
+	Error("Could not create directories for target map file %s\n",
+	      fn);
+      if (!WriteMap(fn, images[i].targetMap, targetMapsLevel,
+		    targetMapWidth, targetMapHeight,
+		    0, 0,
+		    images[i].name, outputName,
+		    UncompressedMap, msg))
+	Error("Could not write target map %s:\n%s\n", fn, msg);
+      //	  printf("freeing %zu bytes from targetMap\n",
+      //		 targetMapHeight * targetMapWidth * sizeof(MapElement));
+      free(images[i].targetMap);
+      images[i].targetMap = NULL;
+    }
+  if (images[i].invMap != NULL)
+    {
+      FreeInverseMap(images[i].invMap);
+      images[i].invMap = NULL;
+    }
+  if (images[i].scanMap != NULL)
+    {
+      free(images[i].scanMap);
+      free(images[i].quads);
+      free(images[i].quadRows);
+      images[i].scanMap = NULL;
+      images[i].quads = NULL;
+      images[i].quadRows = NULL;
+    }
+  if (images[i].map != NULL)
+    {
+      if (images[i].mapAllocated)
+	free(images[i].map);
+      else
+	MapMunmap(images[i].map, images[i].mw, images[i].mh);
+      images[i].map = NULL;
+      images[i].mapAllocated = 0;
+      imageMem -= images[i].mapBytes; // this accounts for the inverse
+				      // map and target map as well
+    }
+  if (images[i].icells != NULL)
+    {
+      free(images[i].icells);
+      images[i].icells = NULL;
+      imageMem -= (images[i].imapw - 1) * (images[i].imaph - 1) *
+	sizeof(IntensityCell);
+    }
+  if (images[i].image != NULL)
+    {
+      //	  printf("freeing %zu bytes from image\n",
+      //		 images[i].height * images[i].width * sizeof(unsigned char));
+      if (images[i].imageMapped)
+	ImageMunmap(images[i].image, images[i].sw, images[i].sh);
+      else
+	free(images[i].image);
+      images[i].image = NULL;
+      images[i].imageMapped = 0;
+      imageMem -= images[i].sw * images[i].sh;
+    }
+  if (images[i].mask != NULL)
+    {
+      //	  printf("freeing %zu bytes from mask\n",
+      //		 (size_t) ((images[i].width + 7) / 8) * images[i].height);
+      free(images[i].mask);
+      images[i].mask = NULL;
+      imageMem -= ((images[i].sw + 7) / 8) * images[i].sh;
+    }
+  if (images[i].dist != NULL)
+    {
+      //	  printf("freeing %zu bytes from dist\n",
+      //		 (size_t) (images[i].width  * images[i].height));
+      free(images[i].dist);
+      images[i].dist = NULL;
+      imageMem -= images[i].sw * images[i].sh;
+    }
+}
+
+void *
+PaintThreadMain (void *arg)
+{
+  par_pin_thread(((PaintThread *) arg)->index);
+  PaintRows((PaintThread *) arg);
+  return(NULL);
+}
+
+void
+PaintRows (PaintThread *pt)
+{
+  int i;
+  int minY;
+  int iw, ih;
+  int x, y;
+  InverseMap *invMap;
+  float xv, yv;
+  int ixv, iyv;
+  float rrx, rry;
+  float rv, dv;
+  size_t mbpl;
+  unsigned char *mask;
+  unsigned char *dist;
+  float cx, cy;
+  float r00, r01, r10, r11;
+  float d00, d01, d10, d11;
+  int pMinX, pMaxX, pMinY, pMaxY;
+  unsigned char *image;
+  float w;
+  float mFactor;
+  int v;
+  int mxMin, myMin;
+  int iixv, iiyv;
+  float rb, rw;
+  IntensityCell *icells, *ic;
+  float imapFactor;
+  int imapw, imaph;
+  float xvi, yvi;
+  int smi;
+  int targetMapSize;
+  MapElement *targetMap;
+  int targetMapWidth, targetMapHeight;
+  int targetMapMask;
+  int tmi;
+  int testX, testY;
+  float sxv, syv;
+  double (*xf)[3];
+  float mxv, myv;
+  unsigned char *rowKind;
+  float *rowX, *rowY;
+
+  i = pt->i;
+  minY = pt->minY;
+  pMinX = pt->pMinX;
+  pMaxX = pt->pMaxX;
+  pMinY = pt->pMinY;
+  pMaxY = pt->pMaxY;
+  mFactor = pt->mFactor;
+  mxMin = pt->mxMin;
+  myMin = pt->myMin;
+  iw = pt->iw;
+  ih = pt->ih;
+  mbpl = pt->mbpl;
+  image = pt->image;
+  mask = pt->mask;
+  dist = pt->dist;
+  icells = pt->icells;
+  imapFactor = pt->imapFactor;
+  imapw = pt->imapw;
+  imaph = pt->imaph;
+  cx = pt->cx;
+  cy = pt->cy;
+  targetMap = pt->targetMap;
+  targetMapWidth = pt->targetMapWidth;
+  targetMapHeight = pt->targetMapHeight;
+  targetMapSize = pt->targetMapSize;
+  targetMapMask = pt->targetMapMask;
+  invMap = pt->invMap;
+  xf = pt->xf;
+
+  rowKind = NULL;
+  rowX = NULL;
+  rowY = NULL;
+  if (pt->scanMap != NULL)
+    {
+      rowKind = (unsigned char *) malloc(pMaxX - pMinX + 1);
+      rowX = (float *) malloc((pMaxX - pMinX + 1) * sizeof(float));
+      rowY = (float *) malloc((pMaxX - pMinX + 1) * sizeof(float));
+      if (rowKind == NULL || rowX == NULL || rowY == NULL)
+	Error("Could not allocate scan-conversion rows\n");
+    }
+
+  testX = (pMinX + pMaxX) / 2;
+  testY = (pMinY + pMaxY) / 2;
+  for (y = pt->y0; y <= pt->y1; ++y)
+    {
+      if (rowKind != NULL)
+	ScanRow(pt, y, rowKind, rowX, rowY);
+      for (x = pMinX; x <= pMaxX; ++x)
+	{
+	  //	if (y == testY && x == testX)
+	  //	  printf("TEST STARTED\n");
+	  if (rowKind != NULL && rowKind[x - pMinX] != QUAD_INVERT)
+	    {
+	      if (rowKind[x - pMinX] == QUAD_EMPTY)
+		continue;
+	      xv = rowX[x - pMinX];
+	      yv = rowY[x - pMinX];
+	    }
+	  else if (!Invert(invMap, &xv, &yv, (x + 0.5) / mFactor, (y + 0.5) / mFactor))
+	    {
+	      //	    if (y == testY && x == testX)
+	      //	      printf("TEST INVERT FAILED %f %f %f %f\n", (x + 0.5)/mFactor,
+	      //		     (y+0.5)/mFactor, xv, yv);
+	      continue;
+	    }
+	  xv = (xv + mxMin) * mFactor - 0.5;
+	  yv = (yv + myMin) * mFactor - 0.5;
+	  mxv = xv;
+	  myv = yv;
+	  if (xf != NULL)
+	    {
+	      /* the map is of the transformed image; the source pixels
+		 are taken straight from the untransformed one */
+	      xv = xf[0][0] * (mxv + 0.5) + xf[0][1] * (myv + 0.5) +
+		xf[0][2] - 0.5;
+	      yv = xf[1][0] * (mxv + 0.5) + xf[1][1] * (myv + 0.5) +
+		xf[1][2] - 0.5;
+	    }
+	  //	if (y == testY && x == testX)
+	  //	  printf("TEST INVERT OK %f %f %f %f\n", (x + 0.5)/mFactor,
+	  //		 (y+0.5)/mFactor, xv, yv);
+	  if (sampleFactor > 1)
+	    {
+	      /* the image, mask, and dist arrays are reduced copies */
+	      sxv = (xv + 0.5) / sampleFactor - 0.5;
+	      syv = (yv + 0.5) / sampleFactor - 0.5;
+	    }
+	  else
+	    {
+	      sxv = xv;
+	      syv = yv;
+	    }
+	  ixv = (int) floor(sxv);
+	  iyv = (int) floor(syv);
+	  if (ixv < -1 || ixv >= iw ||
+	      iyv < -1 || iyv >= ih)
+	    continue;
+	  rrx = sxv - ixv;
+	  rry = syv - iyv;
+	  if (ixv >= 0 && iyv >= 0 &&
+	      !(mask[iyv * mbpl + (ixv >> 3)] & (0x80 >> (ixv & 7))))
+	    {
+	      r00 = image[iyv * iw + ixv];
+	      d00 = dist[iyv * iw + ixv];
+	      if (targetMap != NULL && ((ixv | iyv) & targetMapMask) == 0)
+		{
+		  tmi = (iyv >> targetMapsLevel) * targetMapWidth +
+		    (ixv >> targetMapsLevel);
+		  if (tmi >= targetMapSize)
+		    Error("tmi out-of-bounds: %d %d\n%d %d\n",
+			  tmi, targetMapSize,
+			  targetMapWidth, targetMapHeight);
+		  SetTarget(pt, tmi, x, y);
+		}
+	    }
+	  else
+	    {
+	      r00 = 0.0;
+	      d00 = 0.0;
+	    }
+	  if (ixv >= 0 && iyv+1 < ih &&
+	      !(mask[(iyv + 1) * mbpl + (ixv >> 3)] & (0x80 >> (ixv & 7))))
+	    {
+	      r01 = image[(iyv + 1) * iw + ixv];
+	      d01 = dist[(iyv + 1) * iw + ixv];
+	      if (targetMap != NULL && ((ixv | (iyv+1)) & targetMapMask) == 0)
+		{
+		  tmi = ((iyv + 1) >> targetMapsLevel) * targetMapWidth +
+		    (ixv >> targetMapsLevel);
+		  if (tmi >= targetMapSize)
+		    Error("tmi out-of-bounds: %d %d\n%d %d\n",
+			  tmi, targetMapSize,
+			  targetMapWidth, targetMapHeight);
+		  SetTarget(pt, tmi, x, y);
+		}
+	    }
+	  else
+	    {
+	      r01 = 0.0;
+	      d01 = 0.0;
+	    }
+	  if (ixv+1 < iw && iyv >= 0 &&
+	      !(mask[iyv * mbpl + ((ixv+1) >> 3)] & (0x80 >> ((ixv+1) & 7))))
+	    {
+	      r10 = image[iyv * iw + ixv + 1];
+	      d10 = dist[iyv * iw + ixv + 1];
+	      if (targetMap != NULL && (((ixv + 1) | iyv) & targetMapMask) == 0)
+		{
+		  tmi = (iyv >> targetMapsLevel) * targetMapWidth +
+		    ((ixv + 1) >> targetMapsLevel);
+		  if (tmi >= targetMapSize)
+		    Error("tmi out-of-bounds: %d %d\n%d %d\n",
+			  tmi, targetMapSize,
+			  targetMapWidth, targetMapHeight);
+		  SetTarget(pt, tmi, x, y);
+		}
+	    }
+	  else
+	    {
+	      r10 = 0.0;
+	      d10 = 0.0;
+	    }
+	  if (ixv+1 < iw && iyv+1 < ih &&
+	      !(mask[(iyv+1) * mbpl + ((ixv+1) >> 3)] & (0x80 >> ((ixv+1) & 7))))
+	    {
+	      r11 = image[(iyv + 1) * iw + ixv + 1];
+	      d11 = dist[(iyv + 1) * iw + ixv + 1];
+	      if (targetMap != NULL && (((ixv + 1) | (iyv+1)) & targetMapMask) == 0)
+		{
+		  tmi = ((iyv + 1) >> targetMapsLevel) * targetMapWidth +
+		    ((ixv + 1) >> targetMapsLevel);
+		  if (tmi >= targetMapSize)
+		    Error("tmi out-of-bounds: %d %d\n%d %d\n",
+			  tmi, targetMapSize,
+			  targetMapWidth, targetMapHeight);
+		  SetTarget(pt, tmi, x, y);
+		}
+	    }
+	  else
+	    {
+	      r11 = 0.0;
+	      d11 = 0.0;
+	    }
+	  rv = r00 * (rrx - 1.0) * (rry - 1.0)
+	    - r10 * rrx * (rry - 1.0) 
+	    - r01 * (rrx - 1.0) * rry
+	    + r11 * rrx * rry;
+	  dv = d00 * (rrx - 1.0) * (rry - 1.0)
+	    - d10 * rrx * (rry - 1.0) 
+	    - d01 * (rrx - 1.0) * rry
+	    + d11 * rrx * rry;
+	  if (dv <= 0.0)
+	    continue;
+
+	  if (icells != NULL)
+	    {
+	      /* lookup mxv,myv in intensity map, if present; outside it,
+		 the levels are extrapolated from the nearest cell */
+	      xvi = (mxv + 0.5) / imapFactor;
+	      yvi = (myv + 0.5) / imapFactor;
+	      iixv = (int) floor(xvi);
+	      iiyv = (int) floor(yvi);
+	      rrx = xvi - iixv;
+	      rry = yvi - iiyv;
+	      if (iixv < 0)
+		{
+		  rrx += iixv;
+		  iixv = 0;
+		}
+	      else if (iixv > imapw-2)
+		{
+		  rrx += iixv - (imapw-2);
+		  iixv = imapw-2;
+		}
+	      if (iiyv < 0)
+		{
+		  rry += iiyv;
+		  iiyv = 0;
+		}
+	      else if (iiyv > imaph-2)
+		{
+		  rry += iiyv - (imaph-2);
+		  iiyv = imaph-2;
+		}
+	      ic = &icells[iiyv*(imapw-1)+iixv];
+	      rb = ic->b00 * (rrx - 1.0) * (rry - 1.0)
+		- ic->b10 * rrx * (rry - 1.0) 
+		- ic->b01 * (rrx - 1.0) * rry
+		+ ic->b11 * rrx * rry;
+	      rw = ic->w00 * (rrx - 1.0) * (rry - 1.0)
+		- ic->w10 * rrx * (rry - 1.0) 
+		- ic->w01 * (rrx - 1.0) * rry
+		+ ic->w11 * rrx * rry;
+	      if (rw <= rb)
+		{
+		  pthread_mutex_lock(&paintMutex);
+		  if (!*(pt->warned))
+		    {
+		      printf("Warning: rw level (%f) is less than rb level (%f) for image %s at (%d %d)\n",
+			     rw, rb, images[i].name, ixv, iyv);
+		      *(pt->warned) = 1;
+		    }
+		  pthread_mutex_unlock(&paintMutex);
+		  rw = 255.0;
+		  rb = 0.0;
+		}
+	      rv = (rv - rb) / (rw - rb);
+	    }
+
+	  if (dv < 64.0)
+	    w = 65535 - (int) floor(4.0 * dv);
+	  else
+	    w = (int) floor(hypotf(xv - cx, yv - cy));
+	  if (65535 - w > weight[(y - minY) * weightWidth + x - weightMinX])
+	    {
+	      weight[(y - minY) * weightWidth + x - weightMinX] = 65535 - w;
+	      if (icells != NULL)
+		v = (int) floor(255.0 * rv + 0.5);
+	      else
+		v = (int) floor(255.0 * (rv - blackValue) / range + 0.5);
+	      if (v <= 0)
+		{
+		  if (w == 65535)
+		    v = 0;
+		  else
+		    v = 1;
+		}
+	      else if (v > 255)
+		v = 255;
+	      canvas[(y - minY) * canvasWidth + x - canvasMinX] = v;
+	      canvasPainted[((y - canvasMinY) >> CANVAS_BLOCK_SHIFT) *
+			    paintedCols +
+			    ((x - renderMinX) >> CANVAS_BLOCK_SHIFT)] = 1;
+
+	      if (sourceMap != NULL &&
+		  (((x - oMinX) | (y - oMinY)) & sourceMapMask) == 0)
+		{
+		  smi = ((y - oMinY) >> sourceMapLevel) * sourceMapWidth +
+		    ((x - oMinX) >> sourceMapLevel);
+		  if (smi >= sourceMapSize)
+		    Error("smi out-of-bounds\n");
+		  sourceMap[smi].x = (float) ixv;
+		  sourceMap[smi].y = (float) iyv;
+		  sourceMap[smi].c = (float) i;
+		}
+	    }
+	}
+    }
+  if (rowKind != NULL)
+    {
+      free(rowKind);
+      free(rowX);
+      free(rowY);
+    }
+}
+
+void
+SetTarget (PaintThread *pt, int tmi, int x, int y)
+{
+  if (!pt->defer)
+    {
+      pt->targetMap[tmi].x = (float) x;
+      pt->targetMap[tmi].y = (float) y;
+      pt->targetMap[tmi].c = 1.0;
+      return;
+    }
+  if (pt->nTargets >= pt->maxTargets)
+    {
+      pt->maxTargets = (pt->maxTargets == 0) ? 1024 : 2 * pt->maxTargets;
+      pt->targets = (TargetWrite *) realloc(pt->targets,
+					    pt->maxTargets * sizeof(TargetWrite));
+      if (pt->targets == NULL)
+	Error("Could not allocate target map writes\n");
+    }
+  pt->targets[pt->nTargets].tmi = tmi;
+  pt->targets[pt->nTargets].x = (float) x;
+  pt->targets[pt->nTargets].y = (float) y;
+  ++pt->nTargets;
+}
+
+/* PaintGpu paints, for -gpu, the image of pt on the GPU one tile at a
+   time, merging each tile into the canvas and weight arrays as
+   PaintRows would have painted it.  Only images that are painted
+   entirely by scan-conversion, without intensity, target, or source
+   maps, are painted there; it returns 0 for the others, or if the GPU
+   can not be used, and then the caller paints the image itself. */
+int
+PaintGpu (PaintThread *pt)
+{
+  int i;
+  GpuSource s;
+  int tx, ty, tw, th;
+  int x, y;
+  unsigned short *ws, *nw;
+  unsigned char *nv;
+  size_t k;
+  char msg[PATH_MAX+256];
+
+  i = pt->i;
+  if (pt->scanMap == NULL || images[i].nInvertQuads > 0 ||
+      pt->icells != NULL || pt->targetMap != NULL || sourceMap != NULL)
+    return(0);
+  if (gpuReady == 0)
+    {
+      gpuReady = GpuInit(msg) ? 1 : -1;
+      if (gpuReady < 0)
+	fprintf(stderr, "Warning: painting on the CPU, as the GPU can not be used:\n  %s\n",
+		msg);
+    }
+  if (gpuReady < 0)
+    return(0);
+
+  s.scanMap = pt->scanMap;
+  s.scanW = pt->scanW;
+  s.scanH = pt->scanH;
+  s.scanFactor = pt->scanFactor;
+  s.quads = pt->quads;
+  s.mFactor = pt->mFactor;
+  s.mxMin = pt->mxMin;
+  s.myMin = pt->myMin;
+  s.image = pt->image;
+  s.mask = pt->mask;
+  s.dist = pt->dist;
+  s.iw = pt->iw;
+  s.ih = pt->ih;
+  s.mbpl = pt->mbpl;
+  s.sampleFactor = sampleFactor;
+  s.xf = pt->xf;
+  s.cx = pt->cx;
+  s.cy = pt->cy;
+  s.blackValue = blackValue;
+  s.range = range;
+  if (!GpuLoadSource(&s, msg))
+    {
+      fprintf(stderr, "Warning: painting %s on the CPU:\n  %s\n",
+	      images[i].name, msg);
+      return(0);
+    }
+
+  for (ty = pt->pMinY; ty <= pt->pMaxY; ty += GPU_TILE)
+    {
+      th = pt->pMaxY - ty + 1;
+      if (th > GPU_TILE)
+	th = GPU_TILE;
+      for (tx = pt->pMinX; tx <= pt->pMaxX; tx += GPU_TILE)
+	{
+	  tw = pt->pMaxX - tx + 1;
+	  if (tw > GPU_TILE)
+	    tw = GPU_TILE;
+	  ws = &weight[(ty - pt->minY) * weightWidth + tx - weightMinX];
+	  if (!GpuRenderTile(tx, ty, tw, th, ws, weightWidth, &nw, &nv, msg))
+	    {
+	      /* the tiles already merged are painted over by the
+		 same weight rule */
+	      fprintf(stderr, "Warning: painting %s on the CPU:\n  %s\n",
+		      images[i].name, msg);
+	      return(0);
+	    }
+	  for (y = ty; y < ty + th; ++y)
+	    for (x = tx; x < tx + tw; ++x)
 	      {
-		iy = (int) floor(y / maskScale + 0.001);
-		for (x = 0; x < images[i].width; ++x)
-		  {
-		    ix = (int) floor(x / maskScale + 0.001);
-		    if (imask[iy*imbpl + (ix >> 3)] & (0x80 >> (ix & 7)))
-		      mask[y*mbpl + (x >> 3)] |= 0x80 >> (x & 7);
-		  }
+		k = (size_t) (y - ty) * tw + x - tx;
+		if (nw[k] <= ws[(y - ty) * weightWidth + x - tx])
+		  continue;
+		ws[(y - ty) * weightWidth + x - tx] = nw[k];
+		canvas[(y - pt->minY) * canvasWidth + x - canvasMinX] = nv[k];
+		canvasPainted[((y - canvasMinY) >> CANVAS_BLOCK_SHIFT) *
+			      paintedCols +
+			      ((x - renderMinX) >> CANVAS_BLOCK_SHIFT)] = 1;
 	      }
-	    free(images[i].mask);
-	    images[i].mask = mask;
+	}
+    }
+  return(1);
+}
+
+/* BuildScanMap makes, for -forward, the scan map of image i: its map
+   refined so that the quads are at most SCAN_CELL output pixels on a
+   side, with the elements placed by bilinear interpolation as Invert
+   would place them, so that the triangles the quads are split into
+   follow the map closely.  It also finds which quads can be
+   scan-converted: those whose corners are all defined and that are
+   convex and turned the same way as the map as a whole.  The others
+   (folded or degenerate) are painted by inverting the map at each
+   pixel of their bounding boxes, as without -forward. */
+void
+BuildScanMap (int i)
+{
+  MapElement *map, *scanMap;
+  MapElement *m00, *m01, *m10, *m11;
+  int mw, mh;
+  int sw, sh;
+  int sf;
+  int x, y;
+  int mx, my;
+  int nValid;
+  double u, v;
+  double area, total;
+  double a[4];
+  float mFactor;
+  float minY, maxY;
+  int k;
+  unsigned char *quads;
+  int *quadRows;
+
+  map = images[i].map;
+  mw = images[i].mw;
+  mh = images[i].mh;
+  mFactor = (1 << images[i].mLevel) * mapScale;
+  sf = (int) ceil(mFactor / SCAN_CELL);
+  if (sf < 1)
+    sf = 1;
+  sw = (mw - 1) * sf + 1;
+  sh = (mh - 1) * sf + 1;
+  if (mw < 2 || mh < 2)
+    sw = sh = 1;
+  scanMap = (MapElement *) malloc((size_t) sw * sh * sizeof(MapElement));
+  quads = (unsigned char *) malloc((size_t) sw * sh * sizeof(unsigned char));
+  quadRows = (int *) malloc(2 * sh * sizeof(int));
+  if (scanMap == NULL || quads == NULL || quadRows == NULL)
+    Error("Could not allocate scan map of image %s\n", images[i].name);
+  memset(quads, QUAD_EMPTY, (size_t) sw * sh * sizeof(unsigned char));
+
+  /* the elements on the edge of a map quad depend only on the
+     corners at the ends of that edge, so the quads sharing it agree
+     on them */
+  for (y = 0; y < sh; ++y)
+    for (x = 0; x < sw; ++x)
+      {
+	mx = x / sf;
+	my = y / sf;
+	if (mx > mw - 2)
+	  mx = mw - 2;
+	if (my > mh - 2)
+	  my = mh - 2;
+	if (mx < 0 || my < 0)
+	  {
+	    scanMap[y*sw+x] = map[0];
+	    continue;
 	  }
-	
-	mask = images[i].mask;
-	for (j = 0; j < maskBytes; ++j)
-	  mask[j] ^= 0xff;
-	imageMem += maskBytes;
+	u = (x - mx * sf) / (double) sf;
+	v = (y - my * sf) / (double) sf;
+	m00 = &map[my*mw+mx];
+	m10 = m00 + 1;
+	m01 = m00 + mw;
+	m11 = m01 + 1;
+	scanMap[y*sw+x].x = (1.0 - u) * (1.0 - v) * m00->x +
+	  u * (1.0 - v) * m10->x + (1.0 - u) * v * m01->x + u * v * m11->x;
+	scanMap[y*sw+x].y = (1.0 - u) * (1.0 - v) * m00->y +
+	  u * (1.0 - v) * m10->y + (1.0 - u) * v * m01->y + u * v * m11->y;
+	scanMap[y*sw+x].c = 1.0;
       }
-    else
+
+  /* the orientation of the map as a whole */
+  total = 0.0;
+  for (y = 0; y < mh - 1; ++y)
+    for (x = 0; x < mw - 1; ++x)
       {
-	maskBytes = ((images[i].width + 7) / 8) * images[i].height;
-	//	printf("malloc %zu bytes for mask\n", maskBytes);
-	mask = images[i].mask = (unsigned char *) malloc(maskBytes);
- 	if (mask == 0)
- 	  Error("malloc of mask failed; errno = %d\n", errno);
-	memset(images[i].mask, 0, maskBytes);
-	imageMem += maskBytes;
+	m00 = &map[y*mw+x];
+	m10 = m00 + 1;
+	m01 = m00 + mw;
+	m11 = m01 + 1;
+	if (m00->c == 0.0 || m10->c == 0.0 ||
+	    m01->c == 0.0 || m11->c == 0.0)
+	  continue;
+	total += (m11->x - m00->x) * (m01->y - m10->y) -
+	  (m11->y - m00->y) * (m01->x - m10->x);
       }
-		
-  /* read in intensity map if necessary */
-  if (images[i].imap == NULL)
-    if (imapsName[0] != '\0')
+
+  images[i].nInvertQuads = 0;
+  for (y = 0; y < sh - 1; ++y)
+    {
+      minY = 1.0e30;
+      maxY = -1.0e30;
+      nValid = 0;
+      for (x = 0; x < sw - 1; ++x)
+	{
+	  m00 = &map[(y / sf) * mw + x / sf];
+	  if (m00->c == 0.0 || (m00+1)->c == 0.0 ||
+	      (m00+mw)->c == 0.0 || (m00+mw+1)->c == 0.0)
+	    continue;
+	  m00 = &scanMap[y*sw+x];
+	  m10 = m00 + 1;
+	  m01 = m00 + sw;
+	  m11 = m01 + 1;
+	  ++nValid;
+	  minY = fminf(minY, fminf(fminf(m00->y, m10->y),
+				   fminf(m01->y, m11->y)));
+	  maxY = fmaxf(maxY, fmaxf(fmaxf(m00->y, m10->y),
+				   fmaxf(m01->y, m11->y)));
+
+	  /* the turn at each corner; a convex quad turns the same
+	     way at all four */
+	  a[0] = (m10->x - m00->x) * (m01->y - m00->y) -
+	    (m10->y - m00->y) * (m01->x - m00->x);
+	  a[1] = (m11->x - m10->x) * (m00->y - m10->y) -
+	    (m11->y - m10->y) * (m00->x - m10->x);
+	  a[2] = (m01->x - m11->x) * (m10->y - m11->y) -
+	    (m01->y - m11->y) * (m10->x - m11->x);
+	  a[3] = (m00->x - m01->x) * (m11->y - m01->y) -
+	    (m00->y - m01->y) * (m11->x - m01->x);
+	  quads[y*sw+x] = QUAD_FORWARD;
+	  for (k = 0; k < 4; ++k)
+	    {
+	      area = total > 0.0 ? a[k] : -a[k];
+	      if (!(area > 1.0e-6 / (sf * sf)))
+		quads[y*sw+x] = QUAD_INVERT;
+	    }
+	  if (quads[y*sw+x] == QUAD_INVERT)
+	    ++images[i].nInvertQuads;
+	}
+      if (nValid == 0)
+	{
+	  quadRows[2*y] = 1;
+	  quadRows[2*y+1] = 0;
+	}
+      else
+	{
+	  /* with a row to spare on each side for rounding */
+	  quadRows[2*y] = (int) floor(minY * mFactor - 0.5);
+	  quadRows[2*y+1] = (int) ceil(maxY * mFactor - 0.5);
+	}
+    }
+  quadRows[2*(sh-1)] = 1;
+  quadRows[2*(sh-1)+1] = 0;
+  images[i].scanMap = scanMap;
+  images[i].scanW = sw;
+  images[i].scanH = sh;
+  images[i].scanFactor = sf;
+  images[i].quads = quads;
+  images[i].quadRows = quadRows;
+}
+
+/* ScanRow finds the source point (in map coordinates) of each pixel
+   pMinX..pMaxX of output row y, by scan-converting the two triangles
+   (00,10,11) and (00,11,01) of each quad of the scan map that reaches
+   the row.  kind is set to QUAD_EMPTY where no quad covers the pixel and
+   to QUAD_INVERT where the pixel must be found with Invert. */
+void
+ScanRow (PaintThread *pt, int y, unsigned char *kind,
+	 float *sx, float *sy)
+{
+  MapElement *map;
+  MapElement *m00, *m01, *m10, *m11;
+  int mw, mh;
+  int mx, my;
+  int x, x0, x1;
+  float mFactor;
+  float ty;
+  float minX, maxX, minY, maxY;
+  float sf;
+
+  map = pt->scanMap;
+  mw = pt->scanW;
+  mh = pt->scanH;
+  sf = pt->scanFactor;
+  mFactor = pt->mFactor;
+  ty = (y + 0.5) / mFactor;
+  memset(kind, QUAD_EMPTY, pt->pMaxX - pt->pMinX + 1);
+
+  /* the bounding boxes of the quads that can not be scan-converted
+     go to Invert, whichever quads they overlap */
+  for (my = 0; my < mh - 1; ++my)
+    {
+      if (y < pt->quadRows[2*my] || y > pt->quadRows[2*my+1])
+	continue;
+      for (mx = 0; mx < mw - 1; ++mx)
+	{
+	  if (pt->quads[my*mw+mx] != QUAD_INVERT)
+	    continue;
+	  m00 = &map[my*mw+mx];
+	  m10 = m00 + 1;
+	  m01 = m00 + mw;
+	  m11 = m01 + 1;
+	  minY = fminf(fminf(m00->y, m10->y), fminf(m01->y, m11->y));
+	  maxY = fmaxf(fmaxf(m00->y, m10->y), fmaxf(m01->y, m11->y));
+	  if (ty < minY || ty > maxY)
+	    continue;
+	  minX = fminf(fminf(m00->x, m10->x), fminf(m01->x, m11->x));
+	  maxX = fmaxf(fmaxf(m00->x, m10->x), fmaxf(m01->x, m11->x));
+	  x0 = (int) ceil(minX * mFactor - 0.5);
+	  x1 = (int) floor(maxX * mFactor - 0.5);
+	  if (x0 < pt->pMinX)
+	    x0 = pt->pMinX;
+	  if (x1 > pt->pMaxX)
+	    x1 = pt->pMaxX;
+	  for (x = x0; x <= x1; ++x)
+	    kind[x - pt->pMinX] = QUAD_INVERT;
+	}
+    }
+
+  for (my = 0; my < mh - 1; ++my)
+    {
+      if (y < pt->quadRows[2*my] || y > pt->quadRows[2*my+1])
+	continue;
+      for (mx = 0; mx < mw - 1; ++mx)
+	{
+	  if (pt->quads[my*mw+mx] != QUAD_FORWARD)
+	    continue;
+	  m00 = &map[my*mw+mx];
+	  m10 = m00 + 1;
+	  m01 = m00 + mw;
+	  m11 = m01 + 1;
+	  ScanTriangle(pt, ty, m00, m10, m11,
+		       mx / sf, my / sf, (mx + 1) / sf, my / sf,
+		       (mx + 1) / sf, (my + 1) / sf,
+		       kind, sx, sy);
+	  ScanTriangle(pt, ty, m00, m11, m01,
+		       mx / sf, my / sf, (mx + 1) / sf, (my + 1) / sf,
+		       mx / sf, (my + 1) / sf,
+		       kind, sx, sy);
+	}
+    }
+}
+
+/* ScanTriangle paints into sx,sy the source points of the pixels of
+   the row at ty whose centers lie in the triangle t0,t1,t2 (in output
+   coordinates over mFactor), whose corners come from the source points
+   s0,s1,s2.  A pixel is in the triangle if its center is on or right of
+   the left edge and left of the right edge, and rows at ty on or below
+   the top and above the bottom, so that the triangles sharing an edge
+   never both take a pixel on it.  The source point is interpolated
+   incrementally in barycentric coordinates along the span. */
+void
+ScanTriangle (PaintThread *pt, float ty, MapElement *t0, MapElement *t1,
+	      MapElement *t2, float s0x, float s0y, float s1x, float s1y,
+	      float s2x, float s2y, unsigned char *kind,
+	      float *sx, float *sy)
+{
+  MapElement *e[3][2];
+  MapElement *a, *b;
+  double xs[2];
+  int n;
+  int k;
+  int x, x0, x1;
+  double det;
+  double e1x, e1y, e2x, e2y;
+  double dx, dy;
+  double b1, b2, db1, db2;
+  float mFactor;
+
+  e[0][0] = t0;
+  e[0][1] = t1;
+  e[1][0] = t1;
+  e[1][1] = t2;
+  e[2][0] = t2;
+  e[2][1] = t0;
+  n = 0;
+  for (k = 0; k < 3; ++k)
+    {
+      /* the ends are ordered so that an edge shared with another
+	 triangle gives the same crossing in both; a row crosses
+	 either none of the edges or two of them */
+      a = e[k][0];
+      b = e[k][1];
+      if (a->y > b->y)
+	{
+	  a = e[k][1];
+	  b = e[k][0];
+	}
+      if (ty < a->y || ty >= b->y)
+	continue;
+      xs[n++] = a->x + (ty - a->y) * (b->x - a->x) / (b->y - a->y);
+    }
+  if (n != 2)
+    return;
+  if (xs[0] > xs[1])
+    {
+      dx = xs[0];
+      xs[0] = xs[1];
+      xs[1] = dx;
+    }
+  mFactor = pt->mFactor;
+  x0 = (int) ceil(xs[0] * mFactor - 0.5);
+  x1 = (int) ceil(xs[1] * mFactor - 0.5) - 1;
+  if (x0 < pt->pMinX)
+    x0 = pt->pMinX;
+  if (x1 > pt->pMaxX)
+    x1 = pt->pMaxX;
+  if (x0 > x1)
+    return;
+
+  e1x = t1->x - t0->x;
+  e1y = t1->y - t0->y;
+  e2x = t2->x - t0->x;
+  e2y = t2->y - t0->y;
+  det = e1x * e2y - e1y * e2x;
+  dx = (x0 + 0.5) / mFactor - t0->x;
+  dy = ty - t0->y;
+  b1 = (dx * e2y - dy * e2x) / det;
+  b2 = (e1x * dy - e1y * dx) / det;
+  db1 = e2y / (det * mFactor);
+  db2 = -e1y / (det * mFactor);
+  for (x = x0; x <= x1; ++x, b1 += db1, b2 += db2)
+    {
+      if (kind[x - pt->pMinX] == QUAD_INVERT)
+	continue;
+      kind[x - pt->pMinX] = QUAD_FORWARD;
+      sx[x - pt->pMinX] = s0x + b1 * (s1x - s0x) + b2 * (s2x - s0x);
+      sy[x - pt->pMinX] = s0y + b1 * (s1y - s0y) + b2 * (s2y - s0y);
+    }
+}
+
+/* WriteTiles writes out the tiles in rows startRow through endRow of
+   tile column col, which have been rendered into out; with writer
+   threads, out is handed to them and a fresh buffer is taken up the
+   next time anything is rendered */
+void
+WriteTiles (int col, int startRow, int endRow, char *iName)
+{
+  TileJob *job;
+  int i;
+
+  /* the coarser pyramid levels are summed up here, before out
+     is handed to the writers; the writers do level 0 */
+  if (pyramidLevels > 1)
+    for (i = startRow; i <= endRow; ++i)
+      AddToPyramid(1, i, col, &out[(i - startRow) * th * tw], NULL, iName);
+
+  if (nWriters == 0)
+    WriteTileColumn(out, tilePainted, col, startRow, endRow, iName);
+  else
+    {
+      pthread_mutex_lock(&tileMutex);
+      if (!writersStarted)
+	{
+	  writers = (pthread_t *) malloc(nWriters * sizeof(pthread_t));
+	  for (i = 0; i < nWriters; ++i)
+	    if (pthread_create(&writers[i], NULL, TileWriterMain, NULL) != 0)
+	      Error("pthread_create failed\n");
+	  writersStarted = 1;
+	}
+      job = (TileJob *) malloc(sizeof(TileJob));
+      if (job == NULL)
+	Error("Could not allocate tile job\n");
+      job->next = NULL;
+      job->buffer = out;
+      job->painted = (int *) malloc((endRow - startRow + 1) * sizeof(int));
+      if (job->painted == NULL)
+	Error("Could not allocate tile job\n");
+      memcpy(job->painted, tilePainted, (endRow - startRow + 1) * sizeof(int));
+      job->col = col;
+      job->startRow = startRow;
+      job->endRow = endRow;
+      strcpy(job->name, iName);
+      if (lastTileJob != NULL)
+	lastTileJob->next = job;
+      else
+	firstTileJob = job;
+      lastTileJob = job;
+      ++nWritesPending;
+      pthread_cond_broadcast(&tileCond);
+      pthread_mutex_unlock(&tileMutex);
+      out = NULL;
+    }
+  memset(tilePainted, 0, (endRow - startRow + 1) * sizeof(int));
+
+  for (i = startRow; i <= endRow; ++i)
+    {
+      if ((nProcessed % 50) == 0 && nProcessed != 0)
+	printf(" %d\n    ", nProcessed);
+      printf(".");
+      fflush(stdout);
+      ++nProcessed;
+    }
+}
+
+/* MapZeroed returns bytes of zeroed memory mapped from anonymous
+   memory, so that pages of it that are never written are never
+   allocated; a mostly-empty canvas thus costs only the blocks that
+   images paint into */
+void *
+MapZeroed (size_t bytes)
+{
+  void *p;
+
+  if (bytes == 0)
+    return(NULL);
+  p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    Error("Could not map %zu bytes of canvas; errno = %d\n", bytes, errno);
+  return(p);
+}
+
+void
+UnmapZeroed (void *p, size_t bytes)
+{
+  if (p != NULL)
+    munmap(p, bytes);
+}
+
+/* ResizeCanvas moves the columns from cx onwards of the canvas, whose
+   rows are oldWidth wide, to the left edge of a new canvas newWidth
+   wide; only rows holding painted pixels are copied */
+void
+ResizeCanvas (size_t oldWidth, int cx, size_t newWidth)
+{
+  unsigned char *newCanvas;
+  size_t n;
+  size_t x, y;
+
+  newCanvas = (unsigned char *) MapZeroed(newWidth * canvasHeight *
+					  sizeof(unsigned char));
+  n = oldWidth - cx;
+  if (n > newWidth)
+    n = newWidth;
+  if (canvas != NULL && n > 0)
+    for (y = 0; y < canvasHeight; ++y)
+      for (x = 0; x < n; ++x)
+	if (canvas[y*oldWidth + cx + x] != 0)
+	  {
+	    memcpy(&newCanvas[y*newWidth], &canvas[y*oldWidth + cx], n);
+	    break;
+	  }
+  UnmapZeroed(canvas, canvasSize);
+  canvas = newCanvas;
+  canvasSize = newWidth * canvasHeight * sizeof(unsigned char);
+}
+
+/* MarkPainted notes that pixels from (minX, minY) to (maxX, maxY) of
+   the current strip may have been painted; PaintRows marks the blocks
+   of the pixels it paints itself */
+void
+MarkPainted (int minX, int maxX, int minY, int maxY)
+{
+  int bx, by;
+  int bx0, bx1, by0, by1;
+
+  if (!PaintedBlocks(minX, maxX, minY, maxY, &bx0, &bx1, &by0, &by1))
+    return;
+  for (by = by0; by <= by1; ++by)
+    for (bx = bx0; bx <= bx1; ++bx)
+      canvasPainted[by * paintedCols + bx] = 1;
+}
+
+/* AreaPainted returns 1 if any pixel from (minX, minY) to (maxX, maxY)
+   of the current strip may have been painted, and 0 if all of them
+   are surely black */
+int
+AreaPainted (int minX, int maxX, int minY, int maxY)
+{
+  int bx, by;
+  int bx0, bx1, by0, by1;
+
+  if (!PaintedBlocks(minX, maxX, minY, maxY, &bx0, &bx1, &by0, &by1))
+    return(0);
+  for (by = by0; by <= by1; ++by)
+    for (bx = bx0; bx <= bx1; ++bx)
+      if (canvasPainted[by * paintedCols + bx])
+	return(1);
+  return(0);
+}
+
+/* PaintedBlocks finds the blocks of canvasPainted that the area
+   overlaps, returning 0 if it lies outside the strip */
+int
+PaintedBlocks (int minX, int maxX, int minY, int maxY,
+	       int *bx0, int *bx1, int *by0, int *by1)
+{
+  minX -= renderMinX;
+  maxX -= renderMinX;
+  minY -= canvasMinY;
+  maxY -= canvasMinY;
+  if (minX < 0)
+    minX = 0;
+  if (minY < 0)
+    minY = 0;
+  if (maxX < minX || maxY < minY)
+    return(0);
+  *bx0 = minX / CANVAS_BLOCK;
+  *bx1 = maxX / CANVAS_BLOCK;
+  *by0 = minY / CANVAS_BLOCK;
+  *by1 = maxY / CANVAS_BLOCK;
+  if (*bx1 >= paintedCols)
+    *bx1 = paintedCols - 1;
+  if (*by1 >= paintedRows)
+    *by1 = paintedRows - 1;
+  return(*bx0 <= *bx1 && *by0 <= *by1);
+}
+
+void
+WriteTileColumn (unsigned char *buffer, int *painted,
+		 int col, int startRow, int endRow, char *iName)
+{
+  int row;
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+
+  for (row = startRow; row <= endRow; ++row)
+    {
+      if (skipEmpty && !painted[row - startRow])
+	continue;
+      OutputFileName(fn, col, row, iName);
+      if (ImageOutputIsLocal() && !CreateDirectories(fn))
+	Error("Could not create directories for output file %s\n", fn);
+      if (!WriteTile(fn, &buffer[(row - startRow) * th * tw], msg))
+	Error("Could not write output file %s:\n  error: %s\n",
+	      fn, msg);
+      if (pyramidLevels > 0)
+	{
+	  PyramidFileName(fn, 0, row, col, iName);
+	  if (ImageOutputIsLocal() && !CreateDirectories(fn))
+	    Error("Could not create directories for pyramid tile %s\n", fn);
+	  if (!WriteImage(fn, &buffer[(row - startRow) * th * tw],
+			  (int) tw, (int) th, JpegQuality90, msg))
+	    Error("Could not write pyramid tile %s:\n  error: %s\n",
+		  fn, msg);
+	}
+    }
+}
+
+/* WriteTile writes one tw x th output tile in the -tile_format; JPEG
+   tiles use imio's JpegQuality modes, which step by 5 from
+   JpegQuality95 */
+int
+WriteTile (char *fn, unsigned char *pixels, char *msg)
+{
+  switch (tileFormat)
+    {
+    case TILE_JPEG:
+      return(WriteImage(fn, pixels, (int) tw, (int) th,
+			(enum ImageCompression) (JpegQuality95 +
+						 (95 - tileQuality) / 5),
+			msg));
+    case TILE_WEBP:
+      return(WriteWebpTile(fn, pixels, msg));
+    default:
+      return(WriteImage(fn, pixels, (int) tw, (int) th,
+			(enum ImageCompression) compress, msg));
+    }
+}
+
+/* WriteWebpTile encodes a tile as WebP, which has no grayscale mode,
+   so the gray values are repeated in each channel; a tileQuality of
+   -1 encodes it losslessly.  Like imio's writers, it stages the file
+   when there is an -output_command. */
+int
+WriteWebpTile (char *fn, unsigned char *pixels, char *msg)
+{
+#ifdef WEBP_TILES
+  unsigned char *rgb;
+  uint8_t *data;
+  size_t size;
+  size_t i, n;
+  FILE *f;
+  char staged[PATH_MAX];
+  int local;
+
+  n = tw * th;
+  rgb = (unsigned char *) malloc(3 * n);
+  if (rgb == NULL)
+    {
+      sprintf(msg, "Could not allocate WebP buffer\n");
+      return(0);
+    }
+  for (i = 0; i < n; ++i)
+    rgb[3*i] = rgb[3*i+1] = rgb[3*i+2] = pixels[i];
+  data = NULL;
+  if (tileQuality < 0)
+    size = WebPEncodeLosslessRGB(rgb, (int) tw, (int) th, 3 * (int) tw,
+				 &data);
+  else
+    size = WebPEncodeRGB(rgb, (int) tw, (int) th, 3 * (int) tw,
+			 (float) tileQuality, &data);
+  free(rgb);
+  if (size == 0)
+    {
+      sprintf(msg, "WebP encoding failed\n");
+      WebPFree(data);
+      return(0);
+    }
+
+  local = ImageOutputIsLocal();
+  if (!local && !StageOutputFile(fn, staged, msg))
+    {
+      WebPFree(data);
+      return(0);
+    }
+  f = fopen(local ? fn : staged, "wb");
+  if (f == NULL)
+    {
+      sprintf(msg, "Could not open file %s for writing\n", fn);
+      WebPFree(data);
+      if (!local)
+	unlink(staged);
+      return(0);
+    }
+  if (fwrite(data, 1, size, f) != size)
+    {
+      sprintf(msg, "Could not write file %s\n", fn);
+      fclose(f);
+      WebPFree(data);
+      if (!local)
+	unlink(staged);
+      return(0);
+    }
+  fclose(f);
+  WebPFree(data);
+  if (!local)
+    return(SendOutputFile(staged, fn, msg));
+  return(1);
+#else
+  sprintf(msg, "apply_map was built without WebP support\n");
+  return(0);
+#endif
+}
+
+/* WriteBand appends the first nRows rows of out to the untiled
+   output image, opening the image with the first band of the section;
+   with -volume, the rows go to the current slab instead */
+void
+WriteBand (int nRows, char *iName)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+
+  if (volume)
+    AppendVolumeRows(out, nRows);
+  else if (plane || serving)
+    {
+      memcpy(&planeLine[planeFilled], out, nRows * tw);
+      planeFilled += nRows * tw;
+    }
+  else
+    {
+      if (outWriter == NULL)
+	{
+	  OutputFileName(fn, 0, 0, iName);
+	  if (ImageOutputIsLocal() && !CreateDirectories(fn))
+	    Error("Could not create directories for output file %s\n", fn);
+	  outWriter = OpenPyramidImageWriter(fn, (int) tw, (int) th,
+					     reducedLevels,
+					     (enum ImageCompression) compress,
+					     msg);
+	  if (outWriter == NULL)
+	    Error("Could not open output file %s:\n  error: %s\n", fn, msg);
+	}
+      if (!WriteImageRows(outWriter, out, nRows, msg))
+	Error("Could not write output image:\n  error: %s\n", msg);
+    }
+  if ((nProcessed % 50) == 0 && nProcessed != 0)
+    printf(" %d\n    ", nProcessed);
+  printf(".");
+  fflush(stdout);
+  ++nProcessed;
+}
+
+/* StartSlab sets up the rendering of the slab of output images that
+   begins with image first, as the z slices of one layer of chunks of
+   the -volume output; the rendered rows are staged in a temporary
+   file laid out chunk by chunk, so that each chunk can be read back
+   whole when the slab is finished */
+void
+StartSlab (int first)
+{
+  size_t c;
+  int ncx;
+
+  c = volumeChunk;
+  ncx = (tw + c - 1) / c;
+  slabFirst = first;
+  volumeRowsHeld = 0;
+  volumeRow = 0;
+  if (volumeRows == NULL)
+    {
+      volumeRows = (unsigned char *) malloc(c * ncx * c);
+      volumeTile = (unsigned char *) malloc(c * c * c);
+      if (volumeRows == NULL || volumeTile == NULL)
+	Error("Could not allocate volume chunk buffers.\n");
+    }
+  slabFile = tmpfile();
+  if (slabFile == NULL)
+    Error("Could not create staging file for volume slab.\n");
+}
+
+/* AppendVolumeRows adds nRows rows of the output image being rendered
+   to the current chunk row, staging each full chunk row as it
+   completes */
+void
+AppendVolumeRows (unsigned char *rows, int nRows)
+{
+  size_t c;
+  size_t rowWidth;
+  int n;
+
+  c = volumeChunk;
+  rowWidth = ((tw + c - 1) / c) * c;
+  while (nRows > 0)
+    {
+      n = c - volumeRowsHeld;
+      if (n > nRows)
+	n = nRows;
+      for ( ; n > 0; --n, --nRows, ++volumeRowsHeld, rows += tw)
+	{
+	  memcpy(&volumeRows[volumeRowsHeld * rowWidth], rows, tw);
+	  memset(&volumeRows[volumeRowsHeld * rowWidth + tw], 0,
+		 rowWidth - tw);
+	}
+      if (volumeRowsHeld == c)
+	FlushVolumeRows();
+    }
+}
+
+/* FlushVolumeRows stages the rows held for the current chunk row,
+   padding a partial chunk row with black, as one z layer of each
+   chunk in the row */
+void
+FlushVolumeRows ()
+{
+  size_t c;
+  size_t rowWidth;
+  int ncx;
+  int cx;
+  int y;
+  off_t offset;
+
+  if (volumeRowsHeld == 0)
+    return;
+  c = volumeChunk;
+  ncx = (tw + c - 1) / c;
+  rowWidth = ncx * c;
+  if (volumeRowsHeld < c)
+    memset(&volumeRows[volumeRowsHeld * rowWidth], 0,
+	   (c - volumeRowsHeld) * rowWidth);
+  for (cx = 0; cx < ncx; ++cx)
+    {
+      for (y = 0; y < c; ++y)
+	memcpy(&volumeTile[y * c], &volumeRows[y * rowWidth + cx * c], c);
+      offset = ((((off_t) volumeRow) * ncx + cx) * volumeChunk +
+		(slabSection - slabFirst)) * c * c;
+      if (fseeko(slabFile, offset, SEEK_SET) != 0 ||
+	  fwrite(volumeTile, 1, c * c, slabFile) != c * c)
+	Error("Could not write volume slab staging file.\n");
+    }
+  volumeRowsHeld = 0;
+  ++volumeRow;
+}
+
+/* FinishSlab compresses and writes out each chunk of the slab of
+   nSections output images; a slab at the end of the stack is padded
+   with black */
+void
+FinishSlab (int nSections)
+{
+  char msg[PATH_MAX+256];
+  size_t c;
+  size_t n;
+  int ncx, ncy;
+  int cx, cy;
+
+  c = volumeChunk;
+  ncx = (tw + c - 1) / c;
+  ncy = (th + c - 1) / c;
+  for (cy = 0; cy < ncy; ++cy)
+    for (cx = 0; cx < ncx; ++cx)
       {
-	sprintf(fn, "%s%s.map", imapsName, images[i].name);
-	if (!ReadMap(fn, &(images[i].imap), &(images[i].imapLevel),
-		     &(images[i].imapw), &(images[i].imaph),
-		     &imapXMin, &imapYMin,
-		     imapName0, imapName1,
-		     msg))
-	  Error("Could not read map %s:\n  error: %s\n",
-		fn, msg);
-	if (imapXMin != 0 || imapYMin != 0)
-	  Error("Can not handle partial intensity map: %s\n", fn);
-	imap = images[i].imap;
-	imageMem += images[i].imapw * images[i].imaph * sizeof(MapElement);
+	memset(volumeTile, 0, c * c * c);
+	n = nSections * c * c;
+	if (fseeko(slabFile, (((off_t) cy) * ncx + cx) * c * c * c,
+		   SEEK_SET) != 0 ||
+	    fread(volumeTile, 1, n, slabFile) != n)
+	  Error("Could not read volume slab staging file.\n");
+	if (!WriteVolumeChunk(outputName, cx, cy, slabFirst / volumeChunk,
+			      volumeChunk, volumeTile, msg))
+	  Error("Could not write volume chunk:\n  error: %s\n", msg);
       }
-		
-  /* compute distance table if necessary */
-  if (images[i].dist == NULL)
+  fclose(slabFile);
+  slabFile = NULL;
+}
+
+void
+OutputFileName (char *fn, int col, int row, char *iName)
+{
+  if (overlay)
     {
-      iw = images[i].width;
-      ih = images[i].height;
-      //      printf("malloc %zu bytes for dist\n", iw * ih * sizeof(unsigned char));
-      images[i].dist = (unsigned char*) malloc(iw * ih * sizeof(unsigned char));
-      if (images[i].dist == 0)
- 	Error("malloc of images[i].dist failed; errno = %d\n", errno);
-      distance = (float*) malloc(iw * ih * sizeof(float));
-      if (distance == 0)
- 	Error("malloc of distance failed; errno = %d\n", errno);
-      computeDistance(EUCLIDEAN_DISTANCE,
-		      iw, ih, images[i].mask,
-		      distance);
-
-      /* if distance from edge is less, use that */
-      dist = images[i].dist;
-      for (y = 0; y < ih; ++y)
-	for (x = 0; x < iw; ++x)
+      if (tileWidth < 0 && tileHeight < 0)
+	sprintf(fn, "%s.tif", outputName);
+      else
+	sprintf(fn, "%sc%.2d%sr%.2d.%s", outputName, col+1,
+		tree ? "/" : "", row+1, tileExtensions[tileFormat]);
+    }
+  else
+    {
+      if (tileWidth < 0 && tileHeight < 0)
+	sprintf(fn, "%s%s.tif",
+		outputName, iName);
+      else
+	sprintf(fn, "%s%s/c%.2d%sr%.2d.%s",
+		outputName, iName,
+		col+1, tree ? "/" : "", row+1, tileExtensions[tileFormat]);
+    }
+}
+
+/* StartPyramid sets up the coarser pyramid levels for a task covering
+   tile columns startCol through endCol; the task columns are aligned
+   so that every coarse tile the task touches lies wholly within it */
+void
+StartPyramid (int startCol, int endCol)
+{
+  PyramidLevel *pl;
+  int lvl;
+  int n;
+  int row, col;
+  int nr, nc;
+
+  pyramid = (PyramidLevel *) malloc(pyramidLevels * sizeof(PyramidLevel));
+  if (pyramid == NULL)
+    Error("Could not allocate pyramid\n");
+  for (lvl = 0; lvl < pyramidLevels; ++lvl)
+    {
+      pl = &pyramid[lvl];
+      pl->nCols = (cols + (1 << lvl) - 1) >> lvl;
+      pl->nRows = (rows + (1 << lvl) - 1) >> lvl;
+      pl->minCol = startCol >> lvl;
+      pl->maxCol = endCol >> lvl;
+      pl->tiles = NULL;
+      pl->count = NULL;
+      if (lvl == 0)
+	continue;
+      n = pl->nRows * (pl->maxCol - pl->minCol + 1);
+      pl->tiles = (unsigned int **) malloc(n * sizeof(unsigned int *));
+      pl->count = (int *) malloc(n * sizeof(int));
+      if (pl->tiles == NULL || pl->count == NULL)
+	Error("Could not allocate pyramid level %d\n", lvl);
+      memset(pl->tiles, 0, n * sizeof(unsigned int *));
+      for (row = 0; row < pl->nRows; ++row)
+	for (col = pl->minCol; col <= pl->maxCol; ++col)
 	  {
-	    dst = distance[y*iw+x];
-	    d = x + 1;
-	    if (d < dst)
-	      dst = d;
-	    d = iw - x;
-	    if (d < dst)
-	      dst = d;
-	    d = y + 1;
-	    if (d < dst)
-	      dst = d;
-	    d = ih - y;
-	    if (d < dst)
-	      dst = d;
-	    idst = (int) floor(64.0 * dst);
-	    if (idst > 255)
-	      idst = 255;
-	    else if (idst < 0)
-	      idst = 0;
-	    dist[y*iw + x] = idst;
+	    /* the tiles along the right and bottom edges may have
+	       fewer than 4 finer tiles */
+	    nr = (2 * row + 1 < pyramid[lvl-1].nRows) ? 2 : 1;
+	    nc = (2 * col + 1 < pyramid[lvl-1].nCols) ? 2 : 1;
+	    pl->count[row * (pl->maxCol - pl->minCol + 1) +
+		      col - pl->minCol] = nr * nc;
 	  }
-      free(distance);
-      imageMem += iw * ih;
     }
+}
 
-  /* paint the image on the canvas */
-  pMinX = minX;
-  pMaxX = maxX;
-  pMinY = minY;
-  pMaxY = maxY;
-  if (images[i].minX > pMinX)
-    pMinX = images[i].minX;
-  if (images[i].maxX < pMaxX)
-    pMaxX = images[i].maxX;
-  if (images[i].minY > pMinY)
-    pMinY = images[i].minY;
-  if (images[i].maxY < pMaxY)
-    pMaxY = images[i].maxY;
+/* PyramidMemory estimates the memory needed for the coarse tiles in
+   progress while strips of nTileRows rows of tiles are rendered */
+size_t
+PyramidMemory (int nTileRows)
+{
+  size_t total;
+  int lvl;
+  int n;
+
+  total = 0;
+  for (lvl = 1; lvl < pyramidLevels; ++lvl)
+    {
+      n = (nTileRows >> lvl) + 2;
+      if (n > pyramid[lvl].nRows)
+	n = pyramid[lvl].nRows;
+      total += ((size_t) n) * (pyramid[lvl].maxCol - pyramid[lvl].minCol + 1) *
+	tw * th * sizeof(unsigned int);
+    }
+  return(total);
+}
+
+/* AddToPyramid adds the finished tile (row, col) of level lvl-1
+   (ucTile at level 0, or the pixel sums uiTile above that) into its
+   quadrant of a tile of level lvl, and writes out that tile once all
+   of its quadrants are in; as in gen_pyramid, each pixel of level lvl
+   is the rounded mean of the 4^lvl level 0 pixels it covers */
+void
+AddToPyramid (int lvl, int row, int col,
+	      unsigned char *ucTile, unsigned int *uiTile,
+	      char *iName)
+{
+  PyramidLevel *pl;
+  unsigned int *sTile;
+  unsigned char *tile;
+  int index;
+  int x, y;
+  int sdx, ddx;
+  int shift, offset;
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+
+  pl = &pyramid[lvl];
+  if ((col >> 1) < pl->minCol || (col >> 1) > pl->maxCol ||
+      (row >> 1) >= pl->nRows)
+    Error("Internal error: pyramid tile (%d, %d, %d) out of range\n",
+	  lvl, row >> 1, col >> 1);
+  index = (row >> 1) * (pl->maxCol - pl->minCol + 1) + (col >> 1) - pl->minCol;
+  sTile = pl->tiles[index];
+  if (sTile == NULL)
+    {
+      sTile = (unsigned int *) malloc(th * tw * sizeof(unsigned int));
+      if (sTile == NULL)
+	Error("Could not allocate pyramid tile\n");
+      memset(sTile, 0, th * tw * sizeof(unsigned int));
+      pl->tiles[index] = sTile;
+    }
+  for (y = 0; y < th; ++y)
+    {
+      sdx = y * tw;
+      ddx = (((row & 1) * th + y) >> 1) * tw + (((col & 1) * tw) >> 1);
+      if (ucTile != NULL)
+	for (x = 0; x < tw; ++x)
+	  sTile[(x >> 1) + ddx] += ucTile[sdx + x];
+      else
+	for (x = 0; x < tw; ++x)
+	  sTile[(x >> 1) + ddx] += uiTile[sdx + x];
+    }
+  if (--pl->count[index] > 0)
+    return;
+
+  // all quadrants are in, so write the tile and pass it on up
+  tile = (unsigned char *) malloc(th * tw * sizeof(unsigned char));
+  if (tile == NULL)
+    Error("Could not allocate pyramid tile\n");
+  shift = 2 * lvl;
+  offset = 1 << (shift - 1);
+  for (y = 0; y < th * tw; ++y)
+    tile[y] = (sTile[y] + offset) >> shift;
+  PyramidFileName(fn, lvl, row >> 1, col >> 1, iName);
+  if (ImageOutputIsLocal() && !CreateDirectories(fn))
+    Error("Could not create directories for pyramid tile %s\n", fn);
+  if (!WriteImage(fn, tile, (int) tw, (int) th, JpegQuality90, msg))
+    Error("Could not write pyramid tile %s:\n  error: %s\n", fn, msg);
+  free(tile);
+  if (lvl + 1 < pyramidLevels)
+    AddToPyramid(lvl + 1, row >> 1, col >> 1, NULL, sTile, iName);
+  free(sTile);
+  pl->tiles[index] = NULL;
+}
+
+/* FinishPyramid releases the pyramid levels of a task, all of whose
+   tiles should have been written by now */
+void
+FinishPyramid ()
+{
+  int lvl;
+  int n, i;
+
+  for (lvl = 1; lvl < pyramidLevels; ++lvl)
+    {
+      n = pyramid[lvl].nRows * (pyramid[lvl].maxCol - pyramid[lvl].minCol + 1);
+      for (i = 0; i < n; ++i)
+	if (pyramid[lvl].tiles[i] != NULL)
+	  Error("Internal error: pyramid level %d tile incomplete\n", lvl);
+      free(pyramid[lvl].tiles);
+      free(pyramid[lvl].count);
+    }
+  free(pyramid);
+  pyramid = NULL;
+}
+
+/* the pyramid is laid out as gen_pyramid does it:
+   <tile directory>/pyramid/<level>/<row>/<col>.jpg */
+void
+PyramidFileName (char *fn, int lvl, int row, int col, char *iName)
+{
+  if (overlay)
+    sprintf(fn, "%spyramid/%d/%d/%d.jpg", outputName, lvl, row, col);
+  else
+    sprintf(fn, "%s%s/pyramid/%d/%d/%d.jpg", outputName, iName,
+	    lvl, row, col);
+}
+
+void *
+TileWriterMain (void *arg)
+{
+  TileJob *job;
+
+  pthread_mutex_lock(&tileMutex);
+  for (;;)
+    {
+      while (firstTileJob == NULL && !writersShutdown)
+	pthread_cond_wait(&tileCond, &tileMutex);
+      if (firstTileJob == NULL)
+	break;
+      job = firstTileJob;
+      firstTileJob = job->next;
+      if (firstTileJob == NULL)
+	lastTileJob = NULL;
+      pthread_mutex_unlock(&tileMutex);
+
+      WriteTileColumn(job->buffer, job->painted,
+		      job->col, job->startRow, job->endRow, job->name);
+      ReleaseOutBuffer(job->buffer);
+      free(job->painted);
+      free(job);
+
+      pthread_mutex_lock(&tileMutex);
+      --nWritesPending;
+      pthread_cond_broadcast(&tileCond);
+    }
+  pthread_mutex_unlock(&tileMutex);
+  return(NULL);
+}
+
+/* FlushTiles waits until all tiles handed to the writers are written */
+void
+FlushTiles ()
+{
+  pthread_mutex_lock(&tileMutex);
+  while (nWritesPending > 0)
+    pthread_cond_wait(&tileCond, &tileMutex);
+  pthread_mutex_unlock(&tileMutex);
+}
+
+/* AcquireOutBuffer returns a zeroed out buffer of size bytes, waiting
+   for the writers to finish with one if maxOutBuffers are in use */
+unsigned char *
+AcquireOutBuffer (size_t size)
+{
+  unsigned char *buffer;
+
+  pthread_mutex_lock(&tileMutex);
+  while (nOutBuffers >= maxOutBuffers)
+    pthread_cond_wait(&tileCond, &tileMutex);
+  ++nOutBuffers;
+  pthread_mutex_unlock(&tileMutex);
+  buffer = (unsigned char *) malloc(size * sizeof(unsigned char));
+  if (buffer == 0)
+    Error("malloc of out failed; errno = %d\n", errno);
+  memset(buffer, 0, size * sizeof(unsigned char));
+  return(buffer);
+}
+
+void
+ReleaseOutBuffer (unsigned char *buffer)
+{
+  free(buffer);
+  pthread_mutex_lock(&tileMutex);
+  --nOutBuffers;
+  pthread_cond_broadcast(&tileCond);
+  pthread_mutex_unlock(&tileMutex);
+}
+
+void
+PackContext ()
+{
+  int i;
+
+  par_pkstr(imageListName);
+  par_pkstr(imagesName);
+  par_pkstr(extension);
+  par_pkstr(masksName);
+  par_pkstr(distanceCacheName);
+  par_pkstr(mipmapCacheName);
+  par_pkstr(fontFileName);
+  par_pkstr(mapsName);
+  par_pkint(nChain);
+  for (i = 0; i < nChain; ++i)
+    {
+      par_pkstr(chain[i].name);
+      par_pkint(chain[i].invert);
+    }
+  par_pkstr(imapsName);
+  par_pkstr(outputName);
+  par_pkstr(outputCommand);
+  par_pkstr(sourceMapName);
+  par_pkstr(targetMapsName);
+  par_pkstr(labelName);
+  par_pkint(overlay);
+  par_pkint(blend);
+  par_pkint(margin);
+  par_pkint(tileWidth);
+  par_pkint(tileHeight);
+  par_pkint(memoryLimit);
+  par_pkint(readAhead);
+  par_pkint(tree);
+  par_pkfloat(blackValue);
+  par_pkfloat(whiteValue);
+  par_pkfloat(range);
+  par_pkfloat(mapScale);
+  par_pkfloat(imapScale);
+  par_pkfloat(maskScale);
+  par_pkint(compress);
+  par_pkint(compressionLevel);
+  par_pkint(tileFormat);
+  par_pkint(tileQuality);
+  par_pkint(reductionFactor);
+  par_pkint(sampleFactor);
+  par_pkint(sourceMapLevel);
+  par_pkint(targetMapsLevel);
+  par_pkint(sourceMapFactor);
+  par_pkint(sourceMapMask);
+  par_pkint(targetMapsFactor);
+  par_pkint(update);
+  par_pkfloat(rotation);
+  par_pkfloat(rotationX);
+  par_pkfloat(rotationY);
+  par_pkfloat(cosRot);
+  par_pkfloat(sinRot);
+  par_pkint(nThreads);
+  par_pkint(nWriters);
+  par_pkint(inverseCache);
+  par_pkint(forwardRender);
+  par_pkint(gpuRender);
+  par_pkint(skipEmpty);
+  par_pkint(plane);
+  par_pkint(planOnly);
+  par_pkint(partialMaps);
+  par_pkint(pyramidLevels);
+  par_pkint(reducedLevels);
+  par_pkint(volume);
+  par_pkint(volumeChunk);
+  par_pkint(labelWidth);
+  par_pkint(labelHeight);
+  par_pkint(labelOffsetX);
+  par_pkint(labelOffsetY);
+  par_pkint(rows);
+  par_pkint(cols);
+  par_pkint(nOutputImages);
+  par_pklong((long) tw);
+  par_pklong((long) th);
+  par_pkint(oMinX);
+  par_pkint(oMinY);
+  par_pkint(oMaxX);
+  par_pkint(oMaxY);
+  par_pklong((long) oWidth);
+  par_pklong((long) oHeight);
+  par_pkint(nRegions);
+  if (nRegions > 0)
+    {
+      par_pkstr(regionsOutputName);
+      par_pkint(residentLimit);
+    }
+  for (i = 0; i < nRegions; ++i)
+    {
+      par_pkstr(regions[i].name);
+      par_pkint(regions[i].width);
+      par_pkint(regions[i].height);
+      par_pkint(regions[i].offsetX);
+      par_pkint(regions[i].offsetY);
+    }
+  /* the images table goes as one block, rather than field by field,
+     since it can hold many thousands of entries; the worker replaces
+     its pointers */
+  par_pkint(nImages);
+  par_pkblock(images, nImages * sizeof(Image));
+  for (i = 0; i < nImages; ++i)
+    par_pkstr(images[i].name);
+}
+
+void
+UnpackContext ()
+{
+  int i;
+  char name[PATH_MAX];
+  void *block;
+  int n;
+
+  par_upkstr(imageListName);
+  par_upkstr(imagesName);
+  par_upkstr(extension);
+  par_upkstr(masksName);
+  par_upkstr(distanceCacheName);
+  par_upkstr(mipmapCacheName);
+  par_upkstr(fontFileName);
+  par_upkstr(mapsName);
+  nChain = par_upkint();
+  if (nChain > 0)
+    {
+      chain = (ChainMap *) realloc(chain, nChain * sizeof(ChainMap));
+      if (chain == NULL)
+	Error("Could not allocate map chain\n");
+    }
+  for (i = 0; i < nChain; ++i)
+    {
+      par_upkstr(chain[i].name);
+      chain[i].invert = par_upkint();
+    }
+  par_upkstr(imapsName);
+  par_upkstr(outputName);
+  par_upkstr(outputCommand);
+  SetImageOutputCommand(outputCommand);
+  par_upkstr(sourceMapName);
+  par_upkstr(targetMapsName);
+  par_upkstr(labelName);
+  overlay = par_upkint();
+  blend = par_upkint();
+  margin = par_upkint();
+  tileWidth = par_upkint();
+  tileHeight = par_upkint();
+  memoryLimit = par_upkint();
+  readAhead = par_upkint();
+  tree = par_upkint();
+  blackValue = par_upkfloat();
+  whiteValue = par_upkfloat();
+  range = par_upkfloat();
+  mapScale = par_upkfloat();
+  imapScale = par_upkfloat();
+  maskScale = par_upkfloat();
+  compress = par_upkint();
+  compressionLevel = par_upkint();
+  SetImageCompressionLevel(compressionLevel);
+  tileFormat = par_upkint();
+  tileQuality = par_upkint();
+  reductionFactor = par_upkint();
+  sampleFactor = par_upkint();
+  sourceMapLevel = par_upkint();
+  targetMapsLevel = par_upkint();
+  sourceMapFactor = par_upkint();
+  sourceMapMask = par_upkint();
+  targetMapsFactor = par_upkint();
+  update = par_upkint();
+  rotation = par_upkfloat();
+  rotationX = par_upkfloat();
+  rotationY = par_upkfloat();
+  cosRot = par_upkfloat();
+  sinRot = par_upkfloat();
+  nThreads = par_upkint();
+  nWriters = par_upkint();
+  inverseCache = par_upkint();
+  forwardRender = par_upkint();
+  gpuRender = par_upkint();
+  skipEmpty = par_upkint();
+  plane = par_upkint();
+  planOnly = par_upkint();
+  partialMaps = par_upkint();
+  pyramidLevels = par_upkint();
+  reducedLevels = par_upkint();
+  volume = par_upkint();
+  volumeChunk = par_upkint();
+  labelWidth = par_upkint();
+  labelHeight = par_upkint();
+  labelOffsetX = par_upkint();
+  labelOffsetY = par_upkint();
+  rows = par_upkint();
+  cols = par_upkint();
+  nOutputImages = par_upkint();
+  tw = (size_t) par_upklong();
+  th = (size_t) par_upklong();
+  oMinX = par_upkint();
+  oMinY = par_upkint();
+  oMaxX = par_upkint();
+  oMaxY = par_upkint();
+  oWidth = (size_t) par_upklong();
+  oHeight = (size_t) par_upklong();
+  nRegions = par_upkint();
+  if (nRegions > 0)
+    {
+      par_upkstr(regionsOutputName);
+      residentLimit = par_upkint();
+      regions = (OutputRegion *) realloc(regions,
+					 nRegions * sizeof(OutputRegion));
+      if (regions == NULL)
+	Error("Could not allocate regions\n");
+    }
+  for (i = 0; i < nRegions; ++i)
+    {
+      par_upkstr(regions[i].name);
+      regions[i].width = par_upkint();
+      regions[i].height = par_upkint();
+      regions[i].offsetX = par_upkint();
+      regions[i].offsetY = par_upkint();
+    }
+
+  if (images != NULL)
+    {
+      for (i = 0; i < nImages; ++i)
+	free(images[i].name);
+      free(images);
+    }
+  FreeImageIndex();
+  nImages = par_upkint();
+  images = (Image *) malloc(nImages * sizeof(Image));
+  if (images == NULL)
+    Error("Could not allocate images table\n");
+  block = par_upkblock(&n);
+  if (n != nImages * sizeof(Image))
+    Error("Images table in context has %d bytes instead of %d\n",
+	  n, (int) (nImages * sizeof(Image)));
+  memcpy(images, block, n);
+  for (i = 0; i < nImages; ++i)
+    {
+      par_upkstr(name);
+      images[i].name = (char *) malloc(strlen(name) + 1);
+      strcpy(images[i].name, name);
+      images[i].image = NULL;
+      images[i].imageMapped = 0;
+      images[i].mask = NULL;
+      images[i].dist = NULL;
+      images[i].map = NULL;
+      images[i].mapAllocated = 0;
+      images[i].invMap = NULL;
+      images[i].scanMap = NULL;
+      images[i].quads = NULL;
+      images[i].quadRows = NULL;
+      images[i].icells = NULL;
+      images[i].targetMap = NULL;
+    }
+}
+
+void
+PackTask ()
+{
+  par_pkint(t.section);
+  par_pkint(t.nSections);
+  par_pkint(t.startCol);
+  par_pkint(t.endCol);
+}
+
+void
+UnpackTask ()
+{
+  t.section = par_upkint();
+  t.nSections = par_upkint();
+  t.startCol = par_upkint();
+  t.endCol = par_upkint();
+}
+
+void
+PackResult ()
+{
+  par_pkint(r.section);
+  par_pkint(r.startCol);
+  par_pkint(r.endCol);
+  if (plane)
+    par_pkbytearray(r.line, planeLength);
+  if (planOnly)
+    {
+      par_pkint(r.strips);
+      par_pkint(r.passes);
+      par_pkdouble(r.peak);
+    }
+}
+
+void
+UnpackResult ()
+{
+  r.section = par_upkint();
+  r.startCol = par_upkint();
+  r.endCol = par_upkint();
+  if (plane)
+    {
+      if (r.line == NULL)
+	r.line = (unsigned char *) malloc(planeLength);
+      if (r.line == NULL)
+	Error("Could not allocate plane line\n");
+      par_upkbytearray(r.line, planeLength);
+    }
+  if (planOnly)
+    {
+      r.strips = par_upkint();
+      r.passes = par_upkint();
+      r.peak = par_upkdouble();
+    }
+}
+
+void Error (char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fflush(stderr);
+  abort();
+}
+
+unsigned int
+Hash (char *s)
+{
+  unsigned int v = 0;
+  char *p = s;
+  while (*p != '\0')
+    v = 37 * v + *p++;
+  return(v);
+}
+
+/* OutputDeps sets depsName to the dependency sidecar of output image
+   oi (the overlay, if overlaying), params to the settings it depends
+   on, and inputs to the files it is rendered from, whose names are
+   kept in names ((6 + nChain) * PATH_MAX bytes per image); it returns the
+   number of inputs */
+int
+OutputDeps (int oi, char *depsName, char *params, char **inputs, char *names)
+{
+  int i, k;
+  int first, last;
+  int n;
+
+  if (!overlay)
+    sprintf(depsName, "%s%s.deps", outputName, images[oi].name);
+  else if (outputName[strlen(outputName)-1] == '/')
+    sprintf(depsName, "%sdeps", outputName);
+  else
+    sprintf(depsName, "%s.deps", outputName);
+
+  sprintf(params, "apply_map %d %d %d %d %d %d %d %d %d %d %d %d %d %d"
+	  " %d %d %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %d %d %d %d %d"
+	  " %d %d %d %d %d %d %d %d %d %d %d %d %s",
+	  overlay, blend, margin, tileWidth, tileHeight, tree, skipEmpty,
+	  compress, compressionLevel, reductionFactor, sampleFactor, mipmap,
+	  pyramidLevels, reducedLevels, targetMapsLevel, partialMaps,
+	  blackValue, whiteValue, mapScale, imapScale, maskScale,
+	  rotation, rotationX, rotationY, range,
+	  oMinX, oMinY, oMaxX, oMaxY, nImages,
+	  masksName[0] != '\0', imapsName[0] != '\0',
+	  targetMapsName[0] != '\0', labelWidth, labelHeight,
+	  labelOffsetX, labelOffsetY, (int) tw, (int) th, oi, forwardRender,
+	  gpuRender, labelName);
+  /* deps written before -tile_format existed stay current for TIFF
+     tiles */
+  if (tileFormat != TILE_TIFF)
+    sprintf(&params[strlen(params)], " %s %d",
+	    tileExtensions[tileFormat], tileQuality);
+
+  if (overlay)
+    {
+      first = 0;
+      last = nImages - 1;
+    }
+  else
+    first = last = oi;
+  n = 0;
+  for (i = first; i <= last; ++i)
+    {
+      sprintf(names, "%s%s", imagesName, images[i].name);
+      inputs[n++] = names;
+      names += PATH_MAX;
+      sprintf(names, "%s%s.map", mapsName, images[i].name);
+      inputs[n++] = names;
+      names += PATH_MAX;
+      names[0] = '\0';
+      if (masksName[0] != '\0')
+	sprintf(names, "%s%s", masksName, images[i].name);
+      inputs[n++] = names;
+      names += PATH_MAX;
+      names[0] = '\0';
+      if (imapsName[0] != '\0')
+	sprintf(names, "%s%s.map", imapsName, images[i].name);
+      inputs[n++] = names;
+      names += PATH_MAX;
+      names[0] = '\0';
+      if (targetMapsName[0] != '\0')
+	sprintf(names, "%s%s.map", targetMapsName, images[i].name);
+      inputs[n++] = names;
+      names += PATH_MAX;
+      names[0] = '\0';
+      if (preTransformsName[0] != '\0')
+	sprintf(names, "%s%s.xf", preTransformsName, images[i].name);
+      inputs[n++] = names;
+      names += PATH_MAX;
+      for (k = 0; k < nChain; ++k)
+	{
+	  sprintf(names, "%s%s.map", chain[k].name, images[i].name);
+	  inputs[n++] = names;
+	  names += PATH_MAX;
+	}
+    }
+  return(n);
+}
+
+/* MaskTime returns the modification time of the mask for image i
+   (0 if there is none) */
+time_t
+MaskTime (int i)
+{
+  static char *suffixes[3] = { "", ".pbm", ".pbm.gz" };
+  char fn[PATH_MAX];
+  struct stat sb;
+  time_t t;
+  int k;
+
+  t = 0;
+  if (masksName[0] == '\0')
+    return(t);
+  for (k = 0; k < 3; ++k)
+    {
+      sprintf(fn, "%s%s%s", masksName, images[i].name, suffixes[k]);
+      if (stat(fn, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_mtime > t)
+	t = sb.st_mtime;
+    }
+  return(t);
+}
+
+/* the distance cache holds, for each image, a gzipped header line
+   recording what the distances were computed from, followed by the
+   distance array itself */
+#define DISTANCE_HEADER	"D1 %d %d %ld %.9g\n"
+
+int
+ReadDistance (int i, time_t maskTime)
+{
+  char fn[PATH_MAX];
+  char header[256];
+  char msg[PATH_MAX+256];
+
+  sprintf(fn, "%s%s.dst.gz", distanceCacheName, images[i].name);
+  sprintf(header, DISTANCE_HEADER,
+	  images[i].sw, images[i].sh, (long) maskTime,
+	  (double) maskScale);
+  return(ReadCompressedArray(fn, header, images[i].dist,
+			     ((size_t) images[i].sw) * images[i].sh,
+			     msg));
+}
+
+void
+WriteDistance (int i, time_t maskTime)
+{
+  char fn[PATH_MAX];
+  char header[256];
+  char msg[PATH_MAX+256];
+
+  sprintf(fn, "%s%s.dst.gz", distanceCacheName, images[i].name);
+  sprintf(header, DISTANCE_HEADER,
+	  images[i].sw, images[i].sh, (long) maskTime,
+	  (double) maskScale);
+  if (!CreateDirectories(fn))
+    Error("Could not create directories for distance file %s\n", fn);
+  if (!WriteCompressedArray(fn, header, images[i].dist,
+			    ((size_t) images[i].sw) * images[i].sh,
+			    msg))
+    Error("Could not write distance file %s:\n  error: %s\n", fn, msg);
+}
+
+/* ReadPreTransform reads the transform of image i from
+   <pre_transforms><name>.xf, as written by transform -output_transform:
+   the six coefficients (by rows) of the 2x3 matrix taking a point of
+   the transformed image, on which the map of image i was computed, to
+   the corresponding point of the image itself */
+void
+ReadPreTransform (int i)
+{
+  FILE *f;
+  char fn[PATH_MAX];
+  struct stat sb;
+  double (*xf)[3];
+
+  sprintf(fn, "%s%s.xf", preTransformsName, images[i].name);
+  f = fopen(fn, "r");
+  if (f == NULL)
+    Error("Could not open pre-transform %s\n", fn);
+  xf = images[i].xf;
+  if (fscanf(f, "%lf%lf%lf%lf%lf%lf",
+	     &xf[0][0], &xf[0][1], &xf[0][2],
+	     &xf[1][0], &xf[1][1], &xf[1][2]) != 6)
+    Error("Malformed pre-transform %s\n", fn);
+  fclose(f);
+  images[i].transformed = 1;
+  if (stat(fn, &sb) == 0 && sb.st_mtime > images[i].mtime)
+    images[i].mtime = sb.st_mtime;
+}
+
+/* ReduceImage replaces the image array of image i by its
+   average over sampleFactor x sampleFactor blocks */
+void
+ReduceImage (int i)
+{
+  int x, y;
+  int dx, dy;
+  int iw, ih;
+  int sw, sh;
+  int sum, n;
+  unsigned char *image;
+  unsigned char *reduced;
 
-  mFactor = (1 << images[i].mLevel) * mapScale;
-  invMap = images[i].invMap;
+  iw = images[i].width;
+  ih = images[i].height;
+  sw = images[i].sw;
+  sh = images[i].sh;
   image = images[i].image;
-  mask = images[i].mask;
-  imap = images[i].imap;
-  if (imap != NULL)
-    {
-      imapFactor = (1 << images[i].imapLevel) * imapScale;
-      imapw = images[i].imapw;
-      imaph = images[i].imaph;
-    }
-  dist = images[i].dist;
+  reduced = (unsigned char *) malloc(((size_t) sw) * sh);
+  if (reduced == NULL)
+    Error("malloc of reduced image failed; errno = %d\n", errno);
+  for (y = 0; y < sh; ++y)
+    for (x = 0; x < sw; ++x)
+      {
+	sum = 0;
+	n = 0;
+	for (dy = 0; dy < sampleFactor && y * sampleFactor + dy < ih; ++dy)
+	  for (dx = 0; dx < sampleFactor && x * sampleFactor + dx < iw; ++dx)
+	    {
+	      sum += image[((size_t) (y * sampleFactor + dy)) * iw +
+			   x * sampleFactor + dx];
+	      ++n;
+	    }
+	reduced[((size_t) y) * sw + x] = (sum + n / 2) / n;
+      }
+  if (images[i].imageMapped)
+    ImageMunmap(image, iw, ih);
+  else
+    free(image);
+  images[i].image = reduced;
+  images[i].imageMapped = 0;
+}
+
+/* ReduceMask replaces the mask array of image i (in which set bits
+   mark masked pixels) by one with a pixel per sampleFactor x
+   sampleFactor block; a block is masked if any of its pixels are,
+   so that unmasked blocks average only unmasked image pixels */
+void
+ReduceMask (int i)
+{
+  int x, y;
+  int ix, iy;
+  int dx, dy;
+  int iw, ih;
+  int sw, sh;
+  size_t mbpl, smbpl;
+  unsigned char *mask;
+  unsigned char *reduced;
+  int masked;
+
   iw = images[i].width;
   ih = images[i].height;
-  mxMin = images[i].mxMin;
-  myMin = images[i].myMin;
-  //  printf("mxMin = %d myMin = %d\n", mxMin, myMin);
-  cx = (iw - 1) / 2.0;
-  cy = (ih - 1) / 2.0;
+  sw = images[i].sw;
+  sh = images[i].sh;
   mbpl = (iw + 7) / 8;
-  offset = -1000000.0;
-  printf("Rendering %s from x=%d to %d y=%d to %d\n",
-	 images[i].name, pMinX, pMaxX, pMinY, pMaxY);
-  testX = (pMinX + pMaxX) / 2;
-  testY = (pMinY + pMaxY) / 2;
-  warned = 0;
-  for (y = pMinY; y <= pMaxY; ++y)
-    for (x = pMinX; x <= pMaxX; ++x)
+  smbpl = (sw + 7) / 8;
+  mask = images[i].mask;
+  reduced = (unsigned char *) malloc(smbpl * sh);
+  if (reduced == NULL)
+    Error("malloc of reduced mask failed; errno = %d\n", errno);
+  memset(reduced, 0, smbpl * sh);
+  for (y = 0; y < sh; ++y)
+    for (x = 0; x < sw; ++x)
       {
-	//	if (y == testY && x == testX)
-	//	  printf("TEST STARTED\n");
-	if (!Invert(invMap, &xv, &yv, (x + 0.5) / mFactor, (y + 0.5) / mFactor))
-	  {
-	    //	    if (y == testY && x == testX)
-	    //	      printf("TEST INVERT FAILED %f %f %f %f\n", (x + 0.5)/mFactor,
-	    //		     (y+0.5)/mFactor, xv, yv);
-	    continue;
-	  }
-	xv = (xv + mxMin) * mFactor - 0.5;
-	yv = (yv + myMin) * mFactor - 0.5;
-	//	if (y == testY && x == testX)
-	//	  printf("TEST INVERT OK %f %f %f %f\n", (x + 0.5)/mFactor,
-	//		 (y+0.5)/mFactor, xv, yv);
-	ixv = (int) floor(xv);
-	iyv = (int) floor(yv);
-	if (ixv < -1 || ixv >= iw ||
-	    iyv < -1 || iyv >= ih)
-	  continue;
-	rrx = xv - ixv;
-	rry = yv - iyv;
-	if (ixv >= 0 && iyv >= 0 &&
-	    !(mask[iyv * mbpl + (ixv >> 3)] & (0x80 >> (ixv & 7))))
-	  {
-	    r00 = image[iyv * iw + ixv];
-	    d00 = dist[iyv * iw + ixv];
-	    if (targetMap != NULL && ((ixv | iyv) & targetMapMask) == 0)
-	      {
-		tmi = (iyv >> targetMapsLevel) * targetMapWidth +
-		  (ixv >> targetMapsLevel);
-		if (tmi >= targetMapSize)
-		  Error("tmi out-of-bounds: %d %d\n%d %d\n",
-			tmi, targetMapSize,
-			targetMapWidth, targetMapHeight);
-		targetMap[tmi].x = (float) x;
-		targetMap[tmi].y = (float) y;
-		targetMap[tmi].c = 1.0;
-	      }
-	  }
-	else
-	  {
-	    r00 = 0.0;
-	    d00 = 0.0;
-	  }
-	if (ixv >= 0 && iyv+1 < ih &&
-	    !(mask[(iyv + 1) * mbpl + (ixv >> 3)] & (0x80 >> (ixv & 7))))
-	  {
-	    r01 = image[(iyv + 1) * iw + ixv];
-	    d01 = dist[(iyv + 1) * iw + ixv];
-	    if (targetMap != NULL && ((ixv | (iyv+1)) & targetMapMask) == 0)
-	      {
-		tmi = ((iyv + 1) >> targetMapsLevel) * targetMapWidth +
-		  (ixv >> targetMapsLevel);
-		if (tmi >= targetMapSize)
-		  Error("tmi out-of-bounds: %d %d\n%d %d\n",
-			tmi, targetMapSize,
-			targetMapWidth, targetMapHeight);
-		targetMap[tmi].x = (float) x;
-		targetMap[tmi].y = (float) y;
-		targetMap[tmi].c = 1.0;
-	      }
-	  }
-	else
-	  {
-	    r01 = 0.0;
-	    d01 = 0.0;
-	  }
-	if (ixv+1 < iw && iyv >= 0 &&
-	    !(mask[iyv * mbpl + ((ixv+1) >> 3)] & (0x80 >> ((ixv+1) & 7))))
-	  {
-	    r10 = image[iyv * iw + ixv + 1];
-	    d10 = dist[iyv * iw + ixv + 1];
-	    if (targetMap != NULL && (((ixv + 1) | iyv) & targetMapMask) == 0)
-	      {
-		tmi = (iyv >> targetMapsLevel) * targetMapWidth +
-		  ((ixv + 1) >> targetMapsLevel);
-		if (tmi >= targetMapSize)
-		  Error("tmi out-of-bounds: %d %d\n%d %d\n",
-			tmi, targetMapSize,
-			targetMapWidth, targetMapHeight);
-		targetMap[tmi].x = (float) x;
-		targetMap[tmi].y = (float) y;
-		targetMap[tmi].c = 1.0;
-	      }
-	  }
-	else
-	  {
-	    r10 = 0.0;
-	    d10 = 0.0;
-	  }
-	if (ixv+1 < iw && iyv+1 < ih &&
-	    !(mask[(iyv+1) * mbpl + ((ixv+1) >> 3)] & (0x80 >> ((ixv+1) & 7))))
-	  {
-	    r11 = image[(iyv + 1) * iw + ixv + 1];
-	    d11 = dist[(iyv + 1) * iw + ixv + 1];
-	    if (targetMap != NULL && (((ixv + 1) | (iyv+1)) & targetMapMask) == 0)
+	masked = 0;
+	for (dy = 0; !masked && dy < sampleFactor &&
+	       (iy = y * sampleFactor + dy) < ih; ++dy)
+	  for (dx = 0; dx < sampleFactor &&
+		 (ix = x * sampleFactor + dx) < iw; ++dx)
+	    if (mask[iy * mbpl + (ix >> 3)] & (0x80 >> (ix & 7)))
 	      {
-		tmi = ((iyv + 1) >> targetMapsLevel) * targetMapWidth +
-		  ((ixv + 1) >> targetMapsLevel);
-		if (tmi >= targetMapSize)
-		  Error("tmi out-of-bounds: %d %d\n%d %d\n",
-			tmi, targetMapSize,
-			targetMapWidth, targetMapHeight);
-		targetMap[tmi].x = (float) x;
-		targetMap[tmi].y = (float) y;
-		targetMap[tmi].c = 1.0;
+		masked = 1;
+		break;
 	      }
-	  }
-	else
-	  {
-	    r11 = 0.0;
-	    d11 = 0.0;
-	  }
-	rv = r00 * (rrx - 1.0) * (rry - 1.0)
-	  - r10 * rrx * (rry - 1.0) 
-	  - r01 * (rrx - 1.0) * rry
-	  + r11 * rrx * rry;
-	dv = d00 * (rrx - 1.0) * (rry - 1.0)
-	  - d10 * rrx * (rry - 1.0) 
-	  - d01 * (rrx - 1.0) * rry
-	  + d11 * rrx * rry;
-	if (dv <= 0.0)
-	  continue;
+	if (masked)
+	  reduced[y * smbpl + (x >> 3)] |= 0x80 >> (x & 7);
+      }
+  free(mask);
+  images[i].mask = reduced;
+}
 
-	if (imap != NULL)
-	  {
-	    /* lookup xv,yv in intensity map, if present */
-	    xvi = (xv + 0.5) / imapFactor;
-	    yvi = (yv + 0.5) / imapFactor;
-	    iixv = (int) floor(xvi);
-	    iiyv = (int) floor(yvi);
-	    rrx = xvi - iixv;
-	    rry = yvi - iiyv;
-	    while (iixv < 0)
-	      {
-		++iixv;
-		rrx -= 1.0;
-	      }
-	    while (iixv >= imapw-1)
-	      {
-		--iixv;
-		rrx += 1.0;
-	      }
-	    while (iiyv < 0)
-	      {
-		++iiyv;
-		rry -= 1.0;
-	      }
-	    while (iiyv >= imaph-1)
-	      {
-		--iiyv;
-		rry += 1.0;
-	      }
-	    rb00 = imap[iiyv*imapw+iixv].x;
-	    rw00 = imap[iiyv*imapw+iixv].y;
-	    rb01 = imap[(iiyv+1)*imapw+iixv].x;
-	    rw01 = imap[(iiyv+1)*imapw+iixv].y;
-	    rb10 = imap[iiyv*imapw+iixv+1].x;
-	    rw10 = imap[iiyv*imapw+iixv+1].y;
-	    rb11 = imap[(iiyv+1)*imapw+iixv+1].x;
-	    rw11 = imap[(iiyv+1)*imapw+iixv+1].y;
-	    rb = rb00 * (rrx - 1.0) * (rry - 1.0)
-	      - rb10 * rrx * (rry - 1.0) 
-	      - rb01 * (rrx - 1.0) * rry
-	      + rb11 * rrx * rry;
-	    rw = rw00 * (rrx - 1.0) * (rry - 1.0)
-	      - rw10 * rrx * (rry - 1.0) 
-	      - rw01 * (rrx - 1.0) * rry
-	      + rw11 * rrx * rry;
-	    if (rw <= rb)
-	      {
-		if (!warned)
-		  {
-		    printf("Warning: rw level (%f) is less than rb level (%f) for image %s at (%d %d)\n",
-			   rw, rb, images[i].name, ixv, iyv);
-		    warned = 1;
-		  }
-		rw = 255.0;
-		rb = 0.0;
-	      }
-	    rv = (rv - rb) / (rw - rb);
-	  }
+/* the mipmap cache holds, for each image, a gzipped header line
+   followed by the reduced image array; the modification time recorded
+   is that of the image or its map, whichever is later */
+#define MIPMAP_HEADER	"M1 %d %d %d %ld\n"
 
-	if (dv < 64.0)
-	  w = 65535 - (int) floor(4.0 * dv);
-	else
-	  w = (int) floor(hypotf(xv - cx, yv - cy));
-	if (w < weight[(y - minY) * weightWidth + x - weightMinX])
-	  {
-	    weight[(y - minY) * weightWidth + x - weightMinX] = w;
-	    if (imap != NULL)
-	      v = (int) floor(255.0 * rv + 0.5);
-	    else
-	      v = (int) floor(255.0 * (rv - blackValue) / range + 0.5);
-	    if (v <= 0)
-	      {
-		if (w == 65535)
-		  v = 0;
-		else
-		  v = 1;
-	      }
-	    else if (v > 255)
-	      v = 255;
-	    canvas[(y - minY) * canvasWidth + x - canvasMinX] = v;
+int
+ReadMipmap (int i)
+{
+  char fn[PATH_MAX];
+  char header[256];
+  char msg[PATH_MAX+256];
+  size_t n;
 
-	    if (sourceMap != NULL &&
-		(((x - oMinX) | (y - oMinY)) & sourceMapMask) == 0)
-	      {
-		smi = ((y - oMinY) >> sourceMapLevel) * sourceMapWidth +
-		  ((x - oMinX) >> sourceMapLevel);
-		if (smi >= sourceMapSize)
-		  Error("smi out-of-bounds\n");
-		sourceMap[smi].x = (float) ixv;
-		sourceMap[smi].y = (float) iyv;
-		sourceMap[smi].c = (float) i;
-	      }
-	  }
-      }
+  sprintf(fn, "%s%s.r%d.gz", mipmapCacheName, images[i].name, sampleFactor);
+  sprintf(header, MIPMAP_HEADER,
+	  images[i].width, images[i].height, sampleFactor,
+	  (long) images[i].mtime);
+  n = ((size_t) images[i].sw) * images[i].sh;
+  images[i].image = (unsigned char *) malloc(n);
+  if (images[i].image == NULL)
+    Error("malloc of reduced image failed; errno = %d\n", errno);
+  if (ReadCompressedArray(fn, header, images[i].image, n, msg))
+    return(1);
+  free(images[i].image);
+  images[i].image = NULL;
+  return(0);
+}
 
-  /* free up if no longer required */
-  if (images[i].maxX <= maxX || maxX >= oMaxX)
+void
+WriteMipmap (int i)
+{
+  char fn[PATH_MAX];
+  char header[256];
+  char msg[PATH_MAX+256];
+
+  sprintf(fn, "%s%s.r%d.gz", mipmapCacheName, images[i].name, sampleFactor);
+  sprintf(header, MIPMAP_HEADER,
+	  images[i].width, images[i].height, sampleFactor,
+	  (long) images[i].mtime);
+  if (!CreateDirectories(fn))
+    Error("Could not create directories for mipmap file %s\n", fn);
+  if (!WriteCompressedArray(fn, header, images[i].image,
+			    ((size_t) images[i].sw) * images[i].sh,
+			    msg))
+    Error("Could not write mipmap file %s:\n  error: %s\n", fn, msg);
+}
+
+/* the -bounds_index file is a table of BoundsEntry's, one per line
+   and sorted by image name, following a header giving the parameters
+   that the bounds depend on; an entry is used for an image only if
+   its maps have not changed since it was written */
+#define BOUNDS_INDEX_HEADER	"B1 %.9g %.9g %.9g %.9g\n"
+
+void
+ReadBoundsIndex ()
+{
+  FILE *f;
+  char line[LINE_LENGTH+1];
+  char name[LINE_LENGTH+1];
+  float ms, rot, rotX, rotY;
+  int maxEntries;
+  BoundsEntry e;
+
+  imageBounds = (BoundsEntry *) malloc(nImages * sizeof(BoundsEntry));
+  if (imageBounds == NULL)
+    Error("malloc of imageBounds failed; errno = %d\n", errno);
+  memset(imageBounds, 0, nImages * sizeof(BoundsEntry));
+  nBoundsEntries = 0;
+  maxEntries = 0;
+  f = fopen(boundsIndexName, "r");
+  if (f == NULL)
+    return;
+  if (fgets(line, LINE_LENGTH, f) == NULL ||
+      sscanf(line, "B1 %f %f %f %f", &ms, &rot, &rotX, &rotY) != 4 ||
+      ms != mapScale || rot != rotation ||
+      rotX != rotationX || rotY != rotationY)
     {
-      if (images[i].targetMap != NULL)
-	{
-	  sprintf(fn, "%s%s.map", targetMapsName, images[i].name);
-	  if (!CreateDirectories(fn))
-	    Error("Could not create directories for target map file %s\n",
-		  fn);
-	  if (!WriteMap(fn, images[i].targetMap, targetMapsLevel,
-			targetMapWidth, targetMapHeight,
-			0, 0,
-			images[i].name, outputName,
-			UncompressedMap, msg))
-	    Error("Could not write target map %s:\n%s\n", fn, msg);
-	  //	  printf("freeing %zu bytes from targetMap\n",
-	  //		 targetMapHeight * targetMapWidth * sizeof(MapElement));
-	  free(images[i].targetMap);
-	  images[i].targetMap = NULL;
-	}
-      if (images[i].invMap != NULL)
-	{
-	  FreeInverseMap(images[i].invMap);
-	  images[i].invMap = NULL;
-	}
-      if (images[i].map != NULL)
+      /* made for other parameters, so it will be replaced */
+      fclose(f);
+      return;
+    }
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      if (sscanf(line, "%s %lld %lld %d %d %f %f %f %f %lld %lld %d %d",
+		 name, &e.mapMtime, &e.mapSize, &e.mw, &e.mh,
+		 &e.minX, &e.maxX, &e.minY, &e.maxY,
+		 &e.imapMtime, &e.imapSize, &e.imapw, &e.imaph) != 13)
+	continue;
+      if (nBoundsEntries >= maxEntries)
 	{
-	  free(images[i].map);
-	  images[i].map = NULL;
-	  imageMem -= images[i].mapBytes; // this accounts for the inverse
-	                                  // map and target map as well
+	  maxEntries = (maxEntries == 0) ? 1024 : 2 * maxEntries;
+	  boundsIndex = (BoundsEntry *) realloc(boundsIndex,
+						maxEntries * sizeof(BoundsEntry));
+	  if (boundsIndex == NULL)
+	    Error("realloc of boundsIndex failed; errno = %d\n", errno);
 	}
-      if (images[i].imap != NULL)
+      e.name = (char *) malloc(strlen(name) + 1);
+      if (e.name == NULL)
+	Error("malloc of bounds entry name failed; errno = %d\n", errno);
+      strcpy(e.name, name);
+      boundsIndex[nBoundsEntries++] = e;
+    }
+  fclose(f);
+  qsort(boundsIndex, nBoundsEntries, sizeof(BoundsEntry),
+	CompareBoundsEntries);
+}
+
+/* LookupBounds sets imageBounds[i] from the index and returns 1 if
+   the index has an entry for image i that is good for its map (whose
+   stat is mapSb) and intensity map as they are now */
+int
+LookupBounds (int i, struct stat *mapSb)
+{
+  BoundsEntry key;
+  BoundsEntry *e;
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  key.name = images[i].name;
+  e = (BoundsEntry *) bsearch(&key, boundsIndex, nBoundsEntries,
+			      sizeof(BoundsEntry), CompareBoundsEntries);
+  if (e == NULL ||
+      e->mapMtime != (long long) mapSb->st_mtime ||
+      e->mapSize != (long long) mapSb->st_size)
+    return(0);
+  if (imapsName[0] != '\0')
+    {
+      sprintf(fn, "%s%s.map", imapsName, images[i].name);
+      if (stat(fn, &sb) != 0 ||
+	  e->imapMtime != (long long) sb.st_mtime ||
+	  e->imapSize != (long long) sb.st_size)
+	return(0);
+    }
+  imageBounds[i] = *e;
+  imageBounds[i].name = images[i].name;
+  return(1);
+}
+
+/* WriteBoundsIndex rewrites the index with the entries of the current
+   images, keeping those of other images that it already held */
+void
+WriteBoundsIndex ()
+{
+  BoundsEntry *entries;
+  BoundsEntry *e;
+  int n;
+  int i;
+  char tmpName[PATH_MAX+8];
+  FILE *f;
+
+  entries = (BoundsEntry *) malloc((nImages + nBoundsEntries) *
+				   sizeof(BoundsEntry));
+  if (entries == NULL)
+    Error("malloc of bounds entries failed; errno = %d\n", errno);
+  n = 0;
+  for (i = 0; i < nImages; ++i)
+    entries[n++] = imageBounds[i];
+  qsort(entries, n, sizeof(BoundsEntry), CompareBoundsEntries);
+  for (i = 0; i < nBoundsEntries; ++i)
+    if (bsearch(&boundsIndex[i], entries, nImages,
+		sizeof(BoundsEntry), CompareBoundsEntries) == NULL)
+      entries[n++] = boundsIndex[i];
+  qsort(entries, n, sizeof(BoundsEntry), CompareBoundsEntries);
+
+  /* write to a temporary file first, so that a reader never sees
+     a partial index */
+  sprintf(tmpName, "%s.tmp", boundsIndexName);
+  f = fopen(tmpName, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Warning: could not write bounds index %s\n",
+	      boundsIndexName);
+      free(entries);
+      return;
+    }
+  fprintf(f, BOUNDS_INDEX_HEADER, mapScale, rotation, rotationX, rotationY);
+  for (i = 0; i < n; ++i)
+    {
+      e = &entries[i];
+      fprintf(f, "%s %lld %lld %d %d %.9g %.9g %.9g %.9g %lld %lld %d %d\n",
+	      e->name, e->mapMtime, e->mapSize, e->mw, e->mh,
+	      e->minX, e->maxX, e->minY, e->maxY,
+	      e->imapMtime, e->imapSize, e->imapw, e->imaph);
+    }
+  if (fclose(f) != 0 || rename(tmpName, boundsIndexName) != 0)
+    {
+      fprintf(stderr, "Warning: could not write bounds index %s\n",
+	      boundsIndexName);
+      unlink(tmpName);
+    }
+  free(entries);
+}
+
+/* the -append file records the output extent of the first run, before
+   it is rounded to the reduction factor or cut to a region, and then
+   the names of the sections rendered into it, one per line */
+#define APPEND_HEADER	"X1 %d %d %d %d\n"
+
+/* ReadAppendExtent reads the -append file, if there is one, and marks
+   the images it lists as rendered */
+void
+ReadAppendExtent ()
+{
+  FILE *f;
+  char line[LINE_LENGTH+1];
+  char name[LINE_LENGTH+1];
+  char *key;
+  int maxNames;
+  int i;
+  int n;
+
+  f = fopen(appendName, "r");
+  if (f == NULL)
+    return;
+  if (fgets(line, LINE_LENGTH, f) == NULL ||
+      sscanf(line, "X1 %d %d %d %d", &appendMinX, &appendMaxX,
+	     &appendMinY, &appendMaxY) != 4 ||
+      appendMinX > appendMaxX || appendMinY > appendMaxY)
+    Error("-append file %s has no output extent\n", appendName);
+  maxNames = 0;
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      if (sscanf(line, "%s", name) != 1)
+	continue;
+      if (nAppendedNames >= maxNames)
 	{
-	  free(images[i].imap);
-	  images[i].imap = NULL;
-	  imageMem -= images[i].imapw * images[i].imaph * sizeof(MapElement);
+	  maxNames = (maxNames == 0) ? 1024 : 2 * maxNames;
+	  appendedNames = (char **) realloc(appendedNames,
+					    maxNames * sizeof(char *));
+	  if (appendedNames == NULL)
+	    Error("realloc of appendedNames failed; errno = %d\n", errno);
 	}
-      if (images[i].image != NULL)
+      appendedNames[nAppendedNames] = (char *) malloc(strlen(name) + 1);
+      if (appendedNames[nAppendedNames] == NULL)
+	Error("malloc of appended name failed; errno = %d\n", errno);
+      strcpy(appendedNames[nAppendedNames++], name);
+    }
+  fclose(f);
+  qsort(appendedNames, nAppendedNames, sizeof(char *), CompareNames);
+  haveAppendExtent = 1;
+
+  n = 0;
+  for (i = 0; i < nImages; ++i)
+    {
+      key = images[i].name;
+      images[i].rendered =
+	bsearch(&key, appendedNames, nAppendedNames, sizeof(char *),
+		CompareNames) != NULL;
+      n += images[i].rendered;
+    }
+  printf("Appending %d of %d sections to the output extent of %s\n",
+	 nImages - n, nImages, appendName);
+}
+
+/* WriteAppendExtent rewrites the -append file with the output extent
+   and the sections it held, followed by those just rendered */
+void
+WriteAppendExtent ()
+{
+  char tmpName[PATH_MAX+8];
+  FILE *f;
+  int i;
+  int ok;
+
+  /* write to a temporary file first, so that a run that is stopped
+     never leaves a partial list */
+  sprintf(tmpName, "%s.tmp", appendName);
+  f = fopen(tmpName, "w");
+  if (f == NULL)
+    Error("Could not write -append file %s\n", tmpName);
+  ok = fprintf(f, APPEND_HEADER,
+	       appendMinX, appendMaxX, appendMinY, appendMaxY) > 0;
+  for (i = 0; ok && i < nAppendedNames; ++i)
+    ok = fprintf(f, "%s\n", appendedNames[i]) > 0;
+  for (i = 0; ok && i < nImages; ++i)
+    if (!images[i].rendered)
+      ok = fprintf(f, "%s\n", images[i].name) > 0;
+  if (fclose(f) != 0 || !ok || rename(tmpName, appendName) != 0)
+    {
+      unlink(tmpName);
+      Error("Could not write -append file %s\n", appendName);
+    }
+}
+
+/* IndexImages builds the cell index over the bounds of the images:
+   the output area is divided into square cells about the size of an
+   image, and each cell lists (in increasing order) the images whose
+   bounds overlap it */
+void
+IndexImages ()
+{
+  int i, j;
+  int cx, cy;
+  int cx0, cx1, cy0, cy1;
+  int nCells;
+  int nEntries;
+  double area;
+
+  area = ((double) oWidth) * oHeight;
+  cellSize = (int) ceil(sqrt(area / (nImages > 0 ? nImages : 1)));
+  if (cellSize < 1)
+    cellSize = 1;
+  cellCols = (oWidth + cellSize - 1) / cellSize;
+  cellRows = (oHeight + cellSize - 1) / cellSize;
+  if (cellCols < 1)
+    cellCols = 1;
+  if (cellRows < 1)
+    cellRows = 1;
+  nCells = cellCols * cellRows;
+  cellStart = (int *) malloc((nCells + 1) * sizeof(int));
+  imageStamp = (int *) malloc(nImages * sizeof(int));
+  if (cellStart == NULL || imageStamp == NULL)
+    Error("Could not allocate image cell index\n");
+  memset(cellStart, 0, (nCells + 1) * sizeof(int));
+  memset(imageStamp, 0, nImages * sizeof(int));
+  stamp = 0;
+
+  /* count the entries of each cell, then fill them in */
+  for (j = 0; j < 2; ++j)
+    {
+      for (i = 0; i < nImages; ++i)
 	{
-	  //	  printf("freeing %zu bytes from image\n",
-	  //		 images[i].height * images[i].width * sizeof(unsigned char));
-	  free(images[i].image);
-	  images[i].image = NULL;
-	  imageMem -= images[i].width * images[i].height;
+	  CellRange(floor(images[i].minX), ceil(images[i].maxX),
+		    floor(images[i].minY), ceil(images[i].maxY),
+		    &cx0, &cx1, &cy0, &cy1);
+	  for (cy = cy0; cy <= cy1; ++cy)
+	    for (cx = cx0; cx <= cx1; ++cx)
+	      if (j == 0)
+		++cellStart[cy * cellCols + cx + 1];
+	      else
+		cellImages[cellStart[cy * cellCols + cx]++] = i;
 	}
-      if (images[i].mask != NULL)
+      if (j == 0)
 	{
-	  //	  printf("freeing %zu bytes from mask\n",
-	  //		 (size_t) ((images[i].width + 7) / 8) * images[i].height);
-	  free(images[i].mask);
-	  images[i].mask = NULL;
-	  imageMem -= ((images[i].width + 7) / 8) * images[i].height;
+	  for (i = 0; i < nCells; ++i)
+	    cellStart[i+1] += cellStart[i];
+	  nEntries = cellStart[nCells];
+	  cellImages = (int *) malloc((nEntries > 0 ? nEntries : 1) *
+				      sizeof(int));
+	  if (cellImages == NULL)
+	    Error("Could not allocate image cell index\n");
 	}
-      if (images[i].dist != NULL)
+      else
 	{
-	  //	  printf("freeing %zu bytes from dist\n",
-	  //		 (size_t) (images[i].width  * images[i].height));
-	  free(images[i].dist);
-	  images[i].dist = NULL;
-	  imageMem -= images[i].width * images[i].height;
+	  /* the fill advanced each start to the next cell's */
+	  for (i = nCells; i > 0; --i)
+	    cellStart[i] = cellStart[i-1];
+	  cellStart[0] = 0;
 	}
     }
 }
 
 void
-WriteTiles (int col, int startRow, int endRow, char *iName)
+FreeImageIndex ()
 {
-  int row;
-  char fn[PATH_MAX];
-  char msg[PATH_MAX+256];
+  if (cellStart == NULL)
+    return;
+  free(cellStart);
+  free(cellImages);
+  free(imageStamp);
+  cellStart = NULL;
+  cellImages = NULL;
+  imageStamp = NULL;
+}
 
-  for (row = startRow; row <= endRow; ++row)
+/* CellRange finds the cells of the index that the area from
+   (minX, minY) to (maxX, maxY) overlaps; areas beyond the output
+   are charged to its edge cells */
+void
+CellRange (double minX, double maxX, double minY, double maxY,
+	   int *cx0, int *cx1, int *cy0, int *cy1)
+{
+  *cx0 = CellIndex(minX - oMinX, cellCols);
+  *cx1 = CellIndex(maxX - oMinX, cellCols);
+  *cy0 = CellIndex(minY - oMinY, cellRows);
+  *cy1 = CellIndex(maxY - oMinY, cellRows);
+}
+
+int
+CellIndex (double offset, int n)
+{
+  if (offset <= 0.0)
+    return(0);
+  if (offset / cellSize >= n - 1)
+    return(n - 1);
+  return((int) (offset / cellSize));
+}
+
+/* ImagesInRegion lists in list, in increasing order, the images from
+   first to last whose bounds may overlap the area from (minX, minY)
+   to (maxX, maxY), and returns their number; the caller still has to
+   test each one, as cells are coarser than the images */
+int
+ImagesInRegion (int minX, int maxX, int minY, int maxY,
+		int first, int last, int *list)
+{
+  int n;
+  int i, j;
+  int cx, cy;
+  int cx0, cx1, cy0, cy1;
+
+  n = 0;
+  if (last - first < 16)
     {
-      if (overlay)
-	{
-	  if (tileWidth < 0 && tileHeight < 0)
-	    sprintf(fn, "%s.tif", outputName);
-	  else
-	    sprintf(fn, "%sc%.2d%sr%.2d.tif", outputName, col+1,
-		    tree ? "/" : "", row+1);
-	}
-      else
+      for (i = first; i <= last; ++i)
+	list[n++] = i;
+      return(n);
+    }
+  if (cellStart == NULL)
+    IndexImages();
+  if (++stamp == 0)
+    {
+      memset(imageStamp, 0, nImages * sizeof(int));
+      stamp = 1;
+    }
+  CellRange(minX, maxX, minY, maxY, &cx0, &cx1, &cy0, &cy1);
+  for (cy = cy0; cy <= cy1; ++cy)
+    for (cx = cx0; cx <= cx1; ++cx)
+      for (j = cellStart[cy * cellCols + cx];
+	   j < cellStart[cy * cellCols + cx + 1]; ++j)
 	{
-	  if (tileWidth < 0 && tileHeight < 0)
-	    sprintf(fn, "%s%s.tif",
-		    outputName, iName);
-	  else
-	    sprintf(fn, "%s%s/c%.2d%sr%.2d.tif",
-		    outputName, iName,
-		    col+1, tree ? "/" : "", row+1);
+	  i = cellImages[j];
+	  if (i < first || i > last || imageStamp[i] == stamp)
+	    continue;
+	  imageStamp[i] = stamp;
+	  list[n++] = i;
 	}
-      if (!CreateDirectories(fn))
-	Error("Could not create directories for output file %s\n", fn);
-      if (!WriteImage(fn, &out[(row - startRow) * th * tw], (int) tw, (int) th,
-		      compress ? HDiffDeflateImage : UncompressedImage,
-		      msg))
-	Error("Could not write output file %s:\n  error: %s\n",
-	      fn, msg);
-      if ((nProcessed % 50) == 0 && nProcessed != 0)
-	printf(" %d\n    ", nProcessed);
-      printf(".");
-      fflush(stdout);
-      ++nProcessed;
-    }
+  qsort(list, n, sizeof(int), CompareInts);
+  return(n);
 }
 
-void Error (char *fmt, ...)
+int
+CompareInts (const void *a, const void *b)
 {
-  va_list args;
+  return(*((int *) a) - *((int *) b));
+}
 
-  va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
-  va_end(args);
-  fflush(stderr);
-  abort();
+int
+CompareBoundsEntries (const void *a, const void *b)
+{
+  return(strcmp(((BoundsEntry *) a)->name, ((BoundsEntry *) b)->name));
 }
 
-unsigned int
-Hash (char *s)
+int
+CompareNames (const void *a, const void *b)
 {
-  unsigned int v = 0;
-  char *p = s;
-  while (*p != '\0')
-    v = 37 * v + *p++;
-  return(v);
+  return(strcmp(*((char **) a), *((char **) b)));
 }
 
 int
@@ -2074,6 +6767,8 @@ CreateDirectories (char *fn)
   int hv;
   int i;
 
+  /* the tile writer threads create directories too */
+  pthread_mutex_lock(&dirMutex);
   for (pos = 0;
        (slash = strchr(&fn[pos], '/')) != NULL;
        pos = len + 1)
@@ -2115,9 +6810,10 @@ CreateDirectories (char *fn)
       if (errno != ENOENT)
 	Error("Could not stat directory %s\n", dn);
       
-      if (mkdir(dn, 0777) != 0)
+      if (mkdir(dn, 0777) != 0 && errno != EEXIST)
 	Error("Could not create directory %s\n", dn);
     }
+  pthread_mutex_unlock(&dirMutex);
   return(1);
 }
 
@@ -0,0 +1,249 @@
+/*
+ * atlas.c -- reads and writes the stack overviews that gen_atlas
+ *            makes for inspector
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Acknowledgements:
+ *     Development of this code was supported in part by
+ *       NIH NCRR grant 5P41RR006009 and
+ *       NIH NIGMS grant P41GM103712
+ *
+ *  HISTORY
+ *    2026     Written for gen_atlas and inspector
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "atlas.h"
+
+/* an atlas file is gzipped, and holds a header line, a line for each
+   section and then each pair, and then the thumbnails of the sections
+   one after another, in the order of their lines */
+#define ATLAS_HEADER	"A1 %d %d %d\n"
+#define ATLAS_LINE_LENGTH	(3 * PATH_MAX + 512)
+
+static char *CopyName (char *name);
+
+int
+WriteAtlas (char *filename, Atlas *atlas, char *error)
+{
+  char tmpName[PATH_MAX+32];
+  gzFile gzf;
+  AtlasSection *s;
+  AtlasPair *p;
+  size_t n;
+  int i;
+  int ok;
+
+  sprintf(tmpName, "%s.%d", filename, (int) getpid());
+  gzf = gzopen(tmpName, "wb");
+  if (gzf == NULL)
+    {
+      sprintf(error, "Could not open file %s for writing\n", tmpName);
+      return(0);
+    }
+  ok = gzprintf(gzf, ATLAS_HEADER, atlas->factor,
+		atlas->nSections, atlas->nPairs) > 0;
+  for (i = 0; ok && i < atlas->nSections; ++i)
+    {
+      s = &atlas->sections[i];
+      ok = gzprintf(gzf, "S %s %d %d %d %d\n", s->name,
+		    s->width, s->height,
+		    s->thumbWidth, s->thumbHeight) > 0;
+    }
+  for (i = 0; ok && i < atlas->nPairs; ++i)
+    {
+      p = &atlas->pairs[i];
+      ok = gzprintf(gzf, "P %s %s %s %d %.9g %.9g %.9g %.9g %.9g %d %.9g %.9g\n",
+		    p->imageName, p->refName, p->pairName,
+		    p->summarized, p->correlation, p->distortion,
+		    p->correspondence, p->constraining, p->energy,
+		    p->mapped, p->validFraction, p->meanConfidence) > 0;
+    }
+  for (i = 0; ok && i < atlas->nSections; ++i)
+    {
+      s = &atlas->sections[i];
+      n = ((size_t) s->thumbWidth) * s->thumbHeight;
+      ok = n == 0 ||
+	gzwrite(gzf, s->thumbnail, (unsigned int) n) == (int) n;
+    }
+  if (gzclose(gzf) != Z_OK || !ok || rename(tmpName, filename) != 0)
+    {
+      sprintf(error, "Could not write to file %s\n", filename);
+      unlink(tmpName);
+      return(0);
+    }
+  return(1);
+}
+
+int
+ReadAtlas (char *filename, Atlas *atlas, char *error)
+{
+  char line[ATLAS_LINE_LENGTH];
+  char name0[PATH_MAX], name1[PATH_MAX], name2[PATH_MAX];
+  gzFile gzf;
+  AtlasSection *s;
+  AtlasPair *p;
+  size_t n;
+  int i;
+
+  memset(atlas, 0, sizeof(Atlas));
+  gzf = gzopen(filename, "rb");
+  if (gzf == NULL)
+    {
+      sprintf(error, "Could not open file %s\n", filename);
+      return(0);
+    }
+  if (gzgets(gzf, line, sizeof(line)) == NULL ||
+      sscanf(line, ATLAS_HEADER, &atlas->factor,
+	     &atlas->nSections, &atlas->nPairs) != 3 ||
+      atlas->factor < 1 || atlas->nSections < 0 || atlas->nPairs < 0)
+    {
+      sprintf(error, "File %s is not an atlas\n", filename);
+      gzclose(gzf);
+      return(0);
+    }
+  atlas->sections = (AtlasSection *)
+    calloc(atlas->nSections > 0 ? atlas->nSections : 1,
+	   sizeof(AtlasSection));
+  atlas->pairs = (AtlasPair *)
+    calloc(atlas->nPairs > 0 ? atlas->nPairs : 1, sizeof(AtlasPair));
+  if (atlas->sections == NULL || atlas->pairs == NULL)
+    {
+      sprintf(error, "Could not allocate atlas of %s\n", filename);
+      gzclose(gzf);
+      FreeAtlas(atlas);
+      return(0);
+    }
+  for (i = 0; i < atlas->nSections; ++i)
+    {
+      s = &atlas->sections[i];
+      if (gzgets(gzf, line, sizeof(line)) == NULL ||
+	  sscanf(line, "S %s %d %d %d %d", name0,
+		 &s->width, &s->height,
+		 &s->thumbWidth, &s->thumbHeight) != 5 ||
+	  s->thumbWidth < 0 || s->thumbHeight < 0)
+	{
+	  sprintf(error, "Atlas %s has an invalid section line %d\n",
+		  filename, i);
+	  gzclose(gzf);
+	  FreeAtlas(atlas);
+	  return(0);
+	}
+      s->name = CopyName(name0);
+    }
+  for (i = 0; i < atlas->nPairs; ++i)
+    {
+      p = &atlas->pairs[i];
+      if (gzgets(gzf, line, sizeof(line)) == NULL ||
+	  sscanf(line, "P %s %s %s %d %lf %lf %lf %lf %lf %d %lf %lf",
+		 name0, name1, name2,
+		 &p->summarized, &p->correlation, &p->distortion,
+		 &p->correspondence, &p->constraining, &p->energy,
+		 &p->mapped, &p->validFraction, &p->meanConfidence) != 12)
+	{
+	  sprintf(error, "Atlas %s has an invalid pair line %d\n",
+		  filename, i);
+	  gzclose(gzf);
+	  FreeAtlas(atlas);
+	  return(0);
+	}
+      p->imageName = CopyName(name0);
+      p->refName = CopyName(name1);
+      p->pairName = CopyName(name2);
+    }
+  for (i = 0; i < atlas->nSections; ++i)
+    {
+      s = &atlas->sections[i];
+      n = ((size_t) s->thumbWidth) * s->thumbHeight;
+      s->thumbnail = (unsigned char *) malloc(n > 0 ? n : 1);
+      if (s->thumbnail == NULL ||
+	  (n > 0 && gzread(gzf, s->thumbnail, (unsigned int) n) != (int) n))
+	{
+	  sprintf(error, "Atlas %s apparently truncated\n", filename);
+	  gzclose(gzf);
+	  FreeAtlas(atlas);
+	  return(0);
+	}
+    }
+  gzclose(gzf);
+  return(1);
+}
+
+void
+FreeAtlas (Atlas *atlas)
+{
+  int i;
+
+  if (atlas->sections != NULL)
+    for (i = 0; i < atlas->nSections; ++i)
+      {
+	free(atlas->sections[i].name);
+	free(atlas->sections[i].thumbnail);
+      }
+  if (atlas->pairs != NULL)
+    for (i = 0; i < atlas->nPairs; ++i)
+      {
+	free(atlas->pairs[i].imageName);
+	free(atlas->pairs[i].refName);
+	free(atlas->pairs[i].pairName);
+      }
+  free(atlas->sections);
+  free(atlas->pairs);
+  memset(atlas, 0, sizeof(Atlas));
+}
+
+AtlasSection *
+FindAtlasSection (Atlas *atlas, char *name)
+{
+  int i;
+
+  for (i = 0; i < atlas->nSections; ++i)
+    if (strcmp(atlas->sections[i].name, name) == 0)
+      return(&atlas->sections[i]);
+  return(NULL);
+}
+
+AtlasPair *
+FindAtlasPair (Atlas *atlas, char *pairName)
+{
+  int i;
+
+  for (i = 0; i < atlas->nPairs; ++i)
+    if (strcmp(atlas->pairs[i].pairName, pairName) == 0)
+      return(&atlas->pairs[i]);
+  return(NULL);
+}
+
+static char *
+CopyName (char *name)
+{
+  char *copy;
+
+  copy = (char *) malloc(strlen(name) + 1);
+  if (copy != NULL)
+    strcpy(copy, name);
+  return(copy);
+}
@@ -0,0 +1,66 @@
+//
+// atlas.h - the overview of a stack that gen_atlas makes and
+//           inspector opens on: a thumbnail of every section of a
+//           pairs file and the quality of each pair, in one file
+//
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct AtlasSection
+{
+  char *name;
+  int width, height;		/* size of the section image */
+  int thumbWidth, thumbHeight;	/* size of its thumbnail, the image
+				   reduced by the atlas factor */
+  unsigned char *thumbnail;
+} AtlasSection;
+
+typedef struct AtlasPair
+{
+  char *imageName;
+  char *refName;
+  char *pairName;
+  int summarized;		/* the register summary listed the pair, */
+  double correlation;		/*   with these terms of its energy */
+  double distortion;
+  double correspondence;
+  double constraining;
+  double energy;
+  int mapped;			/* its map was read, and has */
+  double validFraction;		/*   this fraction of its nodes valid */
+  double meanConfidence;	/*   with this mean confidence */
+} AtlasPair;
+
+typedef struct Atlas
+{
+  int factor;			/* the sections are reduced by this
+				   power of 2 for their thumbnails */
+  int nSections;
+  AtlasSection *sections;
+  int nPairs;
+  AtlasPair *pairs;
+} Atlas;
+
+/* WriteAtlas writes the atlas to a gzipped file, by way of a temporary
+   file that is renamed into place */
+int WriteAtlas (char *filename, Atlas *atlas, char *error);
+
+/* ReadAtlas reads the whole of an atlas written by WriteAtlas */
+int ReadAtlas (char *filename, Atlas *atlas, char *error);
+
+void FreeAtlas (Atlas *atlas);
+
+/* FindAtlasSection and FindAtlasPair return the section or pair of
+   that name, or NULL if the atlas has none */
+AtlasSection *FindAtlasSection (Atlas *atlas, char *name);
+AtlasPair *FindAtlasPair (Atlas *atlas, char *pairName);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ATLAS_H */
@@ -0,0 +1,424 @@
+/*
+ * best_fit.c -- closed-form least-squares affine and rigid fits to
+ *               maps, and the list mode of best_affine and best_rigid
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  HISTORY
+ *    2026     Written for the list modes of best_affine and best_rigid
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "best_fit.h"
+
+typedef struct FitItem
+{
+  char *inputName;
+  char *outputName;
+  int done;
+  int ok;
+  double a[3], b[3];
+  char *error;		/* if !ok, why not */
+} FitItem;
+
+typedef struct FitList
+{
+  int nItems;
+  FitItem *items;
+  FitFunction fit;
+  char *kind;
+  int next;		/* the next map to be fitted */
+  int nPrinted;		/* the maps reported so far */
+  int nFailed;
+  pthread_mutex_t lock;
+} FitList;
+
+static void WeightedMeans (MapElement *map, int mLevel, int mw, int mh,
+			   int mxMin, int myMin, double *w,
+			   double *px, double *py, double *qx, double *qy,
+			   int *n);
+static void *FitThreadMain (void *arg);
+static int FitOne (FitList *fl, FitItem *item);
+
+/* FitAffine solves the normal equations of the weighted fit.  The x'
+   and y' coefficients share the same 3 x 3 matrix, which becomes
+   block diagonal once the coordinates are taken relative to their
+   weighted mean, leaving a 2 x 2 system for the linear terms. */
+int
+FitAffine (MapElement *map, int mLevel, int mw, int mh,
+	   int mxMin, int myMin, double *a, double *b)
+{
+  int x, y;
+  int n;
+  double mFactor;
+  double w, c;
+  double px, py, qx, qy;
+  double dx, dy, dqx, dqy;
+  double sxx, sxy, syy;
+  double sxX, syX, sxY, syY;
+  double det;
+  MapElement *e;
+
+  WeightedMeans(map, mLevel, mw, mh, mxMin, myMin, &w, &px, &py, &qx, &qy, &n);
+  if (n < 4)
+    return(0);
+
+  mFactor = 1 << mLevel;
+  sxx = sxy = syy = 0.0;
+  sxX = syX = sxY = syY = 0.0;
+  for (y = 0; y < mh; ++y)
+    for (x = 0; x < mw; ++x)
+      {
+	e = &map[y*mw+x];
+	if (e->c == 0.0)
+	  continue;
+	c = fabs(e->c);
+	dx = mFactor * (x + mxMin) - px;
+	dy = mFactor * (y + myMin) - py;
+	dqx = mFactor * e->x - qx;
+	dqy = mFactor * e->y - qy;
+	sxx += c * dx * dx;
+	sxy += c * dx * dy;
+	syy += c * dy * dy;
+	sxX += c * dx * dqx;
+	syX += c * dy * dqx;
+	sxY += c * dx * dqy;
+	syY += c * dy * dqy;
+      }
+
+  /* the points must not all lie along a line */
+  det = sxx * syy - sxy * sxy;
+  if (det <= 1.0e-12 * sxx * syy)
+    return(0);
+  a[1] = (syy * sxX - sxy * syX) / det;
+  a[2] = (sxx * syX - sxy * sxX) / det;
+  b[1] = (syy * sxY - sxy * syY) / det;
+  b[2] = (sxx * syY - sxy * sxY) / det;
+  a[0] = qx - a[1] * px - a[2] * py;
+  b[0] = qy - b[1] * px - b[2] * py;
+  return(1);
+}
+
+/* FitRigid finds the weighted least-squares rotation in closed form:
+   relative to the weighted means, the best angle is that of the
+   summed dot and cross products of the points with their images,
+   and the translation then carries the mean onto the mean image */
+int
+FitRigid (MapElement *map, int mLevel, int mw, int mh,
+	  int mxMin, int myMin, double *a, double *b)
+{
+  int x, y;
+  int n;
+  double mFactor;
+  double w, c;
+  double px, py, qx, qy;
+  double dx, dy, dqx, dqy;
+  double sDot, sCross;
+  double theta, ct, st;
+  MapElement *e;
+
+  WeightedMeans(map, mLevel, mw, mh, mxMin, myMin, &w, &px, &py, &qx, &qy, &n);
+  if (n == 0)
+    return(0);
+
+  mFactor = 1 << mLevel;
+  sDot = 0.0;
+  sCross = 0.0;
+  for (y = 0; y < mh; ++y)
+    for (x = 0; x < mw; ++x)
+      {
+	e = &map[y*mw+x];
+	if (e->c == 0.0)
+	  continue;
+	c = fabs(e->c);
+	dx = mFactor * (x + mxMin) - px;
+	dy = mFactor * (y + myMin) - py;
+	dqx = mFactor * e->x - qx;
+	dqy = mFactor * e->y - qy;
+	sDot += c * (dx * dqx + dy * dqy);
+	sCross += c * (dx * dqy - dy * dqx);
+      }
+  theta = (sDot != 0.0 || sCross != 0.0) ? atan2(sCross, sDot) : 0.0;
+  ct = cos(theta);
+  st = sin(theta);
+  a[1] = ct;
+  a[2] = -st;
+  b[1] = st;
+  b[2] = ct;
+  a[0] = qx - ct * px + st * py;
+  b[0] = qy - st * px - ct * py;
+  return(1);
+}
+
+/* WeightedMeans finds the |c|-weighted means of the valid points of
+   the map (px, py) and of their images (qx, qy), in level-0 pixels */
+static void
+WeightedMeans (MapElement *map, int mLevel, int mw, int mh,
+	       int mxMin, int myMin, double *w,
+	       double *px, double *py, double *qx, double *qy,
+	       int *n)
+{
+  int x, y;
+  double mFactor;
+  double c;
+  MapElement *e;
+
+  mFactor = 1 << mLevel;
+  *w = 0.0;
+  *px = *py = *qx = *qy = 0.0;
+  *n = 0;
+  for (y = 0; y < mh; ++y)
+    for (x = 0; x < mw; ++x)
+      {
+	e = &map[y*mw+x];
+	if (e->c == 0.0)
+	  continue;
+	c = fabs(e->c);
+	*w += c;
+	*px += c * (x + mxMin);
+	*py += c * (y + myMin);
+	*qx += c * e->x;
+	*qy += c * e->y;
+	++*n;
+      }
+  if (*n == 0)
+    return;
+  *px *= mFactor / *w;
+  *py *= mFactor / *w;
+  *qx *= mFactor / *w;
+  *qy *= mFactor / *w;
+}
+
+void
+AffineMap (double *a, double *b, int mLevel, int mw, int mh,
+	   int mxMin, int myMin, MapElement *rmap, int *rLevel)
+{
+  int mFactor;
+  int rFactor;
+  double xMax, yMax;
+
+  mFactor = 1 << mLevel;
+  xMax = mFactor * (mw + mxMin);
+  yMax = mFactor * (mh + myMin);
+  *rLevel = 0;
+  rFactor = 1;
+  while (xMax > rFactor || yMax > rFactor)
+    rFactor = 1 << (++*rLevel);
+  xMax = rFactor;
+  yMax = rFactor;
+
+  rmap[0].x = a[0] / rFactor;
+  rmap[0].y = b[0] / rFactor;
+  rmap[0].c = 1.0;
+  rmap[1].x = (a[1] * xMax + a[0]) / rFactor;
+  rmap[1].y = (b[1] * xMax + b[0]) / rFactor;
+  rmap[1].c = 1.0;
+  rmap[2].x = (a[2] * yMax + a[0]) / rFactor;
+  rmap[2].y = (b[2] * yMax + b[0]) / rFactor;
+  rmap[2].c = 1.0;
+  rmap[3].x = (a[1] * xMax + a[2] * yMax + a[0]) / rFactor;
+  rmap[3].y = (b[1] * xMax + b[2] * yMax + b[0]) / rFactor;
+  rmap[3].c = 1.0;
+}
+
+int
+FitMapList (char *listName, FitFunction fit, char *kind,
+	    int nThreads, char *error)
+{
+  FitList fl;
+  FitItem *item;
+  pthread_t *threads;
+  FILE *f;
+  char line[2*PATH_MAX+64];
+  char name1[PATH_MAX], name2[PATH_MAX];
+  int lineNo;
+  int i, n;
+
+  f = fopen(listName, "r");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open list %s\n", listName);
+      return(-1);
+    }
+  fl.nItems = 0;
+  fl.items = NULL;
+  lineNo = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+    {
+      ++lineNo;
+      n = sscanf(line, "%s %s", name1, name2);
+      if (n <= 0 || name1[0] == '#')
+	continue;
+      if (n != 2)
+	{
+	  sprintf(error, "Line %d of %s does not name two maps\n",
+		  lineNo, listName);
+	  fclose(f);
+	  for (i = 0; i < fl.nItems; ++i)
+	    {
+	      free(fl.items[i].inputName);
+	      free(fl.items[i].outputName);
+	    }
+	  if (fl.items != NULL)
+	    free(fl.items);
+	  return(-1);
+	}
+      if ((fl.nItems & 255) == 0)
+	fl.items = (FitItem *) realloc(fl.items,
+				       (fl.nItems + 256) * sizeof(FitItem));
+      item = &fl.items[fl.nItems++];
+      item->inputName = strdup(name1);
+      item->outputName = strdup(name2);
+      item->done = 0;
+      item->ok = 0;
+      item->error = NULL;
+    }
+  fclose(f);
+  if (fl.nItems == 0)
+    {
+      sprintf(error, "No maps listed in %s\n", listName);
+      return(-1);
+    }
+
+  fl.fit = fit;
+  fl.kind = kind;
+  fl.next = 0;
+  fl.nPrinted = 0;
+  fl.nFailed = 0;
+  pthread_mutex_init(&fl.lock, NULL);
+  if (nThreads > fl.nItems)
+    nThreads = fl.nItems;
+  if (nThreads <= 1)
+    FitThreadMain(&fl);
+  else
+    {
+      threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+      for (i = 0; i < nThreads; ++i)
+	if (pthread_create(&threads[i], NULL, FitThreadMain, &fl) != 0)
+	  {
+	    /* the threads already started finish the list */
+	    nThreads = i;
+	    break;
+	  }
+      if (nThreads == 0)
+	FitThreadMain(&fl);
+      for (i = 0; i < nThreads; ++i)
+	pthread_join(threads[i], NULL);
+      free(threads);
+    }
+  pthread_mutex_destroy(&fl.lock);
+
+  for (i = 0; i < fl.nItems; ++i)
+    {
+      free(fl.items[i].inputName);
+      free(fl.items[i].outputName);
+      if (fl.items[i].error != NULL)
+	free(fl.items[i].error);
+    }
+  free(fl.items);
+  return(fl.nFailed);
+}
+
+static void *
+FitThreadMain (void *arg)
+{
+  FitList *fl = (FitList *) arg;
+  FitItem *item;
+  int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&fl->lock);
+      i = fl->next;
+      if (i < fl->nItems)
+	++fl->next;
+      pthread_mutex_unlock(&fl->lock);
+      if (i >= fl->nItems)
+	break;
+
+      item = &fl->items[i];
+      item->ok = FitOne(fl, item);
+
+      /* report this map and any finished ones after it, once all
+	 earlier maps have been reported */
+      pthread_mutex_lock(&fl->lock);
+      item->done = 1;
+      while (fl->nPrinted < fl->nItems && fl->items[fl->nPrinted].done)
+	{
+	  item = &fl->items[fl->nPrinted++];
+	  if (item->ok)
+	    printf("%s: x = %gx %+gy %+g  y = %gx %+gy %+g\n",
+		   item->inputName,
+		   item->a[1], item->a[2], item->a[0],
+		   item->b[1], item->b[2], item->b[0]);
+	  else
+	    {
+	      ++fl->nFailed;
+	      fprintf(stderr, "Could not fit %s map to %s:\n  %s",
+		      fl->kind, item->inputName, item->error);
+	    }
+	}
+      fflush(stdout);
+      pthread_mutex_unlock(&fl->lock);
+    }
+  return(NULL);
+}
+
+/* FitOne fits and writes the map of one list item */
+static int
+FitOne (FitList *fl, FitItem *item)
+{
+  MapElement *map;
+  MapElement rmap[4];
+  int mLevel, mw, mh, mxMin, myMin;
+  int rLevel;
+  char imgName[PATH_MAX], refName[PATH_MAX];
+  char msg[PATH_MAX + 1024];
+
+  if (!ReadMap(item->inputName, &map, &mLevel, &mw, &mh,
+	       &mxMin, &myMin, imgName, refName, msg))
+    {
+      item->error = strdup(msg);
+      return(0);
+    }
+  if (!(*fl->fit)(map, mLevel, mw, mh, mxMin, myMin, item->a, item->b))
+    {
+      free(map);
+      item->error = strdup("Not enough valid map points found.\n");
+      return(0);
+    }
+  free(map);
+
+  AffineMap(item->a, item->b, mLevel, mw, mh, mxMin, myMin, rmap, &rLevel);
+  if (!WriteMap(item->outputName, rmap, rLevel, 2, 2, 0, 0,
+		imgName, refName, UncompressedMap, msg))
+    {
+      item->error = (char *) malloc(strlen(msg) + PATH_MAX + 64);
+      sprintf(item->error, "Could not write %s map %s: %s",
+	      fl->kind, item->outputName, msg);
+      return(0);
+    }
+  return(1);
+}
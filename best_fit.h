@@ -0,0 +1,51 @@
+//
+// best_fit.h - closed-form affine and rigid fits to maps, shared by
+//              best_affine and best_rigid, and their list mode
+//
+#ifndef BEST_FIT_H
+#define BEST_FIT_H
+
+#include "imio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a FitFunction sets a and b to the transformation
+     x' = a[0] + a[1] x + a[2] y
+     y' = b[0] + b[1] x + b[2] y
+   (in level-0 pixels) that best fits the points of the mw x mh map at
+   level mLevel with offset (mxMin, myMin), in the least-squares
+   sense with each point weighted by its |c|; points with c == 0 are
+   ignored.  It returns 0 if there are too few points. */
+typedef int (*FitFunction) (MapElement *map, int mLevel, int mw, int mh,
+			    int mxMin, int myMin, double *a, double *b);
+
+/* FitAffine finds the best affine transformation, and FitRigid the
+   best rotation and translation */
+int FitAffine (MapElement *map, int mLevel, int mw, int mh,
+	       int mxMin, int myMin, double *a, double *b);
+int FitRigid (MapElement *map, int mLevel, int mw, int mh,
+	      int mxMin, int myMin, double *a, double *b);
+
+/* AffineMap sets the 2 x 2 map rmap, at level *rLevel, to the
+   transformation a, b over the power-of-two square covering the
+   mw x mh map at level mLevel with offset (mxMin, myMin) */
+void AffineMap (double *a, double *b, int mLevel, int mw, int mh,
+		int mxMin, int myMin, MapElement *rmap, int *rLevel);
+
+/* FitMapList reads the file listName, which gives an input map and an
+   output map on each line, fits each input map with fit on nThreads
+   threads, and writes the output maps.  A line per map giving the
+   transformation is printed in list order as soon as it and all
+   maps before it are done.  kind names the transformation in
+   messages.  Returns the number of maps that could not be fitted,
+   or -1 (setting error) if the list could not be read. */
+int FitMapList (char *listName, FitFunction fit, char *kind,
+		int nThreads, char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BEST_FIT_H */
@@ -27,6 +27,7 @@
  *
  *  HISTORY
  *    2010  Written by Greg Hood (ghood@psc.edu)
+ *    2026  Weighted least-squares fit of best_fit.c; -list and -threads
  */
 
 #include <stdio.h>
@@ -39,47 +40,36 @@
 #include <math.h>
 #include <errno.h>
 
+#include "best_fit.h"
 #include "imio.h"
 
-#define LINE_LENGTH	255
-
 int
 main (int argc, char **argv)
 {
-  FILE *f;
   int mw, mh;
-  int ix, iy;
-  int x, y;
   int i;
+  int n;
   char msg[PATH_MAX + 1024];
   int mLevel;
   int mxMin, myMin;
   char imgName[PATH_MAX], refName[PATH_MAX];
-  int ix0, iy0;
-  double v;
   MapElement *map;
-  int mw1, mh1;
-  int n;
-  float xv, yv;
-  int mFactor;
   MapElement rmap[4];
-  double angleSum;
+  double a[3], b[3];
   double theta;
-  double ct, st;
-  double stx, sty;
-  double tx, ty;
-  double xp, yp;
-  double xMax, yMax;
   int rLevel;
-  int rFactor;
   int error;
+  int nThreads;
   char inputName[PATH_MAX];
   char outputName[PATH_MAX];
+  char listName[PATH_MAX];
   
   error = 0;
   inputName[0] = '\0';
   outputName[0] = '\0';
-  for (i = 0; i < argc; ++i)
+  listName[0] = '\0';
+  nThreads = 1;
+  for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-input") == 0)
       {
 	if (++i == argc)
@@ -100,6 +90,26 @@ main (int argc, char **argv)
 	  }
 	strcpy(outputName, argv[i]);
       }
+    else if (strcmp(argv[i], "-list") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-list error\n");
+	    break;
+	  }
+	strcpy(listName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-threads error\n");
+	    break;
+	  }
+      }
     else
       {
 	fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -112,8 +122,23 @@ main (int argc, char **argv)
 	fprintf(stderr, "Incomplete option: %s\n\n", argv[i-1]);
 
       fprintf(stderr, "Usage: best_rigid -input in.map -output out.map\n");
+      fprintf(stderr, "   or: best_rigid -list list_of_in_and_out_maps\n");
+      fprintf(stderr, "                  [-threads n]\n");
       exit(1);
     }
+
+  /* in list mode, fit every listed map */
+  if (listName[0] != '\0')
+    {
+      n = FitMapList(listName, FitRigid, "rigid", nThreads, msg);
+      if (n < 0)
+	{
+	  fprintf(stderr, "%s", msg);
+	  exit(1);
+	}
+      exit(n > 0 ? 1 : 0);
+    }
+
   if (inputName[0] == '\0' || outputName[0] == '\0')
     {
       fprintf(stderr, "Both -input and -output map files must be specified.\n");
@@ -129,84 +154,18 @@ main (int argc, char **argv)
 	      inputName, msg);
       exit(1);
     }
-  mFactor = 1 << mLevel;
 
-  /* go through all map points */
-  mw1 = mw - 1;
-  mh1 = mh - 1;
-  n = 0;
-  angleSum = 0.0;
-  for (y = 0; y < mh; ++y)
-    for (x = 0; x < mw; ++x)
-      {
-	if (map[y*mw+x].c == 0.0)
-	  continue;
-	if (x < mw1 && map[y*mw+x+1].c != 0.0)
-	  {
-	    angleSum += atan2(map[y*mw+x+1].y - map[y*mw+x].y,
-			      map[y*mw+x+1].x - map[y*mw+x].x);
-	    ++n;
-	  }
-	if (y < mh1 && map[(y+1)*mw+x].c != 0.0)
-	  {
-	    angleSum += atan2(map[(y+1)*mw+x].y - map[y*mw+x].y,
-			      map[(y+1)*mw+x].x - map[y*mw+x].x) - M_PI/2.0;
-	    ++n;
-	  }
-      }	
-  if (n == 0)
+  /* determine the rotation and translation */
+  if (!FitRigid(map, mLevel, mw, mh, mxMin, myMin, a, b))
     {
       fprintf(stderr, "No valid map points found.\n");
       exit(1);
     }
-  theta = angleSum / n;
-  ct = cos(theta);
-  st = sin(theta);
-
-  /* now determine translation */
-  stx = 0.0;
-  sty = 0.0;
-  n = 0;
-  for (y = 0; y < mh; ++y)
-    for (x = 0; x < mw; ++x)
-      {
-	if (map[y*mw+x].c == 0.0)
-	  continue;
-	xv = mFactor * (x + mxMin);
-	yv = mFactor * (y + myMin);
-	xp = ct * xv - st * yv;
-	yp = st * xv + ct * yv;
-	stx += mFactor * map[y*mw+x].x - xp;
-	sty += mFactor * map[y*mw+x].y - yp;
-	++n;
-      }
-  tx = stx / n;
-  ty = sty / n;
-
-  xMax = mFactor * (mw + mxMin);
-  yMax = mFactor * (mh + myMin);
-  rLevel = 0;
-  rFactor = 1;
-  while (xMax > rFactor || yMax > rFactor)
-    rFactor = 1 << (++rLevel);
-  xMax = rFactor;
-  yMax = rFactor;
-
-  rmap[0].x = tx / rFactor;
-  rmap[0].y = ty / rFactor;
-  rmap[0].c = 1.0;
-  rmap[1].x = (ct * xMax + tx) / rFactor;
-  rmap[1].y = (st * xMax + ty) / rFactor;
-  rmap[1].c = 1.0;
-  rmap[2].x = (-st * yMax + tx) / rFactor;
-  rmap[2].y = (ct * yMax + ty) / rFactor;
-  rmap[2].c = 1.0;
-  rmap[3].x = (ct * xMax - st * yMax + tx) / rFactor;
-  rmap[3].y = (st * xMax + ct * yMax + ty) / rFactor;
-  rmap[3].c = 1.0;
+  theta = atan2(b[1], a[1]);
+  AffineMap(a, b, mLevel, mw, mh, mxMin, myMin, rmap, &rLevel);
 
   printf("rigid transformation is theta = %f degrees  tx = %f  ty = %f\n",
-	 theta * 180.0 / M_PI, tx, ty);
+	 theta * 180.0 / M_PI, a[0], b[0]);
   
   /* write new map out */
   if (!WriteMap(outputName, rmap, rLevel, 2, 2, 0, 0,
@@ -220,4 +179,5 @@ main (int argc, char **argv)
 
   /* deallocate all map data structures */
   free(map);
+  return(0);
 }
@@ -0,0 +1,944 @@
+/*
+ * bitmap.c -- defines the operations on packed bitmap masks used by
+ *             combine_masks, reduce_mask, find_rst and register
+ *
+ *  Copyright (c) 2009-2026 Pittsburgh Supercomputing Center,
+ *                          Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Acknowledgements:
+ *     Development of this code was supported in part by
+ *       NIH NCRR grant 5P41RR006009
+ *
+ *  HISTORY
+ *    2009     CountBits and the mask loops written by Greg Hood
+ *               (ghood@psc.edu) in register.c, find_rst.c and
+ *               combine_masks.c
+ *    2026     Gathered here and made to work a word at a time;
+ *             connected components added for gen_mask
+ *    2026     GenerateMask moved here from gen_mask for ingest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cpu.h"
+#include "bitmap.h"
+
+static unsigned int Bits16 (unsigned char *row, int bpl, int start);
+static void SpreadRow (unsigned char *dst, unsigned char *src, int bpl,
+		       unsigned char lastMask, int all);
+static int FilterMask (unsigned char *src, int w, int h, int radius,
+		       unsigned char *dst, int all);
+static void *ComponentsThreadMain (void *arg);
+static void CountRuns (MaskComponents *mc, unsigned char *mask,
+		       int y0, int y1);
+static void FindRuns (MaskComponents *mc, unsigned char *mask,
+		      size_t *parent, int y0, int y1);
+static void JoinRows (MaskComponents *mc, size_t *parent, int y);
+static size_t FindRoot (size_t *parent, size_t i);
+
+typedef struct ComponentsBand
+{
+  pthread_t thread;
+  MaskComponents *mc;
+  unsigned char *mask;
+  size_t *parent;
+  int pass;		/* 0 to count the runs, 1 to find and join them */
+  int started;		/* whether thread was started */
+  int y0, y1;		/* the rows of this band are y0..y1-1 */
+} ComponentsBand;
+
+/* the bits 7, 5, 3 and 1 of a byte, packed into bits 3..0 */
+static const unsigned char oddBits[16] = {
+  0x0, 0x0, 0x1, 0x1, 0x0, 0x0, 0x1, 0x1,
+  0x2, 0x2, 0x3, 0x3, 0x2, 0x2, 0x3, 0x3
+};
+#define PACK_ODD_BITS(b)	((oddBits[(b) >> 4] << 2) | oddBits[(b) & 15])
+
+size_t
+CountBits (unsigned char *p, size_t n)
+{
+  size_t i = 0;
+  size_t sum = 0;
+  unsigned char b;
+#if defined(__GNUC__)
+  uint64_t w;
+
+  for (; i + 8 <= n; i += 8)
+    {
+      memcpy(&w, p + i, 8);
+      sum += __builtin_popcountll(w);
+    }
+#endif
+  for (; i < n; ++i)
+    for (b = p[i]; b != 0; b &= b - 1)
+      ++sum;
+  return(sum);
+}
+
+size_t
+CountIntersectionBits (unsigned char *p, unsigned char *q, size_t n)
+{
+  size_t i = 0;
+  size_t sum = 0;
+  unsigned char b;
+#if defined(__GNUC__)
+  uint64_t w, v;
+
+  for (; i + 8 <= n; i += 8)
+    {
+      memcpy(&w, p + i, 8);
+      memcpy(&v, q + i, 8);
+      sum += __builtin_popcountll(w & v);
+    }
+#endif
+  for (; i < n; ++i)
+    for (b = p[i] & q[i]; b != 0; b &= b - 1)
+      ++sum;
+  return(sum);
+}
+
+void
+AndMasks (unsigned char *dst, unsigned char *a, unsigned char *b, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  if (CpuHas(CPU_SSE2))
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i *) (dst + i),
+		       _mm_and_si128(_mm_loadu_si128((__m128i *) (a + i)),
+				     _mm_loadu_si128((__m128i *) (b + i))));
+#endif
+  for (; i < n; ++i)
+    dst[i] = a[i] & b[i];
+}
+
+void
+OrMasks (unsigned char *dst, unsigned char *a, unsigned char *b, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  if (CpuHas(CPU_SSE2))
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i *) (dst + i),
+		       _mm_or_si128(_mm_loadu_si128((__m128i *) (a + i)),
+				    _mm_loadu_si128((__m128i *) (b + i))));
+#endif
+  for (; i < n; ++i)
+    dst[i] = a[i] | b[i];
+}
+
+void
+InvertMask (unsigned char *dst, unsigned char *src, int w, int h)
+{
+  int bpl;
+  size_t n;
+  size_t i = 0;
+  int y;
+  unsigned char lastMask;
+#if defined(__SSE2__)
+  __m128i ones = _mm_set1_epi8((char) 0xff);
+#endif
+
+  bpl = (w + 7) >> 3;
+  n = ((size_t) h) * bpl;
+#if defined(__SSE2__)
+  if (CpuHas(CPU_SSE2))
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i *) (dst + i),
+		       _mm_xor_si128(_mm_loadu_si128((__m128i *) (src + i)),
+				     ones));
+#endif
+  for (; i < n; ++i)
+    dst[i] = ~src[i];
+
+  /* clear the padding bits again */
+  if ((w & 7) != 0)
+    {
+      lastMask = 0xff << (8 - (w & 7));
+      for (y = 0; y < h; ++y)
+	dst[((size_t) y) * bpl + bpl - 1] &= lastMask;
+    }
+}
+
+int
+ReduceMaskOr2x2 (unsigned char *src, int sw, int sh,
+		 int dx, int dy,
+		 unsigned char *dst, int dw, int dh)
+{
+  int sbpl, dbpl;
+  int x, y;
+  int sy;
+  int n;
+  unsigned int t;
+  unsigned char *row;
+  unsigned char *d;
+
+  sbpl = (sw + 7) >> 3;
+  dbpl = (dw + 7) >> 3;
+  memset(dst, 0, ((size_t) dh) * dbpl);
+  if (dw == 0 || sbpl == 0)
+    return(1);
+  row = (unsigned char *) malloc(sbpl);
+  if (row == NULL)
+    return(0);
+
+  for (y = 0; y < dh; ++y)
+    {
+      /* OR the two source rows of this output row together */
+      sy = 2 * y + dy;
+      n = 0;
+      if (sy >= 0 && sy < sh)
+	{
+	  memcpy(row, &src[((size_t) sy) * sbpl], sbpl);
+	  ++n;
+	}
+      if (sy + 1 >= 0 && sy + 1 < sh)
+	{
+	  if (n == 0)
+	    memcpy(row, &src[((size_t) (sy + 1)) * sbpl], sbpl);
+	  else
+	    OrMasks(row, row, &src[((size_t) (sy + 1)) * sbpl], sbpl);
+	  ++n;
+	}
+      if (n == 0)
+	continue;
+      if ((sw & 7) != 0)
+	row[sbpl-1] &= 0xff << (8 - (sw & 7));
+
+      /* each output byte comes from 16 bits of the combined row:
+	 OR each bit into its left neighbor, then keep every other one */
+      d = &dst[((size_t) y) * dbpl];
+      for (x = 0; x < dbpl; ++x)
+	{
+	  t = Bits16(row, sbpl, 16 * x + dx);
+	  t |= t << 1;
+	  d[x] = (PACK_ODD_BITS((t >> 8) & 0xff) << 4) |
+	    PACK_ODD_BITS(t & 0xff);
+	}
+      if ((dw & 7) != 0)
+	d[dbpl-1] &= 0xff << (8 - (dw & 7));
+    }
+  free(row);
+  return(1);
+}
+
+/* Bits16 returns the 16 bits of row starting at bit start (which may
+   lie outside the row), the first in bit 15; bits outside the row
+   are 0 */
+static unsigned int
+Bits16 (unsigned char *row, int bpl, int start)
+{
+  int b = start >> 3;
+  int o = start & 7;
+  unsigned int v;
+
+  if (b >= 0 && b + 2 < bpl)
+    v = (row[b] << 16) | (row[b+1] << 8) | row[b+2];
+  else
+    v = ((b >= 0 && b < bpl ? row[b] : 0) << 16) |
+      ((b + 1 >= 0 && b + 1 < bpl ? row[b+1] : 0) << 8) |
+      (b + 2 >= 0 && b + 2 < bpl ? row[b+2] : 0);
+  return((v >> (8 - o)) & 0xffff);
+}
+
+int
+DilateMask (unsigned char *src, int w, int h, int radius,
+	    unsigned char *dst)
+{
+  return(FilterMask(src, w, h, radius, dst, 0));
+}
+
+int
+ErodeMask (unsigned char *src, int w, int h, int radius,
+	   unsigned char *dst)
+{
+  return(FilterMask(src, w, h, radius, dst, 1));
+}
+
+/* SpreadRow sets each bit of the bpl-byte row dst to the OR (or, if
+   all is nonzero, the AND) of the bit of src and its two neighbors */
+static void
+SpreadRow (unsigned char *dst, unsigned char *src, int bpl,
+	   unsigned char lastMask, int all)
+{
+  int i;
+  unsigned char prev, next, left, right;
+
+  prev = 0;
+  for (i = 0; i < bpl; ++i)
+    {
+      next = i + 1 < bpl ? src[i+1] : 0;
+      left = (src[i] >> 1) | (prev << 7);
+      right = (src[i] << 1) | (next >> 7);
+      if (all)
+	dst[i] = src[i] & left & right;
+      else
+	dst[i] = src[i] | left | right;
+      prev = src[i];
+    }
+  dst[bpl-1] &= lastMask;
+}
+
+/* FilterMask does DilateMask (all == 0) or ErodeMask (all != 0) as a
+   horizontal pass, radius steps of one pixel along each row, followed
+   by a vertical one, combining the 2 radius + 1 rows around each
+   row */
+static int
+FilterMask (unsigned char *src, int w, int h, int radius,
+	    unsigned char *dst, int all)
+{
+  int bpl;
+  size_t n;
+  int y, yy;
+  int r;
+  unsigned char lastMask;
+  unsigned char *hbuf;
+  unsigned char *tmp;
+  unsigned char *a, *b, *t;
+  unsigned char *d;
+
+  bpl = (w + 7) >> 3;
+  n = ((size_t) h) * bpl;
+  if (radius <= 0 || n == 0)
+    {
+      memcpy(dst, src, n);
+      return(1);
+    }
+  hbuf = (unsigned char *) malloc(n);
+  tmp = (unsigned char *) malloc(bpl);
+  if (hbuf == NULL || tmp == NULL)
+    {
+      if (hbuf != NULL)
+	free(hbuf);
+      if (tmp != NULL)
+	free(tmp);
+      return(0);
+    }
+  lastMask = (w & 7) != 0 ? 0xff << (8 - (w & 7)) : 0xff;
+
+  for (y = 0; y < h; ++y)
+    {
+      a = &src[((size_t) y) * bpl];
+      b = &hbuf[((size_t) y) * bpl];
+      t = tmp;
+      /* alternate between hbuf and tmp so that the last pass writes
+	 into hbuf */
+      if ((radius & 1) == 0)
+	{
+	  t = b;
+	  b = tmp;
+	}
+      for (r = 0; r < radius; ++r)
+	{
+	  SpreadRow(b, a, bpl, lastMask, all);
+	  a = b;
+	  b = t;
+	  t = a;
+	}
+    }
+
+  for (y = 0; y < h; ++y)
+    {
+      d = &dst[((size_t) y) * bpl];
+      if (all && (y - radius < 0 || y + radius >= h))
+	{
+	  memset(d, 0, bpl);
+	  continue;
+	}
+      yy = y - radius >= 0 ? y - radius : 0;
+      memcpy(d, &hbuf[((size_t) yy) * bpl], bpl);
+      for (++yy; yy <= y + radius && yy < h; ++yy)
+	if (all)
+	  AndMasks(d, d, &hbuf[((size_t) yy) * bpl], bpl);
+	else
+	  OrMasks(d, d, &hbuf[((size_t) yy) * bpl], bpl);
+    }
+
+  free(hbuf);
+  free(tmp);
+  return(1);
+}
+
+void
+ErodeMask4 (unsigned char *src, int w, int h, unsigned char *dst)
+{
+  int bpl;
+  int i, y;
+  unsigned char lastMask;
+  unsigned char cur, prev, next, left, right;
+  unsigned char *a, *above, *below, *d;
+
+  bpl = (w + 7) >> 3;
+  if (bpl == 0)
+    return;
+  lastMask = (w & 7) != 0 ? 0xff << (8 - (w & 7)) : 0xff;
+  for (y = 0; y < h; ++y)
+    {
+      a = &src[((size_t) y) * bpl];
+      above = y > 0 ? a - bpl : NULL;
+      below = y < h - 1 ? a + bpl : NULL;
+      d = &dst[((size_t) y) * bpl];
+      /* the pixels beyond either end of the row count as set */
+      prev = 0xff;
+      for (i = 0; i < bpl; ++i)
+	{
+	  cur = a[i];
+	  if (i == bpl - 1)
+	    {
+	      cur |= ~lastMask;
+	      next = 0xff;
+	    }
+	  else if (i == bpl - 2)
+	    next = a[i+1] | ~lastMask;
+	  else
+	    next = a[i+1];
+	  left = (cur >> 1) | (prev << 7);
+	  right = (cur << 1) | (next >> 7);
+	  d[i] = cur & left & right;
+	  if (above != NULL)
+	    d[i] &= above[i];
+	  if (below != NULL)
+	    d[i] &= below[i];
+	  prev = cur;
+	}
+      d[bpl-1] &= lastMask;
+    }
+}
+
+void
+AndMask2x2 (unsigned char *src, int w, int h, unsigned char *dst)
+{
+  int bpl;
+  int i, y;
+  unsigned char lastMask;
+  unsigned char *a, *b, *d;
+  unsigned char pa, pb;
+
+  bpl = (w + 7) >> 3;
+  if (bpl == 0)
+    return;
+  lastMask = (w & 7) != 0 ? 0xff << (8 - (w & 7)) : 0xff;
+  for (y = 0; y < h; ++y)
+    {
+      a = &src[((size_t) y) * bpl];
+      b = a + bpl;
+      d = &dst[((size_t) y) * bpl];
+      if (y == h - 1)
+	{
+	  /* the row below is outside the bitmap */
+	  memset(d, 0, bpl);
+	  continue;
+	}
+      /* each pixel's right neighbor is the next lower bit; if dst is
+	 src, only the bytes already read are overwritten */
+      for (i = 0; i < bpl - 1; ++i)
+	{
+	  pa = a[i] & ((a[i] << 1) | (a[i+1] >> 7));
+	  pb = b[i] & ((b[i] << 1) | (b[i+1] >> 7));
+	  d[i] = pa & pb;
+	}
+      pa = a[i] & lastMask;
+      pb = b[i] & lastMask;
+      d[i] = pa & (pa << 1) & pb & (pb << 1);
+    }
+}
+
+void
+FillMaskRun (unsigned char *row, int x0, int x1, int set)
+{
+  int b0, b1;
+  unsigned char m0, m1;
+
+  if (x1 <= x0)
+    return;
+  b0 = x0 >> 3;
+  b1 = (x1 - 1) >> 3;
+  m0 = 0xff >> (x0 & 7);
+  m1 = 0xff << (7 - ((x1 - 1) & 7));
+  if (b0 == b1)
+    m0 &= m1;
+  if (set)
+    {
+      row[b0] |= m0;
+      if (b1 > b0)
+	{
+	  memset(&row[b0+1], 0xff, b1 - b0 - 1);
+	  row[b1] |= m1;
+	}
+    }
+  else
+    {
+      row[b0] &= ~m0;
+      if (b1 > b0)
+	{
+	  memset(&row[b0+1], 0, b1 - b0 - 1);
+	  row[b1] &= ~m1;
+	}
+    }
+}
+
+int
+CountMaskRun (unsigned char *row, int x0, int x1)
+{
+  int b0, b1;
+  unsigned char m0, m1;
+  unsigned char ends[2];
+
+  if (x1 <= x0)
+    return(0);
+  b0 = x0 >> 3;
+  b1 = (x1 - 1) >> 3;
+  m0 = 0xff >> (x0 & 7);
+  m1 = 0xff << (7 - ((x1 - 1) & 7));
+  if (b0 == b1)
+    {
+      ends[0] = row[b0] & m0 & m1;
+      return((int) CountBits(ends, 1));
+    }
+  ends[0] = row[b0] & m0;
+  ends[1] = row[b1] & m1;
+  return((int) (CountBits(ends, 2) + CountBits(&row[b0+1], b1 - b0 - 1)));
+}
+
+/* FindMaskComponents labels the runs of set bits with a union-find
+   over the runs: each band of rows is scanned by its own thread,
+   which joins each run to the overlapping runs of the row above
+   within the band; the rows on either side of each band boundary
+   are then joined, and the roots numbered in order.  Every join
+   links the later root to the earlier one, so the root of each
+   component is its first run in raster order. */
+MaskComponents*
+FindMaskComponents (unsigned char *mask, int w, int h, int nThreads)
+{
+  MaskComponents *mc;
+  ComponentsBand *bands;
+  size_t *parent;
+  size_t i, n;
+  int nBands;
+  int b, y;
+  int pass;
+
+  mc = (MaskComponents *) malloc(sizeof(MaskComponents));
+  if (mc == NULL)
+    return(NULL);
+  mc->w = w;
+  mc->h = h;
+  mc->nRuns = 0;
+  mc->x0 = NULL;
+  mc->x1 = NULL;
+  mc->label = NULL;
+  mc->nComponents = 0;
+  mc->rowStart = (size_t *) malloc((h + 1) * sizeof(size_t));
+  if (mc->rowStart == NULL)
+    {
+      free(mc);
+      return(NULL);
+    }
+
+  nBands = nThreads;
+  if (nBands > h / 16)
+    nBands = h / 16;
+  if (nBands < 1)
+    nBands = 1;
+  bands = (ComponentsBand *) malloc(nBands * sizeof(ComponentsBand));
+  if (bands == NULL)
+    {
+      FreeMaskComponents(mc);
+      return(NULL);
+    }
+  parent = NULL;
+  for (pass = 0; pass < 2; ++pass)
+    {
+      for (b = 0; b < nBands; ++b)
+	{
+	  bands[b].mc = mc;
+	  bands[b].mask = mask;
+	  bands[b].parent = parent;
+	  bands[b].pass = pass;
+	  bands[b].y0 = (int) (((long long) h) * b / nBands);
+	  bands[b].y1 = (int) (((long long) h) * (b + 1) / nBands);
+	}
+      for (b = 1; b < nBands; ++b)
+	{
+	  bands[b].started = pthread_create(&bands[b].thread, NULL,
+					    ComponentsThreadMain,
+					    &bands[b]) == 0;
+	  if (!bands[b].started)
+	    ComponentsThreadMain(&bands[b]);
+	}
+      ComponentsThreadMain(&bands[0]);
+      for (b = 1; b < nBands; ++b)
+	if (bands[b].started)
+	  pthread_join(bands[b].thread, NULL);
+
+      if (pass == 0)
+	{
+	  /* turn the counts of runs per row into starting indices */
+	  n = 0;
+	  for (y = 0; y < h; ++y)
+	    {
+	      i = mc->rowStart[y];
+	      mc->rowStart[y] = n;
+	      n += i;
+	    }
+	  mc->rowStart[h] = n;
+	  mc->nRuns = n;
+	  mc->x0 = (int *) malloc((n + 1) * sizeof(int));
+	  mc->x1 = (int *) malloc((n + 1) * sizeof(int));
+	  mc->label = (int *) malloc((n + 1) * sizeof(int));
+	  parent = (size_t *) malloc((n + 1) * sizeof(size_t));
+	  if (mc->x0 == NULL || mc->x1 == NULL || mc->label == NULL ||
+	      parent == NULL)
+	    {
+	      if (parent != NULL)
+		free(parent);
+	      free(bands);
+	      FreeMaskComponents(mc);
+	      return(NULL);
+	    }
+	}
+    }
+  free(bands);
+
+  for (b = 1; b < nBands; ++b)
+    JoinRows(mc, parent, (int) (((long long) h) * b / nBands));
+  for (i = 0; i < mc->nRuns; ++i)
+    if (parent[i] == i)
+      mc->label[i] = mc->nComponents++;
+    else
+      mc->label[i] = mc->label[FindRoot(parent, i)];
+  free(parent);
+  return(mc);
+}
+
+void
+FreeMaskComponents (MaskComponents *mc)
+{
+  if (mc->rowStart != NULL)
+    free(mc->rowStart);
+  if (mc->x0 != NULL)
+    free(mc->x0);
+  if (mc->x1 != NULL)
+    free(mc->x1);
+  if (mc->label != NULL)
+    free(mc->label);
+  free(mc);
+}
+
+static void *
+ComponentsThreadMain (void *arg)
+{
+  ComponentsBand *band = (ComponentsBand *) arg;
+  int y;
+
+  if (band->pass == 0)
+    CountRuns(band->mc, band->mask, band->y0, band->y1);
+  else
+    {
+      FindRuns(band->mc, band->mask, band->parent, band->y0, band->y1);
+      for (y = band->y0 + 1; y < band->y1; ++y)
+	JoinRows(band->mc, band->parent, y);
+    }
+  return(NULL);
+}
+
+/* CountRuns sets rowStart[y] to the number of runs in each row y of
+   y0..y1-1 */
+static void
+CountRuns (MaskComponents *mc, unsigned char *mask, int y0, int y1)
+{
+  int bpl;
+  int i, y;
+  size_t n;
+  unsigned char *row;
+  unsigned char b;
+
+  bpl = (mc->w + 7) >> 3;
+  for (y = y0; y < y1; ++y)
+    {
+      /* a run starts at each set bit whose left neighbor is clear */
+      row = &mask[((size_t) y) * bpl];
+      n = 0;
+      for (i = 0; i < bpl; ++i)
+	{
+	  b = row[i] & ~((row[i] >> 1) | (i > 0 ? row[i-1] << 7 : 0));
+	  for (; b != 0; b &= b - 1)
+	    ++n;
+	}
+      mc->rowStart[y] = n;
+    }
+}
+
+/* FindRuns fills in the runs of rows y0..y1-1, each its own root */
+static void
+FindRuns (MaskComponents *mc, unsigned char *mask, size_t *parent,
+	  int y0, int y1)
+{
+  int bpl;
+  int i, x, y;
+  int inRun;
+  size_t n;
+  unsigned char *row;
+  unsigned char b;
+
+  bpl = (mc->w + 7) >> 3;
+  for (y = y0; y < y1; ++y)
+    {
+      row = &mask[((size_t) y) * bpl];
+      n = mc->rowStart[y];
+      inRun = 0;
+      for (i = 0; i < bpl; ++i)
+	{
+	  b = row[i];
+	  /* skip over bytes that do not end or start a run */
+	  if (b == (inRun ? 0xff : 0))
+	    continue;
+	  for (x = 8 * i; x < 8 * i + 8; ++x, b <<= 1)
+	    if ((b & 0x80) != 0)
+	      {
+		if (!inRun)
+		  {
+		    mc->x0[n] = x;
+		    inRun = 1;
+		  }
+	      }
+	    else if (inRun)
+	      {
+		mc->x1[n] = x;
+		parent[n] = n;
+		++n;
+		inRun = 0;
+	      }
+	}
+      if (inRun)
+	{
+	  mc->x1[n] = mc->w;
+	  parent[n] = n;
+	}
+    }
+}
+
+/* JoinRows joins each run of row y with the runs of row y-1 that it
+   overlaps */
+static void
+JoinRows (MaskComponents *mc, size_t *parent, int y)
+{
+  size_t a, aEnd, b, bEnd;
+  size_t ra, rb;
+
+  a = mc->rowStart[y-1];
+  aEnd = mc->rowStart[y];
+  bEnd = mc->rowStart[y+1];
+  b = aEnd;
+  while (a < aEnd && b < bEnd)
+    {
+      if (mc->x0[a] < mc->x1[b] && mc->x0[b] < mc->x1[a])
+	{
+	  ra = FindRoot(parent, a);
+	  rb = FindRoot(parent, b);
+	  if (ra < rb)
+	    parent[rb] = ra;
+	  else if (rb < ra)
+	    parent[ra] = rb;
+	}
+      /* advance whichever run ends first */
+      if (mc->x1[a] < mc->x1[b])
+	++a;
+      else
+	++b;
+    }
+}
+
+static size_t
+FindRoot (size_t *parent, size_t i)
+{
+  while (parent[i] != i)
+    {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+  return(i);
+}
+
+unsigned char *
+GenerateMask (unsigned char *image, int w, int h,
+	      int method, int lowerThreshold, int upperThreshold,
+	      int erode, float clusterThreshold, int nThreads,
+	      int verbose)
+{
+  int i;
+  int x, y;
+  int bpl;
+  size_t r;
+  int count[256];
+  unsigned char *row;
+  unsigned char *newMask;
+  unsigned char *tmpMask;
+  unsigned char background = 0;
+  unsigned char *bitMask = 0;
+  MaskComponents *mc;
+  size_t *clusterCount = 0;
+  unsigned char *useCluster = 0;
+  size_t totalCount;
+
+  bpl = (w+7) >> 3;
+  bitMask = (unsigned char *) malloc(((size_t) h) * bpl);
+  if (bitMask == NULL)
+    return(NULL);
+  memset(bitMask, 0, ((size_t) h) * bpl);
+
+  if (method == MASK_THRESHOLD || method == MASK_RANGE)
+    {
+      for (y = 0; y < h; ++y)
+	{
+	  row = &bitMask[((size_t) y) * bpl];
+	  for (x = 0; x < w; ++x)
+	    {
+	      i = image[((size_t) y) * w + x];
+	      if (i >= lowerThreshold && i <= upperThreshold)
+		row[x >> 3] |= 0x80 >> (x & 7);
+	    }
+	}
+    }
+  else if (method == MASK_BOUNDARY_FILL)
+    {
+      memset(count, 0, 256 * sizeof(int));
+      for (x = 0; x < w; ++x)
+	{
+	  y = 0;
+	  ++count[image[((size_t) y)*w + x]];
+	  y = h-1;
+	  ++count[image[((size_t) y)*w + x]];
+	}
+      for (y = 1; y < h-1; ++y)
+	{
+	  x = 0;
+	  ++count[image[((size_t) y)*w + x]];
+	  x = w-1;
+	  ++count[image[((size_t) y)*w + x]];
+	}
+
+      /* find the most common value and consider that the background */
+      background = 0;
+      for (i = 1; i < 256; ++i)
+	if (count[i] > count[background])
+	  background = i;
+
+      /* clear the background-valued regions that are 4-connected to
+	 the perimeter: find the components of the background pixels,
+	 invert, and set again those components that have no run in
+	 the first or last row or column */
+      for (y = 0; y < h; ++y)
+	{
+	  row = &bitMask[((size_t) y) * bpl];
+	  for (x = 0; x < w; ++x)
+	    if (image[((size_t) y) * w + x] == background)
+	      row[x >> 3] |= 0x80 >> (x & 7);
+	}
+      mc = FindMaskComponents(bitMask, w, h, nThreads);
+      if (mc == NULL)
+	{
+	  free(bitMask);
+	  return(NULL);
+	}
+      useCluster = (unsigned char *) malloc(mc->nComponents + 1);
+      memset(useCluster, 0, mc->nComponents + 1);
+      for (y = 0; y < h; ++y)
+	for (r = mc->rowStart[y]; r < mc->rowStart[y+1]; ++r)
+	  if (y == 0 || y == h-1 || mc->x0[r] == 0 || mc->x1[r] == w)
+	    useCluster[mc->label[r]] = 1;
+      InvertMask(bitMask, bitMask, w, h);
+      for (y = 0; y < h; ++y)
+	for (r = mc->rowStart[y]; r < mc->rowStart[y+1]; ++r)
+	  if (!useCluster[mc->label[r]])
+	    FillMaskRun(&bitMask[((size_t) y) * bpl],
+			mc->x0[r], mc->x1[r], 1);
+      free(useCluster);
+      FreeMaskComponents(mc);
+    }
+
+  if (erode > 0)
+    {
+      newMask = (unsigned char *) malloc(((size_t) h) * bpl);
+      if (newMask == NULL)
+	{
+	  free(bitMask);
+	  return(NULL);
+	}
+    }
+  for (i = 0; i < erode; ++i)
+    {
+      ErodeMask4(bitMask, w, h, newMask);
+      tmpMask = bitMask;
+      bitMask = newMask;
+      newMask = tmpMask;
+    }
+  if (erode > 0)
+    free(newMask);
+
+  /* use only pixels from clusters that are bigger than the
+     given percentage threshold */
+  if (clusterThreshold > 0.0)
+    {
+      mc = FindMaskComponents(bitMask, w, h, nThreads);
+      if (mc == NULL)
+	{
+	  free(bitMask);
+	  return(NULL);
+	}
+      clusterCount = (size_t *) malloc((mc->nComponents + 1) *
+				       sizeof(size_t));
+      memset(clusterCount, 0, (mc->nComponents + 1) * sizeof(size_t));
+      useCluster = (unsigned char *) malloc(mc->nComponents + 1);
+      totalCount = 0;
+      for (r = 0; r < mc->nRuns; ++r)
+	{
+	  clusterCount[mc->label[r]] += mc->x1[r] - mc->x0[r];
+	  totalCount += mc->x1[r] - mc->x0[r];
+	}
+
+      for (i = 0; i < mc->nComponents; ++i)
+	{
+	  if (verbose)
+	    printf("Cluster %d has %zu elements\n", i, clusterCount[i]);
+	  useCluster[i] = (100.0 * clusterCount[i]) / totalCount >=
+	    clusterThreshold;
+	}
+
+      for (y = 0; y < h; ++y)
+	for (r = mc->rowStart[y]; r < mc->rowStart[y+1]; ++r)
+	  if (!useCluster[mc->label[r]])
+	    FillMaskRun(&bitMask[((size_t) y) * bpl],
+			mc->x0[r], mc->x1[r], 0);
+
+      free(useCluster);
+      free(clusterCount);
+      FreeMaskComponents(mc);
+    }
+  return(bitMask);
+}
@@ -0,0 +1,113 @@
+//
+// bitmap.h - functions operating on packed bitmap masks (rows padded
+//            to whole bytes, the leftmost pixel of each byte in its
+//            0x80 bit), shared by the mask tools, find_rst and
+//            register
+//
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CountBits returns the number of bits set in the n bytes at p, and
+   CountIntersectionBits the number set in both p and q */
+size_t CountBits (unsigned char *p, size_t n);
+size_t CountIntersectionBits (unsigned char *p, unsigned char *q, size_t n);
+
+/* AndMasks and OrMasks combine the n bytes of a and b into dst, which
+   may be either of them */
+void AndMasks (unsigned char *dst, unsigned char *a, unsigned char *b,
+	       size_t n);
+void OrMasks (unsigned char *dst, unsigned char *a, unsigned char *b,
+	      size_t n);
+
+/* InvertMask sets dst to the complement of the w x h bitmap src (dst
+   may be src), leaving the padding bits of each row clear */
+void InvertMask (unsigned char *dst, unsigned char *src, int w, int h);
+
+/* ReduceMaskOr2x2 sets bit (x, y) of the dw x dh bitmap dst if any of
+   the bits of the sw x sh bitmap src at columns 2x+dx..2x+dx+1 and
+   rows 2y+dy..2y+dy+1 that lie within src is set; returns 0 if it
+   could not allocate its working row */
+int ReduceMaskOr2x2 (unsigned char *src, int sw, int sh,
+		     int dx, int dy,
+		     unsigned char *dst, int dw, int dh);
+
+/* DilateMask sets each bit of the w x h bitmap dst if any bit of src
+   within the (2 radius + 1) square around it is set, and ErodeMask if
+   all of them are, counting pixels outside the bitmap as clear; dst
+   must not be src; both return 0 if they could not allocate their
+   working arrays */
+int DilateMask (unsigned char *src, int w, int h, int radius,
+		unsigned char *dst);
+int ErodeMask (unsigned char *src, int w, int h, int radius,
+	       unsigned char *dst);
+
+/* ErodeMask4 does one step of erosion of the w x h bitmap src into dst
+   (which must not be src), clearing each bit that has a clear
+   neighbor to the left, right, above or below; pixels outside the
+   bitmap count as set */
+void ErodeMask4 (unsigned char *src, int w, int h, unsigned char *dst);
+
+/* AndMask2x2 sets each bit (x, y) of the w x h bitmap dst if bits
+   (x, y), (x+1, y), (x, y+1) and (x+1, y+1) of src are all set, i.e.
+   if a bilinear sample in the square to the lower right of pixel
+   (x, y) only touches set pixels, counting pixels outside the bitmap
+   as clear; dst may be src */
+void AndMask2x2 (unsigned char *src, int w, int h, unsigned char *dst);
+
+/* FillMaskRun sets (or, if set is 0, clears) bits x0..x1-1 of row,
+   and CountMaskRun returns how many of them are set */
+void FillMaskRun (unsigned char *row, int x0, int x1, int set);
+int CountMaskRun (unsigned char *row, int x0, int x1);
+
+/* the runs of set bits of a bitmap, grouped into 4-connected components */
+typedef struct MaskComponents
+{
+  int w, h;
+  size_t nRuns;
+  size_t *rowStart;	/* the runs of row y are rowStart[y] up to
+			   rowStart[y+1]-1 */
+  int *x0, *x1;		/* each run covers columns x0..x1-1 */
+  int *label;		/* the component of each run; components are
+			   numbered from 0 in the raster order of their
+			   first pixel */
+  int nComponents;
+} MaskComponents;
+
+/* FindMaskComponents finds the 4-connected components of the set bits
+   of the w x h bitmap mask, working on bands of rows with up to
+   nThreads threads; returns NULL if it could not allocate its arrays */
+MaskComponents* FindMaskComponents (unsigned char *mask, int w, int h,
+				    int nThreads);
+void FreeMaskComponents (MaskComponents *mc);
+
+/* the ways GenerateMask can choose the pixels of an image to set */
+#define MASK_THRESHOLD		0	/* within the range of values */
+#define MASK_RANGE		1	/* the same */
+#define MASK_BOUNDARY_FILL	2	/* all but the regions of the most
+					   common edge value that touch
+					   the edge */
+
+/* GenerateMask returns the w x h bitmap (allocated with malloc) of the
+   pixels of image that are in lowerThreshold..upperThreshold, or not
+   in the background (see MASK_BOUNDARY_FILL), eroded erode times by
+   ErodeMask4, and keeping only the 4-connected components that hold at
+   least clusterThreshold percent of the set pixels if that is above 0
+   (printing the size of each if verbose); it is the mask gen_mask
+   writes.  Returns NULL if it could not allocate its arrays. */
+unsigned char* GenerateMask (unsigned char *image, int w, int h,
+			     int method,
+			     int lowerThreshold, int upperThreshold,
+			     int erode, float clusterThreshold,
+			     int nThreads, int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BITMAP_H */
@@ -0,0 +1,150 @@
+#!/bin/bash
+#
+# bench.sh - times the AlignTK pipeline on a synthetic dataset
+#
+# Usage: ./bench.sh [-size <width>[x<height>]] [-sections <int>]
+#                   [-threads <int>] [-memory <MB>] [-seed <int>]
+#                   [-report report.json]
+#
+# gen_sections writes the sections into bench/images/, and find_rst,
+# register, align, apply_map, gen_imaps and ortho are then run on them
+# in turn, each through bench_stage, which records its wall time, CPU
+# time, peak RSS and I/O bytes.  The report (bench/report.json by
+# default) is a JSON object holding the parameters of the run and a
+# list with one entry per stage, so that runs of different releases
+# can be compared.  Set MPIRUN (e.g. to "mpirun -np 4") to run the MPI
+# stages under it.
+
+size=2048
+sections=8
+threads=1
+memory=1000
+seed=1
+report=""
+
+while (($# > 0)); do
+    case "$1" in
+	-size) size="$2"; shift 2 ;;
+	-sections) sections="$2"; shift 2 ;;
+	-threads) threads="$2"; shift 2 ;;
+	-memory) memory="$2"; shift 2 ;;
+	-seed) seed="$2"; shift 2 ;;
+	-report) report="$2"; shift 2 ;;
+	*) echo "Invalid option: $1"
+	   echo "Usage: ./bench.sh [-size <width>[x<height>]] [-sections <int>]"
+	   echo "                  [-threads <int>] [-memory <MB>] [-seed <int>]"
+	   echo "                  [-report report.json]"
+	   exit 1 ;;
+    esac
+done
+
+width=${size%x*}
+height=${size#*x}
+top=`pwd`
+if [ -z "$report" ]; then
+    report="$top/bench/report.json"
+fi
+case "$report" in
+    /*) ;;
+    *) report="$top/$report" ;;
+esac
+
+echo "Benchmarking AlignTK on $sections sections of ${width}x${height}..."
+
+rm -rf bench
+mkdir -p bench/images bench/logs bench/cmaps bench/maps bench/amaps \
+    bench/aligned bench/imaps bench/aligned_yz
+cd bench
+stages="$top/bench/stages.json"
+rm -f "$stages"
+
+# gen_sections names the images z00, z01, ... with as many digits as
+# the last one needs
+digits=2
+n=100
+while ((n < sections)); do
+    digits=$((digits + 1))
+    n=$((n * 10))
+done
+rm -f images.lst pairs.lst maps.lst
+for ((i = 0; i < sections; ++i)); do
+    printf "z%0${digits}d\n" $i >>images.lst
+    if ((i > 0)); then
+	printf "z%0${digits}d z%0${digits}d z%0${digits}d_z%0${digits}d\n" \
+	    $((i - 1)) $i $((i - 1)) $i >>pairs.lst
+    fi
+done
+cp pairs.lst maps.lst
+fixed=`sed -n "$((sections / 2 + 1))p" images.lst`
+
+# the sections are displaced by up to 2% of their size, so find_rst
+# searches a little beyond that
+range=$(( (width > height ? width : height) / 25 + 10 ))
+
+errors=0
+run () {
+    name=$1
+    shift
+    echo ""
+    echo "Running $name"
+    if ! ../bench_stage -name $name -report "$stages" -log logs/$name.out "$@"
+    then
+	echo "$name failed (see bench/logs/$name.out)."
+	errors=1
+    fi
+}
+
+run gen_sections ../gen_sections -output images/ -size ${width}x${height} \
+    -sections $sections -seed $seed
+((errors == 0)) && run find_rst $MPIRUN ../../find_rst -pairs pairs.lst \
+    -tif -images images/ -output cmaps/ -max_res 1024 -scale 1.0 \
+    -tx -$range-$range -ty -$range-$range -summary cmaps/summary.out
+((errors == 0)) && run register $MPIRUN ../../register -pairs pairs.lst \
+    -images images/ -tif -output maps/ -distortion 2.0 -output_level 6 \
+    -depth 6 -quality 0.5 -summary maps/summary.out -initial_map cmaps/ \
+    -threads $threads
+((errors == 0)) && run align $MPIRUN ../../align -images images/ \
+    -image_list images.lst -map_list maps.lst -maps maps/ -output amaps/ \
+    -schedule ../schedule.lst -incremental -fixed $fixed -font ../../font.pgm
+((errors == 0)) && run apply_map $MPIRUN ../../apply_map \
+    -image_list images.lst -images images/ -maps amaps/ -output aligned/ \
+    -memory $memory -font ../../font.pgm
+((errors == 0)) && run gen_imaps $MPIRUN ../../gen_imaps \
+    -image_list images.lst -images aligned/ -output imaps/ \
+    -threads $threads
+((errors == 0)) && run ortho $MPIRUN ../../ortho -input aligned/ \
+    -image_list images.lst -output aligned_yz/x -format z%d \
+    -memory $memory -yz_images -x $((width / 2))
+
+# gather the stages into the report
+{
+    echo "{"
+    echo "  \"date\": \"`date -u +%Y-%m-%dT%H:%M:%SZ`\","
+    echo "  \"host\": \"`uname -n`\","
+    echo "  \"cpus\": `getconf _NPROCESSORS_ONLN`,"
+    echo "  \"mpirun\": \"$MPIRUN\","
+    echo "  \"width\": $width,"
+    echo "  \"height\": $height,"
+    echo "  \"sections\": $sections,"
+    echo "  \"threads\": $threads,"
+    echo "  \"memory_mb\": $memory,"
+    echo "  \"seed\": $seed,"
+    echo "  \"stages\": ["
+    sed -e 's/^/    /' -e '$!s/$/,/' "$stages"
+    echo "  ]"
+    echo "}"
+} >"$report"
+
+echo ""
+printf "%-14s %6s %10s %10s %10s %12s %12s\n" stage status wall user \
+    system "max RSS(KB)" "I/O (MB)"
+sed -e 's/[{}",:]/ /g' "$stages" | awk '{
+    printf "%-14s %6d %10.2f %10.2f %10.2f %12d %12.1f\n",
+	$2, $4, $6, $8, $10, $12, ($14 + $16) / 1048576.0 }'
+echo ""
+echo "Report written to $report"
+if ((errors > 0)); then
+    echo "Errors detected during the benchmark"
+    exit 1
+fi
+exit 0
@@ -0,0 +1,771 @@
+/*
+ *  bench_kernels.c  -  times the inner kernels of AlignTK in isolation
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Each kernel is run -repeat times on synthetic data of -size pixels
+   square, and the fastest, median and mean times are printed, along
+   with the rate in megapixels (or, for Invert, lookups) per second of
+   the fastest run; with -report the same figures are appended to a
+   file as one JSON object per line, like those bench_stage writes.
+   The kernels are:
+     imio         WriteImage and ReadImage for each format and
+                  compression
+     invert       InvertMap (with -threads threads) and Invert
+     dt           computeDistance for each distance type
+     warp         ComputeWarpedImage
+     correlation  ComputeCorrelation and ComputeBoxCorrelation
+     forces       align's force loop, as reported by align -timing
+                  on a synthetic stack of -sections sections
+   All but forces are run unless -kernel names some of them. */
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "imio.h"
+#include "invert.h"
+#include "dt.h"
+#include "correlation.h"
+
+#define LINE_LENGTH	256
+#define MAX_REPEATS	1000
+
+typedef struct Format
+{
+  char *name;
+  char *extension;
+  enum ImageCompression compression;
+} Format;
+
+Format formats[] = {
+  { "tif", "tif", UncompressedImage },
+  { "tif_hdiff_deflate", "tif", HDiffDeflateImage },
+  { "tif_hdiff_lzw", "tif", HDiffLzwImage },
+  { "tif_hdiff_zstd", "tif", HDiffZstdImage },
+  { "pgm", "pgm", UncompressedImage },
+  { "jpg90", "jpg", JpegQuality90 }
+};
+#define N_FORMATS	(sizeof(formats) / sizeof(Format))
+
+int size = 2048;
+int nRepeats = 5;
+int nThreads = 1;
+int halfWidth = 16;
+int nSections = 8;
+int forceLevel = 4;
+char scratchName[PATH_MAX];
+char alignName[PATH_MAX];
+char reportName[PATH_MAX];
+double times[MAX_REPEATS];
+
+double Now ();
+void Report (char *kernel, char *variant, double units, char *unitName);
+unsigned char *SyntheticImage (int w, int h);
+MapElement *SyntheticMap (int mw, int mh, double amplitude);
+void BenchImio ();
+void BenchInvert ();
+void BenchDt ();
+void BenchWarp ();
+void BenchCorrelation ();
+void BenchForces ();
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int error;
+  char kernels[LINE_LENGTH];
+
+  error = 0;
+  kernels[0] = '\0';
+  strcpy(scratchName, "bench_kernels.tmp");
+  strcpy(alignName, "../align");
+  reportName[0] = '\0';
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-kernel") == 0)
+      {
+	if (++i == argc ||
+	    strlen(kernels) + strlen(argv[i]) + 2 >= LINE_LENGTH)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcat(kernels, " ");
+	strcat(kernels, argv[i]);
+      }
+    else if (strcmp(argv[i], "-size") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &size) != 1 || size < 16)
+	  {
+	    fprintf(stderr, "-size error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-repeat") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nRepeats) != 1 ||
+	    nRepeats < 1 || nRepeats > MAX_REPEATS)
+	  {
+	    fprintf(stderr, "-repeat error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    fprintf(stderr, "-threads error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-hw") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &halfWidth) != 1 ||
+	    halfWidth < 1)
+	  {
+	    fprintf(stderr, "-hw error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-sections") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nSections) != 1 ||
+	    nSections < 2)
+	  {
+	    fprintf(stderr, "-sections error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-level") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &forceLevel) != 1 ||
+	    forceLevel < 0 || (size >> forceLevel) < 2)
+	  {
+	    fprintf(stderr, "-level error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-scratch") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(scratchName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-align") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(alignName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-report") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(reportName, argv[i]);
+      }
+    else
+      {
+	error = 1;
+	break;
+      }
+
+  if (error)
+    {
+      if (i < argc)
+        fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      else
+        fprintf(stderr, "Incomplete option: %s\n", argv[i-1]);
+      fprintf(stderr, "\n");
+
+      fprintf(stderr, "Usage: bench_kernels [-kernel imio|invert|dt|warp|correlation|forces]...\n");
+      fprintf(stderr, "                     [-size <int>]\n");
+      fprintf(stderr, "                     [-repeat <int>]\n");
+      fprintf(stderr, "                     [-threads <int>]\n");
+      fprintf(stderr, "                     [-hw correlation_half_width]\n");
+      fprintf(stderr, "                     [-sections <int>]\n");
+      fprintf(stderr, "                     [-level force_loop_level]\n");
+      fprintf(stderr, "                     [-scratch scratch_directory]\n");
+      fprintf(stderr, "                     [-align align_executable]\n");
+      fprintf(stderr, "                     [-report report_file]\n");
+      exit(1);
+    }
+
+  if (mkdir(scratchName, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create scratch directory %s\n",
+	      scratchName);
+      exit(1);
+    }
+
+  strcat(kernels, " ");
+  if (kernels[1] == '\0' || strstr(kernels, " imio ") != NULL)
+    BenchImio();
+  if (kernels[1] == '\0' || strstr(kernels, " invert ") != NULL)
+    BenchInvert();
+  if (kernels[1] == '\0' || strstr(kernels, " dt ") != NULL)
+    BenchDt();
+  if (kernels[1] == '\0' || strstr(kernels, " warp ") != NULL)
+    BenchWarp();
+  if (kernels[1] == '\0' || strstr(kernels, " correlation ") != NULL)
+    BenchCorrelation();
+  if (strstr(kernels, " forces ") != NULL)
+    BenchForces();
+  return(0);
+}
+
+double
+Now ()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 0.000001 * tv.tv_usec);
+}
+
+int
+CompareDoubles (const void *a, const void *b)
+{
+  double da = *((double *) a);
+  double db = *((double *) b);
+
+  return(da < db ? -1 : (da > db ? 1 : 0));
+}
+
+/* Report prints the fastest, median and mean of the nRepeats times,
+   and the rate of the fastest in millions of unitName per second,
+   given that each run handled units of them */
+void
+Report (char *kernel, char *variant, double units, char *unitName)
+{
+  int i;
+  double mean, median, rate;
+  FILE *f;
+
+  mean = 0.0;
+  for (i = 0; i < nRepeats; ++i)
+    mean += times[i];
+  mean /= nRepeats;
+  qsort(times, nRepeats, sizeof(double), CompareDoubles);
+  median = (nRepeats & 1) ? times[nRepeats / 2] :
+    0.5 * (times[nRepeats / 2 - 1] + times[nRepeats / 2]);
+  rate = times[0] > 0.0 ? 0.000001 * units / times[0] : 0.0;
+  printf("%-12s %-24s min %10.6f s  median %10.6f s  mean %10.6f s  %9.2f M%s/s\n",
+	 kernel, variant, times[0], median, mean, rate, unitName);
+  fflush(stdout);
+
+  if (reportName[0] == '\0')
+    return;
+  f = fopen(reportName, "a");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open report file %s\n", reportName);
+      exit(1);
+    }
+  fprintf(f, "{\"kernel\": \"%s\", \"variant\": \"%s\", \"size\": %d, "
+	  "\"threads\": %d, \"repeats\": %d, \"min_seconds\": %.6f, "
+	  "\"median_seconds\": %.6f, \"mean_seconds\": %.6f, "
+	  "\"rate\": %.3f, \"rate_unit\": \"M%s/s\"}\n",
+	  kernel, variant, size, nThreads, nRepeats,
+	  times[0], median, mean, rate, unitName);
+  fclose(f);
+}
+
+/* SyntheticImage returns a w x h image of smooth structure plus noise,
+   which compresses about as well as a real section */
+unsigned char *
+SyntheticImage (int w, int h)
+{
+  unsigned char *image;
+  int x, y;
+  double v;
+
+  image = (unsigned char *) malloc(((size_t) w) * h);
+  srand(1);
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      {
+	v = 128.0 + 60.0 * sin(0.031 * x + 0.7 * sin(0.017 * y)) *
+	  cos(0.023 * y + 0.5 * sin(0.011 * x)) + (rand() % 33) - 16;
+	image[((size_t) y) * w + x] = (unsigned char) (v < 0.0 ? 0.0 :
+						       (v > 255.0 ? 255.0 : v));
+      }
+  return(image);
+}
+
+/* SyntheticMap returns an mw x mh map that displaces each element by a
+   smooth warp of up to amplitude elements */
+MapElement *
+SyntheticMap (int mw, int mh, double amplitude)
+{
+  MapElement *map;
+  int x, y;
+
+  map = (MapElement *) malloc(((size_t) mw) * mh * sizeof(MapElement));
+  for (y = 0; y < mh; ++y)
+    for (x = 0; x < mw; ++x)
+      {
+	map[y*mw+x].x = x + amplitude * sin(2.0 * M_PI * y / mh);
+	map[y*mw+x].y = y + amplitude * sin(2.0 * M_PI * x / mw);
+	map[y*mw+x].c = 1.0;
+      }
+  return(map);
+}
+
+void
+BenchImio ()
+{
+  int i, r;
+  unsigned char *image;
+  unsigned char *input;
+  int w, h;
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  char variant[LINE_LENGTH];
+  double t;
+
+  image = SyntheticImage(size, size);
+  for (i = 0; i < N_FORMATS; ++i)
+    {
+      sprintf(fn, "%s/imio.%s", scratchName, formats[i].extension);
+      for (r = 0; r < nRepeats; ++r)
+	{
+	  t = Now();
+	  if (!WriteImage(fn, image, size, size, formats[i].compression, msg))
+	    break;
+	  times[r] = Now() - t;
+	}
+      if (r < nRepeats)
+	{
+	  printf("%-12s %-24s not supported: %s", "imio", formats[i].name,
+		 msg);
+	  continue;
+	}
+      sprintf(variant, "write_%s", formats[i].name);
+      Report("imio", variant, ((double) size) * size, "pixel");
+
+      for (r = 0; r < nRepeats; ++r)
+	{
+	  t = Now();
+	  if (!ReadImage(fn, &input, &w, &h, -1, -1, -1, -1, msg))
+	    {
+	      fprintf(stderr, "Could not read image %s:\n%s\n", fn, msg);
+	      exit(1);
+	    }
+	  times[r] = Now() - t;
+	  free(input);
+	}
+      sprintf(variant, "read_%s", formats[i].name);
+      Report("imio", variant, ((double) size) * size, "pixel");
+      unlink(fn);
+    }
+  free(image);
+}
+
+void
+BenchInvert ()
+{
+  int mw, r;
+  int i, n;
+  MapElement *map;
+  InverseMap *inverseMap;
+  float x, y;
+  double t;
+  unsigned short xsubi[3];
+
+  /* a map at the 64-pixel spacing register writes */
+  mw = size / 64 + 1;
+  map = SyntheticMap(mw, mw, 1.5);
+  for (r = 0; r < nRepeats; ++r)
+    {
+      t = Now();
+      inverseMap = InvertMapThreads(map, mw, mw, nThreads);
+      times[r] = Now() - t;
+      FreeInverseMap(inverseMap);
+    }
+  Report("invert", "InvertMap", ((double) mw) * mw, "element");
+
+  /* look up the inverse at as many random points as the image has
+     pixels, divided by 16 */
+  inverseMap = InvertMapThreads(map, mw, mw, nThreads);
+  n = (int) (((double) size) * size / 16);
+  for (r = 0; r < nRepeats; ++r)
+    {
+      xsubi[0] = 1;
+      xsubi[1] = 2;
+      xsubi[2] = 3;
+      t = Now();
+      for (i = 0; i < n; ++i)
+	Invert(inverseMap, &x, &y,
+	       2.0 + (mw - 5) * erand48(xsubi),
+	       2.0 + (mw - 5) * erand48(xsubi));
+      times[r] = Now() - t;
+    }
+  Report("invert", "Invert", (double) n, "lookup");
+  FreeInverseMap(inverseMap);
+  free(map);
+}
+
+void
+BenchDt ()
+{
+  static char *typeNames[4] = { "euclidean", "euclidean_squared",
+				"manhattan", "chessboard" };
+  int type, r;
+  int bpl;
+  int x, y;
+  unsigned char *mask;
+  float *dist;
+  double t;
+  char variant[LINE_LENGTH];
+
+  /* a mask with scattered holes and a large unmasked disc, so that
+     the distances range widely */
+  bpl = (size + 7) >> 3;
+  mask = (unsigned char *) malloc(((size_t) bpl) * size);
+  memset(mask, 0xff, ((size_t) bpl) * size);
+  srand(1);
+  for (y = 0; y < size; ++y)
+    for (x = 0; x < size; ++x)
+      if (rand() % 997 == 0 ||
+	  (x - size / 2) * (x - size / 2) + (y - size / 2) * (y - size / 2)
+	  < size * size / 16)
+	mask[y*bpl + (x >> 3)] &= ~(0x80 >> (x & 7));
+  dist = (float *) malloc(((size_t) size) * size * sizeof(float));
+  for (type = 0; type < 4; ++type)
+    {
+      for (r = 0; r < nRepeats; ++r)
+	{
+	  t = Now();
+	  if (nThreads > 1)
+	    computeDistanceThreaded(type, size, size, mask, dist, nThreads);
+	  else
+	    computeDistance(type, size, size, mask, dist);
+	  times[r] = Now() - t;
+	}
+      sprintf(variant, "%s", typeNames[type]);
+      Report("dt", variant, ((double) size) * size, "pixel");
+    }
+  free(dist);
+  free(mask);
+}
+
+void
+BenchWarp ()
+{
+  int mw, r;
+  size_t i, n;
+  unsigned char *image;
+  float *reference;
+  float *warped;
+  unsigned char *valid;
+  MapElement *map;
+  double t;
+
+  n = ((size_t) size) * size;
+  image = SyntheticImage(size, size);
+  reference = (float *) malloc(n * sizeof(float));
+  for (i = 0; i < n; ++i)
+    reference[i] = image[i];
+  free(image);
+  warped = (float *) malloc(n * sizeof(float));
+  valid = (unsigned char *) malloc(n);
+  mw = size / 64 + 2;
+  map = SyntheticMap(mw, mw, 0.5);
+  for (r = 0; r < nRepeats; ++r)
+    {
+      t = Now();
+      if (!ComputeWarpedImage(warped, valid, size, size, 0, 0,
+			      reference, NULL, size, size, 0, 0,
+			      map, 64.0, mw, mw, 0, 0))
+	{
+	  fprintf(stderr, "ComputeWarpedImage could not allocate its arrays\n");
+	  exit(1);
+	}
+      times[r] = Now() - t;
+    }
+  Report("warp", "ComputeWarpedImage", (double) n, "pixel");
+  free(map);
+  free(valid);
+  free(warped);
+  free(reference);
+}
+
+void
+BenchCorrelation ()
+{
+  int r;
+  size_t i, n;
+  unsigned char *image;
+  float *a, *b, *correlation;
+  unsigned char *valid;
+  double t;
+  char variant[LINE_LENGTH];
+
+  n = ((size_t) size) * size;
+  image = SyntheticImage(size, size);
+  a = (float *) malloc(n * sizeof(float));
+  b = (float *) malloc(n * sizeof(float));
+  correlation = (float *) malloc(n * sizeof(float));
+  valid = (unsigned char *) malloc(n);
+  srand(2);
+  for (i = 0; i < n; ++i)
+    {
+      a[i] = image[i];
+      b[i] = image[i] + (rand() % 17) - 8;
+      valid[i] = (i % size) >= 8;
+    }
+  free(image);
+
+  for (r = 0; r < nRepeats; ++r)
+    {
+      t = Now();
+      if (!ComputeCorrelation(correlation, a, b, valid, size, size,
+			      halfWidth))
+	{
+	  fprintf(stderr, "ComputeCorrelation could not allocate its arrays\n");
+	  exit(1);
+	}
+      times[r] = Now() - t;
+    }
+  sprintf(variant, "disc_hw%d", halfWidth);
+  Report("correlation", variant, (double) n, "pixel");
+
+  for (r = 0; r < nRepeats; ++r)
+    {
+      t = Now();
+      if (!ComputeBoxCorrelation(correlation, a, b, valid, size, size,
+				 halfWidth))
+	{
+	  fprintf(stderr, "ComputeBoxCorrelation could not allocate its arrays\n");
+	  exit(1);
+	}
+      times[r] = Now() - t;
+    }
+  sprintf(variant, "box_hw%d", halfWidth);
+  Report("correlation", variant, (double) n, "pixel");
+
+  free(valid);
+  free(correlation);
+  free(b);
+  free(a);
+}
+
+/* BenchForces writes a stack of nSections blank sections with warped
+   maps between neighbors at level forceLevel, runs align -timing on
+   them nRepeats times with a single step at that level, and reports
+   the time per iteration of the force loop; align is run in the
+   scratch directory, where it writes its logs/ */
+void
+BenchForces ()
+{
+  int s, r;
+  int mw;
+  int nIter;
+  int status;
+  int argc;
+  int digits;
+  char *argv[32];
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  char line[LINE_LENGTH];
+  char variant[LINE_LENGTH];
+  char imageList[PATH_MAX], mapList[PATH_MAX], scheduleName[PATH_MAX];
+  char logName[PATH_MAX], fixedName[LINE_LENGTH];
+  char alignPath[PATH_MAX], fontName[PATH_MAX];
+  char threadsArg[LINE_LENGTH];
+  char *slash;
+  char name0[LINE_LENGTH], name1[LINE_LENGTH];
+  unsigned char *image;
+  MapElement *map;
+  FILE *f, *fl;
+  pid_t pid;
+  double seconds, usPerIter;
+
+  sprintf(imageList, "%s/images.lst", scratchName);
+  sprintf(mapList, "%s/maps.lst", scratchName);
+  sprintf(scheduleName, "%s/schedule.lst", scratchName);
+  sprintf(logName, "%s/align.out", scratchName);
+  sprintf(fn, "%s/logs", scratchName);
+  if (mkdir(fn, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create directory %s\n", fn);
+      exit(1);
+    }
+
+  digits = nSections > 100 ? (int) ceil(log10(nSections)) : 2;
+  image = (unsigned char *) malloc(((size_t) size) * size);
+  memset(image, 128, ((size_t) size) * size);
+  mw = (size >> forceLevel) + 1;
+  map = SyntheticMap(mw, mw, 0.5);
+  f = fopen(imageList, "w");
+  fl = fopen(mapList, "w");
+  if (f == NULL || fl == NULL)
+    {
+      fprintf(stderr, "Could not write the lists in %s\n", scratchName);
+      exit(1);
+    }
+  for (s = 0; s < nSections; ++s)
+    {
+      sprintf(name1, "z%0*d", digits, s);
+      fprintf(f, "%s\n", name1);
+      sprintf(fn, "%s/%s.pgm", scratchName, name1);
+      if (!WriteImage(fn, image, size, size, UncompressedImage, msg))
+	{
+	  fprintf(stderr, "Could not write image %s:\n%s\n", fn, msg);
+	  exit(1);
+	}
+      if (s > 0)
+	{
+	  fprintf(fl, "%s %s %s_%s\n", name0, name1, name0, name1);
+	  sprintf(fn, "%s/%s_%s.map", scratchName, name0, name1);
+	  if (!WriteMap(fn, map, forceLevel, mw, mw, 0, 0, name0, name1,
+			UncompressedMap, msg))
+	    {
+	      fprintf(stderr, "Could not write map %s:\n%s\n", fn, msg);
+	      exit(1);
+	    }
+	}
+      if (s == nSections / 2)
+	strcpy(fixedName, name1);
+      strcpy(name0, name1);
+    }
+  fclose(f);
+  fclose(fl);
+  free(image);
+  free(map);
+
+  f = fopen(scheduleName, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not write %s\n", scheduleName);
+      exit(1);
+    }
+  fprintf(f, "%d 1.0 0.1\n", forceLevel);
+  fclose(f);
+
+  /* align is given the font that sits beside it in the source tree,
+     unless it is to be found on the PATH */
+  fontName[0] = '\0';
+  strcpy(alignPath, alignName);
+  if (strchr(alignName, '/') != NULL)
+    {
+      if (realpath(alignName, alignPath) == NULL)
+	{
+	  fprintf(stderr, "Could not find %s\n", alignName);
+	  exit(1);
+	}
+      strcpy(fontName, alignPath);
+      slash = strrchr(fontName, '/');
+      strcpy(slash + 1, "font.pgm");
+    }
+
+  sprintf(threadsArg, "%d", nThreads);
+  argc = 0;
+  argv[argc++] = alignPath;
+  argv[argc++] = "-images";
+  argv[argc++] = "./";
+  argv[argc++] = "-image_list";
+  argv[argc++] = "images.lst";
+  argv[argc++] = "-map_list";
+  argv[argc++] = "maps.lst";
+  argv[argc++] = "-maps";
+  argv[argc++] = "./";
+  argv[argc++] = "-output";
+  argv[argc++] = "out_";
+  argv[argc++] = "-schedule";
+  argv[argc++] = "schedule.lst";
+  argv[argc++] = "-fixed";
+  argv[argc++] = fixedName;
+  argv[argc++] = "-threads";
+  argv[argc++] = threadsArg;
+  if (fontName[0] != '\0')
+    {
+      argv[argc++] = "-font";
+      argv[argc++] = fontName;
+    }
+  argv[argc++] = "-timing";
+  argv[argc] = NULL;
+
+  nIter = 0;
+  for (r = 0; r < nRepeats; ++r)
+    {
+      pid = fork();
+      if (pid == 0)
+	{
+	  if (freopen(logName, "w", stdout) == NULL ||
+	      chdir(scratchName) != 0)
+	    _exit(127);
+	  dup2(1, 2);
+	  execvp(argv[0], argv);
+	  _exit(127);
+	}
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+	  !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+	  fprintf(stderr, "%s failed; see %s\n", alignName, logName);
+	  exit(1);
+	}
+
+      f = fopen(logName, "r");
+      seconds = -1.0;
+      while (f != NULL && fgets(line, LINE_LENGTH, f) != NULL)
+	if (sscanf(line, "timing: step %*d level %*d iterations %d force_seconds %lf us_per_iteration %lf",
+		   &nIter, &seconds, &usPerIter) == 3)
+	  break;
+      if (f != NULL)
+	fclose(f);
+      if (seconds < 0.0 || nIter == 0)
+	{
+	  fprintf(stderr, "%s did not report its timing; see %s\n",
+		  alignName, logName);
+	  exit(1);
+	}
+      /* report the time of 1 iteration, since the number of them
+	 depends on how the relaxation converges */
+      times[r] = seconds / nIter;
+    }
+  sprintf(variant, "level%d_%dsections", forceLevel, nSections);
+  Report("forces", variant, ((double) nSections) * mw * mw, "node");
+}
@@ -0,0 +1,565 @@
+/*
+ *  bench_par.c  -  times libpar's dispatch of tasks to its workers
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The master delegates -tasks synthetic tasks through par_process,
+   under -contexts successive contexts of -context bytes each; a task
+   carries -task bytes, keeps its worker busy for -duration seconds
+   (spinning, or with -sleep, sleeping, so that more workers than
+   cores can be run), and returns -result bytes.  Since all the tasks
+   are queued at once, a worker should start its next task as soon as
+   it has returned a result, so the gap between the two is the
+   dispatch latency: the round trip through the master, plus the time
+   to take in any new context.  Printed are the tasks per second
+   reached and the ideal (workers / duration), the median, 90th and
+   99th percentile dispatch latencies, the master's cpu time as a
+   fraction of the elapsed time, and the fraction of the workers'
+   time spent idle (overall and on the most idle worker); with
+   -report the same figures are appended to a file as one JSON object
+   per line, like those bench_kernels writes.  With -slow_worker, the
+   worker whose par_instance() is given performs each task -factor
+   times more slowly, checking par_task_cancelled() as it goes and
+   stopping if it is told to, and the master checks that the result of
+   each task is taken once; so with -PAR_SPECULATE the duplication of
+   its tasks, and the cancellation of the slow copies (through a
+   sub-master, with -PAR_GROUP), can be watched.  The libpar options
+   (-PAR_LOCAL=n, -PAR_BATCH=n, -PAR_GROUP=n, -PAR_THREADS=n, ...)
+   select the number of workers and how they are fed, so running it
+   for a range of them measures how dispatch scales; make parbench
+   does so for -PAR_LOCAL. */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "par.h"
+
+#define LABEL_LENGTH	64
+
+/* the parameters, which the workers get through the context */
+int nTasks = 10000;
+double duration = 0.001;
+int sleeping = 0;
+int contextSize = 0;
+int nContexts = 1;
+int taskSize = 0;
+int resultSize = 0;
+int slowWorker = -1;
+double slowFactor = 1.0;
+char label[LABEL_LENGTH];
+char reportName[PATH_MAX];
+
+/* master state */
+unsigned char *contextBuffer = NULL;
+unsigned char *taskBuffer = NULL;
+double *gaps = NULL;
+int nGaps = 0;
+double *busy = NULL;
+int nBusy = 0;
+double totalBusy = 0.0;
+int nResults = 0;
+int maxWorkers = 0;
+unsigned char *taken = NULL;	/* whether each task's result came in */
+int nTakenTwice = 0;
+
+/* the current context, task and result; the task and result are per
+   thread, as with -PAR_THREADS=n a worker has n tasks at once */
+int contextNumber = 0;
+__thread int taskIndex = 0;
+__thread double taskBusy = 0.0;
+__thread double taskGap = -1.0;
+__thread int taskInstance = 0;
+__thread unsigned char *resultBuffer = NULL;
+__thread int resultBufferSize = 0;
+__thread unsigned int checksum = 0;
+
+/* worker state */
+__thread double lastEnd = -1.0;
+
+double Now ();
+double CpuSeconds ();
+int CompareDoubles (const void *a, const void *b);
+void MasterTask (int argc, char **argv, char **envp);
+void MasterResult (int id);
+void WorkerContext ();
+void WorkerTask ();
+void PackContext ();
+void UnpackContext ();
+void PackTask ();
+void UnpackTask ();
+void PackResult ();
+void UnpackResult ();
+
+int
+main (int argc, char **argv, char **envp)
+{
+  par_allow_worker_threads();
+  par_process(argc, argv, envp,
+	      (void (*)()) MasterTask, (void (*)()) MasterResult,
+	      WorkerContext, WorkerTask, NULL,
+	      PackContext, UnpackContext,
+	      PackTask, UnpackTask,
+	      PackResult, UnpackResult);
+  return(0);
+}
+
+void
+MasterTask (int argc, char **argv, char **envp)
+{
+  int i, c;
+  int error;
+  int nWorkers;
+  double t0, t1, cpu0, cpu1;
+  double elapsed, rate, ideal;
+  double median, p90, p99;
+  double idle, maxIdle;
+  FILE *f;
+
+  error = 0;
+  label[0] = '\0';
+  reportName[0] = '\0';
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-tasks") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nTasks) != 1 ||
+	    nTasks < 1)
+	  {
+	    fprintf(stderr, "-tasks error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-duration") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%lf", &duration) != 1 ||
+	    duration < 0.0)
+	  {
+	    fprintf(stderr, "-duration error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-sleep") == 0)
+      sleeping = 1;
+    else if (strcmp(argv[i], "-slow_worker") == 0)
+      {
+	if ((i += 2) >= argc ||
+	    sscanf(argv[i-1], "%d", &slowWorker) != 1 || slowWorker < 0 ||
+	    sscanf(argv[i], "%lf", &slowFactor) != 1 || slowFactor < 1.0)
+	  {
+	    fprintf(stderr, "-slow_worker error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-context") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &contextSize) != 1 ||
+	    contextSize < 0)
+	  {
+	    fprintf(stderr, "-context error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-contexts") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nContexts) != 1 ||
+	    nContexts < 1)
+	  {
+	    fprintf(stderr, "-contexts error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-task") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &taskSize) != 1 ||
+	    taskSize < 0)
+	  {
+	    fprintf(stderr, "-task error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-result") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &resultSize) != 1 ||
+	    resultSize < 0)
+	  {
+	    fprintf(stderr, "-result error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-label") == 0)
+      {
+	if (++i == argc || strlen(argv[i]) >= LABEL_LENGTH ||
+	    strchr(argv[i], '"') != NULL || strchr(argv[i], '\\') != NULL)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(label, argv[i]);
+      }
+    else if (strcmp(argv[i], "-report") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(reportName, argv[i]);
+      }
+    else
+      {
+	error = 1;
+	break;
+      }
+
+  if (error)
+    {
+      if (i < argc)
+        fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      else
+        fprintf(stderr, "Incomplete option: %s\n", argv[i-1]);
+      fprintf(stderr, "\n");
+
+      fprintf(stderr, "Usage: bench_par [-PAR_LOCAL=n] [-PAR_BATCH=n] ... (libpar options)\n");
+      fprintf(stderr, "                 [-tasks <int>]\n");
+      fprintf(stderr, "                 [-duration task_seconds]\n");
+      fprintf(stderr, "                 [-sleep]\n");
+      fprintf(stderr, "                 [-slow_worker worker_instance factor]\n");
+      fprintf(stderr, "                 [-context context_bytes]\n");
+      fprintf(stderr, "                 [-contexts <int>]\n");
+      fprintf(stderr, "                 [-task task_bytes]\n");
+      fprintf(stderr, "                 [-result result_bytes]\n");
+      fprintf(stderr, "                 [-label run_label]\n");
+      fprintf(stderr, "                 [-report report_file]\n");
+      exit(1);
+    }
+
+  contextBuffer = (unsigned char *) malloc(contextSize + 1);
+  taskBuffer = (unsigned char *) malloc(taskSize + 1);
+  gaps = (double *) malloc(nTasks * sizeof(double));
+  taken = (unsigned char *) calloc(nTasks, 1);
+  if (contextBuffer == NULL || taskBuffer == NULL || gaps == NULL ||
+      taken == NULL)
+    {
+      fprintf(stderr, "Could not allocate buffers\n");
+      exit(1);
+    }
+  memset(taskBuffer, 0x5a, taskSize);
+
+  t0 = Now();
+  cpu0 = CpuSeconds();
+  for (c = 0; c < nContexts; ++c)
+    {
+      contextNumber = c;
+      memset(contextBuffer, c & 0xff, contextSize);
+      par_set_context();
+      for (i = (int) (((double) c) * nTasks / nContexts);
+	   i < (int) (((double) (c + 1)) * nTasks / nContexts);
+	   ++i)
+	{
+	  taskIndex = i;
+	  par_delegate_task();
+	}
+    }
+  par_finish();
+  t1 = Now();
+  cpu1 = CpuSeconds();
+
+  /* the workers have left by the end of par_finish, so the number
+     is the largest seen while the results came in */
+  nWorkers = maxWorkers > 0 ? maxWorkers : 1;
+  elapsed = t1 - t0;
+  rate = elapsed > 0.0 ? nResults / elapsed : 0.0;
+  ideal = duration > 0.0 ? nWorkers / duration : 0.0;
+  median = p90 = p99 = 0.0;
+  if (nGaps > 0)
+    {
+      qsort(gaps, nGaps, sizeof(double), CompareDoubles);
+      median = gaps[nGaps / 2];
+      p90 = gaps[(int) (0.9 * (nGaps - 1))];
+      p99 = gaps[(int) (0.99 * (nGaps - 1))];
+    }
+  idle = elapsed > 0.0 ? 1.0 - totalBusy / (nWorkers * elapsed) : 0.0;
+  maxIdle = 0.0;
+  for (i = 0; i < nBusy; ++i)
+    if (busy[i] > 0.0 && elapsed > 0.0 && 1.0 - busy[i] / elapsed > maxIdle)
+      maxIdle = 1.0 - busy[i] / elapsed;
+  if (idle < 0.0)
+    idle = 0.0;
+
+  printf("workers %4d  tasks %8d  %10.1f tasks/s (ideal %10.1f)  "
+	 "dispatch median %9.6f s p90 %9.6f s p99 %9.6f s  "
+	 "master cpu %5.1f%%  worker idle %5.1f%% (max %5.1f%%)\n",
+	 nWorkers, nResults, rate, ideal, median, p90, p99,
+	 elapsed > 0.0 ? 100.0 * (cpu1 - cpu0) / elapsed : 0.0,
+	 100.0 * idle, 100.0 * maxIdle);
+  fflush(stdout);
+  if (nResults != nTasks)
+    fprintf(stderr, "Only %d of %d results were returned\n",
+	    nResults, nTasks);
+  if (nTakenTwice > 0)
+    fprintf(stderr, "%d results were taken twice\n", nTakenTwice);
+
+  if (reportName[0] == '\0')
+    return;
+  f = fopen(reportName, "a");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open report file %s\n", reportName);
+      exit(1);
+    }
+  fprintf(f, "{\"benchmark\": \"par_dispatch\", \"label\": \"%s\", "
+	  "\"workers\": %d, \"tasks\": %d, \"task_seconds\": %.6f, "
+	  "\"sleep\": %d, \"context_bytes\": %d, \"contexts\": %d, "
+	  "\"task_bytes\": %d, \"result_bytes\": %d, "
+	  "\"elapsed_seconds\": %.6f, \"tasks_per_second\": %.3f, "
+	  "\"ideal_tasks_per_second\": %.3f, "
+	  "\"median_dispatch_seconds\": %.6f, "
+	  "\"p90_dispatch_seconds\": %.6f, "
+	  "\"p99_dispatch_seconds\": %.6f, "
+	  "\"master_cpu_seconds\": %.6f, \"master_cpu_fraction\": %.4f, "
+	  "\"worker_idle_fraction\": %.4f, "
+	  "\"max_worker_idle_fraction\": %.4f}\n",
+	  label, nWorkers, nResults, duration, sleeping,
+	  contextSize, nContexts, taskSize, resultSize,
+	  elapsed, rate, ideal, median, p90, p99,
+	  cpu1 - cpu0, elapsed > 0.0 ? (cpu1 - cpu0) / elapsed : 0.0,
+	  idle, maxIdle);
+  fclose(f);
+}
+
+void
+MasterResult (int id)
+{
+  int n;
+
+  if (id >= 0 && id < nTasks)
+    {
+      if (taken[id])
+	{
+	  fprintf(stderr, "The result of task %d was taken twice\n", id);
+	  ++nTakenTwice;
+	}
+      taken[id] = 1;
+    }
+  ++nResults;
+  if (par_workers() > maxWorkers)
+    maxWorkers = par_workers();
+  totalBusy += taskBusy;
+  if (taskGap >= 0.0 && nGaps < nTasks)
+    gaps[nGaps++] = taskGap;
+  if (taskInstance < 0)
+    taskInstance = 0;
+  if (taskInstance >= nBusy)
+    {
+      n = taskInstance + 1;
+      busy = (double *) realloc(busy, n * sizeof(double));
+      if (busy == NULL)
+	{
+	  fprintf(stderr, "Could not allocate worker times\n");
+	  exit(1);
+	}
+      memset(&busy[nBusy], 0, (n - nBusy) * sizeof(double));
+      nBusy = n;
+    }
+  busy[taskInstance] += taskBusy;
+}
+
+void
+WorkerContext ()
+{
+}
+
+void
+WorkerTask ()
+{
+  double start, end;
+  double d, left, until;
+  struct timespec ts;
+
+  start = Now();
+  taskGap = lastEnd >= 0.0 ? start - lastEnd : -1.0;
+  if (par_instance() == slowWorker)
+    {
+      /* the slow worker looks for a cancellation every millisecond */
+      d = slowFactor * duration;
+      while ((left = d - (Now() - start)) > 0.0)
+	{
+	  if (par_task_cancelled())
+	    {
+	      fprintf(stderr, "bench_par: worker %d abandoned task %d "
+		      "after %.3f of %.3f s\n", slowWorker, taskIndex,
+		      Now() - start, d);
+	      break;
+	    }
+	  if (left > 0.001)
+	    left = 0.001;
+	  if (sleeping)
+	    {
+	      ts.tv_sec = 0;
+	      ts.tv_nsec = (long) (left * 1.0e9);
+	      nanosleep(&ts, NULL);
+	    }
+	  else
+	    {
+	      until = Now() + left;
+	      while (Now() < until)
+		;
+	    }
+	}
+    }
+  else if (sleeping)
+    {
+      ts.tv_sec = (time_t) duration;
+      ts.tv_nsec = (long) ((duration - ts.tv_sec) * 1.0e9);
+      nanosleep(&ts, NULL);
+    }
+  else
+    while (Now() - start < duration)
+      ;
+  if (resultSize > resultBufferSize)
+    {
+      resultBuffer = (unsigned char *) realloc(resultBuffer, resultSize);
+      if (resultBuffer == NULL)
+	{
+	  fprintf(stderr, "Could not allocate result buffer\n");
+	  exit(1);
+	}
+      resultBufferSize = resultSize;
+    }
+  memset(resultBuffer, taskIndex & 0xff, resultSize);
+  end = Now();
+  taskBusy = end - start;
+  taskInstance = par_instance();
+  lastEnd = end;
+}
+
+void
+PackContext ()
+{
+  par_pkint(contextNumber);
+  par_pkdouble(duration);
+  par_pkint(sleeping);
+  par_pkint(slowWorker);
+  par_pkdouble(slowFactor);
+  par_pkint(resultSize);
+  par_pkblock(contextBuffer, contextSize);
+}
+
+void
+UnpackContext ()
+{
+  int n;
+  unsigned char *p;
+
+  contextNumber = par_upkint();
+  duration = par_upkdouble();
+  sleeping = par_upkint();
+  slowWorker = par_upkint();
+  slowFactor = par_upkdouble();
+  resultSize = par_upkint();
+  p = (unsigned char *) par_upkblock(&n);
+  /* the context is looked at, as a real one would be */
+  if (n > 0)
+    checksum += p[0] + p[n-1];
+}
+
+void
+PackTask ()
+{
+  par_pkint(taskIndex);
+  par_pkblock(taskBuffer, taskSize);
+}
+
+void
+UnpackTask ()
+{
+  int n;
+  unsigned char *p;
+
+  taskIndex = par_upkint();
+  p = (unsigned char *) par_upkblock(&n);
+  if (n > 0)
+    checksum += p[0] + p[n-1];
+}
+
+void
+PackResult ()
+{
+  par_pkdouble(taskBusy);
+  par_pkdouble(taskGap);
+  par_pkint(taskInstance);
+  par_pkblock(resultBuffer, resultSize);
+}
+
+void
+UnpackResult ()
+{
+  int n;
+  unsigned char *p;
+
+  taskBusy = par_upkdouble();
+  taskGap = par_upkdouble();
+  taskInstance = par_upkint();
+  p = (unsigned char *) par_upkblock(&n);
+  if (n > 0)
+    checksum += p[0] + p[n-1];
+}
+
+double
+Now ()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 0.000001 * tv.tv_usec);
+}
+
+/* CpuSeconds returns the user and system time of this process */
+double
+CpuSeconds ()
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return(ru.ru_utime.tv_sec + 0.000001 * ru.ru_utime.tv_usec +
+	 ru.ru_stime.tv_sec + 0.000001 * ru.ru_stime.tv_usec);
+}
+
+int
+CompareDoubles (const void *a, const void *b)
+{
+  double da = *((double *) a);
+  double db = *((double *) b);
+
+  return(da < db ? -1 : (da > db ? 1 : 0));
+}
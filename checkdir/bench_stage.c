@@ -0,0 +1,210 @@
+/*
+ *  bench_stage.c  -  runs one stage of the AlignTK benchmark and
+ *                    appends its resource usage to a report
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Usage: bench_stage -name stage -report report_file [-log log_file]
+                      command args...
+
+   The command is run with its output sent to the log file (if
+   given), and one line holding a JSON object is appended to
+   report_file giving the stage name, the exit status, the wall-clock
+   time, the user and system CPU time and peak resident set size of
+   the command and all the processes it waited for, and the bytes it
+   and they read and wrote (from /proc/<pid>/io where the kernel
+   provides it, as both the bytes passed through read and write
+   calls and those that reached the storage layer; files that are
+   memory-mapped, as libtiff does with the TIFF files it reads, only
+   show in the latter, and only when they are not already cached). */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LINE_LENGTH	256
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int error;
+  char stageName[LINE_LENGTH];
+  char reportName[PATH_MAX];
+  char logName[PATH_MAX];
+  char fn[PATH_MAX];
+  char line[LINE_LENGTH];
+  pid_t pid;
+  int fd;
+  int status;
+  siginfo_t info;
+  struct rusage ru;
+  struct timeval t0, t1;
+  FILE *f;
+  long long rchar, wchar, readBytes, writeBytes;
+  long long value;
+  double wall;
+
+  error = 0;
+  stageName[0] = '\0';
+  reportName[0] = '\0';
+  logName[0] = '\0';
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    if (strcmp(argv[i], "-name") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strncpy(stageName, argv[i], LINE_LENGTH-1);
+	stageName[LINE_LENGTH-1] = '\0';
+      }
+    else if (strcmp(argv[i], "-report") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(reportName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-log") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(logName, argv[i]);
+      }
+    else
+      {
+	error = 1;
+	break;
+      }
+
+  if (error || i >= argc || stageName[0] == '\0' || reportName[0] == '\0')
+    {
+      if (error && i < argc)
+        fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      else if (error)
+        fprintf(stderr, "Incomplete option: %s\n", argv[i-1]);
+      fprintf(stderr, "\n");
+
+      fprintf(stderr, "Usage: bench_stage -name stage -report report_file\n");
+      fprintf(stderr, "                   [-log log_file]\n");
+      fprintf(stderr, "                   command args...\n");
+      exit(1);
+    }
+
+  gettimeofday(&t0, NULL);
+  pid = fork();
+  if (pid < 0)
+    {
+      fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+      exit(1);
+    }
+  if (pid == 0)
+    {
+      if (logName[0] != '\0')
+	{
+	  fd = open(logName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	  if (fd < 0)
+	    {
+	      fprintf(stderr, "Could not open log file %s\n", logName);
+	      _exit(127);
+	    }
+	  dup2(fd, 1);
+	  dup2(fd, 2);
+	  close(fd);
+	}
+      execvp(argv[i], &argv[i]);
+      fprintf(stderr, "Could not run %s: %s\n", argv[i], strerror(errno));
+      _exit(127);
+    }
+
+  /* wait for the command to exit without reaping it, so that its I/O
+     counts (which by then include those of the processes it waited
+     for) can still be read */
+  while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0)
+    if (errno != EINTR)
+      {
+	fprintf(stderr, "Could not wait for %s: %s\n",
+		argv[i], strerror(errno));
+	exit(1);
+      }
+  gettimeofday(&t1, NULL);
+
+  rchar = wchar = readBytes = writeBytes = -1;
+  sprintf(fn, "/proc/%d/io", (int) pid);
+  f = fopen(fn, "r");
+  if (f != NULL)
+    {
+      while (fgets(line, LINE_LENGTH, f) != NULL)
+	if (sscanf(line, "rchar: %lld", &value) == 1)
+	  rchar = value;
+	else if (sscanf(line, "wchar: %lld", &value) == 1)
+	  wchar = value;
+	else if (sscanf(line, "read_bytes: %lld", &value) == 1)
+	  readBytes = value;
+	else if (sscanf(line, "write_bytes: %lld", &value) == 1)
+	  writeBytes = value;
+      fclose(f);
+    }
+
+  if (wait4(pid, &status, 0, &ru) < 0)
+    {
+      fprintf(stderr, "Could not reap %s: %s\n", argv[i], strerror(errno));
+      exit(1);
+    }
+  wall = (t1.tv_sec - t0.tv_sec) + 0.000001 * (t1.tv_usec - t0.tv_usec);
+
+  f = fopen(reportName, "a");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open report file %s\n", reportName);
+      exit(1);
+    }
+  fprintf(f, "{\"stage\": \"%s\", \"status\": %d, "
+	  "\"wall_seconds\": %.3f, \"user_seconds\": %.3f, "
+	  "\"system_seconds\": %.3f, \"max_rss_kb\": %ld, "
+	  "\"read_chars\": %lld, \"write_chars\": %lld, "
+	  "\"read_bytes\": %lld, \"write_bytes\": %lld}\n",
+	  stageName,
+	  WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+	  wall,
+	  ru.ru_utime.tv_sec + 0.000001 * ru.ru_utime.tv_usec,
+	  ru.ru_stime.tv_sec + 0.000001 * ru.ru_stime.tv_usec,
+	  ru.ru_maxrss, rchar, wchar, readBytes, writeBytes);
+  fclose(f);
+
+  if (WIFEXITED(status))
+    return(WEXITSTATUS(status));
+  return(128 + WTERMSIG(status));
+}
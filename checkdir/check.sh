@@ -2,7 +2,7 @@
 echo "Checking AlignTK executables for correctness..."
 
 errors=0
-rm -rf cmaps maps amaps grids aligned aligned_yz compare.out
+rm -rf cmaps gcmaps maps tmaps gmaps amaps grids aligned aligned_yz compare.out
 
 
 echo ""
@@ -20,6 +20,25 @@ else
 fi
 
 
+echo ""
+echo "Checking find_rst with GPU correlations"
+if grep -q "built without GPU support" ../find_rst; then
+    echo "find_rst -gpu skipped (GPU backend not built)."
+else
+    echo "1000000.0" >compare.out
+    mkdir -p gcmaps
+    ../find_rst -pairs pairs.lst -tif -images ../examples/images/ -output gcmaps/ -max_res 1024 -scale 1.0 -tx -50-50 -ty -50-50 -summary gcmaps/summary.out -gpu
+    ../compare_maps -map1 gcmaps/z00_z01.map -map2 cmaps.correct/z00_z01.map -output compare.out
+    export result=`cat compare.out`
+    if (( $(echo "$result < 1.0" | bc -l ) )); then
+        echo "find_rst -gpu passed check."
+    else
+        echo "find_rst -gpu failed check."
+        errors=1
+    fi
+fi
+
+
 echo ""
 echo "Checking register"
 echo "1000000.0" >compare.out
@@ -34,6 +53,38 @@ else
     errors=1
 fi
 
+echo ""
+echo "Checking register with threaded moves"
+echo "1000000.0" >compare.out
+mkdir -p tmaps
+../register -pairs pairs.lst -images ../examples/images/ -tif -output tmaps/ -distortion 2.0 -output_level 6 -depth 6 -quality 0.5 -summary tmaps/summary.out -initial_map cmaps.correct/ -threads 4
+../compare_maps -map1 tmaps/z00_z01.map -map2 maps.correct/z00_z01.map -output compare.out
+export result=`cat compare.out`
+if (( $(echo "$result < 1.0" | bc -l ) )); then
+    echo "register -threads passed check."
+else
+    echo "register -threads failed check."
+    errors=1
+fi
+
+echo ""
+echo "Checking register with GPU moves"
+if grep -q "built without GPU support" ../register; then
+    echo "register -gpu skipped (GPU backend not built)."
+else
+    echo "1000000.0" >compare.out
+    mkdir -p gmaps
+    ../register -pairs pairs.lst -images ../examples/images/ -tif -output gmaps/ -distortion 2.0 -output_level 6 -depth 6 -quality 0.5 -summary gmaps/summary.out -initial_map cmaps.correct/ -gpu
+    ../compare_maps -map1 gmaps/z00_z01.map -map2 maps.correct/z00_z01.map -output compare.out
+    export result=`cat compare.out`
+    if (( $(echo "$result < 1.0" | bc -l ) )); then
+        echo "register -gpu passed check."
+    else
+        echo "register -gpu failed check."
+        errors=1
+    fi
+fi
+
 echo ""
 echo "Checking align"
 echo "1000000" >compare.out
@@ -0,0 +1,261 @@
+/*
+ *  gen_sections.c  -  generates a stack of synthetic serial-section
+ *                     images for benchmarking the AlignTK pipeline
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The sections are slices of a 3-D value-noise volume, so that the
+   structures in neighboring sections are similar but not identical,
+   as in real serial sections.  Each section is displaced by its own
+   translation, a small rotation and a smooth warp, which the
+   registration stages have to recover, and gets its own pixel noise.
+   The output is the same for the same arguments on every machine. */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imio.h"
+
+#define N_OCTAVES	4
+
+unsigned int Hash (int x, int y, int z, int seed);
+double Lattice (int x, int y, int z, int seed);
+double Noise (double x, double y, double z, int seed);
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int error;
+  int width, height;
+  int nSections;
+  int seed;
+  char outputName[PATH_MAX];
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  unsigned char *image;
+  int s;
+  int x, y;
+  int digits;
+  double tx, ty, theta, c, sn;
+  double cx, cy;
+  double u, v, z;
+  double value;
+
+  error = 0;
+  width = 2048;
+  height = 2048;
+  nSections = 8;
+  seed = 1;
+  outputName[0] = '\0';
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-size") == 0)
+      {
+	if (++i == argc ||
+	    (sscanf(argv[i], "%dx%d", &width, &height) != 2 &&
+	     sscanf(argv[i], "%d", &width) != 1) ||
+	    width < 64)
+	  {
+	    fprintf(stderr, "-size error\n");
+	    error = 1;
+	    break;
+	  }
+	if (strchr(argv[i], 'x') == NULL)
+	  height = width;
+	if (height < 64)
+	  {
+	    fprintf(stderr, "-size error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-sections") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nSections) != 1 ||
+	    nSections < 2)
+	  {
+	    fprintf(stderr, "-sections error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-seed") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &seed) != 1)
+	  {
+	    fprintf(stderr, "-seed error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-output") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(outputName, argv[i]);
+      }
+    else
+      {
+	error = 1;
+	break;
+      }
+
+  if (error || outputName[0] == '\0')
+    {
+      if (i < argc)
+        fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      else if (error)
+        fprintf(stderr, "Incomplete option: %s\n", argv[i-1]);
+      fprintf(stderr, "\n");
+
+      fprintf(stderr, "Usage: gen_sections -output output_prefix\n");
+      fprintf(stderr, "                    [-size <width>[x<height>]]\n");
+      fprintf(stderr, "                    [-sections <int>]\n");
+      fprintf(stderr, "                    [-seed <int>]\n");
+      exit(1);
+    }
+
+  /* the images are named z00, z01, ... with as many digits as the
+     last one needs */
+  digits = 2;
+  for (i = 100; i < nSections; i *= 10)
+    ++digits;
+
+  image = (unsigned char *) malloc(((size_t) width) * height);
+  if (image == NULL)
+    {
+      fprintf(stderr, "Could not allocate a %dx%d image.\n", width, height);
+      exit(1);
+    }
+  cx = 0.5 * width;
+  cy = 0.5 * height;
+  for (s = 0; s < nSections; ++s)
+    {
+      /* the displacement of this section: up to 2% of the image in
+	 translation and half a degree of rotation */
+      tx = 0.02 * width * (2.0 * Lattice(s, 0, 1, seed) - 1.0);
+      ty = 0.02 * height * (2.0 * Lattice(s, 0, 2, seed) - 1.0);
+      theta = 0.5 * M_PI / 180.0 * (2.0 * Lattice(s, 0, 3, seed) - 1.0);
+      c = cos(theta);
+      sn = sin(theta);
+      z = 0.2 * s;
+      for (y = 0; y < height; ++y)
+	for (x = 0; x < width; ++x)
+	  {
+	    u = c * (x - cx) - sn * (y - cy) + cx + tx;
+	    v = sn * (x - cx) + c * (y - cy) + cy + ty;
+	    u += 3.0 * sin(2.0 * M_PI * (v / height + 0.1 * s));
+	    v += 3.0 * sin(2.0 * M_PI * (u / width + 0.13 * s));
+	    value = 128.0 + 320.0 * (Noise(u, v, z, seed) - 0.5) +
+	      12.0 * (Lattice(x, y, s + 1000, seed) - 0.5);
+	    if (value < 1.0)
+	      value = 1.0;
+	    else if (value > 255.0)
+	      value = 255.0;
+	    image[((size_t) y) * width + x] = (unsigned char) value;
+	  }
+
+      sprintf(fn, "%sz%0*d.tif", outputName, digits, s);
+      if (!WriteImage(fn, image, width, height, UncompressedImage, msg))
+	{
+	  fprintf(stderr, "Could not write image %s:\n%s\n", fn, msg);
+	  exit(1);
+	}
+    }
+  free(image);
+  return(0);
+}
+
+unsigned int
+Hash (int x, int y, int z, int seed)
+{
+  unsigned int h;
+
+  h = (unsigned int) x * 73856093u ^ (unsigned int) y * 19349663u ^
+    (unsigned int) z * 83492791u ^ (unsigned int) seed * 2654435761u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return(h);
+}
+
+/* Lattice returns a value in 0..1 that depends only on its arguments */
+double
+Lattice (int x, int y, int z, int seed)
+{
+  return((Hash(x, y, z, seed) & 0xffffff) / (double) 0xffffff);
+}
+
+/* Noise returns the sum of N_OCTAVES octaves of trilinearly
+   interpolated lattice values at (x, y, z), scaled to 0..1; the cells
+   of the coarsest octave are 64 pixels across and, since the sections
+   are 0.2 apart in z, five sections deep */
+double
+Noise (double x, double y, double z, int seed)
+{
+  int o;
+  double scale, amplitude, total, sum;
+  double fx, fy, fz;
+  int ix, iy, iz;
+  double ax, ay, az;
+  double v00, v10, v01, v11, v0, v1;
+
+  scale = 1.0 / 64.0;
+  amplitude = 1.0;
+  total = 0.0;
+  sum = 0.0;
+  for (o = 0; o < N_OCTAVES; ++o)
+    {
+      fx = x * scale;
+      fy = y * scale;
+      fz = z + o;
+      ix = (int) floor(fx);
+      iy = (int) floor(fy);
+      iz = (int) floor(fz);
+      ax = fx - ix;
+      ay = fy - iy;
+      az = fz - iz;
+      /* smooth the interpolation so that the cells do not show */
+      ax = ax * ax * (3.0 - 2.0 * ax);
+      ay = ay * ay * (3.0 - 2.0 * ay);
+      az = az * az * (3.0 - 2.0 * az);
+      v00 = (1.0 - az) * Lattice(ix, iy, iz, seed + o) +
+	az * Lattice(ix, iy, iz + 1, seed + o);
+      v10 = (1.0 - az) * Lattice(ix + 1, iy, iz, seed + o) +
+	az * Lattice(ix + 1, iy, iz + 1, seed + o);
+      v01 = (1.0 - az) * Lattice(ix, iy + 1, iz, seed + o) +
+	az * Lattice(ix, iy + 1, iz + 1, seed + o);
+      v11 = (1.0 - az) * Lattice(ix + 1, iy + 1, iz, seed + o) +
+	az * Lattice(ix + 1, iy + 1, iz + 1, seed + o);
+      v0 = (1.0 - ax) * v00 + ax * v10;
+      v1 = (1.0 - ax) * v01 + ax * v11;
+      sum += amplitude * ((1.0 - ay) * v0 + ay * v1);
+      total += amplitude;
+      scale *= 2.0;
+      amplitude *= 0.5;
+    }
+  return(sum / total);
+}
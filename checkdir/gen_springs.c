@@ -0,0 +1,301 @@
+/*
+ *  gen_springs.c  -  generates a synthetic stack of sections and maps
+ *                    for measuring how align scales with the number
+ *                    of processes
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* align only needs the sizes of the sections and the maps between
+   them, so no images are written: the image list gives each section's
+   size, and each section is connected by maps to the next neighbors
+   sections.  Each section has its own smooth warp, and a map carries
+   the points of one section to where the warp of the other puts them,
+   so that the spring graph has a consistent solution for align to
+   relax toward.  The maps are at the given level, which sets the
+   density of the nodes; the schedule written beside them runs a single
+   step at that level.  The output is the same for the same arguments
+   on every machine. */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "imio.h"
+
+unsigned int Hash (int x, int y, int z, int seed);
+double Lattice (int x, int y, int z, int seed);
+void Warp (int s, double x, double y, double *dx, double *dy);
+
+int width, height;		/* the size of each section in pixels */
+double amplitude;		/* the largest displacement of a section's
+				   warp in pixels */
+int warpSeed;			/* the seed of the warps */
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int error;
+  int nSections;
+  int nNeighbors;
+  int level;
+  int minIter;
+  char outputName[PATH_MAX];
+  char fn[PATH_MAX+64];
+  char msg[PATH_MAX+256];
+  char name0[64], name1[64];
+  int s, t;
+  int x, y;
+  int mw, mh;
+  int digits;
+  int factor;
+  double dx0, dy0, dx1, dy1;
+  MapElement *map;
+  FILE *fi, *fm, *fs;
+
+  error = 0;
+  width = 4096;
+  height = 4096;
+  nSections = 16;
+  nNeighbors = 1;
+  level = 6;
+  amplitude = 8.0;
+  minIter = 1000;
+  warpSeed = 1;
+  outputName[0] = '\0';
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-size") == 0)
+      {
+	if (++i == argc ||
+	    (sscanf(argv[i], "%dx%d", &width, &height) != 2 &&
+	     sscanf(argv[i], "%d", &width) != 1) ||
+	    width < 64)
+	  {
+	    fprintf(stderr, "-size error\n");
+	    error = 1;
+	    break;
+	  }
+	if (strchr(argv[i], 'x') == NULL)
+	  height = width;
+	if (height < 64)
+	  {
+	    fprintf(stderr, "-size error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-sections") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nSections) != 1 ||
+	    nSections < 2)
+	  {
+	    fprintf(stderr, "-sections error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-neighbors") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nNeighbors) != 1 ||
+	    nNeighbors < 1)
+	  {
+	    fprintf(stderr, "-neighbors error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-level") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &level) != 1 ||
+	    level < 0 || level > 12)
+	  {
+	    fprintf(stderr, "-level error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-warp") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%lf", &amplitude) != 1 ||
+	    amplitude < 0.0)
+	  {
+	    fprintf(stderr, "-warp error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-iterations") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &minIter) != 1 ||
+	    minIter < 1)
+	  {
+	    fprintf(stderr, "-iterations error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-seed") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &warpSeed) != 1)
+	  {
+	    fprintf(stderr, "-seed error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-output") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(outputName, argv[i]);
+      }
+    else
+      {
+	error = 1;
+	break;
+      }
+
+  if (error || outputName[0] == '\0')
+    {
+      if (i < argc)
+        fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      else if (error)
+        fprintf(stderr, "Incomplete option: %s\n", argv[i-1]);
+      fprintf(stderr, "\n");
+
+      fprintf(stderr, "Usage: gen_springs -output output_directory\n");
+      fprintf(stderr, "                   [-size <width>[x<height>]]\n");
+      fprintf(stderr, "                   [-sections <int>]\n");
+      fprintf(stderr, "                   [-neighbors <int>]\n");
+      fprintf(stderr, "                   [-level <int>]\n");
+      fprintf(stderr, "                   [-warp <pixels>]\n");
+      fprintf(stderr, "                   [-iterations <int>]\n");
+      fprintf(stderr, "                   [-seed <int>]\n");
+      exit(1);
+    }
+  if (mkdir(outputName, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create directory %s\n", outputName);
+      exit(1);
+    }
+
+  /* the sections are named z00, z01, ... with as many digits as the
+     last one needs, as gen_sections names them */
+  digits = 2;
+  for (i = 100; i < nSections; i *= 10)
+    ++digits;
+
+  sprintf(fn, "%s/images.lst", outputName);
+  fi = fopen(fn, "w");
+  sprintf(fn, "%s/maps.lst", outputName);
+  fm = fopen(fn, "w");
+  sprintf(fn, "%s/schedule.lst", outputName);
+  fs = fopen(fn, "w");
+  if (fi == NULL || fm == NULL || fs == NULL)
+    {
+      fprintf(stderr, "Could not write the lists in %s\n", outputName);
+      exit(1);
+    }
+  fprintf(fs, "%d 1.0 0.1 0.0 %d\n", level, minIter);
+  fclose(fs);
+
+  factor = 1 << level;
+  mw = (width + factor - 1) / factor + 1;
+  mh = (height + factor - 1) / factor + 1;
+  map = (MapElement *) malloc(((size_t) mw) * mh * sizeof(MapElement));
+  if (map == NULL)
+    {
+      fprintf(stderr, "Could not allocate a %dx%d map.\n", mw, mh);
+      exit(1);
+    }
+  for (s = 0; s < nSections; ++s)
+    {
+      sprintf(name0, "z%0*d", digits, s);
+      fprintf(fi, "%s %d %d\n", name0, width, height);
+      for (t = s + 1; t <= s + nNeighbors && t < nSections; ++t)
+	{
+	  sprintf(name1, "z%0*d", digits, t);
+	  for (y = 0; y < mh; ++y)
+	    for (x = 0; x < mw; ++x)
+	      {
+		Warp(s, (double) x * factor, (double) y * factor, &dx0, &dy0);
+		Warp(t, (double) x * factor, (double) y * factor, &dx1, &dy1);
+		map[y*mw+x].x = x + (dx1 - dx0) / factor;
+		map[y*mw+x].y = y + (dy1 - dy0) / factor;
+		map[y*mw+x].c = 1.0;
+	      }
+	  fprintf(fm, "%s %s %s_%s\n", name0, name1, name0, name1);
+	  sprintf(fn, "%s/%s_%s.map", outputName, name0, name1);
+	  if (!WriteMap(fn, map, level, mw, mh, 0, 0, name0, name1,
+			UncompressedMap, msg))
+	    {
+	      fprintf(stderr, "Could not write map %s:\n%s\n", fn, msg);
+	      exit(1);
+	    }
+	}
+    }
+  fclose(fi);
+  fclose(fm);
+  free(map);
+  return(0);
+}
+
+/* Warp sets (dx, dy) to the displacement of section s at (x, y): two
+   sinusoids across the section with phases and directions of their
+   own, each up to half the warp amplitude */
+void
+Warp (int s, double x, double y, double *dx, double *dy)
+{
+  double a0, a1, p0, p1;
+
+  a0 = 2.0 * M_PI * (x / width + Lattice(s, 0, 1, warpSeed));
+  a1 = 2.0 * M_PI * (y / height + Lattice(s, 0, 2, warpSeed));
+  p0 = 2.0 * M_PI * Lattice(s, 0, 3, warpSeed);
+  p1 = 2.0 * M_PI * Lattice(s, 0, 4, warpSeed);
+  *dx = 0.5 * amplitude * (sin(a1 + p0) + cos(a0 + p1));
+  *dy = 0.5 * amplitude * (cos(a1 + p1) + sin(a0 + p0));
+}
+
+unsigned int
+Hash (int x, int y, int z, int seed)
+{
+  unsigned int h;
+
+  h = (unsigned int) x * 73856093u ^ (unsigned int) y * 19349663u ^
+    (unsigned int) z * 83492791u ^ (unsigned int) seed * 2654435761u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return(h);
+}
+
+/* Lattice returns a value in 0..1 that depends only on its arguments */
+double
+Lattice (int x, int y, int z, int seed)
+{
+  return((Hash(x, y, z, seed) & 0xffffff) / (double) 0xffffff);
+}
@@ -0,0 +1,148 @@
+#!/bin/bash
+#
+# scale_align.sh - measures how align scales with the number of processes
+#
+# Usage: ./scale_align.sh [-ranks "<int> ..."] [-mode strong|weak|both]
+#                         [-size <width>[x<height>]] [-sections <int>]
+#                         [-neighbors <int>] [-level <int>]
+#                         [-iterations <int>] [-seed <int>]
+#                         [-report report.json]
+#
+# gen_springs writes a synthetic stack of sections and the maps between
+# them into scale/, and align -timing is run on it under mpirun at each
+# of the rank counts.  In strong scaling the stack is the same at every
+# rank count; in weak scaling it has sections sections per process.
+# For each run the time per iteration is split into computation,
+# position exchange (CommunicatePositions, or the overlapped or
+# hierarchical exchange) and the Allreduce of force and energy, taking
+# the slowest process for each, and a JSON object per run is appended
+# to the report (scale/report.json by default).  Set MPIRUN to the
+# command that runs a program on a number of processes given after it
+# (default "mpirun -np").
+
+ranks="1 2 4 8"
+mode=strong
+size=4096
+sections=16
+neighbors=1
+level=6
+iterations=1000
+seed=1
+report=""
+MPIRUN=${MPIRUN:-"mpirun -np"}
+
+while (($# > 0)); do
+    case "$1" in
+	-ranks) ranks="$2"; shift 2 ;;
+	-mode) mode="$2"; shift 2 ;;
+	-size) size="$2"; shift 2 ;;
+	-sections) sections="$2"; shift 2 ;;
+	-neighbors) neighbors="$2"; shift 2 ;;
+	-level) level="$2"; shift 2 ;;
+	-iterations) iterations="$2"; shift 2 ;;
+	-seed) seed="$2"; shift 2 ;;
+	-report) report="$2"; shift 2 ;;
+	*) echo "Invalid option: $1"
+	   echo "Usage: ./scale_align.sh [-ranks \"<int> ...\"] [-mode strong|weak|both]"
+	   echo "                        [-size <width>[x<height>]] [-sections <int>]"
+	   echo "                        [-neighbors <int>] [-level <int>]"
+	   echo "                        [-iterations <int>] [-seed <int>]"
+	   echo "                        [-report report.json]"
+	   exit 1 ;;
+    esac
+done
+
+case "$mode" in
+    strong|weak) modes=$mode ;;
+    both) modes="strong weak" ;;
+    *) echo "-mode must be strong, weak or both"; exit 1 ;;
+esac
+
+top=`pwd`
+if [ -z "$report" ]; then
+    report="$top/scale/report.json"
+fi
+case "$report" in
+    /*) ;;
+    *) report="$top/$report" ;;
+esac
+
+rm -rf scale
+mkdir -p scale/logs
+cd scale
+: >results
+
+errors=0
+for m in $modes; do
+    for n in $ranks; do
+	if [ $m = weak ]; then
+	    s=$((sections * n))
+	else
+	    s=$sections
+	fi
+	echo "Running align on $n processes, $s sections ($m scaling)"
+	if [ ! -f data$s/maps.lst ]; then
+	    rm -rf data*
+	    if ! ../gen_springs -output data$s -size $size -sections $s \
+		-neighbors $neighbors -level $level -iterations $iterations \
+		-seed $seed >logs/gen_springs.out 2>&1
+	    then
+		echo "gen_springs failed (see scale/logs/gen_springs.out)."
+		errors=1
+		break 2
+	    fi
+	fi
+	fixed=`sed -n "$((s / 2 + 1))p" data$s/images.lst | cut -d' ' -f 1`
+	rm -rf amaps
+	mkdir amaps
+	if ! $MPIRUN $n ../../align -image_list data$s/images.lst \
+	    -map_list data$s/maps.lst -maps data$s/ -output amaps/ \
+	    -schedule data$s/schedule.lst -fixed $fixed \
+	    -font ../../font.pgm -timing >logs/align.$m.$n.out 2>&1
+	then
+	    echo "align failed (see scale/logs/align.$m.$n.out)."
+	    errors=1
+	    continue
+	fi
+	grep '^timing:' logs/align.$m.$n.out | sed -n '$p' |
+	    sed -e "s/^timing: /mode $m ranks $n sections $s /" >>results
+    done
+done
+
+# the times of the runs, per iteration, with the parallel efficiency
+# relative to the first rank count of each mode
+echo ""
+printf "%-6s %5s %8s %6s %12s %12s %12s %12s %8s\n" mode ranks sections \
+    iters "us/iter" "compute" "exchange" "allreduce" "scaling"
+awk '{
+    for (i = 1; i < NF; i += 2)
+	v[$i] = $(i + 1)
+    it = v["iterations"]
+    t = 1.0e6 * v["iteration_seconds"] / it
+    cost = v["mode"] == "weak" ? t : t * v["ranks"]
+    if (!(v["mode"] in base))
+	base[v["mode"]] = cost
+    scaling = base[v["mode"]] / cost
+    printf "%-6s %5d %8d %6d %12.1f %12.1f %12.1f %12.1f %8.2f\n",
+	v["mode"], v["ranks"], v["sections"], it, t,
+	1.0e6 * v["compute_seconds"] / it,
+	1.0e6 * v["exchange_seconds"] / it,
+	1.0e6 * v["reduce_seconds"] / it, scaling
+    printf "{\"benchmark\": \"align_scaling\", \"mode\": \"%s\", \"ranks\": %d, \"sections\": %d, \"size\": \"%s\", \"neighbors\": %d, \"level\": %d, \"iterations\": %d, \"us_per_iteration\": %.3f, \"compute_us_per_iteration\": %.3f, \"exchange_us_per_iteration\": %.3f, \"allreduce_us_per_iteration\": %.3f, \"mean_compute_us_per_iteration\": %.3f, \"mean_exchange_us_per_iteration\": %.3f, \"mean_allreduce_us_per_iteration\": %.3f, \"scaling\": %.4f}\n",
+	v["mode"], v["ranks"], v["sections"], size, neighbors, level, it, t,
+	1.0e6 * v["compute_seconds"] / it,
+	1.0e6 * v["exchange_seconds"] / it,
+	1.0e6 * v["reduce_seconds"] / it,
+	1.0e6 * v["mean_compute_seconds"] / it,
+	1.0e6 * v["mean_exchange_seconds"] / it,
+	1.0e6 * v["mean_reduce_seconds"] / it, scaling >>report
+}' size=$size neighbors=$neighbors level=$level report="$report" results
+echo ""
+echo "The scaling column is the parallel efficiency relative to the first"
+echo "rank count of each mode (1.00 is perfect scaling)."
+echo "Report appended to $report"
+if ((errors > 0)); then
+    echo "Errors detected during the measurement"
+    exit 1
+fi
+exit 0
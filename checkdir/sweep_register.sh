@@ -0,0 +1,172 @@
+#!/bin/bash
+#
+# sweep_register.sh - measures the accuracy of register's maps against
+#                     the CPU time they take over a grid of parameters
+#
+# Usage: ./sweep_register.sh [-pairs pairs.lst] [-images <dir>/]
+#                            [-reference <dir>/] [-args "<register args>"]
+#                            [-depth "<int> ..."] [-quality "<float> ..."]
+#                            [-min_res "<int> ..."]
+#                            [-stop_acceptance "<float> ..."]
+#                            [-target <rms>] [-report report.json]
+#
+# register is run on the pairs once for each combination of the listed
+# -depth, -quality, -min_res and -stop_acceptance values (the last
+# bounds how much of the move budget register uses), with the other
+# arguments given by -args, each run through bench_stage, which records
+# its CPU time.  Its maps are compared with those of the same names in
+# the reference directory by compare_maps, and the largest and mean RMS
+# differences are recorded.  A JSON object per run is appended to the
+# report (sweep/report.json by default), and the table printed at the
+# end lists the runs sorted by CPU time, marking with * the ones on the
+# Pareto front, which no other run beats in both CPU time and largest
+# RMS difference.  With -target, the cheapest run whose largest RMS
+# difference is within the target is named.  The defaults sweep the
+# pairs that make check registers.  Set MPIRUN (e.g. to "mpirun -np 4")
+# to run register under it.
+
+pairs=pairs.lst
+images=../examples/images/
+reference=maps.correct/
+args="-tif -distortion 2.0 -output_level 6 -initial_map cmaps.correct/"
+depths="4 5 6"
+qualities="0.25 0.5 1.0"
+minres="1"
+acceptances="0"
+target=""
+report=""
+
+while (($# > 0)); do
+    case "$1" in
+	-pairs) pairs="$2"; shift 2 ;;
+	-images) images="$2"; shift 2 ;;
+	-reference) reference="$2"; shift 2 ;;
+	-args) args="$2"; shift 2 ;;
+	-depth) depths="$2"; shift 2 ;;
+	-quality) qualities="$2"; shift 2 ;;
+	-min_res) minres="$2"; shift 2 ;;
+	-stop_acceptance) acceptances="$2"; shift 2 ;;
+	-target) target="$2"; shift 2 ;;
+	-report) report="$2"; shift 2 ;;
+	*) echo "Invalid option: $1"
+	   echo "Usage: ./sweep_register.sh [-pairs pairs.lst] [-images <dir>/]"
+	   echo "                           [-reference <dir>/] [-args \"<register args>\"]"
+	   echo "                           [-depth \"<int> ...\"] [-quality \"<float> ...\"]"
+	   echo "                           [-min_res \"<int> ...\"]"
+	   echo "                           [-stop_acceptance \"<float> ...\"]"
+	   echo "                           [-target <rms>] [-report report.json]"
+	   exit 1 ;;
+    esac
+done
+
+top=`pwd`
+if [ -z "$report" ]; then
+    report="$top/sweep/report.json"
+fi
+# the paths are given relative to where the script is run, and register
+# is run from sweep/
+absolute () {
+    case "$1" in
+	/*) echo "$1" ;;
+	*) echo "$top/$1" ;;
+    esac
+}
+report=`absolute "$report"`
+pairs=`absolute "$pairs"`
+images=`absolute "$images"`
+reference=`absolute "$reference"`
+# the directories among the register arguments are made absolute too
+set -- $args
+args=""
+while (($# > 0)); do
+    case "$1" in
+	-initial_map|-mask|-cpts|-constraining_map|-warm_maps)
+	    args="$args $1 `absolute "$2"`"; shift 2 ;;
+	*) args="$args $1"; shift ;;
+    esac
+done
+
+rm -rf sweep
+mkdir -p sweep/logs
+cd sweep
+: >results
+
+errors=0
+run=0
+for depth in $depths; do
+    for quality in $qualities; do
+	for res in $minres; do
+	    for acceptance in $acceptances; do
+		run=$((run + 1))
+		name="depth=$depth quality=$quality min_res=$res stop_acceptance=$acceptance"
+		echo "Running register with $name"
+		rm -rf maps stage.json
+		mkdir maps
+		if ! ../bench_stage -name register -report stage.json \
+		    -log logs/register.$run.out $MPIRUN ../../register \
+		    -pairs "$pairs" -images "$images" -output maps/ $args \
+		    -depth $depth -quality $quality -min_res $res \
+		    -stop_acceptance $acceptance
+		then
+		    echo "register failed (see sweep/logs/register.$run.out)."
+		    errors=1
+		    continue
+		fi
+		if ! ../../compare_maps -dir1 maps/ -dir2 "$reference" \
+		    -csv compare.csv -output compare.out \
+		    >logs/compare_maps.$run.out 2>&1
+		then
+		    echo "compare_maps failed (see sweep/logs/compare_maps.$run.out)."
+		    errors=1
+		    continue
+		fi
+		cpu=`sed -e 's/[{}",:]/ /g' stage.json |
+		    awk '{ printf "%.3f\n", $8 + $10 }'`
+		wall=`sed -e 's/[{}",:]/ /g' stage.json |
+		    awk '{ printf "%.3f\n", $6 }'`
+		rms=`cat compare.out`
+		mean=`awk -F, 'NR > 1 && $4 != "" { s += $4; n++ }
+		    END { printf "%f\n", (n > 0 ? s / n : 0) }' compare.csv`
+		echo "$run $depth $quality $res $acceptance $cpu $wall $rms $mean" \
+		    >>results
+	    done
+	done
+    done
+done
+
+# the runs sorted by CPU time, with the ones on the Pareto front of
+# CPU time against largest RMS difference marked
+echo ""
+printf "%-4s %6s %8s %8s %10s %10s %10s %10s %10s %s\n" run depth quality \
+    min_res acceptance "cpu (s)" "wall (s)" "max rms" "mean rms" pareto
+sort -k 6,6g -k 8,8g results | awk '
+BEGIN { best = -1; cheapest = "" }
+{
+    pareto = (best < 0 || $8 < best)
+    if (pareto)
+	best = $8
+    printf "%-4d %6d %8s %8d %10s %10.3f %10.3f %10.4f %10.4f %s\n",
+	$1, $2, $3, $4, $5, $6, $7, $8, $9, pareto ? "*" : ""
+    printf "{\"benchmark\": \"register_sweep\", \"depth\": %d, \"quality\": %s, \"min_res\": %d, \"stop_acceptance\": %s, \"cpu_seconds\": %s, \"wall_seconds\": %s, \"max_rms\": %s, \"mean_rms\": %s, \"pareto\": %s}\n",
+	$2, $3, $4, $5, $6, $7, $8, $9, pareto ? "true" : "false" >>report
+    if (target != "" && cheapest == "" && $8 <= target + 0.0)
+	cheapest = sprintf("run %d: -depth %d -quality %s -min_res %d -stop_acceptance %s (%.3f s)",
+			   $1, $2, $3, $4, $5, $6)
+}
+END {
+    if (target != "")
+    {
+	print ""
+	if (cheapest != "")
+	    print "Cheapest run within an RMS difference of " target ": " cheapest
+	else
+	    print "No run is within an RMS difference of " target
+    }
+}' target="$target" report="$report"
+echo ""
+echo "Report appended to $report"
+if ((errors > 0)); then
+    echo "Errors detected during the sweep"
+    exit 1
+fi
+exit 0
@@ -36,6 +36,7 @@
 #include <limits.h>
 #include <dirent.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <FL/gl.h>
 #include <FL/Fl.H>
 #include <FL/Fl_Window.H>
@@ -50,6 +51,8 @@
 #include <algorithm>
 #include "imio.h"
 #include "invert.h"
+#include "prefetch.h"
+#include "correlation.h"
 
 using std::string;
 using std::max;
@@ -84,8 +87,9 @@ class ImageWindow: public Fl_Gl_Window
 {
 public:
   ImageWindow (MyWindow *p, int w, int h);
-  void setTexture (unsigned char *image, int w, int h);
+  void setTexture (unsigned char *image, int w, int h, int f);
   void computeWarped ();
+  void uploadCorrelation ();
 
 private:
   int handle (int event);
@@ -94,26 +98,29 @@ private:
 
 public:
   bool textureValid;  // true if the texture is up-to-date
+  bool corrTextureValid;  // false if all of the correlation texture
+                          //   must be reloaded
+  bool showCorrelation;   // true to show the correlation instead of the
+                          //   image
   char name[PATH_MAX];// file name 
 
 protected:
   GLuint texture;
+  GLuint corrTexture;
   bool textureInitialized;
   bool circleInitialized;
 
 private:
   void initTexture (int w, int h);
   void initCircle ();
+  void buildMesh ();
   MyWindow *parent;         // the parent window
   int textureWidth;       // the width in pixels of the texture map we are usin\g
   int textureHeight;      // the height in pixels of the texture map we are usi\ng
-  float maxx;             // the portion of the texture width we are actually
-                          //   using (0 < maxx <= 1.0)
-  float maxy;             // the portion of the texture height we are actually
-                          //   using (0 < maxx <= 1.0)
   int width, height;
 
-  unsigned char *warped;
+  GLuint mesh;        // display list that draws the image warped by the map
+  int textureFactor;  // the image is reduced by this to fit in the texture
   float scale;        // how many pixels on the screen correspond to
                       //    one pixel in the image
   float xOffset, yOffset;
@@ -131,12 +138,16 @@ class MyWindow: public Fl_Window
  public:
   MyWindow (int x, int y, int w, int h);
   void loadSection ();
+  void prefetch ();
   void draw ();
   void saveSection ();
   void create ();
   void reshape (int w, int h);
   void selectSeed ();
   void updateMask ();
+  float savedConfidence (int x, int y);
+  void loadCorrelation ();
+  void updateCorrelation ();
 
 public:  
   int width, height;
@@ -183,6 +194,39 @@ Pair* pairs;
 int nPairs;
 bool readOnly = false;
 bool partial = true;
+int prefetchPairs = 2;      // number of pairs to read ahead in each direction
+int prefetchMemory = 1024;  // megabytes that pairs read ahead may take
+bool computeCorrelation = false;
+int correlationHalfWidth = 31;  // in displayed pixels
+bool boxCorrelation = false;
+bool batch = false;         // clean all the pairs without a window
+float batchOrthogonal = 0.1;  // thresholds of -batch for pairs without
+float batchDiagonal = 0.1;    //   a .corr file
+float minKept = 0.5;        // fraction of the valid cells -batch must
+                            //   keep for a pair not to be left for review
+int nThreads = 1;           // threads cleaning pairs with -batch
+char reviewFile[PATH_MAX];  // where -batch lists the pairs left for review
+
+/* the correlation of the image with the reference warped by the map
+   as it would be saved is recomputed, at the displayed resolution, by
+   a thread of its own, a band of the rows marked dirty by the edits
+   at a time; the main thread waits for it to finish its band before
+   changing anything it uses */
+#define CORRELATION_BAND	64
+
+pthread_mutex_t corrLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t corrCond = PTHREAD_COND_INITIALIZER;
+bool corrBusy = false;      // true while the thread is computing a band
+float *corrImage = 0;       // the image, as floats
+float *corrRef = 0;         // the reference, as floats
+int corrRefWidth, corrRefHeight;
+int corrRefMinX, corrRefMinY;
+MapElement *corrMap = 0;    // the map as saveSection would write it
+float *correlation = 0;     // imageWidth x imageHeight
+int dirtyMinX = 0, dirtyMaxX = -1;  // the rectangle still to be recomputed
+int dirtyMinY = 0, dirtyMaxY = -1;
+int doneMinX = 0, doneMaxX = -1;    // the rectangle recomputed since the
+int doneMinY = 0, doneMaxY = -1;    //   correlation texture was loaded
 
 unsigned char colors[16][3] =
   {{255, 0, 0},     // red
@@ -210,6 +254,641 @@ int sliderHeight = 25;
 
 void OrthogonalSliderCallback (Fl_Widget *w, void *data);
 void DiagonalSliderCallback (Fl_Widget *w, void *data);
+void *CorrelationThreadMain (void *arg);
+
+/* GrowRect extends the rectangle minX..maxX, minY..maxY (empty if
+   minY > maxY) to cover x0..x1, y0..y1 */
+void
+GrowRect (int *minX, int *maxX, int *minY, int *maxY,
+	  int x0, int x1, int y0, int y1)
+{
+  if (*minY > *maxY)
+    {
+      *minX = x0;
+      *maxX = x1;
+      *minY = y0;
+      *maxY = y1;
+      return;
+    }
+  *minX = min(*minX, x0);
+  *maxX = max(*maxX, x1);
+  *minY = min(*minY, y0);
+  *maxY = max(*maxY, y1);
+}
+
+void
+CorrelationReady (void *arg)
+{
+  window->imageWindow->redraw();
+}
+
+void *
+CorrelationThreadMain (void *arg)
+{
+  int x0, x1, y0, y1;
+  int ex0, ex1, ey0, ey1;
+  int ew, eh;
+  int x, y;
+  int hw;
+  int ok;
+  float *a, *warped, *corr;
+  unsigned char *valid;
+  MyWindow *p;
+
+  pthread_mutex_lock(&corrLock);
+  for (;;)
+    {
+      while (dirtyMinY > dirtyMaxY)
+	pthread_cond_wait(&corrCond, &corrLock);
+
+      /* take the next band of the dirty rectangle */
+      x0 = dirtyMinX;
+      x1 = dirtyMaxX;
+      y0 = dirtyMinY;
+      y1 = min(dirtyMinY + CORRELATION_BAND - 1, dirtyMaxY);
+      dirtyMinY = y1 + 1;
+      corrBusy = true;
+      pthread_mutex_unlock(&corrLock);
+      p = window;
+
+      /* the correlation of a pixel depends on those within hw of it */
+      hw = correlationHalfWidth;
+      ex0 = max(x0 - hw, 0);
+      ex1 = min(x1 + hw, p->imageWidth - 1);
+      ey0 = max(y0 - hw, 0);
+      ey1 = min(y1 + hw, p->imageHeight - 1);
+      ew = ex1 - ex0 + 1;
+      eh = ey1 - ey0 + 1;
+      a = (float *) malloc(ew * eh * sizeof(float));
+      warped = (float *) malloc(ew * eh * sizeof(float));
+      corr = (float *) malloc(ew * eh * sizeof(float));
+      valid = (unsigned char *) malloc(ew * eh * sizeof(unsigned char));
+      ok = a != 0 && warped != 0 && corr != 0 && valid != 0;
+      if (ok)
+	{
+	  for (y = 0; y < eh; ++y)
+	    memcpy(&a[y * ew], &corrImage[(ey0 + y) * p->imageWidth + ex0],
+		   ew * sizeof(float));
+	  ok = ComputeWarpedImage(warped, valid, ew, eh,
+				  p->imageMinX + ex0, p->imageMinY + ey0,
+				  corrRef, NULL,
+				  corrRefWidth, corrRefHeight,
+				  corrRefMinX, corrRefMinY,
+				  corrMap,
+				  ((float) p->mapFactor) / reductionFactor,
+				  p->mapWidth, p->mapHeight,
+				  p->mapOffsetX, p->mapOffsetY);
+	  if (ok)
+	    ok = boxCorrelation ?
+	      ComputeBoxCorrelation(corr, a, warped, valid, ew, eh, hw) :
+	      ComputeCorrelation(corr, a, warped, valid, ew, eh, hw);
+	}
+
+      pthread_mutex_lock(&corrLock);
+      corrBusy = false;
+      if (ok)
+	{
+	  for (y = y0; y <= y1; ++y)
+	    for (x = x0; x <= x1; ++x)
+	      correlation[y * p->imageWidth + x] =
+		valid[(y - ey0) * ew + x - ex0] ?
+		corr[(y - ey0) * ew + x - ex0] : 0.0;
+	  GrowRect(&doneMinX, &doneMaxX, &doneMinY, &doneMaxY,
+		   x0, x1, y0, y1);
+	  Fl::awake(CorrelationReady, 0);
+	}
+      else
+	fprintf(stderr, "Could not allocate correlation arrays\n");
+      pthread_cond_broadcast(&corrCond);
+      free(a);
+      free(warped);
+      free(corr);
+      free(valid);
+    }
+  return(NULL);
+}
+
+/* StopCorrelation waits for the correlation thread to finish its band,
+   then drops the rest of its work and the arrays it was using */
+void
+StopCorrelation ()
+{
+  pthread_mutex_lock(&corrLock);
+  dirtyMinY = 0;
+  dirtyMaxY = -1;
+  doneMinY = 0;
+  doneMaxY = -1;
+  while (corrBusy)
+    pthread_cond_wait(&corrCond, &corrLock);
+  free(corrImage);
+  free(corrRef);
+  free(corrMap);
+  free(correlation);
+  corrImage = 0;
+  corrRef = 0;
+  corrMap = 0;
+  correlation = 0;
+  pthread_mutex_unlock(&corrLock);
+}
+
+/* THE CLEANING SHARED BY THE WINDOW AND -batch */
+
+/* CellRatios finds, for the cell of the map with corner (x, y), the
+   ratio of its vertical to its horizontal sides and of its two
+   diagonals; it returns false if a corner of the cell is invalid */
+bool
+CellRatios (MapElement *map, int mapWidth, int x, int y,
+	    float *orthogonal, float *diagonal)
+{
+  double distX, distY;
+  double distA, distB;
+
+  if (map[y * mapWidth + x].c == 0.0 || map[y * mapWidth + x + 1].c == 0.0 ||
+      map[(y + 1) * mapWidth + x].c == 0.0 || map[(y + 1) * mapWidth + x + 1].c == 0.0)
+    return(false);
+  distX = 0.5 * hypot(map[y * mapWidth + x].x - map[y * mapWidth + x + 1].x,
+		      map[y * mapWidth + x].y - map[y * mapWidth + x + 1].y) +
+    0.5 * hypot(map[(y + 1) * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
+		map[(y + 1) * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
+  distY = 0.5 * hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x].x,
+		      map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x].y) +
+    0.5 * hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x + 1].x,
+		map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x + 1].y);
+  *orthogonal = distY / distX;
+  distA = hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
+		map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
+  distB = hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x].x,
+		map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x].y);
+  *diagonal = distB / distA;
+  return(true);
+}
+
+/* AverageRatios sets *avgOrthogonal and *avgDiagonal to the average
+   ratios of the valid cells of the map */
+void
+AverageRatios (MapElement *map, int mapWidth, int mapHeight,
+	       float *avgOrthogonal, float *avgDiagonal)
+{
+  int x, y;
+  int n;
+  float orthogonal, diagonal;
+  double sumOrthogonal, sumDiagonal;
+
+  sumOrthogonal = 0.0;
+  sumDiagonal = 0.0;
+  n = 0;
+  for (y = 0; y < mapHeight-1; ++y)
+    for (x = 0; x < mapWidth-1; ++x)
+      if (CellRatios(map, mapWidth, x, y, &orthogonal, &diagonal))
+	{
+	  ++n;
+	  sumOrthogonal += orthogonal;
+	  sumDiagonal += diagonal;
+	}
+  *avgOrthogonal = sumOrthogonal / n;
+  *avgDiagonal = sumDiagonal / n;
+}
+
+/* SelectSeed returns the cell (as y * mapWidth + x) that is closest to
+   the middle of the 10% of the cells that are the least distorted, or
+   -1 if the map has no valid cells */
+int
+SelectSeed (MapElement *map, int mapWidth, int mapHeight,
+	    float avgOrthogonal, float avgDiagonal)
+{
+  vector<MapElementAndDistortion> m;
+  MapElementAndDistortion me;
+  int x, y;
+  float diagonal, orthogonal;
+
+  for (y = 0; y < mapHeight-1; ++y)
+    for (x = 0; x < mapWidth-1; ++x)
+      {
+	if (!CellRatios(map, mapWidth, x, y, &orthogonal, &diagonal))
+	  continue;
+	me.x = x;
+	me.y = y;
+	me.distortion = fabs(orthogonal - avgOrthogonal) / avgOrthogonal +
+	  fabs(diagonal - avgDiagonal) / avgDiagonal;
+	m.push_back(me);
+      }
+  sort(m.begin(), m.end(), lesserDistortion);
+
+  //   find the average location of those
+  double sumX = 0.0, sumY = 0.0;
+  double avgX, avgY;
+  int n = (m.size() + 9) / 10;
+  if (n == 0)
+    return(-1);
+  for (int i = 0; i < n; ++i)
+    {
+      sumX += m[i].x;
+      sumY += m[i].y;
+    }
+  avgX = sumX / n;
+  avgY = sumY / n;
+
+  //   pick the element that is located closest to the average
+  double closestDist = 1.0e30;
+  int closest = -1;
+  double dist;
+  for (int i = 0; i < n; ++i)
+    {
+      dist = hypot(m[i].x - avgX, m[i].y - avgY);
+      if (dist < closestDist)
+	{
+	  closest = i;
+	  closestDist = dist;
+	}
+    }
+  if (closest < 0)
+    return(-1);
+  return(m[closest].y * mapWidth + m[closest].x);
+}
+
+/* ClassifyCells sets the VALID_BIT and THRESHOLD_BIT of every cell of
+   mapMask (keeping the REJECT_BIT and ACCEPT_BIT the user set) and
+   then the CLUSTER_BIT of the cells connected to a seed through cells
+   within the thresholds, recording the seed of each in cluster; it
+   returns the number of cells in the clusters */
+int
+ClassifyCells (MapElement *map, int mapWidth, int mapHeight,
+	       float avgOrthogonal, float avgDiagonal,
+	       float oThreshold, float dThreshold,
+	       vector<int> &seeds,
+	       unsigned char *mapMask, int *cluster, bool verbose)
+{
+  int x, y;
+  bool overThreshold;
+  float diagonal, orthogonal;
+  int total;
+
+  for (y = 0; y < mapHeight-1; ++y)
+    for (x = 0; x < mapWidth-1; ++x)
+      {
+	if (!CellRatios(map, mapWidth, x, y, &orthogonal, &diagonal))
+	  {
+	    mapMask[y * mapWidth + x] = 0;
+	    continue;
+	  }
+	mapMask[y * mapWidth + x] |= VALID_BIT;
+
+	if (mapMask[y*mapWidth + x] & REJECT_BIT)
+	  {
+	    mapMask[y*mapWidth + x] &= ~THRESHOLD_BIT;
+	    continue;
+	  }
+	if (mapMask[y*mapWidth + x] & ACCEPT_BIT)
+	  {
+	    mapMask[y*mapWidth + x] |= THRESHOLD_BIT;
+	    continue;
+	  }
+
+	overThreshold =
+	  fabs(orthogonal - avgOrthogonal) / avgOrthogonal >= oThreshold ||
+	  fabs(diagonal - avgDiagonal) / avgDiagonal >= dThreshold;
+
+	/* update mask */
+	if (overThreshold)
+	  mapMask[y * mapWidth + x] &= ~THRESHOLD_BIT;
+	else
+	  mapMask[y * mapWidth + x] |= THRESHOLD_BIT;
+      }
+
+  // clear all the cluster bits
+  for (y = 0; y < mapHeight-1; ++y)
+    for (x = 0; x < mapWidth-1; ++x)
+      {
+	mapMask[y * mapWidth + x] &= ~CLUSTER_BIT;
+	cluster[y * mapWidth + x] = -1;
+      }
+
+  unsigned int *stack = (unsigned int *) malloc(mapHeight * mapWidth * sizeof(int));
+  if (verbose)
+    printf("updateMask: seeds.size = %zd\n", seeds.size());
+  total = 0;
+  for (int i = 0; i < seeds.size(); ++i)
+    {
+      y = seeds[i] / mapWidth;
+      x = seeds[i] - y * mapWidth;
+      if (cluster[y * mapWidth + x] >= 0)
+	continue;
+      cluster[y * mapWidth + x] = i;
+      int sp = 0;
+      stack[sp++] = y*mapWidth+x;
+      int count = 0;
+      while (sp > 0)
+	{
+	  ++count;
+	  --sp;
+	  y = stack[sp] / mapWidth;
+	  x = stack[sp] - y * mapWidth;
+	  mapMask[y * mapWidth + x] |= CLUSTER_BIT;
+	  
+	  /* check up */
+	  if (y > 0 && (mapMask[(y-1)*mapWidth+x] & THRESHOLD_BIT) &&
+	      cluster[(y-1)*mapWidth+x] < 0)
+	    {
+	      cluster[(y-1)*mapWidth+x] = i;
+	      stack[sp++] = (y-1)*mapWidth+x;
+	    }
+	  /* check right */
+	  if (x < mapWidth-2 && (mapMask[y*mapWidth+x+1] & THRESHOLD_BIT) &&
+	      cluster[y*mapWidth+x+1] < 0)
+	    {
+	      cluster[y*mapWidth+x+1] = i;
+	      stack[sp++] = y*mapWidth+x+1;
+	    }
+	  /* check down */
+	  if (y < mapHeight-2 && (mapMask[(y+1)*mapWidth+x] & THRESHOLD_BIT) &&
+	      cluster[(y+1)*mapWidth+x] < 0)
+	    {
+	      cluster[(y+1)*mapWidth+x] = i;
+	      stack[sp++] = (y+1)*mapWidth+x;
+	    }
+	  /* check left */
+	  if (x > 0 && (mapMask[y*mapWidth+x-1] & THRESHOLD_BIT) &&
+	      cluster[y*mapWidth+x-1] < 0)
+	    {
+	      cluster[y*mapWidth+x-1] = i;
+	      stack[sp++] = y*mapWidth+x-1;
+	    }
+	}
+      if (verbose)
+	printf("flood fill marked %d elements\n", count);
+      total += count;
+    }
+  free(stack);
+  return(total);
+}
+
+/* SavedConfidence returns the confidence a cleaned map gets for map
+   element (x, y): its own if one of the cells it is a corner of
+   belongs to a cluster, and 0 otherwise */
+float
+SavedConfidence (MapElement *map, unsigned char *mapMask,
+		 int mapWidth, int x, int y)
+{
+  if (x > 0 && y > 0 && mapMask[(y-1)*mapWidth + x-1] & CLUSTER_BIT ||
+      x > 0 && mapMask[y*mapWidth + x-1] & CLUSTER_BIT ||
+      y > 0 && mapMask[(y-1)*mapWidth + x] & CLUSTER_BIT ||
+      mapMask[y*mapWidth + x] & CLUSTER_BIT)
+    return(map[y*mapWidth + x].c);
+  return(0.0);
+}
+
+/* ReadCorr reads the thresholds, seeds and marked cells of a pair that
+   was cleaned before into *oThreshold, *dThreshold, seeds and
+   mapMask, returning false if there is no such file */
+bool
+ReadCorr (char *fn, int mapWidth, float *oThreshold, float *dThreshold,
+	  vector<int> &seeds, unsigned char *mapMask)
+{
+  FILE *f;
+  int x, y;
+  double o, d;
+
+  f = fopen(fn, "r");
+  if (f == NULL)
+    return(false);
+  if (fscanf(f, "%lf %lf", &o, &d) != 2)
+    {
+      fprintf(stderr, "Invalid first line in %s\n", fn);
+      exit(1);
+    }
+  *oThreshold = o;
+  *dThreshold = d;
+  while (fscanf(f, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
+    seeds.push_back(y*mapWidth+x);
+  while (fscanf(f, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
+    mapMask[y*mapWidth+x] |= REJECT_BIT;
+  while (fscanf(f, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
+    mapMask[y*mapWidth+x] |= ACCEPT_BIT;
+  fclose(f);
+  return(true);
+}
+
+/* WriteCleaned writes the .corr file and the cleaned map of pair i,
+   retrying every minute until it can */
+void
+WriteCleaned (int i, MapElement *map, int mapLevel,
+	      int mapWidth, int mapHeight, int mapOffsetX, int mapOffsetY,
+	      float oThreshold, float dThreshold,
+	      vector<int> &seeds, unsigned char *mapMask)
+{
+  char fn[PATH_MAX];
+  sprintf(fn, "%s%s.corr", corrName,
+	  (pairs[i].pairName[0] != '\0' ?
+	   pairs[i].pairName : pairs[i].imageName));
+  FILE *f;
+  while ((f = fopen(fn, "w")) == NULL)
+    {
+      fprintf(stderr, "Could not open file %s for writing.\n", fn);
+      fprintf(stderr, "   Will retry operation in 60 seconds.\n");
+      sleep(60);
+    }
+  fprintf(f, "%f %f\n", oThreshold, dThreshold);
+  for (int i = 0; i < seeds.size(); ++i)
+    fprintf(f, "%d %d\n", seeds[i] % mapWidth, seeds[i] / mapWidth);
+  fprintf(f, "-1 -1\n");
+  for (int y = 0; y < mapHeight-1; ++y)
+    for (int x = 0; x < mapWidth-1; ++x)
+      if (mapMask[y*mapWidth+x] & REJECT_BIT)
+	fprintf(f, "%d %d\n", x, y);
+  fprintf(f, "-1 -1\n");
+  for (int y = 0; y < mapHeight-1; ++y)
+    for (int x = 0; x < mapWidth-1; ++x)
+      if (mapMask[y*mapWidth+x] & ACCEPT_BIT)
+	fprintf(f, "%d %d\n", x, y);
+  fprintf(f, "-1 -1\n");
+  fclose(f);
+
+  MapElement *outMap = (MapElement*) malloc(mapHeight * mapWidth *
+					    sizeof(MapElement));
+  for (int y = 0; y < mapHeight; ++y)
+    for (int x = 0; x < mapWidth; ++x)
+      {
+	outMap[y*mapWidth + x].x = map[y*mapWidth + x].x;
+	outMap[y*mapWidth + x].y = map[y*mapWidth + x].y;
+	outMap[y*mapWidth + x].c = SavedConfidence(map, mapMask,
+						   mapWidth, x, y);
+      }
+  sprintf(fn, "%s%s.map", outputName,
+	  (pairs[i].pairName[0] != '\0' ?
+	   pairs[i].pairName : pairs[i].imageName));
+  char errorMsg[PATH_MAX + 256];
+  ForgetPrefetched(fn);
+  while (!WriteMap(fn, outMap, mapLevel, mapWidth, mapHeight,
+		   mapOffsetX, mapOffsetY,
+		   pairs[i].imageName,
+		   (pairs[i].refName[0] != '\0' ?
+		    pairs[i].refName : pairs[i].imageName),
+		   UncompressedMap, errorMsg))
+    {
+      fprintf(stderr, "Could not write map %s\n", fn);
+      fprintf(stderr, "   Will retry operation in 60 seconds.\n");
+      sleep(60);
+    }
+  free(outMap);
+}
+
+/* CleanPair cleans the map of pair i as the window would with the
+   thresholds given (or those of its .corr file, if it has one),
+   writing it out if at least minKept of its valid cells are kept;
+   it returns false if the pair is left for the user */
+bool
+CleanPair (int i, char *reason)
+{
+  char fn[PATH_MAX];
+  char errorMsg[PATH_MAX + 256];
+  char imgn[PATH_MAX], refn[PATH_MAX];
+  MapElement *map;
+  int mapLevel, mapWidth, mapHeight, mapOffsetX, mapOffsetY;
+  float avgOrthogonal, avgDiagonal;
+  float oThreshold, dThreshold;
+  vector<int> seeds;
+  unsigned char *mapMask;
+  int *cluster;
+  int x, y;
+  int nValid, nKept;
+  int seed;
+
+  sprintf(fn, "%s%s.map", mapsName,
+	  (pairs[i].pairName[0] != '\0' ?
+	   pairs[i].pairName : pairs[i].imageName));
+  if (!ReadMap(fn, &map, &mapLevel, &mapWidth, &mapHeight,
+	       &mapOffsetX, &mapOffsetY, imgn, refn, errorMsg))
+    {
+      sprintf(reason, "could not read map %s", fn);
+      return(false);
+    }
+  AverageRatios(map, mapWidth, mapHeight, &avgOrthogonal, &avgDiagonal);
+  mapMask = (unsigned char *) malloc(mapHeight * mapWidth * sizeof(unsigned char));
+  memset(mapMask, 0, mapHeight * mapWidth * sizeof(unsigned char));
+  cluster = (int *) malloc(mapHeight * mapWidth * sizeof(int));
+  oThreshold = batchOrthogonal;
+  dThreshold = batchDiagonal;
+  sprintf(fn, "%s%s.corr", corrName,
+	  (pairs[i].pairName[0] != '\0' ?
+	   pairs[i].pairName : pairs[i].imageName));
+  if (!ReadCorr(fn, mapWidth, &oThreshold, &dThreshold, seeds, mapMask) &&
+      (seed = SelectSeed(map, mapWidth, mapHeight,
+			 avgOrthogonal, avgDiagonal)) >= 0)
+    seeds.push_back(seed);
+  nKept = ClassifyCells(map, mapWidth, mapHeight, avgOrthogonal, avgDiagonal,
+			oThreshold, dThreshold, seeds, mapMask, cluster,
+			false);
+  nValid = 0;
+  for (y = 0; y < mapHeight-1; ++y)
+    for (x = 0; x < mapWidth-1; ++x)
+      if (mapMask[y * mapWidth + x] & VALID_BIT)
+	++nValid;
+  if (nValid == 0 || nKept < minKept * nValid)
+    sprintf(reason, "%d of %d valid cells kept", nKept, nValid);
+  else
+    WriteCleaned(i, map, mapLevel, mapWidth, mapHeight,
+		 mapOffsetX, mapOffsetY, oThreshold, dThreshold,
+		 seeds, mapMask);
+  free(map);
+  free(mapMask);
+  free(cluster);
+  return(nValid > 0 && nKept >= minKept * nValid);
+}
+
+/* with -batch, the pairs are cleaned by nThreads threads, each taking
+   the next pair still to be done */
+pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+int batchNext = 0;
+
+void *
+BatchThreadMain (void *arg)
+{
+  int i;
+  bool ok;
+  char reason[PATH_MAX + 256];
+
+  for (;;)
+    {
+      pthread_mutex_lock(&batchLock);
+      i = batchNext++;
+      pthread_mutex_unlock(&batchLock);
+      if (i >= nPairs)
+	break;
+      ok = CleanPair(i, reason);
+      pthread_mutex_lock(&batchLock);
+      pairs[i].modified = ok;
+      if (!ok)
+	printf("Pair %s left for review: %s\n",
+	       pairs[i].pairName[0] != '\0' ?
+	       pairs[i].pairName : pairs[i].imageName,
+	       reason);
+      pthread_mutex_unlock(&batchLock);
+    }
+  return(NULL);
+}
+
+/* CleanBatch cleans all the pairs without a window, writing those
+   that fail the checks to reviewFile (in the form of the pairs file,
+   for a later interactive run); it returns the exit status */
+int
+CleanBatch ()
+{
+  pthread_t *threads;
+  int t;
+  int i;
+  int nLeft;
+  FILE *f;
+
+  threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+  for (t = 0; t < nThreads; ++t)
+    if (pthread_create(&threads[t], NULL, BatchThreadMain, NULL) != 0)
+      {
+	fprintf(stderr, "Could not create batch thread\n");
+	exit(1);
+      }
+  for (t = 0; t < nThreads; ++t)
+    pthread_join(threads[t], NULL);
+  free(threads);
+
+  nLeft = 0;
+  for (i = 0; i < nPairs; ++i)
+    if (!pairs[i].modified)
+      ++nLeft;
+  printf("%d of %d pairs cleaned, %d left for review.\n",
+	 nPairs - nLeft, nPairs, nLeft);
+  if (reviewFile[0] == '\0')
+    return(0);
+  f = fopen(reviewFile, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open review file %s\n", reviewFile);
+      return(1);
+    }
+  for (i = 0; i < nPairs; ++i)
+    if (!pairs[i].modified)
+      {
+	if (pairs[i].pairName[0] == '\0')
+	  fprintf(f, "%s\n", pairs[i].imageName);
+	else if (pairs[i].imageMinX >= 0)
+	  fprintf(f, "%s %d %d %d %d %s %d %d %d %d %s\n",
+		  pairs[i].imageName,
+		  pairs[i].imageMinX, pairs[i].imageMaxX,
+		  pairs[i].imageMinY, pairs[i].imageMaxY,
+		  pairs[i].refName,
+		  pairs[i].refMinX, pairs[i].refMaxX,
+		  pairs[i].refMinY, pairs[i].refMaxY,
+		  pairs[i].pairName);
+	else
+	  fprintf(f, "%s %s %s\n", pairs[i].imageName,
+		  pairs[i].refName, pairs[i].pairName);
+      }
+  if (fclose(f) != 0)
+    {
+      fprintf(stderr, "Could not write review file %s\n", reviewFile);
+      return(1);
+    }
+  return(0);
+}
 
 int
 main (int argc, char **argv)
@@ -241,6 +920,7 @@ main (int argc, char **argv)
   mapsName[0] = '\0';
   corrName[0] = '\0';
   outputName[0] = '\0';
+  reviewFile[0] = '\0';
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-big") == 0)
       maximizeWindow = true;
@@ -316,8 +996,106 @@ main (int argc, char **argv)
       }
     else if (strcmp(argv[i], "-readonly") == 0)
       readOnly = true;
+    else if (strcmp(argv[i], "-prefetch") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &prefetchPairs) != 1 ||
+	    prefetchPairs < 0)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-prefetch error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-prefetch_memory") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &prefetchMemory) != 1 ||
+	    prefetchMemory < 0)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-prefetch_memory error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-correlation") == 0)
+      computeCorrelation = true;
+    else if (strcmp(argv[i], "-correlation_half_width") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &correlationHalfWidth) != 1 ||
+	    correlationHalfWidth < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-correlation_half_width error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-correlation_kernel") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-correlation_kernel error\n");
+	    break;
+	  }
+	if (strcmp(argv[i], "circle") == 0)
+	  boxCorrelation = false;
+	else if (strcmp(argv[i], "box") == 0)
+	  boxCorrelation = true;
+	else
+	  {
+	    error = 1;
+	    fprintf(stderr, "-correlation_kernel error\n");
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-pgm") == 0)
       strcpy(extension, "pgm");
+    else if (strcmp(argv[i], "-batch") == 0)
+      batch = true;
+    else if (strcmp(argv[i], "-thresholds") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%f,%f", &batchOrthogonal, &batchDiagonal) != 2)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-thresholds error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-min_kept") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%f", &minKept) != 1 ||
+	    minKept < 0.0 || minKept > 1.0)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-min_kept error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-review") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-review error\n");
+	    break;
+	  }
+	strcpy(reviewFile, argv[i]);
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-threads error\n");
+	    break;
+	  }
+      }
     else
       error = 1;
 
@@ -330,11 +1108,22 @@ main (int argc, char **argv)
       fprintf(stderr, "                  [-images imagesfile]\n");
       fprintf(stderr, "                  [-reduction image_reduction_factor]\n");
       fprintf(stderr, "                  [-readonly]\n");
+      fprintf(stderr, "                  [-prefetch pairs] [-prefetch_memory megabytes]\n");
+      fprintf(stderr, "                  [-correlation] [-correlation_half_width pixels]\n");
+      fprintf(stderr, "                  [-correlation_kernel circle|box]\n");
+      fprintf(stderr, "                  [-batch [-thresholds orthogonal,diagonal]\n");
+      fprintf(stderr, "                   [-min_kept fraction] [-review pairfile]\n");
+      fprintf(stderr, "                   [-threads n]]\n");
       exit(1);
     }
 
   /* check that at least minimal parameters were supplied */
-  if (inputName[0] == '\0' || mapsName[0] == '\0' ||
+  if (batch && (readOnly || computeCorrelation))
+    {
+      fprintf(stderr, "-batch cannot be combined with -readonly or -correlation.\n");
+      exit(1);
+    }
+  if (inputName[0] == '\0' && !batch || mapsName[0] == '\0' ||
       pairsFile[0] == '\0' && imagesFile[0] == '\0')
     {
       fprintf(stderr, "-input, -maps, and -pairs (or -images) parameters must be specified.\n");
@@ -450,13 +1239,40 @@ main (int argc, char **argv)
       fclose(f);
       printf("%d pairs listed in pairs file.\n", nPairs);
     }
+  for (i = 0; i < nPairs; ++i)
+    pairs[i].modified = false;
+
+  /* the batch never opens a window, so it runs without a display */
+  if (batch)
+    return(CleanBatch());
+
+  /* read the neighboring pairs while the user looks at this one */
+  if (prefetchPairs > 0 &&
+      !StartPrefetching(2, ((size_t) prefetchMemory) << 20))
+    {
+      fprintf(stderr, "Could not start prefetching threads\n");
+      exit(1);
+    }
+
+  if (computeCorrelation)
+    {
+      /* let the correlation thread wake up the GL thread */
+      Fl::lock();
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, CorrelationThreadMain, NULL) != 0)
+	{
+	  fprintf(stderr, "Could not create correlation thread\n");
+	  exit(1);
+	}
+      pthread_detach(thread);
+    }
 
-  /*  Fl::lock(); */
   Fl::visual(FL_RGB);
   Fl::gl_visual(FL_RGB);
   window = new MyWindow(0, 0, 800, 600);
   window->create();
   window->loadSection();
+  window->prefetch();
   window->show();
   printf("Windows created\n");
   return(Fl::run());
@@ -531,9 +1347,10 @@ MyWindow::loadSection ()
   char fn[PATH_MAX];
   char errorMsg[PATH_MAX + 256];
   char imgn[PATH_MAX], refn[PATH_MAX];
-  double sumOrthogonal, sumDiagonal;
-  double distX, distY;
-  double distA, distB;
+  float oThreshold, dThreshold;
+
+  /* nothing the correlation thread uses may change while it runs */
+  StopCorrelation();
 
  retry:
   if (index < 0)
@@ -569,10 +1386,10 @@ MyWindow::loadSection ()
     imageMaxY = -1;
 
   sprintf(fn, "%s%s.%s", inputName, pairs[index].imageName, extension);
-  if (!ReadImage(fn, &image, &imageWidth, &imageHeight,
-		 imageMinX, imageMaxX,
-		 imageMinY, imageMaxY,
-		 errorMsg))
+  if (!FetchImage(fn, &image, &imageWidth, &imageHeight,
+		  imageMinX, imageMaxX,
+		  imageMinY, imageMaxY,
+		  errorMsg))
     {
       if (partial)
 	{
@@ -597,8 +1414,13 @@ MyWindow::loadSection ()
   sprintf(fn, "%s%s.map", mapsName,
 	  (pairs[index].pairName[0] != '\0' ?
 	   pairs[index].pairName : pairs[index].imageName));
-  if (!ReadMap(fn, &map, &mapLevel, &mapWidth, &mapHeight,
-	       &mapOffsetX, &mapOffsetY, imgn, refn, errorMsg))
+  if (map != 0)
+    {
+      free(map);
+      map = 0;
+    }
+  if (!FetchMap(fn, &map, &mapLevel, &mapWidth, &mapHeight,
+		&mapOffsetX, &mapOffsetY, imgn, refn, errorMsg))
     {
       if (partial)
 	{
@@ -616,33 +1438,7 @@ MyWindow::loadSection ()
   inverseMap = InvertMap(map, mapWidth, mapHeight);
 
   /* compute the average ratios */
-  sumOrthogonal = 0.0;
-  sumDiagonal = 0.0;
-  n = 0;
-  for (y = 0; y < mapHeight-1; ++y)
-    for (x = 0; x < mapWidth-1; ++x)
-      {
-	if (map[y * mapWidth + x].c == 0.0 || map[y * mapWidth + x + 1].c == 0.0 ||
-	    map[(y + 1) * mapWidth + x].c == 0.0 || map[(y + 1) * mapWidth + x + 1].c == 0.0)
-	  continue;
-	++n;
-	distX = 0.5 * hypot(map[y * mapWidth + x].x - map[y * mapWidth + x + 1].x,
-		      map[y * mapWidth + x].y - map[y * mapWidth + x + 1].y) +
-	  0.5 * hypot(map[(y + 1) * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[(y + 1) * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
-	distY = 0.5 * hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x].x,
-			    map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x].y) +
-	  0.5 * hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x + 1].y);
-	sumOrthogonal += distY / distX;
-	distA = hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
-	distB = hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x].x,
-		      map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x].y);
-	sumDiagonal += distB/distA;
-      }
-  avgOrthogonal = sumOrthogonal / n;
-  avgDiagonal = sumDiagonal / n;
+  AverageRatios(map, mapWidth, mapHeight, &avgOrthogonal, &avgDiagonal);
   printf("avg orthogonal ratio = %f\n", avgOrthogonal);
   printf("avg diagonal ratio = %f\n", avgDiagonal);
 
@@ -665,25 +1461,10 @@ MyWindow::loadSection ()
   sprintf(fn, "%s%s.corr", corrName,
 	  (pairs[index].pairName[0] != '\0' ?
 	   pairs[index].pairName : pairs[index].imageName));
-  f = fopen(fn, "r");
-  if (f != NULL)
+  if (ReadCorr(fn, mapWidth, &oThreshold, &dThreshold, seeds, mapMask))
     {
-      double oThreshold, dThreshold;
-      if (fscanf(f, "%lf %lf", &oThreshold, &dThreshold) != 2)
-	{
-	  fprintf(stderr, "Invalid first line in %s\n", fn);
-	  exit(1);
-	}
-
       orthogonalSlider->value(oThreshold);
       diagonalSlider->value(dThreshold);
-      while (fscanf(f, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
-	seeds.push_back(y*mapWidth+x);
-      while (fscanf(f, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
-	mapMask[y*mapWidth+x] |= REJECT_BIT;
-      while (fscanf(f, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
-	mapMask[y*mapWidth+x] |= ACCEPT_BIT;
-      fclose(f);
     }
   else
     {
@@ -698,76 +1479,190 @@ MyWindow::loadSection ()
 
   if (imageWindow != 0)
     imageWindow->computeWarped();
+  if (computeCorrelation)
+    loadCorrelation();
 
   lastIndex = index;
   sectionsLoaded = true;
 }
 
+/* prefetch asks for the pairs on either side of the current one to be
+   read in the background, those in the direction the user is moving
+   first */
+void
+MyWindow::prefetch ()
+{
+  int i, j, k;
+  char fn[PATH_MAX];
+
+  if (prefetchPairs == 0)
+    return;
+  BeginPrefetchRound();
+  for (i = 0; i <= 2 * prefetchPairs; ++i)
+    {
+      k = (i + 1) / 2;
+      j = (i & 1) ? index + k * increment : index - k * increment;
+      if (j < 0 || j >= nPairs)
+	continue;
+      sprintf(fn, "%s%s.%s", inputName, pairs[j].imageName, extension);
+      PrefetchImage(fn,
+		    pairs[j].imageMinX >= 0 ? pairs[j].imageMinX / reductionFactor : -1,
+		    pairs[j].imageMaxX >= 0 ? pairs[j].imageMaxX / reductionFactor : -1,
+		    pairs[j].imageMinY >= 0 ? pairs[j].imageMinY / reductionFactor : -1,
+		    pairs[j].imageMaxY >= 0 ? pairs[j].imageMaxY / reductionFactor : -1);
+      if (computeCorrelation && pairs[j].refName[0] != '\0')
+	{
+	  sprintf(fn, "%s%s.%s", inputName, pairs[j].refName, extension);
+	  PrefetchImage(fn,
+			pairs[j].refMinX >= 0 ? pairs[j].refMinX / reductionFactor : -1,
+			pairs[j].refMaxX >= 0 ? pairs[j].refMaxX / reductionFactor : -1,
+			pairs[j].refMinY >= 0 ? pairs[j].refMinY / reductionFactor : -1,
+			pairs[j].refMaxY >= 0 ? pairs[j].refMaxY / reductionFactor : -1);
+	}
+      sprintf(fn, "%s%s.map", mapsName,
+	      (pairs[j].pairName[0] != '\0' ?
+	       pairs[j].pairName : pairs[j].imageName));
+      PrefetchMap(fn);
+    }
+}
+
 void
 MyWindow::saveSection ()
 {
   if (readOnly)
     return;
 
+  WriteCleaned(index, map, mapLevel, mapWidth, mapHeight,
+	       mapOffsetX, mapOffsetY,
+	       orthogonalSlider->value(), diagonalSlider->value(),
+	       seeds, mapMask);
+}
+
+/* savedConfidence returns the confidence saveSection writes for map
+   element (x, y): its own if one of the cells it is a corner of
+   belongs to a cluster, and 0 otherwise */
+float
+MyWindow::savedConfidence (int x, int y)
+{
+  return(SavedConfidence(map, mapMask, mapWidth, x, y));
+}
+
+/* loadCorrelation gives the correlation thread the reference and map
+   of the pair just loaded, and has it compute the whole correlation */
+void
+MyWindow::loadCorrelation ()
+{
+  int x, y;
+  int refMinX, refMaxX, refMinY, refMaxY;
+  unsigned char *ref;
   char fn[PATH_MAX];
-  sprintf(fn, "%s%s.corr", corrName,
-	  (pairs[index].pairName[0] != '\0' ?
-	   pairs[index].pairName : pairs[index].imageName));
-  FILE *f;
-  while ((f = fopen(fn, "w")) == NULL)
+  char errorMsg[PATH_MAX + 256];
+
+  refMinX = pairs[index].refMinX >= 0 ? pairs[index].refMinX / reductionFactor : -1;
+  refMaxX = pairs[index].refMaxX >= 0 ? pairs[index].refMaxX / reductionFactor : -1;
+  refMinY = pairs[index].refMinY >= 0 ? pairs[index].refMinY / reductionFactor : -1;
+  refMaxY = pairs[index].refMaxY >= 0 ? pairs[index].refMaxY / reductionFactor : -1;
+  sprintf(fn, "%s%s.%s", inputName,
+	  (pairs[index].refName[0] != '\0' ?
+	   pairs[index].refName : pairs[index].imageName),
+	  extension);
+  if (!FetchImage(fn, &ref, &corrRefWidth, &corrRefHeight,
+		  refMinX, refMaxX, refMinY, refMaxY,
+		  errorMsg))
     {
-      fprintf(stderr, "Could not open file %s for writing.\n", fn);
-      fprintf(stderr, "   Will retry operation in 60 seconds.\n");
-      sleep(60);
+      fprintf(stderr, "Could not read in reference %s -- error: %s\n",
+	      fn, errorMsg);
+      return;
     }
-  fprintf(f, "%f %f\n",
-	  orthogonalSlider->value(), diagonalSlider->value());
-  for (int i = 0; i < seeds.size(); ++i)
-    fprintf(f, "%d %d\n", seeds[i] % mapWidth, seeds[i] / mapWidth);
-  fprintf(f, "-1 -1\n");
-  for (int y = 0; y < mapHeight-1; ++y)
-    for (int x = 0; x < mapWidth-1; ++x)
-      if (mapMask[y*mapWidth+x] & REJECT_BIT)
-	fprintf(f, "%d %d\n", x, y);
-  fprintf(f, "-1 -1\n");
-  for (int y = 0; y < mapHeight-1; ++y)
-    for (int x = 0; x < mapWidth-1; ++x)
-      if (mapMask[y*mapWidth+x] & ACCEPT_BIT)
-	fprintf(f, "%d %d\n", x, y);
-  fprintf(f, "-1 -1\n");
-  fclose(f);
+  corrRefMinX = refMinX >= 0 ? refMinX : 0;
+  corrRefMinY = refMinY >= 0 ? refMinY : 0;
+
+  corrRef = (float *) malloc(corrRefWidth * corrRefHeight * sizeof(float));
+  corrImage = (float *) malloc(imageWidth * imageHeight * sizeof(float));
+  corrMap = (MapElement *) malloc(mapWidth * mapHeight * sizeof(MapElement));
+  correlation = (float *) malloc(imageWidth * imageHeight * sizeof(float));
+  if (corrRef == 0 || corrImage == 0 || corrMap == 0 || correlation == 0)
+    {
+      fprintf(stderr, "Could not allocate correlation arrays\n");
+      exit(1);
+    }
+  for (y = 0; y < corrRefHeight; ++y)
+    for (x = 0; x < corrRefWidth; ++x)
+      corrRef[y * corrRefWidth + x] = ref[y * corrRefWidth + x];
+  free(ref);
+  for (y = 0; y < imageHeight; ++y)
+    for (x = 0; x < imageWidth; ++x)
+      corrImage[y * imageWidth + x] = image[y * imageWidth + x];
+  for (y = 0; y < mapHeight; ++y)
+    for (x = 0; x < mapWidth; ++x)
+      {
+	corrMap[y * mapWidth + x] = map[y * mapWidth + x];
+	corrMap[y * mapWidth + x].c = savedConfidence(x, y);
+      }
+  memset(correlation, 0, imageWidth * imageHeight * sizeof(float));
+
+  pthread_mutex_lock(&corrLock);
+  dirtyMinX = 0;
+  dirtyMaxX = imageWidth - 1;
+  dirtyMinY = 0;
+  dirtyMaxY = imageHeight - 1;
+  pthread_cond_broadcast(&corrCond);
+  pthread_mutex_unlock(&corrLock);
+  if (imageWindow != 0)
+    imageWindow->corrTextureValid = false;
+}
 
-  MapElement *outMap = (MapElement*) malloc(mapHeight * mapWidth *
-					    sizeof(MapElement));
-  for (int y = 0; y < mapHeight; ++y)
-    for (int x = 0; x < mapWidth; ++x)
+/* updateCorrelation brings the correlation thread's copy of the map
+   up to date with the edits, and marks the pixels of the cells whose
+   corners changed as needing their correlation recomputed */
+void
+MyWindow::updateCorrelation ()
+{
+  int x, y;
+  float c;
+  int minX, maxX, minY, maxY;
+  float f;
+  int hw;
+
+  if (corrMap == 0)
+    return;
+
+  pthread_mutex_lock(&corrLock);
+  while (corrBusy)
+    pthread_cond_wait(&corrCond, &corrLock);
+  minX = 0;
+  maxX = -1;
+  minY = 0;
+  maxY = -1;
+  for (y = 0; y < mapHeight; ++y)
+    for (x = 0; x < mapWidth; ++x)
       {
-	outMap[y*mapWidth + x].x = map[y*mapWidth + x].x;
-	outMap[y*mapWidth + x].y = map[y*mapWidth + x].y;
-	if (x > 0 && y > 0 && mapMask[(y-1)*mapWidth + x-1] & CLUSTER_BIT ||
-	    x > 0 && mapMask[y*mapWidth + x-1] & CLUSTER_BIT ||
-	    y > 0 && mapMask[(y-1)*mapWidth + x] & CLUSTER_BIT ||
-	    mapMask[y*mapWidth + x] & CLUSTER_BIT)
-	  outMap[y*mapWidth + x].c = map[y*mapWidth + x].c;
-	else
-	  outMap[y*mapWidth + x].c = 0.0;
+	c = savedConfidence(x, y);
+	if (c == corrMap[y * mapWidth + x].c)
+	  continue;
+	corrMap[y * mapWidth + x].c = c;
+	GrowRect(&minX, &maxX, &minY, &maxY, x, x, y, y);
       }
-  sprintf(fn, "%s%s.map", outputName,
-	  (pairs[index].pairName[0] != '\0' ?
-	   pairs[index].pairName : pairs[index].imageName));
-  char errorMsg[PATH_MAX + 256];
-  while (!WriteMap(fn, outMap, mapLevel, mapWidth, mapHeight,
-		   mapOffsetX, mapOffsetY,
-		   pairs[index].imageName,
-		   (pairs[index].refName[0] != '\0' ?
-		 pairs[index].refName : pairs[index].imageName),
-		UncompressedMap, errorMsg))
+  if (minY <= maxY)
     {
-      fprintf(stderr, "Could not write map %s\n", fn);
-      fprintf(stderr, "   Will retry operation in 60 seconds.\n");
-      sleep(60);
+      /* the cells on either side of the changed elements, and the
+	 pixels whose correlation takes those cells into account */
+      f = ((float) mapFactor) / reductionFactor;
+      hw = correlationHalfWidth;
+      minX = max((int) floor((minX - 1 + mapOffsetX) * f) - imageMinX - hw, 0);
+      maxX = min((int) ceil((maxX + 1 + mapOffsetX) * f) - imageMinX + hw,
+		 imageWidth - 1);
+      minY = max((int) floor((minY - 1 + mapOffsetY) * f) - imageMinY - hw, 0);
+      maxY = min((int) ceil((maxY + 1 + mapOffsetY) * f) - imageMinY + hw,
+		 imageHeight - 1);
+      if (minX <= maxX && minY <= maxY)
+	{
+	  GrowRect(&dirtyMinX, &dirtyMaxX, &dirtyMinY, &dirtyMaxY,
+		   minX, maxX, minY, maxY);
+	  pthread_cond_broadcast(&corrCond);
+	}
     }
-  free(outMap);
+  pthread_mutex_unlock(&corrLock);
 }
 
 void
@@ -776,15 +1671,8 @@ ImageWindow::computeWarped ()
   float xMin, xMax, yMin, yMax;
   float xRange, yRange;
   float scaleX, scaleY;
-  float xp, yp;
   int x, y;
-  float rx, ry, rc;
-  int irx, iry;
-  float rrx, rry;
-  float r00, r01, r10, r11;
-  float rv;
   float xv, yv;
-  int b;
 
   int mapWidth = parent->mapWidth;
   int mapHeight = parent->mapHeight;
@@ -829,68 +1717,7 @@ ImageWindow::computeWarped ()
   printf("cw: scale=%f xo=%f yo=%f w=%d h=%d\n", scale, xOffset, yOffset,
 	 width, height);
 
-  if (warped != 0)
-    free(warped);
-  warped = (unsigned char *) malloc(width * height * sizeof(unsigned char));
-  memset(warped, 0, width * height * sizeof(unsigned char));
-
-  unsigned char* image = parent->image;
-  if (image == 0)
-    return;
-  int imageWidth = parent->imageWidth;
-  int imageHeight = parent->imageHeight;
-  int imageMinX = parent->imageMinX;
-  int imageMinY = parent->imageMinY;
-  InverseMap* inverseMap = parent->inverseMap;
-  float mapOffsetX = parent->mapOffsetX;
-  float mapOffsetY = parent->mapOffsetY;
-    
-  for (y = 0; y < height; ++y)
-    for (x = 0; x < width; ++x)
-      {
-	xp = ((x + 0.5 - xOffset) / scale) * reductionFactor / mapFactor;
-	yp = ((y + 0.5 - yOffset) / scale) * reductionFactor / mapFactor;
-	if (!Invert(inverseMap, &xv, &yv, xp, yp))
-	  {
-	    warped[y*width + x] = 0;
-	    continue;
-	  }
-	rx = (xv + mapOffsetX) * mapFactor / reductionFactor - 0.5 - imageMinX;
-	ry = (yv + mapOffsetY) * mapFactor / reductionFactor - 0.5 - imageMinY;
-	irx = (int) floor(rx);
-	iry = (int) floor(ry);
-	if (irx < 0 || irx >= imageWidth-1 ||
-	    iry < 0 || iry >= imageHeight-1)
-	  {
-	    warped[y*width + x] = 0;
-	    continue;
-	  }
-	rrx = rx - irx;
-	rry = ry - iry;
-	r00 = image[iry*imageWidth + irx];
-	r01 = image[(iry+1)*imageWidth + irx];
-	r10 = image[iry*imageWidth + irx + 1];
-	r11 = image[(iry+1)*imageWidth + irx + 1];
-	rv = r00 * (rrx - 1.0) * (rry - 1.0)
-	  - r10 * rrx * (rry - 1.0) 
-	  - r01 * (rrx - 1.0) * rry
-	  + r11 * rrx * rry;
-	if (rv < -10.0 || rv > 1000.0)
-	  {
-	    printf("rv = %f  x = %d y = %d irx = %d iry = %d\n",
-		   rv, x, y, irx, iry);
-	    exit(1);
-	  }
-	b = (int) (rv);
-	if (b < 0)
-	  b = 0;
-	else if (b > 255)
-	  b = 255;
-	warped[y * width + x] = b;
-      }
   textureValid = false;
-
-  printf("warped set: w=%d h=%d\n", width, height);
 }
 
 void
@@ -898,42 +1725,141 @@ ImageWindow::initTexture (int w, int h)
 {
   printf("initTexture called with w=%d h=%d\n", w, h);
 
-  // initialize the texture
-  if (texture > 0)
-    glDeleteTextures(1, &texture);
-  glGenTextures(1, &texture); 
+  // initialize the textures of the image and of its correlation
+  GLuint *textures[2] = { &texture, &corrTexture };
+  for (int i = 0; i < 2; ++i)
+    {
+      if (*textures[i] > 0)
+	glDeleteTextures(1, textures[i]);
+      glGenTextures(1, textures[i]);
+    }
   //  printf("textures = %d %d %d\n", texture[0], texture[1], texture[2]);
   textureWidth = w;
   textureHeight = h;
   unsigned char* black = (unsigned char *) malloc(textureWidth * textureHeight);
   memset(black, 0, textureWidth*textureHeight);
   glEnable(GL_TEXTURE_2D);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_REPEAT); 
+  for (int i = 0; i < 2; ++i)
+    {
+      glBindTexture(GL_TEXTURE_2D, *textures[i]);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_REPEAT); 
+    }
   glTexEnvi(GL_TEXTURE_ENV,GL_TEXTURE_ENV_MODE,GL_REPLACE); 
   glBindTexture(GL_TEXTURE_2D, 0);
   glDisable(GL_TEXTURE_2D);
   free(black);
+  corrTextureValid = false;
+}
+
+/* uploadCorrelation loads the correlation recomputed since it was last
+   called (or all of it, if corrTextureValid is false) into the
+   correlation texture, reduced as the image is; correlations of 0 or
+   less are black, and one of 1 white */
+void
+ImageWindow::uploadCorrelation ()
+{
+  int x0, x1, y0, y1;
+  int x, y;
+  int dx, dy;
+  int f = textureFactor;
+  int imageWidth = parent->imageWidth;
+  int imageHeight = parent->imageHeight;
+  float sum;
+  int b;
+
+  pthread_mutex_lock(&corrLock);
+  if (!corrTextureValid)
+    {
+      x0 = 0;
+      x1 = textureWidth - 1;
+      y0 = 0;
+      y1 = textureHeight - 1;
+    }
+  else if (doneMinY <= doneMaxY)
+    {
+      x0 = doneMinX / f;
+      x1 = min(doneMaxX / f, textureWidth - 1);
+      y0 = doneMinY / f;
+      y1 = min(doneMaxY / f, textureHeight - 1);
+    }
+  else
+    {
+      pthread_mutex_unlock(&corrLock);
+      return;
+    }
+  doneMinY = 0;
+  doneMaxY = -1;
+
+  int w = x1 - x0 + 1;
+  int h = y1 - y0 + 1;
+  unsigned char *img = (unsigned char*) malloc(3 * w * h);
+  unsigned char *p = img;
+  for (y = y0; y <= y1; ++y)
+    for (x = x0; x <= x1; ++x)
+      {
+	if (correlation != 0 && x < imageWidth / f && y < imageHeight / f)
+	  {
+	    sum = 0.0;
+	    for (dy = 0; dy < f; ++dy)
+	      for (dx = 0; dx < f; ++dx)
+		sum += correlation[(y * f + dy) * imageWidth + x * f + dx];
+	    b = (int) (255.0 * sum / (f * f));
+	    if (b < 0)
+	      b = 0;
+	    else if (b > 255)
+	      b = 255;
+	  }
+	else
+	  b = 0;
+	*p++ = b;
+	*p++ = b;
+	*p++ = b;
+      }
+  pthread_mutex_unlock(&corrLock);
+
+  glBindTexture(GL_TEXTURE_2D, corrTexture);
+  if (!corrTextureValid)
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, textureWidth, textureHeight, 0,
+		 GL_RGB, GL_UNSIGNED_BYTE, img);
+  else
+    {
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, w, h,
+		      GL_RGB, GL_UNSIGNED_BYTE, img);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  free(img);
+  corrTextureValid = true;
 }
 
 void
-ImageWindow::setTexture (unsigned char *image, int w, int h)
+ImageWindow::setTexture (unsigned char *image, int w, int h, int f)
 {
   int x, y;
+  int dx, dy;
+  int sum;
   unsigned char b;
 
-  printf("ImageWindow::setTexture(%p, %d, %d)\n",
-	 image, w, h);
+  printf("ImageWindow::setTexture(%p, %d, %d, %d)\n",
+	 image, w, h, f);
   unsigned char *img = (unsigned char*) malloc(3 * textureWidth * textureHeight);
   unsigned char *p = img;
   for (y = 0; y < textureHeight; ++y)
     for (x = 0; x < textureWidth; ++x)
       {
-	if (x < w && y < h)
-	  b = image[y * w + x];
+	if (image != 0 && x < w / f && y < h / f)
+	  {
+	    /* each texel is the mean of an f x f block of the image */
+	    sum = 0;
+	    for (dy = 0; dy < f; ++dy)
+	      for (dx = 0; dx < f; ++dx)
+		sum += image[(y * f + dy) * w + x * f + dx];
+	    b = sum / (f * f);
+	  }
 	else
 	  b = 0;
 	*p++ = b;
@@ -952,11 +1878,16 @@ ImageWindow::ImageWindow(MyWindow *p, int w, int h) :
 {
   parent = p;
   textureValid = false;
+  corrTextureValid = false;
+  showCorrelation = false;
   textureInitialized = false;
+  texture = 0;
+  corrTexture = 0;
   textureWidth = -1;
   textureHeight = -1;
   circleInitialized = false;
-  warped = 0;
+  mesh = 0;
+  textureFactor = 1;
   width = -1;
   height = -1;
   name[0] = '\0';
@@ -992,193 +1923,20 @@ MyWindow::reshape (int w, int h)
 void
 MyWindow::selectSeed ()
 {
-  // find the top 10% of map elements in terms of low distortion score;
-  vector<MapElementAndDistortion> m;
-  MapElementAndDistortion me;
-  int x, y;
-  double distX, distY;
-  double distA, distB;
-  float diagonal, orthogonal;
-  for (y = 0; y < mapHeight-1; ++y)
-    for (x = 0; x < mapWidth-1; ++x)
-      {
-	if (map[y * mapWidth + x].c == 0.0 || map[y * mapWidth + x + 1].c == 0.0 ||
-	    map[(y + 1) * mapWidth + x].c == 0.0 || map[(y + 1) * mapWidth + x + 1].c == 0.0)
-	  continue;
-	distX = 0.5 * hypot(map[y * mapWidth + x].x - map[y * mapWidth + x + 1].x,
-			    map[y * mapWidth + x].y - map[y * mapWidth + x + 1].y) +
-	  0.5 * hypot(map[(y + 1) * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[(y + 1) * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
-	distY = 0.5 * hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x].x,
-			    map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x].y) +
-	  0.5 * hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x + 1].y);
-	orthogonal = distY / distX;
-	distA = hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
-	distB = hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x].x,
-		      map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x].y);
-	diagonal = distB / distA;
-	me.x = x;
-	me.y = y;
-	me.distortion = fabs(orthogonal - avgOrthogonal) / avgOrthogonal +
-	  fabs(diagonal - avgDiagonal) / avgDiagonal;
-	m.push_back(me);
-      }
-  sort(m.begin(), m.end(), lesserDistortion);
-
-  //   find the average location of those
-  double sumX, sumY;
-  double avgX, avgY;
-  int n = (m.size() + 9) / 10;
-  if (n == 0)
-    return;
-  for (int i = 0; i < n; ++i)
-    {
-      sumX += m[i].x;
-      sumY += m[i].y;
-    }
-  avgX = sumX / n;
-  avgY = sumY / n;
+  int seed;
 
-  //   pick the element that is located closest to the average
-  double closestDist = 1.0e30;
-  int closest = -1;
-  double dist;
-  for (int i = 0; i < n; ++i)
-    {
-      dist = hypot(m[i].x - avgX, m[i].y - avgY);
-      if (dist < closestDist)
-	{
-	  closest = i;
-	  closestDist = dist;
-	}
-    }
-  if (closest >= 0)
-    seeds.push_back(m[closest].y * mapWidth + m[closest].x);
+  seed = SelectSeed(map, mapWidth, mapHeight, avgOrthogonal, avgDiagonal);
+  if (seed >= 0)
+    seeds.push_back(seed);
 }
 
 void
 MyWindow::updateMask ()
 {
-  int x, y;
-  double distX, distY;
-  double distA, distB;
-  bool overThreshold;
-  float diagonal, orthogonal;
-
-  float oThreshold = orthogonalSlider->value();
-  float dThreshold = diagonalSlider->value();
-  for (y = 0; y < mapHeight-1; ++y)
-    for (x = 0; x < mapWidth-1; ++x)
-      {
-	if (map[y*mapWidth+x].c == 0.0 || map[y*mapWidth+x+1].c == 0.0 ||
-	    map[(y+1)*mapWidth+x].c == 0.0 || map[(y+1)*mapWidth+x+1].c == 0.0)
-	  {
-	    mapMask[y * mapWidth + x] = 0;
-	    continue;
-	  }
-	mapMask[y * mapWidth + x] |= VALID_BIT;
-
-	if (mapMask[y*mapWidth + x] & REJECT_BIT)
-	  {
-	    mapMask[y*mapWidth + x] &= ~THRESHOLD_BIT;
-	    continue;
-	  }
-	if (mapMask[y*mapWidth + x] & ACCEPT_BIT)
-	  {
-	    mapMask[y*mapWidth + x] |= THRESHOLD_BIT;
-	    continue;
-	  }
-
-	overThreshold = false;
-
-	distX = 0.5 * hypot(map[y * mapWidth + x].x - map[y * mapWidth + x + 1].x,
-			    map[y * mapWidth + x].y - map[y * mapWidth + x + 1].y) +
-	  0.5 * hypot(map[(y + 1) * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[(y + 1) * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
-	distY = 0.5 * hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x].x,
-			    map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x].y) +
-	  0.5 * hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x + 1].y);
-	orthogonal = distY / distX;
-	if (fabs(orthogonal - avgOrthogonal) / avgOrthogonal >= oThreshold)
-	  overThreshold = true;
-	distA = hypot(map[y * mapWidth + x].x - map[(y + 1) * mapWidth + x + 1].x,
-		      map[y * mapWidth + x].y - map[(y + 1) * mapWidth + x + 1].y);
-	distB = hypot(map[y * mapWidth + x + 1].x - map[(y + 1) * mapWidth + x].x,
-		      map[y * mapWidth + x + 1].y - map[(y + 1) * mapWidth + x].y);
-	diagonal = distB / distA;
-	if (fabs(diagonal - avgDiagonal) / avgDiagonal >= dThreshold)
-	  overThreshold = true;
-
-	/* update mask */
-	if (overThreshold)
-	  mapMask[y * mapWidth + x] &= ~THRESHOLD_BIT;
-	else
-	  mapMask[y * mapWidth + x] |= THRESHOLD_BIT;
-      }
-
-  // clear all the cluster bits
-  for (y = 0; y < mapHeight-1; ++y)
-    for (x = 0; x < mapWidth-1; ++x)
-      {
-	mapMask[y * mapWidth + x] &= ~CLUSTER_BIT;
-	cluster[y * mapWidth + x] = -1;
-      }
-
-  unsigned int *stack = (unsigned int *) malloc(mapHeight * mapWidth * sizeof(int));
-  printf("updateMask: seeds.size = %zd\n", seeds.size());
-  for (int i = 0; i < seeds.size(); ++i)
-    {
-      y = seeds[i] / mapWidth;
-      x = seeds[i] - y * mapWidth;
-      if (cluster[y * mapWidth + x] >= 0)
-	continue;
-      cluster[y * mapWidth + x] = i;
-      int sp = 0;
-      stack[sp++] = y*mapWidth+x;
-      int count = 0;
-      while (sp > 0)
-	{
-	  ++count;
-	  --sp;
-	  y = stack[sp] / mapWidth;
-	  x = stack[sp] - y * mapWidth;
-	  mapMask[y * mapWidth + x] |= CLUSTER_BIT;
-	  
-	  /* check up */
-	  if (y > 0 && (mapMask[(y-1)*mapWidth+x] & THRESHOLD_BIT) &&
-	      cluster[(y-1)*mapWidth+x] < 0)
-	    {
-	      cluster[(y-1)*mapWidth+x] = i;
-	      stack[sp++] = (y-1)*mapWidth+x;
-	    }
-	  /* check right */
-	  if (x < mapWidth-2 && (mapMask[y*mapWidth+x+1] & THRESHOLD_BIT) &&
-	      cluster[y*mapWidth+x+1] < 0)
-	    {
-	      cluster[y*mapWidth+x+1] = i;
-	      stack[sp++] = y*mapWidth+x+1;
-	    }
-	  /* check down */
-	  if (y < mapHeight-2 && (mapMask[(y+1)*mapWidth+x] & THRESHOLD_BIT) &&
-	      cluster[(y+1)*mapWidth+x] < 0)
-	    {
-	      cluster[(y+1)*mapWidth+x] = i;
-	      stack[sp++] = (y+1)*mapWidth+x;
-	    }
-	  /* check left */
-	  if (x > 0 && (mapMask[y*mapWidth+x-1] & THRESHOLD_BIT) &&
-	      cluster[y*mapWidth+x-1] < 0)
-	    {
-	      cluster[y*mapWidth+x-1] = i;
-	      stack[sp++] = y*mapWidth+x-1;
-	    }
-	}
-      printf("flood fill marked %d elements\n", count);
-    }
-  free(stack);
+  ClassifyCells(map, mapWidth, mapHeight, avgOrthogonal, avgDiagonal,
+		orthogonalSlider->value(), diagonalSlider->value(),
+		seeds, mapMask, cluster, true);
+  updateCorrelation();
 }
 
 void
@@ -1229,23 +1987,31 @@ ImageWindow::draw ()
   //	 textureValid ? 1 : 0, textureWidth, textureHeight);
   if (!textureValid)
     {
+      // the texture holds the unwarped image, reduced if it is
+      //   too large for the hardware
+      int imageWidth = parent->imageWidth;
+      int imageHeight = parent->imageHeight;
+      GLint maxTextureSize;
+      glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+      textureFactor = 1;
+      while (imageWidth / textureFactor > maxTextureSize ||
+	     imageHeight / textureFactor > maxTextureSize)
+	textureFactor <<= 1;
+
       // resize texture if necessary
       int newTextureWidth = 64;
-      while (newTextureWidth < width)
+      while (newTextureWidth < imageWidth / textureFactor)
 	newTextureWidth <<= 1;
       int newTextureHeight = 64;
-      while (newTextureHeight < height)
+      while (newTextureHeight < imageHeight / textureFactor)
 	newTextureHeight <<= 1;
       printf("ntw=%d nth=%d\n", newTextureWidth, newTextureHeight);
       if (newTextureWidth != textureWidth ||
 	  newTextureHeight != textureHeight)
 	initTexture(newTextureWidth, newTextureHeight);
 
-      maxx = ((float) (width)) / textureWidth;
-      maxy = ((float) (height)) / textureHeight;
-
-      //      printf("setting textures %d %d %d %d %d %d\n", textureWidth, textureHeight, imageWidth, imageHeight, refWidth, refHeight);
-      setTexture(warped, width, height);
+      setTexture(parent->image, imageWidth, imageHeight, textureFactor);
+      buildMesh();
       textureValid = true;
     }
 
@@ -1258,18 +2024,12 @@ ImageWindow::draw ()
 
   //  printf("ImageWindow::draw  aw=%d ah=%d\n", width, height);
   glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+  if (showCorrelation)
+    uploadCorrelation();
   glEnable(GL_TEXTURE_2D);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glBegin(GL_QUADS);
-  glTexCoord2f(0.0, 0.0);
-  glVertex2f(0.0, (float) (height));
-  glTexCoord2f(maxx, 0.0);
-  glVertex2f((float) (width), (float) (height));
-  glTexCoord2f(maxx, maxy);
-  glVertex2f((float) (width), 0.0);
-  glTexCoord2f(0.0, maxy);
-  glVertex2f(0.0, 0.0);
-  glEnd();
+  glBindTexture(GL_TEXTURE_2D, showCorrelation ? corrTexture : texture);
+  glCallList(mesh);
+  glBindTexture(GL_TEXTURE_2D, 0);
   glDisable(GL_TEXTURE_2D);
 
   glBegin(GL_LINES);
@@ -1568,6 +2328,7 @@ ImageWindow::handle (int event)
 		parent->index = max(parent->index-1, 0);
 	      parent->increment = -1;
 	      parent->loadSection();
+	      parent->prefetch();
 	      parent->imageWindow->textureValid = false;
 	      parent->imageWindow->redraw();
 	      parent->redraw();
@@ -1585,6 +2346,7 @@ ImageWindow::handle (int event)
 		parent->index = min(parent->index+1, nPairs-1);
 	      parent->increment = 1;
 	      parent->loadSection();
+	      parent->prefetch();
 	      parent->imageWindow->textureValid = false;
 	      parent->imageWindow->redraw();
 	      parent->redraw();
@@ -1594,6 +2356,17 @@ ImageWindow::handle (int event)
 	  break;
 	}
       break;
+    case FL_FOCUS:
+    case FL_UNFOCUS:
+      break;
+    case FL_KEYBOARD:
+      if (Fl::event_key() != 'c' || !computeCorrelation)
+	return(Fl_Gl_Window::handle(event));
+      /* switch between the image and its correlation */
+      showCorrelation = !showCorrelation;
+      corrTextureValid = false;
+      redraw();
+      break;
     default:
       return(Fl_Gl_Window::handle(event));
     }
@@ -1620,6 +2393,58 @@ DiagonalSliderCallback (Fl_Widget *w, void *data)
   window->imageWindow->redraw();
 }
 
+/* buildMesh makes the display list that draws the image warped by
+   the map: each quad of valid map nodes is drawn where the map puts
+   its nodes, textured with the part of the image the nodes come from,
+   so that OpenGL interpolates the map between them */
+void
+ImageWindow::buildMesh ()
+{
+  int x, y;
+  int i;
+  int dx, dy;
+  MapElement *e;
+
+  int mapWidth = parent->mapWidth;
+  int mapHeight = parent->mapHeight;
+  MapElement* map = parent->map;
+  int mapFactor = parent->mapFactor;
+  int mapOffsetX = parent->mapOffsetX;
+  int mapOffsetY = parent->mapOffsetY;
+  int imageMinX = parent->imageMinX;
+  int imageMinY = parent->imageMinY;
+  float tw = (float) (textureFactor * textureWidth);
+  float th = (float) (textureFactor * textureHeight);
+
+  if (mesh == 0)
+    mesh = glGenLists(1);
+  glNewList(mesh, GL_COMPILE);
+  if (map != 0 && parent->image != 0)
+    {
+      glBegin(GL_QUADS);
+      for (y = 0; y < mapHeight-1; ++y)
+	for (x = 0; x < mapWidth-1; ++x)
+	  {
+	    if (map[y*mapWidth+x].c == 0.0 || map[y*mapWidth+x+1].c == 0.0 ||
+		map[(y+1)*mapWidth+x].c == 0.0 ||
+		map[(y+1)*mapWidth+x+1].c == 0.0)
+	      continue;
+	    for (i = 0; i < 4; ++i)
+	      {
+		dx = (i == 1 || i == 2);
+		dy = (i >= 2);
+		e = &map[(y+dy)*mapWidth+x+dx];
+		glTexCoord2f((((float) (x + dx + mapOffsetX)) * mapFactor / reductionFactor - imageMinX) / tw,
+			     (((float) (y + dy + mapOffsetY)) * mapFactor / reductionFactor - imageMinY) / th);
+		glVertex2f(scale * e->x * mapFactor / reductionFactor + xOffset,
+			   height - (scale * e->y * mapFactor / reductionFactor + yOffset));
+	      }
+	  }
+      glEnd();
+    }
+  glEndList();
+}
+
 void
 ImageWindow::initCircle ()
 {
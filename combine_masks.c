@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "imio.h"
+#include "bitmap.h"
 
 int
 main (int argc, char **argv)
@@ -15,13 +16,15 @@ main (int argc, char **argv)
   unsigned char *inputMask2;
   int iw2, ih2;
   unsigned char *outputMask;
-  int x, y;
+  unsigned char *filtered;
   int error;
   char inputMaskName1[PATH_MAX];
   char inputMaskName2[PATH_MAX];
   char outputMaskName[PATH_MAX];
   int orOperation;
   int andOperation;
+  int invert1, invert2;
+  int dilateRadius, erodeRadius;
 
   error = 0;
   inputMaskName1[0] = '\0';
@@ -29,6 +32,10 @@ main (int argc, char **argv)
   outputMaskName[0] = '\0';
   orOperation = 0;
   andOperation = 0;
+  invert1 = 0;
+  invert2 = 0;
+  dilateRadius = 0;
+  erodeRadius = 0;
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-input1") == 0)
       {
@@ -61,6 +68,28 @@ main (int argc, char **argv)
       orOperation = 1;
     else if (strcmp(argv[i], "-and") == 0)
       andOperation = 1;
+    else if (strcmp(argv[i], "-invert1") == 0)
+      invert1 = 1;
+    else if (strcmp(argv[i], "-invert2") == 0)
+      invert2 = 1;
+    else if (strcmp(argv[i], "-dilate") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &dilateRadius) != 1 ||
+	    dilateRadius < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-erode") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &erodeRadius) != 1 ||
+	    erodeRadius < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else error = 1;
 	
   if (error)
@@ -70,6 +99,10 @@ main (int argc, char **argv)
       fprintf(stderr, "                     -output out.pbm\n");
       fprintf(stderr, "                     [-and]\n");
       fprintf(stderr, "                     [-or]\n");
+      fprintf(stderr, "                     [-invert1]\n");
+      fprintf(stderr, "                     [-invert2]\n");
+      fprintf(stderr, "                     [-dilate radius]\n");
+      fprintf(stderr, "                     [-erode radius]\n");
       exit(1);
     }
 
@@ -91,7 +124,7 @@ main (int argc, char **argv)
 		  msg))
     {
       fprintf(stderr, "Could not read input mask %s:\n  error: %s\n",
-	      argv[1], msg);
+	      inputMaskName1, msg);
       exit(1);
     }
   imbpl = (iw + 7) >> 3;
@@ -100,7 +133,7 @@ main (int argc, char **argv)
 		  msg))
     {
       fprintf(stderr, "Could not read 2nd input mask %s:\n  error: %s\n",
-	      argv[2], msg);
+	      inputMaskName2, msg);
       exit(1);
     }
   if (iw2 != iw || ih2 != ih)
@@ -109,26 +142,51 @@ main (int argc, char **argv)
       exit(1);
     }
   outputMask = malloc(ih * imbpl * sizeof(unsigned char));
-  memset(outputMask, 0, ih * imbpl);
 
+  if (invert1)
+    InvertMask(inputMask1, inputMask1, iw, ih);
+  if (invert2)
+    InvertMask(inputMask2, inputMask2, iw, ih);
   if (orOperation)
-    {
-      for (y = 0; y < ih; ++y)
-	for (i = 0; i < imbpl; ++i)
-	  outputMask[y*imbpl + i] = inputMask1[y*imbpl + i] | inputMask2[y*imbpl + i];
-    }
+    OrMasks(outputMask, inputMask1, inputMask2, ((size_t) ih) * imbpl);
   else
+    AndMasks(outputMask, inputMask1, inputMask2, ((size_t) ih) * imbpl);
+
+  /* dilate first, so that -dilate n -erode n closes gaps in the mask */
+  if (dilateRadius > 0 || erodeRadius > 0)
     {
-      for (y = 0; y < ih; ++y)
-	for (i = 0; i < imbpl; ++i)
-	  outputMask[y*imbpl + i] = inputMask1[y*imbpl + i] & inputMask2[y*imbpl + i];
+      filtered = malloc(ih * imbpl * sizeof(unsigned char));
+      if (filtered == NULL)
+	{
+	  fprintf(stderr, "Could not allocate mask.\n");
+	  exit(1);
+	}
+      if (dilateRadius > 0)
+	{
+	  if (!DilateMask(outputMask, iw, ih, dilateRadius, filtered))
+	    {
+	      fprintf(stderr, "Could not allocate mask.\n");
+	      exit(1);
+	    }
+	  memcpy(outputMask, filtered, ih * imbpl);
+	}
+      if (erodeRadius > 0)
+	{
+	  if (!ErodeMask(outputMask, iw, ih, erodeRadius, filtered))
+	    {
+	      fprintf(stderr, "Could not allocate mask.\n");
+	      exit(1);
+	    }
+	  memcpy(outputMask, filtered, ih * imbpl);
+	}
+      free(filtered);
     }
 
   if (!WriteBitmap(outputMaskName, outputMask, iw, ih,
 		   UncompressedBitmap, msg))
     {
       fprintf(stderr, "Could not write output mask %s:\n  error: %s\n",
-	      argv[3], msg);
+	      outputMaskName, msg);
       exit(1);
     }
 
@@ -0,0 +1,406 @@
+/*
+ * compare_batch.c -- runs the comparison of compare_maps or
+ *                    compare_images over whole directories or lists
+ *                    of pairs, on a pool of threads
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  HISTORY
+ *    2026     Written for the batch modes of compare_maps and
+ *             compare_images
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "compare_batch.h"
+
+typedef struct BatchPair
+{
+  char *label;		/* the name the pair is reported under */
+  char *name1;
+  char *name2;
+  int ok;
+  double rms;
+  double maxError;
+  double seconds;
+  char *error;		/* if !ok, why not */
+} BatchPair;
+
+typedef struct Batch
+{
+  int nPairs;
+  BatchPair *pairs;
+  CompareFunction compare;
+  int next;		/* the next pair to be compared */
+  pthread_mutex_t lock;
+} Batch;
+
+static int ListDirectories (Batch *b, char *dir1, char *dir2,
+			    char **suffixes, int nSuffixes, char *error);
+static int ListPairs (Batch *b, char *listName, char *error);
+static void AddPair (Batch *b, char *label, char *name1, char *name2);
+static void *BatchThreadMain (void *arg);
+static int CompareNames (const void *a, const void *b);
+static void WriteCsvString (FILE *f, char *s);
+static void WriteJsonString (FILE *f, char *s);
+
+int
+CompareBatch (char *dir1, char *dir2, char *listName,
+	      char **suffixes, int nSuffixes,
+	      CompareFunction compare, int nThreads,
+	      char *csvName, char *jsonName,
+	      double *maxRms, char *error)
+{
+  Batch b;
+  BatchPair *p;
+  pthread_t *threads;
+  FILE *f;
+  int i;
+  int nFailed;
+
+  b.nPairs = 0;
+  b.pairs = NULL;
+  b.compare = compare;
+  b.next = 0;
+  pthread_mutex_init(&b.lock, NULL);
+  if (listName != NULL && listName[0] != '\0')
+    {
+      if (!ListPairs(&b, listName, error))
+	return(-1);
+    }
+  else if (!ListDirectories(&b, dir1, dir2, suffixes, nSuffixes, error))
+    return(-1);
+  if (b.nPairs == 0)
+    {
+      sprintf(error, "No pairs of files to compare.\n");
+      return(-1);
+    }
+
+  if (nThreads > b.nPairs)
+    nThreads = b.nPairs;
+  if (nThreads <= 1)
+    BatchThreadMain(&b);
+  else
+    {
+      threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+      for (i = 0; i < nThreads; ++i)
+	if (pthread_create(&threads[i], NULL, BatchThreadMain, &b) != 0)
+	  {
+	    /* the threads already started finish the batch */
+	    nThreads = i;
+	    break;
+	  }
+      if (nThreads == 0)
+	BatchThreadMain(&b);
+      for (i = 0; i < nThreads; ++i)
+	pthread_join(threads[i], NULL);
+      free(threads);
+    }
+
+  nFailed = 0;
+  *maxRms = 0.0;
+  for (i = 0; i < b.nPairs; ++i)
+    if (!b.pairs[i].ok)
+      ++nFailed;
+    else if (b.pairs[i].rms > *maxRms)
+      *maxRms = b.pairs[i].rms;
+
+  if (csvName != NULL && csvName[0] != '\0')
+    {
+      f = fopen(csvName, "w");
+      if (f == NULL)
+	fprintf(stderr, "Could not open %s for writing.\n", csvName);
+      else
+	{
+	  fprintf(f, "name,file1,file2,rms,max_error,seconds,error\n");
+	  for (i = 0; i < b.nPairs; ++i)
+	    {
+	      p = &b.pairs[i];
+	      WriteCsvString(f, p->label);
+	      fprintf(f, ",");
+	      WriteCsvString(f, p->name1);
+	      fprintf(f, ",");
+	      WriteCsvString(f, p->name2);
+	      if (p->ok)
+		fprintf(f, ",%f,%f,%f,\n", p->rms, p->maxError, p->seconds);
+	      else
+		{
+		  fprintf(f, ",,,%f,", p->seconds);
+		  WriteCsvString(f, p->error);
+		  fprintf(f, "\n");
+		}
+	    }
+	  fclose(f);
+	}
+    }
+
+  if (jsonName != NULL && jsonName[0] != '\0')
+    {
+      f = fopen(jsonName, "w");
+      if (f == NULL)
+	fprintf(stderr, "Could not open %s for writing.\n", jsonName);
+      else
+	{
+	  fprintf(f, "[\n");
+	  for (i = 0; i < b.nPairs; ++i)
+	    {
+	      p = &b.pairs[i];
+	      fprintf(f, "  {\"name\": ");
+	      WriteJsonString(f, p->label);
+	      fprintf(f, ", \"file1\": ");
+	      WriteJsonString(f, p->name1);
+	      fprintf(f, ", \"file2\": ");
+	      WriteJsonString(f, p->name2);
+	      if (p->ok)
+		fprintf(f, ", \"rms\": %f, \"max_error\": %f, \"seconds\": %f}",
+			p->rms, p->maxError, p->seconds);
+	      else
+		{
+		  fprintf(f, ", \"seconds\": %f, \"error\": ", p->seconds);
+		  WriteJsonString(f, p->error);
+		  fprintf(f, "}");
+		}
+	      fprintf(f, "%s\n", i < b.nPairs - 1 ? "," : "");
+	    }
+	  fprintf(f, "]\n");
+	  fclose(f);
+	}
+    }
+
+  for (i = 0; i < b.nPairs; ++i)
+    {
+      p = &b.pairs[i];
+      if (!p->ok)
+	fprintf(stderr, "Could not compare %s:\n  %s", p->label, p->error);
+      free(p->label);
+      free(p->name1);
+      free(p->name2);
+      if (p->error != NULL)
+	free(p->error);
+    }
+  free(b.pairs);
+  pthread_mutex_destroy(&b.lock);
+  return(nFailed);
+}
+
+/* ListDirectories pairs each file of dir1 having one of the suffixes
+   with the file of the same name in dir2, in order of name */
+static int
+ListDirectories (Batch *b, char *dir1, char *dir2,
+		 char **suffixes, int nSuffixes, char *error)
+{
+  DIR *dir;
+  struct dirent *de;
+  char **names;
+  int nNames, maxNames;
+  int len, slen;
+  int i, j;
+  char name1[PATH_MAX], name2[PATH_MAX];
+  char *sep1, *sep2;
+
+  dir = opendir(dir1);
+  if (dir == NULL)
+    {
+      sprintf(error, "Could not open directory %s\n", dir1);
+      return(0);
+    }
+  nNames = 0;
+  maxNames = 0;
+  names = NULL;
+  while ((de = readdir(dir)) != NULL)
+    {
+      len = strlen(de->d_name);
+      for (j = 0; j < nSuffixes; ++j)
+	{
+	  slen = strlen(suffixes[j]);
+	  if (len > slen && strcmp(&de->d_name[len-slen], suffixes[j]) == 0)
+	    break;
+	}
+      if (j >= nSuffixes)
+	continue;
+      if (nNames >= maxNames)
+	{
+	  maxNames = 2 * maxNames + 64;
+	  names = (char **) realloc(names, maxNames * sizeof(char *));
+	}
+      names[nNames++] = strdup(de->d_name);
+    }
+  closedir(dir);
+  qsort(names, nNames, sizeof(char *), CompareNames);
+
+  len = strlen(dir1);
+  sep1 = (len > 0 && dir1[len-1] != '/') ? "/" : "";
+  len = strlen(dir2);
+  sep2 = (len > 0 && dir2[len-1] != '/') ? "/" : "";
+  for (i = 0; i < nNames; ++i)
+    {
+      snprintf(name1, PATH_MAX, "%s%s%s", dir1, sep1, names[i]);
+      snprintf(name2, PATH_MAX, "%s%s%s", dir2, sep2, names[i]);
+      AddPair(b, names[i], name1, name2);
+      free(names[i]);
+    }
+  if (names != NULL)
+    free(names);
+  return(1);
+}
+
+/* ListPairs reads the pairs of filenames from listName, one pair per
+   line; blank lines and lines starting with # are skipped */
+static int
+ListPairs (Batch *b, char *listName, char *error)
+{
+  FILE *f;
+  char line[2*PATH_MAX+64];
+  char name1[PATH_MAX], name2[PATH_MAX];
+  int lineNo;
+  int n;
+
+  f = fopen(listName, "r");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open list %s\n", listName);
+      return(0);
+    }
+  lineNo = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+    {
+      ++lineNo;
+      n = sscanf(line, "%s %s", name1, name2);
+      if (n <= 0 || name1[0] == '#')
+	continue;
+      if (n != 2)
+	{
+	  sprintf(error, "Line %d of %s does not name two files\n",
+		  lineNo, listName);
+	  fclose(f);
+	  return(0);
+	}
+      AddPair(b, name1, name1, name2);
+    }
+  fclose(f);
+  return(1);
+}
+
+static void
+AddPair (Batch *b, char *label, char *name1, char *name2)
+{
+  BatchPair *p;
+
+  if ((b->nPairs & 255) == 0)
+    b->pairs = (BatchPair *) realloc(b->pairs,
+				     (b->nPairs + 256) * sizeof(BatchPair));
+  p = &b->pairs[b->nPairs++];
+  p->label = strdup(label);
+  p->name1 = strdup(name1);
+  p->name2 = strdup(name2);
+  p->ok = 0;
+  p->rms = 0.0;
+  p->maxError = 0.0;
+  p->seconds = 0.0;
+  p->error = NULL;
+}
+
+static void *
+BatchThreadMain (void *arg)
+{
+  Batch *b = (Batch *) arg;
+  BatchPair *p;
+  struct timeval start, end;
+  char msg[PATH_MAX+256];
+  int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&b->lock);
+      i = b->next;
+      if (i < b->nPairs)
+	++b->next;
+      pthread_mutex_unlock(&b->lock);
+      if (i >= b->nPairs)
+	break;
+
+      p = &b->pairs[i];
+      msg[0] = '\0';
+      gettimeofday(&start, NULL);
+      p->ok = (*b->compare)(p->name1, p->name2, &p->rms, &p->maxError, msg);
+      gettimeofday(&end, NULL);
+      p->seconds = (end.tv_sec - start.tv_sec) +
+	1.0e-6 * (end.tv_usec - start.tv_usec);
+      if (!p->ok)
+	p->error = strdup(msg);
+    }
+  return(NULL);
+}
+
+static int
+CompareNames (const void *a, const void *b)
+{
+  return(strcmp(*((char **) a), *((char **) b)));
+}
+
+static void
+WriteCsvString (FILE *f, char *s)
+{
+  int len;
+
+  /* drop the trailing newline of error messages */
+  len = strlen(s);
+  while (len > 0 && (s[len-1] == '\n' || s[len-1] == '\r'))
+    --len;
+  if (strcspn(s, ",\"\n\r") >= len)
+    {
+      fprintf(f, "%.*s", len, s);
+      return;
+    }
+  fputc('"', f);
+  for (; len > 0; ++s, --len)
+    {
+      if (*s == '"')
+	fputc('"', f);
+      fputc(*s == '\n' || *s == '\r' ? ' ' : *s, f);
+    }
+  fputc('"', f);
+}
+
+static void
+WriteJsonString (FILE *f, char *s)
+{
+  int len;
+
+  len = strlen(s);
+  while (len > 0 && (s[len-1] == '\n' || s[len-1] == '\r'))
+    --len;
+  fputc('"', f);
+  for (; len > 0; ++s, --len)
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if (*s == '\n')
+      fprintf(f, "\\n");
+    else if ((unsigned char) *s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char) *s);
+    else
+      fputc(*s, f);
+  fputc('"', f);
+}
@@ -0,0 +1,39 @@
+//
+// compare_batch.h - function to run compare_maps or compare_images
+//                   over many pairs of files at once
+//
+#ifndef COMPARE_BATCH_H
+#define COMPARE_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a CompareFunction compares file name1 with file name2, setting the
+   RMS and largest difference; it returns 0 and sets error (which
+   has room for PATH_MAX+256 characters) if they could not be
+   compared */
+typedef int (*CompareFunction) (char *name1, char *name2,
+				double *rms, double *maxError,
+				char *error);
+
+/* CompareBatch compares each file in directory dir1 whose name ends
+   in one of the nSuffixes suffixes with the file of the same name in
+   dir2, or, if listName is not empty, each pair of filenames given
+   one pair per line in that file.  The comparisons are done by
+   nThreads threads, and a line per pair giving the RMS and largest
+   differences and the seconds taken is written to csvName and/or
+   jsonName (if not empty).  The largest RMS difference is returned
+   in *maxRms.  Returns the number of pairs that could not be
+   compared, or -1 (setting error) if no pairs could be listed. */
+int CompareBatch (char *dir1, char *dir2, char *listName,
+		  char **suffixes, int nSuffixes,
+		  CompareFunction compare, int nThreads,
+		  char *csvName, char *jsonName,
+		  double *maxRms, char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPARE_BATCH_H */
@@ -7,30 +7,43 @@
 #include <stdarg.h>
 
 #include "imio.h"
+#include "compare_batch.h"
+
+int CompareImageFiles (char *image1Name, char *image2Name,
+		       double *rms, double *maxError, char *error);
 
 int
 main (int argc, char **argv)
 {
   FILE *f;
-  int iw1, ih1;
-  int iw2, ih2;
   int i;
   int error;
-  int x, y;
-  float d;
-  double sd2;
   double rmsd;
+  double maxError;
   char image1Name[PATH_MAX];
   char image2Name[PATH_MAX];
   char outputName[PATH_MAX];
-  unsigned char *image1;
-  unsigned char *image2;
+  char dir1Name[PATH_MAX];
+  char dir2Name[PATH_MAX];
+  char listName[PATH_MAX];
+  char csvName[PATH_MAX];
+  char jsonName[PATH_MAX];
+  int nThreads;
+  int nFailed;
+  char *suffixes[7] = { ".tif", ".tiff", ".pgm", ".ppm", ".jpg", ".jpeg",
+			".bmp" };
   char errorMsg[PATH_MAX+256];
 
   error = 0;
   image1Name[0] = '\0';
   image2Name[0] = '\0';
   outputName[0] = '\0';
+  dir1Name[0] = '\0';
+  dir2Name[0] = '\0';
+  listName[0] = '\0';
+  csvName[0] = '\0';
+  jsonName[0] = '\0';
+  nThreads = 1;
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-image1") == 0)
       {
@@ -62,6 +75,66 @@ main (int argc, char **argv)
 	  }
 	strcpy(outputName, argv[i]);
       }
+    else if (strcmp(argv[i], "-dir1") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-dir1 error\n");
+	    break;
+	  }
+	strcpy(dir1Name, argv[i]);
+      }
+    else if (strcmp(argv[i], "-dir2") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-dir2 error\n");
+	    break;
+	  }
+	strcpy(dir2Name, argv[i]);
+      }
+    else if (strcmp(argv[i], "-list") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-list error\n");
+	    break;
+	  }
+	strcpy(listName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-csv") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-csv error\n");
+	    break;
+	  }
+	strcpy(csvName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-json") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-json error\n");
+	    break;
+	  }
+	strcpy(jsonName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-threads error\n");
+	    break;
+	  }
+      }
     else
       error = 1;
 
@@ -70,9 +143,48 @@ main (int argc, char **argv)
       fprintf(stderr, "Usage: compare_images -image1 image1.tif\n");
       fprintf(stderr, "                      -image2 image2.tif\n");
       fprintf(stderr, "                       [-output rms.out]\n");
+      fprintf(stderr, "   or: compare_images -dir1 images1/ -dir2 images2/\n");
+      fprintf(stderr, "                      | -list pairs.lst\n");
+      fprintf(stderr, "                       [-threads n]\n");
+      fprintf(stderr, "                       [-csv report.csv]\n");
+      fprintf(stderr, "                       [-json report.json]\n");
+      fprintf(stderr, "                       [-output max_rms.out]\n");
       exit(1);
     }
 
+  if (listName[0] != '\0' || dir1Name[0] != '\0' || dir2Name[0] != '\0')
+    {
+      /* batch mode */
+      if (listName[0] == '\0' &&
+	  (dir1Name[0] == '\0' || dir2Name[0] == '\0'))
+	{
+	  fprintf(stderr, "-dir1 and -dir2 must be specified together.\n");
+	  exit(1);
+	}
+      nFailed = CompareBatch(dir1Name, dir2Name, listName,
+			     suffixes, 7, CompareImageFiles, nThreads,
+			     csvName, jsonName, &rmsd, errorMsg);
+      if (nFailed < 0)
+	{
+	  fprintf(stderr, "%s", errorMsg);
+	  exit(1);
+	}
+      if (outputName[0] != '\0')
+	{
+	  f = fopen(outputName, "w");
+	  fprintf(f, "%lf\n", rmsd);
+	  fclose(f);
+	}
+      printf("Largest RMS difference = %lf\n", rmsd);
+      if (nFailed > 0)
+	{
+	  fprintf(stderr, "%d pairs of images could not be compared.\n",
+		  nFailed);
+	  exit(1);
+	}
+      return(0);
+    }
+
   /* check that at least minimal parameters were supplied */
   if (image1Name[0] == '\0' || image2Name[0] == '\0')
     {
@@ -80,40 +192,74 @@ main (int argc, char **argv)
       exit(1);
     }
 
-  if (!ReadImage(image1Name, &image1, &iw1, &ih1, -1, -1, -1, -1, errorMsg))
+  if (!CompareImageFiles(image1Name, image2Name, &rmsd, &maxError, errorMsg))
     {
-      fprintf(stderr, "Error reading image %s:\n  %s\n", image1Name, errorMsg);
+      fprintf(stderr, "%s", errorMsg);
       exit(1);
     }
+
+  if (outputName[0] != '\0')
+    {
+      f = fopen(outputName, "w");
+      fprintf(f, "%lf\n", rmsd);
+      fclose(f);
+    }
+  printf("RMS difference = %lf\n", rmsd);
+  return(0);
+}
+
+/* CompareImageFiles finds the RMS and largest difference between the
+   pixels of two images of the same size */
+int
+CompareImageFiles (char *image1Name, char *image2Name,
+		   double *rms, double *maxError, char *error)
+{
+  int iw1, ih1;
+  int iw2, ih2;
+  int x, y;
+  float d;
+  double sd2;
+  float maxD;
+  unsigned char *image1;
+  unsigned char *image2;
+  char errorMsg[PATH_MAX+256];
+
+  if (!ReadImage(image1Name, &image1, &iw1, &ih1, -1, -1, -1, -1, errorMsg))
+    {
+      snprintf(error, PATH_MAX+256, "Error reading image %s:\n  %s\n",
+	       image1Name, errorMsg);
+      return(0);
+    }
   if (!ReadImage(image2Name, &image2, &iw2, &ih2, -1, -1, -1, -1, errorMsg))
     {
-      fprintf(stderr, "Error reading image %s:\n  %s\n", image2Name, errorMsg);
-      exit(1);
+      snprintf(error, PATH_MAX+256, "Error reading image %s:\n  %s\n",
+	       image2Name, errorMsg);
+      free(image1);
+      return(0);
     }
 
   /* make sure width and height match */
   if (iw2 != iw1 || ih2 != ih1)
     {
-      fprintf(stderr, "Image dimensions are not consistent.\n");
-      exit(1);
+      sprintf(error, "Image dimensions are not consistent.\n");
+      free(image1);
+      free(image2);
+      return(0);
     }
 
-
   sd2 = 0.0;
+  maxD = 0.0;
   for (y = 0; y < ih1; ++y)
     for (x = 0; x < iw1; ++x)
       {
 	d = image1[y*iw1+x] - image2[y*iw2+x];
 	sd2 += d*d;
+	if (fabs(d) > maxD)
+	  maxD = fabs(d);
       }
-  rmsd = sqrt(sd2 / (ih1 * iw1) );
-
-  if (outputName[0] != '\0')
-    {
-      f = fopen(outputName, "w");
-      fprintf(f, "%lf\n", rmsd);
-      fclose(f);
-    }
-  printf("RMS difference = %lf\n", rmsd);
-  return(0);
+  *rms = sqrt(sd2 / (ih1 * iw1) );
+  *maxError = maxD;
+  free(image1);
+  free(image2);
+  return(1);
 }
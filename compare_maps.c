@@ -7,45 +7,42 @@
 #include <stdarg.h>
 
 #include "imio.h"
+#include "compare_batch.h"
+
+int CompareMapFiles (char *map1Name, char *map2Name,
+		     double *rms, double *maxError, char *error);
 
 int
 main (int argc, char **argv)
 {
   FILE *f;
   int i;
-  int n;
   int error;
   char map1Name[PATH_MAX];
   char map2Name[PATH_MAX];
   char outputName[PATH_MAX];
-  MapElement *map1, *map2;
-  int mLevel1, mLevel2;
-  int mw1, mh1;
-  int mw2, mh2;
-  int mox1, moy1;
-  int mox2, moy2;
-  char imgn[PATH_MAX];
-  char refn[PATH_MAX];
+  char dir1Name[PATH_MAX];
+  char dir2Name[PATH_MAX];
+  char listName[PATH_MAX];
+  char csvName[PATH_MAX];
+  char jsonName[PATH_MAX];
+  int nThreads;
+  int nFailed;
+  char *suffixes[1] = { ".map" };
   char errorMsg[PATH_MAX+256];
-  float mFactor1, mFactor2;
-  int x, y;
-  float xv1, yv1;
-  float xv2, yv2;
-  float rx00, ry00, rc00;
-  float rx01, ry01, rc01;
-  float rx10, ry10, rc10;
-  float rx11, ry11, rc11;
-  int ixv, iyv;
-  float rrx, rry;
-  double sd2;
   double rmsd;
-  float rx1, ry1;
-  float rx2, ry2;
+  double maxError;
 
   error = 0;
   map1Name[0] = '\0';
   map2Name[0] = '\0';
   outputName[0] = '\0';
+  dir1Name[0] = '\0';
+  dir2Name[0] = '\0';
+  listName[0] = '\0';
+  csvName[0] = '\0';
+  jsonName[0] = '\0';
+  nThreads = 1;
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-map1") == 0)
       {
@@ -77,6 +74,66 @@ main (int argc, char **argv)
 	  }
 	strcpy(outputName, argv[i]);
       }
+    else if (strcmp(argv[i], "-dir1") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-dir1 error\n");
+	    break;
+	  }
+	strcpy(dir1Name, argv[i]);
+      }
+    else if (strcmp(argv[i], "-dir2") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-dir2 error\n");
+	    break;
+	  }
+	strcpy(dir2Name, argv[i]);
+      }
+    else if (strcmp(argv[i], "-list") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-list error\n");
+	    break;
+	  }
+	strcpy(listName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-csv") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-csv error\n");
+	    break;
+	  }
+	strcpy(csvName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-json") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-json error\n");
+	    break;
+	  }
+	strcpy(jsonName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-threads error\n");
+	    break;
+	  }
+      }
     else
       error = 1;
 
@@ -85,9 +142,48 @@ main (int argc, char **argv)
       fprintf(stderr, "Usage: rms_compare_maps -map1 map1.map\n");
       fprintf(stderr, "                        -map2 map2.map\n");
       fprintf(stderr, "                       [-output rms.out]\n");
+      fprintf(stderr, "   or: rms_compare_maps -dir1 maps1/ -dir2 maps2/\n");
+      fprintf(stderr, "                        | -list pairs.lst\n");
+      fprintf(stderr, "                       [-threads n]\n");
+      fprintf(stderr, "                       [-csv report.csv]\n");
+      fprintf(stderr, "                       [-json report.json]\n");
+      fprintf(stderr, "                       [-output max_rms.out]\n");
       exit(1);
     }
 
+  if (listName[0] != '\0' || dir1Name[0] != '\0' || dir2Name[0] != '\0')
+    {
+      /* batch mode */
+      if (listName[0] == '\0' &&
+	  (dir1Name[0] == '\0' || dir2Name[0] == '\0'))
+	{
+	  fprintf(stderr, "-dir1 and -dir2 must be specified together.\n");
+	  exit(1);
+	}
+      nFailed = CompareBatch(dir1Name, dir2Name, listName,
+			     suffixes, 1, CompareMapFiles, nThreads,
+			     csvName, jsonName, &rmsd, errorMsg);
+      if (nFailed < 0)
+	{
+	  fprintf(stderr, "%s", errorMsg);
+	  exit(1);
+	}
+      if (outputName[0] != '\0')
+	{
+	  f = fopen(outputName, "w");
+	  fprintf(f, "%lf\n", rmsd);
+	  fclose(f);
+	}
+      printf("Largest RMS difference = %lf\n", rmsd);
+      if (nFailed > 0)
+	{
+	  fprintf(stderr, "%d pairs of maps could not be compared.\n",
+		  nFailed);
+	  exit(1);
+	}
+      return(0);
+    }
+
   /* check that at least minimal parameters were supplied */
   if (map1Name[0] == '\0' || map2Name[0] == '\0')
     {
@@ -95,23 +191,76 @@ main (int argc, char **argv)
       exit(1);
     }
 
-  if (!ReadMap(map1Name, &map1, &mLevel1, &mw1, &mh1,
-	       &mox1, &moy1, imgn, refn, errorMsg))
+  if (!CompareMapFiles(map1Name, map2Name, &rmsd, &maxError, errorMsg))
     {
-      fprintf(stderr, "Error reading map %s:\n  %s\n", map1Name, errorMsg);
+      fprintf(stderr, "%s", errorMsg);
       exit(1);
     }
-  if (!ReadMap(map2Name, &map2, &mLevel2, &mw2, &mh2,
+
+  if (outputName[0] != '\0')
+    {
+      f = fopen(outputName, "w");
+      fprintf(f, "%lf\n", rmsd);
+      fclose(f);
+    }
+  printf("RMS difference = %lf\n", rmsd);
+  return(0);
+}
+
+/* CompareMapFiles finds the RMS and largest distance between where
+   the points of map1 and map2 map to; points of map1 that map2 does
+   not cover count as a distance of the whole map's size */
+int
+CompareMapFiles (char *map1Name, char *map2Name,
+		 double *rms, double *maxError, char *error)
+{
+  int n;
+  MapElement *map1, *map2;
+  int mLevel1, mLevel2;
+  int mw1, mh1;
+  int mw2, mh2;
+  int mox1, moy1;
+  int mox2, moy2;
+  char imgn[PATH_MAX];
+  char refn[PATH_MAX];
+  char errorMsg[PATH_MAX+256];
+  float mFactor1, mFactor2;
+  int x, y;
+  float xv1, yv1;
+  float xv2, yv2;
+  float rx00, ry00, rc00;
+  float rx01, ry01, rc01;
+  float rx10, ry10, rc10;
+  float rx11, ry11, rc11;
+  int ixv, iyv;
+  float rrx, rry;
+  double sd2;
+  double d2, maxD2;
+  double penalty;
+  float rx1, ry1;
+  float rx2, ry2;
+
+  if (!MapMmap(map1Name, &map1, &mLevel1, &mw1, &mh1,
+	       &mox1, &moy1, imgn, refn, errorMsg))
+    {
+      snprintf(error, PATH_MAX+256, "Error reading map %s:\n  %s\n",
+	       map1Name, errorMsg);
+      return(0);
+    }
+  if (!MapMmap(map2Name, &map2, &mLevel2, &mw2, &mh2,
 	       &mox2, &moy2, imgn, refn, errorMsg))
     {
-      fprintf(stderr, "Error reading map %s:\n  %s\n", map2Name, errorMsg);
-      exit(1);
+      snprintf(error, PATH_MAX+256, "Error reading map %s:\n  %s\n",
+	       map2Name, errorMsg);
+      MapMunmap(map1, mw1, mh1);
+      return(0);
     }
 
   /* go through the points of the first map */
   mFactor1 = 1 << mLevel1;
   mFactor2 = 1 << mLevel2;
   sd2 = 0.0;
+  maxD2 = 0.0;
   n = 0;
   for (y = 0; y < mh1; ++y)
     {
@@ -134,7 +283,10 @@ main (int argc, char **argv)
 	      iyv < 0 || iyv >= mh2)
 	    {
 	      //	      printf("PENALTY: %f %f %d %d\n", xv2, yv2, ixv, iyv);
-	      sd2 += mFactor1*mFactor1*(mw1+mh1)*(mw1+mh1);
+	      penalty = mFactor1*mFactor1*(mw1+mh1)*(mw1+mh1);
+	      sd2 += penalty;
+	      if (penalty > maxD2)
+		maxD2 = penalty;
 	      continue;
 	    }
 
@@ -178,7 +330,10 @@ main (int argc, char **argv)
 	    {
 	      //	      printf("PENALTY2: %f %f %d %d %f %f %f %f\n", xv2, yv2, ixv, iyv,
 	      //		     rc00, rc01, rc10, rc11);
-	      sd2 += mFactor1*mFactor1*(mw1+mh1)*(mw1+mh1);
+	      penalty = mFactor1*mFactor1*(mw1+mh1)*(mw1+mh1);
+	      sd2 += penalty;
+	      if (penalty > maxD2)
+		maxD2 = penalty;
 	      continue;
 	    }
 
@@ -190,22 +345,20 @@ main (int argc, char **argv)
 	    - ry10 * rrx * (rry - 1.0) 
 	    - ry01 * (rrx - 1.0) * rry
 	    + ry11 * rrx * rry;
-	  sd2 += (rx2 - rx1) * (rx2 - rx1) + (ry2 - ry1) * (ry2 - ry1);
+	  d2 = (rx2 - rx1) * (rx2 - rx1) + (ry2 - ry1) * (ry2 - ry1);
+	  sd2 += d2;
+	  if (d2 > maxD2)
+	    maxD2 = d2;
 	}
     }
+  MapMunmap(map1, mw1, mh1);
+  MapMunmap(map2, mw2, mh2);
   if (n == 0)
     {
-      fprintf(stderr, "No points of overlap found in maps\n");
-      exit(1);
+      sprintf(error, "No points of overlap found in maps\n");
+      return(0);
     }
-  rmsd = sqrt(sd2 / n);
-
-  if (outputName[0] != '\0')
-    {
-      f = fopen(outputName, "w");
-      fprintf(f, "%lf\n", rmsd);
-      fclose(f);
-    }
-  printf("RMS difference = %lf\n", rmsd);
-  return(0);
+  *rms = sqrt(sd2 / n);
+  *maxError = sqrt(maxD2);
+  return(1);
 }
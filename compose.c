@@ -0,0 +1,258 @@
+/*
+ * compose.c -- defines the composition of maps
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "compose.h"
+#include "resample.h"
+
+/* the rows y0..y1 of one composition step done by one thread */
+typedef struct ComposeBand
+{
+  pthread_t thread;
+  int y0, y1;
+  MapElement *map1;		/* the maps composed so far */
+  int mLevel, mw, mh;
+  MapElement *map2;		/* the next map of the chain */
+  int mLevel2, mw2, mh2;
+  int mxMin2, myMin2;
+  InverseMap *invMap2;		/* if not NULL, compose with the inverse
+				   of map2 using this */
+  MapElement *omap;
+  int failed;			/* if 1, the band stopped at a bad value, */
+  char error[128];		/* described here */
+} ComposeBand;
+
+static void *ComposeThreadMain (void *arg);
+static void ComposeRows (ComposeBand *b);
+
+int
+ComposeMaps (MapElement *map1, int mLevel, int mw, int mh,
+	     MapElement *map2, int mLevel2, int mw2, int mh2,
+	     int mxMin2, int myMin2,
+	     InverseMap *invMap2, int nThreads,
+	     MapElement *omap, char *error)
+{
+  ComposeBand *bands;
+  int nBands;
+  int nStarted;
+  int i;
+  int result;
+
+  nBands = nThreads;
+  if (nBands > mh)
+    nBands = mh;
+  if (nBands < 1)
+    nBands = 1;
+  bands = (ComposeBand *) malloc(nBands * sizeof(ComposeBand));
+  if (bands == NULL)
+    {
+      sprintf(error, "Could not allocate %d compose bands\n", nBands);
+      return(0);
+    }
+  for (i = 0; i < nBands; ++i)
+    {
+      bands[i].y0 = (int) (((long long) mh * i) / nBands);
+      bands[i].y1 = (int) (((long long) mh * (i+1)) / nBands) - 1;
+      bands[i].map1 = map1;
+      bands[i].mLevel = mLevel;
+      bands[i].mw = mw;
+      bands[i].mh = mh;
+      bands[i].map2 = map2;
+      bands[i].mLevel2 = mLevel2;
+      bands[i].mw2 = mw2;
+      bands[i].mh2 = mh2;
+      bands[i].mxMin2 = mxMin2;
+      bands[i].myMin2 = myMin2;
+      bands[i].invMap2 = invMap2;
+      if (invMap2 != NULL && nBands > 1)
+	bands[i].invMap2 = ShareInverseMap(invMap2);
+      bands[i].omap = omap;
+      bands[i].failed = 0;
+    }
+
+  result = 1;
+  if (nBands == 1)
+    ComposeRows(&bands[0]);
+  else
+    {
+      for (nStarted = 0; nStarted < nBands; ++nStarted)
+	if (pthread_create(&bands[nStarted].thread, NULL,
+			   ComposeThreadMain, &bands[nStarted]) != 0)
+	  {
+	    sprintf(error, "Could not create compose thread.\n");
+	    result = 0;
+	    break;
+	  }
+      for (i = 0; i < nStarted; ++i)
+	pthread_join(bands[i].thread, NULL);
+      if (invMap2 != NULL)
+	for (i = 0; i < nBands; ++i)
+	  FreeInverseMap(bands[i].invMap2);
+    }
+
+  /* report the failure of the first band that had one */
+  for (i = 0; result && i < nBands; ++i)
+    if (bands[i].failed)
+      {
+	sprintf(error, "%s", bands[i].error);
+	result = 0;
+      }
+  free(bands);
+  return(result);
+}
+
+static void *
+ComposeThreadMain (void *arg)
+{
+  ComposeRows((ComposeBand *) arg);
+  return(NULL);
+}
+
+static void
+ComposeRows (ComposeBand *b)
+{
+  MapElement *map1 = b->map1;
+  int mLevel = b->mLevel;
+  int mw = b->mw;
+  MapElement *map2 = b->map2;
+  int mLevel2 = b->mLevel2;
+  int mw2 = b->mw2;
+  int mh2 = b->mh2;
+  int mxMin2 = b->mxMin2;
+  int myMin2 = b->myMin2;
+  InverseMap *invMap2 = b->invMap2;
+  MapElement *omap = b->omap;
+
+  int x, y;
+  float x1, y1, c1;
+  float xv, yv;
+  float xp, yp;
+  float rx, ry, rc;
+  MapElement e2;
+  int status;
+
+  if (invMap2 != NULL)
+    {
+      for (y = b->y0; y <= b->y1; ++y)
+	for (x = 0; x < mw; ++x)
+	  {
+	    x1 = map1[y*mw+x].x * (1 << mLevel) / (1 << mLevel2);
+	    y1 = map1[y*mw+x].y * (1 << mLevel) / (1 << mLevel2);
+	    c1 = map1[y*mw+x].c;
+
+	    // next line is temporary to correct for bug in warp3
+	    if (c1 != 0.0 && c1 < 0.001)
+	      c1 = 0.001;
+
+	    if (c1 == 0.0)
+	      {
+		omap[y*mw+x].x = 0.0;
+		omap[y*mw+x].y = 0.0;
+		omap[y*mw+x].c = 0.0;
+		continue;
+	      }
+	    xp = 0.0;
+	    yp = 0.0;
+	    if (Invert(invMap2, &xp, &yp, x1, y1))
+	      {
+		//		printf("Invert of (%f %f) produced (%f %f)\n",
+		//		       x1, y1, xp, yp);
+		omap[y*mw+x].x = xp * (1 << mLevel2) / (1 << mLevel);
+		omap[y*mw+x].y = yp * (1 << mLevel2) / (1 << mLevel);
+		omap[y*mw+x].c = c1;
+	      }
+	    else
+	      {
+		//		printf("Invert of (%f %f) failed\n", x1, y1);
+		omap[y*mw+x].x = 0.0;
+		omap[y*mw+x].y = 0.0;
+		omap[y*mw+x].c = 0.0;
+	      }
+	  }
+    }
+  else
+    {
+      for (y = b->y0; y <= b->y1; ++y)
+	for (x = 0; x < mw; ++x)
+	  {
+	    x1 = map1[y*mw+x].x * (1 << mLevel);
+	    y1 = map1[y*mw+x].y * (1 << mLevel);
+	    c1 = map1[y*mw+x].c;
+
+	    // next line is temporary to correct for bug in warp3
+	    if (c1 != 0.0 && c1 < 0.001)
+	      c1 = 0.001;
+
+	    if (c1 == 0.0)
+	      {
+		omap[y*mw+x].x = 0.0;
+		omap[y*mw+x].y = 0.0;
+		omap[y*mw+x].c = 0.0;
+		continue;
+	      }
+	    if (c1 < 0.0)
+	      {
+		sprintf(b->error, "c1 is negative! %f\n", c1);
+		b->failed = 1;
+		return;
+	      }
+	    xv = x1 / (1 << mLevel2);
+	    yv = y1 / (1 << mLevel2);
+	    status = SampleMap(map2, mw2, mh2, mxMin2, myMin2, xv, yv, &e2);
+	    if (status < 0)
+	      {
+		sprintf(b->error, "rc is negative! %f\n", e2.c);
+		b->failed = 1;
+		return;
+	      }
+	    if (status == 0)
+	      {
+		omap[y*mw+x].x = 0.0;
+		omap[y*mw+x].y = 0.0;
+		omap[y*mw+x].c = 0.0;
+		continue;
+	      }
+	    rx = e2.x;
+	    ry = e2.y;
+	    rc = e2.c;
+	    xp = rx * (1 << mLevel2);
+	    yp = ry * (1 << mLevel2);
+
+	    if (isnan(xp) || isnan(yp) || isnan(rc) || isnan(c1))
+	      {
+		sprintf(b->error, "nan in input maps at (%d,%d).\n", x, y);
+		b->failed = 1;
+		return;
+	      }
+	    omap[y*mw+x].x = xp / (1 << mLevel);
+	    omap[y*mw+x].y = yp / (1 << mLevel);
+	    if (c1 < rc)
+	      rc = c1;
+	    omap[y*mw+x].c = rc;
+	  }
+    }
+}
@@ -0,0 +1,34 @@
+//
+// compose.h - the composition of maps, shared by compose_maps and by
+//             apply_map, which can compose a chain of maps onto each
+//             image's map as it loads it
+//
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include "imio.h"
+#include "invert.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ComposeMaps sets omap, of the same size and level as map1 (mw x mh
+   at mLevel), to map1 composed with map2 (mw2 x mh2 at mLevel2, offset
+   by mxMin2, myMin2), or, if invMap2 is not NULL, with the inverse of
+   map2; the elements that land outside map2, or on parts of it that
+   are not valid, are left invalid.  The rows of map1 are split into
+   bands done by up to nThreads threads.  It returns 0, with a message
+   in error, if a thread could not be started or the maps hold negative
+   or NaN values. */
+int ComposeMaps (MapElement *map1, int mLevel, int mw, int mh,
+		 MapElement *map2, int mLevel2, int mw2, int mh2,
+		 int mxMin2, int myMin2,
+		 InverseMap *invMap2, int nThreads,
+		 MapElement *omap, char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPOSE_H */
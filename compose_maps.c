@@ -40,16 +40,24 @@
 #include <limits.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "compose.h"
 #include "imio.h"
 #include "invert.h"
 
+/* one map of the chain composed onto map1 */
+typedef struct ChainMap
+{
+  char name[PATH_MAX];
+  int invert;		/* if 1, compose with the inverse of the map */
+} ChainMap;
+
 void Error (char *fmt, ...);
 
 int
 main (int argc, char **argv)
 {
-  int invert;
   float thresholdC;
 
   char map1Name[PATH_MAX];
@@ -59,41 +67,33 @@ main (int argc, char **argv)
   int mxMin, myMin;
   char imgName[PATH_MAX], refName[PATH_MAX];
   
-  char map2Name[PATH_MAX];
+  int nChain;
+  ChainMap *chain;
   MapElement *map2;
   int mLevel2;
   int mw2, mh2;
   int mxMin2, myMin2;
   char imgName2[PATH_MAX], refName2[PATH_MAX];
-  
   InverseMap *invMap2;
 
   char outputMapName[PATH_MAX];
   MapElement *omap;
+  MapElement *cmap;
+  MapElement *tmp;
 
+  int nThreads;
   int x, y;
-  float x1, y1, c1;
-  float xv, yv;
-  float xp, yp;
-  int ix, iy;
-  float rx, ry, rc;
-  float rx00, rx01, rx10, rx11;
-  float ry00, ry01, ry10, ry11;
-  float rc00, rc01, rc10, rc11;
-  float rrx, rry;
-
-  int dx, dy;
-  double weight;
-  double totalWeight;
-  double trx, try;
-
-  int i;
+  int i, k;
   int error;
   char msg[PATH_MAX+256];
 
   error = 0;
-  invert = 0;
   thresholdC = 0.0;
+  nThreads = 1;
+  map1Name[0] = '\0';
+  outputMapName[0] = '\0';
+  nChain = 0;
+  chain = (ChainMap *) malloc(argc * sizeof(ChainMap));
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-map1") == 0)
       {
@@ -111,8 +111,8 @@ main (int argc, char **argv)
             error = 1;
             break;
           }
-        strcpy(map2Name, argv[i]);
-	invert = 1;
+        strcpy(chain[nChain].name, argv[i]);
+	chain[nChain++].invert = 1;
       }
     else if (strcmp(argv[i], "-map2") == 0)
       {
@@ -121,8 +121,8 @@ main (int argc, char **argv)
             error = 1;
             break;
           }
-	invert = 0;
-        strcpy(map2Name, argv[i]);
+        strcpy(chain[nChain].name, argv[i]);
+	chain[nChain++].invert = 0;
       }
     else if (strcmp(argv[i], "-output") == 0)
       {
@@ -141,6 +141,15 @@ main (int argc, char **argv)
             break;
           }
       }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+        if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+          {
+            error = 1;
+            break;
+          }
+      }
     else
       {
 	error = 1;
@@ -160,181 +169,54 @@ main (int argc, char **argv)
       fprintf(stderr, "            [-inverse_map2 <map_name>]\n");
       fprintf(stderr, "            -output <output_map_name>]\n");
       fprintf(stderr, "            [-threshold_c <float>]\n");
+      fprintf(stderr, "            [-threads <number_of_threads>]\n");
+      fprintf(stderr, "  -map2 and -inverse_map2 may be repeated to compose\n");
+      fprintf(stderr, "  a chain of maps onto map1, in the order given.\n");
       exit(1);
     }
 
   /* check that at least minimal parameters were supplied */
   if (map1Name[0] == '\0')
     Error("-map1 parameter must be specified.\n");
-  if (map2Name[0] == '\0')
+  if (nChain == 0)
     Error("-map2 or -inverse_map2 parameter must be specified.\n");
   if (outputMapName[0] == '\0')
     Error("-output parameter must be specified.\n");
 
-  if (!ReadMap(map1Name, &map1, &mLevel, &mw, &mh,
+  if (!MapMmap(map1Name, &map1, &mLevel, &mw, &mh,
 	       &mxMin, &myMin, imgName, refName, msg))
     Error("Could not read map %s:\n%s\n", map1Name, msg);
 
-  if (!ReadMap(map2Name, &map2, &mLevel2, &mw2, &mh2,
-	       &mxMin2, &myMin2, imgName2, refName2, msg))
-    Error("Could not read map %s:\n%s\n", map2Name, msg);
-
+  /* the maps composed so far are kept in cmap, and each step
+     composes the next map of the chain onto them, into omap */
   omap = (MapElement*) malloc(mw*mh*sizeof(MapElement));
-
-  if (invert)
+  cmap = NULL;
+  if (nChain > 1)
+    cmap = (MapElement*) malloc(mw*mh*sizeof(MapElement));
+  for (k = 0; k < nChain; ++k)
     {
-      invMap2 = InvertMap(map2, mw2, mh2);
-
-      for (y = 0; y < mh; ++y)
-	for (x = 0; x < mw; ++x)
-	  {
-	    x1 = map1[y*mw+x].x * (1 << mLevel) / (1 << mLevel2);
-	    y1 = map1[y*mw+x].y * (1 << mLevel) / (1 << mLevel2);
-	    c1 = map1[y*mw+x].c;
-
-	    // next line is temporary to correct for bug in warp3
-	    if (c1 != 0.0 && c1 < 0.001)
-	      c1 = 0.001;
-
-	    if (c1 == 0.0)
-	      {
-		omap[y*mw+x].x = 0.0;
-		omap[y*mw+x].y = 0.0;
-		omap[y*mw+x].c = 0.0;
-		continue;
-	      }
-	    xp = 0.0;
-	    yp = 0.0;
-	    if (Invert(invMap2, &xp, &yp, x1, y1))
-	      {
-		//		printf("Invert of (%f %f) produced (%f %f)\n",
-		//		       x1, y1, xp, yp);
-		omap[y*mw+x].x = xp * (1 << mLevel2) / (1 << mLevel);
-		omap[y*mw+x].y = yp * (1 << mLevel2) / (1 << mLevel);
-		omap[y*mw+x].c = c1;
-	      }
-	    else
-	      {
-		//		printf("Invert of (%f %f) failed\n", x1, y1);
-		omap[y*mw+x].x = 0.0;
-		omap[y*mw+x].y = 0.0;
-		omap[y*mw+x].c = 0.0;
-	      }
-	  }
-    }
-  else
-    {
-      for (y = 0; y < mh; ++y)
-	for (x = 0; x < mw; ++x)
-	  {
-	    x1 = map1[y*mw+x].x * (1 << mLevel);
-	    y1 = map1[y*mw+x].y * (1 << mLevel);
-	    c1 = map1[y*mw+x].c;
-
-	    // next line is temporary to correct for bug in warp3
-	    if (c1 != 0.0 && c1 < 0.001)
-	      c1 = 0.001;
-
-	    if (c1 == 0.0)
-	      {
-		omap[y*mw+x].x = 0.0;
-		omap[y*mw+x].y = 0.0;
-		omap[y*mw+x].c = 0.0;
-		continue;
-	      }
-	    if (c1 < 0.0)
-	      Error("c1 is negative! %f\n", c1);
-	    xv = x1 / (1 << mLevel2);
-	    yv = y1 / (1 << mLevel2);
-	    ix = ((int) floor(xv)) - mxMin2;
-	    iy = ((int) floor(yv)) - myMin2;
-	    rrx = xv - (mxMin2 + ix);
-	    rry = yv - (myMin2 + iy);
-
-	    if (ix < -1 || ix == -1 && rrx < 0.999 ||
-		ix == mw2-1 && rrx > 0.001 || ix >= mw2 ||
-		iy < -1 || iy == -1 && rry < 0.999 ||
-		iy == mh2-1 && rry > 0.001 || iy >= mh2)
-	      {
-		omap[y*mw+x].x = 0.0;
-		omap[y*mw+x].y = 0.0;
-		omap[y*mw+x].c = 0.0;
-		continue;
-	      }
-
-	    while (ix < 0)
-	      {
-		++ix;
-		rrx -= 1.0;
-	      }
-	    while (iy < 0)
-	      {
-		++iy;
-		rry -= 1.0;
-	      }
-	    while (ix >= mw2-1)
-	      {
-		--ix;
-		rrx += 1.0;
-	      }
-	    while (iy >= mh2-1)
-	      {
-		--iy;
-		rry += 1.0;
-	      }
-
-	    rx00 = map2[iy*mw2+ix].x;
-	    ry00 = map2[iy*mw2+ix].y;
-	    rc00 = map2[iy*mw2+ix].c;
-	    rx01 = map2[(iy+1)*mw2+ix].x;
-	    ry01 = map2[(iy+1)*mw2+ix].y;
-	    rc01 = map2[(iy+1)*mw2+ix].c;
-	    rx10 = map2[iy*mw2+ix+1].x;
-	    ry10 = map2[iy*mw2+ix+1].y;
-	    rc10 = map2[iy*mw2+ix+1].c;
-	    rx11 = map2[(iy+1)*mw2+ix+1].x;
-	    ry11 = map2[(iy+1)*mw2+ix+1].y;
-	    rc11 = map2[(iy+1)*mw2+ix+1].c;
-
-	    rc = rc00;
-	    if (rc01 < rc)
-	      rc = rc01;
-	    if (rc10 < rc)
-	      rc = rc10;
-	    if (rc11 < rc)
-	      rc = rc11;
-	    if (rc < 0.0)
-	      Error("rc is negative! %f\n", rc);
-	    
-	    if (rc == 0.0)
-	      {
-		omap[y*mw+x].x = 0.0;
-		omap[y*mw+x].y = 0.0;
-		omap[y*mw+x].c = 0.0;
-		continue;
-	      }
-
-	    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-	      - rx10 * rrx * (rry - 1.0) 
-	      - rx01 * (rrx - 1.0) * rry
-	      + rx11 * rrx * rry;
-	    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-	      - ry10 * rrx * (rry - 1.0) 
-	      - ry01 * (rrx - 1.0) * rry
-	      + ry11 * rrx * rry;
-	    xp = rx * (1 << mLevel2);
-	    yp = ry * (1 << mLevel2);
-
-	    if (isnan(xp) || isnan(yp))
-	      Error("nan in xp or yp at (%d,%d).\n", x, y);
-	    if (isnan(rc) || isnan(c1))
-	      Error("nan in input maps at (%d,%d).\n", x, y);
-	    omap[y*mw+x].x = xp / (1 << mLevel);
-	    omap[y*mw+x].y = yp / (1 << mLevel);
-	    if (c1 < rc)
-	      rc = c1;
-	    omap[y*mw+x].c = rc;
-	  }
+      if (!MapMmap(chain[k].name, &map2, &mLevel2, &mw2, &mh2,
+		   &mxMin2, &myMin2, imgName2, refName2, msg))
+	Error("Could not read map %s:\n%s\n", chain[k].name, msg);
+
+      invMap2 = NULL;
+      if (chain[k].invert)
+	invMap2 = InvertMapThreads(map2, mw2, mh2, nThreads);
+
+      if (!ComposeMaps(k == 0 ? map1 : cmap, mLevel, mw, mh,
+		       map2, mLevel2, mw2, mh2, mxMin2, myMin2,
+		       invMap2, nThreads, omap, msg))
+	Error("Could not compose map %s:\n%s\n", chain[k].name, msg);
+
+      if (invMap2 != NULL)
+	FreeInverseMap(invMap2);
+      MapMunmap(map2, mw2, mh2);
+      if (k < nChain - 1)
+	{
+	  tmp = cmap;
+	  cmap = omap;
+	  omap = tmp;
+	}
     }
 
   if (thresholdC != 0.0)
@@ -347,16 +229,16 @@ main (int argc, char **argv)
 
   if (!WriteMap(outputMapName, omap, mLevel, mw, mh,
 		mxMin, myMin,
-		imgName, invert ? imgName2 : refName2,
+		imgName, chain[nChain-1].invert ? imgName2 : refName2,
 		UncompressedMap, msg))
     Error("Could not write map %s:\n%s\n",
 	  outputMapName, msg);
 
-  free(map1);
-  free(map2);
-  if (invert)
-    FreeInverseMap(invMap2);
+  MapMunmap(map1, mw, mh);
   free(omap);
+  if (cmap != NULL)
+    free(cmap);
+  free(chain);
 
   return(0);
 }
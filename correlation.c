@@ -0,0 +1,864 @@
+/*
+ * correlation.c -- defines the routines that warp a reference image
+ *                  by a map and measure how well it then matches the
+ *                  image, pixel by pixel
+ *
+ *  Copyright (c) 2009-2026 Pittsburgh Supercomputing Center,
+ *                          Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Acknowledgements:
+ *     Development of this code was supported in part by
+ *       NIH NCRR grant 5P41RR006009
+ *
+ *  HISTORY
+ *    2009     Written by Greg Hood (ghood@psc.edu) in register.c
+ *    2026     Moved here so that clean_maps can use them
+ *    2026     AVX2 warp loop chosen at run time from the cpu's
+ *             features (see cpu.h)
+ *    2026     Mask test of the warp made with one bit per sample
+ *             from the 2x2-valid mask (see AndMask2x2)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cpu.h"
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+#include "correlation.h"
+
+/* the mask bits at (ix,iy) and (ix+1,iy) as a 2-bit value, with (ix,iy) in the high bit */
+#define MASK2(m,mbpl,ix,iy)		((((ix) & 7) != 7) ? \
+					 ((m[(iy)*((size_t) mbpl) + ((ix) >> 3)] >> (6 - ((ix) & 7))) & 3) : \
+					 (((m[(iy)*((size_t) mbpl) + ((ix) >> 3)] & 1) << 1) | \
+					  (m[(iy)*((size_t) mbpl) + ((ix) >> 3) + 1] >> 7)))
+#define MASK(m,mbpl,ix,iy)		(m[(iy)*((size_t) mbpl) + ((ix) >> 3)] & (0x80 >> ((ix) & 7)))
+#define MAP(map,w,ix,iy)		map[(iy)*((size_t) w) + (ix)]
+#define GETMAP(map,w,ix,iy,xv,yv,cv)	{ MapElement *e = &MAP(map,w,ix,iy); *(xv) = e->x; *(yv) = e->y; *(cv) = e->c; }
+
+/* a WarpRun warps pixels x up to ex of a run within one map cell,
+   whose corners are given by c (rx00, rx01, rx10, rx11, ry00, ry01,
+   ry10, ry11, as in ComputeWarpedImage), into the row warped with its
+   validity in valid, and returns the first pixel that it left for
+   the scalar loop; mask2 is the reference mask AND-ed with its
+   shifts (see AndMask2x2), which decides the mask test of a sample
+   with a single bit except on the edges of a pixel.  The kernel for
+   the best instruction set the cpu supports is chosen at run time. */
+typedef int (*WarpRun) (float *warped, unsigned char *valid,
+			int x, int ex, float *rrxs, float rryRow,
+			float *c, float mapFactor, int refox, int refoy,
+			float *image, unsigned char *mask,
+			unsigned char *mask2, int iw, int ih);
+
+static int WarpRunScalar (float *warped, unsigned char *valid,
+			  int x, int ex, float *rrxs, float rryRow,
+			  float *c, float mapFactor, int refox, int refoy,
+			  float *image, unsigned char *mask,
+			  unsigned char *mask2, int iw, int ih);
+#if defined(CPU_X86)
+static int WarpRunAVX2 (float *warped, unsigned char *valid,
+			int x, int ex, float *rrxs, float rryRow,
+			float *c, float mapFactor, int refox, int refoy,
+			float *image, unsigned char *mask,
+			unsigned char *mask2, int iw, int ih)
+  CPU_TARGET_AVX2;
+#endif
+
+int
+ComputeWarpedImage (float *warped, unsigned char *valid,
+		    int w, int h,           /* of the warped reference */
+		    int imgox, int imgoy,   /* of the warped reference */
+		    float *image, unsigned char *mask,
+		    int iw, int ih,         /* of the reference (image & mask) */
+		    int refox, int refoy,   /* of the reference (image & mask) */
+		    MapElement *map,
+		    float mapFactor,
+		    int mpw, int mph,
+		    int mox, int moy)
+{
+  float xv, yv;
+  int ixv, iyv;
+  int irx, iry;
+  float rrx, rry;
+  float rryRow;
+  float r00, r01, r10, r11;
+  float rv;
+  float rx00, rx01, rx10, rx11;
+  float ry00, ry01, ry10, ry11;
+  float rc00, rc01, rc10, rc11;
+  float rx, ry;
+  int x, y;
+  int sx, ex;
+  int m0, m1;
+  int mbpl;
+  int *ixs;
+  float *rrxs;
+  unsigned char *mask2;
+  float corners[8];
+  WarpRun warpRun;
+
+  mbpl = (iw + 7) >> 3;
+  memset(valid, 0, w * h * sizeof(unsigned char));
+  warpRun = WarpRunScalar;
+#if defined(CPU_X86)
+  if (CpuHas(CPU_AVX2))
+    warpRun = WarpRunAVX2;
+#endif
+
+  /* the map column and fractional offset only depend on x, so
+     compute them once for the whole image */
+  ixs = (int *) malloc(w * sizeof(int));
+  rrxs = (float *) malloc(w * sizeof(float));
+  mask2 = NULL;
+  if (mask != NULL)
+    mask2 = (unsigned char *) malloc(((size_t) ih) * mbpl);
+  if (ixs == NULL || rrxs == NULL || (mask != NULL && mask2 == NULL))
+    {
+      free(ixs);
+      free(rrxs);
+      free(mask2);
+      return(0);
+    }
+  if (mask != NULL)
+    AndMask2x2(mask, iw, ih, mask2);
+  for (x = 0; x < w; ++x)
+    {
+      xv = (x + 0.5 + imgox) / mapFactor - mox;
+      ixs[x] = ((int) (xv + 2.0)) - 2;
+      rrxs[x] = xv - ixs[x];
+    }
+
+  for (y = 0; y < h; ++y)
+    {
+      yv = (y + 0.5 + imgoy) / mapFactor - moy;
+      iyv = ((int) (yv + 2.0)) - 2;
+      rryRow = yv - iyv;
+      if (iyv < 0 || iyv >= mph-1)
+	{
+	  memset(&warped[y * w], 0, w * sizeof(float));
+	  continue;
+	}
+
+      /* walk over the runs of pixels that fall within a single map cell */
+      for (sx = 0; sx < w; sx = ex)
+	{
+	  ixv = ixs[sx];
+	  for (ex = sx + 1; ex < w && ixs[ex] == ixv; ++ex) ;
+
+	  if (ixv < 0 || ixv >= mpw-1)
+	    {
+	      memset(&warped[y * w + sx], 0, (ex - sx) * sizeof(float));
+	      continue;
+	    }
+
+	  GETMAP(map, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+	  GETMAP(map, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+	  GETMAP(map, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+	  GETMAP(map, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+
+	  if (rc00 == 0.0 || rc01 == 0.0 || rc10 == 0.0 || rc11 == 0.0)
+	    {
+	      memset(&warped[y * w + sx], 0, (ex - sx) * sizeof(float));
+	      continue;
+	    }
+	  corners[0] = rx00;
+	  corners[1] = rx01;
+	  corners[2] = rx10;
+	  corners[3] = rx11;
+	  corners[4] = ry00;
+	  corners[5] = ry01;
+	  corners[6] = ry10;
+	  corners[7] = ry11;
+
+	  x = warpRun(&warped[y * w], &valid[y * w], sx, ex, rrxs, rryRow,
+		      corners, mapFactor, refox, refoy,
+		      image, mask, mask2, iw, ih);
+	  for (; x < ex; ++x)
+	    {
+	      rrx = rrxs[x];
+	      rry = rryRow;
+	      rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+		- rx10 * rrx * (rry - 1.0)
+		- rx01 * (rrx - 1.0) * rry
+		+ rx11 * rrx * rry;
+	      ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+		- ry10 * rrx * (rry - 1.0)
+		- ry01 * (rrx - 1.0) * rry
+		+ ry11 * rrx * rry;
+	      rx = mapFactor * rx - 0.5 - refox;
+	      ry = mapFactor * ry - 0.5 - refoy;
+	      irx = ((int) floor(rx + 1.0)) - 1;
+	      iry = ((int) floor(ry + 1.0)) - 1;
+	      if (irx < 0 || irx >= iw - 1 ||
+		  iry < 0 || iry >= ih - 1)
+		{
+		  warped[y * w + x] = 0.0;
+		  continue;
+		}
+	      rrx = rx - irx;
+	      rry = ry - iry;
+
+	      /* a sample strictly inside the square of pixels below and
+		 to the right of (irx, iry) needs all 4 of them; one on
+		 its top or left edge needs fewer */
+	      if (mask != NULL && MASK(mask2, mbpl, irx, iry) == 0)
+		{
+		  if (rrx > 0.0 && rry > 0.0)
+		    {
+		      warped[y * w + x] = 0.0;
+		      continue;
+		    }
+		  /* test both horizontal neighbors with a single lookup */
+		  m0 = MASK2(mask, mbpl, irx, iry);
+		  m1 = (rry > 0.0) ? MASK2(mask, mbpl, irx, iry+1) : 3;
+		  if ((m0 & 2) == 0 || (m1 & 2) == 0 ||
+		      (rrx > 0.0 && ((m0 & 1) == 0 || (m1 & 1) == 0)))
+		    {
+		      warped[y * w + x] = 0.0;
+		      continue;
+		    }
+		}
+
+	      r00 = image[iry * iw + irx];
+	      r01 = image[(iry + 1) * iw + irx];
+	      r10 = image[iry * iw + (irx + 1)];
+	      r11 = image[(iry + 1) * iw + irx + 1];
+	      rv = r00 * (rrx - 1.0) * (rry - 1.0)
+		- r10 * rrx * (rry - 1.0)
+		- r01 * (rrx - 1.0) * rry
+		+ r11 * rrx * rry;
+	      warped[y * w + x] = rv;
+	      valid[y * w + x] = 1;
+	    }
+	}
+    }
+  free(ixs);
+  free(rrxs);
+  free(mask2);
+  return(1);
+}
+
+static int
+WarpRunScalar (float *warped, unsigned char *valid,
+	       int x, int ex, float *rrxs, float rryRow,
+	       float *c, float mapFactor, int refox, int refoy,
+	       float *image, unsigned char *mask,
+	       unsigned char *mask2, int iw, int ih)
+{
+  return(x);
+}
+
+#if defined(CPU_X86)
+static int
+WarpRunAVX2 (float *warped, unsigned char *valid,
+	     int x, int ex, float *rrxs, float rryRow,
+	     float *c, float mapFactor, int refox, int refoy,
+	     float *image, unsigned char *mask,
+	     unsigned char *mask2, int iw, int ih)
+{
+  int irx, iry;
+  int m0, m1;
+  int mbpl;
+  int lane;
+  int lanesValid;
+  __m256d one, rryd, rrym1, vd, td, pd;
+  __m256d rxd, ryd;
+  __m128 rrx4, rxf, ryf, rrxf, rryf, vf;
+  __m128i irx4, iry4, idx;
+  __m128 r00f, r01f, r10f, r11f;
+  __m128 laneMask;
+  int irxa[4], irya[4];
+  float rrxa[4], rrya[4];
+  int ok[4];
+
+  mbpl = (iw + 7) >> 3;
+
+  /* 4 pixels at a time; every operation below is performed in
+     the same precision and order as in the scalar loop so that
+     the results are bit-identical */
+  one = _mm256_set1_pd(1.0);
+  rryd = _mm256_set1_pd((double) rryRow);
+  rrym1 = _mm256_set1_pd(rryRow - 1.0);
+  for (; x + 4 <= ex; x += 4)
+    {
+      rrx4 = _mm_loadu_ps(&rrxs[x]);
+      vd = _mm256_cvtps_pd(rrx4);
+
+      /* rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	      - rx10 * rrx * (rry - 1.0)
+	      - rx01 * (rrx - 1.0) * rry
+	      + rx11 * rrx * rry; */
+      td = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(c[0]),
+				       _mm256_sub_pd(vd, one)), rrym1);
+      td = _mm256_sub_pd(td, _mm256_mul_pd(_mm256_cvtps_pd(_mm_mul_ps(_mm_set1_ps(c[2]), rrx4)), rrym1));
+      td = _mm256_sub_pd(td, _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(c[1]),
+							 _mm256_sub_pd(vd, one)), rryd));
+      rxd = _mm256_add_pd(td, _mm256_cvtps_pd(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(c[3]), rrx4),
+							    _mm_set1_ps(rryRow))));
+      td = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(c[4]),
+				       _mm256_sub_pd(vd, one)), rrym1);
+      td = _mm256_sub_pd(td, _mm256_mul_pd(_mm256_cvtps_pd(_mm_mul_ps(_mm_set1_ps(c[6]), rrx4)), rrym1));
+      td = _mm256_sub_pd(td, _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(c[5]),
+							 _mm256_sub_pd(vd, one)), rryd));
+      ryd = _mm256_add_pd(td, _mm256_cvtps_pd(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(c[7]), rrx4),
+							    _mm_set1_ps(rryRow))));
+
+      /* rx = mapFactor * rx - 0.5 - refox; */
+      rxf = _mm_mul_ps(_mm_set1_ps((float) mapFactor), _mm256_cvtpd_ps(rxd));
+      rxf = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_sub_pd(_mm256_cvtps_pd(rxf),
+							_mm256_set1_pd(0.5)),
+					  _mm256_set1_pd((double) refox)));
+      ryf = _mm_mul_ps(_mm_set1_ps((float) mapFactor), _mm256_cvtpd_ps(ryd));
+      ryf = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_sub_pd(_mm256_cvtps_pd(ryf),
+							_mm256_set1_pd(0.5)),
+					  _mm256_set1_pd((double) refoy)));
+
+      /* irx = ((int) floor(rx + 1.0)) - 1; */
+      irx4 = _mm_sub_epi32(_mm256_cvttpd_epi32(_mm256_floor_pd(_mm256_add_pd(_mm256_cvtps_pd(rxf), one))),
+			   _mm_set1_epi32(1));
+      iry4 = _mm_sub_epi32(_mm256_cvttpd_epi32(_mm256_floor_pd(_mm256_add_pd(_mm256_cvtps_pd(ryf), one))),
+			   _mm_set1_epi32(1));
+      rrxf = _mm_sub_ps(rxf, _mm_cvtepi32_ps(irx4));
+      rryf = _mm_sub_ps(ryf, _mm_cvtepi32_ps(iry4));
+      _mm_storeu_si128((__m128i *) irxa, irx4);
+      _mm_storeu_si128((__m128i *) irya, iry4);
+      _mm_storeu_ps(rrxa, rrxf);
+      _mm_storeu_ps(rrya, rryf);
+
+      /* the bounds and mask tests are done per lane */
+      lanesValid = 0;
+      for (lane = 0; lane < 4; ++lane)
+	{
+	  ok[lane] = 0;
+	  irx = irxa[lane];
+	  iry = irya[lane];
+	  if (irx < 0 || irx >= iw - 1 ||
+	      iry < 0 || iry >= ih - 1)
+	    continue;
+	  if (mask != NULL && MASK(mask2, mbpl, irx, iry) == 0)
+	    {
+	      if (rrxa[lane] > 0.0 && rrya[lane] > 0.0)
+		continue;
+	      m0 = MASK2(mask, mbpl, irx, iry);
+	      m1 = (rrya[lane] > 0.0) ? MASK2(mask, mbpl, irx, iry+1) : 3;
+	      if ((m0 & 2) == 0 || (m1 & 2) == 0 ||
+		  (rrxa[lane] > 0.0 && ((m0 & 1) == 0 || (m1 & 1) == 0)))
+		continue;
+	    }
+	  ok[lane] = -1;
+	  ++lanesValid;
+	}
+      if (lanesValid == 0)
+	{
+	  _mm_storeu_ps(&warped[x], _mm_setzero_ps());
+	  continue;
+	}
+
+      /* gather the 4 neighbors of each valid lane */
+      laneMask = _mm_castsi128_ps(_mm_loadu_si128((__m128i *) ok));
+      idx = _mm_add_epi32(_mm_mullo_epi32(iry4, _mm_set1_epi32(iw)), irx4);
+      idx = _mm_and_si128(idx, _mm_castps_si128(laneMask));
+      r00f = _mm_mask_i32gather_ps(_mm_setzero_ps(), image, idx, laneMask, 4);
+      r10f = _mm_mask_i32gather_ps(_mm_setzero_ps(), image + 1, idx, laneMask, 4);
+      r01f = _mm_mask_i32gather_ps(_mm_setzero_ps(), image + iw, idx, laneMask, 4);
+      r11f = _mm_mask_i32gather_ps(_mm_setzero_ps(), image + iw + 1, idx, laneMask, 4);
+
+      /* rv = r00 * (rrx - 1.0) * (rry - 1.0)
+	      - r10 * rrx * (rry - 1.0)
+	      - r01 * (rrx - 1.0) * rry
+	      + r11 * rrx * rry; */
+      vd = _mm256_cvtps_pd(rrxf);
+      pd = _mm256_sub_pd(_mm256_cvtps_pd(rryf), one);
+      td = _mm256_mul_pd(_mm256_mul_pd(_mm256_cvtps_pd(r00f),
+				       _mm256_sub_pd(vd, one)), pd);
+      td = _mm256_sub_pd(td, _mm256_mul_pd(_mm256_cvtps_pd(_mm_mul_ps(r10f, rrxf)), pd));
+      td = _mm256_sub_pd(td, _mm256_mul_pd(_mm256_mul_pd(_mm256_cvtps_pd(r01f),
+							 _mm256_sub_pd(vd, one)),
+					   _mm256_cvtps_pd(rryf)));
+      td = _mm256_add_pd(td, _mm256_cvtps_pd(_mm_mul_ps(_mm_mul_ps(r11f, rrxf), rryf)));
+      vf = _mm_and_ps(_mm256_cvtpd_ps(td), laneMask);
+      _mm_storeu_ps(&warped[x], vf);
+      for (lane = 0; lane < 4; ++lane)
+	valid[x + lane] = ok[lane] & 1;
+    }
+  return(x);
+}
+#endif
+
+int
+ComputeCorrelation (float *correlation,
+		    float *a, float *b,
+		    unsigned char *valid,
+		    int w, int h,
+		    int hw)
+{
+  int startN;
+  double startSumA, startSumA2, startSumB, startSumB2, startSumAB;
+  int n;
+  double sumA, sumA2, sumB, sumB2, sumAB;
+  double meanA, meanB;
+  double denom;
+  double av, bv;
+  int x, y;
+  int xc, yc;
+  int i;
+  int *lim;
+  double checkSumA, checkSumA2, checkSumB, checkSumB2, checkSumAB;
+  int checkN;
+  int dx, dy, cx, cy;
+  double checkCorr;
+  int minimumSamples;
+
+  // find the extents of one quadrant of a circle of the desired half-width;
+  // also, let the minimum number of samples be about one-quarter of the
+  //   the potential samples
+  lim = (int*) malloc((hw+1) * sizeof(int));
+  if (lim == NULL)
+    return(0);
+  minimumSamples = 1;
+  for (x = 0; x <= hw; ++x)
+    {
+      lim[x] = (int) floor(sqrt((hw + 0.5) * (hw + 0.5) - x * x));
+      if (x > 0)
+	minimumSamples += (lim[x] + 1);
+    }
+
+  // first compute the sums for (-1, -1)
+  startSumA = 0.0;
+  startSumB = 0.0;
+  startSumA2 = 0.0;
+  startSumB2 = 0.0;
+  startSumAB = 0.0;
+  startN = 0;
+  for (y = 0; y < hw; ++y)
+    for (x = 0; x < lim[y+1]; ++x)
+      {
+	if (x >= w || y >= h || !valid[y*w+x])
+	  continue;
+	av = a[y*w+x];
+	bv = b[y*w+x];
+	startSumA += av;
+	startSumA2 += av * av;
+	startSumB += bv;
+	startSumB2 += bv * bv;
+	startSumAB += av * bv;
+	++startN;
+	//	printf("INCR %0.4d %0.4d ADD\n", x, y);
+      }
+  // go through y
+  for (yc = 0; yc < h; ++yc)
+    {
+      for (i = 1; i <= hw; ++i)
+	{
+	  // subtract old top
+	  x = i - 1;
+	  y = yc - lim[i] - 1;
+	  if (y >= 0 && y < h && x < w && valid[y*w+x])
+	    {
+	      av = a[y*w+x];
+	      bv = b[y*w+x];
+	      startSumA -= av;
+	      startSumA2 -= av * av;
+	      startSumB -= bv;
+	      startSumB2 -= bv * bv;
+	      startSumAB -= av * bv;
+	      --startN;
+	      //	      printf("INCR %0.4d %0.4d DROP\n", x, y);
+	    }
+
+	  // add new bottom
+	  y = yc + lim[i];
+	  if (y < h && x < w && valid[y*w+x])
+	    {
+	      av = a[y*w+x];
+	      bv = b[y*w+x];
+	      startSumA += av;
+	      startSumA2 += av * av;
+	      startSumB += bv;
+	      startSumB2 += bv * bv;
+	      startSumAB += av * bv;
+	      ++startN;
+	      //	      printf("INCR %0.4d %0.4d ADD\n", x, y);
+	    }
+	}
+
+      sumA = startSumA;
+      sumA2 = startSumA2;
+      sumB = startSumB;
+      sumB2 = startSumB2;
+      sumAB = startSumAB;
+      n = startN;
+
+      for (xc = 0; xc < w; ++xc)
+	{
+#if 0
+	  checkSumA = 0.0;
+	  checkSumA2 = 0.0;
+	  checkSumB = 0.0;
+	  checkSumB2 = 0.0;
+	  checkSumAB = 0.0;
+	  checkN = 0;
+	  for (dy = -31; dy <= 31; ++dy)
+	    for (dx = -31; dx <= 31; ++dx)
+	      {
+		cx = xc + dx;
+		cy = yc + dy;
+		if (cx < 0 || cx >= w ||
+		    cy < 0 || cy >= h)
+		  continue;
+		if ((dx * dx + dy * dy) > ((hw + 0.5) * (hw + 0.5)))
+		  continue;
+		if (!valid[cy*w+cx])
+		  continue;
+		av = a[cy*w+cx];
+		bv = b[cy*w+cx];
+		checkSumA += av;
+		checkSumA2 += av * av;
+		checkSumB += bv;
+		checkSumB2 += bv * bv;
+		checkSumAB += av * bv;
+		//		printf("CHECK %0.4d %0.4d ADD\n", cx, cy);
+		++checkN;
+	      }
+
+	  if (checkN >= minimumSamples)
+	    {
+	      meanA = checkSumA / checkN;
+	      meanB = checkSumB / checkN;
+	      denom = (checkSumA2 - 2.0 * meanA * checkSumA + checkN * meanA * meanA) *
+		(checkSumB2 - 2.0 * meanB * checkSumB + checkN * meanB * meanB);
+	      if (denom < 0.001)
+		checkCorr = 0.0;
+	      else
+		checkCorr = (checkSumAB - meanA * checkSumB - meanB * checkSumA + checkN * meanA * meanB) / sqrt(denom);
+	    }
+	  else
+	    checkCorr = 0.0;
+#endif
+#if 0
+	  sumA = checkSumA;
+	  sumA2 = checkSumA2;
+	  sumB = checkSumB;
+	  sumB2 = checkSumB2;
+	  sumAB = checkSumAB;
+	  n = checkN;
+#endif
+
+#if 1
+	  // subtract old left
+	  x = xc - lim[0] - 1;
+	  if (x >= 0 && x < w && valid[yc*w+x])
+	    {
+	      av = a[yc*w+x];
+	      bv = b[yc*w+x];
+	      sumA -= av;
+	      sumA2 -= av * av;
+	      sumB -= bv;
+	      sumB2 -= bv * bv;
+	      sumAB -= av * bv;
+	      --n;
+	      //	      printf("INCR %0.4d %0.4d DROP\n", x, y);
+	    }
+
+	  // add new right
+	  x = xc + lim[0];
+	  if (x >= 0 && x < w && valid[yc*w+x])
+	    {
+	      av = a[yc*w+x];
+	      bv = b[yc*w+x];
+	      sumA += av;
+	      sumA2 += av * av;
+	      sumB += bv;
+	      sumB2 += bv * bv;
+	      sumAB += av * bv;
+	      ++n;
+	      //	      printf("INCR %0.4d %0.4d ADD\n", x, y);
+	    }
+
+	  for (i = 1; i <= hw; ++i)
+	    {
+	      // subtract old left
+	      x = xc - lim[i] - 1;
+	      if (x >= 0)
+		{
+		  y = yc - i;
+		  if (y >= 0 && valid[y*w+x])
+		    {
+		      av = a[y*w+x];
+		      bv = b[y*w+x];
+		      sumA -= av;
+		      sumA2 -= av * av;
+		      sumB -= bv;
+		      sumB2 -= bv * bv;
+		      sumAB -= av * bv;
+		      --n;
+		      //		      printf("INCR %0.4d %0.4d DROP\n", x, y);
+		    }
+		  y = yc + i;
+		  if (y < h && valid[y*w+x])
+		    {
+		      av = a[y*w+x];
+		      bv = b[y*w+x];
+		      sumA -= av;
+		      sumA2 -= av * av;
+		      sumB -= bv;
+		      sumB2 -= bv * bv;
+		      sumAB -= av * bv;
+		      --n;
+		      //		      printf("INCR %0.4d %0.4d DROP\n", x, y);
+		    }
+		}
+
+	      // add new right
+	      x = xc + lim[i];
+	      if (x < w)
+		{
+		  y = yc - i;
+		  if (y >= 0 && valid[y*w+x])
+		    {
+		      av = a[y*w+x];
+		      bv = b[y*w+x];
+		      sumA += av;
+		      sumA2 += av * av;
+		      sumB += bv;
+		      sumB2 += bv * bv;
+		      sumAB += av * bv;
+		      ++n;
+		      //		      printf("INCR %0.4d %0.4d ADD\n", x, y);
+		    }
+		  y = yc + i;
+		  if (y < h && valid[y*w+x])
+		    {
+		      av = a[y*w+x];
+		      bv = b[y*w+x];
+		      sumA += av;
+		      sumA2 += av * av;
+		      sumB += bv;
+		      sumB2 += bv * bv;
+		      sumAB += av * bv;
+		      ++n;
+		      //		      printf("INCR %0.4d %0.4d ADD\n", x, y);
+		    }
+		}
+	    }
+#endif
+
+	  // calculate the correlation for the disk surrounding (xc, yc)
+	  if (n >= minimumSamples)
+	    {
+	      meanA = sumA / n;
+	      meanB = sumB / n;
+	      denom = (sumA2 - 2.0 * meanA * sumA + n * meanA * meanA) *
+		(sumB2 - 2.0 * meanB * sumB + n * meanB * meanB);
+	      if (denom < 0.001)
+		correlation[yc*w+xc] = 0.0;
+	      else
+		correlation[yc*w+xc] = (sumAB - meanA * sumB - meanB * sumA + n * meanA * meanB) / sqrt(denom);
+	    }
+	  else
+	    correlation[yc*w+xc] = 0.0;
+
+#if 0
+	  if (fabs(correlation[yc*w+xc] - checkCorr) / checkCorr > 0.001)
+	    Error("mismatch at %d %d %f %f\n(%f %f %f %f %f %d)\n(%f %f %f %f %f %d)\n",
+		  xc, yc, checkCorr, correlation[yc*w+xc],
+		  checkSumA, checkSumA2, checkSumB, checkSumB2, checkSumAB, checkN,
+		  sumA, sumA2, sumB, sumB2, sumAB, n);
+#endif
+	}
+    }
+  free(lim);
+  return(1);
+}
+
+/* ComputeBoxCorrelation is a constant-time-per-pixel alternative to
+   ComputeCorrelation.  Instead of the disc of radius hw + 0.5, it
+   uses a square of the same area, so the sums can be maintained with
+   separable running sums: one set of column sums over the rows of
+   the current window, which is then slid along each output row.
+   Each output pixel costs the same regardless of hw. */
+int
+ComputeBoxCorrelation (float *correlation,
+		       float *a, float *b,
+		       unsigned char *valid,
+		       int w, int h,
+		       int hw)
+{
+  int hb;
+  int x, y;
+  int xc, yc;
+  int i;
+  int lim;
+  double av, bv;
+  double *colA, *colA2, *colB, *colB2, *colAB;
+  int *colN;
+  double sumA, sumA2, sumB, sumB2, sumAB;
+  int n;
+  double meanA, meanB;
+  double denom;
+  int minimumSamples;
+
+  // use the same minimum number of samples as the circular kernel
+  minimumSamples = 1;
+  for (x = 1; x <= hw; ++x)
+    {
+      lim = (int) floor(sqrt((hw + 0.5) * (hw + 0.5) - x * x));
+      minimumSamples += lim + 1;
+    }
+
+  // choose the box half-width so that its area matches the disc
+  hb = (int) floor(0.5 * (sqrt(M_PI) * (hw + 0.5) - 1.0) + 0.5);
+  if (hb < 0)
+    hb = 0;
+
+  colA = (double *) malloc(w * sizeof(double));
+  colA2 = (double *) malloc(w * sizeof(double));
+  colB = (double *) malloc(w * sizeof(double));
+  colB2 = (double *) malloc(w * sizeof(double));
+  colAB = (double *) malloc(w * sizeof(double));
+  colN = (int *) malloc(w * sizeof(int));
+  if (colA == NULL || colA2 == NULL || colB == NULL || colB2 == NULL ||
+      colAB == NULL || colN == NULL)
+    {
+      free(colA);
+      free(colA2);
+      free(colB);
+      free(colB2);
+      free(colAB);
+      free(colN);
+      return(0);
+    }
+  memset(colA, 0, w * sizeof(double));
+  memset(colA2, 0, w * sizeof(double));
+  memset(colB, 0, w * sizeof(double));
+  memset(colB2, 0, w * sizeof(double));
+  memset(colAB, 0, w * sizeof(double));
+  memset(colN, 0, w * sizeof(int));
+
+  // the column sums initially cover rows [0, hb-1]
+  for (y = 0; y < hb && y < h; ++y)
+    for (x = 0; x < w; ++x)
+      if (valid[y*w+x])
+	{
+	  av = a[y*w+x];
+	  bv = b[y*w+x];
+	  colA[x] += av;
+	  colA2[x] += av * av;
+	  colB[x] += bv;
+	  colB2[x] += bv * bv;
+	  colAB[x] += av * bv;
+	  ++colN[x];
+	}
+
+  for (yc = 0; yc < h; ++yc)
+    {
+      // slide the column sums down to rows [yc-hb, yc+hb]
+      y = yc + hb;
+      if (y < h)
+	for (x = 0; x < w; ++x)
+	  if (valid[y*w+x])
+	    {
+	      av = a[y*w+x];
+	      bv = b[y*w+x];
+	      colA[x] += av;
+	      colA2[x] += av * av;
+	      colB[x] += bv;
+	      colB2[x] += bv * bv;
+	      colAB[x] += av * bv;
+	      ++colN[x];
+	    }
+      y = yc - hb - 1;
+      if (y >= 0)
+	for (x = 0; x < w; ++x)
+	  if (valid[y*w+x])
+	    {
+	      av = a[y*w+x];
+	      bv = b[y*w+x];
+	      colA[x] -= av;
+	      colA2[x] -= av * av;
+	      colB[x] -= bv;
+	      colB2[x] -= bv * bv;
+	      colAB[x] -= av * bv;
+	      --colN[x];
+	    }
+
+      // the row sums initially cover columns [0, hb-1]
+      sumA = sumA2 = sumB = sumB2 = sumAB = 0.0;
+      n = 0;
+      for (i = 0; i < hb && i < w; ++i)
+	{
+	  sumA += colA[i];
+	  sumA2 += colA2[i];
+	  sumB += colB[i];
+	  sumB2 += colB2[i];
+	  sumAB += colAB[i];
+	  n += colN[i];
+	}
+
+      for (xc = 0; xc < w; ++xc)
+	{
+	  // add new right
+	  x = xc + hb;
+	  if (x < w)
+	    {
+	      sumA += colA[x];
+	      sumA2 += colA2[x];
+	      sumB += colB[x];
+	      sumB2 += colB2[x];
+	      sumAB += colAB[x];
+	      n += colN[x];
+	    }
+
+	  // subtract old left
+	  x = xc - hb - 1;
+	  if (x >= 0)
+	    {
+	      sumA -= colA[x];
+	      sumA2 -= colA2[x];
+	      sumB -= colB[x];
+	      sumB2 -= colB2[x];
+	      sumAB -= colAB[x];
+	      n -= colN[x];
+	    }
+
+	  if (n >= minimumSamples)
+	    {
+	      meanA = sumA / n;
+	      meanB = sumB / n;
+	      denom = (sumA2 - 2.0 * meanA * sumA + n * meanA * meanA) *
+		(sumB2 - 2.0 * meanB * sumB + n * meanB * meanB);
+	      if (denom < 0.001)
+		correlation[yc*w+xc] = 0.0;
+	      else
+		correlation[yc*w+xc] = (sumAB - meanA * sumB - meanB * sumA + n * meanA * meanB) / sqrt(denom);
+	    }
+	  else
+	    correlation[yc*w+xc] = 0.0;
+	}
+    }
+  free(colA);
+  free(colA2);
+  free(colB);
+  free(colB2);
+  free(colAB);
+  free(colN);
+  return(1);
+}
@@ -0,0 +1,54 @@
+//
+// correlation.h - functions to warp a reference image by a map and
+//                 to compute the local correlation of two images,
+//                 shared by register and clean_maps
+//
+#ifndef CORRELATION_H
+#define CORRELATION_H
+
+#include "imio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ComputeWarpedImage resamples the iw x ih reference image (whose
+   pixel (0,0) is at (refox, refoy)) through map into the w x h image
+   warped (whose pixel (0,0) is at (imgox, imgoy)); a map element
+   covers mapFactor pixels of both images, which need not be a whole
+   number.  valid is set for each warped pixel that came from a cell
+   with all 4 corners valid, within the reference and, if mask is not
+   NULL, within the reference's packed bitmap mask.  Returns 0 if it
+   could not allocate its working arrays. */
+int ComputeWarpedImage (float *warped, unsigned char *valid,
+			int w, int h,
+			int imgox, int imgoy,
+			float *image, unsigned char *mask,
+			int iw, int ih,
+			int refox, int refoy,
+			MapElement *map,
+			float mapFactor,
+			int mpw, int mph,
+			int mox, int moy);
+
+/* ComputeCorrelation sets each pixel of the w x h image correlation
+   to the correlation of a and b over the valid pixels within the
+   disc of radius hw + 0.5 around it; ComputeBoxCorrelation does the
+   same over a square of the same area, in time independent of hw.
+   Both return 0 if they could not allocate their working arrays. */
+int ComputeCorrelation (float *correlation,
+			float *a, float *b,
+			unsigned char *valid,
+			int w, int h,
+			int hw);
+int ComputeBoxCorrelation (float *correlation,
+			   float *a, float *b,
+			   unsigned char *valid,
+			   int w, int h,
+			   int hw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CORRELATION_H */
@@ -0,0 +1,103 @@
+/*
+ * cpu.c -- finds out which vector instruction sets the cpu supports,
+ *          so that one binary picks the best kernels on each node
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "cpu.h"
+
+static int features = 0;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void Detect (void);
+
+int
+CpuHas (int feature)
+{
+  pthread_once(&once, Detect);
+  return((features & feature) != 0);
+}
+
+char *
+CpuName (void)
+{
+  pthread_once(&once, Detect);
+  if (features & CPU_AVX512F)
+    return("avx512");
+  if (features & CPU_AVX2)
+    return("avx2");
+  if (features & CPU_SSE2)
+    return("sse2");
+  if (features & CPU_NEON)
+    return("neon");
+  return("scalar");
+}
+
+static void
+Detect (void)
+{
+  char *limit;
+  int allowed;
+
+#if defined(CPU_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    features |= CPU_SSE2;
+  if (__builtin_cpu_supports("avx2"))
+    features |= CPU_AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    features |= CPU_AVX512F;
+#elif defined(__linux__) && defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+    features |= CPU_NEON;
+#elif defined(__linux__) && defined(__arm__)
+  if (getauxval(AT_HWCAP) & HWCAP_NEON)
+    features |= CPU_NEON;
+#endif
+
+  limit = getenv("ALIGNTK_SIMD");
+  if (limit == NULL || limit[0] == '\0')
+    return;
+  if (strcmp(limit, "scalar") == 0)
+    allowed = 0;
+  else if (strcmp(limit, "sse2") == 0)
+    allowed = CPU_SSE2;
+  else if (strcmp(limit, "avx2") == 0)
+    allowed = CPU_SSE2 | CPU_AVX2;
+  else if (strcmp(limit, "avx512") == 0)
+    allowed = CPU_SSE2 | CPU_AVX2 | CPU_AVX512F;
+  else if (strcmp(limit, "neon") == 0)
+    allowed = CPU_NEON;
+  else
+    {
+      fprintf(stderr, "Unrecognized ALIGNTK_SIMD value %s; ignored\n", limit);
+      return;
+    }
+  features &= allowed;
+}
@@ -0,0 +1,43 @@
+//
+// cpu.h - run-time selection of the vector kernels of bitmap,
+//         reduction and correlation from the features of the cpu
+//
+#ifndef CPU_H
+#define CPU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the instruction sets that kernels may be written for */
+#define CPU_SSE2	0x01	/* x86 */
+#define CPU_AVX2	0x02	/* x86 */
+#define CPU_AVX512F	0x04	/* x86 */
+#define CPU_NEON	0x08	/* ARM Advanced SIMD */
+
+/* on x86 with gcc or clang, a kernel for a later instruction set than
+   the one the file is compiled for is declared with CPU_TARGET_AVX2
+   (and only called when CpuHas returns true for it) */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CPU_X86	1
+#define CPU_TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+
+/* CpuHas returns whether the cpu supports the instruction set, as
+   found the first time it is called (by cpuid on x86, or the hwcaps
+   of the kernel on ARM); if the
+   environment variable ALIGNTK_SIMD is set it limits the instruction
+   sets used to those up to the one it names (scalar, sse2, avx2,
+   avx512 or neon), so that ALIGNTK_SIMD=scalar forces every kernel
+   onto its plain C loop for validation.  It is thread-safe. */
+int CpuHas (int feature);
+
+/* CpuName returns the name of the best instruction set in use, e.g.
+   "avx2", or "scalar" if none */
+char *CpuName (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CPU_H */
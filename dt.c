@@ -38,9 +38,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "dt.h"
 
+/* the column distances are kept in the caller's float array between
+   the two passes when they are all small enough to be held exactly */
+#define MAX_EXACT_FLOAT_INT	(1 << 24)
+
+typedef struct DistanceJob {
+  int type;
+  int nx, ny;
+  unsigned char *mask;
+  float *dist;
+  int *g;			/* column distances, or NULL if they are
+				   kept in dist */
+  int nThreads;
+  pthread_barrier_t barrier;
+} DistanceJob;
+
+typedef struct DistanceThread {
+  DistanceJob *job;
+  int id;
+  pthread_t thread;
+} DistanceThread;
+
+static void *DistanceThreadMain (void *arg);
+static void ColumnPass (DistanceJob *job, int x0, int x1,
+			unsigned char *unmarked);
+static void RowPass (DistanceJob *job, int y, int *gr, int *s, int *t);
+
 
 void
 computeDistance (int type,
@@ -48,14 +75,22 @@ computeDistance (int type,
 		 unsigned char *mask,
 		 float *dist)
 {
-  int *g;
+  computeDistanceThreaded(type, nx, ny, mask, dist, 1);
+}
+
+void
+computeDistanceThreaded (int type,
+			 int nx, int ny,
+			 unsigned char *mask,
+			 float *dist,
+			 int nThreads)
+{
+  DistanceJob job;
+  DistanceThread *dts;
   long long mw;
-  int q;
-  int *s, *t;
-  int u;
-  int w, z;
   int x, y;
   long long lnx;
+  int i;
 
   // make sure there at least one marked pixel in mask; otherwise,
   //   all distances are infinity
@@ -71,141 +106,291 @@ computeDistance (int type,
   return;
 
  nonempty:
-  g = (int *) malloc(lnx * ny * sizeof(int));
-  s = (int *) malloc(nx * sizeof(int));
-  t = (int *) malloc(nx * sizeof(int));
-  for (x = 0; x < nx; ++x)
+  job.type = type;
+  job.nx = nx;
+  job.ny = ny;
+  job.mask = mask;
+  job.dist = dist;
+  if (nx + 2 * (long long) ny < MAX_EXACT_FLOAT_INT)
+    job.g = NULL;
+  else
+    job.g = (int *) malloc(lnx * ny * sizeof(int));
+  if (nThreads > ny)
+    nThreads = ny;
+  if (nThreads > (nx + 15) / 16)
+    nThreads = (nx + 15) / 16;
+  if (nThreads < 1)
+    nThreads = 1;
+  job.nThreads = nThreads;
+
+  dts = (DistanceThread *) malloc(nThreads * sizeof(DistanceThread));
+  for (i = 0; i < nThreads; ++i)
     {
-      if ((mask[x >> 3] & (0x80 >> (x & 7))) != 0)
-	g[x] = 0;
-      else
-	g[x] = nx + ny;
-      for (y = 1; y < ny; ++y)
-	if ((mask[y * mw + (x >> 3)] & (0x80 >> (x & 7))) != 0)
-	  g[y*lnx + x] = 0;
-	else
-	  g[y*lnx + x] = g[(y - 1) * lnx + x] + 1;
-      for (y = ny - 2; y >= 0; --y)
-	if (g[(y + 1) * lnx + x] < g[y*lnx + x])
-	  g[y*lnx + x] = g[(y + 1) * lnx + x] + 1;
+      dts[i].job = &job;
+      dts[i].id = i;
     }
+  if (nThreads == 1)
+    DistanceThreadMain(&dts[0]);
+  else
+    {
+      if (pthread_barrier_init(&job.barrier, NULL, nThreads) != 0)
+	{
+	  fprintf(stderr, "computeDistance: pthread_barrier_init failed\n");
+	  exit(1);
+	}
+      for (i = 1; i < nThreads; ++i)
+	if (pthread_create(&dts[i].thread, NULL, DistanceThreadMain, &dts[i]) != 0)
+	  {
+	    fprintf(stderr, "computeDistance: pthread_create failed\n");
+	    exit(1);
+	  }
+      DistanceThreadMain(&dts[0]);
+      for (i = 1; i < nThreads; ++i)
+	if (pthread_join(dts[i].thread, NULL) != 0)
+	  {
+	    fprintf(stderr, "computeDistance: pthread_join failed\n");
+	    exit(1);
+	  }
+      pthread_barrier_destroy(&job.barrier);
+    }
+  free(dts);
+  if (job.g != NULL)
+    free(job.g);
+}
+
+static void *
+DistanceThreadMain (void *arg)
+{
+  DistanceThread *dt = (DistanceThread *) arg;
+  DistanceJob *job = dt->job;
+  int nx = job->nx;
+  int ny = job->ny;
+  int x0, x1;
+  int y;
+  int *gr, *s, *t;
+  unsigned char *unmarked;
+
+  // each thread takes a strip of columns, cut on multiples of 16
+  //   so that neighboring strips do not share cache lines
+  x0 = ((long long) nx * dt->id / job->nThreads) & ~15;
+  x1 = dt->id + 1 == job->nThreads ? nx :
+    ((long long) nx * (dt->id + 1) / job->nThreads) & ~15;
+  unmarked = (unsigned char *) malloc(nx * sizeof(unsigned char));
+  ColumnPass(job, x0, x1, unmarked);
+  free(unmarked);
+
+  if (job->nThreads > 1)
+    pthread_barrier_wait(&job->barrier);
+
+  // then a band of rows
+  gr = (int *) malloc(nx * sizeof(int));
+  s = (int *) malloc(nx * sizeof(int));
+  t = (int *) malloc(nx * sizeof(int));
+  for (y = (long long) ny * dt->id / job->nThreads;
+       y < (long long) ny * (dt->id + 1) / job->nThreads;
+       ++y)
+    RowPass(job, y, gr, s, t);
+  free(gr);
+  free(s);
+  free(t);
+  return(NULL);
+}
+
+/* ColumnPass finds the distance of each pixel in columns x0..x1-1 to
+   the nearest marked pixel in its column; the columns are swept a row
+   at a time so that the loops vectorize */
+static void
+ColumnPass (DistanceJob *job, int x0, int x1, unsigned char *unmarked)
+{
+  int nx = job->nx;
+  int ny = job->ny;
+  long long lnx = nx;
+  long long mw = (nx + 7) >> 3;
+  int x, y;
+  int *g, *gp;
+  float *d, *dp;
 
   for (y = 0; y < ny; ++y)
     {
-      q = 0;
-      s[0] = 0;
-      t[0] = 0;
-      for (u = 1; u < nx; ++u)
+      for (x = x0; x < x1; ++x)
+	unmarked[x] = ((job->mask[y * mw + (x >> 3)] >> (7 - (x & 7))) & 1) ^ 1;
+      if (job->g != NULL)
 	{
-	  switch (type)
+	  g = &job->g[y * lnx];
+	  if (y == 0)
+	    for (x = x0; x < x1; ++x)
+	      g[x] = unmarked[x] * (nx + ny);
+	  else
 	    {
-	    case EUCLIDEAN_DISTANCE:
-	    case EUCLIDEAN_DISTANCE_SQUARED:
-	      while (q >= 0 &&
-		     (t[q] - s[q]) * ((long long) (t[q] - s[q])) +
-		     g[y*lnx + s[q]] * ((long long) g[y*lnx + s[q]]) >
-		     (t[q] - u) * ((long long) (t[q] - u)) +
-		     g[y*lnx + u] * ((long long) g[y*lnx + u]))
-		--q;
-	      break;
-	    case MANHATTAN_DISTANCE:
-	      while (q >= 0 &&
-		     abs(t[q] - s[q]) + g[y*lnx + s[q]] >
-		     abs(t[q] - u) + g[y*lnx + u])
-		--q;
-	      break;
-	    case CHESSBOARD_DISTANCE:
-	      while (q >= 0)
-		{
-		  w = abs(t[q] - s[q]);
-		  if (g[y*lnx + s[q]] > w)
-		    w = g[y*lnx + s[q]];
-		  z = abs(t[q] - u);
-		  if (g[y*lnx + u] > z)
-		    z = g[y*lnx + u];
-		  if (w <= z)
-		    break;
-		  --q;
-		}
-	      break;
+	      gp = g - lnx;
+	      for (x = x0; x < x1; ++x)
+		g[x] = unmarked[x] * (gp[x] + 1);
 	    }
-	  if (q < 0)
+	}
+      else
+	{
+	  d = &job->dist[y * lnx];
+	  if (y == 0)
+	    for (x = x0; x < x1; ++x)
+	      d[x] = unmarked[x] * (float) (nx + ny);
+	  else
 	    {
-	      q = 0;
-	      s[0] = u;
+	      dp = d - lnx;
+	      for (x = x0; x < x1; ++x)
+		d[x] = unmarked[x] * (dp[x] + 1.0f);
 	    }
-	  else
+	}
+    }
+
+  for (y = ny - 2; y >= 0; --y)
+    if (job->g != NULL)
+      {
+	g = &job->g[y * lnx];
+	gp = g + lnx;
+	for (x = x0; x < x1; ++x)
+	  g[x] = gp[x] + 1 < g[x] ? gp[x] + 1 : g[x];
+      }
+    else
+      {
+	d = &job->dist[y * lnx];
+	dp = d + lnx;
+	for (x = x0; x < x1; ++x)
+	  d[x] = dp[x] + 1.0f < d[x] ? dp[x] + 1.0f : d[x];
+      }
+}
+
+/* RowPass combines the column distances along row y into the final
+   distances, taking the lower envelope of the distance functions of
+   the column minima */
+static void
+RowPass (DistanceJob *job, int y, int *gr, int *s, int *t)
+{
+  int type = job->type;
+  int nx = job->nx;
+  long long lnx = nx;
+  float *dist = job->dist;
+  int q;
+  int u;
+  int w, z;
+
+  // take a copy of the row, since the output may overwrite it
+  if (job->g != NULL)
+    for (u = 0; u < nx; ++u)
+      gr[u] = job->g[y*lnx + u];
+  else
+    for (u = 0; u < nx; ++u)
+      gr[u] = (int) dist[y*lnx + u];
+
+  q = 0;
+  s[0] = 0;
+  t[0] = 0;
+  for (u = 1; u < nx; ++u)
+    {
+      switch (type)
+	{
+	case EUCLIDEAN_DISTANCE:
+	case EUCLIDEAN_DISTANCE_SQUARED:
+	  while (q >= 0 &&
+		 (t[q] - s[q]) * ((long long) (t[q] - s[q])) +
+		 gr[s[q]] * ((long long) gr[s[q]]) >
+		 (t[q] - u) * ((long long) (t[q] - u)) +
+		 gr[u] * ((long long) gr[u]))
+	    --q;
+	  break;
+	case MANHATTAN_DISTANCE:
+	  while (q >= 0 &&
+		 abs(t[q] - s[q]) + gr[s[q]] >
+		 abs(t[q] - u) + gr[u])
+	    --q;
+	  break;
+	case CHESSBOARD_DISTANCE:
+	  while (q >= 0)
 	    {
-	      switch (type)
-		{
-		case EUCLIDEAN_DISTANCE:
-		case EUCLIDEAN_DISTANCE_SQUARED:
-		  w = (u * ((long long) u) - s[q] * ((long long) s[q]) +
-		       g[y*lnx+u] * ((long long) g[y*lnx+u]) -
-		       g[y*lnx+s[q]] * ((long long) g[y*lnx+s[q]])) /
-		    (2 * (u - s[q])) + 1;
-		  break;
-		case MANHATTAN_DISTANCE:
-		  if (g[y*lnx + u] >= g[y*lnx + s[q]] + u - s[q])
-		    w = 1000000000;
-		  else if (g[y*lnx + s[q]] > g[y*lnx + u] + u - s[q])
-		    w = -1000000000;
-		  else
-		    w = (g[y*lnx + u] - g[y*lnx + s[q]] + u + s[q]) / 2 + 1;
-		  break;
-		case CHESSBOARD_DISTANCE:
-		  if (g[y*lnx + s[q]] <= g[y*lnx + u])
-		    {
-		      w = s[q] + g[y*lnx + u];
-		      z = (s[q] + u) / 2;
-		      if (z > w)
-			w = z;
-		    }
-		  else
-		    {
-		      w = u - g[y*lnx + s[q]];
-		      z = (s[q] + u) / 2;
-		      if (z < w)
-			w = z;
-		    }
-		  ++w;
-		  break;
-		}
-	      if (w < nx)
-		{
-		  ++q;
-		  s[q] = u;
-		  t[q] = w;
-		}
+	      w = abs(t[q] - s[q]);
+	      if (gr[s[q]] > w)
+		w = gr[s[q]];
+	      z = abs(t[q] - u);
+	      if (gr[u] > z)
+		z = gr[u];
+	      if (w <= z)
+		break;
+	      --q;
 	    }
+	  break;
 	}
-      for (u = nx-1; u >= 0; --u)
+      if (q < 0)
+	{
+	  q = 0;
+	  s[0] = u;
+	}
+      else
 	{
 	  switch (type)
 	    {
 	    case EUCLIDEAN_DISTANCE:
-	      dist[y * lnx + u] = sqrt((double) ((u - s[q]) * ((long long) (u - s[q])) +
-						 g[y*lnx + s[q]] * ((long long) g[y*lnx + s[q]])));
-	      break;
 	    case EUCLIDEAN_DISTANCE_SQUARED:
-	      dist[y * lnx + u] = (u - s[q]) * ((long long) (u - s[q])) +
-		g[y*lnx + s[q]] * ((long long) g[y*lnx + s[q]]);
+	      w = (u * ((long long) u) - s[q] * ((long long) s[q]) +
+		   gr[u] * ((long long) gr[u]) -
+		   gr[s[q]] * ((long long) gr[s[q]])) /
+		(2 * (u - s[q])) + 1;
 	      break;
 	    case MANHATTAN_DISTANCE:
-	      dist[y * lnx + u] = abs(u - s[q]) + g[y*lnx + s[q]];
+	      if (gr[u] >= gr[s[q]] + u - s[q])
+		w = 1000000000;
+	      else if (gr[s[q]] > gr[u] + u - s[q])
+		w = -1000000000;
+	      else
+		w = (gr[u] - gr[s[q]] + u + s[q]) / 2 + 1;
 	      break;
 	    case CHESSBOARD_DISTANCE:
-	      w = abs(u - s[q]);
-	      if (g[y*lnx + s[q]] > w)
-		w = g[y*lnx + s[q]];
-	      dist[y * lnx + u] = w;
+	      if (gr[s[q]] <= gr[u])
+		{
+		  w = s[q] + gr[u];
+		  z = (s[q] + u) / 2;
+		  if (z > w)
+		    w = z;
+		}
+	      else
+		{
+		  w = u - gr[s[q]];
+		  z = (s[q] + u) / 2;
+		  if (z < w)
+		    w = z;
+		}
+	      ++w;
 	      break;
 	    }
-	  if (u == t[q])
-	    --q;
+	  if (w < nx)
+	    {
+	      ++q;
+	      s[q] = u;
+	      t[q] = w;
+	    }
 	}
     }
-  free(g);
-  free(s);
-  free(t);
+  for (u = nx-1; u >= 0; --u)
+    {
+      switch (type)
+	{
+	case EUCLIDEAN_DISTANCE:
+	  dist[y * lnx + u] = sqrt((double) ((u - s[q]) * ((long long) (u - s[q])) +
+					     gr[s[q]] * ((long long) gr[s[q]])));
+	  break;
+	case EUCLIDEAN_DISTANCE_SQUARED:
+	  dist[y * lnx + u] = (u - s[q]) * ((long long) (u - s[q])) +
+	    gr[s[q]] * ((long long) gr[s[q]]);
+	  break;
+	case MANHATTAN_DISTANCE:
+	  dist[y * lnx + u] = abs(u - s[q]) + gr[s[q]];
+	  break;
+	case CHESSBOARD_DISTANCE:
+	  w = abs(u - s[q]);
+	  if (gr[s[q]] > w)
+	    w = gr[s[q]];
+	  dist[y * lnx + u] = w;
+	  break;
+	}
+      if (u == t[q])
+	--q;
+    }
 }
@@ -15,6 +15,11 @@ extern "C" {
 
 void computeDistance (int type, int nx, int ny, unsigned char *mask, float *dist);
 
+/* computeDistanceThreaded is computeDistance using up to nThreads
+   threads */
+void computeDistanceThreaded (int type, int nx, int ny, unsigned char *mask,
+			      float *dist, int nThreads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,296 @@
+/*
+ * exchange.c -- defines the exchange of image values between the
+ *               processes of align and gen_imaps
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "exchange.h"
+
+static ExchangePeer *FindPeer (Exchange *x, int process);
+static int AddImage (ExchangeList *l, int image, int nFloats);
+
+Exchange *
+CreateExchange (MPI_Comm comm, int tag)
+{
+  Exchange *x;
+
+  x = (Exchange *) malloc(sizeof(Exchange));
+  if (x == NULL)
+    return(NULL);
+  memset(x, 0, sizeof(Exchange));
+  x->comm = comm;
+  x->tag = tag;
+  return(x);
+}
+
+void
+ResetExchange (Exchange *x)
+{
+  int i;
+  ExchangePeer *pr;
+
+  for (i = 0; i < x->nRequests; ++i)
+    MPI_Request_free(&x->requests[i]);
+  x->nRequests = 0;
+  for (i = 0; i < x->nPeers; ++i)
+    {
+      pr = &x->peers[i];
+      pr->send.n = 0;
+      pr->send.total = 0;
+      pr->receive.n = 0;
+      pr->receive.total = 0;
+    }
+  x->nPeers = 0;
+  x->pending = 0;
+  x->nSendFloats = 0;
+}
+
+int
+AddExchangeSend (Exchange *x, int process, int image, int nFloats)
+{
+  ExchangePeer *pr;
+
+  if ((pr = FindPeer(x, process)) == NULL)
+    return(0);
+  return(AddImage(&pr->send, image, nFloats));
+}
+
+int
+AddExchangeReceive (Exchange *x, int process, int image, int nFloats)
+{
+  ExchangePeer *pr;
+
+  if ((pr = FindPeer(x, process)) == NULL)
+    return(0);
+  return(AddImage(&pr->receive, image, nFloats));
+}
+
+int
+PlanExchange (Exchange *x, char *error)
+{
+  int i;
+  int n;
+  ExchangePeer *pr;
+
+  x->requests = (MPI_Request *) realloc(x->requests,
+					(2 * x->nPeers + 1) *
+					sizeof(MPI_Request));
+  if (x->requests == NULL)
+    {
+      sprintf(error, "Could not allocate %d exchange requests\n",
+	      2 * x->nPeers);
+      return(0);
+    }
+
+  /* the receives are created first, so that they are started before
+     the sends */
+  n = 0;
+  x->nSendFloats = 0;
+  for (i = 0; i < x->nPeers; ++i)
+    {
+      pr = &x->peers[i];
+      if (pr->receive.total > INT_MAX || pr->send.total > INT_MAX)
+	{
+	  sprintf(error, "Exchange with process %d is too large\n",
+		  pr->process);
+	  return(0);
+	}
+      free(pr->receive.buffer);
+      free(pr->send.buffer);
+      pr->receive.buffer = (float *) malloc((pr->receive.total + 1) *
+					    sizeof(float));
+      pr->send.buffer = (float *) malloc((pr->send.total + 1) *
+					 sizeof(float));
+      if (pr->receive.buffer == NULL || pr->send.buffer == NULL)
+	{
+	  sprintf(error, "Could not allocate exchange buffers for process %d\n",
+		  pr->process);
+	  return(0);
+	}
+      if (pr->receive.n > 0 &&
+	  MPI_Recv_init(pr->receive.buffer, (int) pr->receive.total,
+			MPI_FLOAT, pr->process, x->tag, x->comm,
+			&x->requests[n++]) != MPI_SUCCESS)
+	{
+	  sprintf(error, "Could not set up receive from process %d\n",
+		  pr->process);
+	  return(0);
+	}
+    }
+  for (i = 0; i < x->nPeers; ++i)
+    {
+      pr = &x->peers[i];
+      if (pr->send.n > 0 &&
+	  MPI_Send_init(pr->send.buffer, (int) pr->send.total,
+			MPI_FLOAT, pr->process, x->tag, x->comm,
+			&x->requests[n++]) != MPI_SUCCESS)
+	{
+	  sprintf(error, "Could not set up send to process %d\n",
+		  pr->process);
+	  return(0);
+	}
+      x->nSendFloats += pr->send.total;
+    }
+  x->nRequests = n;
+  return(1);
+}
+
+int
+StartExchange (Exchange *x, ExchangeCopy pack, char *error)
+{
+  int i, j;
+  float *v;
+  ExchangePeer *pr;
+
+  for (i = 0; i < x->nPeers; ++i)
+    {
+      pr = &x->peers[i];
+      v = pr->send.buffer;
+      for (j = 0; j < pr->send.n; ++j)
+	{
+	  (*pack)(pr->send.images[j], v);
+	  v += pr->send.nFloats[j];
+	}
+    }
+  if (x->nRequests > 0 &&
+      MPI_Startall(x->nRequests, x->requests) != MPI_SUCCESS)
+    {
+      sprintf(error, "Could not start the exchange\n");
+      return(0);
+    }
+  x->pending = 1;
+  return(1);
+}
+
+int
+FinishExchange (Exchange *x, ExchangeCopy unpack, char *error)
+{
+  int i, j;
+  float *v;
+  ExchangePeer *pr;
+
+  if (!x->pending)
+    return(1);
+  if (x->nRequests > 0 &&
+      MPI_Waitall(x->nRequests, x->requests, MPI_STATUSES_IGNORE) !=
+      MPI_SUCCESS)
+    {
+      sprintf(error, "Could not complete the exchange\n");
+      return(0);
+    }
+  x->pending = 0;
+  for (i = 0; i < x->nPeers; ++i)
+    {
+      pr = &x->peers[i];
+      v = pr->receive.buffer;
+      for (j = 0; j < pr->receive.n; ++j)
+	{
+	  (*unpack)(pr->receive.images[j], v);
+	  v += pr->receive.nFloats[j];
+	}
+    }
+  return(1);
+}
+
+void
+FreeExchange (Exchange *x)
+{
+  int i;
+  ExchangePeer *pr;
+
+  ResetExchange(x);
+  for (i = 0; i < x->peersSize; ++i)
+    {
+      pr = &x->peers[i];
+      free(pr->send.images);
+      free(pr->send.nFloats);
+      free(pr->send.buffer);
+      free(pr->receive.images);
+      free(pr->receive.nFloats);
+      free(pr->receive.buffer);
+    }
+  free(x->peers);
+  free(x->requests);
+  free(x);
+}
+
+/* FindPeer returns the entry of process, adding it if need be; the
+   entries beyond nPeers are those of earlier plans, and keep their
+   arrays for reuse */
+static ExchangePeer *
+FindPeer (Exchange *x, int process)
+{
+  int i;
+  ExchangePeer *pr;
+
+  for (i = 0; i < x->nPeers; ++i)
+    if (x->peers[i].process == process)
+      return(&x->peers[i]);
+  if (x->nPeers == x->peersSize)
+    {
+      pr = (ExchangePeer *) realloc(x->peers,
+				    (2 * x->peersSize + 1) *
+				    sizeof(ExchangePeer));
+      if (pr == NULL)
+	return(NULL);
+      x->peers = pr;
+      memset(&x->peers[x->peersSize], 0,
+	     (x->peersSize + 1) * sizeof(ExchangePeer));
+      x->peersSize = 2 * x->peersSize + 1;
+    }
+  pr = &x->peers[x->nPeers++];
+  pr->process = process;
+  pr->send.n = 0;
+  pr->send.total = 0;
+  pr->receive.n = 0;
+  pr->receive.total = 0;
+  return(pr);
+}
+
+static int
+AddImage (ExchangeList *l, int image, int nFloats)
+{
+  int *images, *nFloatsArray;
+
+  if (l->n == l->size)
+    {
+      images = (int *) realloc(l->images, (2 * l->size + 1) * sizeof(int));
+      if (images == NULL)
+	return(0);
+      l->images = images;
+      nFloatsArray = (int *) realloc(l->nFloats,
+				     (2 * l->size + 1) * sizeof(int));
+      if (nFloatsArray == NULL)
+	return(0);
+      l->nFloats = nFloatsArray;
+      l->size = 2 * l->size + 1;
+    }
+  l->images[l->n] = image;
+  l->nFloats[l->n] = nFloats;
+  ++l->n;
+  l->total += nFloats;
+  return(1);
+}
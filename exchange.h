@@ -0,0 +1,90 @@
+//
+// exchange.h - the exchange of the values of images (node positions
+//              or intensities) from the processes that own them to
+//              those that need them, shared by align and gen_imaps;
+//              the messages to each other process are set up once as
+//              persistent MPI requests on buffers of their own, and
+//              then started and completed as often as needed
+//
+#ifndef EXCHANGE_H
+#define EXCHANGE_H
+
+#include <stddef.h>
+#include <mpi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the images sent to or received from one other process, in the order
+   they were added, and the buffer holding their values while they
+   are in transit */
+typedef struct ExchangeList
+{
+  int n;
+  int size;		/* allocated length of images and nFloats */
+  int *images;
+  int *nFloats;		/* number of values of each image */
+  size_t total;		/* sum of nFloats */
+  float *buffer;
+} ExchangeList;
+
+typedef struct ExchangePeer
+{
+  int process;
+  ExchangeList send;
+  ExchangeList receive;
+} ExchangePeer;
+
+typedef struct Exchange
+{
+  MPI_Comm comm;
+  int tag;
+  int nPeers;
+  int peersSize;
+  ExchangePeer *peers;
+  int nRequests;	/* persistent requests (0 until planned) */
+  MPI_Request *requests;
+  int pending;		/* true between StartExchange and FinishExchange */
+  size_t nSendFloats;	/* values sent by each exchange */
+} Exchange;
+
+/* ExchangeCopy copies the values of an image into values (when
+   sending) or from them (when receiving) */
+typedef void (*ExchangeCopy) (int image, float *values);
+
+/* CreateExchange returns an empty exchange among the processes of
+   comm, whose messages will carry the given tag, or NULL if there is
+   no memory */
+Exchange *CreateExchange (MPI_Comm comm, int tag);
+
+/* ResetExchange forgets the images of x and frees its requests, so
+   that it can be set up again (as when the images change size) */
+void ResetExchange (Exchange *x);
+
+/* AddExchangeSend and AddExchangeReceive add an image of nFloats
+   values to the message to or from process; the sender and receiver
+   must add the images of a message in the same order.  Both return 0
+   if there is no memory. */
+int AddExchangeSend (Exchange *x, int process, int image, int nFloats);
+int AddExchangeReceive (Exchange *x, int process, int image, int nFloats);
+
+/* PlanExchange allocates the buffers and creates the persistent
+   requests of the messages added since the last ResetExchange; it
+   returns 0, with a message in error, if it could not */
+int PlanExchange (Exchange *x, char *error);
+
+/* StartExchange packs the sent images with pack and starts all the
+   messages; FinishExchange waits for them and unpacks the received
+   images with unpack (doing nothing if no exchange was started).
+   Both return 0, with a message in error, if MPI fails. */
+int StartExchange (Exchange *x, ExchangeCopy pack, char *error);
+int FinishExchange (Exchange *x, ExchangeCopy unpack, char *error);
+
+void FreeExchange (Exchange *x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXCHANGE_H */
@@ -8,9 +8,46 @@
 #include <limits.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "dt.h"
 #include "imio.h"
 
+typedef struct Extrapolation
+{
+  MapElement *map;	/* the input map */
+  int mw, mh;
+  int mxMin, myMin;
+  MapElement *omap;	/* the output map */
+  int ow, oh;
+  int oxMin, oyMin;
+  int power;
+  float extraC;
+  int *ring;		/* for the sweep, the chessboard distance of each
+			   output element from the nearest valid one */
+  int *points;		/* the elements in order of ring */
+  float *jacobian;	/* for the sweep, the derivatives dx'/dx, dx'/dy,
+			   dy'/dx and dy'/dy at each element */
+} Extrapolation;
+
+typedef struct ExtrapolationBand
+{
+  pthread_t thread;
+  Extrapolation *e;
+  int i0, i1;		/* the rows, or indices in points, of this band */
+  int k;		/* the ring being filled */
+} ExtrapolationBand;
+
+void FilterFill (Extrapolation *e, int nThreads);
+void *FilterThreadMain (void *arg);
+void FilterRows (Extrapolation *e, int y0, int y1);
+void SweepFill (Extrapolation *e, int nThreads);
+void *SweepThreadMain (void *arg);
+void SweepPoints (Extrapolation *e, int k, int i0, int i1);
+void Derivatives (Extrapolation *e, unsigned char *mask, int obpl,
+		  int x, int y, int dx, int dy, float *j);
+void RunBands (Extrapolation *e, int i0, int i1, int k, int minBand,
+	       int nThreads, void *(*threadMain)(void *));
 void Error (char *fmt, ...);
 
 int
@@ -33,21 +70,9 @@ main (int argc, char **argv)
   MapElement *omap;
 
   int factor;
-  int x, y;
-  float x1, y1, c1;
-  float xv, yv;
-  float xp, yp;
-  int ix, iy;
-  float rx, ry, rc;
-  float rx00, rx01, rx10, rx11;
-  float ry00, ry01, ry10, ry11;
-  float rc00, rc01, rc10, rc11;
-  float rrx, rry;
-
-  int dx, dy;
-  double weight;
-  double totalWeight;
-  double trx, try;
+  int sweep;
+  int nThreads;
+  Extrapolation e;
 
   int i;
   int error;
@@ -60,6 +85,8 @@ main (int argc, char **argv)
   height = -1;
   power = 4;
   extraC = 0.0;
+  sweep = 0;
+  nThreads = 1;
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-map") == 0)
       {
@@ -111,6 +138,17 @@ main (int argc, char **argv)
             break;
           }
       }
+    else if (strcmp(argv[i], "-sweep") == 0)
+      sweep = 1;
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+        if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+          {
+            error = 1;
+            break;
+          }
+      }
     else
       {
 	error = 1;
@@ -131,6 +169,8 @@ main (int argc, char **argv)
       fprintf(stderr, "            [-width <int>]\n");
       fprintf(stderr, "            [-height <int>]\n");
       fprintf(stderr, "            [-power <int (range [0-4])>]\n");
+      fprintf(stderr, "            [-sweep]\n");
+      fprintf(stderr, "            [-threads <int>]\n");
       exit(1);
     }
 
@@ -163,18 +203,87 @@ main (int argc, char **argv)
     }
   omap = (MapElement*) malloc(ow*oh*sizeof(MapElement));
 
+  e.map = map;
+  e.mw = mw;
+  e.mh = mh;
+  e.mxMin = mxMin;
+  e.myMin = myMin;
+  e.omap = omap;
+  e.ow = ow;
+  e.oh = oh;
+  e.oxMin = oxMin;
+  e.oyMin = oyMin;
+  e.power = power;
+  e.extraC = extraC;
+  if (power < 0 || power > 4)
+    Error("power = %d is unsupported.\n", power);
+
   // extrapolate all entries with 0 confidence
-  for (y = 0; y < oh; ++y)
+  if (sweep)
+    SweepFill(&e, nThreads);
+  else
+    FilterFill(&e, nThreads);
+
+  if (!WriteMap(outputMapName, omap, mLevel, ow, oh,
+		oxMin, oyMin,
+		imgName, refName,
+		UncompressedMap, msg))
+    Error("Could not write map %s:\n%s\n",
+	  outputMapName, msg);
+
+  free(map);
+  free(omap);
+  return(0);
+}
+
+/* FilterFill sets each element of the output map that has no valid
+   counterpart in the input map to the average of the bilinear
+   extensions of all the valid cells of the input map to it, weighted
+   by the inverse of the power-th power of the distance to each cell;
+   the rows are divided among nThreads threads */
+void
+FilterFill (Extrapolation *e, int nThreads)
+{
+  RunBands(e, 0, e->oh, 0, 1, nThreads, FilterThreadMain);
+}
+
+void *
+FilterThreadMain (void *arg)
+{
+  ExtrapolationBand *band = (ExtrapolationBand *) arg;
+
+  FilterRows(band->e, band->i0, band->i1);
+  return(NULL);
+}
+
+void
+FilterRows (Extrapolation *e, int y0, int y1)
+{
+  MapElement *map = e->map;
+  int mw = e->mw;
+  int mh = e->mh;
+  int ow = e->ow;
+  int x, y;
+  int ix, iy;
+  int dx, dy;
+  float rx00, rx01, rx10, rx11;
+  float ry00, ry01, ry10, ry11;
+  float rrx, rry;
+  double weight;
+  double totalWeight;
+  double trx, try;
+  int mx, my;
+
+  for (y = y0; y < y1; ++y)
     for (x = 0; x < ow; ++x)
       {
-	if ((x + oxMin) >= mxMin && (x + oxMin) < mxMin+mw &&
-	    (y + oyMin) >= myMin && (y + oyMin) < myMin+mh &&
-	    map[(y+oyMin-myMin)*mw + (x+oxMin-mxMin)].c != 0.0)
+	mx = x + e->oxMin - e->mxMin;
+	my = y + e->oyMin - e->myMin;
+	if (mx >= 0 && mx < mw && my >= 0 && my < mh &&
+	    map[my*mw + mx].c != 0.0)
 	  {
 	    // no need to extrapolate
-	    omap[y*ow+x].x = map[(y+oyMin-myMin)*mw + (x+oxMin-mxMin)].x;
-	    omap[y*ow+x].y = map[(y+oyMin-myMin)*mw + (x+oxMin-mxMin)].y;
-	    omap[y*ow+x].c = map[(y+oyMin-myMin)*mw + (x+oxMin-mxMin)].c;
+	    e->omap[y*ow+x] = map[my*mw + mx];
 	    continue;
 	  }
 
@@ -184,11 +293,11 @@ main (int argc, char **argv)
 	totalWeight = 0.0;
 	for (iy = 0; iy < mh-1; ++iy)
 	  {
-	    if (iy >= (y + oyMin - myMin))
-	      dy = iy - (y + oyMin - myMin);
+	    if (iy >= my)
+	      dy = iy - my;
 	    else
-	      dy = (y + oyMin - myMin) - (iy + 1);
-	    rry = (y + oyMin - myMin) - iy;
+	      dy = my - (iy + 1);
+	    rry = my - iy;
 
 	    for (ix = 0; ix < mw-1; ++ix)
 	      {
@@ -198,11 +307,11 @@ main (int argc, char **argv)
 		    map[(iy+1)*mw+ix+1].c == 0.0)
 		  continue;
 		    
-		if (ix >= (x + oxMin - mxMin))
-		  dx = ix - (x + oxMin - mxMin);
+		if (ix >= mx)
+		  dx = ix - mx;
 		else
-		  dx = (x + oxMin - mxMin) - (ix + 1);
-		rrx = (x + oxMin - mxMin) - ix;
+		  dx = mx - (ix + 1);
+		rrx = mx - ix;
 
 		rx00 = map[iy*mw+ix].x;
 		ry00 = map[iy*mw+ix].y;
@@ -213,7 +322,7 @@ main (int argc, char **argv)
 		rx11 = map[(iy+1)*mw+ix+1].x;
 		ry11 = map[(iy+1)*mw+ix+1].y;
 
-		switch (power)
+		switch (e->power)
 		  {
 		  case 0:
 		    weight = 1.0;
@@ -233,7 +342,7 @@ main (int argc, char **argv)
 		      ((double) (dx*dx + dy*dy));
 		    break;
 		  default:
-		    Error("power = %d is unsupported.\n", power);
+		    Error("power = %d is unsupported.\n", e->power);
 		    break;
 		  }
 		if (isnan(weight))
@@ -256,21 +365,238 @@ main (int argc, char **argv)
 	if (totalWeight == 0.0)
 	  Error("Could not extrapolate map element (%d,%d).\n", x, y);
 
-	omap[y*ow+x].x = trx / totalWeight;
-	omap[y*ow+x].y = try / totalWeight;
-	omap[y*ow+x].c = extraC;
+	e->omap[y*ow+x].x = trx / totalWeight;
+	e->omap[y*ow+x].y = try / totalWeight;
+	e->omap[y*ow+x].c = e->extraC;
       }
+}
 
-  if (!WriteMap(outputMapName, omap, mLevel, ow, oh,
-		oxMin, oyMin,
-		imgName, refName,
-		UncompressedMap, msg))
-    Error("Could not write map %s:\n%s\n",
-	  outputMapName, msg);
+/* SweepFill fills the output map outward from the valid elements in
+   a single sweep, in rings of increasing chessboard distance from
+   them.  Each element of a ring has a neighbor in an earlier ring,
+   and is set from its neighbors in earlier rings only, so the
+   elements of each ring are independent and are divided among the
+   threads.  Each element carries the derivatives of the map, found
+   by differences at the valid elements; an element being filled is
+   set to the average of the first-order extensions of those
+   neighbors to it, weighted by the inverse squared distance, and
+   takes the same average of their derivatives.  This is linear in
+   the size of the map, exact for affine maps, and, since every
+   step is an average, does not amplify errors with distance. */
+void
+SweepFill (Extrapolation *e, int nThreads)
+{
+  MapElement *map = e->map;
+  int ow = e->ow;
+  int oh = e->oh;
+  int obpl;
+  int x, y, k;
+  int mx, my;
+  int maxRing;
+  int n;
+  size_t i;
+  unsigned char *mask;
+  float *dist;
+  int *start;
 
-  free(map);
-  free(omap);
-  return(0);
+  obpl = (ow + 7) >> 3;
+  mask = (unsigned char *) malloc(((size_t) oh) * obpl);
+  memset(mask, 0, ((size_t) oh) * obpl);
+  for (y = 0; y < oh; ++y)
+    for (x = 0; x < ow; ++x)
+      {
+	mx = x + e->oxMin - e->mxMin;
+	my = y + e->oyMin - e->myMin;
+	if (mx >= 0 && mx < e->mw && my >= 0 && my < e->mh &&
+	    map[my*e->mw + mx].c != 0.0)
+	  {
+	    e->omap[y*ow+x] = map[my*e->mw + mx];
+	    mask[y*obpl + (x >> 3)] |= 0x80 >> (x & 7);
+	  }
+      }
+  dist = (float *) malloc(((size_t) ow) * oh * sizeof(float));
+  computeDistanceThreaded(CHESSBOARD_DISTANCE, ow, oh, mask, dist, nThreads);
+
+  /* find the derivatives at the valid elements, from central
+     differences where both neighbors are valid, one-sided ones where
+     only one is, and the identity's where neither is */
+  e->jacobian = (float *) malloc(((size_t) ow) * oh * 4 * sizeof(float));
+  for (y = 0; y < oh; ++y)
+    for (x = 0; x < ow; ++x)
+      if ((mask[y*obpl + (x >> 3)] & (0x80 >> (x & 7))) != 0)
+	{
+	  Derivatives(e, mask, obpl, x, y, 1, 0, &e->jacobian[4*(y*ow+x)]);
+	  Derivatives(e, mask, obpl, x, y, 0, 1, &e->jacobian[4*(y*ow+x)+1]);
+	}
+  free(mask);
+
+  /* sort the elements by ring */
+  e->ring = (int *) malloc(((size_t) ow) * oh * sizeof(int));
+  maxRing = 0;
+  for (i = 0; i < ((size_t) ow) * oh; ++i)
+    {
+      if (dist[i] > ow + oh)
+	Error("Could not extrapolate map element (%d,%d).\n",
+	      (int) (i % ow), (int) (i / ow));
+      e->ring[i] = (int) (dist[i] + 0.5);
+      if (e->ring[i] > maxRing)
+	maxRing = e->ring[i];
+    }
+  free(dist);
+  start = (int *) malloc((maxRing + 2) * sizeof(int));
+  memset(start, 0, (maxRing + 2) * sizeof(int));
+  for (i = 0; i < ((size_t) ow) * oh; ++i)
+    ++start[e->ring[i] + 1];
+  for (k = 1; k <= maxRing + 1; ++k)
+    start[k] += start[k-1];
+  e->points = (int *) malloc((((size_t) ow) * oh + 1) * sizeof(int));
+  for (i = 0; i < ((size_t) ow) * oh; ++i)
+    e->points[start[e->ring[i]]++] = i;
+  /* start[k] is now the end of ring k, and so the start of ring k+1;
+     ring 0 holds the valid elements */
+
+  n = start[0];
+  for (k = 1; k <= maxRing; ++k)
+    {
+      RunBands(e, n, start[k], k, 256, nThreads, SweepThreadMain);
+      n = start[k];
+    }
+
+  free(start);
+  free(e->points);
+  free(e->ring);
+  free(e->jacobian);
+}
+
+/* Derivatives sets j[0] and j[2] to the derivatives of x' and y' at
+   valid element (x, y) along (dx, dy), which is (1, 0) or (0, 1) */
+void
+Derivatives (Extrapolation *e, unsigned char *mask, int obpl,
+	     int x, int y, int dx, int dy, float *j)
+{
+  int ow = e->ow;
+  int oh = e->oh;
+  int xm, ym, xp, yp;
+  int vm, vp;
+  MapElement *m, *p;
+
+  xm = x - dx;
+  ym = y - dy;
+  xp = x + dx;
+  yp = y + dy;
+  vm = xm >= 0 && ym >= 0 &&
+    (mask[ym*obpl + (xm >> 3)] & (0x80 >> (xm & 7))) != 0;
+  vp = xp < ow && yp < oh &&
+    (mask[yp*obpl + (xp >> 3)] & (0x80 >> (xp & 7))) != 0;
+  m = vm ? &e->omap[ym*ow+xm] : &e->omap[y*ow+x];
+  p = vp ? &e->omap[yp*ow+xp] : &e->omap[y*ow+x];
+  if (vm || vp)
+    {
+      j[0] = (p->x - m->x) / (vm + vp);
+      j[2] = (p->y - m->y) / (vm + vp);
+    }
+  else
+    {
+      j[0] = dx;
+      j[2] = dy;
+    }
+}
+
+void *
+SweepThreadMain (void *arg)
+{
+  ExtrapolationBand *band = (ExtrapolationBand *) arg;
+
+  SweepPoints(band->e, band->k, band->i0, band->i1);
+  return(NULL);
+}
+
+/* SweepPoints fills the elements points[i0..i1-1] of ring k */
+void
+SweepPoints (Extrapolation *e, int k, int i0, int i1)
+{
+  int ow = e->ow;
+  int oh = e->oh;
+  int i, j;
+  int p;
+  int x, y;
+  int dx, dy;
+  int qx, qy;
+  double w;
+  double tw, tx, ty;
+  double tj[4];
+  MapElement *q;
+  float *jq;
+
+  for (i = i0; i < i1; ++i)
+    {
+      p = e->points[i];
+      x = p % ow;
+      y = p / ow;
+      tw = tx = ty = 0.0;
+      tj[0] = tj[1] = tj[2] = tj[3] = 0.0;
+      for (dy = -1; dy <= 1; ++dy)
+	for (dx = -1; dx <= 1; ++dx)
+	  {
+	    qx = x + dx;
+	    qy = y + dy;
+	    if ((dx == 0 && dy == 0) ||
+		qx < 0 || qx >= ow || qy < 0 || qy >= oh ||
+		e->ring[qy*ow+qx] >= k)
+	      continue;
+	    q = &e->omap[qy*ow+qx];
+	    jq = &e->jacobian[4*(qy*ow+qx)];
+	    w = 1.0 / (dx*dx + dy*dy);
+	    tx += w * (q->x - jq[0] * dx - jq[1] * dy);
+	    ty += w * (q->y - jq[2] * dx - jq[3] * dy);
+	    for (j = 0; j < 4; ++j)
+	      tj[j] += w * jq[j];
+	    tw += w;
+	  }
+      if (tw == 0.0)
+	Error("Could not extrapolate map element (%d,%d).\n", x, y);
+      e->omap[p].x = tx / tw;
+      e->omap[p].y = ty / tw;
+      e->omap[p].c = e->extraC;
+      for (j = 0; j < 4; ++j)
+	e->jacobian[4*p+j] = tj[j] / tw;
+    }
+}
+
+/* RunBands divides i0..i1-1, which are the rows of the output map
+   or, for the sweep, the indices in points of the elements of ring
+   k, into bands of at least minBand, and calls threadMain on each
+   with up to nThreads threads */
+void
+RunBands (Extrapolation *e, int i0, int i1, int k, int minBand,
+	  int nThreads, void *(*threadMain)(void *))
+{
+  ExtrapolationBand *bands;
+  int nBands;
+  int n;
+  int i;
+
+  n = i1 - i0;
+  nBands = nThreads;
+  if (nBands > n / minBand)
+    nBands = n / minBand;
+  if (nBands < 1)
+    nBands = 1;
+  bands = (ExtrapolationBand *) malloc(nBands * sizeof(ExtrapolationBand));
+  for (i = 0; i < nBands; ++i)
+    {
+      bands[i].e = e;
+      bands[i].k = k;
+      bands[i].i0 = i0 + (int) (((long long) n) * i / nBands);
+      bands[i].i1 = i0 + (int) (((long long) n) * (i + 1) / nBands);
+    }
+  for (i = 1; i < nBands; ++i)
+    if (pthread_create(&bands[i].thread, NULL, threadMain, &bands[i]) != 0)
+      Error("Could not create thread\n");
+  (*threadMain)(&bands[0]);
+  for (i = 1; i < nBands; ++i)
+    pthread_join(bands[i].thread, NULL);
+  free(bands);
 }
 
 void Error (char *fmt, ...)
@@ -45,15 +45,22 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
+#include <pthread.h>
 #include <fftw3.h>
 #include <mpi.h>
 
 #include "imio.h"
 #include "dt.h"
+#include "bitmap.h"
 #include "par.h"
+#include "metrics.h"
+#include "pool.h"
+#include "linesort.h"
+#include "gpu_rst.h"
 
 #define MAX_FRAC_FT_RES_LEVELS	4
 #define LINE_LENGTH		255
+#define RESULT_SORT_LINES	65536	/* results sorted in memory at once */
 
 typedef struct Context {
   char type;                        /* 't' for TIFF, 'p' for PGM */ 
@@ -83,6 +90,13 @@ typedef struct Context {
   int maxRSCandidates;              /* number of candidates to try for rotation & scale */
   int maxCandidates;		    /* maximum number of final (rotation,scale,translation) candidates
 				       to output */
+  float rsPruneRatio;		    /* RS candidates whose log-polar peak is below this fraction
+				       of the best one's are dropped; 0 = keep all */
+  float stopQuality;		    /* stop trying RS candidates once all final candidates are
+				       at least this good; 0 = try them all */
+  int coarseTranslation;	    /* if 1, locate the translation peaks on a
+				       subsampled correlation and evaluate the
+				       full-resolution correlation only near them */
 
   float minTheta, maxTheta;         /* expressed as the rotation in degrees to get the image
 				       to match up with the reference */
@@ -99,6 +113,18 @@ typedef struct Context {
   int partial;			    /* if 1, don't abort if input image files
 				       are missing */
   int nWorkers;			    /* number of worker processes */
+  int fftwFlags;		    /* FFTW planner flags (FFTW_ESTIMATE,
+				       FFTW_MEASURE, or FFTW_PATIENT) */
+  int pow2FFT;			    /* if 1, only use power-of-two FFT sizes;
+				       otherwise sizes of the form
+				       2^a 3^b 5^c 7^d */
+  char wisdomName[PATH_MAX];	    /* if non-empty, file of FFTW wisdom
+				       shared by all workers */
+  int spectrumCacheSize;	    /* in megabytes; 0 = no cache */
+  int nThreads;			    /* threads used by each worker's FFTs
+				       and image loops */
+  int gpu;			    /* if 1, compute the spectra and
+				       correlations on the GPU */
 } Context;
 
 
@@ -146,44 +172,145 @@ typedef struct Transformation
   float quality;   /* estimated quality of this transformation (higher is better) */
 } Transformation;
 
+/* identifies the spectra of one image as prepared for a particular
+   FFT size and filtering */
+typedef struct SpectrumKey {
+  char imageName[PATH_MAX];
+  char maskName[PATH_MAX];
+  int minX, maxX, minY, maxY;
+  time_t imageMTime, maskMTime;
+  int n;
+  int rFactor;
+  int blk_w;
+  float logrhooffset, logrhobase;
+} SpectrumKey;
+
+typedef struct SpectrumCacheEntry {
+  SpectrumKey key;
+  fftwf_complex *fft;		/* windowed FFT (fft_orig) */
+  fftwf_complex *flp;		/* FFT of log-polar magnitude spectrum;
+				   NULL if rotation and scale are fixed */
+  size_t bytes;
+  unsigned long lastUse;
+} SpectrumCacheEntry;
+
+/* a loop of WorkerTask over the rows of an image, split into bands
+   that are run on c.nThreads threads; only the fields used by the
+   loop are set */
+typedef struct RowJob {
+  void (*rows) (struct RowJob *job, int y0, int y1);
+  int n;
+  int iw, ih;
+  unsigned char *image;
+  float *dist;
+  float *windowed;
+  float mean;
+  int blk_w;
+  int offset_x, offset_y;
+  int rFactor, sFactor;
+  float scale, ct, st;
+  int res;
+  fftwf_complex *a, *b;		/* spectra of the cross-power spectrum */
+  int width;			/* complex elements per row of a and b */
+  /* the worker's arrays, which are per thread (see -PAR_THREADS);
+     RunRows sets these so that the row threads see the caller's */
+  float *img, *window, *mag, *lp;
+  fftwf_complex *fft_img, *prod;
+  int *lpIndex;
+  float *lpRx, *lpRy;
+} RowJob;
+
+typedef struct RowThread {
+  RowJob *job;
+  int y0, y1;
+  pthread_t thread;
+} RowThread;
+
 /* GLOBAL VARIABLES FOR MASTER */
 int nResults = 0;
-Result* results = 0;
 #define DIR_HASH_SIZE	8192
 char *dirHash[DIR_HASH_SIZE];
 char summaryName[PATH_MAX] = "";
+char resultStreamName[PATH_MAX + 16] = "";
+FILE *resultStream = NULL;	/* each result, as it comes back */
 
 /* GLOBAL VARIABLES FOR MASTER & WORKER */
 Context c;
-Task t;
-Result r;
+/* a worker run with -PAR_THREADS has a task and result per thread */
+__thread Task t;
+__thread Result r;
 FILE *logFile = NULL;
 
-/* GLOBAL VARIABLES FOR WORKER */
-int last_iw[2] = {-1, -1};
-int last_ih[2] = {-1, -1};
-int last_n = -1;
-int last_blk_w = -1;
-
-float *dist[2];
-float *img, *window, *mag, *lp, *cc, *windowed[2];
-float *cos_t, *sin_t, *gaussian;
-fftwf_complex *fft_img, *fft_orig[2];
-fftwf_complex *Y, *Z, *W;
-fftwf_complex *fft_Y, *fft_Z, *ifft_W;
-fftwf_complex *prod, *fft_cc, *fft_lp, *flp[2];
-fftwf_complex *rot;
-fftwf_complex *ccfilter;
-fftwf_plan plan_img, plan_Y, plan_Z, plan_W, plan_lp, plan_cc;
-PositionValue *values;
-unsigned char *marked;
-
+/* GLOBAL VARIABLES FOR WORKER
+   these are per thread, so that each of the threads of a worker run
+   with -PAR_THREADS registers its own pairs with its own arrays,
+   tables and plans */
+__thread int last_iw[2] = {-1, -1};
+__thread int last_ih[2] = {-1, -1};
+__thread int last_n = -1;
+__thread int last_blk_w = -1;
+
+__thread float *dist[2];
+__thread float *img, *window, *mag, *lp, *cc, *windowed[2];
+__thread float *cos_t, *sin_t, *gaussian;
+/* the tables below depend only on the FFT size and the parameters,
+   so they are made once and shared by all of the thread's tasks of
+   that size */
+__thread int chirpN = -1;		/* size the chirp tables were made for */
+__thread float chirpFracRes[MAX_FRAC_FT_RES_LEVELS];
+__thread float *chirpCos, *chirpSin;	/* per resolution, n entries each */
+__thread fftwf_complex *chirpZ, *chirpFftZ; /* per resolution, 2n entries each */
+__thread int lpTableN = -1;		/* size the log-polar table was made for */
+__thread float lpTableBase, lpTableOffset;
+__thread int *lpIndex;			/* element of mag[] at the top-left of the
+					   bilinear footprint of each log-polar
+					   sample */
+__thread float *lpRx, *lpRy;		/* the position within that footprint */
+__thread fftwf_complex *fft_img, *fft_orig[2];
+__thread fftwf_complex *Y, *Z;		/* Y holds n chirp sequences of length 2n,
+					   transformed together in place */
+__thread fftwf_complex *fft_Z;
+__thread fftwf_complex *prod, *fft_cc, *fft_lp, *flp[2];
+__thread fftwf_complex *rot;
+__thread fftwf_complex *ccfilter;
+__thread fftwf_plan plan_img, plan_Y, plan_Z, plan_W, plan_lp, plan_cc;
+__thread PositionValue *values;
+__thread unsigned char *marked;
+__thread int coarseN = -1, coarseK = -1; /* size and band of the coarse correlation */
+__thread int coarseFactor;		/* full-resolution pixels per coarse pixel */
+__thread fftwf_complex *coarseFft;
+__thread float *coarseCc;
+__thread fftwf_complex *coarseRows;	/* partial sums of the refinement */
+__thread PositionValue *coarsePeaks;
+__thread fftwf_plan plan_coarse;
+__thread int gpuReady = 0;		/* with -gpu, 1 once the GPU is set up,
+					   -1 if it can not be used */
+__thread int gpuTablesCurrent = 0;	/* 1 if the GPU holds the chirp and
+					   log-polar tables as they are now */
+
+/* shared by the threads of a worker; the spectrum cache is guarded by
+   cacheLock, the claim on the GPU by gpuLock, and all FFTW planning by
+   fftwLock, since the FFTW planner is not thread-safe */
+int wisdomImported = 0;
+int wisdomAcquired = 0;
+int fftThreadsInitialized = 0;
+SpectrumCacheEntry *spectrumCache = 0;
+int nSpectrumCache = 0;
+unsigned long spectrumCacheClock = 0;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t fftwLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t gpuLock = PTHREAD_MUTEX_INITIALIZER;
+int gpuClaimed = 0;		/* with -gpu, 1 once a thread has set up
+				   the GPU, which then serves only that
+				   thread, -1 if it can not be used */
 
 /* FORWARD DECLARATIONS */
 void MasterTask (int argc, char **argv, char **envp);
 void MasterResult ();
 void WorkerContext ();
 void WorkerTask ();
+void TaskDeps (char *params);
+void WorkerFinalize ();
 void PackContext ();
 void UnpackContext ();
 void PackTask ();
@@ -191,11 +318,12 @@ void UnpackTask ();
 void PackResult ();
 void UnpackResult ();
 int Compare (const void *x, const void *y);
-int SortByName (const void *x, const void *y);
-int SortByQuality (const void *x, const void *y);
+void WriteSortedResults ();
+void WriteStreamedSummary (FILE *f, char *sortedName);
+int CompareStreamedByName (const char *a, const char *b);
+int CompareStreamedByQuality (const char *a, const char *b);
 int ParseRange (char *s, int *pos, int *minValue, int *maxValue);
 int ParseValue (char *s, int *pos, int *value);
-size_t CountBits (unsigned char *p, size_t n);
 int CreateDirectories (char *fn);
 void Error (char *fmt, ...);
 void Log (char *fmt, ...);
@@ -203,7 +331,32 @@ int CompareValues (const void *v1, const void *v2);
 void fft_shift (fftwf_complex *fft, int n);
 void fft_expand (fftwf_complex *fft, int n);
 void fft_compress (fftwf_complex *fft, int n);
+void ConvolveChirp (fftwf_complex *y, fftwf_complex *fft_z, int n);
+int FFTSize (int m);
+int DeltaInRange (int i, int n, int rFactor, float minT, float maxT,
+		  int size);
+int CoarseToFineValues (int n, int K, float radius, int rFactor,
+			int iw0, int ih0);
+void BuildChirps (int n, int nRes);
+void BuildLogPolarTable (int n, int nRes, float *resMin,
+			 float logrhobase, float logrhooffset);
 char *GetTimestamp (char *timestamp, size_t size);
+void MakeSpectrumKey (SpectrumKey *key, char *imageName, char *maskName,
+		      int minX, int maxX, int minY, int maxY,
+		      int n, int rFactor, int blk_w,
+		      float logrhooffset, float logrhobase);
+int LookupSpectrum (SpectrumKey *key, int imi, int n2_partial);
+void StoreSpectrum (SpectrumKey *key, int imi, int n2_partial);
+int SameSpectrumKey (SpectrumKey *a, SpectrumKey *b);
+void TrimSpectrumCache ();
+void RunRows (RowJob *job, int nRows);
+void *RowThreadMain (void *arg);
+void WindowRows (RowJob *job, int y0, int y1);
+void ResampleRows (RowJob *job, int y0, int y1);
+void MagnitudeRows (RowJob *job, int y0, int y1);
+void LogPolarRows (RowJob *job, int y0, int y1);
+void TransformRows (RowJob *job, int y0, int y1);
+void CrossPowerRows (RowJob *job, int y0, int y1);
 
 /* NOTES:
 
@@ -284,9 +437,11 @@ char *GetTimestamp (char *timestamp, size_t size);
 int
 main (int argc, char **argv, char **envp)
 {
+  MetricsInit("find_rst");
+  par_allow_worker_threads();
   par_process(argc, argv, envp,
               (void (*)()) MasterTask, MasterResult,
-              WorkerContext, WorkerTask, NULL,
+              WorkerContext, WorkerTask, WorkerFinalize,
               PackContext, UnpackContext,
               PackTask, UnpackTask,
               PackResult, UnpackResult);
@@ -304,6 +459,7 @@ MasterTask (int argc,
   int i;
   int error;
   char pairsFile[PATH_MAX];
+  char *hints[2];
   int nPairs;
   Pair *pairs;
   FILE *f;
@@ -345,6 +501,9 @@ MasterTask (int argc,
   c.fracRes[2] = 0.2;
   c.maxRSCandidates = 4;
   c.maxCandidates = 1;                        // output only the best final RST candidate
+  c.rsPruneRatio = 0.0;                       // try every RS candidate
+  c.stopQuality = 0.0;
+  c.coarseTranslation = 0;
 
   c.minTheta = 0.0;                           // consider all angles
   c.maxTheta = 360.0;
@@ -357,6 +516,12 @@ MasterTask (int argc,
   c.update = 0;
   c.partial = 0;
   c.nWorkers = par_workers();
+  c.fftwFlags = FFTW_ESTIMATE;
+  c.pow2FFT = 0;
+  c.wisdomName[0] = '\0';
+  c.spectrumCacheSize = 0;
+  c.nThreads = 0;
+  c.gpu = 0;
 
   r.pair.imageName = NULL;
   r.pair.refName = NULL;
@@ -475,6 +640,25 @@ MasterTask (int argc,
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-rs_prune") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%f", &c.rsPruneRatio) != 1 ||
+	    c.rsPruneRatio < 0.0 || c.rsPruneRatio > 1.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-stop_quality") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%f", &c.stopQuality) != 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-coarse_translation") == 0)
+      c.coarseTranslation = 1;
     else if (strcmp(argv[i], "-distortion") == 0)
       {
 	if (++i == argc || sscanf(argv[i], "%f", &c.distortion) != 1)
@@ -603,6 +787,73 @@ MasterTask (int argc,
       c.update = 1;
     else if (strcmp(argv[i], "-partial") == 0)
       c.partial = 1;
+    else if (strcmp(argv[i], "-fft_planning") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	if (strcmp(argv[i], "estimate") == 0)
+	  c.fftwFlags = FFTW_ESTIMATE;
+	else if (strcmp(argv[i], "measure") == 0)
+	  c.fftwFlags = FFTW_MEASURE;
+	else if (strcmp(argv[i], "patient") == 0)
+	  c.fftwFlags = FFTW_PATIENT;
+	else
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-fft_sizes") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	if (strcmp(argv[i], "pow2") == 0)
+	  c.pow2FFT = 1;
+	else if (strcmp(argv[i], "smooth") == 0)
+	  c.pow2FFT = 0;
+	else
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-wisdom") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(c.wisdomName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.nThreads) != 1 ||
+	    c.nThreads < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-gpu") == 0)
+      c.gpu = 1;
+    else if (strcmp(argv[i], "-spectrum_cache") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.spectrumCacheSize) != 1 ||
+	    c.spectrumCacheSize < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
   
     else
       {
@@ -632,12 +883,33 @@ MasterTask (int argc,
 
       fprintf(stderr, "            [-min_rotation_separation <degrees>]\n");
       fprintf(stderr, "            [-min_scale_separation <percent>]\n");
+      fprintf(stderr, "            [-rs_prune <fraction_of_best_peak>]\n");
+      fprintf(stderr, "            [-stop_quality <quality>]\n");
+      fprintf(stderr, "            [-coarse_translation]\n");
       fprintf(stderr, "            [-update]\n");
       fprintf(stderr, "            [-partial]\n");
       fprintf(stderr, "            [-logs <log_file_prefix>]\n");
+      fprintf(stderr, "            [-fft_planning estimate|measure|patient]\n");
+      fprintf(stderr, "            [-fft_sizes smooth|pow2]\n");
+      fprintf(stderr, "            [-wisdom <fftw_wisdom_file>]\n");
+      fprintf(stderr, "            [-spectrum_cache <megabytes_per_worker>]\n");
+      fprintf(stderr, "            [-threads <threads_per_worker>]\n");
+      fprintf(stderr, "            [-gpu]\n");
       exit(1);
     }
 
+  /* with -PAR_PIN=n and no -threads, each worker runs a thread on
+     each cpu of its block, so that a process per node or socket
+     serves them all with one copy of the context and caches; with
+     -PAR_THREADS as well, the block is shared by the pairs that the
+     worker registers at once */
+  if (c.nThreads == 0)
+    {
+      c.nThreads = par_pinned_cpus() / par_worker_threads();
+      if (c.nThreads < 1)
+	c.nThreads = 1;
+    }
+
   /* check that at least minimal parameters were supplied */
   if (c.imageBasename[0] == '\0' || c.outputBasename[0] == '\0' ||
       pairsFile[0] == '\0')
@@ -702,6 +974,20 @@ MasterTask (int argc,
   fclose(f);
   unlink(fn);
 
+ /* the results are streamed to a file as they come back, so that the
+    run can be followed there, and the summary is sorted from it at
+    the end */
+  if (summaryName[0] != '\0')
+    {
+      sprintf(resultStreamName, "%s.partial", summaryName);
+      if (!CreateDirectories(resultStreamName))
+	Error("Could not create directory for summary file: %s\n",
+	      summaryName);
+      resultStream = fopen(resultStreamName, "w");
+      if (resultStream == NULL)
+	Error("Could not open result stream %s\n", resultStreamName);
+    }
+
  Log("MASTER setting context\n");
 
   par_set_context();
@@ -724,42 +1010,14 @@ MasterTask (int argc,
 	continue;
 
       Log("Delegating pair %d\n", pn);
-      par_delegate_task();
+      hints[0] = t.pair.imageName;
+      hints[1] = t.pair.refName;
+      par_set_task_key(fn);
+      par_delegate_task_hint(2, hints);
     }
   par_finish();
 
-  if (summaryName[0] != '\0')
-    {
-      f = fopen(summaryName, "w");
-      if (f == NULL)
-	Error("Could not open summary output file %s\n", summaryName);
-
-      qsort(results, nResults, sizeof(Result), SortByName);
-      fprintf(f, "Sorted by slice:\n");
-      fprintf(f, "         SOURCE  TARGET   QUALITY     ROTATION    SCALE       TX          TY\n");
-      for (i = 0; i < nResults; ++i)
-	fprintf(f, "%s  %s  %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n",
-		results[i].pair.imageName,
-		results[i].pair.refName,
-		results[i].quality,
-		results[i].rotation,
-		results[i].scale,
-		results[i].tx,
-		results[i].ty);
-      fprintf(f, "\n\nSorted by quality:\n");
-      fprintf(f, "         SOURCE  TARGET   QUALITY     ROTATION    SCALE       TX          TY\n");
-      qsort(results, nResults, sizeof(Result), SortByQuality);
-      for (i = 0; i < nResults; ++i)
-	fprintf(f, "%s  %s  %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n",
-		results[i].pair.imageName,
-		results[i].pair.refName,
-		results[i].quality,
-		results[i].rotation,
-		results[i].scale,
-		results[i].tx,
-		results[i].ty);
-      fclose(f);
-    }
+  WriteSortedResults();
 
   printf(" %d\nAll image pairs completed.\n", nResults);
 }
@@ -770,12 +1028,22 @@ MasterResult ()
   if (r.message[0] != '\0')
     Error("\nThe following error was encountered by one of the worker processes:\n");
 
-  results = (Result*) realloc(results, (nResults + 1) * sizeof(Result));
-  results[nResults] = r;
-  results[nResults].message = NULL;
-  r.pair.imageName = NULL;
-  r.pair.refName = NULL;
-  r.pair.pairName = NULL;
+  if (resultStream != NULL)
+    {
+      fprintf(resultStream, "%.17g %s %s %.17g %.17g %.17g %.17g\n",
+	      r.quality, r.pair.imageName, r.pair.refName,
+	      r.rotation, r.scale, r.tx, r.ty);
+      fflush(resultStream);
+    }
+
+  /* a task run here shares its names with the pair (an unpacked
+     result's are freed by the next UnpackPair) */
+  if (r.pair.imageName == t.pair.imageName)
+    {
+      r.pair.imageName = NULL;
+      r.pair.refName = NULL;
+      r.pair.pairName = NULL;
+    }
 
   if ((nResults % 50) == 0 && nResults != 0)
     printf(" %d \n                   ", nResults);
@@ -785,6 +1053,70 @@ MasterResult ()
 }
 
 
+/* WriteSortedResults closes the stream of results and writes the
+   summary from it, sorted by name and by quality; the sorts are
+   external, so that no more than RESULT_SORT_LINES results are in
+   memory at once */
+void
+WriteSortedResults ()
+{
+  char byName[PATH_MAX + 32], byQuality[PATH_MAX + 32];
+  char msg[PATH_MAX + 256];
+  FILE *f;
+
+  if (resultStream == NULL)
+    return;
+  if (fclose(resultStream) != 0)
+    Error("Could not write result stream %s\n", resultStreamName);
+  resultStream = NULL;
+
+  sprintf(byName, "%s.name", resultStreamName);
+  sprintf(byQuality, "%s.quality", resultStreamName);
+  if (!SortLines(resultStreamName, byName, CompareStreamedByName,
+		 RESULT_SORT_LINES, msg) ||
+      !SortLines(resultStreamName, byQuality, CompareStreamedByQuality,
+		 RESULT_SORT_LINES, msg))
+    Error("%s", msg);
+
+  f = fopen(summaryName, "w");
+  if (f == NULL)
+    Error("Could not open summary output file %s\n", summaryName);
+  fprintf(f, "Sorted by slice:\n");
+  fprintf(f, "         SOURCE  TARGET   QUALITY     ROTATION    SCALE       TX          TY\n");
+  WriteStreamedSummary(f, byName);
+  fprintf(f, "\n\nSorted by quality:\n");
+  fprintf(f, "         SOURCE  TARGET   QUALITY     ROTATION    SCALE       TX          TY\n");
+  WriteStreamedSummary(f, byQuality);
+  if (fclose(f) != 0)
+    Error("Could not write summary output file %s\n", summaryName);
+
+  unlink(byName);
+  unlink(byQuality);
+  unlink(resultStreamName);
+}
+
+/* WriteStreamedSummary writes the sorted results in sortedName to the
+   summary f */
+void
+WriteStreamedSummary (FILE *f, char *sortedName)
+{
+  FILE *sf;
+  char line[2 * PATH_MAX + 256];
+  char imageName[PATH_MAX], refName[PATH_MAX];
+  double quality, rotation, scale, tx, ty;
+
+  sf = fopen(sortedName, "r");
+  if (sf == NULL)
+    Error("Could not open sorted results %s\n", sortedName);
+  while (fgets(line, sizeof(line), sf) != NULL)
+    if (sscanf(line, "%lf %s %s %lf %lf %lf %lf",
+	       &quality, imageName, refName,
+	       &rotation, &scale, &tx, &ty) == 7)
+      fprintf(f, "%s  %s  %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n",
+	      imageName, refName, quality, rotation, scale, tx, ty);
+  fclose(sf);
+}
+
 /* WORKER PROCEDURES */
 void
 WorkerContext ()
@@ -798,6 +1130,89 @@ WorkerContext ()
   t.pair.imageName = NULL;
   t.pair.refName = NULL;
   t.pair.pairName = NULL;
+
+  /* the threads must be set up before any wisdom is imported or
+     plan is made */
+  if (!fftThreadsInitialized)
+    {
+#ifdef FFTW_THREADS
+      if (c.nThreads > 1 && !fftwf_init_threads())
+	Error("Could not initialize FFTW threads\n");
+#else
+      if (c.nThreads > 1)
+	Log("find_rst was built without FFTW_THREADS; using 1 thread per worker\n");
+#endif
+      fftThreadsInitialized = 1;
+    }
+
+  /* pick up the plans that earlier runs (or other workers) have
+     already measured */
+  if (c.wisdomName[0] != '\0' && !wisdomImported)
+    {
+      if (fftwf_import_wisdom_from_filename(c.wisdomName))
+	Log("Imported FFTW wisdom from %s\n", c.wisdomName);
+      wisdomImported = 1;
+    }
+}
+
+void
+WorkerFinalize ()
+{
+  char tmpName[PATH_MAX+32];
+
+  if (gpuClaimed > 0)
+    {
+      GpuRstFinish();
+      gpuClaimed = 0;
+    }
+  gpuReady = 0;
+
+  if (c.wisdomName[0] == '\0' || !wisdomAcquired)
+    return;
+
+  /* merge in whatever other workers have exported since we started,
+     then replace the file atomically so that concurrent exports from
+     several workers never leave a partially written file behind */
+  fftwf_import_wisdom_from_filename(c.wisdomName);
+  sprintf(tmpName, "%s.%d", c.wisdomName, (int) getpid());
+  if (!fftwf_export_wisdom_to_filename(tmpName))
+    {
+      Log("Could not export FFTW wisdom to %s\n", tmpName);
+      return;
+    }
+  if (rename(tmpName, c.wisdomName) != 0)
+    {
+      Log("Could not rename %s to %s\n", tmpName, c.wisdomName);
+      unlink(tmpName);
+    }
+}
+
+/* TaskDeps sets params to the settings that the result of the
+   current task depends on, for its dependency sidecar */
+void
+TaskDeps (char *params)
+{
+  int i;
+
+  sprintf(params, "find_rst %d %d %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g"
+	  " %.9g %d %d %.9g %.9g %d %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g"
+	  " %d %d %d %d %d %d %d %d %d %d %d %d",
+	  c.mapLevel, c.maxRes, c.distortion, c.margin,
+	  c.minFeatureSize, c.maxFeatureSize,
+	  c.minTransFeatureSize, c.maxTransFeatureSize,
+	  c.minRotationalSeparation, c.minScaleSeparation,
+	  c.minTranslationalSeparation,
+	  c.maxRSCandidates, c.maxCandidates, c.rsPruneRatio, c.stopQuality,
+	  c.coarseTranslation, c.minTheta, c.maxTheta, c.minScale, c.maxScale,
+	  c.minTX, c.maxTX, c.minTY, c.maxTY,
+	  c.imageMaskBasename[0] != '\0', c.referenceMaskBasename[0] != '\0',
+	  t.pair.imageMinX, t.pair.imageMaxX,
+	  t.pair.imageMinY, t.pair.imageMaxY,
+	  t.pair.refMinX, t.pair.refMaxX,
+	  t.pair.refMinY, t.pair.refMaxY,
+	  c.pow2FFT, c.outputImages);
+  for (i = 0; i < MAX_FRAC_FT_RES_LEVELS; ++i)
+    sprintf(params + strlen(params), " %.9g", c.fracRes[i]);
 }
 
 void
@@ -814,7 +1229,6 @@ WorkerTask ()
   int x, y;
   float xv, yv;
   float v;
-  float theta, rho;
   int it, ir;
   float logrhobase, logrhooffset;
   float rhobase;
@@ -822,8 +1236,6 @@ WorkerTask ()
   float max_v;
   float v_max, v_min;
   int max_x, max_y;
-  float p_r, p_i;
-  float d, dst;
   int count;
   int offset_x, offset_y;
   float alpha;
@@ -833,12 +1245,9 @@ WorkerTask ()
   float resMin[MAX_FRAC_FT_RES_LEVELS];
   int res;
   int imi;
-  float cos_theta, sin_theta;
-  int ixv, iyv;
-  float rrx, rry;
-  float rv00, rv01, rv10, rv11;
-  float hpfx, hpfy;
-  float filter;
+  fftwf_complex *zr;
+  int nValues;
+  int K;
   char fn[PATH_MAX];
   FILE *f;
   float xvp, yvp;
@@ -884,8 +1293,28 @@ WorkerTask ()
   struct stat sb;
   int computeMap;
   double outputTime;
+  char depsName[PATH_MAX];
+  char depsParams[1024];
+  char *depsInputs[4];
+  int depsCurrent;
   float deltaX, deltaY;
-
+  fftwf_complex *yb;
+  SpectrumKey spectrumKeys[2];
+  int useSpectrumCache;
+  RowJob rj;
+  int useGpu;
+  int logPolar;
+  char gpuMsg[PATH_MAX + 256];
+  GpuRstTables gt;
+  GpuRstImage gi;
+  GpuRstPeak *peaks;
+
+  /* with -PAR_THREADS, WorkerContext ran on another thread */
+  if (r.message == NULL)
+    {
+      r.message = (char *) malloc(PATH_MAX + 1024);
+      r.message[0] = '\0';
+    }
   Log("Worker received task %s -> %s\n", t.pair.imageName, t.pair.refName);
   /* construct filenames */
   //  sprintf(imageName, "%s%s.%s", c.imageBasename, t.pair.imageName,
@@ -911,7 +1340,17 @@ WorkerTask ()
   else
     outputName[0] = '\0';
 
-  /* check if we can skip this task because of the -update option */
+  /* the inputs recorded in the result's dependency sidecar */
+  sprintf(depsName, "%s.deps", outputName);
+  TaskDeps(depsParams);
+  depsInputs[0] = imageName;
+  depsInputs[1] = imageMaskName;
+  depsInputs[2] = refName;
+  depsInputs[3] = refMaskName;
+
+  /* check if we can skip this task because of the -update option;
+     if the result has a dependency sidecar, its inputs are compared
+     by content, and otherwise by modification time */
   computeMap = 0;
   if (!c.update)
     computeMap = 1;
@@ -921,25 +1360,32 @@ WorkerTask ()
     outputTime = (double) sb.st_mtime;
   else
     computeMap = 1;
+  depsCurrent = -1;
   if (!computeMap)
+    {
+      depsCurrent = DepsCurrent(depsName, depsParams, 4, depsInputs);
+      if (depsCurrent == 0)
+	computeMap = 1;
+    }
+  if (!computeMap && depsCurrent < 0)
     {
       if (stat(imageName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
 	computeMap = 1;
     }
-  if (!computeMap && imageMaskName[0] != '\0')
+  if (!computeMap && depsCurrent < 0 && imageMaskName[0] != '\0')
     {
       if (stat(imageMaskName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
 	computeMap = 1;
     }
-  if (!computeMap)
+  if (!computeMap && depsCurrent < 0)
     {
       if (stat(refName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
 	computeMap = 1;
     }
-  if (!computeMap && refMaskName[0] != '\0')
+  if (!computeMap && depsCurrent < 0 && refMaskName[0] != '\0')
     {
       if (stat(refMaskName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
@@ -1005,6 +1451,8 @@ WorkerTask ()
     }
 
   Log("\nRegistering image %s against reference %s\n", imageName, refName);
+  MetricsName(t.pair.pairName);
+  MetricsPhase(METRICS_READ);
 
   if (!ReadImage(imageName, &image_in[0],
 		 &iw[0], &ih[0],
@@ -1047,21 +1495,21 @@ WorkerTask ()
 	      refMaskName, refName);
     }
 
+  MetricsPhase(METRICS_COMPUTE);
+
   /* determine resolutions */
-  n = 1;
-  while (n < iw[0] + iw[1] || n < ih[0] + ih[1])
-    n <<= 1;
+  n = FFTSize(iw[0] + iw[1] > ih[0] + ih[1] ?
+	      iw[0] + iw[1] : ih[0] + ih[1]);
   //  printf("full res: n = %d\n", n);
   rFactor = 1;
   if (c.maxRes > 0)
     while (n > c.maxRes)
       {
 	++rFactor;
-	n = 1;
-	while (n < (iw[0] + iw[1]) / rFactor ||
-	       n < (ih[0] + ih[1]) / rFactor)
-	  n <<= 1;
+	n = FFTSize((iw[0] + iw[1]) / rFactor > (ih[0] + ih[1]) / rFactor ?
+		    (iw[0] + iw[1]) / rFactor : (ih[0] + ih[1]) / rFactor);
       }
+  Log("Using FFT size %d\n", n);
 
   //  printf("effective res: n = %d\n", n);
   maxDim = -1;
@@ -1076,11 +1524,14 @@ WorkerTask ()
 	{
 	  if (last_iw[imi] >= 0)
 	    {
-	      fftwf_free(windowed[imi]);
-	      fftwf_free(dist[imi]);
+	      PoolFree(windowed[imi]);
+	      PoolFree(dist[imi]);
 	    }
-	  windowed[imi] = (float*) fftwf_malloc(ih[imi] * iw[imi] * sizeof(float));
-	  dist[imi] = (float *) fftwf_malloc(iw[imi]*ih[imi]*sizeof(float));
+	  /* the pool hands back the buffers of an earlier size of the
+	     same class, so a run of near-equal sizes does not go back
+	     to the system for each */
+	  windowed[imi] = (float*) PoolAlloc(ih[imi] * iw[imi] * sizeof(float));
+	  dist[imi] = (float *) PoolAlloc(iw[imi]*ih[imi]*sizeof(float));
 
 	  last_iw[imi] = iw[imi];
 	  last_ih[imi] = ih[imi];
@@ -1177,17 +1628,19 @@ WorkerTask ()
 	  fftwf_free(mag);
 	  fftwf_free(lp);
 	  fftwf_free(cc);
-	  fftwf_free(cos_t);
-	  fftwf_free(sin_t);
+	  fftwf_free(chirpCos);
+	  fftwf_free(chirpSin);
+	  fftwf_free(chirpZ);
+	  fftwf_free(chirpFftZ);
+	  fftwf_free(lpIndex);
+	  fftwf_free(lpRx);
+	  fftwf_free(lpRy);
 	  fftwf_free(fft_img);
 	  fftwf_free(fft_orig[0]);
 	  fftwf_free(fft_orig[1]);
 	  fftwf_free(Y);
 	  fftwf_free(Z);
-	  fftwf_free(W);
-	  fftwf_free(fft_Y);
 	  fftwf_free(fft_Z);
-	  fftwf_free(ifft_W);
 	  fftwf_free(prod);
 	  fftwf_free(gaussian);
 	  fftwf_free(fft_cc);
@@ -1199,28 +1652,38 @@ WorkerTask ()
 	  fftwf_free(marked);
 	  fftwf_free(ccfilter);
 
+	  pthread_mutex_lock(&fftwLock);
 	  fftwf_destroy_plan(plan_img);
 	  fftwf_destroy_plan(plan_Y);
 	  fftwf_destroy_plan(plan_Z);
 	  fftwf_destroy_plan(plan_W);
 	  fftwf_destroy_plan(plan_lp);
 	  fftwf_destroy_plan(plan_cc);
+	  pthread_mutex_unlock(&fftwLock);
 	}
       img = (float*) fftwf_malloc(n2 * sizeof(float));
       mag = (float*) fftwf_malloc(nRes * n2 * sizeof(float));
       lp = (float *) fftwf_malloc(n2 * sizeof(float));
       cc = (float*) fftwf_malloc(n2 * sizeof(float));
-      cos_t = (float *) fftwf_malloc(n * sizeof(float));
-      sin_t = (float *) fftwf_malloc(n * sizeof(float));
+      chirpCos = (float *) fftwf_malloc(MAX_FRAC_FT_RES_LEVELS * n *
+					sizeof(float));
+      chirpSin = (float *) fftwf_malloc(MAX_FRAC_FT_RES_LEVELS * n *
+					sizeof(float));
+      chirpZ = (fftwf_complex*) fftwf_malloc(MAX_FRAC_FT_RES_LEVELS * 2 * n *
+					     sizeof(fftwf_complex));
+      chirpFftZ = (fftwf_complex*) fftwf_malloc(MAX_FRAC_FT_RES_LEVELS * 2 * n *
+						sizeof(fftwf_complex));
+      chirpN = -1;
+      lpIndex = (int *) fftwf_malloc(n2 * sizeof(int));
+      lpRx = (float *) fftwf_malloc(n2 * sizeof(float));
+      lpRy = (float *) fftwf_malloc(n2 * sizeof(float));
+      lpTableN = -1;
       fft_img = (fftwf_complex*) fftwf_malloc(n2 * sizeof(fftwf_complex));
       fft_orig[0] = (fftwf_complex*) fftwf_malloc(n2_partial * sizeof(fftwf_complex));
       fft_orig[1] = (fftwf_complex*) fftwf_malloc(n2_partial * sizeof(fftwf_complex));
-      Y = (fftwf_complex*) fftwf_malloc(2*n*sizeof(fftwf_complex));
+      Y = (fftwf_complex*) fftwf_malloc(2*n2*sizeof(fftwf_complex));
       Z = (fftwf_complex*) fftwf_malloc(2*n*sizeof(fftwf_complex));
-      W = (fftwf_complex*) fftwf_malloc(2*n*sizeof(fftwf_complex));
-      fft_Y = (fftwf_complex*) fftwf_malloc(2*n*sizeof(fftwf_complex));
       fft_Z = (fftwf_complex*) fftwf_malloc(2*n*sizeof(fftwf_complex));
-      ifft_W = (fftwf_complex*) fftwf_malloc(2*n*sizeof(fftwf_complex));
       prod = (fftwf_complex*) fftwf_malloc(n2_partial * sizeof(fftwf_complex));
       gaussian = (float *) fftwf_malloc(n * sizeof(float));
       fft_cc = (fftwf_complex*) fftwf_malloc(n2_partial * sizeof(fftwf_complex));
@@ -1232,12 +1695,28 @@ WorkerTask ()
       marked = (unsigned char *) fftwf_malloc(n2 * sizeof(unsigned char));
       ccfilter = (fftwf_complex*) fftwf_malloc(n2 * sizeof(fftwf_complex));
 
-      plan_img = fftwf_plan_dft_r2c_2d(n, n, img, fft_img, FFTW_ESTIMATE);
-      plan_Y = fftwf_plan_dft_1d(2*n, Y, fft_Y, FFTW_FORWARD, FFTW_ESTIMATE);
-      plan_Z = fftwf_plan_dft_1d(2*n, Z, fft_Z, FFTW_FORWARD, FFTW_ESTIMATE);
-      plan_W = fftwf_plan_dft_1d(2*n, W, ifft_W, FFTW_BACKWARD, FFTW_ESTIMATE);
-      plan_lp = fftwf_plan_dft_r2c_2d(n, n, lp, fft_lp, FFTW_ESTIMATE);
-      plan_cc = fftwf_plan_dft_c2r_2d(n, n, fft_cc, cc, FFTW_ESTIMATE);
+      pthread_mutex_lock(&fftwLock);
+#ifdef FFTW_THREADS
+      if (c.nThreads > 1)
+	fftwf_plan_with_nthreads(c.nThreads);
+#endif
+      plan_img = fftwf_plan_dft_r2c_2d(n, n, img, fft_img, c.fftwFlags);
+      // the Bluestein convolutions along all rows (or all columns) of
+      //   the fractional FT are done as one batch of n transforms
+      plan_Y = fftwf_plan_many_dft(1, &n_times_2, n,
+				   Y, NULL, 1, n_times_2,
+				   Y, NULL, 1, n_times_2,
+				   FFTW_FORWARD, c.fftwFlags);
+      plan_Z = fftwf_plan_dft_1d(2*n, Z, fft_Z, FFTW_FORWARD, c.fftwFlags);
+      plan_W = fftwf_plan_many_dft(1, &n_times_2, n,
+				   Y, NULL, 1, n_times_2,
+				   Y, NULL, 1, n_times_2,
+				   FFTW_BACKWARD, c.fftwFlags);
+      plan_lp = fftwf_plan_dft_r2c_2d(n, n, lp, fft_lp, c.fftwFlags);
+      plan_cc = fftwf_plan_dft_c2r_2d(n, n, fft_cc, cc, c.fftwFlags);
+      if (c.fftwFlags != FFTW_ESTIMATE)
+	wisdomAcquired = 1;
+      pthread_mutex_unlock(&fftwLock);
 
       last_n = n;
     }
@@ -1251,14 +1730,24 @@ WorkerTask ()
     window[x] = a0 - a1 * cos(2.0 * M_PI * x / (blk_w - 1)) +
       a2 * cos(4.0 * M_PI * x / (blk_w - 1));
 
+  // the debugging images are written per pair, so they bypass the cache
+  useSpectrumCache = c.spectrumCacheSize > 0 && !c.outputImages;
+  if (useSpectrumCache)
+    {
+      MakeSpectrumKey(&spectrumKeys[0], imageName, imageMaskName,
+		      t.pair.imageMinX, t.pair.imageMaxX,
+		      t.pair.imageMinY, t.pair.imageMaxY,
+		      n, rFactor, blk_w, logrhooffset, logrhobase);
+      MakeSpectrumKey(&spectrumKeys[1], refName, refMaskName,
+		      t.pair.refMinX, t.pair.refMaxX,
+		      t.pair.refMinY, t.pair.refMaxY,
+		      n, rFactor, blk_w, logrhooffset, logrhobase);
+    }
+
   for (imi = 0; imi < 2; ++imi)
     {
       eiw[imi] = iw[imi] / rFactor;
       eih[imi] = ih[imi] / rFactor;
-      offset_x = (n - eiw[imi]) >> 1;
-      offset_y = (n - eih[imi]) >> 1;
-      //      printf("iw = %d ih = %d\n", iw[imi], ih[imi]);
-      //      printf("offset_x = %d offset_y = %d\n", offset_x, offset_y);
 
       sum = 0.0;
       for (y = 0; y < ih[imi]; ++y)
@@ -1294,35 +1783,128 @@ WorkerTask ()
 
 	  // take min with distance from edge, and
 	  // apply a Blackman window to smooth out edges
-	  for (y = 0; y < ih[imi]; ++y)
-	    for (x = 0; x < iw[imi]; ++x)
-	      {
-		dst = dist[imi][y*iw[imi] + x];
-		d = x + 1;
-		if (d < dst)
-		  dst = d;
-		d = iw[imi] - x;
-		if (d < dst)
-		  dst = d;
-		d = y + 1;
-		if (d < dst)
-		  dst = d;
-		d = ih[imi] - y;
-		if (d < dst)
-		  dst = d;
-		dist[imi][y*iw[imi] + x] = dst;
-		ix = (int) (dst + 0.5);
-		if (ix >= blk_w/2)
-		  windowed[imi][y*iw[imi]+x] = image_in[imi][y*iw[imi] + x] - mean[imi];
-		else
-		  windowed[imi][y*iw[imi]+x] = window[ix] *
-		    (image_in[imi][y*iw[imi] + x] - mean[imi]);
-	      }
+	  rj.rows = WindowRows;
+	  rj.iw = iw[imi];
+	  rj.ih = ih[imi];
+	  rj.image = image_in[imi];
+	  rj.dist = dist[imi];
+	  rj.windowed = windowed[imi];
+	  rj.mean = mean[imi];
+	  rj.blk_w = blk_w;
+	  RunRows(&rj, ih[imi]);
 	}
       else
 	for (y = 0; y < ih[imi]; ++y)
 	  for (x = 0; x <iw[imi]; ++x)
 	    windowed[imi][y*iw[imi]+x] = image_in[imi][y*iw[imi] + x] - mean[imi];
+    }
+
+  /* with -gpu, the windowed images go to the GPU, and their spectra
+     and correlations stay there; only the peaks of the correlations
+     come back.  The debugging images need the whole arrays, so those
+     are made on the CPU, and the spectrum cache is not used. */
+  useGpu = 0;
+  if (c.gpu && !c.outputImages)
+    {
+      if (gpuReady == 0)
+	{
+	  /* the GPU serves only the first of the worker's threads
+	     that asks for it */
+	  pthread_mutex_lock(&gpuLock);
+	  if (gpuClaimed == 0)
+	    {
+	      gpuClaimed = GpuRstInit(gpuMsg) ? 1 : -1;
+	      gpuReady = gpuClaimed;
+	    }
+	  else
+	    {
+	      sprintf(gpuMsg, "%s\n", gpuClaimed > 0 ?
+		      "it is in use by another thread of this worker" :
+		      "it could not be set up by another thread of this worker");
+	      gpuReady = -1;
+	    }
+	  pthread_mutex_unlock(&gpuLock);
+	  if (gpuReady < 0)
+	    Log("WARNING: correlating on the CPU, as the GPU can not be used:\n  %s",
+		gpuMsg);
+	}
+      useGpu = gpuReady > 0;
+    }
+  if (useGpu)
+    {
+      memset(&gt, 0, sizeof(gt));
+      gt.n = n;
+      gt.nRes = nRes;
+      gt.blk_w = blk_w;
+      gt.window = window;
+      logPolar = c.minScale != c.maxScale || c.minTheta != c.maxTheta;
+      if (logPolar)
+	{
+	  resMin[0] = -0.5 * n;
+	  for (res = 1; res < nRes; ++res)
+	    resMin[res] = -0.5 * n * c.fracRes[res];
+	  if (chirpN != n ||
+	      memcmp(chirpFracRes, c.fracRes, sizeof(chirpFracRes)) != 0)
+	    {
+	      BuildChirps(n, nRes);
+	      lpTableN = -1;
+	    }
+	  if (lpTableN != n || lpTableBase != logrhobase ||
+	      lpTableOffset != logrhooffset)
+	    BuildLogPolarTable(n, nRes, resMin, logrhobase, logrhooffset);
+	  gt.chirpCos = chirpCos;
+	  gt.chirpSin = chirpSin;
+	  gt.chirpZ = (float *) chirpZ;
+	  gt.chirpFftZ = (float *) chirpFftZ;
+	  gt.lpIndex = lpIndex;
+	  gt.lpRx = lpRx;
+	  gt.lpRy = lpRy;
+	}
+      if (!GpuRstSetTables(&gt, !gpuTablesCurrent, gpuMsg))
+	goto gpuFailure;
+      if (logPolar)
+	gpuTablesCurrent = 1;
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  gi.iw = iw[imi];
+	  gi.ih = ih[imi];
+	  gi.image = image_in[imi];
+	  gi.dist = dist[imi];
+	  gi.windowed = windowed[imi];
+	  gi.mean = mean[imi];
+	  if (!GpuRstLoadImage(imi, &gi, gpuMsg))
+	    goto gpuFailure;
+	}
+    }
+  goto spectra;
+
+ gpuFailure:
+  /* whatever the GPU did for this pair is done again on the CPU */
+  Log("WARNING: correlating %s on the CPU, as the GPU failed:\n  %s",
+      t.pair.pairName, gpuMsg);
+  useGpu = 0;
+
+ spectra:
+  for (imi = 0; imi < 2; ++imi)
+    {
+      offset_x = (n - eiw[imi]) >> 1;
+      offset_y = (n - eih[imi]) >> 1;
+      //      printf("iw = %d ih = %d\n", iw[imi], ih[imi]);
+      //      printf("offset_x = %d offset_y = %d\n", offset_x, offset_y);
+
+      if (useGpu)
+	{
+	  if (!GpuRstSpectra(imi, offset_x, offset_y, rFactor, sFactor,
+			     logPolar, gpuMsg))
+	    goto gpuFailure;
+	  continue;
+	}
+
+      // the windowed image is still needed for the translation search,
+      //   but its spectra may have been computed for an earlier pair
+      if (useSpectrumCache &&
+	  LookupSpectrum(&spectrumKeys[imi], imi, n2_partial))
+	continue;
 
       if (rFactor == 1)
 	for (y = 0; y < n; ++y)
@@ -1335,40 +1917,18 @@ WorkerTask ()
 		img[y*n+x] = 0.0;
 	    }
       else
-	for (y = 0; y < n; ++y)
-	  for (x = 0; x < n; ++x)
-	    {
-	      v = 0.0;
-	      count = 0;
-	      for (dy = 0; dy < sFactor; ++dy)
-		for (dx = 0; dx < sFactor; ++dx)
-		  {
-		    xv = (x - offset_x + ((float) dx) / sFactor) * rFactor;
-		    yv = (y - offset_y + ((float) dy) / sFactor) * rFactor;
-
-		    ixv = (int) floor(xv);
-		    iyv = (int) floor(yv);
-		    if (ixv >= 0 && ixv < iw[imi]-1 &&
-			iyv >= 0 && iyv < ih[imi]-1)
-		      {
-			rrx = xv - ixv;
-			rry = yv - iyv;
-			rv00 = windowed[imi][iyv * iw[imi] + ixv];
-			rv01 = windowed[imi][(iyv+1) * iw[imi] + ixv];
-			rv10 = windowed[imi][iyv * iw[imi] + (ixv+1)];
-			rv11 = windowed[imi][(iyv+1) * iw[imi] + (ixv+1)];
-			v += rv00 * (rrx - 1.0) * (rry - 1.0)
-			  - rv10 * rrx * (rry - 1.0) 
-			  - rv01 * (rrx - 1.0) * rry
-			  + rv11 * rrx * rry;
-			++count;
-		      }
-		  }
-	      if (count > 0)
-		img[y*n+x] = v / count;
-	      else
-		img[y*n+x] = 0.0;
-	    }
+	{
+	  rj.rows = ResampleRows;
+	  rj.n = n;
+	  rj.iw = iw[imi];
+	  rj.ih = ih[imi];
+	  rj.windowed = windowed[imi];
+	  rj.offset_x = offset_x;
+	  rj.offset_y = offset_y;
+	  rj.rFactor = rFactor;
+	  rj.sFactor = sFactor;
+	  RunRows(&rj, n);
+	}
 
       if (c.outputImages)
 	{
@@ -1403,7 +1963,11 @@ WorkerTask ()
 
       // no need to do fractional FFTs if RS is known
       if (c.minScale == c.maxScale && c.minTheta == c.maxTheta)
-	continue;
+	{
+	  if (useSpectrumCache)
+	    StoreSpectrum(&spectrumKeys[imi], imi, n2_partial);
+	  continue;
+	}
 
       fft_expand(fft_img, n);
       fft_shift(fft_img, n);
@@ -1415,93 +1979,84 @@ WorkerTask ()
 	  mag[y*n+x] = log(hypot(fft_img[y*n+x][0],
 				 fft_img[y*n+x][1]));
       resMin[0] = -0.5 * n;
+      if (chirpN != n ||
+	  memcmp(chirpFracRes, c.fracRes, sizeof(chirpFracRes)) != 0)
+	{
+	  BuildChirps(n, nRes);
+	  lpTableN = -1;
+	}
 
       for (res = 1; res < nRes; ++res)
 	{
-	  alpha = c.fracRes[res] / n;
 	  resMin[res] = -0.5 * n * c.fracRes[res];
-	  //	  printf("resMin[%d] = %f  c.fracRes[%d] = %f\n",
-	  //		 res, resMin[res], res, c.fracRes[res]);
-	  for (j = n; j < n_times_2; ++j)
-	    {
-	      Y[j][0] = 0.0;
-	      Y[j][1] = 0.0;
-	    }
-	  for (j = 0; j < n; ++j)
-	    {
-	      theta = -M_PI*j*j*alpha;
-	      cos_t[j] = cos(theta);
-	      sin_t[j] = sin(theta);
-	      theta = M_PI*(j-n_over_2)*(j-n_over_2)*alpha;
-	      Z[j][0] = cos(theta);
-	      Z[j][1] = sin(theta);
-	    }
-	  for (j = n; j < n_times_2; ++j)
-	    {
-	      theta = M_PI*(j-n_over_2-n_times_2)*(j-n_over_2-n_times_2)*alpha;
-	      Z[j][0] = cos(theta);
-	      Z[j][1] = sin(theta);
-	    }
-	  fftwf_execute(plan_Z);
+	  cos_t = &chirpCos[res * n];
+	  sin_t = &chirpSin[res * n];
+	  zr = &chirpZ[res * n_times_2];
 
 	  for (y = 0; y < n; ++y)
 	    {
+	      yb = &Y[y*n_times_2];
 	      for (j = 0; j < n; ++j)
 		{
-		  Y[j][0] = img[y*n+j] * cos_t[j];
-		  Y[j][1] = img[y*n+j] * sin_t[j];
+		  yb[j][0] = img[y*n+j] * cos_t[j];
+		  yb[j][1] = img[y*n+j] * sin_t[j];
 		}
-	      fftwf_execute(plan_Y);
-	      
-	      for (j = 0; j < n_times_2; ++j)
+	      for (j = n; j < n_times_2; ++j)
 		{
-		  W[j][0] = fft_Y[j][0] * fft_Z[j][0] - fft_Y[j][1] * fft_Z[j][1];
-		  W[j][1] = fft_Y[j][0] * fft_Z[j][1] + fft_Y[j][1] * fft_Z[j][0];
+		  yb[j][0] = 0.0;
+		  yb[j][1] = 0.0;
 		}
-	      fftwf_execute(plan_W);
-
+	    }
+	  fftwf_execute(plan_Y);
+	  ConvolveChirp(Y, &chirpFftZ[res * n_times_2], n);
+	  fftwf_execute(plan_W);
+	  for (y = 0; y < n; ++y)
+	    {
+	      yb = &Y[y*n_times_2];
 	      for (j = 0; j < n; ++j)
 		{
 		  fft_img[y * n + j][0] =
-		    (Z[j][0] * ifft_W[j][0] + Z[j][1] * ifft_W[j][1]) / (2*n);
+		    (zr[j][0] * yb[j][0] + zr[j][1] * yb[j][1]) / (2*n);
 		  fft_img[y * n + j][1] =
-		    (Z[j][0] * ifft_W[j][1] - Z[j][1] * ifft_W[j][0]) / (2*n);
+		    (zr[j][0] * yb[j][1] - zr[j][1] * yb[j][0]) / (2*n);
 		}
 	    }
       
 	  for (x = 0; x < n; ++x)
 	    {
+	      yb = &Y[x*n_times_2];
 	      for (j = 0; j < n; ++j)
 		{
-		  Y[j][0] = fft_img[j*n+x][0] * cos_t[j] -
+		  yb[j][0] = fft_img[j*n+x][0] * cos_t[j] -
 		    fft_img[j*n+x][1] * sin_t[j];
-		  Y[j][1] = fft_img[j*n+x][0] * sin_t[j] +
+		  yb[j][1] = fft_img[j*n+x][0] * sin_t[j] +
 		    fft_img[j*n+x][1] * cos_t[j];
 		}
-	      fftwf_execute(plan_Y);
-      
-	      for (j = 0; j < n_times_2; ++j)
+	      for (j = n; j < n_times_2; ++j)
 		{
-		  W[j][0] = fft_Y[j][0] * fft_Z[j][0] - fft_Y[j][1] * fft_Z[j][1];
-		  W[j][1] = fft_Y[j][0] * fft_Z[j][1] + fft_Y[j][1] * fft_Z[j][0];
+		  yb[j][0] = 0.0;
+		  yb[j][1] = 0.0;
 		}
-	      fftwf_execute(plan_W);
-	      
+	    }
+	  fftwf_execute(plan_Y);
+	  ConvolveChirp(Y, &chirpFftZ[res * n_times_2], n);
+	  fftwf_execute(plan_W);
+	  for (x = 0; x < n; ++x)
+	    {
+	      yb = &Y[x*n_times_2];
 	      for (j = 0; j < n; ++j)
 		{
 		  fft_img[j * n + x][0] =
-		    (Z[j][0] * ifft_W[j][0] + Z[j][1] * ifft_W[j][1]) / (2*n);
+		    (zr[j][0] * yb[j][0] + zr[j][1] * yb[j][1]) / (2*n);
 		  fft_img[j * n + x][1] =
-		    (Z[j][0] * ifft_W[j][1] - Z[j][1] * ifft_W[j][0]) / (2*n);
+		    (zr[j][0] * yb[j][1] - zr[j][1] * yb[j][0]) / (2*n);
 		}
 	    }
 
-	  for (y = 0; y < n; ++y)
-	    for (x = 0; x < n; ++x)
-	      //	      mag[res*n2+ y*n + x] = hypot(fft_img[y*n+x][0],
-	      //					       fft_img[y*n+x][1]);
-	      mag[res*n2+ y*n + x] = log(hypot(fft_img[y*n+x][0],
-					       fft_img[y*n+x][1]));
+	  rj.rows = MagnitudeRows;
+	  rj.n = n;
+	  rj.res = res;
+	  RunRows(&rj, n);
 	}
 
       if (c.outputImages)
@@ -1542,51 +2097,14 @@ WorkerTask ()
 	    fclose(f);
 	  }
 
-      for (it = 0; it < n; ++it)
-	{
-	  theta = it * M_PI / n;
-	  cos_theta = cos(theta);
-	  sin_theta = sin(theta);
-	  for (ir = 0; ir < n; ++ir)
-	    {
-	      rho = exp(ir * logrhobase + logrhooffset);
-	      xv = rho * cos_theta;
-	      yv = rho * sin_theta;
-	      for (res = nRes - 1; res >= 0; --res)
-		{
-		  xvp = (xv - resMin[res]) / c.fracRes[res];
-		  yvp = (yv - resMin[res]) / c.fracRes[res];
-		  ixv = (int) floor(xvp);
-		  iyv = (int) floor(yvp);
-		  if (ixv >= 0 && ixv < n-1 &&
-		      iyv >= 0 && iyv < n-1)
-		    {
-		      rrx = xvp - ixv;
-		      rry = yvp - iyv;
-		      rv00 = mag[res*n2 + iyv * n + ixv];
-		      rv01 = mag[res*n2 + (iyv+1) * n + ixv];
-		      rv10 = mag[res*n2 + iyv * n + (ixv+1)];
-		      rv11 = mag[res*n2 + (iyv+1) * n + (ixv+1)];
-		      v = rv00 * (rrx - 1.0) * (rry - 1.0)
-			- rv10 * rrx * (rry - 1.0) 
-			- rv01 * (rrx - 1.0) * rry
-			+ rv11 * rrx * rry;
-		      break;
-		    }
-		}
-	      if (res < 0)
-		Error("Could not find point in any resolution level: %d %d %f %f  %f %f %f\n", it, ir, xv, yv, resMin[0], resMin[1], resMin[2]);
-
-#if 0
-	      hpfx = cos(xv * M_PI / n);
-	      hpfy = cos(yv * M_PI / n);
-	      filter = (1.0 - hpfx*hpfy) * (2.0 - hpfx*hpfy);
-#else
-	      filter = 1.0;
-#endif
-	      lp[ir*n+it] = filter * v;
-	    }
-	}
+      /* the log-polar resampling is a gather through a table that
+	 depends only on n and the log-polar parameters */
+      if (lpTableN != n || lpTableBase != logrhobase ||
+	  lpTableOffset != logrhooffset)
+	BuildLogPolarTable(n, nRes, resMin, logrhobase, logrhooffset);
+      rj.rows = LogPolarRows;
+      rj.n = n;
+      RunRows(&rj, n);
 
       if (c.outputImages)
 	{
@@ -1606,6 +2124,8 @@ WorkerTask ()
 	}
       fftwf_execute(plan_lp);
       memcpy(flp[imi], fft_lp, n2_partial * sizeof(fftwf_complex));
+      if (useSpectrumCache)
+	StoreSpectrum(&spectrumKeys[imi], imi, n2_partial);
     }
 
   if (c.minScale == c.maxScale && c.minTheta == c.maxTheta)
@@ -1621,35 +2141,6 @@ WorkerTask ()
       goto findTranslation;
     }
 
-  for (i = 0; i < n2_partial; ++i)
-    {
-      p_r = flp[0][i][0] * flp[1][i][0] + flp[0][i][1] * flp[1][i][1];
-      p_i = flp[0][i][1] * flp[1][i][0] - flp[0][i][0] * flp[1][i][1];
-      d = hypot(p_r, p_i);
-      prod[i][0] = p_r / d;
-      prod[i][1] = p_i / d;
-    }
-
-#if 0
-  printf("Completed construction of prod\n");
-  count = 0;
-  for (i = 0; i < n2_partial; ++i)
-    {
-      if (fabs(prod[i][0]) > 0.001 ||
-	  fabs(prod[i][1]) > 0.001)
-	++count;
-    }
-  printf("%d entries in prod are nonzero\n", count);
-
-  printf("max_x = %d max_y = %d\n", max_x, max_y);
-  printf("   val at max = %f\n", cc[max_y*n+max_x]);
-  printf("%f %f\n", cc[256], cc[512+256]);
-
-  printf("theta = %f degrees\n", (180.0 * max_x) / (n - 1));
-  printf("factor = %f\n", max_y < (n / 2) ? exp(max_y * logrhobase) :
-	 exp((max_y - n) * logrhobase));
-#endif
-
   nCandidates = 0;
   //  printf("minITSeparation = %f  minIRSeparation = %f\n",
   //	 minITSeparation, minIRSeparation);
@@ -1685,6 +2176,70 @@ WorkerTask ()
       // printf("final i = %d\n", i);
     }
 	  
+  target_it = fmod((c.minTheta + c.maxTheta) / 2.0, 180.0) * n / 180.0;
+  target_ir = 0.5 * log(c.minScale * c.maxScale) / logrhobase;
+  if (target_ir < 0)
+    target_ir += n;
+  max_delta_it = ((c.maxTheta - c.minTheta) / 2.0 / 180.0) * n;
+  max_delta_ir = log(sqrt(c.maxScale / c.minScale)) / logrhobase;
+  //     printf("target_it = %d   mdit = %d\n", target_it, max_delta_it);
+  //     printf("target_ir = %d   mdir = %d\n", target_ir, max_delta_ir);
+
+  if (useGpu)
+    {
+      /* only a peak of the valid region can be chosen below, so the
+	 GPU returns just those; marked holds the valid rows and
+	 columns until the marking starts */
+      for (i = 0; i < n; ++i)
+	{
+	  delta_it = abs(i - target_it);
+	  if (delta_it > n_over_2)
+	    delta_it = n - delta_it;
+	  marked[i] = delta_it <= max_delta_it;
+	  delta_ir = abs(i - target_ir);
+	  if (delta_ir > n_over_2)
+	    delta_ir = n - delta_ir;
+	  marked[n + i] = delta_ir <= max_delta_ir;
+	}
+      if (!GpuRstCorrelate(-1, gaussian, 0, n_over_2, gpuMsg) ||
+	  !GpuRstPeaks(marked, &marked[n], 0, &peaks, &nValues, gpuMsg))
+	goto gpuFailure;
+      for (i = 0; i < nValues; ++i)
+	{
+	  values[i].x = peaks[i].x;
+	  values[i].y = peaks[i].y;
+	  values[i].val = peaks[i].val;
+	  values[i].radius = radius;
+	}
+      goto sortRSValues;
+    }
+
+  rj.rows = CrossPowerRows;
+  rj.a = flp[0];
+  rj.b = flp[1];
+  rj.width = n_over_2_plus_1;
+  RunRows(&rj, n);
+
+#if 0
+  printf("Completed construction of prod\n");
+  count = 0;
+  for (i = 0; i < n2_partial; ++i)
+    {
+      if (fabs(prod[i][0]) > 0.001 ||
+	  fabs(prod[i][1]) > 0.001)
+	++count;
+    }
+  printf("%d entries in prod are nonzero\n", count);
+
+  printf("max_x = %d max_y = %d\n", max_x, max_y);
+  printf("   val at max = %f\n", cc[max_y*n+max_x]);
+  printf("%f %f\n", cc[256], cc[512+256]);
+
+  printf("theta = %f degrees\n", (180.0 * max_x) / (n - 1));
+  printf("factor = %f\n", max_y < (n / 2) ? exp(max_y * logrhobase) :
+	 exp((max_y - n) * logrhobase));
+#endif
+
   // apply gaussian directly to partial FT
   for (y = 0; y < n; ++y)
     for (x = 0; x < n_over_2_plus_1; ++x)
@@ -1748,24 +2303,18 @@ WorkerTask ()
 	values[i].radius = radius;
 	++i;
       }
+  nValues = n2;
+
+ sortRSValues:
   //      printf("values[0].val = %f\n", values[0].val);
-  qsort(values, n2, sizeof(PositionValue), CompareValues);
+  qsort(values, nValues, sizeof(PositionValue), CompareValues);
   //      printf("values[0].val = %f\n", values[0].val);
       
   // pick the top candidates
   memset(marked, 0, n2*sizeof(unsigned char));
   nCandidatesAdded = 0;
 
-  target_it = fmod((c.minTheta + c.maxTheta) / 2.0, 180.0) * n / 180.0;
-  target_ir = 0.5 * log(c.minScale * c.maxScale) / logrhobase;
-  if (target_ir < 0)
-    target_ir += n;
-  max_delta_it = ((c.maxTheta - c.minTheta) / 2.0 / 180.0) * n;
-  max_delta_ir = log(sqrt(c.maxScale / c.minScale)) / logrhobase;
-  //     printf("target_it = %d   mdit = %d\n", target_it, max_delta_it);
-  //     printf("target_ir = %d   mdir = %d\n", target_ir, max_delta_ir);
-
-  for (i = 0; i < n2; ++i)
+  for (i = 0; i < nValues; ++i)
     {
       it = values[i].x;
       ir = values[i].y;
@@ -1795,6 +2344,17 @@ WorkerTask ()
 	      goto nextPosition;
 	  }
 
+      /* with -rs_prune, the peaks are sorted, so once one is too
+	 far below the best none of the rest can be used either */
+      if (c.rsPruneRatio > 0.0 && nCandidates > 0 &&
+	  candidates[0].val > 0.0 &&
+	  values[i].val < c.rsPruneRatio * candidates[0].val)
+	{
+	  Log("Pruning RS candidates below %f (best peak %f)\n",
+	      values[i].val, candidates[0].val);
+	  break;
+	}
+
       /* check if far enough from already chosen candidates */
       for (j = 0; j < nCandidates; ++j)
 	{
@@ -1846,6 +2406,17 @@ WorkerTask ()
   /* find translations for all candidates */
   for (i = 0; i < nCandidates; ++i)
     {
+      /* with -stop_quality, the remaining candidates are skipped once
+	 every final candidate is good enough */
+      if (c.stopQuality > 0.0 && nFinalCandidates == c.maxCandidates &&
+	  finalCandidates[nFinalCandidates-1].quality >= c.stopQuality)
+	{
+	  Log("Stopping after %d of %d RS candidates (quality %f)\n",
+	      i, nCandidates, finalCandidates[nFinalCandidates-1].quality);
+	  MetricsCount("rs_candidates_skipped", nCandidates - i);
+	  break;
+	}
+
       /* rotate and scale the larger image down to the smaller
          using subsampling */
 
@@ -1886,7 +2457,15 @@ WorkerTask ()
       offset_x = (n - eiw[larger]) >> 1;
       offset_y = (n - eih[larger]) >> 1;
 
-      if (rFactor == 1 && scale == 1.0 && baseRotation == 0.0)
+      if (useGpu)
+	{
+	  if (!GpuRstTransform(larger, offset_x, offset_y, rFactor, sFactor,
+			       scale, ct, st,
+			       rFactor == 1 && scale == 1.0 &&
+			       baseRotation == 0.0, gpuMsg))
+	    goto gpuFailure;
+	}
+      else if (rFactor == 1 && scale == 1.0 && baseRotation == 0.0)
 	for (y = 0; y < n; ++y)
 	  for (x = 0; x < n; ++x)
 	    {
@@ -1897,54 +2476,24 @@ WorkerTask ()
 		img[y*n+x] = mean[larger];
 	    }
       else
-	for (y = 0; y < n; ++y)
-	  for (x = 0; x < n; ++x)
-	    {
-	      v = 0.0;
-	      count = 0;
-	      for (dy = 0; dy < sFactor; ++dy)
-		for (dx = 0; dx < sFactor; ++dx)
-		  {
-		    xv = (x - n_over_2) + dx / ((float) sFactor);
-		    yv = (y - n_over_2) + dy / ((float) sFactor);
-		    
-		    xvp = scale * (ct * xv - st * yv) + n_over_2 - offset_x;
-		    yvp = scale * (st * xv + ct * yv) + n_over_2 - offset_y;
-
-		    xvp *= rFactor;
-		    yvp *= rFactor;
-
-		    ixv = (int) floor(xvp);
-		    iyv = (int) floor(yvp);
-		    if (ixv >= 0 && ixv < iw[larger]-1 &&
-			iyv >= 0 && iyv < ih[larger]-1)
-		      {
-			rrx = xvp - ixv;
-			rry = yvp - iyv;
-			rv00 = image_in[larger][iyv * iw[larger] + ixv];
-			rv01 = image_in[larger][(iyv+1) * iw[larger] + ixv];
-			rv10 = image_in[larger][iyv * iw[larger] + (ixv+1)];
-			rv11 = image_in[larger][(iyv+1) * iw[larger] + (ixv+1)];
-			v += rv00 * (rrx - 1.0) * (rry - 1.0)
-			  - rv10 * rrx * (rry - 1.0) 
-			  - rv01 * (rrx - 1.0) * rry
-			  + rv11 * rrx * rry;
-			++count;
-
-			dst = dist[larger][iyv * iw[larger] + ixv];
-		      }
-		  }
-	      if (count > 0)
-		{
-		  ix = (int) (dst * scale + 0.5);
-		  if (ix >= blk_w/2)
-		    img[y*n+x] = (v / count) - mean[larger];
-		  else
-		    img[y*n+x] = window[ix] * (v / count - mean[larger]);
-		}
-	      else
-		img[y*n+x] = 0.0;
-	    }
+	{
+	  rj.rows = TransformRows;
+	  rj.n = n;
+	  rj.iw = iw[larger];
+	  rj.ih = ih[larger];
+	  rj.image = image_in[larger];
+	  rj.dist = dist[larger];
+	  rj.mean = mean[larger];
+	  rj.blk_w = blk_w;
+	  rj.offset_x = offset_x;
+	  rj.offset_y = offset_y;
+	  rj.rFactor = rFactor;
+	  rj.sFactor = sFactor;
+	  rj.scale = scale;
+	  rj.ct = ct;
+	  rj.st = st;
+	  RunRows(&rj, n);
+	}
 
       if (c.outputImages && i == 0)
 	{
@@ -1973,7 +2522,8 @@ WorkerTask ()
 	}
 
       /* perform FFT */
-      fftwf_execute(plan_img);
+      if (!useGpu)
+	fftwf_execute(plan_img);
 
       for (th = 0; th <= 180; th += 180)
 	{
@@ -1985,7 +2535,12 @@ WorkerTask ()
 	  ct = cos(rotation);
 	  st = sin(rotation);
 
-	  if (th == 180)
+	  if (th == 180 && useGpu)
+	    {
+	      if (!GpuRstRotate(gpuMsg))
+		goto gpuFailure;
+	    }
+	  else if (th == 180)
 	    {
 	      /* obtain FT of image rotated by 180 degrees by
 		 rotating the phases of the conjugate of the FT of
@@ -2002,18 +2557,6 @@ WorkerTask ()
 		  }
 	    }
 
-	  /* compute cross-power spectrum */
-	  for (j = 0; j < n2_partial; ++j)
-	    {
-	      p_r = fft_orig[smaller][j][0] * fft_img[j][0] +
-		fft_orig[smaller][j][1] * fft_img[j][1];
-	      p_i = fft_orig[smaller][j][1] * fft_img[j][0] -
-		fft_orig[smaller][j][0] * fft_img[j][1];
-	      d = hypot(p_r, p_i);
-	      prod[j][0] = p_r / d;
-	      prod[j][1] = p_i / d;
-	    }
-
 	  /* convolve with a Gaussian of the given radius */
 	  if (radius == 0.0)
 	    {
@@ -2044,7 +2587,40 @@ WorkerTask ()
 		}
 	      //		  printf("final j = %d\n", j);
 	    }
-	  
+
+	  if (useGpu)
+	    {
+	      /* as in the RS search, only the peaks of the valid region
+		 can be chosen below */
+	      for (j = 0; j < n; ++j)
+		{
+		  marked[j] = DeltaInRange(j, n, rFactor,
+					   c.minTX, c.maxTX, iw[0]);
+		  marked[n + j] = DeltaInRange(j, n, rFactor,
+					       c.minTY, c.maxTY, ih[0]);
+		}
+	      if (!GpuRstCorrelate(smaller, gaussian,
+				   ccFilterMin, ccFilterMax, gpuMsg) ||
+		  !GpuRstPeaks(marked, &marked[n], 1, &peaks, &nValues,
+			       gpuMsg))
+		goto gpuFailure;
+	      for (j = 0; j < nValues; ++j)
+		{
+		  values[j].x = peaks[j].x;
+		  values[j].y = peaks[j].y;
+		  values[j].val = peaks[j].val;
+		  values[j].radius = radius;
+		}
+	      goto sortTranslationValues;
+	    }
+
+	  /* compute cross-power spectrum */
+	  rj.rows = CrossPowerRows;
+	  rj.a = fft_orig[smaller];
+	  rj.b = fft_img;
+	  rj.width = n_over_2_plus_1;
+	  RunRows(&rj, n);
+
 	  // apply gaussian directly to partial FT
 	  for (y = 0; y < n; ++y)
 	    for (x = 0; x < n_over_2_plus_1; ++x)
@@ -2078,56 +2654,85 @@ WorkerTask ()
 	      memcpy(fft_cc, ccfilter, n2_partial * sizeof(fftwf_complex));
 	    }
 
-	  /* perform IFFT */
-	  fftwf_execute(plan_cc);
-
-	  /* generate a picture */
-	  if (c.outputImages && i == 0)
+	  /* with -coarse_translation, only the neighborhoods of the
+	     peaks of a subsampled correlation are evaluated at full
+	     resolution */
+	  nValues = -1;
+	  if (c.coarseTranslation && radius > 0.0 &&
+	      !(c.outputImages && i == 0))
 	    {
-	      v_max = 0.0;
-	      v_min = 0.0;
-	      for (y = 0; y < n; ++y)
-		for (x = 0; x < n; ++x)
-		  {
-		    if (cc[y*n+x] > v_max)
-		      v_max = cc[y*n+x];
-		    if (cc[y*n+x] < v_min)
-		      v_min = cc[y*n+x];
-		  }
-	      sprintf(fn, "%s%s.cc.pgm",
-		      c.outputBasename, t.pair.pairName);
-	      f = fopen(fn, "w");
-	      fprintf(f, "P5\n%d %d\n255\n", n, n);
+	      for (K = 1; K < n_over_2 - 1; ++K)
+		if (gaussian[K] < 1.0e-4 * gaussian[0])
+		  break;
+	      memset(marked, 0, n2*sizeof(unsigned char));
+	      nValues = CoarseToFineValues(n, K, radius, rFactor,
+					   iw[0], ih[0]);
+	      if (nValues >= 0)
+		MetricsCount("translation_values", nValues);
+	    }
+	  if (nValues < 0)
+	    {
+	      /* perform IFFT */
+	      fftwf_execute(plan_cc);
+
+	      /* generate a picture */
+	      if (c.outputImages && i == 0)
+		{
+		  v_max = 0.0;
+		  v_min = 0.0;
+		  for (y = 0; y < n; ++y)
+		    for (x = 0; x < n; ++x)
+		      {
+			if (cc[y*n+x] > v_max)
+			  v_max = cc[y*n+x];
+			if (cc[y*n+x] < v_min)
+			  v_min = cc[y*n+x];
+		      }
+		  sprintf(fn, "%s%s.cc.pgm",
+			  c.outputBasename, t.pair.pairName);
+		  f = fopen(fn, "w");
+		  fprintf(f, "P5\n%d %d\n255\n", n, n);
+		  for (y = 0; y < n; ++y)
+		    for (x = 0; x < n; ++x)
+		      {
+			j = 255.99 * (cc[y*n+x] - v_min) / (v_max - v_min);
+			if (j > 255)
+			  j = 255;
+			fputc(j, f);
+		      }
+		  fclose(f);
+		}
+
+	      /* sort the values, leaving out those outside of the
+		 valid region */
+	      j = 0; 
 	      for (y = 0; y < n; ++y)
-		for (x = 0; x < n; ++x)
-		  {
-		    j = 255.99 * (cc[y*n+x] - v_min) / (v_max - v_min);
-		    if (j > 255)
-		      j = 255;
-		    fputc(j, f);
-		  }
-	      fclose(f);
+		{
+		  if (!DeltaInRange(y, n, rFactor, c.minTY, c.maxTY, ih[0]))
+		    continue;
+		  for (x = 0; x < n; ++x)
+		    {
+		      if (!DeltaInRange(x, n, rFactor, c.minTX, c.maxTX, iw[0]))
+			continue;
+		      values[j].x = x;
+		      values[j].y = y;
+		      values[j].val = cc[y*n+x];
+		      values[j].radius = radius;
+		      ++j;
+		    }
+		}
+	      nValues = j;
 	    }
 
-	  /* sort the values */
-	  j = 0; 
-	  for (y = 0; y < n; ++y)
-	    for (x = 0; x < n; ++x)
-	      {
-		values[j].x = x;
-		values[j].y = y;
-		values[j].val = cc[y*n+x];
-		values[j].radius = radius;
-		++j;
-	      }
+	sortTranslationValues:
 	  //	  Log("before values[0].val = %f\n", values[0].val);
-	  qsort(values, n2, sizeof(PositionValue), CompareValues);
+	  qsort(values, nValues, sizeof(PositionValue), CompareValues);
 	  //	  Log("after values[0].val = %f  radius = %f\n", values[0].val,
 	  //	      radius);
 
 	  /* determine highest peaks in the normalized cross-correlation */
 	  memset(marked, 0, n2*sizeof(unsigned char));
-	  for (j = 0; j < n2; ++j)
+	  for (j = 0; j < nValues; ++j)
 	    {
 	      quality = values[j].val;
 	      ix = values[j].x;
@@ -2266,6 +2871,7 @@ WorkerTask ()
 	  finalCandidates[i].quality,
 	  finalCandidates[i].radius);
 
+  MetricsPhase(METRICS_WRITE);
   if (outputName[0] != '\0')
     {
       /* turn the best candidate into a map */
@@ -2356,6 +2962,8 @@ WorkerTask ()
 	      finalCandidates[0].tx,
 	      finalCandidates[0].ty);
       fclose(f);
+      if (!WriteDeps(depsName, depsParams, 4, depsInputs))
+	Log("Could not write dependency sidecar %s\n", depsName);
     }
 
   memcpy(&(r.pair), &(t.pair), sizeof(Pair));
@@ -2469,27 +3077,803 @@ fft_compress (fftwf_complex *fft, int n)
   memset(&fft[n*n21], 0, n*(n-n21)*sizeof(fftwf_complex));
 }
 
+/* the worker-side spectrum cache; each entry holds copies of the
+   windowed FFT and the log-polar spectrum FFT of one image so that
+   the other pairs the image occurs in do not have to recompute them */
+void
+MakeSpectrumKey (SpectrumKey *key, char *imageName, char *maskName,
+		 int minX, int maxX, int minY, int maxY,
+		 int n, int rFactor, int blk_w,
+		 float logrhooffset, float logrhobase)
+{
+  struct stat sb;
+
+  memset(key, 0, sizeof(SpectrumKey));
+  strcpy(key->imageName, imageName);
+  strcpy(key->maskName, maskName);
+  key->minX = minX;
+  key->maxX = maxX;
+  key->minY = minY;
+  key->maxY = maxY;
+  key->n = n;
+  key->rFactor = rFactor;
+  key->blk_w = blk_w;
+  key->logrhooffset = logrhooffset;
+  key->logrhobase = logrhobase;
+  if (stat(imageName, &sb) == 0)
+    key->imageMTime = sb.st_mtime;
+  if (maskName[0] != '\0' && stat(maskName, &sb) == 0)
+    key->maskMTime = sb.st_mtime;
+}
+
 int
-SortByQuality (const void *x, const void *y)
+SameSpectrumKey (SpectrumKey *a, SpectrumKey *b)
 {
-  Result *rx, *ry;
-  rx = (Result *) x;
-  ry = (Result *) y;
-  if (rx->quality < ry->quality)
-    return(-1);
-  else if (rx->quality == ry->quality)
-    return(0);
+  return(a->n == b->n && a->rFactor == b->rFactor && a->blk_w == b->blk_w &&
+	 a->logrhooffset == b->logrhooffset &&
+	 a->logrhobase == b->logrhobase &&
+	 a->minX == b->minX && a->maxX == b->maxX &&
+	 a->minY == b->minY && a->maxY == b->maxY &&
+	 a->imageMTime == b->imageMTime && a->maskMTime == b->maskMTime &&
+	 strcmp(a->imageName, b->imageName) == 0 &&
+	 strcmp(a->maskName, b->maskName) == 0);
+}
+
+/* LookupSpectrum copies the cached spectra matching key into
+   fft_orig[imi] and flp[imi]; it returns 0 if there is no such entry */
+int
+LookupSpectrum (SpectrumKey *key, int imi, int n2_partial)
+{
+  int i;
+  SpectrumCacheEntry *se;
+
+  pthread_mutex_lock(&cacheLock);
+  for (i = 0; i < nSpectrumCache; ++i)
+    {
+      se = &spectrumCache[i];
+      if (!SameSpectrumKey(&se->key, key))
+	continue;
+      memcpy(fft_orig[imi], se->fft, n2_partial * sizeof(fftwf_complex));
+      if (se->flp != NULL)
+	memcpy(flp[imi], se->flp, n2_partial * sizeof(fftwf_complex));
+      se->lastUse = ++spectrumCacheClock;
+      pthread_mutex_unlock(&cacheLock);
+      Log("Spectrum cache hit for %s\n", key->imageName);
+      return(1);
+    }
+  pthread_mutex_unlock(&cacheLock);
+  return(0);
+}
+
+/* StoreSpectrum adds copies of fft_orig[imi] (and flp[imi] if rotation
+   and scale are being searched for) to the cache, and then evicts the
+   least recently used entries until the cache fits within its budget */
+void
+StoreSpectrum (SpectrumKey *key, int imi, int n2_partial)
+{
+  int i;
+  size_t bytes;
+  SpectrumCacheEntry *se;
+
+  pthread_mutex_lock(&cacheLock);
+  for (i = 0; i < nSpectrumCache; ++i)
+    if (SameSpectrumKey(&spectrumCache[i].key, key))
+      {
+	pthread_mutex_unlock(&cacheLock);
+	return;
+      }
+
+  bytes = n2_partial * sizeof(fftwf_complex);
+  spectrumCache = (SpectrumCacheEntry *)
+    realloc(spectrumCache, (nSpectrumCache + 1) * sizeof(SpectrumCacheEntry));
+  se = &spectrumCache[nSpectrumCache++];
+  se->key = *key;
+  se->fft = (fftwf_complex *) fftwf_malloc(bytes);
+  memcpy(se->fft, fft_orig[imi], bytes);
+  se->bytes = bytes;
+  if (c.minScale == c.maxScale && c.minTheta == c.maxTheta)
+    se->flp = NULL;
   else
+    {
+      se->flp = (fftwf_complex *) fftwf_malloc(bytes);
+      memcpy(se->flp, flp[imi], bytes);
+      se->bytes += bytes;
+    }
+  se->lastUse = ++spectrumCacheClock;
+  TrimSpectrumCache();
+  pthread_mutex_unlock(&cacheLock);
+}
+
+/* TrimSpectrumCache is called with cacheLock held */
+void
+TrimSpectrumCache ()
+{
+  int i;
+  int lru;
+  size_t total;
+
+  for (;;)
+    {
+      total = 0;
+      lru = -1;
+      for (i = 0; i < nSpectrumCache; ++i)
+	{
+	  total += spectrumCache[i].bytes;
+	  if (lru < 0 || spectrumCache[i].lastUse < spectrumCache[lru].lastUse)
+	    lru = i;
+	}
+      if (total <= ((size_t) c.spectrumCacheSize) << 20 || lru < 0)
+	break;
+      Log("Evicting %s from spectrum cache (%zd bytes)\n",
+	  spectrumCache[lru].key.imageName, spectrumCache[lru].bytes);
+      fftwf_free(spectrumCache[lru].fft);
+      if (spectrumCache[lru].flp != NULL)
+	fftwf_free(spectrumCache[lru].flp);
+      spectrumCache[lru] = spectrumCache[--nSpectrumCache];
+    }
+}
+
+/* multiply each of the n transformed chirp sequences of length 2n
+   stored consecutively in y by the transformed kernel fft_z */
+/* FFTSize returns the smallest even n >= m (or the smallest power of
+   two with -fft_sizes pow2) that has no prime factors above 7, for
+   which FFTW's transforms are about as fast per element as for powers
+   of two; the arrays are still n x n since the log-polar transform
+   needs the same frequency spacing in x and y */
+int
+FFTSize (int m)
+{
+  int n;
+  int k;
+
+  n = 1;
+  while (n < m)
+    n <<= 1;
+  if (c.pow2FFT)
+    return(n);
+  for (n = m > 2 ? m + (m & 1) : 2; ; n += 2)
+    {
+      k = n;
+      while (k % 2 == 0)
+	k /= 2;
+      while (k % 3 == 0)
+	k /= 3;
+      while (k % 5 == 0)
+	k /= 5;
+      while (k % 7 == 0)
+	k /= 7;
+      if (k == 1)
+	return(n);
+    }
+}
+
+/* DeltaInRange returns 1 if a correlation peak at index i along an
+   axis of the n x n array is within the allowed translation range
+   [minT, maxT] (in percent of an image size of size pixels) */
+int
+DeltaInRange (int i, int n, int rFactor, float minT, float maxT, int size)
+{
+  float delta;
+
+  if (i <= n / 2)
+    delta = -(float) i;
+  else
+    delta = -(float) (i - n);
+  return(!(delta * rFactor < minT * size * 0.01 ||
+	   delta * rFactor > maxT * size * 0.01));
+}
+
+/* CoarseToFineValues fills values[] with the full-resolution
+   correlation around the peaks of a subsampled one, for -coarse_translation.
+   The Gaussian-filtered cross-power spectrum in fft_cc is negligible
+   beyond frequency K, so the correlation sampled every coarseFactor
+   pixels is the inverse FFT of just its central m x m block; the
+   positions within coarseFactor of the best coarse peaks that are in
+   the allowed translation range are then evaluated exactly by direct
+   summation over the band.  It returns the number of values, or -1 if
+   the band is too wide for a smaller FFT to help.  The positions
+   evaluated are left set in marked[]. */
+int
+CoarseToFineValues (int n, int K, float radius, int rFactor,
+		    int iw0, int ih0)
+{
+  int f, m, w;
+  int mh, nh;
+  int maxPeaks, nPeaks, nValues;
+  int x, y, u, v, a, b;
+  int xa, yb;
+  int ix, iy;
+  int inX, inY;
+  float val;
+  float gr, gi;
+  float fr, fi, er, ei;
+  float sum;
+  int k;
+
+  if (n != coarseN || K != coarseK)
+    {
+      if (coarseN > 0)
+	{
+	  pthread_mutex_lock(&fftwLock);
+	  fftwf_destroy_plan(plan_coarse);
+	  pthread_mutex_unlock(&fftwLock);
+	  fftwf_free(coarseFft);
+	  fftwf_free(coarseCc);
+	  fftwf_free(coarseRows);
+	  free(coarsePeaks);
+	}
+      coarseN = -1;
+      coarseK = -1;
+
+      /* the largest subsampling factor (up to 8) that divides n and
+	 still leaves room for the band */
+      for (f = 8; f >= 2; --f)
+	if (n % f == 0 && (n / f) % 2 == 0 && n / f >= 2 * K + 2)
+	  break;
+      if (f < 2)
+	return(-1);
+      m = n / f;
+      coarseFft = (fftwf_complex *) fftwf_malloc(m * (m / 2 + 1) *
+						 sizeof(fftwf_complex));
+      coarseCc = (float *) fftwf_malloc(m * m * sizeof(float));
+      coarseRows = (fftwf_complex *) fftwf_malloc((2 * K + 1) * (2 * f + 1) *
+						  sizeof(fftwf_complex));
+      coarsePeaks = (PositionValue *) malloc((4 * c.maxCandidates + 4) *
+					     sizeof(PositionValue));
+      pthread_mutex_lock(&fftwLock);
+      plan_coarse = fftwf_plan_dft_c2r_2d(m, m, coarseFft, coarseCc,
+					  c.fftwFlags);
+      pthread_mutex_unlock(&fftwLock);
+      coarseFactor = f;
+      coarseN = n;
+      coarseK = K;
+      Log("Coarse translation search: band %d, subsampling %d (%d x %d)\n",
+	  K, f, m, m);
+    }
+  f = coarseFactor;
+  m = n / f;
+  w = 2 * f + 1;
+  mh = m / 2 + 1;
+  nh = n / 2 + 1;
+  maxPeaks = 4 * c.maxCandidates + 4;
+
+  /* the coarse correlation */
+  memset(coarseFft, 0, m * mh * sizeof(fftwf_complex));
+  for (v = -K; v <= K; ++v)
+    for (u = 0; u <= K; ++u)
+      {
+	coarseFft[((v + m) % m) * mh + u][0] = fft_cc[((v + n) % n) * nh + u][0];
+	coarseFft[((v + m) % m) * mh + u][1] = fft_cc[((v + n) % n) * nh + u][1];
+      }
+  fftwf_execute(plan_coarse);
+
+  /* its highest local maxima near the allowed range */
+  nPeaks = 0;
+  for (y = 0; y < m; ++y)
+    for (x = 0; x < m; ++x)
+      {
+	val = coarseCc[y * m + x];
+	if (val <= 0.0 ||
+	    nPeaks == maxPeaks && val <= coarsePeaks[nPeaks-1].val)
+	  continue;
+	for (b = -1; b <= 1; ++b)
+	  for (a = -1; a <= 1; ++a)
+	    if (coarseCc[((y + b + m) % m) * m + (x + a + m) % m] > val)
+	      goto nextCoarse;
+	inX = 0;
+	inY = 0;
+	for (a = -f; a <= f; ++a)
+	  {
+	    if (DeltaInRange((f * x + a + n) % n, n, rFactor,
+			     c.minTX, c.maxTX, iw0))
+	      inX = 1;
+	    if (DeltaInRange((f * y + a + n) % n, n, rFactor,
+			     c.minTY, c.maxTY, ih0))
+	      inY = 1;
+	  }
+	if (!inX || !inY)
+	  continue;
+	if (nPeaks == maxPeaks)
+	  --nPeaks;
+	for (k = nPeaks; k > 0 && coarsePeaks[k-1].val < val; --k)
+	  coarsePeaks[k] = coarsePeaks[k-1];
+	coarsePeaks[k].x = x;
+	coarsePeaks[k].y = y;
+	coarsePeaks[k].val = val;
+	++nPeaks;
+      nextCoarse: ;
+      }
+
+  /* the full-resolution correlation around each of them:
+       cc(x,y) = Re sum_v e^(2 pi i v y / n) sum_u w_u F(u,v) e^(2 pi i u x / n)
+     where w_0 = 1 and w_u = 2 for the other (non-Nyquist) u */
+  nValues = 0;
+  for (k = 0; k < nPeaks; ++k)
+    {
+      for (a = 0; a < w; ++a)
+	{
+	  xa = (f * coarsePeaks[k].x - f + a + n) % n;
+	  for (v = -K; v <= K; ++v)
+	    {
+	      gr = 0.0;
+	      gi = 0.0;
+	      for (u = 0; u <= K; ++u)
+		{
+		  fr = fft_cc[((v + n) % n) * nh + u][0];
+		  fi = fft_cc[((v + n) % n) * nh + u][1];
+		  er = rot[(u * xa) % n][0];
+		  ei = rot[(u * xa) % n][1];
+		  if (u > 0)
+		    {
+		      fr *= 2.0;
+		      fi *= 2.0;
+		    }
+		  gr += fr * er - fi * ei;
+		  gi += fr * ei + fi * er;
+		}
+	      coarseRows[(v + K) * w + a][0] = gr;
+	      coarseRows[(v + K) * w + a][1] = gi;
+	    }
+	}
+      for (b = 0; b < w; ++b)
+	{
+	  iy = (f * coarsePeaks[k].y - f + b + n) % n;
+	  if (!DeltaInRange(iy, n, rFactor, c.minTY, c.maxTY, ih0))
+	    continue;
+	  for (a = 0; a < w; ++a)
+	    {
+	      ix = (f * coarsePeaks[k].x - f + a + n) % n;
+	      if (marked[iy * n + ix] ||
+		  !DeltaInRange(ix, n, rFactor, c.minTX, c.maxTX, iw0))
+		continue;
+	      marked[iy * n + ix] = 1;
+	      sum = 0.0;
+	      for (v = -K; v <= K; ++v)
+		{
+		  yb = ((v + n) * iy) % n;
+		  sum += coarseRows[(v + K) * w + a][0] * rot[yb][0] -
+		    coarseRows[(v + K) * w + a][1] * rot[yb][1];
+		}
+	      values[nValues].x = ix;
+	      values[nValues].y = iy;
+	      values[nValues].val = sum;
+	      values[nValues].radius = radius;
+	      ++nValues;
+	    }
+	}
+    }
+  return(nValues);
+}
+
+/* BuildChirps makes the chirp tables of the Bluestein FFTs at each
+   fractional resolution for size n: cos_t and sin_t premultiply the
+   rows and columns, chirpZ postmultiplies them and chirpFftZ is the
+   transform they are convolved with */
+void
+BuildChirps (int n, int nRes)
+{
+  int res;
+  int j;
+  int n_over_2, n_times_2;
+  float alpha;
+  float theta;
+
+  n_over_2 = n / 2;
+  n_times_2 = 2 * n;
+  for (res = 1; res < nRes; ++res)
+    {
+      alpha = c.fracRes[res] / n;
+      for (j = 0; j < n; ++j)
+	{
+	  theta = -M_PI*j*j*alpha;
+	  chirpCos[res*n + j] = cos(theta);
+	  chirpSin[res*n + j] = sin(theta);
+	  theta = M_PI*(j-n_over_2)*(j-n_over_2)*alpha;
+	  Z[j][0] = cos(theta);
+	  Z[j][1] = sin(theta);
+	}
+      for (j = n; j < n_times_2; ++j)
+	{
+	  theta = M_PI*(j-n_over_2-n_times_2)*(j-n_over_2-n_times_2)*alpha;
+	  Z[j][0] = cos(theta);
+	  Z[j][1] = sin(theta);
+	}
+      fftwf_execute(plan_Z);
+      memcpy(&chirpZ[res * n_times_2], Z, n_times_2 * sizeof(fftwf_complex));
+      memcpy(&chirpFftZ[res * n_times_2], fft_Z,
+	     n_times_2 * sizeof(fftwf_complex));
+    }
+  memcpy(chirpFracRes, c.fracRes, sizeof(chirpFracRes));
+  chirpN = n;
+  gpuTablesCurrent = 0;
+}
+
+/* BuildLogPolarTable finds, for each sample (it,ir) of the n x n
+   log-polar transform, the finest fractional-resolution magnitude
+   spectrum that holds it and the bilinear footprint it is read from
+   there; the samples are stored in the order of lp[] */
+void
+BuildLogPolarTable (int n, int nRes, float *resMin,
+		    float logrhobase, float logrhooffset)
+{
+  int it, ir;
+  int res;
+  int ixv, iyv;
+  size_t n2;
+  float theta, rho;
+  float cos_theta, sin_theta;
+  float xv, yv;
+  float xvp, yvp;
+
+  n2 = ((size_t) n) * n;
+  for (it = 0; it < n; ++it)
+    {
+      theta = it * M_PI / n;
+      cos_theta = cos(theta);
+      sin_theta = sin(theta);
+      for (ir = 0; ir < n; ++ir)
+	{
+	  rho = exp(ir * logrhobase + logrhooffset);
+	  xv = rho * cos_theta;
+	  yv = rho * sin_theta;
+	  for (res = nRes - 1; res >= 0; --res)
+	    {
+	      xvp = (xv - resMin[res]) / c.fracRes[res];
+	      yvp = (yv - resMin[res]) / c.fracRes[res];
+	      ixv = (int) floor(xvp);
+	      iyv = (int) floor(yvp);
+	      if (ixv >= 0 && ixv < n-1 &&
+		  iyv >= 0 && iyv < n-1)
+		{
+		  lpIndex[ir*n+it] = res*n2 + iyv * n + ixv;
+		  lpRx[ir*n+it] = xvp - ixv;
+		  lpRy[ir*n+it] = yvp - iyv;
+		  break;
+		}
+	    }
+	  if (res < 0)
+	    Error("Could not find point in any resolution level: %d %d %f %f  %f %f %f\n", it, ir, xv, yv, resMin[0], resMin[1], resMin[2]);
+	}
+    }
+  lpTableN = n;
+  lpTableBase = logrhobase;
+  lpTableOffset = logrhooffset;
+  gpuTablesCurrent = 0;
+}
+
+/* RunRows runs job->rows over rows 0..nRows-1, in one band per thread
+   of c.nThreads (but never fewer than 16 rows each); the rows of a job
+   are independent, so the result does not depend on the banding */
+void
+RunRows (RowJob *job, int nRows)
+{
+  RowThread *rts;
+  int nThreads;
+  int i;
+
+  job->img = img;
+  job->window = window;
+  job->mag = mag;
+  job->lp = lp;
+  job->fft_img = fft_img;
+  job->prod = prod;
+  job->lpIndex = lpIndex;
+  job->lpRx = lpRx;
+  job->lpRy = lpRy;
+  nThreads = c.nThreads;
+  if (nThreads > nRows / 16)
+    nThreads = nRows / 16;
+  if (nThreads <= 1)
+    {
+      (*job->rows)(job, 0, nRows);
+      return;
+    }
+  rts = (RowThread *) malloc(nThreads * sizeof(RowThread));
+  if (rts == NULL)
+    Error("Could not allocate row threads\n");
+  for (i = 0; i < nThreads; ++i)
+    {
+      rts[i].job = job;
+      rts[i].y0 = (long long) nRows * i / nThreads;
+      rts[i].y1 = (long long) nRows * (i + 1) / nThreads;
+    }
+  for (i = 1; i < nThreads; ++i)
+    if (pthread_create(&rts[i].thread, NULL, RowThreadMain, &rts[i]) != 0)
+      Error("Could not create row thread\n");
+  RowThreadMain(&rts[0]);
+  for (i = 1; i < nThreads; ++i)
+    if (pthread_join(rts[i].thread, NULL) != 0)
+      Error("Could not join row thread\n");
+  free(rts);
+}
+
+void *
+RowThreadMain (void *arg)
+{
+  RowThread *rt = (RowThread *) arg;
+
+  (*rt->job->rows)(rt->job, rt->y0, rt->y1);
+  return(NULL);
+}
+
+/* WindowRows takes the min of each pixel's mask distance with its
+   distance from the edge, and applies a Blackman window to smooth out
+   the edges of the image */
+void
+WindowRows (RowJob *job, int y0, int y1)
+{
+  int x, y;
+  int ix;
+  int iw = job->iw;
+  int ih = job->ih;
+  float d, dst;
+
+  for (y = y0; y < y1; ++y)
+    for (x = 0; x < iw; ++x)
+      {
+	dst = job->dist[y*iw + x];
+	d = x + 1;
+	if (d < dst)
+	  dst = d;
+	d = iw - x;
+	if (d < dst)
+	  dst = d;
+	d = y + 1;
+	if (d < dst)
+	  dst = d;
+	d = ih - y;
+	if (d < dst)
+	  dst = d;
+	job->dist[y*iw + x] = dst;
+	ix = (int) (dst + 0.5);
+	if (ix >= job->blk_w/2)
+	  job->windowed[y*iw+x] = job->image[y*iw + x] - job->mean;
+	else
+	  job->windowed[y*iw+x] = job->window[ix] *
+	    (job->image[y*iw + x] - job->mean);
+      }
+}
+
+/* ResampleRows fills img by supersampling the windowed image at the
+   reduction factor */
+void
+ResampleRows (RowJob *job, int y0, int y1)
+{
+  int n = job->n;
+  int iw = job->iw;
+  int ih = job->ih;
+  int sFactor = job->sFactor;
+  int x, y;
+  int dx, dy;
+  int ixv, iyv;
+  int count;
+  float v;
+  float xv, yv;
+  float rrx, rry;
+  float rv00, rv01, rv10, rv11;
+
+  for (y = y0; y < y1; ++y)
+    for (x = 0; x < n; ++x)
+      {
+	v = 0.0;
+	count = 0;
+	for (dy = 0; dy < sFactor; ++dy)
+	  for (dx = 0; dx < sFactor; ++dx)
+	    {
+	      xv = (x - job->offset_x + ((float) dx) / sFactor) * job->rFactor;
+	      yv = (y - job->offset_y + ((float) dy) / sFactor) * job->rFactor;
+
+	      ixv = (int) floor(xv);
+	      iyv = (int) floor(yv);
+	      if (ixv >= 0 && ixv < iw-1 &&
+		  iyv >= 0 && iyv < ih-1)
+		{
+		  rrx = xv - ixv;
+		  rry = yv - iyv;
+		  rv00 = job->windowed[iyv * iw + ixv];
+		  rv01 = job->windowed[(iyv+1) * iw + ixv];
+		  rv10 = job->windowed[iyv * iw + (ixv+1)];
+		  rv11 = job->windowed[(iyv+1) * iw + (ixv+1)];
+		  v += rv00 * (rrx - 1.0) * (rry - 1.0)
+		    - rv10 * rrx * (rry - 1.0) 
+		    - rv01 * (rrx - 1.0) * rry
+		    + rv11 * rrx * rry;
+		  ++count;
+		}
+	    }
+	if (count > 0)
+	  job->img[y*n+x] = v / count;
+	else
+	  job->img[y*n+x] = 0.0;
+      }
+}
+
+/* MagnitudeRows stores the log magnitude of fft_img as resolution
+   level job->res of mag */
+void
+MagnitudeRows (RowJob *job, int y0, int y1)
+{
+  int n = job->n;
+  size_t n2 = ((size_t) n) * n;
+  int x, y;
+
+  for (y = y0; y < y1; ++y)
+    for (x = 0; x < n; ++x)
+      job->mag[job->res*n2 + y*n + x] =
+	log(hypot(job->fft_img[y*n+x][0], job->fft_img[y*n+x][1]));
+}
+
+/* LogPolarRows gathers the log-polar transform of mag into lp through
+   the table made by BuildLogPolarTable */
+void
+LogPolarRows (RowJob *job, int y0, int y1)
+{
+  int n = job->n;
+  int k;
+  int o;
+  float rrx, rry;
+
+  for (k = y0 * n; k < y1 * n; ++k)
+    {
+      o = job->lpIndex[k];
+      rrx = job->lpRx[k];
+      rry = job->lpRy[k];
+      job->lp[k] = job->mag[o] * (rrx - 1.0) * (rry - 1.0)
+	- job->mag[o + 1] * rrx * (rry - 1.0)
+	- job->mag[o + n] * (rrx - 1.0) * rry
+	+ job->mag[o + n + 1] * rrx * rry;
+    }
+}
+
+/* TransformRows fills img by rotating, scaling, and supersampling the
+   larger image of an RS candidate, windowing it by its distances */
+void
+TransformRows (RowJob *job, int y0, int y1)
+{
+  int n = job->n;
+  int n_over_2 = n / 2;
+  int iw = job->iw;
+  int ih = job->ih;
+  int sFactor = job->sFactor;
+  float scale = job->scale;
+  float ct = job->ct;
+  float st = job->st;
+  int x, y;
+  int dx, dy;
+  int ix, ixv, iyv;
+  int count;
+  float v;
+  float dst = 0.0;
+  float xv, yv;
+  float xvp, yvp;
+  float rrx, rry;
+  float rv00, rv01, rv10, rv11;
+
+  for (y = y0; y < y1; ++y)
+    for (x = 0; x < n; ++x)
+      {
+	v = 0.0;
+	count = 0;
+	for (dy = 0; dy < sFactor; ++dy)
+	  for (dx = 0; dx < sFactor; ++dx)
+	    {
+	      xv = (x - n_over_2) + dx / ((float) sFactor);
+	      yv = (y - n_over_2) + dy / ((float) sFactor);
+
+	      xvp = scale * (ct * xv - st * yv) + n_over_2 - job->offset_x;
+	      yvp = scale * (st * xv + ct * yv) + n_over_2 - job->offset_y;
+
+	      xvp *= job->rFactor;
+	      yvp *= job->rFactor;
+
+	      ixv = (int) floor(xvp);
+	      iyv = (int) floor(yvp);
+	      if (ixv >= 0 && ixv < iw-1 &&
+		  iyv >= 0 && iyv < ih-1)
+		{
+		  rrx = xvp - ixv;
+		  rry = yvp - iyv;
+		  rv00 = job->image[iyv * iw + ixv];
+		  rv01 = job->image[(iyv+1) * iw + ixv];
+		  rv10 = job->image[iyv * iw + (ixv+1)];
+		  rv11 = job->image[(iyv+1) * iw + (ixv+1)];
+		  v += rv00 * (rrx - 1.0) * (rry - 1.0)
+		    - rv10 * rrx * (rry - 1.0) 
+		    - rv01 * (rrx - 1.0) * rry
+		    + rv11 * rrx * rry;
+		  ++count;
+
+		  dst = job->dist[iyv * iw + ixv];
+		}
+	    }
+	if (count > 0)
+	  {
+	    ix = (int) (dst * scale + 0.5);
+	    if (ix >= job->blk_w/2)
+	      job->img[y*n+x] = (v / count) - job->mean;
+	    else
+	      job->img[y*n+x] = job->window[ix] * (v / count - job->mean);
+	  }
+	else
+	  job->img[y*n+x] = 0.0;
+      }
+}
+
+/* CrossPowerRows stores in prod the normalized cross-power spectrum of
+   the partial spectra job->a and job->b */
+void
+CrossPowerRows (RowJob *job, int y0, int y1)
+{
+  size_t i;
+  float p_r, p_i;
+  float d;
+
+  for (i = (size_t) y0 * job->width; i < (size_t) y1 * job->width; ++i)
+    {
+      p_r = job->a[i][0] * job->b[i][0] + job->a[i][1] * job->b[i][1];
+      p_i = job->a[i][1] * job->b[i][0] - job->a[i][0] * job->b[i][1];
+      d = hypot(p_r, p_i);
+      job->prod[i][0] = p_r / d;
+      job->prod[i][1] = p_i / d;
+    }
+}
+
+void
+ConvolveChirp (fftwf_complex *y, fftwf_complex *fft_z, int n)
+{
+  int i, j;
+  int n_times_2;
+  float yr, yi;
+  fftwf_complex *yb;
+
+  n_times_2 = 2 * n;
+  for (i = 0; i < n; ++i)
+    {
+      yb = &y[i * n_times_2];
+      for (j = 0; j < n_times_2; ++j)
+	{
+	  yr = yb[j][0];
+	  yi = yb[j][1];
+	  yb[j][0] = yr * fft_z[j][0] - yi * fft_z[j][1];
+	  yb[j][1] = yr * fft_z[j][1] + yi * fft_z[j][0];
+	}
+    }
+}
+
+/* CompareStreamedByName orders streamed results by the name of their
+   image, the second field */
+int
+CompareStreamedByName (const char *a, const char *b)
+{
+  a = strchr(a, ' ');
+  b = strchr(b, ' ');
+  if (a == NULL || b == NULL)
+    return(a == NULL ? (b == NULL ? 0 : -1) : 1);
+  for (++a, ++b; *a == *b && *a != ' ' && *a != '\0'; ++a, ++b) ;
+  if (*a == *b)
+    return(0);
+  if (*a == ' ')
+    return(-1);
+  if (*b == ' ')
     return(1);
+  return(*((unsigned char *) a) - *((unsigned char *) b));
 }
 
+/* CompareStreamedByQuality orders streamed results by increasing
+   quality, the first field */
 int
-SortByName (const void *x, const void *y)
+CompareStreamedByQuality (const char *a, const char *b)
 {
-  Result *rx, *ry;
-  rx = (Result *) x;
-  ry = (Result *) y;
-  return(strcmp(rx->pair.imageName, ry->pair.imageName));
+  double qa, qb;
+
+  qa = strtod(a, NULL);
+  qb = strtod(b, NULL);
+  if (qa < qb)
+    return(-1);
+  else if (qa == qb)
+    return(0);
+  else
+    return(1);
 }
 
 void
@@ -2521,6 +3905,9 @@ PackContext ()
     par_pkfloat(c.fracRes[i]);
   par_pkint(c.maxRSCandidates);
   par_pkint(c.maxCandidates);
+  par_pkfloat(c.rsPruneRatio);
+  par_pkfloat(c.stopQuality);
+  par_pkint(c.coarseTranslation);
 
   par_pkfloat(c.minTheta);
   par_pkfloat(c.maxTheta);
@@ -2535,6 +3922,12 @@ PackContext ()
   par_pkint(c.update);
   par_pkint(c.partial);
   par_pkint(c.nWorkers);
+  par_pkint(c.fftwFlags);
+  par_pkint(c.pow2FFT);
+  par_pkstr(c.wisdomName);
+  par_pkint(c.spectrumCacheSize);
+  par_pkint(c.nThreads);
+  par_pkint(c.gpu);
 }
 
 void
@@ -2566,6 +3959,9 @@ UnpackContext ()
     c.fracRes[i] = par_upkfloat();
   c.maxRSCandidates = par_upkint();
   c.maxCandidates = par_upkint();
+  c.rsPruneRatio = par_upkfloat();
+  c.stopQuality = par_upkfloat();
+  c.coarseTranslation = par_upkint();
 
   c.minTheta = par_upkfloat();
   c.maxTheta = par_upkfloat();
@@ -2580,6 +3976,12 @@ UnpackContext ()
   c.update = par_upkint();
   c.partial = par_upkint();
   c.nWorkers = par_upkint();
+  c.fftwFlags = par_upkint();
+  c.pow2FFT = par_upkint();
+  par_upkstr(c.wisdomName);
+  c.spectrumCacheSize = par_upkint();
+  c.nThreads = par_upkint();
+  c.gpu = par_upkint();
 }
 
 void
@@ -2670,26 +4072,6 @@ UnpackResult ()
   par_upkstr(r.message);
 }
 
-size_t
-CountBits (unsigned char *p, size_t n)
-{
-  size_t ii;
-  unsigned char b;
-  size_t sum = 0;
-
-  for (ii = 0; ii < n; ++ii)
-    {
-      b = *p++;
-      while (b != 0)
-	{
-	  if (b & 1)
-	    ++sum;
-	  b >>= 1;
-	}
-    }
-  return(sum);
-}
-
 int
 CreateDirectories (char *fn)
 {
@@ -2804,11 +4186,14 @@ void Log (char *fmt, ...)
 	Error("Could not open log file %s\n", logName);
     }
 
+  /* keep the lines of the threads of a worker whole */
+  flockfile(logFile);
   va_start(args, fmt);
   fprintf(logFile, "%s: ", GetTimestamp(timestamp, 32));
   vfprintf(logFile, fmt, args);
   va_end(args);
   fflush(logFile);
+  funlockfile(logFile);
 }
 
 char *
@@ -0,0 +1,455 @@
+/*
+ *  gen_atlas.c  -  makes the atlas of a stack that inspector opens on:
+ *                  a thumbnail of each section of a pairs file, and
+ *                  the quality of each pair, in one small file
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Acknowledgements:
+ *     Development of this code was supported in part by
+ *       NIH NIGMS grant P41GM103712
+ *
+ *  HISTORY
+ *    2026  Written for inspector's -atlas
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "imio.h"
+#include "atlas.h"
+
+#define LINE_LENGTH	(3 * PATH_MAX + 512)
+
+/* GLOBAL VARIABLES */
+char pairsName[PATH_MAX];
+char inputName[PATH_MAX];
+char outputName[PATH_MAX];
+char mapName[PATH_MAX];		/* if nonempty, the prefix of the maps
+				   whose valid nodes are counted */
+char summaryName[PATH_MAX];	/* if nonempty, the register summary
+				   the energies are taken from */
+char extension[8] = "pgm";
+int thumbnailSize = 128;	/* the largest section is reduced to at
+				   most this many pixels on a side */
+int nThreads = 4;
+
+Atlas atlas;
+char **fileNames;		/* the image file of each section */
+
+/* the sections are handed out to the threads in order */
+int nextSection = 0;
+int failed = 0;
+pthread_mutex_t sectionLock = PTHREAD_MUTEX_INITIALIZER;
+
+int AddSection (char *name);
+void ReadSummary (char *filename);
+void ReadMapStatistics (AtlasPair *p);
+void *ThumbnailThreadMain (void *arg);
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int error;
+  FILE *f;
+  char line[LINE_LENGTH];
+  char imgn[PATH_MAX], refn[PATH_MAX], pairn[PATH_MAX];
+  int v[8];
+  char msg[PATH_MAX + 256];
+  int maxSize;
+  AtlasPair *p;
+  pthread_t *threads;
+  int nSummarized, nMapped;
+  size_t bytes;
+
+  error = 0;
+  pairsName[0] = '\0';
+  inputName[0] = '\0';
+  outputName[0] = '\0';
+  mapName[0] = '\0';
+  summaryName[0] = '\0';
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-pairs") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-pairs error\n");
+	    break;
+	  }
+	strcpy(pairsName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-input") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-input error\n");
+	    break;
+	  }
+	strcpy(inputName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-output") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-output error\n");
+	    break;
+	  }
+	strcpy(outputName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-maps") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-maps error\n");
+	    break;
+	  }
+	strcpy(mapName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-summary") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-summary error\n");
+	    break;
+	  }
+	strcpy(summaryName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-tif") == 0)
+      strcpy(extension, "tif");
+    else if (strcmp(argv[i], "-bmp") == 0)
+      strcpy(extension, "bmp");
+    else if (strcmp(argv[i], "-size") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &thumbnailSize) != 1 ||
+	    thumbnailSize < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-size error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-threads error\n");
+	    break;
+	  }
+      }
+    else
+      {
+	fprintf(stderr, "Unknown option: %s\n", argv[i]);
+	error = 1;
+      }
+
+  if (error)
+    {
+      if (i >= argc)
+	fprintf(stderr, "Incomplete option: %s\n\n", argv[i-1]);
+
+      fprintf(stderr, "Usage: gen_atlas -pairs pairfile -input file_prefix\n");
+      fprintf(stderr, "                 -output atlas_file\n");
+      fprintf(stderr, "                 [-tif] [-bmp]\n");
+      fprintf(stderr, "                 [-maps map_prefix]\n");
+      fprintf(stderr, "                 [-summary register_summary]\n");
+      fprintf(stderr, "                 [-size pixels] [-threads n]\n");
+      exit(1);
+    }
+  if (pairsName[0] == '\0' || outputName[0] == '\0')
+    {
+      fprintf(stderr, "-pairs and -output parameters must be specified.\n");
+      exit(1);
+    }
+
+  /* the pairs file is read as inspector reads it */
+  f = fopen(pairsName, "r");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open pairs file %s\n", pairsName);
+      exit(1);
+    }
+  memset(&atlas, 0, sizeof(Atlas));
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      if (line[0] == '\0' || line[0] == '#')
+	continue;
+      if (sscanf(line, "%s %d %d %d %d %s %d %d %d %d %s",
+		 imgn, &v[0], &v[1], &v[2], &v[3],
+		 refn, &v[4], &v[5], &v[6], &v[7],
+		 pairn) != 11 &&
+	  sscanf(line, "%s %s %s", imgn, refn, pairn) != 3)
+	{
+	  fprintf(stderr, "Invalid line in pairs file %s:\n%s\n",
+		  pairsName, line);
+	  exit(1);
+	}
+      AddSection(imgn);
+      AddSection(refn);
+      if ((atlas.nPairs & 1023) == 0)
+	atlas.pairs = (AtlasPair *) realloc(atlas.pairs,
+					    (atlas.nPairs + 1024) *
+					    sizeof(AtlasPair));
+      p = &atlas.pairs[atlas.nPairs++];
+      memset(p, 0, sizeof(AtlasPair));
+      p->imageName = strdup(imgn);
+      p->refName = strdup(refn);
+      p->pairName = strdup(pairn);
+    }
+  fclose(f);
+  printf("%d pairs of %d sections listed in pairs file.\n",
+	 atlas.nPairs, atlas.nSections);
+
+  /* the one factor the thumbnails are reduced by is the smallest power
+     of 2 that brings the largest section within the thumbnail size */
+  fileNames = (char **) malloc((atlas.nSections + 1) * sizeof(char *));
+  for (i = 0; i < atlas.nSections; ++i)
+    {
+      sprintf(line, "%s%s.%s", inputName, atlas.sections[i].name,
+	      extension);
+      fileNames[i] = strdup(line);
+    }
+  if (!ScanImageSizes(atlas.nSections, fileNames, msg))
+    {
+      fprintf(stderr, "%s", msg);
+      exit(1);
+    }
+  maxSize = 0;
+  for (i = 0; i < atlas.nSections; ++i)
+    {
+      if (!ReadImageSize(fileNames[i], &atlas.sections[i].width,
+			 &atlas.sections[i].height, msg))
+	{
+	  fprintf(stderr, "Could not read size of image %s:\n  %s",
+		  fileNames[i], msg);
+	  exit(1);
+	}
+      if (atlas.sections[i].width > maxSize)
+	maxSize = atlas.sections[i].width;
+      if (atlas.sections[i].height > maxSize)
+	maxSize = atlas.sections[i].height;
+    }
+  atlas.factor = 1;
+  while (maxSize / atlas.factor > thumbnailSize)
+    atlas.factor *= 2;
+  printf("Reducing sections by %d for their thumbnails.\n", atlas.factor);
+
+  threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_create(&threads[i], NULL, ThumbnailThreadMain, NULL) != 0)
+      {
+	fprintf(stderr, "Could not create thumbnail thread\n");
+	exit(1);
+      }
+  for (i = 0; i < nThreads; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  if (failed)
+    exit(1);
+
+  /* the quality of each pair */
+  if (summaryName[0] != '\0')
+    ReadSummary(summaryName);
+  if (mapName[0] != '\0')
+    for (i = 0; i < atlas.nPairs; ++i)
+      ReadMapStatistics(&atlas.pairs[i]);
+  nSummarized = 0;
+  nMapped = 0;
+  for (i = 0; i < atlas.nPairs; ++i)
+    {
+      nSummarized += atlas.pairs[i].summarized;
+      nMapped += atlas.pairs[i].mapped;
+    }
+  if (summaryName[0] != '\0')
+    printf("%d of %d pairs found in summary %s.\n",
+	   nSummarized, atlas.nPairs, summaryName);
+  if (mapName[0] != '\0')
+    printf("%d of %d maps read.\n", nMapped, atlas.nPairs);
+
+  if (!WriteAtlas(outputName, &atlas, msg))
+    {
+      fprintf(stderr, "%s", msg);
+      exit(1);
+    }
+  bytes = 0;
+  for (i = 0; i < atlas.nSections; ++i)
+    bytes += ((size_t) atlas.sections[i].thumbWidth) *
+      atlas.sections[i].thumbHeight;
+  printf("Wrote atlas %s with %llu bytes of thumbnails.\n",
+	 outputName, (unsigned long long) bytes);
+  return(0);
+}
+
+/* AddSection adds the section of that name to the atlas if it is not
+   already there, and returns its index */
+int
+AddSection (char *name)
+{
+  int i;
+
+  for (i = atlas.nSections - 1; i >= 0; --i)
+    if (strcmp(atlas.sections[i].name, name) == 0)
+      return(i);
+  if ((atlas.nSections & 1023) == 0)
+    atlas.sections = (AtlasSection *) realloc(atlas.sections,
+					      (atlas.nSections + 1024) *
+					      sizeof(AtlasSection));
+  i = atlas.nSections++;
+  memset(&atlas.sections[i], 0, sizeof(AtlasSection));
+  atlas.sections[i].name = strdup(name);
+  return(i);
+}
+
+void *
+ThumbnailThreadMain (void *arg)
+{
+  int i;
+  AtlasSection *s;
+  char msg[PATH_MAX + 256];
+
+  for (;;)
+    {
+      pthread_mutex_lock(&sectionLock);
+      i = failed ? atlas.nSections : nextSection++;
+      pthread_mutex_unlock(&sectionLock);
+      if (i >= atlas.nSections)
+	break;
+
+      s = &atlas.sections[i];
+      s->thumbnail = NULL;
+      if (!ReadImageReduced(fileNames[i], atlas.factor, &s->thumbnail,
+			    &s->thumbWidth, &s->thumbHeight, msg))
+	{
+	  pthread_mutex_lock(&sectionLock);
+	  fprintf(stderr, "Could not read image %s:\n  %s",
+		  fileNames[i], msg);
+	  failed = 1;
+	  pthread_mutex_unlock(&sectionLock);
+	  break;
+	}
+    }
+  return(NULL);
+}
+
+/* ReadSummary takes the energy terms of each pair from the "Sorted by
+   slice" table of a register summary, where the pairs are named by
+   their image and reference */
+void
+ReadSummary (char *filename)
+{
+  FILE *f;
+  char line[LINE_LENGTH];
+  char imgn[PATH_MAX], refn[PATH_MAX];
+  double corr, dist, corresp, constr, energy;
+  int i;
+  int inTable;
+  AtlasPair *p;
+
+  f = fopen(filename, "r");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open summary file %s\n", filename);
+      exit(1);
+    }
+  inTable = 0;
+  i = 0;
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      if (!inTable)
+	{
+	  inTable = strncmp(line, "Sorted by slice:", 16) == 0;
+	  continue;
+	}
+      if (strncmp(line, "IMAGE", 5) == 0)
+	continue;
+      if (sscanf(line, "%s %s %lf %lf %lf %lf %lf",
+		 imgn, refn, &corr, &dist, &corresp, &constr, &energy) != 7)
+	break;
+
+      /* the table is usually in the order of the pairs file */
+      if (i >= atlas.nPairs ||
+	  strcmp(atlas.pairs[i].imageName, imgn) != 0 ||
+	  strcmp(atlas.pairs[i].refName, refn) != 0)
+	for (i = 0; i < atlas.nPairs; ++i)
+	  if (strcmp(atlas.pairs[i].imageName, imgn) == 0 &&
+	      strcmp(atlas.pairs[i].refName, refn) == 0)
+	    break;
+      if (i >= atlas.nPairs)
+	{
+	  i = 0;
+	  continue;
+	}
+      p = &atlas.pairs[i++];
+      p->summarized = 1;
+      p->correlation = corr;
+      p->distortion = dist;
+      p->correspondence = corresp;
+      p->constraining = constr;
+      p->energy = energy;
+    }
+  fclose(f);
+}
+
+/* ReadMapStatistics records the fraction of the nodes of the pair's
+   map that are valid (have a positive confidence), and their mean
+   confidence; a pair without a readable map is left unmapped */
+void
+ReadMapStatistics (AtlasPair *p)
+{
+  char fn[PATH_MAX];
+  char imgn[PATH_MAX], refn[PATH_MAX];
+  char msg[PATH_MAX + 256];
+  MapElement *map;
+  int level;
+  int mw, mh;
+  int mxMin, myMin;
+  size_t i, n, nValid;
+  double sum;
+
+  sprintf(fn, "%s%s.map", mapName, p->pairName);
+  map = NULL;
+  if (!ReadMap(fn, &map, &level, &mw, &mh, &mxMin, &myMin,
+	       imgn, refn, msg))
+    {
+      printf("WARNING: Could not read map %s:\n  %s", fn, msg);
+      return;
+    }
+  n = ((size_t) mw) * mh;
+  nValid = 0;
+  sum = 0.0;
+  for (i = 0; i < n; ++i)
+    if (map[i].c > 0.0)
+      {
+	++nValid;
+	sum += map[i].c;
+      }
+  free(map);
+  p->mapped = 1;
+  p->validFraction = n > 0 ? ((double) nValid) / n : 0.0;
+  p->meanConfidence = nValid > 0 ? sum / nValid : 0.0;
+}
@@ -47,15 +47,22 @@
 #include <sched.h>
 #include <limits.h>
 #include <sys/resource.h>
+#include <pthread.h>
 
 #include "imio.h"
 #include "invert.h"
 #include "dt.h"
+#include "prefetch.h"
+#include "exchange.h"
+#include "metrics.h"
 
 #define DEBUG	0
 #define PDEBUG	0
 
 #define LINE_LENGTH	256
+#define HISTOGRAM_BAND_BYTES	(16*1024*1024)	/* target size of each band
+						   of pixels read while
+						   building the histograms */
 
 typedef struct Node
 {
@@ -85,7 +92,9 @@ typedef struct Image
   int gray;		/* gray level for this image */
   int white; 		/* white level for this image */
   Node *nodes;          /* nodes in the image */
-  unsigned char *image; /* image pixels */
+  unsigned char *image; /* image pixels (rows bandY..bandY+bandHeight-1) */
+  int bandY;		/* first image row held in image */
+  int bandHeight;	/* number of image rows held in image */
   unsigned char *mask;  /* mask of valid pixels */
   unsigned int *histogram;   /* histogram of pixel values for the entire image */
   unsigned short *nodeHistograms;
@@ -103,20 +112,29 @@ typedef struct InterImageMap
 
 typedef struct CommPhase
 {
-  int otherProcess;      /* the process to communicate with in this phase;
-			    the lower-numbered process always sends first,
-			    then receives */
+  int otherProcess;      /* the process exchanged with in this phase */
   int nSendImages;	 /* number of images to send */
   int *sendImages;	 /* the images to send */
-  int nSends;            /* number of MPI_Send's */
-  int *nImagesToSend;    /* number of images to send for each MPI_Send */
   int nReceiveImages;    /* number of images to receive */
   int *receiveImages;    /* the images to receive */
-  int nReceives;	 /* number of MPI_Recv's */
-  int *floatsToReceive;  /* number of floats to receive for each MPI_Recv */
-  int *nImagesToReceive; /* number of images to receive for each MPI_Recv */
 } CommPhase;
 
+typedef struct RelaxThread
+{
+  pthread_t thread;
+  int t;                 /* index of this thread */
+  int phase;             /* 0 = node histograms of one image,
+			    1 = spring forces,
+			    2 = add the buffered spring forces
+			        into the nodes,
+			    3 = spring forces of a direction (see
+			        SpringForces) */
+  int image;             /* image whose histograms are built in phase 0 */
+  double energy;         /* energy accumulated by this thread */
+  float *f;              /* spring forces (one per node) accumulated
+			    by this thread */
+} RelaxThread;
+
 int p;      /* rank of this process */
 int np;     /* number of processes in this run */
 
@@ -140,19 +158,43 @@ int mapsPos = 0;
 
 int nPhases;
 CommPhase *commPhases;
-int bufferSize = 0;
-float *buffer = 0;
+Exchange *intensityExchange = NULL;	/* the node values sent to and
+					   received from the other
+					   processes */
 
 int springsSize = 0;
 int nSprings = 0;
 Spring *springs = NULL;
 
+/* the nodes of all images needed in this process, in one block */
+int nAllNodes = 0;
+Node *allNodes = NULL;
+
+/* the springs, sorted by first node and laid out as separate arrays;
+   the nodes are given as indices into allNodes, with springNode1 < 0
+   for a spring that pulls springNode0 toward a fixed value */
+int *springNode0 = NULL;
+int *springNode1 = NULL;
+float *springK = NULL;
+float *springOffset = NULL;
+
+int nThreads = 1;	/* threads building histograms and relaxing springs
+			   in each process */
+RelaxThread *relaxThreads = NULL;
+int readAhead = 0;	/* number of images (or bands of one) to read in
+			   the background ahead of the one being used */
+int memoryLimit = 0;	/* MB that what is read ahead may take, or 0
+			   for no limit */
+
 FILE *logFile = 0;
 
 float levelK = 1.0;
 float intraimageK = 1.0;
 float interimageK = 10.0;
 float threshold = 1.0;  /* ppm change per iteration */
+int conjugateGradient = 0;	/* relax the springs by preconditioned
+				   conjugate gradients rather than by
+				   damped force steps */
 
 int level = 6;
 int spacing;		/* 2^level = pixels between intensity map points in x and y */
@@ -164,9 +206,28 @@ void Error (char *fmt, ...);
 void Log (char *fmt, ...);
 void PlanCommunications ();
 void CommunicateIntensities ();
+void PackIntensities (int its, float *v);
+void UnpackIntensities (int its, float *v);
 unsigned int Hash (char *s);
 unsigned int HashMap (char *s, int nx, int ny);
 int CreateDirectories (char *fn);
+int IsTiffFile (char *fn);
+unsigned char *ReadMask (int i);
+void LoadImage (int i);
+void PrefetchMapImages (int i);
+int HistogramBandRows (char *fn, int width, int ny);
+void PrefetchFirstBand (int i);
+void FreeImage (int i);
+void NodeHistograms (int i, int rowOffset, int rowStep);
+void LayOutSprings ();
+int CompareSprings (const void *a, const void *b);
+void SpringForces (int first, int last, float *f, int stride,
+		   int direction, double *pEnergy);
+void NodeForces (int direction, double *pEnergy);
+int SolveSprings ();
+double GlobalSum (double v);
+void RunRelaxThreads (int phase, int image, double *pEnergy);
+void *RelaxThreadMain (void *arg);
 
 
 int
@@ -194,7 +255,6 @@ main (int argc, char **argv)
   float deltaX, deltaY;
   float nomD;
   float d;
-  float force;
   float kdx, kdy;
   float dampingFactor;
   MPI_Status status;
@@ -205,7 +265,6 @@ main (int argc, char **argv)
   unsigned char red, green, blue;
   float mag;
   int nNodes;
-  int nFloats;
   Node *p00, *p10, *p01, *p11;
   float kIntraThisImage;
   struct stat sb;
@@ -283,14 +342,13 @@ main (int argc, char **argv)
   int mx, my;
   float msk;
   float sk;
-  size_t mbpl, mbpl0, mbpl1;
-  unsigned char *mask, *mask0, *mask1;
+  size_t mbpl0, mbpl1;
+  unsigned char *mask0, *mask1;
   int minIter;
   int rnx, rny;
   int valid;
   int ix, iy;
   int count;
-  int maskWidth, maskHeight;
   int ixMin, ixMax, iyMin, iyMax;
 
   unsigned short *nh;
@@ -333,9 +391,9 @@ main (int argc, char **argv)
   int nPixels;
   double sum;
   float x0, y0;
-  Spring *s;
 
   int ni, nix, niy, nlv;
+  int bandRows;
   float lvl0, lvl1, lvl;
 
   /* DECLS */
@@ -357,6 +415,8 @@ main (int argc, char **argv)
   logFile = fopen(fn, "w");
   gethostname(hostName, 255);
   Log("Process %d is running on %s\n", p, hostName);
+  MetricsInit("gen_imaps");
+  MetricsSetProcess(p);
   memset(dirHash, 0, DIR_HASH_SIZE * sizeof(char*));
   if (p == 0)
     {
@@ -434,6 +494,38 @@ main (int argc, char **argv)
 		break;
 	      }
 	  }
+	else if (strcmp(argv[i], "-threads") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &nThreads) != 1 ||
+		nThreads < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-read_ahead") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &readAhead) != 1 ||
+		readAhead < 0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-memory") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &memoryLimit) != 1 ||
+		memoryLimit < 0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-cg") == 0)
+	  conjugateGradient = 1;
 	else
 	  {
 	    fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
@@ -447,6 +539,10 @@ main (int argc, char **argv)
 	  fprintf(stderr, "              -images images_prefix\n");
 	  fprintf(stderr, "              -output output_prefix\n");
 	  fprintf(stderr, "             [-map_list maps_file]\n");
+	  fprintf(stderr, "             [-threads threads_per_process]\n");
+	  fprintf(stderr, "             [-read_ahead number_of_images]\n");
+	  fprintf(stderr, "             [-memory read_ahead_limit_in_MB]\n");
+	  fprintf(stderr, "             [-cg]\n");
 	  exit(1);
 	}
       
@@ -471,9 +567,18 @@ main (int argc, char **argv)
       MPI_Bcast(mapsName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(masksName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(outputName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
-      MPI_Bcast(&level, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+      MPI_Bcast(&level, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&nThreads, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&readAhead, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&memoryLimit, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&conjugateGradient, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
     Error("Broadcast of parameters failed.\n");
   spacing = 1 << level;
+  if (readAhead > 0 &&
+      !StartPrefetching(readAhead < 4 ? readAhead : 4,
+			memoryLimit > 0 ? ((size_t) memoryLimit) * 1000000 :
+			(size_t) -1))
+    Error("Could not start read-ahead threads\n");
 
   if (p == 0)
     {
@@ -545,6 +650,8 @@ main (int argc, char **argv)
       images[i].white = 0;
       images[i].nodes = 0;
       images[i].image = NULL;
+      images[i].bandY = 0;
+      images[i].bandHeight = 0;
       images[i].mask = NULL;
       images[i].histogram = NULL;
       images[i].nodeHistograms = NULL;
@@ -664,13 +771,8 @@ main (int argc, char **argv)
 	cp->otherProcess = -1;
       cp->nSendImages = 0;
       cp->sendImages = NULL;
-      cp->nSends = 0;
-      cp->nImagesToSend = NULL;
       cp->nReceiveImages = 0;
       cp->receiveImages = NULL;
-      cp->nReceives = 0;
-      cp->floatsToReceive = NULL;
-      cp->nImagesToReceive = NULL;
     }
 
   if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
@@ -789,9 +891,6 @@ main (int argc, char **argv)
 					       cp->nSendImages * sizeof(int));
 	      cp->sendImages[cp->nSendImages-1] = i;
 	    }
-	nFloats = 2 * images[i].nx * images[i].ny;
-	if (nFloats > bufferSize)
-	  bufferSize = nFloats;
       }
     else if (images[i].needed)
       {
@@ -806,13 +905,7 @@ main (int argc, char **argv)
 	cp->receiveImages = (int *) realloc(cp->receiveImages,
 					    cp->nReceiveImages * sizeof(int));
 	cp->receiveImages[cp->nReceiveImages-1] = i;
-	nFloats = 2 * images[i].nx * images[i].ny;
-	if (nFloats > bufferSize)
-	  bufferSize = nFloats;
       }
-  if (bufferSize < 4096*1024)
-    bufferSize = 4096*1024;
-  buffer = (float *) malloc(bufferSize * sizeof(float));
   
   /* eliminate unnecessary phases */
   Log("Eliminating unnecessary phases\n");
@@ -839,9 +932,12 @@ main (int argc, char **argv)
   free(phaseCount);
   free(globalPhaseCount);
 
-  /* read the images and masks; also build the histograms */
+  /* build the histograms, streaming each image through memory in
+     bands; the pixels are read again only while making the inter-image
+     springs */
   Log("Reading images and masks\n");
   Log("spacing = %d\n", spacing);
+  MetricsPhase(METRICS_READ);
   memset(dgh, 0, 256*sizeof(double));
   for (i = 0; i < nImages; ++i)
     {
@@ -849,44 +945,11 @@ main (int argc, char **argv)
 	continue;
       sprintf(fn, "%s%s", imagesName, images[i].name);
       Log("Reading image %s\n", fn);
-      if (!ReadImage(fn, &image, &imageWidth, &imageHeight,
-		     -1, -1, -1, -1, msg))
-	Error("Could not read image file %s:\n%s\n", fn, msg);
-      images[i].image = image;
+      if (!ReadImageSize(fn, &imageWidth, &imageHeight, msg))
+	Error("Could not read size of image file %s:\n%s\n", fn, msg);
       images[i].width = imageWidth;
       images[i].height = imageHeight;
-      mask = NULL;
-      if (masksName[0] != '\0')
-	{
-	  /* read the mask from a file */
-	  sprintf(fn, "%s%s.pbm", masksName, images[i].name);
-	  Log("Reading mask %s\n", fn);
-	  if (ReadBitmap(fn, &mask, &maskWidth, &maskHeight,
-			 -1, -1, -1, -1,
-			 msg))
-	    {
-	      Log("Read mask %s  -- width=%d height=%d\n",
-		  fn, maskWidth, maskHeight);
-	      if (maskWidth != imageWidth ||
-		  maskHeight != imageHeight)
-		Error("Mask %s is not same size as image %s  %d %d %d %d\n",
-		      fn, images[i].name,
-		      maskWidth, maskHeight, imageWidth, imageHeight);
-	      mbpl = (maskWidth + 7) >> 3;
-	    }
-	  else
-	    Log("WARNING: could not read mask %s -- assuming unmasked image.\n",
-		fn);
-	}
-      if (mask == NULL)
-	{
-	  maskWidth = images[i].width;
-	  maskHeight = images[i].height;
-	  mbpl = (maskWidth + 7) >> 3;
-	  mask = (unsigned char *) malloc(maskHeight * mbpl);
-	  memset(mask, 0xff, maskHeight * mbpl);
-	}
-      images[i].mask = mask;
+      images[i].mask = ReadMask(i);
       images[i].nx = nx = (imageWidth + spacing-1) / spacing + 1;
       images[i].ny = ny = (imageHeight + spacing-1) / spacing + 1;
 
@@ -894,25 +957,37 @@ main (int argc, char **argv)
       images[i].nodeHistograms = nodeHistograms =
 	(unsigned short *) malloc((ny - 1) * (nx - 1) * 256 * sizeof(unsigned short));
       memset(nodeHistograms, 0, (ny - 1) * (nx - 1) * 256 * sizeof(unsigned short));
-      for (iy = 0; iy < ny-1; ++iy)
-	for (ix = 0; ix < nx-1; ++ix)
-	  {
-	    nh = &nodeHistograms[(iy * (nx-1) + ix) * 256];
-	    for (dy = 0; dy < spacing; ++dy)
-	      {
-		y = iy *spacing + dy;
-		if (y >= imageHeight)
-		  break;
-		for (dx = 0; dx < spacing; ++dx)
-		  {
-		    x = ix * spacing + dx;
-		    if (x >= imageWidth)
-		      break;
-		    if (mask[y*mbpl+(x >> 3)] & (0x80 >> (x & 7)))
-		      ++nh[image[y*imageWidth+x]];
-		  }
-	      }
-	  }
+
+      bandRows = HistogramBandRows(fn, imageWidth, ny);
+      for (iy = 0; iy < ny-1; iy += bandRows)
+	{
+	  y = iy * spacing;
+	  n = bandRows * spacing;
+	  if (y + n > imageHeight)
+	    n = imageHeight - y;
+	  /* decode the next band while this one is histogrammed, or,
+	     for the last band, the first band of the next image */
+	  if (readAhead > 0 && iy + bandRows < ny - 1)
+	    PrefetchImage(fn, 0, imageWidth-1, y + n,
+			  (iy + 2 * bandRows) * spacing < imageHeight ?
+			  (iy + 2 * bandRows) * spacing - 1 : imageHeight-1);
+	  else if (readAhead > 0)
+	    PrefetchFirstBand(i);
+	  if (!TakeImage(fn, &image, &width, &height,
+			 0, imageWidth-1, y, y+n-1, msg))
+	    Error("Could not read image file %s:\n%s\n", fn, msg);
+	  images[i].image = image;
+	  images[i].bandY = y;
+	  images[i].bandHeight = n;
+	  if (nThreads > 1)
+	    RunRelaxThreads(0, i, NULL);
+	  else
+	    NodeHistograms(i, 0, 1);
+	  free(image);
+	  images[i].image = NULL;
+	}
+      FreeImage(i);
+      MetricsCount("images_read", 1);
 
       /* combine these into a histogram for the entire image */
       images[i].histogram = ih =
@@ -968,6 +1043,23 @@ main (int argc, char **argv)
     Error("MPI_Barrier after cpi failed.\n");
   Log("After node init barrier\n");
 
+  /* lay out the nodes of all needed images in one block, so that
+     the springs can refer to them by index */
+  nAllNodes = 0;
+  for (i = 0; i < nImages; ++i)
+    if (images[i].owner == p || images[i].needed)
+      nAllNodes += 2 * images[i].nx * images[i].ny;
+  allNodes = (Node *) malloc(nAllNodes * sizeof(Node));
+  if (allNodes == NULL && nAllNodes > 0)
+    Error("Could not allocate %d nodes.\n", nAllNodes);
+  n = 0;
+  for (i = 0; i < nImages; ++i)
+    if (images[i].owner == p || images[i].needed)
+      {
+	images[i].nodes = &allNodes[n];
+	n += 2 * images[i].nx * images[i].ny;
+      }
+
   /* initialize the image nodes */
   for (i = 0; i < nImages; ++i)
     {
@@ -1006,7 +1098,7 @@ main (int argc, char **argv)
       nx = images[i].nx;
       ny = images[i].ny;
       nodeHistograms = images[i].nodeHistograms;
-      images[i].nodes = nodes = (Node*) malloc(2 * ny * nx * sizeof(Node));
+      nodes = images[i].nodes;
       if (images[i].owner != p)
 	{
 	  memset(nodes, 0, 2 * nx * ny * sizeof(Node));
@@ -1089,8 +1181,14 @@ main (int argc, char **argv)
   /* initialize the maps that are needed */
   for (i = 0; i < nMaps; ++i)
     {
+      /* read the next maps while the springs of this one are made */
+      for (j = i + 1; readAhead > 0 && j < nMaps && j <= i + readAhead; ++j)
+	{
+	  sprintf(fn, "%s%s.map", mapsName, maps[j].name);
+	  PrefetchMap(fn);
+	}
       sprintf(fn, "%s%s.map", mapsName, maps[i].name);
-      if (!ReadMap(fn, &map, &mLevel,
+      if (!TakeMap(fn, -1, &map, &mLevel,
 		   &mw, &mh, &mxMin, &myMin,
 		   imName0, imName1,
 		   msg))
@@ -1103,6 +1201,21 @@ main (int argc, char **argv)
       nInterSpringsWhite = 0;
       Log("Constructing inter-image springs for map %s\n", maps[i].name);
       
+      /* hold the pixels of only the two images joined by this map */
+      if (i > 0)
+	{
+	  if (maps[i-1].image0 != maps[i].image0 &&
+	      maps[i-1].image0 != maps[i].image1)
+	    FreeImage(maps[i-1].image0);
+	  if (maps[i-1].image1 != maps[i].image0 &&
+	      maps[i-1].image1 != maps[i].image1)
+	    FreeImage(maps[i-1].image1);
+	}
+      LoadImage(maps[i].image0);
+      LoadImage(maps[i].image1);
+      if (readAhead > 0)
+	PrefetchMapImages(i);
+
       //		  ++steps[1];
       i0 = maps[i].image0;
       nx0 = images[i0].nx;
@@ -1429,12 +1542,27 @@ main (int argc, char **argv)
       FreeInverseMap(iMap);
       free(map);
     }
+  if (nMaps > 0)
+    {
+      FreeImage(maps[nMaps-1].image0);
+      FreeImage(maps[nMaps-1].image1);
+    }
 
   /* set up communications with other nodes */
   PlanCommunications();
 
+  LayOutSprings();
+
   /* relax the spring system */
   Log("Starting relaxation iterations.\n");
+  MetricsPhase(METRICS_OTHER);
+  MetricsEmit("setup", 0);
+  MetricsPhase(METRICS_COMPUTE);
+  if (conjugateGradient)
+    {
+      iter = SolveSprings();
+      goto relaxed;
+    }
   dampingFactor = 0.1;
   epochIterations = 512;
   terminationRequestedIter = -1;
@@ -1450,6 +1578,8 @@ main (int argc, char **argv)
 #if DEBUG
       Log("Starting iteration %d\n", iter);
 #endif
+      MetricsCount("iterations", 1);
+      MetricsGauge("iteration", iter);
       CommunicateIntensities();
 
       /* update all forces, also computing energy */
@@ -1485,46 +1615,10 @@ main (int argc, char **argv)
       //      Log("FX 0: %f\n", images[2].nodes[98*74+34*98+41].fx);
 
       /* update all forces, also computing energy */
-      for (i = 0; i < nSprings; ++i)
-	{
-	  s = &springs[i];
-	  if (s->node1 == NULL)
-	    {
-	      if (isnan(s->offset) || isnan(s->node0->x) || isnan(s->k))
-		{
-		  Log("invalid value: %f %f %f %d\n",
-		      s->offset, s->node0->x, s->k, i);
-		  exit(1);
-		}
-	      delta = s->offset - s->node0->x;
-	      force = s->k * delta;
-	      s->node0->fx += force;
-	      energy += force * delta;
-	    }
-	  else
-	    {
-	      if (isnan(s->offset) || isnan(s->node0->x) || isnan(s->node1->x) || isnan(s->k))
-		{
-		  Log("invalid value: %f %f %f %f %d\n",
-		      s->offset, s->node0->x, s->node1->x, s->k, i);
-		  exit(1);
-		}
-	      delta = s->node1->x - s->node0->x - s->offset;
-	      force = s->k * delta;
-	      s->node0->fx += force;
-	      s->node1->fx -= force;
-	      energy += force * delta;
-#if 0
-	      if ((i & ~1) == 234452)
-		Log("iter %d spr %d: %f %f %f %f  %f %f  %f %f\n",
-		    iter, i,
-		    s->offset, s->node0->x, s->node1->x, s->k,
-		    delta, force,
-		    s->node0->fx,
-		    s->node1->fx);
-#endif
-	    }
-	}
+      if (nThreads > 1)
+	RunRelaxThreads(1, -1, &energy);
+      else
+	SpringForces(0, nSprings, &(allNodes[0].fx), 2, 0, &energy);
 
       //      Log("FX 1: %f\n", images[2].nodes[98*74+34*98+41].fx);
 
@@ -1619,6 +1713,7 @@ main (int argc, char **argv)
       if (MPI_Allreduce(&energy, &totalEnergy, 1, MPI_DOUBLE,
 			MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
 	Error("Could not sum up energies.\n");
+      MetricsGauge("energy", totalEnergy);
       /*	  if (p == 0 && (iter % 1000) == 999) */
       if (p == 0 && iter % 100 == 0)
 	Log("After %d iterations, total energy is %f  (df = %f mgf = %f)\n",
@@ -1683,8 +1778,12 @@ main (int argc, char **argv)
 	  (nDecrease == 32 || iter > terminationRequestedIter + 128))
 	break;
     }
+ relaxed:
   if (p == 0)
     Log("Finished intensity adjustment at iteration %d.\n", iter);
+  MetricsPhase(METRICS_OTHER);
+  MetricsEmit("relax", iter);
+  MetricsPhase(METRICS_WRITE);
       
   /* output the intensity maps */
   for (i = myFirstImage; i <= myLastImage; ++i)
@@ -1721,6 +1820,7 @@ main (int argc, char **argv)
     }
 
   Log("FINALIZING\n");
+  MetricsClose();
   MPI_Finalize();
   fclose(logFile);
   return(0);
@@ -1756,206 +1856,90 @@ void Log (char *fmt, ...)
   fflush(logFile);
 }
 
+/* PlanCommunications sets up the exchange of the node values of the
+   images that this process owns and others need, and of those it
+   needs from others; the images of each phase go into the single
+   message to or from its other process, in the same order on both
+   sides */
 void
 PlanCommunications ()
 {
   int phase;
   CommPhase *cp;
-  int bufferPos;
-  int i, j, k;
-  int nFloats;
+  int i, j;
+  char msg[PATH_MAX+256];
 
   Log("Planning communication\n");
+  if (intensityExchange == NULL &&
+      (intensityExchange = CreateExchange(MPI_COMM_WORLD, 0)) == NULL)
+    Error("Could not allocate intensity exchange\n");
+  ResetExchange(intensityExchange);
   for (phase = 0; phase < nPhases; ++phase)
     {
-      // schedule the communication of positions between processors
       cp = &(commPhases[phase]);
-
-      // first, the sends
-      cp->nSends = 0;
-      bufferPos = 0;
-      k = 0;
+      if (cp->otherProcess < 0)
+	continue;
       for (i = 0; i < cp->nSendImages; ++i)
 	{
 	  j = cp->sendImages[i];
-	  nFloats = 2 * images[j].nx * images[j].ny;
-	  if (bufferPos + nFloats > bufferSize)
-	    {
-	      ++(cp->nSends);
-	      cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
-						  cp->nSends * sizeof(int));
-	      cp->nImagesToSend[cp->nSends-1] = k;
-	      Log("In phase %d will send %d images to %d in a message of %d floats\n",
-		  phase, k, cp->otherProcess, bufferPos);
-	      k = 0;
-	      bufferPos = 0;
-	    }
-	  bufferPos += nFloats;
-	  ++k;
+	  if (!AddExchangeSend(intensityExchange, cp->otherProcess, j,
+			       2 * images[j].nx * images[j].ny))
+	    Error("Could not allocate intensity exchange\n");
 	}
-      if (k > 0)
-	{
-	  ++(cp->nSends);
-	  cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
-					      cp->nSends * sizeof(int));
-	  cp->nImagesToSend[cp->nSends-1] = k;
-	  Log("In phase %d will send %d images to %d in a final message of %d floats\n",
-	      phase, k, cp->otherProcess, bufferPos);
-	}
-
-      // next, the receives
-      cp->nReceives = 0;
-      bufferPos = 0;
-      k = 0;
       for (i = 0; i < cp->nReceiveImages; ++i)
 	{
 	  j = cp->receiveImages[i];
-	  nFloats = 2 * images[j].nx * images[j].ny;
-	  if (bufferPos + nFloats > bufferSize)
-	    {
-	      ++(cp->nReceives);
-	      cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
-						    cp->nReceives * sizeof(int));
-	      cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
-						  cp->nReceives * sizeof(int));
-	      cp->floatsToReceive[cp->nReceives-1] = bufferPos;
-	      cp->nImagesToReceive[cp->nReceives-1] = k;
-	      Log("In phase %d will receive %d images from %d in a message of %d floats\n",
-		  phase, k, cp->otherProcess, bufferPos);
-	      k = 0;
-	      bufferPos = 0;
-	    }
-	  bufferPos += nFloats;
-	  ++k;
-	}
-      if (k > 0)
-	{
-	  ++(cp->nReceives);
-	  cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
-						cp->nReceives * sizeof(int));
-	  cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
-						 cp->nReceives * sizeof(int));
-	  cp->floatsToReceive[cp->nReceives-1] = bufferPos;
-	  cp->nImagesToReceive[cp->nReceives-1] = k;
-	  Log("In phase %d will receive %d images from %d in a final message of %d floats\n",
-	      phase, k, cp->otherProcess, bufferPos);
+	  if (!AddExchangeReceive(intensityExchange, cp->otherProcess, j,
+				  2 * images[j].nx * images[j].ny))
+	    Error("Could not allocate intensity exchange\n");
 	}
+      Log("In phase %d will send %d images to and receive %d images from %d\n",
+	  phase, cp->nSendImages, cp->nReceiveImages, cp->otherProcess);
     }
+  if (!PlanExchange(intensityExchange, msg))
+    Error("%s", msg);
 }
 
-
+/* CommunicateIntensities sends the node values of the images this
+   process owns to the processes that need them, and receives those
+   this process needs, all at once */
 void
 CommunicateIntensities ()
 {
-  /* communicate image positions to other nodes */
-  //      (min(a,b) / sep) & 1 == 0  : first phase
-  //      (min(a,b) / sep) & 1 == 1  : second phase
-  
-  //	  0-1,2-3,4-5,6-7,8-9,10-11,12-13      0,2,4,6,8,10,12
-  //        1-2,3-4,5-6,7-8,9-10,11-12,13-14   1,3,5,7,9,11,13
-  //      sep 1, 
-
-  //      0-2,1-3,4-6,5-7,8-10,9-11,12-14      0,1,4,5,8,9,12
-  //      2-4,3-5,6-8,7-9,10-12,11-13          2,3,6,7,10,11
-  //      sep 2
-
-  //      0-3,1-4,2-5,6-9,7-10,8-11            0,1,2,6,7,8
-  //      3-6,4-7,5-8,9-12,10-13,11-14         3,4,5,9,10,11
-  
-  //      0-4,1-5,2-6,3-7,8-12,9-13,10-14
-  //      4-8,5-9,6-10,7-11
-
-  //      0-5,1-6,2-7,3-8,4-9
-  //      5-10,6-11,7-12,8-13,9-14
-
-  //      0-6,1-7,2-8,3-9,4-10,5-11
-  //      6-12,7-13,8-14
-
-  //      0-7,1-8,2-9,3-10,4-11,5-12,6-13
-  //      7-14
-
-  //      0-8,1-9,2-10,3-11,4-12,5-13,6-14
-  //      none
-
-  //      0-9,1-10,2-11,3-12,4-13,5-14
-  //      none
-
-  //      0-10,1-11,2-12,3-13,4-14
-  //      none
+  char msg[PATH_MAX+256];
 
-  //      0-11,1-12,2-13,3-14
-  //      none
+  if (!StartExchange(intensityExchange, PackIntensities, msg) ||
+      !FinishExchange(intensityExchange, UnpackIntensities, msg))
+    Error("%s", msg);
+}
 
-  //      0-12,1-13,2-14
-  //      none
+/* PackIntensities and UnpackIntensities copy the values of the nodes
+   of image its (both the black and the white ones) to and from the
+   values of an exchange */
+void
+PackIntensities (int its, float *v)
+{
+  int k;
+  int nNodes;
+  Node *nodes;
 
-  //      0-13,1-14
-  //      none
+  nNodes = 2 * images[its].nx * images[its].ny;
+  nodes = images[its].nodes;
+  for (k = 0; k < nNodes; ++k)
+    *v++ = nodes[k].x;
+}
 
-  //      0-14
-  //      none
-  int phase;
-  int op;
-  int subPhase;
-  int i, j, k;
-  int jj;
-  int bufferPos;
+void
+UnpackIntensities (int its, float *v)
+{
+  int k;
   int nNodes;
-  int its;
   Node *nodes;
-  MPI_Status status;
 
-  for (phase = 0; phase < nPhases; ++phase)
-    {
-      if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
-	Error("MPI_Barrier() failed.\n");
-      op = commPhases[phase].otherProcess;
-      if (op < 0)
-	continue;
-      for (subPhase = 0; subPhase < 2; ++subPhase)
-	{
-	  if (subPhase ^ (p < op))
-	    {
-	      /* send */
-	      for (i = 0; i < commPhases[phase].nSends; ++i)
-		{
-		  jj = 0;
-		  bufferPos = 0;
-		  for (j = 0; j < commPhases[phase].nImagesToSend[i]; ++j, ++jj)
-		    {
-		      its = commPhases[phase].sendImages[jj];
-		      nNodes = 2 * images[its].nx * images[its].ny;
-		      nodes = images[its].nodes;
-		      for (k = 0; k < nNodes; ++k)
-			buffer[bufferPos++] = nodes[k].x;
-		    }
-		  if (MPI_Send(buffer, bufferPos, MPI_FLOAT,
-			       op, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
-		    Error("Could not send to process %d\n", op);
-		}
-	    }
-	  else
-	    {
-	      /* receive */
-	      for (i = 0; i < commPhases[phase].nReceives; ++i)
-		{
-		  if (MPI_Recv(buffer, commPhases[phase].floatsToReceive[i], MPI_FLOAT,
-			       op, 0, MPI_COMM_WORLD, &status) != MPI_SUCCESS)
-		    Error("Could not receive from process %d\n", op);
-		  jj = 0;
-		  bufferPos = 0;
-		  for (j = 0; j < commPhases[phase].nImagesToReceive[i]; ++j, ++jj)
-		    {
-		      its = commPhases[phase].receiveImages[jj];
-		      nNodes = 2 * images[its].nx * images[its].ny;
-		      nodes = images[its].nodes;
-		      for (k = 0; k < nNodes; ++k)
-			nodes[k].x =  buffer[bufferPos++];
-		    }
-		}
-	    }
-	}
-    }
+  nNodes = 2 * images[its].nx * images[its].ny;
+  nodes = images[its].nodes;
+  for (k = 0; k < nNodes; ++k)
+    nodes[k].x = *v++;
 }
 
 unsigned int
@@ -2045,3 +2029,596 @@ CreateDirectories (char *fn)
     }
   return(1);
 }
+
+/* IsTiffFile returns 1 if the image file fn (whose name may omit the
+   extension, as allowed by ReadImage) is in TIFF format */
+int
+IsTiffFile (char *fn)
+{
+  static char *tiffExtensions[4] = { ".tif", ".tiff", ".TIF", ".TIFF" };
+  char tfn[PATH_MAX];
+  struct stat sb;
+  int len;
+  int i;
+
+  len = strlen(fn);
+  if ((len > 4 && strcasecmp(&fn[len-4], ".tif") == 0) ||
+      (len > 5 && strcasecmp(&fn[len-5], ".tiff") == 0))
+    return(1);
+  for (i = 0; i < 4; ++i)
+    {
+      sprintf(tfn, "%s%s", fn, tiffExtensions[i]);
+      if (stat(tfn, &sb) == 0)
+	return(1);
+    }
+  return(0);
+}
+
+/* ReadMask reads the mask of image i, or, if there is none, makes one
+   that marks every pixel as valid */
+unsigned char *
+ReadMask (int i)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  unsigned char *mask;
+  int maskWidth, maskHeight;
+  size_t mbpl;
+
+  mask = NULL;
+  if (masksName[0] != '\0')
+    {
+      /* read the mask from a file */
+      sprintf(fn, "%s%s.pbm", masksName, images[i].name);
+      Log("Reading mask %s\n", fn);
+      if (ReadBitmap(fn, &mask, &maskWidth, &maskHeight,
+		     -1, -1, -1, -1,
+		     msg))
+	{
+	  Log("Read mask %s  -- width=%d height=%d\n",
+	      fn, maskWidth, maskHeight);
+	  if (maskWidth != images[i].width ||
+	      maskHeight != images[i].height)
+	    Error("Mask %s is not same size as image %s  %d %d %d %d\n",
+		  fn, images[i].name,
+		  maskWidth, maskHeight, images[i].width, images[i].height);
+	}
+      else
+	Log("WARNING: could not read mask %s -- assuming unmasked image.\n",
+	    fn);
+    }
+  if (mask == NULL)
+    {
+      mbpl = (images[i].width + 7) >> 3;
+      mask = (unsigned char *) malloc(images[i].height * mbpl);
+      memset(mask, 0xff, images[i].height * mbpl);
+    }
+  return(mask);
+}
+
+/* LoadImage reads all the pixels and the mask of image i, if they are
+   not already in memory */
+void
+LoadImage (int i)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  int w, h;
+
+  if (images[i].image != NULL)
+    return;
+  sprintf(fn, "%s%s", imagesName, images[i].name);
+  Log("Reading image %s\n", fn);
+  if (!TakeImage(fn, &(images[i].image), &w, &h,
+		 -1, -1, -1, -1, msg))
+    Error("Could not read image file %s:\n%s\n", fn, msg);
+  if (w != images[i].width || h != images[i].height)
+    Error("Image %s changed size while being read.\n", fn);
+  images[i].bandY = 0;
+  images[i].bandHeight = h;
+  images[i].mask = ReadMask(i);
+}
+
+/* PrefetchMapImages asks for the images of the readAhead maps after
+   map i that are not in memory to be read in the background */
+void
+PrefetchMapImages (int i)
+{
+  int j;
+  char fn[PATH_MAX];
+
+  for (j = i + 1; j < nMaps && j <= i + readAhead; ++j)
+    {
+      if (images[maps[j].image0].image == NULL)
+	{
+	  sprintf(fn, "%s%s", imagesName, images[maps[j].image0].name);
+	  PrefetchImage(fn, -1, -1, -1, -1);
+	}
+      if (images[maps[j].image1].image == NULL)
+	{
+	  sprintf(fn, "%s%s", imagesName, images[maps[j].image1].name);
+	  PrefetchImage(fn, -1, -1, -1, -1);
+	}
+    }
+}
+
+/* HistogramBandRows returns the rows of nodes in each band of image
+   file fn (of the given width, and ny rows of nodes) read while
+   building the histograms; only TIFF files can be decoded in part, so
+   other formats are read as a single band */
+int
+HistogramBandRows (char *fn, int width, int ny)
+{
+  int bandRows;
+
+  bandRows = ny - 1;
+  if (IsTiffFile(fn))
+    {
+      bandRows = HISTOGRAM_BAND_BYTES / ((size_t) spacing * width);
+      if (bandRows < 1)
+	bandRows = 1;
+    }
+  return(bandRows);
+}
+
+/* PrefetchFirstBand asks for the first band of the next image after
+   image i whose histograms this process builds to be read in the
+   background */
+void
+PrefetchFirstBand (int i)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  int w, h;
+  int ny;
+  int n;
+
+  for (++i; i < nImages; ++i)
+    if (images[i].owner == p || images[i].needed)
+      break;
+  if (i >= nImages)
+    return;
+  sprintf(fn, "%s%s", imagesName, images[i].name);
+  if (!ReadImageSize(fn, &w, &h, msg))
+    return;	/* reported when the image itself is read */
+  ny = (h + spacing-1) / spacing + 1;
+  n = HistogramBandRows(fn, w, ny) * spacing;
+  if (n > h)
+    n = h;
+  PrefetchImage(fn, 0, w-1, 0, n-1);
+}
+
+void
+FreeImage (int i)
+{
+  free(images[i].image);
+  images[i].image = NULL;
+  images[i].bandHeight = 0;
+  free(images[i].mask);
+  images[i].mask = NULL;
+}
+
+/* NodeHistograms adds the valid pixels held in images[i].image into the
+   histograms of the nodes they fall under, taking the rows of nodes
+   within the band with the given offset and step, so that threads can
+   divide up the band */
+void
+NodeHistograms (int i, int rowOffset, int rowStep)
+{
+  int x, y;
+  int ix, iy;
+  int dx, dy;
+  int nx, ny;
+  int width;
+  int y0, y1;
+  int firstRow, lastRow;
+  size_t mbpl;
+  unsigned char *image;
+  unsigned char *mask;
+  unsigned short *nh;
+
+  nx = images[i].nx;
+  ny = images[i].ny;
+  width = images[i].width;
+  image = images[i].image;
+  mask = images[i].mask;
+  mbpl = (width + 7) >> 3;
+  y0 = images[i].bandY;
+  y1 = y0 + images[i].bandHeight;
+  firstRow = y0 / spacing;
+  lastRow = (y1 + spacing - 1) / spacing;
+  if (lastRow > ny-1)
+    lastRow = ny-1;
+  for (iy = firstRow + rowOffset; iy < lastRow; iy += rowStep)
+    for (ix = 0; ix < nx-1; ++ix)
+      {
+	nh = &images[i].nodeHistograms[(iy * (nx-1) + ix) * 256];
+	for (dy = 0; dy < spacing; ++dy)
+	  {
+	    y = iy * spacing + dy;
+	    if (y >= y1)
+	      break;
+	    for (dx = 0; dx < spacing; ++dx)
+	      {
+		x = ix * spacing + dx;
+		if (x >= width)
+		  break;
+		if (mask[y*mbpl+(x >> 3)] & (0x80 >> (x & 7)))
+		  ++nh[image[(y - y0)*width+x]];
+	      }
+	  }
+      }
+}
+
+/* LayOutSprings converts the springs into the index-based arrays
+   springNode0, springNode1, springK, and springOffset, sorted by
+   first node so that a contiguous run of springs touches a compact
+   range of nodes */
+void
+LayOutSprings ()
+{
+  int i;
+
+  qsort(springs, nSprings, sizeof(Spring), CompareSprings);
+  springNode0 = (int *) malloc(nSprings * sizeof(int));
+  springNode1 = (int *) malloc(nSprings * sizeof(int));
+  springK = (float *) malloc(nSprings * sizeof(float));
+  springOffset = (float *) malloc(nSprings * sizeof(float));
+  if (nSprings > 0 &&
+      (springNode0 == NULL || springNode1 == NULL ||
+       springK == NULL || springOffset == NULL))
+    Error("Could not allocate spring arrays for %d springs.\n", nSprings);
+  for (i = 0; i < nSprings; ++i)
+    {
+      springNode0[i] = springs[i].node0 - allNodes;
+      springNode1[i] = (springs[i].node1 != NULL) ?
+	(springs[i].node1 - allNodes) : -1;
+      springK[i] = springs[i].k;
+      springOffset[i] = springs[i].offset;
+    }
+  free(springs);
+  springs = NULL;
+  springsSize = 0;
+  Log("Laid out %d springs over %d nodes\n", nSprings, nAllNodes);
+}
+
+int
+CompareSprings (const void *a, const void *b)
+{
+  const Spring *s0 = (const Spring *) a;
+  const Spring *s1 = (const Spring *) b;
+
+  if (s0->node0 != s1->node0)
+    return((s0->node0 < s1->node0) ? -1 : 1);
+  if (s0->node1 == s1->node1)
+    return(0);
+  if (s0->node1 == NULL)
+    return(-1);
+  if (s1->node1 == NULL)
+    return(1);
+  return((s0->node1 < s1->node1) ? -1 : 1);
+}
+
+/* SpringForces applies the springs first through last-1, adding the
+   force on node j into f[j*stride] and the energy into *pEnergy; with
+   direction set, the offsets and the fixed values are taken as 0, so
+   that the forces are those of the node values taken as a direction of
+   change, which is the product of that direction with (less) the
+   matrix of the quadratic spring energy */
+void
+SpringForces (int first, int last, float *f, int stride, int direction,
+	      double *pEnergy)
+{
+  int i;
+  int n0, n1;
+  float x0, x1;
+  double delta;
+  float force;
+  double energy;
+
+  energy = 0.0;
+  for (i = first; i < last; ++i)
+    {
+      n0 = springNode0[i];
+      n1 = springNode1[i];
+      x0 = allNodes[n0].x;
+      if (n1 < 0)
+	{
+	  if (isnan(springOffset[i]) || isnan(x0) || isnan(springK[i]))
+	    {
+	      Log("invalid value: %f %f %f %d\n",
+		  springOffset[i], x0, springK[i], i);
+	      exit(1);
+	    }
+	  delta = (direction ? 0.0 : springOffset[i]) - x0;
+	  force = springK[i] * delta;
+	  f[n0 * stride] += force;
+	  energy += force * delta;
+	}
+      else
+	{
+	  x1 = allNodes[n1].x;
+	  if (isnan(springOffset[i]) || isnan(x0) || isnan(x1) ||
+	      isnan(springK[i]))
+	    {
+	      Log("invalid value: %f %f %f %f %d\n",
+		  springOffset[i], x0, x1, springK[i], i);
+	      exit(1);
+	    }
+	  delta = x1 - x0 - (direction ? 0.0 : springOffset[i]);
+	  force = springK[i] * delta;
+	  f[n0 * stride] += force;
+	  f[n1 * stride] -= force;
+	  energy += force * delta;
+	}
+    }
+  *pEnergy += energy;
+}
+
+/* NodeForces sets the force on every node from all the springs,
+   adding their energy to *pEnergy (see SpringForces for direction) */
+void
+NodeForces (int direction, double *pEnergy)
+{
+  int i;
+
+  for (i = 0; i < nAllNodes; ++i)
+    allNodes[i].fx = 0.0;
+  if (nThreads > 1)
+    RunRelaxThreads(direction ? 3 : 1, -1, pEnergy);
+  else
+    SpringForces(0, nSprings, &(allNodes[0].fx), 2, direction, pEnergy);
+}
+
+/* SolveSprings relaxes the springs, for -cg, by the conjugate gradient
+   method with a Jacobi preconditioner, returning the number of
+   iterations.  The spring energy is quadratic in the node values, so
+   the forces at the node values are the residual of a sparse symmetric
+   linear system, and the forces of a direction are its product with
+   the matrix; the direction is carried to the other processes in the
+   node values, which are restored at the end.  Each process works on
+   the nodes of its own images, which it has all the springs of, and
+   the dot products are summed over the processes.  The iterations stop
+   once one lowers the energy by less than threshold ppm, as the epochs
+   of the damped relaxation do. */
+int
+SolveSprings ()
+{
+  int first, n;
+  int i, k;
+  int iter;
+  double *x, *r, *z, *d, *dir;
+  double rz, rzNew, dq, alpha, beta;
+  double energy, totalEnergy, decrease;
+  double sum;
+
+  /* the nodes of this process's images are one run of allNodes */
+  first = 0;
+  n = 0;
+  if (myFirstImage <= myLastImage)
+    {
+      first = images[myFirstImage].nodes - allNodes;
+      n = images[myLastImage].nodes +
+	2 * images[myLastImage].nx * images[myLastImage].ny -
+	images[myFirstImage].nodes;
+    }
+  x = (double *) malloc((n + 1) * sizeof(double));
+  r = (double *) malloc((n + 1) * sizeof(double));
+  z = (double *) malloc((n + 1) * sizeof(double));
+  d = (double *) malloc((n + 1) * sizeof(double));
+  dir = (double *) malloc((n + 1) * sizeof(double));
+  if (x == NULL || r == NULL || z == NULL || d == NULL || dir == NULL)
+    Error("Could not allocate conjugate gradient vectors of %d nodes.\n", n);
+
+  /* the preconditioner is the inverse of the diagonal of the matrix,
+     the sum of the spring constants at each node */
+  memset(d, 0, n * sizeof(double));
+  for (i = 0; i < nSprings; ++i)
+    {
+      k = springNode0[i] - first;
+      if (k >= 0 && k < n)
+	d[k] += springK[i];
+      k = springNode1[i] - first;
+      if (springNode1[i] >= 0 && k >= 0 && k < n)
+	d[k] += springK[i];
+    }
+  for (k = 0; k < n; ++k)
+    d[k] = d[k] > 0.0 ? 1.0 / d[k] : 0.0;
+
+  CommunicateIntensities();
+  energy = 0.0;
+  NodeForces(0, &energy);
+  totalEnergy = GlobalSum(energy);
+  sum = 0.0;
+  for (k = 0; k < n; ++k)
+    {
+      x[k] = allNodes[first+k].x;
+      r[k] = allNodes[first+k].fx;
+      z[k] = d[k] * r[k];
+      dir[k] = z[k];
+      sum += r[k] * z[k];
+    }
+  rz = GlobalSum(sum);
+
+  for (iter = 0; rz > 0.0; ++iter)
+    {
+      /* the product of the matrix with dir is less the forces of dir */
+      for (k = 0; k < n; ++k)
+	allNodes[first+k].x = dir[k];
+      CommunicateIntensities();
+      energy = 0.0;
+      NodeForces(1, &energy);
+      sum = 0.0;
+      for (k = 0; k < n; ++k)
+	sum -= dir[k] * allNodes[first+k].fx;
+      dq = GlobalSum(sum);
+      if (dq <= 0.0)
+	break;
+      alpha = rz / dq;
+      for (k = 0; k < n; ++k)
+	{
+	  x[k] += alpha * dir[k];
+	  r[k] += alpha * allNodes[first+k].fx;
+	}
+
+      /* the energy (summed as SpringForces does, so twice the
+	 quadratic form) drops by alpha * rz */
+      decrease = alpha * rz;
+      totalEnergy -= decrease;
+
+      /* the forces are single precision, so the updated residual
+	 drifts from the true one and is recomputed now and then */
+      if (iter % 50 == 49)
+	{
+	  for (k = 0; k < n; ++k)
+	    allNodes[first+k].x = x[k];
+	  CommunicateIntensities();
+	  energy = 0.0;
+	  NodeForces(0, &energy);
+	  totalEnergy = GlobalSum(energy);
+	  for (k = 0; k < n; ++k)
+	    r[k] = allNodes[first+k].fx;
+	}
+      MetricsCount("iterations", 1);
+      MetricsGauge("iteration", iter);
+      MetricsGauge("energy", totalEnergy);
+      if (p == 0 && iter % 10 == 0)
+	Log("After %d conjugate gradient iterations, total energy is %f\n",
+	    iter, totalEnergy);
+      if (decrease < totalEnergy * threshold * 0.000001 ||
+	  totalEnergy < 0.000001)
+	{
+	  ++iter;
+	  break;
+	}
+
+      sum = 0.0;
+      for (k = 0; k < n; ++k)
+	{
+	  z[k] = d[k] * r[k];
+	  sum += r[k] * z[k];
+	}
+      rzNew = GlobalSum(sum);
+      beta = rzNew / rz;
+      rz = rzNew;
+      for (k = 0; k < n; ++k)
+	dir[k] = z[k] + beta * dir[k];
+    }
+
+  for (k = 0; k < n; ++k)
+    allNodes[first+k].x = x[k];
+  CommunicateIntensities();
+  energy = 0.0;
+  NodeForces(0, &energy);
+  totalEnergy = GlobalSum(energy);
+  if (p == 0)
+    Log("After %d conjugate gradient iterations, total energy is %f\n",
+	iter, totalEnergy);
+  free(x);
+  free(r);
+  free(z);
+  free(d);
+  free(dir);
+  return(iter);
+}
+
+/* GlobalSum returns the sum of v over all the processes */
+double
+GlobalSum (double v)
+{
+  double sum;
+
+  if (MPI_Allreduce(&v, &sum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD) !=
+      MPI_SUCCESS)
+    Error("Could not sum over the processes.\n");
+  return(sum);
+}
+
+/* RunRelaxThreads does one phase of the work (see RelaxThread) on
+   nThreads threads, adding the energy they find to *pEnergy; the
+   spring phase is given a private force buffer per thread, and so is
+   followed by a phase that adds those buffers into the nodes */
+void
+RunRelaxThreads (int phase, int image, double *pEnergy)
+{
+  int t;
+  RelaxThread *rt;
+
+  if (relaxThreads == NULL)
+    {
+      relaxThreads = (RelaxThread *) malloc(nThreads * sizeof(RelaxThread));
+      if (relaxThreads == NULL)
+	Error("Could not allocate relaxation thread table.\n");
+      for (t = 0; t < nThreads; ++t)
+	relaxThreads[t].f = NULL;
+    }
+  if ((phase == 1 || phase == 3) && relaxThreads[0].f == NULL)
+    for (t = 0; t < nThreads; ++t)
+      {
+	relaxThreads[t].f = (float *) malloc(nAllNodes * sizeof(float));
+	if (relaxThreads[t].f == NULL)
+	  Error("Could not allocate force buffer of %d nodes.\n", nAllNodes);
+      }
+
+  for (;;)
+    {
+      for (t = 0; t < nThreads; ++t)
+	{
+	  rt = &relaxThreads[t];
+	  rt->t = t;
+	  rt->phase = phase;
+	  rt->image = image;
+	  rt->energy = 0.0;
+	  if (pthread_create(&(rt->thread), NULL, RelaxThreadMain, rt) != 0)
+	    Error("Could not create relaxation thread.\n");
+	}
+      for (t = 0; t < nThreads; ++t)
+	{
+	  pthread_join(relaxThreads[t].thread, NULL);
+	  if (pEnergy != NULL)
+	    *pEnergy += relaxThreads[t].energy;
+	}
+      if (phase != 1 && phase != 3)
+	break;
+      phase = 2;
+    }
+}
+
+void *
+RelaxThreadMain (void *arg)
+{
+  RelaxThread *rt = (RelaxThread *) arg;
+  int i, j;
+  int first, last;
+  float sum;
+
+  switch (rt->phase)
+    {
+    case 0:
+      NodeHistograms(rt->image, rt->t, nThreads);
+      break;
+
+    case 1:
+    case 3:
+      /* each thread takes a contiguous run of the sorted springs, and
+	 so mostly touches a compact block of nodes */
+      memset(rt->f, 0, nAllNodes * sizeof(float));
+      first = (int) (((long long) rt->t * nSprings) / nThreads);
+      last = (int) (((long long) (rt->t + 1) * nSprings) / nThreads);
+      SpringForces(first, last, rt->f, 1, rt->phase == 3, &(rt->energy));
+      break;
+
+    case 2:
+      first = (int) (((long long) rt->t * nAllNodes) / nThreads);
+      last = (int) (((long long) (rt->t + 1) * nAllNodes) / nThreads);
+      for (i = first; i < last; ++i)
+	{
+	  sum = 0.0;
+	  for (j = 0; j < nThreads; ++j)
+	    sum += relaxThreads[j].f[i];
+	  allNodes[i].fx += sum;
+	}
+      break;
+    }
+  return(NULL);
+}
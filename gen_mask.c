@@ -28,6 +28,10 @@
  *
  *  HISTORY
  *    2008-2013  Written by Greg Hood (ghood@psc.edu)
+ *    2026       Work on the packed mask with the connected components
+ *                 of bitmap.c; -cluster_threshold and -threads added
+ *    2026       Mask computation moved to GenerateMask in bitmap.c
+ *    2026       -scale and -upsample added
  */
 
 #include <stdio.h>
@@ -39,20 +43,16 @@
 #include <limits.h>
 #include <dirent.h>
 
+#include "bitmap.h"
 #include "imio.h"
 
-#define THRESHOLD_METHOD	0
-#define RANGE_METHOD		1
-#define BOUNDARY_FILL_METHOD	2
-
 /* FORWARD DECLARATIONS */
-void FloodFill (unsigned char *image, unsigned char *mask,
-		unsigned char background,
-		int x, int y, int w, int h);
-int ClusterFloodFill (int w, int h,
-		      int *cluster, unsigned char *image, unsigned char *mask,
-		      int id, int ix, int iy);
 void Error (char *fmt, ...);
+unsigned char *ReduceForMask (unsigned char *image, int w, int h,
+			      int factor, int method,
+			      int lowerThreshold, int upperThreshold);
+unsigned char *UpsampleMask (unsigned char *mask, int w, int h,
+			     int factor, int ow, int oh);
 
 int
 main (int argc, char **argv)
@@ -63,39 +63,30 @@ main (int argc, char **argv)
   int lowerThreshold, upperThreshold;
   int erode;
   float clusterThreshold;  // a percentage
+  int nThreads;
+  int scale;
+  int upsample;
+  int fw, fh;
+  unsigned char *reduced;
+  unsigned char *fullMask;
   char inputName[PATH_MAX];
   char outputName[PATH_MAX];
   char msg[PATH_MAX+256];
   int w, h;
-  int i, j;
-  int n;
-  char tc;
-  int m;
-  int b;
-  int x, y;
-  int dx, dy;
-  int bpl;
-  int side;
-  int count[256];
-  unsigned char *newMask;
-  unsigned char *tmpMask;
-  unsigned char background = 0;
+  int i;
   unsigned char *image = 0;
-  unsigned char *mask = 0;
   unsigned char *bitMask = 0;
-  int nClusters = 0;
-  int *cluster = 0;
-  int *clusterCount = 0;
-  unsigned char *useCluster = 0;
-  int totalCount;
 
   error = 0;
-  method = THRESHOLD_METHOD;
+  method = MASK_THRESHOLD;
   threshold = 1;
   lowerThreshold = 0;
   upperThreshold = 255;
   erode = 0;
   clusterThreshold = 0.0;
+  nThreads = 1;
+  scale = 1;
+  upsample = 0;
   inputName[0] = '\0';
   outputName[0] = '\0';
   for (i = 1; i < argc; ++i)
@@ -127,7 +118,7 @@ main (int argc, char **argv)
 	    error = 1;
 	    break;
 	  }
-	method = THRESHOLD_METHOD;
+	method = MASK_THRESHOLD;
       }
     else if (strcmp(argv[i], "-range") == 0)
       {
@@ -139,10 +130,10 @@ main (int argc, char **argv)
 	    error = 1;
 	    break;
 	  }
-	method = RANGE_METHOD;
+	method = MASK_RANGE;
       }
     else if (strcmp(argv[i], "-boundary-fill") == 0)
-      method = BOUNDARY_FILL_METHOD;
+      method = MASK_BOUNDARY_FILL;
     else if (strcmp(argv[i], "-erode") == 0)
       {
 	if (++i == argc || sscanf(argv[i], "%d", &erode) != 1)
@@ -152,6 +143,37 @@ main (int argc, char **argv)
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-cluster_threshold") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%f", &clusterThreshold) != 1)
+	  {
+	    fprintf(stderr, "-cluster_threshold error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-scale") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &scale) != 1 ||
+	    scale < 1)
+	  {
+	    fprintf(stderr, "-scale error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-upsample") == 0)
+      upsample = 1;
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    fprintf(stderr, "-threads error\n");
+	    error = 1;
+	    break;
+	  }
+      }
     else
       {
 	fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -165,6 +187,12 @@ main (int argc, char **argv)
 
       fprintf(stderr, "Usage: gen_mask -input image.tif -output mask.pbm\n");
       fprintf(stderr, "               [-threshold int_value ]\n");
+      fprintf(stderr, "               [-range lower-upper ]\n");
+      fprintf(stderr, "               [-boundary-fill ]\n");
+      fprintf(stderr, "               [-erode n_pixels ]\n");
+      fprintf(stderr, "               [-cluster_threshold percent ]\n");
+      fprintf(stderr, "               [-threads n ]\n");
+      fprintf(stderr, "               [-scale reduction_factor [-upsample] ]\n");
       exit(1);
     }
 
@@ -175,260 +203,208 @@ main (int argc, char **argv)
       exit(1);
     }
 
-
   if (!ReadImage(inputName, &image, &w, &h, -1, -1, -1, -1, msg))
     Error("%s\n", msg);
-  mask = (unsigned char *) malloc(h*w);
+  if (method == MASK_THRESHOLD)
+    {
+      lowerThreshold = threshold;
+      upperThreshold = 255;
+    }
 
-  if (method == THRESHOLD_METHOD)
+  /* with -scale, the mask is made from the image reduced by that
+     factor, and is written at that scale (as apply_map's -mask_scale
+     reads it) or, with -upsample, at the size of the image; the
+     erosion is reduced to the fewest steps that still clear every
+     block within erode pixels of a clear pixel, so that the mask
+     stays within the one made at full size */
+  fw = w;
+  fh = h;
+  if (scale > 1)
     {
-      for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x)
-	  mask[y*w + x] = image[y*w + x] >= threshold;
+      if (w < scale || h < scale)
+	Error("Image %s is too small to reduce by %d\n", inputName, scale);
+      reduced = ReduceForMask(image, w, h, scale, method,
+			      lowerThreshold, upperThreshold);
+      if (reduced == NULL)
+	Error("Could not allocate the reduced image.\n");
+      free(image);
+      image = reduced;
+      w /= scale;
+      h /= scale;
     }
-  else if (method == RANGE_METHOD)
+  bitMask = GenerateMask(image, w, h, method,
+			 lowerThreshold, upperThreshold,
+			 erode > 0 ? (erode + 2 * scale - 2) / scale : 0,
+			 clusterThreshold, nThreads, 1);
+  if (bitMask == NULL)
+    Error("Could not allocate the mask.\n");
+  free(image);
+  if (scale > 1 && upsample)
+    {
+      fullMask = UpsampleMask(bitMask, w, h, scale, fw, fh);
+      if (fullMask == NULL)
+	Error("Could not allocate the upsampled mask.\n");
+      free(bitMask);
+      bitMask = fullMask;
+      w = fw;
+      h = fh;
+    }
+
+  /* write out the mask */
+  if (!WriteBitmap(outputName, bitMask,
+		   w, h, UncompressedBitmap, msg))
+    Error("%s\n", msg);
+  free(bitMask);
+  exit(0);
+}
+
+/* ReduceForMask returns the (w/factor) x (h/factor) reduction of the
+   w x h image, made so that the mask of the reduction is conservative:
+   a factor x factor block whose pixels would all be set by method is
+   given their mean, and any other block a value that would not be set
+   (for MASK_BOUNDARY_FILL, the background value).  The pixels beyond
+   the last whole block of a row or column go with that block.
+   Returns NULL if it could not allocate the reduction. */
+unsigned char *
+ReduceForMask (unsigned char *image, int w, int h, int factor, int method,
+	       int lowerThreshold, int upperThreshold)
+{
+  int rw, rh;
+  int x, y, bx, by;
+  int x0, x1, y0, y1;
+  int count[256];
+  int i;
+  int v;
+  int inside;
+  int background, outside;
+  unsigned long long sum;
+  unsigned char *row;
+  unsigned char *out;
+  unsigned long long *sums;
+  unsigned char *ok;
+
+  rw = w / factor;
+  rh = h / factor;
+  out = (unsigned char *) malloc(((size_t) rw) * rh);
+  sums = (unsigned long long *) malloc(rw * sizeof(unsigned long long));
+  ok = (unsigned char *) malloc(rw);
+  if (out == NULL || sums == NULL || ok == NULL)
     {
-      for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x)
-	  mask[y*w + x] =
-	    image[y*w + x] >= lowerThreshold &&
-	    image[y*w + x] <= upperThreshold;
+      free(out);
+      free(sums);
+      free(ok);
+      return(NULL);
     }
-  else if (method == BOUNDARY_FILL_METHOD)
+
+  /* the value a failing block gets: for MASK_BOUNDARY_FILL, the most
+     common value on the perimeter, as GenerateMask finds it */
+  background = 0;
+  if (method == MASK_BOUNDARY_FILL)
     {
+      memset(count, 0, 256 * sizeof(int));
       for (x = 0; x < w; ++x)
 	{
-	  y = 0;
-	  ++count[image[y*w + x]];
-	  y = h-1;
-	  ++count[image[y*w + x]];
+	  ++count[image[x]];
+	  ++count[image[((size_t) (h-1)) * w + x]];
 	}
       for (y = 1; y < h-1; ++y)
 	{
-	  x = 0;
-	  ++count[image[y*w + x]];
-	  x = w-1;
-	  ++count[image[y*w + x]];
+	  ++count[image[((size_t) y) * w]];
+	  ++count[image[((size_t) y) * w + w - 1]];
 	}
-
-      /* find the most common value and consider that the background */
-      background = 0;
       for (i = 1; i < 256; ++i)
 	if (count[i] > count[background])
 	  background = i;
+      outside = background;
+    }
+  else
+    outside = lowerThreshold > 0 ? 0 : (upperThreshold < 255 ? 255 : -1);
 
-      /* flood fill in from all perimeter pixels with that value */
-      memset(mask, 1, h*w);
-      for (x = 0; x < w; ++x)
+  for (by = 0; by < rh; ++by)
+    {
+      y0 = by * factor;
+      y1 = by == rh - 1 ? h : y0 + factor;
+      memset(sums, 0, rw * sizeof(unsigned long long));
+      memset(ok, 1, rw);
+      for (y = y0; y < y1; ++y)
 	{
-	  y = 0;
-	  if (image[y*w + x] == background && mask[y*w + x])
-	    FloodFill(image, mask, background, x, y, w, h);
-	  y = h-1;
-	  if (image[y*w + x] == background && mask[y*w + x])
-	    FloodFill(image, mask, background, x, y, w, h);
+	  row = &image[((size_t) y) * w];
+	  for (bx = 0; bx < rw; ++bx)
+	    {
+	      x0 = bx * factor;
+	      x1 = bx == rw - 1 ? w : x0 + factor;
+	      sum = 0;
+	      inside = 1;
+	      if (method == MASK_BOUNDARY_FILL)
+		for (x = x0; x < x1; ++x)
+		  {
+		    sum += row[x];
+		    inside &= row[x] != background;
+		  }
+	      else
+		for (x = x0; x < x1; ++x)
+		  {
+		    sum += row[x];
+		    inside &= row[x] >= lowerThreshold &&
+		      row[x] <= upperThreshold;
+		  }
+	      sums[bx] += sum;
+	      ok[bx] &= inside;
+	    }
 	}
-      for (y = 1; y < h-1; ++y)
+      for (bx = 0; bx < rw; ++bx)
 	{
-	  x = 0;
-	  if (image[y*w + x] == background &&
-	      (mask[y*bpl + (x >> 3)] & (0x80 >> (x & 7))) != 0)
-	    FloodFill(image, mask, background, x, y, w, h);
-	  x = w-1;
-	  if (image[y*w + x] == background &&
-	      (mask[y*bpl + (x >> 3)] & (0x80 >> (x & 7))) != 0)
-	    FloodFill(image, mask, background, x, y, w, h);
+	  x0 = bx * factor;
+	  x1 = bx == rw - 1 ? w : x0 + factor;
+	  v = (sums[bx] + ((x1 - x0) * (y1 - y0)) / 2) /
+	    ((x1 - x0) * (y1 - y0));
+	  if (!ok[bx] && outside >= 0)
+	    v = outside;
+	  else if (method == MASK_BOUNDARY_FILL && v == background)
+	    v = background == 255 ? 254 : background + 1;
+	  out[((size_t) by) * rw + bx] = v;
 	}
     }
-
-  if (erode > 0)
-    {
-      newMask = (unsigned char *) malloc(h * w);
-      memset(mask, 0, h*bpl);
-    }  
-  for (i = 0; i < erode; ++i)
-    {
-      for (y = 0; y < h; ++y)
-        for (x = 0; x < w; ++x)
-          newMask[y*w+x] = mask[y*w+x] &&
-            (x == 0 || mask[y*w+x-1]) &&
-            (x >= w-1 || mask[y*w+x+1]) &&
-            (y == 0 || mask[(y-1)*w+x]) &&
-            (y >= h-1 || mask[(y+1)*w+x]);
-      tmpMask = mask;
-      mask = newMask;
-      newMask = tmpMask;
-    }
-  if (erode > 0)
-    free(newMask);
-
-  /* use only pixels from clusters that are bigger than the
-     given percentage threshold */
-  if (clusterThreshold > 0.0)
-    {
-      // clear all the cluster bits
-      cluster = (int *) malloc(h * w * sizeof(int));
-      for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x)
-	  cluster[y * w + x] = -1;
-
-      clusterCount = (int *) malloc(h * w * sizeof(int));
-      useCluster = (unsigned char *) malloc(h * w * sizeof(unsigned char));
-      nClusters = 0;
-      totalCount = 0;
-      for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x)
-	  {
-	    if (!mask[y * w + x] || cluster[y * w + x] >= 0)
-	      continue;
-	    clusterCount[nClusters] = ClusterFloodFill(w, h, cluster, image, mask, nClusters, x, y);
-	    printf("Cluster %d has %d elements\n", nClusters, count[nClusters]);
-	    totalCount += clusterCount[nClusters];
-	    ++nClusters;
-	  }
-
-      for (i = 0; i < nClusters; ++i)
-	useCluster[i] = (100.0 * count[nClusters]) / totalCount >= clusterThreshold;
-
-      for (y = 0; y < h; ++y)
-	for (x = 0; x < w; ++x)
-
-	  //	  if (!
-	  //
-	  //	  if (useCluster[
-      
-
-      free(useCluster);
-      free(clusterCount);
-      free(cluster);
-    }
-
-  /* write out the mask */
-  bpl = (w+7) >> 3;
-  bitMask = (unsigned char *) malloc(h*bpl);
-  memset(bitMask, 0, h*bpl);
-  for (y = 0; y < h; ++y)
-    for (x = 0; x < w; ++x)
-      if (mask[y*w+x])
-	bitMask[y * bpl + (x >> 3)] |= 0x80 >> (x & 7);
-  free(mask);
-  if (!WriteBitmap(outputName, bitMask,
-		   w, h, UncompressedBitmap, msg))
-    Error("%s\n", msg);
-  free(bitMask);
-  exit(0);
+  free(sums);
+  free(ok);
+  return(out);
 }
 
-void
-FloodFill (unsigned char *image, unsigned char *mask,
-	   unsigned char background,
-	   int x, int y, int w, int h)
+/* UpsampleMask returns the ow x oh bitmap whose pixels are set where
+   the w x h bitmap mask, made by reducing by factor, is set; the
+   pixels beyond the last whole block of a row or column take the
+   value of that block */
+unsigned char *
+UpsampleMask (unsigned char *mask, int w, int h, int factor, int ow, int oh)
 {
-  int y1;
-  int left, right;
-  int sp;
-  unsigned int *stack;
-  int bpl;
-
-  sp = 0;
-  stack = (unsigned int *) malloc(h * w * sizeof(int));
-  stack[sp++] = y*w+x;
-  while (sp > 0)
-    {
-      --sp;
-      y = stack[sp] / w;
-      x = stack[sp] - y * w;
-      y1 = y;
-      while (y1 >= 0 &&
-             image[y1*w + x] == background &&
-             mask[y1*w + x])
-        --y1;
-      ++y1;
-      left = 0;
-      right = 0;
-      while (y1 < h &&
-             image[y1*w + x] == background &&
-             mask[y1*w + x])
-        {
-          mask[y1*w + x] = 0;
-          if (!left &&
-              x > 0 &&
-	      image[y1*w + (x-1)] == background &&
-	      mask[y1*w + (x-1)])
-            {
-              stack[sp++] = y1 * w + (x-1);
-              left = 1;
-            }
-          else if (left &&
-                   x > 0 &&
-                   (image[y1*w + (x-1)] != background ||
-                    !mask[y1*w + (x-1)]))
-	    left = 0;
+  unsigned char *out;
+  unsigned char *row;
+  size_t mbpl, obpl;
+  int x, y, by;
+  int x0, x1;
 
-          if (!right &&
-              x < w-1 &&
-              image[y1*w + (x+1)] == background &&
-              mask[y1*w + (x+1)])
-            {
-              stack[sp++] = y1 * w + (x+1);
-              right = 1;
-            }
-          else if (right &&
-                   x < w-1 &&
-                   (image[y1*w + (x+1)] != background ||
-                    !mask[y1*w + (x+1)]))
-            right = 0;
-          ++y1;
-        }
-    }
-  free(stack);
-}
-
-int
-ClusterFloodFill (int w, int h,
-		  int *cluster, unsigned char *image, unsigned char *mask,
-		  int id, int ix, int iy)
-{
-  unsigned int *stack = (unsigned int *) malloc(h * w * sizeof(unsigned int));
-  int sp = 0;
-  int count = 0;
-  int x, y;
-  cluster[iy * w + ix] = id;
-  stack[sp++] = iy*w+ix;
-  while (sp > 0)
+  mbpl = (w + 7) >> 3;
+  obpl = (ow + 7) >> 3;
+  out = (unsigned char *) malloc(obpl * oh);
+  if (out == NULL)
+    return(NULL);
+  memset(out, 0, obpl * oh);
+  for (by = 0; by < h; ++by)
     {
-      ++count;
-      --sp;
-      y = stack[sp] / w;
-      x = stack[sp] - y * w;
-      
-      /* check up */
-      if (y > 0 && mask[(y-1)*w+x] && cluster[(y-1)*w+x] < 0)
-        {
-          cluster[(y-1)*w+x] = id;
-          stack[sp++] = (y-1)*w+x;
-        }
-      /* check right */
-      if (x < w-2 && mask[y*w+x+1] && cluster[y*w+x+1] < 0)
-        {
-          cluster[y*w+x+1] = id;
-          stack[sp++] = y*w+x+1;
-        }
-      /* check down */
-      if (y < h-2 && mask[(y+1)*w+x] && cluster[(y+1)*w+x] < 0)
-        {
-          cluster[(y+1)*w+x] = id;
-          stack[sp++] = (y+1)*w+x;
-        }
-      /* check left */
-      if (x > 0 && mask[y*w+x-1] && cluster[y*w+x-1] < 0)
-        {
-          cluster[y*w+x-1] = id;
-          stack[sp++] = y*w+x-1;
-        }
+      /* make the first row of the block, then copy it to the others */
+      y = by * factor;
+      row = &out[y * obpl];
+      for (x = 0; x < w; ++x)
+	if (mask[by * mbpl + (x >> 3)] & (0x80 >> (x & 7)))
+	  {
+	    x0 = x * factor;
+	    x1 = x == w - 1 ? ow : x0 + factor;
+	    FillMaskRun(row, x0, x1, 1);
+	  }
+      for (++y; y < (by == h - 1 ? oh : (by + 1) * factor); ++y)
+	memcpy(&out[y * obpl], row, obpl);
     }
-  free(stack);
-  return(count);
+  return(out);
 }
 
 void Error (char *fmt, ...)
@@ -0,0 +1,422 @@
+/*
+ * gen_pairs.c -- generates the pairs list for register or find_rst
+ *                from the approximate positions of the tiles of a
+ *                montage or stack, finding the overlapping tiles
+ *                through a grid over each section instead of
+ *                comparing every tile with every other
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_LENGTH	(2*PATH_MAX + 256)
+
+typedef struct Tile {
+  char *name;
+  int z;			/* section number */
+  double x, y;			/* approximate position of pixel (0,0)
+				   in the coordinates of the section */
+  int width, height;		/* size in pixels */
+} Tile;
+
+typedef struct GridEntry {
+  int tile;			/* index into tiles */
+  int cx, cy;			/* the grid cell */
+  int next;			/* next entry in the hash chain, or -1 */
+} GridEntry;
+
+Tile *tiles = NULL;
+int nTiles = 0;
+GridEntry *entries = NULL;
+int nEntries = 0;
+int entriesSize = 0;
+int *buckets = NULL;		/* first entry of each hash chain */
+unsigned int bucketMask;
+double cellSize;
+
+void Error (char *fmt, ...);
+int ReadPositions (char *positionsFile);
+void BuildGrid ();
+unsigned int CellHash (int z, int cx, int cy);
+int FindPair (int i, int j, double margin, int minOverlap, int crop[2][4]);
+void PairName (char *pairName, char *name0, char *name1);
+
+int
+main (int argc, char **argv)
+{
+  int i, j, k;
+  int error;
+  char positionsFile[PATH_MAX];
+  char outputFile[PATH_MAX];
+  char pairName[2*PATH_MAX+2];
+  double margin;
+  int minOverlap;
+  int minDz, maxDz;
+  int noCrop;
+  int dz;
+  int cx, cy, cxMin, cxMax, cyMin, cyMax;
+  int *seen;
+  int crop[2][4];
+  int nPairs;
+  FILE *f;
+
+  error = 0;
+  positionsFile[0] = '\0';
+  outputFile[0] = '\0';
+  margin = 0.0;
+  minOverlap = 1;
+  minDz = 0;
+  maxDz = 1;
+  noCrop = 0;
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-positions") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(positionsFile, argv[i]);
+      }
+    else if (strcmp(argv[i], "-output") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(outputFile, argv[i]);
+      }
+    else if (strcmp(argv[i], "-margin") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%lf", &margin) != 1 ||
+	    margin < 0.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-min_overlap") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &minOverlap) != 1 ||
+	    minOverlap < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-min_dz") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &minDz) != 1 ||
+	    minDz < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-max_dz") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &maxDz) != 1 ||
+	    maxDz < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-no_crop") == 0)
+      noCrop = 1;
+    else error = 1;
+
+  if (error)
+    {
+      fprintf(stderr, "Usage: gen_pairs -positions positions.lst\n");
+      fprintf(stderr, "                 -output pairs.lst\n");
+      fprintf(stderr, "                 [-margin pixels]\n");
+      fprintf(stderr, "                 [-min_overlap pixels]\n");
+      fprintf(stderr, "                 [-min_dz sections]\n");
+      fprintf(stderr, "                 [-max_dz sections]\n");
+      fprintf(stderr, "                 [-no_crop]\n");
+      fprintf(stderr, "  where each line of positions.lst is\n");
+      fprintf(stderr, "    image section x y width height\n");
+      fprintf(stderr, "  giving the approximate position of the image's top-left\n");
+      fprintf(stderr, "  pixel in the coordinates of its section\n");
+      exit(1);
+    }
+  if (positionsFile[0] == '\0' || outputFile[0] == '\0')
+    {
+      fprintf(stderr, "-positions and -output options must be specified.\n");
+      exit(1);
+    }
+  if (minDz > maxDz)
+    {
+      fprintf(stderr, "-min_dz must not exceed -max_dz.\n");
+      exit(1);
+    }
+
+  nTiles = ReadPositions(positionsFile);
+  if (nTiles == 0)
+    Error("No tiles in positions file %s\n", positionsFile);
+
+  /* a cell is as large as the largest tile, grown by the margin, so
+     that each tile falls into at most four cells */
+  cellSize = 1.0;
+  for (i = 0; i < nTiles; ++i)
+    {
+      if (tiles[i].width + 2.0 * margin > cellSize)
+	cellSize = tiles[i].width + 2.0 * margin;
+      if (tiles[i].height + 2.0 * margin > cellSize)
+	cellSize = tiles[i].height + 2.0 * margin;
+    }
+  BuildGrid();
+
+  f = fopen(outputFile, "w");
+  if (f == NULL)
+    Error("Could not open output file %s\n", outputFile);
+  seen = (int *) malloc(nTiles * sizeof(int));
+  if (seen == NULL)
+    Error("Could not allocate seen array\n");
+  for (j = 0; j < nTiles; ++j)
+    seen[j] = -1;
+  nPairs = 0;
+  for (i = 0; i < nTiles; ++i)
+    {
+      /* the cells that any tile overlapping this one (within the
+	 margin) must fall into */
+      cxMin = (int) floor((tiles[i].x - 2.0 * margin) / cellSize);
+      cxMax = (int) floor((tiles[i].x + tiles[i].width + 2.0 * margin) /
+			  cellSize);
+      cyMin = (int) floor((tiles[i].y - 2.0 * margin) / cellSize);
+      cyMax = (int) floor((tiles[i].y + tiles[i].height + 2.0 * margin) /
+			  cellSize);
+      for (dz = minDz; dz <= maxDz; ++dz)
+	for (cy = cyMin; cy <= cyMax; ++cy)
+	  for (cx = cxMin; cx <= cxMax; ++cx)
+	    for (k = buckets[CellHash(tiles[i].z + dz, cx, cy)];
+		 k >= 0; k = entries[k].next)
+	      {
+		j = entries[k].tile;
+		if (entries[k].cx != cx || entries[k].cy != cy ||
+		    tiles[j].z != tiles[i].z + dz ||
+		    (dz == 0 && j <= i) ||
+		    seen[j] == i)
+		  continue;
+		seen[j] = i;
+		if (!FindPair(i, j, margin, minOverlap, crop))
+		  continue;
+		PairName(pairName, tiles[i].name, tiles[j].name);
+		if (noCrop)
+		  fprintf(f, "%s %s %s\n",
+			  tiles[i].name, tiles[j].name, pairName);
+		else
+		  fprintf(f, "%s %d %d %d %d %s %d %d %d %d %s\n",
+			  tiles[i].name,
+			  crop[0][0], crop[0][1], crop[0][2], crop[0][3],
+			  tiles[j].name,
+			  crop[1][0], crop[1][1], crop[1][2], crop[1][3],
+			  pairName);
+		++nPairs;
+	      }
+    }
+  if (fclose(f) != 0)
+    Error("Could not close output file %s\n", outputFile);
+  printf("%d pairs of %d tiles written to %s\n", nPairs, nTiles, outputFile);
+  return(0);
+}
+
+int
+ReadPositions (char *positionsFile)
+{
+  FILE *f;
+  char line[LINE_LENGTH+1];
+  char name[PATH_MAX];
+  int n;
+  int z;
+  double x, y;
+  int width, height;
+
+  f = fopen(positionsFile, "r");
+  if (f == NULL)
+    Error("Could not open positions file %s\n", positionsFile);
+  n = 0;
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      if (line[0] == '\0' || line[0] == '#' || line[0] == '\n')
+	continue;
+      if (sscanf(line, "%s %d %lf %lf %d %d",
+		 name, &z, &x, &y, &width, &height) != 6 ||
+	  width <= 0 || height <= 0)
+	Error("Invalid line in positions file %s:\n%s\n",
+	      positionsFile, line);
+      if ((n & 1023) == 0)
+	{
+	  tiles = (Tile *) realloc(tiles, (n + 1024) * sizeof(Tile));
+	  if (tiles == NULL)
+	    Error("Could not allocate tiles array\n");
+	}
+      tiles[n].name = (char *) malloc(strlen(name) + 1);
+      if (tiles[n].name == NULL)
+	Error("Could not allocate tile name\n");
+      strcpy(tiles[n].name, name);
+      tiles[n].z = z;
+      tiles[n].x = x;
+      tiles[n].y = y;
+      tiles[n].width = width;
+      tiles[n].height = height;
+      ++n;
+    }
+  fclose(f);
+  return(n);
+}
+
+/* BuildGrid enters each tile into the hash chain of every grid cell
+   of its section that the tile covers */
+void
+BuildGrid ()
+{
+  int i;
+  int cx, cy;
+  unsigned int h;
+  unsigned int nBuckets;
+
+  nBuckets = 1024;
+  while (nBuckets < 4 * (unsigned int) nTiles)
+    nBuckets <<= 1;
+  bucketMask = nBuckets - 1;
+  buckets = (int *) malloc(nBuckets * sizeof(int));
+  if (buckets == NULL)
+    Error("Could not allocate grid\n");
+  for (h = 0; h < nBuckets; ++h)
+    buckets[h] = -1;
+
+  for (i = 0; i < nTiles; ++i)
+    for (cy = (int) floor(tiles[i].y / cellSize);
+	 cy <= (int) floor((tiles[i].y + tiles[i].height) / cellSize);
+	 ++cy)
+      for (cx = (int) floor(tiles[i].x / cellSize);
+	   cx <= (int) floor((tiles[i].x + tiles[i].width) / cellSize);
+	   ++cx)
+	{
+	  if (nEntries >= entriesSize)
+	    {
+	      entriesSize = (entriesSize == 0) ? 4096 : 2 * entriesSize;
+	      entries = (GridEntry *) realloc(entries,
+					      entriesSize * sizeof(GridEntry));
+	      if (entries == NULL)
+		Error("Could not allocate grid entries\n");
+	    }
+	  h = CellHash(tiles[i].z, cx, cy);
+	  entries[nEntries].tile = i;
+	  entries[nEntries].cx = cx;
+	  entries[nEntries].cy = cy;
+	  entries[nEntries].next = buckets[h];
+	  buckets[h] = nEntries;
+	  ++nEntries;
+	}
+}
+
+unsigned int
+CellHash (int z, int cx, int cy)
+{
+  unsigned int h;
+
+  h = (unsigned int) z * 73856093U;
+  h ^= (unsigned int) cx * 19349663U;
+  h ^= (unsigned int) cy * 83492791U;
+  return(h & bucketMask);
+}
+
+/* FindPair decides whether tiles i and j are expected to overlap by
+   at least minOverlap pixels in each direction once their positions
+   are allowed to be off by margin pixels; if so, it returns 1 and sets
+   crop[0] and crop[1] to the region (minX, maxX, minY, maxY, in the
+   tile's own pixels) of tile i and of tile j that covers the expected
+   overlap, grown by the margin */
+int
+FindPair (int i, int j, double margin, int minOverlap, int crop[2][4])
+{
+  double minX, maxX, minY, maxY;
+  int t;
+  int tile;
+
+  minX = tiles[i].x > tiles[j].x ? tiles[i].x : tiles[j].x;
+  maxX = (tiles[i].x + tiles[i].width < tiles[j].x + tiles[j].width) ?
+    tiles[i].x + tiles[i].width : tiles[j].x + tiles[j].width;
+  minY = tiles[i].y > tiles[j].y ? tiles[i].y : tiles[j].y;
+  maxY = (tiles[i].y + tiles[i].height < tiles[j].y + tiles[j].height) ?
+    tiles[i].y + tiles[i].height : tiles[j].y + tiles[j].height;
+  minX -= margin;
+  maxX += margin;
+  minY -= margin;
+  maxY += margin;
+  if (maxX - minX < minOverlap || maxY - minY < minOverlap)
+    return(0);
+
+  for (t = 0; t < 2; ++t)
+    {
+      tile = (t == 0) ? i : j;
+      crop[t][0] = (int) floor(minX - tiles[tile].x);
+      crop[t][1] = (int) ceil(maxX - tiles[tile].x) - 1;
+      crop[t][2] = (int) floor(minY - tiles[tile].y);
+      crop[t][3] = (int) ceil(maxY - tiles[tile].y) - 1;
+      if (crop[t][0] < 0)
+	crop[t][0] = 0;
+      if (crop[t][1] > tiles[tile].width - 1)
+	crop[t][1] = tiles[tile].width - 1;
+      if (crop[t][2] < 0)
+	crop[t][2] = 0;
+      if (crop[t][3] > tiles[tile].height - 1)
+	crop[t][3] = tiles[tile].height - 1;
+      if (crop[t][1] - crop[t][0] + 1 < minOverlap ||
+	  crop[t][3] - crop[t][2] + 1 < minOverlap)
+	return(0);
+    }
+  return(1);
+}
+
+/* PairName names the pair of images name0 and name1 as register's
+   examples do, name0_name1, with any directory separators in the
+   image names replaced so that the pair's outputs stay in the output
+   directory */
+void
+PairName (char *pairName, char *name0, char *name1)
+{
+  char *p;
+
+  sprintf(pairName, "%s_%s", name0, name1);
+  for (p = pairName; *p != '\0'; ++p)
+    if (*p == '/')
+      *p = '_';
+}
+
+void
+Error (char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  exit(1);
+}
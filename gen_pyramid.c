@@ -37,21 +37,74 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "imio.h"
+#include "reduction.h"
+
+/* number of locks shared out among the tiles that are being summed into */
+#define N_TILE_LOCKS	64
+
+/* GLOBAL VARIABLES */
+unsigned char inputName[PATH_MAX];
+unsigned char outputName[PATH_MAX];
+unsigned char subdirName[PATH_MAX];
+char outputCommand[PATH_MAX];	/* if nonempty, the command each tile is
+				   piped to (see imio.h) */
+int outputTileWidth, outputTileHeight;
+int rowCol;
+char format[PATH_MAX];
+enum ImageCompression compressionMode;
+int tm[4];
+int zeroBasis;
+int nHorizInputTiles, nVertInputTiles;
+int inputTileWidth, inputTileHeight;
+int nLevels;
+int *nHorizOutputTiles, *nVertOutputTiles;
+unsigned char ***ucTiles;
+unsigned int ***uiTiles;
+int **req;
+
+/* with -update, only the level 0 tiles overlapping input tiles that
+   changed since the last run (as recorded in a dependency sidecar
+   per input tile, or else by modification time), and their
+   ancestors, are rebuilt; the children of a rebuilt tile that are
+   not themselves rebuilt are read back from the pyramid */
+int update = 0;
+unsigned char **stale;		/* the tiles of each level to be
+				   rebuilt, or NULL if all are */
+char depsParams[PATH_MAX];	/* the settings the tiles depend on */
+
+/* the input tiles are handed out to the threads in row-major order;
+   a thread may not start a tile more than tileWindow tiles past the
+   first one not yet finished, so only the tiles along the current row
+   of input tiles (and the row of partially summed tiles above them
+   at each level) are ever resident */
+int nThreads = 1;
+int nInputTiles;
+int *inputOrder;		/* the k of the input tiles to be read
+				   (ty * nHorizInputTiles + tx) */
+int nextTile = 0;
+int firstUnfinishedTile = 0;
+int tileWindow;
+unsigned char *tileFinished;
+pthread_mutex_t reqLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t windowCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t tileLocks[N_TILE_LOCKS];
+
+void *TileThreadMain (void *arg);
+void ProcessInputTile (int tx, int ty);
+int DecrementReq (int lvl, int ix, int iy);
+void InputTileName (int tx, int ty, char *fn);
+void FindStaleTiles ();
+int InputChanged (int tx, int ty);
+void TileRange (int tx, int ty, int *minBX, int *maxBX,
+		int *minBY, int *maxBY);
+void AddStoredChild (int lvl, int ix, int iy, unsigned int *sTile);
 
 int
 main (int argc, char **argv)
 {
-  unsigned char inputName[PATH_MAX];
-  unsigned char outputName[PATH_MAX];
-  unsigned char subdirName[PATH_MAX];
-  int outputTileWidth, outputTileHeight;
-  int rowCol;
-  char format[PATH_MAX];
   int quality;
-  enum ImageCompression compressionMode;
-  int tm[4];
-
   DIR *dir;
   struct dirent *de;
   int len;
@@ -59,49 +112,26 @@ main (int argc, char **argv)
   char fn[PATH_MAX];
   char msg[PATH_MAX + 256];
   int error;
-
-  int zeroBasis;
-  int nHorizInputTiles, nVertInputTiles;
-  int inputTileWidth, inputTileHeight;
   int iw, ih;
-
-  unsigned char *out = NULL;
-  unsigned char *img;
-  int imw, imh;
   int row, col;
-  int x, y;
-  int dx, dy;
   int i, j;
   int tx, ty;
   int bx, by;
-  int nLevels;
-  int *nHorizOutputTiles, *nVertOutputTiles;
   int ow, oh;
-  unsigned char ***ucTiles;
-  unsigned int ***uiTiles;
-  int **req;
   int minBX, maxBX, minBY, maxBY;
   int lvl;
-  int srcMinX, srcMaxX, srcMinY, srcMaxY;
-  int dstMinX, dstMaxX, dstMinY, dstMaxY;
-  unsigned char *ucTile;
-  unsigned int *uiTile;
-  unsigned int *sTile;
-  int shift;
-  int offset;
-  int ix, iy;
-  int sdx, ddx;
   float rotation;
   int n90;
   int tmp[4];
-  int ttx, tty;
-  unsigned char *tImg;
   struct stat sb;
+  pthread_t *threads;
+  char *inputs[1];
 
   error = 0;
   inputName[0] = '\0';
   outputName[0] = '\0';
   subdirName[0] = '\0';
+  outputCommand[0] = '\0';
   outputTileWidth = 0;
   outputTileHeight = 0;
   rowCol = -1;
@@ -257,6 +287,26 @@ main (int argc, char **argv)
 	    memcpy(tm, tmp, 4 * sizeof(int));
 	  }
       }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-output_command") == 0)
+      {
+	if (++i == argc || strlen(argv[i]) >= PATH_MAX)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(outputCommand, argv[i]);
+      }
+    else if (strcmp(argv[i], "-update") == 0)
+      update = 1;
     else if (strcmp(argv[i], "-flip_x") == 0)
       {
 	tm[0] = -tm[0];
@@ -291,6 +341,9 @@ main (int argc, char **argv)
       fprintf(stderr, "           -rotate ccw_direction_in_degrees\n");
       fprintf(stderr, "           -flip_x\n");
       fprintf(stderr, "           -flip_y\n");
+      fprintf(stderr, "           -threads integer\n");
+      fprintf(stderr, "           -output_command upload_command_with_%%s\n");
+      fprintf(stderr, "           -update\n");
       exit(1);
     }
 
@@ -398,7 +451,13 @@ main (int argc, char **argv)
   ++nLevels;
 
   printf("Output image pyramid will have %d levels.\n", nLevels);
-  if (mkdir(outputName, 0777) != 0 &&
+  SetImageOutputCommand(outputCommand);
+  if (update && !ImageOutputIsLocal())
+    {
+      fprintf(stderr, "-update cannot be used with -output_command\n");
+      exit(1);
+    }
+  if (ImageOutputIsLocal() && mkdir(outputName, 0777) != 0 &&
       errno != EEXIST)
     {
       fprintf(stderr, "Could not create output directory %s\n", outputName);
@@ -413,7 +472,7 @@ main (int argc, char **argv)
   for (lvl = 0; lvl < nLevels; ++lvl)
     {
       sprintf(fn, "%s/%d", outputName, lvl);
-      if (mkdir(fn, 0777) != 0 &&
+      if (ImageOutputIsLocal() && mkdir(fn, 0777) != 0 &&
 	  errno != EEXIST)
 	{
 	  fprintf(stderr, "Could not create directory %s\n", fn);
@@ -422,7 +481,7 @@ main (int argc, char **argv)
       if (subdirName[0] != '\0')
 	{
 	  sprintf(fn, "%s/%d/%s", outputName, lvl, subdirName);
-	  if (mkdir(fn, 0777) != 0 &&
+	  if (ImageOutputIsLocal() && mkdir(fn, 0777) != 0 &&
 	      errno != EEXIST)
 	    {
 	      fprintf(stderr, "Could not create directory %s\n", fn);
@@ -455,7 +514,7 @@ main (int argc, char **argv)
       for (by = 0; by < nVertOutputTiles[lvl]; ++by)
 	{
 	  sprintf(fn, "%s/%d/%s/%d", outputName, lvl, subdirName, by);
-	  if (mkdir(fn, 0777) != 0 &&
+	  if (ImageOutputIsLocal() && mkdir(fn, 0777) != 0 &&
 	      errno != EEXIST)
 	    {
 	      fprintf(stderr, "Could not create directory %s\n", fn);
@@ -465,255 +524,616 @@ main (int argc, char **argv)
     }
 
 
+  // with -update, find the tiles to be rebuilt
+  stale = NULL;
+  if (update)
+    {
+      sprintf(fn, "%s/deps", outputName);
+      if (mkdir(fn, 0777) != 0 && errno != EEXIST)
+	{
+	  fprintf(stderr, "Could not create directory %s\n", fn);
+	  exit(1);
+	}
+      sprintf(depsParams, "gen_pyramid %d %d %d %d %d %d %d %d %d %d %d %s",
+	      outputTileWidth, outputTileHeight, (int) compressionMode,
+	      tm[0], tm[1], tm[2], tm[3],
+	      nHorizInputTiles, nVertInputTiles,
+	      inputTileWidth, inputTileHeight, subdirName);
+      FindStaleTiles();
+    }
+
+  // the input tiles to be read are those overlapping a level 0 tile
+  //   that is to be written
+  inputOrder = (int *) malloc(nHorizInputTiles * nVertInputTiles *
+			      sizeof(int));
+  nInputTiles = 0;
+  for (ty = 0; ty < nVertInputTiles; ++ty)
+    for (tx = 0; tx < nHorizInputTiles; ++tx)
+      {
+	TileRange(tx, ty, &minBX, &maxBX, &minBY, &maxBY);
+	j = stale == NULL;
+	for (by = minBY; by <= maxBY && !j; ++by)
+	  for (bx = minBX; bx <= maxBX && !j; ++bx)
+	    j = stale[0][by * nHorizOutputTiles[0] + bx];
+	if (j)
+	  inputOrder[nInputTiles++] = ty * nHorizInputTiles + tx;
+      }
+  if (update)
+    printf("Updating from %d of %d input tiles.\n",
+	   nInputTiles, nHorizInputTiles * nVertInputTiles);
+
   // first go through and see how many items (subtiles or input tiles) are required
   //    to output each tile
-  for (tx = 0; tx < nHorizInputTiles; ++tx)
-    for (ty = 0; ty < nVertInputTiles; ++ty)
-      {
-	minBX = (tx * inputTileWidth) / outputTileWidth;
-	maxBX = (tx * inputTileWidth + inputTileWidth - 1) / outputTileWidth;
-	minBY = (ty * inputTileHeight) / outputTileHeight;
-	maxBY = (ty * inputTileHeight + inputTileHeight - 1) / outputTileHeight;
-	for (by = minBY; by <= maxBY; ++by)
-	  for (bx = minBX; bx <= maxBX; ++bx)
+  for (i = 0; i < nInputTiles; ++i)
+    {
+      TileRange(inputOrder[i] % nHorizInputTiles,
+		inputOrder[i] / nHorizInputTiles,
+		&minBX, &maxBX, &minBY, &maxBY);
+      for (by = minBY; by <= maxBY; ++by)
+	for (bx = minBX; bx <= maxBX; ++bx)
+	  if (stale == NULL || stale[0][by * nHorizOutputTiles[0] + bx])
 	    ++req[0][by * nHorizOutputTiles[0] + bx];
-      }
+    }
   for (lvl = 0; lvl < nLevels-1; ++lvl)
     for (by = 0; by < nVertOutputTiles[lvl]; ++by)
       for (bx = 0; bx < nHorizOutputTiles[lvl]; ++bx)
-	++req[lvl+1][(by >> 1) * nHorizOutputTiles[lvl+1] + (bx >> 1)];
+	if (stale == NULL || stale[lvl][by * nHorizOutputTiles[lvl] + bx])
+	  ++req[lvl+1][(by >> 1) * nHorizOutputTiles[lvl+1] + (bx >> 1)];
+
+  tileWindow = nHorizInputTiles;
+  if (tileWindow < nThreads)
+    tileWindow = nThreads;
+  tileFinished = (unsigned char *) malloc(nInputTiles * sizeof(unsigned char));
+  memset(tileFinished, 0, nInputTiles * sizeof(unsigned char));
+  for (i = 0; i < N_TILE_LOCKS; ++i)
+    pthread_mutex_init(&tileLocks[i], NULL);
+  threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_create(&threads[i], NULL, TileThreadMain, NULL) != 0)
+      {
+	fprintf(stderr, "Could not create thread %d\n", i);
+	exit(1);
+      }
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_join(threads[i], NULL) != 0)
+      {
+	fprintf(stderr, "Could not join thread %d\n", i);
+	exit(1);
+      }
+  free(threads);
+  free(tileFinished);
+
+  // record what the rebuilt tiles were made from
+  if (update)
+    for (i = 0; i < nInputTiles; ++i)
+      {
+	tx = inputOrder[i] % nHorizInputTiles;
+	ty = inputOrder[i] / nHorizInputTiles;
+	InputTileName(tx, ty, fn);
+	sprintf(baseName, "%s/deps/c%dr%d.deps", outputName, tx, ty);
+	inputs[0] = fn;
+	if (!WriteDeps(baseName, depsParams, 1, inputs))
+	  fprintf(stderr, "Could not write dependency sidecar %s\n",
+		  baseName);
+      }
+  free(inputOrder);
 
-  for (tx = 0; tx < nHorizInputTiles; ++tx)
-    for (ty = 0; ty < nVertInputTiles; ++ty)
+  printf("Pyramid generation completed.\n");
+  return(0);
+}
+
+void *
+TileThreadMain (void *arg)
+{
+  int k;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&reqLock);
+      while (nextTile < nInputTiles &&
+	     nextTile >= firstUnfinishedTile + tileWindow)
+	pthread_cond_wait(&windowCond, &reqLock);
+      k = nextTile;
+      if (k < nInputTiles)
+	++nextTile;
+      pthread_mutex_unlock(&reqLock);
+      if (k >= nInputTiles)
+	break;
+
+      ProcessInputTile(inputOrder[k] % nHorizInputTiles,
+		       inputOrder[k] / nHorizInputTiles);
+
+      pthread_mutex_lock(&reqLock);
+      tileFinished[k] = 1;
+      if (k == firstUnfinishedTile)
+	{
+	  while (firstUnfinishedTile < nInputTiles &&
+		 tileFinished[firstUnfinishedTile])
+	    ++firstUnfinishedTile;
+	  pthread_cond_broadcast(&windowCond);
+	}
+      pthread_mutex_unlock(&reqLock);
+    }
+  return(NULL);
+}
+
+/* ProcessInputTile reads input tile (tx, ty) and copies it into the
+   level 0 output tiles it overlaps; any output tile that this completes
+   is written out and summed into its parent by this thread, which
+   continues up the levels for as long as it completes the parent too */
+void
+ProcessInputTile (int tx, int ty)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX + 256];
+  unsigned char *img;
+  int imw, imh;
+  int x, y;
+  int dx, dy;
+  int bx, by;
+  int minBX, maxBX, minBY, maxBY;
+  int lvl;
+  int srcMinX, srcMaxX, srcMinY, srcMaxY;
+  int dstMinX, dstMaxX, dstMinY, dstMaxY;
+  unsigned char *ucTile;
+  unsigned int *uiTile;
+  unsigned int *sTile;
+  int shift;
+  int offset;
+  int ix, iy;
+  int sdx, ddx;
+  int tmp;
+  unsigned char *tImg;
+  size_t parent;
+  pthread_mutex_t *lock;
+  int complete;
+
+  InputTileName(tx, ty, fn);
+  if (!ReadImage(fn, &img, &imw, &imh, -1, -1, -1, -1, msg))
+    {
+      fprintf(stderr, "Could not read image %s:\n  error: %s\n",
+	      fn, msg);
+      exit(1);
+    }
+  if (imw * imh != inputTileWidth * inputTileHeight)
+    {
+      fprintf(stderr, "Dimensions of image %s are inconsistent.\n", fn);
+      exit(1);
+    }
+
+  // check if a reordering within the tile is needed
+  if (tm[0] != 1 || tm[3] != 1)
+    {
+      tImg = (unsigned char *) malloc(imw * imh * sizeof(unsigned char));
+      if (tm[0] < 0)
+	dx = inputTileWidth - 1;
+      else if (tm[1] < 0)
+	dx = inputTileHeight - 1;
+      else
+	dx = 0;
+      if (tm[2] < 0)
+	dy = inputTileWidth - 1;
+      else if (tm[3] < 0)
+	dy = inputTileHeight - 1;
+      else
+	dy = 0;
+      for (y = 0; y < inputTileHeight; ++y)
+	for (x = 0; x < inputTileWidth; ++x)
+	  tImg[y*inputTileWidth + x] = 
+	    img[(tm[2] * x + tm[3] * y + dy) * imw + tm[0] * x + tm[1] * y + dx];
+      free(img);
+      img = tImg;
+      if (tm[0] == 0)
+	{
+	  tmp = imw;
+	  imw = imh;
+	  imh = tmp;
+	}
+    }
+
+  if (imw != inputTileWidth || imh != inputTileHeight)
+    {
+      fprintf(stderr, "Dimensions of image %s are inconsistent.\n", fn);
+      exit(1);
+    }
+	
+  TileRange(tx, ty, &minBX, &maxBX, &minBY, &maxBY);
+  for (by = minBY; by <= maxBY; ++by)
+    for (bx = minBX; bx <= maxBX; ++bx)
       {
-	// ttx, tty are the transformed tx and ty
-	if (tm[0] == 1)
-	  ttx = tx;
-	else if (tm[0] == -1)
-	  ttx = nHorizInputTiles - tx - 1;
-	else if (tm[1] == 1)
-	  ttx = ty;
-	else
-	  ttx = nVertInputTiles - ty - 1;
-	if (tm[3] == 1)
-	  tty = ty;
-	else if (tm[3] == -1)
-	  tty = nVertInputTiles - ty - 1;
-	else if (tm[2] == 1)
-	  tty = tx;
-	else
-	  tty = nHorizInputTiles - tx - 1;
-
-	if (rowCol < 0)
-	  strcpy(fn, inputName);
-	else
+	// with -update, the input tile may be read only for a
+	//   neighbouring tile's sake
+	if (stale != NULL && !stale[0][by * nHorizOutputTiles[0] + bx])
+	  continue;
+
+	srcMinX = bx * outputTileWidth - tx * inputTileWidth;
+	srcMaxX = srcMinX + outputTileWidth - 1;
+	dstMinX = 0;
+	dstMaxX = outputTileWidth-1;
+	if (srcMinX < 0)
 	  {
-	    if (rowCol)
-	      sprintf(baseName, format,
-		      tty + (zeroBasis ? 0 : 1),
-		      ttx + (zeroBasis ? 0 : 1));
-	    else
-	      sprintf(baseName, format,
-		      ttx + (zeroBasis ? 0 : 1),
-		      tty + (zeroBasis ? 0 : 1));
-	    sprintf(fn, "%s/%s", inputName, baseName);
+	    dstMinX -= srcMinX;
+	    srcMinX = 0;
 	  }
-	if (!ReadImage(fn, &img, &imw, &imh, -1, -1, -1, -1, msg))
-	    {
-	      fprintf(stderr, "Could not read image %s:\n  error: %s\n",
-		      fn, msg);
-	      exit(1);
-	    }
-	if (imw * imh != inputTileWidth * inputTileHeight)
+	if (srcMaxX >= inputTileWidth)
+	  {
+	    dstMaxX -= srcMaxX - inputTileWidth + 1;
+	    srcMaxX = inputTileWidth-1;
+	  }
+	srcMinY = by * outputTileHeight - ty * inputTileHeight;
+	srcMaxY = srcMinY + outputTileHeight - 1;
+	dstMinY = 0;
+	dstMaxY = outputTileHeight-1;
+	if (srcMinY < 0)
 	  {
-	    fprintf(stderr, "Dimensions of image %s are inconsistent.\n", fn);
-	    exit(1);
+	    dstMinY -= srcMinY;
+	    srcMinY = 0;
+	  }
+	if (srcMaxY >= inputTileHeight)
+	  {
+	    dstMaxY -= srcMaxY - inputTileHeight + 1;
+	    srcMaxY = inputTileHeight-1;
 	  }
 
-	// check if a reordering within the tile is needed
-	if (tm[0] != 1 || tm[3] != 1)
+	// the input tiles overlapping a level 0 tile fill disjoint
+	//   parts of it, so only its allocation needs the lock
+	pthread_mutex_lock(&reqLock);
+	ucTile = ucTiles[0][by * nHorizOutputTiles[0] + bx];
+	if (ucTile == NULL)
 	  {
-	    tImg = (unsigned char *) malloc(imw * imh * sizeof(unsigned char));
-	    if (tm[0] < 0)
-	      dx = inputTileWidth - 1;
-	    else if (tm[1] < 0)
-	      dx = inputTileHeight - 1;
-	    else
-	      dx = 0;
-	    if (tm[2] < 0)
-	      dy = inputTileWidth - 1;
-	    else if (tm[3] < 0)
-	      dy = inputTileHeight - 1;
-	    else
-	      dy = 0;
-	    for (y = 0; y < inputTileHeight; ++y)
-	      for (x = 0; x < inputTileWidth; ++x)
-		tImg[y*inputTileWidth + x] = 
-		  img[(tm[2] * x + tm[3] * y + dy) * imw + tm[0] * x + tm[1] * y + dx];
-	    free(img);
-	    img = tImg;
-	    if (tm[0] == 0)
+	    ucTile = (unsigned char *) malloc(outputTileHeight *
+					      outputTileWidth *
+					      sizeof(unsigned char));
+	    memset(ucTile, 0,
+		   outputTileHeight * outputTileWidth * sizeof(unsigned char));
+	    ucTiles[0][by * nHorizOutputTiles[0] + bx] = ucTile;
+	  }
+	pthread_mutex_unlock(&reqLock);
+
+	for (y = dstMinY; y <= dstMaxY; ++y)
+	  memcpy(&ucTile[y * outputTileWidth + dstMinX],
+		 &img[(srcMinY + y - dstMinY) * inputTileWidth + srcMinX],
+		 dstMaxX - dstMinX + 1);
+	lvl = 0;
+	ix = bx;
+	iy = by;
+	complete = DecrementReq(lvl, ix, iy);
+	while (complete)
+	  {
+	    // this thread made the last contribution to the tile,
+	    //   so it alone now owns it
+	    if (lvl > 0)
+	      {
+		uiTile = uiTiles[lvl][iy * nHorizOutputTiles[lvl] + ix];
+		if (uiTile == NULL)
+		  {
+		    fprintf(stderr, "Internal error: uiTile is NULL\n");
+		    exit(1);
+		  }
+		ucTile = (unsigned char *) malloc(outputTileHeight *
+						  outputTileWidth *
+						  sizeof(unsigned char));
+		shift = 2 * lvl;
+		offset = 1 << (shift - 1);
+		for (y = 0; y < outputTileHeight; ++y)
+		  {
+		    ddx = y * outputTileWidth;
+		    for (x = 0; x < outputTileWidth; ++x)
+		      ucTile[x + ddx] = (uiTile[x + ddx] + offset) >> shift;
+		  }
+	      }
+
+	    sprintf(fn, "%s/%d/%s/%d/%d.jpg",
+		    outputName, lvl, subdirName, iy, ix);
+	    printf("Writing image %s\n", fn);
+	    if (!WriteImage(fn, ucTile,
+			    outputTileWidth, outputTileHeight,
+			    compressionMode, msg))
+	      {
+		fprintf(stderr, "Could not write tile %s\n%s\n", fn, msg);
+		exit(1);
+	      }
+
+	    if (lvl+1 < nLevels)
+	      {
+		// propagate upwards; the four children of a tile may be
+		//   summed into it by different threads at once
+		parent = (iy >> 1) * nHorizOutputTiles[lvl+1] + (ix >> 1);
+		lock = &tileLocks[(parent * nLevels + lvl + 1) % N_TILE_LOCKS];
+		pthread_mutex_lock(lock);
+		sTile = uiTiles[lvl+1][parent];
+		if (sTile == NULL)
+		  {
+		    sTile = (unsigned int *) malloc(outputTileHeight *
+						    outputTileWidth *
+						    sizeof(unsigned int));
+		    memset(sTile, 0,
+			   outputTileHeight *
+			   outputTileWidth *
+			   sizeof(unsigned int));
+		    uiTiles[lvl+1][parent] = sTile;
+
+		    // the siblings that are not being rebuilt are
+		    //   summed in from the pyramid as it stands
+		    if (stale != NULL)
+		      for (dy = 0; dy < 2; ++dy)
+			for (dx = 0; dx < 2; ++dx)
+			  if (((iy & ~1) | dy) < nVertOutputTiles[lvl] &&
+			      ((ix & ~1) | dx) < nHorizOutputTiles[lvl] &&
+			      !stale[lvl][((iy & ~1) | dy) *
+					  nHorizOutputTiles[lvl] +
+					  ((ix & ~1) | dx)])
+			    AddStoredChild(lvl, (ix & ~1) | dx,
+					   (iy & ~1) | dy, sTile);
+		  }
+
+		for (y = 0; y < outputTileHeight; ++y)
+		  {
+		    sdx = y * outputTileWidth;
+		    ddx = (((iy & 1) * outputTileHeight + y) >> 1) *
+		      outputTileWidth +
+		      (((ix & 1) * outputTileWidth) >> 1);
+		    if (lvl == 0)
+		      SumPairs(&ucTile[sdx], outputTileWidth, &sTile[ddx]);
+		    else
+		      SumPairsUInt(&uiTile[sdx], outputTileWidth, &sTile[ddx]);
+		  }
+		pthread_mutex_unlock(lock);
+	      }
+
+	    free(ucTile);
+	    if (lvl > 0)
 	      {
-		tmp[0] = imw;
-		imw = imh;
-		imh = tmp[0];
+		free(uiTile);
+		uiTiles[lvl][iy * nHorizOutputTiles[lvl] + ix] = NULL;
 	      }
+	    else
+	      ucTiles[0][iy * nHorizOutputTiles[0] + ix] = NULL;
+	    ucTile = NULL;
+	    uiTile = NULL;
+
+	    ++lvl;
+	    ix >>= 1;
+	    iy >>= 1;
+	    complete = lvl < nLevels && DecrementReq(lvl, ix, iy);
 	  }
+      }
+  free(img);
+}
+
+/* DecrementReq records one more contribution to tile (ix, iy) of level
+   lvl, returning 1 if that was the last one the tile required */
+int
+DecrementReq (int lvl, int ix, int iy)
+{
+  int r;
+
+  pthread_mutex_lock(&reqLock);
+  r = --req[lvl][iy * nHorizOutputTiles[lvl] + ix];
+  pthread_mutex_unlock(&reqLock);
+  if (r < 0)
+    {
+      fprintf(stderr, "Internal error: req[%d][%d*%d + %d] = %d\n",
+	      lvl, iy, nHorizOutputTiles[lvl], ix, r);
+      exit(1);
+    }
+  return(r == 0);
+}
+
+/* InputTileName sets fn to the name of input tile (tx, ty), which are
+   the indices of the tile after any rotation or flip */
+void
+InputTileName (int tx, int ty, char *fn)
+{
+  char baseName[PATH_MAX];
+  int ttx, tty;
+
+  // ttx, tty are the transformed tx and ty
+  if (tm[0] == 1)
+    ttx = tx;
+  else if (tm[0] == -1)
+    ttx = nHorizInputTiles - tx - 1;
+  else if (tm[1] == 1)
+    ttx = ty;
+  else
+    ttx = nVertInputTiles - ty - 1;
+  if (tm[3] == 1)
+    tty = ty;
+  else if (tm[3] == -1)
+    tty = nVertInputTiles - ty - 1;
+  else if (tm[2] == 1)
+    tty = tx;
+  else
+    tty = nHorizInputTiles - tx - 1;
+
+  if (rowCol < 0)
+    strcpy(fn, inputName);
+  else
+    {
+      if (rowCol)
+	sprintf(baseName, format,
+		tty + (zeroBasis ? 0 : 1),
+		ttx + (zeroBasis ? 0 : 1));
+      else
+	sprintf(baseName, format,
+		ttx + (zeroBasis ? 0 : 1),
+		tty + (zeroBasis ? 0 : 1));
+      sprintf(fn, "%s/%s", inputName, baseName);
+    }
+}
+
+/* TileRange sets the range of level 0 tiles that input tile (tx, ty)
+   overlaps */
+void
+TileRange (int tx, int ty, int *minBX, int *maxBX, int *minBY, int *maxBY)
+{
+  *minBX = (tx * inputTileWidth) / outputTileWidth;
+  *maxBX = (tx * inputTileWidth + inputTileWidth - 1) / outputTileWidth;
+  *minBY = (ty * inputTileHeight) / outputTileHeight;
+  *maxBY = (ty * inputTileHeight + inputTileHeight - 1) / outputTileHeight;
+}
 
-	if (imw != inputTileWidth || imh != inputTileHeight)
+/* FindStaleTiles sets stale to the tiles to be rebuilt: the level 0
+   tiles that overlap a changed input tile or are missing, the level 0
+   tiles under any missing tile of a higher level, and the ancestors
+   of all of those */
+void
+FindStaleTiles ()
+{
+  int lvl;
+  int tx, ty;
+  int bx, by;
+  int x, y;
+  int minBX, maxBX, minBY, maxBY;
+  int n, nStale;
+  char fn[PATH_MAX];
+  char msg[PATH_MAX + 256];
+  char **names;
+  struct stat sb;
+
+  // the times of the input tiles are looked up all at once
+  n = nHorizInputTiles * nVertInputTiles;
+  names = (char **) malloc(n * sizeof(char *));
+  for (ty = 0; ty < nVertInputTiles; ++ty)
+    for (tx = 0; tx < nHorizInputTiles; ++tx)
+      {
+	InputTileName(tx, ty, fn);
+	names[ty * nHorizInputTiles + tx] = strdup(fn);
+      }
+  if (!ScanImageSizes(n, names, msg))
+    {
+      fprintf(stderr, "%s", msg);
+      exit(1);
+    }
+  while (--n >= 0)
+    free(names[n]);
+  free(names);
+
+  stale = (unsigned char **) malloc(nLevels * sizeof(unsigned char *));
+  for (lvl = 0; lvl < nLevels; ++lvl)
+    {
+      n = nHorizOutputTiles[lvl] * nVertOutputTiles[lvl];
+      stale[lvl] = (unsigned char *) malloc(n);
+      memset(stale[lvl], 0, n);
+    }
+
+  for (ty = 0; ty < nVertInputTiles; ++ty)
+    for (tx = 0; tx < nHorizInputTiles; ++tx)
+      if (InputChanged(tx, ty))
+	{
+	  TileRange(tx, ty, &minBX, &maxBX, &minBY, &maxBY);
+	  for (by = minBY; by <= maxBY; ++by)
+	    for (bx = minBX; bx <= maxBX; ++bx)
+	      stale[0][by * nHorizOutputTiles[0] + bx] = 1;
+	}
+
+  for (lvl = 0; lvl < nLevels; ++lvl)
+    for (by = 0; by < nVertOutputTiles[lvl]; ++by)
+      for (bx = 0; bx < nHorizOutputTiles[lvl]; ++bx)
+	{
+	  sprintf(fn, "%s/%d/%s/%d/%d.jpg",
+		  outputName, lvl, subdirName, by, bx);
+	  if (stat(fn, &sb) == 0)
+	    continue;
+	  for (y = by << lvl;
+	       y < ((by + 1) << lvl) && y < nVertOutputTiles[0]; ++y)
+	    for (x = bx << lvl;
+		 x < ((bx + 1) << lvl) && x < nHorizOutputTiles[0]; ++x)
+	      stale[0][y * nHorizOutputTiles[0] + x] = 1;
+	}
+
+  nStale = 0;
+  for (lvl = 0; lvl < nLevels; ++lvl)
+    for (by = 0; by < nVertOutputTiles[lvl]; ++by)
+      for (bx = 0; bx < nHorizOutputTiles[lvl]; ++bx)
+	if (stale[lvl][by * nHorizOutputTiles[lvl] + bx])
 	  {
-	    fprintf(stderr, "Dimensions of image %s are inconsistent.\n", fn);
-	    exit(1);
+	    ++nStale;
+	    if (lvl+1 < nLevels)
+	      stale[lvl+1][(by >> 1) * nHorizOutputTiles[lvl+1] +
+			   (bx >> 1)] = 1;
 	  }
-	
-	minBX = (tx * inputTileWidth) / outputTileWidth;
-	maxBX = (tx * inputTileWidth + inputTileWidth - 1) / outputTileWidth;
-	minBY = (ty * inputTileHeight) / outputTileHeight;
-	maxBY = (ty * inputTileHeight + inputTileHeight - 1) / outputTileHeight;
-	for (by = minBY; by <= maxBY; ++by)
-	  for (bx = minBX; bx <= maxBX; ++bx)
-	    {
-	      srcMinX = bx * outputTileWidth - tx * inputTileWidth;
-	      srcMaxX = srcMinX + outputTileWidth - 1;
-	      dstMinX = 0;
-	      dstMaxX = outputTileWidth-1;
-	      if (srcMinX < 0)
-		{
-		  dstMinX -= srcMinX;
-		  srcMinX = 0;
-		}
-	      if (srcMaxX >= inputTileWidth)
-		{
-		  dstMaxX -= srcMaxX - inputTileWidth + 1;
-		  srcMaxX = inputTileWidth-1;
-		}
-	      srcMinY = by * outputTileHeight - ty * inputTileHeight;
-	      srcMaxY = srcMinY + outputTileHeight - 1;
-	      dstMinY = 0;
-	      dstMaxY = outputTileHeight-1;
-	      if (srcMinY < 0)
-		{
-		  dstMinY -= srcMinY;
-		  srcMinY = 0;
-		}
-	      if (srcMaxY >= inputTileHeight)
-		{
-		  dstMaxY -= srcMaxY - inputTileHeight + 1;
-		  srcMaxY = inputTileHeight-1;
-		}
-
-	      ucTile = ucTiles[0][by * nHorizOutputTiles[0] + bx];
-	      if (ucTile == NULL)
-		{
-		  ucTile = (unsigned char *) malloc(outputTileHeight *
-						    outputTileWidth *
-						    sizeof(unsigned char));
-		  memset(ucTile, 0,
-			 outputTileHeight * outputTileWidth * sizeof(unsigned char));
-		  ucTiles[0][by * nHorizOutputTiles[0] + bx] = ucTile;
-		}
-
-	      for (y = dstMinY; y <= dstMaxY; ++y)
-		memcpy(&ucTile[y * outputTileWidth + dstMinX],
-		       &img[(srcMinY + y - dstMinY) * inputTileWidth + srcMinX],
-		       dstMaxX - dstMinX + 1);
-	      lvl = 0;
-	      ix = bx;
-	      iy = by;
-	      while (lvl < nLevels &&
-		     --req[lvl][iy * nHorizOutputTiles[lvl] + ix] == 0)
-		{
-		  if (lvl > 0)
-		    {
-		      uiTile = uiTiles[lvl][iy * nHorizOutputTiles[lvl] + ix];
-		      if (uiTile == NULL)
-			{
-			  fprintf(stderr, "Internal error: uiTile is NULL\n");
-			  exit(1);
-			}
-		      ucTile = (unsigned char *) malloc(outputTileHeight *
-							outputTileWidth *
-							sizeof(unsigned char));
-		      shift = 2 * lvl;
-		      offset = 1 << (shift - 1);
-		      for (y = 0; y < outputTileHeight; ++y)
-			{
-			  ddx = y * outputTileWidth;
-			  for (x = 0; x < outputTileWidth; ++x)
-			    ucTile[x + ddx] = (uiTile[x + ddx] + offset) >> shift;
-			}
-		    }
-
-		  sprintf(fn, "%s/%d/%s/%d/%d.jpg",
-			  outputName, lvl, subdirName, iy, ix);
-		  printf("Writing image %s\n", fn);
-		  if (!WriteImage(fn, ucTile,
-				  outputTileWidth, outputTileHeight,
-				  compressionMode, msg))
-		    {
-		      fprintf(stderr, "Could not write tile %s\n%s\n", fn, msg);
-		      exit(1);
-		    }
-
-		  if (lvl+1 < nLevels)
-		    {
-		      // propagate upwards
-		      sTile = uiTiles[lvl+1][(iy >> 1) * nHorizOutputTiles[lvl+1] +
-					     (ix >> 1)];
-		      if (sTile == NULL)
-			{
-			  sTile = (unsigned int *) malloc(outputTileHeight *
-							  outputTileWidth *
-							  sizeof(unsigned int));
-			  memset(sTile, 0,
-				 outputTileHeight *
-				 outputTileWidth *
-				 sizeof(unsigned int));
-			  uiTiles[lvl+1][(iy >> 1) * nHorizOutputTiles[lvl+1] +
-					 (ix >> 1)] = sTile;
-			}
-
-		      for (y = 0; y < outputTileHeight; ++y)
-			{
-			  sdx = y * outputTileWidth;
-			  ddx = (((iy & 1) * outputTileHeight + y) >> 1) *
-			    outputTileWidth +
-			    (((ix & 1) * outputTileWidth) >> 1);
-			  if (lvl == 0)
-			    for (x = 0; x < outputTileWidth; ++x)
-			      sTile[(x >> 1) + ddx] += ucTile[sdx + x];
-			  else
-			    for (x = 0; x < outputTileWidth; ++x)
-			      sTile[(x >> 1) + ddx] += uiTile[sdx + x];
-			}
-		    }
-
-		  free(ucTile);
-		  if (lvl > 0)
-		    {
-		      free(uiTile);
-		      uiTiles[lvl][iy * nHorizOutputTiles[lvl] + ix] = NULL;
-		    }
-		  else
-		    ucTiles[0][iy * nHorizOutputTiles[0] + ix] = NULL;
-		  ucTile = NULL;
-		  uiTile = NULL;
-
-		  ++lvl;
-		  ix >>= 1;
-		  iy >>= 1;
-		}
-	      if (lvl < nLevels && req[lvl][iy * nHorizOutputTiles[lvl] + ix] < 0)
-		{
-		  fprintf(stderr, "Internal error: req[%d][%d*%d + %d] = %d\n",
-			  lvl, iy, nHorizOutputTiles[lvl], ix,
-			  req[lvl][iy * nHorizOutputTiles[lvl] + ix]);
-		  exit(1);
-		}
-	    }
-	free(img);
-	img = 0;
+  printf("Rebuilding %d tiles.\n", nStale);
+}
+
+/* InputChanged returns 1 if input tile (tx, ty) differs from the one
+   the pyramid was last built from, going by its dependency sidecar
+   if it has one, and otherwise by whether it is newer than any of the
+   level 0 tiles it overlaps */
+int
+InputChanged (int tx, int ty)
+{
+  char fn[PATH_MAX];
+  char depsName[PATH_MAX];
+  char tileName[PATH_MAX];
+  char *inputs[1];
+  int current;
+  int bx, by;
+  int minBX, maxBX, minBY, maxBY;
+  int w, h;
+  long long mtime;
+  struct stat sb;
+
+  InputTileName(tx, ty, fn);
+  sprintf(depsName, "%s/deps/c%dr%d.deps", outputName, tx, ty);
+  inputs[0] = fn;
+  current = DepsCurrent(depsName, depsParams, 1, inputs);
+  if (current >= 0)
+    return(!current);
+
+  if (!LookupImageInfo(fn, &w, &h, &mtime))
+    return(1);
+  TileRange(tx, ty, &minBX, &maxBX, &minBY, &maxBY);
+  for (by = minBY; by <= maxBY; ++by)
+    for (bx = minBX; bx <= maxBX; ++bx)
+      {
+	sprintf(tileName, "%s/0/%s/%d/%d.jpg",
+		outputName, subdirName, by, bx);
+	if (stat(tileName, &sb) != 0 || sb.st_mtime < mtime)
+	  return(1);
       }
-  printf("Pyramid generation completed.\n");
   return(0);
 }
+
+/* AddStoredChild sums tile (ix, iy) of level lvl, as written by an
+   earlier run, into its parent sTile, scaled to the sums of level 0
+   pixels that the parent accumulates */
+void
+AddStoredChild (int lvl, int ix, int iy, unsigned int *sTile)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX + 256];
+  unsigned char *img;
+  unsigned int *row;
+  int imw, imh;
+  int x, y;
+  int ddx;
+
+  sprintf(fn, "%s/%d/%s/%d/%d.jpg", outputName, lvl, subdirName, iy, ix);
+  if (!ReadImage(fn, &img, &imw, &imh, -1, -1, -1, -1, msg))
+    {
+      fprintf(stderr, "Could not read tile %s:\n  error: %s\n", fn, msg);
+      exit(1);
+    }
+  if (imw != outputTileWidth || imh != outputTileHeight)
+    {
+      fprintf(stderr, "Dimensions of tile %s are inconsistent.\n", fn);
+      exit(1);
+    }
+  row = (unsigned int *) malloc(outputTileWidth * sizeof(unsigned int));
+  for (y = 0; y < outputTileHeight; ++y)
+    {
+      ddx = (((iy & 1) * outputTileHeight + y) >> 1) * outputTileWidth +
+	(((ix & 1) * outputTileWidth) >> 1);
+      if (lvl == 0)
+	SumPairs(&img[y * outputTileWidth], outputTileWidth, &sTile[ddx]);
+      else
+	{
+	  for (x = 0; x < outputTileWidth; ++x)
+	    row[x] = ((unsigned int) img[y * outputTileWidth + x]) << (2 * lvl);
+	  SumPairsUInt(row, outputTileWidth, &sTile[ddx]);
+	}
+    }
+  free(row);
+  free(img);
+}
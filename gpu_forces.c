@@ -0,0 +1,796 @@
+/*
+ * gpu_forces.c -- computes the forces and moves of align's iterations
+ *                 on a GPU
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpu_forces.h"
+
+#ifndef GPU_FORCES
+
+int
+GpuForcesInit (char *error)
+{
+  sprintf(error, "align was built without GPU support (see GPU_FORCES in the Makefile)\n");
+  return(0);
+}
+
+int
+GpuForcesLoad (int nNodes, float *xy, unsigned char *flags,
+	       float *absXY, float *velocity,
+	       int nIntra, GpuIntraSpring *intra,
+	       int nInter, GpuInterSpring *inter,
+	       char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuForcesUpload (int first, int n, float *xy, float *velocity, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuForcesDownload (int first, int n, float *xy, float *velocity,
+		   char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuForcesCompute (float kAbsolute, float kIntra, float kInter,
+		  double *intraEnergy, double *interEnergy, float *maxF,
+		  char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuForcesMove (float scale, float momentum,
+	       float maxStepX, float maxStepY, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+void
+GpuForcesFinish ()
+{
+}
+
+#else
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+
+#define GROUP_SIZE	256	/* invocations in a work group */
+#define MAX_GROUPS	65535	/* work groups in a dispatch; each
+				   invocation goes through the items
+				   GROUP_SIZE * MAX_GROUPS apart */
+
+/* the buffers, each at the binding of the same index */
+#define POSITIONS	0
+#define INFO		1
+#define FORCES		2
+#define VELOCITIES	3
+#define INTRA		4
+#define INTER		5
+#define INCIDENT	6
+#define PARTIAL		7
+#define N_BUFFERS	8
+
+/* the declarations shared by the programs; the static state of a node
+   is kept in NodeInfo, with the part of the incident list that names
+   the springs pulling on it, each as twice its index (the inter-image
+   springs numbered after the intra-image ones) plus 1 if the node is
+   the second of the spring */
+#define SHADER_HEADER \
+  "#version 430 core\n" \
+  "layout(local_size_x = 256) in;\n" \
+  "struct NodeInfo { float ax; float ay; uint flags; int first; int count; int pad; };\n" \
+  "struct Intra { int i0; int i1; float nomD; float k; };\n" \
+  "struct Inter { int i0; int i1; float ox; float oy; float k; float e; };\n" \
+  "uniform int nNodes;\n" \
+  "uniform int nIntra;\n" \
+  "uniform int nInter;\n" \
+  "uniform float kAbsolute;\n" \
+  "uniform float kIntra;\n" \
+  "uniform float kInter;\n" \
+  "bool Valid (vec2 p) { return p.x <= 0.5e30; }\n"
+
+/* the force program is ImageForces and MapForces turned around: each
+   owned node sums the springs that pull on it, and the work group
+   keeps the largest force of the movable ones */
+static const char *forceShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer PositionBuffer { vec2 pos[]; };\n"
+  "layout(std430, binding = 1) readonly buffer InfoBuffer { NodeInfo info[]; };\n"
+  "layout(std430, binding = 2) writeonly buffer ForceBuffer { vec2 force[]; };\n"
+  "layout(std430, binding = 4) readonly buffer IntraBuffer { Intra intra[]; };\n"
+  "layout(std430, binding = 5) readonly buffer InterBuffer { Inter inter[]; };\n"
+  "layout(std430, binding = 6) readonly buffer IncidentBuffer { int incident[]; };\n"
+  "layout(std430, binding = 7) writeonly buffer PartialBuffer { double partial[]; };\n"
+  "uniform int partialBase;\n"
+  "shared float largest[256];\n"
+  "void main ()\n"
+  "{\n"
+  "  float m = 0.0;\n"
+  "  for (int n = int(gl_GlobalInvocationID.x); n < nNodes;\n"
+  "       n += int(gl_NumWorkGroups.x) * 256)\n"
+  "    {\n"
+  "      uint fl = info[n].flags;\n"
+  "      vec2 p0 = pos[n];\n"
+  "      if ((fl & 1u) == 0u || !Valid(p0))\n"
+  "        continue;\n"
+  "      vec2 f = vec2(0.0);\n"
+  "      if ((fl & 16u) != 0u)\n"
+  "        {\n"
+  "          if (info[n].ax < 0.5e30)\n"
+  "            f.x = kAbsolute * (info[n].ax - p0.x);\n"
+  "          if (info[n].ay < 0.5e30)\n"
+  "            f.y = kAbsolute * (info[n].ay - p0.y);\n"
+  "        }\n"
+  "      int end = info[n].first + info[n].count;\n"
+  "      for (int j = info[n].first; j < end; ++j)\n"
+  "        {\n"
+  "          int s = incident[j] >> 1;\n"
+  "          bool second = (incident[j] & 1) != 0;\n"
+  "          vec2 df;\n"
+  "          if (s < nIntra)\n"
+  "            {\n"
+  "              vec2 a = pos[intra[s].i0];\n"
+  "              vec2 b = pos[intra[s].i1];\n"
+  "              if (!Valid(a) || !Valid(b))\n"
+  "                continue;\n"
+  "              vec2 delta = b - a;\n"
+  "              float d = length(delta);\n"
+  "              if (d == 0.0)\n"
+  "                continue;\n"
+  "              df = (kIntra * intra[s].k * (d - intra[s].nomD) / d) * delta;\n"
+  "            }\n"
+  "          else\n"
+  "            {\n"
+  "              s -= nIntra;\n"
+  "              vec2 a = pos[inter[s].i0];\n"
+  "              vec2 b = pos[inter[s].i1];\n"
+  "              if (!Valid(a) || !Valid(b))\n"
+  "                continue;\n"
+  "              df = (inter[s].k * kInter) *\n"
+  "                (b + vec2(inter[s].ox, inter[s].oy) - a);\n"
+  "            }\n"
+  "          f += second ? -df : df;\n"
+  "        }\n"
+  "      force[n] = f;\n"
+  "      if ((fl & 2u) == 0u)\n"
+  "        continue;\n"
+  "      if ((fl & 4u) == 0u)\n"
+  "        m = max(m, ((fl & 8u) == 0u) ? length(f) : abs(f.x));\n"
+  "      else if ((fl & 8u) == 0u)\n"
+  "        m = max(m, abs(f.y));\n"
+  "    }\n"
+  "  uint l = gl_LocalInvocationID.x;\n"
+  "  largest[l] = m;\n"
+  "  barrier();\n"
+  "  for (uint h = 128u; h > 0u; h >>= 1)\n"
+  "    {\n"
+  "      if (l < h)\n"
+  "        largest[l] = max(largest[l], largest[l + h]);\n"
+  "      barrier();\n"
+  "    }\n"
+  "  if (l == 0u)\n"
+  "    partial[partialBase + int(gl_WorkGroupID.x)] = double(largest[0]);\n"
+  "}\n";
+
+/* the energy program goes through the absolute springs of the owned
+   nodes, then the intra-image springs, then the inter-image ones, and
+   each work group sums their energies in double, as align does */
+static const char *energyShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer PositionBuffer { vec2 pos[]; };\n"
+  "layout(std430, binding = 1) readonly buffer InfoBuffer { NodeInfo info[]; };\n"
+  "layout(std430, binding = 4) readonly buffer IntraBuffer { Intra intra[]; };\n"
+  "layout(std430, binding = 5) readonly buffer InterBuffer { Inter inter[]; };\n"
+  "layout(std430, binding = 7) writeonly buffer PartialBuffer { double partial[]; };\n"
+  "shared double sum0[256];\n"
+  "shared double sum1[256];\n"
+  "void main ()\n"
+  "{\n"
+  "  double e0 = 0.0;\n"
+  "  double e1 = 0.0;\n"
+  "  for (int t = int(gl_GlobalInvocationID.x); t < nNodes + nIntra + nInter;\n"
+  "       t += int(gl_NumWorkGroups.x) * 256)\n"
+  "    {\n"
+  "      if (t < nNodes)\n"
+  "        {\n"
+  "          vec2 p = pos[t];\n"
+  "          if ((info[t].flags & 17u) != 17u || !Valid(p))\n"
+  "            continue;\n"
+  "          vec2 delta = vec2(0.0);\n"
+  "          if (info[t].ax < 0.5e30)\n"
+  "            delta.x = info[t].ax - p.x;\n"
+  "          if (info[t].ay < 0.5e30)\n"
+  "            delta.y = info[t].ay - p.y;\n"
+  "          e0 += double(kAbsolute * dot(delta, delta));\n"
+  "        }\n"
+  "      else if (t < nNodes + nIntra)\n"
+  "        {\n"
+  "          int s = t - nNodes;\n"
+  "          vec2 a = pos[intra[s].i0];\n"
+  "          vec2 b = pos[intra[s].i1];\n"
+  "          if (!Valid(a) || !Valid(b))\n"
+  "            continue;\n"
+  "          float stretch = length(b - a) - intra[s].nomD;\n"
+  "          e0 += double(kIntra * intra[s].k * stretch * stretch);\n"
+  "        }\n"
+  "      else\n"
+  "        {\n"
+  "          int s = t - nNodes - nIntra;\n"
+  "          vec2 a = pos[inter[s].i0];\n"
+  "          vec2 b = pos[inter[s].i1];\n"
+  "          if (!Valid(a) || !Valid(b))\n"
+  "            continue;\n"
+  "          vec2 delta = b + vec2(inter[s].ox, inter[s].oy) - a;\n"
+  "          e1 += double(inter[s].e * inter[s].k * kInter * dot(delta, delta));\n"
+  "        }\n"
+  "    }\n"
+  "  uint l = gl_LocalInvocationID.x;\n"
+  "  sum0[l] = e0;\n"
+  "  sum1[l] = e1;\n"
+  "  barrier();\n"
+  "  for (uint h = 128u; h > 0u; h >>= 1)\n"
+  "    {\n"
+  "      if (l < h)\n"
+  "        {\n"
+  "          sum0[l] += sum0[l + h];\n"
+  "          sum1[l] += sum1[l + h];\n"
+  "        }\n"
+  "      barrier();\n"
+  "    }\n"
+  "  if (l == 0u)\n"
+  "    {\n"
+  "      partial[2 * int(gl_WorkGroupID.x)] = sum0[0];\n"
+  "      partial[2 * int(gl_WorkGroupID.x) + 1] = sum1[0];\n"
+  "    }\n"
+  "}\n";
+
+/* the move program is the position update of align's iterations */
+static const char *moveShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) buffer PositionBuffer { vec2 pos[]; };\n"
+  "layout(std430, binding = 1) readonly buffer InfoBuffer { NodeInfo info[]; };\n"
+  "layout(std430, binding = 2) readonly buffer ForceBuffer { vec2 force[]; };\n"
+  "layout(std430, binding = 3) buffer VelocityBuffer { vec2 velocity[]; };\n"
+  "uniform float scale;\n"
+  "uniform float momentum;\n"
+  "uniform float maxStepX;\n"
+  "uniform float maxStepY;\n"
+  "void main ()\n"
+  "{\n"
+  "  for (int n = int(gl_GlobalInvocationID.x); n < nNodes;\n"
+  "       n += int(gl_NumWorkGroups.x) * 256)\n"
+  "    {\n"
+  "      uint fl = info[n].flags;\n"
+  "      vec2 p = pos[n];\n"
+  "      if ((fl & 2u) == 0u || !Valid(p))\n"
+  "        continue;\n"
+  "      vec2 v = velocity[n];\n"
+  "      vec2 f = force[n];\n"
+  "      float d;\n"
+  "      if ((fl & 4u) == 0u)\n"
+  "        {\n"
+  "          d = scale * f.x;\n"
+  "          if (momentum > 0.0)\n"
+  "            d += momentum * v.x;\n"
+  "          d = clamp(d, -maxStepX, maxStepX);\n"
+  "          p.x += d;\n"
+  "          if (momentum > 0.0)\n"
+  "            v.x = d;\n"
+  "        }\n"
+  "      if ((fl & 8u) == 0u)\n"
+  "        {\n"
+  "          d = scale * f.y;\n"
+  "          if (momentum > 0.0)\n"
+  "            d += momentum * v.y;\n"
+  "          d = clamp(d, -maxStepY, maxStepY);\n"
+  "          p.y += d;\n"
+  "          if (momentum > 0.0)\n"
+  "            v.y = d;\n"
+  "        }\n"
+  "      pos[n] = p;\n"
+  "      velocity[n] = v;\n"
+  "    }\n"
+  "}\n";
+
+/* the layouts of NodeInfo, Intra and Inter in the shaders */
+typedef struct NodeInfo
+{
+  float ax, ay;
+  unsigned int flags;
+  int first;
+  int count;
+  int pad;
+} NodeInfo;
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static GLuint forceProgram = 0, energyProgram = 0, moveProgram = 0;
+static GLuint buffers[N_BUFFERS];
+static int nNodes = 0;
+static int nIntra = 0;
+static int nInter = 0;
+static double *partial = NULL;	/* the work groups' sums and maxima */
+
+static GLuint BuildProgram (const char *text, char *error);
+static int Upload (int b, void *p, size_t n, GLint64 maxBlock, char *error);
+static int Groups (long n);
+static void SetCounts (GLuint program);
+static int MakeCurrent (char *error);
+
+int
+GpuForcesInit (char *error)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+  EGLint major, minor;
+  EGLint attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 4,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+
+  if (context != EGL_NO_CONTEXT)
+    return(1);
+
+  /* as in gpu_render.c, a node without a display server is reached
+     through Mesa's surfaceless platform */
+  display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+      getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+	eglGetProcAddress("eglGetPlatformDisplayEXT");
+      if (getPlatformDisplay == NULL)
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+      display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+				   EGL_DEFAULT_DISPLAY, NULL);
+      if (display == EGL_NO_DISPLAY ||
+	  !eglInitialize(display, &major, &minor))
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+    }
+  if (!eglBindAPI(EGL_OPENGL_API))
+    {
+      sprintf(error, "EGL does not support OpenGL\n");
+      return(0);
+    }
+  context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+			     attributes);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not create an OpenGL 4.3 context (EGL error 0x%x)\n",
+	      eglGetError());
+      context = EGL_NO_CONTEXT;
+      return(0);
+    }
+
+  forceProgram = BuildProgram(forceShader, error);
+  if (forceProgram == 0)
+    return(0);
+  energyProgram = BuildProgram(energyShader, error);
+  if (energyProgram == 0)
+    return(0);
+  moveProgram = BuildProgram(moveShader, error);
+  if (moveProgram == 0)
+    return(0);
+  glGenBuffers(N_BUFFERS, buffers);
+
+  partial = (double *) malloc((2 * MAX_GROUPS + MAX_GROUPS) * sizeof(double));
+  if (partial == NULL)
+    {
+      sprintf(error, "Could not allocate the GPU work group sums\n");
+      return(0);
+    }
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not set up the GPU force computation\n");
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuForcesLoad (int nn, float *xy, unsigned char *flags,
+	       float *absXY, float *velocity,
+	       int ni, GpuIntraSpring *intra,
+	       int ne, GpuInterSpring *inter,
+	       char *error)
+{
+  int i, j, k;
+  int ok;
+  int pos;
+  int *incident;
+  NodeInfo *info;
+  float *zero;
+  GLint64 maxBlock;
+
+  if (!MakeCurrent(error))
+    return(0);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+
+  /* the springs pulling on each owned node */
+  info = (NodeInfo *) malloc(((size_t) nn + 1) * sizeof(NodeInfo));
+  incident = (int *) malloc((2 * ((size_t) ni + ne) + 1) * sizeof(int));
+  if (info == NULL || incident == NULL)
+    {
+      free(info);
+      free(incident);
+      sprintf(error, "Could not allocate the springs of %d GPU nodes\n", nn);
+      return(0);
+    }
+  memset(info, 0, ((size_t) nn + 1) * sizeof(NodeInfo));
+  for (k = 0; k < ni; ++k)
+    {
+      ++info[intra[k].index0].count;
+      ++info[intra[k].index1].count;
+    }
+  for (k = 0; k < ne; ++k)
+    {
+      if (flags[inter[k].index0] & GPU_OWNED)
+	++info[inter[k].index0].count;
+      if (flags[inter[k].index1] & GPU_OWNED)
+	++info[inter[k].index1].count;
+    }
+  pos = 0;
+  for (i = 0; i < nn; ++i)
+    {
+      info[i].first = pos;
+      pos += info[i].count;
+      info[i].count = 0;
+      info[i].flags = flags[i];
+      if (flags[i] & GPU_ABSOLUTE)
+	{
+	  info[i].ax = absXY[2*i];
+	  info[i].ay = absXY[2*i+1];
+	}
+    }
+  for (k = 0; k < ni; ++k)
+    {
+      j = intra[k].index0;
+      incident[info[j].first + info[j].count++] = 2 * k;
+      j = intra[k].index1;
+      incident[info[j].first + info[j].count++] = 2 * k + 1;
+    }
+  for (k = 0; k < ne; ++k)
+    {
+      j = inter[k].index0;
+      if (flags[j] & GPU_OWNED)
+	incident[info[j].first + info[j].count++] = 2 * (ni + k);
+      j = inter[k].index1;
+      if (flags[j] & GPU_OWNED)
+	incident[info[j].first + info[j].count++] = 2 * (ni + k) + 1;
+    }
+
+  zero = NULL;
+  if (velocity == NULL)
+    {
+      zero = (float *) malloc(2 * ((size_t) nn + 1) * sizeof(float));
+      if (zero == NULL)
+	{
+	  free(info);
+	  free(incident);
+	  sprintf(error, "Could not allocate the velocities of %d GPU nodes\n",
+		  nn);
+	  return(0);
+	}
+      memset(zero, 0, 2 * ((size_t) nn + 1) * sizeof(float));
+      velocity = zero;
+    }
+  ok = Upload(POSITIONS, xy, 2 * (size_t) nn * sizeof(float),
+	      maxBlock, error) &&
+    Upload(INFO, info, (size_t) nn * sizeof(NodeInfo), maxBlock, error) &&
+    Upload(FORCES, NULL, 2 * (size_t) nn * sizeof(float),
+	     maxBlock, error) &&
+    Upload(VELOCITIES, velocity, 2 * (size_t) nn * sizeof(float),
+	     maxBlock, error) &&
+    Upload(INTRA, intra, (size_t) ni * sizeof(GpuIntraSpring),
+	     maxBlock, error) &&
+    Upload(INTER, inter, (size_t) ne * sizeof(GpuInterSpring),
+	     maxBlock, error) &&
+    Upload(INCIDENT, incident, (size_t) pos * sizeof(int),
+	     maxBlock, error) &&
+    Upload(PARTIAL, NULL, 3 * MAX_GROUPS * sizeof(double),
+	   maxBlock, error);
+  free(info);
+  free(incident);
+  free(zero);
+  if (!ok)
+    return(0);
+  nNodes = nn;
+  nIntra = ni;
+  nInter = ne;
+  for (i = 0; i < N_BUFFERS; ++i)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, buffers[i]);
+  return(1);
+}
+
+int
+GpuForcesUpload (int first, int n, float *xy, float *velocity, char *error)
+{
+  if (n == 0)
+    return(1);
+  if (!MakeCurrent(error))
+    return(0);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[POSITIONS]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+		  2 * (size_t) first * sizeof(float),
+		  2 * (size_t) n * sizeof(float), xy);
+  if (velocity != NULL)
+    {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[VELOCITIES]);
+      glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+		      2 * (size_t) first * sizeof(float),
+		      2 * (size_t) n * sizeof(float), velocity);
+    }
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not upload %d node positions to the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuForcesDownload (int first, int n, float *xy, float *velocity,
+		   char *error)
+{
+  if (n == 0)
+    return(1);
+  if (!MakeCurrent(error))
+    return(0);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[POSITIONS]);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER,
+		     2 * (size_t) first * sizeof(float),
+		     2 * (size_t) n * sizeof(float), xy);
+  if (velocity != NULL)
+    {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[VELOCITIES]);
+      glGetBufferSubData(GL_SHADER_STORAGE_BUFFER,
+			 2 * (size_t) first * sizeof(float),
+			 2 * (size_t) n * sizeof(float), velocity);
+    }
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not download %d node positions from the GPU\n",
+	      n);
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuForcesCompute (float kAbsolute, float kIntra, float kInter,
+		  double *intraEnergy, double *interEnergy, float *maxF,
+		  char *error)
+{
+  int i;
+  int eGroups, fGroups;
+  double m;
+
+  *intraEnergy = 0.0;
+  *interEnergy = 0.0;
+  *maxF = 0.0;
+  if (nNodes == 0)
+    return(1);
+  if (!MakeCurrent(error))
+    return(0);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  eGroups = Groups((long) nNodes + nIntra + nInter);
+  glUseProgram(energyProgram);
+  SetCounts(energyProgram);
+  glUniform1f(glGetUniformLocation(energyProgram, "kAbsolute"), kAbsolute);
+  glUniform1f(glGetUniformLocation(energyProgram, "kIntra"), kIntra);
+  glUniform1f(glGetUniformLocation(energyProgram, "kInter"), kInter);
+  glDispatchCompute(eGroups, 1, 1);
+
+  fGroups = Groups(nNodes);
+  glUseProgram(forceProgram);
+  SetCounts(forceProgram);
+  glUniform1f(glGetUniformLocation(forceProgram, "kAbsolute"), kAbsolute);
+  glUniform1f(glGetUniformLocation(forceProgram, "kIntra"), kIntra);
+  glUniform1f(glGetUniformLocation(forceProgram, "kInter"), kInter);
+  glUniform1i(glGetUniformLocation(forceProgram, "partialBase"),
+	      2 * eGroups);
+  glDispatchCompute(fGroups, 1, 1);
+
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[PARTIAL]);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		     (2 * eGroups + fGroups) * sizeof(double), partial);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not compute the forces on the GPU\n");
+      return(0);
+    }
+  for (i = 0; i < eGroups; ++i)
+    {
+      *intraEnergy += partial[2*i];
+      *interEnergy += partial[2*i+1];
+    }
+  m = 0.0;
+  for (i = 0; i < fGroups; ++i)
+    if (partial[2 * eGroups + i] > m)
+      m = partial[2 * eGroups + i];
+  *maxF = m;
+  return(1);
+}
+
+int
+GpuForcesMove (float scale, float momentum,
+	       float maxStepX, float maxStepY, char *error)
+{
+  if (nNodes == 0)
+    return(1);
+  if (!MakeCurrent(error))
+    return(0);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glUseProgram(moveProgram);
+  SetCounts(moveProgram);
+  glUniform1f(glGetUniformLocation(moveProgram, "scale"), scale);
+  glUniform1f(glGetUniformLocation(moveProgram, "momentum"), momentum);
+  glUniform1f(glGetUniformLocation(moveProgram, "maxStepX"), maxStepX);
+  glUniform1f(glGetUniformLocation(moveProgram, "maxStepY"), maxStepY);
+  glDispatchCompute(Groups(nNodes), 1, 1);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not move the nodes on the GPU\n");
+      return(0);
+    }
+  return(1);
+}
+
+void
+GpuForcesFinish ()
+{
+  if (context == EGL_NO_CONTEXT)
+    return;
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+  glDeleteBuffers(N_BUFFERS, buffers);
+  glDeleteProgram(forceProgram);
+  glDeleteProgram(energyProgram);
+  glDeleteProgram(moveProgram);
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+  context = EGL_NO_CONTEXT;
+  free(partial);
+  partial = NULL;
+  nNodes = 0;
+}
+
+static GLuint
+BuildProgram (const char *text, char *error)
+{
+  GLuint shader, program;
+  GLint ok;
+  char log[1024];
+
+  shader = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(shader, 1, &text, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+    {
+      glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+      sprintf(error, "Could not compile GPU shader:\n%s\n", log);
+      glDeleteShader(shader);
+      return(0);
+    }
+  program = glCreateProgram();
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok)
+    {
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      sprintf(error, "Could not link GPU program:\n%s\n", log);
+      glDeleteProgram(program);
+      return(0);
+    }
+  return(program);
+}
+
+/* Upload replaces buffer b with the n bytes at p, or with n undefined
+   bytes if p is NULL; an empty buffer is given a few bytes so that it
+   can still be bound */
+static int
+Upload (int b, void *p, size_t n, GLint64 maxBlock, char *error)
+{
+  if ((GLint64) n > maxBlock)
+    {
+      sprintf(error, "GPU buffer of %zu bytes is larger than the %lld allowed\n",
+	      n, (long long) maxBlock);
+      return(0);
+    }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[b]);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, n > 0 ? n : 16, NULL,
+	       GL_DYNAMIC_DRAW);
+  if (p != NULL && n > 0)
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n, p);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not upload %zu bytes to the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+/* Groups returns the number of work groups to dispatch for n items */
+static int
+Groups (long n)
+{
+  long g;
+
+  g = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+  if (g > MAX_GROUPS)
+    g = MAX_GROUPS;
+  if (g < 1)
+    g = 1;
+  return((int) g);
+}
+
+static void
+SetCounts (GLuint program)
+{
+  glUniform1i(glGetUniformLocation(program, "nNodes"), nNodes);
+  glUniform1i(glGetUniformLocation(program, "nIntra"), nIntra);
+  glUniform1i(glGetUniformLocation(program, "nInter"), nInter);
+}
+
+static int
+MakeCurrent (char *error)
+{
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not make the GPU context current\n");
+      return(0);
+    }
+  return(1);
+}
+
+#endif
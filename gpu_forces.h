@@ -0,0 +1,93 @@
+//
+// gpu_forces.h - the spring forces and node moves of align's
+//                iterations computed on a GPU through OpenGL compute
+//                shaders, in a headless (EGL) context; the nodes of
+//                the images a process holds and the springs between
+//                them stay on the GPU, and only the positions the
+//                process exchanges with others go back and forth
+//
+#ifndef GPU_FORCES_H
+#define GPU_FORCES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the flags of a node */
+#define GPU_OWNED		1	/* the node's image is owned by this
+					   process, so its forces and
+					   absolute energy are computed */
+#define GPU_MOVABLE		2	/* the node is moved */
+#define GPU_CONSTRAINED_X	4	/* the node may not move in x */
+#define GPU_CONSTRAINED_Y	8	/* the node may not move in y */
+#define GPU_ABSOLUTE		16	/* the node is pulled toward an
+					   absolute position */
+
+/* an intra-image spring between two nodes; its constant is multiplied
+   by the kIntra of the computation */
+typedef struct GpuIntraSpring
+{
+  int index0, index1;
+  float nomD;
+  float k;
+} GpuIntraSpring;
+
+/* an inter-image spring, which pulls node index0 toward node index1
+   displaced by (offsetX, offsetY); its constant is multiplied by the
+   kInter of the computation, and its energy by energyFactor */
+typedef struct GpuInterSpring
+{
+  int index0, index1;
+  float offsetX, offsetY;
+  float k;
+  float energyFactor;
+} GpuInterSpring;
+
+/* GpuForcesInit creates the OpenGL context and programs; it returns 0,
+   with a message in error, if there is no usable GPU or align was built
+   without GPU support (see GPU_FORCES in the Makefile) */
+int GpuForcesInit (char *error);
+
+/* GpuForcesLoad replaces the nodes and springs on the GPU: nNodes nodes,
+   with their positions in xy (x and y of each node; an x greater than
+   0.5e+30 marks a node that is not valid), flags, absolute positions
+   in absXY (only read for the nodes with GPU_ABSOLUTE; a coordinate
+   greater than 0.5e+30 exerts no force), and the last steps taken in
+   velocity (NULL if none); it returns 0, with a message in error, if
+   they do not fit */
+int GpuForcesLoad (int nNodes, float *xy, unsigned char *flags,
+		   float *absXY, float *velocity,
+		   int nIntra, GpuIntraSpring *intra,
+		   int nInter, GpuInterSpring *inter,
+		   char *error);
+
+/* GpuForcesUpload replaces the positions of the n nodes from first with
+   those in xy, and, if velocity is not NULL, their last steps with those
+   in velocity; GpuForcesDownload copies them back the same way */
+int GpuForcesUpload (int first, int n, float *xy, float *velocity,
+		     char *error);
+int GpuForcesDownload (int first, int n, float *xy, float *velocity,
+		       char *error);
+
+/* GpuForcesCompute computes the force on each node that is owned; it
+   sets *intraEnergy to the energy of the absolute and intra-image
+   springs, *interEnergy to that of the inter-image springs, and *maxF
+   to the largest force, on the axes it may move along, of a node that
+   is movable */
+int GpuForcesCompute (float kAbsolute, float kIntra, float kInter,
+		      double *intraEnergy, double *interEnergy, float *maxF,
+		      char *error);
+
+/* GpuForcesMove moves each movable node by scale times its last force,
+   plus momentum times its last step, clamped to maxStepX and maxStepY,
+   and records that as its step */
+int GpuForcesMove (float scale, float momentum,
+		   float maxStepX, float maxStepY, char *error);
+
+void GpuForcesFinish ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPU_FORCES_H */
@@ -0,0 +1,694 @@
+/*
+ * gpu_moves.c -- evaluates the candidate moves of register's move
+ *                loop on a GPU
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gpu_moves.h"
+
+#ifndef GPU_MOVES
+
+int
+GpuMovesInit (char *error)
+{
+  sprintf(error, "register was built without GPU support (see GPU_MOVES in the Makefile)\n");
+  return(0);
+}
+
+int
+GpuMovesLoad (GpuMoveLevel *level, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuMovesEvaluate (int n, GpuMove *moves, GpuMoveDelta *deltas,
+		  char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuMovesCommit (int n, GpuMove *moves, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+void
+GpuMovesFinish ()
+{
+}
+
+#else
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+
+#define GROUP_SIZE	256	/* invocations in a work group */
+#define MAX_GROUPS	65535	/* work groups in a dispatch */
+
+/* the buffers, each at the binding of the same index */
+#define MAP		0
+#define IMAGE		1
+#define IMAGE_MASK	2
+#define REF		3
+#define REF_MASK	4
+#define NOMINAL		5
+#define MOVES		6
+#define DELTAS		7
+#define N_BUFFERS	8
+
+/* the declarations shared by the programs; the masks are the bytes
+   of register's bit masks packed 4 to a uint, as a little-endian
+   host lays them out */
+#define SHADER_HEADER \
+  "#version 430 core\n" \
+  "layout(local_size_x = 256) in;\n" \
+  "struct Move { int x; int y; float cx; float cy; };\n" \
+  "uniform int mpw;\n" \
+  "uniform int mph;\n" \
+  "uniform int mox;\n" \
+  "uniform int moy;\n" \
+  "uniform int factor;\n" \
+  "uniform int iw;\n" \
+  "uniform int ih;\n" \
+  "uniform int imbpl;\n" \
+  "uniform int imgox;\n" \
+  "uniform int imgoy;\n" \
+  "uniform int rw;\n" \
+  "uniform int rh;\n" \
+  "uniform int rmbpl;\n" \
+  "uniform int refox;\n" \
+  "uniform int refoy;\n"
+
+/* the evaluation program is TryMove without the correspondence and
+   constraining terms: one work group takes a move, its invocations
+   go through the pixels of the cells around the point, and the
+   first four each take one of those cells for the distortion.  All
+   of it is in double, as in register; GLSL only has atan in float,
+   and that to far fewer bits on some drivers, so the angle of a cell
+   side from its nominal direction comes from Atan, the rational
+   approximation of the Cephes library. */
+static const char *evaluateShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer MapBuffer { float map[]; };\n"
+  "layout(std430, binding = 1) readonly buffer ImageBuffer { float image[]; };\n"
+  "layout(std430, binding = 2) readonly buffer ImageMaskBuffer { uint imageMask[]; };\n"
+  "layout(std430, binding = 3) readonly buffer RefBuffer { float ref[]; };\n"
+  "layout(std430, binding = 4) readonly buffer RefMaskBuffer { uint refMask[]; };\n"
+  "layout(std430, binding = 5) readonly buffer NominalBuffer { double nominal[]; };\n"
+  "layout(std430, binding = 6) readonly buffer MoveBuffer { Move moves[]; };\n"
+  "layout(std430, binding = 7) writeonly buffer DeltaBuffer { double delta[]; };\n"
+  "uniform int moveBase;\n"
+  "shared double sums[7 * 256];\n"
+  "Move m;\n"
+  "bool ImageBit (int x, int y)\n"
+  "{\n"
+  "  int b = y * imbpl + (x >> 3);\n"
+  "  return ((imageMask[b >> 2] >> uint(8 * (b & 3) + 7 - (x & 7))) & 1u) != 0u;\n"
+  "}\n"
+  "bool RefBit (int x, int y)\n"
+  "{\n"
+  "  int b = y * rmbpl + (x >> 3);\n"
+  "  return ((refMask[b >> 2] >> uint(8 * (b & 3) + 7 - (x & 7))) & 1u) != 0u;\n"
+  "}\n"
+  "dvec3 Point (int x, int y)\n"
+  "{\n"
+  "  int i = 3 * (y * mpw + x);\n"
+  "  return dvec3(map[i], map[i + 1], map[i + 2]);\n"
+  "}\n"
+  "dvec3 MovedPoint (int x, int y)\n"
+  "{\n"
+  "  if (x == m.x && y == m.y)\n"
+  "    return dvec3(m.cx, m.cy, 1.0lf);\n"
+  "  return Point(x, y);\n"
+  "}\n"
+  "dvec2 Bilinear (dvec3 p00, dvec3 p01, dvec3 p10, dvec3 p11,\n"
+  "                double rrx, double rry)\n"
+  "{\n"
+  "  return p00.xy * (rrx - 1.0lf) * (rry - 1.0lf)\n"
+  "    - p10.xy * rrx * (rry - 1.0lf)\n"
+  "    - p01.xy * (rrx - 1.0lf) * rry\n"
+  "    + p11.xy * rrx * rry;\n"
+  "}\n"
+  "bool Sample (dvec2 r, out double rv)\n"
+  "{\n"
+  "  double rx = double(factor) * r.x - 0.5lf - double(refox);\n"
+  "  double ry = double(factor) * r.y - 0.5lf - double(refoy);\n"
+  "  int irx = int(rx + 1.0lf) - 1;\n"
+  "  int iry = int(ry + 1.0lf) - 1;\n"
+  "  if (irx < 0 || irx >= rw - 1 || iry < 0 || iry >= rh - 1)\n"
+  "    return false;\n"
+  "  double rrx = rx - double(irx);\n"
+  "  double rry = ry - double(iry);\n"
+  "  if (!RefBit(irx, iry) ||\n"
+  "      (rrx > 0.0lf && !RefBit(irx + 1, iry)) ||\n"
+  "      (rry > 0.0lf && !RefBit(irx, iry + 1)) ||\n"
+  "      (rrx > 0.0lf && rry > 0.0lf && !RefBit(irx + 1, iry + 1)))\n"
+  "    return false;\n"
+  "  int i = iry * rw + irx;\n"
+  "  double r00 = double(ref[i]);\n"
+  "  double r10 = double(ref[i + 1]);\n"
+  "  double r01 = double(ref[i + rw]);\n"
+  "  double r11 = double(ref[i + rw + 1]);\n"
+  "  rv = r00 * (rrx - 1.0lf) * (rry - 1.0lf)\n"
+  "    - r10 * rrx * (rry - 1.0lf)\n"
+  "    - r01 * (rrx - 1.0lf) * rry\n"
+  "    + r11 * rrx * rry;\n"
+  "  return true;\n"
+  "}\n"
+  "const double PI = 3.14159265358979323846lf;\n"
+  "double Atan (double x)\n"
+  "{\n"
+  "  double y = 0.0lf;\n"
+  "  double extra = 0.0lf;\n"
+  "  if (x > 2.41421356237309504880lf)\n"
+  "    {\n"
+  "      y = 0.5lf * PI;\n"
+  "      extra = 6.123233995736765886130e-17lf;\n"
+  "      x = -1.0lf / x;\n"
+  "    }\n"
+  "  else if (x > 0.66lf)\n"
+  "    {\n"
+  "      y = 0.25lf * PI;\n"
+  "      extra = 3.061616997868382943065e-17lf;\n"
+  "      x = (x - 1.0lf) / (x + 1.0lf);\n"
+  "    }\n"
+  "  double z = x * x;\n"
+  "  z = z * ((((-8.750608600031904122785e-1lf * z\n"
+  "              - 1.615753718733365076637e1lf) * z\n"
+  "             - 7.500855792314704667340e1lf) * z\n"
+  "            - 1.228866684490136173410e2lf) * z\n"
+  "           - 6.485021904942025371773e1lf) /\n"
+  "    (((((z + 2.485846490142306297962e1lf) * z\n"
+  "        + 1.650270098316988542046e2lf) * z\n"
+  "       + 4.328810604912902668951e2lf) * z\n"
+  "      + 4.853903996359136964868e2lf) * z\n"
+  "     + 1.945506571482613964425e2lf);\n"
+  "  return y + (x * z + x + extra);\n"
+  "}\n"
+  "double AngleDifference (dvec2 nom, dvec3 p, dvec3 q)\n"
+  "{\n"
+  "  dvec2 v = q.xy - p.xy;\n"
+  "  double s = abs(nom.x * v.y - nom.y * v.x);\n"
+  "  double c = dot(nom, v);\n"
+  "  if (c > 0.0lf)\n"
+  "    return Atan(s / c);\n"
+  "  if (c < 0.0lf)\n"
+  "    return PI - Atan(s / -c);\n"
+  "  return s > 0.0lf ? 0.5lf * PI : 0.0lf;\n"
+  "}\n"
+  "double Terms (dvec3 p0, dvec3 p1, dvec3 p2, dvec3 p3, int k)\n"
+  "{\n"
+  "  double l0 = length(p1.xy - p0.xy) - nominal[8 * k];\n"
+  "  double l1 = length(p2.xy - p1.xy) - nominal[8 * k + 1];\n"
+  "  double l2 = length(p3.xy - p2.xy) - nominal[8 * k + 2];\n"
+  "  double l3 = length(p0.xy - p3.xy) - nominal[8 * k + 3];\n"
+  "  double txd = AngleDifference(dvec2(nominal[8 * k + 4], nominal[8 * k + 5]),\n"
+  "                               p0, p3);\n"
+  "  double tyd = AngleDifference(dvec2(nominal[8 * k + 6], nominal[8 * k + 7]),\n"
+  "                               p0, p1);\n"
+  "  return txd * txd + tyd * tyd +\n"
+  "    l0 * l0 + l1 * l1 + l2 * l2 + l3 * l3;\n"
+  "}\n"
+  "double CellDistortion (int x, int y)\n"
+  "{\n"
+  "  dvec3 p0 = Point(x, y);\n"
+  "  dvec3 p1 = Point(x, y + 1);\n"
+  "  dvec3 p2 = Point(x + 1, y + 1);\n"
+  "  dvec3 p3 = Point(x + 1, y);\n"
+  "  if (p0.z == 0.0lf || p1.z == 0.0lf || p2.z == 0.0lf || p3.z == 0.0lf)\n"
+  "    return 0.0lf;\n"
+  "  int k = y * (mpw - 1) + x;\n"
+  "  return Terms(MovedPoint(x, y), MovedPoint(x, y + 1),\n"
+  "               MovedPoint(x + 1, y + 1), MovedPoint(x + 1, y), k) -\n"
+  "    Terms(p0, p1, p2, p3, k);\n"
+  "}\n"
+  "void main ()\n"
+  "{\n"
+  "  uint l = gl_LocalInvocationID.x;\n"
+  "  int g = moveBase + int(gl_WorkGroupID.x);\n"
+  "  double s[7];\n"
+  "  for (int j = 0; j < 7; ++j)\n"
+  "    s[j] = 0.0lf;\n"
+  "  m = moves[g];\n"
+  "  int sx = max((m.x - 1 + mox) * factor - imgox, 0);\n"
+  "  int ex = min((m.x + 1 + mox) * factor - 1 - imgox, iw - 1);\n"
+  "  int sy = max((m.y - 1 + moy) * factor - imgoy, 0);\n"
+  "  int ey = min((m.y + 1 + moy) * factor - 1 - imgoy, ih - 1);\n"
+  "  int w = ex - sx + 1;\n"
+  "  int n = (w > 0 && ey >= sy) ? w * (ey - sy + 1) : 0;\n"
+  "  for (int t = int(l); t < n; t += 256)\n"
+  "    {\n"
+  "      int x = sx + t % w;\n"
+  "      int y = sy + t / w;\n"
+  "      if (!ImageBit(x, y))\n"
+  "        continue;\n"
+  "      double xv = (double(x) + 0.5lf + double(imgox)) / double(factor) - double(mox);\n"
+  "      double yv = (double(y) + 0.5lf + double(imgoy)) / double(factor) - double(moy);\n"
+  "      int ixv = int(xv + 2.0lf) - 2;\n"
+  "      int iyv = int(yv + 2.0lf) - 2;\n"
+  "      if (ixv < 0 || ixv >= mpw - 1 || iyv < 0 || iyv >= mph - 1)\n"
+  "        continue;\n"
+  "      if ((ixv != m.x && ixv + 1 != m.x) || (iyv != m.y && iyv + 1 != m.y))\n"
+  "        continue;\n"
+  "      double rrx = xv - double(ixv);\n"
+  "      double rry = yv - double(iyv);\n"
+  "      double iv = double(image[y * iw + x]);\n"
+  "      double rv;\n"
+  "      dvec3 p00 = Point(ixv, iyv);\n"
+  "      dvec3 p01 = Point(ixv, iyv + 1);\n"
+  "      dvec3 p10 = Point(ixv + 1, iyv);\n"
+  "      dvec3 p11 = Point(ixv + 1, iyv + 1);\n"
+  "      if (p00.z != 0.0lf && p01.z != 0.0lf && p10.z != 0.0lf && p11.z != 0.0lf &&\n"
+  "          Sample(Bilinear(p00, p01, p10, p11, rrx, rry), rv))\n"
+  "        {\n"
+  "          s[0] -= iv;\n"
+  "          s[1] -= iv * iv;\n"
+  "          s[2] -= rv;\n"
+  "          s[3] -= rv * rv;\n"
+  "          s[4] -= iv * rv;\n"
+  "          s[6] -= 1.0lf;\n"
+  "        }\n"
+  "      p00 = MovedPoint(ixv, iyv);\n"
+  "      p01 = MovedPoint(ixv, iyv + 1);\n"
+  "      p10 = MovedPoint(ixv + 1, iyv);\n"
+  "      p11 = MovedPoint(ixv + 1, iyv + 1);\n"
+  "      if (p00.z != 0.0lf && p01.z != 0.0lf && p10.z != 0.0lf && p11.z != 0.0lf &&\n"
+  "          Sample(Bilinear(p00, p01, p10, p11, rrx, rry), rv))\n"
+  "        {\n"
+  "          s[0] += iv;\n"
+  "          s[1] += iv * iv;\n"
+  "          s[2] += rv;\n"
+  "          s[3] += rv * rv;\n"
+  "          s[4] += iv * rv;\n"
+  "          s[6] += 1.0lf;\n"
+  "        }\n"
+  "    }\n"
+  "  if (l < 4u)\n"
+  "    {\n"
+  "      int x = m.x - 1 + int(l & 1u);\n"
+  "      int y = m.y - 1 + int(l >> 1);\n"
+  "      if (x >= 0 && x < mpw - 1 && y >= 0 && y < mph - 1)\n"
+  "        s[5] = CellDistortion(x, y);\n"
+  "    }\n"
+  "  for (int j = 0; j < 7; ++j)\n"
+  "    sums[j * 256 + int(l)] = s[j];\n"
+  "  barrier();\n"
+  "  for (uint h = 128u; h > 0u; h >>= 1)\n"
+  "    {\n"
+  "      if (l < h)\n"
+  "        for (int j = 0; j < 7; ++j)\n"
+  "          sums[j * 256 + int(l)] += sums[j * 256 + int(l + h)];\n"
+  "      barrier();\n"
+  "    }\n"
+  "  if (l == 0u)\n"
+  "    for (int j = 0; j < 7; ++j)\n"
+  "      delta[7 * g + j] = sums[j * 256];\n"
+  "}\n";
+
+/* the commit program writes the accepted moves into the map */
+static const char *commitShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) buffer MapBuffer { float map[]; };\n"
+  "layout(std430, binding = 6) readonly buffer MoveBuffer { Move moves[]; };\n"
+  "uniform int nMoves;\n"
+  "void main ()\n"
+  "{\n"
+  "  for (int i = int(gl_GlobalInvocationID.x); i < nMoves;\n"
+  "       i += int(gl_NumWorkGroups.x) * 256)\n"
+  "    {\n"
+  "      int k = 3 * (moves[i].y * mpw + moves[i].x);\n"
+  "      map[k] = moves[i].cx;\n"
+  "      map[k + 1] = moves[i].cy;\n"
+  "      map[k + 2] = 1.0;\n"
+  "    }\n"
+  "}\n";
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static GLuint evaluateProgram = 0, commitProgram = 0;
+static GLuint buffers[N_BUFFERS];
+static int moveCapacity = 0;	/* moves the MOVES and DELTAS buffers
+				   hold */
+
+static GLuint BuildProgram (const char *text, char *error);
+static int Upload (int b, void *p, size_t n, GLint64 maxBlock, char *error);
+static int Reserve (int n, char *error);
+static int Groups (long n);
+static void SetLevel (GLuint program, GpuMoveLevel *l);
+static int MakeCurrent (char *error);
+
+int
+GpuMovesInit (char *error)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+  EGLint major, minor;
+  EGLint attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 4,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+
+  if (context != EGL_NO_CONTEXT)
+    return(1);
+
+  /* as in gpu_forces.c, a node without a display server is reached
+     through Mesa's surfaceless platform */
+  display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+      getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+	eglGetProcAddress("eglGetPlatformDisplayEXT");
+      if (getPlatformDisplay == NULL)
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+      display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+				   EGL_DEFAULT_DISPLAY, NULL);
+      if (display == EGL_NO_DISPLAY ||
+	  !eglInitialize(display, &major, &minor))
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+    }
+  if (!eglBindAPI(EGL_OPENGL_API))
+    {
+      sprintf(error, "EGL does not support OpenGL\n");
+      return(0);
+    }
+  context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+			     attributes);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not create an OpenGL 4.3 context (EGL error 0x%x)\n",
+	      eglGetError());
+      context = EGL_NO_CONTEXT;
+      return(0);
+    }
+
+  evaluateProgram = BuildProgram(evaluateShader, error);
+  if (evaluateProgram == 0)
+    return(0);
+  commitProgram = BuildProgram(commitShader, error);
+  if (commitProgram == 0)
+    return(0);
+  glGenBuffers(N_BUFFERS, buffers);
+  moveCapacity = 0;
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not set up the GPU move evaluation\n");
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuMovesLoad (GpuMoveLevel *l, char *error)
+{
+  int i;
+  int ok;
+  size_t k;
+  size_t nCells;
+  double *nominal;
+  GLint64 maxBlock;
+
+  if (!MakeCurrent(error))
+    return(0);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+
+  /* the nominal geometry of each cell, together, with the angles of
+     its sides as directions */
+  nCells = ((size_t) (l->mpw - 1)) * (l->mph - 1);
+  nominal = (double *) malloc((8 * nCells + 1) * sizeof(double));
+  if (nominal == NULL)
+    {
+      sprintf(error, "Could not allocate the nominal geometry of %zu GPU cells\n",
+	      nCells);
+      return(0);
+    }
+  for (k = 0; k < nCells; ++k)
+    {
+      nominal[8*k] = l->nomL0[k];
+      nominal[8*k+1] = l->nomL1[k];
+      nominal[8*k+2] = l->nomL2[k];
+      nominal[8*k+3] = l->nomL3[k];
+      nominal[8*k+4] = cos(l->nomThetaX[k]);
+      nominal[8*k+5] = sin(l->nomThetaX[k]);
+      nominal[8*k+6] = cos(l->nomThetaY[k]);
+      nominal[8*k+7] = sin(l->nomThetaY[k]);
+    }
+  ok = Upload(MAP, l->map, 3 * ((size_t) l->mpw) * l->mph * sizeof(float),
+	      maxBlock, error) &&
+    Upload(IMAGE, l->image, ((size_t) l->iw) * l->ih * sizeof(float),
+	   maxBlock, error) &&
+    Upload(IMAGE_MASK, l->imageMask, l->ih * l->imbpl, maxBlock, error) &&
+    Upload(REF, l->ref, ((size_t) l->rw) * l->rh * sizeof(float),
+	   maxBlock, error) &&
+    Upload(REF_MASK, l->refMask, l->rh * l->rmbpl, maxBlock, error) &&
+    Upload(NOMINAL, nominal, 8 * nCells * sizeof(double), maxBlock, error);
+  free(nominal);
+  if (!ok)
+    return(0);
+  for (i = 0; i < N_BUFFERS; ++i)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, buffers[i]);
+  glUseProgram(evaluateProgram);
+  SetLevel(evaluateProgram, l);
+  glUseProgram(commitProgram);
+  SetLevel(commitProgram, l);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not load the level onto the GPU\n");
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuMovesEvaluate (int n, GpuMove *moves, GpuMoveDelta *deltas,
+		  char *error)
+{
+  int first;
+  int count;
+
+  if (n == 0)
+    return(1);
+  if (!MakeCurrent(error) || !Reserve(n, error))
+    return(0);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[MOVES]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		  (size_t) n * sizeof(GpuMove), moves);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glUseProgram(evaluateProgram);
+  for (first = 0; first < n; first += MAX_GROUPS)
+    {
+      count = n - first;
+      if (count > MAX_GROUPS)
+	count = MAX_GROUPS;
+      glUniform1i(glGetUniformLocation(evaluateProgram, "moveBase"), first);
+      glDispatchCompute(count, 1, 1);
+    }
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[DELTAS]);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		     (size_t) n * sizeof(GpuMoveDelta), deltas);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not evaluate %d moves on the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuMovesCommit (int n, GpuMove *moves, char *error)
+{
+  if (n == 0)
+    return(1);
+  if (!MakeCurrent(error) || !Reserve(n, error))
+    return(0);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[MOVES]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		  (size_t) n * sizeof(GpuMove), moves);
+  glUseProgram(commitProgram);
+  glUniform1i(glGetUniformLocation(commitProgram, "nMoves"), n);
+  glDispatchCompute(Groups(n), 1, 1);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not make %d moves on the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+void
+GpuMovesFinish ()
+{
+  if (context == EGL_NO_CONTEXT)
+    return;
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+  glDeleteBuffers(N_BUFFERS, buffers);
+  glDeleteProgram(evaluateProgram);
+  glDeleteProgram(commitProgram);
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+  context = EGL_NO_CONTEXT;
+  moveCapacity = 0;
+}
+
+static GLuint
+BuildProgram (const char *text, char *error)
+{
+  GLuint shader, program;
+  GLint ok;
+  char log[1024];
+
+  shader = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(shader, 1, &text, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+    {
+      glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+      sprintf(error, "Could not compile GPU shader:\n%s\n", log);
+      glDeleteShader(shader);
+      return(0);
+    }
+  program = glCreateProgram();
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok)
+    {
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      sprintf(error, "Could not link GPU program:\n%s\n", log);
+      glDeleteProgram(program);
+      return(0);
+    }
+  return(program);
+}
+
+/* Upload replaces buffer b with the n bytes at p, or with n undefined
+   bytes if p is NULL; the buffer is rounded up to whole uints, so that
+   the shaders can read the last bytes of a mask, and an empty buffer
+   is given a few bytes so that it can still be bound */
+static int
+Upload (int b, void *p, size_t n, GLint64 maxBlock, char *error)
+{
+  if ((GLint64) n > maxBlock)
+    {
+      sprintf(error, "GPU buffer of %zu bytes is larger than the %lld allowed\n",
+	      n, (long long) maxBlock);
+      return(0);
+    }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[b]);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, n > 0 ? (n + 3) & ~((size_t) 3) : 16,
+	       NULL, GL_DYNAMIC_DRAW);
+  if (p != NULL && n > 0)
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n, p);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not upload %zu bytes to the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+/* Reserve makes room for n moves and their deltas */
+static int
+Reserve (int n, char *error)
+{
+  GLint64 maxBlock;
+
+  if (n <= moveCapacity)
+    return(1);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+  if (!Upload(MOVES, NULL, (size_t) n * sizeof(GpuMove), maxBlock, error) ||
+      !Upload(DELTAS, NULL, (size_t) n * sizeof(GpuMoveDelta),
+	      maxBlock, error))
+    return(0);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MOVES, buffers[MOVES]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DELTAS, buffers[DELTAS]);
+  moveCapacity = n;
+  return(1);
+}
+
+/* Groups returns the number of work groups to dispatch for n items */
+static int
+Groups (long n)
+{
+  long g;
+
+  g = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+  if (g > MAX_GROUPS)
+    g = MAX_GROUPS;
+  if (g < 1)
+    g = 1;
+  return((int) g);
+}
+
+static void
+SetLevel (GLuint program, GpuMoveLevel *l)
+{
+  glUniform1i(glGetUniformLocation(program, "mpw"), l->mpw);
+  glUniform1i(glGetUniformLocation(program, "mph"), l->mph);
+  glUniform1i(glGetUniformLocation(program, "mox"), l->mox);
+  glUniform1i(glGetUniformLocation(program, "moy"), l->moy);
+  glUniform1i(glGetUniformLocation(program, "factor"), l->factor);
+  glUniform1i(glGetUniformLocation(program, "iw"), (int) l->iw);
+  glUniform1i(glGetUniformLocation(program, "ih"), (int) l->ih);
+  glUniform1i(glGetUniformLocation(program, "imbpl"), (int) l->imbpl);
+  glUniform1i(glGetUniformLocation(program, "imgox"), l->imgox);
+  glUniform1i(glGetUniformLocation(program, "imgoy"), l->imgoy);
+  glUniform1i(glGetUniformLocation(program, "rw"), (int) l->rw);
+  glUniform1i(glGetUniformLocation(program, "rh"), (int) l->rh);
+  glUniform1i(glGetUniformLocation(program, "rmbpl"), (int) l->rmbpl);
+  glUniform1i(glGetUniformLocation(program, "refox"), l->refox);
+  glUniform1i(glGetUniformLocation(program, "refoy"), l->refoy);
+}
+
+static int
+MakeCurrent (char *error)
+{
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not make the GPU context current\n");
+      return(0);
+    }
+  return(1);
+}
+
+#endif
@@ -0,0 +1,84 @@
+//
+// gpu_moves.h - the candidate moves of register's move loop evaluated
+//               on a GPU through OpenGL compute shaders, in a headless
+//               (EGL) context; the images, the nominal geometry of the
+//               map cells, and the map of a level stay on the GPU, and
+//               only the moves and what they would change go back and
+//               forth
+//
+#ifndef GPU_MOVES_H
+#define GPU_MOVES_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the state of one level of the move loop, as in register's
+   MoveState; map holds the x, y, and c of each of the mpw x mph map
+   points (the layout of a MapElement), and the nominal arrays have
+   one entry for each of the (mpw-1) x (mph-1) cells */
+typedef struct GpuMoveLevel
+{
+  int mpw, mph;
+  int mox, moy;
+  int factor;
+  float *map;
+  float *image;
+  unsigned char *imageMask;
+  unsigned int iw, ih;
+  size_t imbpl;
+  int imgox, imgoy;
+  float *ref;
+  unsigned char *refMask;
+  unsigned int rw, rh;
+  size_t rmbpl;
+  int refox, refoy;
+  double *nomL0, *nomL1, *nomL2, *nomL3;
+  double *nomThetaX, *nomThetaY;
+} GpuMoveLevel;
+
+/* a candidate move of map point (x, y) to (cx, cy) */
+typedef struct GpuMove
+{
+  int x, y;
+  float cx, cy;
+} GpuMove;
+
+/* the changes a move would make to the correlation sums of the level
+   (points is the change in the number of samples, a whole number),
+   and to the sum of the distortion terms of the cells around it */
+typedef struct GpuMoveDelta
+{
+  double si, si2, sr, sr2, sir;
+  double distortion;
+  double points;
+} GpuMoveDelta;
+
+/* GpuMovesInit creates the OpenGL context and programs; it returns 0,
+   with a message in error, if there is no usable GPU or register was
+   built without GPU support (see GPU_MOVES in the Makefile) */
+int GpuMovesInit (char *error);
+
+/* GpuMovesLoad replaces the level on the GPU; it returns 0, with a
+   message in error, if it does not fit */
+int GpuMovesLoad (GpuMoveLevel *level, char *error);
+
+/* GpuMovesEvaluate sets deltas[i] to what moves[i] would change, for
+   each of the n moves, all against the map on the GPU; the moves
+   must be far enough apart (at least 3 map points in x or y) that no
+   two of them touch the same cell */
+int GpuMovesEvaluate (int n, GpuMove *moves, GpuMoveDelta *deltas,
+		      char *error);
+
+/* GpuMovesCommit makes the n moves in the map on the GPU */
+int GpuMovesCommit (int n, GpuMove *moves, char *error);
+
+void GpuMovesFinish ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPU_MOVES_H */
@@ -0,0 +1,523 @@
+/*
+ * gpu_render.c -- renders the output tiles of apply_map on a GPU
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpu_render.h"
+
+#ifndef GPU_RENDER
+
+int
+GpuInit (char *error)
+{
+  sprintf(error, "apply_map was built without GPU support (see GPU_RENDER in the Makefile)\n");
+  return(0);
+}
+
+int
+GpuLoadSource (GpuSource *s, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRenderTile (int x0, int y0, int w, int h,
+	       unsigned short *weight, size_t stride,
+	       unsigned short **newWeight, unsigned char **value,
+	       char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+void
+GpuFinish ()
+{
+}
+
+#else
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+
+/* the vertex shader places the scan map elements in the tile, and
+   passes on their map coordinates to be interpolated */
+static const char *vertexShader =
+  "#version 430 core\n"
+  "layout(location = 0) in vec4 node;\n"
+  "uniform vec2 origin;\n"
+  "uniform vec2 size;\n"
+  "noperspective out vec2 src;\n"
+  "void main ()\n"
+  "{\n"
+  "  src = node.zw;\n"
+  "  gl_Position = vec4(2.0 * (node.xy - origin) / size - 1.0, 0.0, 1.0);\n"
+  "}\n";
+
+/* the fragment shader is the body of apply_map's PaintRows after the
+   source point is found; the bilinear interpolation is done by hand
+   so that the masked corners count as 0, as they do there, and the
+   weight goes to the depth buffer so that the depth test keeps the
+   greatest */
+static const char *fragmentShader =
+  "#version 430 core\n"
+  "noperspective in vec2 src;\n"
+  "layout(location = 0) out uint value;\n"
+  "layout(std430, binding = 0) readonly buffer ImageBuffer { uint image[]; };\n"
+  "layout(std430, binding = 1) readonly buffer DistBuffer { uint dist[]; };\n"
+  "layout(std430, binding = 2) readonly buffer MaskBuffer { uint mask[]; };\n"
+  "uniform vec2 mapOffset;\n"
+  "uniform float mFactor;\n"
+  "uniform int transformed;\n"
+  "uniform vec3 xf0;\n"
+  "uniform vec3 xf1;\n"
+  "uniform float sampleFactor;\n"
+  "uniform int iw;\n"
+  "uniform int ih;\n"
+  "uniform int mbpl;\n"
+  "uniform vec2 center;\n"
+  "uniform float blackValue;\n"
+  "uniform float range;\n"
+  "uint ImageByte (int i) { return (image[i >> 2] >> (8 * (i & 3))) & 255u; }\n"
+  "uint DistByte (int i) { return (dist[i >> 2] >> (8 * (i & 3))) & 255u; }\n"
+  "bool Masked (int x, int y)\n"
+  "{\n"
+  "  int i = y * mbpl + (x >> 3);\n"
+  "  return (((mask[i >> 2] >> (8 * (i & 3))) & (128u >> (x & 7))) != 0u);\n"
+  "}\n"
+  "void main ()\n"
+  "{\n"
+  "  vec2 mv = (src + mapOffset) * mFactor - 0.5;\n"
+  "  vec2 v = mv;\n"
+  "  if (transformed != 0)\n"
+  "    v = vec2(dot(xf0, vec3(mv + 0.5, 1.0)) - 0.5,\n"
+  "             dot(xf1, vec3(mv + 0.5, 1.0)) - 0.5);\n"
+  "  vec2 s = v;\n"
+  "  if (sampleFactor > 1.0)\n"
+  "    s = (v + 0.5) / sampleFactor - 0.5;\n"
+  "  ivec2 i0 = ivec2(floor(s));\n"
+  "  if (i0.x < -1 || i0.x >= iw || i0.y < -1 || i0.y >= ih)\n"
+  "    discard;\n"
+  "  vec2 r = s - vec2(i0);\n"
+  "  float r00 = 0.0, r01 = 0.0, r10 = 0.0, r11 = 0.0;\n"
+  "  float d00 = 0.0, d01 = 0.0, d10 = 0.0, d11 = 0.0;\n"
+  "  if (i0.x >= 0 && i0.y >= 0 && !Masked(i0.x, i0.y))\n"
+  "    {\n"
+  "      r00 = float(ImageByte(i0.y * iw + i0.x));\n"
+  "      d00 = float(DistByte(i0.y * iw + i0.x));\n"
+  "    }\n"
+  "  if (i0.x >= 0 && i0.y + 1 < ih && !Masked(i0.x, i0.y + 1))\n"
+  "    {\n"
+  "      r01 = float(ImageByte((i0.y + 1) * iw + i0.x));\n"
+  "      d01 = float(DistByte((i0.y + 1) * iw + i0.x));\n"
+  "    }\n"
+  "  if (i0.x + 1 < iw && i0.y >= 0 && !Masked(i0.x + 1, i0.y))\n"
+  "    {\n"
+  "      r10 = float(ImageByte(i0.y * iw + i0.x + 1));\n"
+  "      d10 = float(DistByte(i0.y * iw + i0.x + 1));\n"
+  "    }\n"
+  "  if (i0.x + 1 < iw && i0.y + 1 < ih && !Masked(i0.x + 1, i0.y + 1))\n"
+  "    {\n"
+  "      r11 = float(ImageByte((i0.y + 1) * iw + i0.x + 1));\n"
+  "      d11 = float(DistByte((i0.y + 1) * iw + i0.x + 1));\n"
+  "    }\n"
+  "  float rv = r00 * (r.x - 1.0) * (r.y - 1.0) - r10 * r.x * (r.y - 1.0)\n"
+  "    - r01 * (r.x - 1.0) * r.y + r11 * r.x * r.y;\n"
+  "  float dv = d00 * (r.x - 1.0) * (r.y - 1.0) - d10 * r.x * (r.y - 1.0)\n"
+  "    - d01 * (r.x - 1.0) * r.y + d11 * r.x * r.y;\n"
+  "  if (dv <= 0.0)\n"
+  "    discard;\n"
+  "  float w;\n"
+  "  if (dv < 64.0)\n"
+  "    w = 65535.0 - floor(4.0 * dv);\n"
+  "  else\n"
+  "    w = floor(length(v - center));\n"
+  "  if (65535.0 - w <= 0.0)\n"
+  "    discard;\n"
+  "  int iv = int(floor(255.0 * (rv - blackValue) / range + 0.5));\n"
+  "  if (iv <= 0)\n"
+  "    iv = (w == 65535.0) ? 0 : 1;\n"
+  "  else if (iv > 255)\n"
+  "    iv = 255;\n"
+  "  value = uint(iv);\n"
+  "  gl_FragDepth = (65535.0 - w) / 65535.0;\n"
+  "}\n";
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static GLuint program = 0;
+static GLuint vertexArray, nodeBuffer, indexBuffer;
+static GLuint sourceBuffers[3];	/* image, dist, mask */
+static GLuint framebuffer, valueTexture, depthTexture;
+static int nIndices = 0;
+static GpuSource source;
+static unsigned short *tileWeight = NULL;
+static unsigned char *tileValue = NULL;
+
+static GLuint CompileShader (GLenum type, const char *text, char *error);
+static int UploadBytes (GLuint buffer, unsigned char *p, size_t n,
+			char *error);
+
+int
+GpuInit (char *error)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+  EGLint major, minor;
+  EGLint attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 4,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  GLuint vs, fs;
+  GLint ok;
+  char log[1024];
+
+  if (context != EGL_NO_CONTEXT)
+    return(1);
+
+  /* a node without a display server has no default display, but
+     Mesa's drivers offer one without surfaces */
+  display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+      getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+	eglGetProcAddress("eglGetPlatformDisplayEXT");
+      if (getPlatformDisplay == NULL)
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+      display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+				   EGL_DEFAULT_DISPLAY, NULL);
+      if (display == EGL_NO_DISPLAY ||
+	  !eglInitialize(display, &major, &minor))
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+    }
+  if (!eglBindAPI(EGL_OPENGL_API))
+    {
+      sprintf(error, "EGL does not support OpenGL\n");
+      return(0);
+    }
+  context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+			     attributes);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not create an OpenGL 4.3 context (EGL error 0x%x)\n",
+	      eglGetError());
+      context = EGL_NO_CONTEXT;
+      return(0);
+    }
+
+  vs = CompileShader(GL_VERTEX_SHADER, vertexShader, error);
+  if (vs == 0)
+    return(0);
+  fs = CompileShader(GL_FRAGMENT_SHADER, fragmentShader, error);
+  if (fs == 0)
+    return(0);
+  program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok)
+    {
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      sprintf(error, "Could not link GPU program:\n%s\n", log);
+      return(0);
+    }
+
+  glGenVertexArrays(1, &vertexArray);
+  glBindVertexArray(vertexArray);
+  glGenBuffers(1, &nodeBuffer);
+  glGenBuffers(1, &indexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, nodeBuffer);
+  glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+  glGenBuffers(3, sourceBuffers);
+
+  glGenTextures(1, &valueTexture);
+  glBindTexture(GL_TEXTURE_2D, valueTexture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8UI, GPU_TILE, GPU_TILE);
+  glGenTextures(1, &depthTexture);
+  glBindTexture(GL_TEXTURE_2D, depthTexture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT16, GPU_TILE, GPU_TILE);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			 GL_TEXTURE_2D, valueTexture, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+			 GL_TEXTURE_2D, depthTexture, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      sprintf(error, "Could not set up the GPU framebuffer\n");
+      return(0);
+    }
+
+  tileWeight = (unsigned short *) malloc(GPU_TILE * GPU_TILE *
+					 sizeof(unsigned short));
+  tileValue = (unsigned char *) malloc(GPU_TILE * GPU_TILE);
+  if (tileWeight == NULL || tileValue == NULL)
+    {
+      sprintf(error, "Could not allocate GPU tile buffers\n");
+      return(0);
+    }
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not set up the GPU renderer\n");
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuLoadSource (GpuSource *s, char *error)
+{
+  float *nodes;
+  GLuint *indices;
+  int x, y;
+  int sw, sh;
+  size_t k;
+  MapElement *m;
+  GLint maxBlock;
+
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not make the GPU context current\n");
+      return(0);
+    }
+  glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+  if ((size_t) s->iw * s->ih > (size_t) maxBlock ||
+      s->mbpl * s->ih > (size_t) maxBlock)
+    {
+      sprintf(error, "Image of %dx%d is too large for the GPU\n",
+	      s->iw, s->ih);
+      return(0);
+    }
+  if (!UploadBytes(sourceBuffers[0], s->image, (size_t) s->iw * s->ih,
+		   error) ||
+      !UploadBytes(sourceBuffers[1], s->dist, (size_t) s->iw * s->ih,
+		   error) ||
+      !UploadBytes(sourceBuffers[2], s->mask, s->mbpl * s->ih, error))
+    return(0);
+
+  /* each element goes to the output pixels it lands on, with the map
+     coordinates it comes from */
+  sw = s->scanW;
+  sh = s->scanH;
+  nodes = (float *) malloc((size_t) sw * sh * 4 * sizeof(float));
+  indices = (GLuint *) malloc((size_t) (sw - 1) * (sh - 1) * 6 *
+			      sizeof(GLuint) + 1);
+  if (nodes == NULL || indices == NULL)
+    {
+      free(nodes);
+      free(indices);
+      sprintf(error, "Could not allocate the GPU scan map\n");
+      return(0);
+    }
+  for (y = 0; y < sh; ++y)
+    for (x = 0; x < sw; ++x)
+      {
+	m = &s->scanMap[y*sw+x];
+	k = 4 * ((size_t) y * sw + x);
+	nodes[k] = m->x * s->mFactor;
+	nodes[k+1] = m->y * s->mFactor;
+	nodes[k+2] = x / (float) s->scanFactor;
+	nodes[k+3] = y / (float) s->scanFactor;
+      }
+  nIndices = 0;
+  for (y = 0; y < sh - 1; ++y)
+    for (x = 0; x < sw - 1; ++x)
+      if (s->quads[y*sw+x] == 1)
+	{
+	  indices[nIndices++] = y*sw + x;
+	  indices[nIndices++] = y*sw + x + 1;
+	  indices[nIndices++] = (y+1)*sw + x + 1;
+	  indices[nIndices++] = y*sw + x;
+	  indices[nIndices++] = (y+1)*sw + x + 1;
+	  indices[nIndices++] = (y+1)*sw + x;
+	}
+  glBindBuffer(GL_ARRAY_BUFFER, nodeBuffer);
+  glBufferData(GL_ARRAY_BUFFER, (size_t) sw * sh * 4 * sizeof(float),
+	       nodes, GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, nIndices * sizeof(GLuint) + 1,
+	       indices, GL_STATIC_DRAW);
+  free(nodes);
+  free(indices);
+
+  glUseProgram(program);
+  glUniform2f(glGetUniformLocation(program, "mapOffset"),
+	      (float) s->mxMin, (float) s->myMin);
+  glUniform1f(glGetUniformLocation(program, "mFactor"), s->mFactor);
+  glUniform1i(glGetUniformLocation(program, "transformed"), s->xf != NULL);
+  if (s->xf != NULL)
+    {
+      glUniform3f(glGetUniformLocation(program, "xf0"),
+		  s->xf[0][0], s->xf[0][1], s->xf[0][2]);
+      glUniform3f(glGetUniformLocation(program, "xf1"),
+		  s->xf[1][0], s->xf[1][1], s->xf[1][2]);
+    }
+  glUniform1f(glGetUniformLocation(program, "sampleFactor"),
+	      (float) s->sampleFactor);
+  glUniform1i(glGetUniformLocation(program, "iw"), s->iw);
+  glUniform1i(glGetUniformLocation(program, "ih"), s->ih);
+  glUniform1i(glGetUniformLocation(program, "mbpl"), (int) s->mbpl);
+  glUniform2f(glGetUniformLocation(program, "center"), s->cx, s->cy);
+  glUniform1f(glGetUniformLocation(program, "blackValue"), s->blackValue);
+  glUniform1f(glGetUniformLocation(program, "range"), s->range);
+  source = *s;
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not upload the source to the GPU\n");
+      return(0);
+    }
+  return(1);
+}
+
+int
+GpuRenderTile (int x0, int y0, int w, int h,
+	       unsigned short *weight, size_t stride,
+	       unsigned short **newWeight, unsigned char **value,
+	       char *error)
+{
+  GLuint zero[4] = {0, 0, 0, 0};
+
+  if (w > GPU_TILE || h > GPU_TILE)
+    {
+      sprintf(error, "GPU tile of %dx%d is too large\n", w, h);
+      return(0);
+    }
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not make the GPU context current\n");
+      return(0);
+    }
+
+  /* the weights already painted are the depths to beat */
+  glBindTexture(GL_TEXTURE_2D, depthTexture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) stride);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
+		  GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, weight);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(0, 0, w, h);
+  glClearBufferuiv(GL_COLOR, 0, zero);
+  glEnable(GL_DEPTH_TEST);
+  glDepthFunc(GL_GREATER);
+  glDepthMask(GL_TRUE);
+
+  glUseProgram(program);
+  glUniform2f(glGetUniformLocation(program, "origin"),
+	      (float) x0, (float) y0);
+  glUniform2f(glGetUniformLocation(program, "size"), (float) w, (float) h);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sourceBuffers[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sourceBuffers[1]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sourceBuffers[2]);
+  glBindVertexArray(vertexArray);
+  glDrawElements(GL_TRIANGLES, nIndices, GL_UNSIGNED_INT, NULL);
+
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, w, h, GL_RED_INTEGER, GL_UNSIGNED_BYTE, tileValue);
+  glPixelStorei(GL_PACK_ALIGNMENT, 2);
+  glReadPixels(0, 0, w, h, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, tileWeight);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not render a tile on the GPU\n");
+      return(0);
+    }
+  *newWeight = tileWeight;
+  *value = tileValue;
+  return(1);
+}
+
+void
+GpuFinish ()
+{
+  if (context == EGL_NO_CONTEXT)
+    return;
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+  context = EGL_NO_CONTEXT;
+  free(tileWeight);
+  free(tileValue);
+  tileWeight = NULL;
+  tileValue = NULL;
+}
+
+static GLuint
+CompileShader (GLenum type, const char *text, char *error)
+{
+  GLuint shader;
+  GLint ok;
+  char log[1024];
+
+  shader = glCreateShader(type);
+  glShaderSource(shader, 1, &text, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+    {
+      glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+      sprintf(error, "Could not compile GPU shader:\n%s\n", log);
+      glDeleteShader(shader);
+      return(0);
+    }
+  return(shader);
+}
+
+/* UploadBytes copies the n bytes at p into buffer, padded to a whole
+   number of the 32-bit words the shaders read them in */
+static int
+UploadBytes (GLuint buffer, unsigned char *p, size_t n, char *error)
+{
+  size_t padded;
+
+  padded = (n + 3) & ~((size_t) 3);
+  if (padded == 0)
+    padded = 4;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, padded, NULL, GL_STATIC_DRAW);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n, p);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not upload %zu bytes to the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+#endif
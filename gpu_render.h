@@ -0,0 +1,74 @@
+//
+// gpu_render.h - rendering of the output tiles of apply_map on a GPU
+//                through OpenGL, in a headless (EGL) context; an
+//                image is rasterized through the triangles of its
+//                scan map, and the pixels that it paints are those
+//                where its weight is greater than that of the images
+//                already painted, as in apply_map's PaintRows
+//
+#ifndef GPU_RENDER_H
+#define GPU_RENDER_H
+
+#include <stddef.h>
+#include "imio.h"
+
+#define GPU_TILE	2048	/* largest edge of a tile GpuRenderTile renders */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a source image as painted by apply_map */
+typedef struct GpuSource
+{
+  MapElement *scanMap;	/* the map refined for scan-conversion, in map
+			   units of the output */
+  int scanW, scanH;
+  int scanFactor;	/* scan map elements per map element */
+  unsigned char *quads;	/* kind of each scan map quad; only those of
+			   kind 1 are drawn */
+  float mFactor;	/* output pixels per map unit */
+  int mxMin, myMin;	/* map offset in x and y */
+  unsigned char *image;	/* iw x ih source pixels */
+  unsigned char *mask;	/* mbpl bytes per row; set bits are masked */
+  unsigned char *dist;	/* distances to the mask in 1/64 pixels */
+  int iw, ih;
+  size_t mbpl;
+  int sampleFactor;	/* factor by which image, mask and dist are
+			   reduced */
+  double (*xf)[3];	/* pre-transform of the image, or NULL */
+  float cx, cy;		/* center of the unreduced image */
+  float blackValue;
+  float range;
+} GpuSource;
+
+/* GpuInit creates the OpenGL context and programs; it returns 0, with
+   a message in error, if there is no usable GPU or apply_map was built
+   without GPU support (see GPU_RENDER in the Makefile) */
+int GpuInit (char *error);
+
+/* GpuLoadSource uploads the arrays of s, replacing the source loaded
+   before; it returns 0, with a message in error, if they do not fit */
+int GpuLoadSource (GpuSource *s, char *error);
+
+/* GpuRenderTile renders the loaded source into the w x h output pixels
+   from (x0,y0), w and h at most GPU_TILE, given the weights (65535 less
+   the weight, as in apply_map) already painted there, stride elements
+   apart in each row.  On return, *newWeight and *value hold w x h
+   weights and values, as apply_map would have painted them; a pixel
+   was painted by the source if and only if its new weight is greater
+   than the old.  The arrays belong to the renderer and are good until
+   the next call.  It returns 0, with a message in error, if rendering
+   fails. */
+int GpuRenderTile (int x0, int y0, int w, int h,
+		   unsigned short *weight, size_t stride,
+		   unsigned short **newWeight, unsigned char **value,
+		   char *error);
+
+void GpuFinish ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPU_RENDER_H */
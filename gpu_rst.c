@@ -0,0 +1,1259 @@
+/*
+ * gpu_rst.c -- computes the correlations of find_rst on a GPU
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gpu_rst.h"
+
+#ifndef GPU_RST
+
+int
+GpuRstInit (char *error)
+{
+  sprintf(error, "find_rst was built without GPU support (see GPU_RST in the Makefile)\n");
+  return(0);
+}
+
+int
+GpuRstSetTables (GpuRstTables *t, int reload, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRstLoadImage (int imi, GpuRstImage *im, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRstSpectra (int imi, int offsetX, int offsetY,
+	       int rFactor, int sFactor, int logPolar, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRstTransform (int imi, int offsetX, int offsetY,
+		 int rFactor, int sFactor,
+		 float scale, float ct, float st, int direct,
+		 char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRstRotate (char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRstCorrelate (int smaller, float *gaussian,
+		 int ccFilterMin, int ccFilterMax, char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+int
+GpuRstPeaks (unsigned char *xValid, unsigned char *yValid,
+	     int nonNegative, GpuRstPeak **peaks, int *nPeaks,
+	     char *error)
+{
+  sprintf(error, "No GPU support\n");
+  return(0);
+}
+
+void
+GpuRstFinish ()
+{
+}
+
+#else
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+
+#define GROUP_SIZE	256	/* invocations in a work group */
+#define MAX_GROUPS	65535	/* work groups in a dispatch */
+#define MAX_PASSES	64	/* passes of an FFT */
+
+/* the buffers; the complex arrays are n x n unless noted, and hold
+   whole spectra rather than the half spectra of FFTW's real
+   transforms */
+#define SPECTRUM0	0	/* spectra of the windowed images */
+#define SPECTRUM1	1
+#define LOG_POLAR0	2	/* spectra of their log-polar transforms */
+#define LOG_POLAR1	3
+#define TRANSFORMED	4	/* the fractional FT of an image, then the
+				   spectrum of a transformed image */
+#define WORK		5	/* an image, then a correlation */
+#define ROWS		6	/* n chirp sequences of length 2n */
+#define SCRATCH		7	/* the other half of each FFT pass
+				   (2n x n) */
+#define MAG		8	/* nRes levels of log magnitudes */
+#define LP_TABLE	9
+#define CHIRP		10	/* nRes x n cos, sin pairs */
+#define CHIRP_Z		11	/* nRes x 2n */
+#define CHIRP_FFT_Z	12	/* nRes x 2n */
+#define TWIDDLES	13	/* the 2n roots of unity */
+#define WINDOW		14
+#define GAUSSIAN	15
+#define VALID		16	/* the x, then the y, flags of GpuRstPeaks */
+#define PEAKS		17	/* a count, then the peaks */
+#define IMAGE0		18	/* the images, as bytes packed 4 to a uint */
+#define IMAGE1		19
+#define DIST0		20
+#define DIST1		21
+#define WINDOWED0	22
+#define WINDOWED1	23
+#define N_BUFFERS	24
+
+/* the programs */
+#define FFT_PROGRAM		0
+#define COPY_PROGRAM		1
+#define RESAMPLE_PROGRAM	2
+#define TRANSFORM_PROGRAM	3
+#define CHIRP_IN_PROGRAM	4
+#define CHIRP_MULTIPLY_PROGRAM	5
+#define CHIRP_OUT_PROGRAM	6
+#define MAGNITUDE_PROGRAM	7
+#define LOG_POLAR_PROGRAM	8
+#define CROSS_POWER_PROGRAM	9
+#define ROTATE_PROGRAM		10
+#define PEAKS_PROGRAM		11
+#define N_PROGRAMS		12
+
+/* the declarations shared by the programs; each goes through its
+   items with a stride of the whole dispatch, as the dispatches are
+   limited to MAX_GROUPS work groups */
+#define SHADER_HEADER \
+  "#version 430 core\n" \
+  "layout(local_size_x = 256) in;\n" \
+  "uniform int n;\n" \
+  "vec2 Mul (vec2 a, vec2 b)\n" \
+  "{\n" \
+  "  return vec2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);\n" \
+  "}\n"
+
+#define FOR_ITEMS(count) \
+  "  for (int i = int(gl_GlobalInvocationID.x); i < " count ";\n" \
+  "       i += int(gl_NumWorkGroups.x) * 256)\n"
+
+/* the FFT program is one pass of a Stockham autosort FFT of a batch
+   of sequences of length len, each element stride apart and each
+   sequence distance after the last; the passes are of radix 2, 3, 4,
+   5 or 7, span being the product of the radices of the earlier ones.
+   The twiddles come from a table of the 2n roots of unity made in
+   double, which holds those of every length that is used. */
+static const char *fftShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer SrcBuffer { vec2 src[]; };\n"
+  "layout(std430, binding = 1) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "layout(std430, binding = 2) readonly buffer TwiddleBuffer { vec2 twiddles[]; };\n"
+  "uniform int len;\n"
+  "uniform int radix;\n"
+  "uniform int span;\n"
+  "uniform int batch;\n"
+  "uniform int stride;\n"
+  "uniform int distance;\n"
+  "uniform int inverse;\n"
+  "vec2 Twiddle (int k)\n"
+  "{\n"
+  "  vec2 w = twiddles[(k * (2 * n / len)) % (2 * n)];\n"
+  "  return inverse != 0 ? vec2(w.x, -w.y) : w;\n"
+  "}\n"
+  "void main ()\n"
+  "{\n"
+  "  int m = len / radix;\n"
+  "  int step = len / (span * radix);\n"
+  "  vec2 v[7];\n"
+  FOR_ITEMS("batch * m")
+  "    {\n"
+  "      int b = i / m;\n"
+  "      int j = i - b * m;\n"
+  "      int base = b * distance;\n"
+  "      int k = j % span;\n"
+  "      for (int r = 0; r < radix; ++r)\n"
+  "        v[r] = Mul(src[base + (j + r * m) * stride], Twiddle(k * r * step));\n"
+  "      int o = (j - k) * radix + k;\n"
+  "      for (int q = 0; q < radix; ++q)\n"
+  "        {\n"
+  "          vec2 s = v[0];\n"
+  "          for (int r = 1; r < radix; ++r)\n"
+  "            s += Mul(v[r], Twiddle((q * r) % radix * m));\n"
+  "          dst[base + (o + q * span) * stride] = s;\n"
+  "        }\n"
+  "    }\n"
+  "}\n";
+
+static const char *copyShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer SrcBuffer { vec2 src[]; };\n"
+  "layout(std430, binding = 1) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "uniform int count;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("count")
+  "    dst[i] = src[i];\n"
+  "}\n";
+
+/* the resampling program is find_rst's ResampleRows, or, if direct is
+   set, the copy it makes of the windowed image at full resolution */
+static const char *resampleShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer WindowedBuffer { float windowed[]; };\n"
+  "layout(std430, binding = 1) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "uniform int iw;\n"
+  "uniform int ih;\n"
+  "uniform int offsetX;\n"
+  "uniform int offsetY;\n"
+  "uniform int rFactor;\n"
+  "uniform int sFactor;\n"
+  "uniform int direct;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int x = i % n;\n"
+  "      int y = i / n;\n"
+  "      if (direct != 0)\n"
+  "        {\n"
+  "          if (x >= offsetX && x < offsetX + iw &&\n"
+  "              y >= offsetY && y < offsetY + ih)\n"
+  "            dst[i] = vec2(windowed[(y - offsetY) * iw + x - offsetX], 0.0);\n"
+  "          else\n"
+  "            dst[i] = vec2(0.0);\n"
+  "          continue;\n"
+  "        }\n"
+  "      float v = 0.0;\n"
+  "      int count = 0;\n"
+  "      for (int dy = 0; dy < sFactor; ++dy)\n"
+  "        for (int dx = 0; dx < sFactor; ++dx)\n"
+  "          {\n"
+  "            float xv = (float(x - offsetX) + float(dx) / float(sFactor)) * float(rFactor);\n"
+  "            float yv = (float(y - offsetY) + float(dy) / float(sFactor)) * float(rFactor);\n"
+  "            int ixv = int(floor(xv));\n"
+  "            int iyv = int(floor(yv));\n"
+  "            if (ixv < 0 || ixv >= iw - 1 || iyv < 0 || iyv >= ih - 1)\n"
+  "              continue;\n"
+  "            float rrx = xv - float(ixv);\n"
+  "            float rry = yv - float(iyv);\n"
+  "            int k = iyv * iw + ixv;\n"
+  "            v += windowed[k] * (rrx - 1.0) * (rry - 1.0)\n"
+  "              - windowed[k + 1] * rrx * (rry - 1.0)\n"
+  "              - windowed[k + iw] * (rrx - 1.0) * rry\n"
+  "              + windowed[k + iw + 1] * rrx * rry;\n"
+  "            ++count;\n"
+  "          }\n"
+  "      dst[i] = vec2(count > 0 ? v / float(count) : 0.0, 0.0);\n"
+  "    }\n"
+  "}\n";
+
+/* the transformation program is find_rst's TransformRows, or, if
+   direct is set, the copy it makes of the windowed image when there
+   is nothing to transform */
+static const char *transformShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer ImageBuffer { uint image[]; };\n"
+  "layout(std430, binding = 1) readonly buffer DistBuffer { float dist[]; };\n"
+  "layout(std430, binding = 2) readonly buffer WindowBuffer { float window[]; };\n"
+  "layout(std430, binding = 3) readonly buffer WindowedBuffer { float windowed[]; };\n"
+  "layout(std430, binding = 4) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "uniform int iw;\n"
+  "uniform int ih;\n"
+  "uniform int offsetX;\n"
+  "uniform int offsetY;\n"
+  "uniform int rFactor;\n"
+  "uniform int sFactor;\n"
+  "uniform float scale;\n"
+  "uniform float ct;\n"
+  "uniform float st;\n"
+  "uniform float mean;\n"
+  "uniform int blkW;\n"
+  "uniform int direct;\n"
+  "float Pixel (int k)\n"
+  "{\n"
+  "  return float((image[k >> 2] >> uint(8 * (k & 3))) & 255u);\n"
+  "}\n"
+  "void main ()\n"
+  "{\n"
+  "  int h = n / 2;\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int x = i % n;\n"
+  "      int y = i / n;\n"
+  "      if (direct != 0)\n"
+  "        {\n"
+  "          if (x >= offsetX && x < offsetX + iw &&\n"
+  "              y >= offsetY && y < offsetY + ih)\n"
+  "            dst[i] = vec2(windowed[(y - offsetY) * iw + x - offsetX], 0.0);\n"
+  "          else\n"
+  "            dst[i] = vec2(mean, 0.0);\n"
+  "          continue;\n"
+  "        }\n"
+  "      float v = 0.0;\n"
+  "      float d = 0.0;\n"
+  "      int count = 0;\n"
+  "      for (int dy = 0; dy < sFactor; ++dy)\n"
+  "        for (int dx = 0; dx < sFactor; ++dx)\n"
+  "          {\n"
+  "            float xv = float(x - h) + float(dx) / float(sFactor);\n"
+  "            float yv = float(y - h) + float(dy) / float(sFactor);\n"
+  "            float xvp = (scale * (ct * xv - st * yv) + float(h) - float(offsetX)) * float(rFactor);\n"
+  "            float yvp = (scale * (st * xv + ct * yv) + float(h) - float(offsetY)) * float(rFactor);\n"
+  "            int ixv = int(floor(xvp));\n"
+  "            int iyv = int(floor(yvp));\n"
+  "            if (ixv < 0 || ixv >= iw - 1 || iyv < 0 || iyv >= ih - 1)\n"
+  "              continue;\n"
+  "            float rrx = xvp - float(ixv);\n"
+  "            float rry = yvp - float(iyv);\n"
+  "            int k = iyv * iw + ixv;\n"
+  "            v += Pixel(k) * (rrx - 1.0) * (rry - 1.0)\n"
+  "              - Pixel(k + 1) * rrx * (rry - 1.0)\n"
+  "              - Pixel(k + iw) * (rrx - 1.0) * rry\n"
+  "              + Pixel(k + iw + 1) * rrx * rry;\n"
+  "            ++count;\n"
+  "            d = dist[k];\n"
+  "          }\n"
+  "      if (count == 0)\n"
+  "        {\n"
+  "          dst[i] = vec2(0.0);\n"
+  "          continue;\n"
+  "        }\n"
+  "      int ix = int(d * scale + 0.5);\n"
+  "      if (ix >= blkW / 2)\n"
+  "        dst[i] = vec2(v / float(count) - mean, 0.0);\n"
+  "      else\n"
+  "        dst[i] = vec2(window[ix] * (v / float(count) - mean), 0.0);\n"
+  "    }\n"
+  "}\n";
+
+/* the chirp programs are the steps of find_rst's fractional FT along
+   the rows (bStep n, jStep 1) or the columns (bStep 1, jStep n) of an
+   n x n array: the chirp-in program multiplies each sequence b by the
+   chirp into row b of ROWS, padded to 2n, which is then convolved
+   with the chirp z through its FFT, and the chirp-out program
+   multiplies the result back by the conjugate of z */
+static const char *chirpInShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer SrcBuffer { vec2 src[]; };\n"
+  "layout(std430, binding = 1) writeonly buffer RowsBuffer { vec2 rows[]; };\n"
+  "layout(std430, binding = 2) readonly buffer ChirpBuffer { vec2 chirp[]; };\n"
+  "uniform int res;\n"
+  "uniform int bStep;\n"
+  "uniform int jStep;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("2 * n * n")
+  "    {\n"
+  "      int b = i / (2 * n);\n"
+  "      int j = i - b * 2 * n;\n"
+  "      if (j < n)\n"
+  "        rows[i] = Mul(src[b * bStep + j * jStep], chirp[res * n + j]);\n"
+  "      else\n"
+  "        rows[i] = vec2(0.0);\n"
+  "    }\n"
+  "}\n";
+
+static const char *chirpMultiplyShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) buffer RowsBuffer { vec2 rows[]; };\n"
+  "layout(std430, binding = 1) readonly buffer ChirpFftZBuffer { vec2 fftZ[]; };\n"
+  "uniform int res;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("2 * n * n")
+  "    rows[i] = Mul(rows[i], fftZ[res * 2 * n + i % (2 * n)]);\n"
+  "}\n";
+
+static const char *chirpOutShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer RowsBuffer { vec2 rows[]; };\n"
+  "layout(std430, binding = 1) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "layout(std430, binding = 2) readonly buffer ChirpZBuffer { vec2 z[]; };\n"
+  "uniform int res;\n"
+  "uniform int bStep;\n"
+  "uniform int jStep;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int b = i / n;\n"
+  "      int j = i - b * n;\n"
+  "      vec2 zr = z[res * 2 * n + j];\n"
+  "      vec2 y = rows[b * 2 * n + j];\n"
+  "      dst[b * bStep + j * jStep] = vec2(zr.x * y.x + zr.y * y.y,\n"
+  "                                        zr.x * y.y - zr.y * y.x) / float(2 * n);\n"
+  "    }\n"
+  "}\n";
+
+/* the magnitude program stores the log magnitude of a spectrum as
+   level res of MAG, shifting it so that frequency 0 is at the center
+   if shift is set */
+static const char *magnitudeShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer SrcBuffer { vec2 src[]; };\n"
+  "layout(std430, binding = 1) writeonly buffer MagBuffer { float mag[]; };\n"
+  "uniform int res;\n"
+  "uniform int shift;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int k = i;\n"
+  "      if (shift != 0)\n"
+  "        k = ((i / n + n / 2) % n) * n + (i % n + n / 2) % n;\n"
+  "      mag[res * n * n + i] = log(length(src[k]));\n"
+  "    }\n"
+  "}\n";
+
+/* the log-polar program is find_rst's LogPolarRows */
+static const char *logPolarShader =
+  SHADER_HEADER
+  "struct Sample { int o; float rx; float ry; };\n"
+  "layout(std430, binding = 0) readonly buffer MagBuffer { float mag[]; };\n"
+  "layout(std430, binding = 1) readonly buffer TableBuffer { Sample table[]; };\n"
+  "layout(std430, binding = 2) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int o = table[i].o;\n"
+  "      float rrx = table[i].rx;\n"
+  "      float rry = table[i].ry;\n"
+  "      dst[i] = vec2(mag[o] * (rrx - 1.0) * (rry - 1.0)\n"
+  "                    - mag[o + 1] * rrx * (rry - 1.0)\n"
+  "                    - mag[o + n] * (rrx - 1.0) * rry\n"
+  "                    + mag[o + n + 1] * rrx * rry, 0.0);\n"
+  "    }\n"
+  "}\n";
+
+/* the cross-power program is find_rst's CrossPowerRows, followed by
+   the Gaussian weighting and the band limits of the translation
+   search; the band of find_rst is that of the x frequency in both
+   directions, and so it is here */
+static const char *crossPowerShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) readonly buffer ABuffer { vec2 a[]; };\n"
+  "layout(std430, binding = 1) readonly buffer BBuffer { vec2 b[]; };\n"
+  "layout(std430, binding = 2) writeonly buffer DstBuffer { vec2 dst[]; };\n"
+  "layout(std430, binding = 3) readonly buffer GaussianBuffer { float gaussian[]; };\n"
+  "uniform int filterMin;\n"
+  "uniform int filterMax;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int x = i % n;\n"
+  "      int y = i / n;\n"
+  "      int d = min(x, n - x);\n"
+  "      if (d < filterMin || d > filterMax)\n"
+  "        {\n"
+  "          dst[i] = vec2(0.0);\n"
+  "          continue;\n"
+  "        }\n"
+  "      vec2 p = vec2(a[i].x * b[i].x + a[i].y * b[i].y,\n"
+  "                    a[i].y * b[i].x - a[i].x * b[i].y);\n"
+  "      p /= max(abs(p.x), abs(p.y));\n"
+  "      dst[i] = p / length(p) * gaussian[x] * gaussian[y];\n"
+  "    }\n"
+  "}\n";
+
+/* the rotation program turns a spectrum into that of the image
+   rotated by 180 degrees, by rotating the phases of its conjugate */
+static const char *rotateShader =
+  SHADER_HEADER
+  "layout(std430, binding = 0) buffer SpectrumBuffer { vec2 spectrum[]; };\n"
+  "layout(std430, binding = 1) readonly buffer TwiddleBuffer { vec2 twiddles[]; };\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      vec2 w = twiddles[2 * ((i % n + i / n) % n)];\n"
+  "      vec2 v = spectrum[i];\n"
+  "      spectrum[i] = vec2(v.x * w.x - v.y * w.y, -v.x * w.y - v.y * w.x);\n"
+  "    }\n"
+  "}\n";
+
+/* the peak program keeps the valid positions of a correlation that
+   are higher than their valid neighbors, the positions find_rst's
+   marking leaves as candidates */
+static const char *peaksShader =
+  SHADER_HEADER
+  "struct Peak { int x; int y; float val; };\n"
+  "layout(std430, binding = 0) readonly buffer CcBuffer { vec2 cc[]; };\n"
+  "layout(std430, binding = 1) readonly buffer ValidBuffer { int valid[]; };\n"
+  "layout(std430, binding = 2) buffer PeakBuffer { uint count; Peak peaks[]; };\n"
+  "uniform int nonNegative;\n"
+  "void main ()\n"
+  "{\n"
+  FOR_ITEMS("n * n")
+  "    {\n"
+  "      int x = i % n;\n"
+  "      int y = i / n;\n"
+  "      float v = cc[i].x;\n"
+  "      if (valid[x] == 0 || valid[n + y] == 0 || isnan(v) ||\n"
+  "          nonNegative != 0 && v < 0.0)\n"
+  "        continue;\n"
+  "      bool peak = true;\n"
+  "      for (int dy = -1; dy <= 1 && peak; ++dy)\n"
+  "        for (int dx = -1; dx <= 1; ++dx)\n"
+  "          {\n"
+  "            int nx = x + dx;\n"
+  "            int ny = y + dy;\n"
+  "            if (nx < 0 || nx >= n || ny < 0 || ny >= n ||\n"
+  "                dx == 0 && dy == 0 ||\n"
+  "                valid[nx] == 0 || valid[n + ny] == 0)\n"
+  "              continue;\n"
+  "            float nv = cc[ny * n + nx].x;\n"
+  "            if (nv > v || nv == v && ny * n + nx < i)\n"
+  "              {\n"
+  "                peak = false;\n"
+  "                break;\n"
+  "              }\n"
+  "          }\n"
+  "      if (peak)\n"
+  "        peaks[atomicAdd(count, 1u)] = Peak(x, y, v);\n"
+  "    }\n"
+  "}\n";
+
+static const char **shaders[N_PROGRAMS] = {
+  &fftShader, &copyShader, &resampleShader, &transformShader,
+  &chirpInShader, &chirpMultiplyShader, &chirpOutShader,
+  &magnitudeShader, &logPolarShader, &crossPowerShader,
+  &rotateShader, &peaksShader
+};
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static GLuint programs[N_PROGRAMS];
+static GLuint buffers[N_BUFFERS];
+static int tableN = -1;		/* size the buffers were made for */
+static int tableNRes = 0;
+static int blkW = 0;
+static int imageW[2], imageH[2];
+static float imageMean[2];
+static GpuRstPeak *peakList = NULL;
+static int peakCapacity = 0;
+
+static GLuint BuildProgram (const char *text, char *error);
+static int Upload (int b, void *p, size_t n, GLint64 maxBlock, char *error);
+static int Groups (long n);
+static void Bind (int binding, int b);
+static void Use (int p);
+static void Uniform (int p, const char *name, int v);
+static void UniformF (int p, const char *name, float v);
+static void Dispatch (long n);
+static int Fft (int b, int len, int batch, int stride, int distance,
+		int inverse, char *error);
+static int Fft2 (int b, int inverse, char *error);
+static int FractionalFt (int res, char *error);
+static int Check (char *what, char *error);
+static int MakeCurrent (char *error);
+
+int
+GpuRstInit (char *error)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+  EGLint major, minor;
+  EGLint attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 4,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  int i;
+
+  if (context != EGL_NO_CONTEXT)
+    return(1);
+
+  /* as in gpu_forces.c, a node without a display server is reached
+     through Mesa's surfaceless platform */
+  display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+      getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+	eglGetProcAddress("eglGetPlatformDisplayEXT");
+      if (getPlatformDisplay == NULL)
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+      display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+				   EGL_DEFAULT_DISPLAY, NULL);
+      if (display == EGL_NO_DISPLAY ||
+	  !eglInitialize(display, &major, &minor))
+	{
+	  sprintf(error, "Could not open an EGL display\n");
+	  return(0);
+	}
+    }
+  if (!eglBindAPI(EGL_OPENGL_API))
+    {
+      sprintf(error, "EGL does not support OpenGL\n");
+      return(0);
+    }
+  context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+			     attributes);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not create an OpenGL 4.3 context (EGL error 0x%x)\n",
+	      eglGetError());
+      context = EGL_NO_CONTEXT;
+      return(0);
+    }
+
+  for (i = 0; i < N_PROGRAMS; ++i)
+    {
+      programs[i] = BuildProgram(*shaders[i], error);
+      if (programs[i] == 0)
+	return(0);
+    }
+  glGenBuffers(N_BUFFERS, buffers);
+  tableN = -1;
+  return(Check("set up the GPU correlations", error));
+}
+
+int
+GpuRstSetTables (GpuRstTables *t, int reload, char *error)
+{
+  int n = t->n;
+  size_t n2 = ((size_t) n) * n;
+  size_t k;
+  int i;
+  int ok;
+  float *twiddles;
+  float *table;
+  GLint64 maxBlock;
+
+  if (!MakeCurrent(error))
+    return(0);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+  if (n != tableN || t->nRes != tableNRes)
+    {
+      /* the twiddles are made in double, so that an FFT on the GPU is
+	 as accurate as one by FFTW in single precision */
+      twiddles = (float *) malloc(4 * n * sizeof(float));
+      if (twiddles == NULL)
+	{
+	  sprintf(error, "Could not allocate the GPU twiddles\n");
+	  return(0);
+	}
+      for (i = 0; i < 2 * n; ++i)
+	{
+	  twiddles[2*i] = cos(M_PI * i / n);
+	  twiddles[2*i+1] = -sin(M_PI * i / n);
+	}
+      ok = Upload(TWIDDLES, twiddles, 4 * n * sizeof(float), maxBlock, error);
+      free(twiddles);
+      for (i = SPECTRUM0; ok && i <= WORK; ++i)
+	ok = Upload(i, NULL, 2 * n2 * sizeof(float), maxBlock, error);
+      ok = ok &&
+	Upload(ROWS, NULL, 4 * n2 * sizeof(float), maxBlock, error) &&
+	Upload(SCRATCH, NULL, 4 * n2 * sizeof(float), maxBlock, error) &&
+	Upload(MAG, NULL, t->nRes * n2 * sizeof(float), maxBlock, error) &&
+	Upload(PEAKS, NULL, sizeof(unsigned int) + n2 * sizeof(GpuRstPeak),
+	       maxBlock, error);
+      if (!ok)
+	{
+	  tableN = -1;
+	  return(0);
+	}
+      tableN = n;
+      tableNRes = t->nRes;
+      reload = 1;
+      for (i = 0; i < N_PROGRAMS; ++i)
+	{
+	  Use(i);
+	  Uniform(i, "n", n);
+	}
+    }
+
+  blkW = t->blk_w;
+  if (!Upload(WINDOW, t->window, (blkW >= 2 ? blkW / 2 : 0) * sizeof(float),
+	      maxBlock, error))
+    return(0);
+
+  if (reload && t->chirpCos != NULL)
+    {
+      table = (float *) malloc(2 * t->nRes * n * sizeof(float));
+      if (table == NULL)
+	{
+	  sprintf(error, "Could not allocate the GPU chirps\n");
+	  return(0);
+	}
+      for (k = 0; k < t->nRes * (size_t) n; ++k)
+	{
+	  table[2*k] = t->chirpCos[k];
+	  table[2*k+1] = t->chirpSin[k];
+	}
+      ok = Upload(CHIRP, table, 2 * t->nRes * n * sizeof(float),
+		  maxBlock, error) &&
+	Upload(CHIRP_Z, t->chirpZ, 4 * t->nRes * n * sizeof(float),
+	       maxBlock, error) &&
+	Upload(CHIRP_FFT_Z, t->chirpFftZ, 4 * t->nRes * n * sizeof(float),
+	       maxBlock, error);
+      free(table);
+      if (!ok)
+	return(0);
+    }
+  if (reload && t->lpIndex != NULL)
+    {
+      /* the samples of the log-polar table, as its Sample struct */
+      table = (float *) malloc(3 * n2 * sizeof(float));
+      if (table == NULL)
+	{
+	  sprintf(error, "Could not allocate the GPU log-polar table\n");
+	  return(0);
+	}
+      for (k = 0; k < n2; ++k)
+	{
+	  memcpy(&table[3*k], &t->lpIndex[k], sizeof(int));
+	  table[3*k+1] = t->lpRx[k];
+	  table[3*k+2] = t->lpRy[k];
+	}
+      ok = Upload(LP_TABLE, table, 3 * n2 * sizeof(float), maxBlock, error);
+      free(table);
+      if (!ok)
+	return(0);
+    }
+  return(1);
+}
+
+int
+GpuRstLoadImage (int imi, GpuRstImage *im, char *error)
+{
+  size_t size;
+  GLint64 maxBlock;
+
+  if (!MakeCurrent(error))
+    return(0);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+  size = ((size_t) im->iw) * im->ih;
+  if (!Upload(IMAGE0 + imi, im->image, size, maxBlock, error) ||
+      !Upload(DIST0 + imi, im->dist, size * sizeof(float), maxBlock, error) ||
+      !Upload(WINDOWED0 + imi, im->windowed, size * sizeof(float),
+	      maxBlock, error))
+    return(0);
+  imageW[imi] = im->iw;
+  imageH[imi] = im->ih;
+  imageMean[imi] = im->mean;
+  return(1);
+}
+
+int
+GpuRstSpectra (int imi, int offsetX, int offsetY,
+	       int rFactor, int sFactor, int logPolar, char *error)
+{
+  int n = tableN;
+  int res;
+
+  if (!MakeCurrent(error))
+    return(0);
+
+  /* the image placed in the n x n array stays in WORK for the
+     fractional FTs */
+  Use(RESAMPLE_PROGRAM);
+  Bind(0, WINDOWED0 + imi);
+  Bind(1, WORK);
+  Uniform(RESAMPLE_PROGRAM, "iw", imageW[imi]);
+  Uniform(RESAMPLE_PROGRAM, "ih", imageH[imi]);
+  Uniform(RESAMPLE_PROGRAM, "offsetX", offsetX);
+  Uniform(RESAMPLE_PROGRAM, "offsetY", offsetY);
+  Uniform(RESAMPLE_PROGRAM, "rFactor", rFactor);
+  Uniform(RESAMPLE_PROGRAM, "sFactor", sFactor);
+  Uniform(RESAMPLE_PROGRAM, "direct", rFactor == 1);
+  Dispatch((long) n * n);
+
+  Use(COPY_PROGRAM);
+  Bind(0, WORK);
+  Bind(1, SPECTRUM0 + imi);
+  Uniform(COPY_PROGRAM, "count", n * n);
+  Dispatch((long) n * n);
+  if (!Fft2(SPECTRUM0 + imi, 0, error))
+    return(0);
+  if (!logPolar)
+    return(Check("compute a spectrum on the GPU", error));
+
+  Use(MAGNITUDE_PROGRAM);
+  Bind(0, SPECTRUM0 + imi);
+  Bind(1, MAG);
+  Uniform(MAGNITUDE_PROGRAM, "res", 0);
+  Uniform(MAGNITUDE_PROGRAM, "shift", 1);
+  Dispatch((long) n * n);
+  for (res = 1; res < tableNRes; ++res)
+    {
+      if (!FractionalFt(res, error))
+	return(0);
+      Use(MAGNITUDE_PROGRAM);
+      Bind(0, TRANSFORMED);
+      Bind(1, MAG);
+      Uniform(MAGNITUDE_PROGRAM, "res", res);
+      Uniform(MAGNITUDE_PROGRAM, "shift", 0);
+      Dispatch((long) n * n);
+    }
+
+  Use(LOG_POLAR_PROGRAM);
+  Bind(0, MAG);
+  Bind(1, LP_TABLE);
+  Bind(2, LOG_POLAR0 + imi);
+  Dispatch((long) n * n);
+  if (!Fft2(LOG_POLAR0 + imi, 0, error))
+    return(0);
+  return(Check("compute the log-polar spectrum on the GPU", error));
+}
+
+int
+GpuRstTransform (int imi, int offsetX, int offsetY,
+		 int rFactor, int sFactor,
+		 float scale, float ct, float st, int direct,
+		 char *error)
+{
+  int n = tableN;
+
+  if (!MakeCurrent(error))
+    return(0);
+  Use(TRANSFORM_PROGRAM);
+  Bind(0, IMAGE0 + imi);
+  Bind(1, DIST0 + imi);
+  Bind(2, WINDOW);
+  Bind(3, WINDOWED0 + imi);
+  Bind(4, TRANSFORMED);
+  Uniform(TRANSFORM_PROGRAM, "iw", imageW[imi]);
+  Uniform(TRANSFORM_PROGRAM, "ih", imageH[imi]);
+  Uniform(TRANSFORM_PROGRAM, "offsetX", offsetX);
+  Uniform(TRANSFORM_PROGRAM, "offsetY", offsetY);
+  Uniform(TRANSFORM_PROGRAM, "rFactor", rFactor);
+  Uniform(TRANSFORM_PROGRAM, "sFactor", sFactor);
+  UniformF(TRANSFORM_PROGRAM, "scale", scale);
+  UniformF(TRANSFORM_PROGRAM, "ct", ct);
+  UniformF(TRANSFORM_PROGRAM, "st", st);
+  UniformF(TRANSFORM_PROGRAM, "mean", imageMean[imi]);
+  Uniform(TRANSFORM_PROGRAM, "blkW", blkW);
+  Uniform(TRANSFORM_PROGRAM, "direct", direct);
+  Dispatch((long) n * n);
+  if (!Fft2(TRANSFORMED, 0, error))
+    return(0);
+  return(Check("transform an image on the GPU", error));
+}
+
+int
+GpuRstRotate (char *error)
+{
+  if (!MakeCurrent(error))
+    return(0);
+  Use(ROTATE_PROGRAM);
+  Bind(0, TRANSFORMED);
+  Bind(1, TWIDDLES);
+  Dispatch((long) tableN * tableN);
+  return(Check("rotate a spectrum on the GPU", error));
+}
+
+int
+GpuRstCorrelate (int smaller, float *gaussian,
+		 int ccFilterMin, int ccFilterMax, char *error)
+{
+  int n = tableN;
+  GLint64 maxBlock;
+
+  if (!MakeCurrent(error))
+    return(0);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+  if (!Upload(GAUSSIAN, gaussian, n * sizeof(float), maxBlock, error))
+    return(0);
+  Use(CROSS_POWER_PROGRAM);
+  if (smaller < 0)
+    {
+      Bind(0, LOG_POLAR0);
+      Bind(1, LOG_POLAR1);
+      ccFilterMin = 0;
+      ccFilterMax = n / 2;
+    }
+  else
+    {
+      Bind(0, SPECTRUM0 + smaller);
+      Bind(1, TRANSFORMED);
+    }
+  Bind(2, WORK);
+  Bind(3, GAUSSIAN);
+  Uniform(CROSS_POWER_PROGRAM, "filterMin", ccFilterMin);
+  Uniform(CROSS_POWER_PROGRAM, "filterMax", ccFilterMax);
+  Dispatch((long) n * n);
+
+  /* the cross-power spectrum is that of a real correlation, so the
+     real part of its inverse is what FFTW's c2r transform gives */
+  if (!Fft2(WORK, 1, error))
+    return(0);
+  return(Check("correlate on the GPU", error));
+}
+
+int
+GpuRstPeaks (unsigned char *xValid, unsigned char *yValid,
+	     int nonNegative, GpuRstPeak **peaks, int *nPeaks,
+	     char *error)
+{
+  int n = tableN;
+  int i;
+  int *valid;
+  unsigned int count;
+  GLint64 maxBlock;
+
+  if (!MakeCurrent(error))
+    return(0);
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlock);
+  valid = (int *) malloc(2 * n * sizeof(int));
+  if (valid == NULL)
+    {
+      sprintf(error, "Could not allocate the GPU peak flags\n");
+      return(0);
+    }
+  for (i = 0; i < n; ++i)
+    {
+      valid[i] = xValid[i];
+      valid[n + i] = yValid[i];
+    }
+  i = Upload(VALID, valid, 2 * n * sizeof(int), maxBlock, error);
+  free(valid);
+  if (!i)
+    return(0);
+
+  count = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[PEAKS]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(count), &count);
+  Use(PEAKS_PROGRAM);
+  Bind(0, WORK);
+  Bind(1, VALID);
+  Bind(2, PEAKS);
+  Uniform(PEAKS_PROGRAM, "nonNegative", nonNegative);
+  Dispatch((long) n * n);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[PEAKS]);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(count), &count);
+  if (count > peakCapacity)
+    {
+      free(peakList);
+      peakList = (GpuRstPeak *) malloc(count * sizeof(GpuRstPeak));
+      if (peakList == NULL)
+	{
+	  peakCapacity = 0;
+	  sprintf(error, "Could not allocate %u GPU peaks\n", count);
+	  return(0);
+	}
+      peakCapacity = count;
+    }
+  if (count > 0)
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(count),
+		       count * sizeof(GpuRstPeak), peakList);
+  *peaks = peakList;
+  *nPeaks = count;
+  return(Check("find the correlation peaks on the GPU", error));
+}
+
+void
+GpuRstFinish ()
+{
+  int i;
+
+  if (context == EGL_NO_CONTEXT)
+    return;
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+  glDeleteBuffers(N_BUFFERS, buffers);
+  for (i = 0; i < N_PROGRAMS; ++i)
+    glDeleteProgram(programs[i]);
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+  context = EGL_NO_CONTEXT;
+  tableN = -1;
+  free(peakList);
+  peakList = NULL;
+  peakCapacity = 0;
+}
+
+/* Fft transforms, in place, the batch of sequences of length len in
+   buffer b, using SCRATCH for the other half of each pass */
+static int
+Fft (int b, int len, int batch, int stride, int distance, int inverse,
+     char *error)
+{
+  int radices[MAX_PASSES];
+  int nPasses;
+  int m;
+  int r;
+  int span;
+  int i;
+  int from, to, t;
+
+  nPasses = 0;
+  m = len;
+  while (m > 1 && nPasses < MAX_PASSES)
+    {
+      if (m % 4 == 0)
+	r = 4;
+      else if (m % 2 == 0)
+	r = 2;
+      else if (m % 3 == 0)
+	r = 3;
+      else if (m % 5 == 0)
+	r = 5;
+      else if (m % 7 == 0)
+	r = 7;
+      else
+	{
+	  sprintf(error, "FFT size %d is not a product of 2, 3, 5, and 7\n",
+		  len);
+	  return(0);
+	}
+      radices[nPasses++] = r;
+      m /= r;
+    }
+
+  Use(FFT_PROGRAM);
+  Bind(2, TWIDDLES);
+  Uniform(FFT_PROGRAM, "len", len);
+  Uniform(FFT_PROGRAM, "batch", batch);
+  Uniform(FFT_PROGRAM, "stride", stride);
+  Uniform(FFT_PROGRAM, "distance", distance);
+  Uniform(FFT_PROGRAM, "inverse", inverse);
+  from = b;
+  to = SCRATCH;
+  span = 1;
+  for (i = 0; i < nPasses; ++i)
+    {
+      Bind(0, from);
+      Bind(1, to);
+      Uniform(FFT_PROGRAM, "radix", radices[i]);
+      Uniform(FFT_PROGRAM, "span", span);
+      Dispatch((long) batch * (len / radices[i]));
+      span *= radices[i];
+      t = from;
+      from = to;
+      to = t;
+    }
+  if (from != b)
+    {
+      /* the sequences fill their n x n (or 2n x n) array */
+      Use(COPY_PROGRAM);
+      Bind(0, SCRATCH);
+      Bind(1, b);
+      Uniform(COPY_PROGRAM, "count", batch * len);
+      Dispatch((long) batch * len);
+    }
+  return(1);
+}
+
+/* Fft2 transforms the n x n array in buffer b, by rows and then by
+   columns */
+static int
+Fft2 (int b, int inverse, char *error)
+{
+  int n = tableN;
+
+  return(Fft(b, n, n, 1, n, inverse, error) &&
+	 Fft(b, n, n, n, 1, inverse, error));
+}
+
+/* FractionalFt computes, into TRANSFORMED, the fractional FT at
+   level res of the image in WORK, along its rows and then along its
+   columns, as find_rst does with plan_Y and plan_W */
+static int
+FractionalFt (int res, char *error)
+{
+  int n = tableN;
+  int pass;
+  int bStep, jStep;
+
+  for (pass = 0; pass < 2; ++pass)
+    {
+      bStep = pass == 0 ? n : 1;
+      jStep = pass == 0 ? 1 : n;
+      Use(CHIRP_IN_PROGRAM);
+      Bind(0, pass == 0 ? WORK : TRANSFORMED);
+      Bind(1, ROWS);
+      Bind(2, CHIRP);
+      Uniform(CHIRP_IN_PROGRAM, "res", res);
+      Uniform(CHIRP_IN_PROGRAM, "bStep", bStep);
+      Uniform(CHIRP_IN_PROGRAM, "jStep", jStep);
+      Dispatch(2L * n * n);
+      if (!Fft(ROWS, 2 * n, n, 1, 2 * n, 0, error))
+	return(0);
+      Use(CHIRP_MULTIPLY_PROGRAM);
+      Bind(0, ROWS);
+      Bind(1, CHIRP_FFT_Z);
+      Uniform(CHIRP_MULTIPLY_PROGRAM, "res", res);
+      Dispatch(2L * n * n);
+      if (!Fft(ROWS, 2 * n, n, 1, 2 * n, 1, error))
+	return(0);
+      Use(CHIRP_OUT_PROGRAM);
+      Bind(0, ROWS);
+      Bind(1, TRANSFORMED);
+      Bind(2, CHIRP_Z);
+      Uniform(CHIRP_OUT_PROGRAM, "res", res);
+      Uniform(CHIRP_OUT_PROGRAM, "bStep", bStep);
+      Uniform(CHIRP_OUT_PROGRAM, "jStep", jStep);
+      Dispatch((long) n * n);
+    }
+  return(1);
+}
+
+static GLuint
+BuildProgram (const char *text, char *error)
+{
+  GLuint shader, program;
+  GLint ok;
+  char log[1024];
+
+  shader = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(shader, 1, &text, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+    {
+      glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+      sprintf(error, "Could not compile GPU shader:\n%s\n", log);
+      glDeleteShader(shader);
+      return(0);
+    }
+  program = glCreateProgram();
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok)
+    {
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      sprintf(error, "Could not link GPU program:\n%s\n", log);
+      glDeleteProgram(program);
+      return(0);
+    }
+  return(program);
+}
+
+/* Upload replaces buffer b with the n bytes at p, or with n undefined
+   bytes if p is NULL; the buffer is rounded up to whole uints, so that
+   the shaders can read the last bytes of an image, and an empty buffer
+   is given a few bytes so that it can still be bound */
+static int
+Upload (int b, void *p, size_t n, GLint64 maxBlock, char *error)
+{
+  if ((GLint64) n > maxBlock)
+    {
+      sprintf(error, "GPU buffer of %zu bytes is larger than the %lld allowed\n",
+	      n, (long long) maxBlock);
+      return(0);
+    }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[b]);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, n > 0 ? (n + 3) & ~((size_t) 3) : 16,
+	       NULL, GL_DYNAMIC_DRAW);
+  if (p != NULL && n > 0)
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n, p);
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not upload %zu bytes to the GPU\n", n);
+      return(0);
+    }
+  return(1);
+}
+
+/* Groups returns the number of work groups to dispatch for n items */
+static int
+Groups (long n)
+{
+  long g;
+
+  g = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+  if (g > MAX_GROUPS)
+    g = MAX_GROUPS;
+  if (g < 1)
+    g = 1;
+  return((int) g);
+}
+
+static void
+Bind (int binding, int b)
+{
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffers[b]);
+}
+
+static void
+Use (int p)
+{
+  glUseProgram(programs[p]);
+}
+
+static void
+Uniform (int p, const char *name, int v)
+{
+  glUniform1i(glGetUniformLocation(programs[p], name), v);
+}
+
+static void
+UniformF (int p, const char *name, float v)
+{
+  glUniform1f(glGetUniformLocation(programs[p], name), v);
+}
+
+/* Dispatch runs the current program over n items, after whatever
+   the programs before it wrote */
+static void
+Dispatch (long n)
+{
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glDispatchCompute(Groups(n), 1, 1);
+}
+
+static int
+Check (char *what, char *error)
+{
+  if (glGetError() != GL_NO_ERROR)
+    {
+      sprintf(error, "Could not %s\n", what);
+      return(0);
+    }
+  return(1);
+}
+
+static int
+MakeCurrent (char *error)
+{
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      sprintf(error, "Could not make the GPU context current\n");
+      return(0);
+    }
+  return(1);
+}
+
+#endif
@@ -0,0 +1,110 @@
+//
+// gpu_rst.h - the correlations of find_rst computed on a GPU through
+//             OpenGL compute shaders, in a headless (EGL) context;
+//             the windowed images of a pair, their spectra, and the
+//             correlations made from them stay on the GPU, and only
+//             the peaks of each correlation come back, for find_rst
+//             to choose its rotation, scale, and translation
+//             candidates from
+//
+#ifndef GPU_RST_H
+#define GPU_RST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the tables of find_rst for one FFT size n; the chirps (nRes levels,
+   of which level 0 is not used) and the log-polar table are only
+   needed if rotation and scale are searched for, and may otherwise
+   be NULL */
+typedef struct GpuRstTables
+{
+  int n;
+  int nRes;
+  float *chirpCos, *chirpSin;	/* nRes x n */
+  float *chirpZ, *chirpFftZ;	/* nRes x 2n complex values */
+  int *lpIndex;			/* n x n, as made by BuildLogPolarTable */
+  float *lpRx, *lpRy;
+  int blk_w;
+  float *window;		/* blk_w/2 entries of the Blackman
+				   window */
+} GpuRstTables;
+
+/* one image of a pair; dist is its distance from the mask or the
+   edge, as left by WindowRows */
+typedef struct GpuRstImage
+{
+  int iw, ih;
+  unsigned char *image;
+  float *dist;
+  float *windowed;
+  float mean;
+} GpuRstImage;
+
+/* a position of a correlation that is higher than all of its
+   neighbors */
+typedef struct GpuRstPeak
+{
+  int x, y;
+  float val;
+} GpuRstPeak;
+
+/* GpuRstInit creates the OpenGL context and programs; it returns 0,
+   with a message in error, if there is no usable GPU or find_rst was
+   built without GPU support (see GPU_RST in the Makefile) */
+int GpuRstInit (char *error);
+
+/* GpuRstSetTables makes the buffers for FFT size t->n and loads the
+   window; the chirps and the log-polar table are loaded only if
+   reload is set or the size changed */
+int GpuRstSetTables (GpuRstTables *t, int reload, char *error);
+
+/* GpuRstLoadImage loads image imi (0 or 1) of the pair */
+int GpuRstLoadImage (int imi, GpuRstImage *im, char *error);
+
+/* GpuRstSpectra computes the spectrum of image imi placed in the
+   n x n array at (offsetX, offsetY), as find_rst's fft_orig, and, if
+   logPolar is set, the spectrum of the log-polar transform of its
+   magnitude spectrum, as flp */
+int GpuRstSpectra (int imi, int offsetX, int offsetY,
+		   int rFactor, int sFactor, int logPolar, char *error);
+
+/* GpuRstTransform computes the spectrum of image imi rotated and
+   scaled as by TransformRows, or, if direct is set, placed as it is
+   and surrounded by its mean */
+int GpuRstTransform (int imi, int offsetX, int offsetY,
+		     int rFactor, int sFactor,
+		     float scale, float ct, float st, int direct,
+		     char *error);
+
+/* GpuRstRotate turns the spectrum of the last GpuRstTransform into
+   that of the image rotated by 180 degrees */
+int GpuRstRotate (char *error);
+
+/* GpuRstCorrelate computes the correlation of the log-polar spectra
+   of the two images if smaller is negative, and otherwise of the
+   spectrum of image smaller with that of the last GpuRstTransform;
+   the cross-power spectrum is weighted by gaussian (n entries) in
+   both directions, and, in the second case, limited to the
+   frequencies from ccFilterMin to ccFilterMax as in find_rst */
+int GpuRstCorrelate (int smaller, float *gaussian,
+		     int ccFilterMin, int ccFilterMax, char *error);
+
+/* GpuRstPeaks sets *peaks to the peaks of the last correlation,
+   and *nPeaks to their number, among the positions (x, y) for which
+   xValid[x] and yValid[y] are set (n entries each); a peak must be
+   higher than its valid neighbors, or as high and earlier in row
+   order, and, if nonNegative is set, not negative.  The peaks are
+   not sorted, and are valid until the next call. */
+int GpuRstPeaks (unsigned char *xValid, unsigned char *yValid,
+		 int nonNegative, GpuRstPeak **peaks, int *nPeaks,
+		 char *error);
+
+void GpuRstFinish ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPU_RST_H */
@@ -33,6 +33,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
 #include <zlib.h>
 #include <tiffio.h>
 #include <jpeglib.h>
@@ -40,6 +45,9 @@
 #include <limits.h>
 #include <math.h>
 #include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "imio.h"
 
@@ -53,6 +61,10 @@ static int extension = 0;
 #define N_BITMAP_EXTENSIONS	2
 static char *bitmapExtensions[N_BITMAP_EXTENSIONS] = { ".pbm", ".pbm.gz"};
 static int bitmapExtension = 0;
+
+/* the most reduced levels that an ImageWriter will write */
+#define MAX_WRITER_LEVELS	16
+
 // define BMP file header structures [Nilton]
 #define BMP_FILE_TYPE      0x4D42  // "BM" in little endian
 #define BMP_FILE_HEADER_SIZE   14  // BMP file header size
@@ -91,12 +103,26 @@ int ReadBmpImageSize (const char *filename, int *width, int *height,
 int ReadTiffImage (char *filename, unsigned char **buffer,
 		   int *width, int *height,
 		   char *error);
+int ReadTiffImageRegion (char *filename, unsigned char **buffer,
+			 int *width, int *height,
+			 int minX, int maxX, int minY, int maxY,
+			 char *error);
+int ReadTiffDirectoryRegion (char *filename, toff_t directory,
+			     unsigned char **buffer,
+			     int *width, int *height,
+			     int minX, int maxX, int minY, int maxY,
+			     char *error);
+toff_t FindTiffReducedDirectory (char *filename, int width, int height);
 int ReadPgmImage (char *filename, unsigned char **buffer,
 		  int *width, int *height,
 		  char *error);
 int ReadJpgImage (char *filename, unsigned char **buffer,
 		  int *width, int *height,
 		  char *error);
+int ReadJpgImageScaled (char *filename, int scaleDenom,
+			unsigned char **buffer,
+			int *width, int *height,
+			char *error);
 int ReadBmpImage (char *filename, unsigned char **buffer,
 		  int *width, int *height, char *error); // add ReadBmpImage [Nilton]
 int ReadHeader (FILE *f, char *tc, uint32 *w, uint32 *h, int *m);
@@ -112,10 +138,476 @@ int ReadPbmgzBitmap (char *filename, unsigned char **buffer,
 		     int *width, int *height,
 		     char *error);
 
+/* the images whose sizes were read by ScanImageSizes or recorded in an
+   image manifest, sorted by name */
+typedef struct ScannedImage
+{
+  char *name;
+  int width, height;	/* -1 if the image could not be read */
+  long long mtime;	/* modification time and size of its file */
+  long long size;
+  int recorded;		/* true if taken from the manifest unchanged */
+} ScannedImage;
+
+typedef struct ImageScan
+{
+  pthread_mutex_t lock;
+  int next;		/* the next image to be scanned */
+  int n;
+  ScannedImage *images;
+  int nRecorded;	/* the previous manifest */
+  ScannedImage *recorded;
+} ImageScan;
+
+#define IMAGE_SCAN_THREADS	16
+#define IMAGE_MANIFEST_HEADER	"# image manifest: width height mtime size name\n"
+
+static char imageManifest[PATH_MAX] = "";
+static int nScanned = 0;
+static ScannedImage *scanned = NULL;
+
+static int ReadImageHeaderSize (char *filename, int *width, int *height,
+				char *error);
+static void *ScanThreadMain (void *arg);
+static int StatImageFile (char *filename, struct stat *sb);
+static ScannedImage *FindScanned (ScannedImage *images, int n, char *name);
+static int CompareScanned (const void *a, const void *b);
+static int ReadImageManifest (ScannedImage **images, int *n, char *error);
+static int WriteImageManifest (ImageScan *s, char *error);
+static void FreeScanned (ScannedImage *images, int n);
+
+/* a RegionSink receives the pixels of a region of an image as
+   DecodeTiffRegion decodes them */
+typedef struct RegionSink RegionSink;
+struct RegionSink
+{
+  char *filename;
+  size_t width, height;		/* of the region */
+  int invert;			/* whether the pixels are stored inverted */
+  int rowStep;			/* if > 1, the region only holds every
+				   rowStep-th row from minY */
+  int (*begin) (RegionSink *s, char *error);
+  void (*put) (RegionSink *s, size_t x, size_t y,
+	       unsigned char *p, size_t n);
+  unsigned char *bytes;		/* the 8-bit region */
+  float *floats;		/* or the float region, */
+  int allocated;		/*   whether it was allocated here, */
+  unsigned char *mask;		/*   the mask applied to it, or NULL, */
+  size_t maskWidth, maskHeight;
+  size_t mbpl;
+  FloatImageStats stats;	/*   and the statistics of its pixels */
+};
+
+static int DecodeTiffRegion (char *filename, toff_t directory,
+			     int minX, int maxX, int minY, int maxY,
+			     RegionSink *sink, char *error);
+static int BeginBytes (RegionSink *s, char *error);
+static void PutBytes (RegionSink *s, size_t x, size_t y,
+		      unsigned char *p, size_t n);
+static int BeginFloats (RegionSink *s, char *error);
+static void PutFloats (RegionSink *s, size_t x, size_t y,
+		       unsigned char *p, size_t n);
+static int FindImageFile (char *filename, char *fn, char *error);
+
+/* with $ALIGNTK_CACHE_DIR set, the image and bitmap readers read
+   through a node-local cache in that directory: a file on another
+   filesystem is first copied there, as the hash of its path with its
+   extension, keeping its modification time, and is read from the copy
+   for as long as the size and time of the original match it.  The
+   cache is held under $ALIGNTK_CACHE_SIZE megabytes by removing the
+   least recently read copies. */
+#define CACHE_DEFAULT_MB	65536
+#define CACHE_MIN_AGE		60	/* seconds for which a copy that was
+					   just read is not removed */
+
+typedef struct CachedCopy
+{
+  char name[NAME_MAX + 1];
+  long long size;
+  time_t atime;
+} CachedCopy;
+
+static pthread_once_t cacheOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static char cacheDir[PATH_MAX] = "";
+static dev_t cacheDev;
+static long long cacheLimit = 0;
+
+static void InitReadCache (void);
+static char *CachedFile (char *filename, char *cached);
+static int CopyToCache (char *filename, struct stat *sb, char *cached);
+static void TrimReadCache (void);
+static int CompareCachedCopies (const void *a, const void *b);
+static uint64_t HashString (char *s);
+
+void
+SetImageManifest (char *filename)
+{
+  if (filename == NULL)
+    imageManifest[0] = '\0';
+  else
+    strcpy(imageManifest, filename);
+}
+
+int
+ScanImageSizes (int n, char **names, char *error)
+{
+  ImageScan s;
+  pthread_t threads[IMAGE_SCAN_THREADS];
+  int nThreads;
+  int i, j;
+  int changed;
+
+  s.images = (ScannedImage *) malloc((n + 1) * sizeof(ScannedImage));
+  if (s.images == NULL)
+    {
+      sprintf(error, "Could not allocate table of %d images\n", n);
+      return(0);
+    }
+  for (i = 0; i < n; ++i)
+    {
+      s.images[i].name = names[i];
+      s.images[i].recorded = 0;
+    }
+  qsort(s.images, n, sizeof(ScannedImage), CompareScanned);
+  s.n = 0;
+  for (i = 0; i < n; ++i)
+    if (s.n == 0 || strcmp(s.images[i].name, s.images[s.n-1].name) != 0)
+      {
+	s.images[s.n] = s.images[i];
+	s.images[s.n].name = strdup(s.images[i].name);
+	if (s.images[s.n].name == NULL)
+	  {
+	    FreeScanned(s.images, s.n);
+	    sprintf(error, "Could not allocate image name\n");
+	    return(0);
+	  }
+	++s.n;
+      }
+
+  s.recorded = NULL;
+  s.nRecorded = 0;
+  if (imageManifest[0] != '\0' &&
+      !ReadImageManifest(&s.recorded, &s.nRecorded, error))
+    {
+      FreeScanned(s.images, s.n);
+      return(0);
+    }
+
+  pthread_mutex_init(&s.lock, NULL);
+  s.next = 0;
+  nThreads = s.n < IMAGE_SCAN_THREADS ? s.n : IMAGE_SCAN_THREADS;
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_create(&threads[i], NULL, ScanThreadMain, &s) != 0)
+      break;
+  if (i == 0 && s.n > 0)
+    ScanThreadMain(&s);
+  for (j = 0; j < i; ++j)
+    pthread_join(threads[j], NULL);
+  pthread_mutex_destroy(&s.lock);
+
+  changed = imageManifest[0] != '\0' && s.nRecorded == 0;
+  for (i = 0; i < s.n; ++i)
+    if (!s.images[i].recorded && s.images[i].width >= 0)
+      changed = 1;
+  if (changed && imageManifest[0] != '\0' &&
+      !WriteImageManifest(&s, error))
+    {
+      FreeScanned(s.recorded, s.nRecorded);
+      FreeScanned(s.images, s.n);
+      return(0);
+    }
+  FreeScanned(s.recorded, s.nRecorded);
+
+  FreeScanned(scanned, nScanned);
+  scanned = s.images;
+  nScanned = s.n;
+  return(1);
+}
+
+int
+ScanImageList (char *listName, char *prefix, char *suffix, char *error)
+{
+  FILE *f;
+  char line[PATH_MAX + 256];
+  char name[PATH_MAX + 256];
+  int width, height;
+  char **names;
+  int n, size;
+  int i;
+  int result;
+
+  f = fopen(listName, "r");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open image list %s\n", listName);
+      return(0);
+    }
+  names = NULL;
+  n = 0;
+  size = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+    {
+      if (line[0] == '\0' || line[0] == '#')
+	continue;
+      if (sscanf(line, "%s%d%d", name, &width, &height) != 1)
+	continue;
+      if (n == size)
+	{
+	  size = size > 0 ? 2 * size : 1024;
+	  names = (char **) realloc(names, size * sizeof(char *));
+	  if (names == NULL)
+	    {
+	      fclose(f);
+	      sprintf(error, "Could not allocate image names\n");
+	      return(0);
+	    }
+	}
+      names[n] = (char *) malloc(strlen(prefix) + strlen(name) +
+				 strlen(suffix) + 1);
+      if (names[n] == NULL)
+	{
+	  fclose(f);
+	  sprintf(error, "Could not allocate image name\n");
+	  return(0);
+	}
+      sprintf(names[n], "%s%s%s", prefix, name, suffix);
+      ++n;
+    }
+  fclose(f);
+  result = n == 0 || ScanImageSizes(n, names, error);
+  for (i = 0; i < n; ++i)
+    free(names[i]);
+  free(names);
+  return(result);
+}
+
+int
+LookupImageInfo (char *filename, int *width, int *height, long long *mtime)
+{
+  ScannedImage *si;
+
+  if (nScanned == 0 ||
+      (si = FindScanned(scanned, nScanned, filename)) == NULL ||
+      si->width < 0)
+    return(0);
+  *width = si->width;
+  *height = si->height;
+  *mtime = si->mtime;
+  return(1);
+}
+
+static void *
+ScanThreadMain (void *arg)
+{
+  ImageScan *s = (ImageScan *) arg;
+  ScannedImage *si, *ri;
+  struct stat sb;
+  int i;
+  char msg[PATH_MAX + 256];
+
+  for (;;)
+    {
+      pthread_mutex_lock(&s->lock);
+      i = s->next++;
+      pthread_mutex_unlock(&s->lock);
+      if (i >= s->n)
+	break;
+      si = &s->images[i];
+      si->width = -1;
+      si->height = -1;
+      if (!StatImageFile(si->name, &sb))
+	continue;
+      si->mtime = (long long) sb.st_mtime;
+      si->size = (long long) sb.st_size;
+      ri = FindScanned(s->recorded, s->nRecorded, si->name);
+      if (ri != NULL && ri->mtime == si->mtime && ri->size == si->size &&
+	  ri->width >= 0)
+	{
+	  si->width = ri->width;
+	  si->height = ri->height;
+	  si->recorded = 1;
+	}
+      else if (!ReadImageHeaderSize(si->name, &si->width, &si->height, msg))
+	{
+	  si->width = -1;
+	  si->height = -1;
+	}
+    }
+  return(NULL);
+}
+
+/* StatImageFile stats the file that ReadImageSize would read for
+   filename, which may lack its extension */
+static int
+StatImageFile (char *filename, struct stat *sb)
+{
+  int i;
+  char fn[PATH_MAX];
+
+  if (stat(filename, sb) == 0)
+    return(S_ISREG(sb->st_mode));
+  for (i = 0; i < N_EXTENSIONS; ++i)
+    {
+      snprintf(fn, PATH_MAX, "%s%s", filename, extensions[i]);
+      if (stat(fn, sb) == 0)
+	return(1);
+    }
+  return(0);
+}
+
+static ScannedImage *
+FindScanned (ScannedImage *images, int n, char *name)
+{
+  ScannedImage key;
+
+  if (n == 0)
+    return(NULL);
+  key.name = name;
+  return((ScannedImage *) bsearch(&key, images, n, sizeof(ScannedImage),
+				  CompareScanned));
+}
+
+static int
+CompareScanned (const void *a, const void *b)
+{
+  return(strcmp(((ScannedImage *) a)->name, ((ScannedImage *) b)->name));
+}
+
+/* ReadImageManifest reads the entries of the image manifest, sorted
+   by name; a missing manifest has none */
+static int
+ReadImageManifest (ScannedImage **images, int *n, char *error)
+{
+  FILE *f;
+  char line[PATH_MAX + 256];
+  int size;
+  int pos;
+  int len;
+  ScannedImage si;
+
+  *images = NULL;
+  *n = 0;
+  f = fopen(imageManifest, "r");
+  if (f == NULL)
+    return(1);
+  size = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+    {
+      if (line[0] == '#')
+	continue;
+      if (sscanf(line, "%d %d %lld %lld %n", &si.width, &si.height,
+		 &si.mtime, &si.size, &pos) != 4)
+	{
+	  fclose(f);
+	  FreeScanned(*images, *n);
+	  sprintf(error, "Malformed line in image manifest %s:\n%s\n",
+		  imageManifest, line);
+	  return(0);
+	}
+      len = strlen(line);
+      if (len > 0 && line[len-1] == '\n')
+	line[--len] = '\0';
+      si.name = strdup(&line[pos]);
+      si.recorded = 0;
+      if (*n == size)
+	{
+	  size = size > 0 ? 2 * size : 1024;
+	  *images = (ScannedImage *) realloc(*images,
+					     size * sizeof(ScannedImage));
+	}
+      if (si.name == NULL || *images == NULL)
+	{
+	  fclose(f);
+	  sprintf(error, "Could not allocate image manifest\n");
+	  return(0);
+	}
+      (*images)[(*n)++] = si;
+    }
+  fclose(f);
+  if (*n > 0)
+    qsort(*images, *n, sizeof(ScannedImage), CompareScanned);
+  return(1);
+}
+
+/* WriteImageManifest writes the images of s that could be read, and
+   those of the previous manifest that were not scanned this time, to
+   a new manifest that then replaces the old one */
+static int
+WriteImageManifest (ImageScan *s, char *error)
+{
+  FILE *f;
+  char tmpName[PATH_MAX + 16];
+  int i, j;
+  int cmp;
+  ScannedImage *si;
+
+  sprintf(tmpName, "%s.%d", imageManifest, (int) getpid());
+  f = fopen(tmpName, "w");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open image manifest %s for writing\n",
+	      tmpName);
+      return(0);
+    }
+  fprintf(f, IMAGE_MANIFEST_HEADER);
+  i = 0;
+  j = 0;
+  while (i < s->n || j < s->nRecorded)
+    {
+      if (i == s->n)
+	cmp = 1;
+      else if (j == s->nRecorded)
+	cmp = -1;
+      else
+	cmp = strcmp(s->images[i].name, s->recorded[j].name);
+      if (cmp <= 0)
+	{
+	  si = &s->images[i++];
+	  if (cmp == 0)
+	    ++j;
+	}
+      else
+	si = &s->recorded[j++];
+      if (si->width >= 0)
+	fprintf(f, "%d %d %lld %lld %s\n", si->width, si->height,
+		si->mtime, si->size, si->name);
+    }
+  if (fclose(f) != 0 || rename(tmpName, imageManifest) != 0)
+    {
+      unlink(tmpName);
+      sprintf(error, "Could not write image manifest %s\n", imageManifest);
+      return(0);
+    }
+  return(1);
+}
+
+static void
+FreeScanned (ScannedImage *images, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i)
+    free(images[i].name);
+  free(images);
+}
+
 int
 ReadImageSize (char *filename,
 	       int *width, int *height,
 	       char *error)
+{
+  long long mtime;
+
+  if (nScanned > 0 && LookupImageInfo(filename, width, height, &mtime))
+    return(1);
+  return(ReadImageHeaderSize(filename, width, height, error));
+}
+
+static int
+ReadImageHeaderSize (char *filename,
+		     int *width, int *height,
+		     char *error)
 {
   int len;
   int i, j, k;
@@ -403,6 +895,189 @@ int ReadBmpImageSize (const char *filename, int *width, int *height, char *error
 }
 // Add ReadBmpImageSize [Nilton]
 
+static void
+InitReadCache (void)
+{
+  char *dir, *size;
+  struct stat sb;
+  long long mb;
+
+  dir = getenv("ALIGNTK_CACHE_DIR");
+  if (dir == NULL || dir[0] == '\0' || strlen(dir) >= PATH_MAX - 64)
+    return;
+  mb = CACHE_DEFAULT_MB;
+  size = getenv("ALIGNTK_CACHE_SIZE");
+  if (size != NULL && size[0] != '\0' &&
+      (sscanf(size, "%lld", &mb) != 1 || mb <= 0))
+    return;
+  if ((mkdir(dir, 0700) != 0 && errno != EEXIST) ||
+      stat(dir, &sb) != 0 || !S_ISDIR(sb.st_mode))
+    return;
+  strcpy(cacheDir, dir);
+  cacheDev = sb.st_dev;
+  cacheLimit = mb << 20;
+}
+
+/* CachedFile returns the name of the file the readers should open for
+   filename: its copy in the read cache, which it makes or refreshes
+   in cached if need be, or filename itself if there is no cache, the
+   file is already on the cache's filesystem or could not be copied */
+static char *
+CachedFile (char *filename, char *cached)
+{
+  struct stat sb, csb;
+  char path[PATH_MAX];
+  char *ext;
+  struct timespec times[2];
+
+  pthread_once(&cacheOnce, InitReadCache);
+  if (cacheDir[0] == '\0' ||
+      stat(filename, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+      sb.st_dev == cacheDev || sb.st_size > cacheLimit ||
+      realpath(filename, path) == NULL)
+    return(filename);
+  ext = strrchr(path, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL || strlen(ext) > 8)
+    ext = "";
+  sprintf(cached, "%s/%016llx%s", cacheDir,
+	  (unsigned long long) HashString(path), ext);
+
+  if (stat(cached, &csb) == 0 &&
+      csb.st_size == sb.st_size && csb.st_mtime == sb.st_mtime)
+    {
+      /* the access time orders the copies for eviction */
+      times[0].tv_sec = 0;
+      times[0].tv_nsec = UTIME_NOW;
+      times[1].tv_sec = 0;
+      times[1].tv_nsec = UTIME_OMIT;
+      utimensat(AT_FDCWD, cached, times, 0);
+      return(cached);
+    }
+  if (!CopyToCache(filename, &sb, cached))
+    return(filename);
+  TrimReadCache();
+  return(cached);
+}
+
+/* CopyToCache copies the file filename, of status sb, to cached
+   through a temporary file, so that other processes sharing the cache
+   never see a partial copy; it returns 0 if the copy could not be
+   made */
+static int
+CopyToCache (char *filename, struct stat *sb, char *cached)
+{
+  char tmpName[PATH_MAX];
+  int in, out;
+  char *buffer;
+  ssize_t n;
+  int ok;
+  struct timespec times[2];
+
+  snprintf(tmpName, PATH_MAX, "%s/.copy.XXXXXX", cacheDir);
+  if ((in = open(filename, O_RDONLY)) < 0)
+    return(0);
+  if ((out = mkstemp(tmpName)) < 0)
+    {
+      close(in);
+      return(0);
+    }
+  buffer = (char *) malloc(1 << 20);
+  ok = buffer != NULL;
+  while (ok && (n = read(in, buffer, 1 << 20)) != 0)
+    ok = n > 0 && write(out, buffer, n) == n;
+  free(buffer);
+  close(in);
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_NOW;
+  times[1] = sb->st_mtim;
+  if (ok)
+    ok = futimens(out, times) == 0;
+  if (close(out) != 0)
+    ok = 0;
+  if (!ok || rename(tmpName, cached) != 0)
+    {
+      unlink(tmpName);
+      return(0);
+    }
+  return(1);
+}
+
+/* TrimReadCache removes the least recently read copies, other than
+   those read in the last CACHE_MIN_AGE seconds, until the cache holds
+   no more than its limit */
+static void
+TrimReadCache (void)
+{
+  DIR *d;
+  struct dirent *de;
+  struct stat sb;
+  char fn[PATH_MAX + NAME_MAX + 2];
+  CachedCopy *copies, *nc;
+  int n, nAllocated;
+  int i;
+  long long total;
+  time_t now;
+
+  pthread_mutex_lock(&cacheLock);
+  if ((d = opendir(cacheDir)) == NULL)
+    {
+      pthread_mutex_unlock(&cacheLock);
+      return;
+    }
+  copies = NULL;
+  n = nAllocated = 0;
+  total = 0;
+  while ((de = readdir(d)) != NULL)
+    {
+      if (de->d_name[0] == '.')
+	continue;
+      sprintf(fn, "%s/%s", cacheDir, de->d_name);
+      if (stat(fn, &sb) != 0 || !S_ISREG(sb.st_mode))
+	continue;
+      if (n == nAllocated)
+	{
+	  nAllocated = nAllocated > 0 ? 2 * nAllocated : 256;
+	  nc = (CachedCopy *) realloc(copies, nAllocated * sizeof(CachedCopy));
+	  if (nc == NULL)
+	    break;
+	  copies = nc;
+	}
+      strcpy(copies[n].name, de->d_name);
+      copies[n].size = sb.st_size;
+      copies[n].atime = sb.st_atime;
+      total += sb.st_size;
+      ++n;
+    }
+  closedir(d);
+
+  if (total > cacheLimit)
+    {
+      qsort(copies, n, sizeof(CachedCopy), CompareCachedCopies);
+      now = time(NULL);
+      for (i = 0; i < n && total > cacheLimit; ++i)
+	{
+	  if (copies[i].atime > now - CACHE_MIN_AGE)
+	    break;
+	  sprintf(fn, "%s/%s", cacheDir, copies[i].name);
+	  if (unlink(fn) == 0)
+	    total -= copies[i].size;
+	}
+    }
+  free(copies);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+static int
+CompareCachedCopies (const void *a, const void *b)
+{
+  const CachedCopy *ca = (const CachedCopy *) a;
+  const CachedCopy *cb = (const CachedCopy *) b;
+
+  if (ca->atime != cb->atime)
+    return(ca->atime < cb->atime ? -1 : 1);
+  return(strcmp(ca->name, cb->name));
+}
+
 int
 ReadImage (char *filename, unsigned char **pixels,
 	   int *width, int *height,
@@ -430,8 +1105,9 @@ ReadImage (char *filename, unsigned char **pixels,
   if (len > 4 && strcasecmp(&filename[len-4], ".tif") == 0 ||
       len > 5 && strcasecmp(&filename[len-5], ".tiff") == 0)
     {
-      if (!ReadTiffImage(filename, &buffer, &iw, &ih, error))
-	return(0);
+      /* TIFF files are cropped while decoding */
+      return(ReadTiffImageRegion(filename, pixels, width, height,
+				 minX, maxX, minY, maxY, error));
     }
   else if (len > 4 && strcasecmp(&filename[len-4], ".pgm") == 0)
     {
@@ -464,9 +1140,9 @@ ReadImage (char *filename, unsigned char **pixels,
 	    case 1:
 	    case 2:
 	    case 3:
-	      if (!ReadTiffImage(fn, &buffer, &iw, &ih, error))
-		return(0);
-	      break;
+	      extension = k;
+	      return(ReadTiffImageRegion(fn, pixels, width, height,
+					 minX, maxX, minY, maxY, error));
 	    case 4:
 	    case 5:
 	      if (!ReadPgmImage(fn, &buffer, &iw, &ih, error))
@@ -559,1177 +1235,4121 @@ ReadImage (char *filename, unsigned char **pixels,
   return(1);
 }
 
-int
-ReadTiffImage (char *filename, unsigned char **buffer,
-	       int *width, int *height,
-	       char *error)
+/* BoxReduce returns the ow x oh image each of whose pixels is the
+   rounded mean of an f x f block of the iw-wide image img; rows of
+   img beyond ih, and the blocks that would need them, are not used */
+static unsigned char *
+BoxReduce (unsigned char *img, int iw, int ih, int f,
+	   unsigned char *out, int ow, int oh, int y0)
+{
+  int x, y;
+  int dx, dy;
+  unsigned int sum;
+  unsigned int half = (f * f) / 2;
+  unsigned char *p;
+
+  for (y = 0; y < oh && (y + 1) * f <= ih; ++y)
+    for (x = 0; x < ow; ++x)
+      {
+	sum = 0;
+	for (dy = 0; dy < f; ++dy)
+	  {
+	    p = &img[((size_t) (y * f + dy)) * iw + x * f];
+	    for (dx = 0; dx < f; ++dx)
+	      sum += p[dx];
+	  }
+	out[((size_t) (y0 + y)) * ow + x] = (sum + half) / (f * f);
+      }
+  return(out);
+}
+
+/* FindTiffReducedDirectory returns the offset of the directory of a
+   TIFF file that holds a width x height version of the first image,
+   looking first at the first image's SubIFDs (as OpenPyramidImageWriter
+   writes them) and then at the later images of the file, or 0 if
+   there is none */
+toff_t
+FindTiffReducedDirectory (char *filename, int width, int height)
 {
   TIFF *image;
   uint32 iw, ih;
-  uint16 photo, bps, spp, fillorder;
-  tsize_t stripSize;
-  unsigned long imageOffset, result;
-  int stripMax, stripCount;
-  unsigned long bufferSize, count;
-  unsigned char *b;
-
-  // Open the TIFF image
-  if ((image = TIFFOpen(filename, "r")) == NULL)
-    {
-      sprintf(error, "Could not open TIFF image: %s\n", filename);
-      return(0);
-    }
-  
-  // Check that it is of a type that we support
-  if (TIFFGetField(image, TIFFTAG_BITSPERSAMPLE, &bps) == 0 || bps != 8)
-    {
-      sprintf(error, "Either undefined or unsupported number of bits per sample (bps = %d) in tiff image %s\n", bps, filename);
-      return(0);
-    }
-  
-  if (TIFFGetField(image, TIFFTAG_SAMPLESPERPIXEL, &spp) != 0 && spp != 1)
-    {
-      sprintf(error, "Unsupported number of samples per pixel (spp = %d) in tiff image %s\n", spp, filename);
-      return(0);
-    }
+  uint16 nSubIFDs;
+  toff_t *offsets;
+  toff_t subIFDs[MAX_WRITER_LEVELS];
+  toff_t found = 0;
+  int i;
+  char cached[PATH_MAX];
 
-  if (TIFFGetField(image, TIFFTAG_IMAGEWIDTH, &iw) == 0)
-    {
-      sprintf(error, "TIFF image %s does not define its width\n",
-	      filename);
-      return(0);
-    }
-  
-  if (TIFFGetField(image, TIFFTAG_IMAGELENGTH, &ih) == 0)
+  if ((image = TIFFOpen(CachedFile(filename, cached), "r")) == NULL)
+    return(0);
+  if (TIFFGetField(image, TIFFTAG_SUBIFD, &nSubIFDs, &offsets) != 0)
     {
-      sprintf(error, "Image %s does not define its height (length)\n",
-	      filename);
-      return(0);
+      /* the offsets belong to the directory, which is about to go */
+      if (nSubIFDs > MAX_WRITER_LEVELS)
+	nSubIFDs = MAX_WRITER_LEVELS;
+      memcpy(subIFDs, offsets, nSubIFDs * sizeof(toff_t));
+      for (i = 0; found == 0 && i < nSubIFDs; ++i)
+	if (TIFFSetSubDirectory(image, subIFDs[i]) &&
+	    TIFFGetField(image, TIFFTAG_IMAGEWIDTH, &iw) != 0 &&
+	    TIFFGetField(image, TIFFTAG_IMAGELENGTH, &ih) != 0 &&
+	    iw == width && ih == height)
+	  found = subIFDs[i];
+      if (found == 0 && !TIFFSetDirectory(image, 0))
+	{
+	  TIFFClose(image);
+	  return(0);
+	}
     }
-  
-  // Read in the possibly multiple strips
-  stripSize = TIFFStripSize(image);
-  stripMax = TIFFNumberOfStrips(image);
-  imageOffset = 0;
+  while (found == 0 && TIFFReadDirectory(image))
+    if (TIFFGetField(image, TIFFTAG_IMAGEWIDTH, &iw) != 0 &&
+	TIFFGetField(image, TIFFTAG_IMAGELENGTH, &ih) != 0 &&
+	iw == width && ih == height)
+      found = TIFFCurrentDirOffset(image);
+  TIFFClose(image);
+  return(found);
+}
 
-  bufferSize = stripMax * stripSize;
-  //      Log("TIFF: %ld %ld %ld %d %d %d %d\n",
-  //	  (long) stripSize, (long) stripMax, (long) bufferSize,
-  //	  (int) bps, (int) spp, (int) iw, (int) ih);
+/* FindImageFile sets fn to the name of the image file filename
+   names, trying the known extensions if only its basename was given,
+   and returns the length of fn, or 0 if there is no such file */
+static int
+FindImageFile (char *filename, char *fn, char *error)
+{
+  struct stat sb;
+  int i;
 
-  if ((b = (unsigned char *) malloc(bufferSize)) == NULL)
+  if (strlen(filename) >= PATH_MAX)
     {
-      sprintf(error, "Could not allocate enough memory for the uncompressed image (bytes = %lu) of TIFF file %s\n", bufferSize, filename);
+      sprintf(error, "Image filename is too long: %s\n", filename);
       return(0);
     }
-
-  for (stripCount = 0; stripCount < stripMax; ++stripCount)
+  strcpy(fn, filename);
+  if (stat(fn, &sb) != 0)
     {
-      if ((result = TIFFReadEncodedStrip(image, stripCount,
-					 b + imageOffset,
-					 stripSize)) == -1)
+      for (i = 0; i < N_EXTENSIONS; ++i)
 	{
-	  sprintf(error, "Read error on input strip number %d in TIFF file %s\n",
-		  stripCount, filename);
-	  return(0);
+	  sprintf(fn, "%s%s", filename, extensions[(extension + i) %
+						  N_EXTENSIONS]);
+	  if (stat(fn, &sb) == 0)
+	    break;
+	}
+      if (i >= N_EXTENSIONS)
+	{
+	  sprintf(error, "Cannot find image file with basename %s\n",
+		  filename);
+	  return(0);
 	}
-      imageOffset += result;
-    }
-  
-  // Deal with photometric interpretations
-  if (TIFFGetField(image, TIFFTAG_PHOTOMETRIC, &photo) == 0)
-    {
-      sprintf(error, "TIFF file %s has an undefined photometric interpretation\n",
-	      filename);
-      return(0);
-    }
-  
-  if (photo != PHOTOMETRIC_MINISBLACK)
-    {
-      // flip bits
-      for (count = 0; count < bufferSize; ++count)
-	b[count] = ~b[count];
     }
-  
-  TIFFClose(image);
-
-  *buffer = b;
-  *width = iw;
-  *height = ih;
-  return(1);
+  return(strlen(fn));
 }
 
+/* the number of bytes of a TIFF image that ReadImageReduced decodes
+   at once when it has to reduce the image itself */
+#define REDUCE_BAND_BYTES	(16*1024*1024)
+
 int
-ReadPgmImage (char *filename, unsigned char **buffer,
-	      int *width, int *height,
-	      char *error)
+ReadImageReduced (char *filename, int factor,
+		  unsigned char **pixels,
+		  int *width, int *height,
+		  char *error)
 {
-  FILE *f;
-  char tc;
-  int m;
-  uint32 iw, ih;
-  unsigned char *b;
+  char fn[PATH_MAX];
+  int len;
+  int iw, ih;
+  int ow, oh;
+  int f, s;
+  toff_t dir;
+  int y, bandRows;
+  int bw, bh;
+  unsigned char *img;
+  unsigned char *out;
 
-  f = fopen(filename, "rb");
-  if (f == NULL)
+  if (factor <= 1)
+    return(ReadImage(filename, pixels, width, height,
+		     -1, -1, -1, -1, error));
+
+  if ((len = FindImageFile(filename, fn, error)) == 0)
+    return(0);
+  if (!ReadImageSize(fn, &iw, &ih, error))
+    return(0);
+  ow = iw / factor;
+  oh = ih / factor;
+  if (ow == 0 || oh == 0)
     {
-      sprintf(error, "Could not open file %s for reading\n",
-	      filename);
+      sprintf(error, "Image %s is too small to reduce by %d\n", fn, factor);
       return(0);
     }
-  if (!ReadHeader(f, &tc, &iw, &ih, &m))
+
+  if (len > 4 && strcasecmp(&fn[len-4], ".jpg") == 0 ||
+      len > 5 && strcasecmp(&fn[len-5], ".jpeg") == 0)
     {
-      sprintf(error, "Image file %s not binary pgm.\n", filename);
-      return(0);
+      /* let the decoder do as much of the reduction as it can */
+      for (s = 8; factor % s != 0; s >>= 1) ;
+      if (!ReadJpgImageScaled(fn, s, &img, &iw, &ih, error))
+	return(0);
+      f = factor / s;
+      if (f == 1 && iw == ow && ih == oh)
+	out = img;
+      else
+	{
+	  out = (unsigned char *) malloc(((size_t) ow) * oh);
+	  if (out == NULL)
+	    {
+	      free(img);
+	      sprintf(error, "Could not allocate reduced image of %s\n", fn);
+	      return(0);
+	    }
+	  BoxReduce(img, iw, ih, f, out, ow, oh, 0);
+	  free(img);
+	}
     }
-  if ((b = (unsigned char *) malloc(iw * ih)) == NULL)
+  else if (len > 4 && strcasecmp(&fn[len-4], ".tif") == 0 ||
+	   len > 5 && strcasecmp(&fn[len-5], ".tiff") == 0)
     {
-      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
-      return(0);
+      if ((dir = FindTiffReducedDirectory(fn, ow, oh)) != 0)
+	return(ReadTiffDirectoryRegion(fn, dir, pixels, width, height,
+				       -1, -1, -1, -1, error));
+
+      /* no stored level of that size; decode and reduce a band of
+	 rows at a time */
+      out = (unsigned char *) malloc(((size_t) ow) * oh);
+      if (out == NULL)
+	{
+	  sprintf(error, "Could not allocate reduced image of %s\n", fn);
+	  return(0);
+	}
+      bandRows = REDUCE_BAND_BYTES / iw / factor;
+      if (bandRows < 1)
+	bandRows = 1;
+      for (y = 0; y < oh; y += bandRows)
+	{
+	  if (y + bandRows > oh)
+	    bandRows = oh - y;
+	  if (!ReadTiffImageRegion(fn, &img, &bw, &bh,
+				   0, ow * factor - 1,
+				   y * factor, (y + bandRows) * factor - 1,
+				   error))
+	    {
+	      free(out);
+	      return(0);
+	    }
+	  BoxReduce(img, bw, bh, factor, out, ow, bandRows, y);
+	  free(img);
+	}
     }
-  if (fread(b, 1, iw * ih, f) != iw * ih)
+  else
     {
-      sprintf(error, "Image file %s apparently truncated.\n",
-	      filename);
-      return(0);
+      if (!ReadImage(fn, &img, &iw, &ih, -1, -1, -1, -1, error))
+	return(0);
+      out = (unsigned char *) malloc(((size_t) ow) * oh);
+      if (out == NULL)
+	{
+	  free(img);
+	  sprintf(error, "Could not allocate reduced image of %s\n", fn);
+	  return(0);
+	}
+      BoxReduce(img, iw, ih, factor, out, ow, oh, 0);
+      free(img);
     }
-  fclose(f);
 
-  *buffer = b;
-  *width = iw;
-  *height = ih;
+  *pixels = out;
+  *width = ow;
+  *height = oh;
   return(1);
 }
 
 int
-ReadPpmImage (char *filename, unsigned char **buffer,
-	      int *width, int *height,
-	      char *error)
+ReadImageRegionReduced (char *filename, int factor,
+			unsigned char **pixels,
+			int *width, int *height,
+			int minX, int maxX, int minY, int maxY,
+			char *error)
 {
-  FILE *f;
-  char tc;
-  int m;
-  uint32 iw, ih;
-  unsigned char *b;
+  char fn[PATH_MAX];
+  int len;
+  int iw, ih;
+  int ow, oh;
+  int bw, bh;
+  int x0, y0, y;
+  toff_t dir;
+  unsigned char *img;
+  unsigned char *out;
 
-  f = fopen(filename, "rb");
-  if (f == NULL)
-    {
-      sprintf(error, "Could not open file %s for reading\n",
-	      filename);
-      return(0);
-    }
-  if (!ReadHeader(f, &tc, &iw, &ih, &m))
-    {
-      sprintf(error, "Image file %s not binary ppm.\n", filename);
-      return(0);
-    }
-  if ((b = (unsigned char *) malloc(iw * ih)) == NULL)
+  if (factor <= 1)
+    return(ReadImage(filename, pixels, width, height,
+		     minX, maxX, minY, maxY, error));
+  if ((len = FindImageFile(filename, fn, error)) == 0)
+    return(0);
+  if (!ReadImageSize(fn, &iw, &ih, error))
+    return(0);
+  ow = iw / factor;
+  oh = ih / factor;
+  if ((len > 4 && strcasecmp(&fn[len-4], ".tif") == 0 ||
+       len > 5 && strcasecmp(&fn[len-5], ".tiff") == 0) &&
+      ow > 0 && oh > 0 &&
+      (dir = FindTiffReducedDirectory(fn, ow, oh)) != 0)
+    return(ReadTiffDirectoryRegion(fn, dir, pixels, width, height,
+				   minX, maxX, minY, maxY, error));
+
+  /* reduce the corresponding full-size region */
+  if (!ReadImage(fn, &img, &bw, &bh,
+		 minX < 0 ? -1 : minX * factor,
+		 maxX < 0 ? -1 : (maxX + 1) * factor - 1,
+		 minY < 0 ? -1 : minY * factor,
+		 maxY < 0 ? -1 : (maxY + 1) * factor - 1,
+		 error))
+    return(0);
+  if (bw / factor == 0 || bh / factor == 0)
     {
-      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      free(img);
+      sprintf(error, "Region of %s is too small to reduce by %d\n",
+	      fn, factor);
       return(0);
     }
-  if (fread(b, 1, iw * ih, f) != iw * ih)
+  out = (unsigned char *) malloc(((size_t) (bw / factor)) * (bh / factor));
+  if (out == NULL)
     {
-      sprintf(error, "Image file %s apparently truncated.\n",
-	      filename);
+      free(img);
+      sprintf(error, "Could not allocate reduced region of %s\n", fn);
       return(0);
     }
-  fclose(f);
+  BoxReduce(img, bw, bh, factor, out, bw / factor, bh / factor, 0);
+  free(img);
+  *pixels = out;
+  *width = bw / factor;
+  *height = bh / factor;
 
-  *buffer = b;
-  *width = iw;
-  *height = ih;
+  /* the partial blocks at the right and bottom edges of the image
+     are not part of the reduced image, just as for ReadImageReduced */
+  x0 = minX < 0 ? 0 : minX;
+  y0 = minY < 0 ? 0 : minY;
+  for (y = 0; y < *height; ++y)
+    if (y0 + y >= oh)
+      memset(&out[((size_t) y) * *width], 0, *width);
+    else if (x0 + *width > ow)
+      memset(&out[((size_t) y) * *width + (ow > x0 ? ow - x0 : 0)], 0,
+	     *width - (ow > x0 ? ow - x0 : 0));
   return(1);
 }
 
 int
-ReadJpgImage (char *filename, unsigned char **buffer,
-	      int *width, int *height,
-	      char *error)
+ReadImageRows (char *filename, int factor, int step,
+	       unsigned char **pixels,
+	       int *width, int *height,
+	       int minX, int maxX, int minY, int maxY,
+	       char *error)
 {
-  struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  FILE *f;
-  uint32 iw, ih;
-  unsigned char **b;
-  uint32 i;
-  
-  if ((f = fopen(filename, "rb")) == NULL)
-    {
-      sprintf(error, "Could not open file %s for reading\n",
-		  filename);
-      return(0);
-    }
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
-  jpeg_stdio_src(&cinfo, f);
-  jpeg_read_header(&cinfo, 1);
-  cinfo.out_color_space = JCS_GRAYSCALE;
-  jpeg_calc_output_dimensions(&cinfo);
-  iw = cinfo.output_width;
-  ih = cinfo.output_height;
-  b = (unsigned char **) malloc(ih * sizeof(unsigned char *));
-  b[0] = (unsigned char *) malloc(iw * ih * sizeof(unsigned char));
-  for (i = 0; i < ih; ++i)
-    b[i] = b[0] + i * iw;
-  jpeg_start_decompress(&cinfo);
-  if (cinfo.output_components != 1)
+  char fn[PATH_MAX];
+  int len;
+  int iw, ih;
+  int bw, bh;
+  int y, n;
+  toff_t dir;
+  unsigned char *img;
+  RegionSink s;
+
+  if (step < 1)
+    step = 1;
+  if ((len = FindImageFile(filename, fn, error)) == 0)
+    return(0);
+  if ((len > 4 && strcasecmp(&fn[len-4], ".tif") == 0) ||
+      (len > 5 && strcasecmp(&fn[len-5], ".tiff") == 0))
     {
-      free(b);
-      fclose(f);
-      jpeg_destroy_decompress(&cinfo);
-      sprintf(error, "Image file %s is not a grayscale jpg.\n", filename);
-      return(0);
+      dir = 0;
+      if (factor > 1)
+	{
+	  if (!ReadImageSize(fn, &iw, &ih, error))
+	    return(0);
+	  if (iw / factor > 0 && ih / factor > 0)
+	    dir = FindTiffReducedDirectory(fn, iw / factor, ih / factor);
+	}
+      if (factor <= 1 || dir != 0)
+	{
+	  memset(&s, 0, sizeof(RegionSink));
+	  s.filename = fn;
+	  s.begin = BeginBytes;
+	  s.put = PutBytes;
+	  s.rowStep = step;
+	  if (!DecodeTiffRegion(fn, dir, minX, maxX, minY, maxY, &s, error))
+	    {
+	      free(s.bytes);
+	      return(0);
+	    }
+	  *pixels = s.bytes;
+	  *width = s.width;
+	  *height = s.height;
+	  return(1);
+	}
     }
-  while (cinfo.output_scanline < cinfo.output_height)
-    jpeg_read_scanlines(&cinfo, &b[cinfo.output_scanline],
-			cinfo.output_height - cinfo.output_scanline);
-  jpeg_finish_decompress(&cinfo);
-  fclose(f);
-  jpeg_destroy_decompress(&cinfo);
 
-  *buffer = b[0];
-  free(b);
-  *width = iw;
-  *height =  ih;
+  /* otherwise the whole region is read and the wanted rows kept */
+  if (!ReadImageRegionReduced(fn, factor, &img, &bw, &bh,
+			      minX, maxX, minY, maxY, error))
+    return(0);
+  n = (bh + step - 1) / step;
+  for (y = 1; y < n; ++y)
+    memmove(&img[((size_t) y) * bw], &img[((size_t) y) * step * bw], bw);
+  *pixels = img;
+  *width = bw;
+  *height = n;
   return(1);
 }
 
-// Add ReadBmpImage [Nilton]
 int
-ReadBmpImage (char *filename, unsigned char **buffer,
-	      int *width, int *height, char *error)
+ReadTiffImage (char *filename, unsigned char **buffer,
+	       int *width, int *height,
+	       char *error)
 {
-  FILE *f;
-  BMPFILEHEADER file;
-  BMPINFOHEADER info;
-  int rowsize;
-  unsigned char *b;
-  
-  f = fopen(filename, "rb");
-  if (f == NULL)
+  return(ReadTiffImageRegion(filename, buffer, width, height,
+			     -1, -1, -1, -1, error));
+}
+
+/* ReadTiffImageRegion reads the subregion minX..maxX, minY..maxY
+   (a negative bound means the edge of the image) of a TIFF file;
+   only the strips or tiles that intersect the region are decoded,
+   and any part of the region beyond the image is set to 0 */
+int
+ReadTiffImageRegion (char *filename, unsigned char **buffer,
+		     int *width, int *height,
+		     int minX, int maxX, int minY, int maxY,
+		     char *error)
+{
+  return(ReadTiffDirectoryRegion(filename, 0, buffer, width, height,
+				 minX, maxX, minY, maxY, error));
+}
+
+/* ReadTiffDirectoryRegion is ReadTiffImageRegion for the image whose
+   directory (IFD) is at the given file offset, which may be a SubIFD;
+   an offset of 0 means the first image */
+int
+ReadTiffDirectoryRegion (char *filename, toff_t directory,
+			 unsigned char **buffer,
+			 int *width, int *height,
+			 int minX, int maxX, int minY, int maxY,
+			 char *error)
+{
+  RegionSink s;
+
+  memset(&s, 0, sizeof(RegionSink));
+  s.filename = filename;
+  s.begin = BeginBytes;
+  s.put = PutBytes;
+  if (!DecodeTiffRegion(filename, directory, minX, maxX, minY, maxY,
+			&s, error))
     {
-      sprintf(error, "Could not open file %s for reading\n",
-		  filename);
+      free(s.bytes);
       return(0);
     }
-  
-  if (fread(&file.bfType, sizeof(file.bfType), 1, f) != 1 ||
-    file.bfType != BMP_FILE_TYPE)
+  *buffer = s.bytes;
+  *width = s.width;
+  *height = s.height;
+  return(1);
+}
+
+/* DecodeTiffRegion decodes the region minX..maxX, minY..maxY of the
+   TIFF image at directory of filename into sink: begin is called once
+   the size of the region is known, and put for each row segment of it
+   that lies within the image, as each strip or tile that holds part
+   of the region is decoded; the rest of the region is left to begin
+   to clear */
+static int
+DecodeTiffRegion (char *filename, toff_t directory,
+		  int minX, int maxX, int minY, int maxY,
+		  RegionSink *sink, char *error)
+{
+  TIFF *image;
+  uint32 iw, ih;
+  uint32 tw, th;
+  uint32 rowsPerStrip;
+  uint16 photo, bps, spp;
+  uint32 xmin, xmax, ymin, ymax;
+  uint32 cxmax, cymax;
+  uint32 x0, y0, x1, y1;
+  uint32 tx, ty;
+  uint32 y, ys;
+  uint32 step;
+  tstrip_t strip, firstStrip, lastStrip;
+  tsize_t blockSize, result;
+  size_t bpl;
+  unsigned char *block;
+  char cached[PATH_MAX];
+
+  // Open the TIFF image
+  if ((image = TIFFOpen(CachedFile(filename, cached), "r")) == NULL)
     {
-      sprintf(error, "Image file %s not bmp file.bfType.\n", filename);
+      sprintf(error, "Could not open TIFF image: %s\n", filename);
       return(0);
     }
-  if (fread(&file.bfSize, sizeof(file.bfSize), 1, f) != 1)
+  if (directory != 0 && !TIFFSetSubDirectory(image, directory))
     {
-      sprintf(error, "Image file %s not bmp file.bfSize.\n", filename);
+      sprintf(error, "TIFF file %s has no directory at offset %llu\n",
+	      filename, (unsigned long long) directory);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&file.bfReserved, sizeof(file.bfReserved), 1, f) != 1)
+  
+  // Check that it is of a type that we support
+  if (TIFFGetField(image, TIFFTAG_BITSPERSAMPLE, &bps) == 0 || bps != 8)
     {
-      sprintf(error, "Image file %s not bmp file.bfReserved.\n", filename);
+      sprintf(error, "Either undefined or unsupported number of bits per sample (bps = %d) in tiff image %s\n", bps, filename);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&file.bfOffset, sizeof(file.bfOffset), 1, f) != 1)
+  
+  if (TIFFGetField(image, TIFFTAG_SAMPLESPERPIXEL, &spp) != 0 && spp != 1)
     {
-      sprintf(error, "Image file %s not bmp file.bfOffset.\n", filename);
+      sprintf(error, "Unsupported number of samples per pixel (spp = %d) in tiff image %s\n", spp, filename);
+      TIFFClose(image);
       return(0);
     }
 
-  if (fread(&info.biSize, sizeof(info.biSize), 1, f) != 1)
+  if (TIFFGetField(image, TIFFTAG_IMAGEWIDTH, &iw) == 0)
     {
-      sprintf(error, "Image file %s not bmp info.biSize.\n", filename);
+      sprintf(error, "TIFF image %s does not define its width\n",
+	      filename);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&info.biWidth, sizeof(info.biWidth), 1, f) != 1)
+  
+  if (TIFFGetField(image, TIFFTAG_IMAGELENGTH, &ih) == 0)
     {
-      sprintf(error, "Image file %s not bmp info.biWidth.\n", filename);
+      sprintf(error, "Image %s does not define its height (length)\n",
+	      filename);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&info.biHeight, sizeof(info.biHeight), 1, f) != 1)
+
+  if (TIFFGetField(image, TIFFTAG_PHOTOMETRIC, &photo) == 0)
     {
-      sprintf(error, "Image file %s not bmp info.biHeight.\n", filename);
+      sprintf(error, "TIFF file %s has an undefined photometric interpretation\n",
+	      filename);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&info.biPlanes, sizeof(info.biPlanes), 1, f) != 1)
+
+  xmin = minX < 0 ? 0 : minX;
+  xmax = maxX < 0 ? iw-1 : maxX;
+  ymin = minY < 0 ? 0 : minY;
+  ymax = maxY < 0 ? ih-1 : maxY;
+  step = sink->rowStep > 1 ? sink->rowStep : 1;
+  sink->width = xmax - xmin + 1;
+  sink->height = (ymax - ymin) / step + 1;
+  sink->invert = photo != PHOTOMETRIC_MINISBLACK;
+  if (!(*sink->begin)(sink, error))
     {
-      sprintf(error, "Image file %s not bmp info.biPlanes.\n", filename);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&info.biBitCount, sizeof(info.biBitCount), 1, f) != 1)
+
+  // the part of the region that lies within the image
+  cxmax = xmax < iw ? xmax : iw-1;
+  cymax = ymax < ih ? ymax : ih-1;
+  if (xmin > cxmax || ymin > cymax)
     {
-      sprintf(error, "Image file %s not bmp info.biBitCount.\n", filename);
-      return(0);
+      TIFFClose(image);
+      return(1);
     }
-  if (info.biBitCount != 8)
+
+  if (TIFFIsTiled(image))
     {
-      sprintf(error, "Unsupported pixel size (%d) for file %s. Convert to grayscale image\n",
-	      info.biBitCount, filename);
-      return(0);
+      TIFFGetField(image, TIFFTAG_TILEWIDTH, &tw);
+      TIFFGetField(image, TIFFTAG_TILELENGTH, &th);
+      blockSize = TIFFTileSize(image);
     }
-  if (fread(&info.biCompression, sizeof(info.biCompression), 1, f) != 1)
+  else
     {
-      sprintf(error, "Image file %s not bmp info.biCompression.\n", filename);
-      return(0);
+      TIFFGetFieldDefaulted(image, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+      if (rowsPerStrip > ih)
+	rowsPerStrip = ih;
+      tw = iw;
+      th = rowsPerStrip;
+      blockSize = TIFFStripSize(image);
     }
-  if (fread(&info.biImageSize, sizeof(info.biImageSize), 1, f) != 1)
+  if ((block = (unsigned char *) malloc(blockSize)) == NULL)
     {
-      sprintf(error, "Image file %s not bmp info.biImageSize.\n", filename);
+      sprintf(error, "Could not allocate enough memory for a block (bytes = %lu) of TIFF file %s\n", (unsigned long) blockSize, filename);
+      TIFFClose(image);
       return(0);
     }
-  if (fread(&info.biPixPerMeterX, sizeof(info.biPixPerMeterX), 1, f) != 1)
+  bpl = tw;
+
+  // decode only those strips or tiles that hold rows of the region
+  if (TIFFIsTiled(image))
     {
-      sprintf(error, "Image file %s not bmp info.biPixPerMeterX.\n", filename);
-      return(0);
+      for (ty = (ymin / th) * th; ty <= cymax; ty += th)
+	for (tx = (xmin / tw) * tw; tx <= cxmax; tx += tw)
+	  {
+	    y0 = ty > ymin ? ty : ymin;
+	    y1 = ty + th - 1 < cymax ? ty + th - 1 : cymax;
+	    ys = y0 + (step - (y0 - ymin) % step) % step;
+	    if (ys > y1)
+	      continue;
+	    if (TIFFReadTile(image, block, tx, ty, 0, 0) == -1)
+	      {
+		sprintf(error, "Read error on input tile at (%u, %u) in TIFF file %s\n",
+			(unsigned) tx, (unsigned) ty, filename);
+		free(block);
+		TIFFClose(image);
+		return(0);
+	      }
+	    x0 = tx > xmin ? tx : xmin;
+	    x1 = tx + tw - 1 < cxmax ? tx + tw - 1 : cxmax;
+	    for (y = ys; y <= y1; y += step)
+	      (*sink->put)(sink, x0 - xmin, (y - ymin) / step,
+			   block + (y - ty) * bpl + (x0 - tx),
+			   x1 - x0 + 1);
+	  }
     }
-  if (fread(&info.biPixPerMeterY, sizeof(info.biPixPerMeterY), 1, f) != 1)
+  else
     {
-      sprintf(error, "Image file %s not bmp info.biPixPerMeterY.\n", filename);
-      return(0);
+      firstStrip = TIFFComputeStrip(image, ymin, 0);
+      lastStrip = TIFFComputeStrip(image, cymax, 0);
+      for (strip = firstStrip; strip <= lastStrip; ++strip)
+	{
+	  ty = strip * th;
+	  y0 = ty > ymin ? ty : ymin;
+	  ys = y0 + (step - (y0 - ymin) % step) % step;
+	  if (ys > ty + th - 1 || ys > cymax)
+	    continue;
+	  if ((result = TIFFReadEncodedStrip(image, strip, block,
+					     blockSize)) == -1)
+	    {
+	      sprintf(error, "Read error on input strip number %d in TIFF file %s\n",
+		      (int) strip, filename);
+	      free(block);
+	      TIFFClose(image);
+	      return(0);
+	    }
+	  /* a strip that decodes to fewer rows than the region needs,
+	     as in a truncated file, is a read error, as in the tiled path */
+	  y1 = ty + th - 1 < cymax ? ty + th - 1 : cymax;
+	  if ((size_t) result < (y1 - ty + 1) * bpl)
+	    {
+	      sprintf(error, "Short read on input strip number %d in TIFF file %s\n",
+		      (int) strip, filename);
+	      free(block);
+	      TIFFClose(image);
+	      return(0);
+	    }
+	  for (y = ys; y <= y1; y += step)
+	    (*sink->put)(sink, 0, (y - ymin) / step,
+			 block + (y - ty) * bpl + xmin,
+			 cxmax - xmin + 1);
+	}
     }
-  if (fread(&info.biColorUsed, sizeof(info.biColorUsed), 1, f) != 1)
+  free(block);
+  TIFFClose(image);
+  return(1);
+}
+
+/* BeginBytes and PutBytes make the 8-bit region of ReadTiffDirectoryRegion;
+   the pixels beyond the image stay 0 */
+static int
+BeginBytes (RegionSink *s, char *error)
+{
+  if ((s->bytes = (unsigned char *) malloc(s->width * s->height)) == NULL)
     {
-      sprintf(error, "Image file %s not bmp info.biColorUsed.\n", filename);
+      sprintf(error, "Could not allocate enough memory for the uncompressed image (bytes = %lu) of TIFF file %s\n", (unsigned long) (s->width * s->height), s->filename);
       return(0);
     }
-  if (fread(&info.biColorImportant, sizeof(info.biColorImportant), 1, f) != 1)
+  memset(s->bytes, 0, s->width * s->height);
+  return(1);
+}
+
+static void
+PutBytes (RegionSink *s, size_t x, size_t y, unsigned char *p, size_t n)
+{
+  unsigned char *q;
+  size_t i;
+
+  q = s->bytes + y * s->width + x;
+  if (!s->invert)
+    memcpy(q, p, n);
+  else
+    for (i = 0; i < n; ++i)
+      q[i] = ~p[i];
+}
+
+/* BeginFloats and PutFloats make the float region of ReadFloatImage,
+   applying the mask and accumulating the statistics of the pixels as
+   they are converted */
+static int
+BeginFloats (RegionSink *s, char *error)
+{
+  if (s->mask != NULL &&
+      (s->maskWidth != s->width || s->maskHeight != s->height))
     {
-      sprintf(error, "Image file %s not bmp info.biColorImportant.\n", filename);
+      sprintf(error, "Mask of size %lu x %lu does not match the %lu x %lu region of image %s\n",
+	      (unsigned long) s->maskWidth, (unsigned long) s->maskHeight,
+	      (unsigned long) s->width, (unsigned long) s->height,
+	      s->filename);
       return(0);
     }
-  /*
-  if (file.bfOffset != (BMP_DEFAULT_HEADER_SIZE + info.biColorImportant * 4) ||
-      info.biHeight <= 0)
+  if (s->floats == NULL)
     {
-      printf("\n Offset = %d\n", file.bfOffset);
-      printf("Color Important = %d\n", info.biColorImportant);
-      printf("Compression + %d\n", info.biCompression);
-      sprintf(error, "Image file %s not bmp Offset error.\n", filename);
-      return(0);
+      s->floats = (float *) malloc(s->width * s->height * sizeof(float));
+      if (s->floats == NULL)
+	{
+	  sprintf(error, "Could not allocate enough memory for the float image (bytes = %lu) of %s\n",
+		  (unsigned long) (s->width * s->height * sizeof(float)),
+		  s->filename);
+	  return(0);
+	}
+      s->allocated = 1;
     }
-  */
-  *width = info.biWidth;
-  *height = info.biHeight;
-  rowsize = (int)(ceil((info.biBitCount*(*width)/32)*4));
-  
-  if ((b = (unsigned char *) malloc((*width) * (*height))) == NULL)
+  memset(s->floats, 0, s->width * s->height * sizeof(float));
+  s->mbpl = (s->width + 7) >> 3;
+  return(1);
+}
+
+static void
+PutFloats (RegionSink *s, size_t x, size_t y, unsigned char *p, size_t n)
+{
+  float *q;
+  unsigned char *m;
+  unsigned char flip;
+  size_t i;
+  unsigned int v;
+  unsigned long long sum, sum2;
+  size_t count;
+
+  q = s->floats + y * s->width + x;
+  flip = s->invert ? 0xff : 0;
+  sum = sum2 = 0;
+  count = 0;
+  if (s->mask == NULL)
     {
-      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
-      return(0);
+      for (i = 0; i < n; ++i)
+	{
+	  v = p[i] ^ flip;
+	  q[i] = v;
+	  sum += v;
+	  sum2 += v * v;
+	}
+      count = n;
     }
-  //printf("Offset: %d\n", file.bfOffset);
-  if (fseek(f, file.bfOffset, SEEK_SET) != 0)
+  else
     {
-      sprintf(error, "Could not reach image data in file %s\n", filename);
-      return(0);
+      m = s->mask + y * s->mbpl;
+      for (i = 0; i < n; ++i)
+	if (m[(x + i) >> 3] & (0x80 >> ((x + i) & 7)))
+	  {
+	    v = p[i] ^ flip;
+	    q[i] = v;
+	    sum += v;
+	    sum2 += v * v;
+	    ++count;
+	  }
     }
-  //printf("width: %d, height: %d, rowsize: %d\n", *width, *height, rowsize);
-  for (int i=*height; i>0; i--)
+  s->stats.count += count;
+  s->stats.sum += sum;
+  s->stats.sum2 += sum2;
+}
+
+int
+ReadFloatImage (char *filename, float **pixels,
+		int *width, int *height,
+		int minX, int maxX, int minY, int maxY,
+		unsigned char *mask, int maskWidth, int maskHeight,
+		FloatImageStats *stats,
+		char *error)
+{
+  RegionSink s;
+  char fn[PATH_MAX];
+  int len;
+  unsigned char *img;
+  int w, h;
+  size_t y;
+
+  memset(&s, 0, sizeof(RegionSink));
+  s.filename = filename;
+  s.begin = BeginFloats;
+  s.put = PutFloats;
+  s.floats = *pixels;
+  s.mask = mask;
+  s.maskWidth = maskWidth;
+  s.maskHeight = maskHeight;
+  if ((len = FindImageFile(filename, fn, error)) == 0)
+    return(0);
+  if ((len > 4 && strcasecmp(&fn[len-4], ".tif") == 0) ||
+      (len > 5 && strcasecmp(&fn[len-5], ".tiff") == 0))
     {
-      if (fread(b + (i-1)*(*width), 1, (*width), f) != (*width))
+      if (!DecodeTiffRegion(fn, 0, minX, maxX, minY, maxY, &s, error))
 	{
-	  sprintf(error, "Image file %s apparently truncated.\n",
-		  filename);
+	  if (s.allocated)
+	    free(s.floats);
 	  return(0);
 	}
-      if (fseek(f, rowsize-(*width), SEEK_CUR) != 0)
+    }
+  else
+    {
+      /* the other formats are decoded whole; the region is converted
+	 in a single pass */
+      if (!ReadImage(fn, &img, &w, &h, minX, maxX, minY, maxY, error))
+	return(0);
+      s.width = w;
+      s.height = h;
+      if (!BeginFloats(&s, error))
 	{
-	  sprintf(error, "Could not reach image data in file %s, row %d\n",
-		  filename, i);
+	  free(img);
 	  return(0);
 	}
+      for (y = 0; y < s.height; ++y)
+	PutFloats(&s, 0, y, img + y * s.width, s.width);
+      free(img);
+    }
+  *pixels = s.floats;
+  *width = s.width;
+  *height = s.height;
+  if (stats != NULL)
+    *stats = s.stats;
+  return(1);
+}
+
+int
+ReadPgmImage (char *filename, unsigned char **buffer,
+	      int *width, int *height,
+	      char *error)
+{
+  FILE *f;
+  char tc;
+  int m;
+  uint32 iw, ih;
+  unsigned char *b;
+  char cached[PATH_MAX];
+
+  f = fopen(CachedFile(filename, cached), "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n",
+	      filename);
+      return(0);
+    }
+  if (!ReadHeader(f, &tc, &iw, &ih, &m))
+    {
+      sprintf(error, "Image file %s not binary pgm.\n", filename);
+      return(0);
+    }
+  if ((b = (unsigned char *) malloc(iw * ih)) == NULL)
+    {
+      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      return(0);
+    }
+  if (fread(b, 1, iw * ih, f) != iw * ih)
+    {
+      sprintf(error, "Image file %s apparently truncated.\n",
+	      filename);
+      return(0);
     }
-  
   fclose(f);
 
   *buffer = b;
+  *width = iw;
+  *height = ih;
   return(1);
 }
-// Add ReadBmpImage [Nilton]
-
 
+/* ImageMmap maps the pixels of an uncompressed 8-bit grayscale image,
+   a PGM file or a MINISBLACK TIFF file whose strips are stored one
+   after another, straight from the file, so that nothing is copied
+   and processes on a node reading the same image share the pages; it
+   returns 0 for any other image, which must be read with ReadImage */
 int
-WriteImage (char *filename, unsigned char *pixels,
-	    int width, int height,
-	    enum ImageCompression compressionMethod,
-	    char *error)
+ImageMmap (char *filename, unsigned char **pixels,
+	   int *width, int *height,
+	   char *error)
 {
   int len;
-  int quality;
-  
+  TIFF *image;
+  uint32 iw, ih;
+  uint32 rowsPerStrip;
+  uint16 photo, bps, spp, compression;
+  toff_t *offsets;
+  tstrip_t s, nStrips;
+  FILE *f;
+  char tc;
+  int m;
+  off_t offset;
+  size_t size, pageOffset;
+  struct stat sb;
+  void *p;
+  char cached[PATH_MAX];
+
   len = strlen(filename);
-  if (len < 5)
-    {
-      sprintf(error, "Image filename is too short: %s\n", filename);
-      return(0);
-    }
-  if (strcasecmp(&filename[len-4], ".tif") == 0 ||
+  if (len > 4 && strcasecmp(&filename[len-4], ".tif") == 0 ||
       len > 5 && strcasecmp(&filename[len-5], ".tiff") == 0)
     {
-      TIFF *image;
-      uint32 rowsperstrip = (uint32) -1;
-      int row;
-
-      // open the TIFF output file
-      if ((image = TIFFOpen(filename, "w")) == NULL)
+      if ((image = TIFFOpen(CachedFile(filename, cached), "r")) == NULL)
 	{
-	  sprintf(error, "Could not open file %s for writing\n", filename);
+	  sprintf(error, "Could not open TIFF image: %s\n", filename);
 	  return(0);
 	}
-
-      TIFFSetField(image, TIFFTAG_IMAGEWIDTH, (uint32) width);
-      TIFFSetField(image, TIFFTAG_IMAGELENGTH, (uint32) height);
-      TIFFSetField(image, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-      TIFFSetField(image, TIFFTAG_SAMPLESPERPIXEL, 1);
-      TIFFSetField(image, TIFFTAG_BITSPERSAMPLE, 8);
-      TIFFSetField(image, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-      TIFFSetField(image, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-      switch (compressionMethod)
+      if (TIFFIsTiled(image) ||
+	  TIFFGetField(image, TIFFTAG_IMAGEWIDTH, &iw) == 0 ||
+	  TIFFGetField(image, TIFFTAG_IMAGELENGTH, &ih) == 0 ||
+	  TIFFGetFieldDefaulted(image, TIFFTAG_BITSPERSAMPLE, &bps) == 0 ||
+	  bps != 8 ||
+	  TIFFGetFieldDefaulted(image, TIFFTAG_SAMPLESPERPIXEL, &spp) == 0 ||
+	  spp != 1 ||
+	  TIFFGetFieldDefaulted(image, TIFFTAG_COMPRESSION, &compression) == 0 ||
+	  compression != COMPRESSION_NONE ||
+	  TIFFGetField(image, TIFFTAG_PHOTOMETRIC, &photo) == 0 ||
+	  photo != PHOTOMETRIC_MINISBLACK ||
+	  TIFFGetFieldDefaulted(image, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip) == 0 ||
+	  TIFFGetField(image, TIFFTAG_STRIPOFFSETS, &offsets) == 0)
 	{
-	case UncompressedImage:
-	  TIFFSetField(image, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-	  break;
-	case HDiffDeflateImage:
-	  TIFFSetField(image, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
-	  TIFFSetField(image, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
-	  break;
-	default:
-	  sprintf(error, "Unsupported compression method: %d\n",
-		  (int) compressionMethod);
+	  sprintf(error, "TIFF image %s is not uncompressed 8-bit grayscale in strips\n",
+		  filename);
+	  TIFFClose(image);
 	  return(0);
 	}
-      TIFFSetField(image, TIFFTAG_ROWSPERSTRIP,
-                   TIFFDefaultStripSize(image, rowsperstrip));
-      for (row = 0; row < height; ++row)
-	if (TIFFWriteScanline(image, &pixels[row*width], row, 0)  <  0)
-	  {
-	    sprintf(error, "Could not write to tif file %s\n", filename);
-	    return(0);
-	  }
+      if (rowsPerStrip > ih)
+	rowsPerStrip = ih;
+      nStrips = TIFFNumberOfStrips(image);
+      for (s = 1; s < nStrips; ++s)
+	if (offsets[s] != offsets[0] + ((toff_t) s) * rowsPerStrip * iw)
+	  break;
+      offset = offsets[0];
       TIFFClose(image);
-    }
-  else if (strcasecmp(&filename[len-4], ".pgm") == 0)
-    {
-      FILE *f = fopen(filename, "wb");
-      if (f == NULL)
+      if (s < nStrips)
 	{
-	  sprintf(error, "Could not open file %s for writing\n",
+	  sprintf(error, "Strips of TIFF image %s are not contiguous\n",
 		  filename);
 	  return(0);
 	}
-      fprintf(f, "P5\n%d %d\n255\n", width, height);
-      if (fwrite(pixels, ((size_t) width)*height, 1, f) != 1)
+    }
+  else if (len > 4 && strcasecmp(&filename[len-4], ".pgm") == 0)
+    {
+      if ((f = fopen(CachedFile(filename, cached), "rb")) == NULL)
 	{
-	  sprintf(error, "Could not write to file %s\n", filename);
+	  sprintf(error, "Could not open file %s for reading\n", filename);
 	  return(0);
 	}
-      fclose(f);
-    }
-  else if (strcasecmp(&filename[len-4], ".jpg") == 0)
-    {
-      switch (compressionMethod)
+      if (!ReadHeader(f, &tc, &iw, &ih, &m) || tc != '5' || m != 255)
 	{
-	case JpegQuality95:
-	  quality = 95;
-	  break;
-	case JpegQuality90:
-	  quality = 90;
-	  break;
-	case JpegQuality85:
-	  quality = 85;
-	  break;
-	case JpegQuality80:
-	  quality = 80;
-	  break;
-	case JpegQuality75:
-	  quality = 75;
-	  break;
-	case JpegQuality70:
-	  quality = 70;
-	  break;
-	default:
-	  sprintf(error, "Unsupported compression method for jpg output: %d\n",
-		  (int) compressionMethod);
+	  sprintf(error, "Image file %s not 8-bit binary pgm.\n", filename);
+	  fclose(f);
 	  return(0);
 	}
-      return(WriteJpgImage(filename, pixels, width, height,
-			   quality, error));
+      offset = ftell(f);
+      fclose(f);
     }
   else
     {
-      sprintf(error, "Unrecognized file extension for image file %s\n", filename);
+      sprintf(error, "Image %s is neither TIFF nor PGM\n", filename);
+      return(0);
+    }
+
+  size = ((size_t) iw) * ih;
+  if ((f = fopen(CachedFile(filename, cached), "rb")) == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n", filename);
+      return(0);
+    }
+  if (size == 0 || fstat(fileno(f), &sb) != 0 || sb.st_size < offset + size)
+    {
+      sprintf(error, "Image file %s apparently truncated.\n", filename);
+      fclose(f);
+      return(0);
+    }
+  /* the mapping must start on a page boundary, which the pixels
+     usually do not */
+  pageOffset = offset % sysconf(_SC_PAGESIZE);
+  p = mmap(NULL, size + pageOffset, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	   fileno(f), offset - pageOffset);
+  fclose(f);
+  if (p == MAP_FAILED)
+    {
+      sprintf(error, "Could not map image file %s\n", filename);
       return(0);
     }
+  *pixels = ((unsigned char *) p) + pageOffset;
+  *width = iw;
+  *height = ih;
   return(1);
 }
 
+void
+ImageMunmap (unsigned char *pixels, int width, int height)
+{
+  size_t pageOffset;
+
+  if (pixels == NULL)
+    return;
+  pageOffset = ((size_t) pixels) % sysconf(_SC_PAGESIZE);
+  munmap(pixels - pageOffset, ((size_t) width) * height + pageOffset);
+}
+
 int
-WriteJpgImage (char *filename, unsigned char *buffer,
-	       int width, int height,
-	       int quality,
-	       char *error)
+ReadPpmImage (char *filename, unsigned char **buffer,
+	      int *width, int *height,
+	      char *error)
 {
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  JSAMPROW row_pointer[1];        /* pointer to a single row */
+  FILE *f;
+  char tc;
+  int m;
+  uint32 iw, ih;
+  unsigned char *b;
+  char cached[PATH_MAX];
+
+  f = fopen(CachedFile(filename, cached), "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n",
+	      filename);
+      return(0);
+    }
+  if (!ReadHeader(f, &tc, &iw, &ih, &m))
+    {
+      sprintf(error, "Image file %s not binary ppm.\n", filename);
+      return(0);
+    }
+  if ((b = (unsigned char *) malloc(iw * ih)) == NULL)
+    {
+      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      return(0);
+    }
+  if (fread(b, 1, iw * ih, f) != iw * ih)
+    {
+      sprintf(error, "Image file %s apparently truncated.\n",
+	      filename);
+      return(0);
+    }
+  fclose(f);
+
+  *buffer = b;
+  *width = iw;
+  *height = ih;
+  return(1);
+}
+
+int
+ReadJpgImage (char *filename, unsigned char **buffer,
+	      int *width, int *height,
+	      char *error)
+{
+  return(ReadJpgImageScaled(filename, 1, buffer, width, height, error));
+}
+
+/* ReadJpgImageScaled decodes a JPEG file at 1/scaleDenom of its size
+   (scaleDenom being 1, 2, 4, or 8), letting libjpeg do the reduction
+   in its inverse DCT instead of decoding the pixels at full size;
+   the result is ceil(width/scaleDenom) x ceil(height/scaleDenom) */
+int
+ReadJpgImageScaled (char *filename, int scaleDenom,
+		    unsigned char **buffer,
+		    int *width, int *height,
+		    char *error)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
   FILE *f;
   uint32 iw, ih;
   unsigned char **b;
   uint32 i;
+  char cached[PATH_MAX];
+  
+  if ((f = fopen(CachedFile(filename, cached), "rb")) == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n",
+		  filename);
+      return(0);
+    }
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, f);
+  jpeg_read_header(&cinfo, 1);
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scaleDenom;
+  jpeg_calc_output_dimensions(&cinfo);
+  iw = cinfo.output_width;
+  ih = cinfo.output_height;
+  b = (unsigned char **) malloc(ih * sizeof(unsigned char *));
+  b[0] = (unsigned char *) malloc(iw * ih * sizeof(unsigned char));
+  for (i = 0; i < ih; ++i)
+    b[i] = b[0] + i * iw;
+  jpeg_start_decompress(&cinfo);
+  if (cinfo.output_components != 1)
+    {
+      free(b);
+      fclose(f);
+      jpeg_destroy_decompress(&cinfo);
+      sprintf(error, "Image file %s is not a grayscale jpg.\n", filename);
+      return(0);
+    }
+  while (cinfo.output_scanline < cinfo.output_height)
+    jpeg_read_scanlines(&cinfo, &b[cinfo.output_scanline],
+			cinfo.output_height - cinfo.output_scanline);
+  jpeg_finish_decompress(&cinfo);
+  fclose(f);
+  jpeg_destroy_decompress(&cinfo);
+
+  *buffer = b[0];
+  free(b);
+  *width = iw;
+  *height =  ih;
+  return(1);
+}
+
+// Add ReadBmpImage [Nilton]
+int
+ReadBmpImage (char *filename, unsigned char **buffer,
+	      int *width, int *height, char *error)
+{
+  FILE *f;
+  BMPFILEHEADER file;
+  BMPINFOHEADER info;
+  int rowsize;
+  unsigned char *b;
+  char cached[PATH_MAX];
+  
+  f = fopen(CachedFile(filename, cached), "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n",
+		  filename);
+      return(0);
+    }
+  
+  if (fread(&file.bfType, sizeof(file.bfType), 1, f) != 1 ||
+    file.bfType != BMP_FILE_TYPE)
+    {
+      sprintf(error, "Image file %s not bmp file.bfType.\n", filename);
+      return(0);
+    }
+  if (fread(&file.bfSize, sizeof(file.bfSize), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp file.bfSize.\n", filename);
+      return(0);
+    }
+  if (fread(&file.bfReserved, sizeof(file.bfReserved), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp file.bfReserved.\n", filename);
+      return(0);
+    }
+  if (fread(&file.bfOffset, sizeof(file.bfOffset), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp file.bfOffset.\n", filename);
+      return(0);
+    }
+
+  if (fread(&info.biSize, sizeof(info.biSize), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biSize.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biWidth, sizeof(info.biWidth), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biWidth.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biHeight, sizeof(info.biHeight), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biHeight.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biPlanes, sizeof(info.biPlanes), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biPlanes.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biBitCount, sizeof(info.biBitCount), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biBitCount.\n", filename);
+      return(0);
+    }
+  if (info.biBitCount != 8)
+    {
+      sprintf(error, "Unsupported pixel size (%d) for file %s. Convert to grayscale image\n",
+	      info.biBitCount, filename);
+      return(0);
+    }
+  if (fread(&info.biCompression, sizeof(info.biCompression), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biCompression.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biImageSize, sizeof(info.biImageSize), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biImageSize.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biPixPerMeterX, sizeof(info.biPixPerMeterX), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biPixPerMeterX.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biPixPerMeterY, sizeof(info.biPixPerMeterY), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biPixPerMeterY.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biColorUsed, sizeof(info.biColorUsed), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biColorUsed.\n", filename);
+      return(0);
+    }
+  if (fread(&info.biColorImportant, sizeof(info.biColorImportant), 1, f) != 1)
+    {
+      sprintf(error, "Image file %s not bmp info.biColorImportant.\n", filename);
+      return(0);
+    }
+  /*
+  if (file.bfOffset != (BMP_DEFAULT_HEADER_SIZE + info.biColorImportant * 4) ||
+      info.biHeight <= 0)
+    {
+      printf("\n Offset = %d\n", file.bfOffset);
+      printf("Color Important = %d\n", info.biColorImportant);
+      printf("Compression + %d\n", info.biCompression);
+      sprintf(error, "Image file %s not bmp Offset error.\n", filename);
+      return(0);
+    }
+  */
+  *width = info.biWidth;
+  *height = info.biHeight;
+  rowsize = (int)(ceil((info.biBitCount*(*width)/32)*4));
+  
+  if ((b = (unsigned char *) malloc((*width) * (*height))) == NULL)
+    {
+      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      return(0);
+    }
+  //printf("Offset: %d\n", file.bfOffset);
+  if (fseek(f, file.bfOffset, SEEK_SET) != 0)
+    {
+      sprintf(error, "Could not reach image data in file %s\n", filename);
+      return(0);
+    }
+  //printf("width: %d, height: %d, rowsize: %d\n", *width, *height, rowsize);
+  for (int i=*height; i>0; i--)
+    {
+      if (fread(b + (i-1)*(*width), 1, (*width), f) != (*width))
+	{
+	  sprintf(error, "Image file %s apparently truncated.\n",
+		  filename);
+	  return(0);
+	}
+      if (fseek(f, rowsize-(*width), SEEK_CUR) != 0)
+	{
+	  sprintf(error, "Could not reach image data in file %s, row %d\n",
+		  filename, i);
+	  return(0);
+	}
+    }
   
-  if ((f = fopen(filename, "wb")) == NULL)
+  fclose(f);
+
+  *buffer = b;
+  return(1);
+}
+// Add ReadBmpImage [Nilton]
+
+
+struct ImageWriter {
+  char filename[PATH_MAX];	/* with an output command, the local
+				   staging file */
+  char destination[PATH_MAX];	/* with an output command, the name the
+				   image is sent under ("" otherwise) */
+  int width;
+  int height;
+  int row;		/* number of rows written so far */
+  TIFF *tif;		/* non-NULL for TIFF output */
+  FILE *f;		/* non-NULL for PGM output */
+  enum ImageCompression compressionMethod;
+  unsigned char *band;	/* for tiled TIFF output, the row of tiles
+			   being filled (NULL for strip output) */
+  unsigned char *tile;	/* one tile, copied out of band; for compressed
+			   strip output, one row, since libtiff's
+			   predictor differences the row that it is
+			   given in place */
+  int bandRows;		/* number of rows now in band */
+
+  /* reduced-resolution levels, written as SubIFDs of the TIFF image;
+     level l is 2^l times smaller than the image, and its rows are
+     kept in levelFile[l] until the image itself is complete */
+  int nLevels;
+  int levelWidth[MAX_WRITER_LEVELS+1];
+  int levelHeight[MAX_WRITER_LEVELS+1];
+  int levelRows[MAX_WRITER_LEVELS+1];
+  FILE *levelFile[MAX_WRITER_LEVELS+1];
+  unsigned char *pending[MAX_WRITER_LEVELS]; /* for each level, a row
+						awaiting the next row to
+						be reduced with it */
+  int havePending[MAX_WRITER_LEVELS];
+};
+
+/* TIFF files whose pixel data would come this close to the 4GB limit
+   of classic TIFF offsets are written as BigTIFF */
+#define BIGTIFF_THRESHOLD	((size_t) 0xf0000000)
+
+/* TIFF files with more pixels than this are written in square tiles of
+   TIFF_TILE_SIZE pixels on a side, so that readers asking for a window
+   of the image only have to decode the tiles that it covers; smaller
+   images are written in strips, which every reader understands */
+#define TILED_THRESHOLD		((size_t) 64*1024*1024)
+#define TIFF_TILE_SIZE		512
+
+/* the level for deflate and zstd TIFF output; 0 means the default */
+static int compressionLevel = 0;
+
+/* the command that finished images are piped to, with each %s
+   replaced by the image filename, quoted for the shell; NULL writes
+   local files */
+static char *outputCommand = NULL;
+
+static char *QuoteForShell (char *s, char *d);
+
+static int SetUpTiffImage (ImageWriter *w, int level, char *error);
+static int PutImageRows (ImageWriter *w, unsigned char *pixels,
+			 int nRows, char *error);
+static int ReduceImageRow (ImageWriter *w, int level, unsigned char *row,
+			   char *error);
+static void FreeImageWriter (ImageWriter *w);
+
+void
+SetImageCompressionLevel (int level)
+{
+  compressionLevel = level > 0 ? level : 0;
+}
+
+void
+SetImageOutputCommand (char *command)
+{
+  if (outputCommand != NULL)
+    free(outputCommand);
+  outputCommand = NULL;
+  if (command == NULL || command[0] == '\0')
+    return;
+  outputCommand = (char *) malloc(strlen(command) + 1);
+  if (outputCommand != NULL)
+    strcpy(outputCommand, command);
+}
+
+int
+ImageOutputIsLocal (void)
+{
+  return(outputCommand == NULL);
+}
+
+int
+StageOutputFile (char *filename, char *staged, char *error)
+{
+  char *dir;
+  char *ext;
+  int fd;
+
+  dir = getenv("TMPDIR");
+  if (dir == NULL || dir[0] == '\0')
+    dir = "/tmp";
+  ext = strrchr(filename, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL)
+    ext = "";
+  if (snprintf(staged, PATH_MAX, "%s/imio.XXXXXX%s", dir, ext) >= PATH_MAX ||
+      (fd = mkstemps(staged, strlen(ext))) < 0)
+    {
+      sprintf(error, "Could not create a staging file for %s in %s\n",
+	      filename, dir);
+      return(0);
+    }
+  close(fd);
+  return(1);
+}
+
+int
+SendOutputFile (char *staged, char *filename, char *error)
+{
+  char *command;
+  char *c, *d;
+  int n;
+  FILE *in, *out;
+  char buf[65536];
+  size_t len;
+  int ok;
+  int status;
+  sigset_t pipeSet, oldSet, pending;
+  int wasPending;
+  struct timespec noWait;
+
+  /* each quote in the name takes 4 characters, and the whole is
+     enclosed in a pair */
+  n = 0;
+  for (c = strstr(outputCommand, "%s"); c != NULL; c = strstr(c + 2, "%s"))
+    ++n;
+  command = (char *) malloc(strlen(outputCommand) +
+			    n * (4 * strlen(filename) + 2) + 1);
+  if (command == NULL)
+    {
+      sprintf(error, "Could not allocate output command for %s\n", filename);
+      unlink(staged);
+      return(0);
+    }
+  for (c = outputCommand, d = command; *c != '\0'; )
+    if (c[0] == '%' && c[1] == 's')
+      {
+	d = QuoteForShell(filename, d);
+	c += 2;
+      }
+    else
+      *d++ = *c++;
+  *d = '\0';
+
+  if ((in = fopen(staged, "rb")) == NULL)
+    {
+      sprintf(error, "Could not reopen staging file %s\n", staged);
+      free(command);
+      unlink(staged);
+      return(0);
+    }
+  if ((out = popen(command, "w")) == NULL)
+    {
+      sprintf(error, "Could not run output command for %s\n", filename);
+      fclose(in);
+      free(command);
+      unlink(staged);
+      return(0);
+    }
+
+  /* a command that exits early must fail the image, not the process,
+     so SIGPIPE is held off in this thread while the pipe is written,
+     and any that the writes raised is taken before it is let in */
+  sigemptyset(&pipeSet);
+  sigaddset(&pipeSet, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+  sigpending(&pending);
+  wasPending = sigismember(&pending, SIGPIPE);
+  ok = 1;
+  while (ok && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = fwrite(buf, 1, len, out) == len;
+  if (ferror(in) || fflush(out) != 0)
+    ok = 0;
+  fclose(in);
+  status = pclose(out);
+  if (!wasPending)
+    {
+      noWait.tv_sec = 0;
+      noWait.tv_nsec = 0;
+      while (sigtimedwait(&pipeSet, NULL, &noWait) == SIGPIPE) ;
+    }
+  pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+  unlink(staged);
+  if (!ok || status != 0)
+    {
+      sprintf(error, "Output command for %s failed (status %d)\n",
+	      filename, status);
+      free(command);
+      return(0);
+    }
+  free(command);
+  return(1);
+}
+
+/* QuoteForShell copies s to d in single quotes, with each quote of s
+   closed, escaped and reopened, returning the end of the copy */
+static char *
+QuoteForShell (char *s, char *d)
+{
+  *d++ = '\'';
+  for (; *s != '\0'; ++s)
+    if (*s == '\'')
+      {
+	strcpy(d, "'\\''");
+	d += 4;
+      }
+    else
+      *d++ = *s;
+  *d++ = '\'';
+  return(d);
+}
+
+ImageWriter *
+OpenImageWriter (char *filename,
+		 int width, int height,
+		 enum ImageCompression compressionMethod,
+		 char *error)
+{
+  return(OpenPyramidImageWriter(filename, width, height, 0,
+				compressionMethod, error));
+}
+
+ImageWriter *
+OpenPyramidImageWriter (char *filename,
+			int width, int height, int nLevels,
+			enum ImageCompression compressionMethod,
+			char *error)
+{
+  ImageWriter *w;
+  int len;
+  int l;
+  size_t nPixels;
+
+  len = strlen(filename);
+  if (len < 5)
+    {
+      sprintf(error, "Image filename is too short: %s\n", filename);
+      return(NULL);
+    }
+  if (len >= PATH_MAX)
+    {
+      sprintf(error, "Image filename is too long: %s\n", filename);
+      return(NULL);
+    }
+  w = (ImageWriter *) malloc(sizeof(ImageWriter));
+  if (w == NULL)
+    {
+      sprintf(error, "Could not allocate writer for %s\n", filename);
+      return(NULL);
+    }
+  memset(w, 0, sizeof(ImageWriter));
+  strcpy(w->filename, filename);
+  w->width = width;
+  w->height = height;
+  w->compressionMethod = compressionMethod;
+
+  /* there are no more levels than will have at least one pixel */
+  if (nLevels > MAX_WRITER_LEVELS)
+    nLevels = MAX_WRITER_LEVELS;
+  w->levelWidth[0] = width;
+  w->levelHeight[0] = height;
+  nPixels = ((size_t) width) * height;
+  for (l = 1; l <= nLevels; ++l)
+    {
+      w->levelWidth[l] = w->levelWidth[l-1] / 2;
+      w->levelHeight[l] = w->levelHeight[l-1] / 2;
+      if (w->levelWidth[l] == 0 || w->levelHeight[l] == 0)
+	break;
+      nPixels += ((size_t) w->levelWidth[l]) * w->levelHeight[l];
+    }
+  w->nLevels = nLevels = l - 1;
+
+  if (strcasecmp(&filename[len-4], ".tif") == 0 ||
+      len > 5 && strcasecmp(&filename[len-5], ".tiff") == 0)
+    {
+      switch (compressionMethod)
+	{
+	case UncompressedImage:
+	case HDiffDeflateImage:
+	case HDiffLzwImage:
+	  break;
+	case HDiffZstdImage:
+	  if (!TIFFIsCODECConfigured(COMPRESSION_ZSTD))
+	    {
+	      sprintf(error, "This libtiff was built without zstd support; cannot write %s\n",
+		      filename);
+	      free(w);
+	      return(NULL);
+	    }
+	  break;
+	default:
+	  sprintf(error, "Unsupported compression method: %d\n",
+		  (int) compressionMethod);
+	  free(w);
+	  return(NULL);
+	}
+
+      for (l = 0; l < nLevels; ++l)
+	{
+	  w->levelFile[l+1] = tmpfile();
+	  w->pending[l] = (unsigned char *) malloc(w->levelWidth[l]);
+	  if (w->levelFile[l+1] == NULL || w->pending[l] == NULL)
+	    {
+	      sprintf(error, "Could not set up reduced levels of %s\n",
+		      filename);
+	      FreeImageWriter(w);
+	      return(NULL);
+	    }
+	}
+
+      // open the TIFF output file
+      if (outputCommand != NULL)
+	{
+	  strcpy(w->destination, filename);
+	  if (!StageOutputFile(filename, w->filename, error))
+	    {
+	      w->destination[0] = '\0';
+	      FreeImageWriter(w);
+	      return(NULL);
+	    }
+	}
+      if ((w->tif = TIFFOpen(w->filename,
+			     nPixels > BIGTIFF_THRESHOLD ?
+			     "w8" : "w")) == NULL)
+	{
+	  sprintf(error, "Could not open file %s for writing\n", filename);
+	  FreeImageWriter(w);
+	  return(NULL);
+	}
+      if (!SetUpTiffImage(w, 0, error))
+	{
+	  FreeImageWriter(w);
+	  return(NULL);
+	}
+    }
+  else if (nLevels > 0)
+    {
+      sprintf(error, "Reduced levels can only be written to TIFF files, not %s\n",
+	      filename);
+      free(w);
+      return(NULL);
+    }
+  else if (strcasecmp(&filename[len-4], ".pgm") == 0)
+    {
+      if (outputCommand != NULL)
+	{
+	  strcpy(w->destination, filename);
+	  if (!StageOutputFile(filename, w->filename, error))
+	    {
+	      free(w);
+	      return(NULL);
+	    }
+	}
+      if ((w->f = fopen(w->filename, "wb")) == NULL)
+	{
+	  sprintf(error, "Could not open file %s for writing\n",
+		  filename);
+	  if (w->destination[0] != '\0')
+	    unlink(w->filename);
+	  free(w);
+	  return(NULL);
+	}
+      fprintf(w->f, "P5\n%d %d\n255\n", width, height);
+    }
+  else
+    {
+      sprintf(error, "Unsupported file extension for streamed image file %s\n",
+	      filename);
+      free(w);
+      return(NULL);
+    }
+  return(w);
+}
+
+/* SetUpTiffImage sets the fields of the current TIFF directory for
+   the given level of the image, and makes it the one that
+   PutImageRows writes */
+static int
+SetUpTiffImage (ImageWriter *w, int level, char *error)
+{
+  uint32 rowsperstrip = (uint32) -1;
+  toff_t subIFDs[MAX_WRITER_LEVELS];
+  int width, height;
+
+  width = w->levelWidth[level];
+  height = w->levelHeight[level];
+  w->width = width;
+  w->height = height;
+  w->row = 0;
+  w->bandRows = 0;
+  if (w->band != NULL)
+    free(w->band);
+  if (w->tile != NULL)
+    free(w->tile);
+  w->band = NULL;
+  w->tile = NULL;
+
+  if (level > 0)
+    TIFFSetField(w->tif, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+  else if (w->nLevels > 0)
+    {
+      memset(subIFDs, 0, sizeof(subIFDs));
+      TIFFSetField(w->tif, TIFFTAG_SUBIFD, (uint16) w->nLevels, subIFDs);
+    }
+  TIFFSetField(w->tif, TIFFTAG_IMAGEWIDTH, (uint32) width);
+  TIFFSetField(w->tif, TIFFTAG_IMAGELENGTH, (uint32) height);
+  TIFFSetField(w->tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+  TIFFSetField(w->tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField(w->tif, TIFFTAG_BITSPERSAMPLE, 8);
+  TIFFSetField(w->tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(w->tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  switch (w->compressionMethod)
+    {
+    case HDiffDeflateImage:
+      TIFFSetField(w->tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+      TIFFSetField(w->tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+      if (compressionLevel > 0)
+	TIFFSetField(w->tif, TIFFTAG_ZIPQUALITY,
+		     compressionLevel < 9 ? compressionLevel : 9);
+      break;
+    case HDiffLzwImage:
+      TIFFSetField(w->tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+      TIFFSetField(w->tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+      break;
+    case HDiffZstdImage:
+      TIFFSetField(w->tif, TIFFTAG_COMPRESSION, COMPRESSION_ZSTD);
+      TIFFSetField(w->tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+      if (compressionLevel > 0)
+	TIFFSetField(w->tif, TIFFTAG_ZSTD_LEVEL,
+		     compressionLevel < 22 ? compressionLevel : 22);
+      break;
+    default:
+      TIFFSetField(w->tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+      break;
+    }
+  if (((size_t) width) * height > TILED_THRESHOLD)
+    {
+      TIFFSetField(w->tif, TIFFTAG_TILEWIDTH, (uint32) TIFF_TILE_SIZE);
+      TIFFSetField(w->tif, TIFFTAG_TILELENGTH, (uint32) TIFF_TILE_SIZE);
+      w->band = (unsigned char *)
+	malloc(((size_t) TIFF_TILE_SIZE) *
+	       ((width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE) *
+	       TIFF_TILE_SIZE);
+      w->tile = (unsigned char *)
+	malloc(((size_t) TIFF_TILE_SIZE) * TIFF_TILE_SIZE);
+      if (w->band == NULL || w->tile == NULL)
+	{
+	  sprintf(error, "Could not allocate tile buffers for %s\n",
+		  w->filename);
+	  return(0);
+	}
+    }
+  else
+    {
+      TIFFSetField(w->tif, TIFFTAG_ROWSPERSTRIP,
+		   TIFFDefaultStripSize(w->tif, rowsperstrip));
+      if (w->compressionMethod != UncompressedImage &&
+	  (w->tile = (unsigned char *) malloc(width)) == NULL)
+	{
+	  sprintf(error, "Could not allocate row buffer for %s\n",
+		  w->filename);
+	  return(0);
+	}
+    }
+  return(1);
+}
+
+int
+WriteImageRows (ImageWriter *w, unsigned char *pixels,
+		int nRows, char *error)
+{
+  int i;
+
+  if (w->row + nRows > w->height)
+    {
+      sprintf(error, "Too many rows written to image file %s\n",
+	      w->filename);
+      return(0);
+    }
+  if (!PutImageRows(w, pixels, nRows, error))
+    return(0);
+  for (i = 0; i < nRows && w->nLevels > 0; ++i)
+    if (!ReduceImageRow(w, 0, &pixels[((size_t) i)*w->levelWidth[0]],
+			error))
+      return(0);
+  return(1);
+}
+
+/* PutImageRows writes rows of the image (or level) now being written */
+static int
+PutImageRows (ImageWriter *w, unsigned char *pixels,
+	      int nRows, char *error)
+{
+  int i;
+  int x, y;
+  size_t bpl;
+
+  if (w->band != NULL)
+    {
+      /* fill the row of tiles, and write it out each time it is full
+	 or the image is complete */
+      bpl = ((size_t) (w->width + TIFF_TILE_SIZE - 1)) /
+	TIFF_TILE_SIZE * TIFF_TILE_SIZE;
+      for (i = 0; i < nRows; ++i)
+	{
+	  memcpy(&w->band[w->bandRows * bpl],
+		 &pixels[((size_t) i)*w->width], w->width);
+	  memset(&w->band[w->bandRows * bpl + w->width], 0,
+		 bpl - w->width);
+	  if (++w->bandRows < TIFF_TILE_SIZE &&
+	      w->row + i + 1 < w->height)
+	    continue;
+	  memset(&w->band[w->bandRows * bpl], 0,
+		 (TIFF_TILE_SIZE - w->bandRows) * bpl);
+	  for (x = 0; x < w->width; x += TIFF_TILE_SIZE)
+	    {
+	      for (y = 0; y < TIFF_TILE_SIZE; ++y)
+		memcpy(&w->tile[y * TIFF_TILE_SIZE],
+		       &w->band[y * bpl + x], TIFF_TILE_SIZE);
+	      if (TIFFWriteTile(w->tif, w->tile, x,
+				w->row + i + 1 - w->bandRows, 0, 0) < 0)
+		{
+		  sprintf(error, "Could not write to tif file %s\n",
+			  w->filename);
+		  return(0);
+		}
+	    }
+	  w->bandRows = 0;
+	}
+    }
+  else if (w->tif != NULL)
+    {
+      for (i = 0; i < nRows; ++i)
+	{
+	  if (w->tile != NULL)
+	    memcpy(w->tile, &pixels[((size_t) i)*w->width], w->width);
+	  if (TIFFWriteScanline(w->tif,
+				w->tile != NULL ? w->tile :
+				&pixels[((size_t) i)*w->width],
+				w->row + i, 0) < 0)
+	    {
+	      sprintf(error, "Could not write to tif file %s\n", w->filename);
+	      return(0);
+	    }
+	}
+    }
+  else if (nRows > 0 &&
+	   fwrite(pixels, ((size_t) w->width)*nRows, 1, w->f) != 1)
+    {
+      sprintf(error, "Could not write to file %s\n", w->filename);
+      return(0);
+    }
+  w->row += nRows;
+  return(1);
+}
+
+/* ReduceImageRow takes the next row of the given level; every second
+   row is averaged 2x2 with the one before it into a row of the next
+   level, which is saved and passed on in turn */
+static int
+ReduceImageRow (ImageWriter *w, int level, unsigned char *row,
+		char *error)
+{
+  unsigned char *p;
+  int x, n;
+
+  if (level >= w->nLevels ||
+      w->levelRows[level+1] >= w->levelHeight[level+1])
+    return(1);
+  p = w->pending[level];
+  if (!w->havePending[level])
+    {
+      memcpy(p, row, w->levelWidth[level]);
+      w->havePending[level] = 1;
+      return(1);
+    }
+  w->havePending[level] = 0;
+
+  /* the reduced row replaces the pending one in place */
+  n = w->levelWidth[level+1];
+  for (x = 0; x < n; ++x)
+    p[x] = (p[2*x] + p[2*x+1] + row[2*x] + row[2*x+1] + 2) >> 2;
+  if (fwrite(p, n, 1, w->levelFile[level+1]) != 1)
+    {
+      sprintf(error, "Could not save reduced level %d of %s\n",
+	      level+1, w->filename);
+      return(0);
+    }
+  ++w->levelRows[level+1];
+  return(ReduceImageRow(w, level+1, p, error));
+}
+
+int
+CloseImageWriter (ImageWriter *w, char *error)
+{
+  int result = 1;
+  int l, y;
+  unsigned char *row;
+
+  if (w->row != w->height)
+    {
+      sprintf(error, "Only %d of %d rows were written to image file %s\n",
+	      w->row, w->height, w->filename);
+      result = 0;
+    }
+
+  /* the reduced levels follow the image as its SubIFDs */
+  for (l = 1; l <= w->nLevels && result; ++l)
+    {
+      if (!TIFFWriteDirectory(w->tif))
+	{
+	  sprintf(error, "Could not write directory of %s\n", w->filename);
+	  result = 0;
+	  break;
+	}
+      if (!SetUpTiffImage(w, l, error))
+	{
+	  result = 0;
+	  break;
+	}
+      row = w->pending[0];
+      rewind(w->levelFile[l]);
+      for (y = 0; y < w->height && result; ++y)
+	if (fread(row, w->width, 1, w->levelFile[l]) != 1)
+	  {
+	    sprintf(error, "Could not read back reduced level %d of %s\n",
+		    l, w->filename);
+	    result = 0;
+	  }
+	else if (!PutImageRows(w, row, 1, error))
+	  result = 0;
+    }
+
+  if (w->tif != NULL)
+    TIFFClose(w->tif);
+  else if (fclose(w->f) != 0 && result)
+    {
+      sprintf(error, "Could not close file %s\n", w->filename);
+      result = 0;
+    }
+  w->tif = NULL;
+  w->f = NULL;
+  if (w->destination[0] != '\0')
+    {
+      if (result)
+	result = SendOutputFile(w->filename, w->destination, error);
+      w->destination[0] = '\0';
+    }
+  FreeImageWriter(w);
+  return(result);
+}
+
+static void
+FreeImageWriter (ImageWriter *w)
+{
+  int l;
+
+  if (w->tif != NULL)
+    TIFFClose(w->tif);
+  for (l = 0; l < w->nLevels; ++l)
+    {
+      if (w->levelFile[l+1] != NULL)
+	fclose(w->levelFile[l+1]);
+      if (w->pending[l] != NULL)
+	free(w->pending[l]);
+    }
+  if (w->band != NULL)
+    free(w->band);
+  if (w->tile != NULL)
+    free(w->tile);
+  if (w->destination[0] != '\0')
+    unlink(w->filename);
+  free(w);
+}
+
+int
+WriteImage (char *filename, unsigned char *pixels,
+	    int width, int height,
+	    enum ImageCompression compressionMethod,
+	    char *error)
+{
+  int len;
+  int quality;
+  
+  len = strlen(filename);
+  if (len < 5)
+    {
+      sprintf(error, "Image filename is too short: %s\n", filename);
+      return(0);
+    }
+  if (strcasecmp(&filename[len-4], ".tif") == 0 ||
+      len > 5 && strcasecmp(&filename[len-5], ".tiff") == 0 ||
+      strcasecmp(&filename[len-4], ".pgm") == 0)
+    {
+      ImageWriter *w;
+
+      if ((w = OpenImageWriter(filename, width, height,
+			       compressionMethod, error)) == NULL)
+	return(0);
+      if (!WriteImageRows(w, pixels, height, error))
+	{
+	  CloseImageWriter(w, error + strlen(error));
+	  return(0);
+	}
+      return(CloseImageWriter(w, error));
+    }
+  else if (strcasecmp(&filename[len-4], ".jpg") == 0)
+    {
+      switch (compressionMethod)
+	{
+	case JpegQuality95:
+	  quality = 95;
+	  break;
+	case JpegQuality90:
+	  quality = 90;
+	  break;
+	case JpegQuality85:
+	  quality = 85;
+	  break;
+	case JpegQuality80:
+	  quality = 80;
+	  break;
+	case JpegQuality75:
+	  quality = 75;
+	  break;
+	case JpegQuality70:
+	  quality = 70;
+	  break;
+	default:
+	  sprintf(error, "Unsupported compression method for jpg output: %d\n",
+		  (int) compressionMethod);
+	  return(0);
+	}
+      return(WriteJpgImage(filename, pixels, width, height,
+			   quality, error));
+    }
+  else
+    {
+      sprintf(error, "Unrecognized file extension for image file %s\n", filename);
+      return(0);
+    }
+  return(1);
+}
+
+int
+WriteJpgImage (char *filename, unsigned char *buffer,
+	       int width, int height,
+	       int quality,
+	       char *error)
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  JSAMPROW row_pointer[1];        /* pointer to a single row */
+  FILE *f;
+  uint32 iw, ih;
+  unsigned char **b;
+  uint32 i;
+  char staged[PATH_MAX];
+  
+  if (outputCommand != NULL &&
+      !StageOutputFile(filename, staged, error))
+    return(0);
+  if ((f = fopen(outputCommand != NULL ? staged : filename, "wb")) == NULL)
+    {
+      sprintf(error, "Could not open file %s for writing\n",
+		  filename);
+      if (outputCommand != NULL)
+	unlink(staged);
+      return(0);
+    }
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, f);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 1;
+  cinfo.in_color_space = JCS_GRAYSCALE;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height)
+    {
+      row_pointer[0] = &buffer[cinfo.next_scanline * width];
+      (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+  jpeg_finish_compress(&cinfo);
+  fclose(f);
+  jpeg_destroy_compress(&cinfo);
+  if (outputCommand != NULL)
+    return(SendOutputFile(staged, filename, error));
+  return(1);
+}
+
+int
+WriteCompressedArray (char *filename, char *header,
+		      unsigned char *data, size_t n,
+		      char *error)
+{
+  char tmpName[PATH_MAX+32];
+  gzFile gzf;
+  size_t pos, len;
+  int ok;
+
+  sprintf(tmpName, "%s.%d", filename, (int) getpid());
+  gzf = gzopen(tmpName, "wb");
+  if (gzf == NULL)
+    {
+      sprintf(error, "Could not open file %s for writing\n", tmpName);
+      return(0);
+    }
+  ok = gzputs(gzf, header) == strlen(header);
+  /* gzwrite takes an unsigned int length, so write in pieces */
+  for (pos = 0; ok && pos < n; pos += len)
+    {
+      len = n - pos;
+      if (len > (1 << 30))
+	len = 1 << 30;
+      ok = gzwrite(gzf, data + pos, (unsigned int) len) == (int) len;
+    }
+  if (gzclose(gzf) != Z_OK || !ok || rename(tmpName, filename) != 0)
+    {
+      sprintf(error, "Could not write to file %s\n", filename);
+      unlink(tmpName);
+      return(0);
+    }
+  return(1);
+}
+
+int
+ReadCompressedArray (char *filename, char *header,
+		     unsigned char *data, size_t n,
+		     char *error)
+{
+  char line[1024];
+  gzFile gzf;
+  size_t pos, len;
+
+  gzf = gzopen(filename, "rb");
+  if (gzf == NULL)
+    {
+      sprintf(error, "Could not open file %s\n", filename);
+      return(0);
+    }
+  if (gzgets(gzf, line, sizeof(line)) == NULL ||
+      strcmp(line, header) != 0)
+    {
+      sprintf(error, "File %s does not have the expected header\n",
+	      filename);
+      gzclose(gzf);
+      return(0);
+    }
+  for (pos = 0; pos < n; pos += len)
+    {
+      len = n - pos;
+      if (len > (1 << 30))
+	len = 1 << 30;
+      if (gzread(gzf, data + pos, (unsigned int) len) != (int) len)
+	{
+	  sprintf(error, "File %s apparently truncated\n", filename);
+	  gzclose(gzf);
+	  return(0);
+	}
+    }
+  gzclose(gzf);
+  return(1);
+}
+
+/* VolumeFileName makes the name of the .zarray metadata file (if cz < 0)
+   or of one chunk file of the volume dirName */
+static void
+VolumeFileName (char *fn, char *dirName, int cx, int cy, int cz)
+{
+  int len;
+  char *sep;
+
+  len = strlen(dirName);
+  sep = (len > 0 && dirName[len-1] == '/') ? "" : "/";
+  if (cz < 0)
+    sprintf(fn, "%s%s.zarray", dirName, sep);
+  else
+    sprintf(fn, "%s%s%d/%d/%d", dirName, sep, cz, cy, cx);
+}
+
+int
+CreateVolume (char *dirName, int width, int height, int depth,
+	      int chunkSize, char *error)
+{
+  char fn[PATH_MAX];
+  char tmpName[PATH_MAX+32];
+  FILE *f;
+  int ok;
+
+  if (mkdir(dirName, 0777) != 0 && errno != EEXIST)
+    {
+      sprintf(error, "Could not create volume directory %s\n", dirName);
+      return(0);
+    }
+  VolumeFileName(fn, dirName, 0, 0, -1);
+  sprintf(tmpName, "%s.%d", fn, (int) getpid());
+  f = fopen(tmpName, "w");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for writing\n", tmpName);
+      return(0);
+    }
+  fprintf(f, "{\n");
+  fprintf(f, "  \"zarr_format\": 2,\n");
+  fprintf(f, "  \"shape\": [%d, %d, %d],\n", depth, height, width);
+  fprintf(f, "  \"chunks\": [%d, %d, %d],\n", chunkSize, chunkSize, chunkSize);
+  fprintf(f, "  \"dtype\": \"|u1\",\n");
+  fprintf(f, "  \"compressor\": {\"id\": \"zlib\", \"level\": 1},\n");
+  fprintf(f, "  \"fill_value\": 0,\n");
+  fprintf(f, "  \"order\": \"C\",\n");
+  fprintf(f, "  \"filters\": null,\n");
+  fprintf(f, "  \"dimension_separator\": \"/\"\n");
+  fprintf(f, "}\n");
+  ok = !ferror(f);
+  if (fclose(f) != 0 || !ok || rename(tmpName, fn) != 0)
+    {
+      sprintf(error, "Could not write to file %s\n", fn);
+      unlink(tmpName);
+      return(0);
+    }
+  return(1);
+}
+
+int
+ReadVolumeSize (char *dirName, int *width, int *height, int *depth,
+		int *chunkSize, char *error)
+{
+  char fn[PATH_MAX];
+  char text[4096];
+  FILE *f;
+  size_t n;
+  char *c;
+  int cd, ch, cw;
+
+  VolumeFileName(fn, dirName, 0, 0, -1);
+  f = fopen(fn, "r");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open volume metadata file %s\n", fn);
+      return(0);
+    }
+  n = fread(text, 1, sizeof(text) - 1, f);
+  fclose(f);
+  text[n] = '\0';
+  if ((c = strstr(text, "\"shape\"")) == NULL ||
+      sscanf(c + 7, " : [ %d , %d , %d ]", depth, height, width) != 3 ||
+      (c = strstr(text, "\"chunks\"")) == NULL ||
+      sscanf(c + 8, " : [ %d , %d , %d ]", &cd, &ch, &cw) != 3)
+    {
+      sprintf(error, "Volume metadata file %s does not give a 3-D shape and chunk size\n",
+	      fn);
+      return(0);
+    }
+  if (cd != ch || cd != cw || cd <= 0 ||
+      strstr(text, "\"|u1\"") == NULL ||
+      strstr(text, "\"zlib\"") == NULL)
+    {
+      sprintf(error, "Volume %s is not made of cubic zlib-compressed chunks of bytes\n",
+	      dirName);
+      return(0);
+    }
+  *chunkSize = cd;
+  return(1);
+}
+
+int
+WriteVolumeChunk (char *dirName, int cx, int cy, int cz, int chunkSize,
+		  unsigned char *data, char *error)
+{
+  char fn[PATH_MAX];
+  char tmpName[PATH_MAX+32];
+  char *slash;
+  FILE *f;
+  uLong n;
+  uLongf cn;
+  unsigned char *cdata;
+  int ok;
+
+  VolumeFileName(fn, dirName, cx, cy, cz);
+
+  /* make the cz and cz/cy directories */
+  strcpy(tmpName, fn);
+  slash = strrchr(tmpName, '/');
+  *slash = '\0';
+  slash = strrchr(tmpName, '/');
+  *slash = '\0';
+  if (mkdir(tmpName, 0777) != 0 && errno != EEXIST)
+    {
+      sprintf(error, "Could not create volume directory %s\n", tmpName);
+      return(0);
+    }
+  *slash = '/';
+  if (mkdir(tmpName, 0777) != 0 && errno != EEXIST)
+    {
+      sprintf(error, "Could not create volume directory %s\n", tmpName);
+      return(0);
+    }
+
+  n = ((uLong) chunkSize) * chunkSize * chunkSize;
+  cn = compressBound(n);
+  cdata = (unsigned char *) malloc(cn);
+  if (cdata == NULL)
+    {
+      sprintf(error, "Could not allocate compression buffer for volume chunk %s\n",
+	      fn);
+      return(0);
+    }
+  if (compress2(cdata, &cn, data, n, 1) != Z_OK)
+    {
+      sprintf(error, "Could not compress volume chunk %s\n", fn);
+      free(cdata);
+      return(0);
+    }
+  sprintf(tmpName, "%s.%d", fn, (int) getpid());
+  f = fopen(tmpName, "wb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for writing\n", tmpName);
+      free(cdata);
+      return(0);
+    }
+  ok = fwrite(cdata, 1, cn, f) == cn;
+  free(cdata);
+  if (fclose(f) != 0 || !ok || rename(tmpName, fn) != 0)
+    {
+      sprintf(error, "Could not write to file %s\n", fn);
+      unlink(tmpName);
+      return(0);
+    }
+  return(1);
+}
+
+int
+ReadVolumeChunk (char *dirName, int cx, int cy, int cz, int chunkSize,
+		 unsigned char *data, char *error)
+{
+  char fn[PATH_MAX];
+  FILE *f;
+  struct stat sb;
+  uLongf n;
+  unsigned char *cdata;
+  int ok;
+
+  VolumeFileName(fn, dirName, cx, cy, cz);
+  n = ((uLong) chunkSize) * chunkSize * chunkSize;
+  f = fopen(fn, "rb");
+  if (f == NULL)
+    {
+      if (errno != ENOENT)
+	{
+	  sprintf(error, "Could not open volume chunk %s\n", fn);
+	  return(0);
+	}
+      /* chunks that were never written hold the fill value */
+      memset(data, 0, n);
+      return(1);
+    }
+  if (fstat(fileno(f), &sb) != 0 ||
+      (cdata = (unsigned char *) malloc(sb.st_size)) == NULL)
+    {
+      sprintf(error, "Could not allocate buffer for volume chunk %s\n", fn);
+      fclose(f);
+      return(0);
+    }
+  ok = fread(cdata, 1, sb.st_size, f) == sb.st_size;
+  fclose(f);
+  if (!ok ||
+      uncompress(data, &n, cdata, sb.st_size) != Z_OK ||
+      n != ((uLong) chunkSize) * chunkSize * chunkSize)
+    {
+      sprintf(error, "Volume chunk %s is corrupt or truncated\n", fn);
+      free(cdata);
+      return(0);
+    }
+  free(cdata);
+  return(1);
+}
+
+int
+ReadBitmapSize (char *filename,
+		int *width, int *height,
+		char *error)
+{
+  int len;
+  char fn[PATH_MAX];
+  int i, j, k;
+  struct stat sb;
+
+  len = strlen(filename);
+  if (len == 0)
+    {
+      sprintf(error, "Bitmap filename is empty.\n");
+      return(0);
+    }
+  if (len > 4 && strcasecmp(&filename[len-4], ".pbm") == 0)
+    return(ReadPbmBitmapSize(filename, width, height, error));
+  else if (len > 7 && strcasecmp(&filename[len-7], ".pbm.gz") == 0)
+    return(ReadPbmgzBitmapSize(filename, width, height, error));
+  else
+    {
+      j = bitmapExtension;
+      for (i = 0; i < N_EXTENSIONS; ++i)
+	{
+	  k = (j + i) % N_BITMAP_EXTENSIONS;
+	  sprintf(fn, "%s%s", filename, bitmapExtensions[k]);
+	  if (stat(fn, &sb) != 0)
+	    continue;
+	  switch (k)
+	    {
+	    case 0:
+	      if (!ReadPbmBitmapSize(fn, width, height, error))
+		return(0);
+	    case 1:
+	      if (!ReadPbmgzBitmapSize(fn, width, height, error))
+		return(0);
+	      break;
+	    default:
+	      break;
+	    }
+	  bitmapExtension = k;
+	  break;
+	}
+      if (i >= N_BITMAP_EXTENSIONS)
+	{
+	  sprintf(error, "Cannot find bitmap file with basename %s\n",
+		  filename);
+	  return(0);
+	}
+    }
+  return(1);
+}
+
+int
+ReadPbmBitmapSize (const char *filename,
+		   int *width, int *height,
+		   char *error)
+{
+  FILE *f;
+  int iw, ih;
+  char tc;
+  int m;
+  
+  f = fopen(filename, "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n",
+	      filename);
+      return(0);
+    }
+  if (!ReadHeader(f, &tc, &iw, &ih, &m) || tc != '4')
+    {
+      sprintf(error, "Bitmap file not binary pbm: %s\n", filename);
+      return(0);
+    }
+  fclose(f);
+  *width = iw;
+  *height = ih;
+  return(1);
+}
+
+int
+ReadPbmgzBitmapSize (const char *filename,
+		     int *width, int *height,
+		     char *error)
+{
+  gzFile gzf;
+  int iw, ih;
+  char tc;
+  int m;
+  
+  gzf = gzopen(filename, "rb");
+  if (!ReadGZHeader(gzf, &tc, &iw, &ih, &m) || tc != '4')
+    {
+      sprintf(error, "Mask file not binary pbm: %s\n", filename);
+      return(0);
+    }
+  gzclose(gzf);
+
+  *width = iw;
+  *height = ih;
+  return(1);
+}
+
+int
+ReadBitmap (char *filename, unsigned char **bitmap,
+	    int *width, int *height,
+	    int minX, int maxX, int minY, int maxY,
+	    char *error)
+{
+  int len;
+  int iw, ih;
+  int ibpl;
+  unsigned char *buffer;
+  unsigned char *ptr;
+  int rbpl;
+  int m;
+  uint32 xmin, xmax, ymin, ymax;
+  int w, h;
+  int x, y;
+  int i, j, k;
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  len = strlen(filename);
+  if (len == 0)
+    {
+      sprintf(error, "Bitmap filename is empty.\n");
+      return(0);
+    }
+
+  if (len > 4 && strcasecmp(&filename[len-4], ".pbm") == 0)
+    {
+      if (!ReadPbmBitmap(filename, &buffer, &iw, &ih, error))
+	return(0);
+    }
+  else if (len > 7 && strcasecmp(&filename[len-7], ".pbm.gz") == 0)
+    {
+      if (!ReadPbmgzBitmap(filename, &buffer, &iw, &ih, error))
+	return(0);
+    }
+  else
+    {
+      j = bitmapExtension;
+      for (i = 0; i < N_BITMAP_EXTENSIONS; ++i)
+	{
+	  k = (j + i) % N_BITMAP_EXTENSIONS;
+	  sprintf(fn, "%s%s", filename, bitmapExtensions[k]);
+	  if (stat(fn, &sb) != 0)
+	    continue;
+	  switch (k)
+	    {
+	    case 0:
+	      if (!ReadPbmBitmap(fn, &buffer, &iw, &ih, error))
+		return(0);
+	      break;
+	    case 1:
+	      if (!ReadPbmgzBitmap(fn, &buffer, &iw, &ih, error))
+		return(0);
+	      break;
+	    }
+	  bitmapExtension = k;
+	  break;
+	}
+      if (i >= N_BITMAP_EXTENSIONS)
+	{
+	  sprintf(error, "Cannot find bitmap file with basename %s\n",
+		  filename);
+	  return(0);
+	}
+    }
+
+  if (minX <= 0 && (maxX < 0 || maxX == iw-1) &&
+      minY <= 0 && (maxY < 0 || maxY == ih-1))
+    {
+      *bitmap = buffer;
+      *width = iw;
+      *height = ih;
+      return(1);
+    }
+
+  if (minX < 0)
+    xmin = 0;
+  else
+    xmin = minX;
+  if (maxX < 0)
+    xmax = iw-1;
+  else
+    xmax = maxX;
+  if (minY < 0)
+    ymin = 0;
+  else
+    ymin = minY;
+  if (maxY < 0)
+    ymax = ih-1;
+  else
+    ymax = maxY;
+  w = xmax - xmin + 1;
+  h = ymax - ymin + 1;
+  *width = w;
+  *height = h;
+  rbpl = (w + 7) >> 3;
+
+  if ((ptr = (unsigned char *) malloc(h * rbpl)) == NULL)
+    {
+      free(buffer);
+      sprintf(error, "Could not allocate enough memory for requested bitmap subregion of %s\n", filename);
+      return(0);
+    }
+  *bitmap = ptr;
+  ibpl = (iw + 7) >> 3;
+  for (y = ymin; y < ymax; ++y)
+    {
+      if (y >= ih)
+	memset(ptr, 0, rbpl);
+      else if (xmax < iw && (xmin & 7) == 0)
+	memcpy(ptr, buffer + y * ibpl + (xmin >> 3), rbpl);
+      else
+	{
+	  memset(ptr, 0, rbpl);
+	  for (x = xmin; x <= xmax; ++x)
+	    if (x < iw && (buffer[y*ibpl+(x >> 3)] & (0x80 >> (x & 7))) != 0)
+	      ptr[(x - xmin) >> 3] |= (0x80 >> ((x - xmin) & 7));
+	}
+      ptr += rbpl;
+    }
+  free(buffer);
+  return(1);
+}
+
+int
+ReadPbmBitmap (char *filename, unsigned char **buffer,
+	       int *width, int *height,
+	       char *error)
+{
+  FILE *f;
+  int iw, ih;
+  int m;
+  char tc;
+  int ibpl;
+  char cached[PATH_MAX];
+
+  f = fopen(CachedFile(filename, cached), "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open file %s for reading\n",
+	      filename);
+      return(0);
+    }
+  if (!ReadHeader(f, &tc, &iw, &ih, &m) || tc != '4')
+    {
+      sprintf(error, "Mask file not binary pbm: %s\n", filename);
+      return(0);
+    }
+
+  ibpl = (iw + 7) >> 3;
+  if ((*buffer = (unsigned char *) malloc(ih * ibpl)) == NULL)
+    {
+      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      return(0);
+    }
+  if (fread(*buffer, 1, ih*ibpl, f) != ih * ibpl)
+    {
+      fclose(f);
+      sprintf(error, "Image file %s apparently truncated.\n", filename);
+      return(0);
+    }
+  fclose(f);
+  *width = iw;
+  *height = ih;
+  return(1);
+}
+
+int
+ReadPbmgzBitmap (char *filename, unsigned char **buffer,
+		 int *width, int *height,
+		 char *error)
+{
+  gzFile gzf;
+  int iw, ih;
+  int m;
+  char tc;
+  int ibpl;
+  char cached[PATH_MAX];
+
+  gzf = gzopen(CachedFile(filename, cached), "rb");
+  if (!ReadGZHeader(gzf, &tc, &iw, &ih, &m) || tc != '4')
+    {
+      sprintf(error, "Mask file not binary pbm: %s\n", filename);
+      return(0);
+    }
+
+  ibpl = (iw + 7) >> 3;
+  if ((*buffer = (unsigned char *) malloc(ih * ibpl)) == NULL)
+    {
+      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      return(0);
+    }
+  if (gzread(gzf, *buffer, ih*ibpl) != ih * ibpl)
+    {
+      gzclose(gzf);
+      sprintf(error, "Image file %s apparently truncated.\n", filename);
+      return(0);
+    }
+  gzclose(gzf);
+  *width = iw;
+  *height = ih;
+  return(1);
+}
+
+int
+ReadHeader (FILE *f, char *tc, uint32 *w, uint32 *h, int *m)
+{
+  int c;
+  int v;
+
+  c = fgetc(f);
+  while (c == '#')
+    {
+      while ((c = fgetc(f)) != EOF && c != '\n') ;
+    }
+  if (c != 'P')
+    return(0);
+  c = fgetc(f);
+  if (c != '4' && c != '5' && c != '6')
+    return(0);
+  *tc = c;
+  c = fgetc(f);
+
+  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
+    if (c == '#')
+      {
+	while ((c = fgetc(f)) != EOF && c != '\n') ;
+      }
+    else
+      c = fgetc(f);
+  if (c >= '0' && c <= '9')
+    {
+      v = 0;
+      while (c != EOF && c >= '0' && c <= '9')
+	{
+	  v = 10 * v + (c - '0');
+	  c = fgetc(f);
+	}
+      *w = v;
+    }
+  else
+    return(0);
+
+  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
+    if (c == '#')
+      {
+	while ((c = fgetc(f)) != EOF && c != '\n') ;
+      }
+    else
+      c = fgetc(f);
+  if (c >= '0' && c <= '9')
+    {
+      v = 0;
+      while (c != EOF && c >= '0' && c <= '9')
+	{
+	  v = 10 * v + (c - '0');
+	  c = fgetc(f);
+	}
+      *h = v;
+    }
+  else
+    return(0);
+
+  if (*tc == '4')
+    return(1);
+
+  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
+    if (c == '#')
+      while ((c = fgetc(f)) != EOF && c != '\n') ;
+    else
+      c = fgetc(f);
+  if (c >= '0' && c <= '9')
+    {
+      v = 0;
+      while (c != EOF && c >= '0' && c <= '9')
+	{
+	  v = 10 * v + (c - '0');
+	  c = fgetc(f);
+	}
+      *m = v;
+    }
+  else
+    return(0);
+
+  return(1);
+}
+
+int
+ReadGZHeader (gzFile f, char *tc, unsigned int *w, unsigned int *h, int *m)
+{
+  int c;
+  int v;
+
+  c = gzgetc(f);
+  while (c == '#')
+    {
+      while ((c = gzgetc(f)) != EOF && c != '\n') ;
+    }
+  if (c != 'P')
+    return(0);
+  c = gzgetc(f);
+  if (c != '4' && c != '5' && c != '6')
+    return(0);
+  *tc = c;
+  c = gzgetc(f);
+
+  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
+    if (c == '#')
+      {
+	while ((c = gzgetc(f)) != EOF && c != '\n') ;
+      }
+    else
+      c = gzgetc(f);
+  if (c >= '0' && c <= '9')
+    {
+      v = 0;
+      while (c != EOF && c >= '0' && c <= '9')
+	{
+	  v = 10 * v + (c - '0');
+	  c = gzgetc(f);
+	}
+      *w = v;
+    }
+  else
+    return(0);
+
+  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
+    if (c == '#')
+      {
+	while ((c = gzgetc(f)) != EOF && c != '\n') ;
+      }
+    else
+      c = gzgetc(f);
+  if (c >= '0' && c <= '9')
+    {
+      v = 0;
+      while (c != EOF && c >= '0' && c <= '9')
+	{
+	  v = 10 * v + (c - '0');
+	  c = gzgetc(f);
+	}
+      *h = v;
+    }
+  else
+    return(0);
+
+  if (*tc == '4')
+    return(1);
+
+  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
+    if (c == '#')
+      while ((c = gzgetc(f)) != EOF && c != '\n') ;
+    else
+      c = gzgetc(f);
+  if (c >= '0' && c <= '9')
+    {
+      v = 0;
+      while (c != EOF && c >= '0' && c <= '9')
+	{
+	  v = 10 * v + (c - '0');
+	  c = gzgetc(f);
+	}
+      *m = v;
+    }
+  else
+    return(0);
+
+  return(1);
+}
+
+int
+WriteBitmap (char *filename, unsigned char *bitmap,
+	     int width, int height,
+	     enum BitmapCompression compressionMethod,
+	     char *error)
+{
+  int len;
+  size_t ibpl;
+  char fullFilename[PATH_MAX];
+  char *dotPos;
+  char *slashPos;
+
+  len = strlen(filename);
+  if (len < 1)
+    {
+      sprintf(error, "Bitmap filename is too short: %s\n", filename);
+      return(0);
+    }
+
+  dotPos = strrchr(filename, '.');
+  slashPos = strrchr(filename, '/');
+  strcpy(fullFilename, filename);
+  if (dotPos == NULL ||
+      slashPos != NULL && dotPos < slashPos)
+    strcat(fullFilename, ".pbm");
+  len = strlen(fullFilename);
+
+  if (strcasecmp(&fullFilename[len-4], ".pbm") == 0)
+    {
+      FILE *f;
+      f = fopen(fullFilename, "wb");
+      if (f == NULL)
+	{
+	  sprintf(error, "Could not open file %s for writing\n",
+		  fullFilename);
+	  return(0);
+	}
+      fprintf(f, "P4\n%d %d\n", width, height);
+      ibpl = (width + 7) >> 3;
+      if (fwrite(bitmap, ibpl * height, 1, f) != 1)
+	{
+	  sprintf(error, "Could not write to file %s\n", fullFilename);
+	  return(0);
+	}
+      fclose(f);
+    }
+  else if (len > 7 && strcasecmp(&fullFilename[len-7], ".pbm.gz") == 0)
     {
-      sprintf(error, "Could not open file %s for writing\n",
-		  filename);
+      gzFile gzf;
+      gzf = gzopen(fullFilename, "wb");
+
+      gzprintf(gzf, "P4\n%d %d\n", width, height);
+      ibpl = (width + 7) >> 3;
+      if (gzwrite(gzf, bitmap, ibpl * height) != ibpl * height)
+	{
+	  sprintf(error, "Could not write to file %s\n", fullFilename);
+	  return(0);
+	}
+      gzclose(gzf);
+    }
+  else
+    {
+      sprintf(error, "Unrecognized file extension for bitmap file %s\n", fullFilename);
       return(0);
     }
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
-  jpeg_stdio_dest(&cinfo, f);
-  cinfo.image_width = width;
-  cinfo.image_height = height;
-  cinfo.input_components = 1;
-  cinfo.in_color_space = JCS_GRAYSCALE;
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_quality(&cinfo, quality, TRUE);
+  return(1);
+}
 
-  jpeg_start_compress(&cinfo, TRUE);
-  while (cinfo.next_scanline < cinfo.image_height)
+
+/* the layout of the elements of a map file */
+typedef struct MapFormat {
+  int version;			/* 1 (M1), 2 (M2, aligned) or 3 (M3, tiled) */
+  int tileSize;			/* M3: elements along each side of a tile */
+  int encoding;			/* M3: MAP_TILE_FLOAT or MAP_TILE_HALF */
+} MapFormat;
+
+#define MAP_TILE_FLOAT	0	/* exact: x and y as the difference of their
+				   bits from those of the identity map */
+#define MAP_TILE_HALF	1	/* x and y as half-precision offsets from
+				   the identity map, c in half precision */
+
+static int ReadTiledMapRegion (FILE *f, MapFormat *fmt,
+			       int width, int height, int xMin, int yMin,
+			       MapElement *map,
+			       int rMinX, int rMaxX, int rMinY, int rMaxY);
+static int ReadMapElements (FILE *f, MapFormat *fmt, long dataPos,
+			    int width, int height, int xMin, int yMin,
+			    MapElement *map,
+			    int rMinX, int rMaxX, int rMinY, int rMaxY);
+static int WriteTiledMapElements (FILE *f, MapElement *map,
+				  int width, int height, int xMin, int yMin,
+				  int encoding);
+static int WriteMapLevels (FILE *f, MapElement *map,
+			   int level, int width, int height,
+			   int xMin, int yMin, int encoding);
+static int FindMapLevel (FILE *f, int wantedLevel, int *level,
+			 int *width, int *height, int *xMin, int *yMin,
+			 long *dataPos);
+
+/* the number of coarser copies that WritePreviewMap appends to a map */
+static int mapLevels = 0;
+
+/* ReadMapHeader reads the header of a map file and leaves f positioned
+   at the first map element (or, in an M3 file, at the tile index); the
+   level line of a preview map goes on with "preview <level>", which is
+   returned in *previewLevel (-1 for other maps) */
+static int
+ReadMapHeader (FILE *f, int *level,
+	       int *width, int *height,
+	       int *xMin, int *yMin,
+	       char *imageName, char *referenceName,
+	       int *previewLevel, MapFormat *fmt)
+{
+  char imgName[PATH_MAX], refName[PATH_MAX];
+  char rest[64];
+  int version;
+  long offset;
+
+  if (fgetc(f) != 'M')
+    return(0);
+  version = fgetc(f);
+  if ((version != '1' && version != '2' && version != '3') ||
+      fgetc(f) != '\n' ||
+      fscanf(f, "%d", level) != 1 ||
+      fgets(rest, sizeof(rest), f) == NULL)
+    return(0);
+  *previewLevel = -1;
+  if (rest[0] != '\n' &&
+      sscanf(rest, " preview %d", previewLevel) != 1)
+    return(0);
+  if (fscanf(f, "%d%d%d%d%s%s",
+	     width, height,
+	     xMin, yMin,
+	     imgName, refName) != 6 ||
+      fgetc(f) != '\n')
+    return(0);
+  fmt->version = version - '0';
+  fmt->tileSize = 0;
+  fmt->encoding = MAP_TILE_FLOAT;
+  if (version == '3' &&
+      (fscanf(f, "%d%d", &fmt->tileSize, &fmt->encoding) != 2 ||
+       fgetc(f) != '\n' || fmt->tileSize <= 0 ||
+       fmt->encoding != MAP_TILE_FLOAT && fmt->encoding != MAP_TILE_HALF))
+    return(0);
+  if (version == '2')
     {
-      row_pointer[0] = &buffer[cinfo.next_scanline * width];
-      (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+      /* the elements start at the next MAP_ALIGNMENT boundary */
+      offset = (ftell(f) + MAP_ALIGNMENT - 1) / MAP_ALIGNMENT * MAP_ALIGNMENT;
+      if (fseek(f, offset, SEEK_SET) != 0)
+	return(0);
     }
-  jpeg_finish_compress(&cinfo);
-  fclose(f);
-  jpeg_destroy_compress(&cinfo);
+  if (imageName != NULL)
+    strcpy(imageName, imgName);
+  if (referenceName != NULL)
+    strcpy(referenceName, refName);
   return(1);
 }
 
+int ReadMap (char *filename,
+	     MapElement** map,
+	     int *level,
+	     int *width, int *height,
+	     int *xMin, int *yMin,
+	     char *imageName, char *referenceName,
+	     char *error)
+{
+  return(ReadMapLevel(filename, map, -1, level, width, height, xMin, yMin,
+		      imageName, referenceName, error));
+}
+
 int
-ReadBitmapSize (char *filename,
-		int *width, int *height,
-		char *error)
+ReadMapLevel (char *filename,
+	      MapElement** map,
+	      int wantedLevel,
+	      int *level,
+	      int *width, int *height,
+	      int *xMin, int *yMin,
+	      char *imageName, char *referenceName,
+	      char *error)
 {
-  int len;
-  char fn[PATH_MAX];
-  int i, j, k;
-  struct stat sb;
+  int mapWidth, mapHeight;
+  int previewLevel;
+  MapFormat fmt;
+  long dataPos;
 
-  len = strlen(filename);
-  if (len == 0)
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
     {
-      sprintf(error, "Bitmap filename is empty.\n");
+      sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
-  if (len > 4 && strcasecmp(&filename[len-4], ".pbm") == 0)
-    return(ReadPbmBitmapSize(filename, width, height, error));
-  else if (len > 7 && strcasecmp(&filename[len-7], ".pbm.gz") == 0)
-    return(ReadPbmgzBitmapSize(filename, width, height, error));
-  else
+  if (!ReadMapHeader(f, level, &mapWidth, &mapHeight, xMin, yMin,
+		     imageName, referenceName, &previewLevel, &fmt))
     {
-      j = bitmapExtension;
-      for (i = 0; i < N_EXTENSIONS; ++i)
-	{
-	  k = (j + i) % N_BITMAP_EXTENSIONS;
-	  sprintf(fn, "%s%s", filename, bitmapExtensions[k]);
-	  if (stat(fn, &sb) != 0)
-	    continue;
-	  switch (k)
-	    {
-	    case 0:
-	      if (!ReadPbmBitmapSize(fn, width, height, error))
-		return(0);
-	    case 1:
-	      if (!ReadPbmgzBitmapSize(fn, width, height, error))
-		return(0);
-	      break;
-	    default:
-	      break;
-	    }
-	  bitmapExtension = k;
-	  break;
-	}
-      if (i >= N_BITMAP_EXTENSIONS)
+      sprintf(error, "Cannot read header of map file %s\n", filename);
+      fclose(f);
+      return(0);
+    }
+  if (wantedLevel > *level)
+    {
+      dataPos = ftell(f);
+      if (!FindMapLevel(f, wantedLevel, level, &mapWidth, &mapHeight,
+			xMin, yMin, &dataPos) ||
+	  fseek(f, dataPos, SEEK_SET) != 0)
 	{
-	  sprintf(error, "Cannot find bitmap file with basename %s\n",
-		  filename);
+	  sprintf(error, "Cannot read the levels of map file %s\n", filename);
+	  fclose(f);
 	  return(0);
 	}
     }
+  *map = (MapElement *) malloc(((size_t) mapWidth) * mapHeight *
+			       sizeof(MapElement));
+  if (*map == NULL)
+    {
+      sprintf(error, "Could not allocate space for map %s\n", filename);
+      fclose(f);
+      return(0);
+    }
+  *width = mapWidth;
+  *height = mapHeight;
+  if (fmt.version == 3 ?
+      !ReadTiledMapRegion(f, &fmt, mapWidth, mapHeight, *xMin, *yMin, *map,
+			  0, mapWidth - 1, 0, mapHeight - 1) :
+      fread(*map, sizeof(MapElement), mapWidth * mapHeight, f) != mapWidth * mapHeight)
+    {
+      sprintf(error, "Could not read map from file %s\n", filename);
+      free(*map);
+      fclose(f);
+      return(0);
+    }
+  fclose(f);
   return(1);
 }
 
+static size_t
+MapLength (int width, int height)
+{
+  size_t len;
+
+  len = ((size_t) width) * height * sizeof(MapElement);
+  return(len > 0 ? len : 1);
+}
+
 int
-ReadPbmBitmapSize (const char *filename,
-		   int *width, int *height,
-		   char *error)
+MapMmap (char *filename,
+	 MapElement** map,
+	 int *level,
+	 int *width, int *height,
+	 int *xMin, int *yMin,
+	 char *imageName, char *referenceName,
+	 char *error)
 {
-  FILE *f;
-  int iw, ih;
-  char tc;
-  int m;
-  
-  f = fopen(filename, "rb");
+  int mapWidth, mapHeight;
+  int previewLevel;
+  MapFormat fmt;
+  long offset;
+  size_t len;
+  void *p;
+  struct stat sb;
+
+  FILE *f = fopen(filename, "rb");
   if (f == NULL)
     {
-      sprintf(error, "Could not open file %s for reading\n",
-	      filename);
+      sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
-  if (!ReadHeader(f, &tc, &iw, &ih, &m) || tc != '4')
+  if (!ReadMapHeader(f, level, &mapWidth, &mapHeight, xMin, yMin,
+		     imageName, referenceName, &previewLevel, &fmt))
     {
-      sprintf(error, "Bitmap file not binary pbm: %s\n", filename);
+      sprintf(error, "Cannot read header of map file %s\n", filename);
+      fclose(f);
+      return(0);
+    }
+  len = MapLength(mapWidth, mapHeight);
+  offset = ftell(f);
+
+  /* a mapping beyond the end of the file would give zeros or SIGBUS
+     rather than an error, so check that the elements are all there */
+  if (fmt.version == 2 &&
+      (fstat(fileno(f), &sb) != 0 ||
+       sb.st_size < offset +
+       (off_t) (((size_t) mapWidth) * mapHeight * sizeof(MapElement))))
+    {
+      sprintf(error, "Map file %s apparently truncated.\n", filename);
+      fclose(f);
       return(0);
     }
+  p = MAP_FAILED;
+  if (fmt.version == 2 && offset % sysconf(_SC_PAGESIZE) == 0)
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	     fileno(f), offset);
+  if (p == MAP_FAILED)
+    {
+      /* older (M1) and tiled (M3) files cannot be mapped, so read them
+	 into an anonymous mapping that MapMunmap can release the same way */
+      p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+	{
+	  sprintf(error, "Could not allocate space for map %s\n", filename);
+	  fclose(f);
+	  return(0);
+	}
+      if (fmt.version == 3 ?
+	  !ReadTiledMapRegion(f, &fmt, mapWidth, mapHeight, *xMin, *yMin,
+			      (MapElement *) p,
+			      0, mapWidth - 1, 0, mapHeight - 1) :
+	  fread(p, sizeof(MapElement), mapWidth * mapHeight, f) !=
+	  mapWidth * mapHeight)
+	{
+	  sprintf(error, "Could not read map from file %s\n", filename);
+	  munmap(p, len);
+	  fclose(f);
+	  return(0);
+	}
+    }
   fclose(f);
-  *width = iw;
-  *height = ih;
+  *map = (MapElement *) p;
+  *width = mapWidth;
+  *height = mapHeight;
   return(1);
 }
 
+void
+MapMunmap (MapElement *map, int width, int height)
+{
+  if (map != NULL)
+    munmap(map, MapLength(width, height));
+}
+
 int
-ReadPbmgzBitmapSize (const char *filename,
-		     int *width, int *height,
-		     char *error)
+ReadMapRegion (char *filename, MapElement **map,
+	       int *level,
+	       int *width, int *height,
+	       int *xMin, int *yMin,
+	       char *imageName, char *referenceName,
+	       int rMinX, int rMaxX, int rMinY, int rMaxY,
+	       char *error)
 {
-  gzFile gzf;
-  int iw, ih;
-  char tc;
-  int m;
-  
-  gzf = gzopen(filename, "rb");
-  if (!ReadGZHeader(gzf, &tc, &iw, &ih, &m) || tc != '4')
+  int mapWidth, mapHeight;
+  int previewLevel;
+  MapFormat fmt;
+  int rw, rh;
+
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
     {
-      sprintf(error, "Mask file not binary pbm: %s\n", filename);
+      sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
-  gzclose(gzf);
-
-  *width = iw;
-  *height = ih;
+  if (!ReadMapHeader(f, level, &mapWidth, &mapHeight, xMin, yMin,
+		     imageName, referenceName, &previewLevel, &fmt))
+    {
+      sprintf(error, "Cannot read header of map file %s\n", filename);
+      fclose(f);
+      return(0);
+    }
+  if (rMinX < 0)
+    rMinX = 0;
+  if (rMaxX >= mapWidth)
+    rMaxX = mapWidth - 1;
+  if (rMinY < 0)
+    rMinY = 0;
+  if (rMaxY >= mapHeight)
+    rMaxY = mapHeight - 1;
+  if (rMaxX < rMinX || rMaxY < rMinY)
+    {
+      sprintf(error, "Region is outside of map %s\n", filename);
+      fclose(f);
+      return(0);
+    }
+  rw = rMaxX - rMinX + 1;
+  rh = rMaxY - rMinY + 1;
+  *map = (MapElement *) malloc(((size_t) rw) * rh * sizeof(MapElement));
+  if (*map == NULL)
+    {
+      sprintf(error, "Could not allocate space for map %s\n", filename);
+      fclose(f);
+      return(0);
+    }
+  if (!ReadMapElements(f, &fmt, ftell(f), mapWidth, mapHeight, *xMin, *yMin,
+		       *map, rMinX, rMaxX, rMinY, rMaxY))
+    {
+      sprintf(error, "Could not read map from file %s\n", filename);
+      free(*map);
+      fclose(f);
+      return(0);
+    }
+  fclose(f);
+  *width = rw;
+  *height = rh;
+  *xMin += rMinX;
+  *yMin += rMinY;
   return(1);
 }
 
 int
-ReadBitmap (char *filename, unsigned char **bitmap,
-	    int *width, int *height,
-	    int minX, int maxX, int minY, int maxY,
-	    char *error)
+ReadMapTargetRegion (char *filename, MapElement **map,
+		     int *level,
+		     int *width, int *height,
+		     int *xMin, int *yMin,
+		     char *imageName, char *referenceName,
+		     float tMinX, float tMaxX, float tMinY, float tMaxY,
+		     char *error)
 {
-  int len;
-  int iw, ih;
-  int ibpl;
-  unsigned char *buffer;
-  unsigned char *ptr;
-  int rbpl;
-  int m;
-  uint32 xmin, xmax, ymin, ymax;
-  int w, h;
-  int x, y;
-  int i, j, k;
-  char fn[PATH_MAX];
-  struct stat sb;
+  int mapWidth, mapHeight;
+  int previewLevel;
+  MapFormat fmt;
+  long dataPos;
+  MapElement *rows;
+  int band;
+  int y0, y1;
+  int x, y, dx, dy;
+  int cMinX, cMaxX, cMinY, cMaxY;
+  float spacing;
+  float rx, ry;
+  float minX, maxX, minY, maxY;
+  MapElement *e;
+  int rw, rh;
 
-  len = strlen(filename);
-  if (len == 0)
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
     {
-      sprintf(error, "Bitmap filename is empty.\n");
+      sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
-
-  if (len > 4 && strcasecmp(&filename[len-4], ".pbm") == 0)
+  if (!ReadMapHeader(f, level, &mapWidth, &mapHeight, xMin, yMin,
+		     imageName, referenceName, &previewLevel, &fmt))
     {
-      if (!ReadPbmBitmap(filename, &buffer, &iw, &ih, error))
-	return(0);
+      sprintf(error, "Cannot read header of map file %s\n", filename);
+      fclose(f);
+      return(0);
     }
-  else if (len > 7 && strcasecmp(&filename[len-7], ".pbm.gz") == 0)
+  dataPos = ftell(f);
+  spacing = (float) (1 << *level);
+
+  /* find the cells (with all 4 corners valid) that land in the target
+     box, a band of rows at a time; successive bands share a row */
+  band = 64;
+  if (band > mapHeight)
+    band = mapHeight;
+  rows = (MapElement *) malloc(((size_t) mapWidth) * band * sizeof(MapElement));
+  if (rows == NULL)
     {
-      if (!ReadPbmgzBitmap(filename, &buffer, &iw, &ih, error))
-	return(0);
+      sprintf(error, "Could not allocate space for map %s\n", filename);
+      fclose(f);
+      return(0);
     }
-  else
+  cMinX = mapWidth;
+  cMaxX = -1;
+  cMinY = mapHeight;
+  cMaxY = -1;
+  for (y0 = 0; y0 < mapHeight - 1; y0 = y1)
     {
-      j = bitmapExtension;
-      for (i = 0; i < N_BITMAP_EXTENSIONS; ++i)
-	{
-	  k = (j + i) % N_BITMAP_EXTENSIONS;
-	  sprintf(fn, "%s%s", filename, bitmapExtensions[k]);
-	  if (stat(fn, &sb) != 0)
-	    continue;
-	  switch (k)
-	    {
-	    case 0:
-	      if (!ReadPbmBitmap(fn, &buffer, &iw, &ih, error))
-		return(0);
-	      break;
-	    case 1:
-	      if (!ReadPbmgzBitmap(fn, &buffer, &iw, &ih, error))
-		return(0);
-	      break;
-	    }
-	  bitmapExtension = k;
-	  break;
-	}
-      if (i >= N_BITMAP_EXTENSIONS)
+      y1 = y0 + band - 1;
+      if (y1 > mapHeight - 1)
+	y1 = mapHeight - 1;
+      if (!ReadMapElements(f, &fmt, dataPos, mapWidth, mapHeight, *xMin, *yMin,
+			   rows, 0, mapWidth - 1, y0, y1))
 	{
-	  sprintf(error, "Cannot find bitmap file with basename %s\n",
-		  filename);
+	  sprintf(error, "Could not read map from file %s\n", filename);
+	  free(rows);
+	  fclose(f);
 	  return(0);
 	}
+      for (y = y0; y < y1; ++y)
+	for (x = 0; x < mapWidth - 1; ++x)
+	  {
+	    minX = maxX = minY = maxY = 0.0;
+	    for (dy = 0; dy < 2; ++dy)
+	      for (dx = 0; dx < 2; ++dx)
+		{
+		  e = &rows[(size_t) (y + dy - y0) * mapWidth + x + dx];
+		  if (e->c == 0.0)
+		    goto nextCell;
+		  rx = e->x * spacing;
+		  ry = e->y * spacing;
+		  if ((dx == 0 && dy == 0) || rx < minX)
+		    minX = rx;
+		  if ((dx == 0 && dy == 0) || rx > maxX)
+		    maxX = rx;
+		  if ((dx == 0 && dy == 0) || ry < minY)
+		    minY = ry;
+		  if ((dx == 0 && dy == 0) || ry > maxY)
+		    maxY = ry;
+		}
+	    if (maxX < tMinX || minX > tMaxX || maxY < tMinY || minY > tMaxY)
+	      continue;
+	    if (x < cMinX)
+	      cMinX = x;
+	    if (x > cMaxX)
+	      cMaxX = x;
+	    if (y < cMinY)
+	      cMinY = y;
+	    if (y > cMaxY)
+	      cMaxY = y;
+	  nextCell: ;
+	  }
     }
+  free(rows);
 
-  if (minX <= 0 && (maxX < 0 || maxX == iw-1) &&
-      minY <= 0 && (maxY < 0 || maxY == ih-1))
+  if (cMaxX < 0)
     {
-      *bitmap = buffer;
-      *width = iw;
-      *height = ih;
+      /* nothing lands in the box */
+      fclose(f);
+      *map = NULL;
+      *width = 0;
+      *height = 0;
       return(1);
     }
-
-  if (minX < 0)
-    xmin = 0;
-  else
-    xmin = minX;
-  if (maxX < 0)
-    xmax = iw-1;
-  else
-    xmax = maxX;
-  if (minY < 0)
-    ymin = 0;
-  else
-    ymin = minY;
-  if (maxY < 0)
-    ymax = ih-1;
-  else
-    ymax = maxY;
-  w = xmax - xmin + 1;
-  h = ymax - ymin + 1;
-  *width = w;
-  *height = h;
-  rbpl = (w + 7) >> 3;
-
-  if ((ptr = (unsigned char *) malloc(h * rbpl)) == NULL)
+  rw = cMaxX - cMinX + 2;
+  rh = cMaxY - cMinY + 2;
+  *map = (MapElement *) malloc(((size_t) rw) * rh * sizeof(MapElement));
+  if (*map == NULL)
     {
-      free(buffer);
-      sprintf(error, "Could not allocate enough memory for requested bitmap subregion of %s\n", filename);
+      sprintf(error, "Could not allocate space for map %s\n", filename);
+      fclose(f);
       return(0);
     }
-  *bitmap = ptr;
-  ibpl = (iw + 7) >> 3;
-  for (y = ymin; y < ymax; ++y)
+  if (!ReadMapElements(f, &fmt, dataPos, mapWidth, mapHeight, *xMin, *yMin,
+		       *map, cMinX, cMaxX + 1, cMinY, cMaxY + 1))
     {
-      if (y >= ih)
-	memset(ptr, 0, rbpl);
-      else if (xmax < iw && (xmin & 7) == 0)
-	memcpy(ptr, buffer + y * ibpl + (xmin >> 3), rbpl);
-      else
-	{
-	  memset(ptr, 0, rbpl);
-	  for (x = xmin; x <= xmax; ++x)
-	    if (x < iw && (buffer[y*ibpl+(x >> 3)] & (0x80 >> (x & 7))) != 0)
-	      ptr[(x - xmin) >> 3] |= (0x80 >> ((x - xmin) & 7));
-	}
-      ptr += rbpl;
+      sprintf(error, "Could not read map from file %s\n", filename);
+      free(*map);
+      fclose(f);
+      return(0);
     }
-  free(buffer);
+  fclose(f);
+  *width = rw;
+  *height = rh;
+  *xMin += cMinX;
+  *yMin += cMinY;
   return(1);
 }
 
-int
-ReadPbmBitmap (char *filename, unsigned char **buffer,
-	       int *width, int *height,
-	       char *error)
+/* ReadMapElements reads the elements (rMinX..rMaxX, rMinY..rMaxY) of
+   the map in f, whose elements (or, for M3, tile index) start at
+   dataPos, into map, with a seek per row for M1 and M2 maps */
+static int
+ReadMapElements (FILE *f, MapFormat *fmt, long dataPos,
+		 int width, int height, int xMin, int yMin,
+		 MapElement *map,
+		 int rMinX, int rMaxX, int rMinY, int rMaxY)
 {
-  FILE *f;
-  int iw, ih;
-  int m;
-  char tc;
-  int ibpl;
+  int rw;
+  int y;
 
-  f = fopen(filename, "rb");
-  if (f == NULL)
-    {
-      sprintf(error, "Could not open file %s for reading\n",
-	      filename);
-      return(0);
-    }
-  if (!ReadHeader(f, &tc, &iw, &ih, &m) || tc != '4')
-    {
-      sprintf(error, "Mask file not binary pbm: %s\n", filename);
+  if (fmt->version == 3)
+    return(fseek(f, dataPos, SEEK_SET) == 0 &&
+	   ReadTiledMapRegion(f, fmt, width, height, xMin, yMin,
+			      map, rMinX, rMaxX, rMinY, rMaxY));
+  rw = rMaxX - rMinX + 1;
+  for (y = rMinY; y <= rMaxY; ++y)
+    if (fseek(f, dataPos + ((long) y * width + rMinX) *
+	      (long) sizeof(MapElement), SEEK_SET) != 0 ||
+	fread(&map[(size_t) (y - rMinY) * rw], sizeof(MapElement), rw, f) != rw)
       return(0);
-    }
+  return(1);
+}
 
-  ibpl = (iw + 7) >> 3;
-  if ((*buffer = (unsigned char *) malloc(ih * ibpl)) == NULL)
+int
+ReadMapPreviewLevel (char *filename, int *previewLevel, char *error)
+{
+  int level, width, height, xMin, yMin;
+  MapFormat fmt;
+
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
     {
-      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
-  if (fread(*buffer, 1, ih*ibpl, f) != ih * ibpl)
+  if (!ReadMapHeader(f, &level, &width, &height, &xMin, &yMin,
+		     NULL, NULL, previewLevel, &fmt))
     {
+      sprintf(error, "Cannot read header of map file %s\n", filename);
       fclose(f);
-      sprintf(error, "Image file %s apparently truncated.\n", filename);
       return(0);
     }
   fclose(f);
-  *width = iw;
-  *height = ih;
   return(1);
 }
 
 int
-ReadPbmgzBitmap (char *filename, unsigned char **buffer,
-		 int *width, int *height,
-		 char *error)
+ReadMapLevels (char *filename, int *nLevels, char *error)
 {
-  gzFile gzf;
-  int iw, ih;
-  int m;
-  char tc;
-  int ibpl;
+  int level, width, height, xMin, yMin;
+  int previewLevel;
+  MapFormat fmt;
+  long dataPos;
+  int l, w, h, x, y;
 
-  gzf = gzopen(filename, "rb");
-  if (!ReadGZHeader(gzf, &tc, &iw, &ih, &m) || tc != '4')
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
     {
-      sprintf(error, "Mask file not binary pbm: %s\n", filename);
+      sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
-
-  ibpl = (iw + 7) >> 3;
-  if ((*buffer = (unsigned char *) malloc(ih * ibpl)) == NULL)
+  if (!ReadMapHeader(f, &level, &width, &height, &xMin, &yMin,
+		     NULL, NULL, &previewLevel, &fmt))
     {
-      sprintf(error, "Could not allocate enough memory for image in file %s\n", filename);
+      sprintf(error, "Cannot read header of map file %s\n", filename);
+      fclose(f);
       return(0);
     }
-  if (gzread(gzf, *buffer, ih*ibpl) != ih * ibpl)
+  /* the copies are at successive levels, so the coarsest tells how
+     many there are */
+  l = level;
+  if (!FindMapLevel(f, INT_MAX, &l, &w, &h, &x, &y, &dataPos))
     {
-      gzclose(gzf);
-      sprintf(error, "Image file %s apparently truncated.\n", filename);
+      sprintf(error, "Cannot read the levels of map file %s\n", filename);
+      fclose(f);
       return(0);
     }
-  gzclose(gzf);
-  *width = iw;
-  *height = ih;
+  fclose(f);
+  *nLevels = l - level;
   return(1);
 }
 
+void
+SetMapLevels (int nLevels)
+{
+  mapLevels = nLevels > 0 ? nLevels : 0;
+}
+
 int
-ReadHeader (FILE *f, char *tc, uint32 *w, uint32 *h, int *m)
+WriteMap (char *filename, MapElement *map,
+	  int level,
+	  int width, int height,
+	  int xMin, int yMin,
+	  char *imageName, char *referenceName,
+	  enum MapCompression compressionMethod,
+	  char *error)
 {
-  int c;
-  int v;
+  return(WritePreviewMap(filename, map, level, width, height, xMin, yMin,
+			 imageName, referenceName, -1,
+			 compressionMethod, error));
+}
 
-  c = fgetc(f);
-  while (c == '#')
+int
+WritePreviewMap (char *filename, MapElement *map,
+		 int level,
+		 int width, int height,
+		 int xMin, int yMin,
+		 char *imageName, char *referenceName,
+		 int previewLevel,
+		 enum MapCompression compressionMethod,
+		 char *error)
+{
+  long pos, offset;
+
+  if (compressionMethod != UncompressedMap &&
+      compressionMethod != AlignedMap &&
+      compressionMethod != TiledMap &&
+      compressionMethod != TiledHalfMap)
     {
-      while ((c = fgetc(f)) != EOF && c != '\n') ;
+      strcpy(error, "WriteMap: unsupported compression method\n");
+      return(0);
     }
-  if (c != 'P')
-    return(0);
-  c = fgetc(f);
-  if (c != '4' && c != '5' && c != '6')
-    return(0);
-  *tc = c;
-  c = fgetc(f);
 
-  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
-    if (c == '#')
-      {
-	while ((c = fgetc(f)) != EOF && c != '\n') ;
-      }
-    else
-      c = fgetc(f);
-  if (c >= '0' && c <= '9')
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL)
     {
-      v = 0;
-      while (c != EOF && c >= '0' && c <= '9')
-	{
-	  v = 10 * v + (c - '0');
-	  c = fgetc(f);
-	}
-      *w = v;
+      sprintf(error, "Cannot open file %s for writing\n", filename);
+      return(0);
     }
+  fprintf(f, "M%c\n", compressionMethod == AlignedMap ? '2' :
+	  compressionMethod == UncompressedMap ? '1' : '3');
+  if (previewLevel >= 0)
+    fprintf(f, "%d preview %d\n", level, previewLevel);
   else
-    return(0);
-
-  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
-    if (c == '#')
-      {
-	while ((c = fgetc(f)) != EOF && c != '\n') ;
-      }
-    else
-      c = fgetc(f);
-  if (c >= '0' && c <= '9')
+    fprintf(f, "%d\n", level);
+  fprintf(f, "%d %d\n", width, height);
+  fprintf(f, "%d %d\n", xMin, yMin);
+  fprintf(f, "%s %s\n", imageName, referenceName);
+  if (compressionMethod == TiledMap || compressionMethod == TiledHalfMap)
     {
-      v = 0;
-      while (c != EOF && c >= '0' && c <= '9')
+      fprintf(f, "%d %d\n", MAP_TILE_SIZE,
+	      compressionMethod == TiledHalfMap ? MAP_TILE_HALF : MAP_TILE_FLOAT);
+      if (!WriteTiledMapElements(f, map, width, height, xMin, yMin,
+				 compressionMethod == TiledHalfMap ?
+				 MAP_TILE_HALF : MAP_TILE_FLOAT) ||
+	  !WriteMapLevels(f, map, level, width, height, xMin, yMin,
+			  compressionMethod == TiledHalfMap ?
+			  MAP_TILE_HALF : MAP_TILE_FLOAT) ||
+	  fclose(f) != 0)
 	{
-	  v = 10 * v + (c - '0');
-	  c = fgetc(f);
+	  sprintf(error, "Could not write to file %s\n", filename);
+	  return(0);
 	}
-      *h = v;
+      return(1);
     }
-  else
-    return(0);
+  if (compressionMethod == AlignedMap)
+    {
+      /* pad the header out to the next MAP_ALIGNMENT boundary */
+      pos = ftell(f);
+      offset = (pos + MAP_ALIGNMENT - 1) / MAP_ALIGNMENT * MAP_ALIGNMENT;
+      for (; pos < offset; ++pos)
+	fputc('\0', f);
+    }
+  if (fwrite(map, ((size_t) width) * height * sizeof(MapElement), 1, f) != 1 ||
+      !WriteMapLevels(f, map, level, width, height, xMin, yMin, -1) ||
+      fclose(f) != 0)
+    {
+      sprintf(error, "Could not write to file %s\n", filename);
+      return(0);
+    }
+  return(1);
+}
 
-  if (*tc == '4')
-    return(1);
+/* The coarser copies of a map follow its elements (or tiles), each
+   laid out as the elements of the map itself are; then comes a table
+   with a line "levels <n>" and a line "<level> <width> <height> <xMin>
+   <yMin> <offset>" for each copy, and the file ends with a fixed-size
+   line giving the offset of the table, so that readers can find it
+   from the end of the file. */
+#define MAP_LEVELS_TAG		"MLEVELS"
+#define MAP_LEVELS_FOOTER	29	/* bytes in "MLEVELS %020ld\n" */
 
-  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
-    if (c == '#')
-      while ((c = fgetc(f)) != EOF && c != '\n') ;
-    else
-      c = fgetc(f);
-  if (c >= '0' && c <= '9')
+/* WriteMapLevels appends the mapLevels coarser copies of map to f,
+   whose elements were written with encoding (or -1 if they were
+   stored as they are); copies too small to hold a cell are left out */
+static int
+WriteMapLevels (FILE *f, MapElement *map,
+		int level, int width, int height,
+		int xMin, int yMin, int encoding)
+{
+  int n, k;
+  int i, j;
+  int cxMin, cyMin, cw, ch;
+  int cLevel[32], cWidth[32], cHeight[32], cXMin[32], cYMin[32];
+  long cPos[32];
+  long tablePos;
+  MapElement *fine, *coarse;
+  MapElement *fe, *ce;
+  int ok;
+
+  if (mapLevels == 0)
+    return(1);
+  fine = map;
+  ok = 1;
+  for (n = 0; ok && n < mapLevels && n < 32; ++n)
     {
-      v = 0;
-      while (c != EOF && c >= '0' && c <= '9')
+      /* the coarse element (i, j) lies on the fine one
+	 (2 (i + cxMin) - xMin, 2 (j + cyMin) - yMin) */
+      cxMin = (xMin + 1) >> 1;
+      cyMin = (yMin + 1) >> 1;
+      cw = ((xMin + width - 1) >> 1) - cxMin + 1;
+      ch = ((yMin + height - 1) >> 1) - cyMin + 1;
+      if (cw < 2 || ch < 2)
+	break;
+      coarse = (MapElement *) malloc(((size_t) cw) * ch * sizeof(MapElement));
+      if (coarse == NULL)
 	{
-	  v = 10 * v + (c - '0');
-	  c = fgetc(f);
+	  ok = 0;
+	  break;
 	}
-      *m = v;
+      for (j = 0; j < ch; ++j)
+	for (i = 0; i < cw; ++i)
+	  {
+	    fe = &fine[(size_t) (2 * (j + cyMin) - yMin) * width +
+		       2 * (i + cxMin) - xMin];
+	    ce = &coarse[(size_t) j * cw + i];
+	    ce->x = 0.5 * fe->x;
+	    ce->y = 0.5 * fe->y;
+	    ce->c = fe->c;
+	  }
+      if (fine != map)
+	free(fine);
+      fine = coarse;
+      ++level;
+      width = cw;
+      height = ch;
+      xMin = cxMin;
+      yMin = cyMin;
+
+      /* WriteTiledMapElements leaves f at its tile index */
+      ok = fseek(f, 0, SEEK_END) == 0;
+      cPos[n] = ftell(f);
+      cLevel[n] = level;
+      cWidth[n] = width;
+      cHeight[n] = height;
+      cXMin[n] = xMin;
+      cYMin[n] = yMin;
+      if (ok)
+	ok = encoding >= 0 ?
+	  WriteTiledMapElements(f, fine, width, height, xMin, yMin, encoding) :
+	  fwrite(fine, ((size_t) width) * height * sizeof(MapElement),
+		 1, f) == 1;
     }
-  else
+  if (fine != map)
+    free(fine);
+  if (!ok || fseek(f, 0, SEEK_END) != 0)
     return(0);
+  tablePos = ftell(f);
+  fprintf(f, "levels %d\n", n);
+  for (k = 0; k < n; ++k)
+    fprintf(f, "%d %d %d %d %d %ld\n", cLevel[k], cWidth[k], cHeight[k],
+	    cXMin[k], cYMin[k], cPos[k]);
+  return(fprintf(f, "%s %020ld\n", MAP_LEVELS_TAG, tablePos) ==
+	 MAP_LEVELS_FOOTER);
+}
+
+/* FindMapLevel looks in the table at the end of the map file f for the
+   coarsest copy of the map no coarser than wantedLevel, updating the
+   level, size and offset and setting *dataPos to where its elements
+   start; if the file has no table, or no such copy, they are left as
+   they are (those of the map itself) */
+static int
+FindMapLevel (FILE *f, int wantedLevel, int *level,
+	      int *width, int *height, int *xMin, int *yMin,
+	      long *dataPos)
+{
+  char footer[MAP_LEVELS_FOOTER+1];
+  char tag[16];
+  long tablePos;
+  int n, k;
+  int l, w, h, x, y;
+  long pos;
 
+  if (fseek(f, -MAP_LEVELS_FOOTER, SEEK_END) != 0 ||
+      fread(footer, 1, MAP_LEVELS_FOOTER, f) != MAP_LEVELS_FOOTER)
+    return(1);
+  footer[MAP_LEVELS_FOOTER] = '\0';
+  if (sscanf(footer, "%15s %ld", tag, &tablePos) != 2 ||
+      strcmp(tag, MAP_LEVELS_TAG) != 0)
+    return(1);
+  if (fseek(f, tablePos, SEEK_SET) != 0 ||
+      fscanf(f, " levels %d", &n) != 1)
+    return(0);
+  for (k = 0; k < n; ++k)
+    {
+      if (fscanf(f, "%d %d %d %d %d %ld", &l, &w, &h, &x, &y, &pos) != 6)
+	return(0);
+      if (l > wantedLevel)
+	break;
+      *level = l;
+      *width = w;
+      *height = h;
+      *xMin = x;
+      *yMin = y;
+      *dataPos = pos;
+    }
   return(1);
 }
 
-int
-ReadGZHeader (gzFile f, char *tc, unsigned int *w, unsigned int *h, int *m)
+
+/* An M3 (tiled) map file goes on after the text header with a line
+   giving the tile size and the encoding, and then an index of the
+   file offsets of the tiles (in row-major order, plus the offset of
+   the end of the last one) as 8-byte little-endian integers, and the
+   zlib-compressed tiles.  The elements of a tile are stored as planes,
+   byte 0 of every element's x, then byte 1, and so on, so that the
+   high bytes, which vary slowly across the map, compress well; x and y
+   are stored relative to the identity map (the map element at (i, j)
+   holding (i + xMin, j + yMin)), which most maps are close to. */
+
+static uint32_t
+FloatBits (float v)
 {
-  int c;
-  int v;
+  uint32_t b;
 
-  c = gzgetc(f);
-  while (c == '#')
+  memcpy(&b, &v, sizeof(b));
+  return(b);
+}
+
+static float
+BitsFloat (uint32_t b)
+{
+  float v;
+
+  memcpy(&v, &b, sizeof(v));
+  return(v);
+}
+
+/* FloatToHalf rounds v to the nearest IEEE half-precision value,
+   saturating at the largest finite one */
+static uint16_t
+FloatToHalf (float v)
+{
+  uint32_t b;
+  uint32_t sign;
+  int e;
+  uint32_t m;
+  uint32_t h;
+
+  b = FloatBits(v);
+  sign = (b >> 16) & 0x8000;
+  e = (int) ((b >> 23) & 0xff) - 127 + 15;
+  m = b & 0x7fffff;
+  if (((b >> 23) & 0xff) == 0xff)
+    return(sign | (m != 0 ? 0x7e00 : 0x7bff));
+  if (e >= 31)
+    return(sign | 0x7bff);
+  if (e <= 0)
     {
-      while ((c = gzgetc(f)) != EOF && c != '\n') ;
+      /* subnormal (or zero) */
+      if (e < -10)
+	return(sign);
+      m |= 0x800000;
+      h = m >> (14 - e);
+      if ((m >> (13 - e)) & 1 &&
+	  ((m & ((1u << (13 - e)) - 1)) != 0 || (h & 1)))
+	++h;
+      return(sign | h);
     }
-  if (c != 'P')
-    return(0);
-  c = gzgetc(f);
-  if (c != '4' && c != '5' && c != '6')
-    return(0);
-  *tc = c;
-  c = gzgetc(f);
+  h = (e << 10) | (m >> 13);
+  if ((m & 0x1000) && ((m & 0xfff) != 0 || (h & 1)))
+    ++h;
+  if ((h & 0x7c00) == 0x7c00)
+    h = 0x7bff;
+  return(sign | h);
+}
 
-  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
-    if (c == '#')
-      {
-	while ((c = gzgetc(f)) != EOF && c != '\n') ;
-      }
-    else
-      c = gzgetc(f);
-  if (c >= '0' && c <= '9')
+static float
+HalfToFloat (uint16_t h)
+{
+  uint32_t sign;
+  int e;
+  uint32_t m;
+
+  sign = ((uint32_t) (h & 0x8000)) << 16;
+  e = (h >> 10) & 0x1f;
+  m = h & 0x3ff;
+  if (e == 0)
     {
-      v = 0;
-      while (c != EOF && c >= '0' && c <= '9')
+      if (m == 0)
+	return(BitsFloat(sign));
+      /* subnormal: normalize it */
+      e = 1;
+      while ((m & 0x400) == 0)
 	{
-	  v = 10 * v + (c - '0');
-	  c = gzgetc(f);
+	  m <<= 1;
+	  --e;
 	}
-      *w = v;
+      m &= 0x3ff;
     }
-  else
-    return(0);
+  else if (e == 31)
+    return(BitsFloat(sign | 0x7f800000 | (m << 13)));
+  return(BitsFloat(sign | ((uint32_t) (e - 15 + 127) << 23) | (m << 13)));
+}
 
-  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
-    if (c == '#')
-      {
-	while ((c = gzgetc(f)) != EOF && c != '\n') ;
-      }
-    else
-      c = gzgetc(f);
-  if (c >= '0' && c <= '9')
+static int
+MapTileBytes (int encoding)
+{
+  return(encoding == MAP_TILE_HALF ? 6 : 12);
+}
+
+static int
+WriteTiledMapElements (FILE *f, MapElement *map,
+		       int width, int height, int xMin, int yMin,
+		       int encoding)
+{
+  int ts;
+  int nTx, nTy, nTiles;
+  int tx, ty, k;
+  int i, j, n, e;
+  int gx, gy;
+  int bpe, field, bytes;
+  uint32_t v;
+  unsigned char *raw, *packed;
+  unsigned char b8[8];
+  uLongf packedLen;
+  long indexPos;
+  uint64_t *index;
+  MapElement *me;
+  int ok;
+
+  ts = MAP_TILE_SIZE;
+  nTx = (width + ts - 1) / ts;
+  nTy = (height + ts - 1) / ts;
+  nTiles = nTx * nTy;
+  bpe = MapTileBytes(encoding);
+  bytes = bpe / 3;
+  raw = (unsigned char *) malloc(ts * ts * bpe);
+  packed = (unsigned char *) malloc(compressBound(ts * ts * bpe));
+  index = (uint64_t *) malloc((nTiles + 1) * sizeof(uint64_t));
+  if (raw == NULL || packed == NULL || index == NULL)
     {
-      v = 0;
-      while (c != EOF && c >= '0' && c <= '9')
-	{
-	  v = 10 * v + (c - '0');
-	  c = gzgetc(f);
-	}
-      *h = v;
+      free(raw);
+      free(packed);
+      free(index);
+      return(0);
     }
-  else
-    return(0);
 
-  if (*tc == '4')
-    return(1);
+  /* leave room for the index */
+  indexPos = ftell(f);
+  memset(b8, 0, 8);
+  ok = 1;
+  for (k = 0; ok && k <= nTiles; ++k)
+    ok = fwrite(b8, 8, 1, f) == 1;
 
-  while (c == ' ' || c == '\t' || c == '\n' || c == '#')
-    if (c == '#')
-      while ((c = gzgetc(f)) != EOF && c != '\n') ;
-    else
-      c = gzgetc(f);
-  if (c >= '0' && c <= '9')
+  for (ty = 0; ok && ty < nTy; ++ty)
+    for (tx = 0; ok && tx < nTx; ++tx)
+      {
+	n = 0;
+	for (j = 0; j < ts && ty * ts + j < height; ++j)
+	  for (i = 0; i < ts && tx * ts + i < width; ++i)
+	    ++n;
+	e = 0;
+	for (j = 0; j < ts && ty * ts + j < height; ++j)
+	  for (i = 0; i < ts && tx * ts + i < width; ++i)
+	    {
+	      gx = tx * ts + i;
+	      gy = ty * ts + j;
+	      me = &map[(size_t) gy * width + gx];
+	      for (field = 0; field < 3; ++field)
+		{
+		  if (encoding == MAP_TILE_HALF)
+		    v = FloatToHalf(field == 0 ? me->x - (float) (gx + xMin) :
+				    field == 1 ? me->y - (float) (gy + yMin) :
+				    me->c);
+		  else
+		    v = field == 0 ? FloatBits(me->x) - FloatBits((float) (gx + xMin)) :
+		      field == 1 ? FloatBits(me->y) - FloatBits((float) (gy + yMin)) :
+		      FloatBits(me->c);
+		  for (k = 0; k < bytes; ++k)
+		    raw[(field * bytes + k) * n + e] = (v >> (8 * k)) & 0xff;
+		}
+	      ++e;
+	    }
+	index[ty * nTx + tx] = ftell(f);
+	packedLen = compressBound(n * bpe);
+	ok = compress2(packed, &packedLen, raw, n * bpe,
+		       Z_DEFAULT_COMPRESSION) == Z_OK &&
+	  fwrite(packed, 1, packedLen, f) == packedLen;
+      }
+  index[nTiles] = ftell(f);
+
+  if (ok)
+    ok = fseek(f, indexPos, SEEK_SET) == 0;
+  for (k = 0; ok && k <= nTiles; ++k)
     {
-      v = 0;
-      while (c != EOF && c >= '0' && c <= '9')
-	{
-	  v = 10 * v + (c - '0');
-	  c = gzgetc(f);
-	}
-      *m = v;
+      for (i = 0; i < 8; ++i)
+	b8[i] = (index[k] >> (8 * i)) & 0xff;
+      ok = fwrite(b8, 8, 1, f) == 1;
     }
-  else
-    return(0);
-
-  return(1);
+  free(raw);
+  free(packed);
+  free(index);
+  return(ok);
 }
 
-int
-WriteBitmap (char *filename, unsigned char *bitmap,
-	     int width, int height,
-	     enum BitmapCompression compressionMethod,
-	     char *error)
+/* ReadTiledMapRegion decodes the elements (rMinX..rMaxX, rMinY..rMaxY)
+   of the M3 map in f, which must be positioned at the tile index, into
+   map, reading only the tiles that they fall in */
+static int
+ReadTiledMapRegion (FILE *f, MapFormat *fmt,
+		    int width, int height, int xMin, int yMin,
+		    MapElement *map,
+		    int rMinX, int rMaxX, int rMinY, int rMaxY)
 {
-  int len;
-  size_t ibpl;
-  char fullFilename[PATH_MAX];
-  char *dotPos;
-  char *slashPos;
+  int ts;
+  int nTx, nTy;
+  int tx, ty, k;
+  int i, j, n, e;
+  int gx, gy;
+  int bpe, field, bytes;
+  int rw;
+  uint32_t v[3];
+  unsigned char *raw, *packed;
+  unsigned char b8[8];
+  uLongf rawLen;
+  size_t packedLen, maxPacked;
+  long indexPos;
+  uint64_t index0, index1;
+  MapElement *me;
+  int ok;
 
-  len = strlen(filename);
-  if (len < 1)
+  ts = fmt->tileSize;
+  nTx = (width + ts - 1) / ts;
+  nTy = (height + ts - 1) / ts;
+  bpe = MapTileBytes(fmt->encoding);
+  bytes = bpe / 3;
+  rw = rMaxX - rMinX + 1;
+  indexPos = ftell(f);
+  raw = (unsigned char *) malloc(((size_t) ts) * ts * bpe);
+  maxPacked = compressBound(ts * ts * bpe);
+  packed = (unsigned char *) malloc(maxPacked);
+  if (raw == NULL || packed == NULL)
     {
-      sprintf(error, "Bitmap filename is too short: %s\n", filename);
+      free(raw);
+      free(packed);
       return(0);
     }
 
-  dotPos = strrchr(filename, '.');
-  slashPos = strrchr(filename, '/');
-  strcpy(fullFilename, filename);
-  if (dotPos == NULL ||
-      slashPos != NULL && dotPos < slashPos)
-    strcat(fullFilename, ".pbm");
-  len = strlen(fullFilename);
+  ok = 1;
+  for (ty = rMinY / ts; ok && ty <= rMaxY / ts && ty < nTy; ++ty)
+    for (tx = rMinX / ts; ok && tx <= rMaxX / ts && tx < nTx; ++tx)
+      {
+	/* look up the tile's extent in the index */
+	k = ty * nTx + tx;
+	ok = fseek(f, indexPos + 8L * k, SEEK_SET) == 0 &&
+	  fread(b8, 8, 1, f) == 1;
+	for (i = 0, index0 = 0; i < 8; ++i)
+	  index0 |= ((uint64_t) b8[i]) << (8 * i);
+	ok = ok && fread(b8, 8, 1, f) == 1;
+	for (i = 0, index1 = 0; i < 8; ++i)
+	  index1 |= ((uint64_t) b8[i]) << (8 * i);
+	if (!ok || index1 < index0 || index1 - index0 > maxPacked)
+	  {
+	    ok = 0;
+	    break;
+	  }
+	packedLen = index1 - index0;
 
-  if (strcasecmp(&fullFilename[len-4], ".pbm") == 0)
+	n = 0;
+	for (j = 0; j < ts && ty * ts + j < height; ++j)
+	  for (i = 0; i < ts && tx * ts + i < width; ++i)
+	    ++n;
+	rawLen = n * bpe;
+	ok = fseek(f, (long) index0, SEEK_SET) == 0 &&
+	  fread(packed, 1, packedLen, f) == packedLen &&
+	  uncompress(raw, &rawLen, packed, packedLen) == Z_OK &&
+	  rawLen == (uLongf) (n * bpe);
+	if (!ok)
+	  break;
+
+	e = 0;
+	for (j = 0; j < ts && ty * ts + j < height; ++j)
+	  for (i = 0; i < ts && tx * ts + i < width; ++i, ++e)
+	    {
+	      gx = tx * ts + i;
+	      gy = ty * ts + j;
+	      if (gx < rMinX || gx > rMaxX || gy < rMinY || gy > rMaxY)
+		continue;
+	      for (field = 0; field < 3; ++field)
+		{
+		  v[field] = 0;
+		  for (k = 0; k < bytes; ++k)
+		    v[field] |= ((uint32_t) raw[(field * bytes + k) * n + e]) << (8 * k);
+		}
+	      me = &map[(size_t) (gy - rMinY) * rw + (gx - rMinX)];
+	      if (fmt->encoding == MAP_TILE_HALF)
+		{
+		  me->x = (float) (gx + xMin) + HalfToFloat(v[0]);
+		  me->y = (float) (gy + yMin) + HalfToFloat(v[1]);
+		  me->c = HalfToFloat(v[2]);
+		}
+	      else
+		{
+		  me->x = BitsFloat(v[0] + FloatBits((float) (gx + xMin)));
+		  me->y = BitsFloat(v[1] + FloatBits((float) (gy + yMin)));
+		  me->c = BitsFloat(v[2]);
+		}
+	    }
+      }
+  free(raw);
+  free(packed);
+  return(ok);
+}
+
+/* HashFile sets *hash to a 64-bit FNV-1a hash of the contents of the
+   file, taken a word at a time; it returns 0 if the file could not
+   be read */
+static int
+HashFile (char *filename, uint64_t *hash)
+{
+  FILE *f;
+  unsigned char *buffer;
+  size_t n, i;
+  uint64_t h, w;
+
+  f = fopen(filename, "rb");
+  if (f == NULL)
+    return(0);
+  buffer = (unsigned char *) malloc(1 << 20);
+  if (buffer == NULL)
     {
-      FILE *f;
-      f = fopen(fullFilename, "wb");
-      if (f == NULL)
-	{
-	  sprintf(error, "Could not open file %s for writing\n",
-		  fullFilename);
-	  return(0);
-	}
-      fprintf(f, "P4\n%d %d\n", width, height);
-      ibpl = (width + 7) >> 3;
-      if (fwrite(bitmap, ibpl * height, 1, f) != 1)
-	{
-	  sprintf(error, "Could not write to file %s\n", fullFilename);
-	  return(0);
-	}
       fclose(f);
+      return(0);
     }
-  else if (len > 7 && strcasecmp(&fullFilename[len-7], ".pbm.gz") == 0)
+  h = 0xcbf29ce484222325ULL;
+  while ((n = fread(buffer, 1, 1 << 20, f)) > 0)
     {
-      gzFile gzf;
-      gzf = gzopen(fullFilename, "wb");
-
-      gzprintf(gzf, "P4\n%d %d\n", width, height);
-      ibpl = (width + 7) >> 3;
-      if (gzwrite(gzf, bitmap, ibpl * height) != ibpl * height)
+      for (i = 0; i + 8 <= n; i += 8)
 	{
-	  sprintf(error, "Could not write to file %s\n", fullFilename);
-	  return(0);
+	  memcpy(&w, &buffer[i], 8);
+	  h ^= w;
+	  h *= 0x100000001b3ULL;
+	}
+      for (; i < n; ++i)
+	{
+	  h ^= buffer[i];
+	  h *= 0x100000001b3ULL;
 	}
-      gzclose(gzf);
     }
-  else
+  free(buffer);
+  if (ferror(f))
     {
-      sprintf(error, "Unrecognized file extension for bitmap file %s\n", fullFilename);
+      fclose(f);
       return(0);
     }
+  fclose(f);
+  *hash = h;
   return(1);
 }
 
+/* StatInput finds the file that the readers would open for name,
+   trying the image and bitmap extensions if name itself does not
+   exist, and sets fn to it; it returns 0 if there is none */
+static int
+StatInput (char *name, char *fn, struct stat *sb)
+{
+  int i;
 
-int ReadMap (char *filename,
-	     MapElement** map,
-	     int *level,
-	     int *width, int *height,
-	     int *xMin, int *yMin,
-	     char *imageName, char *referenceName,
-	     char *error)
+  strcpy(fn, name);
+  if (stat(fn, sb) == 0)
+    return(1);
+  for (i = 0; i < N_EXTENSIONS; ++i)
+    {
+      sprintf(fn, "%s%s", name, extensions[i]);
+      if (stat(fn, sb) == 0)
+	return(1);
+    }
+  for (i = 0; i < N_BITMAP_EXTENSIONS; ++i)
+    {
+      sprintf(fn, "%s%s", name, bitmapExtensions[i]);
+      if (stat(fn, sb) == 0)
+	return(1);
+    }
+  strcpy(fn, name);
+  return(0);
+}
+
+static uint64_t
+HashString (char *s)
 {
-  char imgName[PATH_MAX], refName[PATH_MAX];
-  int mapWidth, mapHeight;
+  uint64_t h;
 
-  FILE *f = fopen(filename, "rb");
-  if (f == NULL)
+  h = 0xcbf29ce484222325ULL;
+  for (; *s != '\0'; ++s)
     {
-      sprintf(error, "Cannot open file %s\n", filename);
-      return(0);
+      h ^= (unsigned char) *s;
+      h *= 0x100000001b3ULL;
     }
-  if (fgetc(f) != 'M' || fgetc(f) != '1' || fgetc(f) != '\n' ||
-      fscanf(f, "%d%d%d%d%d%s%s",
-	     level,
-	     &mapWidth, &mapHeight,
-	     xMin, yMin,
-	     imgName, refName) != 7 ||
-      fgetc(f) != '\n')
+  return(h);
+}
+
+int
+WriteDeps (char *depsName, char *params, int nInputs, char **inputs)
+{
+  FILE *f;
+  int i;
+  uint64_t h;
+  struct stat sb;
+  char tmpName[PATH_MAX];
+  char fn[PATH_MAX];
+
+  snprintf(tmpName, PATH_MAX, "%s.tmp", depsName);
+  f = fopen(tmpName, "w");
+  if (f == NULL)
+    return(0);
+  fprintf(f, "aligntk-deps 1\nparams %016llx\n",
+	  (unsigned long long) HashString(params));
+  for (i = 0; i < nInputs; ++i)
     {
-      sprintf(error, "Cannot read header of map file %s\n", filename);
-      return(0);
+      if (inputs[i] == NULL || inputs[i][0] == '\0')
+	continue;
+      if (StatInput(inputs[i], fn, &sb) && HashFile(fn, &h))
+	fprintf(f, "input %016llx %lld %lld %s\n",
+		(unsigned long long) h,
+		(long long) sb.st_size, (long long) sb.st_mtime,
+		fn);
+      else
+	fprintf(f, "input missing 0 0 %s\n", inputs[i]);
     }
-  if (imageName != NULL)
-    strcpy(imageName, imgName);
-  if (referenceName != NULL)
-    strcpy(referenceName, refName);
-  *map = (MapElement *) malloc(mapWidth * mapHeight * sizeof(MapElement));
-  if (*map == NULL)
+  if (fclose(f) != 0)
     {
-      sprintf(error, "Could not allocate space for map %s\n", filename);
+      unlink(tmpName);
       return(0);
     }
-  *width = mapWidth;
-  *height = mapHeight;
-  if (fread(*map, sizeof(MapElement), mapWidth * mapHeight, f) != mapWidth * mapHeight)
+  if (rename(tmpName, depsName) != 0)
     {
-      sprintf(error, "Could not read map from file %s\n", filename);
+      unlink(tmpName);
       return(0);
     }
-  fclose(f);
   return(1);
 }
 
 int
-WriteMap (char *filename, MapElement *map,
-	  int level,
-	  int width, int height,
-	  int xMin, int yMin,
-	  char *imageName, char *referenceName,
-	  enum MapCompression compressionMethod,
-	  char *error)
+DepsCurrent (char *depsName, char *params, int nInputs, char **inputs)
 {
-  if (compressionMethod != UncompressedMap)
-    {
-      strcpy(error, "WriteMap: unsupported compression method\n");
-      return(0);
-    }
+  FILE *f;
+  char line[PATH_MAX+128];
+  char hashText[32];
+  unsigned long long recorded, paramsHash;
+  long long size, mtime;
+  int version;
+  int i;
+  int current;
+  int rehashed;
+  uint64_t h;
+  struct stat sb;
+  char fn[PATH_MAX];
 
-  FILE *f = fopen(filename, "wb");
+  f = fopen(depsName, "r");
   if (f == NULL)
+    return(-1);
+  if (fgets(line, sizeof(line), f) == NULL ||
+      sscanf(line, "aligntk-deps %d", &version) != 1 ||
+      version != 1 ||
+      fgets(line, sizeof(line), f) == NULL ||
+      sscanf(line, "params %llx", &paramsHash) != 1)
     {
-      sprintf(error, "Cannot open file %s for writing\n", filename);
-      return(0);
+      fclose(f);
+      return(-1);
     }
-  fprintf(f, "M1\n");
-  fprintf(f, "%d\n", level);
-  fprintf(f, "%d %d\n", width, height);
-  fprintf(f, "%d %d\n", xMin, yMin);
-  fprintf(f, "%s %s\n", imageName, referenceName);
-  if (fwrite(map, ((size_t) width) * height * sizeof(MapElement), 1, f) != 1)
+  current = paramsHash == HashString(params);
+  rehashed = 0;
+
+  /* the inputs are matched by position, not by name, so that moving
+     the data to another directory does not make the outputs stale */
+  for (i = 0; current && i < nInputs; ++i)
     {
-      sprintf(error, "Could not write to file %s\n", filename);
-      return(0);
+      if (inputs[i] == NULL || inputs[i][0] == '\0')
+	continue;
+      if (fgets(line, sizeof(line), f) == NULL ||
+	  sscanf(line, "input %31s %lld %lld", hashText, &size, &mtime) != 3 ||
+	  strcmp(hashText, "missing") == 0 ||
+	  sscanf(hashText, "%llx", &recorded) != 1 ||
+	  !StatInput(inputs[i], fn, &sb) ||
+	  (long long) sb.st_size != size)
+	{
+	  current = 0;
+	  break;
+	}
+      if ((long long) sb.st_mtime == mtime)
+	continue;
+      /* the file was touched or copied; look at its contents */
+      if (!HashFile(fn, &h) || h != recorded)
+	current = 0;
+      else
+	rehashed = 1;
     }
+  if (current && fgets(line, sizeof(line), f) != NULL)
+    current = 0;
   fclose(f);
-  return(1);
+
+  /* record the new times so that the next check need not rehash */
+  if (current && rehashed)
+    WriteDeps(depsName, params, nInputs, inputs);
+  return(current);
 }
@@ -4,6 +4,8 @@
 #ifndef IMIO_H
 #define IMIO_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,31 +17,142 @@ extern "C" {
 			  JpegQuality85 = 4,
 			  JpegQuality80 = 5,
 			  JpegQuality75 = 6,
-			  JpegQuality70 = 7};
+			  JpegQuality70 = 7,
+			  HDiffLzwImage = 8,
+			  HDiffZstdImage = 9};
 
   enum BitmapCompression { UncompressedBitmap = 0,
 			   GZBitmap = 1};
 
-  enum MapCompression { UncompressedMap = 0 };
+  enum MapCompression { UncompressedMap = 0,
+			AlignedMap = 1,	    /* uncompressed, with the elements
+					       starting on a MAP_ALIGNMENT
+					       boundary so that MapMmap can
+					       map them directly */
+			TiledMap = 2,	    /* exact, in separately
+					       compressed tiles that
+					       ReadMapRegion can read
+					       individually */
+			TiledHalfMap = 3 }; /* tiled, with the offsets from
+					       the identity map and the
+					       confidences in half
+					       precision */
+
+#define MAP_ALIGNMENT	4096
+#define MAP_TILE_SIZE	64
 			
   typedef struct MapElement {
     float x;
     float y;
     float c;
   } MapElement;
+
+  typedef struct FloatImageStats {
+    size_t count;
+    double sum;
+    double sum2;
+  } FloatImageStats;
   
   int ReadImageSize (char *filename,
 		     int *width, int *height,
 		     char *error);
 
+  /* ScanImageSizes reads the sizes of the n images in names (named as
+     they will be given to ReadImageSize) with a pool of threads, so
+     that a master that needs the size of every image before handing
+     out work does not read thousands of headers one after another;
+     afterwards ReadImageSize on those names answers from memory.  If
+     SetImageManifest has named a manifest file, an image whose file
+     has the size and modification time recorded there is not opened
+     at all, and the manifest is rewritten with what was read.  Images
+     that cannot be read are left for ReadImageSize to report.  It
+     returns 0, with a message in error, only if the scan itself could
+     not be carried out, and must not be called while other threads
+     are reading images. */
+  void SetImageManifest (char *filename);
+  int ScanImageSizes (int n, char **names, char *error);
+
+  /* ScanImageList is ScanImageSizes for the images of the list file
+     listName (one image per line, followed by its width and height
+     if they are known) that have no size given there; each is named
+     prefix, the name in the list, then suffix */
+  int ScanImageList (char *listName, char *prefix, char *suffix,
+		     char *error);
+
+  /* LookupImageInfo returns 1, with the width, height and modification
+     time of the image, if filename was scanned by ScanImageSizes, and
+     0 otherwise */
+  int LookupImageInfo (char *filename, int *width, int *height,
+		       long long *mtime);
+
+  /* the image and bitmap readers read through a node-local cache
+     when $ALIGNTK_CACHE_DIR names a directory for it: each file from
+     another filesystem is copied there when first read and read from
+     the copy while the original's size and modification time are
+     unchanged; $ALIGNTK_CACHE_SIZE bounds the cache in megabytes
+     (default 65536), the least recently read copies going first */
   int ReadImage (char *filename, unsigned char **pixels,
 	       int *width, int *height,
 	       int minX, int maxX, int minY, int maxY,
 	       char *error);
 
+  /* ImageMmap is like ReadImage for a whole image, but the pixels of
+     an uncompressed 8-bit grayscale PGM or striped TIFF file are
+     mapped from the file rather than read and copied, so that they
+     cost no copy and are shared through the page cache; it returns 0
+     for any other kind of image, which must then be read with
+     ReadImage.  The pixels are copy-on-write and must be released with
+     ImageMunmap, never free. */
+  int ImageMmap (char *filename, unsigned char **pixels,
+		 int *width, int *height,
+		 char *error);
+  void ImageMunmap (unsigned char *pixels, int width, int height);
+
+  /* ReadImageReduced reads an image reduced by an integer factor to
+     (width/factor) x (height/factor), each pixel being the mean of a
+     factor x factor block; JPEG files are reduced by 2, 4, or 8 in the
+     decoder, and TIFF files that hold a reduced image of exactly that
+     size, as a SubIFD or a later image, are read from it, so that the
+     full-size pixels need not be decoded */
+  int ReadImageReduced (char *filename, int factor,
+			unsigned char **pixels,
+			int *width, int *height,
+			char *error);
+
+  /* ReadImageRegionReduced reads the region minX..maxX, minY..maxY
+     (in reduced pixels; a negative bound means the edge of the image)
+     of the image reduced by factor, from a stored reduced TIFF image
+     of that size if there is one */
+  int ReadImageRegionReduced (char *filename, int factor,
+			      unsigned char **pixels,
+			      int *width, int *height,
+			      int minX, int maxX, int minY, int maxY,
+			      char *error);
+
+  /* ReadImageRows is ReadImageRegionReduced for every step-th row of
+     the region from minY, which are returned one after another as a
+     width x height image; for a TIFF file, or the stored reduced image
+     of one, only the strips or tiles that hold those rows are decoded,
+     and other images are read as a whole region */
+  int ReadImageRows (char *filename, int factor, int step,
+		     unsigned char **pixels,
+		     int *width, int *height,
+		     int minX, int maxX, int minY, int maxY,
+		     char *error);
+
+  /* ReadFloatImage is ReadImage for an image wanted as floats: the
+     pixels are converted as they are decoded, with no 8-bit copy of
+     the region in between.  If *pixels is not NULL it is used, rather
+     than allocated, and must hold the whole region.  If mask is not
+     NULL it must be a bitmap of the size of the region ((width+7)/8
+     bytes per row); the pixels whose bits are clear are set to 0.  If
+     stats is not NULL it is set to the count, sum, and sum of squares
+     of the pixels within the image that the mask keeps. */
   int ReadFloatImage (char *filename, float **pixels,
 		      int *width, int *height,
 		      int minX, int maxX, int minY, int maxY,
+		      unsigned char *mask, int maskWidth, int maskHeight,
+		      FloatImageStats *stats,
 		      char *error);
 
   int WriteImage (char *filename, unsigned char *pixels,
@@ -47,12 +160,93 @@ extern "C" {
 		  enum ImageCompression compressionMode,
 		  char *error);
 
+  /* an ImageWriter writes an image a band of rows at a time, so that
+     the caller never has to hold the whole image in memory; large
+     TIFF output is written in tiles, and output larger than 4GB is
+     written as BigTIFF; only TIFF and PGM files are supported */
+  typedef struct ImageWriter ImageWriter;
+
+  /* SetImageCompressionLevel sets the level used for subsequent
+     HDiffDeflateImage (1-9) and HDiffZstdImage (1-22) TIFF output;
+     a level of 0 or less restores the libtiff default */
+  void SetImageCompressionLevel (int level);
+
+  /* SetImageOutputCommand makes WriteImage and the ImageWriters send
+     each finished TIFF, PGM or JPEG image to a shell command instead
+     of writing it in place: the image is encoded to a staging file in
+     $TMPDIR (or /tmp) and piped to the command's standard input, with
+     each %s in the command replaced by the image filename, quoted for
+     the shell (so %s should not itself be quoted), e.g.
+       aws s3 cp - s3://bucket/%s
+     so that only one image per writer is ever held locally; a NULL or
+     empty command restores local output.  ImageOutputIsLocal tells
+     callers whether they still need to create output directories. */
+  void SetImageOutputCommand (char *command);
+  int ImageOutputIsLocal (void);
+
+  /* StageOutputFile creates an empty local file, with the same
+     extension as filename, into which a caller can write some other
+     output while there is an output command; SendOutputFile then pipes
+     it to the command for filename and removes it */
+  int StageOutputFile (char *filename, char *staged, char *error);
+  int SendOutputFile (char *staged, char *filename, char *error);
+
+  ImageWriter *OpenImageWriter (char *filename,
+				int width, int height,
+				enum ImageCompression compressionMode,
+				char *error);
+
+  /* OpenPyramidImageWriter is OpenImageWriter for TIFF files that also
+     hold nLevels reduced-resolution versions of the image as SubIFDs,
+     each half the size of the one before (2x2 means); the levels are
+     made from the rows as they are written, and ReadImageReduced reads
+     them back directly */
+  ImageWriter *OpenPyramidImageWriter (char *filename,
+				       int width, int height, int nLevels,
+				       enum ImageCompression compressionMode,
+				       char *error);
+
+  int WriteImageRows (ImageWriter *writer, unsigned char *pixels,
+		      int nRows, char *error);
+
+  int CloseImageWriter (ImageWriter *writer, char *error);
+
   int WriteFloatImage (char *filename, float *pixels,
 		       int width, int height, int depth,
 		       float minValue, float maxValue,
 		       enum ImageCompression compressionMode,
 		       char *error);
 
+  /* WriteCompressedArray writes the header line, followed by n bytes
+     of data, to a gzipped file; it writes to a temporary file that
+     is renamed into place, so that other processes never see a partial
+     file; ReadCompressedArray reads the data back, failing if the file
+     does not start with the same header line */
+  int WriteCompressedArray (char *filename, char *header,
+			    unsigned char *data, size_t n,
+			    char *error);
+
+  int ReadCompressedArray (char *filename, char *header,
+			   unsigned char *data, size_t n,
+			   char *error);
+
+  /* a volume is a chunked 3-D array of bytes stored as a Zarr (version 2)
+     array: the directory dirName holds a .zarray JSON metadata file and
+     one zlib-compressed file per cubic chunk, named cz/cy/cx; chunks
+     are in C order (z, then y, then x), and those never written read
+     back as 0 */
+  int CreateVolume (char *dirName, int width, int height, int depth,
+		    int chunkSize, char *error);
+
+  int ReadVolumeSize (char *dirName, int *width, int *height, int *depth,
+		      int *chunkSize, char *error);
+
+  int WriteVolumeChunk (char *dirName, int cx, int cy, int cz,
+			int chunkSize, unsigned char *data, char *error);
+
+  int ReadVolumeChunk (char *dirName, int cx, int cy, int cz,
+		       int chunkSize, unsigned char *data, char *error);
+
   int ReadBitmapSize (char *filename,
 		      int *width, int *height,
 		      char *error);
@@ -74,6 +268,19 @@ extern "C" {
 	       char *imageName, char *referenceName,
 	       char *error);
 
+  /* MapMmap is like ReadMap, but the elements of an AlignedMap file are
+     mapped copy-on-write from the file instead of being read, so that
+     processes holding the same map share its pages through the OS
+     cache; the map must be released with MapMunmap, never free */
+  int MapMmap (char *filename, MapElement **map,
+	       int *level,
+	       int *width, int *height,
+	       int *xMin, int *yMin,
+	       char *imageName, char *referenceName,
+	       char *error);
+
+  void MapMunmap (MapElement *map, int width, int height);
+
   int WriteMap (char *filename, MapElement *map,
 		int level,
 		int width, int height,
@@ -82,6 +289,84 @@ extern "C" {
 		enum MapCompression compressionMethod,
 		char *error);
 
+  /* WritePreviewMap is like WriteMap, but marks the map as a preview
+     that was only registered down to previewLevel and then upsampled
+     to level; ReadMapPreviewLevel sets *previewLevel to that level, or
+     to -1 if the file holds an ordinary map */
+  int WritePreviewMap (char *filename, MapElement *map,
+		       int level,
+		       int width, int height,
+		       int xMin, int yMin,
+		       char *imageName, char *referenceName,
+		       int previewLevel,
+		       enum MapCompression compressionMethod,
+		       char *error);
+
+  int ReadMapPreviewLevel (char *filename, int *previewLevel, char *error);
+
+  /* SetMapLevels makes subsequent WriteMap and WritePreviewMap calls
+     follow the map with up to nLevels coarser copies of it (each
+     sampling every other element of the one before, at the next
+     level), which ReadMapLevel can read without reading the map
+     itself; readers that do not know of them see an ordinary map */
+  void SetMapLevels (int nLevels);
+
+  /* ReadMapLevel is like ReadMap, but if the file holds coarser copies
+     of the map, reads the coarsest that is no coarser than
+     wantedLevel instead, setting *level to its level */
+  int ReadMapLevel (char *filename, MapElement **map,
+		    int wantedLevel,
+		    int *level,
+		    int *width, int *height,
+		    int *xMin, int *yMin,
+		    char *imageName, char *referenceName,
+		    char *error);
+
+  /* ReadMapLevels sets *nLevels to the number of coarser copies of the
+     map that the file holds */
+  int ReadMapLevels (char *filename, int *nLevels, char *error);
+
+  /* ReadMapRegion is like ReadMap, but only reads the elements from
+     (minX, minY) to (maxX, maxY) of the map's grid (clipped to it),
+     returning them as a map of their own with *xMin and *yMin offset
+     to match; for tiled maps only the tiles covering the region are
+     read */
+  int ReadMapRegion (char *filename, MapElement **map,
+		     int *level,
+		     int *width, int *height,
+		     int *xMin, int *yMin,
+		     char *imageName, char *referenceName,
+		     int minX, int maxX, int minY, int maxY,
+		     char *error);
+
+  /* ReadMapTargetRegion is like ReadMapRegion, but reads the smallest
+     block of elements that holds every cell (with all 4 corners valid)
+     landing in the box (minX..maxX, minY..maxY) of the target, measured
+     in full-resolution pixels (the element's x and y times 2^level);
+     the map is scanned a band of rows at a time, so the memory used
+     scales with the block.  If no cell lands in the box, *map is set to
+     NULL and *width and *height to 0. */
+  int ReadMapTargetRegion (char *filename, MapElement **map,
+			   int *level,
+			   int *width, int *height,
+			   int *xMin, int *yMin,
+			   char *imageName, char *referenceName,
+			   float minX, float maxX, float minY, float maxY,
+			   char *error);
+
+  /* the -update options decide whether an output is stale from a
+     sidecar file <output>.deps, which WriteDeps writes after the
+     output, recording a hash of params (a string of the parameters
+     the output depends on) and the size, modification time and
+     content hash of each of the inputs (empty or NULL names are
+     skipped).  DepsCurrent returns 1 if params and the contents of
+     the inputs are unchanged (only rehashing an input whose size or
+     time differ from the recorded ones), 0 if anything changed, and
+     -1 if there is no readable sidecar, in which case the caller
+     should fall back to comparing modification times. */
+  int WriteDeps (char *depsName, char *params, int nInputs, char **inputs);
+  int DepsCurrent (char *depsName, char *params, int nInputs, char **inputs);
+
 #ifdef __cplusplus
 }
 #endif
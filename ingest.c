@@ -0,0 +1,603 @@
+/*
+ *  ingest.c  -  prepares raw section images for alignment in one pass:
+ *               each image is read once, and its mask, reduced image
+ *               and mask, and pyramid tiles are all made from it
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  HISTORY
+ *    2026  Written to replace running gen_mask, reduce, reduce_mask
+ *            and gen_pyramid separately on each image
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "bitmap.h"
+#include "imio.h"
+#include "reduction.h"
+
+/* GLOBAL VARIABLES */
+char inputName[PATH_MAX];	/* prefix of the raw images */
+char maskName[PATH_MAX];	/* prefix of the full-size masks */
+char reducedName[PATH_MAX];	/* prefix of the reduced images */
+char reducedMaskName[PATH_MAX];	/* prefix of the reduced masks */
+char pyramidName[PATH_MAX];	/* root directory of the pyramid tiles */
+int factor = 0;			/* reduction factor */
+int method;			/* mask method (see bitmap.h) */
+int lowerThreshold, upperThreshold;
+int erode = 0;
+float clusterThreshold = 0.0;	/* a percentage */
+int outputTileWidth = 0, outputTileHeight = 0;
+enum ImageCompression compressionMode = JpegQuality90;
+
+/* the images are handed out to the threads in list order */
+int nImages = 0;
+char **imageNames = NULL;
+int nThreads = 1;
+int nextImage = 0;
+pthread_mutex_t nextLock = PTHREAD_MUTEX_INITIALIZER;
+
+void *ImageThreadMain (void *arg);
+void ProcessImage (char *name);
+void WritePyramid (char *name, unsigned char *img, int iw, int ih);
+void MakeParentDirectories (char *fn);
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int error;
+  int threshold;
+  int quality;
+  char imageListName[PATH_MAX];
+  char line[PATH_MAX];
+  char name[PATH_MAX];
+  FILE *f;
+  pthread_t *threads;
+
+  error = 0;
+  inputName[0] = '\0';
+  maskName[0] = '\0';
+  reducedName[0] = '\0';
+  reducedMaskName[0] = '\0';
+  pyramidName[0] = '\0';
+  imageListName[0] = '\0';
+  method = MASK_THRESHOLD;
+  threshold = 1;
+  lowerThreshold = 0;
+  upperThreshold = 255;
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "-input") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-input error\n");
+	    break;
+	  }
+	strcpy(inputName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-image_list") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-image_list error\n");
+	    break;
+	  }
+	strcpy(imageListName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-mask") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-mask error\n");
+	    break;
+	  }
+	strcpy(maskName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-reduced") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-reduced error\n");
+	    break;
+	  }
+	strcpy(reducedName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-reduced_mask") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-reduced_mask error\n");
+	    break;
+	  }
+	strcpy(reducedMaskName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-factor") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &factor) != 1)
+	  {
+	    fprintf(stderr, "-factor error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-pyramid") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-pyramid error\n");
+	    break;
+	  }
+	strcpy(pyramidName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-output_tile_size") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%dx%d", &outputTileWidth, &outputTileHeight) != 2)
+	  {
+	    fprintf(stderr, "-output_tile_size error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-quality") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &quality) != 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+	switch (quality)
+	  {
+	  case 70:
+	    compressionMode = JpegQuality70;
+	    break;
+	  case 75:
+	    compressionMode = JpegQuality75;
+	    break;
+	  case 80:
+	    compressionMode = JpegQuality80;
+	    break;
+	  case 85:
+	    compressionMode = JpegQuality85;
+	    break;
+	  case 90:
+	    compressionMode = JpegQuality90;
+	    break;
+	  case 95:
+	    compressionMode = JpegQuality95;
+	    break;
+	  default:
+	    fprintf(stderr, "-quality must be one of 70, 75, 80, 85, 90, or 95\n");
+	    error = 1;
+	    break;
+	  }
+	if (error)
+	  break;
+      }
+    else if (strcmp(argv[i], "-threshold") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &threshold) != 1)
+	  {
+	    fprintf(stderr, "-threshold error\n");
+	    error = 1;
+	    break;
+	  }
+	method = MASK_THRESHOLD;
+      }
+    else if (strcmp(argv[i], "-range") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d-%d",
+				  &lowerThreshold,
+				  &upperThreshold) != 2)
+	  {
+	    fprintf(stderr, "-range error\n");
+	    error = 1;
+	    break;
+	  }
+	method = MASK_RANGE;
+      }
+    else if (strcmp(argv[i], "-boundary-fill") == 0)
+      method = MASK_BOUNDARY_FILL;
+    else if (strcmp(argv[i], "-erode") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &erode) != 1)
+	  {
+	    fprintf(stderr, "-erode error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-cluster_threshold") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%f", &clusterThreshold) != 1)
+	  {
+	    fprintf(stderr, "-cluster_threshold error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    fprintf(stderr, "-threads error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else
+      {
+	fprintf(stderr, "Unknown option: %s\n", argv[i]);
+	error = 1;
+      }
+
+  if (error)
+    {
+      if (i >= argc)
+	fprintf(stderr, "Incomplete option: %s\n\n", argv[i-1]);
+
+      fprintf(stderr, "Usage: ingest -input raw_image_prefix\n");
+      fprintf(stderr, "              -image_list images_file\n");
+      fprintf(stderr, "              [-mask mask_prefix]\n");
+      fprintf(stderr, "              [-factor int_value]\n");
+      fprintf(stderr, "              [-reduced reduced_image_prefix]\n");
+      fprintf(stderr, "              [-reduced_mask reduced_mask_prefix]\n");
+      fprintf(stderr, "              [-pyramid root_directory]\n");
+      fprintf(stderr, "              [-output_tile_size WxH]\n");
+      fprintf(stderr, "              [-quality integer]\n");
+      fprintf(stderr, "              [-threshold int_value ]\n");
+      fprintf(stderr, "              [-range lower-upper ]\n");
+      fprintf(stderr, "              [-boundary-fill ]\n");
+      fprintf(stderr, "              [-erode n_pixels ]\n");
+      fprintf(stderr, "              [-cluster_threshold percent ]\n");
+      fprintf(stderr, "              [-threads n ]\n");
+      exit(1);
+    }
+
+  /* check that at least minimal parameters were supplied */
+  if (inputName[0] == '\0' || imageListName[0] == '\0')
+    {
+      fprintf(stderr, "Both -input and -image_list parameters must be specified.\n");
+      exit(1);
+    }
+  if (maskName[0] == '\0' && reducedName[0] == '\0' &&
+      reducedMaskName[0] == '\0' && pyramidName[0] == '\0')
+    {
+      fprintf(stderr, "At least one of -mask, -reduced, -reduced_mask and -pyramid must be specified.\n");
+      exit(1);
+    }
+  if ((reducedName[0] != '\0' || reducedMaskName[0] != '\0') && factor <= 0)
+    {
+      fprintf(stderr, "reduction factor must be a positive integer\n");
+      exit(1);
+    }
+  if (pyramidName[0] != '\0' &&
+      (outputTileWidth <= 0 || outputTileHeight <= 0))
+    {
+      fprintf(stderr, "Must specify a tile width and height with -output_tile_size WxH\n");
+      exit(1);
+    }
+  if (method == MASK_THRESHOLD)
+    {
+      lowerThreshold = threshold;
+      upperThreshold = 255;
+    }
+
+  /* read the image list (the first word of each line) */
+  f = fopen(imageListName, "r");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Could not open image list %s\n", imageListName);
+      exit(1);
+    }
+  while (fgets(line, PATH_MAX, f) != NULL)
+    {
+      if (sscanf(line, "%s", name) != 1 || name[0] == '#')
+	continue;
+      if ((nImages & (nImages - 1)) == 0)
+	imageNames = (char **) realloc(imageNames,
+				       (nImages == 0 ? 1 : 2 * nImages) *
+				       sizeof(char *));
+      imageNames[nImages++] = strdup(name);
+    }
+  fclose(f);
+
+  if (nThreads > nImages)
+    nThreads = nImages;
+  threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_create(&threads[i], NULL, ImageThreadMain, NULL) != 0)
+      {
+	fprintf(stderr, "Could not create thread %d\n", i);
+	exit(1);
+      }
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_join(threads[i], NULL) != 0)
+      {
+	fprintf(stderr, "Could not join thread %d\n", i);
+	exit(1);
+      }
+  free(threads);
+
+  printf("Ingested %d images.\n", nImages);
+  return(0);
+}
+
+void *
+ImageThreadMain (void *arg)
+{
+  int k;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&nextLock);
+      k = nextImage;
+      if (k < nImages)
+	++nextImage;
+      pthread_mutex_unlock(&nextLock);
+      if (k >= nImages)
+	break;
+      ProcessImage(imageNames[k]);
+    }
+  return(NULL);
+}
+
+/* ProcessImage reads raw image name and makes all the requested
+   outputs from it; only the mask at full and reduced size and the
+   reduced image are held besides the image itself */
+void
+ProcessImage (char *name)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX + 256];
+  unsigned char *img;
+  unsigned char *mask;
+  unsigned char *out;
+  int iw, ih;
+  int ow, oh;
+  int ok;
+
+  sprintf(fn, "%s%s", inputName, name);
+  if (!ReadImage(fn, &img, &iw, &ih, -1, -1, -1, -1, msg))
+    {
+      fprintf(stderr, "Could not read image %s:\n  error: %s\n", fn, msg);
+      exit(1);
+    }
+  ow = (factor > 0) ? iw / factor : iw;
+  oh = (factor > 0) ? ih / factor : ih;
+
+  if (maskName[0] != '\0' || reducedMaskName[0] != '\0')
+    {
+      mask = GenerateMask(img, iw, ih, method,
+			  lowerThreshold, upperThreshold,
+			  erode, clusterThreshold, 1, 0);
+      if (mask == NULL)
+	{
+	  fprintf(stderr, "Could not allocate the mask of %s\n", fn);
+	  exit(1);
+	}
+      if (maskName[0] != '\0')
+	{
+	  sprintf(fn, "%s%s.pbm", maskName, name);
+	  MakeParentDirectories(fn);
+	  if (!WriteBitmap(fn, mask, iw, ih, UncompressedBitmap, msg))
+	    {
+	      fprintf(stderr, "Could not write mask %s:\n%s\n", fn, msg);
+	      exit(1);
+	    }
+	}
+      if (reducedMaskName[0] != '\0')
+	{
+	  out = (unsigned char *) malloc(((size_t) oh) * ((ow + 7) >> 3));
+	  ok = out != NULL &&
+	    (factor == 2 ? ReduceMaskOr2x2(mask, iw, ih, 0, 0, out, ow, oh) :
+	     ReduceMask(mask, iw, ih, factor, 0, out));
+	  if (!ok)
+	    {
+	      fprintf(stderr, "Could not allocate reduced mask of %s\n", name);
+	      exit(1);
+	    }
+	  sprintf(fn, "%s%s.pbm", reducedMaskName, name);
+	  MakeParentDirectories(fn);
+	  if (!WriteBitmap(fn, out, ow, oh, UncompressedBitmap, msg))
+	    {
+	      fprintf(stderr, "Could not write mask %s:\n%s\n", fn, msg);
+	      exit(1);
+	    }
+	  free(out);
+	}
+      free(mask);
+    }
+
+  if (reducedName[0] != '\0')
+    {
+      out = (unsigned char *) malloc(((size_t) ow) * oh);
+      if (out == NULL || !ReduceImage(img, iw, ih, factor, out))
+	{
+	  fprintf(stderr, "Could not allocate reduced image of %s\n", name);
+	  exit(1);
+	}
+      sprintf(fn, "%s%s.tif", reducedName, name);
+      MakeParentDirectories(fn);
+      if (!WriteImage(fn, out, ow, oh, UncompressedImage, msg))
+	{
+	  fprintf(stderr, "Could not write image %s:\n%s\n", fn, msg);
+	  exit(1);
+	}
+      free(out);
+    }
+
+  if (pyramidName[0] != '\0')
+    WritePyramid(name, img, iw, ih);
+  free(img);
+  printf("Ingested image %s\n", name);
+}
+
+/* WritePyramid writes the tiles of image name as gen_pyramid -subdir
+   name does: tile (bx, by) of level lvl goes to
+   pyramid/lvl/name/by/bx.jpg, and each pixel of level lvl is the
+   rounded mean of the 2^lvl x 2^lvl block of the image under it, the
+   area beyond the edges of the image counting as black; the sums of
+   each level are made from those of the level below */
+void
+WritePyramid (char *name, unsigned char *img, int iw, int ih)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX + 256];
+  int nLevels;
+  int lvl;
+  int nh, nv;
+  int w, h;
+  int pw, ph;
+  int bx, by;
+  int x, y;
+  int sx, sy;
+  int shift;
+  unsigned int offset;
+  unsigned int *sum;
+  unsigned int *prev;
+  unsigned int *s;
+  unsigned char *tile;
+
+  nLevels = 0;
+  while (iw > (1 << nLevels) * outputTileWidth ||
+	 ih > (1 << nLevels) * outputTileHeight)
+    ++nLevels;
+  ++nLevels;
+
+  tile = (unsigned char *) malloc(outputTileWidth * outputTileHeight);
+  if (tile == NULL)
+    {
+      fprintf(stderr, "Could not allocate tile for %s\n", name);
+      exit(1);
+    }
+  sum = NULL;
+  pw = ph = 0;
+  for (lvl = 0; lvl < nLevels; ++lvl)
+    {
+      nh = (iw + (outputTileWidth << lvl) - 1) / (outputTileWidth << lvl);
+      nv = (ih + (outputTileHeight << lvl) - 1) / (outputTileHeight << lvl);
+      w = nh * outputTileWidth;
+      h = nv * outputTileHeight;
+      if (lvl > 0)
+	{
+	  prev = sum;
+	  sum = (unsigned int *) malloc(((size_t) w) * h *
+					sizeof(unsigned int));
+	  if (sum == NULL)
+	    {
+	      fprintf(stderr, "Could not allocate pyramid level of %s\n",
+		      name);
+	      exit(1);
+	    }
+	  memset(sum, 0, ((size_t) w) * h * sizeof(unsigned int));
+	  for (y = 0; y < h; ++y)
+	    {
+	      s = &sum[((size_t) y) * w];
+	      for (sy = 2 * y; sy <= 2 * y + 1; ++sy)
+		if (lvl == 1)
+		  {
+		    if (sy < ih)
+		      SumPairs(&img[((size_t) sy) * iw],
+			       (iw < 2 * w) ? iw : 2 * w, s);
+		  }
+		else if (sy < ph)
+		  SumPairsUInt(&prev[((size_t) sy) * pw],
+			       (pw < 2 * w) ? pw : 2 * w, s);
+	    }
+	  free(prev);
+	  pw = w;
+	  ph = h;
+	}
+      shift = 2 * lvl;
+      offset = (lvl > 0) ? 1 << (shift - 1) : 0;
+
+      for (by = 0; by < nv; ++by)
+	for (bx = 0; bx < nh; ++bx)
+	  {
+	    for (y = 0; y < outputTileHeight; ++y)
+	      {
+		sy = by * outputTileHeight + y;
+		sx = bx * outputTileWidth;
+		if (lvl > 0)
+		  {
+		    s = &sum[((size_t) sy) * w + sx];
+		    for (x = 0; x < outputTileWidth; ++x)
+		      tile[y * outputTileWidth + x] = (s[x] + offset) >> shift;
+		  }
+		else if (sy >= ih || sx >= iw)
+		  memset(&tile[y * outputTileWidth], 0, outputTileWidth);
+		else
+		  {
+		    x = (iw - sx < outputTileWidth) ? iw - sx : outputTileWidth;
+		    memcpy(&tile[y * outputTileWidth],
+			   &img[((size_t) sy) * iw + sx], x);
+		    memset(&tile[y * outputTileWidth + x], 0,
+			   outputTileWidth - x);
+		  }
+	      }
+	    sprintf(fn, "%s/%d/%s/%d/%d.jpg", pyramidName, lvl, name, by, bx);
+	    MakeParentDirectories(fn);
+	    if (!WriteImage(fn, tile, outputTileWidth, outputTileHeight,
+			    compressionMode, msg))
+	      {
+		fprintf(stderr, "Could not write tile %s\n%s\n", fn, msg);
+		exit(1);
+	      }
+	  }
+    }
+  free(sum);
+  free(tile);
+}
+
+/* MakeParentDirectories creates the directories of path fn that do
+   not yet exist */
+void
+MakeParentDirectories (char *fn)
+{
+  char dir[PATH_MAX];
+  char *p;
+
+  strcpy(dir, fn);
+  for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+      *p = '\0';
+      if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+	{
+	  fprintf(stderr, "Could not create directory %s\n", dir);
+	  exit(1);
+	}
+      *p = '/';
+    }
+}
@@ -31,6 +31,7 @@
  *    2008-2009  Written by Greg Hood (ghood@psc.edu)
  *    2010  Fixes to correctly display pairs involving
  *           subimages with nonzero offsets (ghood@psc.edu)
+ *    2026  Added the tiled level-of-detail renderer (-lod, -pyramid)
  */
 
 #include <stdio.h>
@@ -41,6 +42,8 @@
 #include <limits.h>
 #include <dirent.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <FL/gl.h>
 #include <FL/Fl.H>
 #include <FL/Fl_Window.H>
@@ -51,8 +54,13 @@
 #include <GL/glu.h>
 #include <string>
 #include <algorithm>
+#include <map>
+#include <deque>
+#include <vector>
 #include "imio.h"
 #include "invert.h"
+#include "prefetch.h"
+#include "atlas.h"
 
 using std::string;
 using std::max;
@@ -60,10 +68,9 @@ using std::min;
 
 int fmDebug = 0;
 
-#define N_LEVELS	16       /* max image size (w or h) is 2^N_LEVELS */s
+#define N_LEVELS	16       /* max image size (w or h) is 2^N_LEVELS */
 #define MAP(map,x,y)	map[(y)*mapWidth + x]
 #define IMAGE(i,x,y)    (x >= 0 && x < w && y >= 0 && y < h ? i[(y)*w + (x)] : background)
-#define RIMAGE(i,x,y)   (x >= 0 && x < rw && y >= 0 && y < rh ? i[(y)*rw + (x)] : background)
 #define LINE_LENGTH	255
 
 struct CPoint
@@ -74,6 +81,17 @@ struct CPoint
   float wrx, wry;  // point in image that maps to the reference point
 };
 
+/* the images the tiled renderer pages in as they are needed */
+struct TileSource
+{
+  char name[PATH_MAX];   // image file, or section name within the pyramid
+  int width, height;     // size of the full-resolution image
+  int tileWidth;         // size of a tile, in pixels of its own level
+  int tileHeight;
+  int nLevels;           // number of pyramid levels; level l is reduced
+                         //   by a factor of 2^l
+};
+
 struct Pair
 {
   char *imageName;
@@ -91,12 +109,16 @@ class MyWindow: public Fl_Gl_Window
   void draw ();
   int handle (int);
   void loadSection ();
+  void loadFullSection ();
   void saveSection ();
   void setTexture (unsigned int type, unsigned char *image,
 		   int w, int h);
   bool backmap (float *rx, float *ry, float x, float y);
   bool forwardmap (float *px, float *py, float *pc, float x, float y);
   void reshape ();
+  void drawTiles ();
+  void buildMesh ();
+  void prefetch ();
 
  protected:
   GLuint texture[3];
@@ -123,6 +145,10 @@ class MyWindow: public Fl_Gl_Window
   int lastIndex;          // the last "good" index
   int increment;          // the last increment to index (-1 or 1)
   bool sectionsLoaded;    // true if we have already loaded the currentPair
+  bool preview;           // true if the sections shown are the atlas
+                          //   thumbnails, until the full ones are read
+  bool fullLoad;          // true if loadSection must read the full
+                          //   sections even if the atlas has thumbnails
   bool displayOriginal;   // true if we should display the original reference
                           //   rather than the warped reference
   bool displayMap;        // true if we should display the map superimposed
@@ -157,13 +183,18 @@ class MyWindow: public Fl_Gl_Window
 
   unsigned char *image;
   unsigned char *ref;
-  unsigned char *warped;
+  GLuint mesh;            // display list that draws the reference texture
+                          //   warped by the map
 
   int mapWidth, mapHeight;
   int mapOffsetX, mapOffsetY;
   int mapFactor;
   MapElement *map;
   InverseMap *inverseMap;
+
+  TileSource sources[2];  // the image and reference when paging in tiles
+  int drawnGeneration;    // the tileGeneration whose tiles are cached
+  unsigned int frame;     // the number of times drawTiles has been called
 };
 
 char pairsFile[PATH_MAX];
@@ -179,6 +210,17 @@ char extension[8] = "pgm";
 int baseReductionFactor = 1;
 bool partial = false;
 bool gray = true;
+bool lod = false;           // true if the images are paged in as tiles
+char pyramidName[PATH_MAX]; // root of the gen_pyramid tiles, if any
+int lodTileSize = 256;      // size of the tiles read from TIFF images
+int lodThreads = 2;         // number of threads that read tiles
+int prefetchPairs = 2;      // number of pairs to read ahead in each direction
+int prefetchMemory = 1024;  // megabytes that pairs read ahead may take
+char atlasName[PATH_MAX];   // the gen_atlas output to preview pairs from
+Atlas atlas;                // its thumbnails and pair statistics
+bool haveAtlas = false;
+double previewDelay = 0.4;  // seconds a thumbnail preview is shown before
+                            //   the full sections are read
 
 unsigned char colors[16][3] =
   {{255, 0, 0},     // red
@@ -209,6 +251,10 @@ int ParseRange (char *s, int *pos, int *minValue, int *maxValue);
 int ParseValue (char *s, int *pos, int *value);
 int ReadHeader (FILE *f, char *tc, int *w, int *h, int *m);
 void Beep();
+void LoadFullSection (void *w);
+unsigned char *ThumbnailRegion (AtlasSection *s,
+				int *minX, int *maxX, int *minY, int *maxY,
+				int *width, int *height);
 
 #if 0
 extern "C" {
@@ -227,64 +273,193 @@ extern "C" {
 }
 #endif
 
+/* The tiled renderer keeps the tiles it has read in a cache that it
+   shares with the threads that read them.  A tile is named by the
+   image of the pair it belongs to (0 or 2, as for MyWindow::type),
+   its pyramid level, and its column and row within that level.  Only
+   the GL thread makes textures out of the tiles the readers leave. */
+#define MAX_TILES	512	/* the cache holds at most this many tiles */
 
-int MyReadMap (char *filename,
-	     MapElement** map,
-	     int *level,
-	     int *width, int *height,
-	     int *xMin, int *yMin,
-	     char *imageName, char *referenceName,
-	     char *error)
+#define TILE_QUEUED	0	/* waiting for a reader */
+#define TILE_READING	1	/* being read */
+#define TILE_READ	2	/* read, but not yet made into a texture */
+#define TILE_LOADED	3	/* in a texture */
+#define TILE_FAILED	4	/* could not be read */
+
+struct TileKey
 {
-  char imgName[PATH_MAX], refName[PATH_MAX];
-  int newWidth, newHeight;
+  int which, level, tx, ty;
 
-  FILE *f = fopen(filename, "r");
-  if (f == NULL)
-    {
-      sprintf(error, "Cannot open file %s\n", filename);
-      return(0);
-    }
-  if (fgetc(f) != 'M' || fgetc(f) != '1' || fgetc(f) != '\n' ||
-      fscanf(f, "%d%d%d%d%d%s%s",
-	     level,
-	     &newWidth, &newHeight,
-	     xMin, yMin,
-	     imgName, refName) != 7 ||
-      fgetc(f) != '\n')
+  bool operator< (const TileKey &k) const
+  {
+    if (which != k.which)
+      return(which < k.which);
+    if (level != k.level)
+      return(level < k.level);
+    if (ty != k.ty)
+      return(ty < k.ty);
+    return(tx < k.tx);
+  }
+};
+
+struct Tile
+{
+  int state;
+  unsigned char *pixels;  // the tile as read (state TILE_READ)
+  int width, height;
+  GLuint texture;         // the tile's texture (state TILE_LOADED)
+  int textureWidth, textureHeight;
+  unsigned int lastUsed;  // the frame in which the tile was last wanted
+};
+
+struct TileRequest
+{
+  TileKey key;
+  int generation;         // the tileGeneration the request was made in
+  string fileName;
+  int factor;             // reduction factor when reading a TIFF region
+  int minX, maxX, minY, maxY;
+};
+
+pthread_mutex_t tileLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tileCond = PTHREAD_COND_INITIALIZER;
+std::map<TileKey, Tile> tiles;
+std::deque<TileRequest> tileQueue;
+int tileGeneration = 0;   // incremented whenever a new pair is loaded
+
+void
+TileReady (void *arg)
+{
+  window->redraw();
+}
+
+void *
+TileThreadMain (void *arg)
+{
+  TileRequest req;
+  std::map<TileKey, Tile>::iterator t;
+  unsigned char *pixels;
+  int w, h;
+  int ok;
+  char errorMsg[PATH_MAX + 256];
+
+  pthread_mutex_lock(&tileLock);
+  for (;;)
     {
-      sprintf(error, "Cannot read header of map file %s\n", filename);
-      return(0);
+      while (tileQueue.empty())
+	pthread_cond_wait(&tileCond, &tileLock);
+      req = tileQueue.front();
+      tileQueue.pop_front();
+      t = tiles.find(req.key);
+      if (req.generation != tileGeneration || t == tiles.end() ||
+	  t->second.state != TILE_QUEUED)
+	continue;
+      t->second.state = TILE_READING;
+      pthread_mutex_unlock(&tileLock);
+
+      if (pyramidName[0] != '\0')
+	ok = ReadImage((char *) req.fileName.c_str(), &pixels, &w, &h,
+		       -1, -1, -1, -1, errorMsg);
+      else
+	ok = ReadImageRegionReduced((char *) req.fileName.c_str(), req.factor,
+				    &pixels, &w, &h,
+				    req.minX, req.maxX, req.minY, req.maxY,
+				    errorMsg);
+
+      pthread_mutex_lock(&tileLock);
+      t = tiles.find(req.key);
+      if (req.generation != tileGeneration || t == tiles.end())
+	{
+	  /* the pair changed while the tile was being read */
+	  if (ok)
+	    free(pixels);
+	  continue;
+	}
+      if (ok)
+	{
+	  t->second.pixels = pixels;
+	  t->second.width = w;
+	  t->second.height = h;
+	  t->second.state = TILE_READ;
+	}
+      else
+	{
+	  fprintf(stderr, "Could not read tile of %s -- error: %s\n",
+		  req.fileName.c_str(), errorMsg);
+	  t->second.state = TILE_FAILED;
+	}
+      Fl::awake(TileReady, 0);
     }
-  if (imageName != NULL)
-    strcpy(imageName, imgName);
-  if (referenceName != NULL)
-    strcpy(referenceName, refName);
-  if (*width <= 0 || *height <= 0)
-    *map = NULL;
-  if (*map != NULL && (newWidth != *width || newHeight != *height))
+  return(NULL);
+}
+
+/* OpenTileSource finds the size and tiling of the image named name,
+   and sets width and height to the size of the region
+   minX..maxX, minY..maxY of it, as ReadImage would */
+int
+OpenTileSource (TileSource *src, char *name,
+		int *width, int *height,
+		int minX, int maxX, int minY, int maxY,
+		char *error)
+{
+  char fn[PATH_MAX];
+  struct stat sb;
+  int n;
+
+  if (pyramidName[0] != '\0')
     {
-      free(*map);
-      *map = NULL;
+      /* count the tiles of level 0, then the levels */
+      strcpy(src->name, name);
+      sprintf(fn, "%s/0/%s/0/0.jpg", pyramidName, name);
+      if (!ReadImageSize(fn, &src->tileWidth, &src->tileHeight, error))
+	return(0);
+      for (n = 1; ; ++n)
+	{
+	  sprintf(fn, "%s/0/%s/0/%d.jpg", pyramidName, name, n);
+	  if (stat(fn, &sb) != 0)
+	    break;
+	}
+      src->width = n * src->tileWidth;
+      for (n = 1; ; ++n)
+	{
+	  sprintf(fn, "%s/0/%s/%d/0.jpg", pyramidName, name, n);
+	  if (stat(fn, &sb) != 0)
+	    break;
+	}
+      src->height = n * src->tileHeight;
+      for (n = 1; n < N_LEVELS; ++n)
+	{
+	  sprintf(fn, "%s/%d/%s/0/0.jpg", pyramidName, n, name);
+	  if (stat(fn, &sb) != 0)
+	    break;
+	}
+      src->nLevels = n;
     }
-  if (*map == NULL)
-    *map = (MapElement *) malloc(newWidth * newHeight * sizeof(MapElement));
-  if (*map == NULL)
+  else
     {
-      sprintf(error, "Could not allocate space for map %s\n", filename);
-      return(0);
+      sprintf(src->name, "%s%s.%s", inputName, name, extension);
+      if (!ReadImageSize(src->name, &src->width, &src->height, error))
+	return(0);
+      src->tileWidth = lodTileSize;
+      src->tileHeight = lodTileSize;
+      for (n = 1;
+	   n < N_LEVELS &&
+	     ((lodTileSize << (n - 1)) < src->width ||
+	      (lodTileSize << (n - 1)) < src->height);
+	   ++n) ;
+      src->nLevels = n;
     }
-  *width = newWidth;
-  *height = newHeight;
-  if (fread(*map, sizeof(MapElement), newWidth * newHeight, f) != newWidth * newHeight)
+  *width = (maxX >= 0 ? maxX : src->width - 1) - (minX >= 0 ? minX : 0) + 1;
+  *height = (maxY >= 0 ? maxY : src->height - 1) - (minY >= 0 ? minY : 0) + 1;
+  if (*width <= 0 || *height <= 0)
     {
-      sprintf(error, "Could not read map from file %s\n", filename);
+      sprintf(error, "Region of %s is empty\n", src->name);
       return(0);
     }
-  fclose(f);
   return(1);
 }
 
+
 int
 main (int argc, char **argv)
 {
@@ -311,12 +486,14 @@ main (int argc, char **argv)
   int imgMinX, imgMaxX, imgMinY, imgMaxY;
   int refMinX, refMaxX, refMinY, refMaxY;
   char line[LINE_LENGTH+1];
+  char errorMsg[PATH_MAX + 256];
 
   error = 0;
   pairsFile[0] = '\0';
   inputName[0] = '\0';
   mapName[0] = '\0';
   cptsName[0] = '\0';
+  atlasName[0] = '\0';
   minSection = 0;
   maxSection = 1000000000;
   for (i = 1; i < argc; ++i)
@@ -381,6 +558,79 @@ main (int argc, char **argv)
       partial = true;
     else if (strcmp(argv[i], "-no_gray") == 0)
       gray = false;
+    else if (strcmp(argv[i], "-prefetch") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &prefetchPairs) != 1 ||
+	    prefetchPairs < 0)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-prefetch error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-prefetch_memory") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &prefetchMemory) != 1 ||
+	    prefetchMemory < 0)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-prefetch_memory error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-atlas") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-atlas error\n");
+	    break;
+	  }
+	strcpy(atlasName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-preview_delay") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%lf", &previewDelay) != 1 ||
+	    previewDelay < 0.0)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-preview_delay error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-lod") == 0)
+      lod = true;
+    else if (strcmp(argv[i], "-pyramid") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-pyramid error\n");
+	    break;
+	  }
+	strcpy(pyramidName, argv[i]);
+	lod = true;
+      }
+    else if (strcmp(argv[i], "-lod_tile") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &lodTileSize) != 1 ||
+	    lodTileSize < 16)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-lod_tile error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-lod_threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &lodThreads) != 1 ||
+	    lodThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-lod_threads error\n");
+	    break;
+	  }
+      }
     else
       error = 1;
 
@@ -392,6 +642,10 @@ main (int argc, char **argv)
       fprintf(stderr, "                  [-reduction factor]\n");
       fprintf(stderr, "                  [-tif]\n");
       fprintf(stderr, "                  [-partial]\n");
+      fprintf(stderr, "                  [-prefetch pairs] [-prefetch_memory megabytes]\n");
+      fprintf(stderr, "                  [-atlas gen_atlas_output] [-preview_delay seconds]\n");
+      fprintf(stderr, "                  [-lod] [-lod_tile pixels] [-lod_threads n]\n");
+      fprintf(stderr, "                  [-pyramid gen_pyramid_output_dir]\n");
       fprintf(stderr, "   where ranges are expressed as: integer\n");
       fprintf(stderr, "                              or: integer-integer\n");
       fprintf(stderr, "                              or: integer-\n");
@@ -457,7 +711,44 @@ main (int argc, char **argv)
   fclose(f);
   printf("%d pairs listed in pairs file.\n", nPairs);
 
-  /*  Fl::lock(); */
+  /* with an atlas, each pair is shown at once from its thumbnails, and
+     the full sections are read only if the user stays on it */
+  if (atlasName[0] != '\0')
+    {
+      if (!ReadAtlas(atlasName, &atlas, errorMsg))
+	{
+	  fprintf(stderr, "Could not read atlas %s -- error: %s\n",
+		  atlasName, errorMsg);
+	  exit(1);
+	}
+      haveAtlas = true;
+      printf("%d sections and %d pairs in atlas %s.\n",
+	     atlas.nSections, atlas.nPairs, atlasName);
+    }
+
+  /* read the neighboring pairs while the user looks at this one */
+  if (prefetchPairs > 0 &&
+      !StartPrefetching(2, ((size_t) prefetchMemory) << 20))
+    {
+      fprintf(stderr, "Could not start prefetching threads\n");
+      exit(1);
+    }
+
+  if (lod)
+    {
+      /* let the tile readers wake up the GL thread */
+      Fl::lock();
+      for (i = 0; i < lodThreads; ++i)
+	{
+	  pthread_t thread;
+	  if (pthread_create(&thread, NULL, TileThreadMain, NULL) != 0)
+	    {
+	      fprintf(stderr, "Could not create tile reading thread\n");
+	      exit(1);
+	    }
+	  pthread_detach(thread);
+	}
+    }
   Fl::visual(FL_RGB);
   Fl::gl_visual(FL_RGB);
   availableHeight = Fl::h() - 20;
@@ -466,6 +757,7 @@ main (int argc, char **argv)
   //  availableWidth = 1270;
   window = new MyWindow(0, 0, 256, 256);
   window->loadSection();
+  window->prefetch();
   window->reshape();
   window->show();
   printf("Windows created\n");
@@ -484,8 +776,10 @@ MyWindow::MyWindow (int x, int y, int w, int h) : Fl_Gl_Window (x, y, w, h)
   lastIndex = -1;
   increment = 1;
   sectionsLoaded = false;
+  preview = false;
+  fullLoad = false;
 
-  displayOriginal = (mapName[0] == '\0');
+  displayOriginal = (mapName[0] == '\0' || lod);
   displayMap = 0;
   dragX = 0;
   dragY = 0;
@@ -502,10 +796,13 @@ MyWindow::MyWindow (int x, int y, int w, int h) : Fl_Gl_Window (x, y, w, h)
 
   image = 0;
   ref = 0;
-  warped = 0;
+  mesh = 0;
 
   mapFactor = 0;
   map = 0;
+
+  drawnGeneration = -1;
+  frame = 0;
 }
 
 void
@@ -546,7 +843,7 @@ MyWindow::draw ()
     }
 
   // set the textures if necessary
-  if (setTextures)
+  if (setTextures && !lod)
     {
       //      printf("Entering setTextures... nCpts = %d\n", nCpts);
 
@@ -566,15 +863,29 @@ MyWindow::draw ()
 
       //      printf("setting textures %d %d %d %d %d %d\n", textureWidth, textureHeight, imageWidth, imageHeight, refWidth, refHeight);
       setTexture(0, image, imageWidth, imageHeight);
-      setTexture(1, warped, imageWidth, imageHeight);
       setTexture(2, ref, refWidth, refHeight);
+      buildMesh();
       setTextures = false;
 
       //      printf("Leaving setTextures... nCpts = %d\n", nCpts);
     }
 
   char name[128];
-  char title[128];
+  char title[512];
+  char stats[192];
+  AtlasPair *ap;
+  stats[0] = '\0';
+  if (haveAtlas && (ap = FindAtlasPair(&atlas, pairs[index].pairName)) != 0)
+    {
+      if (ap->summarized)
+	sprintf(stats, "  energy %.4f (corr %.4f dist %.4f)",
+		ap->energy, ap->correlation, ap->distortion);
+      if (ap->mapped)
+	sprintf(stats + strlen(stats), "  %.1f%% valid, mean c %.3f",
+		100.0 * ap->validFraction, ap->meanConfidence);
+    }
+  if (preview)
+    strcat(stats, "  (thumbnail)");
   if (mapName[0] != '\0')
     {
       switch (type)
@@ -591,10 +902,10 @@ MyWindow::draw ()
 	  sprintf(name, "image %s", pairs[index].refName);
 	  break;
 	}
-      sprintf(title, "%s Pair %s: %s   \n",
+      sprintf(title, "%s Pair %s: %s%s   \n",
 	      pairs[index].modified ? "**" : "  ",
 	      pairs[index].pairName,
-	      name);
+	      name, stats);
     }
   else
     {
@@ -611,35 +922,55 @@ MyWindow::draw ()
   label(title);
 
   glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-  glEnable(GL_TEXTURE_2D);
-  //  printf("type = %d, texture[type] = %d\n", type, (int) texture[type]);
-  glBindTexture(GL_TEXTURE_2D, texture[type]);
-  glBegin(GL_QUADS);
-  glTexCoord2f(0.0, 0.0);
-  //  glTexCoord2f(0.0, maxy);
-  glVertex2f(offsetX, h() - offsetY);
-  glTexCoord2f(maxx, 0.0);
-  //  glTexCoord2f(maxx, 1.0 - maxy);
-  glVertex2f(scale * displayWidth + offsetX,
-	     h() - offsetY);
-  glTexCoord2f(maxx, maxy);
-  //  glTexCoord2f(maxx, 1.0);
-  glVertex2f(scale * displayWidth + offsetX,
-	     h() - (scale * displayHeight + offsetY));
-  glTexCoord2f(0.0, maxy);
-  //  glTexCoord2f(0.0, 1.0);
-  glVertex2f(offsetX,
-	     h() - (scale * displayHeight + offsetY));
-  //  printf("quad: (%f %f) (%f %f) (%f %f) (%f %f)\noffsetX = %f offsetY = %f\nmaxx = %f maxy = %f\ntw = %d th = %d\n",
-  //	 offsetX, h() - offsetY,
-  //	 scale * displayWidth + offsetX, h() - offsetY,
-  //	 scale * displayWidth + offsetX, h() - (scale * displayHeight + offsetY),
-  //	 offsetX, h() - (scale * displayHeight + offsetY),
-  //	 offsetX, offsetY,
-  //	 maxx, maxy,
-  //	 textureWidth, textureHeight);
-  glEnd();
-  glDisable(GL_TEXTURE_2D);
+  if (lod)
+    drawTiles();
+  else if (type == 1)
+    {
+      glEnable(GL_TEXTURE_2D);
+      glBindTexture(GL_TEXTURE_2D, texture[2]);
+      if (gray)
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+      glPushMatrix();
+      glTranslatef(offsetX, h() - offsetY, 0.0);
+      glScalef(scale, -scale, 1.0);
+      glCallList(mesh);
+      glPopMatrix();
+      glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glDisable(GL_TEXTURE_2D);
+    }
+  else
+    {
+      glEnable(GL_TEXTURE_2D);
+      //  printf("type = %d, texture[type] = %d\n", type, (int) texture[type]);
+      glBindTexture(GL_TEXTURE_2D, texture[type]);
+      glBegin(GL_QUADS);
+      glTexCoord2f(0.0, 0.0);
+      //  glTexCoord2f(0.0, maxy);
+      glVertex2f(offsetX, h() - offsetY);
+      glTexCoord2f(maxx, 0.0);
+      //  glTexCoord2f(maxx, 1.0 - maxy);
+      glVertex2f(scale * displayWidth + offsetX,
+		 h() - offsetY);
+      glTexCoord2f(maxx, maxy);
+      //  glTexCoord2f(maxx, 1.0);
+      glVertex2f(scale * displayWidth + offsetX,
+		 h() - (scale * displayHeight + offsetY));
+      glTexCoord2f(0.0, maxy);
+      //  glTexCoord2f(0.0, 1.0);
+      glVertex2f(offsetX,
+		 h() - (scale * displayHeight + offsetY));
+      //  printf("quad: (%f %f) (%f %f) (%f %f) (%f %f)\noffsetX = %f offsetY = %f\nmaxx = %f maxy = %f\ntw = %d th = %d\n",
+      //	 offsetX, h() - offsetY,
+      //	 scale * displayWidth + offsetX, h() - offsetY,
+      //	 scale * displayWidth + offsetX, h() - (scale * displayHeight + offsetY),
+      //	 offsetX, h() - (scale * displayHeight + offsetY),
+      //	 offsetX, offsetY,
+      //	 maxx, maxy,
+      //	 textureWidth, textureHeight);
+      glEnd();
+      glDisable(GL_TEXTURE_2D);
+    }
 
   if (displayMap && type == 2)
     {
@@ -721,6 +1052,203 @@ MyWindow::draw ()
   glFlush();
 }
 
+/* drawTiles draws the tiles of the current image that are in view,
+   taking them from the level whose pixels are nearest to, but no
+   smaller than, a screen pixel; tiles of that level that are not yet
+   cached are requested from the reader threads, and until they
+   arrive the coarser cached levels show through */
+void
+MyWindow::drawTiles ()
+{
+  TileSource *src = &sources[type == 0 ? 0 : 1];
+  int minX, maxX, minY, maxY;
+  int vx0, vx1, vy0, vy1;
+  int level, lvl;
+  int spanX, spanY;
+  int tx, ty;
+  int xa, xb, ya, yb;
+  float s0, s1, t0, t1;
+  bool wanted;
+  TileKey key;
+  TileRequest req;
+  std::map<TileKey, Tile>::iterator t;
+  std::vector<std::pair<unsigned int, TileKey> > old;
+  char fn[PATH_MAX];
+
+  if (type == 0)
+    {
+      minX = imageMinX;
+      maxX = imageMaxX;
+      minY = imageMinY;
+      maxY = imageMaxY;
+    }
+  else
+    {
+      minX = refMinX;
+      maxX = refMaxX;
+      minY = refMinY;
+      maxY = refMaxY;
+    }
+
+  /* the part of the image that is in the window */
+  vx0 = max(minX, minX + (int) floor(-offsetX / scale));
+  vx1 = min(maxX + 1, minX + (int) ceil((w() - offsetX) / scale));
+  vy0 = max(minY, minY + (int) floor(-offsetY / scale));
+  vy1 = min(maxY + 1, minY + (int) ceil((h() - offsetY) / scale));
+
+  level = 0;
+  while (level < src->nLevels - 1 && scale * (2 << level) <= 1.0)
+    ++level;
+
+  ++frame;
+  pthread_mutex_lock(&tileLock);
+  if (drawnGeneration != tileGeneration)
+    {
+      /* a new pair has been loaded */
+      for (t = tiles.begin(); t != tiles.end(); ++t)
+	if (t->second.state == TILE_LOADED)
+	  glDeleteTextures(1, &t->second.texture);
+	else if (t->second.state == TILE_READ)
+	  free(t->second.pixels);
+      tiles.clear();
+      drawnGeneration = tileGeneration;
+    }
+
+  /* forget the requests of the previous frame that no reader has
+     started on; the ones still in view are made again below */
+  tileQueue.clear();
+  for (t = tiles.begin(); t != tiles.end(); )
+    if (t->second.state == TILE_QUEUED)
+      tiles.erase(t++);
+    else
+      ++t;
+
+  glEnable(GL_TEXTURE_2D);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (lvl = src->nLevels - 1; lvl >= level && vx0 < vx1 && vy0 < vy1; --lvl)
+    {
+      /* the number of full-resolution pixels a tile covers */
+      spanX = src->tileWidth << lvl;
+      spanY = src->tileHeight << lvl;
+      wanted = (lvl == level || lvl == src->nLevels - 1);
+      for (ty = vy0 / spanY; ty <= (vy1 - 1) / spanY; ++ty)
+	for (tx = vx0 / spanX; tx <= (vx1 - 1) / spanX; ++tx)
+	  {
+	    key.which = type;
+	    key.level = lvl;
+	    key.tx = tx;
+	    key.ty = ty;
+	    t = tiles.find(key);
+	    if (t == tiles.end())
+	      {
+		if (!wanted)
+		  continue;
+		Tile &tile = tiles[key];
+		tile.state = TILE_QUEUED;
+		tile.pixels = 0;
+		tile.texture = 0;
+		tile.lastUsed = frame;
+		req.key = key;
+		req.generation = tileGeneration;
+		if (pyramidName[0] != '\0')
+		  {
+		    sprintf(fn, "%s/%d/%s/%d/%d.jpg",
+			    pyramidName, lvl, src->name, ty, tx);
+		    req.fileName = fn;
+		  }
+		else
+		  req.fileName = src->name;
+		req.factor = 1 << lvl;
+		req.minX = tx * src->tileWidth;
+		req.maxX = req.minX + src->tileWidth - 1;
+		req.minY = ty * src->tileHeight;
+		req.maxY = req.minY + src->tileHeight - 1;
+		tileQueue.push_back(req);
+		continue;
+	      }
+	    Tile &tile = t->second;
+	    tile.lastUsed = frame;
+	    if (tile.state == TILE_READ)
+	      {
+		/* make the tile into a texture */
+		tile.textureWidth = 1;
+		while (tile.textureWidth < tile.width)
+		  tile.textureWidth <<= 1;
+		tile.textureHeight = 1;
+		while (tile.textureHeight < tile.height)
+		  tile.textureHeight <<= 1;
+		glGenTextures(1, &tile.texture);
+		glBindTexture(GL_TEXTURE_2D, tile.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE,
+			     tile.textureWidth, tile.textureHeight, 0,
+			     GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tile.width, tile.height,
+				GL_LUMINANCE, GL_UNSIGNED_BYTE, tile.pixels);
+		free(tile.pixels);
+		tile.pixels = 0;
+		tile.state = TILE_LOADED;
+	      }
+	    if (tile.state != TILE_LOADED)
+	      continue;
+
+	    /* draw the part of the tile that lies within the region */
+	    xa = max(tx * spanX, minX);
+	    xb = min(tx * spanX + (tile.width << lvl), maxX + 1);
+	    ya = max(ty * spanY, minY);
+	    yb = min(ty * spanY + (tile.height << lvl), maxY + 1);
+	    if (xa >= xb || ya >= yb)
+	      continue;
+	    s0 = ((float) (xa - tx * spanX)) / (tile.textureWidth << lvl);
+	    s1 = ((float) (xb - tx * spanX)) / (tile.textureWidth << lvl);
+	    t0 = ((float) (ya - ty * spanY)) / (tile.textureHeight << lvl);
+	    t1 = ((float) (yb - ty * spanY)) / (tile.textureHeight << lvl);
+	    glBindTexture(GL_TEXTURE_2D, tile.texture);
+	    glBegin(GL_QUADS);
+	    glTexCoord2f(s0, t0);
+	    glVertex2f(scale * (xa - minX) + offsetX,
+		       h() - (scale * (ya - minY) + offsetY));
+	    glTexCoord2f(s1, t0);
+	    glVertex2f(scale * (xb - minX) + offsetX,
+		       h() - (scale * (ya - minY) + offsetY));
+	    glTexCoord2f(s1, t1);
+	    glVertex2f(scale * (xb - minX) + offsetX,
+		       h() - (scale * (yb - minY) + offsetY));
+	    glTexCoord2f(s0, t1);
+	    glVertex2f(scale * (xa - minX) + offsetX,
+		       h() - (scale * (yb - minY) + offsetY));
+	    glEnd();
+	  }
+    }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glDisable(GL_TEXTURE_2D);
+  if (!tileQueue.empty())
+    pthread_cond_broadcast(&tileCond);
+
+  /* evict the tiles that have gone longest without being wanted */
+  if (tiles.size() > MAX_TILES)
+    {
+      for (t = tiles.begin(); t != tiles.end(); ++t)
+	if (t->second.lastUsed != frame && t->second.state != TILE_READING)
+	  old.push_back(std::make_pair(t->second.lastUsed, t->first));
+      std::sort(old.begin(), old.end());
+      for (size_t i = 0; i < old.size() && tiles.size() > MAX_TILES; ++i)
+	{
+	  t = tiles.find(old[i].second);
+	  if (t->second.state == TILE_LOADED)
+	    glDeleteTextures(1, &t->second.texture);
+	  else if (t->second.state == TILE_READ)
+	    free(t->second.pixels);
+	  tiles.erase(t);
+	}
+    }
+  pthread_mutex_unlock(&tileLock);
+}
+
 /*              LEFT           MIDDLE             RIGHT
 NONE           toggle          place_point        next image
 SHIFT          toggle/orig     remove_point       prev image   
@@ -755,7 +1283,13 @@ MyWindow::handle (int event)
 	    }
 	  else if (Fl::event_state() & FL_SHIFT)
 	    {
-	      if (mapName[0] != '\0')
+	      if (mapName[0] != '\0' && lod)
+		{
+		  /* there is no warped reference when paging in tiles */
+		  displayMap = !displayMap;
+		  type = 2;
+		}
+	      else if (mapName[0] != '\0')
 		{
 		  if (displayOriginal)
 		    displayMap = !displayMap;
@@ -929,7 +1463,7 @@ MyWindow::handle (int event)
 	  redraw();
 	  break;
 	case FL_RIGHT_MOUSE:
-	  if (mapName[0] != '\0')
+	  if (mapName[0] != '\0' && !lod)
 	    displayOriginal = false;
 	  if (Fl::event_state() & FL_SHIFT)
 	    {
@@ -944,6 +1478,7 @@ MyWindow::handle (int event)
 		index = max(index-1, 0);
 	      increment = -1;
 	      loadSection();
+	      prefetch();
 	      offsetX = 0.0;
 	      offsetY = 0.0;
 	      reshape();
@@ -962,6 +1497,7 @@ MyWindow::handle (int event)
 		index = min(index+1, nPairs-1);
 	      increment = 1;
 	      loadSection();
+	      prefetch();
 	      offsetX = 0.0;
 	      offsetY = 0.0;
 	      reshape();
@@ -1015,26 +1551,18 @@ void
 MyWindow::loadSection ()
 {
   int level;
-  int w, h;
   int n;
   int i;
   int x, y;
   float *warp;
   FILE *f;
   int refSection;
-  float rx, ry, rc;
-  int irx, iry;
-  float rrx, rry;
-  float r00, r01, r10, r11;
-  float rv;
   char fn[PATH_MAX];
   char tc;
   int m;
-  int b;
   float xv, yv;
   int ixv, iyv;
   float rx00, rx01, rx10, rx11, ry00, ry01, ry10, ry11;
-  int rw, rh;
   char errorMsg[PATH_MAX + 256];
   char imgn[PATH_MAX], refn[PATH_MAX];
   int iv;
@@ -1043,6 +1571,7 @@ MyWindow::loadSection ()
   int newImageMinX, newImageMaxX, newImageMinY, newImageMaxY;
   int newRefMinX, newRefMaxX, newRefMinY, newRefMaxY;
   int deltaX, deltaY, delta;
+  AtlasSection *imageThumb, *refThumb;
 
  retry:
   if (index < 0)
@@ -1050,14 +1579,24 @@ MyWindow::loadSection ()
       fprintf(stderr, "Could not find a valid image pair to display.\n");
       exit(1);
     }
+
+  /* a pair whose sections are both in the atlas is first shown from
+     their thumbnails, and read in full after previewDelay */
+  Fl::remove_timeout(LoadFullSection, this);
+  imageThumb = 0;
+  refThumb = 0;
+  preview = haveAtlas && !lod && !fullLoad && mapName[0] != '\0' &&
+    pairs[index].refName[0] != '\0' &&
+    (imageThumb = FindAtlasSection(&atlas, pairs[index].imageName)) != 0 &&
+    (refThumb = FindAtlasSection(&atlas, pairs[index].refName)) != 0;
   if (pairs[index].refName[0] != '\0')
-    printf("Loading sections %s and %s  (pair %s)  (%p %p %p %p)\n", pairs[index].imageName, pairs[index].refName,
+    printf("Loading sections %s and %s  (pair %s)  (%p %p %p)\n", pairs[index].imageName, pairs[index].refName,
 	   pairs[index].pairName,
-	   image, ref, warped,
+	   image, ref,
 	   map);
   else
-    printf("Loading section %s  (%p %p %p)\n", pairs[index].imageName,
-	   image, ref, warped);
+    printf("Loading section %s  (%p %p)\n", pairs[index].imageName,
+	   image, ref);
 
   if (image != 0)
     {
@@ -1069,10 +1608,13 @@ MyWindow::loadSection ()
       free(ref);
       ref = 0;
     }
-  if (warped != 0)
+  if (lod)
     {
-      free(warped);
-      warped = 0;
+      /* the cached tiles belong to the previous pair */
+      pthread_mutex_lock(&tileLock);
+      ++tileGeneration;
+      tileQueue.clear();
+      pthread_mutex_unlock(&tileLock);
     }
 
   /* read in the image */
@@ -1095,10 +1637,21 @@ MyWindow::loadSection ()
 
   sprintf(fn, "%s%s.%s", inputName, pairs[index].imageName, extension);
 #if 1
-  if (!ReadImage(fn, &image, &imageWidth, &imageHeight,
-		 imageMinX, imageMaxX,
-		 imageMinY, imageMaxY,
-		 errorMsg))
+  if (preview)
+    {
+      imageWidth = imageThumb->width;
+      imageHeight = imageThumb->height;
+    }
+  else if (lod ?
+      !OpenTileSource(&sources[0], pairs[index].imageName,
+		      &imageWidth, &imageHeight,
+		      imageMinX, imageMaxX,
+		      imageMinY, imageMaxY,
+		      errorMsg) :
+      !FetchImage(fn, &image, &imageWidth, &imageHeight,
+		  imageMinX, imageMaxX,
+		  imageMinY, imageMaxY,
+		  errorMsg))
     {
       if (partial)
 	{
@@ -1123,11 +1676,14 @@ MyWindow::loadSection ()
   printf("Image limits: %d %d %d %d\n",
 	 pairs[index].imageMinX, pairs[index].imageMaxX,
 	 pairs[index].imageMinY, pairs[index].imageMaxY);
-  for (y = 0; y < imageHeight; ++y)
-    for (x = 0; x < imageWidth; ++x)
-      if (image[y * imageWidth + x] > 0)
-	++count;
-  printf("Image is %f%% non-black.\n", ((double) count) * 100.0 / imageHeight / imageWidth);
+  if (!lod && !preview)
+    {
+      for (y = 0; y < imageHeight; ++y)
+	for (x = 0; x < imageWidth; ++x)
+	  if (image[y * imageWidth + x] > 0)
+	    ++count;
+      printf("Image is %f%% non-black.\n", ((double) count) * 100.0 / imageHeight / imageWidth);
+    }
 
 #endif
 
@@ -1157,10 +1713,21 @@ MyWindow::loadSection ()
     refMaxY = -1;
 
   sprintf(fn, "%s%s.%s", inputName, pairs[index].refName, extension);
-  if (!ReadImage(fn, &ref, &refWidth, &refHeight,
-		 refMinX, refMaxX,
-		 refMinY, refMaxY,
-		 errorMsg))
+  if (preview)
+    {
+      refWidth = refThumb->width;
+      refHeight = refThumb->height;
+    }
+  else if (lod ?
+      !OpenTileSource(&sources[1], pairs[index].refName,
+		      &refWidth, &refHeight,
+		      refMinX, refMaxX,
+		      refMinY, refMaxY,
+		      errorMsg) :
+      !FetchImage(fn, &ref, &refWidth, &refHeight,
+		  refMinX, refMaxX,
+		  refMinY, refMaxY,
+		  errorMsg))
     {
       if (partial)
 	{
@@ -1196,8 +1763,13 @@ MyWindow::loadSection ()
 
   /* read in the map */
   sprintf(fn, "%s%s.map", mapName, pairs[index].pairName);
-  if (!MyReadMap(fn, &map, &level, &mapWidth, &mapHeight,
-	       &mapOffsetX, &mapOffsetY, imgn, refn, errorMsg))
+  if (map != 0)
+    {
+      free(map);
+      map = 0;
+    }
+  if (!FetchMap(fn, &map, &level, &mapWidth, &mapHeight,
+		&mapOffsetX, &mapOffsetY, imgn, refn, errorMsg))
     {
       if (partial)
 	{
@@ -1213,80 +1785,14 @@ MyWindow::loadSection ()
   /* construct the inverse map */
   inverseMap = InvertMap(map, mapWidth, mapHeight);
 
-  /* compute the warped image */
+  /* the warped reference is drawn by warping the reference texture
+     with a mesh made from the map (see buildMesh) */
   mapFactor = (1 << level);
   printf("Set mapFactor to %d  (%d %d)\n", mapFactor, imageWidth, mapWidth);
-  h = imageHeight;
-  w = imageWidth;
-  rh = refHeight;
-  rw = refWidth;
   printf("image dim = (%d %d) imageMinX = %d  imageMinY = %d refMinX = %d refMinY = %d mapOffset = (%d %d)\n",
 	 imageWidth, imageHeight, imageMinX, imageMinY, refMinX, refMinY,
 	 mapOffsetX, mapOffsetY);
 
-  int npp = 0;
-  warped = (unsigned char *) malloc(imageWidth * imageHeight * sizeof(unsigned char));
-  memset(warped, 0, imageWidth * imageHeight * sizeof(unsigned char));
-  for (y = 0; y < h; ++y)
-    for (x = 0; x < w; ++x)
-      {
-	//	fmDebug = (y == 1000 && x == 3995);
-	if (!forwardmap(&rx, &ry, &rc,
-			(float) (x + imageMinX + 0.5) * baseReductionFactor,
-			(float) (y + imageMinY + 0.5) * baseReductionFactor))
-	  {
-	    if (fmDebug)
-	      printf("FMDEBUG pt skipped\n");
-	    continue;
-	  }
-	if (fmDebug)
-	  printf("FMDEBUG pt %d %d %f %f\n",
-		 x, y, rx, ry);
-	if (x == 0 && y == 0)
-	  {
-	    printf("computed fwd map of (0, 0) to be %f %f\n",
-		   rx, ry);
-	  }
-	rx = rx / baseReductionFactor - refMinX - 0.5;
-	ry = ry / baseReductionFactor - refMinY - 0.5;
-	irx = (int) floor(rx);
-	iry = (int) floor(ry);
-	rrx = rx - irx;
-	rry = ry - iry;
-	if (x == 0 && y == 0)
-	  {
-	    printf("irx,y (%d %d) rrx,y (%f %f)\n",
-		   irx, iry, rrx, rry);
-	  }
-	r00 = RIMAGE(ref, irx, iry);
-	r01 = RIMAGE(ref, irx, iry + 1);
-	r10 = RIMAGE(ref, irx + 1, iry);
-	r11 = RIMAGE(ref, irx + 1, iry + 1);
-	rv = r00 * (rrx - 1.0) * (rry - 1.0)
-	  - r10 * rrx * (rry - 1.0) 
-	  - r01 * (rrx - 1.0) * rry
-	  + r11 * rrx * rry;
-	if (gray)
-	  {
-	    if (rc == 0.0)
-	      b = 0;
-	    else
-	      b = (int) ((0.5 + 0.5 * rc) * rv);
-	  }
-	else
-	  {
-	    if (rc == 0.0)
-	      b = 0;
-	    else
-	      b = (int) rv;
-	  }
-	if (b < 0)
-	  b = 0;
-	else if (b > 255)
-	  b = 255;
-	warped[y * w + x] = b;
-      }
-  //  printf("warped[70, 200] set to %d\n", warped[200*w+70]);
 
   // read in the correspondence points
   nCpts = 0;
@@ -1328,6 +1834,16 @@ MyWindow::loadSection ()
       fclose(f);
     }
 
+  if (preview)
+    {
+      image = ThumbnailRegion(imageThumb,
+			      &imageMinX, &imageMaxX, &imageMinY, &imageMaxY,
+			      &imageWidth, &imageHeight);
+      ref = ThumbnailRegion(refThumb,
+			    &refMinX, &refMaxX, &refMinY, &refMaxY,
+			    &refWidth, &refHeight);
+    }
+
   displayWidth = max(imageWidth, refWidth);
   displayHeight = max(imageHeight, refHeight);
 
@@ -1335,7 +1851,9 @@ MyWindow::loadSection ()
   if (((float) availableHeight) / displayHeight < scale)
     scale = ((float) availableHeight) / displayHeight;
   reductionFactor = baseReductionFactor;
-  while (scale <= 0.5)
+  if (preview)
+    reductionFactor *= atlas.factor;
+  while (!lod && scale <= 0.5)
     {
       // reduce the resolution by a factor of 2
       reductionFactor *= 2;
@@ -1359,12 +1877,6 @@ MyWindow::loadSection ()
 	    iv += image[(2*y+1)*imageWidth + 2*x + delta];
 	    iv += image[(2*y+1)*imageWidth + 2*x + 1 + delta];
 	    image[y*nw+x] = (iv + 2) >> 2;
-
-	    iv = warped[2*y*imageWidth + 2*x + delta];
-	    iv += warped[2*y*imageWidth + 2*x + 1 + delta];
-	    iv += warped[(2*y+1)*imageWidth + 2*x + delta];
-	    iv += warped[(2*y+1)*imageWidth + 2*x + 1 + delta];
-	    warped[y*nw+x] = (iv + 2) >> 2;
 	  }
       imageWidth = nw;
       imageHeight = nh;
@@ -1373,7 +1885,6 @@ MyWindow::loadSection ()
       imageMinY = newImageMinY;
       imageMaxY = newImageMaxY;
       image = (unsigned char *) realloc(image, imageHeight*imageWidth);
-      warped = (unsigned char *) realloc(warped, imageHeight*imageWidth);
 
       newRefMinX = (refMinX + 1) / 2;
       newRefMaxX = (refMaxX - 1) / 2;
@@ -1417,9 +1928,110 @@ MyWindow::loadSection ()
   lastIndex = index;
   sectionsLoaded = true;
   setTextures = true;
+  if (preview)
+    Fl::add_timeout(previewDelay, LoadFullSection, this);
   //  printf("Leaving loadSection... nCpts = %d\n", nCpts);
 }
 
+/* loadFullSection replaces the thumbnails of a previewed pair with the
+   full sections, keeping the points marked on the preview */
+void
+MyWindow::loadFullSection ()
+{
+  if (!preview)
+    return;
+  saveSection();
+  fullLoad = true;
+  loadSection();
+  fullLoad = false;
+  reshape();
+  redraw();
+}
+
+void
+LoadFullSection (void *w)
+{
+  ((MyWindow *) w)->loadFullSection();
+}
+
+/* ThumbnailRegion returns the part of the thumbnail of section s that
+   covers the region minX..maxX, minY..maxY of the section, with the
+   bounds reduced by the atlas factor as loadSection halves them, and
+   sets the bounds and the size of the part to match */
+unsigned char *
+ThumbnailRegion (AtlasSection *s,
+		 int *minX, int *maxX, int *minY, int *maxY,
+		 int *width, int *height)
+{
+  int f;
+  int y;
+  unsigned char *p;
+
+  for (f = 1; f < atlas.factor; f *= 2)
+    {
+      *minX = (*minX + 1) / 2;
+      *maxX = (*maxX - 1) / 2;
+      *minY = (*minY + 1) / 2;
+      *maxY = (*maxY - 1) / 2;
+    }
+  *maxX = min(*maxX, s->thumbWidth - 1);
+  *minX = min(*minX, *maxX);
+  *maxY = min(*maxY, s->thumbHeight - 1);
+  *minY = min(*minY, *maxY);
+  *width = *maxX - *minX + 1;
+  *height = *maxY - *minY + 1;
+  p = (unsigned char *) malloc(*width * *height);
+  for (y = 0; y < *height; ++y)
+    memcpy(&p[y * *width],
+	   &s->thumbnail[(*minY + y) * s->thumbWidth + *minX],
+	   *width);
+  return(p);
+}
+
+/* prefetch asks for the pairs on either side of the current one to be
+   read in the background, those in the direction the user is moving
+   first */
+void
+MyWindow::prefetch ()
+{
+  int i, j, k;
+  char fn[PATH_MAX];
+
+  if (prefetchPairs == 0)
+    return;
+  BeginPrefetchRound();
+  for (i = 0; i <= 2 * prefetchPairs; ++i)
+    {
+      k = (i + 1) / 2;
+      j = (i & 1) ? index + k * increment : index - k * increment;
+      if (j < 0 || j >= nPairs)
+	continue;
+      if (!lod)
+	{
+	  sprintf(fn, "%s%s.%s", inputName, pairs[j].imageName, extension);
+	  PrefetchImage(fn,
+			pairs[j].imageMinX >= 0 ? pairs[j].imageMinX / baseReductionFactor : -1,
+			pairs[j].imageMaxX >= 0 ? pairs[j].imageMaxX / baseReductionFactor : -1,
+			pairs[j].imageMinY >= 0 ? pairs[j].imageMinY / baseReductionFactor : -1,
+			pairs[j].imageMaxY >= 0 ? pairs[j].imageMaxY / baseReductionFactor : -1);
+	  if (pairs[j].refName[0] != '\0')
+	    {
+	      sprintf(fn, "%s%s.%s", inputName, pairs[j].refName, extension);
+	      PrefetchImage(fn,
+			    pairs[j].refMinX >= 0 ? pairs[j].refMinX / baseReductionFactor : -1,
+			    pairs[j].refMaxX >= 0 ? pairs[j].refMaxX / baseReductionFactor : -1,
+			    pairs[j].refMinY >= 0 ? pairs[j].refMinY / baseReductionFactor : -1,
+			    pairs[j].refMaxY >= 0 ? pairs[j].refMaxY / baseReductionFactor : -1);
+	    }
+	}
+      if (mapName[0] != '\0' && pairs[j].refName[0] != '\0')
+	{
+	  sprintf(fn, "%s%s.map", mapName, pairs[j].pairName);
+	  PrefetchMap(fn);
+	}
+    }
+}
+
 void
 MyWindow::saveSection ()
 {
@@ -1555,6 +2167,49 @@ MyWindow::setTexture (unsigned int type, unsigned char *image, int w, int h)
   free(img);
 }
 
+/* buildMesh makes the display list that draws the warped reference:
+   each quad of valid map nodes is drawn over the image pixels the
+   nodes sit on, textured with the part of the reference the nodes
+   map to, so that OpenGL interpolates the map between them; with
+   gray, each node is dimmed by its correlation as well */
+void
+MyWindow::buildMesh ()
+{
+  int x, y;
+  int i;
+  int dx, dy;
+  MapElement *e;
+
+  if (mesh == 0)
+    mesh = glGenLists(1);
+  glNewList(mesh, GL_COMPILE);
+  if (map != 0 && mapName[0] != '\0' && !lod)
+    {
+      glBegin(GL_QUADS);
+      for (y = 0; y < mapHeight-1; ++y)
+	for (x = 0; x < mapWidth-1; ++x)
+	  {
+	    if (MAP(map, x, y).c == 0.0 || MAP(map, x+1, y).c == 0.0 ||
+		MAP(map, x, y+1).c == 0.0 || MAP(map, x+1, y+1).c == 0.0)
+	      continue;
+	    for (i = 0; i < 4; ++i)
+	      {
+		dx = (i == 1 || i == 2);
+		dy = (i >= 2);
+		e = &MAP(map, x + dx, y + dy);
+		if (gray)
+		  glColor3f(0.5 + 0.5 * e->c, 0.5 + 0.5 * e->c, 0.5 + 0.5 * e->c);
+		glTexCoord2f((e->x * mapFactor / reductionFactor - refMinX) / textureWidth,
+			     (e->y * mapFactor / reductionFactor - refMinY) / textureHeight);
+		glVertex2f(((float) (x + dx + mapOffsetX)) * mapFactor / reductionFactor - imageMinX,
+			   ((float) (y + dy + mapOffsetY)) * mapFactor / reductionFactor - imageMinY);
+	      }
+	  }
+      glEnd();
+    }
+  glEndList();
+}
+
 bool
 MyWindow::backmap (float *wrx, float *wry, float x, float y)
 {
@@ -34,6 +34,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include "invert.h"
 #include "imio.h"
 
@@ -48,33 +51,42 @@ BilinearInvert (float *pAlpha, float *pBeta, float u1, float u2,
 		float x1, float x2, float y1, float y2,
 		float z1, float z2, float w1, float w2);
 
+/* the work of one thread building an InverseMap */
+typedef struct InvertThread {
+  InverseMap *inverseMap;
+  int startY, endY;	/* the rows of map quads (or grid points) to do */
+  int minRow, maxRow;	/* the rows of the table held in table */
+  InverseMapElement *table;  /* bounding boxes for those rows */
+  MapElement *grid;	/* the grid being filled in */
+  int started;		/* if 1, the work is being done in thread */
+  pthread_t thread;
+} InvertThread;
+
+static void EnterQuads (InverseMap *inverseMap, int nThreads);
+static void *EnterQuadsMain (void *arg);
+static void EnterQuad (InvertThread *it, int x, int y);
+static void BuildInverseGrid (InverseMap *inverseMap, int nThreads);
+static void *GridPointsMain (void *arg);
+
 InverseMap*
 InvertMap (MapElement *map, int nx, int ny)
+{
+  return(InvertMapThreads(map, nx, ny, 1));
+}
+
+InverseMap*
+InvertMapThreads (MapElement *map, int nx, int ny, int nThreads)
 {
   float xMin, xMax, yMin, yMax;
   InverseMap *inverseMap;
   InverseMapElement *e;
   int x, y;
   float xv, yv, cv;
-  int minX, maxX, minY, maxY;
   float area;
   float scale;
   int nxp, nyp;
-  int nxm1, nym1;
-  int ix, iy;
-  float alpha, beta;
-  int overlap;
-  float pxv, pyv;
-  float xvp, yvp;
-  float pxvp, pyvp;
-  int tx, ty;
-  int corner;
-  int side;
-  float den;
-  float ua, ub;
   int n;
   int maxElements;
-  int incomplete;
 
   /* allocate the map */
   inverseMap = (InverseMap*) malloc(sizeof(InverseMap));
@@ -141,52 +153,411 @@ InvertMap (MapElement *map, int nx, int ny)
       }
 
   /* set table entries */
-  nym1 = ny - 1;
-  nxm1 = nx - 1;
-  for (y = 0; y < nym1; ++y)
-    for (x = 0; x < nxm1; ++x)
+  EnterQuads(inverseMap, nThreads);
+
+  e = inverseMap->inverseMap;
+  maxElements = 1;
+  for (y = 0; y < nyp; ++y)
+    for (x = 0; x < nxp; ++x)
       {
-	minX = 1000000000;
-	minY = 1000000000;
-	maxX = -1000000000;
-	maxY = -1000000000;
-	incomplete = 0;
-	for (corner = 0; corner < 4; ++corner)
+	if (e->minX <= e->maxX)
+	  {
+	    n = (e->maxX - e->minX + 1) * (e->maxY - e->minY + 1);
+	    if (n > maxElements)
+	      maxElements = n;
+	  }
+	++e;
+      }
+#if DEBUG
+  printf("maxElements = %d\n", maxElements);
+#endif
+  inverseMap->tried = (long long*) malloc(maxElements * sizeof(long long));
+  inverseMap->maxTried = maxElements;
+  inverseMap->marked = (unsigned char *) malloc(nx * ny * sizeof(unsigned char));
+  memset(inverseMap->marked, 0, nx * ny * sizeof(unsigned char));
+  inverseMap->lastX = 0;
+  inverseMap->lastY = 0;
+  inverseMap->shared = 0;
+  inverseMap->grid = NULL;
+  inverseMap->irregular = NULL;
+  BuildInverseGrid(inverseMap, nThreads);
+  return(inverseMap);
+}
+
+/* EnterQuads fills in the bounding boxes of the table, splitting the
+   rows of map quads among nThreads threads; each thread collects
+   the boxes for just the table rows its quads can reach, and these
+   are merged into the table at the end */
+static void
+EnterQuads (InverseMap *inverseMap, int nThreads)
+{
+  InvertThread it;
+  InvertThread *its;
+  InverseMapElement *e, *te;
+  int nyq;
+  int nxp;
+  int i;
+  int x, y;
+
+  nyq = inverseMap->ny - 1;
+  if (nThreads > nyq)
+    nThreads = nyq;
+  if (nThreads <= 1)
+    {
+      it.inverseMap = inverseMap;
+      it.startY = 0;
+      it.endY = nyq;
+      it.minRow = 0;
+      it.maxRow = inverseMap->nyp - 1;
+      it.table = inverseMap->inverseMap;
+      EnterQuadsMain(&it);
+      return;
+    }
+
+  its = (InvertThread*) malloc(nThreads * sizeof(InvertThread));
+  for (i = 0; i < nThreads; ++i)
+    {
+      its[i].inverseMap = inverseMap;
+      its[i].startY = i * nyq / nThreads;
+      its[i].endY = (i + 1) * nyq / nThreads;
+      its[i].table = NULL;
+      its[i].started = 1;
+    }
+  for (i = 0; i < nThreads; ++i)
+    if (pthread_create(&(its[i].thread), NULL, EnterQuadsMain, &its[i]) != 0)
+      {
+	its[i].started = 0;
+	EnterQuadsMain(&its[i]);
+      }
+
+  nxp = inverseMap->nxp;
+  for (i = 0; i < nThreads; ++i)
+    {
+      if (its[i].started)
+	pthread_join(its[i].thread, NULL);
+      for (y = its[i].minRow; y <= its[i].maxRow; ++y)
+	for (x = 0; x < nxp; ++x)
+	  {
+	    te = &(its[i].table[(y - its[i].minRow) * nxp + x]);
+	    if (te->minX > te->maxX)
+	      continue;
+	    e = &(inverseMap->inverseMap[y * nxp + x]);
+	    if (te->minX < e->minX)
+	      e->minX = te->minX;
+	    if (te->maxX > e->maxX)
+	      e->maxX = te->maxX;
+	    if (te->minY < e->minY)
+	      e->minY = te->minY;
+	    if (te->maxY > e->maxY)
+	      e->maxY = te->maxY;
+	  }
+      free(its[i].table);
+    }
+  free(its);
+}
+
+static void *
+EnterQuadsMain (void *arg)
+{
+  InvertThread *it = (InvertThread *) arg;
+  InverseMap *inverseMap = it->inverseMap;
+  MapElement *map = inverseMap->map;
+  int nx = inverseMap->nx;
+  int nyp = inverseMap->nyp;
+  int x, y;
+  int iy;
+  size_t n, i;
+
+  if (it->table == NULL)
+    {
+      /* find which table rows the corners of these quads fall in */
+      it->minRow = nyp;
+      it->maxRow = -1;
+      for (y = it->startY; y <= it->endY; ++y)
+	for (x = 0; x < nx; ++x)
+	  {
+	    if (map[y*nx + x].c == 0.0)
+	      continue;
+	    iy = floor((map[y*nx + x].y - inverseMap->yMin) / inverseMap->scale);
+	    if (iy >= nyp)
+	      iy = nyp-1;
+	    if (iy < it->minRow)
+	      it->minRow = iy;
+	    if (iy > it->maxRow)
+	      it->maxRow = iy;
+	  }
+      if (it->minRow > it->maxRow)
+	return(NULL);
+      n = ((size_t) (it->maxRow - it->minRow + 1)) * inverseMap->nxp;
+      it->table = (InverseMapElement*) malloc(n * sizeof(InverseMapElement));
+      for (i = 0; i < n; ++i)
+	{
+	  it->table[i].minX = 1000000000;
+	  it->table[i].maxX = -1000000000;
+	  it->table[i].minY = 1000000000;
+	  it->table[i].maxY = -1000000000;
+	}
+    }
+
+  for (y = it->startY; y < it->endY; ++y)
+    for (x = 0; x < nx - 1; ++x)
+      EnterQuad(it, x, y);
+  return(NULL);
+}
+
+/* EnterQuad adds the map quadrilateral with upper left corner (x, y)
+   to the bounding boxes of all table squares it overlaps */
+static void
+EnterQuad (InvertThread *it, int x, int y)
+{
+  InverseMap *inverseMap = it->inverseMap;
+  MapElement *map = inverseMap->map;
+  int nx = inverseMap->nx;
+  int nxp = inverseMap->nxp;
+  int nyp = inverseMap->nyp;
+  float xMin = inverseMap->xMin;
+  float yMin = inverseMap->yMin;
+  float scale = inverseMap->scale;
+  InverseMapElement *e;
+  float xv, yv, cv;
+  int minX, maxX, minY, maxY;
+  int ix, iy;
+  float alpha, beta;
+  int overlap;
+  float pxv, pyv;
+  float xvp, yvp;
+  float pxvp, pyvp;
+  int tx, ty;
+  int corner;
+  int side;
+  float den;
+  float ua, ub;
+  int incomplete;
+
+  minX = 1000000000;
+  minY = 1000000000;
+  maxX = -1000000000;
+  maxY = -1000000000;
+  incomplete = 0;
+  for (corner = 0; corner < 4; ++corner)
+    {
+      switch (corner)
+	{
+	case 0:
+	  xv = map[y*nx + x].x;
+	  yv = map[y*nx + x].y;
+	  cv = map[y*nx + x].c;
+	  break;
+	case 1:
+	  xv = map[y*nx + x + 1].x;
+	  yv = map[y*nx + x + 1].y;
+	  cv = map[y*nx + x + 1].c;
+	  break;
+	case 2:
+	  xv = map[(y+1)*nx + x + 1].x;
+	  yv = map[(y+1)*nx + x + 1].y;
+	  cv = map[(y+1)*nx + x + 1].c;
+	  break;
+	case 3:
+	  xv = map[(y+1)*nx + x].x;
+	  yv = map[(y+1)*nx + x].y;
+	  cv = map[(y+1)*nx + x].c;
+	  break;
+	}
+      if (cv == 0.0)
+	{
+	  incomplete = 1;
+	  break;
+	}
+      ix = floor((xv - xMin) / scale);
+      iy = floor((yv - yMin) / scale);
+      if (ix >= nxp)
+	ix = nxp-1;
+      if (iy >= nyp)
+	iy = nyp-1;
+      if (ix < minX)
+	minX = ix;
+      if (ix > maxX)
+	maxX = ix;
+      if (iy < minY)
+	minY = iy;
+      if (iy > maxY)
+	maxY = iy;
+    }
+  if (incomplete)
+    return;
+  for (ty = minY; ty <= maxY; ++ty)
+    for (tx = minX; tx <= maxX; ++tx)
+      // for (ty = minY; ty < maxY; ++ty)
+      //	  for (tx = minX; tx < maxX; ++tx)
+      {
+	/* check for overlap between quadrilateral and square */
+
+	/* first check if the center of the square lies within
+	   the quadrilateral */
+	xv = scale * (tx + 0.5) + xMin;
+	yv = scale * (ty + 0.5) + yMin;
+	overlap = 0;
+	if (BilinearInvert(&alpha, &beta, xv, yv,
+			   map[y*nx + x].x, map[y*nx + x].y,
+			   map[(y+1)*nx + x].x, map[(y+1)*nx + x].y,
+			   map[(y+1)*nx + (x+1)].x, map[(y+1)*nx + (x+1)].y,
+			   map[y*nx + (x+1)].x, map[y*nx + (x+1)].y))
+	  overlap = 1;
+
+	pxv = map[(y+1)*nx + x].x;
+	pyv = map[(y+1)*nx + x].y;
+	for (corner = 0; corner < 4 && !overlap; ++corner)
 	  {
 	    switch (corner)
 	      {
 	      case 0:
 		xv = map[y*nx + x].x;
 		yv = map[y*nx + x].y;
-		cv = map[y*nx + x].c;
 		break;
 	      case 1:
 		xv = map[y*nx + x + 1].x;
 		yv = map[y*nx + x + 1].y;
-		cv = map[y*nx + x + 1].c;
 		break;
 	      case 2:
 		xv = map[(y+1)*nx + x + 1].x;
 		yv = map[(y+1)*nx + x + 1].y;
-		cv = map[(y+1)*nx + x + 1].c;
 		break;
 	      case 3:
 		xv = map[(y+1)*nx + x].x;
 		yv = map[(y+1)*nx + x].y;
-		cv = map[(y+1)*nx + x].c;
 		break;
 	      }
-	    if (cv == 0.0)
+	    pxvp = tx * scale + xMin;
+	    pyvp = ty * scale + yMin;
+	    for (side = 0; side < 4 && !overlap; ++side)
 	      {
-		incomplete = 1;
+		switch (side)
+		  {
+		  case 0:
+		    xvp = (tx + 1) * scale + xMin;
+		    yvp = pyvp;
+		    break;
+		  case 1:
+		    yvp = (ty + 1) * scale + yMin;
+		    break;
+		  case 2:
+		    xvp = tx * scale + xMin;
+		    break;
+		  case 3:
+		    yvp = ty * scale + yMin;
+		    break;
+		  }
+		den = (yvp - pyvp) * (xv - pxv) - (xvp - pxvp) * (yv - pyv);
+		if (den < -1.0e-15 || den > 1.0e-15)
+		  {
+		    ua = ((xvp - pxvp) * (pyv - pyvp) - (yvp - pyvp) * (pxv - pxvp)) / den;
+		    ub = ((xv - pxv) * (pyv - pyvp) - (yv - pyv) * (pxv - pxvp)) / den;
+		    overlap = (ua >= 0.0) && (ua <= 1.0) && (ub >= 0.0) && (ub <= 1.0);
+		  }
+		pxvp = xvp;
+		pyvp = yvp;
+	      }
+	    pxv = xv;
+	    pyv = yv;
+	  }
+	if (overlap)
+	  {
+	    if (ty < 0 || ty >= nyp || tx < 0 || tx >= nxp)
+	      abort();
+	    e = &(it->table[(ty - it->minRow) * nxp + tx]);
+	    if (x < e->minX)
+	      e->minX = x;
+	    if (x > e->maxX)
+	      e->maxX = x;
+	    if (y < e->minY)
+	      e->minY = y;
+	    if (y > e->maxY)
+	      e->maxY = y;
+	  }
+      }
+}
+
+/* BuildInverseGrid finds the inverse at each corner of the table squares
+   so that Invert can interpolate them to go straight to the right
+   MapElement; squares that touch an undefined corner, or whose corners
+   map back more than one MapElement apart (as happens near folds and
+   edges), are marked irregular and are left to the search */
+static void
+BuildInverseGrid (InverseMap *inverseMap, int nThreads)
+{
+  int nxp, nyp;
+  int x, y;
+  int i;
+  MapElement *g;
+  MapElement *corner[4];
+  int minX, maxX, minY, maxY;
+  int ix, iy;
+  InvertThread it;
+  InvertThread *its;
+
+  nxp = inverseMap->nxp;
+  nyp = inverseMap->nyp;
+  g = (MapElement*) malloc((nxp + 1) * (nyp + 1) * sizeof(MapElement));
+
+  /* the grid points are found by searching, so split their rows
+     among threads, each with its own search state */
+  if (nThreads > nyp + 1)
+    nThreads = nyp + 1;
+  if (nThreads <= 1)
+    {
+      it.inverseMap = inverseMap;
+      it.startY = 0;
+      it.endY = nyp + 1;
+      it.grid = g;
+      GridPointsMain(&it);
+    }
+  else
+    {
+      its = (InvertThread*) malloc(nThreads * sizeof(InvertThread));
+      for (i = 0; i < nThreads; ++i)
+	{
+	  its[i].inverseMap = ShareInverseMap(inverseMap);
+	  its[i].startY = i * (nyp + 1) / nThreads;
+	  its[i].endY = (i + 1) * (nyp + 1) / nThreads;
+	  its[i].grid = g;
+	  its[i].started = 1;
+	}
+      for (i = 0; i < nThreads; ++i)
+	if (pthread_create(&(its[i].thread), NULL, GridPointsMain, &its[i]) != 0)
+	  {
+	    its[i].started = 0;
+	    GridPointsMain(&its[i]);
+	  }
+      for (i = 0; i < nThreads; ++i)
+	{
+	  if (its[i].started)
+	    pthread_join(its[i].thread, NULL);
+	  FreeInverseMap(its[i].inverseMap);
+	}
+      free(its);
+    }
+
+  inverseMap->irregular = (unsigned char *) malloc(nxp * nyp * sizeof(unsigned char));
+  for (y = 0; y < nyp; ++y)
+    for (x = 0; x < nxp; ++x)
+      {
+	corner[0] = &g[y*(nxp+1) + x];
+	corner[1] = corner[0] + 1;
+	corner[2] = corner[0] + nxp + 1;
+	corner[3] = corner[2] + 1;
+	minX = minY = 1000000000;
+	maxX = maxY = -1000000000;
+	inverseMap->irregular[y*nxp + x] = 0;
+	for (i = 0; i < 4; ++i)
+	  {
+	    if (corner[i]->c == 0.0)
+	      {
+		inverseMap->irregular[y*nxp + x] = 1;
 		break;
 	      }
-	    ix = floor((xv - xMin) / scale);
-	    iy = floor((yv - yMin) / scale);
-	    if (ix >= nxp)
-	      ix = nxp-1;
-	    if (iy >= nyp)
-	      iy = nyp-1;
+	    ix = (int) floor(corner[i]->x);
+	    iy = (int) floor(corner[i]->y);
 	    if (ix < minX)
 	      minX = ix;
 	    if (ix > maxX)
@@ -196,120 +567,73 @@ InvertMap (MapElement *map, int nx, int ny)
 	    if (iy > maxY)
 	      maxY = iy;
 	  }
-	if (incomplete)
-	  continue;
-	for (ty = minY; ty <= maxY; ++ty)
-	  for (tx = minX; tx <= maxX; ++tx)
-	    // for (ty = minY; ty < maxY; ++ty)
-	    //	  for (tx = minX; tx < maxX; ++tx)
-	    {
-	      /* check for overlap between quadrilateral and square */
-	      
-	      /* first check if the center of the square lies within
-		 the quadrilateral */
-	      xv = scale * (tx + 0.5) + xMin;
-	      yv = scale * (ty + 0.5) + yMin;
-	      overlap = 0;
-	      if (BilinearInvert(&alpha, &beta, xv, yv,
-				 map[y*nx + x].x, map[y*nx + x].y,
-				 map[(y+1)*nx + x].x, map[(y+1)*nx + x].y,
-				 map[(y+1)*nx + (x+1)].x, map[(y+1)*nx + (x+1)].y,
-				 map[y*nx + (x+1)].x, map[y*nx + (x+1)].y))
-		overlap = 1;
-
-	      pxv = map[(y+1)*nx + x].x;
-	      pyv = map[(y+1)*nx + x].y;
-	      for (corner = 0; corner < 4 && !overlap; ++corner)
-		{
-		  switch (corner)
-		    {
-		    case 0:
-		      xv = map[y*nx + x].x;
-		      yv = map[y*nx + x].y;
-		      break;
-		    case 1:
-		      xv = map[y*nx + x + 1].x;
-		      yv = map[y*nx + x + 1].y;
-		      break;
-		    case 2:
-		      xv = map[(y+1)*nx + x + 1].x;
-		      yv = map[(y+1)*nx + x + 1].y;
-		      break;
-		    case 3:
-		      xv = map[(y+1)*nx + x].x;
-		      yv = map[(y+1)*nx + x].y;
-		      break;
-		    }
-		  pxvp = tx * scale + xMin;
-		  pyvp = ty * scale + yMin;
-		  for (side = 0; side < 4 && !overlap; ++side)
-		    {
-		      switch (side)
-			{
-			case 0:
-			  xvp = (tx + 1) * scale + xMin;
-			  yvp = pyvp;
-			  break;
-			case 1:
-			  yvp = (ty + 1) * scale + yMin;
-			  break;
-			case 2:
-			  xvp = tx * scale + xMin;
-			  break;
-			case 3:
-			  yvp = ty * scale + yMin;
-			  break;
-			}
-		      den = (yvp - pyvp) * (xv - pxv) - (xvp - pxvp) * (yv - pyv);
-		      if (den < -1.0e-15 || den > 1.0e-15)
-			{
-			  ua = ((xvp - pxvp) * (pyv - pyvp) - (yvp - pyvp) * (pxv - pxvp)) / den;
-			  ub = ((xv - pxv) * (pyv - pyvp) - (yv - pyv) * (pxv - pxvp)) / den;
-			  overlap = (ua >= 0.0) && (ua <= 1.0) && (ub >= 0.0) && (ub <= 1.0);
-			}
-		      pxvp = xvp;
-		      pyvp = yvp;
-		    }
-		  pxv = xv;
-		  pyv = yv;
-		}
-	      if (overlap)
-		{
-		  if (ty < 0 || ty >= nyp || tx < 0 || tx >= nxp)
-		    abort();
-		  e = &(inverseMap->inverseMap[ty * nxp + tx]);
-		  if (x < e->minX)
-		    e->minX = x;
-		  if (x > e->maxX)
-		    e->maxX = x;
-		  if (y < e->minY)
-		    e->minY = y;
-		  if (y > e->maxY)
-		    e->maxY = y;
-		}
-	    }
+	if (maxX - minX > 1 || maxY - minY > 1)
+	  inverseMap->irregular[y*nxp + x] = 1;
       }
+  inverseMap->grid = g;
+}
 
-  e = inverseMap->inverseMap;
-  maxElements = 1;
-  for (y = 0; y < nyp; ++y)
-    for (x = 0; x < nxp; ++x)
+static void *
+GridPointsMain (void *arg)
+{
+  InvertThread *it = (InvertThread *) arg;
+  InverseMap *inverseMap = it->inverseMap;
+  int nxp = inverseMap->nxp;
+  MapElement *g;
+  int x, y;
+  float xv, yv;
+
+  for (y = it->startY; y < it->endY; ++y)
+    for (x = 0; x <= nxp; ++x)
       {
-	if (e->minX <= e->maxX)
+	g = &(it->grid[y*(nxp+1) + x]);
+	if (Invert(inverseMap, &xv, &yv,
+		   inverseMap->xMin + x * inverseMap->scale,
+		   inverseMap->yMin + y * inverseMap->scale))
 	  {
-	    n = (e->maxX - e->minX + 1) * (e->maxY - e->minY + 1);
-	    if (n > maxElements)
-	      maxElements = n;
+	    g->x = xv;
+	    g->y = yv;
+	    g->c = 1.0;
+	  }
+	else
+	  {
+	    g->x = 0.0;
+	    g->y = 0.0;
+	    g->c = 0.0;
 	  }
-	++e;
       }
-#if DEBUG
-  printf("maxElements = %d\n", maxElements);
-#endif
-  inverseMap->tried = (long long*) malloc(maxElements * sizeof(long long));
-  inverseMap->marked = (unsigned char *) malloc(nx * ny * sizeof(unsigned char));
-  memset(inverseMap->marked, 0, nx * ny * sizeof(unsigned char));
-  return(inverseMap);
+  return(NULL);
+}
+
+InverseMap*
+ShareInverseMap (InverseMap *inverseMap)
+{
+  static unsigned short nShared = 0;
+  InverseMap *im;
+  int nx, ny;
+
+  im = (InverseMap*) malloc(sizeof(InverseMap));
+  *im = *inverseMap;
+  nx = inverseMap->nx;
+  ny = inverseMap->ny;
+  im->tried = (long long*) malloc(inverseMap->maxTried * sizeof(long long));
+  im->marked = (unsigned char *) malloc(nx * ny * sizeof(unsigned char));
+  memset(im->marked, 0, nx * ny * sizeof(unsigned char));
+  im->shared = 1;
+  im->xsubi[0] = 0x330e;
+  im->xsubi[1] = ++nShared;
+  im->xsubi[2] = 0;
+  return(im);
+}
+
+/* shared InverseMaps draw from their own random state so that they
+   can be used from different threads */
+static double
+RandomFraction (InverseMap *inverseMap)
+{
+  if (inverseMap->shared)
+    return(erand48(inverseMap->xsubi));
+  return(drand48());
 }
 
 int
@@ -326,9 +650,14 @@ Invert (InverseMap *inverseMap, float *xv, float *yv, float xvp, float yvp)
   MapElement *me;
   int i;
   float alpha, beta;
+  float fx, fy;
+  MapElement *g;
+  int nxp1;
 
-  ix = (int) floor((xvp - inverseMap->xMin) / inverseMap->scale);
-  iy = (int) floor((yvp - inverseMap->yMin) / inverseMap->scale);
+  fx = (xvp - inverseMap->xMin) / inverseMap->scale;
+  fy = (yvp - inverseMap->yMin) / inverseMap->scale;
+  ix = (int) floor(fx);
+  iy = (int) floor(fy);
 #if DEBUG
   printf("invert: ix = %d iy = %d\n", ix, iy);
 #endif
@@ -346,6 +675,57 @@ Invert (InverseMap *inverseMap, float *xv, float *yv, float xvp, float yvp)
 	 minX, maxX, minY, maxY);
 #endif
   nx = inverseMap->nx;
+
+  if (inverseMap->grid != NULL &&
+      !inverseMap->irregular[iy * inverseMap->nxp + ix])
+    {
+      /* interpolate the grid to find the MapElement, and refine
+	 within it; if that misses, follow where BilinearInvert
+	 points a couple of times before resorting to the search */
+      fx -= ix;
+      fy -= iy;
+      nxp1 = inverseMap->nxp + 1;
+      g = &(inverseMap->grid[iy * nxp1 + ix]);
+      x = (int) floor((1.0 - fy) * ((1.0 - fx) * g->x + fx * (g+1)->x) +
+		      fy * ((1.0 - fx) * (g+nxp1)->x + fx * (g+nxp1+1)->x));
+      y = (int) floor((1.0 - fy) * ((1.0 - fx) * g->y + fx * (g+1)->y) +
+		      fy * ((1.0 - fx) * (g+nxp1)->y + fx * (g+nxp1+1)->y));
+      for (i = 0; i < 3; ++i)
+	{
+	  if (x < minX)
+	    x = minX;
+	  else if (x > maxX)
+	    x = maxX;
+	  if (y < minY)
+	    y = minY;
+	  else if (y > maxY)
+	    y = maxY;
+	  me = &(inverseMap->map[y * nx + x]);
+	  alpha = 0.0;
+	  beta = 0.0;
+	  if (me->c == 0.0 ||
+	      (me+1)->c == 0.0 ||
+	      (me+nx)->c == 0.0 ||
+	      (me+nx+1)->c == 0.0)
+	    break;
+	  if (BilinearInvert(&alpha, &beta,
+			     xvp, yvp,
+			     me->x, me->y,
+			     (me+nx)->x, (me+nx)->y,
+			     (me+nx+1)->x, (me+nx+1)->y,
+			     (me+1)->x, (me+1)->y))
+	    {
+	      *xv = x + alpha;
+	      *yv = y + beta;
+	      return(1);
+	    }
+	  if (alpha == 0.0 && beta == 0.0)
+	    break;
+	  x += (int) floor(alpha);
+	  y += (int) floor(beta);
+	}
+    }
+
   x = inverseMap->lastX;
   y = inverseMap->lastY;
   nTried = 0;
@@ -381,14 +761,14 @@ Invert (InverseMap *inverseMap, float *xv, float *yv, float xvp, float yvp)
 	    }
 	  if (nNeighborsTried < 8)
 	    {
-	      x += (int) floor(3.0 * drand48() - 1.0);
-	      y += (int) floor(3.0 * drand48() - 1.0);
+	      x += (int) floor(3.0 * RandomFraction(inverseMap) - 1.0);
+	      y += (int) floor(3.0 * RandomFraction(inverseMap) - 1.0);
 	    }
 	  else
 	    {
 	      nNeighborsTried = 0;
-	      x = minX + (int) floor(drand48() * (maxX - minX + 1));
-	      y = minY + (int) floor(drand48() * (maxY - minY + 1));
+	      x = minX + (int) floor(RandomFraction(inverseMap) * (maxX - minX + 1));
+	      y = minY + (int) floor(RandomFraction(inverseMap) * (maxY - minY + 1));
 	    }
 	  continue;
 	}
@@ -429,8 +809,8 @@ Invert (InverseMap *inverseMap, float *xv, float *yv, float xvp, float yvp)
 	}
       else
 	{
-	  x = minX + (int) floor(drand48() * (maxX - minX + 1));
-	  y = minY + (int) floor(drand48() * (maxY - minY + 1));
+	  x = minX + (int) floor(RandomFraction(inverseMap) * (maxX - minX + 1));
+	  y = minY + (int) floor(RandomFraction(inverseMap) * (maxY - minY + 1));
 	  nNeighborsTried = 0;
 	}
     }
@@ -439,12 +819,134 @@ Invert (InverseMap *inverseMap, float *xv, float *yv, float xvp, float yvp)
 void
 FreeInverseMap (InverseMap *inverseMap)
 {
-  free(inverseMap->inverseMap);
+  if (!inverseMap->shared)
+    {
+      free(inverseMap->inverseMap);
+      free(inverseMap->grid);
+      free(inverseMap->irregular);
+    }
   free(inverseMap->tried);
   free(inverseMap->marked);
   free(inverseMap);
 }
 
+int
+WriteInverseMap (char *filename, InverseMap *inverseMap, char *error)
+{
+  char tmpName[PATH_MAX];
+  FILE *f;
+  size_t nTable, nGrid;
+  float header[3];
+
+  /* write to a temporary file and rename it, so that other processes
+     reading or writing the same inverse never see a partial file */
+  if (strlen(filename) + 16 >= PATH_MAX)
+    {
+      sprintf(error, "Inverse map filename is too long: %s\n", filename);
+      return(0);
+    }
+  sprintf(tmpName, "%s.%d", filename, (int) getpid());
+  f = fopen(tmpName, "wb");
+  if (f == NULL)
+    {
+      sprintf(error, "Cannot open file %s for writing\n", tmpName);
+      return(0);
+    }
+  fprintf(f, "I1\n");
+  fprintf(f, "%d %d\n", inverseMap->nx, inverseMap->ny);
+  fprintf(f, "%d %d %d\n", inverseMap->nxp, inverseMap->nyp,
+	  inverseMap->maxTried);
+  header[0] = inverseMap->xMin;
+  header[1] = inverseMap->yMin;
+  header[2] = inverseMap->scale;
+  nTable = ((size_t) inverseMap->nxp) * inverseMap->nyp;
+  nGrid = ((size_t) inverseMap->nxp + 1) * (inverseMap->nyp + 1);
+  if (fwrite(header, sizeof(header), 1, f) != 1 ||
+      fwrite(inverseMap->inverseMap, nTable * sizeof(InverseMapElement), 1, f) != 1 ||
+      fwrite(inverseMap->grid, nGrid * sizeof(MapElement), 1, f) != 1 ||
+      fwrite(inverseMap->irregular, nTable * sizeof(unsigned char), 1, f) != 1)
+    {
+      sprintf(error, "Could not write to file %s\n", tmpName);
+      fclose(f);
+      unlink(tmpName);
+      return(0);
+    }
+  if (fclose(f) != 0 || rename(tmpName, filename) != 0)
+    {
+      sprintf(error, "Could not write inverse map file %s\n", filename);
+      unlink(tmpName);
+      return(0);
+    }
+  return(1);
+}
+
+InverseMap*
+ReadInverseMap (char *filename, MapElement *map, int nx, int ny, char *error)
+{
+  FILE *f;
+  InverseMap *inverseMap;
+  int fnx, fny;
+  int nxp, nyp, maxTried;
+  size_t nTable, nGrid;
+  float header[3];
+
+  f = fopen(filename, "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open inverse map file %s\n", filename);
+      return(NULL);
+    }
+  if (fscanf(f, "I1 %d %d %d %d %d", &fnx, &fny, &nxp, &nyp, &maxTried) != 5 ||
+      fgetc(f) != '\n' ||
+      nxp <= 0 || nyp <= 0 || maxTried <= 0)
+    {
+      sprintf(error, "Invalid header in inverse map file %s\n", filename);
+      fclose(f);
+      return(NULL);
+    }
+  if (fnx != nx || fny != ny)
+    {
+      sprintf(error, "Inverse map file %s is for a %dx%d map, not %dx%d\n",
+	      filename, fnx, fny, nx, ny);
+      fclose(f);
+      return(NULL);
+    }
+
+  nTable = ((size_t) nxp) * nyp;
+  nGrid = ((size_t) nxp + 1) * (nyp + 1);
+  inverseMap = (InverseMap*) malloc(sizeof(InverseMap));
+  inverseMap->map = map;
+  inverseMap->nx = nx;
+  inverseMap->ny = ny;
+  inverseMap->nxp = nxp;
+  inverseMap->nyp = nyp;
+  inverseMap->maxTried = maxTried;
+  inverseMap->inverseMap = (InverseMapElement*) malloc(nTable * sizeof(InverseMapElement));
+  inverseMap->grid = (MapElement*) malloc(nGrid * sizeof(MapElement));
+  inverseMap->irregular = (unsigned char *) malloc(nTable * sizeof(unsigned char));
+  inverseMap->tried = (long long*) malloc(maxTried * sizeof(long long));
+  inverseMap->marked = (unsigned char *) malloc(nx * ny * sizeof(unsigned char));
+  inverseMap->lastX = 0;
+  inverseMap->lastY = 0;
+  inverseMap->shared = 0;
+  if (fread(header, sizeof(header), 1, f) != 1 ||
+      fread(inverseMap->inverseMap, nTable * sizeof(InverseMapElement), 1, f) != 1 ||
+      fread(inverseMap->grid, nGrid * sizeof(MapElement), 1, f) != 1 ||
+      fread(inverseMap->irregular, nTable * sizeof(unsigned char), 1, f) != 1)
+    {
+      sprintf(error, "Inverse map file %s apparently truncated\n", filename);
+      fclose(f);
+      FreeInverseMap(inverseMap);
+      return(NULL);
+    }
+  fclose(f);
+  inverseMap->xMin = header[0];
+  inverseMap->yMin = header[1];
+  inverseMap->scale = header[2];
+  memset(inverseMap->marked, 0, nx * ny * sizeof(unsigned char));
+  return(inverseMap);
+}
+
 int
 BilinearInvert (float *pu, float *pv, float xp, float yp,
 		float x00, float y00, float x01, float y01,
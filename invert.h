@@ -23,9 +23,33 @@ extern "C" {
     int lastX, lastY;  /* the last used position in the original map */
     unsigned char *marked; /* the MapElements that have been marked */
     long long *tried;  /* the MapElements that have been tried */
+    int maxTried;      /* the number of elements in tried */
+    MapElement *grid;  /* the inverse at each corner of the table squares,
+			  (nxp+1) x (nyp+1) points; c is 0 where the
+			  inverse is undefined */
+    unsigned char *irregular; /* the table squares in which the grid cannot
+				 be interpolated to find the MapElement */
+    int shared;        /* if 1, map and inverseMap belong to another
+			  InverseMap (see ShareInverseMap) */
+    unsigned short xsubi[3];  /* random state of a shared InverseMap */
   } InverseMap;
 
   InverseMap* InvertMap (MapElement *map, int nx, int ny);
+  /* InvertMapThreads is like InvertMap, but builds the tables with
+     up to nThreads threads */
+  InverseMap* InvertMapThreads (MapElement *map, int nx, int ny,
+				int nThreads);
+  /* WriteInverseMap saves the tables of inverseMap so that
+     ReadInverseMap can restore them for the same map without building
+     them again; both return 0 (NULL) and set error on failure */
+  int WriteInverseMap (char *filename, InverseMap *inverseMap, char *error);
+  InverseMap* ReadInverseMap (char *filename, MapElement *map,
+			      int nx, int ny, char *error);
+  /* ShareInverseMap returns an InverseMap that uses the tables of
+     inverseMap but has its own search state, so that several threads
+     may call Invert at once, each with its own copy; the copy must be
+     freed (with FreeInverseMap) before the original */
+  InverseMap* ShareInverseMap (InverseMap *inverseMap);
   int Invert (InverseMap *inverseMap, float *x, float *y, float xp, float yp);
   void FreeInverseMap (InverseMap *inverseMap);
 
@@ -66,9 +66,17 @@
  *	    run when a faster worker will likely soon be available.
  */
 
+#define _GNU_SOURCE		/* for sched_setaffinity and CPU_SET */
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <time.h>
@@ -80,6 +88,7 @@
 #include <math.h>
 #include <mpi.h>
 #include "par.h"
+#include "metrics.h"
 
 #define WORKER_RECEIVE_TIMEOUT	600000	/* seconds before a worker will timeout
 					   waiting for a message from the
@@ -90,6 +99,17 @@
 					   many seconds when waiting
 					   for pending workers to show up */
 #define MAX_HOSTNAME_LENGTH	128     /* maximum # of chars in host name */
+#define BATCH_SECONDS		0.25	/* when batching, the amount of work
+					   (in seconds) that should go in
+					   each batch of tasks */
+#define HEARTBEAT_INTERVAL	60	/* default seconds between telemetry
+					   heartbeat lines */
+#define TELEMETRY_TAIL		10	/* # of slowest tasks listed in the
+					   telemetry report */
+
+#define MAX_JOURNAL_KEY		256	/* maximum length of a task key, with
+					   its terminating null */
+#define JOURNAL_BUCKETS		65536	/* # of hash chains of the journal */
 
 #define REQUEST_MSG		1	/* worker -> master */
 #define RESTART_MSG		2	/* worker -> master */
@@ -99,6 +119,11 @@
 #define WORKER_EXIT_MSG		7	/* PVM daemon -> master */
 #define BROADCAST_CONTEXT_MSG	10	/* master -> worker */
 #define BROADCAST_ACK_MSG	11	/* worker -> master */
+#define COLLECTIVE_CONTEXT_MSG	12	/* master -> worker */
+#define TASK_BATCH_MSG		13	/* master -> worker */
+#define RESULTS_MSG		14	/* worker -> master */
+#define CANCEL_MSG		15	/* master -> worker */
+#define RELAY_RESULTS_MSG	16	/* sub-master -> master */
 
 #ifndef FALSE
 #define FALSE			0
@@ -122,9 +147,20 @@ typedef struct Buffer {
   int position;			/* reading or writing position */
 } Buffer;
 
+typedef struct LocalPeer {
+  pid_t pid;			/* process id of a worker forked by the
+				   master */
+  int fd;			/* socket to the peer, or -1 if closed */
+  Buffer in;			/* bytes received from the peer; position
+				   is the end of the data */
+  int start;			/* where the first unread message begins */
+} LocalPeer;
+
 typedef struct Context {
   int use_count;		/* # of times this structure is referenced */
   Buffer buffer;		/* the context buffer */
+  Boolean shared;		/* TRUE if this context has been given
+				   to all workers collectively */
 } Context;
 
 typedef struct Task {
@@ -133,8 +169,71 @@ typedef struct Task {
   Context *context;	        /* context associated with the task */
   int number;			/* number of this task */
   Buffer buffer;		/* the task buffer */
+  int n_hints;			/* # of affinity keys for this task */
+  unsigned int hints[PAR_MAX_TASK_HINTS]; /* hashes of the affinity keys */
+  double dispatch_time;		/* when the task was sent to a worker */
+  double start_time;		/* when the worker most likely started
+				   on it */
+  double size;			/* the task's size hint (negative if
+				   none was given) */
+  double memory;		/* the megabytes of memory and the # of */
+  int gpus;			/*   GPUs the task needs (0 if it did
+				   not say) */
+  int worker_tid;		/* the worker it was sent to */
+  Boolean copy;			/* TRUE if this is a speculative copy of
+				   another task */
+  struct Task *twin;		/* the other copy of a speculatively
+				   duplicated task, while both are
+				   running */
 } Task;
 
+typedef struct TaskRecord {
+  int number;			/* number of the task */
+  int worker;			/* the worker that performed it */
+  double seconds;		/* time the worker spent on it */
+  double latency;		/* time from dispatch to result */
+} TaskRecord;
+
+typedef struct JournalEntry {
+  struct JournalEntry *next;	/* next in the hash chain */
+  char *key;			/* the key the task was given */
+  int size;			/* the size of its packed result */
+  unsigned char *data;		/*   and the result */
+} JournalEntry;
+
+typedef struct Message {
+  struct Message *next;		/* next on the held message list */
+  int tag;			/* the message type */
+  int from_tid;			/* the TID of the sender */
+  Buffer buffer;		/* the packed message */
+  Boolean prefetched;		/* TRUE if (*worker_prefetch)() has been
+				   called for this (task) message */
+  int batch_index;		/* position of this task within its batch */
+  int batch_size;		/* # of tasks in the batch (0 if the task
+				   was not sent as part of a batch) */
+} Message;
+
+typedef struct WorkerThread {
+  int index;			/* its position in the thread table */
+  pthread_t thread;
+  pthread_cond_t wake;		/* signalled when it is given a task or
+				   told to quit */
+  Message *msg;			/* the task it has been given (NULL if it
+				   has none) */
+  int task;			/* the number of that task */
+  Boolean done;			/* TRUE once it has performed the task;
+				   the result then waits to be taken */
+  Boolean cancelled;		/* TRUE if the master has said it no
+				   longer needs the task */
+  Boolean quit;			/* TRUE once the worker is terminating */
+  double seconds;		/* the time the task took */
+  int result_appended;		/* TRUE if a result was packed */
+  unsigned char *result;	/* the packed result (in the thread's */
+  int result_size;		/*   own out_buffer) */
+  int first_cpu;		/* the thread's share of the process's */
+  int n_cpus;			/*   block of cpus (0 if not pinned) */
+} WorkerThread;
+
 typedef struct WorkerState {
   int tid;			/* the TID of this worker; note that for
 				   MPI-based compilations, this is equal
@@ -142,22 +241,53 @@ typedef struct WorkerState {
   Hostname host;		/* the name of the host this worker
 				   is running on */
   Boolean idle;			/* TRUE if this worker is ready to accept
-				   a task and has no tasks currently
+				   a task, i.e., has fewer than
+				   1 + prefetch_depth tasks currently
 				   assigned to it */
   int next_idle;		/* the next worker on the idle list
 				   (-1 terminates list) */
   Context* last_context;	/* the context that was last sent to the
 				   worker */
-  Task *first_task;		/* the first task (of at most 2) assigned to
-				   this worker */
+  Task *first_task;		/* the first task assigned to this worker;
+				   further assigned tasks are chained
+				   through the next field in the order
+				   that they were sent */
+  Task *last_task;		/* the last task assigned to this worker */
+  int n_tasks;			/* # of tasks currently assigned to this
+				   worker */
+  int n_batches;		/* # of messages those tasks were sent in */
+  int n_recent_hints;		/* # of valid entries in recent_hints */
+  int next_recent_hint;		/* where the next hint will be recorded */
+  unsigned int recent_hints[PAR_HINT_HISTORY];
+				/* hashes of the affinity keys of the tasks
+				   most recently assigned to this worker */
+  double start_time;		/* when the worker first reported */
+  double assigned_since;	/* when n_tasks last became nonzero */
+  double assigned_seconds;	/* total time n_tasks was nonzero */
+  double busy_seconds;		/* time the worker reports spending on
+				   tasks */
+  double context_seconds;	/* time the worker reports spending on
+				   taking in contexts */
+  int n_completed;		/* # of tasks it has completed */
+  double bytes_sent;		/* bytes the master sent it */
+  double bytes_received;	/* bytes the master received from it */
+  Boolean sub_master;		/* TRUE if this is a sub-master */
+  int capacity;			/* 1, or for a sub-master, the # of
+				   workers it dispatches its tasks to */
+  int memory;			/* the megabytes of memory and the # of */
+  int gpus;			/*   GPUs the worker advertised (0 if it
+				   did not) */
 } WorkerState;
 
 static Context *current_context = NULL;
 
 static Task *first_queued_task = NULL;
 static Task *last_queued_task = NULL;
+static int n_queued_tasks = 0;	/* # of tasks on the queue */
 
-static WorkerState workers[PAR_MAX_WORKERS];
+static WorkerState *workers = NULL; /* the table of workers, grown as
+				      they report */
+static int workers_size = 0;	/* # of entries allocated in workers */
 
 static Boolean par = TRUE;	/* TRUE if we are going to run in parallel */
 
@@ -184,6 +314,32 @@ static Boolean context_changed = FALSE;	/* TRUE if the context has changed
 					   since the last call to
 					   par_delegate_task */
 
+static int n_pending_hints = 0;	/* # of affinity keys to be attached to
+				   the next delegated task */
+static unsigned int pending_hints[PAR_MAX_TASK_HINTS];
+				/* hashes of those affinity keys */
+static double pending_size = -1.0; /* the size hint to be attached to the
+				      next delegated task */
+static double pending_memory = 0.0; /* the needs to be attached to the */
+static int pending_gpus = 0;	/*   next delegated task */
+static int my_memory = 0;	/* with -PAR_MEMORY=n and -PAR_GPUS=n, the */
+static int my_gpus = 0;		/*   megabytes of memory and the # of
+				   GPUs this process advertises */
+static int max_worker_memory = 0; /* the most memory and GPUs that any */
+static int max_worker_gpus = 0;	/*   of the workers advertised */
+static double speculate_factor = 0.0;
+				/* at the end of a run, a task that has
+				   been running this many times the mean
+				   task time is also given to an idle
+				   worker (0 disables) */
+static int n_speculated = 0;	/* # of speculative copies sent */
+static int n_speculation_wins = 0; /* # of those that finished first */
+static __thread int current_task = -1;
+				/* the task a worker (or a thread of a
+				   threaded worker) is performing */
+static int cancelled_task = -1;	/* the last task a worker was told to
+				   abandon */
+
 static Par_Task task_number = 0; /* the next task number to be assigned */
 static int tasks_outstanding = 0;/* counts the # of tasks that have been
 				    delegated but not yet finished by the
@@ -193,8 +349,109 @@ static int n_workers = 0;	/* actual number of workers that are running */
 static int n_workers_pending = 0; /* number of workers that should be starting,
 				     but we haven't heard from yet */
 static int idle_workers = -1;	/* a list of idle workers (i.e., those workers
-				   having 0 tasks currently assigned to them);
+				   that can accept another task);
 				   a -1 terminates this list */
+static int prefetch_depth = 0;	/* # of tasks beyond the one it is
+				   currently performing that may be
+				   assigned to a worker */
+static int collective_threshold = -1;
+				/* contexts of at least this many bytes
+				   are given to the workers with a
+				   collective broadcast instead of
+				   worker-by-worker sends (-1 disables) */
+static int batch_max = 1;	/* maximum # of tasks that may be sent to
+				   a worker in one message (1 disables
+				   batching) */
+static double mean_task_time = 0.0;
+				/* running average of the time workers
+				   spend on one task, as reported with
+				   batched results */
+static int current_batch_index = 0; /* batch_index and batch_size of */
+static int current_batch_size = 0;  /*   the task a worker is performing */
+static int batch_position = 0;	/* the end of the batched results packed
+				   into out_buffer so far */
+static double batch_seconds = 0.0; /* time spent on the current batch */
+static double context_seconds = 0.0;
+				/* time a worker has spent on contexts
+				   since it last reported to the master */
+static FILE *telemetry_file = NULL; /* where the master writes telemetry,
+				       if it was requested */
+static char telemetry_name[256] = "";
+				/* the name of that file ("-" is stdout) */
+static double heartbeat_interval = HEARTBEAT_INTERVAL;
+				/* seconds between heartbeat lines (0
+				   disables them) */
+static double telemetry_start = 0.0; /* when the master started */
+static char journal_name[256] = ""; /* with -PAR_JOURNAL=file, where the
+				       master records finished tasks */
+static FILE *journal_file = NULL;
+static JournalEntry *journal_table[JOURNAL_BUCKETS];
+				/* the tasks that the journal recorded
+				   as finished when it was opened */
+static char *pending_key = NULL; /* the key to be given to the next
+				    task delegated */
+static char **task_keys = NULL;	/* the keys of the outstanding tasks,
+				   indexed by task number */
+static int task_keys_size = 0;
+static double last_heartbeat = 0.0;
+static int heartbeat_completed = 0; /* tasks completed at last heartbeat */
+static double master_wait_seconds = 0.0;
+				/* time the master spent waiting for
+				   messages */
+static double master_context_bytes = 0.0;
+				/* bytes of context sent to workers */
+static double queue_time = 0.0;	/* when n_queued_tasks last changed */
+static int queue_depth = 0;	/* n_queued_tasks at that time */
+static double queue_integral = 0.0; /* time integral of the queue depth */
+static int queue_max = 0;	/* largest queue depth seen */
+static TaskRecord *task_records = NULL;
+static int n_task_records = 0;	/* # of completed tasks recorded */
+static int task_records_size = 0;
+static int n_ranks = 1;		/* # of processes in MPI_COMM_WORLD */
+static int pin_cores = 0;	/* # of cores each process is pinned to
+				   (0 for no pinning) */
+static int n_pin_cpus = 0;	/* the cpus of this process's block, */
+static int pin_cpus[CPU_SETSIZE]; /*   grouped by socket */
+static int cpu_package[CPU_SETSIZE]; /* the socket of each cpu */
+static MPI_Comm node_comm = MPI_COMM_NULL;
+				/* the processes that share this node */
+static MPI_Comm leader_comm = MPI_COMM_NULL;
+				/* the lowest ranked process on each node */
+static Message *first_held_message = NULL;
+static Message *last_held_message = NULL;
+				/* messages that a worker has received
+				   while performing a task, but not yet
+				   acted upon */
+
+static int group_size = 0;	/* with -PAR_GROUP=n, the # of workers
+				   each sub-master serves (0 if the
+				   master serves all workers itself) */
+static Boolean relay = FALSE;	/* TRUE if this process is a sub-master */
+static Boolean relay_terminate = FALSE;
+				/* TRUE once a sub-master has been told
+				   to terminate */
+static Buffer relay_results = { NULL, 0, 0 };
+				/* the results a sub-master has gathered
+				   for the master but not yet sent */
+static int relay_n_results = 0;	/* # of results in relay_results */
+static double relay_first_result = 0.0;
+				/* when the first of them arrived */
+static double relay_context_reported = 0.0;
+				/* context seconds of its workers that a
+				   sub-master has already reported */
+static int in_length = 0;	/* # of bytes in the message last received
+				   by MasterReceiveMessage */
+
+static int local_workers = 0;	/* with -PAR_LOCAL=n, the # of worker
+				   processes forked on this host when not
+				   running under MPI */
+static Boolean local = FALSE;	/* TRUE if the processes were forked by
+				   the master and talk over sockets */
+static LocalPeer *local_peers = NULL;
+				/* indexed by tid; of a worker, only the
+				   master's entry is used */
+static int local_next_peer = 0;	/* the peer whose messages are looked
+				   for first, so that none is starved */
 
 static int par_verbose = FALSE;	/* if TRUE, report on normal events such as
 				   task delegation and receiving worker
@@ -231,7 +488,7 @@ static int broadcast_second_forward_tid = -1; /* TID of the second process to
 static int broadcast_backward_tid = -1; /* TID of the process from which this
 					   process receives broadcasts */
 static int n_processes = 1;	/* number of entries in process_tids */
-static int process_tids[PAR_MAX_WORKERS+1];
+static int *process_tids = NULL;
                                 /* stores all TIDs for processes
 				   involved in a broadcast */
 static int my_process_index = 0; /* index into process_tids for my process */
@@ -243,13 +500,33 @@ static int n_hosts_pending = 0;	/* number of hosts in the host table which
 static struct timeval longest_task= {0,0}; 
                                 /* run time of longest task so far */
 
-static unsigned char *out_buffer = NULL;  /* output buffer */
-static int out_size = 0;	/* size of output buffer in bytes */
-static int out_position = 0;	/* index into output buffer */
-
-static unsigned char *in_buffer = NULL;
-static int in_size = 0;		/* size of input buffer in bytes */
-static int in_position = 0;	/* index into input buffer */
+static int worker_threads = 1;	/* with -PAR_THREADS=n, the # of threads
+				   on which each worker performs tasks */
+static Boolean threads_allowed = FALSE;
+				/* TRUE once the application has said
+				   that its worker routines may run on
+				   several threads at once */
+static WorkerThread *threads = NULL;
+				/* of a threaded worker, the table of its
+				   threads (NULL otherwise) */
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+				/* guards the thread table */
+static pthread_cond_t threads_done = PTHREAD_COND_INITIALIZER;
+				/* signalled when a thread finishes a
+				   task */
+static __thread WorkerThread *my_thread = NULL;
+				/* the entry of the calling thread, if it
+				   is one of those threads */
+
+/* the message being packed and the one being unpacked are per thread,
+   so that each thread of a threaded worker packs and unpacks its own */
+static __thread unsigned char *out_buffer = NULL;  /* output buffer */
+static __thread int out_size = 0; /* size of output buffer in bytes */
+static __thread int out_position = 0; /* index into output buffer */
+
+static __thread unsigned char *in_buffer = NULL;
+static __thread int in_size = 0; /* size of input buffer in bytes */
+static __thread int in_position = 0; /* index into input buffer */
 
 static int sizeof_byte;		/* size of packed length of individual types */
 static int sizeof_short;
@@ -271,14 +548,30 @@ static void (*par_pack_task)() = NULL;		/* optional */
 static void (*par_unpack_task)() = NULL;	/* optional */
 static void (*par_pack_result)() = NULL;	/* optional */
 static void (*par_unpack_result)() = NULL;	/* optional */
+static void (*par_worker_prefetch)() = NULL;	/* optional */
 
 /* the internal functions */
 static void ScanEnvironment();
 static void DispatchTasks();
 static void DispatchTask();
 static int  FindReadyWorker();
+static Task *DispatchableTask();
+static Boolean WorkerMeets();
+static Boolean LessCapable();
+static void NoteWorkerClasses();
+static int  HintScore();
+static void RecordHints();
+static unsigned int HashKey();
 static void HandleMessage();
 static void HandleRequest();
+static void HandleResults();
+static void HandleRelayResults();
+static void CompleteTask();
+static void MarkTaskFinished();
+static void NoteTaskTime();
+static int  BatchSize();
+static Boolean WorkerReady();
+static void HoldMessage();
 static void HandleBroadcastAck();
 static void HandleWorkerExit();
 static void QueueTask();
@@ -290,9 +583,53 @@ static void PutOnIdleList();
 static void RemoveFromIdleList();
 static void DeclareWorkerDead();
 static void PerformWorkerTasks();
+static void ThreadTasks();
+static void *WorkerThreadMain(void *arg);
+static void ThreadCancel();
+static int  HeldTaskNumber();
+static void PinWorkerThread();
 static void ComposeRequest();
+static void ReceiveBroadcastContext();
+static void ReceiveBroadcastAck();
+static void AwaitPendingWorkers();
+static int  SubMasterOf();
+static int  GroupWorkers();
+static void RelayTasks();
+static void RelayMessage();
+static void RelayQueueTask();
+static void RelayCancel();
+static void RelayResult();
+static void RelayFlush();
 static int  MasterReceiveMessage(float timeout);
 static int  WorkerReceiveMessage();
+static void HoldArrivedMessages();
+static int  ReleaseHeldMessage();
+static void PrefetchNextTask();
+static Boolean CollectiveAvailable();
+static void CollectiveBroadcast();
+static void ReceiveCollectiveContext();
+static void ShareBuffer();
+static void SetUpNodeComms ();
+static void PinProcess ();
+static int  ComparePackages (const void *a, const void *b);
+static void InterleaveMemory (void *p, size_t size);
+static Boolean ProbeMessage (Boolean block, int *ptag, int *psource,
+			     int *plen);
+static Boolean ReceiveMessage (unsigned char *buffer, int len,
+			       int source, int tag);
+static Boolean SendMessage (unsigned char *buffer, int len,
+			    int tid, int tag);
+static int  ForkLocalWorkers ();
+static Boolean LocalWrite (int tid, unsigned char *p, int n);
+static Boolean LocalWait (int write_tid, int timeout);
+static void LocalRead (int tid);
+static Boolean LocalWorkersWanted (int argc, char **argv);
+static int  LocalTypeSize (MPI_Datatype type);
+static Boolean PackedSize (int n, MPI_Datatype type, int *psize);
+static Boolean PackItems (void *p, int n, MPI_Datatype type,
+			  void *buffer, int size, int *pposition);
+static Boolean UnpackItems (void *buffer, int size, int *pposition,
+			    void *p, int n, MPI_Datatype type);
 static void PrepareToSend();
 static void Send();
 
@@ -302,6 +639,26 @@ static void ExpandOutBuffer(int size);
 
 static Boolean StringCopy (char *to, const char *from, const int maxChars);
 
+static double WallTime ();
+static void QueueTaskBySize (Task *task);
+static void DispatchReadyTasks ();
+static void SendContext (int n, Task *task);
+static void Speculate ();
+static void SpeculateTask (int n, Task *task);
+static void TelemetryStart ();
+static void OpenJournal ();
+static JournalEntry *FindJournalEntry (char *key);
+static Boolean ReplayJournal (int tc);
+static void JournalTask (int tc, double seconds, unsigned char *data,
+			 int size);
+static void KeyTask (int tc);
+static void NoteQueueDepth ();
+static void NoteTaskRecord (int n, Task *task, double seconds,
+			    Boolean duplicate);
+static void Heartbeat (Boolean force);
+static void TelemetryReport ();
+static int CompareTaskRecords (const void *a, const void *b);
+
 static void Report (char *fmt, ...);
 static void Error (char *fmt, ...);
 static void Abort (char *fmt, ...);
@@ -323,6 +680,7 @@ par_process (int argc,
 	     void (*unpack_result)())
 {
   struct hostent *e;
+  int i;
 
   /* save the user-supplied functions */
   if (master_task == NULL)
@@ -349,25 +707,45 @@ par_process (int argc,
   else
     strcpy(my_host_name, "unknown_host");
 
-  /* we have to enroll with MPI here in order for the command-line
-     arguments to be valid */
+  /* a process started on its own with -PAR_LOCAL=n forks its workers
+     itself, and then none of them makes any MPI call at all, so
+     MPI is never initialized and no MPI runtime need be running */
+  if (LocalWorkersWanted(argc, argv))
+    {
+      local = TRUE;
+      n_workers_pending = 1;
+    }
+
+  /* otherwise we have to enroll with MPI here in order for the
+     command-line arguments to be valid */
 
   //  printf("Going to call MPI_Init with argc = %d and argv[1] = %s\n",
   //	 argc, argv[1]);
-  if (MPI_Init(&argc, &argv) == MPI_SUCCESS &&
-      MPI_Comm_size(MPI_COMM_WORLD, &n_workers_pending) == MPI_SUCCESS &&
-      n_workers_pending > 1)
+  else if (MPI_Init(&argc, &argv) != MPI_SUCCESS ||
+	   MPI_Comm_size(MPI_COMM_WORLD, &n_workers_pending) != MPI_SUCCESS)
+    n_workers_pending = -1;
+  else if (n_workers_pending > 1)
     {
       printf("running in parallel with MPI\n");
       n_workers_pending = 0;
       par = TRUE;
     }
-  else
-    printf("not running in parallel\n");
 
   /* check the relevant environment variables */
   ScanEnvironment(argc, argv);
 
+  if (local)
+    {
+      if (local_workers > PAR_MAX_WORKERS_PER_HOST)
+	local_workers = PAR_MAX_WORKERS_PER_HOST;
+      printf("running in parallel with %d local workers\n", local_workers);
+      n_workers_pending = 0;
+      group_size = 0;
+      par = TRUE;
+    }
+  else if (n_workers_pending != 0)
+    printf("not running in parallel\n");
+
   if (par) 
     {
       /* the parallelism flag is on, so start running in an MPI mode */
@@ -376,24 +754,74 @@ par_process (int argc,
 
   if (!par) /* par may possibly have been turned off by StartMPI */
     {
+      MetricsSetProcess(0);
+      if (n_pin_cpus == 0)
+	PinProcess();
+      OpenJournal();
       /* the parallelism flag is off, so just run the master task */
       (*master_task)(prog_argc, prog_argv, envp);
       if (worker_finalize != NULL)
 	(*worker_finalize)();
     }
 
+  MetricsClose();
+  if (local)
+    {
+      if (rank != 0)
+	{
+	  /* the workers share the master's stdio state as of the fork,
+	     so they leave by _exit rather than by exit */
+	  fflush(NULL);
+	  _exit(0);
+	}
+      if (local_peers != NULL)
+	for (i = 1; i <= local_workers; ++i)
+	  while (waitpid(local_peers[i].pid, NULL, 0) < 0 && errno == EINTR) ;
+      return;
+    }
   if (par_verbose) Report("Tid %d at MPI_Finalize\n",my_tid);
   if (MPI_Finalize() != MPI_SUCCESS) {
     Abort("MPI_Finalize failed\n");
   }
 }
 
+/* LocalWorkersWanted returns TRUE if -PAR_LOCAL=n (or the PAR_LOCAL
+   environment variable) asks for n > 0 local workers and this
+   process was not started by an MPI launcher with other processes;
+   it must decide this before MPI_Init, so it looks at the launchers'
+   environment variables rather than asking MPI */
+static Boolean
+LocalWorkersWanted (int argc, char **argv)
+{
+  char *p;
+  int i;
+  int v;
+  int n;
+
+  n = 0;
+  if ((p = getenv("PAR_LOCAL")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    n = v;
+  for (i = 1; i < argc; ++i)
+    if (strncmp(argv[i], "-PAR_LOCAL=", 11) == 0 &&
+	sscanf(&argv[i][11], "%d", &v) == 1 && v >= 0)
+      n = v;
+  if (n <= 0)
+    return(FALSE);
+  if (((p = getenv("OMPI_COMM_WORLD_SIZE")) != NULL ||
+       (p = getenv("PMI_SIZE")) != NULL) &&
+      sscanf(p, "%d", &v) == 1 && v > 1)
+    return(FALSE);
+  return(TRUE);
+}
+
 static void
 ScanEnvironment (int argc, char **argv)
 {
   char *p;
   int i;
   int v;
+  double f;
   char s[256];
 
   if ((p = strrchr(argv[0], '/')) == NULL)
@@ -404,6 +832,43 @@ ScanEnvironment (int argc, char **argv)
   if ((p = getenv("PAR_VERBOSE")) != NULL &&
       sscanf(p, "%d", &v) == 1)
     par_verbose = (v != 0);
+  if ((p = getenv("PAR_PREFETCH")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    prefetch_depth = v;
+  if ((p = getenv("PAR_COLLECTIVE")) != NULL &&
+      sscanf(p, "%d", &v) == 1)
+    collective_threshold = v;
+  if ((p = getenv("PAR_BATCH")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 1)
+    batch_max = v;
+  if ((p = getenv("PAR_TELEMETRY")) != NULL)
+    StringCopy(telemetry_name, p, 256);
+  if ((p = getenv("PAR_HEARTBEAT")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    heartbeat_interval = v;
+  if ((p = getenv("PAR_SPECULATE")) != NULL &&
+      sscanf(p, "%lf", &f) == 1 && f >= 0.0)
+    speculate_factor = f;
+  if ((p = getenv("PAR_PIN")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    pin_cores = v;
+  if ((p = getenv("PAR_JOURNAL")) != NULL)
+    StringCopy(journal_name, p, 256);
+  if ((p = getenv("PAR_GROUP")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    group_size = v;
+  if ((p = getenv("PAR_LOCAL")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    local_workers = v;
+  if ((p = getenv("PAR_MEMORY")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    my_memory = v;
+  if ((p = getenv("PAR_GPUS")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 0)
+    my_gpus = v;
+  if ((p = getenv("PAR_THREADS")) != NULL &&
+      sscanf(p, "%d", &v) == 1 && v >= 1)
+    worker_threads = v;
   prog_argc = 0;
   prog_argv = (char **) malloc(argc * sizeof(char *));
   par_argc = 0;
@@ -430,6 +895,65 @@ ScanEnvironment (int argc, char **argv)
 	    if (sscanf(&argv[i][13], "%d", &v) == 1)
 	      par_verbose = (v != 0);
 	  }
+	else if (strncmp(argv[i], "-PAR_PREFETCH=", 14) == 0)
+	  {
+	    if (sscanf(&argv[i][14], "%d", &v) == 1 && v >= 0)
+	      prefetch_depth = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_COLLECTIVE=", 16) == 0)
+	  {
+	    if (sscanf(&argv[i][16], "%d", &v) == 1)
+	      collective_threshold = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_BATCH=", 11) == 0)
+	  {
+	    if (sscanf(&argv[i][11], "%d", &v) == 1 && v >= 1)
+	      batch_max = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_TELEMETRY=", 15) == 0)
+	  StringCopy(telemetry_name, &argv[i][15], 256);
+	else if (strncmp(argv[i], "-PAR_HEARTBEAT=", 15) == 0)
+	  {
+	    if (sscanf(&argv[i][15], "%d", &v) == 1 && v >= 0)
+	      heartbeat_interval = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_SPECULATE=", 15) == 0)
+	  {
+	    if (sscanf(&argv[i][15], "%lf", &f) == 1 && f >= 0.0)
+	      speculate_factor = f;
+	  }
+	else if (strncmp(argv[i], "-PAR_PIN=", 9) == 0)
+	  {
+	    if (sscanf(&argv[i][9], "%d", &v) == 1 && v >= 0)
+	      pin_cores = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_JOURNAL=", 13) == 0)
+	  StringCopy(journal_name, &argv[i][13], 256);
+	else if (strncmp(argv[i], "-PAR_GROUP=", 11) == 0)
+	  {
+	    if (sscanf(&argv[i][11], "%d", &v) == 1 && v >= 0)
+	      group_size = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_LOCAL=", 11) == 0)
+	  {
+	    if (sscanf(&argv[i][11], "%d", &v) == 1 && v >= 0)
+	      local_workers = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_MEMORY=", 12) == 0)
+	  {
+	    if (sscanf(&argv[i][12], "%d", &v) == 1 && v >= 0)
+	      my_memory = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_GPUS=", 10) == 0)
+	  {
+	    if (sscanf(&argv[i][10], "%d", &v) == 1 && v >= 0)
+	      my_gpus = v;
+	  }
+	else if (strncmp(argv[i], "-PAR_THREADS=", 13) == 0)
+	  {
+	    if (sscanf(&argv[i][13], "%d", &v) == 1 && v >= 1)
+	      worker_threads = v;
+	  }
       }
       else {
 	prog_argv[prog_argc++]= argv[i];
@@ -444,6 +968,7 @@ par_delegate_task ()
   int new_task_completed_size;
   int index, bit;
   Task* task;
+  double start;
 
   if (par_verbose)
     Report("par_delegate_task called.\n");
@@ -451,9 +976,29 @@ par_delegate_task ()
   /* if we are not running in parallel, do the worker task ourself */
   if (!par)
     {
+      n_pending_hints = 0;
+      pending_size = -1.0;
+      pending_memory = 0.0;
+      pending_gpus = 0;
+      if (ReplayJournal(task_number))
+	return(task_number++);
       if (par_verbose)
 	Report("Performing task %d myself\n", task_number);
+      start = WallTime();
       (*par_worker_task)();
+      MetricsPhase(METRICS_OTHER);
+      MetricsEmit("task", task_number);
+      if (pending_key != NULL)
+	{
+	  /* pack the result as a worker would, for the journal */
+	  KeyTask(task_number);
+	  out_position = 0;
+	  if (par_pack_result != NULL)
+	    (*par_pack_result)();
+	  JournalTask(task_number, WallTime() - start,
+		      out_buffer, out_position);
+	  out_position = 0;
+	}
       if (par_master_result != NULL)
 	(*par_master_result)(task_number);
       return(task_number++);
@@ -485,13 +1030,24 @@ par_delegate_task ()
   bit = (task_number - task_completed_first) & 7;
   task_completed[index] &= ~(0xff << bit);
 
+  /* a task that the journal records as finished is not sent again */
+  if (ReplayJournal(task_number))
+    {
+      MarkTaskFinished(task_number);
+      return(task_number++);
+    }
+  KeyTask(task_number);
+
   ++tasks_outstanding;
+  MetricsCount("tasks_delegated", 1);
+  MetricsGauge("tasks_outstanding", tasks_outstanding);
   if (context_changed)
     {
       current_context = (Context *) malloc(sizeof(Context));
       if (par_verbose)
 	Report("Context allocated at %x\n", current_context);
       current_context->use_count = 1;
+      current_context->shared = FALSE;
       out_position = 0;
       if (par_pack_context != NULL)
 	(*par_pack_context)();
@@ -508,6 +1064,19 @@ par_delegate_task ()
   task->prev = NULL;
   task->context = ReuseContext(current_context);
   task->number = task_number;
+  task->n_hints = n_pending_hints;
+  for (i = 0; i < n_pending_hints; ++i)
+    task->hints[i] = pending_hints[i];
+  n_pending_hints = 0;
+  task->size = pending_size;
+  pending_size = -1.0;
+  task->memory = pending_memory;
+  task->gpus = pending_gpus;
+  pending_memory = 0.0;
+  pending_gpus = 0;
+  task->worker_tid = -1;
+  task->copy = FALSE;
+  task->twin = NULL;
 
   out_position = 0;
   par_pkint(task_number);
@@ -523,18 +1092,82 @@ par_delegate_task ()
   if (par_verbose)
     Report("par_delegate_task queueing task.\n");
 
-  QueueTask(task);
+  if (task->size >= 0.0)
+    {
+      /* a task with a size hint waits on the queue, ahead of any
+	 smaller ones, until a worker is ready for it */
+      QueueTaskBySize(task);
+      DispatchReadyTasks();
+    }
+  else
+    {
+      QueueTask(task);
 
-  if (par_verbose)
-    Report("par_delegate_task dispatching tasks.\n");
+      if (par_verbose)
+	Report("par_delegate_task dispatching tasks.\n");
 
-  DispatchTasks();
+      DispatchTasks(FALSE);
+    }
 
   if (par_verbose)
     Report("par_delegate_task returning %d.\n", task_number+1);
   return(task_number++);
 }
 
+void
+par_set_task_size (double size)
+{
+  pending_size = size;
+}
+
+void
+par_set_task_needs (double memory, int gpus)
+{
+  pending_memory = memory;
+  pending_gpus = gpus;
+}
+
+int
+par_worker_memory ()
+{
+  return(my_memory);
+}
+
+int
+par_worker_gpus ()
+{
+  return(my_gpus);
+}
+
+void
+par_set_task_key (char *key)
+{
+  free(pending_key);
+  pending_key = NULL;
+  if (journal_file == NULL || key == NULL || key[0] == '\0' ||
+      strlen(key) >= MAX_JOURNAL_KEY || strpbrk(key, " \t\r\n") != NULL)
+    return;
+  pending_key = strdup(key);
+}
+
+int
+par_journaling ()
+{
+  return(journal_name[0] != '\0');
+}
+
+Par_Task
+par_delegate_task_hint (int n_keys, char **keys)
+{
+  int i;
+
+  n_pending_hints = 0;
+  for (i = 0; i < n_keys && n_pending_hints < PAR_MAX_TASK_HINTS; ++i)
+    if (keys[i] != NULL)
+      pending_hints[n_pending_hints++] = HashKey(keys[i]);
+  return(par_delegate_task());
+}
+
 void
 par_set_context ()
 {
@@ -560,6 +1193,7 @@ par_broadcast_context ()
   int i;
   int oldid;
   struct timeval current_time;
+  Buffer context_buffer;
 
   /* if we are not running in parallel, call WorkerContext directly */
   if (!par)
@@ -573,6 +1207,7 @@ par_broadcast_context ()
     Report("Master going to broadcast context %d\n", broadcast_count);
 
   /* wait for all tasks to complete */
+  DispatchTasks(TRUE);
   while (tasks_outstanding > 0)
     (void) MasterReceiveMessage(PAR_FOREVER);
 
@@ -601,6 +1236,30 @@ par_broadcast_context ()
   n_hosts_pending = 0;
   n_workers_pending = 0;
 
+  if (CollectiveAvailable())
+    {
+      PrepareToSend();
+      if (par_pack_context != NULL)
+	(*par_pack_context)();
+      if (out_position >= collective_threshold)
+	{
+	  if (par_verbose)
+	    Report("Master broadcasting context collectively (%d bytes)\n",
+		   out_position);
+	  /* take over the packed context, since sending the
+	     notifications reuses out_buffer */
+	  context_buffer.buffer = out_buffer;
+	  context_buffer.size = out_size;
+	  context_buffer.position = out_position;
+	  out_buffer = NULL;
+	  out_size = 0;
+	  out_position = 0;
+	  CollectiveBroadcast(context_buffer.buffer, context_buffer.position);
+	  FreeBuffer(&context_buffer);
+	  return;
+	}
+    }
+
   /* if there are many broadcasts already in progress, we have to
      wait here for acknowledgements */
   while (broadcast_count > MIN(broadcast_first_ack_count,
@@ -612,6 +1271,10 @@ par_broadcast_context ()
     {
       if (n_workers <= 0)
 	Abort("Broadcast operation not possible without any workers!\n");
+      process_tids = (int *) realloc(process_tids,
+				     (n_workers + 1) * sizeof(int));
+      if (process_tids == NULL)
+	Abort("Could not allocate broadcast process table\n");
       process_tids[0] = master_tid;
       for (i = 0; i < n_workers; ++i)
 	process_tids[i+1] = workers[i].tid;
@@ -665,6 +1328,8 @@ par_wait (float timeout)
   /* if we are not running in parallel, there is nothing to do */
   if (!par)
     return(0);
+  if (first_queued_task != NULL)
+    DispatchTasks(TRUE);
   return(MasterReceiveMessage(timeout));
 }
 
@@ -678,19 +1343,39 @@ par_finish ()
   if (!par)
     return;
 
+  DispatchTasks(TRUE);
   while (tasks_outstanding > 0)
-    (void) MasterReceiveMessage(PAR_FOREVER);
+    if (speculate_factor > 0.0)
+      {
+	/* wake up now and then to look for stragglers */
+	Speculate();
+	(void) MasterReceiveMessage(1.0);
+      }
+    else
+      (void) MasterReceiveMessage(PAR_FOREVER);
+
+  /* wait for the losing copies of speculatively duplicated tasks,
+     which have been told to stop */
+  for (;;)
+    {
+      for (i = 0; i < n_workers; ++i)
+	if (workers[i].n_tasks > 0)
+	  break;
+      if (i >= n_workers)
+	break;
+      (void) MasterReceiveMessage(PAR_FOREVER);
+    }
 
   /* wait for all workers to start up before shutting down */
   while (n_workers_pending > 0)
     MasterReceiveMessage(PAR_FOREVER);
 
+  TelemetryReport();
+
   if (par_verbose)
     Report("Sending terminate messages to %d workers\n",n_workers);
   for (i = 0; i < n_workers; ++i)
-    if (MPI_Send(out_buffer, 0, MPI_PACKED,
-		   workers[i].tid, TERMINATE_MSG,
-		   MPI_COMM_WORLD) != MPI_SUCCESS)
+    if (!SendMessage(out_buffer, 0, workers[i].tid, TERMINATE_MSG))
       Abort("Master cannot send TERMINATE message to worker.\n");
 
   n_workers = 0;   /* consider all workers dead */
@@ -755,10 +1440,24 @@ par_enabled ()
 
 int
 par_workers ()
+{
+  int i;
+  int n;
+
+  if (!par)
+    return(1);
+  n = 0;
+  for (i = 0; i < n_workers; ++i)
+    n += workers[i].capacity;
+  return(n);
+}
+
+int
+par_processes ()
 {
   if (!par)
     return(1);
-  return(n_workers);
+  return(n_ranks);
 }
 
 int
@@ -789,11 +1488,64 @@ par_arch ()
   return arch;
 }
 
+void
+par_set_worker_prefetch (void (*worker_prefetch)())
+{
+  par_worker_prefetch = worker_prefetch;
+}
+
+void
+par_allow_worker_threads ()
+{
+  threads_allowed = TRUE;
+}
+
+int
+par_worker_threads ()
+{
+  if (!par || !threads_allowed || group_size > 0)
+    return(1);
+  return(worker_threads);
+}
+
+void
+par_worker_poll ()
+{
+  /* the threads of a threaded worker never receive messages */
+  if (par && rank > 0 && my_thread == NULL)
+    PrefetchNextTask();
+}
+
+int
+par_task_cancelled ()
+{
+  Boolean cancelled;
+
+  if (!par || rank <= 0)
+    return(FALSE);
+  if (my_thread != NULL)
+    {
+      pthread_mutex_lock(&threads_lock);
+      cancelled = my_thread->cancelled;
+      pthread_mutex_unlock(&threads_lock);
+      return(cancelled);
+    }
+  if (current_task < 0)
+    return(FALSE);
+  HoldArrivedMessages();
+  return(cancelled_task == current_task);
+}
+
 /* DispatchTasks does not return until all queued tasks have been assigned to
-   workers for processing */
+   workers for processing; when batching, tasks are instead left on
+   the queue until a full batch has accumulated or some worker has
+   nothing to do, unless flush is TRUE */
 static void
-DispatchTasks ()
+DispatchTasks (Boolean flush)
 {
+  int i;
+  int k;
+
   /* make sure all broadcasts have completed */
   while (broadcast_first_ack_count < (broadcast_count - 1) ||
 	 broadcast_second_ack_count < (broadcast_count - 1))
@@ -804,132 +1556,570 @@ DispatchTasks ()
 
   /* dispatch all tasks */
   while (first_queued_task != NULL)
-      DispatchTask();
+    {
+      k = BatchSize();
+      /* when flushing, leave some tasks for the other workers */
+      if (flush && n_workers > 1)
+	k = MIN(k, (n_queued_tasks + n_workers - 1) / n_workers);
+      if (k > 1 && !flush && n_queued_tasks < k)
+	{
+	  for (i = 0; i < n_workers; ++i)
+	    if (workers[i].n_tasks == 0)
+	      break;
+	  if (i >= n_workers)
+	    return;
+	}
+      DispatchTask(k);
+    }
+}
+
+/* DispatchReadyTasks assigns queued tasks, largest first, to the
+   workers that are ready for them, but unlike DispatchTasks never waits
+   for a worker to become ready */
+static void
+DispatchReadyTasks ()
+{
+  /* take note of the workers that have finished */
+  while (MasterReceiveMessage(0.0)) ;
+
+  if (broadcast_first_ack_count < (broadcast_count - 1) ||
+      broadcast_second_ack_count < (broadcast_count - 1))
+    return;
+  while (DispatchableTask() != NULL)
+    DispatchTask(BatchSize());
+}
+
+/* BatchSize returns the number of tasks that should be sent to a
+   worker in one message, based on how long tasks have been taking */
+static int
+BatchSize ()
+{
+  int k;
+
+  if (batch_max <= 1 || mean_task_time <= 0.0)
+    return(1);
+  if (mean_task_time * batch_max <= BATCH_SECONDS)
+    k = batch_max;
+  else
+    k = (int) (BATCH_SECONDS / mean_task_time);
+  return(MAX(k, 1));
+}
+
+/* WorkerReady returns TRUE if worker n may be sent more tasks: an
+   ordinary worker may have up to 1 + prefetch_depth messages of tasks
+   outstanding, and a sub-master that many tasks for each of its
+   workers */
+static Boolean
+WorkerReady (int n)
+{
+  if (workers[n].sub_master)
+    return(workers[n].n_tasks < workers[n].capacity * (1 + prefetch_depth));
+  return(workers[n].n_batches <= prefetch_depth);
 }
 
 static void
-DispatchTask ()
+DispatchTask (int k)
 {
   int n;
   int res;
+  int count;
   Task *task;
+  Task *t;
+  double now;
 
-  /* take the first task off the queue */
-  task = first_queued_task;
-  first_queued_task = task->next;
-  if (first_queued_task != NULL)
-    first_queued_task->prev = NULL;
+  /* take the first task that a ready worker can run off the queue,
+     so that a task waiting for a worker of its class (see
+     WorkerMeets) does not hold up the others */
+  while ((task = DispatchableTask()) == NULL)
+    {
+      if (first_queued_task == NULL)
+	return;
+      (void) MasterReceiveMessage(PAR_FOREVER);
+    }
+  if (task->prev != NULL)
+    task->prev->next = task->next;
+  else
+    first_queued_task = task->next;
+  if (task->next != NULL)
+    task->next->prev = task->prev;
   else
-    last_queued_task = NULL;
+    last_queued_task = task->prev;
   task->next = NULL;
+  task->prev = NULL;
+  --n_queued_tasks;
+  NoteQueueDepth();
+
+  /* a large context is given to all workers at once, once they
+     have finished any tasks using the previous context */
+  if (task->context != NULL && !task->context->shared &&
+      task->context->buffer.position >= collective_threshold &&
+      CollectiveAvailable())
+    {
+      for (;;)
+	{
+	  for (n = 0; n < n_workers; ++n)
+	    if (workers[n].n_tasks > 0)
+	      break;
+	  if (n >= n_workers || !CollectiveAvailable())
+	    break;
+	  (void) MasterReceiveMessage(PAR_FOREVER);
+	}
+      if (n >= n_workers)
+	{
+	  if (par_verbose)
+	    Report("Master sending context collectively (%d bytes)\n",
+		   task->context->buffer.position);
+	  CollectiveBroadcast(task->context->buffer.buffer,
+			      task->context->buffer.position);
+	  for (n = 0; n < n_workers; ++n)
+	    {
+	      DisuseContext(&workers[n].last_context);
+	      workers[n].last_context = ReuseContext(task->context);
+	    }
+	  task->context->shared = TRUE;
+	}
+    }
 
   /* find a worker to run it on */
-  n = FindReadyWorker();
+  n = FindReadyWorker(task);
+
+  SendContext(n, task);
+
+  if (!workers[n].sub_master && workers[n].n_batches > prefetch_depth)
+    Abort("Worker %d was assigned more than %d tasks at a time.\n",
+	  n, 1 + prefetch_depth);
 
-  /* check if the context needs to be sent */
-  if (task->context != NULL &&
-      task->context != workers[n].last_context)
+  /* a sub-master is sent enough tasks at once to keep all of its
+     workers busy */
+  if (workers[n].sub_master)
+    k = MAX(k, workers[n].capacity * (1 + prefetch_depth) -
+	    workers[n].n_tasks);
+
+  /* gather up to k tasks to be sent along; they must all use the
+     context that the worker now has */
+  task->next = NULL;
+  count = 1;
+  for (t = task; count < k && first_queued_task != NULL &&
+	 first_queued_task->context == task->context &&
+	 WorkerMeets(n, first_queued_task); ++count)
     {
-      if (MPI_Send(task->context->buffer.buffer, task->context->buffer.position,
-		   MPI_PACKED, workers[n].tid, CONTEXT_MSG,
-		   MPI_COMM_WORLD) != MPI_SUCCESS)
-	Abort("Error sending context to worker.\n");
+      t->next = first_queued_task;
+      first_queued_task->prev = t;
+      t = first_queued_task;
+      first_queued_task = t->next;
+      if (first_queued_task != NULL)
+	first_queued_task->prev = NULL;
+      else
+	last_queued_task = NULL;
+      t->next = NULL;
+      --n_queued_tasks;
+    }
+  NoteQueueDepth();
 
-      DisuseContext(&workers[n].last_context);
-      workers[n].last_context = ReuseContext(task->context);
+  /* send the task(s) */
+  if (count == 1)
+    {
+      if (par_verbose)
+	Report("Master sending task %d to worker %d on %s\n",
+	       task->number, n, workers[n].host);
+
+      if (!SendMessage(task->buffer.buffer, task->buffer.position,
+		       workers[n].tid, TASK_MSG))
+	Abort("Error sending task to worker.\n");
+      MetricsCount("messages_sent", 1);
+      MetricsCount("bytes_sent", task->buffer.position);
+      workers[n].bytes_sent += task->buffer.position;
+    }
+  else
+    {
+      if (par_verbose)
+	Report("Master sending tasks %d-%d to worker %d on %s\n",
+	       task->number, t->number, n, workers[n].host);
+      PrepareToSend();
+      par_pkint(count);
+      for (t = task; t != NULL; t = t->next)
+	{
+	  par_pkint(t->buffer.position);
+	  par_pkbytearray(t->buffer.buffer, t->buffer.position);
+	}
+      Send(workers[n].tid, TASK_BATCH_MSG);
+      workers[n].bytes_sent += out_position;
     }
 
-  /* send the task */
-  if (par_verbose)
-    Report("Master sending task %d to worker %d on %s\n",
-	   task->number, n, workers[n].host);
+  /* record that worker n is performing the task(s) */
+  task->prev = workers[n].last_task;
+  if (workers[n].last_task != NULL)
+    workers[n].last_task->next = task;
+  else
+    workers[n].first_task = task;
+  now = WallTime();
+  if (workers[n].n_tasks == 0)
+    workers[n].assigned_since = now;
+  for (t = task; t != NULL; t = t->next)
+    {
+      RecordHints(n, t);
+      workers[n].last_task = t;
+      t->dispatch_time = now;
+      t->start_time = (t == workers[n].first_task ||
+		       workers[n].sub_master) ? now : -1.0;
+      t->worker_tid = workers[n].tid;
+    }
+  workers[n].n_tasks += count;
+  ++workers[n].n_batches;
+  if (!WorkerReady(n))
+    RemoveFromIdleList(n);
+}
 
-  if (MPI_Send(task->buffer.buffer, task->buffer.position, MPI_PACKED,
-	       workers[n].tid, TASK_MSG, MPI_COMM_WORLD) != MPI_SUCCESS)
-    Abort("Error sending task to worker.\n");
+/* SendContext sends worker n the context of the task if it does not
+   already have it */
+static void
+SendContext (int n, Task *task)
+{
+  if (task->context == NULL || task->context == workers[n].last_context)
+    return;
+  if (!SendMessage(task->context->buffer.buffer,
+		   task->context->buffer.position,
+		   workers[n].tid, CONTEXT_MSG))
+    Abort("Error sending context to worker.\n");
+  MetricsCount("messages_sent", 1);
+  MetricsCount("bytes_sent", task->context->buffer.position);
+  workers[n].bytes_sent += task->context->buffer.position;
+  master_context_bytes += task->context->buffer.position;
+
+  DisuseContext(&workers[n].last_context);
+  workers[n].last_context = ReuseContext(task->context);
+}
 
-  /* record that worker n is performing the task */
-  if (workers[n].first_task == NULL)
+/* Speculate gives each worker that has nothing to do (which only
+   happens once the queue is empty) a copy of the task that has been
+   running longest, provided it has been running at least
+   speculate_factor times the mean task time and has not already been
+   duplicated; whichever copy finishes first supplies the result, and
+   the other is told to stop */
+static void
+Speculate ()
+{
+  int i, m;
+  int next;
+  double now;
+  double running, longest;
+  Task *t;
+  Task *best;
+
+  if (first_queued_task != NULL || mean_task_time <= 0.0)
+    return;
+  now = WallTime();
+  for (i = idle_workers; i >= 0; i = next)
     {
-      workers[n].first_task = task;
-      RemoveFromIdleList(n);
+      next = workers[i].next_idle;
+      if (workers[i].n_tasks > 0)
+	continue;
+      best = NULL;
+      longest = speculate_factor * mean_task_time;
+      for (m = 0; m < n_workers; ++m)
+	{
+	  t = workers[m].first_task;
+	  if (t == NULL || t->copy || t->twin != NULL || t->start_time < 0.0 ||
+	      !WorkerMeets(i, t))
+	    continue;
+	  running = now - t->start_time;
+	  if (running > longest)
+	    {
+	      best = t;
+	      longest = running;
+	    }
+	}
+      if (best == NULL)
+	return;
+      SpeculateTask(i, best);
     }
-  else Abort("Worker %d requested more than 1 task at a time.\n", n);
+}
+
+/* SpeculateTask sends worker n, which has no tasks, a copy of task */
+static void
+SpeculateTask (int n, Task *task)
+{
+  Task *copy;
+
+  copy = (Task *) malloc(sizeof(Task));
+  if (copy == NULL)
+    Abort("Could not allocate task copy\n");
+  *copy = *task;
+  copy->next = NULL;
+  copy->prev = NULL;
+  copy->context = ReuseContext(task->context);
+  copy->n_hints = 0;
+  copy->buffer.size = task->buffer.position > 0 ? task->buffer.position : 1;
+  copy->buffer.buffer = (unsigned char *) malloc(copy->buffer.size);
+  if (copy->buffer.buffer == NULL)
+    Abort("Could not allocate task copy buffer\n");
+  memcpy(copy->buffer.buffer, task->buffer.buffer, task->buffer.position);
+  copy->copy = TRUE;
+  copy->twin = task;
+  task->twin = copy;
+
+  if (par_verbose)
+    Report("Master sending a copy of task %d (running %.1f s) to worker %d on %s\n",
+	   task->number, WallTime() - task->start_time, n, workers[n].host);
+  SendContext(n, copy);
+  if (!SendMessage(copy->buffer.buffer, copy->buffer.position,
+		   workers[n].tid, TASK_MSG))
+    Abort("Error sending task to worker.\n");
+  MetricsCount("messages_sent", 1);
+  MetricsCount("bytes_sent", copy->buffer.position);
+  workers[n].bytes_sent += copy->buffer.position;
+  ++n_speculated;
+
+  copy->dispatch_time = WallTime();
+  copy->start_time = copy->dispatch_time;
+  copy->worker_tid = workers[n].tid;
+  workers[n].first_task = copy;
+  workers[n].last_task = copy;
+  workers[n].n_tasks = 1;
+  workers[n].assigned_since = copy->dispatch_time;
+  ++workers[n].n_batches;
+  if (!WorkerReady(n))
+    RemoveFromIdleList(n);
 }
 
 static int
-FindReadyWorker ()
+FindReadyWorker (Task *task)
 {
+  int i;
+  int best;
+  int score, best_score;
+
   for (;;)
     {
       if (par_verbose)
 	Report("FindReadyWorker: idle_workers = %d\n", idle_workers);
 
-      /* if a worker is totally idle, choose it */
+      /* if a worker that has what the task needs is ready, choose
+	 the one with the fewest tasks assigned so that no worker goes
+	 without work while another holds prefetched tasks; among
+	 those, if the task has affinity keys, prefer the worker that
+	 has most recently seen the most of them, and then the least
+	 capable one, keeping the others for the tasks that need them */
       if (idle_workers >= 0)
-	return(idle_workers);
+	{
+	  if (task->n_hints == 0 && prefetch_depth == 0 &&
+	      max_worker_memory == 0 && max_worker_gpus == 0 &&
+	      task->memory <= 0.0 && task->gpus <= 0)
+	    return(idle_workers);
+	  best = -1;
+	  best_score = -1;
+	  for (i = idle_workers; i >= 0; i = workers[i].next_idle)
+	    {
+	      if (!WorkerMeets(i, task) ||
+		  (best >= 0 && workers[i].n_tasks > workers[best].n_tasks))
+		continue;
+	      score = HintScore(i, task);
+	      if (best < 0 ||
+		  workers[i].n_tasks < workers[best].n_tasks ||
+		  score > best_score ||
+		  (score == best_score && LessCapable(i, best)))
+		{
+		  best = i;
+		  best_score = score;
+		}
+	    }
+	  if (best >= 0)
+	    {
+	      if (par_verbose && best_score > 0)
+		Report("FindReadyWorker: task %d has affinity %d for worker %d\n",
+		       task->number, best_score, best);
+	      return(best);
+	    }
+	}
 
       /* wait for something to happen */
       (void) MasterReceiveMessage(PAR_FOREVER);
     }
 }
 
-static int
-MasterReceiveMessage (float timeout)
+/* DispatchableTask returns the first queued task that one of the ready
+   workers can run (see WorkerMeets), or NULL if there is none */
+static Task *
+DispatchableTask ()
 {
-  int flag;
-  int len;
-  MPI_Status status;
+  int n;
+  Task *t;
+
+  if (idle_workers < 0)
+    return(NULL);
+  if (max_worker_memory == 0 && max_worker_gpus == 0 &&
+      n_workers_pending <= 0)
+    return(first_queued_task);
+  for (t = first_queued_task; t != NULL; t = t->next)
+    for (n = idle_workers; n >= 0; n = workers[n].next_idle)
+      if (WorkerMeets(n, t))
+	return(t);
+  return(NULL);
+}
+
+/* WorkerMeets returns TRUE if worker n may be given the task: a task
+   that needs memory or GPUs is only given to a worker that advertised
+   at least as much, unless no worker did (once all the workers have
+   reported), in which case any worker will do */
+static Boolean
+WorkerMeets (int n, Task *task)
+{
+  if (task->memory > workers[n].memory &&
+      (task->memory <= max_worker_memory || n_workers_pending > 0))
+    return(FALSE);
+  if (task->gpus > workers[n].gpus &&
+      (task->gpus <= max_worker_gpus || n_workers_pending > 0))
+    return(FALSE);
+  return(TRUE);
+}
+
+/* LessCapable returns TRUE if worker n advertised fewer GPUs than
+   worker m, or as many and less memory */
+static Boolean
+LessCapable (int n, int m)
+{
+  if (workers[n].gpus != workers[m].gpus)
+    return(workers[n].gpus < workers[m].gpus);
+  return(workers[n].memory < workers[m].memory);
+}
+
+/* NoteWorkerClasses records the most memory and GPUs that any of the
+   workers advertised, after a worker has joined or been lost */
+static void
+NoteWorkerClasses ()
+{
+  int n;
+
+  max_worker_memory = 0;
+  max_worker_gpus = 0;
+  for (n = 0; n < n_workers; ++n)
+    {
+      max_worker_memory = MAX(max_worker_memory, workers[n].memory);
+      max_worker_gpus = MAX(max_worker_gpus, workers[n].gpus);
+    }
+}
+
+/* HintScore returns how well the affinity keys of the task match
+   those recently seen by worker n; a key that was seen more recently
+   counts for more */
+static int
+HintScore (int n, Task *task)
+{
+  int i, j, k;
+  int score;
+
+  score = 0;
+  for (i = 0; i < task->n_hints; ++i)
+    for (j = 1; j <= workers[n].n_recent_hints; ++j)
+      {
+	k = (workers[n].next_recent_hint - j + PAR_HINT_HISTORY) %
+	  PAR_HINT_HISTORY;
+	if (workers[n].recent_hints[k] == task->hints[i])
+	  {
+	    score += PAR_HINT_HISTORY + 1 - j;
+	    break;
+	  }
+      }
+  return(score);
+}
+
+static void
+RecordHints (int n, Task *task)
+{
+  int i;
+
+  for (i = 0; i < task->n_hints; ++i)
+    {
+      workers[n].recent_hints[workers[n].next_recent_hint] = task->hints[i];
+      workers[n].next_recent_hint = (workers[n].next_recent_hint + 1) %
+	PAR_HINT_HISTORY;
+      if (workers[n].n_recent_hints < PAR_HINT_HISTORY)
+	++workers[n].n_recent_hints;
+    }
+}
+
+static unsigned int
+HashKey (char *key)
+{
+  unsigned int h;
+
+  /* FNV-1a; collisions only cost a poorer placement */
+  h = 2166136261U;
+  while (*key != '\0')
+    h = (h ^ (unsigned char) *key++) * 16777619U;
+  return(h);
+}
+
+static int
+MasterReceiveMessage (float timeout)
+{
+  int flag;
+  int len;
+  int tag, source;
   struct timeval end_time, current_time;
   struct timespec duration;
+  int prev;
+  int i;
+  double wait_start;
 
   if (par_verbose)
     Report("Master entering MasterReceiveMessage.\n");
+  prev = MetricsPhase(METRICS_COMMUNICATE);
+  wait_start = 0.0;
+  if (telemetry_file != NULL)
+    {
+      Heartbeat(FALSE);
+      wait_start = WallTime();
+    }
   if (timeout == 0.0)
     {
       /* check if any message has arrived */
-      if (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-		     &flag, &status) != MPI_SUCCESS)
-	Abort("Could not probe for messages in MasterReceiveMessage()\n");
-
-      if (!flag)
-	/* no message has arrived */
-	return(0);
+      if (!ProbeMessage(FALSE, &tag, &source, &len))
+	{
+	  /* no message has arrived */
+	  MetricsPhase(prev);
+	  if (telemetry_file != NULL)
+	    master_wait_seconds += WallTime() - wait_start;
+	  return(0);
+	}
 
       /* a message is there; now receive it */
-      if (MPI_Get_count(&status, MPI_PACKED, &len) != MPI_SUCCESS)
-	Abort("Could not obtain number of bytes in message\n");
-
       if (par_verbose)
 	Report("Master going to receive message of %d bytes\n", len);
 
       if (len > in_size)
 	ExpandInBuffer(len);
 
-      if (MPI_Recv(in_buffer, len, MPI_PACKED, MPI_ANY_SOURCE, MPI_ANY_TAG,
-		   MPI_COMM_WORLD, &status) != MPI_SUCCESS)
+      if (!ReceiveMessage(in_buffer, len, source, tag))
 	Abort("Master could not receive message.\n");
     }
   else if (timeout < 0.0)
     {
       /* we can't spawn new workers, so we'll have
-	 to be patient and wait for one to free up */
-      if (MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-		    &status) != MPI_SUCCESS)
-	Abort("Could not probe for messages in MasterReceiveMessage()\n");
+	 to be patient and wait for one to free up; if heartbeats
+	 are wanted, we poll so that they can be written while
+	 waiting */
+      if (telemetry_file != NULL && heartbeat_interval > 0)
+	{
+	  duration.tv_sec = 0;
+	  duration.tv_nsec = 10000000;	/* 10 milliseconds */
+	  while (!ProbeMessage(FALSE, &tag, &source, &len))
+	    {
+	      nanosleep(&duration, NULL);
+	      Heartbeat(FALSE);
+	    }
+	}
+      else
+	ProbeMessage(TRUE, &tag, &source, &len);
 
       /* a message is there; now receive it */
-      if (MPI_Get_count(&status, MPI_PACKED, &len) != MPI_SUCCESS)
-	Abort("Could not obtain number of bytes in message\n");
-
       if (par_verbose)
 	Report("Master going to receive message of %d bytes\n", len);
 
       if (len > in_size)
 	ExpandInBuffer(len);
 
-      if (MPI_Recv(in_buffer, len, MPI_PACKED, MPI_ANY_SOURCE, MPI_ANY_TAG,
-		   MPI_COMM_WORLD, &status) != MPI_SUCCESS)
+      if (!ReceiveMessage(in_buffer, len, source, tag))
 	Abort("Master could not receive message.\n");
     }
   else
@@ -951,10 +2141,7 @@ MasterReceiveMessage (float timeout)
       duration.tv_nsec = 10000000;	/* 10 milliseconds */
       do {
 	/* check if any message has arrived */
-	if (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-		       &flag, &status) != MPI_SUCCESS)
-	  Abort("Could not probe for messages in MasterReceiveMessage()\n");
-
+	flag = ProbeMessage(FALSE, &tag, &source, &len);
 	if (flag)
 	  break;
 
@@ -967,21 +2154,35 @@ MasterReceiveMessage (float timeout)
 		current_time.tv_usec < end_time.tv_usec));
 
       if (!flag)
-	return(0);
+	{
+	  MetricsPhase(prev);
+	  if (telemetry_file != NULL)
+	    master_wait_seconds += WallTime() - wait_start;
+	  return(0);
+	}
 
       /* a message is there; now receive it */
-      if (MPI_Get_count(&status, MPI_PACKED, &len) != MPI_SUCCESS)
-	Abort("Could not obtain number of bytes in message\n");
       if (len > in_size)
 	ExpandInBuffer(len);
       
-      if (MPI_Recv(in_buffer, len, MPI_PACKED, MPI_ANY_SOURCE, MPI_ANY_TAG,
-		   MPI_COMM_WORLD, &status) != MPI_SUCCESS)
+      if (!ReceiveMessage(in_buffer, len, source, tag))
 	Abort("Master could not receive message.\n");
     }
 
+  MetricsPhase(prev);
+  MetricsCount("messages_received", 1);
+  MetricsCount("bytes_received", len);
+  if (telemetry_file != NULL)
+    {
+      master_wait_seconds += WallTime() - wait_start;
+      for (i = 0; i < n_workers; ++i)
+	if (workers[i].tid == source)
+	  workers[i].bytes_received += len;
+    }
+
   in_position = 0;
-  HandleMessage(status.MPI_TAG, status.MPI_SOURCE);
+  in_length = len;
+  HandleMessage(tag, source);
   return(1);
 }
 
@@ -993,9 +2194,20 @@ HandleMessage (int msg_tag, int tid)
     case REQUEST_MSG:
       HandleRequest(tid);
       break;
+
+    case RESULTS_MSG:
+      HandleResults(tid);
+      break;
 	      
+    case RELAY_RESULTS_MSG:
+      HandleRelayResults(tid);
+      break;
+
     case BROADCAST_ACK_MSG:
-      HandleBroadcastAck(tid);
+      if (relay)
+	ReceiveBroadcastAck(tid);
+      else
+	HandleBroadcastAck(tid);
       break;
 
     case WORKER_EXIT_MSG:
@@ -1003,7 +2215,10 @@ HandleMessage (int msg_tag, int tid)
       break;
 
     default:
-      Error("Master received unknown message: %d\n", msg_tag);
+      if (relay && tid == master_tid)
+	RelayMessage(msg_tag);
+      else
+	Error("Master received unknown message: %d\n", msg_tag);
     }
 }
 
@@ -1013,14 +2228,24 @@ HandleRequest (int tid)
   int tc;
   int n;
   int result_appended;
-  int index, bit;
-  int current;
+  int capacity;
+  int memory, gpus;
+  double seconds;
   Hostname worker_host_name;
 
-  /* locate the worker in the worker table */
+  /* locate the worker in the worker table; a sub-master reports
+     with -2 and the number of its workers, and a new worker then
+     gives the memory and GPUs it advertises */
   tc = par_upkint();
   if (tc < 0)
     par_upkstr(worker_host_name);
+  capacity = (tc == -2) ? par_upkint() : 1;
+  memory = gpus = 0;
+  if (tc < 0)
+    {
+      memory = par_upkint();
+      gpus = par_upkint();
+    }
 
   if (par_verbose)
     Report("Master: HandleRequest called (tid = %d tc = %d %s\n",
@@ -1035,74 +2260,301 @@ HandleRequest (int tid)
       if (par_verbose)
         Report("Received msg from new worker: %d\n", tid);
       --n_workers_pending;
-      /* check that integer value sent is -1 */
-      if (tc != -1)
+      /* check that integer value sent is -1 (or -2) */
+      if (tc != -1 && tc != -2)
         Abort("Initial worker message was invalid.\n");
       /* add it to the table of workers */
+      if (n_workers >= workers_size)
+	{
+	  workers_size = (workers_size == 0) ? PAR_MAX_WORKERS :
+	    2 * workers_size;
+	  workers = (WorkerState *) realloc(workers,
+					    workers_size *
+					    sizeof(WorkerState));
+	  if (workers == NULL)
+	    Abort("Could not allocate worker table of %d entries\n",
+		  workers_size);
+	}
       workers[n_workers].tid = tid;
       strcpy(workers[n_workers].host, worker_host_name);
       workers[n_workers].idle = FALSE;
       workers[n_workers].last_context = NULL;
       workers[n_workers].first_task = NULL;
+      workers[n_workers].last_task = NULL;
+      workers[n_workers].n_tasks = 0;
+      workers[n_workers].n_batches = 0;
+      workers[n_workers].n_recent_hints = 0;
+      workers[n_workers].next_recent_hint = 0;
+      workers[n_workers].start_time = WallTime();
+      workers[n_workers].assigned_since = 0.0;
+      workers[n_workers].assigned_seconds = 0.0;
+      workers[n_workers].busy_seconds = 0.0;
+      workers[n_workers].context_seconds = 0.0;
+      workers[n_workers].n_completed = 0;
+      workers[n_workers].bytes_sent = 0.0;
+      workers[n_workers].bytes_received = 0.0;
+      workers[n_workers].capacity = capacity;
+      workers[n_workers].sub_master = (tc == -2);
+      workers[n_workers].memory = memory;
+      workers[n_workers].gpus = gpus;
       PutOnIdleList(n_workers);
       if (par_verbose)
         Report("Worker %d started on host %s\n", n_workers, workers[n_workers].host);
+      if (par_verbose && (memory > 0 || gpus > 0))
+        Report("Worker %d advertises %d MB of memory and %d GPUs\n",
+	       n_workers, memory, gpus);
+      if (par_verbose && tc == -2)
+        Report("Worker %d is a sub-master of %d workers\n", n_workers,
+	       capacity);
       ++n_workers;
+      NoteWorkerClasses();
+      MetricsGauge("workers", n_workers);
       return;
     }
 
   /* this is an old worker */
-  /* update the first_task field */
-  if (tc >= 0 && workers[n].first_task->number == tc)
+  if (tc >= 0)
     {
-      /* we are done with the first task */
-      if (par_verbose)
-	Report("Master received result of task %d from worker %d on host %s\n",
-	       tc, n, workers[n].host);
       result_appended = par_upkint();
-      if (result_appended && par_master_result != NULL)
-	{
-	  if (par_unpack_result != NULL)
-	    (*par_unpack_result)();
-	  (*par_master_result)(tc);
-	}
-      --tasks_outstanding;
-      DisuseContext(&workers[n].first_task->context);
-
-      /* free up the task buffer */
-      FreeBuffer(&workers[n].first_task->buffer);
-
-      /* mark as finished */
-      index = (((workers[n].first_task->number - task_completed_first) >> 3) +
-	       task_completed_offset) % task_completed_size;
-      bit = (workers[n].first_task->number - task_completed_first) & 7;
-      task_completed[index] |= 1 << bit;
-      if (index == task_completed_offset)
-	{
-	  current = (((task_number - task_completed_first) >> 3) +
-		     task_completed_offset) % task_completed_size;
-	  while (task_completed_offset != current)
-	    {
-	      if (task_completed[task_completed_offset] != 0xff)
-		break;
-	      task_completed_first += 8;
-	      if (++task_completed_offset >= task_completed_size)
-		task_completed_offset = 0;
-	    }
-	}
-
-      free(workers[n].first_task);
-      workers[n].first_task = NULL;
+      seconds = par_upkdouble();
+      workers[n].context_seconds += par_upkdouble();
+      NoteTaskTime(seconds, 1);
+      CompleteTask(n, tc, seconds, result_appended);
+      --workers[n].n_batches;
     }
   else
     if (tc != -1)
       Error("Worker %d on host %s completed task %d instead of %d\n",
 	    n, workers[n].host, tc, workers[n].first_task->number);
 
-  if (workers[n].first_task == NULL)
+  if (WorkerReady(n))
+    PutOnIdleList(n);
+}
+
+/* HandleResults processes the results of a batch of tasks that
+   were sent to a worker in one message */
+static void
+HandleResults (int tid)
+{
+  int n;
+  int i;
+  int count;
+  int tc;
+  double seconds;
+
+  for (n = 0; n < n_workers; ++n)
+    if (workers[n].tid == tid)
+      break;
+  if (n >= n_workers)
+    Abort("Received results from unknown worker %d\n", tid);
+
+  count = par_upkint();
+  for (i = 0; i < count; ++i)
+    {
+      tc = par_upkint();
+      seconds = par_upkdouble();
+      CompleteTask(n, tc, seconds, par_upkint());
+    }
+  NoteTaskTime(par_upkdouble(), count);
+  workers[n].context_seconds += par_upkdouble();
+  if (par_verbose)
+    Report("Master received %d results from worker %d; mean task time %f\n",
+	   count, n, mean_task_time);
+  --workers[n].n_batches;
+  if (WorkerReady(n))
+    PutOnIdleList(n);
+}
+
+/* HandleRelayResults processes the results of tasks that a
+   sub-master's workers have performed */
+static void
+HandleRelayResults (int tid)
+{
+  int n;
+  int i;
+  int count;
+  int tc;
+  int result_appended;
+  int len;
+  double seconds;
+  unsigned char *save_buffer;
+  int save_size;
+  int save_position;
+  Buffer result;
+
+  for (n = 0; n < n_workers; ++n)
+    if (workers[n].tid == tid)
+      break;
+  if (n >= n_workers)
+    Abort("Received results from unknown sub-master %d\n", tid);
+
+  count = par_upkint();
+  for (i = 0; i < count; ++i)
+    {
+      tc = par_upkint();
+      seconds = par_upkdouble();
+      result_appended = par_upkint();
+      len = par_upkint();
+      result.size = (len > 0) ? len : 1;
+      result.buffer = (unsigned char *) malloc(result.size);
+      if (result.buffer == NULL)
+	Abort("Could not allocate relayed result of %d bytes\n", len);
+      par_upkbytearray(result.buffer, len);
+
+      /* the result is unpacked from its own buffer */
+      save_buffer = in_buffer;
+      save_size = in_size;
+      save_position = in_position;
+      in_buffer = result.buffer;
+      in_size = result.size;
+      in_position = 0;
+      CompleteTask(n, tc, seconds, result_appended);
+      in_buffer = save_buffer;
+      in_size = save_size;
+      in_position = save_position;
+      FreeBuffer(&result);
+      NoteTaskTime(seconds, 1);
+    }
+  workers[n].context_seconds += par_upkdouble();
+  if (par_verbose)
+    Report("Master received %d results from sub-master %d; mean task time %f\n",
+	   count, n, mean_task_time);
+  if (WorkerReady(n))
     PutOnIdleList(n);
 }
 
+/* NoteTaskTime updates the running average of the time per task
+   with a report that count tasks took seconds on a worker */
+static void
+NoteTaskTime (double seconds, int count)
+{
+  if (count <= 0)
+    return;
+  if (mean_task_time <= 0.0)
+    mean_task_time = seconds / count;
+  else
+    mean_task_time = 0.75 * mean_task_time + 0.25 * seconds / count;
+  if (mean_task_time <= 0.0)
+    mean_task_time = 1.0e-6;
+}
+
+/* CompleteTask records that worker n has finished task tc, which
+   must be the first task assigned to it (or, for a sub-master, any
+   of them) and which the worker reports took seconds, and hands its
+   result (if result_appended) to the user's (*master_result)(), or
+   on a sub-master, passes it on towards the master */
+static void
+CompleteTask (int n, int tc, double seconds, int result_appended)
+{
+  Task *task;
+  Boolean duplicate;
+  int start;
+
+  task = workers[n].first_task;
+  if (workers[n].sub_master)
+    while (task != NULL && task->number != tc)
+      task = task->next;
+  if (task == NULL || task->number != tc)
+    {
+      Error("Worker %d on host %s completed task %d instead of %d\n",
+	    n, workers[n].host, tc,
+	    workers[n].first_task != NULL ? workers[n].first_task->number : -1);
+      return;
+    }
+
+  /* a speculatively duplicated task may already have been completed
+     by its other copy, in which case this result is only read past */
+  duplicate = par_finished(tc);
+
+  /* we are done with the first task */
+  if (par_verbose)
+    Report("Master received %sresult of task %d from worker %d on host %s\n",
+	   duplicate ? "duplicate " : "", tc, n, workers[n].host);
+  start = in_position;
+  if (result_appended && par_master_result != NULL)
+    {
+      if (par_unpack_result != NULL)
+	(*par_unpack_result)();
+      if (!duplicate && !relay)
+	(*par_master_result)(tc);
+    }
+  if (relay)
+    RelayResult(tc, seconds, result_appended,
+		in_buffer + start, in_position - start);
+  else if (!duplicate)
+    JournalTask(tc, seconds, in_buffer + start, in_position - start);
+  DisuseContext(&task->context);
+
+  /* free up the task buffer */
+  FreeBuffer(&task->buffer);
+
+  if (task->twin != NULL)
+    {
+      /* tell the other copy to stop */
+      if (par_verbose)
+	Report("Master cancelling the other copy of task %d\n", tc);
+      PrepareToSend();
+      par_pkint(tc);
+      Send(task->twin->worker_tid, CANCEL_MSG);
+      task->twin->twin = NULL;
+      task->twin = NULL;
+      if (task->copy)
+	++n_speculation_wins;
+    }
+
+  if (task->prev != NULL)
+    task->prev->next = task->next;
+  else
+    workers[n].first_task = task->next;
+  if (task->next != NULL)
+    {
+      task->next->prev = task->prev;
+      if (task->prev == NULL && !workers[n].sub_master)
+	task->next->start_time = WallTime();
+    }
+  else
+    workers[n].last_task = task->prev;
+  --workers[n].n_tasks;
+  if (telemetry_file != NULL)
+    NoteTaskRecord(n, task, seconds, duplicate);
+  free(task);
+  if (duplicate || relay)
+    return;
+  --tasks_outstanding;
+  MetricsCount("tasks_completed", 1);
+  MetricsGauge("tasks_outstanding", tasks_outstanding);
+  MetricsGauge("tasks_queued", n_queued_tasks);
+  MarkTaskFinished(tc);
+}
+
+/* MarkTaskFinished sets the bit of task tc in task_completed,
+   advancing task_completed_first past any leading bytes that have
+   become complete */
+static void
+MarkTaskFinished (int tc)
+{
+  int index, bit;
+  int current;
+
+  index = (((tc - task_completed_first) >> 3) +
+	   task_completed_offset) % task_completed_size;
+  bit = (tc - task_completed_first) & 7;
+  task_completed[index] |= 1 << bit;
+  if (index == task_completed_offset)
+    {
+      current = (((task_number - task_completed_first) >> 3) +
+		 task_completed_offset) % task_completed_size;
+      while (task_completed_offset != current)
+	{
+	  if (task_completed[task_completed_offset] != 0xff)
+	    break;
+	  task_completed_first += 8;
+	  if (++task_completed_offset >= task_completed_size)
+	    task_completed_offset = 0;
+	}
+    }
+}
+
 static void
 HandleBroadcastAck (int from_tid)
 {
@@ -1153,6 +2605,8 @@ QueueTask (Task* task)
   else
     first_queued_task = task;
   last_queued_task = task;
+  ++n_queued_tasks;
+  NoteQueueDepth();
 }
      
 static void
@@ -1167,8 +2621,47 @@ RequeueTask (Task *task)
   else
     last_queued_task = task;
   first_queued_task = task;
+  ++n_queued_tasks;
+  NoteQueueDepth();
 }
      
+/* QueueTaskBySize puts a task that has a size hint on the queue ahead
+   of the smaller tasks at its end that share its context, so that
+   the largest tasks are dispatched first; tasks of equal size stay
+   in the order they were delegated */
+static void
+QueueTaskBySize (Task *task)
+{
+  Task *t;
+
+  for (t = last_queued_task;
+       t != NULL && t->context == task->context &&
+	 t->size >= 0.0 && t->size < task->size;
+       t = t->prev) ;
+  if (t == NULL)
+    {
+      task->prev = NULL;
+      task->next = first_queued_task;
+      if (first_queued_task != NULL)
+	first_queued_task->prev = task;
+      else
+	last_queued_task = task;
+      first_queued_task = task;
+    }
+  else
+    {
+      task->prev = t;
+      task->next = t->next;
+      if (t->next != NULL)
+	t->next->prev = task;
+      else
+	last_queued_task = task;
+      t->next = task;
+    }
+  ++n_queued_tasks;
+  NoteQueueDepth();
+}
+
 static Context*
 ReuseContext (Context *context)
 {
@@ -1207,11 +2700,11 @@ DisuseContext (Context **pContext)
 	fprintf(stderr,
 		"CONTEXT ERROR: worker %d has a pointer to deleted context %p\n",
 		i, context);
-      if (workers[i].first_task != NULL &&
-	  workers[i].first_task->context == context)
-	fprintf(stderr,
-		"CONTEXT ERROR: the first_task of worker %d has a pointer to deleted context %p\n",
-		i, context);
+      for (t = workers[i].first_task; t != NULL; t = t->next)
+	if (t->context == context)
+	  fprintf(stderr,
+		  "CONTEXT ERROR: task %p assigned to worker %d has a pointer to deleted context %p\n",
+		  t, i, context);
     }
   for (t = first_queued_task; t != NULL; t = t->next)
     if (t->context == context)
@@ -1276,8 +2769,31 @@ RemoveFromIdleList (int n)
 static void
 DeclareWorkerDead (int n)
 {
-  if (workers[n].first_task != NULL)
-    RequeueTask(workers[n].first_task);
+  Task *task;
+
+  /* put all of its tasks back at the front of the queue, keeping
+     them in their original order; a task that has been completed
+     elsewhere, or whose other copy is still running, is dropped */
+  while ((task = workers[n].last_task) != NULL)
+    {
+      workers[n].last_task = task->prev;
+      if (par_finished(task->number) || task->twin != NULL)
+	{
+	  if (task->twin != NULL)
+	    task->twin->twin = NULL;
+	  DisuseContext(&task->context);
+	  FreeBuffer(&task->buffer);
+	  free(task);
+	}
+      else
+	{
+	  task->copy = FALSE;
+	  RequeueTask(task);
+	}
+    }
+  workers[n].first_task = NULL;
+  workers[n].n_tasks = 0;
+  workers[n].n_batches = 0;
   RemoveFromIdleList(n);
 
   --n_workers;
@@ -1293,6 +2809,7 @@ DeclareWorkerDead (int n)
 	  PutOnIdleList(n);
 	}
     }
+  NoteWorkerClasses();
 }
 
 static void
@@ -1302,43 +2819,73 @@ PerformWorkerTasks ()
   int msg_type;
   int task_num;
   int from_tid;
-  int i;
-  int dest;
   int oldid;
   struct timeval task_start;
   struct timeval task_end;
   long task_sec;
   long task_usec;
+  Buffer batch;
+  double context_start;
 
 #ifdef PTHREADS
   /* launch another thread that will actually execute the tasks */
 #endif
 
-  ComposeRequest(-1, FALSE);
+  ComposeRequest(-1, FALSE, 0.0);
   Send(master_tid, REQUEST_MSG);
+  task_sec = 0;
+  task_usec = 0;
 
   for (;;)
     {
-      msg_type = WorkerReceiveMessage(&from_tid);
+      if (first_held_message != NULL)
+	msg_type = ReleaseHeldMessage(&from_tid);
+      else
+	{
+	  msg_type = WorkerReceiveMessage(&from_tid);
+	  current_batch_size = 0;
+	}
 
       switch (msg_type)
 	{
 	case CONTEXT_MSG:
+	  context_start = WallTime();
 	  if (par_unpack_context != NULL)
 	    (*par_unpack_context)();
 	  if (par_worker_context != NULL)
 	    (*par_worker_context)();
+	  context_seconds += WallTime() - context_start;
+	  break;
+	case COLLECTIVE_CONTEXT_MSG:
+	  context_start = WallTime();
+	  ReceiveCollectiveContext(par_upkint());
+	  context_seconds += WallTime() - context_start;
+	  break;
+	case TASK_BATCH_MSG:
+	  /* split the batch into individual held tasks */
+	  batch.buffer = in_buffer;
+	  batch.size = in_size;
+	  batch.position = 0;
+	  in_buffer = NULL;
+	  in_size = 0;
+	  in_position = 0;
+	  HoldMessage(TASK_BATCH_MSG, from_tid, &batch);
 	  break;
 	case TASK_MSG:
 	  task_num = par_upkint();
+	  current_task = task_num;
 	  if (par_verbose)
 	    Report("Worker received task %d\n", task_num);
 	  if (par_unpack_task != NULL)
 	    (*par_unpack_task)();
+	  /* give the application a chance to start on the next task's
+	     input while this one is being performed */
+	  PrefetchNextTask();
 	  if (par_worker_task != NULL) {
 	    if (gettimeofday(&task_start, NULL) != 0)
 	      Abort("Worker could not get time of day.\n");
 	    (*par_worker_task)();
+	    MetricsPhase(METRICS_OTHER);
 	    if (gettimeofday(&task_end, NULL) != 0)
 	      Abort("Worker could not get time of day.\n");
 	    task_sec= task_end.tv_sec-task_start.tv_sec;
@@ -1356,143 +2903,60 @@ PerformWorkerTasks ()
 		longest_task.tv_usec= task_usec;
 	      }
 	  }
-	  if (par_master_result != NULL)
+	  if (current_batch_size > 0)
+	    {
+	      /* the results of a batch are returned together in one
+		 message, which is built up in out_buffer */
+	      if (current_batch_index == 0)
+		{
+		  PrepareToSend();
+		  par_pkint(current_batch_size);
+		  batch_seconds = 0.0;
+		}
+	      else
+		out_position = batch_position;
+	      par_pkint(task_num);
+	      par_pkdouble(task_sec + 0.000001 * task_usec);
+	      par_pkint(par_master_result != NULL);
+	      if (par_master_result != NULL && par_pack_result != NULL)
+		(*par_pack_result)();
+	      batch_seconds += task_sec + 0.000001 * task_usec;
+	      if (current_batch_index == current_batch_size - 1)
+		{
+		  par_pkdouble(batch_seconds);
+		  par_pkdouble(context_seconds);
+		  context_seconds = 0.0;
+		  Send(master_tid, RESULTS_MSG);
+		}
+	      else
+		batch_position = out_position;
+	    }
+	  else if (par_master_result != NULL)
 	    {
-	      ComposeRequest(task_num, TRUE);
+	      ComposeRequest(task_num, TRUE, task_sec + 0.000001 * task_usec);
 	      if (par_pack_result != NULL)
 		(*par_pack_result)();
 	      Send(master_tid, REQUEST_MSG);
 	    }
 	  else
 	    {
-	      ComposeRequest(task_num, FALSE);
+	      ComposeRequest(task_num, FALSE, task_sec + 0.000001 * task_usec);
 	      Send(master_tid, REQUEST_MSG);
 	    }
+	  current_task = -1;
+	  MetricsEmit("task", task_num);
+	  break;
+	case CANCEL_MSG:
+	  /* the task has already been finished */
+	  cancelled_task = par_upkint();
 	  break;
 	case BROADCAST_CONTEXT_MSG:
-	  broadcast_count = par_upkint();
-	  if (broadcast_count == 0)
-	    {
-	      n_processes = par_upkint();
-	      par_upkintarray(process_tids, n_processes);
-	      /* find my_process_index */
-	      for (i = 0; i < n_processes; ++i)
-		if (process_tids[i] == my_tid)
-		  {
-		    my_process_index = i;
-		    break;
-		  }
-	      if (i >= n_processes)
-		Abort("Could not find my process tid in process array.\n");
-	      dest = (my_process_index << 1) + 1;
-	      if (dest < n_processes)
-		broadcast_first_forward_tid = process_tids[dest];
-	      dest = (my_process_index << 1) + 2;
-	      if (dest < n_processes)
-		broadcast_second_forward_tid = process_tids[dest];
-	      dest = (my_process_index - 1) >> 1;
-	      broadcast_backward_tid = process_tids[dest];
-	    }
-	  if (par_verbose)
-	    Report("Process %d received broadcast context %d\n",
-		   my_process_index, broadcast_count);
-	  /* handle the broadcast message locally */
-	  if (par_unpack_context != NULL)
-	    (*par_unpack_context)();
-	  if (par_worker_context != NULL)
-	    (*par_worker_context)();
-
-	  if (broadcast_first_forward_tid >= 0)
-	    {
-	      if (par_verbose)
-		Report("Process %d relaying context %d onto tid %d\n",
-		       my_process_index, broadcast_count,
-		       broadcast_first_forward_tid);
-
-	      /* prepare message */
-	      PrepareToSend();
-	      par_pkint(broadcast_count);
-	      if (broadcast_count == 0)
-		{
-		  par_pkint(n_processes);
-		  par_pkintarray(process_tids, n_processes);
-		}
-	      if (par_pack_context != NULL)
-		(*par_pack_context)();
-	      Send(broadcast_first_forward_tid, BROADCAST_CONTEXT_MSG);
-	    }
-	  else
-	    broadcast_first_ack_count = broadcast_count;
-
-	  if (broadcast_second_forward_tid >= 0)
-	    {
-	      if (par_verbose)
-		Report("Process %d relaying context %d onto tid %d\n",
-		       my_process_index, broadcast_count,
-		       broadcast_second_forward_tid);
-
-	      /* prepare message */
-	      PrepareToSend();
-	      par_pkint(broadcast_count);
-	      if (broadcast_count == 0)
-		{
-		  par_pkint(n_processes);
-		  par_pkintarray(process_tids, n_processes);
-		}
-	      if (par_pack_context != NULL)
-		(*par_pack_context)();
-	      Send(broadcast_second_forward_tid, BROADCAST_CONTEXT_MSG);
-	    }
-	  else 
-	    broadcast_second_ack_count = broadcast_count;
-
-	  if (broadcast_first_ack_count == broadcast_count &&
-	      broadcast_second_ack_count == broadcast_count)
-	    {
-	      /* we can acknowledge this immediately */
-	      if (par_verbose)
-		Report("Process %d sending immediate acknowledge of %d\n",
-		       my_process_index, broadcast_count);
-	      PrepareToSend();
-	      par_pkint(broadcast_count);
-	      Send(broadcast_backward_tid, BROADCAST_ACK_MSG);
-	    }
+	  context_start = WallTime();
+	  ReceiveBroadcastContext();
+	  context_seconds += WallTime() - context_start;
 	  break;
 	case BROADCAST_ACK_MSG:
-	  broadcast_count = par_upkint();
-	  if (par_verbose)
-	    Report("Process %d received acknowledgement of %d from %d\n",
-		   my_process_index, broadcast_count, from_tid);
-	  if (from_tid == broadcast_first_forward_tid)
-	    {
-	      broadcast_first_ack_count = broadcast_count;
-	      if (broadcast_first_ack_count <= broadcast_second_ack_count)
-		{
-		  /* relay acknowledgement */
-		  if (par_verbose)
-		    Report("Process %d relaying acknowledgement of %d\n",
-			   my_process_index, broadcast_count);
-		  PrepareToSend();
-		  par_pkint(broadcast_count);
-		  Send(broadcast_backward_tid, BROADCAST_ACK_MSG);
-		}
-	    }
-	  else if (from_tid == broadcast_second_forward_tid)
-	    {
-	      broadcast_second_ack_count = broadcast_count;
-	      if (broadcast_second_ack_count <= broadcast_first_ack_count)
-		{
-		  /* relay acknowledgement */
-		  if (par_verbose)
-		    Report("Process %d relaying acknowledgement of %d\n",
-			   my_process_index, broadcast_count);
-		  PrepareToSend();
-		  par_pkint(broadcast_count);
-		  Send(broadcast_backward_tid, BROADCAST_ACK_MSG);
-		}
-	    }
-	  else
-	    Abort("Received BROADCAST_ACK_MSG from unexpected source.\n");
+	  ReceiveBroadcastAck(from_tid);
 	  break;
 	case TERMINATE_MSG:
 	  if (par_verbose)
@@ -1505,77 +2969,1706 @@ PerformWorkerTasks ()
     }
 }
 
+/* ThreadTasks is the main loop of a worker run with -PAR_THREADS=n
+   (see par_allow_worker_threads): it reports to the master as a
+   sub-master of n workers would, holds the contexts and tasks it is
+   sent in the order they arrive, and hands each task to the first of
+   its n threads that has nothing to do; a context or broadcast is
+   taken in by this thread itself once the threads have finished the
+   tasks before it.  The results are returned to the master a batch
+   at a time, as a sub-master's are.  Only this thread sends or
+   receives messages. */
 static void
-ComposeRequest (int last_task_completed, int result_appended)
+ThreadTasks ()
+{
+  int i;
+  int msg_type;
+  int from_tid;
+  int busy;
+  Boolean terminate;
+  Message *msg;
+  WorkerThread *wt;
+  double context_start;
+  double last_active;
+  double now;
+  struct timespec until;
+
+  threads = (WorkerThread *) malloc(worker_threads * sizeof(WorkerThread));
+  if (threads == NULL)
+    Abort("Could not allocate table of %d worker threads\n", worker_threads);
+  for (i = 0; i < worker_threads; ++i)
+    {
+      wt = &threads[i];
+      wt->index = i;
+      wt->msg = NULL;
+      wt->task = -1;
+      wt->done = FALSE;
+      wt->cancelled = FALSE;
+      wt->quit = FALSE;
+      if (pthread_cond_init(&wt->wake, NULL) != 0 ||
+	  pthread_create(&wt->thread, NULL, WorkerThreadMain, wt) != 0)
+	Abort("Could not create worker thread %d\n", i);
+    }
+  if (par_verbose)
+    Report("Worker %d performing tasks on %d threads\n", rank,
+	   worker_threads);
+
+  PrepareToSend();
+  par_pkint(-2);
+  par_pkstr(my_host_name);
+  par_pkint(worker_threads);
+  par_pkint(my_memory);
+  par_pkint(my_gpus);
+  Send(master_tid, REQUEST_MSG);
+
+  terminate = FALSE;
+  last_active = WallTime();
+  while (!terminate)
+    {
+      HoldArrivedMessages();
+
+      /* take the results of the tasks the threads have finished, and
+	 give the threads that have nothing to do the next tasks */
+      busy = 0;
+      pthread_mutex_lock(&threads_lock);
+      for (i = 0; i < worker_threads; ++i)
+	{
+	  wt = &threads[i];
+	  if (wt->msg != NULL && wt->done)
+	    {
+	      RelayResult(wt->task, wt->seconds, wt->result_appended,
+			  wt->result, wt->result_size);
+	      if (wt->seconds > longest_task.tv_sec +
+		  0.000001 * longest_task.tv_usec)
+		{
+		  longest_task.tv_sec = (long) wt->seconds;
+		  longest_task.tv_usec = (long) (1000000.0 *
+						 (wt->seconds -
+						  longest_task.tv_sec));
+		}
+	      FreeBuffer(&wt->msg->buffer);
+	      free(wt->msg);
+	      wt->msg = NULL;
+	      wt->done = FALSE;
+	    }
+	  if (wt->msg == NULL && first_held_message != NULL &&
+	      first_held_message->tag == TASK_MSG)
+	    {
+	      msg = first_held_message;
+	      first_held_message = msg->next;
+	      if (first_held_message == NULL)
+		last_held_message = NULL;
+	      wt->msg = msg;
+	      wt->task = HeldTaskNumber(msg);
+	      wt->cancelled = FALSE;
+	      if (par_verbose)
+		Report("Worker giving task %d to thread %d\n", wt->task, i);
+	      pthread_cond_signal(&wt->wake);
+	    }
+	  if (wt->msg != NULL)
+	    ++busy;
+	}
+      pthread_mutex_unlock(&threads_lock);
+
+      /* anything else waits for the tasks sent before it, except
+	 acknowledgements, which do not concern them */
+      if (first_held_message != NULL &&
+	  (busy == 0 || first_held_message->tag == BROADCAST_ACK_MSG))
+	{
+	  msg_type = ReleaseHeldMessage(&from_tid);
+	  switch (msg_type)
+	    {
+	    case CONTEXT_MSG:
+	      context_start = WallTime();
+	      if (par_unpack_context != NULL)
+		(*par_unpack_context)();
+	      if (par_worker_context != NULL)
+		(*par_worker_context)();
+	      context_seconds += WallTime() - context_start;
+	      break;
+	    case COLLECTIVE_CONTEXT_MSG:
+	      context_start = WallTime();
+	      ReceiveCollectiveContext(par_upkint());
+	      context_seconds += WallTime() - context_start;
+	      break;
+	    case BROADCAST_CONTEXT_MSG:
+	      context_start = WallTime();
+	      ReceiveBroadcastContext();
+	      context_seconds += WallTime() - context_start;
+	      break;
+	    case BROADCAST_ACK_MSG:
+	      ReceiveBroadcastAck(from_tid);
+	      break;
+	    case TERMINATE_MSG:
+	      if (par_verbose)
+		Report("Worker received TERMINATE_MSG: tid=%d\n", my_tid);
+	      terminate = TRUE;
+	      break;
+	    default:
+	      Abort("Unknown message type received.\n");
+	      break;
+	    }
+	  last_active = WallTime();
+	  continue;
+	}
+
+      /* the results go back once there is one per thread, or some
+	 thread has nothing to do, or the first has waited long enough */
+      now = WallTime();
+      if (relay_n_results > 0 &&
+	  (relay_n_results >= worker_threads || busy < worker_threads ||
+	   now - relay_first_result >= BATCH_SECONDS))
+	RelayFlush(TRUE);
+
+      if (busy > 0 || first_held_message != NULL)
+	last_active = now;
+      else if (now - last_active >
+	       MAX(WORKER_RECEIVE_TIMEOUT, 10*(longest_task.tv_sec+1)))
+	{
+	  Report("Worker timed out waiting for message. Exiting...\n");
+	  PrepareToSend();
+	  par_pkint(my_tid);
+	  Send(master_tid, WORKER_EXIT_MSG);
+	  break;
+	}
+
+      /* wait a millisecond for a thread to finish (messages are
+	 looked for again after that) */
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += 1000000;
+      if (until.tv_nsec >= 1000000000)
+	{
+	  ++until.tv_sec;
+	  until.tv_nsec -= 1000000000;
+	}
+      pthread_mutex_lock(&threads_lock);
+      for (i = 0; i < worker_threads; ++i)
+	if (threads[i].msg != NULL && threads[i].done)
+	  break;
+      if (i >= worker_threads)
+	(void) pthread_cond_timedwait(&threads_done, &threads_lock, &until);
+      pthread_mutex_unlock(&threads_lock);
+    }
+  RelayFlush(TRUE);
+
+  pthread_mutex_lock(&threads_lock);
+  for (i = 0; i < worker_threads; ++i)
+    {
+      threads[i].quit = TRUE;
+      pthread_cond_signal(&threads[i].wake);
+    }
+  pthread_mutex_unlock(&threads_lock);
+  for (i = 0; i < worker_threads; ++i)
+    if (pthread_join(threads[i].thread, NULL) != 0)
+      Abort("Could not join worker thread %d\n", i);
+}
+
+/* WorkerThreadMain is the loop of each thread of a threaded worker:
+   it performs the tasks ThreadTasks gives it, unpacking each from its
+   own message and packing the result into its own out_buffer, where
+   ThreadTasks takes it from */
+static void *
+WorkerThreadMain (void *arg)
+{
+  WorkerThread *wt = (WorkerThread *) arg;
+  int task_num;
+  double start;
+  double seconds;
+
+  my_thread = wt;
+  PinWorkerThread(wt);
+  pthread_mutex_lock(&threads_lock);
+  for (;;)
+    {
+      while ((wt->msg == NULL || wt->done) && !wt->quit)
+	pthread_cond_wait(&wt->wake, &threads_lock);
+      if (wt->quit)
+	break;
+      in_buffer = wt->msg->buffer.buffer;
+      in_size = wt->msg->buffer.size;
+      in_position = 0;
+      pthread_mutex_unlock(&threads_lock);
+
+      task_num = par_upkint();
+      current_task = task_num;
+      if (par_verbose)
+	Report("Worker thread %d performing task %d\n", wt->index, task_num);
+      if (par_unpack_task != NULL)
+	(*par_unpack_task)();
+      start = WallTime();
+      if (par_worker_task != NULL)
+	(*par_worker_task)();
+      seconds = WallTime() - start;
+      MetricsPhase(METRICS_OTHER);
+      PrepareToSend();
+      if (par_master_result != NULL && par_pack_result != NULL)
+	(*par_pack_result)();
+      current_task = -1;
+      MetricsEmit("task", task_num);
+      /* the message is freed by ThreadTasks */
+      in_buffer = NULL;
+      in_size = 0;
+      in_position = 0;
+
+      pthread_mutex_lock(&threads_lock);
+      wt->seconds = seconds;
+      wt->result_appended = par_master_result != NULL;
+      wt->result = out_buffer;
+      wt->result_size = out_position;
+      wt->done = TRUE;
+      pthread_cond_signal(&threads_done);
+    }
+  pthread_mutex_unlock(&threads_lock);
+  return(NULL);
+}
+
+/* ThreadCancel acts on the master's cancellation of task tc for a
+   threaded worker: if the task is still held, it is dropped and
+   reported done, and otherwise the thread performing it will find
+   through par_task_cancelled() that it may stop */
+static void
+ThreadCancel (int tc)
+{
+  int i;
+  Message *msg;
+  Message *prev;
+
+  prev = NULL;
+  for (msg = first_held_message; msg != NULL; prev = msg, msg = msg->next)
+    if (msg->tag == TASK_MSG && HeldTaskNumber(msg) == tc)
+      {
+	if (prev != NULL)
+	  prev->next = msg->next;
+	else
+	  first_held_message = msg->next;
+	if (msg == last_held_message)
+	  last_held_message = prev;
+	FreeBuffer(&msg->buffer);
+	free(msg);
+	RelayResult(tc, 0.0, FALSE, NULL, 0);
+	return;
+      }
+  pthread_mutex_lock(&threads_lock);
+  for (i = 0; i < worker_threads; ++i)
+    if (threads[i].msg != NULL && threads[i].task == tc)
+      threads[i].cancelled = TRUE;
+  pthread_mutex_unlock(&threads_lock);
+}
+
+/* HeldTaskNumber returns the number of the task held in msg */
+static int
+HeldTaskNumber (Message *msg)
+{
+  int tc;
+  int position;
+
+  position = 0;
+  if (!UnpackItems(msg->buffer.buffer, msg->buffer.size, &position,
+		   &tc, 1, MPI_INT))
+    Abort("Could not unpack held task number\n");
+  return(tc);
+}
+
+/* ReceiveBroadcastContext is a worker's (or sub-master's) side of
+   par_broadcast_context(): it takes in the context, relays it to the
+   processes below it in the broadcast tree, and acknowledges it once
+   they have */
+static void
+ReceiveBroadcastContext ()
+{
+  int i;
+  int dest;
+
+  broadcast_count = par_upkint();
+  if (broadcast_count == 0)
+    {
+      n_processes = par_upkint();
+      process_tids = (int *) realloc(process_tids,
+				     n_processes * sizeof(int));
+      if (process_tids == NULL)
+	Abort("Could not allocate broadcast process table\n");
+      par_upkintarray(process_tids, n_processes);
+      /* find my_process_index */
+      for (i = 0; i < n_processes; ++i)
+	if (process_tids[i] == my_tid)
+	  {
+	    my_process_index = i;
+	    break;
+	  }
+      if (i >= n_processes)
+	Abort("Could not find my process tid in process array.\n");
+      dest = (my_process_index << 1) + 1;
+      if (dest < n_processes)
+	broadcast_first_forward_tid = process_tids[dest];
+      dest = (my_process_index << 1) + 2;
+      if (dest < n_processes)
+	broadcast_second_forward_tid = process_tids[dest];
+      dest = (my_process_index - 1) >> 1;
+      broadcast_backward_tid = process_tids[dest];
+    }
+  if (par_verbose)
+    Report("Process %d received broadcast context %d\n",
+	   my_process_index, broadcast_count);
+  /* handle the broadcast message locally; a sub-master does not
+     perform tasks, but passes the context on to each of its workers */
+  if (par_unpack_context != NULL)
+    (*par_unpack_context)();
+  if (relay)
+    {
+      AwaitPendingWorkers();
+      for (i = 0; i < n_workers; ++i)
+	{
+	  PrepareToSend();
+	  if (par_pack_context != NULL)
+	    (*par_pack_context)();
+	  Send(workers[i].tid, CONTEXT_MSG);
+	  workers[i].bytes_sent += out_position;
+	}
+    }
+  else if (par_worker_context != NULL)
+    (*par_worker_context)();
+
+  if (broadcast_first_forward_tid >= 0)
+    {
+      if (par_verbose)
+	Report("Process %d relaying context %d onto tid %d\n",
+	       my_process_index, broadcast_count,
+	       broadcast_first_forward_tid);
+
+      /* prepare message */
+      PrepareToSend();
+      par_pkint(broadcast_count);
+      if (broadcast_count == 0)
+	{
+	  par_pkint(n_processes);
+	  par_pkintarray(process_tids, n_processes);
+	}
+      if (par_pack_context != NULL)
+	(*par_pack_context)();
+      Send(broadcast_first_forward_tid, BROADCAST_CONTEXT_MSG);
+    }
+  else
+    broadcast_first_ack_count = broadcast_count;
+
+  if (broadcast_second_forward_tid >= 0)
+    {
+      if (par_verbose)
+	Report("Process %d relaying context %d onto tid %d\n",
+	       my_process_index, broadcast_count,
+	       broadcast_second_forward_tid);
+
+      /* prepare message */
+      PrepareToSend();
+      par_pkint(broadcast_count);
+      if (broadcast_count == 0)
+	{
+	  par_pkint(n_processes);
+	  par_pkintarray(process_tids, n_processes);
+	}
+      if (par_pack_context != NULL)
+	(*par_pack_context)();
+      Send(broadcast_second_forward_tid, BROADCAST_CONTEXT_MSG);
+    }
+  else 
+    broadcast_second_ack_count = broadcast_count;
+
+  if (broadcast_first_ack_count == broadcast_count &&
+      broadcast_second_ack_count == broadcast_count)
+    {
+      /* we can acknowledge this immediately */
+      if (par_verbose)
+	Report("Process %d sending immediate acknowledge of %d\n",
+	       my_process_index, broadcast_count);
+      PrepareToSend();
+      par_pkint(broadcast_count);
+      Send(broadcast_backward_tid, BROADCAST_ACK_MSG);
+    }
+}
+
+/* ReceiveBroadcastAck notes the acknowledgement of a broadcast by
+   from_tid, one of the processes this process relayed it to, and
+   passes it back up the tree once both have acknowledged */
+static void
+ReceiveBroadcastAck (int from_tid)
+{
+  broadcast_count = par_upkint();
+  if (par_verbose)
+    Report("Process %d received acknowledgement of %d from %d\n",
+	   my_process_index, broadcast_count, from_tid);
+  if (from_tid == broadcast_first_forward_tid)
+    {
+      broadcast_first_ack_count = broadcast_count;
+      if (broadcast_first_ack_count <= broadcast_second_ack_count)
+	{
+	  /* relay acknowledgement */
+	  if (par_verbose)
+	    Report("Process %d relaying acknowledgement of %d\n",
+		   my_process_index, broadcast_count);
+	  PrepareToSend();
+	  par_pkint(broadcast_count);
+	  Send(broadcast_backward_tid, BROADCAST_ACK_MSG);
+	}
+    }
+  else if (from_tid == broadcast_second_forward_tid)
+    {
+      broadcast_second_ack_count = broadcast_count;
+      if (broadcast_second_ack_count <= broadcast_first_ack_count)
+	{
+	  /* relay acknowledgement */
+	  if (par_verbose)
+	    Report("Process %d relaying acknowledgement of %d\n",
+		   my_process_index, broadcast_count);
+	  PrepareToSend();
+	  par_pkint(broadcast_count);
+	  Send(broadcast_backward_tid, BROADCAST_ACK_MSG);
+	}
+    }
+  else
+    Abort("Received BROADCAST_ACK_MSG from unexpected source.\n");
+}
+
+/* AwaitPendingWorkers waits for the workers of a sub-master that
+   have not yet reported, giving up on them after a while */
+static void
+AwaitPendingWorkers ()
+{
+  int total_time;
+
+  total_time = 0;
+  while (n_workers_pending > 0 && total_time < PENDING_WORKERS_TIMEOUT)
+    if (MasterReceiveMessage(REPORT_INTERVAL) == 0)
+      total_time += REPORT_INTERVAL;
+  n_workers_pending = 0;
+}
+
+/* SubMasterOf returns the rank of the process that process r takes
+   its tasks from: with -PAR_GROUP=n the processes after the master
+   are divided, in order of rank, into groups of n + 1, the first of
+   each group being a sub-master that takes tasks from the master and
+   dispatches them to the other n; a group of one is an ordinary
+   worker of the master */
+static int
+SubMasterOf (int r)
+{
+  int leader;
+
+  if (group_size <= 0 || r == 0)
+    return(0);
+  leader = 1 + ((r - 1) / (group_size + 1)) * (group_size + 1);
+  return(r == leader ? 0 : leader);
+}
+
+/* GroupWorkers returns the number of workers of process r if it is
+   a sub-master, and otherwise 0 */
+static int
+GroupWorkers (int r)
+{
+  if (group_size <= 0 || r == 0 || SubMasterOf(r) != 0)
+    return(0);
+  return(MIN(group_size, n_ranks - 1 - r));
+}
+
+/* RelayTasks is the main loop of a sub-master: it reports to the
+   master as a single worker of GroupWorkers() times the capacity of
+   an ordinary one, puts the contexts and tasks it is sent on its own
+   queue, from which it dispatches them to its workers just as the
+   master would, and returns their results to the master a batch at
+   a time */
+static void
+RelayTasks ()
+{
+  int i;
+  int capacity;
+  float wait;
+
+  relay = TRUE;
+  capacity = GroupWorkers(rank);
+  n_workers_pending = capacity;
+  if (par_verbose)
+    Report("Process %d is a sub-master of %d workers\n", rank, capacity);
+
+  PrepareToSend();
+  par_pkint(-2);
+  par_pkstr(my_host_name);
+  par_pkint(capacity);
+  par_pkint(my_memory);
+  par_pkint(my_gpus);
+  Send(master_tid, REQUEST_MSG);
+
+  while (!relay_terminate)
+    {
+      wait = PAR_FOREVER;
+      if (relay_n_results > 0)
+	wait = MAX(0.001, BATCH_SECONDS - (WallTime() - relay_first_result));
+      (void) MasterReceiveMessage(wait);
+      while (DispatchableTask() != NULL)
+	DispatchTask(BatchSize());
+      RelayFlush(FALSE);
+    }
+  RelayFlush(TRUE);
+
+  /* the master only terminates once all tasks are finished */
+  AwaitPendingWorkers();
+  if (par_verbose)
+    Report("Sub-master sending terminate messages to %d workers\n",
+	   n_workers);
+  for (i = 0; i < n_workers; ++i)
+    if (!SendMessage(out_buffer, 0, workers[i].tid, TERMINATE_MSG))
+      Abort("Sub-master cannot send TERMINATE message to worker.\n");
+  n_workers = 0;
+}
+
+/* RelayMessage handles a message that a sub-master has received
+   from the master */
+static void
+RelayMessage (int msg_tag)
+{
+  int i;
+  int count;
+
+  switch (msg_tag)
+    {
+    case CONTEXT_MSG:
+      /* the tasks that follow use this context */
+      DisuseContext(&current_context);
+      current_context = (Context *) malloc(sizeof(Context));
+      if (current_context == NULL)
+	Abort("Could not allocate relayed context\n");
+      current_context->use_count = 1;
+      current_context->shared = FALSE;
+      current_context->buffer.size = (in_length > 0) ? in_length : 1;
+      current_context->buffer.buffer =
+	(unsigned char *) malloc(current_context->buffer.size);
+      if (current_context->buffer.buffer == NULL)
+	Abort("Could not allocate relayed context of %d bytes\n", in_length);
+      memcpy(current_context->buffer.buffer, in_buffer, in_length);
+      current_context->buffer.position = in_length;
+      break;
+
+    case TASK_MSG:
+      RelayQueueTask(in_length, TRUE);
+      break;
+
+    case TASK_BATCH_MSG:
+      count = par_upkint();
+      for (i = 0; i < count; ++i)
+	RelayQueueTask(par_upkint(), FALSE);
+      break;
+
+    case CANCEL_MSG:
+      RelayCancel(par_upkint());
+      break;
+
+    case BROADCAST_CONTEXT_MSG:
+      ReceiveBroadcastContext();
+      break;
+
+    case COLLECTIVE_CONTEXT_MSG:
+      Abort("Collective contexts cannot be given to sub-masters\n");
+      break;
+
+    case TERMINATE_MSG:
+      if (par_verbose)
+	Report("Sub-master received TERMINATE_MSG: tid=%d\n", my_tid);
+      relay_terminate = TRUE;
+      break;
+
+    default:
+      Error("Sub-master received unknown message: %d\n", msg_tag);
+    }
+}
+
+/* RelayQueueTask puts a task of len bytes, which is either the whole
+   of the current message (if whole) or the next len bytes of it, on
+   a sub-master's queue, with the context last sent by the master */
+static void
+RelayQueueTask (int len, Boolean whole)
+{
+  Task *task;
+  int position;
+
+  task = (Task *) malloc(sizeof(Task));
+  if (task == NULL)
+    Abort("Could not allocate relayed task\n");
+  task->buffer.size = (len > 0) ? len : 1;
+  task->buffer.buffer = (unsigned char *) malloc(task->buffer.size);
+  if (task->buffer.buffer == NULL)
+    Abort("Could not allocate relayed task of %d bytes\n", len);
+  if (whole)
+    memcpy(task->buffer.buffer, in_buffer, len);
+  else
+    par_upkbytearray(task->buffer.buffer, len);
+  task->buffer.position = len;
+  position = 0;
+  if (!UnpackItems(task->buffer.buffer, task->buffer.size, &position,
+		   &task->number, 1, MPI_INT))
+    Abort("Could not unpack relayed task number\n");
+  task->context = ReuseContext(current_context);
+  task->n_hints = 0;
+  task->size = -1.0;
+  task->memory = 0.0;
+  task->gpus = 0;
+  task->worker_tid = -1;
+  task->copy = FALSE;
+  task->twin = NULL;
+  if (par_verbose)
+    Report("Sub-master queueing task %d\n", task->number);
+  QueueTask(task);
+}
+
+/* RelayCancel passes the master's cancellation of task tc on to the
+   worker performing it, or, if it is still on the sub-master's
+   queue, drops it and tells the master it is done */
+static void
+RelayCancel (int tc)
+{
+  int n;
+  Task *task;
+
+  for (task = first_queued_task; task != NULL; task = task->next)
+    if (task->number == tc)
+      {
+	if (task->prev != NULL)
+	  task->prev->next = task->next;
+	else
+	  first_queued_task = task->next;
+	if (task->next != NULL)
+	  task->next->prev = task->prev;
+	else
+	  last_queued_task = task->prev;
+	--n_queued_tasks;
+	if (par_verbose)
+	  Report("Sub-master dropping cancelled task %d from its queue\n", tc);
+	DisuseContext(&task->context);
+	FreeBuffer(&task->buffer);
+	free(task);
+	RelayResult(tc, 0.0, FALSE, NULL, 0);
+	return;
+      }
+  for (n = 0; n < n_workers; ++n)
+    for (task = workers[n].first_task; task != NULL; task = task->next)
+      if (task->number == tc)
+	{
+	  if (par_verbose)
+	    Report("Sub-master passing on the cancellation of task %d "
+		   "to worker %d\n", tc, n);
+	  PrepareToSend();
+	  par_pkint(tc);
+	  Send(workers[n].tid, CANCEL_MSG);
+	  return;
+	}
+}
+
+/* RelayResult adds the result of task tc, the size bytes at data,
+   to those a sub-master will next send to the master */
+static void
+RelayResult (int tc, double seconds, int result_appended,
+	     unsigned char *data, int size)
+{
+  unsigned char *save_buffer;
+  int save_size;
+  int save_position;
+
+  save_buffer = out_buffer;
+  save_size = out_size;
+  save_position = out_position;
+  out_buffer = relay_results.buffer;
+  out_size = relay_results.size;
+  out_position = relay_results.position;
+  if (relay_n_results == 0)
+    {
+      /* room for the count, which is filled in when they are sent */
+      out_position = 0;
+      par_pkint(0);
+      relay_first_result = WallTime();
+    }
+  par_pkint(tc);
+  par_pkdouble(seconds);
+  par_pkint(result_appended);
+  par_pkint(size);
+  if (size > 0)
+    par_pkbytearray(data, size);
+  ++relay_n_results;
+  relay_results.buffer = out_buffer;
+  relay_results.size = out_size;
+  relay_results.position = out_position;
+  out_buffer = save_buffer;
+  out_size = save_size;
+  out_position = save_position;
+}
+
+/* RelayFlush sends the results a sub-master (or threaded worker) has
+   gathered to the master, if force is TRUE, or there is one for each
+   of its workers, or some worker has nothing to do, or the first of
+   them has waited BATCH_SECONDS; a threaded worker decides this
+   itself, and always passes TRUE */
+static void
+RelayFlush (Boolean force)
+{
+  int i;
+  int done;
+  int position;
+  double seconds;
+  unsigned char *save_buffer;
+  int save_size;
+  int save_position;
+  Buffer sending;
+  MPI_Request request;
+  struct timespec duration;
+
+  if (relay_n_results == 0)
+    return;
+  if (!force && relay_n_results < n_workers &&
+      (first_queued_task != NULL || idle_workers < 0) &&
+      WallTime() - relay_first_result < BATCH_SECONDS)
+    return;
+
+  /* append the context time the workers (or a threaded worker
+     itself) have reported since the last results were sent, and fill
+     in the count */
+  seconds = context_seconds;
+  for (i = 0; i < n_workers; ++i)
+    seconds += workers[i].context_seconds;
+  save_buffer = out_buffer;
+  save_size = out_size;
+  save_position = out_position;
+  out_buffer = relay_results.buffer;
+  out_size = relay_results.size;
+  out_position = relay_results.position;
+  par_pkdouble(MAX(seconds - relay_context_reported, 0.0));
+  relay_context_reported = seconds;
+  position = 0;
+  if (!PackItems(&relay_n_results, 1, MPI_INT, out_buffer, out_size,
+		 &position))
+    Abort("Could not pack relayed result count\n");
+  sending.buffer = out_buffer;
+  sending.size = out_size;
+  sending.position = out_position;
+  out_buffer = save_buffer;
+  out_size = save_size;
+  out_position = save_position;
+  relay_results.buffer = NULL;
+  relay_results.size = 0;
+  relay_results.position = 0;
+  if (par_verbose)
+    Report("Sub-master sending %d results to the master\n",
+	   relay_n_results);
+  relay_n_results = 0;
+
+  /* the master may be sending us tasks at this very moment, so we
+     keep taking in messages until it has taken this one (a local
+     worker's socket writes already do so) */
+  if (local)
+    {
+      if (!SendMessage(sending.buffer, sending.position, master_tid,
+		       RELAY_RESULTS_MSG))
+	Abort("Worker cannot send results to the master\n");
+    }
+  else
+    {
+      if (MPI_Isend(sending.buffer, sending.position, MPI_PACKED,
+		    master_tid, RELAY_RESULTS_MSG, MPI_COMM_WORLD,
+		    &request) != MPI_SUCCESS)
+	Abort("Sub-master cannot send results to the master\n");
+      duration.tv_sec = 0;
+      duration.tv_nsec = 1000000;	/* 1 millisecond */
+      for (;;)
+	{
+	  if (MPI_Test(&request, &done, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+	    Abort("Could not test for completion of results message\n");
+	  if (done)
+	    break;
+	  if (relay)
+	    {
+	      if (!MasterReceiveMessage(0.0))
+		nanosleep(&duration, NULL);
+	    }
+	  else
+	    {
+	      HoldArrivedMessages();
+	      nanosleep(&duration, NULL);
+	    }
+	}
+    }
+  MetricsCount("messages_sent", 1);
+  MetricsCount("bytes_sent", sending.position);
+  FreeBuffer(&sending);
+}
+
+static void
+ComposeRequest (int last_task_completed, int result_appended, double seconds)
 {
   if (par_verbose)
     Report("Worker requesting task\n");
   PrepareToSend();
   par_pkint(last_task_completed);
   if (last_task_completed < 0)
-    par_pkstr(my_host_name);
+    {
+      par_pkstr(my_host_name);
+      par_pkint(my_memory);
+      par_pkint(my_gpus);
+    }
   par_pkint(result_appended);
+  if (last_task_completed >= 0)
+    {
+      par_pkdouble(seconds);
+      par_pkdouble(context_seconds);
+      context_seconds = 0.0;
+    }
+}
+
+static int
+WorkerReceiveMessage (int *pfrom_tid)
+{
+  int flag;
+  int len;
+  int tag, source;
+  struct timeval end_time, current_time;
+  struct timespec duration;
+  int prev;
+
+  /* wait until a message arrives or the timeout has expired */
+  /* since MPI does not support timeouts, and we don't want to use
+     multiple threads, we have to poll (yuck) */
+  end_time.tv_sec = 0;
+  if (gettimeofday(&end_time, NULL) != 0)
+    Abort("Worker could not get time of day.\n");
+  end_time.tv_sec += MAX(WORKER_RECEIVE_TIMEOUT,10*(longest_task.tv_sec+1));
+  prev = MetricsPhase(METRICS_COMMUNICATE);
+  duration.tv_sec = 0;
+  duration.tv_nsec = 10000000;	/* 10 milliseconds */
+  do {
+    /* check if any message has arrived */
+    flag = ProbeMessage(FALSE, &tag, &source, &len);
+    if (flag)
+      break;
+
+    nanosleep(&duration, NULL);
+
+    if (gettimeofday(&current_time, NULL) != 0)
+      Abort("Worker could not get time of day.\n");
+  } while (current_time.tv_sec < end_time.tv_sec ||
+	   (current_time.tv_sec == end_time.tv_sec &&
+	    current_time.tv_usec < end_time.tv_usec));
+
+  if (!flag)
+    {
+      MetricsPhase(prev);
+      Report("Worker timed out waiting for message. Exiting...\n");
+      PrepareToSend ();
+      par_pkint (my_tid);
+      Send (master_tid, WORKER_EXIT_MSG);
+      /* Fake msg so finalize will be done before exit.*/
+      return (TERMINATE_MSG); 
+    }
+
+  /* a message is there; now receive it */
+  if (len > in_size)
+    ExpandInBuffer(len);
+
+  if (!ReceiveMessage(in_buffer, len, source, tag))
+    Abort("Worker could not receive message.\n");
+  MetricsPhase(prev);
+  MetricsCount("messages_received", 1);
+  MetricsCount("bytes_received", len);
+
+  in_position = 0;
+
+  *pfrom_tid = source;
+  return(tag);
+}
+
+/* HoldArrivedMessages receives, without waiting, all messages that
+   have already arrived and appends them to the held message list;
+   they will be acted upon in order by PerformWorkerTasks() */
+static void
+HoldArrivedMessages ()
+{
+  int len;
+  int tag, source;
+  Buffer buffer;
+
+  for (;;)
+    {
+      if (!ProbeMessage(FALSE, &tag, &source, &len))
+	return;
+      buffer.size = (len > 0) ? len : 1;
+      buffer.buffer = (unsigned char *) malloc(buffer.size);
+      if (buffer.buffer == NULL)
+	Abort("Could not allocate held message buffer of %d bytes\n", len);
+      buffer.position = 0;
+      if (!ReceiveMessage(buffer.buffer, len, source, tag))
+	Abort("Worker could not receive message.\n");
+      HoldMessage(tag, source, &buffer);
+    }
+}
+
+/* HoldMessage appends a received message (whose buffer it takes over)
+   to the held message list; a batch of tasks is held as the
+   individual tasks */
+static void
+HoldMessage (int tag, int from_tid, Buffer *buffer)
+{
+  Message *msg;
+  int i;
+  int count;
+  int len;
+  unsigned char *save_buffer = NULL;
+  int save_size = 0;
+  int save_position;
+
+  if (tag == CANCEL_MSG)
+    {
+      /* this is acted upon at once, so that par_task_cancelled() can
+	 report it to the task being performed */
+      save_position = 0;
+      if (!UnpackItems(buffer->buffer, buffer->size, &save_position,
+		       &cancelled_task, 1, MPI_INT))
+	Abort("Could not unpack cancelled task\n");
+      if (par_verbose)
+	Report("Worker told to abandon task %d\n", cancelled_task);
+      FreeBuffer(buffer);
+      if (threads != NULL)
+	ThreadCancel(cancelled_task);
+      return;
+    }
+  if (tag == TASK_BATCH_MSG)
+    {
+      save_buffer = in_buffer;
+      save_size = in_size;
+      save_position = in_position;
+      in_buffer = buffer->buffer;
+      in_size = buffer->size;
+      in_position = 0;
+      count = par_upkint();
+    }
+  else
+    count = 1;
+  for (i = 0; i < count; ++i)
+    {
+      msg = (Message *) malloc(sizeof(Message));
+      if (msg == NULL)
+	Abort("Could not allocate held message\n");
+      msg->next = NULL;
+      msg->from_tid = from_tid;
+      msg->prefetched = FALSE;
+      if (tag == TASK_BATCH_MSG)
+	{
+	  len = par_upkint();
+	  msg->tag = TASK_MSG;
+	  msg->buffer.size = (len > 0) ? len : 1;
+	  msg->buffer.buffer = (unsigned char *) malloc(msg->buffer.size);
+	  if (msg->buffer.buffer == NULL)
+	    Abort("Could not allocate held task buffer of %d bytes\n", len);
+	  msg->buffer.position = 0;
+	  par_upkbytearray(msg->buffer.buffer, len);
+	  msg->batch_index = i;
+	  msg->batch_size = count;
+	}
+      else
+	{
+	  msg->tag = tag;
+	  msg->buffer = *buffer;
+	  msg->batch_index = 0;
+	  msg->batch_size = 0;
+	}
+      if (last_held_message != NULL)
+	last_held_message->next = msg;
+      else
+	first_held_message = msg;
+      last_held_message = msg;
+      if (par_verbose)
+	Report("Worker holding message %d from %d\n",
+	       msg->tag, msg->from_tid);
+    }
+  if (tag == TASK_BATCH_MSG)
+    {
+      in_buffer = save_buffer;
+      in_size = save_size;
+      in_position = save_position;
+      FreeBuffer(buffer);
+    }
+}
+
+/* ReleaseHeldMessage takes the first message off the held message list
+   and makes it the current input message, just as if it had
+   been received by WorkerReceiveMessage() */
+static int
+ReleaseHeldMessage (int *pfrom_tid)
+{
+  Message *msg;
+  int tag;
+
+  msg = first_held_message;
+  first_held_message = msg->next;
+  if (first_held_message == NULL)
+    last_held_message = NULL;
+  if (in_buffer != NULL)
+    free(in_buffer);
+  in_buffer = msg->buffer.buffer;
+  in_size = msg->buffer.size;
+  in_position = 0;
+  *pfrom_tid = msg->from_tid;
+  tag = msg->tag;
+  current_batch_index = msg->batch_index;
+  current_batch_size = msg->batch_size;
+  free(msg);
+  return(tag);
+}
+
+/* PrefetchNextTask calls the user's (*worker_prefetch)() for the next
+   task that has been sent to this worker, if it is already here
+   and will use the current context; while (*worker_prefetch)() runs,
+   the par_upk* routines unpack from that task's message */
+static void
+PrefetchNextTask ()
+{
+  Message *msg;
+  unsigned char *save_buffer;
+  int save_size;
+  int save_position;
+
+  if (prefetch_depth == 0 || par_worker_prefetch == NULL)
+    return;
+  HoldArrivedMessages();
+  for (msg = first_held_message; msg != NULL; msg = msg->next)
+    if (msg->tag != TASK_MSG)
+      /* a new context or a broadcast has to be handled first */
+      return;
+    else if (!msg->prefetched)
+      break;
+  if (msg == NULL)
+    return;
+
+  save_buffer = in_buffer;
+  save_size = in_size;
+  save_position = in_position;
+  in_buffer = msg->buffer.buffer;
+  in_size = msg->buffer.size;
+  in_position = 0;
+  if (par_verbose)
+    Report("Worker prefetching task %d\n", par_upkint());
+  else
+    (void) par_upkint();
+  (*par_worker_prefetch)();
+  msg->prefetched = TRUE;
+  in_buffer = save_buffer;
+  in_size = save_size;
+  in_position = save_position;
+}
+
+/* CollectiveAvailable returns TRUE if contexts may be given to the
+   workers with a collective broadcast; this requires MPI-3 and that
+   every other process in MPI_COMM_WORLD is a live worker, since all
+   of them take part in the operation */
+static Boolean
+CollectiveAvailable ()
+{
+#if MPI_VERSION >= 3
+  return(!local &&
+	 collective_threshold >= 0 &&
+	 n_workers_pending == 0 &&
+	 n_workers == n_ranks - 1);
+#else
+  return(FALSE);
+#endif
+}
+
+/* CollectiveBroadcast is called by the master to give the packed
+   context in data to all workers; the workers are told the size with
+   a short COLLECTIVE_CONTEXT_MSG and then all processes enter
+   ShareBuffer() together; the master must not have any tasks
+   outstanding */
+static void
+CollectiveBroadcast (unsigned char *data, int size)
+{
+  int i;
+  unsigned char *shared;
+  void *win;
+
+  for (i = 0; i < n_workers; ++i)
+    {
+      PrepareToSend();
+      par_pkint(size);
+      Send(workers[i].tid, COLLECTIVE_CONTEXT_MSG);
+    }
+  ShareBuffer(data, size, &shared, &win);
+#if MPI_VERSION >= 3
+  MPI_Win_free((MPI_Win *) win);
+  free(win);
+#endif
+}
+
+/* ReceiveCollectiveContext is the worker's side of
+   CollectiveBroadcast(); the context is unpacked directly out of the
+   node's shared copy */
+static void
+ReceiveCollectiveContext (int size)
+{
+  unsigned char *shared;
+  void *win;
+  unsigned char *save_buffer;
+  int save_size;
+  int save_position;
+
+  if (par_verbose)
+    Report("Worker receiving collective context of %d bytes\n", size);
+  ShareBuffer(NULL, size, &shared, &win);
+  save_buffer = in_buffer;
+  save_size = in_size;
+  save_position = in_position;
+  in_buffer = shared;
+  in_size = size;
+  in_position = 0;
+  if (par_unpack_context != NULL)
+    (*par_unpack_context)();
+  if (par_worker_context != NULL)
+    (*par_worker_context)();
+  in_buffer = save_buffer;
+  in_size = save_size;
+  in_position = save_position;
+#if MPI_VERSION >= 3
+  /* the window can only be released once every process on the node
+     has unpacked from it */
+  MPI_Win_free((MPI_Win *) win);
+  free(win);
+#endif
+}
+
+/* ShareBuffer makes the size bytes at data (which need only be
+   valid on the master) available to every process: the lowest ranked
+   process on each node allocates a shared-memory window, the master
+   broadcasts the bytes to those processes only, and the other
+   processes on each node map the same window; *pshared is set
+   to the node's copy and *pwin to the window, which the caller must
+   free collectively */
+static void
+ShareBuffer (unsigned char *data, int size,
+	     unsigned char **pshared, void **pwin)
+{
+#if MPI_VERSION >= 3
+  int node_rank;
+  MPI_Win *win;
+  MPI_Aint qsize;
+  int disp;
+  void *base;
+
+  SetUpNodeComms();
+  if (MPI_Comm_rank(node_comm, &node_rank) != MPI_SUCCESS)
+    Abort("Could not obtain node rank\n");
+
+  win = (MPI_Win *) malloc(sizeof(MPI_Win));
+  if (win == NULL)
+    Abort("Could not allocate window handle\n");
+  if (MPI_Win_allocate_shared(node_rank == 0 ? (MPI_Aint) size : 0, 1,
+			      MPI_INFO_NULL, node_comm,
+			      &base, win) != MPI_SUCCESS)
+    Abort("Could not allocate shared context window of %d bytes\n", size);
+  if (MPI_Win_shared_query(*win, 0, &qsize, &disp, &base) != MPI_SUCCESS)
+    Abort("Could not query shared context window\n");
+  MPI_Win_fence(0, *win);
+  if (node_rank == 0)
+    {
+      /* the context is read by processes on every socket, so it is
+	 spread over them rather than placed on the leader's */
+      if (n_pin_cpus > 0)
+	InterleaveMemory(base, size);
+
+      /* the master is rank 0 of both node_comm and leader_comm */
+      if (rank == 0)
+	memcpy(base, data, size);
+      if (MPI_Bcast(base, size, MPI_BYTE, 0, leader_comm) != MPI_SUCCESS)
+	Abort("Could not broadcast context to node leaders\n");
+    }
+  MPI_Win_fence(0, *win);
+  *pshared = (unsigned char *) base;
+  *pwin = win;
+#else
+  Abort("Collective context broadcast requires MPI-3\n");
+#endif
+}
+
+/* SetUpNodeComms creates, on the first call, node_comm and
+   leader_comm; like any collective operation, it must be called by
+   every process */
+static void
+SetUpNodeComms ()
+{
+#if MPI_VERSION >= 3
+  int node_rank;
+
+  if (node_comm != MPI_COMM_NULL)
+    return;
+  if (MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+			  MPI_INFO_NULL, &node_comm) != MPI_SUCCESS)
+    Abort("Could not create node communicator\n");
+  if (MPI_Comm_rank(node_comm, &node_rank) != MPI_SUCCESS)
+    Abort("Could not obtain node rank\n");
+  if (MPI_Comm_split(MPI_COMM_WORLD,
+		     node_rank == 0 ? 0 : MPI_UNDEFINED, rank,
+		     &leader_comm) != MPI_SUCCESS)
+    Abort("Could not create node leader communicator\n");
+#endif
+}
+
+/* PinProcess, with -PAR_PIN=n, restricts this process to a block of n
+   of the cpus it may run on, the blocks being dealt out in order of
+   rank among the processes on the node, with the cpus of a socket
+   kept together; since Linux places memory on the socket of the cpu
+   that first touches it, what a process allocates and initializes
+   (such as its image pyramids) is then local to it.  It is called
+   collectively by every process when running under MPI. */
+static void
+PinProcess ()
+{
+  cpu_set_t mask;
+  int cpus[CPU_SETSIZE];
+  int n_cpus;
+  int node_rank;
+  int i;
+  char fn[128];
+  FILE *f;
+
+  if (pin_cores <= 0)
+    return;
+  node_rank = 0;
+  if (local)
+    node_rank = rank;
+  else if (par)
+    {
+#if MPI_VERSION >= 3
+      SetUpNodeComms();
+      if (MPI_Comm_rank(node_comm, &node_rank) != MPI_SUCCESS)
+	Abort("Could not obtain node rank\n");
+#else
+      node_rank = rank;
+#endif
+    }
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &mask) != 0)
+    {
+      Report("Could not get cpu affinity; not pinning\n");
+      return;
+    }
+  n_cpus = 0;
+  for (i = 0; i < CPU_SETSIZE; ++i)
+    if (CPU_ISSET(i, &mask))
+      {
+	cpus[n_cpus++] = i;
+	cpu_package[i] = 0;
+	sprintf(fn,
+		"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+		i);
+	if ((f = fopen(fn, "r")) != NULL)
+	  {
+	    if (fscanf(f, "%d", &cpu_package[i]) != 1)
+	      cpu_package[i] = 0;
+	    fclose(f);
+	  }
+      }
+  if (n_cpus == 0)
+    return;
+  qsort(cpus, n_cpus, sizeof(int), ComparePackages);
+
+  n_pin_cpus = pin_cores < n_cpus ? pin_cores : n_cpus;
+  CPU_ZERO(&mask);
+  for (i = 0; i < n_pin_cpus; ++i)
+    {
+      pin_cpus[i] = cpus[(node_rank * n_pin_cpus + i) % n_cpus];
+      CPU_SET(pin_cpus[i], &mask);
+    }
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &mask) != 0)
+    {
+      Report("Could not set cpu affinity; not pinning\n");
+      n_pin_cpus = 0;
+      return;
+    }
+  if (par_verbose)
+    Report("Process %d pinned to %d cpus starting at cpu %d\n",
+	   rank, n_pin_cpus, pin_cpus[0]);
+}
+
+/* PinWorkerThread pins a thread of a threaded worker to its share of
+   the process's block of cpus, on which the threads it starts are
+   then pinned by par_pin_thread */
+static void
+PinWorkerThread (WorkerThread *wt)
+{
+  cpu_set_t mask;
+  int i;
+
+  wt->first_cpu = 0;
+  wt->n_cpus = 0;
+  if (n_pin_cpus == 0)
+    return;
+  wt->n_cpus = MAX(1, n_pin_cpus / worker_threads);
+  wt->first_cpu = (wt->index * wt->n_cpus) % n_pin_cpus;
+  CPU_ZERO(&mask);
+  for (i = 0; i < wt->n_cpus; ++i)
+    CPU_SET(pin_cpus[(wt->first_cpu + i) % n_pin_cpus], &mask);
+  (void) sched_setaffinity(0, sizeof(cpu_set_t), &mask);
+}
+
+void
+par_pin_thread (int thread)
+{
+  cpu_set_t mask;
+
+  if (thread <= 0 || n_pin_cpus == 0)
+    return;
+  CPU_ZERO(&mask);
+  if (my_thread != NULL)
+    CPU_SET(pin_cpus[(my_thread->first_cpu + thread % my_thread->n_cpus) %
+		     n_pin_cpus], &mask);
+  else
+    CPU_SET(pin_cpus[thread % n_pin_cpus], &mask);
+  (void) sched_setaffinity(0, sizeof(cpu_set_t), &mask);
+}
+
+int
+par_pinned_cpus ()
+{
+  return(n_pin_cpus);
+}
+
+/* ComparePackages orders cpus by socket (physical package), and by
+   number within a socket */
+static int
+ComparePackages (const void *a, const void *b)
+{
+  int ca = *((int *) a);
+  int cb = *((int *) b);
+
+  if (cpu_package[ca] != cpu_package[cb])
+    return(cpu_package[ca] - cpu_package[cb]);
+  return(ca - cb);
+}
+
+/* InterleaveMemory asks that the pages of the size bytes at p, not
+   yet touched, be spread round-robin over the NUMA nodes of the
+   system; it does nothing where that is not supported */
+static void
+InterleaveMemory (void *p, size_t size)
+{
+#ifdef SYS_mbind
+  unsigned long nodes;
+  unsigned long page;
+  unsigned long start;
+  int first, last;
+  char line[256];
+  char *s;
+  FILE *f;
+
+  f = fopen("/sys/devices/system/node/online", "r");
+  if (f == NULL)
+    return;
+  nodes = 0;
+  if (fgets(line, 256, f) != NULL)
+    for (s = strtok(line, ","); s != NULL; s = strtok(NULL, ","))
+      {
+	if (sscanf(s, "%d-%d", &first, &last) != 2)
+	  {
+	    if (sscanf(s, "%d", &first) != 1)
+	      continue;
+	    last = first;
+	  }
+	for (; first <= last && first < 8 * (int) sizeof(long); ++first)
+	  nodes |= 1UL << first;
+      }
+  fclose(f);
+  if ((nodes & (nodes - 1)) == 0)
+    return;		/* a single node */
+  page = sysconf(_SC_PAGESIZE);
+  start = ((unsigned long) p) & ~(page - 1);
+  /* 3 is MPOL_INTERLEAVE */
+  (void) syscall(SYS_mbind, start, ((unsigned long) p) + size - start,
+		 3, &nodes, 8 * sizeof(long), 0);
+#endif
+}
+
+/* ProbeMessage looks for a message that has arrived from any process,
+   waiting for one if block is TRUE; it returns FALSE if there is none,
+   and otherwise TRUE with its tag, source and length in bytes */
+static Boolean
+ProbeMessage (Boolean block, int *ptag, int *psource, int *plen)
+{
+  MPI_Status status;
+  int flag;
+  int i, j;
+  int header[2];
+  LocalPeer *p;
+
+  if (!local)
+    {
+      if (block)
+	{
+	  if (MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
+			&status) != MPI_SUCCESS)
+	    Abort("Could not probe for messages\n");
+	}
+      else
+	{
+	  if (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
+			 &flag, &status) != MPI_SUCCESS)
+	    Abort("Could not probe for messages\n");
+	  if (!flag)
+	    return(FALSE);
+	}
+      if (MPI_Get_count(&status, MPI_PACKED, plen) != MPI_SUCCESS)
+	Abort("Could not obtain number of bytes in message\n");
+      *ptag = status.MPI_TAG;
+      *psource = status.MPI_SOURCE;
+      return(TRUE);
+    }
+
+  LocalWait(-1, 0);
+  for (;;)
+    {
+      for (j = 0; j < n_ranks; ++j)
+	{
+	  i = (local_next_peer + j) % n_ranks;
+	  p = &local_peers[i];
+	  if (p->in.position - p->start < sizeof(header))
+	    continue;
+	  memcpy(header, &p->in.buffer[p->start], sizeof(header));
+	  if (p->in.position - p->start < sizeof(header) + header[1])
+	    continue;
+	  local_next_peer = (i + 1) % n_ranks;
+	  *ptag = header[0];
+	  *psource = i;
+	  *plen = header[1];
+	  return(TRUE);
+	}
+      if (!block)
+	return(FALSE);
+      if (!LocalWait(-1, -1))
+	Abort("Could not probe for messages; no process is left\n");
+    }
 }
 
-static int
-WorkerReceiveMessage (int *pfrom_tid)
+/* ReceiveMessage receives into buffer the message of len bytes from
+   source that was found by ProbeMessage */
+static Boolean
+ReceiveMessage (unsigned char *buffer, int len, int source, int tag)
 {
-  int flag;
-  int len;
   MPI_Status status;
-  struct timeval end_time, current_time;
-  struct timespec duration;
+  int header[2];
+  LocalPeer *p;
 
-  /* wait until a message arrives or the timeout has expired */
-  /* since MPI does not support timeouts, and we don't want to use
-     multiple threads, we have to poll (yuck) */
-  end_time.tv_sec = 0;
-  if (gettimeofday(&end_time, NULL) != 0)
-    Abort("Worker could not get time of day.\n");
-  end_time.tv_sec += MAX(WORKER_RECEIVE_TIMEOUT,10*(longest_task.tv_sec+1));
-  duration.tv_sec = 0;
-  duration.tv_nsec = 10000000;	/* 10 milliseconds */
-  do {
-    /* check if any message has arrived */
-    if (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-		   &flag, &status) != MPI_SUCCESS)
-      Abort("Could not probe for messages in WorkerReceiveMessage()\n");
+  if (!local)
+    return(MPI_Recv(buffer, len, MPI_PACKED, source, tag,
+		    MPI_COMM_WORLD, &status) == MPI_SUCCESS);
 
-    if (flag)
-      break;
+  p = &local_peers[source];
+  memcpy(header, &p->in.buffer[p->start], sizeof(header));
+  if (header[0] != tag || header[1] != len)
+    return(FALSE);
+  memcpy(buffer, &p->in.buffer[p->start + sizeof(header)], len);
+  p->start += sizeof(header) + len;
+  if (p->start == p->in.position)
+    {
+      p->start = 0;
+      p->in.position = 0;
+    }
+  return(TRUE);
+}
 
-    nanosleep(&duration, NULL);
+/* SendMessage sends the len bytes at buffer to process tid */
+static Boolean
+SendMessage (unsigned char *buffer, int len, int tid, int tag)
+{
+  int header[2];
 
-    if (gettimeofday(&current_time, NULL) != 0)
-      Abort("Worker could not get time of day.\n");
-  } while (current_time.tv_sec < end_time.tv_sec ||
-	   (current_time.tv_sec == end_time.tv_sec &&
-	    current_time.tv_usec < end_time.tv_usec));
+  if (!local)
+    return(MPI_Send(buffer, len, MPI_PACKED, tid, tag,
+		    MPI_COMM_WORLD) == MPI_SUCCESS);
 
-  if (!flag)
+  header[0] = tag;
+  header[1] = len;
+  return(LocalWrite(tid, (unsigned char *) header, sizeof(header)) &&
+	 LocalWrite(tid, buffer, len));
+}
+
+/* ForkLocalWorkers is called with -PAR_LOCAL=n when this is the only
+   process; it forks the n workers, each connected to the master by
+   its own socket, and returns the rank of the calling process.  MPI
+   has not been initialized, and is not used by any of the processes.
+   The workers inherit the state the program had at the start of
+   par_process, and are then sent contexts and tasks just as if they
+   ran under MPI. */
+static int
+ForkLocalWorkers ()
+{
+  int i, j;
+  int sv[2];
+  pid_t pid;
+
+  local_peers = (LocalPeer *) malloc((local_workers + 1) *
+				     sizeof(LocalPeer));
+  if (local_peers == NULL)
+    Abort("Could not allocate local peer table\n");
+  for (i = 0; i <= local_workers; ++i)
     {
-      Report("Worker timed out waiting for message. Exiting...\n");
-      PrepareToSend ();
-      par_pkint (my_tid);
-      Send (master_tid, WORKER_EXIT_MSG);
-      /* Fake msg so finalize will be done before exit.*/
-      return (TERMINATE_MSG); 
+      local_peers[i].pid = 0;
+      local_peers[i].fd = -1;
+      local_peers[i].in.buffer = NULL;
+      local_peers[i].in.size = 0;
+      local_peers[i].in.position = 0;
+      local_peers[i].start = 0;
+    }
+  fflush(NULL);
+  for (i = 1; i <= local_workers; ++i)
+    {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+	Abort("Could not create socket for local worker %d\n", i);
+      pid = fork();
+      if (pid < 0)
+	Abort("Could not fork local worker %d\n", i);
+      if (pid == 0)
+	{
+	  close(sv[0]);
+	  for (j = 1; j < i; ++j)
+	    {
+	      close(local_peers[j].fd);
+	      local_peers[j].fd = -1;
+	    }
+	  local_peers[0].fd = sv[1];
+	  fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+	  return(i);
+	}
+      close(sv[1]);
+      local_peers[i].pid = pid;
+      local_peers[i].fd = sv[0];
+      fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
     }
+  return(0);
+}
 
-  /* a message is there; now receive it */
-  if (MPI_Get_count(&status, MPI_PACKED, &len) != MPI_SUCCESS)
-    Abort("Could not obtain number of bytes in message\n");
-  if (len > in_size)
-    ExpandInBuffer(len);
+/* LocalWrite writes the n bytes at p to the socket of tid; while the
+   socket is full, whatever arrives from the other processes is read,
+   so that two processes sending to each other at once cannot
+   deadlock */
+static Boolean
+LocalWrite (int tid, unsigned char *p, int n)
+{
+  ssize_t k;
 
-  if (MPI_Recv(in_buffer, len, MPI_PACKED, MPI_ANY_SOURCE, MPI_ANY_TAG,
-	       MPI_COMM_WORLD, &status) != MPI_SUCCESS)
-    Abort("Worker could not receive message.\n");
+  while (n > 0)
+    {
+      if (local_peers[tid].fd < 0)
+	return(FALSE);
+      k = send(local_peers[tid].fd, p, n, MSG_NOSIGNAL);
+      if (k > 0)
+	{
+	  p += k;
+	  n -= k;
+	}
+      else if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	LocalWait(tid, -1);
+      else if (k == 0 || errno != EINTR)
+	return(FALSE);
+    }
+  return(TRUE);
+}
 
-  in_position = 0;
+/* LocalWait waits up to timeout milliseconds (forever if negative)
+   for data to arrive from any process, or, if write_tid is not -1,
+   for room in its socket, and reads what has arrived; it returns FALSE
+   if there is no open socket to wait on */
+static Boolean
+LocalWait (int write_tid, int timeout)
+{
+  struct pollfd fds[PAR_MAX_WORKERS_PER_HOST+1];
+  int tids[PAR_MAX_WORKERS_PER_HOST+1];
+  int n;
+  int i;
+
+  n = 0;
+  for (i = 0; i < n_ranks && n <= PAR_MAX_WORKERS_PER_HOST; ++i)
+    if (local_peers[i].fd >= 0)
+      {
+	fds[n].fd = local_peers[i].fd;
+	fds[n].events = POLLIN | (i == write_tid ? POLLOUT : 0);
+	fds[n].revents = 0;
+	tids[n++] = i;
+      }
+  if (n == 0)
+    return(FALSE);
+  if (poll(fds, n, timeout) < 0)
+    return(errno == EINTR);
+  for (i = 0; i < n; ++i)
+    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      LocalRead(tids[i]);
+  return(TRUE);
+}
+
+/* LocalRead appends what has arrived on the socket of tid to its
+   input; when the other end has gone away, a message is made up as
+   if the other process had said so: a worker exit for the master, or
+   termination for a worker */
+static void
+LocalRead (int tid)
+{
+  LocalPeer *p;
+  ssize_t k;
+  int header[2];
+  int position;
+
+  p = &local_peers[tid];
+  for (;;)
+    {
+      if (p->in.size - p->in.position < 65536)
+	{
+	  if (p->start > 0)
+	    {
+	      memmove(p->in.buffer, &p->in.buffer[p->start],
+		      p->in.position - p->start);
+	      p->in.position -= p->start;
+	      p->start = 0;
+	    }
+	  if (p->in.size - p->in.position < 65536)
+	    {
+	      p->in.size = 2 * p->in.size + 65536;
+	      p->in.buffer = (unsigned char *) realloc(p->in.buffer,
+						       p->in.size);
+	      if (p->in.buffer == NULL)
+		Abort("Could not expand buffer of local process %d\n", tid);
+	    }
+	}
+      k = recv(p->fd, &p->in.buffer[p->in.position],
+	       p->in.size - p->in.position, 0);
+      if (k > 0)
+	p->in.position += k;
+      else if (k < 0 && errno == EINTR)
+	continue;
+      else if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return;
+      else
+	break;
+    }
 
-  *pfrom_tid = status.MPI_SOURCE;
-  return(status.MPI_TAG);
+  /* the other process has gone away */
+  close(p->fd);
+  p->fd = -1;
+  if (p->in.size - p->in.position < sizeof(header) + 64)
+    {
+      p->in.size = p->in.position + sizeof(header) + 64;
+      p->in.buffer = (unsigned char *) realloc(p->in.buffer, p->in.size);
+      if (p->in.buffer == NULL)
+	Abort("Could not expand buffer of local process %d\n", tid);
+    }
+  position = 0;
+  if (rank == 0)
+    {
+      header[0] = WORKER_EXIT_MSG;
+      PackItems(&tid, 1, MPI_INT,
+		&p->in.buffer[p->in.position + sizeof(header)], 64,
+		&position);
+    }
+  else
+    header[0] = TERMINATE_MSG;
+  header[1] = position;
+  memcpy(&p->in.buffer[p->in.position], header, sizeof(header));
+  p->in.position += sizeof(header) + position;
 }
 
 static void
@@ -1587,12 +4680,87 @@ PrepareToSend ()
 static void
 Send (int tid, int tag)
 {
+  int prev;
+
   if (par_verbose)
     Report("Worker %d sending message %d to %d.\n",
 	   rank, tag, tid);
-  if (MPI_Send(out_buffer, out_position, MPI_PACKED,
-	       tid, tag, MPI_COMM_WORLD) != MPI_SUCCESS)
+  prev = MetricsPhase(METRICS_COMMUNICATE);
+  if (!SendMessage(out_buffer, out_position, tid, tag))
     Abort("Cannot send message (tid = %d tag = %d)\n", tid, tag);
+  MetricsPhase(prev);
+  MetricsCount("messages_sent", 1);
+  MetricsCount("bytes_sent", out_position);
+}
+
+/* LocalTypeSize returns the size in bytes of an item of one of the
+   elementary types that libpar packs */
+static int
+LocalTypeSize (MPI_Datatype type)
+{
+  if (type == MPI_BYTE)
+    return(sizeof(unsigned char));
+  if (type == MPI_CHAR)
+    return(sizeof(char));
+  if (type == MPI_SHORT)
+    return(sizeof(short));
+  if (type == MPI_INT)
+    return(sizeof(int));
+  if (type == MPI_LONG)
+    return(sizeof(long));
+  if (type == MPI_FLOAT)
+    return(sizeof(float));
+  if (type == MPI_DOUBLE)
+    return(sizeof(double));
+  Abort("Unknown type for local packing\n");
+  return(0);
+}
+
+/* PackedSize, PackItems and UnpackItems stand in for MPI_Pack_size,
+   MPI_Pack and MPI_Unpack; with -PAR_LOCAL, where MPI is never
+   initialized and every process runs the same binary on the same
+   host, the items are simply copied as they lie in memory */
+static Boolean
+PackedSize (int n, MPI_Datatype type, int *psize)
+{
+  if (!local)
+    return(MPI_Pack_size(n, type, MPI_COMM_WORLD, psize) == MPI_SUCCESS);
+  *psize = n * LocalTypeSize(type);
+  return(TRUE);
+}
+
+static Boolean
+PackItems (void *p, int n, MPI_Datatype type,
+	   void *buffer, int size, int *pposition)
+{
+  int len;
+
+  if (!local)
+    return(MPI_Pack(p, n, type, buffer, size, pposition,
+		    MPI_COMM_WORLD) == MPI_SUCCESS);
+  len = n * LocalTypeSize(type);
+  if (n < 0 || *pposition + len > size)
+    return(FALSE);
+  memcpy((unsigned char *) buffer + *pposition, p, len);
+  *pposition += len;
+  return(TRUE);
+}
+
+static Boolean
+UnpackItems (void *buffer, int size, int *pposition,
+	     void *p, int n, MPI_Datatype type)
+{
+  int len;
+
+  if (!local)
+    return(MPI_Unpack(buffer, size, pposition, p, n, type,
+		      MPI_COMM_WORLD) == MPI_SUCCESS);
+  len = n * LocalTypeSize(type);
+  if (n < 0 || *pposition + len > size)
+    return(FALSE);
+  memcpy(p, (unsigned char *) buffer + *pposition, len);
+  *pposition += len;
+  return(TRUE);
 }
 
 void
@@ -1600,8 +4768,7 @@ par_pkbyte(unsigned char v)
 {
   if (out_position + sizeof_byte > out_size)
     ExpandOutBuffer(out_position + sizeof_byte);
-  if (MPI_Pack(&v, 1, MPI_BYTE, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&v, 1, MPI_BYTE, out_buffer, out_size, &out_position))
     Abort("Could not pack byte into MPI buffer\n");
 }
 
@@ -1610,8 +4777,7 @@ par_pkshort(short v)
 {
   if (out_position + sizeof_short > out_size)
     ExpandOutBuffer(out_position + sizeof_short);
-  if (MPI_Pack(&v, 1, MPI_SHORT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&v, 1, MPI_SHORT, out_buffer, out_size, &out_position))
     Abort("Could not pack short into MPI buffer\n");
 }
 
@@ -1620,8 +4786,7 @@ par_pkint(int v)
 {
   if (out_position + sizeof_int > out_size)
     ExpandOutBuffer(out_position + sizeof_int);
-  if (MPI_Pack(&v, 1, MPI_INT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&v, 1, MPI_INT, out_buffer, out_size, &out_position))
     Abort("Could not pack int into MPI buffer\n");
 }
 
@@ -1630,8 +4795,7 @@ par_pklong (long v)
 {
   if (out_position + sizeof_long > out_size)
     ExpandOutBuffer(out_position + sizeof_long);
-  if (MPI_Pack(&v, 1, MPI_LONG, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&v, 1, MPI_LONG, out_buffer, out_size, &out_position))
     Abort("Could not pack long into MPI buffer\n");
 }
 
@@ -1640,8 +4804,7 @@ par_pkfloat (float v)
 {
   if (out_position + sizeof_float > out_size)
     ExpandOutBuffer(out_position + sizeof_float);
-  if (MPI_Pack(&v, 1, MPI_FLOAT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&v, 1, MPI_FLOAT, out_buffer, out_size, &out_position))
     Abort("Could not pack float into MPI buffer\n");
 }
 
@@ -1650,8 +4813,7 @@ par_pkdouble (double v)
 {
   if (out_position + sizeof_double > out_size)
     ExpandOutBuffer(out_position + sizeof_double);
-  if (MPI_Pack(&v, 1, MPI_DOUBLE, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&v, 1, MPI_DOUBLE, out_buffer, out_size, &out_position))
     Abort("Could not pack double into MPI buffer\n");
 }
 
@@ -1661,15 +4823,14 @@ par_pkstr (char *v)
   int size;
   int string_len = strlen(v);
 
-  if (MPI_Pack_size(string_len, MPI_CHAR, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(string_len, MPI_CHAR, &size))
     Abort("Could not determine packing size of string\n");
   if (out_position + sizeof_int + size > out_size)
     ExpandOutBuffer(out_position + sizeof_int + size);
-  if (MPI_Pack(&string_len, 1, MPI_INT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS ||
-      MPI_Pack(v, string_len, MPI_CHAR, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(&string_len, 1, MPI_INT,
+		 out_buffer, out_size, &out_position) ||
+      !PackItems(v, string_len, MPI_CHAR,
+		 out_buffer, out_size, &out_position))
     Abort("Could not pack string into MPI buffer\n");
 }
 
@@ -1677,13 +4838,11 @@ void
 par_pkbytearray (unsigned char *p, int n)
 {
   int size;
-  if (MPI_Pack_size(n, MPI_BYTE, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(n, MPI_BYTE, &size))
     Abort("Could not determine packing size of byte array\n");
   if (out_position + size > out_size)
     ExpandOutBuffer(out_position + size);
-  if (MPI_Pack(p, n, MPI_BYTE, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(p, n, MPI_BYTE, out_buffer, out_size, &out_position))
     Abort("Could not pack byte array into MPI buffer\n");
 }
 
@@ -1691,13 +4850,11 @@ void
 par_pkshortarray (short *p, int n)
 {
   int size;
-  if (MPI_Pack_size(n, MPI_SHORT, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(n, MPI_SHORT, &size))
     Abort("Could not determine packing size of short array\n");
   if (out_position + size > out_size)
     ExpandOutBuffer(out_position + size);
-  if (MPI_Pack(p, n, MPI_SHORT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(p, n, MPI_SHORT, out_buffer, out_size, &out_position))
     Abort("Could not pack short array into MPI buffer\n");
 }
 
@@ -1705,13 +4862,11 @@ void
 par_pkintarray (int *p, int n)
 {
   int size;
-  if (MPI_Pack_size(n, MPI_INT, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(n, MPI_INT, &size))
     Abort("Could not determine packing size of int array\n");
   if (out_position + size > out_size)
     ExpandOutBuffer(out_position + size);
-  if (MPI_Pack(p, n, MPI_INT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(p, n, MPI_INT, out_buffer, out_size, &out_position))
     Abort("Could not pack int array into MPI buffer\n");
 }
 
@@ -1719,13 +4874,11 @@ void
 par_pklongarray (long *p, int n)
 {
   int size;
-  if (MPI_Pack_size(n, MPI_LONG, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(n, MPI_LONG, &size))
     Abort("Could not determine packing size of long array\n");
   if (out_position + size > out_size)
     ExpandOutBuffer(out_position + size);
-  if (MPI_Pack(p, n, MPI_LONG, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(p, n, MPI_LONG, out_buffer, out_size, &out_position))
     Abort("Could not pack long array into MPI buffer\n");
 }
 
@@ -1733,13 +4886,11 @@ void
 par_pkfloatarray (float *p, int n)
 {
   int size;
-  if (MPI_Pack_size(n, MPI_FLOAT, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(n, MPI_FLOAT, &size))
     Abort("Could not determine packing size of float array\n");
   if (out_position + size > out_size)
     ExpandOutBuffer(out_position + size);
-  if (MPI_Pack(p, n, MPI_FLOAT, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(p, n, MPI_FLOAT, out_buffer, out_size, &out_position))
     Abort("Could not pack float array into MPI buffer\n");
 }
 
@@ -1747,22 +4898,34 @@ void
 par_pkdoublearray (double *p, int n)
 {
   int size;
-  if (MPI_Pack_size(n, MPI_DOUBLE, MPI_COMM_WORLD,
-		    &size) != MPI_SUCCESS)
+  if (!PackedSize(n, MPI_DOUBLE, &size))
     Abort("Could not determine packing size of double array\n");
   if (out_position + size > out_size)
     ExpandOutBuffer(out_position + size);
-  if (MPI_Pack(p, n, MPI_DOUBLE, out_buffer, out_size, &out_position,
-	       MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!PackItems(p, n, MPI_DOUBLE, out_buffer, out_size, &out_position))
     Abort("Could not pack double array into MPI buffer\n");
 }
 
+void
+par_pkblock (void *p, int n)
+{
+  int size;
+
+  if (!PackedSize(n, MPI_BYTE, &size))
+    Abort("Could not determine packing size of block\n");
+  if (out_position + sizeof_int + size > out_size)
+    ExpandOutBuffer(out_position + sizeof_int + size);
+  if (!PackItems(&n, 1, MPI_INT, out_buffer, out_size, &out_position) ||
+      !PackItems(p, n, MPI_BYTE, out_buffer, out_size, &out_position))
+    Abort("Could not pack block into MPI buffer\n");
+}
+
 unsigned char
 par_upkbyte ()
 {
   unsigned char v;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &v, 1, MPI_BYTE, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &v, 1, MPI_BYTE))
     Abort("Could not unpack byte from MPI buffer\n");
   return(v);
 }
@@ -1771,8 +4934,8 @@ short
 par_upkshort ()
 {
   short v;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &v, 1, MPI_SHORT, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &v, 1, MPI_SHORT))
     Abort("Could not unpack short from MPI buffer\n");
   return(v);
 }
@@ -1781,8 +4944,8 @@ int
 par_upkint ()
 {
   int v;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &v, 1, MPI_INT, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &v, 1, MPI_INT))
     Abort("Could not unpack int from MPI buffer\n");
   return(v);
 }
@@ -1791,8 +4954,8 @@ long
 par_upklong ()
 {
   long v;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &v, 1, MPI_LONG, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &v, 1, MPI_LONG))
     Abort("Could not unpack long from MPI buffer\n");
   return(v);
 }
@@ -1801,8 +4964,8 @@ float
 par_upkfloat ()
 {
   float v;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &v, 1, MPI_FLOAT, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &v, 1, MPI_FLOAT))
     Abort("Could not unpack float from MPI buffer\n");
   return(v);
 }
@@ -1811,8 +4974,8 @@ double
 par_upkdouble ()
 {
   double v;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &v, 1, MPI_DOUBLE, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &v, 1, MPI_DOUBLE))
     Abort("Could not unpack double from MPI buffer\n");
   return(v);
 }
@@ -1821,10 +4984,10 @@ void
 par_upkstr (char *s)
 {
   int string_len;
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 &string_len, 1, MPI_INT, MPI_COMM_WORLD) != MPI_SUCCESS ||
-      MPI_Unpack(in_buffer, in_size, &in_position,
-		 s, string_len, MPI_CHAR, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   &string_len, 1, MPI_INT) ||
+      !UnpackItems(in_buffer, in_size, &in_position,
+		   s, string_len, MPI_CHAR))
     Abort("Could not unpack string from MPI buffer\n");
   s[string_len] = '\0';
 }
@@ -1832,73 +4995,95 @@ par_upkstr (char *s)
 void
 par_upkbytearray (unsigned char *p, int n)
 {
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 p, n, MPI_BYTE, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   p, n, MPI_BYTE))
     Abort("Could not unpack byte array from MPI buffer\n");
 }
 
 void
 par_upkshortarray (short *p, int n)
 {
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 p, n, MPI_SHORT, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   p, n, MPI_SHORT))
     Abort("Could not unpack short array from MPI buffer\n");
 }
 
 void
 par_upkintarray (int *p, int n)
 {
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 p, n, MPI_INT, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   p, n, MPI_INT))
     Abort("Could not unpack int array from MPI buffer\n");
 }
 
 void
 par_upklongarray (long *p, int n)
 {
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 p, n, MPI_LONG, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   p, n, MPI_LONG))
     Abort("Could not unpack long array from MPI buffer\n");
 }
 
 void
 par_upkfloatarray (float *p, int n)
 {
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 p, n, MPI_FLOAT, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   p, n, MPI_FLOAT))
     Abort("Could not unpack float array from MPI buffer\n");
 }
 
 void
 par_upkdoublearray (double *p, int n)
 {
-  if (MPI_Unpack(in_buffer, in_size, &in_position,
-		 p, n, MPI_DOUBLE, MPI_COMM_WORLD) != MPI_SUCCESS)
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   p, n, MPI_DOUBLE))
     Abort("Could not unpack double array from MPI buffer\n");
 }
 
+void *
+par_upkblock (int *n)
+{
+  void *p;
+
+  /* MPI_BYTE is packed as is, so the block can be used in place */
+  if (!UnpackItems(in_buffer, in_size, &in_position,
+		   n, 1, MPI_INT) ||
+      *n < 0 || in_position + *n > in_size)
+    Abort("Could not unpack block from MPI buffer\n");
+  p = in_buffer + in_position;
+  in_position += *n;
+  return(p);
+}
 
 static void
 StartMPI (int argc,
 	  char **argv,
 	  char **envp)
 {	
-  if (MPI_Comm_rank(MPI_COMM_WORLD, &rank) != MPI_SUCCESS)
-    Abort("Could not obtain rank\n");
-  my_tid = rank;
+  int i;
 
-  if (MPI_Pack_size(1, MPI_BYTE, MPI_COMM_WORLD,
-		    &sizeof_byte) != MPI_SUCCESS ||
-      MPI_Pack_size(1, MPI_SHORT, MPI_COMM_WORLD,
-		    &sizeof_short) != MPI_SUCCESS ||
-      MPI_Pack_size(1, MPI_INT, MPI_COMM_WORLD,
-		    &sizeof_int) != MPI_SUCCESS ||
-      MPI_Pack_size(1, MPI_LONG, MPI_COMM_WORLD,
-		    &sizeof_long) != MPI_SUCCESS ||
-      MPI_Pack_size(1, MPI_FLOAT, MPI_COMM_WORLD,
-		    &sizeof_float) != MPI_SUCCESS ||
-      MPI_Pack_size(1, MPI_DOUBLE, MPI_COMM_WORLD,
-		    &sizeof_double) != MPI_SUCCESS)
+  if (local)
+    {
+      rank = ForkLocalWorkers();
+      n_ranks = local_workers + 1;
+    }
+  else
+    {
+      if (MPI_Comm_rank(MPI_COMM_WORLD, &rank) != MPI_SUCCESS)
+	Abort("Could not obtain rank\n");
+      if (MPI_Comm_size(MPI_COMM_WORLD, &n_ranks) != MPI_SUCCESS)
+	Abort("Cannot obtain number of processes\n");
+    }
+  my_tid = rank;
+  MetricsSetProcess(rank);
+  PinProcess();
+
+  if (!PackedSize(1, MPI_BYTE, &sizeof_byte) ||
+      !PackedSize(1, MPI_SHORT, &sizeof_short) ||
+      !PackedSize(1, MPI_INT, &sizeof_int) ||
+      !PackedSize(1, MPI_LONG, &sizeof_long) ||
+      !PackedSize(1, MPI_FLOAT, &sizeof_float) ||
+      !PackedSize(1, MPI_DOUBLE, &sizeof_double))
     Abort("Could not determine packing size of elementary types\n");
 
   if (rank == 0)
@@ -1906,10 +5091,8 @@ StartMPI (int argc,
       /* I am the master */
       master_tid = 0;
       
-      if (MPI_Comm_size(MPI_COMM_WORLD, &n_workers_pending) != MPI_SUCCESS)
-	Abort("Cannot obtain number of workers\n");
-      
-      --n_workers_pending;	/* because the master is not a worker */
+      n_workers_pending = n_ranks - 1; /* because the master is not a
+					  worker */
 
       if (n_workers_pending == 0)
 	{
@@ -1917,8 +5100,24 @@ StartMPI (int argc,
 	  return;
 	}
 
+      /* with sub-masters, only they and any ungrouped workers
+	 report to the master */
+      if (group_size > 0)
+	{
+	  n_workers_pending = 0;
+	  for (i = 1; i < n_ranks; ++i)
+	    if (SubMasterOf(i) == 0)
+	      ++n_workers_pending;
+	}
+
+      if (worker_threads > 1 && par_worker_threads() == 1)
+	Report("Ignoring -PAR_THREADS=%d: %s\n", worker_threads,
+	       group_size > 0 ? "it cannot be combined with -PAR_GROUP" :
+	       "this program performs one task at a time per process");
       if (par_verbose)
 	Report("I am the master with %d workers.\n", n_workers_pending);
+      TelemetryStart();
+      OpenJournal();
 
       (*par_master_task)(prog_argc, prog_argv, envp);
 
@@ -1928,12 +5127,20 @@ StartMPI (int argc,
     }
   else
     {
-      /* I am a worker */
-      master_tid = 0;
+      /* I am a worker, or a sub-master */
+      master_tid = SubMasterOf(rank);
 
-      PerformWorkerTasks();
-      if (par_worker_finalize != NULL)
-	(*par_worker_finalize)();
+      if (GroupWorkers(rank) > 0)
+	RelayTasks();
+      else
+	{
+	  if (par_worker_threads() > 1)
+	    ThreadTasks();
+	  else
+	    PerformWorkerTasks();
+	  if (par_worker_finalize != NULL)
+	    (*par_worker_finalize)();
+	}
 
 #ifdef ACCT
       PrintAcct(argv[0], my_tid);
@@ -1985,6 +5192,412 @@ StringCopy (char *to,
     }
 }
 
+static double
+WallTime ()
+{
+  struct timeval tv;
+
+  if (gettimeofday(&tv, NULL) != 0)
+    Abort("Could not get time of day.\n");
+  return(tv.tv_sec + 0.000001 * tv.tv_usec);
+}
+
+/* TelemetryStart opens the telemetry file, if one was requested
+   with -PAR_TELEMETRY=file (or the PAR_TELEMETRY environment
+   variable); only the master writes to it */
+/* OpenJournal, with -PAR_JOURNAL=file, reads the tasks that the file
+   records as finished into journal_table and opens it to append the
+   tasks finished from now on; a record that does not match its
+   checksum, such as a last line cut short by a crash, is ignored */
+static void
+OpenJournal ()
+{
+  FILE *f;
+  char *line;
+  size_t lineSize;
+  char *p;
+  char key[MAX_JOURNAL_KEY];
+  double seconds;
+  int size;
+  int pos;
+  int i;
+  unsigned int checksum, v;
+  JournalEntry *e;
+  int n;
+  Boolean torn;
+
+  if (journal_name[0] == '\0' || journal_file != NULL)
+    return;
+  n = 0;
+  torn = FALSE;
+  if ((f = fopen(journal_name, "r")) != NULL)
+    {
+      line = NULL;
+      lineSize = 0;
+      while (getline(&line, &lineSize, f) > 0)
+	{
+	  torn = line[strlen(line)-1] != '\n';
+	  if ((p = strrchr(line, ' ')) == NULL ||
+	      sscanf(p+1, "%x", &checksum) != 1)
+	    continue;
+	  *p = '\0';
+	  if (HashKey(line) != checksum ||
+	      sscanf(line, "%255s %lf %d %n", key, &seconds, &size, &pos) != 3 ||
+	      size < 0 || strlen(&line[pos]) != 2 * size)
+	    continue;
+	  e = FindJournalEntry(key);
+	  if (e == NULL)
+	    {
+	      e = (JournalEntry *) malloc(sizeof(JournalEntry));
+	      e->key = strdup(key);
+	      e->data = NULL;
+	      i = HashKey(key) % JOURNAL_BUCKETS;
+	      e->next = journal_table[i];
+	      journal_table[i] = e;
+	      ++n;
+	    }
+	  free(e->data);
+	  e->size = size;
+	  e->data = (unsigned char *) malloc(size > 0 ? size : 1);
+	  if (e->data == NULL)
+	    Abort("Could not allocate journal entry of %d bytes\n", size);
+	  for (i = 0; i < size; ++i)
+	    {
+	      sscanf(&line[pos + 2*i], "%2x", &v);
+	      e->data[i] = v;
+	    }
+	}
+      free(line);
+      fclose(f);
+    }
+  if ((journal_file = fopen(journal_name, "a")) == NULL)
+    {
+      Error("Could not open journal file %s\n", journal_name);
+      journal_name[0] = '\0';
+      return;
+    }
+  /* end a torn last record so that the next one starts a line */
+  if (torn)
+    fputc('\n', journal_file);
+  if (n > 0)
+    Report("Journal %s records %d finished tasks\n", journal_name, n);
+}
+
+static JournalEntry *
+FindJournalEntry (char *key)
+{
+  JournalEntry *e;
+
+  for (e = journal_table[HashKey(key) % JOURNAL_BUCKETS];
+       e != NULL; e = e->next)
+    if (strcmp(e->key, key) == 0)
+      return(e);
+  return(NULL);
+}
+
+/* ReplayJournal returns TRUE if the task about to be delegated as
+   number tc has a key that the journal records as finished, in which
+   case its recorded result has been handed to the user's
+   (*master_result)() */
+static Boolean
+ReplayJournal (int tc)
+{
+  JournalEntry *e;
+  unsigned char *saved_buffer;
+  int saved_size, saved_position;
+
+  if (pending_key == NULL || (e = FindJournalEntry(pending_key)) == NULL)
+    return(FALSE);
+  if (par_verbose)
+    Report("Task %s is finished according to the journal\n", pending_key);
+  free(pending_key);
+  pending_key = NULL;
+  if (par_master_result != NULL)
+    {
+      saved_buffer = in_buffer;
+      saved_size = in_size;
+      saved_position = in_position;
+      in_buffer = e->data;
+      in_size = e->size;
+      in_position = 0;
+      if (par_unpack_result != NULL && e->size > 0)
+	(*par_unpack_result)();
+      in_buffer = saved_buffer;
+      in_size = saved_size;
+      in_position = saved_position;
+      (*par_master_result)(tc);
+    }
+  return(TRUE);
+}
+
+/* JournalTask appends to the journal, if the finished task tc was
+   given a key, a record of the key, the seconds it took and its packed
+   result, of size bytes at data, and makes sure that it is on disk */
+static void
+JournalTask (int tc, double seconds, unsigned char *data, int size)
+{
+  char *line;
+  char *p;
+  char *key;
+  int i;
+
+  if (journal_file == NULL || tc >= task_keys_size ||
+      (key = task_keys[tc]) == NULL)
+    return;
+  line = (char *) malloc(strlen(key) + 2 * size + 64);
+  if (line == NULL)
+    Abort("Could not allocate journal record of %d bytes\n", size);
+  p = line + sprintf(line, "%s %.3f %d ", key, seconds, size);
+  for (i = 0; i < size; ++i)
+    p += sprintf(p, "%02x", data[i]);
+  fprintf(journal_file, "%s %08x\n", line, HashKey(line));
+  if (fflush(journal_file) != 0 || fsync(fileno(journal_file)) != 0)
+    Error("Could not write journal file %s\n", journal_name);
+  free(line);
+  free(key);
+  task_keys[tc] = NULL;
+}
+
+/* KeyTask gives the pending key, if any, to task tc */
+static void
+KeyTask (int tc)
+{
+  int n;
+
+  if (pending_key == NULL)
+    return;
+  if (tc >= task_keys_size)
+    {
+      n = task_keys_size == 0 ? 1024 : task_keys_size;
+      while (n <= tc)
+	n *= 2;
+      task_keys = (char **) realloc(task_keys, n * sizeof(char *));
+      if (task_keys == NULL)
+	Abort("Could not allocate task key table\n");
+      memset(&task_keys[task_keys_size], 0,
+	     (n - task_keys_size) * sizeof(char *));
+      task_keys_size = n;
+    }
+  free(task_keys[tc]);
+  task_keys[tc] = pending_key;
+  pending_key = NULL;
+}
+
+static void
+TelemetryStart ()
+{
+  if (telemetry_name[0] == '\0')
+    return;
+  if (strcmp(telemetry_name, "-") == 0)
+    telemetry_file = stdout;
+  else if ((telemetry_file = fopen(telemetry_name, "a")) == NULL)
+    {
+      Error("Could not open telemetry file %s\n", telemetry_name);
+      return;
+    }
+  telemetry_start = WallTime();
+  last_heartbeat = telemetry_start;
+  queue_time = telemetry_start;
+}
+
+/* NoteQueueDepth accumulates the time-weighted queue depth; it is
+   called whenever n_queued_tasks changes */
+static void
+NoteQueueDepth ()
+{
+  double t;
+
+  if (telemetry_file == NULL)
+    return;
+  t = WallTime();
+  queue_integral += queue_depth * (t - queue_time);
+  queue_time = t;
+  queue_depth = n_queued_tasks;
+  if (queue_depth > queue_max)
+    queue_max = queue_depth;
+}
+
+/* NoteTaskRecord records the completion by worker n of a task that
+   the worker reports took seconds; the losing copy of a speculatively
+   duplicated task only counts toward the worker's busy time */
+static void
+NoteTaskRecord (int n, Task *task, double seconds, Boolean duplicate)
+{
+  double t;
+
+  t = WallTime();
+  workers[n].busy_seconds += seconds;
+  if (workers[n].n_tasks == 0)
+    workers[n].assigned_seconds += t - workers[n].assigned_since;
+  if (duplicate)
+    return;
+  if (n_task_records >= task_records_size)
+    {
+      task_records_size = (task_records_size == 0) ? 1024 :
+	2 * task_records_size;
+      task_records = (TaskRecord *) realloc(task_records,
+					    task_records_size *
+					    sizeof(TaskRecord));
+      if (task_records == NULL)
+	Abort("Could not allocate task records\n");
+    }
+  task_records[n_task_records].number = task->number;
+  task_records[n_task_records].worker = n;
+  task_records[n_task_records].seconds = seconds;
+  task_records[n_task_records].latency = t - task->dispatch_time;
+  ++n_task_records;
+  ++workers[n].n_completed;
+}
+
+/* Heartbeat writes a line giving the current state of the master if
+   the heartbeat interval has passed since the last one (or if
+   force is TRUE) */
+static void
+Heartbeat (Boolean force)
+{
+  int i;
+  int busy;
+  double t;
+
+  if (telemetry_file == NULL)
+    return;
+  t = WallTime();
+  if (!force &&
+      (heartbeat_interval <= 0 || t - last_heartbeat < heartbeat_interval))
+    return;
+  busy = 0;
+  for (i = 0; i < n_workers; ++i)
+    if (workers[i].n_tasks > 0)
+      ++busy;
+  fprintf(telemetry_file,
+	  "{\"kind\": \"heartbeat\", \"program\": \"%s\", "
+	  "\"elapsed\": %.3f, \"workers\": %d, \"busy_workers\": %d, "
+	  "\"queued\": %d, \"outstanding\": %d, \"completed\": %d, "
+	  "\"tasks_per_second\": %.3f, \"mean_task_seconds\": %.6f, "
+	  "\"master_wait_seconds\": %.3f}\n",
+	  prog_name, t - telemetry_start, n_workers, busy,
+	  n_queued_tasks, tasks_outstanding, n_task_records,
+	  (t > last_heartbeat) ?
+	  (n_task_records - heartbeat_completed) / (t - last_heartbeat) : 0.0,
+	  mean_task_time, master_wait_seconds);
+  fflush(telemetry_file);
+  last_heartbeat = t;
+  heartbeat_completed = n_task_records;
+}
+
+/* TelemetryReport is called by par_finish once all tasks have
+   completed; it writes one line per worker giving how its time was
+   divided, a summary of the master's time and of the task times,
+   and a line for each of the slowest tasks */
+static void
+TelemetryReport ()
+{
+  int i;
+  int nt;
+  double t, elapsed;
+  double idle;
+  double median, p90, p99;
+  double *times;
+
+  if (telemetry_file == NULL)
+    return;
+  NoteQueueDepth();
+  Heartbeat(TRUE);
+  t = WallTime();
+  elapsed = t - telemetry_start;
+
+  for (i = 0; i < n_workers; ++i)
+    {
+      if (workers[i].n_tasks > 0)
+	workers[i].assigned_seconds += t - workers[i].assigned_since;
+      /* the time the worker spent neither on tasks nor on contexts
+	 was spent waiting for the master */
+      idle = workers[i].capacity * (t - workers[i].start_time) -
+	workers[i].busy_seconds -
+	workers[i].context_seconds;
+      fprintf(telemetry_file,
+	      "{\"kind\": \"worker\", \"program\": \"%s\", "
+	      "\"worker\": %d, \"host\": \"%s\", \"workers\": %d, "
+	      "\"tasks\": %d, "
+	      "\"busy_seconds\": %.3f, \"context_seconds\": %.3f, "
+	      "\"idle_seconds\": %.3f, \"assigned_seconds\": %.3f, "
+	      "\"utilisation\": %.4f, "
+	      "\"bytes_sent\": %.0f, \"bytes_received\": %.0f, "
+	      "\"memory_mb\": %d, \"gpus\": %d}\n",
+	      prog_name, i, workers[i].host, workers[i].capacity,
+	      workers[i].n_completed,
+	      workers[i].busy_seconds, workers[i].context_seconds,
+	      MAX(idle, 0.0), workers[i].assigned_seconds,
+	      (t > workers[i].start_time) ?
+	      workers[i].busy_seconds /
+	      (workers[i].capacity * (t - workers[i].start_time)) : 0.0,
+	      workers[i].bytes_sent, workers[i].bytes_received,
+	      workers[i].memory, workers[i].gpus);
+    }
+
+  /* order the tasks from slowest to fastest */
+  nt = n_task_records;
+  median = p90 = p99 = 0.0;
+  if (nt > 0)
+    {
+      qsort(task_records, nt, sizeof(TaskRecord), CompareTaskRecords);
+      times = (double *) malloc(nt * sizeof(double));
+      if (times == NULL)
+	Abort("Could not allocate task times\n");
+      for (i = 0; i < nt; ++i)
+	times[i] = task_records[i].seconds;
+      median = times[nt / 2];
+      p90 = times[nt / 10];
+      p99 = times[nt / 100];
+      free(times);
+    }
+  fprintf(telemetry_file,
+	  "{\"kind\": \"summary\", \"program\": \"%s\", "
+	  "\"elapsed\": %.3f, \"workers\": %d, \"tasks\": %d, "
+	  "\"master_wait_seconds\": %.3f, \"master_busy_seconds\": %.3f, "
+	  "\"context_bytes\": %.0f, "
+	  "\"mean_queue_depth\": %.3f, \"max_queue_depth\": %d, "
+	  "\"median_task_seconds\": %.6f, \"p90_task_seconds\": %.6f, "
+	  "\"p99_task_seconds\": %.6f, \"max_task_seconds\": %.6f, "
+	  "\"speculative_copies\": %d, \"speculative_wins\": %d}\n",
+	  prog_name, elapsed, n_workers, nt,
+	  master_wait_seconds, MAX(elapsed - master_wait_seconds, 0.0),
+	  master_context_bytes,
+	  (elapsed > 0.0) ? queue_integral / elapsed : 0.0, queue_max,
+	  median, p90, p99, (nt > 0) ? task_records[0].seconds : 0.0,
+	  n_speculated, n_speculation_wins);
+  for (i = 0; i < nt && i < TELEMETRY_TAIL; ++i)
+    fprintf(telemetry_file,
+	    "{\"kind\": \"slow_task\", \"program\": \"%s\", "
+	    "\"rank\": %d, \"task\": %d, \"worker\": %d, "
+	    "\"seconds\": %.6f, \"latency\": %.6f, "
+	    "\"times_median\": %.2f}\n",
+	    prog_name, i + 1, task_records[i].number, task_records[i].worker,
+	    task_records[i].seconds, task_records[i].latency,
+	    (median > 0.0) ? task_records[i].seconds / median : 0.0);
+  fflush(telemetry_file);
+  if (telemetry_file != stdout)
+    fclose(telemetry_file);
+  telemetry_file = NULL;
+  free(task_records);
+  task_records = NULL;
+  n_task_records = 0;
+  task_records_size = 0;
+}
+
+static int
+CompareTaskRecords (const void *a, const void *b)
+{
+  const TaskRecord *ra = (const TaskRecord *) a;
+  const TaskRecord *rb = (const TaskRecord *) b;
+
+  if (ra->seconds > rb->seconds)
+    return(-1);
+  if (ra->seconds < rb->seconds)
+    return(1);
+  return(ra->number - rb->number);
+}
+
 static void
 Report (char *fmt, ...)
 {
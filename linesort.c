@@ -0,0 +1,253 @@
+/*
+ * linesort.c -- defines the external sort of the lines of a file
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "linesort.h"
+
+#define MAX_MERGE	64	/* runs merged at once */
+
+static LineCompare compare;	/* cmp of the SortLines in progress */
+
+static int CompareLines (const void *x, const void *y);
+static int ReadLine (FILE *f, char **line, size_t *size);
+static int MergeRuns (char *outName, int firstRun, int nRuns,
+		      char *error);
+static void RunName (char *name, int run);
+
+static char runBase[PATH_MAX];	/* outName of the SortLines in progress */
+
+int
+SortLines (char *inName, char *outName, LineCompare cmp, int maxLines,
+	   char *error)
+{
+  FILE *f, *rf;
+  char **lines;
+  size_t *sizes;
+  int n;
+  int i;
+  int nRuns, firstRun, group;
+  int done;
+  int ok;
+  char fn[PATH_MAX + 32];
+
+  if (maxLines < 1)
+    maxLines = 1;
+  compare = cmp;
+  strcpy(runBase, outName);
+  f = fopen(inName, "r");
+  if (f == NULL)
+    {
+      sprintf(error, "Could not open %s for sorting\n", inName);
+      return(0);
+    }
+  lines = (char **) malloc(maxLines * sizeof(char *));
+  sizes = (size_t *) malloc(maxLines * sizeof(size_t));
+  if (lines == NULL || sizes == NULL)
+    {
+      fclose(f);
+      free(lines);
+      free(sizes);
+      sprintf(error, "Could not allocate sorting buffer of %d lines\n",
+	      maxLines);
+      return(0);
+    }
+  memset(lines, 0, maxLines * sizeof(char *));
+  memset(sizes, 0, maxLines * sizeof(size_t));
+
+  /* sort the input in runs of maxLines lines; an input that fits in
+     one run goes straight to outName */
+  nRuns = 0;
+  done = 0;
+  ok = 1;
+  while (ok && !done)
+    {
+      for (n = 0; n < maxLines; ++n)
+	if (!ReadLine(f, &lines[n], &sizes[n]))
+	  break;
+      done = n < maxLines;
+      if (n == 0 && nRuns > 0)
+	break;
+      qsort(lines, n, sizeof(char *), CompareLines);
+      if (done && nRuns == 0)
+	strcpy(fn, outName);
+      else
+	RunName(fn, nRuns);
+      rf = fopen(fn, "w");
+      if (rf == NULL)
+	{
+	  sprintf(error, "Could not open sort file %s\n", fn);
+	  ok = 0;
+	  break;
+	}
+      for (i = 0; i < n; ++i)
+	fprintf(rf, "%s\n", lines[i]);
+      if (fclose(rf) != 0)
+	{
+	  sprintf(error, "Could not write sort file %s\n", fn);
+	  ok = 0;
+	  break;
+	}
+      if (!done || nRuns > 0)
+	++nRuns;
+    }
+  fclose(f);
+  for (i = 0; i < maxLines; ++i)
+    free(lines[i]);
+  free(lines);
+  free(sizes);
+  if (!ok)
+    {
+      for (i = 0; i < nRuns; ++i)
+	{
+	  RunName(fn, i);
+	  unlink(fn);
+	}
+      return(0);
+    }
+
+  /* an input of exactly maxLines lines leaves one run */
+  if (nRuns == 1)
+    {
+      RunName(fn, 0);
+      if (rename(fn, outName) != 0)
+	{
+	  sprintf(error, "Could not rename sort file %s\n", fn);
+	  unlink(fn);
+	  return(0);
+	}
+      return(1);
+    }
+
+  /* merge the runs, MAX_MERGE at a time, numbering the merged runs
+     after the ones they came from, until there is one */
+  firstRun = 0;
+  while (nRuns > 1)
+    {
+      if (nRuns <= MAX_MERGE)
+	return(MergeRuns(outName, firstRun, nRuns, error));
+      for (i = 0; i < nRuns; i += MAX_MERGE)
+	{
+	  group = nRuns - i < MAX_MERGE ? nRuns - i : MAX_MERGE;
+	  RunName(fn, firstRun + nRuns + i / MAX_MERGE);
+	  if (!MergeRuns(fn, firstRun + i, group, error))
+	    return(0);
+	}
+      firstRun += nRuns;
+      nRuns = (nRuns + MAX_MERGE - 1) / MAX_MERGE;
+    }
+  return(1);
+}
+
+static int
+CompareLines (const void *x, const void *y)
+{
+  return((*compare)(*((char **) x), *((char **) y)));
+}
+
+/* ReadLine reads the next line of f, without its newline, into *line
+   (of *size bytes, grown as needed), returning 0 at the end of f */
+static int
+ReadLine (FILE *f, char **line, size_t *size)
+{
+  ssize_t len;
+
+  len = getline(line, size, f);
+  if (len < 0)
+    return(0);
+  if (len > 0 && (*line)[len-1] == '\n')
+    (*line)[len-1] = '\0';
+  return(1);
+}
+
+/* MergeRuns merges the nRuns runs from firstRun on into outName and
+   removes them */
+static int
+MergeRuns (char *outName, int firstRun, int nRuns, char *error)
+{
+  FILE *in[MAX_MERGE];
+  char *lines[MAX_MERGE];
+  size_t sizes[MAX_MERGE];
+  int live[MAX_MERGE];
+  FILE *f;
+  char fn[PATH_MAX + 32];
+  int i, best;
+  int result;
+
+  result = 1;
+  for (i = 0; i < nRuns; ++i)
+    {
+      lines[i] = NULL;
+      sizes[i] = 0;
+      RunName(fn, firstRun + i);
+      in[i] = fopen(fn, "r");
+      if (in[i] == NULL)
+	{
+	  sprintf(error, "Could not open sort file %s\n", fn);
+	  result = 0;
+	}
+      live[i] = in[i] != NULL && ReadLine(in[i], &lines[i], &sizes[i]);
+    }
+  f = result ? fopen(outName, "w") : NULL;
+  if (result && f == NULL)
+    {
+      sprintf(error, "Could not open sort file %s\n", outName);
+      result = 0;
+    }
+  while (result)
+    {
+      best = -1;
+      for (i = 0; i < nRuns; ++i)
+	if (live[i] &&
+	    (best < 0 || (*compare)(lines[i], lines[best]) < 0))
+	  best = i;
+      if (best < 0)
+	break;
+      fprintf(f, "%s\n", lines[best]);
+      live[best] = ReadLine(in[best], &lines[best], &sizes[best]);
+    }
+  if (f != NULL && fclose(f) != 0 && result)
+    {
+      sprintf(error, "Could not write sort file %s\n", outName);
+      result = 0;
+    }
+  for (i = 0; i < nRuns; ++i)
+    {
+      if (in[i] != NULL)
+	fclose(in[i]);
+      free(lines[i]);
+      RunName(fn, firstRun + i);
+      unlink(fn);
+    }
+  return(result);
+}
+
+static void
+RunName (char *name, int run)
+{
+  sprintf(name, "%s.run%d", runBase, run);
+}
@@ -0,0 +1,30 @@
+//
+// linesort.h - an external sort of the lines of a text file, for
+//              the summaries that masters stream to disk as results
+//              arrive and sort only once they are all in
+//
+#ifndef LINESORT_H
+#define LINESORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* LineCompare compares two lines (without their newlines) as qsort's
+   comparison functions do */
+typedef int (*LineCompare) (const char *a, const char *b);
+
+/* SortLines writes the lines of file inName, sorted by cmp, to file
+   outName.  At most maxLines lines are held in memory at once: longer
+   inputs are sorted in runs of that many lines, kept in files named
+   after outName, which are then merged (no more than 64 at a time) and
+   removed.  It returns 0, with a message in error, if a file could not
+   be read or written or there was no memory. */
+int SortLines (char *inName, char *outName, LineCompare cmp, int maxLines,
+	       char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LINESORT_H */
@@ -30,6 +30,7 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,23 +42,54 @@
 
 #define MAX_INPUTS	32
 
+/* the state shared by the threads merging the image a strip of rows
+   at a time; each strip is merged into one of nSlots buffers, and the
+   main thread writes the strips out in order as they are finished */
+typedef struct MergeSlot
+{
+  unsigned char *pixels;
+  int done;
+} MergeSlot;
+
+typedef struct Merge
+{
+  int nInputs;
+  char **inputName;
+  int width, height;
+  int stripRows;
+  int nStrips;
+  int nSlots;
+  MergeSlot *slots;
+  int next;			/* the next strip to be merged */
+  int written;			/* the number of strips written */
+  int failed;
+  char error[PATH_MAX+256];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} Merge;
+
+int IsTiffName (char *fn);
+void MergePixels (unsigned char *output, unsigned char *input, size_t n);
+int MergeWholeImages (int nInputs, char **inputName, char *outputName);
+int MergeStrips (int nInputs, char **inputName, char *outputName,
+		 int stripRows, int nThreads);
+void *MergeThreadMain (void *arg);
+
 int
 main (int argc, char **argv)
 {
   int i;
-  char msg[PATH_MAX+256];
   char *inputName[MAX_INPUTS];
-  unsigned char *input;
-  int iw, ih;
   char outputName[PATH_MAX];
-  unsigned char *output;
-  int ow, oh;
-  int x, y;
   int nInputs;
+  int stripRows;
+  int nThreads;
   int error;
 
   error = 0;
   nInputs = 0;
+  stripRows = 256;
+  nThreads = 1;
   for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-input") == 0)
       {
@@ -83,6 +115,26 @@ main (int argc, char **argv)
 	  }
 	strcpy(outputName, argv[i]);
       }
+    else if (strcmp(argv[i], "-rows") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &stripRows) != 1 ||
+	    stripRows < 0)
+	  {
+	    fprintf(stderr, "-rows error\n");
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    fprintf(stderr, "-threads error\n");
+	    error = 1;
+	    break;
+	  }
+      }
     else
       {
 	error = 1;
@@ -101,6 +153,8 @@ main (int argc, char **argv)
       fprintf(stderr, "                    -input image1.tif\n");
       fprintf(stderr, "                    ...\n");
       fprintf(stderr, "                    -output out.tif\n");
+      fprintf(stderr, "                    [-rows <int>]\n");
+      fprintf(stderr, "                    [-threads <int>]\n");
       exit(1);
     }
 	
@@ -110,31 +164,78 @@ main (int argc, char **argv)
   fprintf(stderr, "into %s\n", outputName);
   fflush(stderr);
 
+  /* TIFF inputs can be read a strip at a time, and TIFF and PGM output
+     written that way; anything else is merged whole */
+  if (stripRows > 0 &&
+      (IsTiffName(outputName) ||
+       (strlen(outputName) > 4 &&
+	strcasecmp(&outputName[strlen(outputName)-4], ".pgm") == 0)))
+    {
+      for (i = 0; i < nInputs; ++i)
+	if (!IsTiffName(inputName[i]))
+	  break;
+      if (i >= nInputs)
+	return(!MergeStrips(nInputs, inputName, outputName,
+			    stripRows, nThreads));
+    }
+  return(!MergeWholeImages(nInputs, inputName, outputName));
+}
+
+int
+IsTiffName (char *fn)
+{
+  int len;
+
+  len = strlen(fn);
+  return((len > 4 && strcasecmp(&fn[len-4], ".tif") == 0) ||
+	 (len > 5 && strcasecmp(&fn[len-5], ".tiff") == 0));
+}
+
+/* MergePixels sets each of the n output pixels that is still 0 to the
+   corresponding input pixel; the loop has no branches, so that the
+   compiler can vectorize it */
+void
+MergePixels (unsigned char *output, unsigned char *input, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    output[i] = output[i] != 0 ? output[i] : input[i];
+}
+
+int
+MergeWholeImages (int nInputs, char **inputName, char *outputName)
+{
+  int i;
+  char msg[PATH_MAX+256];
+  unsigned char *input;
+  int iw, ih;
+  unsigned char *output;
+  int ow, oh;
+
+  output = NULL;
+  ow = oh = 0;
   for (i = 0; i < nInputs; ++i)
     {
       if (!ReadImage(inputName[i], &input, &iw, &ih, -1, -1, -1, -1, msg))
 	{
 	  fprintf(stderr, "Could not read image %s:\n%s\n", inputName[i], msg);
-	  exit(1);
+	  return(0);
 	}
       if (i == 0)
 	{
 	  ow = iw;
 	  oh = ih;
-	  output = (unsigned char *) malloc(oh*ow);
-	  memset(output, 0, oh*ow);
+	  output = (unsigned char *) malloc(((size_t) oh) * ow);
+	  memset(output, 0, ((size_t) oh) * ow);
 	}
       else if (iw != ow || ih != oh)
 	{
 	  fprintf(stderr, "Image %s has a different size.\n", inputName[i]);
-	  exit(1);
+	  return(0);
 	}
 
-      for (y = 0; y < ih; ++y)
-	for (x = 0; x < iw; ++x)
-	  if (output[y*ow+x] == 0 &&
-	      input[y*iw+x] != 0)
-	    output[y*ow+x] = input[y*iw+x];
+      MergePixels(output, input, ((size_t) ih) * iw);
       free(input);
       input = NULL;
     }
@@ -144,9 +245,194 @@ main (int argc, char **argv)
     {
       fprintf(stderr, "Could not write image %s:\n%s\n",
 	      outputName, msg);
-      exit(1);
+      return(0);
     }
 
   free(output);
-  return(0);
+  return(1);
+}
+
+/* MergeStrips merges the TIFF inputs a strip of stripRows rows at a
+   time, reading only that strip of each input; the strips are merged
+   by nThreads threads and written as soon as all strips before them
+   have been, so that the memory used depends only on the width of
+   the image and the number of threads, not on the number of inputs */
+int
+MergeStrips (int nInputs, char **inputName, char *outputName,
+	     int stripRows, int nThreads)
+{
+  Merge m;
+  char msg[PATH_MAX+256];
+  int i;
+  int iw, ih;
+  int s;
+  int nRows;
+  ImageWriter *writer;
+  pthread_t *threads;
+  MergeSlot *slot;
+
+  for (i = 0; i < nInputs; ++i)
+    {
+      if (!ReadImageSize(inputName[i], &iw, &ih, msg))
+	{
+	  fprintf(stderr, "Could not read image %s:\n%s\n", inputName[i], msg);
+	  return(0);
+	}
+      if (i == 0)
+	{
+	  m.width = iw;
+	  m.height = ih;
+	}
+      else if (iw != m.width || ih != m.height)
+	{
+	  fprintf(stderr, "Image %s has a different size.\n", inputName[i]);
+	  return(0);
+	}
+    }
+
+  m.nInputs = nInputs;
+  m.inputName = inputName;
+  m.stripRows = stripRows;
+  m.nStrips = (m.height + stripRows - 1) / stripRows;
+  if (nThreads > m.nStrips)
+    nThreads = m.nStrips > 0 ? m.nStrips : 1;
+  m.nSlots = 2 * nThreads;
+  m.slots = (MergeSlot *) malloc(m.nSlots * sizeof(MergeSlot));
+  for (i = 0; i < m.nSlots; ++i)
+    {
+      m.slots[i].pixels = (unsigned char *) malloc(((size_t) stripRows) *
+						   m.width);
+      m.slots[i].done = 0;
+    }
+  m.next = 0;
+  m.written = 0;
+  m.failed = 0;
+  pthread_mutex_init(&m.lock, NULL);
+  pthread_cond_init(&m.cond, NULL);
+
+  writer = OpenImageWriter(outputName, m.width, m.height,
+			   UncompressedImage, msg);
+  if (writer == NULL)
+    {
+      fprintf(stderr, "Could not open output image %s:\n%s\n",
+	      outputName, msg);
+      return(0);
+    }
+
+  threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+  for (i = 0; i < nThreads; ++i)
+    pthread_create(&threads[i], NULL, MergeThreadMain, &m);
+
+  for (s = 0; s < m.nStrips; ++s)
+    {
+      slot = &m.slots[s % m.nSlots];
+      pthread_mutex_lock(&m.lock);
+      while (!slot->done && !m.failed)
+	pthread_cond_wait(&m.cond, &m.lock);
+      pthread_mutex_unlock(&m.lock);
+      if (m.failed)
+	break;
+
+      nRows = m.height - s * stripRows;
+      if (nRows > stripRows)
+	nRows = stripRows;
+      if (!WriteImageRows(writer, slot->pixels, nRows, msg))
+	{
+	  pthread_mutex_lock(&m.lock);
+	  m.failed = 1;
+	  sprintf(m.error, "Could not write image %s:\n%s\n",
+		  outputName, msg);
+	  pthread_cond_broadcast(&m.cond);
+	  pthread_mutex_unlock(&m.lock);
+	  break;
+	}
+
+      pthread_mutex_lock(&m.lock);
+      slot->done = 0;
+      ++m.written;
+      pthread_cond_broadcast(&m.cond);
+      pthread_mutex_unlock(&m.lock);
+    }
+
+  for (i = 0; i < nThreads; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (!CloseImageWriter(writer, msg) && !m.failed)
+    {
+      m.failed = 1;
+      sprintf(m.error, "Could not write image %s:\n%s\n", outputName, msg);
+    }
+  if (m.failed)
+    fprintf(stderr, "%s", m.error);
+
+  for (i = 0; i < m.nSlots; ++i)
+    free(m.slots[i].pixels);
+  free(m.slots);
+  pthread_mutex_destroy(&m.lock);
+  pthread_cond_destroy(&m.cond);
+  return(!m.failed);
+}
+
+void *
+MergeThreadMain (void *arg)
+{
+  Merge *m = (Merge *) arg;
+  int s;
+  int i;
+  int y0, y1;
+  int iw, ih;
+  unsigned char *output;
+  unsigned char *input;
+  char msg[PATH_MAX+256];
+
+  for (;;)
+    {
+      /* take the next strip once its slot has been written out */
+      pthread_mutex_lock(&m->lock);
+      while (!m->failed && m->next < m->nStrips &&
+	     m->next >= m->written + m->nSlots)
+	pthread_cond_wait(&m->cond, &m->lock);
+      if (m->failed || m->next >= m->nStrips)
+	{
+	  pthread_mutex_unlock(&m->lock);
+	  break;
+	}
+      s = m->next++;
+      pthread_mutex_unlock(&m->lock);
+
+      y0 = s * m->stripRows;
+      y1 = y0 + m->stripRows - 1;
+      if (y1 >= m->height)
+	y1 = m->height - 1;
+      output = m->slots[s % m->nSlots].pixels;
+      for (i = 0; i < m->nInputs; ++i)
+	{
+	  if (!ReadImage(m->inputName[i], &input, &iw, &ih,
+			 -1, -1, y0, y1, msg))
+	    {
+	      pthread_mutex_lock(&m->lock);
+	      if (!m->failed)
+		{
+		  m->failed = 1;
+		  sprintf(m->error, "Could not read image %s:\n%s\n",
+			  m->inputName[i], msg);
+		}
+	      pthread_cond_broadcast(&m->cond);
+	      pthread_mutex_unlock(&m->lock);
+	      return(NULL);
+	    }
+	  if (i == 0)
+	    memcpy(output, input, ((size_t) ih) * iw);
+	  else
+	    MergePixels(output, input, ((size_t) ih) * iw);
+	  free(input);
+	}
+
+      pthread_mutex_lock(&m->lock);
+      m->slots[s % m->nSlots].done = 1;
+      pthread_cond_broadcast(&m->cond);
+      pthread_mutex_unlock(&m->lock);
+    }
+  return(NULL);
 }
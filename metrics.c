@@ -0,0 +1,735 @@
+/*
+ * metrics.c -- defines the per-phase timers, counters and memory
+ *              sampling that register, find_rst, align, apply_map
+ *              and libpar write as JSON lines, and the live text
+ *              file of their running totals
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#if defined(PROFILE_NVTX)
+#include <nvtx3/nvToolsExt.h>
+#elif defined(PROFILE_ITT)
+#include <ittnotify.h>
+#elif defined(PROFILE_SDT)
+#include <sys/sdt.h>
+#endif
+
+#define MAX_COUNTERS	32
+#define MAX_GAUGES	32
+#define MAX_KINDS	16
+#define NAME_LENGTH	64
+#define LIVE_INTERVAL	10.0	/* default seconds between rewrites of
+				   the live metrics */
+
+static char *phaseNames[METRICS_N_PHASES] = {
+  "other", "read", "pyramid", "compute", "write", "communicate"
+};
+
+static int enabled = 0;
+static char toolName[NAME_LENGTH];
+static int processNumber = -1;
+static FILE *metricsFile = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a record being accumulated; the thread that called MetricsInit
+   owns the process's record, and any other thread gets one of its own
+   the first time it switches phase, names or emits a record, so that
+   the worker threads of libpar each time their own tasks */
+typedef struct MetricsRecord
+{
+  char name[PATH_MAX];
+  double start;
+  double phaseSeconds[METRICS_N_PHASES];
+  int phase;			/* the current phase */
+  double phaseStart;
+  int nCounters;
+  char counterNames[MAX_COUNTERS][NAME_LENGTH];
+  double counterValues[MAX_COUNTERS];
+  long peakRss;			/* KB, of the samples in this record */
+} MetricsRecord;
+
+static pthread_t owner;
+static MetricsRecord mainRecord;
+static __thread MetricsRecord *threadRecord = NULL;
+static pthread_key_t recordKey;
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+
+/* the running totals of the live metrics */
+static int live = 0;
+static char liveName[PATH_MAX];
+static double liveInterval = LIVE_INTERVAL;
+static int liveStarted = 0;
+static int liveStop = 0;
+static pthread_t liveThread;
+static pthread_cond_t liveCond = PTHREAD_COND_INITIALIZER;
+static double startTime;
+static double progressTime;	/* when anything was last counted */
+static double totalPhaseSeconds[METRICS_N_PHASES];
+				/* of the records already emitted */
+static int nTotals = 0;
+static char totalNames[MAX_COUNTERS][NAME_LENGTH];
+static double totalValues[MAX_COUNTERS];
+static int nGauges = 0;
+static char gaugeNames[MAX_GAUGES][NAME_LENGTH];
+static double gaugeValues[MAX_GAUGES];
+static int nKinds = 0;
+static char kindNames[MAX_KINDS][NAME_LENGTH];
+static double kindCounts[MAX_KINDS];
+
+#ifdef METRICS_PROFILE
+/* a phase or mark shown to the profiler; these may overlap the ranges
+   of METRICS_RANGE_BEGIN, so are kept as ranges that need not nest */
+typedef struct ProfileSpan
+{
+  int open;
+#if defined(PROFILE_NVTX)
+  nvtxRangeId_t id;
+#elif defined(PROFILE_ITT)
+  __itt_id id;
+  unsigned long long n;		/* spans so far, to make each id unique */
+#endif
+} ProfileSpan;
+
+static __thread int profilePhase = METRICS_OTHER;
+static __thread ProfileSpan phaseSpan;
+static __thread ProfileSpan markSpan;
+
+static void SpanOpen (ProfileSpan *s, const char *name);
+static void SpanClose (ProfileSpan *s);
+#if defined(PROFILE_ITT)
+static __itt_domain *ProfileDomain (void);
+#endif
+#endif
+
+static MetricsRecord *Record (int create);
+static void CreateRecordKey (void);
+static void FreeRecord (void *r);
+static long CurrentRss (void);
+static void OpenFile (void);
+static int FindName (char names[][NAME_LENGTH], double *values, int *pN,
+		     int max, char *name);
+static void *LiveThreadMain (void *arg);
+static void WriteLive (int up);
+
+void
+MetricsInit (char *tool)
+{
+  char *s;
+  double v;
+
+  enabled = getenv("ALIGNTK_METRICS") != NULL &&
+    getenv("ALIGNTK_METRICS")[0] != '\0';
+  s = getenv("ALIGNTK_METRICS_LIVE");
+  live = s != NULL && s[0] != '\0';
+  if (!enabled && !live)
+    return;
+  strncpy(toolName, tool, NAME_LENGTH-1);
+  toolName[NAME_LENGTH-1] = '\0';
+  owner = pthread_self();
+  mainRecord.name[0] = '\0';
+  mainRecord.start = MetricsTime();
+  mainRecord.phase = METRICS_OTHER;
+  mainRecord.phaseStart = mainRecord.start;
+  mainRecord.peakRss = CurrentRss();
+  if (live)
+    {
+      strncpy(liveName, s, PATH_MAX-1);
+      liveName[PATH_MAX-1] = '\0';
+      s = getenv("ALIGNTK_METRICS_INTERVAL");
+      if (s != NULL && sscanf(s, "%lf", &v) == 1 && v >= 0.1)
+	liveInterval = v;
+      startTime = mainRecord.start;
+      progressTime = mainRecord.start;
+    }
+}
+
+void
+MetricsSetProcess (int process)
+{
+  if (!enabled && !live)
+    return;
+  pthread_mutex_lock(&lock);
+  processNumber = process;
+  /* the thread is only started now, as libpar forks its local
+     workers before their process numbers are known */
+  if (live && !liveStarted)
+    {
+      if (pthread_create(&liveThread, NULL, LiveThreadMain, NULL) == 0)
+	liveStarted = 1;
+      else
+	{
+	  fprintf(stderr, "Could not start live metrics thread; "
+		  "live metrics disabled\n");
+	  live = 0;
+	}
+    }
+  pthread_mutex_unlock(&lock);
+}
+
+int
+MetricsEnabled (void)
+{
+  return(enabled || live);
+}
+
+double
+MetricsTime (void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 0.000001 * tv.tv_usec);
+}
+
+int
+MetricsPhase (int phase)
+{
+  int prev;
+  double t;
+  long rss;
+  MetricsRecord *r;
+
+#ifdef METRICS_PROFILE
+  SpanClose(&phaseSpan);
+  SpanOpen(&phaseSpan, phaseNames[phase]);
+  prev = profilePhase;
+  profilePhase = phase;
+  if (!enabled && !live)
+    return(prev);
+#else
+  if (!enabled && !live)
+    return(METRICS_OTHER);
+#endif
+  r = Record(1);
+  if (r == NULL)
+    return(METRICS_OTHER);
+  t = MetricsTime();
+  rss = CurrentRss();
+  pthread_mutex_lock(&lock);
+  prev = r->phase;
+  r->phaseSeconds[prev] += t - r->phaseStart;
+  r->phaseStart = t;
+  r->phase = phase;
+  if (rss > r->peakRss)
+    r->peakRss = rss;
+  pthread_mutex_unlock(&lock);
+  return(prev);
+}
+
+void
+MetricsCount (char *name, double n)
+{
+  int i;
+  MetricsRecord *r;
+
+  if (!enabled && !live)
+    return;
+  r = Record(0);
+  pthread_mutex_lock(&lock);
+  i = FindName(r->counterNames, r->counterValues, &r->nCounters,
+	       MAX_COUNTERS, name);
+  if (i >= 0)
+    r->counterValues[i] += n;
+  if (live)
+    {
+      i = FindName(totalNames, totalValues, &nTotals, MAX_COUNTERS, name);
+      if (i >= 0)
+	totalValues[i] += n;
+      progressTime = MetricsTime();
+    }
+  pthread_mutex_unlock(&lock);
+}
+
+void
+MetricsGauge (char *name, double value)
+{
+  int i;
+
+  if (!live)
+    return;
+  pthread_mutex_lock(&lock);
+  i = FindName(gaugeNames, gaugeValues, &nGauges, MAX_GAUGES, name);
+  if (i >= 0)
+    gaugeValues[i] = value;
+  pthread_mutex_unlock(&lock);
+}
+
+void
+MetricsName (char *name)
+{
+  MetricsRecord *r;
+
+  if (!enabled && !live)
+    return;
+  if ((r = Record(1)) == NULL)
+    return;
+  pthread_mutex_lock(&lock);
+  strncpy(r->name, name, PATH_MAX-1);
+  r->name[PATH_MAX-1] = '\0';
+  pthread_mutex_unlock(&lock);
+}
+
+void
+MetricsEmit (char *kind, long index)
+{
+  int i;
+  double t;
+  long rss;
+  struct rusage ru;
+  char *c;
+  MetricsRecord *r;
+
+  if (!enabled && !live)
+    return;
+  if ((r = Record(1)) == NULL)
+    return;
+  t = MetricsTime();
+  rss = CurrentRss();
+  getrusage(RUSAGE_SELF, &ru);
+  pthread_mutex_lock(&lock);
+  r->phaseSeconds[r->phase] += t - r->phaseStart;
+  r->phaseStart = t;
+  if (rss > r->peakRss)
+    r->peakRss = rss;
+  if (live)
+    {
+      i = FindName(kindNames, kindCounts, &nKinds, MAX_KINDS, kind);
+      if (i >= 0)
+	kindCounts[i] += 1.0;
+      for (i = 0; i < METRICS_N_PHASES; ++i)
+	totalPhaseSeconds[i] += r->phaseSeconds[i];
+      progressTime = t;
+    }
+  if (enabled)
+    OpenFile();
+  if (enabled && metricsFile != NULL)
+    {
+      fprintf(metricsFile, "{\"tool\": \"%s\", \"process\": %d, "
+	      "\"kind\": \"%s\", \"index\": %ld, \"name\": \"",
+	      toolName, processNumber, kind, index);
+      for (c = r->name; *c != '\0'; ++c)
+	if (*c == '"' || *c == '\\')
+	  fprintf(metricsFile, "\\%c", *c);
+	else if ((unsigned char) *c >= ' ')
+	  fputc(*c, metricsFile);
+      fprintf(metricsFile, "\", \"time\": %.6f, \"seconds\": %.6f",
+	      t, t - r->start);
+      for (i = 0; i < METRICS_N_PHASES; ++i)
+	fprintf(metricsFile, ", \"%s_seconds\": %.6f",
+		phaseNames[i], r->phaseSeconds[i]);
+      fprintf(metricsFile, ", \"counters\": {");
+      for (i = 0; i < r->nCounters; ++i)
+	fprintf(metricsFile, "%s\"%s\": %.17g", i > 0 ? ", " : "",
+		r->counterNames[i], r->counterValues[i]);
+      fprintf(metricsFile, "}, \"rss_kb\": %ld, \"peak_rss_kb\": %ld, "
+	      "\"max_rss_kb\": %ld}\n",
+	      rss, r->peakRss, ru.ru_maxrss);
+      fflush(metricsFile);
+    }
+
+  r->name[0] = '\0';
+  r->start = t;
+  for (i = 0; i < METRICS_N_PHASES; ++i)
+    r->phaseSeconds[i] = 0.0;
+  r->nCounters = 0;
+  r->peakRss = rss;
+  pthread_mutex_unlock(&lock);
+}
+
+void
+MetricsClose (void)
+{
+  if (!enabled && !live)
+    return;
+  MetricsEmit("exit", 0);
+  pthread_mutex_lock(&lock);
+  if (metricsFile != NULL)
+    fclose(metricsFile);
+  metricsFile = NULL;
+  enabled = 0;
+  liveStop = 1;
+  pthread_cond_signal(&liveCond);
+  pthread_mutex_unlock(&lock);
+  if (liveStarted)
+    {
+      pthread_join(liveThread, NULL);
+      liveStarted = 0;
+    }
+  if (live)
+    WriteLive(0);
+  live = 0;
+}
+
+#ifdef METRICS_PROFILE
+void
+MetricsRangeBegin (const char *name)
+{
+#if defined(PROFILE_NVTX)
+  nvtxRangePushA(name);
+#elif defined(PROFILE_ITT)
+  __itt_task_begin(ProfileDomain(), __itt_null, __itt_null,
+		   __itt_string_handle_create(name));
+#else
+  DTRACE_PROBE1(aligntk, range_begin, name);
+#endif
+}
+
+void
+MetricsRangeEnd (void)
+{
+#if defined(PROFILE_NVTX)
+  nvtxRangePop();
+#elif defined(PROFILE_ITT)
+  __itt_task_end(ProfileDomain());
+#else
+  DTRACE_PROBE(aligntk, range_end);
+#endif
+}
+
+void
+MetricsMark (const char *name)
+{
+  SpanClose(&markSpan);
+  if (name != NULL)
+    SpanOpen(&markSpan, name);
+}
+
+static void
+SpanOpen (ProfileSpan *s, const char *name)
+{
+#if defined(PROFILE_NVTX)
+  s->id = nvtxRangeStartA(name);
+#elif defined(PROFILE_ITT)
+  s->id = __itt_id_make(s, ++s->n);
+  __itt_id_create(ProfileDomain(), s->id);
+  __itt_task_begin_overlapped(ProfileDomain(), s->id, __itt_null,
+			      __itt_string_handle_create(name));
+#else
+  DTRACE_PROBE2(aligntk, span_begin, s, name);
+#endif
+  s->open = 1;
+}
+
+static void
+SpanClose (ProfileSpan *s)
+{
+  if (!s->open)
+    return;
+#if defined(PROFILE_NVTX)
+  nvtxRangeEnd(s->id);
+#elif defined(PROFILE_ITT)
+  __itt_task_end_overlapped(ProfileDomain(), s->id);
+  __itt_id_destroy(ProfileDomain(), s->id);
+#else
+  DTRACE_PROBE1(aligntk, span_end, s);
+#endif
+  s->open = 0;
+}
+
+#if defined(PROFILE_ITT)
+/* ProfileDomain returns the ITT domain of the tasks, creating it on
+   first use; __itt_domain_create returns the same domain to threads
+   that race to create it */
+static __itt_domain *
+ProfileDomain (void)
+{
+  static __itt_domain *domain = NULL;
+
+  if (domain == NULL)
+    domain = __itt_domain_create("aligntk");
+  return(domain);
+}
+#endif
+#endif
+
+/* Record returns the record of the calling thread: the process's if
+   the thread owns it or has none of its own, unless create is set, in
+   which case a thread that does not own the process's record is given
+   one, starting now in phase METRICS_OTHER; NULL is returned if that
+   cannot be allocated.  Counting threads that never switch phase, such
+   as the helpers of a task, so add to the process's record. */
+static MetricsRecord *
+Record (int create)
+{
+  MetricsRecord *r;
+
+  if (threadRecord != NULL)
+    return(threadRecord);
+  if (!create || pthread_equal(pthread_self(), owner))
+    return(&mainRecord);
+  pthread_once(&recordKeyOnce, CreateRecordKey);
+  r = (MetricsRecord *) calloc(1, sizeof(MetricsRecord));
+  if (r == NULL)
+    return(NULL);
+  r->start = MetricsTime();
+  r->phase = METRICS_OTHER;
+  r->phaseStart = r->start;
+  r->peakRss = CurrentRss();
+  /* the key frees the record when the thread exits */
+  pthread_setspecific(recordKey, r);
+  threadRecord = r;
+  return(r);
+}
+
+static void
+CreateRecordKey (void)
+{
+  pthread_key_create(&recordKey, FreeRecord);
+}
+
+static void
+FreeRecord (void *r)
+{
+  free(r);
+}
+
+/* CurrentRss returns the resident set size of the process in KB */
+static long
+CurrentRss (void)
+{
+  FILE *f;
+  long pages, resident;
+
+  f = fopen("/proc/self/statm", "r");
+  if (f == NULL)
+    return(0);
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return(resident * (sysconf(_SC_PAGESIZE) / 1024));
+}
+
+/* OpenFile opens the metrics file on the first record, once the
+   process number is likely to be known; lock must be held */
+static void
+OpenFile (void)
+{
+  char *name;
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  if (metricsFile != NULL)
+    return;
+  name = getenv("ALIGNTK_METRICS");
+  if (stat(name, &sb) == 0 && S_ISDIR(sb.st_mode))
+    {
+      snprintf(fn, PATH_MAX, "%s/%s.%d.jsonl", name, toolName,
+	       processNumber);
+      metricsFile = fopen(fn, "w");
+    }
+  else
+    {
+      strncpy(fn, name, PATH_MAX-1);
+      fn[PATH_MAX-1] = '\0';
+      metricsFile = fopen(fn, "a");
+    }
+  if (metricsFile == NULL)
+    {
+      fprintf(stderr, "Could not open metrics file %s; metrics disabled\n",
+	      fn);
+      enabled = 0;
+    }
+}
+
+/* FindName returns the index of name among the *pN names, adding it,
+   with a value of 0, if there is room, or -1 if there is not; lock
+   must be held */
+static int
+FindName (char names[][NAME_LENGTH], double *values, int *pN, int max,
+	  char *name)
+{
+  int i;
+
+  for (i = 0; i < *pN; ++i)
+    if (strcmp(names[i], name) == 0)
+      return(i);
+  if (*pN >= max)
+    return(-1);
+  strncpy(names[i], name, NAME_LENGTH-1);
+  names[i][NAME_LENGTH-1] = '\0';
+  values[i] = 0.0;
+  ++*pN;
+  return(i);
+}
+
+/* LiveThreadMain rewrites the live metrics every liveInterval seconds
+   until MetricsClose stops it */
+static void *
+LiveThreadMain (void *arg)
+{
+  struct timespec deadline;
+  double t;
+
+  pthread_mutex_lock(&lock);
+  while (!liveStop)
+    {
+      t = MetricsTime() + liveInterval;
+      deadline.tv_sec = (time_t) t;
+      deadline.tv_nsec = (long) ((t - deadline.tv_sec) * 1.0e9);
+      while (!liveStop &&
+	     pthread_cond_timedwait(&liveCond, &lock, &deadline) != ETIMEDOUT)
+	;
+      if (liveStop)
+	break;
+      pthread_mutex_unlock(&lock);
+      WriteLive(1);
+      pthread_mutex_lock(&lock);
+    }
+  pthread_mutex_unlock(&lock);
+  return(NULL);
+}
+
+/* WriteLive replaces the live metrics file with the current totals;
+   the values are copied under the lock and written without it, so
+   that a slow file system does not hold up the counting threads */
+static void
+WriteLive (int up)
+{
+  int i;
+  int process;
+  int nt, ng, nk;
+  char names[MAX_COUNTERS + MAX_GAUGES + MAX_KINDS][NAME_LENGTH];
+  double values[MAX_COUNTERS + MAX_GAUGES + MAX_KINDS];
+  double phases[METRICS_N_PHASES];
+  double t, progress;
+  long rss;
+  long long rchar, wchar;
+  struct rusage ru;
+  struct stat sb;
+  char fn[PATH_MAX+NAME_LENGTH+32], tmp[PATH_MAX+NAME_LENGTH+64];
+  char line[256];
+  char labels[NAME_LENGTH + 64];
+  char *c;
+  FILE *f;
+
+  t = MetricsTime();
+  rss = CurrentRss();
+  getrusage(RUSAGE_SELF, &ru);
+  rchar = -1;
+  wchar = -1;
+  if ((f = fopen("/proc/self/io", "r")) != NULL)
+    {
+      while (fgets(line, sizeof(line), f) != NULL)
+	if (sscanf(line, "rchar: %lld", &rchar) != 1)
+	  sscanf(line, "wchar: %lld", &wchar);
+      fclose(f);
+    }
+
+  pthread_mutex_lock(&lock);
+  process = processNumber;
+  progress = progressTime;
+  for (i = 0; i < METRICS_N_PHASES; ++i)
+    phases[i] = totalPhaseSeconds[i] + mainRecord.phaseSeconds[i];
+  phases[mainRecord.phase] += t - mainRecord.phaseStart;
+  nt = nTotals;
+  ng = nGauges;
+  nk = nKinds;
+  for (i = 0; i < nt; ++i)
+    {
+      strcpy(names[i], totalNames[i]);
+      values[i] = totalValues[i];
+    }
+  for (i = 0; i < ng; ++i)
+    {
+      strcpy(names[nt+i], gaugeNames[i]);
+      values[nt+i] = gaugeValues[i];
+    }
+  for (i = 0; i < nk; ++i)
+    {
+      strcpy(names[nt+ng+i], kindNames[i]);
+      values[nt+ng+i] = kindCounts[i];
+    }
+  pthread_mutex_unlock(&lock);
+
+  if (stat(liveName, &sb) == 0 && S_ISDIR(sb.st_mode))
+    sprintf(fn, "%s/%s.%d.prom", liveName, toolName, process);
+  else if (process <= 0)
+    {
+      strncpy(fn, liveName, PATH_MAX-1);
+      fn[PATH_MAX-1] = '\0';
+    }
+  else
+    return;
+  sprintf(tmp, "%s.tmp.%d", fn, (int) getpid());
+  if ((f = fopen(tmp, "w")) == NULL)
+    return;
+
+  /* the names are made to fit Prometheus' [a-zA-Z0-9_] */
+  for (i = 0; i < nt + ng + nk; ++i)
+    for (c = names[i]; *c != '\0'; ++c)
+      if (!isalnum((unsigned char) *c))
+	*c = '_';
+  sprintf(labels, "tool=\"%s\",process=\"%d\"", toolName, process);
+
+  fprintf(f, "# TYPE aligntk_up gauge\n"
+	  "aligntk_up{%s} %d\n", labels, up);
+  fprintf(f, "# TYPE aligntk_start_time_seconds gauge\n"
+	  "aligntk_start_time_seconds{%s} %.3f\n", labels, startTime);
+  fprintf(f, "# TYPE aligntk_update_time_seconds gauge\n"
+	  "aligntk_update_time_seconds{%s} %.3f\n", labels, t);
+  fprintf(f, "# TYPE aligntk_progress_time_seconds gauge\n"
+	  "aligntk_progress_time_seconds{%s} %.3f\n", labels, progress);
+  fprintf(f, "# TYPE aligntk_phase_seconds_total counter\n");
+  for (i = 0; i < METRICS_N_PHASES; ++i)
+    fprintf(f, "aligntk_phase_seconds_total{%s,phase=\"%s\"} %.6f\n",
+	    labels, phaseNames[i], phases[i]);
+  fprintf(f, "# TYPE aligntk_cpu_seconds_total counter\n"
+	  "aligntk_cpu_seconds_total{%s} %.6f\n", labels,
+	  ru.ru_utime.tv_sec + 0.000001 * ru.ru_utime.tv_usec +
+	  ru.ru_stime.tv_sec + 0.000001 * ru.ru_stime.tv_usec);
+  fprintf(f, "# TYPE aligntk_resident_bytes gauge\n"
+	  "aligntk_resident_bytes{%s} %ld\n", labels, 1024 * rss);
+  if (rchar >= 0)
+    fprintf(f, "# TYPE aligntk_read_bytes_total counter\n"
+	    "aligntk_read_bytes_total{%s} %lld\n", labels, rchar);
+  if (wchar >= 0)
+    fprintf(f, "# TYPE aligntk_written_bytes_total counter\n"
+	    "aligntk_written_bytes_total{%s} %lld\n", labels, wchar);
+  if (nk > 0)
+    fprintf(f, "# TYPE aligntk_records_total counter\n");
+  for (i = 0; i < nk; ++i)
+    fprintf(f, "aligntk_records_total{%s,kind=\"%s\"} %.17g\n",
+	    labels, names[nt+ng+i], values[nt+ng+i]);
+  for (i = 0; i < nt; ++i)
+    fprintf(f, "# TYPE aligntk_%s_total counter\n"
+	    "aligntk_%s_total{%s} %.17g\n",
+	    names[i], names[i], labels, values[i]);
+  for (i = 0; i < ng; ++i)
+    fprintf(f, "# TYPE aligntk_%s gauge\n"
+	    "aligntk_%s{%s} %.17g\n",
+	    names[nt+i], names[nt+i], labels, values[nt+i]);
+  if (fclose(f) != 0 || rename(tmp, fn) != 0)
+    unlink(tmp);
+}
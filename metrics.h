@@ -0,0 +1,122 @@
+//
+// metrics.h - lightweight per-phase timing, counters and memory
+//             sampling for register, find_rst, align, apply_map and
+//             libpar, written as one JSON line per task or step, and
+//             a live Prometheus-style text file of running totals
+//
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the phases that the time of a process is divided among; at any
+   moment exactly one phase is current, and the time until the next
+   switch is charged to it.  The phases, name and counters make up a
+   record; the thread that calls MetricsInit owns the process's record,
+   and any other thread that switches phase, names or emits a record
+   (e.g., a worker thread of libpar performing its own tasks) is given
+   a record of its own, so that the threads' times are not mixed */
+#define METRICS_OTHER		0
+#define METRICS_READ		1
+#define METRICS_PYRAMID		2
+#define METRICS_COMPUTE		3
+#define METRICS_WRITE		4
+#define METRICS_COMMUNICATE	5
+#define METRICS_N_PHASES	6
+
+/* MetricsInit enables the metrics if the environment variable
+   ALIGNTK_METRICS is set, in which case each process writes its
+   records to $ALIGNTK_METRICS/<tool>.<process>.jsonl (or, if
+   ALIGNTK_METRICS does not name a directory, appends them to that
+   file); it may be called before the process number is known, which
+   MetricsSetProcess then supplies.
+
+   If ALIGNTK_METRICS_LIVE is set, each process also keeps running
+   totals of its counters, records and phases, and the gauges set by
+   MetricsGauge, and a thread started by MetricsSetProcess rewrites
+   them every ALIGNTK_METRICS_INTERVAL seconds (10 by default), in the
+   Prometheus text format, to $ALIGNTK_METRICS_LIVE/<tool>.<process>.prom
+   (or, if ALIGNTK_METRICS_LIVE does not name a directory, process 0
+   alone writes that file).  The file is replaced by a rename, so a
+   scraper (e.g. node_exporter's textfile collector) never sees one
+   half written; aligntk_progress_time_seconds, the last time anything
+   was counted, lets a stalled process be told from a slow one.
+
+   When both are disabled every other function returns at once. */
+void MetricsInit (char *tool);
+void MetricsSetProcess (int process);
+int MetricsEnabled (void);
+
+/* MetricsTime returns the wall-clock time in seconds */
+double MetricsTime (void);
+
+/* MetricsPhase makes phase the current phase and returns the one it
+   replaced, so that a piece of code can be timed as a scope with
+     prev = MetricsPhase(METRICS_WRITE);
+     ...
+     MetricsPhase(prev);
+   which nests, each piece being charged only its own time; it acts on
+   the record of the calling thread */
+int MetricsPhase (int phase);
+
+/* MetricsCount adds n to the named counter of the current record;
+   it may be called from any thread, a thread without a record of its
+   own (such as a helper thread of a task) adding to the process's,
+   and up to 32 differently-named counters are kept */
+void MetricsCount (char *name, double n);
+
+/* MetricsGauge sets the named gauge of the live metrics, e.g. the
+   current level or energy, to value; it is not part of the records */
+void MetricsGauge (char *name, double value);
+
+/* MetricsName sets the name of the calling thread's record, e.g. the
+   pair being registered */
+void MetricsName (char *name);
+
+/* MetricsEmit writes the calling thread's record, labeled with kind
+   and index, giving the seconds since its previous record and their
+   division among the phases, the counters, and the current and peak
+   resident set size, and starts a new record */
+void MetricsEmit (char *kind, long index);
+
+/* MetricsClose writes a last record, of kind "exit", covering the
+   time since the previous one and closes the file; the live metrics
+   are written a last time, with aligntk_up set to 0 */
+void MetricsClose (void);
+
+/* built with one of PROFILE_NVTX, PROFILE_ITT or PROFILE_SDT defined
+   (see PROFILE_FLAGS in the Makefile), the phases of MetricsPhase, and
+   the ranges and marks below, are also shown to a profiler, as NVTX
+   ranges for Nsight Systems, ITT tasks for VTune, or USDT probes for
+   perf and bpftrace, whether or not the metrics are enabled; otherwise
+   these macros compile to nothing.
+
+   METRICS_RANGE_BEGIN and METRICS_RANGE_END bracket a named piece of
+   work, such as a batch of moves or a correlation pass; ranges nest,
+   and each must end on the thread it began on.  METRICS_MARK begins a
+   named mark, ending the thread's previous one, and
+   METRICS_MARK(NULL) just ends it; marks do not nest, so one placed at
+   the top of a loop, such as that over the levels, needs no end on
+   each of the ways out of the loop.  The names should be constant
+   strings. */
+#if defined(PROFILE_NVTX) || defined(PROFILE_ITT) || defined(PROFILE_SDT)
+#define METRICS_PROFILE	1
+void MetricsRangeBegin (const char *name);
+void MetricsRangeEnd (void);
+void MetricsMark (const char *name);
+#define METRICS_RANGE_BEGIN(name)	MetricsRangeBegin(name)
+#define METRICS_RANGE_END()		MetricsRangeEnd()
+#define METRICS_MARK(name)		MetricsMark(name)
+#else
+#define METRICS_RANGE_BEGIN(name)	((void) 0)
+#define METRICS_RANGE_END()		((void) 0)
+#define METRICS_MARK(name)		((void) 0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
@@ -48,6 +48,7 @@
 #include <sys/resource.h>
 
 #include "imio.h"
+#include "prefetch.h"
 
 #define LINE_LENGTH	256
 
@@ -67,11 +68,27 @@ int maxZ = -1;
 int xzImages = 1;
 int memoryLimit = 1024;
 int every = 1;
+int outOfCore = 0;
+char scratchName[PATH_MAX];
+int volume = 0;		/* the input is a chunked volume (see imio.h) */
+int reduction = 1;		/* the images are read reduced by this
+				   factor, and -x and -y are in reduced
+				   pixels */
+int readAhead = 0;		/* number of images (or bands of them) to
+				   read in the background ahead of the
+				   one being resliced */
 
 FILE *logFile = 0;
 
 void Error (char *fmt, ...);
 void Log (char *fmt, ...);
+void ResliceVolume (int chunkSize, char *outputNameFormat);
+void Reslice (char **images, int nVirtualImages, int nImagesPerProcess,
+	      int width, int height, char *outputNameFormat);
+void BandRows (int u0, int u1, int *pMinY, int *pMaxY);
+void PrefetchBands (char **images, int nVirtualImages,
+		    int nImagesPerProcess, int nUnits, int unitsPerBand,
+		    int u0, int i);
 
 int
 main (int argc, char **argv)
@@ -122,6 +139,8 @@ main (int argc, char **argv)
   int nVirtualImages;
   int nImages;
   char **images;
+  int depth, chunkSize;
+  int rowStep, nRows;
   
   /* DECLS */
 
@@ -155,6 +174,7 @@ main (int argc, char **argv)
       inputName[0] = '\0';
       outputName[0] = '\0';
       format[0] = '\0';
+      scratchName[0] = '\0';
       
       for (i = 0; i < argc; ++i)
 	Log("ARGV[%d] = %s\n", i, argv[i]);
@@ -244,6 +264,39 @@ main (int argc, char **argv)
 		break;
 	      }
 	  }
+	else if (strcmp(argv[i], "-out_of_core") == 0)
+	  outOfCore = 1;
+	else if (strcmp(argv[i], "-scratch") == 0)
+	  {
+	    if (++i == argc)
+	      {
+		error = 1;
+		break;
+	      }
+	    strcpy(scratchName, argv[i]);
+	  }
+	else if (strcmp(argv[i], "-volume") == 0)
+	  volume = 1;
+	else if (strcmp(argv[i], "-reduction") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &reduction) != 1 ||
+		reduction < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-read_ahead") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &readAhead) != 1 ||
+		readAhead < 0)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
 	else error = 1;
 
       if (error)
@@ -258,6 +311,11 @@ main (int argc, char **argv)
 	  fprintf(stderr, "              [-format zFormat]\n");
 	  fprintf(stderr, "              [-memory memory_limit_in_MB]\n");
 	  fprintf(stderr, "              [-every multiple]\n");
+	  fprintf(stderr, "              [-out_of_core]\n");
+	  fprintf(stderr, "              [-scratch scratch_file]\n");
+	  fprintf(stderr, "              [-volume]\n");
+	  fprintf(stderr, "              [-reduction reduction_factor]\n");
+	  fprintf(stderr, "              [-read_ahead number_of_images]\n");
 	  exit(1);
 	}
       
@@ -269,13 +327,33 @@ main (int argc, char **argv)
       */
 
       /* check that at least minimal parameters were supplied */
-      if (imageListName[0] == '\0' ||
+      if ((imageListName[0] == '\0' && !volume) ||
 	  inputName[0] == '\0' ||
 	  outputName[0] == '\0')
 	Error("-image_list, -input, and -output must be specified\n");
+      if (volume && format[0] != '\0')
+	Error("-format cannot be used with -volume\n");
+      if (volume && reduction > 1)
+	Error("-reduction cannot be used with -volume\n");
+      if (volume && readAhead > 0)
+	Error("-read_ahead cannot be used with -volume\n");
+      if (scratchName[0] == '\0')
+	sprintf(scratchName, "%sortho.scratch", outputName);
     }
   
-  if (p == 0)
+  chunkSize = 0;
+  if (p == 0 && volume)
+    {
+      /* with -volume, the input is the volume directory and its
+	 z slices stand in for the images */
+      if (!ReadVolumeSize(inputName, &width, &height, &depth, &chunkSize,
+			  msg))
+	Error("Could not read volume %s:\n%s\n", inputName, msg);
+      nImages = depth;
+      imageNamesSize = 0;
+      imageNames = NULL;
+    }
+  else if (p == 0)
     {
       /* read the images file */
       f = fopen(imageListName, "r");
@@ -321,13 +399,13 @@ main (int argc, char **argv)
 	  if (nImages == 0)
 	    {
 	      sprintf(fn, "%s%s.tif", inputName, imageName);
-	      if (!ReadImage(fn, &img, &w, &h,
-			     -1, -1, -1, -1,
-			     msg))
-		Error("Could not read image %s:\n%s\n",
+	      if (!ReadImageSize(fn, &w, &h, msg))
+		Error("Could not read size of image %s:\n%s\n",
 		      fn, msg);
-	      width = w;
-	      height = h;
+	      width = w / reduction;
+	      height = h / reduction;
+	      if (width == 0 || height == 0)
+		Error("Image %s is too small to reduce by %d\n", fn, reduction);
 	    }
 
 	  ++nImages;
@@ -336,7 +414,10 @@ main (int argc, char **argv)
 
       imageNamesSize = imageNamesPos;
       imageNames = (char *) realloc(imageNames, imageNamesSize);
+    }
 
+  if (p == 0)
+    {
       if (minX < 0)
 	{
 	  minX = 0;
@@ -396,6 +477,12 @@ main (int argc, char **argv)
       MPI_Bcast(&xzImages, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&memoryLimit, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&every, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&outOfCore, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(scratchName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&volume, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&reduction, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&readAhead, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&chunkSize, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&width, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&height, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&nImages, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
@@ -428,25 +515,38 @@ main (int argc, char **argv)
   else
     digits = 1;
   sprintf(outputNameFormat, "%%s%%0.%dd.tif", digits);
+
+  if (volume)
+    {
+      ResliceVolume(chunkSize, outputNameFormat);
+
+      Log("FINALIZING\n");
+      MPI_Finalize();
+      fclose(logFile);
+      return(0);
+    }
+
+  /* only the rows of the x and y range that the output planes use are
+     read: for xz images, every every-th row; with -read_ahead, that
+     many more images are held while they are read in the background */
+  rowStep = xzImages ? every : 1;
+  nRows = (maxY - minY) / rowStep + 1;
   outputImageSize = ((size_t) (maxZ - minZ + 1)) * (maxW - minW + 1);
   sizePerImage = ((size_t) (maxW - minW + 1)) * nImagesPerProcess;
   blockSize = np * sizePerImage;
   maxBlocks = (memoryLimit * 1024LL * 1024LL -
-	       ((long long) width) * height - outputImageSize) / blockSize;
+	       (1LL + readAhead) * (maxX - minX + 1) * nRows -
+	       outputImageSize) /
+    blockSize;
   //  nBlocks = ((maxV - minV + 1) + np - 1) / np;
   nBlocks = ((maxV - minV + every) / every + np - 1) / np;
   if (nBlocks > maxBlocks)
     nBlocks = maxBlocks;
   //  nPasses = (maxV - minV + 1 + nBlocks * np - 1) / (nBlocks * np);
-  nPasses = ((maxV - minV + every) / every + nBlocks * np - 1) / (nBlocks * np);
-
-  if (p == 0)
-    Log("Going to make %d passes through the image stack\n",
-	nPasses);
-  buffer = (unsigned char *) malloc(nBlocks * blockSize);
-  if (buffer == NULL)
-    Error("Could not allocate %zd bytes of buffer space.\n",
-	  nBlocks * blockSize);
+  if (nBlocks > 0)
+    nPasses = ((maxV - minV + every) / every + nBlocks * np - 1) / (nBlocks * np);
+  else
+    nPasses = 0;
 
   images = (char **) malloc(nVirtualImages * sizeof(char *));
   memset(images, 0, nVirtualImages * sizeof(char *));
@@ -465,11 +565,37 @@ main (int argc, char **argv)
       imageNamesPos += strlen(&imageNames[imageNamesPos]) + 1;
     }
 
+  /* when the stack would have to be read more than once, reslice it
+     out of core instead, which reads each image just once */
+  if (outOfCore || nPasses != 1)
+    {
+      Reslice(images, nVirtualImages, nImagesPerProcess,
+	      width, height, outputNameFormat);
+
+      Log("FINALIZING\n");
+      MPI_Finalize();
+      fclose(logFile);
+      return(0);
+    }
+
+  if (p == 0)
+    Log("Going to make %d passes through the image stack\n",
+	nPasses);
+  buffer = (unsigned char *) malloc(nBlocks * blockSize);
+  if (buffer == NULL)
+    Error("Could not allocate %zd bytes of buffer space.\n",
+	  nBlocks * blockSize);
+
   sendCounts = (int *) malloc(np * sizeof(int));
   sendOffsets = (int *) malloc(np * sizeof(int));
   receiveCounts = (int *) malloc(np * sizeof(int));
   receiveOffsets = (int *) malloc(np * sizeof(int));
 
+  /* read the next images while this one is cut up */
+  if (readAhead > 0 &&
+      !StartPrefetching(1, ((size_t) readAhead) * (maxX - minX + 1) * nRows))
+    Error("Could not start read-ahead thread.\n");
+
   for (pass = 0; pass < nPasses; ++pass)
     {
       for (i = 0; i < nImagesPerProcess; ++i)
@@ -477,22 +603,35 @@ main (int argc, char **argv)
 	  iv = p * nImagesPerProcess + i;
 	  if (iv >= nVirtualImages)
 	    break;
+	  for (j = iv + 1; readAhead > 0 && j <= iv + readAhead &&
+		 j < (p + 1) * nImagesPerProcess && j < nVirtualImages; ++j)
+	    if (images[j] != NULL)
+	      {
+		sprintf(fn, "%s%s.tif", inputName, images[j]);
+		PrefetchImageRows(fn, reduction, rowStep,
+				  minX, maxX, minY, maxY);
+	      }
 	  if (images[iv] != NULL)
 	    {
 	      sprintf(fn, "%s%s.tif", inputName, images[iv]);
-	      if (!ReadImage(fn, &img, &w, &h,
-			     -1, -1, -1, -1,
-			     msg))
-		Error("Could not read image %s:\n%s\n",
+	      if (!ReadImageSize(fn, &w, &h, msg))
+		Error("Could not read size of image %s:\n%s\n",
 		      fn, msg);
-	      if (w != width || h != height)
+	      if (w / reduction != width || h / reduction != height)
 		Error("Size of image %s (%dx%d) is inconsistent with first image (%dx%d).\n",
-		      fn, w, h, width, height);
+		      fn, w / reduction, h / reduction, width, height);
+	      if (!TakeImageRows(fn, reduction, rowStep, &img, &w, &h,
+				 minX, maxX, minY, maxY,
+				 msg))
+		Error("Could not read image %s:\n%s\n",
+		      fn, msg);
 	    }
 	  else
 	    {
-	      img = (unsigned char *) malloc(width * height);
-	      memset(img, 0, width * height);
+	      w = maxX - minX + 1;
+	      h = nRows;
+	      img = (unsigned char *) malloc(((size_t) w) * h);
+	      memset(img, 0, ((size_t) w) * h);
 	    }
 
 	  /* save the part destined for output */
@@ -506,7 +645,7 @@ main (int argc, char **argv)
 		    memcpy(&buffer[(((size_t) (block * np + target)) *
 				    nImagesPerProcess + i) *
 				   (maxX - minX + 1)],
-			   &img[y*w + minX],
+			   &img[((size_t) ((y - minY) / every)) * w],
 			   maxX - minX + 1);
 		  else
 		    memset(&buffer[(((size_t) (block * np + target)) *
@@ -524,8 +663,8 @@ main (int argc, char **argv)
 		      dst = &buffer[(((size_t) (block * np + target)) *
 				     nImagesPerProcess + i) *
 				    (maxY - minY + 1)];
-		      for (y = minY; y <= maxY; ++y)
-			*dst++ = img[y*w+x];
+		      for (y = 0; y < h; ++y)
+			*dst++ = img[((size_t) y) * w + x - minX];
 		    }
 		  else
 		    memset(&buffer[(((size_t) (block * np + target)) *
@@ -603,6 +742,510 @@ main (int argc, char **argv)
   return(0);
 }
 
+/* Reslice makes the output planes out of core.  Each process is given
+   a contiguous range of the output planes, and reads each of its own
+   input images just once, in bands of the rows its planes use.  The
+   parts of each band are exchanged with MPI_Alltoallv so that every
+   process receives the data for its own planes, which it gathers over
+   a group of input images and writes into a scratch file shared
+   through MPI-IO.  Once the whole stack has been read, each process
+   reads back its planes and writes them out.  Within each plane, the
+   scratch file holds the data band by band, each band being a
+   (z x band width) array. */
+void
+Reslice (char **images, int nVirtualImages, int nImagesPerProcess,
+	 int width, int height, char *outputNameFormat)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  int i, i0, i1;
+  int j, j0, j1;
+  int r, s, t;
+  int iv, zs;
+  int count;
+  int w, h;
+  int nPlanes, nUnits;
+  int nW, nXin, nZ;
+  int *planeFirst;
+  int maxMyPlanes;
+  int unitsPerBand, groupSize;
+  int u0, u1;
+  int ya, yb;
+  int wb;
+  int nMy;
+  size_t budget;
+  size_t readPerUnit, sendPerUnit, recvPerUnit;
+  size_t roundSize, groupPerImage;
+  size_t n, planeSize, pos;
+  unsigned char *img, *src, *zeros;
+  unsigned char *sendBuf, *recvBuf, *groupBuf;
+  unsigned char *plane;
+  int *sendCounts, *sendOffsets;
+  int *receiveCounts, *receiveOffsets;
+  MPI_File fh;
+  MPI_Offset bandBase, off;
+  MPI_Status status;
+
+  nPlanes = ((xzImages ? maxY - minY : maxX - minX) + every) / every;
+  nW = xzImages ? (maxX - minX + 1) : (maxY - minY + 1);
+  nXin = maxX - minX + 1;
+  nZ = nVirtualImages;
+  planeSize = ((size_t) nZ) * nW;
+
+  /* each process gets a contiguous range of the output planes */
+  planeFirst = (int *) malloc((np + 1) * sizeof(int));
+  for (r = 0; r <= np; ++r)
+    planeFirst[r] = (int) (((long long) r * nPlanes) / np);
+  maxMyPlanes = (nPlanes + np - 1) / np;
+
+  /* the bands are made up of units -- output planes for xz images,
+     and rows of the input (which become columns of every output
+     plane) for yz images; size the bands and the groups of images
+     gathered before each write to fit within the memory limit */
+  if (xzImages)
+    {
+      nUnits = nPlanes;
+      readPerUnit = nXin;
+      sendPerUnit = nW;
+      recvPerUnit = ((size_t) np) * nW;
+    }
+  else
+    {
+      nUnits = maxY - minY + 1;
+      readPerUnit = nXin;
+      sendPerUnit = nPlanes;
+      recvPerUnit = ((size_t) np) * maxMyPlanes;
+    }
+  budget = memoryLimit * 1024LL * 1024LL;
+  unitsPerBand = (budget / 2) / ((1 + readAhead) * readPerUnit +
+				 sendPerUnit + 2 * recvPerUnit);
+  if (unitsPerBand < 1)
+    unitsPerBand = 1;
+  if (unitsPerBand > nUnits)
+    unitsPerBand = nUnits;
+  if (xzImages && unitsPerBand > maxMyPlanes)
+    unitsPerBand = maxMyPlanes;
+  roundSize = unitsPerBand * ((1 + readAhead) * readPerUnit +
+			      sendPerUnit + recvPerUnit);
+  groupPerImage = unitsPerBand * recvPerUnit;
+  if (roundSize < budget)
+    groupSize = (budget - roundSize) / groupPerImage;
+  else
+    groupSize = 1;
+  if (groupSize < 1)
+    groupSize = 1;
+  if (groupSize > nImagesPerProcess)
+    groupSize = nImagesPerProcess;
+  if (p == 0)
+    Log("Going to reslice out of core through %s in bands of %d %s, gathering %d images per write\n",
+	scratchName, unitsPerBand, xzImages ? "planes" : "rows", groupSize);
+
+  /* read the bands of the next images while this one is exchanged */
+  if (readAhead > 0 &&
+      !StartPrefetching(1, ((size_t) readAhead) * unitsPerBand * readPerUnit))
+    Error("Could not start read-ahead thread.\n");
+
+  zeros = (unsigned char *) malloc(unitsPerBand * readPerUnit);
+  sendBuf = (unsigned char *) malloc(unitsPerBand * sendPerUnit);
+  recvBuf = (unsigned char *) malloc(unitsPerBand * recvPerUnit);
+  groupBuf = (unsigned char *) malloc(groupSize * groupPerImage);
+  sendCounts = (int *) malloc(np * sizeof(int));
+  sendOffsets = (int *) malloc(np * sizeof(int));
+  receiveCounts = (int *) malloc(np * sizeof(int));
+  receiveOffsets = (int *) malloc(np * sizeof(int));
+  if (zeros == NULL || sendBuf == NULL || recvBuf == NULL ||
+      groupBuf == NULL || sendCounts == NULL || sendOffsets == NULL ||
+      receiveCounts == NULL || receiveOffsets == NULL)
+    Error("Could not allocate reslicing buffers.\n");
+  memset(zeros, 0, unitsPerBand * readPerUnit);
+
+  if (MPI_File_open(MPI_COMM_WORLD, scratchName,
+		    MPI_MODE_CREATE | MPI_MODE_RDWR | MPI_MODE_DELETE_ON_CLOSE,
+		    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    Error("Could not open scratch file %s\n", scratchName);
+
+  for (u0 = 0; u0 < nUnits; u0 += unitsPerBand)
+    {
+      u1 = u0 + unitsPerBand;
+      if (u1 > nUnits)
+	u1 = nUnits;
+
+      /* find the input rows of this band, and the part of the band
+	 that goes into this process's planes */
+      BandRows(u0, u1, &ya, &yb);
+      if (xzImages)
+	{
+	  j0 = planeFirst[p] > u0 ? planeFirst[p] : u0;
+	  j1 = planeFirst[p+1] < u1 ? planeFirst[p+1] : u1;
+	  wb = nW;
+	  bandBase = 0;
+	}
+      else
+	{
+	  j0 = planeFirst[p];
+	  j1 = planeFirst[p+1];
+	  wb = u1 - u0;
+	  bandBase = ((MPI_Offset) nZ) * u0;
+	}
+      nMy = j1 > j0 ? j1 - j0 : 0;
+
+      for (i0 = 0; i0 < nImagesPerProcess; i0 += groupSize)
+	{
+	  i1 = i0 + groupSize;
+	  if (i1 > nImagesPerProcess)
+	    i1 = nImagesPerProcess;
+	  for (i = i0; i < i1; ++i)
+	    {
+	      /* read this band of the image */
+	      iv = p * nImagesPerProcess + i;
+	      if (readAhead > 0)
+		PrefetchBands(images, nVirtualImages, nImagesPerProcess,
+			      nUnits, unitsPerBand, u0, i);
+	      img = NULL;
+	      src = zeros;
+	      if (iv < nVirtualImages && images[iv] != NULL)
+		{
+		  sprintf(fn, "%s%s.tif", inputName, images[iv]);
+		  if (u0 == 0)
+		    {
+		      if (!ReadImageSize(fn, &w, &h, msg))
+			Error("Could not read size of image %s:\n%s\n",
+			      fn, msg);
+		      if (w / reduction != width || h / reduction != height)
+			Error("Size of image %s (%dx%d) is inconsistent with first image (%dx%d).\n",
+			      fn, w / reduction, h / reduction, width, height);
+		    }
+		  if (!TakeImageRows(fn, reduction, xzImages ? every : 1,
+				     &img, &w, &h,
+				     minX, maxX, ya, yb,
+				     msg))
+		    Error("Could not read image %s:\n%s\n",
+			  fn, msg);
+		  src = img;
+		}
+
+	      /* pack the parts for each process's planes */
+	      n = 0;
+	      for (t = 0; t < np; ++t)
+		{
+		  sendOffsets[t] = n;
+		  if (iv < nVirtualImages)
+		    {
+		      if (xzImages)
+			for (j = (planeFirst[t] > u0 ? planeFirst[t] : u0);
+			     j < planeFirst[t+1] && j < u1; ++j)
+			  {
+			    memcpy(&sendBuf[n],
+				   &src[((size_t) (j - u0)) * nXin],
+				   nW);
+			    n += nW;
+			  }
+		      else
+			for (j = planeFirst[t]; j < planeFirst[t+1]; ++j)
+			  for (r = 0; r < wb; ++r)
+			    sendBuf[n++] = src[((size_t) r) * nXin + j * every];
+		    }
+		  sendCounts[t] = n - sendOffsets[t];
+		}
+	      if (img != NULL)
+		free(img);
+
+	      n = 0;
+	      for (s = 0; s < np; ++s)
+		{
+		  receiveOffsets[s] = n;
+		  if (s * nImagesPerProcess + i < nVirtualImages)
+		    n += nMy * wb;
+		  receiveCounts[s] = n - receiveOffsets[s];
+		}
+
+	      if (MPI_Alltoallv(sendBuf, sendCounts, sendOffsets, MPI_UNSIGNED_CHAR,
+				recvBuf, receiveCounts, receiveOffsets, MPI_UNSIGNED_CHAR,
+				MPI_COMM_WORLD) != MPI_SUCCESS)
+		Error("MPI_Alltoallv() failed.\n");
+
+	      /* gather by plane and source, so that the images of each
+		 source that go into one plane are contiguous */
+	      for (s = 0; s < np; ++s)
+		if (receiveCounts[s] > 0)
+		  for (j = 0; j < nMy; ++j)
+		    memcpy(&groupBuf[(((size_t) j * np + s) * groupSize +
+				      (i - i0)) * wb],
+			   &recvBuf[receiveOffsets[s] + ((size_t) j) * wb],
+			   wb);
+	    }
+
+	  /* write out the gathered data */
+	  for (j = 0; j < nMy; ++j)
+	    for (s = 0; s < np; ++s)
+	      {
+		zs = s * nImagesPerProcess + i0;
+		count = (i1 < nVirtualImages - s * nImagesPerProcess ?
+			 i1 : nVirtualImages - s * nImagesPerProcess) - i0;
+		if (count <= 0)
+		  continue;
+		off = ((MPI_Offset) (j0 + j)) * planeSize + bandBase +
+		  ((MPI_Offset) zs) * wb;
+		if (MPI_File_write_at(fh, off,
+				      &groupBuf[((size_t) j * np + s) * groupSize * wb],
+				      count * wb, MPI_UNSIGNED_CHAR,
+				      &status) != MPI_SUCCESS)
+		  Error("Could not write to scratch file %s\n", scratchName);
+	      }
+	}
+    }
+  free(zeros);
+  free(sendBuf);
+  free(recvBuf);
+  free(groupBuf);
+
+  if (MPI_File_sync(fh) != MPI_SUCCESS ||
+      MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_File_sync(fh) != MPI_SUCCESS)
+    Error("Could not synchronize scratch file %s\n", scratchName);
+
+  /* read back and write out this process's planes */
+  plane = (unsigned char *) malloc(planeSize);
+  img = xzImages ? plane : (unsigned char *) malloc(planeSize);
+  if (plane == NULL || img == NULL)
+    Error("Could not allocate output plane.\n");
+  for (j = planeFirst[p]; j < planeFirst[p+1]; ++j)
+    {
+      for (pos = 0; pos < planeSize; pos += n)
+	{
+	  n = planeSize - pos;
+	  if (n > 1024*1024*1024)
+	    n = 1024*1024*1024;
+	  if (MPI_File_read_at(fh, ((MPI_Offset) j) * planeSize + pos,
+			       &plane[pos], n, MPI_UNSIGNED_CHAR,
+			       &status) != MPI_SUCCESS)
+	    Error("Could not read from scratch file %s\n", scratchName);
+	}
+      if (!xzImages)
+	for (u0 = 0; u0 < nUnits; u0 += unitsPerBand)
+	  {
+	    wb = (u0 + unitsPerBand < nUnits ? unitsPerBand : nUnits - u0);
+	    for (zs = 0; zs < nZ; ++zs)
+	      memcpy(&img[((size_t) zs) * nW + u0],
+		     &plane[((size_t) nZ) * u0 + ((size_t) zs) * wb],
+		     wb);
+	  }
+
+      sprintf(fn, outputNameFormat,
+	      outputName,
+	      (xzImages ? minY : minX) + j * every);
+      if (!WriteImage(fn, img,
+		      nW, nZ,
+		      UncompressedImage, msg))
+	Error("Could not write output image %s:\n%s\n", fn, msg);
+    }
+  if (img != plane)
+    free(img);
+  free(plane);
+
+  if (MPI_File_close(&fh) != MPI_SUCCESS)
+    Error("Could not close scratch file %s\n", scratchName);
+  free(planeFirst);
+  free(sendCounts);
+  free(sendOffsets);
+  free(receiveCounts);
+  free(receiveOffsets);
+}
+
+/* BandRows finds the rows of the input that hold the units u0 up to
+   (but not including) u1 of a band of Reslice */
+void
+BandRows (int u0, int u1, int *pMinY, int *pMaxY)
+{
+  if (xzImages)
+    {
+      *pMinY = minY + u0 * every;
+      *pMaxY = minY + (u1 - 1) * every;
+    }
+  else
+    {
+      *pMinY = minY + u0;
+      *pMaxY = minY + u1 - 1;
+    }
+}
+
+/* PrefetchBands asks for the bands that Reslice reads after that of
+   image i in the band starting at unit u0 to be read in the
+   background, readAhead of them, running on into the next band */
+void
+PrefetchBands (char **images, int nVirtualImages,
+	       int nImagesPerProcess, int nUnits, int unitsPerBand,
+	       int u0, int i)
+{
+  char fn[PATH_MAX];
+  int k;
+  int iv;
+  int u1;
+  int ya, yb;
+
+  for (k = 0; k < readAhead; ++k)
+    {
+      if (++i >= nImagesPerProcess)
+	{
+	  i = 0;
+	  u0 += unitsPerBand;
+	  if (u0 >= nUnits)
+	    return;
+	}
+      iv = p * nImagesPerProcess + i;
+      if (iv >= nVirtualImages || images[iv] == NULL)
+	continue;
+      u1 = u0 + unitsPerBand;
+      if (u1 > nUnits)
+	u1 = nUnits;
+      BandRows(u0, u1, &ya, &yb);
+      sprintf(fn, "%s%s.tif", inputName, images[iv]);
+      PrefetchImageRows(fn, reduction, xzImages ? every : 1,
+			minX, maxX, ya, yb);
+    }
+}
+
+/* ResliceVolume makes the output planes from a chunked volume.  The
+   planes that lie within one row of chunks (or one column, for yz
+   output) are made together, by reading down through the chunks of
+   that row from the first slice to the last; each pass through a
+   layer of chunks gives the next chunkSize rows of all of those planes,
+   which are appended through ImageWriters, so only one layer of one
+   row of chunks has to be held in memory.  The rows of chunks are
+   dealt out to the processes in turn. */
+void
+ResliceVolume (int chunkSize, char *outputNameFormat)
+{
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  int c;
+  int u, nUnits;
+  int v, v0, v1;
+  int cw, cw0, cw1;
+  int cz, z0, z1, z;
+  int ww, iw, w0, w1;
+  int j, nMy;
+  int minV, maxV, minW, maxW;
+  size_t chunkBytes;
+  unsigned char *chunk;
+  unsigned char *rows;
+  unsigned char *dst;
+  unsigned char *src;
+  ImageWriter **writers;
+
+  c = chunkSize;
+  if (xzImages)
+    {
+      minV = minY;
+      maxV = maxY;
+      minW = minX;
+      maxW = maxX;
+    }
+  else
+    {
+      minV = minX;
+      maxV = maxX;
+      minW = minY;
+      maxW = maxY;
+    }
+  ww = maxW - minW + 1;
+  nUnits = maxV / c + 1;
+  if (p == 0)
+    Log("Going to reslice volume in chunks of %d, %d rows of chunks\n",
+	c, nUnits - minV / c);
+
+  chunkBytes = ((size_t) c) * c * c;
+  chunk = (unsigned char *) malloc(chunkBytes);
+  rows = (unsigned char *) malloc(((size_t) c) * c * ww);
+  writers = (ImageWriter **) malloc(c * sizeof(ImageWriter *));
+  if (chunk == NULL || rows == NULL || writers == NULL)
+    Error("Could not allocate chunk buffers.\n");
+  cw0 = minW / c;
+  cw1 = maxW / c;
+
+  for (u = minV / c + p; u < nUnits; u += np)
+    {
+      /* open writers for the planes in this row of chunks */
+      v0 = u * c;
+      if (v0 < minV)
+	v0 = minV;
+      v0 = minV + (v0 - minV + every - 1) / every * every;
+      v1 = u * c + c - 1;
+      if (v1 > maxV)
+	v1 = maxV;
+      nMy = 0;
+      for (v = v0; v <= v1; v += every)
+	{
+	  sprintf(fn, outputNameFormat, outputName, v);
+	  writers[nMy] = OpenImageWriter(fn, ww, maxZ - minZ + 1,
+					 UncompressedImage, msg);
+	  if (writers[nMy] == NULL)
+	    Error("Could not open output image %s:\n%s\n", fn, msg);
+	  ++nMy;
+	}
+      if (nMy == 0)
+	continue;
+
+      for (cz = minZ / c; cz <= maxZ / c; ++cz)
+	{
+	  z0 = cz * c;
+	  if (z0 < minZ)
+	    z0 = minZ;
+	  z1 = cz * c + c - 1;
+	  if (z1 > maxZ)
+	    z1 = maxZ;
+	  for (cw = cw0; cw <= cw1; ++cw)
+	    {
+	      if (xzImages)
+		{
+		  if (!ReadVolumeChunk(inputName, cw, u, cz, c, chunk, msg))
+		    Error("Could not read volume chunk:\n%s\n", msg);
+		}
+	      else if (!ReadVolumeChunk(inputName, u, cw, cz, c, chunk, msg))
+		Error("Could not read volume chunk:\n%s\n", msg);
+	      w0 = cw * c;
+	      if (w0 < minW)
+		w0 = minW;
+	      w1 = cw * c + c - 1;
+	      if (w1 > maxW)
+		w1 = maxW;
+
+	      /* rows[plane][z][w] */
+	      for (j = 0, v = v0; j < nMy; ++j, v += every)
+		for (z = z0; z <= z1; ++z)
+		  {
+		    dst = &rows[(((size_t) j) * c + (z - z0)) * ww +
+				(w0 - minW)];
+		    if (xzImages)
+		      memcpy(dst,
+			     &chunk[(((size_t) (z - cz * c)) * c +
+				     (v - u * c)) * c + (w0 - cw * c)],
+			     w1 - w0 + 1);
+		    else
+		      {
+			src = &chunk[(((size_t) (z - cz * c)) * c +
+				      (w0 - cw * c)) * c + (v - u * c)];
+			for (iw = w0; iw <= w1; ++iw, src += c)
+			  *dst++ = *src;
+		      }
+		  }
+	    }
+	  for (j = 0; j < nMy; ++j)
+	    if (!WriteImageRows(writers[j], &rows[((size_t) j) * c * ww],
+				z1 - z0 + 1, msg))
+	      Error("Could not write output image rows:\n%s\n", msg);
+	}
+
+      for (j = 0; j < nMy; ++j)
+	if (!CloseImageWriter(writers[j], msg))
+	  Error("Could not close output image:\n%s\n", msg);
+    }
+
+  free(writers);
+  free(rows);
+  free(chunk);
+}
+
 void Error (char *fmt, ...)
 {
   va_list args;
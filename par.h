@@ -59,11 +59,15 @@
 					   may be used at once */
 #define PAR_MAX_WORKERS_PER_HOST 256	/* maximum # of workers on a single
 					   host */
-#define PAR_MAX_WORKERS		1024	/* maximum # of workers in the entire
-					   collection of hosts */
+#define PAR_MAX_WORKERS		1024	/* initial size of the master's worker
+					   table, which grows as needed */
 #define PAR_MAX_OVERLAPPED_BROADCASTS	8   /* maximum # of broadcasts that may
 					       be issued before waiting for
 					       acknowledgements */
+#define PAR_MAX_TASK_HINTS	4	/* maximum # of affinity keys that may
+					   be attached to a single task */
+#define PAR_HINT_HISTORY	16	/* # of recent affinity keys remembered
+					   for each worker */
 
 
 /*----------- nothing beyond this point----------------*/
@@ -80,6 +84,30 @@ typedef int Par_Task;		/* identifies a specific task that was doled
  *	APPLICATION PROGRAM INTERFACE FUNCTIONS
  *-----------------------------------------------------------------------*/
 
+/* with -PAR_GROUP=n (or the PAR_GROUP environment variable), the
+   processes after the master are divided, in order of rank, into
+   groups of n + 1; the first process of each group becomes a
+   sub-master, which takes tasks and contexts from the master as a
+   single worker able to hold n times as many tasks, dispatches them
+   to the other n processes of its group, and returns their results to
+   the master a batch at a time, so that the master only deals with
+   the sub-masters; since consecutive ranks are usually placed on the
+   same node, n is typically the number of processes per node less one.
+   Contexts are then always sent worker by worker (or by
+   par_broadcast_context), never collectively. */
+
+/* with -PAR_LOCAL=n (or the PAR_LOCAL environment variable), a
+   program started on its own, without mpirun, forks n worker
+   processes on the host and then runs just as it would under MPI
+   with n + 1 processes, the master talking to each worker over a
+   socket; this gives a workstation the use of all its cores without
+   an MPI launcher.  The workers are forked before master_task is
+   called, so nothing set up by master_task is seen by them except
+   through contexts and tasks.  In this mode MPI is never initialized,
+   so no MPI runtime is needed, and the program itself should make
+   no MPI calls (see par_processes).  It is ignored when started by
+   an MPI launcher with more than one process. */
+
 /* par_process is the function that should be called in the user's main()
    program to register the handlers, and transfer control over to the
    libpar library */
@@ -106,14 +134,149 @@ extern void par_set_context ();
    the current context to the workers; this is useful when the context is
    so large that it must be sent in parts; the library will wait for any
    outstanding tasks to complete before issuing the broadcast */
+/* with -PAR_COLLECTIVE=n (or the PAR_COLLECTIVE environment variable),
+   any context of at least n bytes, whether set with par_set_context or
+   par_broadcast_context, is instead delivered to all workers at once
+   with MPI_Bcast into one MPI-3 shared-memory window per node; this
+   needs every MPI process to be a live worker, and a context set with
+   par_set_context then waits for the workers' outstanding tasks to
+   finish before it is sent */
 extern void par_broadcast_context ();
 
 /* par_delegate_task causes the current task to be packed up
    (via a call to the user's (*pack_task)()) and delegated to the
-   first available worker */
+   first available worker; with -PAR_BATCH=n (or the PAR_BATCH
+   environment variable), up to n queued tasks sharing a context are
+   sent to a worker in one message and their results returned in one
+   message, the number being adapted to the task times the workers
+   report so that each batch holds roughly a quarter second of work
+   (this works best together with -PAR_PREFETCH=1) */
 extern Par_Task par_delegate_task ();
 
-/* par_finish waits for all delegated tasks to finish */
+/* par_delegate_task_hint is like par_delegate_task, but also tags the
+   task with n_keys affinity keys (typically the names of the input
+   files the task will read); among the idle workers, the task is
+   preferentially given to one that recently ran tasks having the same
+   keys, so that any worker-side caching of those inputs can be
+   exploited; the task is never held back waiting for such a worker */
+extern Par_Task par_delegate_task_hint (int n_keys, char **keys);
+
+/* par_set_task_size gives an estimate (in any units, e.g. pixels) of
+   the work in the next task to be delegated; queued tasks that share
+   a context and have such estimates are dispatched largest first, so
+   that the longest ones do not start last and hold up the finish */
+extern void par_set_task_size (double size);
+
+/* with -PAR_MEMORY=n and -PAR_GPUS=n (or the PAR_MEMORY and PAR_GPUS
+   environment variables), a worker advertises to the master, when it
+   starts, that it has n megabytes of memory or n GPUs; these are
+   usually given to only some of the processes, for instance through
+   the environment of the high-memory or GPU nodes or with the
+   separate argument lists of an MPMD mpirun.  par_set_task_needs
+   gives the megabytes of memory and the number of GPUs the next task
+   to be delegated needs (0 for either if it does not care); such a
+   task is only given to a worker that advertised at least as much,
+   waiting for one to be ready while the tasks behind it go to the
+   other workers, unless no worker advertised enough, in which case
+   any worker may take it.  Tasks are otherwise given to the least
+   capable of the ready workers, keeping the others free for the
+   tasks that need them.  With -PAR_GROUP, a sub-master advertises its
+   own memory and GPUs, and the needs of a task only choose among the
+   sub-masters.  par_worker_memory and par_worker_gpus return what the
+   calling process advertised (0 if nothing). */
+extern void par_set_task_needs (double memory, int gpus);
+extern int par_worker_memory ();
+extern int par_worker_gpus ();
+
+/* par_set_task_key names the next task to be delegated, with a key
+   that identifies it across runs (such as the name of its output) and
+   has no whitespace; with -PAR_JOURNAL=file (or the PAR_JOURNAL
+   environment variable), the master appends a record of each keyed
+   task's result to that file once (*master_result)() has it, and a
+   task whose key the file already records is not sent to a worker:
+   its recorded result is handed to (*master_result)() at once.  The
+   journal should be removed when the parameters of a run change.
+   par_journaling returns 1 if a journal was requested, in which case
+   a task's outputs should be complete by the time its result is
+   returned. */
+extern void par_set_task_key (char *key);
+extern int par_journaling ();
+
+/* par_set_worker_prefetch registers a routine that a worker will call
+   when the next task assigned to it has arrived while it is still
+   busy with the current one (this requires a prefetch depth greater
+   than 0, set through -PAR_PREFETCH=n or the PAR_PREFETCH environment
+   variable); the routine should unpack the task itself with the
+   par_upk* routines (the current task's fields must not be
+   disturbed) and may start loading its input in the background */
+extern void par_set_worker_prefetch (void (*worker_prefetch)());
+
+/* par_worker_poll may be called by a worker in the middle of a long
+   task to pick up any task that has arrived since the task began,
+   and pass it to the routine registered with par_set_worker_prefetch */
+extern void par_worker_poll ();
+
+/* par_task_cancelled may be called by a worker in the middle of a long
+   task; it returns 1 if the master no longer needs the task's result
+   (because a speculative copy of it has already finished, see
+   par_finish), in which case the worker may return from the task at
+   once, without a result, otherwise 0 */
+extern int par_task_cancelled ();
+
+/* par_pin_thread pins the calling thread, which should be the thread'th
+   (counting from 1) that a process has started for some parallel
+   work, to a cpu of its own; it does nothing unless each process has
+   been pinned to a block of cpus with -PAR_PIN=n (or the PAR_PIN
+   environment variable), in which case the process's threads share
+   the block and run on its socket, so that memory they first touch is
+   local to them; shared, read-mostly data, such as a context broadcast
+   collectively, is instead interleaved across the sockets */
+extern void par_pin_thread (int thread);
+
+/* par_pinned_cpus returns the number of cpus in the block this process
+   was pinned to with -PAR_PIN=n, or 0 if it was not pinned; a program
+   run with one process per node or socket can default to that many
+   threads per worker, divided by par_worker_threads() */
+extern int par_pinned_cpus ();
+
+/* with -PAR_THREADS=n (or the PAR_THREADS environment variable), each
+   worker process performs up to n tasks at once on n threads of its
+   own: the master gives it tasks as it would a sub-master of n
+   workers (see -PAR_GROUP), the process holds them on its own queue
+   and hands them to its threads as these become free, and so the
+   processes of a node can be fewer and share one copy of the context
+   and of whatever the workers cache.  A program has to allow this by
+   calling par_allow_worker_threads before par_process, and its
+   (*unpack_task)(), (*worker_task)() and (*pack_result)() must then be
+   safe to run on several threads at once; the par_pk* and par_upk*
+   routines act on the calling thread's own messages, so the Task and
+   Result records are best made thread-local (__thread).  Contexts and
+   broadcasts are taken in by the process's main thread, once its
+   threads have finished the tasks sent before them, and only that
+   thread sends or receives messages, so par_worker_poll does nothing
+   on the others.  With -PAR_PIN=n, each thread is pinned to its share
+   of the process's block of cpus, which par_pin_thread then divides
+   among the threads it starts.  par_worker_threads returns n in a
+   program that allows it, and otherwise 1 (as it does with
+   -PAR_GROUP, with which the option cannot be combined); it may be
+   called by the master as well as the workers. */
+extern void par_allow_worker_threads ();
+extern int par_worker_threads ();
+
+/* par_finish waits for all delegated tasks to finish; with
+   -PAR_TELEMETRY=file (or the PAR_TELEMETRY environment variable;
+   "-" means stdout), the master appends JSON lines to that file: a
+   heartbeat every -PAR_HEARTBEAT=n seconds (60 by default, 0 for
+   none) giving the queue depth and the busy workers, and, from
+   par_finish, one line per worker dividing its time among tasks,
+   contexts and waiting for the master, a summary of the master's
+   waiting time, the queue depth and the task-time percentiles, and
+   a line for each of the slowest tasks; with -PAR_SPECULATE=f (or the
+   PAR_SPECULATE environment variable), once no tasks remain queued,
+   any task that has been running more than f times the mean task
+   time is also given to an idle worker, the first result to arrive
+   is used, and the worker still running the other copy can learn
+   through par_task_cancelled that it may stop */
 extern void par_finish ();
 
 /* par_wait blocks for at most timeout seconds; it returns when
@@ -143,9 +306,16 @@ extern Par_Task par_next_task();
 extern int par_enabled ();
 
 /* par_workers returns the number of workers that are currently
-   in the configuration; this call is only valid in the master process */
+   in the configuration (counting those of any sub-masters); this call
+   is only valid in the master process */
 extern int par_workers ();
 
+/* par_processes returns the number of processes taking part in the
+   run, counting the master, whether they were started by MPI or
+   forked with -PAR_LOCAL; it is 1 when not running in parallel.
+   Unlike par_workers it is valid as soon as master_task is called. */
+extern int par_processes ();
+
 /* par_instance returns the instance number of the process and may be
    called by both master and worker processes; it will return 0 for the
    master, 1 through n_workers for the worker processes, and -1 if the
@@ -175,6 +345,15 @@ void par_pklongarray(long *p, int n);
 void par_pkfloatarray(float *p, int n);
 void par_pkdoublearray(double *p, int n);
 
+/* par_pkblock packs n bytes of contiguous memory, together with their
+   count, with a single copy into the message; as with MPI_BYTE data
+   generally, no conversion is done, so it is for structures that all
+   the processes lay out alike.  par_upkblock returns a pointer to such
+   a block within the received message, setting *n to its size,
+   without copying it; the pointer is only valid until the unpack
+   routine that calls it returns. */
+void par_pkblock(void *p, int n);
+
 /* the following routines unpack individual values from a message */
 unsigned char par_upkbyte();
 short par_upkshort();
@@ -191,3 +370,4 @@ void par_upkintarray(int *p, int n);
 void par_upklongarray(long *p, int n);
 void par_upkfloatarray(float *p, int n);
 void par_upkdoublearray(double *p, int n);
+void *par_upkblock(int *n);
@@ -0,0 +1,252 @@
+/*
+ * pool.c -- defines the pool of large buffers that register and
+ *           find_rst workers reuse across tasks
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define ALIGNMENT	64
+#define HEADER_SIZE	64		/* keeps the data aligned */
+#define MIN_SIZE	4096		/* smallest class */
+#define STEPS		4		/* classes per doubling of size */
+#define N_CLASSES	(STEPS * 48)
+#define MMAP_SIZE	(2 * 1024 * 1024)
+
+/* the header in front of each buffer */
+typedef struct Block {
+  struct Block *next;	/* the held blocks of the same class, most */
+  struct Block *prev;	/*   recently released first */
+  struct Block *older;	/* all held blocks, in the order released */
+  struct Block *newer;
+  size_t size;		/* bytes of data, the size of its class */
+  size_t total;		/* bytes allocated, with the header */
+  int class;
+  int mapped;		/* true if mmapped rather than from malloc */
+} Block;
+
+static Block *held[N_CLASSES];
+static Block *oldest = NULL;
+static Block *newest = NULL;
+static size_t heldBytes = 0;
+static size_t inUseBytes = 0;
+static size_t peakBytes = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int SizeClass (size_t size, size_t *classSize);
+static void Unhold (Block *b);
+static void FreeBlock (Block *b);
+
+void *
+PoolAlloc (size_t size)
+{
+  int k;
+  size_t classSize;
+  size_t total;
+  Block *b;
+  void *m;
+
+  k = SizeClass(size, &classSize);
+  pthread_mutex_lock(&lock);
+  b = NULL;
+  if (k < N_CLASSES && held[k] != NULL)
+    {
+      b = held[k];
+      Unhold(b);
+    }
+  pthread_mutex_unlock(&lock);
+
+  if (b == NULL)
+    {
+      total = HEADER_SIZE + classSize;
+      if (total >= MMAP_SIZE)
+	{
+	  total = (total + MMAP_SIZE - 1) & ~((size_t) MMAP_SIZE - 1);
+	  m = mmap(NULL, total, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  if (m == MAP_FAILED)
+	    return(NULL);
+#ifdef MADV_HUGEPAGE
+	  madvise(m, total, MADV_HUGEPAGE);
+#endif
+	  b = (Block *) m;
+	  b->mapped = 1;
+	}
+      else
+	{
+	  if (posix_memalign(&m, ALIGNMENT, total) != 0)
+	    return(NULL);
+	  b = (Block *) m;
+	  b->mapped = 0;
+	}
+      b->size = classSize;
+      b->total = total;
+      b->class = k;
+    }
+
+  pthread_mutex_lock(&lock);
+  inUseBytes += b->total;
+  if (inUseBytes > peakBytes)
+    peakBytes = inUseBytes;
+  pthread_mutex_unlock(&lock);
+  return((char *) b + HEADER_SIZE);
+}
+
+void
+PoolFree (void *p)
+{
+  Block *b;
+  Block *evicted;
+  Block *e;
+
+  if (p == NULL)
+    return;
+  b = (Block *) ((char *) p - HEADER_SIZE);
+  evicted = NULL;
+  pthread_mutex_lock(&lock);
+  inUseBytes -= b->total;
+  if (b->class >= N_CLASSES)
+    {
+      pthread_mutex_unlock(&lock);
+      FreeBlock(b);
+      return;
+    }
+
+  /* hold it, making room by giving up the blocks that have been held
+     the longest */
+  b->prev = NULL;
+  b->next = held[b->class];
+  if (b->next != NULL)
+    b->next->prev = b;
+  held[b->class] = b;
+  b->older = newest;
+  b->newer = NULL;
+  if (newest != NULL)
+    newest->newer = b;
+  else
+    oldest = b;
+  newest = b;
+  heldBytes += b->total;
+  while (inUseBytes + heldBytes > peakBytes && oldest != NULL)
+    {
+      e = oldest;
+      Unhold(e);
+      e->next = evicted;
+      evicted = e;
+    }
+  pthread_mutex_unlock(&lock);
+  while ((e = evicted) != NULL)
+    {
+      evicted = e->next;
+      FreeBlock(e);
+    }
+}
+
+void
+PoolRelease (void)
+{
+  int k;
+  Block *b;
+  Block *list;
+
+  pthread_mutex_lock(&lock);
+  list = oldest;
+  for (k = 0; k < N_CLASSES; ++k)
+    held[k] = NULL;
+  oldest = newest = NULL;
+  heldBytes = 0;
+  pthread_mutex_unlock(&lock);
+  while ((b = list) != NULL)
+    {
+      list = b->newer;
+      FreeBlock(b);
+    }
+}
+
+/* SizeClass returns the class of buffers of size bytes, setting
+   *classSize to the size of the buffers of that class; there are STEPS
+   classes to each doubling, so a buffer wastes at most a fifth of
+   itself, and sizes beyond the last class get a class of their own
+   (N_CLASSES or more) that is never held */
+static int
+SizeClass (size_t size, size_t *classSize)
+{
+  int k;
+  int shift;
+  size_t base;
+  size_t s;
+
+  if (size <= MIN_SIZE)
+    {
+      *classSize = MIN_SIZE;
+      return(0);
+    }
+  for (shift = 0, base = MIN_SIZE;
+       base <= size / 2 && shift < N_CLASSES / STEPS;
+       ++shift, base <<= 1) ;
+  for (k = STEPS * shift; ; ++k)
+    {
+      s = base + (base / STEPS) * (k - STEPS * shift);
+      if (s >= size || k >= N_CLASSES)
+	break;
+    }
+  if (k >= N_CLASSES)
+    {
+      *classSize = (size + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+      return(N_CLASSES);
+    }
+  *classSize = s;
+  return(k);
+}
+
+/* Unhold takes b off the lists of held blocks; lock must be held */
+static void
+Unhold (Block *b)
+{
+  if (b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    held[b->class] = b->next;
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  if (b->older != NULL)
+    b->older->newer = b->newer;
+  else
+    oldest = b->newer;
+  if (b->newer != NULL)
+    b->newer->older = b->older;
+  else
+    newest = b->older;
+  heldBytes -= b->total;
+}
+
+static void
+FreeBlock (Block *b)
+{
+  if (b->mapped)
+    munmap(b, b->total);
+  else
+    free(b);
+}
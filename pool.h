@@ -0,0 +1,34 @@
+//
+// pool.h - a process-wide pool of large buffers, kept by size class
+//          so that workers reuse them from one task to the next
+//
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* PoolAlloc returns a buffer of at least size bytes, aligned to 64
+   bytes (enough for the SIMD loads of FFTW), or NULL if there is no
+   memory; a buffer released by PoolFree that is of the same size class
+   is handed out again as is, without being zeroed.  New buffers of 2 MB
+   or more are mmapped and, where the system supports it, backed by
+   transparent huge pages.  PoolFree holds the buffer, giving up those
+   held the longest so that the memory held and in use stays within the
+   most that has been in use at once; the pool thus never raises the
+   peak footprint of the process.  Both may be called from any
+   thread. */
+void *PoolAlloc (size_t size);
+void PoolFree (void *p);
+
+/* PoolRelease returns all held buffers to the system */
+void PoolRelease (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POOL_H */
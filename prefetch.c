@@ -0,0 +1,604 @@
+/*
+ * prefetch.c -- reads the images and maps of the pairs a viewer is
+ *               likely to show next while the user looks at the
+ *               current one
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Acknowledgements:
+ *     Development of this code was supported in part by
+ *       NIH NCRR grant 5P41RR006009 and
+ *       NIH NIGMS grant P41GM103712
+ *
+ *  HISTORY
+ *    2026     Written for inspector and clean_maps
+ *    2026     Maps read at a level, and TakeMap, for align and
+ *               apply_map
+ *    2026     Image rows, for ortho
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "prefetch.h"
+
+#define PREFETCH_IMAGE	0
+#define PREFETCH_MAP	1
+#define PREFETCH_ROWS	2
+
+#define ENTRY_WAITING	0	/* asked for, but not yet being read */
+#define ENTRY_READING	1	/* being read by a thread */
+#define ENTRY_DONE	2	/* read (or found to be unreadable) */
+
+typedef struct PrefetchEntry {
+  int kind;
+  char *filename;
+  int minX, maxX, minY, maxY;	/* the region, for images; for maps,
+				   minX is the level wanted from
+				   ReadMapLevel, or -1 for ReadMap */
+  int factor, step;		/* for image rows, the reduction and
+				   row step of ReadImageRows */
+  int state;
+  int round;			/* the round it was last asked for in */
+  int order;			/* its place among that round's requests */
+
+  int ok;			/* what the read returned */
+  char error[PATH_MAX + 256];
+  unsigned char *pixels;
+  int width, height;
+  MapElement *map;
+  int level;
+  int xMin, yMin;
+  char imageName[PATH_MAX];
+  char referenceName[PATH_MAX];
+  size_t bytes;			/* the memory held by what was read */
+
+  struct PrefetchEntry *next;
+} PrefetchEntry;
+
+static pthread_mutex_t prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static PrefetchEntry *entries = NULL;
+static int started = 0;
+static int currentRound = 0;
+static int nextOrder = 0;
+static size_t budget = 0;
+static size_t used = 0;
+
+static void *PrefetchThreadMain (void *arg);
+static PrefetchEntry *FindEntry (int kind, char *filename,
+				 int minX, int maxX, int minY, int maxY,
+				 int factor, int step);
+static void Request (int kind, char *filename,
+		     int minX, int maxX, int minY, int maxY,
+		     int factor, int step);
+static PrefetchEntry *Obtain (int kind, char *filename,
+			      int minX, int maxX, int minY, int maxY,
+			      int factor, int step);
+static size_t ReadEntry (PrefetchEntry *e);
+static void Evict ();
+static size_t RoundBytes ();
+static void FreeEntry (PrefetchEntry *e);
+
+
+int
+StartPrefetching (int nThreads, size_t maxBytes)
+{
+  int i;
+  pthread_t thread;
+
+  pthread_mutex_lock(&prefetchLock);
+  budget = maxBytes;
+  started = 1;
+  pthread_mutex_unlock(&prefetchLock);
+  for (i = 0; i < nThreads; ++i)
+    {
+      if (pthread_create(&thread, NULL, PrefetchThreadMain, NULL) != 0)
+	return(0);
+      pthread_detach(thread);
+    }
+  return(1);
+}
+
+void
+BeginPrefetchRound ()
+{
+  PrefetchEntry **pe;
+  PrefetchEntry *e;
+
+  pthread_mutex_lock(&prefetchLock);
+  ++currentRound;
+  nextOrder = 0;
+  for (pe = &entries; (e = *pe) != NULL; )
+    if (e->state == ENTRY_WAITING)
+      {
+	*pe = e->next;
+	FreeEntry(e);
+      }
+    else
+      pe = &e->next;
+  pthread_mutex_unlock(&prefetchLock);
+}
+
+void
+PrefetchImage (char *filename,
+	       int minX, int maxX, int minY, int maxY)
+{
+  Request(PREFETCH_IMAGE, filename, minX, maxX, minY, maxY, 1, 1);
+}
+
+void
+PrefetchMap (char *filename)
+{
+  Request(PREFETCH_MAP, filename, -1, -1, -1, -1, 1, 1);
+}
+
+void
+PrefetchMapLevel (char *filename, int wantedLevel)
+{
+  Request(PREFETCH_MAP, filename, wantedLevel, -1, -1, -1, 1, 1);
+}
+
+void
+PrefetchImageRows (char *filename, int factor, int step,
+		   int minX, int maxX, int minY, int maxY)
+{
+  Request(PREFETCH_ROWS, filename, minX, maxX, minY, maxY, factor, step);
+}
+
+int
+FetchImage (char *filename, unsigned char **pixels,
+	    int *width, int *height,
+	    int minX, int maxX, int minY, int maxY,
+	    char *error)
+{
+  PrefetchEntry *e;
+  int ok;
+
+  if (!started)
+    return(ReadImage(filename, pixels, width, height,
+		     minX, maxX, minY, maxY, error));
+  e = Obtain(PREFETCH_IMAGE, filename, minX, maxX, minY, maxY, 1, 1);
+  if (e == NULL)
+    return(ReadImage(filename, pixels, width, height,
+		     minX, maxX, minY, maxY, error));
+  ok = e->ok;
+  if (!ok)
+    strcpy(error, e->error);
+  else if ((*pixels = (unsigned char *) malloc(e->bytes)) == NULL)
+    {
+      sprintf(error, "Could not allocate space for image %s\n", filename);
+      ok = 0;
+    }
+  else
+    {
+      memcpy(*pixels, e->pixels, e->bytes);
+      *width = e->width;
+      *height = e->height;
+    }
+  pthread_mutex_unlock(&prefetchLock);
+  return(ok);
+}
+
+int
+FetchMap (char *filename, MapElement **map,
+	  int *level,
+	  int *width, int *height,
+	  int *xMin, int *yMin,
+	  char *imageName, char *referenceName,
+	  char *error)
+{
+  PrefetchEntry *e;
+  int ok;
+
+  if (!started)
+    return(ReadMap(filename, map, level, width, height, xMin, yMin,
+		   imageName, referenceName, error));
+  e = Obtain(PREFETCH_MAP, filename, -1, -1, -1, -1, 1, 1);
+  if (e == NULL)
+    return(ReadMap(filename, map, level, width, height, xMin, yMin,
+		   imageName, referenceName, error));
+  ok = e->ok;
+  if (!ok)
+    strcpy(error, e->error);
+  else if ((*map = (MapElement *) malloc(e->bytes)) == NULL)
+    {
+      sprintf(error, "Could not allocate space for map %s\n", filename);
+      ok = 0;
+    }
+  else
+    {
+      memcpy(*map, e->map, e->bytes);
+      *level = e->level;
+      *width = e->width;
+      *height = e->height;
+      *xMin = e->xMin;
+      *yMin = e->yMin;
+      if (imageName != NULL)
+	strcpy(imageName, e->imageName);
+      if (referenceName != NULL)
+	strcpy(referenceName, e->referenceName);
+    }
+  pthread_mutex_unlock(&prefetchLock);
+  return(ok);
+}
+
+int
+TakeImage (char *filename, unsigned char **pixels,
+	   int *width, int *height,
+	   int minX, int maxX, int minY, int maxY,
+	   char *error)
+{
+  PrefetchEntry **pe;
+  PrefetchEntry *e;
+  int ok;
+
+  if (!started)
+    return(ReadImage(filename, pixels, width, height,
+		     minX, maxX, minY, maxY, error));
+  e = Obtain(PREFETCH_IMAGE, filename, minX, maxX, minY, maxY, 1, 1);
+  if (e == NULL)
+    return(ReadImage(filename, pixels, width, height,
+		     minX, maxX, minY, maxY, error));
+  ok = e->ok;
+  if (!ok)
+    strcpy(error, e->error);
+  else
+    {
+      *pixels = e->pixels;
+      *width = e->width;
+      *height = e->height;
+      e->pixels = NULL;
+    }
+  for (pe = &entries; *pe != e; pe = &(*pe)->next) ;
+  *pe = e->next;
+  used -= e->bytes;
+  FreeEntry(e);
+  pthread_mutex_unlock(&prefetchLock);
+  return(ok);
+}
+
+int
+TakeImageRows (char *filename, int factor, int step,
+	       unsigned char **pixels,
+	       int *width, int *height,
+	       int minX, int maxX, int minY, int maxY,
+	       char *error)
+{
+  PrefetchEntry **pe;
+  PrefetchEntry *e;
+  int ok;
+
+  if (!started)
+    return(ReadImageRows(filename, factor, step, pixels, width, height,
+			 minX, maxX, minY, maxY, error));
+  e = Obtain(PREFETCH_ROWS, filename, minX, maxX, minY, maxY,
+	     factor, step);
+  if (e == NULL)
+    return(ReadImageRows(filename, factor, step, pixels, width, height,
+			 minX, maxX, minY, maxY, error));
+  ok = e->ok;
+  if (!ok)
+    strcpy(error, e->error);
+  else
+    {
+      *pixels = e->pixels;
+      *width = e->width;
+      *height = e->height;
+      e->pixels = NULL;
+    }
+  for (pe = &entries; *pe != e; pe = &(*pe)->next) ;
+  *pe = e->next;
+  used -= e->bytes;
+  FreeEntry(e);
+  pthread_mutex_unlock(&prefetchLock);
+  return(ok);
+}
+
+int
+TakeMap (char *filename, int wantedLevel,
+	 MapElement **map,
+	 int *level,
+	 int *width, int *height,
+	 int *xMin, int *yMin,
+	 char *imageName, char *referenceName,
+	 char *error)
+{
+  PrefetchEntry **pe;
+  PrefetchEntry *e;
+  int ok;
+
+  if (wantedLevel < 0)
+    wantedLevel = -1;
+  e = NULL;
+  if (started)
+    e = Obtain(PREFETCH_MAP, filename, wantedLevel, -1, -1, -1, 1, 1);
+  if (e == NULL)
+    {
+      if (wantedLevel < 0)
+	return(ReadMap(filename, map, level, width, height, xMin, yMin,
+		       imageName, referenceName, error));
+      return(ReadMapLevel(filename, map, wantedLevel, level,
+			  width, height, xMin, yMin,
+			  imageName, referenceName, error));
+    }
+  ok = e->ok;
+  if (!ok)
+    strcpy(error, e->error);
+  else
+    {
+      *map = e->map;
+      *level = e->level;
+      *width = e->width;
+      *height = e->height;
+      *xMin = e->xMin;
+      *yMin = e->yMin;
+      if (imageName != NULL)
+	strcpy(imageName, e->imageName);
+      if (referenceName != NULL)
+	strcpy(referenceName, e->referenceName);
+      e->map = NULL;
+    }
+  for (pe = &entries; *pe != e; pe = &(*pe)->next) ;
+  *pe = e->next;
+  used -= e->bytes;
+  FreeEntry(e);
+  pthread_mutex_unlock(&prefetchLock);
+  return(ok);
+}
+
+void
+ForgetPrefetched (char *filename)
+{
+  PrefetchEntry **pe;
+  PrefetchEntry *e;
+
+  pthread_mutex_lock(&prefetchLock);
+  for (pe = &entries; (e = *pe) != NULL; )
+    if (strcmp(e->filename, filename) == 0 && e->state != ENTRY_READING)
+      {
+	*pe = e->next;
+	used -= e->bytes;
+	FreeEntry(e);
+      }
+    else
+      pe = &e->next;
+  pthread_mutex_unlock(&prefetchLock);
+}
+
+static void *
+PrefetchThreadMain (void *arg)
+{
+  PrefetchEntry *e;
+  PrefetchEntry *best;
+  size_t bytes;
+
+  pthread_mutex_lock(&prefetchLock);
+  for (;;)
+    {
+      /* take the most important request of this round, if what has
+	 been read for this round leaves room for it */
+      best = NULL;
+      if (RoundBytes() < budget)
+	for (e = entries; e != NULL; e = e->next)
+	  if (e->state == ENTRY_WAITING &&
+	      (best == NULL || e->order < best->order))
+	    best = e;
+      if (best == NULL)
+	{
+	  pthread_cond_wait(&workCond, &prefetchLock);
+	  continue;
+	}
+      best->state = ENTRY_READING;
+      pthread_mutex_unlock(&prefetchLock);
+      bytes = ReadEntry(best);
+      pthread_mutex_lock(&prefetchLock);
+      best->state = ENTRY_DONE;
+      best->bytes = bytes;
+      used += bytes;
+      Evict();
+      pthread_cond_broadcast(&doneCond);
+    }
+  return(NULL);
+}
+
+static PrefetchEntry *
+FindEntry (int kind, char *filename,
+	   int minX, int maxX, int minY, int maxY,
+	   int factor, int step)
+{
+  PrefetchEntry *e;
+
+  for (e = entries; e != NULL; e = e->next)
+    if (e->kind == kind && strcmp(e->filename, filename) == 0 &&
+	e->minX == minX && e->maxX == maxX &&
+	e->minY == minY && e->maxY == maxY &&
+	e->factor == factor && e->step == step)
+      return(e);
+  return(NULL);
+}
+
+/* Request asks for a file to be read in this round, making an entry
+   for it if there is none */
+static void
+Request (int kind, char *filename,
+	 int minX, int maxX, int minY, int maxY,
+	 int factor, int step)
+{
+  PrefetchEntry *e;
+
+  if (!started)
+    return;
+  pthread_mutex_lock(&prefetchLock);
+  e = FindEntry(kind, filename, minX, maxX, minY, maxY, factor, step);
+  if (e == NULL)
+    {
+      e = (PrefetchEntry *) malloc(sizeof(PrefetchEntry));
+      if (e == NULL || (e->filename = strdup(filename)) == NULL)
+	{
+	  /* prefetching is only an optimization */
+	  free(e);
+	  pthread_mutex_unlock(&prefetchLock);
+	  return;
+	}
+      e->kind = kind;
+      e->minX = minX;
+      e->maxX = maxX;
+      e->minY = minY;
+      e->maxY = maxY;
+      e->factor = factor;
+      e->step = step;
+      e->state = ENTRY_WAITING;
+      e->pixels = NULL;
+      e->map = NULL;
+      e->bytes = 0;
+      e->next = entries;
+      entries = e;
+    }
+  e->round = currentRound;
+  e->order = nextOrder++;
+  pthread_cond_signal(&workCond);
+  pthread_mutex_unlock(&prefetchLock);
+}
+
+/* Obtain returns the read entry for a file with prefetchLock held,
+   reading the file itself if no thread has started on it, or NULL
+   (without the lock) if it could not make an entry */
+static PrefetchEntry *
+Obtain (int kind, char *filename,
+	int minX, int maxX, int minY, int maxY,
+	int factor, int step)
+{
+  PrefetchEntry *e;
+  size_t bytes;
+
+  Request(kind, filename, minX, maxX, minY, maxY, factor, step);
+  pthread_mutex_lock(&prefetchLock);
+  e = FindEntry(kind, filename, minX, maxX, minY, maxY, factor, step);
+  if (e == NULL)
+    {
+      pthread_mutex_unlock(&prefetchLock);
+      return(NULL);
+    }
+  if (e->state == ENTRY_WAITING)
+    {
+      e->state = ENTRY_READING;
+      pthread_mutex_unlock(&prefetchLock);
+      bytes = ReadEntry(e);
+      pthread_mutex_lock(&prefetchLock);
+      e->state = ENTRY_DONE;
+      e->bytes = bytes;
+      used += bytes;
+      Evict();
+      pthread_cond_broadcast(&doneCond);
+    }
+  while (e->state != ENTRY_DONE)
+    pthread_cond_wait(&doneCond, &prefetchLock);
+  return(e);
+}
+
+/* ReadEntry reads the file of an entry that is being read, returning
+   the memory that what it read takes; the caller records that under
+   prefetchLock */
+static size_t
+ReadEntry (PrefetchEntry *e)
+{
+  if (e->kind == PREFETCH_IMAGE || e->kind == PREFETCH_ROWS)
+    {
+      if (e->kind == PREFETCH_IMAGE)
+	e->ok = ReadImage(e->filename, &e->pixels, &e->width, &e->height,
+			  e->minX, e->maxX, e->minY, e->maxY, e->error);
+      else
+	e->ok = ReadImageRows(e->filename, e->factor, e->step,
+			      &e->pixels, &e->width, &e->height,
+			      e->minX, e->maxX, e->minY, e->maxY, e->error);
+      if (e->ok)
+	return(((size_t) e->width) * e->height);
+      e->pixels = NULL;
+    }
+  else
+    {
+      if (e->minX >= 0)
+	e->ok = ReadMapLevel(e->filename, &e->map, e->minX, &e->level,
+			     &e->width, &e->height, &e->xMin, &e->yMin,
+			     e->imageName, e->referenceName, e->error);
+      else
+	e->ok = ReadMap(e->filename, &e->map, &e->level,
+			&e->width, &e->height, &e->xMin, &e->yMin,
+			e->imageName, e->referenceName, e->error);
+      if (e->ok)
+	return(((size_t) e->width) * e->height * sizeof(MapElement));
+      e->map = NULL;
+    }
+  return(0);
+}
+
+/* Evict drops what was read for earlier rounds, oldest first, until
+   the rest fits within the budget */
+static void
+Evict ()
+{
+  PrefetchEntry **pe;
+  PrefetchEntry **oldest;
+  PrefetchEntry *e;
+
+  while (used > budget)
+    {
+      oldest = NULL;
+      for (pe = &entries; (e = *pe) != NULL; pe = &e->next)
+	if (e->state == ENTRY_DONE && e->round != currentRound &&
+	    (oldest == NULL || e->round < (*oldest)->round))
+	  oldest = pe;
+      if (oldest == NULL)
+	break;
+      e = *oldest;
+      *oldest = e->next;
+      used -= e->bytes;
+      FreeEntry(e);
+    }
+}
+
+/* RoundBytes returns the memory held by what has been read for this
+   round */
+static size_t
+RoundBytes ()
+{
+  PrefetchEntry *e;
+  size_t n = 0;
+
+  for (e = entries; e != NULL; e = e->next)
+    if (e->round == currentRound)
+      n += e->bytes;
+  return(n);
+}
+
+static void
+FreeEntry (PrefetchEntry *e)
+{
+  if (e->pixels != NULL)
+    free(e->pixels);
+  if (e->map != NULL)
+    free(e->map);
+  free(e->filename);
+  free(e);
+}
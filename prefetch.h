@@ -0,0 +1,97 @@
+//
+// prefetch.h - functions to read the images and maps of the pairs
+//              a viewer is likely to show next, or the images a
+//              batch tool will read next, in the background
+//
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include "imio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* StartPrefetching starts nThreads threads that read the files asked
+   for by PrefetchImage and PrefetchMap, keeping what they read while
+   it takes no more than budget bytes; until it is called, FetchImage
+   and FetchMap simply read their files */
+int StartPrefetching (int nThreads, size_t budget);
+
+/* BeginPrefetchRound discards the requests that have not been started
+   yet; the requests made after it, in decreasing order of importance,
+   are the ones the threads work on, and what they read is kept in
+   preference to what was asked for in earlier rounds */
+void BeginPrefetchRound ();
+
+/* PrefetchImage and PrefetchMap ask for an image (or region of one,
+   as for ReadImage) and a map to be read in the background */
+void PrefetchImage (char *filename,
+		    int minX, int maxX, int minY, int maxY);
+void PrefetchMap (char *filename);
+
+/* PrefetchMapLevel asks for a map to be read in the background as
+   ReadMapLevel reads it, at the coarsest stored level no coarser than
+   wantedLevel */
+void PrefetchMapLevel (char *filename, int wantedLevel);
+
+/* PrefetchImageRows asks for the rows of an image that ReadImageRows
+   would read to be read in the background */
+void PrefetchImageRows (char *filename, int factor, int step,
+			int minX, int maxX, int minY, int maxY);
+
+/* FetchImage and FetchMap are ReadImage and ReadMap, taking copies of
+   what was prefetched if it is there, waiting for it if it is being
+   read, and otherwise reading the file (and keeping it) themselves */
+int FetchImage (char *filename, unsigned char **pixels,
+		int *width, int *height,
+		int minX, int maxX, int minY, int maxY,
+		char *error);
+int FetchMap (char *filename, MapElement **map,
+	      int *level,
+	      int *width, int *height,
+	      int *xMin, int *yMin,
+	      char *imageName, char *referenceName,
+	      char *error);
+
+/* TakeImage is FetchImage for readers that need each file only once,
+   such as apply_map and gen_imaps: it hands over the prefetched pixels
+   themselves rather than a copy, and forgets the entry, so that what
+   is held in the background is only what has been asked for and not
+   yet taken; only one thread should take a given file */
+int TakeImage (char *filename, unsigned char **pixels,
+	       int *width, int *height,
+	       int minX, int maxX, int minY, int maxY,
+	       char *error);
+
+/* TakeImageRows is TakeImage for the rows asked for by
+   PrefetchImageRows, reading them as ReadImageRows does if they were
+   not asked for */
+int TakeImageRows (char *filename, int factor, int step,
+		   unsigned char **pixels,
+		   int *width, int *height,
+		   int minX, int maxX, int minY, int maxY,
+		   char *error);
+
+/* TakeMap is TakeImage for the maps that a batch tool such as align
+   or apply_map reads once each, at startup: it hands over the map
+   read by PrefetchMapLevel (or, if wantedLevel is negative, by
+   PrefetchMap), reading it itself if it was not asked for */
+int TakeMap (char *filename, int wantedLevel,
+	     MapElement **map,
+	     int *level,
+	     int *width, int *height,
+	     int *xMin, int *yMin,
+	     char *imageName, char *referenceName,
+	     char *error);
+
+/* ForgetPrefetched drops anything read from filename, which is about
+   to be rewritten */
+void ForgetPrefetched (char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PREFETCH_H */
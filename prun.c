@@ -10,8 +10,66 @@
 
 #define MAX_COMMAND_LENGTH	4095
 
+/* job states */
+#define WAITING		0	/* some dependencies have not finished */
+#define READY		1
+#define RUNNING		2
+#define DONE		3
+#define FAILED		4	/* exited with a non-zero code */
+#define SKIPPED		5	/* a dependency failed or was skipped */
+
+typedef struct Job
+{
+  char *command;	/* NULL for the barriers */
+  char *name;		/* NULL if not named */
+  int threads;		/* workers the job occupies on its node */
+  double memory;	/* MB the job needs on its node */
+  int nDeps;
+  int *deps;
+  int nDependents;
+  int *dependents;
+  int nWaiting;		/* dependencies not yet finished */
+  int blocked;		/* whether a dependency did not succeed */
+  int height;		/* longest chain of dependents below the job */
+  int state;
+  int node;
+} Job;
+
+typedef struct Node
+{
+  char name[PATH_MAX];
+  int nWorkers;
+  int nIdle;
+  double memory;	/* MB on the node */
+  double freeMemory;	/* MB not claimed by running jobs */
+} Node;
+
 FILE *logFile = NULL;
 
+int nJobs = 0;
+Job *jobs = NULL;
+int *order = NULL;	/* the jobs by decreasing height */
+int firstOrder = 0;	/* the jobs in order before this have started */
+int nNodes = 0;
+Node *nodes = NULL;
+int nWorkers = 0;
+int *workerNode = NULL;
+int *workerJob = NULL;	/* the job each worker is running or reserved
+			   for, -1 if idle, or -2 if not yet heard from */
+int nBusy = 0;		/* workers we expect to hear from */
+int nFinished = 0;
+int nFailed = 0;
+int nSkipped = 0;
+
+void ReadJobs (char *listName, char *command,
+	       int defaultThreads, double defaultMemory);
+int AddJob (char *command, char *name, int threads, double memory);
+void AddDependency (int j, int d);
+int ParseMemory (char *s, double *memory);
+void CheckFits (Job *job);
+void Dispatch ();
+void FinishJob (int j, int state);
+int CompareHeights (const void *a, const void *b);
 void Error (char *fmt, ...);
 void Log (char *fmt, ...);
 
@@ -19,7 +77,7 @@ int
 main (int argc, char **argv)
 {
   int p, np;
-  int i;
+  int i, j, k;
   char command[MAX_COMMAND_LENGTH+1];
   char line[MAX_COMMAND_LENGTH+1];
   char cmd[MAX_COMMAND_LENGTH+1];
@@ -28,6 +86,16 @@ main (int argc, char **argv)
   char logName[PATH_MAX];
   char fn[PATH_MAX];
   char hostName[PATH_MAX];
+  char *hostNames;
+  double memory;
+  double *memories;
+  int threads;
+  double nodeMemory;
+  double defaultMemory;
+  int defaultThreads;
+  int msg[3];
+  int task[2];
+  char threadsString[32];
   int error;
   int n;
   FILE *f;
@@ -60,6 +128,9 @@ main (int argc, char **argv)
       listName[0] = '\0';
       logName[0] = '\0';
       commandName[0] = '\0';
+      defaultThreads = 1;
+      defaultMemory = 0.0;
+      nodeMemory = 0.0;
       for (i = 1; i < argc; ++i)
 	if (strcmp(argv[i], "-command") == 0)
 	  {
@@ -88,6 +159,35 @@ main (int argc, char **argv)
 	      }
 	    strcpy(logName, argv[i]);
 	  }
+	else if (strcmp(argv[i], "-threads") == 0)
+	  {
+	    if (++i == argc || sscanf(argv[i], "%d", &defaultThreads) != 1 ||
+		defaultThreads < 1)
+	      {
+		fprintf(stderr, "-threads error\n");
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-memory") == 0)
+	  {
+	    if (++i == argc || !ParseMemory(argv[i], &defaultMemory))
+	      {
+		fprintf(stderr, "-memory error\n");
+		error = 1;
+		break;
+	      }
+	  }
+	else if (strcmp(argv[i], "-node_memory") == 0)
+	  {
+	    if (++i == argc || !ParseMemory(argv[i], &nodeMemory) ||
+		nodeMemory <= 0.0)
+	      {
+		fprintf(stderr, "-node_memory error\n");
+		error = 1;
+		break;
+	      }
+	  }
 	else
 	  error = 1;
 
@@ -96,6 +196,19 @@ main (int argc, char **argv)
 	  fprintf(stderr, "Usage: prun -list list_file\n");
 	  fprintf(stderr, "            [-command command_file]\n");
 	  fprintf(stderr, "            [-logs log_file_prefix]\n");
+	  fprintf(stderr, "            [-threads default_threads_per_command]\n");
+	  fprintf(stderr, "            [-memory default_MB_per_command]\n");
+	  fprintf(stderr, "            [-node_memory MB_per_node]\n");
+	  fprintf(stderr, "  Lines of the list may be prefixed by\n");
+	  fprintf(stderr, "    @name=N threads=T memory=M after=N1,N2,... :\n");
+	  fprintf(stderr, "  (each item optional), and a line @barrier makes\n");
+	  fprintf(stderr, "  the later lines wait for all earlier ones.\n");
+	  MPI_Abort(MPI_COMM_WORLD, 1);
+	  exit(1);
+	}
+      if (np < 2)
+	{
+	  fprintf(stderr, "prun needs at least 2 processes.\n");
 	  MPI_Abort(MPI_COMM_WORLD, 1);
 	  exit(1);
 	}
@@ -119,10 +232,59 @@ main (int argc, char **argv)
       exit(1);
     }
 
-  gethostname(hostName, PATH_MAX);
+  /* gather the node and memory of every worker so that the master
+     can place the commands that need several threads or much
+     memory */
+  memset(hostName, 0, PATH_MAX);
+  gethostname(hostName, PATH_MAX-1);
+  memory = ((double) sysconf(_SC_PHYS_PAGES)) *
+    sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+  hostNames = NULL;
+  memories = NULL;
+  if (p == 0)
+    {
+      hostNames = (char *) malloc(((size_t) np) * PATH_MAX);
+      memories = (double *) malloc(np * sizeof(double));
+    }
+  if (MPI_Gather(hostName, PATH_MAX, MPI_CHAR,
+		 hostNames, PATH_MAX, MPI_CHAR,
+		 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Gather(&memory, 1, MPI_DOUBLE,
+		 memories, 1, MPI_DOUBLE,
+		 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+    Error("MPI_Gather of worker nodes failed\n");
+
   if (p == 0)
     {
       Log("prun master starting on node %s\n", hostName);
+      nodes = (Node *) malloc(np * sizeof(Node));
+      workerNode = (int *) malloc(np * sizeof(int));
+      workerJob = (int *) malloc(np * sizeof(int));
+      nWorkers = np - 1;
+      for (i = 1; i < np; ++i)
+	{
+	  for (k = 0; k < nNodes; ++k)
+	    if (strcmp(nodes[k].name, &hostNames[((size_t) i) * PATH_MAX]) == 0)
+	      break;
+	  if (k == nNodes)
+	    {
+	      strcpy(nodes[k].name, &hostNames[((size_t) i) * PATH_MAX]);
+	      nodes[k].nWorkers = 0;
+	      nodes[k].nIdle = 0;
+	      nodes[k].memory = nodeMemory > 0.0 ? nodeMemory : memories[i];
+	      nodes[k].freeMemory = nodes[k].memory;
+	      ++nNodes;
+	    }
+	  ++nodes[k].nWorkers;
+	  workerNode[i] = k;
+	  workerJob[i] = -2;
+	}
+      for (k = 0; k < nNodes; ++k)
+	Log("Node %s has %d workers and %.0f MB\n",
+	    nodes[k].name, nodes[k].nWorkers, nodes[k].memory);
+      free(hostNames);
+      free(memories);
+
       if (commandName[0] != '\0')
 	{
 	  f = fopen(commandName, "r");
@@ -139,80 +301,102 @@ main (int argc, char **argv)
 	}
       else
 	strcpy(command, "%s");
+      ReadJobs(listName, command, defaultThreads, defaultMemory);
 
-      f = fopen(listName, "r");
-      if (f == NULL)
-	Error("Could not open list file %s\n", listName);
-      while (fgets(line, MAX_COMMAND_LENGTH+1, f) != NULL)
-	{
-	  if (line[0] == '#')
-	    continue;
-
-	  len = strlen(line);
-	  if (len > 0 && line[len-1] == '\n')
-	    line[len-1] = '\0';
-	  if (line[0] == '\0')
-	    continue;
-
-	  /* construct command to execute */
-	  snprintf(cmd, MAX_COMMAND_LENGTH+1, command,
-		   line, line, line, line,
-		   line, line, line, line,
-		   line, line, line, line,
-		   line, line, line, line);
-	  cmd[MAX_COMMAND_LENGTH] = '\0';
-	  if (cmd[0] == '\0')
-	    continue;
+      /* run the jobs at the head of the longest chains first */
+      for (j = nJobs-1; j >= 0; --j)
+	for (k = 0; k < jobs[j].nDeps; ++k)
+	  if (jobs[jobs[j].deps[k]].height < jobs[j].height + 1)
+	    jobs[jobs[j].deps[k]].height = jobs[j].height + 1;
+      order = (int *) malloc((nJobs + 1) * sizeof(int));
+      for (j = 0; j < nJobs; ++j)
+	order[j] = j;
+      qsort(order, nJobs, sizeof(int), CompareHeights);
+      for (j = 0; j < nJobs; ++j)
+	if (jobs[j].nWaiting == 0 && jobs[j].state == WAITING)
+	  FinishJob(j, READY);
 
-	  /* wait for a ready worker */
-	  if (MPI_Recv(&n, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG,
+      /* hand out the jobs as workers become free */
+      nBusy = np - 1;
+      while (nFinished < nJobs)
+	{
+	  Dispatch();
+	  if (nBusy == 0)
+	    Error("No job can be started.\n");
+	  if (MPI_Recv(msg, 3, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG,
 		       MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS)
 	    Error("MPI_Recv failed\n");
+	  n = msg[0];
 	  if (n < 1 || n >= np)
 	    Error("Received out-of-range worker index (%d)\n", n);
-	  Log("Delegating to worker %d: %s\n", n, cmd);
+	  --nBusy;
+	  j = msg[1];
+	  if (j < 0)
+	    {
+	      workerJob[n] = -1;
+	      ++nodes[workerNode[n]].nIdle;
+	      continue;
+	    }
+	  if (j >= nJobs || jobs[j].state != RUNNING)
+	    Error("Worker %d reported on unexpected job %d\n", n, j);
 
-	  /* send command to that worker */
-	  if (MPI_Send(cmd, MAX_COMMAND_LENGTH+1, MPI_CHAR,
-		       n, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
-	    Error("MPI_Send to worker %d failed\n", n);
+	  /* free the worker, the workers reserved for the job's extra
+	     threads, and its memory */
+	  for (i = 1; i < np; ++i)
+	    if (workerJob[i] == j)
+	      {
+		workerJob[i] = -1;
+		++nodes[workerNode[i]].nIdle;
+	      }
+	  nodes[jobs[j].node].freeMemory += jobs[j].memory;
+	  if (msg[2] != 0)
+	    Log("Command failed on worker %d (exit code = %d): %s\n",
+		n, msg[2], jobs[j].command);
+	  FinishJob(j, msg[2] == 0 ? DONE : FAILED);
 	}
-      fclose(f);
 
-      /* wait for all workers to finish */
-      Log("All commands delegated; waiting for completion\n");
-      cmd[0] = '\0';
+      /* all workers are now waiting for a job; tell them to finish */
+      Log("All commands finished; %d failed and %d were skipped\n",
+	  nFailed, nSkipped);
+      task[0] = -1;
+      task[1] = 0;
       for (i = 1; i < np; ++i)
-	{
-	  if (MPI_Recv(&n, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG,
-		       MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS)
-	    Error("Final MPI_Recv failed\n");
-	  if (MPI_Send(cmd, MAX_COMMAND_LENGTH+1, MPI_CHAR,
-		       n, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
-	    Error("Final MPI_Send failed\n");
-	}
+	if (MPI_Send(task, 2, MPI_INT, i, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+	  Error("Final MPI_Send failed\n");
       Log("All workers finished.\n");
     }
   else
     {
       Log("prun worker starting on node %s\n", hostName);
+      msg[0] = p;
+      msg[1] = -1;
+      msg[2] = 0;
       for (;;)
 	{
-	  /* send a ready message */
-	  if (MPI_Send(&p, 1, MPI_INT, 0, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+	  /* send a ready message, reporting on the last job */
+	  if (MPI_Send(msg, 3, MPI_INT, 0, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
 	    Error("MPI_Send of ready worker failed.\n");
 
-	  /* receive a command */
-	  if (MPI_Recv(cmd, MAX_COMMAND_LENGTH+1, MPI_CHAR, 0, 0,
+	  /* receive a job and its number of threads, then its command */
+	  if (MPI_Recv(task, 2, MPI_INT, 0, 0,
 		       MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS)
 	    Error("MPI_Recv in worker failed.\n");
-	  if (cmd[0] == '\0')
+	  if (task[0] < 0)
 	    {
 	      Log("Worker %d received request to finalize.\n", p);
 	      break;
 	    }
+	  if (MPI_Recv(cmd, MAX_COMMAND_LENGTH+1, MPI_CHAR, 0, 0,
+		       MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+	    Error("MPI_Recv in worker failed.\n");
 
-	  /* execute the command, piping stdout to log file */
+	  /* execute the command, piping stdout to log file; the
+	     command may find its number of threads in the
+	     environment */
+	  threads = task[1];
+	  sprintf(threadsString, "%d", threads);
+	  setenv("PRUN_THREADS", threadsString, 1);
+	  setenv("OMP_NUM_THREADS", threadsString, 1);
 	  Log("Worker %d running command %s\n", p, cmd);
 	  pf = popen(cmd, "r");
 	  if (pf == NULL)
@@ -221,11 +405,8 @@ main (int argc, char **argv)
 	    Log("%s", line);
 	  status = pclose(pf);
 	  Log("Worker %d finished running command %s (exit code = %d).\n\n", p, cmd, WEXITSTATUS(status));
-	  //	  if (WEXITSTATUS(status) != 0)
-	  //	    {
-	  //	      Log("prun worker terminating because of non-zero exit code.\n");
-	  //	      break;
-	  //	    }
+	  msg[1] = task[0];
+	  msg[2] = status == -1 || !WIFEXITED(status) ? -1 : WEXITSTATUS(status);
 	}
     }
 
@@ -234,6 +415,372 @@ main (int argc, char **argv)
   return(0);
 }
 
+/* ReadJobs reads the list file.  A line of the form
+     @name=N threads=T memory=M after=N1,N2,... : rest
+   (with any of the items left out) runs rest with the given hints,
+   after all earlier jobs named N1, N2, ... have finished, and
+   names the job N; a line @barrier makes all later jobs wait for
+   all earlier ones to finish, successfully or not. */
+void
+ReadJobs (char *listName, char *command,
+	  int defaultThreads, double defaultMemory)
+{
+  FILE *f;
+  char line[MAX_COMMAND_LENGTH+1];
+  char cmd[MAX_COMMAND_LENGTH+1];
+  char name[MAX_COMMAND_LENGTH+1];
+  char after[MAX_COMMAND_LENGTH+1];
+  char token[MAX_COMMAND_LENGTH+1];
+  char *rest;
+  char *s, *t;
+  int lineNo;
+  int len;
+  int n;
+  int j, k;
+  int found;
+  int threads;
+  double memory;
+  int barrier;		/* the last barrier, or -1 */
+  int segmentStart;	/* the first job after that barrier */
+
+  f = fopen(listName, "r");
+  if (f == NULL)
+    Error("Could not open list file %s\n", listName);
+  barrier = -1;
+  segmentStart = 0;
+  lineNo = 0;
+  while (fgets(line, MAX_COMMAND_LENGTH+1, f) != NULL)
+    {
+      ++lineNo;
+      if (line[0] == '#')
+	continue;
+
+      len = strlen(line);
+      if (len > 0 && line[len-1] == '\n')
+	line[len-1] = '\0';
+      if (line[0] == '\0')
+	continue;
+
+      name[0] = '\0';
+      after[0] = '\0';
+      threads = defaultThreads;
+      memory = defaultMemory;
+      rest = line;
+      if (line[0] == '@')
+	{
+	  if (sscanf(line+1, "%s%n", token, &n) == 1 &&
+	      strcmp(token, "barrier") == 0 &&
+	      sscanf(line+1+n, "%s", token) != 1)
+	    {
+	      /* a barrier depends on the jobs since the barrier
+		 before, which in turn depend on that one */
+	      if (segmentStart == nJobs)
+		continue;
+	      j = AddJob(NULL, NULL, 0, 0.0);
+	      for (k = segmentStart; k < j; ++k)
+		AddDependency(j, k);
+	      barrier = j;
+	      segmentStart = nJobs;
+	      continue;
+	    }
+
+	  rest = NULL;
+	  for (s = line + 1; sscanf(s, "%s%n", token, &n) == 1; s += n)
+	    if (strcmp(token, ":") == 0)
+	      {
+		rest = s + n;
+		break;
+	      }
+	    else if (strncmp(token, "name=", 5) == 0)
+	      strcpy(name, token+5);
+	    else if (strncmp(token, "threads=", 8) == 0)
+	      {
+		if (sscanf(token+8, "%d", &threads) != 1 || threads < 1)
+		  Error("Bad threads on line %d of %s\n", lineNo, listName);
+	      }
+	    else if (strncmp(token, "memory=", 7) == 0)
+	      {
+		if (!ParseMemory(token+7, &memory))
+		  Error("Bad memory on line %d of %s\n", lineNo, listName);
+	      }
+	    else if (strncmp(token, "after=", 6) == 0)
+	      strcpy(after, token+6);
+	    else
+	      Error("Unknown prefix %s on line %d of %s\n",
+		    token, lineNo, listName);
+	  if (rest == NULL)
+	    Error("Missing ':' on line %d of %s\n", lineNo, listName);
+	  while (*rest == ' ' || *rest == '\t')
+	    ++rest;
+	  if (*rest == '\0')
+	    continue;
+	}
+
+      /* construct command to execute */
+      snprintf(cmd, MAX_COMMAND_LENGTH+1, command,
+	       rest, rest, rest, rest,
+	       rest, rest, rest, rest,
+	       rest, rest, rest, rest,
+	       rest, rest, rest, rest);
+      cmd[MAX_COMMAND_LENGTH] = '\0';
+      if (cmd[0] == '\0')
+	continue;
+
+      j = AddJob(cmd, name[0] != '\0' ? name : NULL, threads, memory);
+      if (barrier >= 0)
+	AddDependency(j, barrier);
+      for (s = after; *s != '\0'; s = *t != '\0' ? t + 1 : t)
+	{
+	  t = strchr(s, ',');
+	  if (t == NULL)
+	    t = s + strlen(s);
+	  if (t == s)
+	    continue;
+	  found = 0;
+	  for (k = 0; k < j; ++k)
+	    if (jobs[k].name != NULL &&
+		strncmp(jobs[k].name, s, t - s) == 0 &&
+		jobs[k].name[t - s] == '\0')
+	      {
+		AddDependency(j, k);
+		found = 1;
+	      }
+	  if (!found)
+	    {
+	      *t = '\0';
+	      Error("Line %d of %s runs after %s, which no earlier line names\n",
+		    lineNo, listName, s);
+	    }
+	}
+    }
+  fclose(f);
+  Log("Read %d jobs from %s\n", nJobs, listName);
+}
+
+int
+AddJob (char *command, char *name, int threads, double memory)
+{
+  Job *job;
+
+  if ((nJobs & 1023) == 0)
+    jobs = (Job *) realloc(jobs, (nJobs + 1024) * sizeof(Job));
+  job = &jobs[nJobs];
+  job->command = command != NULL ? strdup(command) : NULL;
+  job->name = name != NULL ? strdup(name) : NULL;
+  job->threads = threads;
+  job->memory = memory;
+  job->nDeps = 0;
+  job->deps = NULL;
+  job->nDependents = 0;
+  job->dependents = NULL;
+  job->nWaiting = 0;
+  job->blocked = 0;
+  job->height = 0;
+  job->state = WAITING;
+  job->node = -1;
+  if (command != NULL)
+    CheckFits(job);
+  return(nJobs++);
+}
+
+void
+AddDependency (int j, int d)
+{
+  Job *job = &jobs[j];
+  Job *dep = &jobs[d];
+
+  if ((job->nDeps & 15) == 0)
+    job->deps = (int *) realloc(job->deps, (job->nDeps + 16) * sizeof(int));
+  job->deps[job->nDeps++] = d;
+  if ((dep->nDependents & 15) == 0)
+    dep->dependents = (int *) realloc(dep->dependents,
+				      (dep->nDependents + 16) * sizeof(int));
+  dep->dependents[dep->nDependents++] = j;
+  ++job->nWaiting;
+}
+
+/* ParseMemory reads a number of MB, or of KB, MB, GB or TB if followed
+   by K, M, G or T */
+int
+ParseMemory (char *s, double *memory)
+{
+  char unit;
+  int n;
+
+  unit = 'M';
+  n = sscanf(s, "%lf%c", memory, &unit);
+  if (n < 1 || *memory < 0.0)
+    return(0);
+  switch (unit)
+    {
+    case 'k': case 'K': *memory /= 1024.0; break;
+    case 'm': case 'M': break;
+    case 'g': case 'G': *memory *= 1024.0; break;
+    case 't': case 'T': *memory *= 1024.0 * 1024.0; break;
+    default: return(0);
+    }
+  return(1);
+}
+
+/* CheckFits cuts down the hints of a job that asks for more threads or
+   memory than any node has, so that it can still be run */
+void
+CheckFits (Job *job)
+{
+  int k;
+  int maxWorkers;
+  double maxMemory;
+
+  maxWorkers = 0;
+  for (k = 0; k < nNodes; ++k)
+    if (nodes[k].nWorkers > maxWorkers)
+      maxWorkers = nodes[k].nWorkers;
+  if (job->threads > maxWorkers)
+    {
+      Log("Using %d threads instead of %d, the most workers of a node, for %s\n",
+	  maxWorkers, job->threads, job->command);
+      job->threads = maxWorkers;
+    }
+  maxMemory = 0.0;
+  for (k = 0; k < nNodes; ++k)
+    if (nodes[k].nWorkers >= job->threads && nodes[k].memory > maxMemory)
+      maxMemory = nodes[k].memory;
+  if (job->memory > maxMemory)
+    {
+      Log("Using %.0f MB instead of %.0f, the most memory of a node, for %s\n",
+	  maxMemory, job->memory, job->command);
+      job->memory = maxMemory;
+    }
+}
+
+/* Dispatch starts each ready job, in order of height, for which some
+   node has enough idle workers and memory; a job with several
+   threads runs on one worker of the node and keeps the others idle */
+void
+Dispatch ()
+{
+  int i, j, k, m;
+  int w;
+  int needed;
+  int task[2];
+  Job *job;
+
+  while (firstOrder < nJobs && jobs[order[firstOrder]].state > READY)
+    ++firstOrder;
+  for (m = firstOrder; m < nJobs; ++m)
+    {
+      j = order[m];
+      job = &jobs[j];
+      if (job->state != READY)
+	continue;
+      for (k = 0; k < nNodes; ++k)
+	if (nodes[k].nIdle >= job->threads &&
+	    nodes[k].freeMemory >= job->memory)
+	  break;
+      if (k == nNodes)
+	continue;
+
+      /* the first idle worker of the node runs the job, and the
+	 next threads-1 are held for it */
+      w = -1;
+      needed = job->threads;
+      for (i = 1; i < nWorkers + 1 && needed > 0; ++i)
+	if (workerNode[i] == k && workerJob[i] == -1)
+	  {
+	    if (w < 0)
+	      w = i;
+	    workerJob[i] = j;
+	    --needed;
+	  }
+      nodes[k].nIdle -= job->threads;
+      nodes[k].freeMemory -= job->memory;
+      job->node = k;
+      job->state = RUNNING;
+      ++nBusy;
+      Log("Delegating to worker %d (%d threads, %.0f MB): %s\n",
+	  w, job->threads, job->memory, job->command);
+      task[0] = j;
+      task[1] = job->threads;
+      if (MPI_Send(task, 2, MPI_INT, w, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+	  MPI_Send(job->command, MAX_COMMAND_LENGTH+1, MPI_CHAR,
+		   w, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+	Error("MPI_Send to worker %d failed\n", w);
+    }
+}
+
+/* FinishJob moves job j to the given state, which is READY when its
+   dependencies have all finished; when a job finishes this is passed
+   on to its dependents.  Barriers finish at once, whether or not
+   the jobs before them succeeded, and jobs with a dependency that
+   did not succeed are skipped. */
+void
+FinishJob (int j, int state)
+{
+  int *stack;
+  int *states;
+  int sp;
+  int k, d;
+  Job *job;
+
+  stack = (int *) malloc(2 * (nJobs + 1) * sizeof(int));
+  states = stack + nJobs + 1;
+  sp = 0;
+  stack[sp] = j;
+  states[sp++] = state;
+  while (sp > 0)
+    {
+      --sp;
+      job = &jobs[stack[sp]];
+      state = states[sp];
+      if (state == READY)
+	{
+	  if (job->command == NULL)
+	    state = DONE;
+	  else if (job->blocked)
+	    state = SKIPPED;
+	  else
+	    {
+	      job->state = READY;
+	      continue;
+	    }
+	}
+      job->state = state;
+      ++nFinished;
+      if (state == FAILED)
+	++nFailed;
+      else if (state == SKIPPED)
+	{
+	  ++nSkipped;
+	  if (job->command != NULL)
+	    Log("Skipping command because a dependency failed: %s\n",
+		job->command);
+	}
+      for (k = 0; k < job->nDependents; ++k)
+	{
+	  d = job->dependents[k];
+	  if (state != DONE)
+	    jobs[d].blocked = 1;
+	  if (--jobs[d].nWaiting == 0)
+	    {
+	      stack[sp] = d;
+	      states[sp++] = READY;
+	    }
+	}
+    }
+  free(stack);
+}
+
+int
+CompareHeights (const void *a, const void *b)
+{
+  int ja = *((int *) a);
+  int jb = *((int *) b);
+
+  if (jobs[ja].height != jobs[jb].height)
+    return(jobs[jb].height - jobs[ja].height);
+  return(ja - jb);
+}
+
 void Error (char *fmt, ...)
 {
   va_list args;
@@ -13,23 +13,14 @@
 int
 main (int argc, char **argv)
 {
-  int iw, ih;
-  unsigned char *img;
-  int x, y;
-  int dx, dy;
   int i;
-  int iv;
   unsigned char inputName[PATH_MAX];
   unsigned char outputName[PATH_MAX];
   char msg[PATH_MAX + 256];
   unsigned char *out = NULL;
-  float v;
   int factor;
   int ow, oh;
   int error;
-  unsigned long long liw, lih;
-  unsigned long long low, loh;
-  unsigned long long n;
 
   error = 0;
   inputName[0] = '\0';
@@ -87,47 +78,14 @@ main (int argc, char **argv)
       exit(1);
     }
 
-  img = NULL;
-  if (!ReadImage(inputName, &img,
-		 &iw, &ih,
-		 -1, -1, -1, -1,
-		 msg))
+  /* the reduction is done while reading, so that JPEG and pyramidal
+     TIFF input need not be decoded at full size */
+  out = NULL;
+  if (!ReadImageReduced(inputName, factor, &out, &ow, &oh, msg))
     {
       fprintf(stderr, "%s", msg);
       exit(1);
     }
-  ow = iw / factor;
-  oh = ih / factor;
-  liw = iw;
-  lih = ih;
-  low = ow;
-  loh = oh;
-  n = low * loh;
-  if (n == 0)
-    {
-      fprintf(stderr, "Image size was too small to reduce.\n");
-      exit(1);
-    }
-  out = (unsigned char *) malloc(n * sizeof(unsigned char));
-  memset(out, 0, n);
-	    
-  for (y = 0; y < oh; ++y)
-    for (x = 0; x < ow; ++x)
-      {
-	v = 0.0;
-	for (dy = 0; dy < factor; ++dy)
-	  for (dx = 0; dx < factor; ++dx)
-	    v += img[(factor*y+dy)*liw + factor*x+dx];
-	v /= factor * factor;
-	iv = (int) floor(v + 0.5);
-	if (iv < 0)
-	  iv = 0;
-	else if (iv > 255)
-	  iv = 255;
-	out[y * low + x] = iv;
-      }
-  free(img);
-  img = NULL;
 
   if (!WriteImage(outputName, out, ow, oh, UncompressedImage, msg))
     {
@@ -9,6 +9,8 @@
 #include <math.h>
 
 #include "imio.h"
+#include "reduction.h"
+#include "bitmap.h"
 
 int
 main (int argc, char **argv)
@@ -16,8 +18,6 @@ main (int argc, char **argv)
   unsigned long long n;
   int iw, ih;
   unsigned char *mask;
-  int x, y;
-  int dx, dy;
   int i;
   unsigned char inputName[PATH_MAX];
   unsigned char outputName[PATH_MAX];
@@ -25,14 +25,14 @@ main (int argc, char **argv)
   unsigned char *out = NULL;
   int factor;
   int ow, oh;
-  unsigned long long imbpl, ombpl;
+  unsigned long long ombpl;
   int error;
 
   error = 0;
   inputName[0] = '\0';
   outputName[0] = '\0';
   factor = 0;
-  for (i = 0; i < argc; ++i)
+  for (i = 1; i < argc; ++i)
     if (strcmp(argv[i], "-input") == 0)
       {
 	if (++i == argc)
@@ -93,27 +93,18 @@ main (int argc, char **argv)
       fprintf(stderr, "%s", msg);
       exit(1);
     }
-  imbpl = (iw + 7) >> 3;
   ow = iw / factor;
   ombpl = (ow + 7) >> 3;
   oh = ih / factor;
   n = ombpl * oh;
   out = (unsigned char *) malloc(n * sizeof(unsigned char));
-  memset(out, 0, n);
-	    
-  for (y = 0; y < oh; ++y)
-    for (x = 0; x < ow; ++x)
-      {
-	for (dy = 0; dy < factor; ++dy)
-	  for (dx = 0; dx < factor; ++dx)
-	    if (mask[(factor*y+dy)*imbpl + ((factor*x+dx) >> 3)] &
-		(0x80 >> ((factor*x+dx) & 7)))
-	      {
-		out[y*ombpl+ (x>>3)] |= 0x80 >> (x & 7);
-		goto outerLoop;
-	      }
-      outerLoop: ;
-      }
+  if (out == NULL ||
+      !(factor == 2 ? ReduceMaskOr2x2(mask, iw, ih, 0, 0, out, ow, oh) :
+	ReduceMask(mask, iw, ih, factor, 0, out)))
+    {
+      fprintf(stderr, "Could not allocate output mask\n");
+      exit(1);
+    }
   free(mask);
   mask = NULL;
 
@@ -0,0 +1,390 @@
+/*
+ * reduction.c -- defines the routines used to reduce images and
+ *                bitmap masks when building image pyramids
+ *
+ *  Copyright (c) 2009-2026 Pittsburgh Supercomputing Center,
+ *                          Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Acknowledgements:
+ *     Development of this code was supported in part by
+ *       NIH NCRR grant 5P41RR006009
+ *
+ *  HISTORY
+ *    2009     Reduction loops written by Greg Hood (ghood@psc.edu)
+ *               in register.c, reduce_mask.c and gen_pyramid.c
+ *    2026     Gathered here and given SSE2 versions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cpu.h"
+#include "reduction.h"
+
+#define MBIT(m,mbpl,ix,iy)	((m[(iy)*((size_t) (mbpl)) + ((ix) >> 3)] >> (7 - ((ix) & 7))) & 1)
+
+static int AnyBits (unsigned char *row, int start, int n);
+static int AllBits (unsigned char *row, int start, int n);
+static void ReduceMaskedPixel (float *src, int sw, int sh,
+			       unsigned char *srcMask, int smbpl,
+			       int ix, int iy,
+			       float *value, int *count);
+
+
+void
+SumPairs (unsigned char *src, int n, unsigned int *dst)
+{
+  int x = 0;
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i ones = _mm_set1_epi16(1);
+  __m128i v;
+  __m128i *d;
+
+  if (CpuHas(CPU_SSE2))
+    for (; x + 16 <= n; x += 16)
+      {
+	v = _mm_loadu_si128((__m128i *) (src + x));
+	d = (__m128i *) (dst + (x >> 1));
+	_mm_storeu_si128(d,
+			 _mm_add_epi32(_mm_loadu_si128(d),
+				       _mm_madd_epi16(_mm_unpacklo_epi8(v, zero),
+						      ones)));
+	_mm_storeu_si128(d + 1,
+			 _mm_add_epi32(_mm_loadu_si128(d + 1),
+				       _mm_madd_epi16(_mm_unpackhi_epi8(v, zero),
+						      ones)));
+      }
+#endif
+  for (; x < n; ++x)
+    dst[x >> 1] += src[x];
+}
+
+void
+SumPairsUInt (unsigned int *src, int n, unsigned int *dst)
+{
+  int x = 0;
+#if defined(__SSE2__)
+  __m128 a, b;
+  __m128i *d;
+
+  if (CpuHas(CPU_SSE2))
+    for (; x + 8 <= n; x += 8)
+      {
+	a = _mm_castsi128_ps(_mm_loadu_si128((__m128i *) (src + x)));
+	b = _mm_castsi128_ps(_mm_loadu_si128((__m128i *) (src + x + 4)));
+	d = (__m128i *) (dst + (x >> 1));
+	_mm_storeu_si128(d,
+			 _mm_add_epi32(_mm_loadu_si128(d),
+				       _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, 0x88)),
+						     _mm_castps_si128(_mm_shuffle_ps(a, b, 0xdd)))));
+      }
+#endif
+  for (; x < n; ++x)
+    dst[x >> 1] += src[x];
+}
+
+int
+ReduceMask (unsigned char *src, int sw, int sh, int factor, int all,
+	    unsigned char *dst)
+{
+  int sbpl, dbpl;
+  int dw, dh;
+  int x, y, dy;
+  int i;
+  unsigned char *row;
+  unsigned char *s;
+
+  sbpl = (sw + 7) >> 3;
+  dw = sw / factor;
+  dh = sh / factor;
+  dbpl = (dw + 7) >> 3;
+  memset(dst, 0, ((size_t) dh) * dbpl);
+  if (dw == 0)
+    return(1);
+  row = (unsigned char *) malloc(sbpl);
+  if (row == NULL)
+    return(0);
+
+  for (y = 0; y < dh; ++y)
+    {
+      /* combine the factor source rows of this output row, so that the
+	 blocks only have to be examined along one row */
+      memcpy(row, &src[((size_t) y) * factor * sbpl], sbpl);
+      for (dy = 1; dy < factor; ++dy)
+	{
+	  s = &src[(((size_t) y) * factor + dy) * sbpl];
+	  i = 0;
+#if defined(__SSE2__)
+	  if (!CpuHas(CPU_SSE2))
+	    ;
+	  else if (all)
+	    for (; i + 16 <= sbpl; i += 16)
+	      _mm_storeu_si128((__m128i *) (row + i),
+			       _mm_and_si128(_mm_loadu_si128((__m128i *) (row + i)),
+					     _mm_loadu_si128((__m128i *) (s + i))));
+	  else
+	    for (; i + 16 <= sbpl; i += 16)
+	      _mm_storeu_si128((__m128i *) (row + i),
+			       _mm_or_si128(_mm_loadu_si128((__m128i *) (row + i)),
+					    _mm_loadu_si128((__m128i *) (s + i))));
+#endif
+	  if (all)
+	    for (; i < sbpl; ++i)
+	      row[i] &= s[i];
+	  else
+	    for (; i < sbpl; ++i)
+	      row[i] |= s[i];
+	}
+
+      for (x = 0; x < dw; ++x)
+	if (all ? AllBits(row, x * factor, factor) :
+	    AnyBits(row, x * factor, factor))
+	  dst[((size_t) y) * dbpl + (x >> 3)] |= 0x80 >> (x & 7);
+    }
+  free(row);
+  return(1);
+}
+
+int
+ReduceImage (unsigned char *src, int sw, int sh, int factor,
+	     unsigned char *dst)
+{
+  int dw, dh;
+  int x, y, dy;
+  int i;
+  unsigned int half;
+  unsigned int *sum;
+  unsigned char *s;
+
+  dw = sw / factor;
+  dh = sh / factor;
+  if (dw == 0)
+    return(1);
+  sum = (unsigned int *) malloc(dw * sizeof(unsigned int));
+  if (sum == NULL)
+    return(0);
+  half = (factor * factor) / 2;
+  for (y = 0; y < dh; ++y)
+    {
+      /* the block sums are accumulated a source row at a time */
+      memset(sum, 0, dw * sizeof(unsigned int));
+      for (dy = 0; dy < factor; ++dy)
+	{
+	  s = &src[(((size_t) y) * factor + dy) * sw];
+	  for (x = 0; x < dw; ++x, s += factor)
+	    for (i = 0; i < factor; ++i)
+	      sum[x] += s[i];
+	}
+      for (x = 0; x < dw; ++x)
+	dst[((size_t) y) * dw + x] = (sum[x] + half) / (factor * factor);
+    }
+  free(sum);
+  return(1);
+}
+
+static int
+AnyBits (unsigned char *row, int start, int n)
+{
+  int end = start + n;
+
+  for (; start < end && (start & 7) != 0; ++start)
+    if (row[start >> 3] & (0x80 >> (start & 7)))
+      return(1);
+  for (; start + 8 <= end; start += 8)
+    if (row[start >> 3] != 0)
+      return(1);
+  for (; start < end; ++start)
+    if (row[start >> 3] & (0x80 >> (start & 7)))
+      return(1);
+  return(0);
+}
+
+static int
+AllBits (unsigned char *row, int start, int n)
+{
+  int end = start + n;
+
+  for (; start < end && (start & 7) != 0; ++start)
+    if (!(row[start >> 3] & (0x80 >> (start & 7))))
+      return(0);
+  for (; start + 8 <= end; start += 8)
+    if (row[start >> 3] != 0xff)
+      return(0);
+  for (; start < end; ++start)
+    if (!(row[start >> 3] & (0x80 >> (start & 7))))
+      return(0);
+  return(1);
+}
+
+void
+ReduceMaskedFloat2x2 (float *src, int sw, int sh,
+		      unsigned char *srcMask,
+		      int dx, int dy,
+		      float *dst, int dw, int dh,
+		      unsigned char *dstMask,
+		      int strict)
+{
+  int smbpl, dmbpl;
+  int x, y;
+  int iy;
+  int xLo, xHi;
+  int count;
+  float value;
+  float *d;
+  unsigned char *dm;
+#if defined(__SSE2__)
+  static const double recip[5] = { 0.0, 1.0 / 1, 1.0 / 2, 1.0 / 3, 1.0 / 4 };
+  static const unsigned char pairCount[4] = { 0, 1, 1, 2 };
+  float *r0, *r1;
+  __m128 a0, b0, a1, b1, s;
+  __m128d lo, hi;
+  __m128i keep;
+  int ix;
+  int sx, sh0, bits0, bits1;
+  unsigned char *m0, *m1;
+  int k;
+  int counts[4];
+  int sse2 = CpuHas(CPU_SSE2);
+#endif
+
+  smbpl = (sw + 7) >> 3;
+  dmbpl = (dw + 7) >> 3;
+  memset(dstMask, 0, ((size_t) dh) * dmbpl);
+
+  /* output columns whose 2x2 source blocks lie entirely within src */
+  xLo = dx >= 0 ? 0 : (1 - dx) / 2;
+  xHi = (sw - 2 - dx) >= 0 ? (sw - 2 - dx) / 2 + 1 : 0;
+  if (xHi > dw)
+    xHi = dw;
+  if (xLo > xHi)
+    xLo = xHi;
+
+  for (y = 0; y < dh; ++y)
+    {
+      iy = 2 * y + dy;
+      d = &dst[((size_t) y) * dw];
+      dm = &dstMask[((size_t) y) * dmbpl];
+      x = 0;
+#if defined(__SSE2__)
+      if (sse2 && iy >= 0 && iy + 1 < sh)
+	{
+	  for (; x < xLo; ++x)
+	    {
+	      ReduceMaskedPixel(src, sw, sh, srcMask, smbpl,
+				2 * x + dx, iy, &d[x], &count);
+	      if (strict ? count == 4 : count > 0)
+		dm[x >> 3] |= 0x80 >> (x & 7);
+	    }
+	  r0 = &src[((size_t) iy) * sw];
+	  r1 = r0 + sw;
+	  m0 = &srcMask[((size_t) iy) * smbpl];
+	  m1 = m0 + smbpl;
+	  for (; x + 4 <= xHi; x += 4)
+	    {
+	      ix = 2 * x + dx;
+	      a0 = _mm_loadu_ps(r0 + ix);
+	      b0 = _mm_loadu_ps(r0 + ix + 4);
+	      a1 = _mm_loadu_ps(r1 + ix);
+	      b1 = _mm_loadu_ps(r1 + ix + 4);
+	      /* add in the same order as the pixel-by-pixel loop so
+		 the results are identical */
+	      s = _mm_add_ps(_mm_shuffle_ps(a0, b0, 0x88),
+			     _mm_shuffle_ps(a0, b0, 0xdd));
+	      s = _mm_add_ps(s, _mm_shuffle_ps(a1, b1, 0x88));
+	      s = _mm_add_ps(s, _mm_shuffle_ps(a1, b1, 0xdd));
+
+	      /* gather the 8 mask bits under the 4 blocks */
+	      sx = ix >> 3;
+	      sh0 = ix & 7;
+	      if (sh0 == 0)
+		{
+		  bits0 = m0[sx];
+		  bits1 = m1[sx];
+		}
+	      else
+		{
+		  bits0 = ((m0[sx] << 8 | m0[sx+1]) >> (8 - sh0)) & 0xff;
+		  bits1 = ((m1[sx] << 8 | m1[sx+1]) >> (8 - sh0)) & 0xff;
+		}
+	      for (k = 0; k < 4; ++k)
+		{
+		  counts[k] = pairCount[(bits0 >> (6 - 2*k)) & 3] +
+		    pairCount[(bits1 >> (6 - 2*k)) & 3];
+		  if (strict ? counts[k] == 4 : counts[k] > 0)
+		    dm[(x + k) >> 3] |= 0x80 >> ((x + k) & 7);
+		}
+
+	      lo = _mm_mul_pd(_mm_cvtps_pd(s),
+			      _mm_set_pd(recip[counts[1]], recip[counts[0]]));
+	      hi = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(s, s)),
+			      _mm_set_pd(recip[counts[3]], recip[counts[2]]));
+	      keep = _mm_cmpgt_epi32(_mm_set_epi32(counts[3], counts[2],
+						   counts[1], counts[0]),
+				     _mm_setzero_si128());
+	      _mm_storeu_ps(d + x,
+			    _mm_and_ps(_mm_movelh_ps(_mm_cvtpd_ps(lo),
+						     _mm_cvtpd_ps(hi)),
+				       _mm_castsi128_ps(keep)));
+	    }
+	}
+#endif
+      for (; x < dw; ++x)
+	{
+	  ReduceMaskedPixel(src, sw, sh, srcMask, smbpl,
+			    2 * x + dx, iy, &value, &count);
+	  d[x] = value;
+	  if (strict ? count == 4 : count > 0)
+	    dm[x >> 3] |= 0x80 >> (x & 7);
+	}
+    }
+}
+
+static void
+ReduceMaskedPixel (float *src, int sw, int sh,
+		   unsigned char *srcMask, int smbpl,
+		   int ix, int iy,
+		   float *value, int *count)
+{
+  int sx, sy;
+  float v = 0.0;
+  int n = 0;
+
+  for (sy = iy; sy < iy + 2; ++sy)
+    {
+      if (sy < 0 || sy >= sh)
+	continue;
+      for (sx = ix; sx < ix + 2; ++sx)
+	{
+	  if (sx < 0 || sx >= sw)
+	    continue;
+	  v += src[((size_t) sy) * sw + sx];
+	  n += MBIT(srcMask, smbpl, sx, sy);
+	}
+    }
+  if (n > 0)
+    v *= 1.0 / n;
+  else
+    v = 0.0;
+  *value = v;
+  *count = n;
+}
@@ -0,0 +1,52 @@
+//
+// reduction.h - functions to reduce images and bitmap masks by
+//               integer factors, shared by the tools that build
+//               image pyramids
+//
+#ifndef REDUCTION_H
+#define REDUCTION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SumPairs adds each pair of adjacent pixels of the n-pixel row src
+   into one element of dst (dst[x/2] += src[x]); SumPairsUInt does the
+   same for a row of sums */
+void SumPairs (unsigned char *src, int n, unsigned int *dst);
+void SumPairsUInt (unsigned int *src, int n, unsigned int *dst);
+
+/* ReduceMask reduces the sw x sh packed bitmap src by factor into the
+   (sw/factor) x (sh/factor) bitmap dst, setting each bit of dst if any
+   (or, if all is nonzero, every) bit of its factor x factor block is
+   set; rows of both bitmaps are padded to whole bytes; returns 0 if
+   it could not allocate its working row */
+int ReduceMask (unsigned char *src, int sw, int sh, int factor, int all,
+		unsigned char *dst);
+
+/* ReduceImage reduces the sw x sh image src by factor into the
+   (sw/factor) x (sh/factor) image dst, each of whose pixels is the
+   rounded mean of a factor x factor block, as ReadImageReduced
+   computes it; returns 0 if it could not allocate its working row */
+int ReduceImage (unsigned char *src, int sw, int sh, int factor,
+		 unsigned char *dst);
+
+/* ReduceMaskedFloat2x2 makes the next level of a masked float image
+   pyramid: pixel (x, y) of the dw x dh image dst is the mean of the
+   pixels of src at columns 2x+dx..2x+dx+1 and rows 2y+dy..2y+dy+1
+   (dx and dy being 0 or 1) that lie within src, divided by the number
+   of those that are set in srcMask instead of by their number, or 0
+   if none are set; the bit for (x, y) in dstMask is set if any (or if
+   strict is nonzero, all four) of them are set */
+void ReduceMaskedFloat2x2 (float *src, int sw, int sh,
+			   unsigned char *srcMask,
+			   int dx, int dy,
+			   float *dst, int dw, int dh,
+			   unsigned char *dstMask,
+			   int strict);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REDUCTION_H */
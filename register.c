@@ -36,10 +36,10 @@
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
-#include <mpi.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -48,21 +48,32 @@
 #include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define GRAPHICS 0
 
 #if GRAPHICS
 #include <GL/glut.h>
-#include <pthread.h>
 #endif
 
 #include "imio.h"
 #include "dt.h"
+#include "reduction.h"
+#include "correlation.h"
+#include "bitmap.h"
 #include "par.h"
+#include "metrics.h"
+#include "pool.h"
+#include "linesort.h"
+#include "gpu_moves.h"
 
 #define DEBUG_MOVES	0
 #define MASKING		1
 #define FOLDING		0
+#define TILED_REFERENCE	0	/* sample the reference from 64x64 tiles */
 
 #define MAX_LEVELS	32       /* max image size (w or h) is 2^MAX_LEVELS */
 
@@ -71,14 +82,94 @@
 #define AFFINE_METHOD		2
 #define QUADRATIC_METHOD	3
 
+#define CIRCULAR_KERNEL		0
+#define BOX_KERNEL		1
+
+/* the similarity metrics; for the first three the energy is the
+   correlation of the two images over the overlap, but GRADIENT_METRIC
+   and RANK_METRIC first replace every level of both images by a
+   feature image, made by their entries of metricFeatures[];
+   NGF_METRIC is the mean squared dot product of the normalized
+   gradient fields of the two images, and MI_METRIC the normalized
+   mutual information of their joint histogram of MI_BINS x MI_BINS
+   intensity bins */
+#define CORRELATION_METRIC	0
+#define GRADIENT_METRIC		1
+#define RANK_METRIC		2
+#define NGF_METRIC		3
+#define MI_METRIC		4
+#define N_METRICS		5
+
+#define MI_BINS			32
+
+/* the kinds of task; with -split, a pair too big for one task is
+   registered down to its split level from images reduced to that
+   level (SPLIT_COARSE), then by overlapping parts of its image at the
+   finer levels, each starting from the coarse map (SPLIT_PART), and
+   the maps of the parts are blended into its map (SPLIT_STITCH) */
+#define SPLIT_NONE		0
+#define SPLIT_COARSE		1
+#define SPLIT_PART		2
+#define SPLIT_STITCH		3
+
+/* the passes of -adaptive; every pair is first registered at the
+   cheaper -adaptive_depth and -adaptive_quality (PASS_CHEAP), and
+   those whose correlation falls short of the -adaptive threshold are
+   registered again at -depth and -quality (PASS_RETRY) */
+#define PASS_FULL		0
+#define PASS_CHEAP		1
+#define PASS_RETRY		2
+
+#define OUTPUT_MAP		0
+#define OUTPUT_IMAGE		1
+#define OUTPUT_SCORE		2
+#define MAX_WRITE_QUEUE		64
+
+/* h log h for a histogram count h, as summed in a JointHistogram */
+#define HLOGH(h)	((h) > 0 ? (h) * log((double) (h)) : 0.0)
+
 #define IMAGE(i,w,ix,iy)		i[(iy)*((size_t) w) + (ix)]
 #define MASK(m,mbpl,ix,iy)		(m[(iy)*((size_t) mbpl) + ((ix) >> 3)] & (0x80 >> ((ix) & 7)))
+/* the mask bits at (ix,iy) and (ix+1,iy) as a 2-bit value, with (ix,iy) in the high bit */
+#define MASK2(m,mbpl,ix,iy)		((((ix) & 7) != 7) ? \
+					 ((m[(iy)*((size_t) mbpl) + ((ix) >> 3)] >> (6 - ((ix) & 7))) & 3) : \
+					 (((m[(iy)*((size_t) mbpl) + ((ix) >> 3)] & 1) << 1) | \
+					  (m[(iy)*((size_t) mbpl) + ((ix) >> 3) + 1] >> 7)))
 #define SETMASKBIT(m,mbpl,ix,iy)  	m[(iy)*((size_t) mbpl) + ((ix) >> 3)] |= 0x80 >> ((ix) & 7)
 #define CLEARMASKBIT(m,mbpl,ix,iy)  	m[(iy)*((size_t) mbpl) + ((ix) >> 3)] &= ~(0x80 >> ((ix) & 7))
+/* the moves sample the reference image and mask at scattered points,
+   so with TILED_REFERENCE Compute() reads them from copies laid out
+   in 64x64 tiles, each contiguous in memory (tw is the width of the
+   copy in tiles); the mask tiles hold 8 bytes per row.  This only
+   pays when the map is far from row-preserving (e.g., sections rotated
+   by large angles); for nearly aligned sections the row-major reads
+   are already sequential and the tile arithmetic costs about 10%. */
+#define TILE_SHIFT			6
+#define TILE_MASK			((1 << TILE_SHIFT) - 1)
+#define TILE_OFFSET(tw,ix,iy)		(((((size_t) ((iy) >> TILE_SHIFT)) * (tw) + ((ix) >> TILE_SHIFT)) << (2 * TILE_SHIFT)) + \
+					 (((iy) & TILE_MASK) << TILE_SHIFT) + ((ix) & TILE_MASK))
+#if TILED_REFERENCE
+#define REF(r,tw,w,ix,iy)		r[TILE_OFFSET(tw,ix,iy)]
+#define REFMASK(m,tw,mbpl,ix,iy)	(m[TILE_OFFSET(tw,ix,iy) >> 3] & (0x80 >> ((ix) & 7)))
+#else
+#define REF(r,tw,w,ix,iy)		IMAGE(r,w,ix,iy)
+#define REFMASK(m,tw,mbpl,ix,iy)	MASK(m,mbpl,ix,iy)
+#endif
+/* whether the bilinear sample at (irx + rrx, iry + rry) touches a
+   masked-out pixel of the reference; m2 is the mask AND-ed with its
+   shifts (see AndMask2x2), which settles it with one bit test unless
+   the sample lies on the top or left edge of its square of pixels */
+#define SAMPLE_MASKED(m,m2,tw,mbpl,irx,iry,rrx,rry) \
+  ((REFMASK(m2,tw,mbpl,irx,iry)) == 0 && \
+   (((rrx) > 0.0 && (rry) > 0.0) || \
+    (REFMASK(m,tw,mbpl,irx,iry)) == 0 || \
+    ((rrx) > 0.0 && (REFMASK(m,tw,mbpl,(irx) + 1,iry)) == 0) || \
+    ((rry) > 0.0 && (REFMASK(m,tw,mbpl,irx,(iry) + 1)) == 0)))
 #define MAP(map,w,ix,iy)		map[(iy)*((size_t) w) + (ix)]
 #define GETMAP(map,w,ix,iy,xv,yv,cv)	{ MapElement *e = &MAP(map,w,ix,iy); *(xv) = e->x; *(yv) = e->y; *(cv) = e->c; }
 #define SETMAP(map,w,ix,iy,xv,yv,cv)	{ MapElement *e = &MAP(map,w,ix,iy); e->x = xv; e->y = yv; e->c = cv; }
 #define LINE_LENGTH	255
+#define RESULT_SORT_LINES	65536	/* results sorted in memory at once */
 
 
 typedef struct Context {
@@ -91,6 +182,7 @@ typedef struct Context {
   int strictMasking;
 
   char cptsName[PATH_MAX];
+  char roiName[PATH_MAX];
   char initialMapName[PATH_MAX];
   char constrainingMapName[PATH_MAX];
 
@@ -104,6 +196,7 @@ typedef struct Context {
 
   int startLevel;
   int outputLevel;
+  int previewLevel;		/* -1 = register down to outputLevel */
   int minResolution;
   int depth;
   int cptsMethod;
@@ -117,24 +210,66 @@ typedef struct Context {
   double minOverlap;
   double trimMapSourceThreshold;
   double trimMapTargetThreshold;
+  double stopAcceptance;	/* 0 = always use the whole move budget */
+  double stopEnergy;
+  int refineSweeps;		/* 0 = random moves only */
+  double refinePolish;		/* fraction of the move budget spent on
+				   random moves after -refine */
+  int roiMargin;		/* in pixels */
 
   int correlationHalfWidth;
+  int correlationKernel;
+  int metric;
+  double ngfEdge;		/* 0 = the mean gradient magnitude */
   int writeAllMaps;
   int update;
   int partial;
   int nWorkers;
+  int nThreads;
+  int gpu;			/* evaluate the random moves on a GPU */
+  int writeQueue;		/* outputs a worker may have pending; 0 =
+				   write them synchronously */
+  int mapCompression;		/* enum MapCompression of the output maps */
+  int mapLevels;		/* coarser copies stored with each map */
+  int pyramidCacheSize;		/* in megabytes; 0 = no cache */
+  int pyramidBits;		/* bits per stored pyramid pixel: 8, 16,
+				   or 32 (float) */
+  int splitSize;		/* with -split, the largest width or height
+				   (in pixels) of image registered in one
+				   task; 0 = never split */
+  int splitOverlap;		/* overlap of the parts, in pixels */
+  double adaptiveCorrelation;	/* with -adaptive, the correlation below
+				   which a pair of the cheap pass is
+				   registered again */
+  int adaptiveDepth;		/* the -depth and -quality */
+  double adaptiveQuality;	/*   of the cheap pass */
+  int adaptiveWarm;		/* whether the retry of a pair starts from
+				   its map of the cheap pass */
+  int memoryBudget;		/* with -memory, the megabytes a worker may
+				   use for a task, its pyramid cache
+				   included; 0 = no limit */
 } Context;
 
 typedef struct Pair {
   char *imageName[2];
   int imageMinX[2], imageMaxX[2], imageMinY[2], imageMaxY[2];
   char *pairName;
+  char *warmName[2];		/* with -warm_start, the finished maps to
+				   compose into the initial map, or NULL */
 } Pair;
 
 typedef struct Task {
   /* NOTE: any new fields added to this struct should
      be also added to PackTask and UnpackTask */ 
-  Pair pair;
+  Pair pair;			/* the pair being registered */
+  int nGroup;			/* the pairs of the task; more than one */
+  Pair *group;			/*   with -group                        */
+  int split;			/* SPLIT_NONE, or the stage of a split pair */
+  int splitLevel;		/* the level the split pair is split at */
+  int splitPart;		/* the index of the part (SPLIT_PART) */
+  int splitSize;		/* the part size and overlap the split */
+  int splitOverlap;		/*   pair is cut with */
+  int pass;			/* PASS_FULL, or the pass of -adaptive */
 } Task;
 
 typedef struct Result {
@@ -144,9 +279,25 @@ typedef struct Result {
   double correlation;
   double correspondence;
   double constraining;
+  int pass;			/* the pass of -adaptive the map was made
+				   at */
+  double memoryNeeded;		/* with -memory, the megabytes the pair
+				   was estimated to need if that is more
+				   than a worker may use (and no map was
+				   made), else 0 */
   char *message;
 } Result;
 
+/* a pair that is registered by parts (see -split) */
+typedef struct SplitPair {
+  Pair pair;
+  int level;			/* the split level */
+  int size;			/* the -split size and overlap of its */
+  int overlap;			/*   parts */
+  int nParts;
+  int current;			/* whether its map was found up-to-date */
+} SplitPair;
+
 typedef struct CPoint {
   float ix, iy;
   float rx, ry;
@@ -154,21 +305,238 @@ typedef struct CPoint {
   double newEnergy;
 } CPoint;
 
+/* running sums that make up the energy of a map; these are additive
+   over disjoint regions of the map, so that each move thread can
+   accumulate its own deltas and have them merged between phases */
+typedef struct MoveSums {
+  long nPoints;
+  double si, si2, sr, sr2, sir;
+  double sg;			/* with -metric ngf, the sum of the
+				   squared gradient dot products */
+  double distortion;
+  double correspondence;
+  double constraining;
+} MoveSums;
+
+/* with -metric mi, the joint histogram of the image and reference
+   intensities over the overlap, with the sums of h log h over its
+   bins and over those of its two marginal histograms, from which the
+   entropies follow */
+typedef struct JointHistogram {
+  long n;
+  long joint[MI_BINS * MI_BINS];	/* indexed by image bin * MI_BINS +
+					   reference bin */
+  long image[MI_BINS];
+  long ref[MI_BINS];
+  double sJoint, sImage, sRef;
+} JointHistogram;
+
+/* the changes to a JointHistogram that a move would make; touched
+   lists the joint bins that have been changed, so that only those
+   need be looked at when the move is evaluated */
+typedef struct HistogramDelta {
+  long n;
+  int joint[MI_BINS * MI_BINS];
+  int image[MI_BINS];
+  int ref[MI_BINS];
+  unsigned char marked[MI_BINS * MI_BINS];
+  int nTouched;
+  short touched[MI_BINS * MI_BINS];
+} HistogramDelta;
+
+/* the per-level state shared by all move threads; everything except
+   the map, prop, and cpts arrays is read-only while a phase runs */
+typedef struct MoveState {
+  int nThreads;
+  int level;
+  int factor;
+  int mpw, mph;
+  int mox, moy;
+  int rMinX, rMaxX, rMinY, rMaxY;	/* the map points to move */
+  MapElement *map;
+  MapElement *prop;
+  MapElement *mapCons;
+  float *cimage, *cref;
+  unsigned char *cimask, *crmask;
+  float *tref;			/* cref and crmask as read by REF() */
+  unsigned char *trmask;	/*   and REFMASK() */
+  unsigned char *trmask2;	/* trmask AND-ed with its shifts */
+  int rtw;
+  float *ingf, *rngf;		/* with -metric ngf, the normalized
+				   gradient fields of cimage and cref */
+  JointHistogram *hist;		/* with -metric mi, the global joint
+				   histogram */
+  size_t icmbpl, rcmbpl;
+  unsigned int iw, ih, rw, rh;
+  int imgox, imgoy, refox, refoy;
+  double *nomL0, *nomL1, *nomL2, *nomL3;
+  double *nomThetaX, *nomThetaY;
+  double lFactor, kFactor;
+  size_t requiredPoints;
+  long dPoints;
+  double logMinRadius, logRadiusRange;
+  double udLimit, diagLimit;
+  int tileSize;
+  int ntx, nty;
+  size_t nSweeps;
+  char *tileActive;		/* with -stop_acceptance, the tiles to */
+  size_t *tileMoves;		/*   sweep next, and the moves tried and */
+  size_t *tileAccepted;		/*   accepted in each this sweep */
+  int focusing;
+  double sweepEnergy;
+  int refine;			/* whether the sweeps are RefineMove()s */
+  double refineStep;		/* its finite difference step */
+  size_t sweepAccepted;		/* steps taken before this sweep */
+  int done;
+  pthread_barrier_t barrier;
+  struct MoveThread *threads;
+  MoveSums g;			/* global sums (without the 255.0 padding) */
+  double correlation;
+  double energy;
+} MoveState;
+
+typedef struct MoveThread {
+  MoveState *ms;
+  int id;
+  pthread_t thread;
+  size_t sweep;			/* the sweep being made */
+  MoveSums d;			/* deltas accepted during this phase */
+  JointHistogram hist;		/* with -metric mi, the global histogram
+				   plus the moves accepted this phase */
+  HistogramDelta hdelta;	/*   and the changes of the move being
+				   tried */
+  double correlation;
+  double energy;
+  size_t moveCount;
+  size_t acceptedMoveCount;
+  size_t statLogRadius[21];
+  size_t statTheta[21];
+  double statDeltaE[21];
+} MoveThread;
+
+/* a band of rows of the output map being trimmed by TrimOutputMap */
+typedef struct TrimBand {
+  pthread_t thread;
+  int started;			/* whether thread was started */
+  int pass;			/* 0 to trim the quadrilaterals, 1 to
+				   invalidate the map points */
+  int y0, y1;			/* the rows of this band are y0..y1-1 */
+  MapElement *map;
+  unsigned char *validArray;
+  int mpw, mph, mox, moy;
+  int factor;
+  unsigned int iw, ih;
+  int imgox, imgoy;
+  unsigned int rw, rh;
+  int refox, refoy;
+  unsigned char *cimask;
+  unsigned char *crmask;
+} TrimBand;
+
+/* identifies a masked image pyramid held in the worker's cache */
+typedef struct PyramidKey {
+  char imageName[PATH_MAX];
+  char maskName[PATH_MAX];
+  int minX, maxX, minY, maxY;
+  time_t imageMTime, maskMTime;
+  int strictMasking;
+  int bits;
+} PyramidKey;
+
+typedef struct PyramidCacheEntry {
+  PyramidKey key;
+  int nLevels;
+  int width[MAX_LEVELS], height[MAX_LEVELS];
+  int offsetX[MAX_LEVELS], offsetY[MAX_LEVELS];
+  float *images[MAX_LEVELS];
+  void *packed[MAX_LEVELS];
+  double scale[MAX_LEVELS], bias[MAX_LEVELS];
+  unsigned char *masks[MAX_LEVELS];
+  size_t bytes;
+  unsigned long lastUse;
+  int inUse;			/* in use by the current task */
+} PyramidCacheEntry;
+
+/* the input files of a task that were read ahead of time */
+typedef struct PrefetchedImage {
+  char imageName[PATH_MAX];
+  char maskName[PATH_MAX];
+  int minX, maxX, minY, maxY;
+  int wanted;
+  int imageRead;
+  unsigned char *image;
+  int width, height;
+  int maskRead;
+  unsigned char *mask;
+  int maskWidth, maskHeight;
+} PrefetchedImage;
+
+/* an output file handed to the background writer; data (the map
+   elements, the pixels or the text of a score file) is freed once it
+   is written */
+typedef struct PendingOutput {
+  int kind;
+  char fn[PATH_MAX];
+  void *data;
+  int level;
+  int width, height;
+  int xMin, yMin;
+  int previewLevel;
+  char imageName[PATH_MAX], referenceName[PATH_MAX];
+} PendingOutput;
+
+typedef struct PrefetchedTask {
+  char pairName[PATH_MAX];
+  pthread_t thread;
+  int joined;
+  PrefetchedImage images[2];
+} PrefetchedTask;
+
 /* GLOBAL VARIABLES FOR MASTER */
 int nResults = 0;
+int keepResults = 0;		/* whether results are held (for -warm_start
+				   and -watch) */
+int nKeptResults = 0;
 Result* results = 0;
 #define DIR_HASH_SIZE	8192
 char *dirHash[DIR_HASH_SIZE];
 char summaryName[PATH_MAX] = "";
+char resultStreamName[PATH_MAX + 16] = "";
+FILE *resultStream = NULL;	/* each result, as it comes back */
 int vis = 0;
+SplitPair *splitPairs = NULL;	/* the pairs of the batch registered by */
+int nSplitPairs = 0;		/*   parts */
+Pair *retryPairs = NULL;	/* the pairs of the batch that -adaptive */
+int nRetryPairs = 0;		/*   registers again */
+int nRetried = 0;		/* and of the run */
+Pair *oversizedPairs = NULL;	/* the pairs of the batch that did not */
+int nOversizedPairs = 0;	/*   fit in a worker's -memory */
+double *oversizedMemory = NULL;	/* and the megabytes each needed */
+int nUnregistered = 0;		/* the pairs of the run that could not be
+				   made to fit */
 
 /* GLOBAL VARIABLES FOR MASTER & WORKER */
 Context c;
 Task t;
 Result r;
+int nGroupResults = 0;		/* one result per pair of the task */
+Result *groupResults = NULL;
+int resultSplit = SPLIT_NONE;	/* the kind of task the results are of */
 FILE *logFile = NULL;
 
 /* GLOBAL VARIABLES FOR WORKER */
+PendingOutput pendingOutputs[MAX_WRITE_QUEUE]; /* ring of outputs waiting
+						   for the writer thread */
+int firstPendingOutput = 0;
+int nPendingOutputs = 0;
+pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t outputReady = PTHREAD_COND_INITIALIZER;
+pthread_cond_t outputSpace = PTHREAD_COND_INITIALIZER;
+pthread_t outputWriter;
+int outputWriterRunning = 0;
+int outputWriterStop = 0;
+uint32_t moveKey[2];			/* key of the random moves of the
+					   pair being registered */
 int nLevels;                         /* number of resolution levels;
 					0 = finest resolution */
 int imageWidth[2][MAX_LEVELS],       /* image/reference width/height at */
@@ -178,6 +546,9 @@ int imageOffsetX[2][MAX_LEVELS],     /* the amount each image is offset from */
 		                     /*   level */
 float* images[2][MAX_LEVELS];        /* images to be warped (at various */
                                      /*    resolution levels) */
+void* packedImages[2][MAX_LEVELS];   /* with -pyramid_storage 8 or 16, the */
+double imageScale[2][MAX_LEVELS];    /*   levels are kept only as codes, */
+double imageBias[2][MAX_LEVELS];     /*   pixel = bias + scale * code */
 unsigned char *masks[2][MAX_LEVELS]; /* masks of images to be warped */
 unsigned char *idisc[2][MAX_LEVELS]; /* image discontinuity masks */
 
@@ -208,6 +579,34 @@ int offxc, offyc;
 
 int nCpts = 0;
 CPoint *cpts = 0;
+int cptsCellWidth;		/* the index of cpts by map cell at the */
+int *cptsCellStart = NULL;	/*   current level (see IndexCpts) */
+int *cptsCellPoint = NULL;
+
+int roiMinX = -1, roiMaxX, roiMinY, roiMaxY; /* the region of interest,
+						in image pixels, or -1 */
+int levelShift = 0;			/* levels by which the images of the
+					   task were reduced when read (the
+					   coarse pass of a split pair) */
+Context savedContext;			/* c as broadcast, while a split
+					   task or a pass of -adaptive runs
+					   with its own */
+
+PyramidCacheEntry *pyramidCache = 0;
+int nPyramidCache = 0;
+unsigned long pyramidCacheClock = 0;
+PyramidKey pyramidKeys[2];           /* keys of the current task's images */
+int pyramidCacheIndex[2];            /* cache entry supplying each image,
+					or -1 */
+int cachedLevels[2];                 /* number of levels of each image
+					supplied by the cache */
+
+#define MAX_PREFETCHED_TASKS	2
+PrefetchedTask *prefetchedTasks[MAX_PREFETCHED_TASKS];
+int nPrefetchedTasks = 0;
+
+int gpuReady = 0;			/* with -gpu, 1 once the GPU is set
+					   up, -1 if it can not be used */
 
 int windowWidth = 1024;
 int windowHeight = 1024;
@@ -218,49 +617,137 @@ void MasterTask (int argc, char **argv, char **envp);
 void MasterResult ();
 void WorkerContext ();
 void WorkerTask ();
+void TaskDeps (char *params);
+void RegisterPair ();
 void PackContext ();
 void UnpackContext ();
 void PackTask ();
 void UnpackTask ();
+int UnpackTaskHeader (Task *tp);
+void PackPair (Pair *p);
+void CopyPair (Pair *dst, Pair *src);
+int SharesImage (Pair *p, Pair *q);
+void PlanTasks (Pair *pairs, int nPairs, int groupSize);
+void ScanPairImages (Pair *pairs, int nPairs);
+void FindWarmMaps (Pair *p, Pair *pairs, int nPairs, char *warmMaps);
+int SeparateSplitPairs (Pair *pairs, int nPairs);
+void RegisterSplitPairs (Pair *pairs, int nPairs, int warmStart,
+			 char *warmMaps);
+void AddRetryPair (Pair *p);
+void RetryAdaptivePairs (Pair *pairs, int nPairs, int warmStart,
+			 char *warmMaps);
+void DelegateSplitTask (SplitPair *sp, int split, int part);
+void AddOversizedPair (Pair *p, double memoryNeeded);
+void RegisterOversizedPairs (Pair *pairs, int nPairs, int warmStart,
+			     char *warmMaps);
+double PixelBytes (int bits);
+double MapBytes (int width, int height);
+double TaskMemory (Pair *p);
+void SetTaskNeeds ();
+int FitMemoryBudget (char *mapName);
+int CropToOverlap (char *mapName);
+int PairRegion (Pair *p, int imi, int *minX, int *maxX, int *minY, int *maxY);
+void SplitGrid (int minX, int maxX, int minY, int maxY, int *ntx, int *nty);
+void SplitWindow (int minX, int maxX, int minY, int maxY, int k,
+		  int *wMinX, int *wMaxX, int *wMinY, int *wMaxY);
+int BeginSplitTask (char *outputName, char *outputWarpedName,
+		    char *outputCorrelationName, char *outputMaskName);
+void StitchSplitPair (char *outputName);
+int FinishedMap (char *from, char *to, Pair *pairs, int nPairs,
+		 char *warmMaps, char *mapName);
+int ComposeWarmMap (char *firstName, char *secondName, char *error);
+void AddResult (Result *rp);
+void FreeKeptResults ();
+void WriteSortedResults (char *outputPairsFile, char *outputSortedPairsFile);
+int ReadStreamedResult (FILE *f, Result *rp, char names[3][PATH_MAX]);
+void WriteStreamedPairs (char *sortedName, char *outputName);
+void WriteStreamedSummary (FILE *f, char *sortedName, char *format);
+int CompareStreamedBySlice (const char *a, const char *b);
+int CompareStreamedByEnergy (const char *a, const char *b);
+int ReadPairs (char *pairsFile, Pair **pairs);
+void FreePairs (Pair *pairs, int nPairs);
+int NextWatchedBatch (char *watchDir, char *batchName, Pair **pairs);
+void FinishWatchedBatch (char *watchDir, char *batchName, int firstResult);
+void AllocateGroupResults (int n);
+void UnpackPair (Pair *p);
 void PackResult ();
 void UnpackResult ();
 int Init ();
 void Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName);
-void ComputeWarpedImage (float *warped, unsigned char *valid,
-			 int w, int h,
-			 int imgox, int imgoy,
-			 float *image, unsigned char *mask,
-			 int iw, int ih,
-			 int refox, int refoy,
-			 MapElement *map,
-			 int mapFactor,
-			 int mpw, int mph,
-			 int mox, int moy);
-void ComputeCorrelation (float *correlation,
-			 float *a, float *b,
-			 unsigned char *valid,
-			 int w, int h,
-			 int hw);
+void ComputeThreadedMoves (MoveState *ms, MoveThread *mts);
+void *MoveThreadMain (void *arg);
+int ComputeGpuMoves (MoveState *ms, MoveThread *mt, char *error);
+int GridAllows (MoveState *ms, int icx, int icy, double cx, double cy);
+void ThreadedMove (MoveThread *mt, int icx, int icy);
+void RefineMove (MoveThread *mt, int icx, int icy);
+int TryMove (MoveThread *mt, int icx, int icy, double cx, double cy,
+	     int commit, double *energy);
+void IndexCpts (int mpw, int mph, int mox, int moy, double lFactor);
+void SetMoveKey (char *name);
+void MoveRandom (int level, size_t index, double *u0, double *u1);
+int NextSweepRegions (int n, size_t *moves, size_t *accepted, char *active,
+		      double *sweepEnergy, double energy, int *focusing);
+double PaddedCorrelation (long nPoints, size_t requiredPoints,
+			  double si, double si2, double sr, double sr2,
+			  double sir);
+double NgfTerm (float *ingf, float *rngf, unsigned int iw, unsigned int rw,
+		int x, int y, int irx, int iry, double rrx, double rry);
+double NgfSimilarity (long nPoints, size_t requiredPoints, double sg);
+void TallyHistogram (HistogramDelta *d, double iv, double rv, int n);
+void ClearHistogramDelta (HistogramDelta *d);
+void ApplyHistogramDelta (JointHistogram *h, HistogramDelta *d);
+void SumHistogram (JointHistogram *h);
+double HistogramSimilarity (JointHistogram *h, HistogramDelta *d,
+			    size_t requiredPoints);
 void TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 		    int factor,
 		    unsigned int iw, unsigned int ih, int imgox, int imgoy,
 		    unsigned int rw, unsigned int rh, int refox, int refoy,
 		    unsigned char *cimask,
 		    unsigned char *crmask);
+void *TrimThreadMain (void *arg);
 void WriteOutputMap (char *outputName, int level, MapElement *map,
 		     int mpw, int mph, int mox, int moy);
+void QueueOutput (PendingOutput *po);
+void *OutputWriterMain (void *arg);
+void WriteOutput (PendingOutput *po);
+void StopOutputWriter ();
+void WorkerFinalize ();
 int WriteOutputImage (char *outputName, int level, float *output,
 		      int w, int h, float scale);
 int Extrapolate (double *prx, double *pry, double *prc,
 		 int ix, int iy, float arrx, float arry,
 		 MapElement* map, int mw, int mh, float threshold);
+void MakePyramidKey (PyramidKey *key, Pair *p, int imi,
+		     char *imageName, char *maskName);
+int SamePyramidKey (PyramidKey *a, PyramidKey *b);
+int LookupPyramid (int imi);
+void StorePyramid (int imi);
+void TrimPyramidCache ();
+void EvictPyramid (int i);
+void KeepPyramidsFor (Pair *p);
+int UsePyramidCache ();
+int PackLevel (int imi, int level);
+float *TileImage (float *img, int w, int h, int *tw);
+float *GradientFeature (float *img, unsigned char *mask,
+			int w, int h, size_t mbpl);
+float *RankFeature (float *img, unsigned char *mask,
+		    int w, int h, size_t mbpl);
+float *NgfField (float *img, unsigned char *mask,
+		 int w, int h, size_t mbpl, double edge);
+unsigned char *TileMask (unsigned char *m, int w, int h, size_t mbpl);
+float *UnpackLevel (int imi, int level);
+void ReleaseLevel (int level, int releaseMasks);
+int LowestComputeLevel (int built);
+int SortPairsByImage (const void *x, const void *y);
+void PrefetchTask ();
+void *PrefetchMain (void *arg);
+int TakePrefetchedImage (char *name, int isMask, int imi,
+			 unsigned char **pixels, int *width, int *height);
+void ReleasePrefetchedTask (char *pairName);
 int Compare (const void *x, const void *y);
-int SortBySlice (const void *x, const void *y);
-int SortByEnergy (const void *x, const void *y);
 int ParseRange (char *s, int *pos, int *minValue, int *maxValue);
 int ParseValue (char *s, int *pos, int *value);
-size_t CountBits (unsigned char *p, size_t n);
-size_t CountIntersectionBits (unsigned char *p, unsigned char *q, size_t n);
 int CreateDirectories (char *fn);
 void CopyString (char **dst, char *src);
 void SetMessage (char *fmt, ...);
@@ -275,6 +762,15 @@ void myMouse (int button, int state, int mouseX, int mouseY);
 void myReshape (int width, int height);
 void myIdle ();
 
+/* the names and feature functions of the metrics */
+char *metricNames[N_METRICS] = {
+  "correlation", "gradient", "rank", "ngf", "mi"
+};
+float *(*metricFeatures[N_METRICS]) (float *img, unsigned char *mask,
+				     int w, int h, size_t mbpl) = {
+  NULL, GradientFeature, RankFeature, NULL, NULL
+};
+
 int
 main (int argc, char **argv, char **envp)
 {
@@ -334,14 +830,20 @@ main (int argc, char **argv, char **envp)
   t.pair.imageName[0] = NULL;
   t.pair.imageName[1] = NULL;
   t.pair.pairName = NULL;
+  t.pair.warmName[0] = NULL;
+  t.pair.warmName[1] = NULL;
   r.pair.imageName[0] = NULL;
   r.pair.imageName[1] = NULL;
   r.pair.pairName = NULL;
+  r.pair.warmName[0] = NULL;
+  r.pair.warmName[1] = NULL;
   r.message = NULL;
 
+  MetricsInit("register");
+  par_set_worker_prefetch(PrefetchTask);
   par_process(argc, argv, envp,
               (void (*)()) MasterTask, MasterResult,
-              WorkerContext, WorkerTask, NULL,
+              WorkerContext, WorkerTask, WorkerFinalize,
               PackContext, UnpackContext,
               PackTask, UnpackTask,
               PackResult, UnpackResult);
@@ -539,6 +1041,7 @@ MasterTask (int argc,
   int n;
   int len;
   char pairsFile[PATH_MAX];
+  char imageManifestName[PATH_MAX];
   char outputPairsFile[PATH_MAX];
   char outputSortedPairsFile[PATH_MAX];
   int nPairs;
@@ -557,16 +1060,35 @@ MasterTask (int argc,
   int minS, maxS;
   struct stat statBuf;
   int pn;
-  char imgn[2][PATH_MAX];
-  char pairn[PATH_MAX];
-  int imgMinX[2], imgMaxX[2], imgMinY[2], imgMaxY[2];
   unsigned int iw, ih;
   int imageSlice, refSlice;
   int imi;
-  char line[LINE_LENGTH+1];
-  FILE *opf;
+  char *hints[2];
+  int scheduleByImage;
+  int largestFirst;
+  int warmStart;
+  int adaptive;
+  char warmMaps[PATH_MAX];
+  int groupSize;
+  int planOnly;
+  char watchDir[PATH_MAX];
+  char batchName[PATH_MAX];
+  int firstResult;
+  double size;
+  int width, height;
+  char errorMsg[PATH_MAX + 256];
 
   error = 0;
+  c.metric = CORRELATION_METRIC;
+  c.ngfEdge = 0.0;
+  scheduleByImage = 0;
+  largestFirst = 0;
+  warmStart = 0;
+  adaptive = 0;
+  warmMaps[0] = '\0';
+  groupSize = 1;
+  planOnly = 0;
+  watchDir[0] = '\0';
   c.type = '\0';
   c.imageBasename[0] = '\0';
   c.maskBasename[0] = '\0';
@@ -574,6 +1096,8 @@ MasterTask (int argc,
   c.strictMasking = 0;
   c.initialMapName[0] = '\0';
   c.cptsName[0] = '\0';
+  c.roiName[0] = '\0';
+  c.roiMargin = 256;
   c.constrainingMapName[0] = '\0';
   c.outputMapBasename[0] = '\0';
   c.outputWarpedBasename[0] = '\0';
@@ -583,6 +1107,7 @@ MasterTask (int argc,
   c.logBasename[0] = '\0';
   c.startLevel = -1;
   c.outputLevel = 6;
+  c.previewLevel = -1;
   c.minResolution = 1;
   c.distortion = 1.0;
   c.correspondence = 1.0;
@@ -593,18 +1118,38 @@ MasterTask (int argc,
   c.quality = 10.0;
   c.minOverlap = 20.0;
   c.correlationHalfWidth = 31;
+  c.correlationKernel = CIRCULAR_KERNEL;
   c.writeAllMaps = 0;
   c.depth = 6;
   c.cptsMethod = -1;
   c.update = 0;
   c.partial = 0;
   c.nWorkers = par_workers();
+  c.nThreads = 0;
+  c.gpu = 0;
+  c.writeQueue = 8;
+  c.mapCompression = UncompressedMap;
+  c.mapLevels = 0;
+  c.pyramidCacheSize = 0;
+  c.pyramidBits = 32;
   c.trimMapSourceThreshold = 0.0;
   c.trimMapTargetThreshold = 0.0;
+  c.stopAcceptance = 0.0;
+  c.stopEnergy = 0.0001;
+  c.refineSweeps = 0;
+  c.refinePolish = 0.1;
+  c.splitSize = 0;
+  c.splitOverlap = -1;
+  c.adaptiveCorrelation = 0.0;
+  c.adaptiveDepth = -1;
+  c.adaptiveQuality = -1.0;
+  c.adaptiveWarm = 0;
+  c.memoryBudget = 0;
   r.pair.imageName[0]  = r.pair.imageName[1] = NULL;
   r.pair.pairName = NULL;
   r.message = NULL;
   pairsFile[0] = '\0';
+  imageManifestName[0] = '\0';
   outputPairsFile[0] = '\0';
   outputSortedPairsFile[0] = '\0';
   nPairs = 0;
@@ -664,6 +1209,25 @@ MasterTask (int argc,
 	  }
 	strcpy(c.cptsName, argv[i]);
       }
+    else if (strcmp(argv[i], "-roi") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(c.roiName, argv[i]);
+      }
+    else if (strcmp(argv[i], "-roi_margin") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.roiMargin) != 1 ||
+	    c.roiMargin < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-constraining_map") == 0)
       {
 	if (++i == argc)
@@ -716,6 +1280,15 @@ MasterTask (int argc,
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-preview_level") == 0)
+      {
+	if (++i == argc || sscanf(argv[i], "%d", &c.previewLevel) != 1 ||
+	    c.previewLevel < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-output_warped") == 0)
       {
 	if (++i == argc)
@@ -752,6 +1325,15 @@ MasterTask (int argc,
 	  }
 	strcpy(pairsFile, argv[i]);
       }
+    else if (strcmp(argv[i], "-manifest") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(imageManifestName, argv[i]);
+      }
     else if (strcmp(argv[i], "-summary") == 0)
       {
 	if (++i == argc)
@@ -824,6 +1406,46 @@ MasterTask (int argc,
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-stop_acceptance") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%lf", &c.stopAcceptance) != 1 ||
+	    c.stopAcceptance < 0.0 || c.stopAcceptance >= 1.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-stop_energy") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%lf", &c.stopEnergy) != 1 ||
+	    c.stopEnergy < 0.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-refine") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.refineSweeps) != 1 ||
+	    c.refineSweeps < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-refine_polish") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%lf", &c.refinePolish) != 1 ||
+	    c.refinePolish < 0.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-correlation_half_width") == 0)
       {
 	if (++i == argc ||
@@ -833,6 +1455,49 @@ MasterTask (int argc,
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-correlation_kernel") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	if (strcmp(argv[i], "circle") == 0)
+	  c.correlationKernel = CIRCULAR_KERNEL;
+	else if (strcmp(argv[i], "box") == 0)
+	  c.correlationKernel = BOX_KERNEL;
+	else
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-metric") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	for (c.metric = 0; c.metric < N_METRICS; ++c.metric)
+	  if (strcmp(argv[i], metricNames[c.metric]) == 0)
+	    break;
+	if (c.metric >= N_METRICS)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-ngf_edge") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%lf", &c.ngfEdge) != 1 ||
+	    c.ngfEdge < 0.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-min_overlap") == 0)
       {
 	if (++i == argc ||
@@ -926,6 +1591,187 @@ MasterTask (int argc,
 	    break;
 	  }
       }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.nThreads) != 1 ||
+	    c.nThreads < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-gpu") == 0)
+      c.gpu = 1;
+    else if (strcmp(argv[i], "-write_queue") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.writeQueue) != 1 ||
+	    c.writeQueue < 0 || c.writeQueue > MAX_WRITE_QUEUE)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-map_format") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	if (strcmp(argv[i], "plain") == 0)
+	  c.mapCompression = UncompressedMap;
+	else if (strcmp(argv[i], "aligned") == 0)
+	  c.mapCompression = AlignedMap;
+	else if (strcmp(argv[i], "tiled") == 0)
+	  c.mapCompression = TiledMap;
+	else if (strcmp(argv[i], "tiled_half") == 0)
+	  c.mapCompression = TiledHalfMap;
+	else
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-map_levels") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.mapLevels) != 1 ||
+	    c.mapLevels < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-pyramid_storage") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	if (strcmp(argv[i], "float") == 0)
+	  c.pyramidBits = 32;
+	else if (strcmp(argv[i], "16") == 0)
+	  c.pyramidBits = 16;
+	else if (strcmp(argv[i], "8") == 0)
+	  c.pyramidBits = 8;
+	else
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-pyramid_cache") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.pyramidCacheSize) != 1 ||
+	    c.pyramidCacheSize < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-schedule_by_image") == 0)
+      scheduleByImage = 1;
+    else if (strcmp(argv[i], "-largest_first") == 0)
+      largestFirst = 1;
+    else if (strcmp(argv[i], "-warm_start") == 0)
+      warmStart = 1;
+    else if (strcmp(argv[i], "-warm_maps") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(warmMaps, argv[i]);
+	warmStart = 1;
+      }
+    else if (strcmp(argv[i], "-group") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &groupSize) != 1 ||
+	    groupSize < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-split") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.splitSize) != 1 ||
+	    c.splitSize < 1024)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-split_overlap") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.splitOverlap) != 1 ||
+	    c.splitOverlap < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-memory") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.memoryBudget) != 1 ||
+	    c.memoryBudget < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-adaptive") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%lf", &c.adaptiveCorrelation) != 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+	adaptive = 1;
+      }
+    else if (strcmp(argv[i], "-adaptive_depth") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.adaptiveDepth) != 1 ||
+	    c.adaptiveDepth < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-adaptive_quality") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%lf", &c.adaptiveQuality) != 1 ||
+	    c.adaptiveQuality <= 0.0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-adaptive_warm") == 0)
+      c.adaptiveWarm = 1;
+    else if (strcmp(argv[i], "-plan") == 0)
+      planOnly = 1;
+    else if (strcmp(argv[i], "-watch") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(watchDir, argv[i]);
+      }
     else error = 1;
 
   if (error)
@@ -940,15 +1786,23 @@ MasterTask (int argc,
       fprintf(stderr, "              [-affine]\n");
       fprintf(stderr, "              [-quadratic]\n");
       fprintf(stderr, "              [-quality quality_factor]\n");
+      fprintf(stderr, "              [-stop_acceptance fraction]\n");
+      fprintf(stderr, "              [-stop_energy fraction]\n");
+      fprintf(stderr, "              [-refine sweeps]\n");
+      fprintf(stderr, "              [-refine_polish fraction]\n");
       fprintf(stderr, "              [-min_res minimum_resolution_in_pixels]\n");
       fprintf(stderr, "              [-trim_map_source_threshold]\n");
       fprintf(stderr, "              [-trim_map_target_threshold]\n");
       fprintf(stderr, "              [-depth delta_depth]\n");
+      fprintf(stderr, "              [-preview_level level]\n");
       fprintf(stderr, "              [-all_maps]\n");
       fprintf(stderr, "              [-update]\n");
       fprintf(stderr, "              [-partial]\n");
       fprintf(stderr, "              [-pairs <pair_file>]\n");
+      fprintf(stderr, "              [-manifest <image_manifest_file>]\n");
       fprintf(stderr, "              [-initial_map <initial_map_prefix>]\n");
+      fprintf(stderr, "              [-roi <region_of_interest_prefix>]\n");
+      fprintf(stderr, "              [-roi_margin pixels]\n");
       fprintf(stderr, "              [-constraining_map <constraining_map_prefix>]\n");
       fprintf(stderr, "              [-constraining constraining_weight]\n");
       fprintf(stderr, "              [-constraining_threshold pixels]\n");
@@ -958,6 +1812,30 @@ MasterTask (int argc,
       fprintf(stderr, "              [-output_pairs <output_pair_file>]\n");
       fprintf(stderr, "              [-output_sorted_pairs <output_pair_file>]\n");
       fprintf(stderr, "              [-logs <log_file_directory>]\n");
+      fprintf(stderr, "              [-correlation_kernel circle|box]\n");
+      fprintf(stderr, "              [-metric correlation|gradient|rank|ngf|mi]\n");
+      fprintf(stderr, "              [-ngf_edge intensity_per_pixel]\n");
+      fprintf(stderr, "              [-threads threads_per_worker]\n");
+      fprintf(stderr, "              [-gpu]\n");
+      fprintf(stderr, "              [-write_queue max_pending_outputs]\n");
+      fprintf(stderr, "              [-map_format plain|aligned|tiled|tiled_half]\n");
+      fprintf(stderr, "              [-map_levels coarser_levels_per_map]\n");
+      fprintf(stderr, "              [-pyramid_cache megabytes_per_worker]\n");
+      fprintf(stderr, "              [-pyramid_storage float|16|8]\n");
+      fprintf(stderr, "              [-schedule_by_image]\n");
+      fprintf(stderr, "              [-largest_first]\n");
+      fprintf(stderr, "              [-warm_start]\n");
+      fprintf(stderr, "              [-warm_maps <finished_map_prefix>]\n");
+      fprintf(stderr, "              [-group max_pairs_per_task]\n");
+      fprintf(stderr, "              [-split max_pixels_per_task]\n");
+      fprintf(stderr, "              [-split_overlap pixels]\n");
+      fprintf(stderr, "              [-memory megabytes_per_worker]\n");
+      fprintf(stderr, "              [-adaptive min_correlation]\n");
+      fprintf(stderr, "              [-adaptive_depth delta_depth]\n");
+      fprintf(stderr, "              [-adaptive_quality quality_factor]\n");
+      fprintf(stderr, "              [-adaptive_warm]\n");
+      fprintf(stderr, "              [-watch <queue_directory>]\n");
+      fprintf(stderr, "              [-plan]\n");
       fprintf(stderr, "   where ranges are expressed as: integer\n");
       fprintf(stderr, "                              or: integer-integer\n");
       fprintf(stderr, "                              or: integer-\n");
@@ -971,52 +1849,45 @@ MasterTask (int argc,
   for (i = 0; i < argc; ++i)
     Log("ARGV[%d] = %s\n", i, argv[i]);
 
+  /* with -PAR_PIN=n and no -threads, each worker runs a thread on
+     each cpu of its block, so that a process per node or socket
+     serves them all with one copy of the context and caches */
+  if (c.nThreads == 0)
+    c.nThreads = par_pinned_cpus() > 0 ? par_pinned_cpus() : 1;
+
   /* check that at least minimal parameters were supplied */
   if (c.imageBasename[0] == '\0' || c.outputMapBasename[0] == '\0' ||
-      pairsFile[0] == '\0')
-    Error("-images, -output, and -pairs parameters must be specified.\n");
+      pairsFile[0] == '\0' && watchDir[0] == '\0')
+    Error("-images, -output, and -pairs (or -watch) parameters must be specified.\n");
+  if (c.previewLevel >= 0 && c.previewLevel <= c.outputLevel)
+    Error("-preview_level must be coarser than -output_level (%d).\n",
+	  c.outputLevel);
   if (c.cptsMethod < 0)
     c.cptsMethod = AFFINE_METHOD;
 
-  f = fopen(pairsFile, "r");
-  if (f == NULL)
-    Error("Could not open pairs file %s\n", pairsFile);
-  while (fgets(line, LINE_LENGTH, f) != NULL)
+  if (pairsFile[0] != '\0')
+    nPairs = ReadPairs(pairsFile, &pairs);
+
+  /* -largest_first and -plan need the size of every image before
+     anything is delegated */
+  if (imageManifestName[0] != '\0')
+    SetImageManifest(imageManifestName);
+  if (nPairs > 0 && (largestFirst || planOnly))
+    ScanPairImages(pairs, nPairs);
+
+  /* delegate the pairs that share an image one after another so
+     that the workers' pyramid caches get reused */
+  if (scheduleByImage)
+    qsort(pairs, nPairs, sizeof(Pair), SortPairsByImage);
+
+  /* with -plan, only report what registering the pairs would take */
+  if (planOnly)
     {
-      if (line[0] == '\0' || line[0] == '#')
-	continue;
-      if (sscanf(line, "%s %d %d %d %d %s %d %d %d %d %s",
-		 imgn[0], &imgMinX[0], &imgMaxX[0], &imgMinY[0], &imgMaxY[0],
-		 imgn[1], &imgMinX[1], &imgMaxX[1], &imgMinY[1], &imgMaxY[1],
-		 pairn) != 11)
-	{
-	  if (sscanf(line, "%s %s %s", imgn[0], imgn[1], pairn) != 3)
-	    Error("Invalid line in pairs file %s:\n%s\n", pairsFile, line);
-	  imgMinX[0] = -1;
-	  imgMaxX[0] = -1;
-	  imgMinY[0] = -1;
-	  imgMaxY[0] = -1;
-	  imgMinX[1] = -1;
-	  imgMaxX[1] = -1;
-	  imgMinY[1] = -1;
-	  imgMaxY[1] = -1;
-	}
-      if ((nPairs & 1023) == 0)
-	pairs = (Pair *) realloc(pairs, (nPairs + 1024) * sizeof(Pair));
-      for (imi = 0; imi < 2; ++imi)
-	{
-	  pairs[nPairs].imageName[imi] = NULL;
-	  CopyString(&(pairs[nPairs].imageName[imi]), imgn[imi]);
-	  pairs[nPairs].imageMinX[imi] = imgMinX[imi];
-	  pairs[nPairs].imageMaxX[imi] = imgMaxX[imi];
-	  pairs[nPairs].imageMinY[imi] = imgMinY[imi];
-	  pairs[nPairs].imageMaxY[imi] = imgMaxY[imi];
-	}
-      pairs[nPairs].pairName = NULL;
-      CopyString(&(pairs[nPairs].pairName), pairn);
-      ++nPairs;
+      if (pairsFile[0] == '\0')
+	Error("-plan requires -pairs\n");
+      PlanTasks(pairs, nPairs, groupSize);
+      return;
     }
-  fclose(f);
 
   /* check that output directories are writeable */ 
   Log("MASTER checking output directories\n");
@@ -1130,6 +2001,68 @@ MasterTask (int argc,
       unlink(fn);
     }
 
+  /* the results are streamed to a file as they come back, so that
+     the run can be followed there, and the sorted outputs are made
+     from it at the end; only -warm_start and -watch hold them */
+  if (summaryName[0] != '\0')
+    sprintf(resultStreamName, "%s.partial", summaryName);
+  else if (outputSortedPairsFile[0] != '\0')
+    sprintf(resultStreamName, "%s.partial", outputSortedPairsFile);
+  else if (outputPairsFile[0] != '\0')
+    sprintf(resultStreamName, "%s.partial", outputPairsFile);
+  if (resultStreamName[0] != '\0')
+    {
+      resultStream = fopen(resultStreamName, "w");
+      if (resultStream == NULL)
+	Error("Could not open result stream %s\n", resultStreamName);
+    }
+  keepResults = warmStart || watchDir[0] != '\0';
+
+  /* in -watch mode, a batch is reported done when its results come
+     back, so the maps must have been written by then */
+  if (watchDir[0] != '\0')
+    c.writeQueue = 0;
+
+  /* likewise with -warm_start, since the maps of the finished pairs
+     are read by the workers of later ones */
+  if (warmStart)
+    c.writeQueue = 0;
+
+  /* and with -PAR_JOURNAL, since a pair whose result is recorded
+     there is not registered again */
+  if (par_journaling())
+    c.writeQueue = 0;
+
+  /* and with -split, since each stage of a split pair reads the maps
+     of the one before */
+  if (c.splitSize > 0)
+    {
+      c.writeQueue = 0;
+      if (c.splitOverlap < 0)
+	c.splitOverlap = c.splitSize / 8;
+    }
+
+  /* and with -adaptive, since a retry reads the map and sidecar of
+     the cheap pass; the cheap pass defaults to a quarter of the
+     correlation pixels per map element and of the moves */
+  if (adaptive)
+    {
+      c.writeQueue = 0;
+      if (c.adaptiveDepth < 0)
+	c.adaptiveDepth = c.depth >= 1 ? c.depth - 1 : 0;
+      if (c.adaptiveQuality < 0.0)
+	c.adaptiveQuality = c.quality / 4.0;
+    }
+
+  /* and with -memory, since a pair too big for a worker is registered
+     by parts, as with -split */
+  if (c.memoryBudget > 0)
+    {
+      c.writeQueue = 0;
+      if (c.pyramidCacheSize >= c.memoryBudget)
+	Error("-pyramid_cache must be smaller than -memory\n");
+    }
+
   Log("MASTER setting context\n");
 
   par_set_context();
@@ -1142,157 +2075,545 @@ MasterTask (int argc,
   for (imi = 0; imi < 2; ++imi)
     t.pair.imageMinX[imi] = t.pair.imageMaxX[imi] = t.pair.imageMinY[imi] = t.pair.imageMaxY[imi] = -1;
   Log("nPairs = %d\n", nPairs);
-  for (pn = 0; pn < nPairs; ++pn)
+  t.nGroup = 0;
+  t.group = (Pair *) malloc(groupSize * sizeof(Pair));
+  if (t.group == NULL)
+    Error("Could not allocate task group\n");
+  memset(t.group, 0, groupSize * sizeof(Pair));
+  firstResult = 0;
+  batchName[0] = '\0';
+  for (;;)
     {
-      for (imi = 0; imi < 2; ++imi)
+      /* with -split, the pairs too big for one task are registered
+	 by parts once the others have been delegated */
+      if (c.splitSize > 0)
+	nPairs = SeparateSplitPairs(pairs, nPairs);
+      t.pass = adaptive ? PASS_CHEAP : PASS_FULL;
+      size = 0.0;
+      for (pn = 0; pn < nPairs; ++pn)
 	{
-	  CopyString(&(t.pair.imageName[imi]), pairs[pn].imageName[imi]);
-	  t.pair.imageMinX[imi] = pairs[pn].imageMinX[imi];
-	  t.pair.imageMaxX[imi] = pairs[pn].imageMaxX[imi];
-	  t.pair.imageMinY[imi] = pairs[pn].imageMinY[imi];
-	  t.pair.imageMaxY[imi] = pairs[pn].imageMaxY[imi];
+	  for (imi = 0; imi < 2; ++imi)
+	    {
+	      CopyString(&(t.pair.imageName[imi]), pairs[pn].imageName[imi]);
+	      t.pair.imageMinX[imi] = pairs[pn].imageMinX[imi];
+	      t.pair.imageMaxX[imi] = pairs[pn].imageMaxX[imi];
+	      t.pair.imageMinY[imi] = pairs[pn].imageMinY[imi];
+	      t.pair.imageMaxY[imi] = pairs[pn].imageMaxY[imi];
+	    }
+	  CopyString(&(t.pair.pairName), pairs[pn].pairName);
+
+	  /* with -warm_start, start the pair from the composition of
+	     finished maps, if any, through an intermediate image */
+	  if (warmStart)
+	    FindWarmMaps(&t.pair, pairs, nPairs, warmMaps);
+
+	  // make sure that output directories exist
+	  sprintf(fn, "%s%s.map", c.outputMapBasename, t.pair.pairName);
+	  if (!CreateDirectories(fn))
+	    continue;
+	  if (c.outputWarpedBasename[0] != '\0')
+	    {
+	      sprintf(fn, "%s%s.pgm", c.outputWarpedBasename, t.pair.pairName);
+	      if (!CreateDirectories(fn))
+		continue;
+	    }
+	  if (c.outputCorrelationBasename[0] != '\0')
+	    {
+	      sprintf(fn, "%s%s.pgm", c.outputCorrelationBasename, t.pair.pairName);
+	      if (!CreateDirectories(fn))
+		continue;
+	    }
+
+	  /* with -largest_first, give the master the number of pixels
+	     in the pair so that the biggest pairs are started first */
+	  if (largestFirst)
+	    {
+	      for (imi = 0; imi < 2; ++imi)
+		if (t.pair.imageMinX[imi] >= 0)
+		  size += ((double) (t.pair.imageMaxX[imi] - t.pair.imageMinX[imi] + 1)) *
+		    (t.pair.imageMaxY[imi] - t.pair.imageMinY[imi] + 1);
+		else
+		  {
+		    sprintf(fn, "%s%s", c.imageBasename, t.pair.imageName[imi]);
+		    if (ReadImageSize(fn, &width, &height, errorMsg))
+		      size += ((double) width) * height;
+		  }
+	    }
+
+	  /* with -group, consecutive pairs that share an image are
+	     given to one worker as a single task so that the pyramid of
+	     the shared image is only built once */
+	  CopyPair(&t.group[t.nGroup++], &t.pair);
+	  if (t.nGroup < groupSize && pn + 1 < nPairs &&
+	      SharesImage(&pairs[pn], &pairs[pn+1]))
+	    continue;
+
+	  if (largestFirst)
+	    par_set_task_size(size);
+	  size = 0.0;
+	  SetTaskNeeds();
+	  Log("Delegating pair %d (%d pairs in task)\n", pn, t.nGroup);
+	  hints[0] = t.group[0].imageName[0];
+	  hints[1] = t.group[0].imageName[1];
+	  sprintf(fn, "%s%s.map", c.outputMapBasename, t.group[0].pairName);
+	  if (t.nGroup > 1)
+	    sprintf(fn + strlen(fn), "+%d", t.nGroup);
+	  par_set_task_key(fn);
+	  par_delegate_task_hint(2, hints);
+	  t.nGroup = 0;
 	}
-      CopyString(&(t.pair.pairName), pairs[pn].pairName);
+      if (nSplitPairs > 0)
+	RegisterSplitPairs(pairs, nPairs, warmStart, warmMaps);
+      if (adaptive)
+	RetryAdaptivePairs(pairs, nPairs, warmStart, warmMaps);
+      if (c.memoryBudget > 0)
+	RegisterOversizedPairs(pairs, nPairs, warmStart, warmMaps);
+      if (watchDir[0] == '\0')
+	break;
 
-      // make sure that output directories exist
-      sprintf(fn, "%s%s.map", c.outputMapBasename, t.pair.pairName);
-      if (!CreateDirectories(fn))
+      /* with -watch, once this batch is finished, wait for the next
+	 one to be queued; the workers, and so their caches, stay up
+	 in between */
+      while (par_tasks_outstanding() > 0)
+	par_wait(1.0);
+      if (batchName[0] != '\0')
+	FinishWatchedBatch(watchDir, batchName, firstResult);
+      if (!warmStart)
+	FreeKeptResults();
+      firstResult = nKeptResults;
+      FreePairs(pairs, nPairs);
+      pairs = NULL;
+      nPairs = NextWatchedBatch(watchDir, batchName, &pairs);
+      if (nPairs < 0)
+	break;
+      if (scheduleByImage)
+	qsort(pairs, nPairs, sizeof(Pair), SortPairsByImage);
+    }
+  par_finish();
+
+  WriteSortedResults(outputPairsFile, outputSortedPairsFile);
+
+  /* without MPI the tasks ran in this process */
+  StopOutputWriter();
+
+  printf(" %d\nAll slices completed.\n", nResults);
+  if (adaptive)
+    printf("Pairs registered again at -depth and -quality: %d\n",
+	   nRetried);
+  if (nUnregistered > 0)
+    printf("Pairs not registered since they do not fit in -memory: %d\n",
+	   nUnregistered);
+}
+
+/* ReadPairs reads the pairs file fn into *pairs (which may be NULL) and
+   returns the number of pairs */
+int
+ReadPairs (char *pairsFile, Pair **pairs)
+{
+  FILE *f;
+  char line[LINE_LENGTH+1];
+  char imgn[2][PATH_MAX];
+  char pairn[PATH_MAX];
+  int imgMinX[2], imgMaxX[2], imgMinY[2], imgMaxY[2];
+  int nPairs;
+  int imi;
+
+  nPairs = 0;
+  f = fopen(pairsFile, "r");
+  if (f == NULL)
+    Error("Could not open pairs file %s\n", pairsFile);
+  while (fgets(line, LINE_LENGTH, f) != NULL)
+    {
+      if (line[0] == '\0' || line[0] == '#')
 	continue;
-      if (c.outputWarpedBasename[0] != '\0')
+      if (sscanf(line, "%s %d %d %d %d %s %d %d %d %d %s",
+		 imgn[0], &imgMinX[0], &imgMaxX[0], &imgMinY[0], &imgMaxY[0],
+		 imgn[1], &imgMinX[1], &imgMaxX[1], &imgMinY[1], &imgMaxY[1],
+		 pairn) != 11)
 	{
-	  sprintf(fn, "%s%s.pgm", c.outputWarpedBasename, t.pair.pairName);
-	  if (!CreateDirectories(fn))
+	  if (sscanf(line, "%s %s %s", imgn[0], imgn[1], pairn) != 3)
+	    Error("Invalid line in pairs file %s:\n%s\n", pairsFile, line);
+	  imgMinX[0] = -1;
+	  imgMaxX[0] = -1;
+	  imgMinY[0] = -1;
+	  imgMaxY[0] = -1;
+	  imgMinX[1] = -1;
+	  imgMaxX[1] = -1;
+	  imgMinY[1] = -1;
+	  imgMaxY[1] = -1;
+	}
+      if ((nPairs & 1023) == 0)
+	*pairs = (Pair *) realloc(*pairs, (nPairs + 1024) * sizeof(Pair));
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  (*pairs)[nPairs].imageName[imi] = NULL;
+	  CopyString(&((*pairs)[nPairs].imageName[imi]), imgn[imi]);
+	  (*pairs)[nPairs].imageMinX[imi] = imgMinX[imi];
+	  (*pairs)[nPairs].imageMaxX[imi] = imgMaxX[imi];
+	  (*pairs)[nPairs].imageMinY[imi] = imgMinY[imi];
+	  (*pairs)[nPairs].imageMaxY[imi] = imgMaxY[imi];
+	}
+      (*pairs)[nPairs].pairName = NULL;
+      (*pairs)[nPairs].warmName[0] = NULL;
+      (*pairs)[nPairs].warmName[1] = NULL;
+      CopyString(&((*pairs)[nPairs].pairName), pairn);
+      ++nPairs;
+    }
+  fclose(f);
+  return(nPairs);
+}
+
+void
+FreePairs (Pair *pairs, int nPairs)
+{
+  int i;
+
+  for (i = 0; i < nPairs; ++i)
+    {
+      free(pairs[i].imageName[0]);
+      free(pairs[i].imageName[1]);
+      free(pairs[i].pairName);
+      free(pairs[i].warmName[0]);
+      free(pairs[i].warmName[1]);
+    }
+  free(pairs);
+}
+
+/* NextWatchedBatch waits for the next pairs file (a name ending in
+   .pairs) to appear in the -watch directory and reads it into *pairs,
+   returning the number of pairs and setting batchName; the batches are
+   taken in name order, so producers should write each under another
+   name and rename it into place.  It returns -1 once a file named
+   "stop" appears there. */
+int
+NextWatchedBatch (char *watchDir, char *batchName, Pair **pairs)
+{
+  DIR *dir;
+  struct dirent *de;
+  char fn[PATH_MAX];
+  int len;
+
+  for (;;)
+    {
+      sprintf(fn, "%s/stop", watchDir);
+      if (access(fn, F_OK) == 0)
+	{
+	  unlink(fn);
+	  return(-1);
+	}
+      batchName[0] = '\0';
+      dir = opendir(watchDir);
+      if (dir == NULL)
+	Error("Could not open watch directory %s\n", watchDir);
+      while ((de = readdir(dir)) != NULL)
+	{
+	  len = strlen(de->d_name);
+	  if (len <= 6 || len >= PATH_MAX ||
+	      strcmp(&de->d_name[len-6], ".pairs") != 0)
 	    continue;
+	  if (batchName[0] == '\0' || strcmp(de->d_name, batchName) < 0)
+	    strcpy(batchName, de->d_name);
 	}
-      if (c.outputCorrelationBasename[0] != '\0')
+      closedir(dir);
+      if (batchName[0] != '\0')
 	{
-	  sprintf(fn, "%s%s.pgm", c.outputCorrelationBasename, t.pair.pairName);
-	  if (!CreateDirectories(fn))
+	  sprintf(fn, "%s/%s", watchDir, batchName);
+	  Log("MASTER starting batch %s\n", fn);
+	  return(ReadPairs(fn, pairs));
+	}
+      sleep(1);
+    }
+}
+
+/* FinishWatchedBatch reports the results of a batch, from firstResult
+   on, in <batch>.done (one line per pair: name, whether its map was
+   updated, correlation, distortion, correspondence and constraining
+   energies) and removes the batch's pairs file */
+void
+FinishWatchedBatch (char *watchDir, char *batchName, int firstResult)
+{
+  char fn[PATH_MAX], tfn[PATH_MAX];
+  FILE *f;
+  int i;
+
+  sprintf(fn, "%s/%.*s.done", watchDir,
+	  (int) strlen(batchName) - 6, batchName);
+  sprintf(tfn, "%s.tmp", fn);
+  f = fopen(tfn, "w");
+  if (f == NULL)
+    Error("Could not open batch results file %s\n", tfn);
+  for (i = firstResult; i < nKeptResults; ++i)
+    fprintf(f, "%s %d %f %f %f %f\n",
+	    results[i].pair.pairName,
+	    results[i].updated,
+	    results[i].correlation,
+	    results[i].distortion,
+	    results[i].correspondence,
+	    results[i].constraining);
+  if (fclose(f) != 0 || rename(tfn, fn) != 0)
+    Error("Could not write batch results file %s\n", fn);
+  sprintf(fn, "%s/%s", watchDir, batchName);
+  unlink(fn);
+  Log("MASTER finished batch %s (%d pairs)\n", fn,
+      nKeptResults - firstResult);
+}
+
+void
+MasterResult ()
+{
+  int i, j;
+  Result *rp;
+
+  /* of the tasks of a split pair, the last stands for the pair, unless
+     the first found its map up-to-date */
+  for (i = 0; i < nGroupResults; ++i)
+    {
+      rp = &groupResults[i];
+      if (resultSplit == SPLIT_COARSE && rp->message == NULL)
+	{
+	  if (rp->updated)
 	    continue;
+	  for (j = 0; j < nSplitPairs; ++j)
+	    if (strcmp(splitPairs[j].pair.pairName, rp->pair.pairName) == 0)
+	      splitPairs[j].current = 1;
 	}
+      else if (resultSplit == SPLIT_PART && rp->message == NULL)
+	continue;
+      else if (rp->memoryNeeded > 0.0 && rp->message == NULL)
+	{
+	  AddOversizedPair(&rp->pair, rp->memoryNeeded);
+	  continue;
+	}
+      else if (rp->pass == PASS_CHEAP && rp->message == NULL &&
+	       rp->correlation < c.adaptiveCorrelation)
+	{
+	  AddRetryPair(&rp->pair);
+	  continue;
+	}
+      AddResult(rp);
+    }
+}
+
+void
+AddResult (Result *rp)
+{
+  int imi;
+
+  if (rp->message != NULL)
+    Error("\nThe following error was encountered by one of the worker processes:%s\n", rp->message);
 
-      Log("Delegating pair %d\n", pn);
-      par_delegate_task();
+  if (resultStream != NULL)
+    {
+      fprintf(resultStream, "%.17g %s %d %d %d %d %s %d %d %d %d %s %d %.17g %.17g %.17g %.17g\n",
+	      rp->distortion * c.distortion - rp->correlation +
+	      rp->correspondence * c.correspondence +
+	      rp->constraining * c.constraining,
+	      rp->pair.imageName[0],
+	      rp->pair.imageMinX[0], rp->pair.imageMaxX[0],
+	      rp->pair.imageMinY[0], rp->pair.imageMaxY[0],
+	      rp->pair.imageName[1],
+	      rp->pair.imageMinX[1], rp->pair.imageMaxX[1],
+	      rp->pair.imageMinY[1], rp->pair.imageMaxY[1],
+	      rp->pair.pairName,
+	      rp->updated,
+	      rp->correlation, rp->distortion,
+	      rp->correspondence, rp->constraining);
+      fflush(resultStream);
     }
-  par_finish();
 
-  if (outputPairsFile[0] != '\0')
+  if (keepResults)
     {
-      qsort(results, nResults, sizeof(Result), SortBySlice);
-      opf = fopen(outputPairsFile, "w");
-      if (opf == NULL)
-	Error("Could not open output pairs file %s for writing.\n",
-	      outputPairsFile);
-      for (i = 0; i < nResults; ++i)
-	if (results[i].updated)
-	  fprintf(opf, "%s %d %d %d %d %s %d %d %d %d %s\n",
-		  results[i].pair.imageName[0],
-		  results[i].pair.imageMinX[0],
-		  results[i].pair.imageMaxX[0],
-		  results[i].pair.imageMinY[0],
-		  results[i].pair.imageMaxX[0],
-		  results[i].pair.imageName[1],
-		  results[i].pair.imageMinX[1],
-		  results[i].pair.imageMaxX[1],
-		  results[i].pair.imageMinY[1],
-		  results[i].pair.imageMaxX[1],
-		  results[i].pair.pairName);
-      fclose(opf);
+      results = (Result*) realloc(results, (nKeptResults + 1) * sizeof(Result));
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  results[nKeptResults].pair.imageName[imi] = NULL;
+	  CopyString(&(results[nKeptResults].pair.imageName[imi]), rp->pair.imageName[imi]);
+	  results[nKeptResults].pair.imageMinX[imi] = rp->pair.imageMinX[imi];
+	  results[nKeptResults].pair.imageMaxX[imi] = rp->pair.imageMaxX[imi];
+	  results[nKeptResults].pair.imageMinY[imi] = rp->pair.imageMinY[imi];
+	  results[nKeptResults].pair.imageMaxY[imi] = rp->pair.imageMaxY[imi];
+	}
+      results[nKeptResults].pair.pairName = NULL;
+      CopyString(&(results[nKeptResults].pair.pairName), rp->pair.pairName);
+      results[nKeptResults].pair.warmName[0] = NULL;
+      results[nKeptResults].pair.warmName[1] = NULL;
+      results[nKeptResults].updated = rp->updated;
+      results[nKeptResults].distortion = rp->distortion;
+      results[nKeptResults].correlation = rp->correlation;
+      results[nKeptResults].correspondence = rp->correspondence;
+      results[nKeptResults].constraining = rp->constraining;
+      results[nKeptResults].message = NULL;
+      CopyString(&(results[nKeptResults].message), rp->message);
+      ++nKeptResults;
     }
-  if (outputSortedPairsFile[0] != '\0')
+
+  if ((nResults % 50) == 0 && nResults != 0)
+    printf(" %d \n                   ", nResults);
+  printf(".");
+  ++nResults;
+}
+
+/* FreeKeptResults frees the results held so far */
+void
+FreeKeptResults ()
+{
+  int i;
+  int imi;
+
+  for (i = 0; i < nKeptResults; ++i)
     {
-      qsort(results, nResults, sizeof(Result), SortByEnergy);
-      opf = fopen(outputSortedPairsFile, "w");
-      if (opf == NULL)
-	Error("Could not open output sorted pairs file %s for writing.\n",
-	      outputSortedPairsFile);
-      for (i = 0; i < nResults; ++i)
-	if (results[i].updated)
-	  fprintf(opf, "%s %d %d %d %d %s %d %d %d %d %s\n",
-		  results[i].pair.imageName[0],
-		  results[i].pair.imageMinX[0],
-		  results[i].pair.imageMaxX[0],
-		  results[i].pair.imageMinY[0],
-		  results[i].pair.imageMaxX[0],
-		  results[i].pair.imageName[1],
-		  results[i].pair.imageMinX[1],
-		  results[i].pair.imageMaxX[1],
-		  results[i].pair.imageMinY[1],
-		  results[i].pair.imageMaxX[1],
-		  results[i].pair.pairName);
-      fclose(opf);
+      for (imi = 0; imi < 2; ++imi)
+	CopyString(&(results[i].pair.imageName[imi]), NULL);
+      CopyString(&(results[i].pair.pairName), NULL);
+      CopyString(&(results[i].message), NULL);
     }
+  nKeptResults = 0;
+}
+
+/* WriteSortedResults closes the stream of results and makes from it
+   the output pairs file, sorted by slice, the output sorted pairs
+   file, sorted by energy, and the summary, sorted both ways; the sorts
+   are external, so that no more than RESULT_SORT_LINES results are in
+   memory at once */
+void
+WriteSortedResults (char *outputPairsFile, char *outputSortedPairsFile)
+{
+  char bySlice[PATH_MAX + 32], byEnergy[PATH_MAX + 32];
+  char msg[PATH_MAX + 256];
+  FILE *f;
+
+  if (resultStream == NULL)
+    return;
+  if (fclose(resultStream) != 0)
+    Error("Could not write result stream %s\n", resultStreamName);
+  resultStream = NULL;
+
+  sprintf(bySlice, "%s.slice", resultStreamName);
+  sprintf(byEnergy, "%s.energy", resultStreamName);
+  if ((outputPairsFile[0] != '\0' || summaryName[0] != '\0') &&
+      !SortLines(resultStreamName, bySlice, CompareStreamedBySlice,
+		 RESULT_SORT_LINES, msg))
+    Error("%s", msg);
+  if ((outputSortedPairsFile[0] != '\0' || summaryName[0] != '\0') &&
+      !SortLines(resultStreamName, byEnergy, CompareStreamedByEnergy,
+		 RESULT_SORT_LINES, msg))
+    Error("%s", msg);
+
+  if (outputPairsFile[0] != '\0')
+    WriteStreamedPairs(bySlice, outputPairsFile);
+  if (outputSortedPairsFile[0] != '\0')
+    WriteStreamedPairs(byEnergy, outputSortedPairsFile);
 
   if (summaryName[0] != '\0')
     {
-      qsort(results, nResults, sizeof(Result), SortBySlice);
       f = fopen(summaryName, "w");
       if (f == NULL)
 	Error("Could not open summary output file %s\n", summaryName);
 
       fprintf(f, "Sorted by slice:\n");
       fprintf(f, "IMAGE    REFERENCE  CORRELATION   DISTORTION    CORRESPOND    CONSTRAIN     ENERGY\n");
-      for (i = 0; i < nResults; ++i)
-	fprintf(f, "%8s %8s %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n",
-		results[i].pair.imageName[0],
-		results[i].pair.imageName[1],
-		results[i].correlation,
-		results[i].distortion,
-		results[i].correspondence,
-		results[i].constraining,
-		results[i].distortion * c.distortion - results[i].correlation +
-		results[i].correspondence * c.correspondence + results[i].constraining * c.constraining);
+      WriteStreamedSummary(f, bySlice,
+			   "%8s %8s %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n");
       fprintf(f, "\n\nSorted by energy:\n");
       fprintf(f, "IMAGE    REFERENCE  CORRELATION   DISTORTION    CORRESPOND    CONSTRAIN     ENERGY\n");
-      qsort(results, nResults, sizeof(Result), SortByEnergy);
-      for (i = 0; i < nResults; ++i)
-	fprintf(f, "%8s %8s  %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n",
-		results[i].pair.imageName[0],
-		results[i].pair.imageName[1],
-		results[i].correlation,
-		results[i].distortion,
-		results[i].correspondence,
-		results[i].constraining,
-		results[i].distortion * c.distortion - results[i].correlation +
-		results[i].correspondence * c.correspondence + results[i].constraining * c.constraining);
-      fclose(f);
+      WriteStreamedSummary(f, byEnergy,
+			   "%8s %8s  %12.6f  %12.6f  %12.6f  %12.6f  %12.6f\n");
+      if (fclose(f) != 0)
+	Error("Could not write summary output file %s\n", summaryName);
     }
 
-  printf(" %d\nAll slices completed.\n", nResults);
+  unlink(bySlice);
+  unlink(byEnergy);
+  unlink(resultStreamName);
 }
 
-void
-MasterResult ()
+/* ReadStreamedResult reads the next result of f into *rp, whose names
+   are kept in names; it returns 0 at the end of f */
+int
+ReadStreamedResult (FILE *f, Result *rp, char names[3][PATH_MAX])
 {
-  int imi;
+  char line[3 * PATH_MAX + 512];
+  double energy;
 
-  if (r.message != NULL)
-    Error("\nThe following error was encountered by one of the worker processes:%s\n", r.message);
+  while (fgets(line, sizeof(line), f) != NULL)
+    if (sscanf(line, "%lf %s %d %d %d %d %s %d %d %d %d %s %d %lf %lf %lf %lf",
+	       &energy,
+	       names[0],
+	       &(rp->pair.imageMinX[0]), &(rp->pair.imageMaxX[0]),
+	       &(rp->pair.imageMinY[0]), &(rp->pair.imageMaxY[0]),
+	       names[1],
+	       &(rp->pair.imageMinX[1]), &(rp->pair.imageMaxX[1]),
+	       &(rp->pair.imageMinY[1]), &(rp->pair.imageMaxY[1]),
+	       names[2],
+	       &(rp->updated),
+	       &(rp->correlation), &(rp->distortion),
+	       &(rp->correspondence), &(rp->constraining)) == 17)
+      {
+	rp->pair.imageName[0] = names[0];
+	rp->pair.imageName[1] = names[1];
+	rp->pair.pairName = names[2];
+	return(1);
+      }
+  return(0);
+}
 
-  results = (Result*) realloc(results, (nResults + 1) * sizeof(Result));
-  for (imi = 0; imi < 2; ++imi)
-    {
-      results[nResults].pair.imageName[imi] = NULL;
-      CopyString(&(results[nResults].pair.imageName[imi]), r.pair.imageName[imi]);
-      results[nResults].pair.imageMinX[imi] = r.pair.imageMinX[imi];
-      results[nResults].pair.imageMaxX[imi] = r.pair.imageMaxX[imi];
-      results[nResults].pair.imageMinY[imi] = r.pair.imageMinY[imi];
-      results[nResults].pair.imageMaxY[imi] = r.pair.imageMaxY[imi];
-    }
-  results[nResults].pair.pairName = NULL;
-  CopyString(&(results[nResults].pair.pairName), r.pair.pairName);
-  results[nResults].updated = r.updated;
-  results[nResults].distortion = r.distortion;
-  results[nResults].correlation = r.correlation;
-  results[nResults].correspondence = r.correspondence;
-  results[nResults].constraining = r.constraining;
-  results[nResults].message = NULL;
-  CopyString(&(results[nResults].message), r.message);
+/* WriteStreamedPairs writes the updated pairs of the sorted results
+   in sortedName to the pairs file outputName */
+void
+WriteStreamedPairs (char *sortedName, char *outputName)
+{
+  FILE *f, *opf;
+  Result rs;
+  char names[3][PATH_MAX];
 
-  if ((nResults % 50) == 0 && nResults != 0)
-    printf(" %d \n                   ", nResults);
-  printf(".");
-  ++nResults;
+  f = fopen(sortedName, "r");
+  if (f == NULL)
+    Error("Could not open sorted results %s\n", sortedName);
+  opf = fopen(outputName, "w");
+  if (opf == NULL)
+    Error("Could not open output pairs file %s for writing.\n",
+	  outputName);
+  while (ReadStreamedResult(f, &rs, names))
+    if (rs.updated)
+      fprintf(opf, "%s %d %d %d %d %s %d %d %d %d %s\n",
+	      rs.pair.imageName[0],
+	      rs.pair.imageMinX[0],
+	      rs.pair.imageMaxX[0],
+	      rs.pair.imageMinY[0],
+	      rs.pair.imageMaxX[0],
+	      rs.pair.imageName[1],
+	      rs.pair.imageMinX[1],
+	      rs.pair.imageMaxX[1],
+	      rs.pair.imageMinY[1],
+	      rs.pair.imageMaxX[1],
+	      rs.pair.pairName);
+  fclose(opf);
+  fclose(f);
+}
+
+/* WriteStreamedSummary writes the sorted results in sortedName to the
+   summary f, one line each in format */
+void
+WriteStreamedSummary (FILE *f, char *sortedName, char *format)
+{
+  FILE *sf;
+  Result rs;
+  char names[3][PATH_MAX];
+
+  sf = fopen(sortedName, "r");
+  if (sf == NULL)
+    Error("Could not open sorted results %s\n", sortedName);
+  while (ReadStreamedResult(sf, &rs, names))
+    fprintf(f, format,
+	    rs.pair.imageName[0],
+	    rs.pair.imageName[1],
+	    rs.correlation,
+	    rs.distortion,
+	    rs.correspondence,
+	    rs.constraining,
+	    rs.distortion * c.distortion - rs.correlation +
+	    rs.correspondence * c.correspondence + rs.constraining * c.constraining);
+  fclose(sf);
 }
 
 int
@@ -1388,29 +2709,69 @@ Compare (const void *x, const void *y)
     return(1);
 }
 
+/* SortPairsByImage orders pairs so that pairs sharing their
+   lexically first image are delegated consecutively */
+int
+SortPairsByImage (const void *x, const void *y)
+{
+  Pair *px, *py;
+  char *ax, *bx, *ay, *by;
+  int cmp;
+
+  px = (Pair *) x;
+  py = (Pair *) y;
+  ax = px->imageName[0];
+  bx = px->imageName[1];
+  if (strcmp(ax, bx) > 0)
+    {
+      ax = px->imageName[1];
+      bx = px->imageName[0];
+    }
+  ay = py->imageName[0];
+  by = py->imageName[1];
+  if (strcmp(ay, by) > 0)
+    {
+      ay = py->imageName[1];
+      by = py->imageName[0];
+    }
+  if ((cmp = strcmp(ax, ay)) != 0)
+    return(cmp);
+  if ((cmp = strcmp(bx, by)) != 0)
+    return(cmp);
+  return(strcmp(px->pairName, py->pairName));
+}
+
+/* CompareStreamedBySlice orders streamed results by the name of their
+   image, the second field */
 int
-SortBySlice (const void *x, const void *y)
+CompareStreamedBySlice (const char *a, const char *b)
 {
-  Result *rx, *ry;
-  rx = (Result *) x;
-  ry = (Result *) y;
-  return(strcmp(rx->pair.imageName[0], ry->pair.imageName[0]));
+  a = strchr(a, ' ');
+  b = strchr(b, ' ');
+  if (a == NULL || b == NULL)
+    return(a == NULL ? (b == NULL ? 0 : -1) : 1);
+  for (++a, ++b; *a == *b && *a != ' ' && *a != '\0'; ++a, ++b) ;
+  if (*a == *b)
+    return(0);
+  if (*a == ' ')
+    return(-1);
+  if (*b == ' ')
+    return(1);
+  return(*((unsigned char *) a) - *((unsigned char *) b));
 }
 
+/* CompareStreamedByEnergy orders streamed results by decreasing
+   energy, the first field */
 int
-SortByEnergy (const void *x, const void *y)
+CompareStreamedByEnergy (const char *a, const char *b)
 {
-  Result *rx, *ry;
-  double ex, ey;
-  rx = (Result *) x;
-  ry = (Result *) y;
-  ex = rx->distortion * c.distortion - rx->correlation + rx->correspondence * c.correspondence +
-    rx->constraining * c.constraining;
-  ey = ry->distortion * c.distortion - ry->correlation + ry->correspondence * c.correspondence +
-    ry->constraining * c.constraining;
-  if (ex > ey)
+  double ea, eb;
+
+  ea = strtod(a, NULL);
+  eb = strtod(b, NULL);
+  if (ea > eb)
     return(-1);
-  else if (ex == ey)
+  else if (ea == eb)
     return(0);
   else
     return(1);
@@ -1479,17 +2840,121 @@ WorkerContext ()
   t.pair.imageName[0] = NULL;
   t.pair.imageName[1] = NULL;
   t.pair.pairName = NULL;
+  t.pair.warmName[0] = NULL;
+  t.pair.warmName[1] = NULL;
+  SetMapLevels(c.mapLevels);
+}
+
+/* TaskDeps sets params to the settings that the map of the current
+   task depends on, for its dependency sidecar */
+void
+TaskDeps (char *params)
+{
+  int imi;
+
+  sprintf(params, "register %d %d %d %d %d %d %d %.9g %.9g %.9g %.9g %.9g %.9g"
+	  " %.9g %.9g %.9g %.9g %.9g %.9g %d %.9g %d %d %d %d %d %d %d %d %d %d %d %d %d",
+	  c.strictMasking, c.startLevel, c.outputLevel, c.previewLevel,
+	  c.minResolution, c.depth, c.cptsMethod,
+	  c.distortion, c.correspondence, c.correspondenceThreshold,
+	  c.constraining, c.constrainingThreshold,
+	  c.constrainingConfidenceThreshold, c.quality, c.minOverlap,
+	  c.trimMapSourceThreshold, c.trimMapTargetThreshold,
+	  c.stopAcceptance, c.stopEnergy, c.refineSweeps, c.refinePolish,
+	  c.roiMargin, c.correlationHalfWidth, c.correlationKernel, c.metric,
+	  c.mapCompression, c.mapLevels, c.pyramidBits,
+	  c.maskBasename[0] != '\0', c.discontinuityBasename[0] != '\0',
+	  c.cptsName[0] != '\0', c.roiName[0] != '\0',
+	  c.initialMapName[0] != '\0', c.constrainingMapName[0] != '\0');
+  if (t.split != SPLIT_NONE)
+    sprintf(params + strlen(params), " split %d %d",
+	    c.splitSize, c.splitOverlap);
+  if (c.metric == NGF_METRIC)
+    sprintf(params + strlen(params), " ngf %.9g", c.ngfEdge);
+  for (imi = 0; imi < 2; ++imi)
+    sprintf(params + strlen(params), " %d %d %d %d %d",
+	    t.pair.imageMinX[imi], t.pair.imageMaxX[imi],
+	    t.pair.imageMinY[imi], t.pair.imageMaxY[imi],
+	    t.pair.warmName[imi] != NULL);
 }
 
 void
 WorkerTask ()
 {
-  FILE *f;
-  unsigned int w, h;
-  int i;
-  int n;
-  char fn[PATH_MAX];
-  int m;
+  int g;
+  int imi;
+
+  /* the pyramids of a group are kept for the next pair of the group
+     even without -pyramid_cache */
+  AllocateGroupResults(t.nGroup);
+  nGroupResults = 0;
+  resultSplit = t.split;
+  for (g = 0; g < t.nGroup; ++g)
+    {
+      CopyPair(&t.pair, &t.group[g]);
+
+      /* the tasks of a split pair change the context for themselves
+	 (see BeginSplitTask), with the part size and overlap the
+	 master chose, and the cheap pass of -adaptive runs at its own
+	 depth and quality */
+      if (t.split != SPLIT_NONE || t.pass == PASS_CHEAP)
+	savedContext = c;
+      if (t.split != SPLIT_NONE)
+	{
+	  c.splitSize = t.splitSize;
+	  c.splitOverlap = t.splitOverlap;
+	}
+      if (t.pass == PASS_CHEAP)
+	{
+	  c.depth = c.adaptiveDepth;
+	  c.quality = c.adaptiveQuality;
+	}
+      RegisterPair();
+      if (t.split != SPLIT_NONE || t.pass == PASS_CHEAP)
+	{
+	  c = savedContext;
+	  levelShift = 0;
+	}
+
+      /* a pair cropped to fit in -memory (see FitMemoryBudget) is
+	 reported with the bounds it was given */
+      if (t.split == SPLIT_NONE && c.memoryBudget > 0)
+	for (imi = 0; imi < 2; ++imi)
+	  {
+	    r.pair.imageMinX[imi] = t.group[g].imageMinX[imi];
+	    r.pair.imageMaxX[imi] = t.group[g].imageMaxX[imi];
+	    r.pair.imageMinY[imi] = t.group[g].imageMinY[imi];
+	    r.pair.imageMaxY[imi] = t.group[g].imageMaxY[imi];
+	  }
+      KeepPyramidsFor(g + 1 < t.nGroup && r.message == NULL ?
+		      &t.group[g+1] : NULL);
+
+      CopyPair(&groupResults[g].pair, &r.pair);
+      groupResults[g].updated = r.updated;
+      groupResults[g].distortion = r.distortion;
+      groupResults[g].correlation = r.correlation;
+      groupResults[g].correspondence = r.correspondence;
+      groupResults[g].constraining = r.constraining;
+      groupResults[g].pass = r.pass;
+      groupResults[g].memoryNeeded = r.memoryNeeded;
+      CopyString(&(groupResults[g].message), r.message);
+      ++nGroupResults;
+      if (r.message != NULL)
+	break;
+    }
+}
+
+/* RegisterPair computes the map of the pair t.pair, leaving its
+   result in r */
+void
+RegisterPair ()
+{
+  FILE *f;
+  unsigned int w, h;
+  int i;
+  int n;
+  char fn[PATH_MAX];
+  int m;
   int mx, my;
   int x, y;
   int irx, iry;
@@ -1510,6 +2975,7 @@ WorkerTask ()
   char line[LINE_LENGTH+1];
   struct stat sb;
   int computeMap;
+  int previewLevel;
   double outputTime;
   double energy;
   size_t imagePixels;
@@ -1517,6 +2983,7 @@ WorkerTask ()
   int mapHeader[3];
   char imageName[2][PATH_MAX], maskName[2][PATH_MAX], discontinuityName[2][PATH_MAX];
   char cptsName[PATH_MAX], initialMapName[PATH_MAX], constrainingMapName[PATH_MAX];
+  char roiName[PATH_MAX];
   char outputName[PATH_MAX], outputWarpedName[PATH_MAX], outputCorrelationName[PATH_MAX];
   char outputMaskName[PATH_MAX];
   int cw, ch;
@@ -1529,14 +2996,20 @@ WorkerTask ()
   double mi, mr;
   char errorMsg[PATH_MAX+256];
   int imi;
+  int warm;
   unsigned char *image_in;
   float *img;
-  cpu_set_t cpumask;
+  char depsName[PATH_MAX];
+  char depsParams[1024];
+  char fullParams[1024];
+  char *depsInputs[12];
+  int nDeps;
+  int depsCurrent;
+  int minX, maxX, minY, maxY;
+  unsigned char *fullMask;
 
+  /* the process is pinned, if at all, by libpar (-PAR_PIN) */
   Log("WORKER starting on node %d\n", par_instance());
-  //  CPU_ZERO(&cpumask);
-  //  CPU_SET(getpid() & 7, &cpumask);
-  //  sched_setaffinity(0, sizeof(cpu_set_t), &cpumask);
 
   /* construct filenames */
   for (imi = 0; imi < 2; ++imi)
@@ -1557,6 +3030,10 @@ WorkerTask ()
     sprintf(cptsName, "%s%s.pts", c.cptsName, t.pair.pairName);
   else
     cptsName[0] = '\0';
+  if (c.roiName[0] != '\0')
+    sprintf(roiName, "%s%s.roi", c.roiName, t.pair.pairName);
+  else
+    roiName[0] = '\0';
   if (c.initialMapName[0] != '\0')
     sprintf(initialMapName, "%s%s.map", c.initialMapName, t.pair.pairName);
   else
@@ -1583,9 +3060,40 @@ WorkerTask ()
   else
     outputMaskName[0] = '\0';
 
-  /* check if we can skip this task because of the -update option */
+  r.pass = t.pass;
+  r.memoryNeeded = 0.0;
+
+  /* the inputs recorded in the map's dependency sidecar */
+  sprintf(depsName, "%s.deps", outputName);
+  TaskDeps(depsParams);
+  nDeps = 0;
+  for (imi = 0; imi < 2; ++imi)
+    {
+      depsInputs[nDeps++] = imageName[imi];
+      depsInputs[nDeps++] = maskName[imi];
+      depsInputs[nDeps++] = discontinuityName[imi];
+      depsInputs[nDeps++] = t.pair.warmName[imi];
+    }
+  depsInputs[nDeps++] = cptsName;
+  depsInputs[nDeps++] = roiName;
+  depsInputs[nDeps++] = initialMapName;
+  depsInputs[nDeps++] = constrainingMapName;
+
+  /* the last stage of a split pair blends the maps of its parts */
+  if (t.split == SPLIT_STITCH)
+    {
+      StitchSplitPair(outputName);
+      if (r.message == NULL &&
+	  !WriteDeps(depsName, depsParams, nDeps, depsInputs))
+	Log("Could not write dependency sidecar %s\n", depsName);
+      return;
+    }
+
+  /* check if we can skip this task because of the -update option;
+     if the map has a dependency sidecar, its inputs are compared by
+     content, and otherwise by modification time */
   computeMap = 0;
-  if (!c.update)
+  if (!c.update || t.split == SPLIT_PART)
     computeMap = 1;
   /* check if output map file already exists */
   sprintf(fn, "%s.score", outputName);
@@ -1593,7 +3101,33 @@ WorkerTask ()
     outputTime = (double) sb.st_mtime;
   else
     computeMap = 1;
-  for (imi = 0; imi < 2; ++imi)
+  depsCurrent = -1;
+  if (!computeMap)
+    {
+      depsCurrent = DepsCurrent(depsName, depsParams, nDeps, depsInputs);
+
+      /* the cheap pass of -adaptive also keeps a map left by a retry */
+      if (depsCurrent == 0 && t.pass == PASS_CHEAP)
+	{
+	  c.depth = savedContext.depth;
+	  c.quality = savedContext.quality;
+	  TaskDeps(fullParams);
+	  c.depth = c.adaptiveDepth;
+	  c.quality = c.adaptiveQuality;
+	  if (DepsCurrent(depsName, fullParams, nDeps, depsInputs) == 1)
+	    {
+	      depsCurrent = 1;
+	      r.pass = PASS_FULL;
+	    }
+	}
+      if (depsCurrent == 0)
+	computeMap = 1;
+    }
+  /* without a sidecar, a retry cannot tell its own map from that of
+     the cheap pass */
+  if (t.pass == PASS_RETRY && depsCurrent < 0)
+    computeMap = 1;
+  for (imi = 0; imi < 2 && depsCurrent < 0; ++imi)
     {
       if (!computeMap)
 	{
@@ -1614,25 +3148,39 @@ WorkerTask ()
 	    computeMap = 1;
 	}	  
     }
-  if (!computeMap && cptsName[0] != '\0')
+  if (!computeMap && depsCurrent < 0 && cptsName[0] != '\0')
     {
       if (stat(cptsName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
 	computeMap = 1;
     }
-  if (!computeMap && initialMapName[0] != '\0')
+  if (!computeMap && depsCurrent < 0 && roiName[0] != '\0')
+    {
+      if (stat(roiName, &sb) == 0 &&
+	  (double) (sb.st_mtime) > outputTime)
+	computeMap = 1;
+    }
+  if (!computeMap && depsCurrent < 0 && initialMapName[0] != '\0')
     {
       if (stat(initialMapName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
 	computeMap = 1;
     }
-  if (!computeMap && constrainingMapName[0] != '\0')
+  if (!computeMap && depsCurrent < 0 && constrainingMapName[0] != '\0')
     {
       if (stat(constrainingMapName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
 	computeMap = 1;
     }
-  if (!computeMap && outputMaskName[0] != '\0')
+  /* a full run replaces the maps left by a -preview_level run */
+  if (!computeMap && c.previewLevel < 0)
+    {
+      sprintf(fn, "%s.map", outputName);
+      if (!ReadMapPreviewLevel(fn, &previewLevel, errorMsg) ||
+	  previewLevel >= 0)
+	computeMap = 1;
+    }
+  if (!computeMap && depsCurrent < 0 && outputMaskName[0] != '\0')
     {
       if (stat(outputMaskName, &sb) == 0 &&
 	  (double) (sb.st_mtime) > outputTime)
@@ -1719,80 +3267,192 @@ WorkerTask ()
     }
 
   Log("STARTING WORKER TASK\n");
+  MetricsName(t.pair.pairName);
+  MetricsPhase(METRICS_READ);
 
   initialMap = NULL;
   constrainingMap = NULL;
+  if (t.split != SPLIT_NONE &&
+      !BeginSplitTask(outputName, outputWarpedName, outputCorrelationName,
+		      outputMaskName))
+    return;
+
+  /* with -memory, a task that would not fit is made to, or handed
+     back to the master, before anything is read */
+  if (c.memoryBudget > 0 && !FitMemoryBudget(initialMapName))
+    return;
+
+  /* with -adaptive_warm, a retry starts from its map of the cheap
+     pass */
+  if (t.pass == PASS_RETRY && c.adaptiveWarm)
+    {
+      sprintf(fn, "%s.map", outputName);
+      if (!ReadMap(fn, &initialMap, &initialMapLevel,
+		   &mpwi, &mphi, &offxi, &offyi,
+		   NULL, NULL, errorMsg))
+	{
+	  Log("Could not start from the map of the cheap pass:\n %s\n",
+	      errorMsg);
+	  initialMap = NULL;
+	}
+    }
 
+  for (i = 0; i < nPyramidCache; ++i)
+    pyramidCache[i].inUse = 0;
   for (imi = 0; imi < 2; ++imi)
     {
-      Log("WORKER reading image %s\n", imageName[imi]);
+      cachedLevels[imi] = 0;
+      pyramidCacheIndex[imi] = -1;
+      if (UsePyramidCache())
+	{
+	  MakePyramidKey(&pyramidKeys[imi], &t.pair, imi,
+			 imageName[imi], maskName[imi]);
+	  cachedLevels[imi] = LookupPyramid(imi);
+	}
+      if (cachedLevels[imi] > 0)
+	{
+	  MetricsCount("pyramid_cache_hits", 1);
+	  continue;
+	}
 
+      /* the coarse pass of a split pair reads the images reduced
+	 to its split level, which then stands for level 0, and the
+	 whole pixels of the reduction that lie within the bounds */
       image_in = NULL;
-      if (!ReadImage(imageName[imi], &image_in,
-		     &imageWidth[imi][0], &imageHeight[imi][0],
-		     t.pair.imageMinX[imi], t.pair.imageMaxX[imi],
-		     t.pair.imageMinY[imi], t.pair.imageMaxY[imi],
-		     errorMsg))
+      factor = 1 << levelShift;
+      minX = t.pair.imageMinX[imi] >= 0 ?
+	(t.pair.imageMinX[imi] + factor - 1) / factor : -1;
+      maxX = t.pair.imageMaxX[imi] >= 0 ?
+	(t.pair.imageMaxX[imi] + 1) / factor - 1 : -1;
+      minY = t.pair.imageMinY[imi] >= 0 ?
+	(t.pair.imageMinY[imi] + factor - 1) / factor : -1;
+      maxY = t.pair.imageMaxY[imi] >= 0 ?
+	(t.pair.imageMaxY[imi] + 1) / factor - 1 : -1;
+
+      /* the mask is read first so that an image that has to be
+	 decoded can be masked as it is converted to floats */
+      masks[imi][0] = NULL;
+      maskPresent = 0;
+#if MASKING
+      if (maskName[imi][0] != '\0')
+	{
+	  if (levelShift > 0)
+	    {
+	      if (!ReadBitmap(maskName[imi], &fullMask, &imw, &imh,
+			      minX >= 0 ? minX * factor : -1,
+			      maxX >= 0 ? (maxX + 1) * factor - 1 : -1,
+			      minY >= 0 ? minY * factor : -1,
+			      maxY >= 0 ? (maxY + 1) * factor - 1 : -1,
+			      errorMsg))
+		{
+		  SetMessage("Could not read mask %s\n", maskName[imi]);
+		  return;
+		}
+	      masks[imi][0] = (unsigned char *)
+		malloc((imh / factor) * (size_t) ((imw / factor + 7) >> 3));
+	      if (masks[imi][0] == NULL ||
+		  !ReduceMask(fullMask, imw, imh, factor, c.strictMasking,
+			      masks[imi][0]))
+		{
+		  SetMessage("Could not reduce mask %s\n", maskName[imi]);
+		  return;
+		}
+	      free(fullMask);
+	      imw /= factor;
+	      imh /= factor;
+	    }
+	  else if (!TakePrefetchedImage(maskName[imi], 1, imi, &masks[imi][0],
+					&imw, &imh) &&
+		   !ReadBitmap(maskName[imi], &masks[imi][0],
+			       &imw, &imh,
+			       t.pair.imageMinX[imi], t.pair.imageMaxX[imi],
+			       t.pair.imageMinY[imi], t.pair.imageMaxY[imi],
+			       errorMsg))
+	    {
+	      SetMessage("Could not read mask %s\n", maskName[imi]);
+	      return;
+	    }
+	  Log("WORKER READ THE IMAGE MASK\n");
+	  maskPresent = 1;
+	}
+#endif
+
+      Log("WORKER reading image %s\n", imageName[imi]);
+      images[imi][0] = NULL;
+      if (levelShift > 0)
 	{
-	  SetMessage("Could not read image %s\n", imageName[imi]);
+	  if (!ReadImageRegionReduced(imageName[imi], factor, &image_in,
+				      &imageWidth[imi][0],
+				      &imageHeight[imi][0],
+				      minX, maxX, minY, maxY, errorMsg))
+	    {
+	      SetMessage("Could not read image %s\n", imageName[imi]);
+	      return;
+	    }
+	}
+      else if (!TakePrefetchedImage(imageName[imi], 0, imi, &image_in,
+				    &imageWidth[imi][0],
+				    &imageHeight[imi][0]) &&
+	       !ReadFloatImage(imageName[imi], &images[imi][0],
+			       &imageWidth[imi][0], &imageHeight[imi][0],
+			       t.pair.imageMinX[imi], t.pair.imageMaxX[imi],
+			       t.pair.imageMinY[imi], t.pair.imageMaxY[imi],
+			       masks[imi][0], imw, imh, NULL,
+			       errorMsg))
+	{
+	  SetMessage("Could not read image %s:\n%s", imageName[imi],
+		     errorMsg);
 	  return;
 	}
       Log("image_in = %llx  w = %d h = %d\n", image_in,
 	  imageWidth[imi][0], imageHeight[imi][0]);
-      imageOffsetX[imi][0] = (t.pair.imageMinX[imi] >= 0) ? t.pair.imageMinX[imi] : 0;
-      imageOffsetY[imi][0] = (t.pair.imageMinY[imi] >= 0) ? t.pair.imageMinY[imi] : 0;
+      imageOffsetX[imi][0] = (minX >= 0) ? minX : 0;
+      imageOffsetY[imi][0] = (minY >= 0) ? minY : 0;
       Log("WORKER READ IMAGE: %s\n", imageName[imi]);
 
-      imagePixels = ((size_t) imageWidth[imi][0]) * imageHeight[imi][0];
-      images[imi][0] = (float *) malloc(imagePixels * sizeof(float));
-      if (images[imi][0] == NULL)
+#if MASKING
+      Log("imw[%d] = %d imh[%d] = %d imageWidth[%d][0] = %d imageHeight[%d][0] = %d\n",
+	  imi, imw, imi, imh, imi, imageWidth[imi][0], imi, imageHeight[imi][0]);
+      if (maskPresent &&
+	  (imw != imageWidth[imi][0] ||
+	   imh != imageHeight[imi][0]))
 	{
-	  SetMessage("Could not allocate image arrays (%zd)\n",
-		     imagePixels * sizeof(float));
+	  SetMessage("Error: incorrect reference mask size: %s\n", maskName[imi]);
 	  return;
 	}
-      Log("images[0] = %llx  imp = %llu\n", (long long) images[imi][0], imagePixels);
-      img = images[imi][0];
-      for (ii = 0; ii < imagePixels; ++ii)
-	img[ii] = image_in[ii];
-      free(image_in);
-      image_in = NULL;
+#endif
 
-#if MASKING
-      maskPresent = 0;
+      /* an image that was reduced or prefetched is still 8-bit */
+      imagePixels = ((size_t) imageWidth[imi][0]) * imageHeight[imi][0];
       imbpl = (imageWidth[imi][0] + 7) >> 3;
-      if (maskName[imi][0] != '\0')
+      if (image_in != NULL)
 	{
-	  masks[imi][0] = NULL;
-	  if (!ReadBitmap(maskName[imi], &masks[imi][0],
-			  &imw, &imh,
-			  t.pair.imageMinX[imi], t.pair.imageMaxX[imi],
-			  t.pair.imageMinY[imi], t.pair.imageMaxY[imi],
-			  errorMsg))
+	  images[imi][0] = (float *) malloc(imagePixels * sizeof(float));
+	  if (images[imi][0] == NULL)
 	    {
-	      SetMessage("Could not read mask %s\n", maskName[imi]);
+	      SetMessage("Could not allocate image arrays (%zd)\n",
+			 imagePixels * sizeof(float));
 	      return;
 	    }
-	  Log("WORKER READ THE IMAGE MASK\n");
-
-	  Log("imw[%d] = %d imh[%d] = %d imageWidth[%d][0] = %d imageHeight[%d][0] = %d\n",
-	      imi, imw, imi, imh, imi, imageWidth[imi][0], imi, imageHeight[imi][0]);
-
-	  if (imw != imageWidth[imi][0] ||
-	      imh != imageHeight[imi][0])
+	  img = images[imi][0];
+	  for (ii = 0; ii < imagePixels; ++ii)
+	    img[ii] = image_in[ii];
+	  free(image_in);
+	  image_in = NULL;
+#if MASKING
+	  if (maskPresent)
 	    {
-	      SetMessage("Error: incorrect reference mask size: %s\n", maskName[imi]);
-	      return;
+	      for (my = 0; my < imh; ++my)
+		for (mx = 0; mx < imw; ++mx)
+		  if (!MASK(masks[imi][0], imbpl, mx, my))
+		    IMAGE(img, imw, mx, my) = 0;
+	      Log("WORKER APPLIED THE IMAGE MASK\n");
 	    }
-	  
-	  img = images[imi][0];
-	  for (my = 0; my < imh; ++my)
-	    for (mx = 0; mx < imw; ++mx)
-	      if (!MASK(masks[imi][0], imbpl, mx, my))
-		IMAGE(img, imw, mx, my) = 0;
-	  Log("WORKER APPLIED THE IMAGE MASK\n");
-	  maskPresent = 1;
+#endif
 	}
+      Log("images[0] = %llx  imp = %llu\n", (long long) images[imi][0], imagePixels);
+
+#if MASKING
       if (!maskPresent)
 	{
 	  masks[imi][0] = (unsigned char *) malloc(imageHeight[imi][0]*imbpl);
@@ -1828,6 +3488,7 @@ WorkerTask ()
 	}
 #endif
     }
+  ReleasePrefetchedTask(t.pair.pairName);
 
 #if MASKING
   outputMasks[0] = NULL;
@@ -1883,10 +3544,66 @@ WorkerTask ()
 	    }
 	  fclose(f);
 	}
+      for (i = 0; i < nCpts; ++i)
+	{
+	  cpts[i].ix /= 1 << levelShift;
+	  cpts[i].iy /= 1 << levelShift;
+	  cpts[i].rx /= 1 << levelShift;
+	  cpts[i].ry /= 1 << levelShift;
+	}
+    }
+
+  /* read in the region of interest, if present; it is given as
+     "minX maxX minY maxY" in the pixel coordinates of the image */
+  roiMinX = -1;
+  if (roiName[0] != '\0')
+    {
+      f = fopen(roiName, "r");
+      if (f != NULL)
+	{
+	  if (fgets(line, LINE_LENGTH, f) == NULL ||
+	      sscanf(line, "%d%d%d%d",
+		     &roiMinX, &roiMaxX, &roiMinY, &roiMaxY) != 4 ||
+	      roiMinX < 0 || roiMaxX < roiMinX ||
+	      roiMinY < 0 || roiMaxY < roiMinY)
+	    Error("Invalid region of interest in %s\n", roiName);
+	  fclose(f);
+	  roiMinX >>= levelShift;
+	  roiMaxX >>= levelShift;
+	  roiMinY >>= levelShift;
+	  roiMaxY >>= levelShift;
+	  Log("Region of interest is %d-%d, %d-%d\n",
+	      roiMinX, roiMaxX, roiMinY, roiMaxY);
+	}
     }
 
-  /* get the initial map, if present */
-  if (initialMapName[0] != '\0')
+  /* get the initial map, if present; with -warm_start, the
+     composition of the finished maps takes its place, unless it
+     cannot be made */
+  warm = 0;
+  if (t.pair.warmName[0] != NULL)
+    {
+      warm = ComposeWarmMap(t.pair.warmName[0], t.pair.warmName[1], errorMsg);
+      if (!warm)
+	Log("Could not warm start; using the usual initial map:\n %s\n",
+	    errorMsg);
+    }
+  if (warm)
+    {
+      initialMapFactor = 1 << initialMapLevel;
+      Log("Warm start from maps %s and %s of size %d x %d;  initialMapFactor = %d\n",
+	  t.pair.warmName[0], t.pair.warmName[1], mpwi, mphi,
+	  initialMapFactor);
+    }
+  else if (initialMap != NULL)
+    {
+      /* a part of a split pair starts from the coarse map, and a
+	 retry of -adaptive_warm from the map of the cheap pass */
+      initialMapFactor = 1 << initialMapLevel;
+      Log("Starting from the map of an earlier stage of size %d x %d;  initialMapFactor = %d\n",
+	  mpwi, mphi, initialMapFactor);
+    }
+  else if (initialMapName[0] != '\0')
     {
       if (!ReadMap(initialMapName,
 		   &initialMap,
@@ -1921,13 +3638,48 @@ WorkerTask ()
   else
     constrainingMapFactor = 0;
 
+  /* the coarse pass of a split pair measures its maps in the pixels
+     of its reduced images */
+  if (levelShift > 0 && initialMapFactor != 0)
+    {
+      if (initialMapLevel < levelShift)
+	{
+	  SetMessage("Initial map of %s is finer than its split level (%d)\n",
+		     t.pair.pairName, levelShift);
+	  return;
+	}
+      initialMapLevel -= levelShift;
+      initialMapFactor = 1 << initialMapLevel;
+    }
+  if (levelShift > 0 && constrainingMapFactor != 0)
+    {
+      if (constrainingMapLevel < levelShift)
+	{
+	  SetMessage("Constraining map of %s is finer than its split level (%d)\n",
+		     t.pair.pairName, levelShift);
+	  return;
+	}
+      constrainingMapLevel -= levelShift;
+      constrainingMapFactor = 1 << constrainingMapLevel;
+    }
+
+  MetricsPhase(METRICS_PYRAMID);
   if (!Init())
     {
       Log("Init was unsuccessful.\n");
       return;
     }
 
+  /* the next task has most likely arrived by now, so its input can
+     be read while this one computes */
+  par_worker_poll();
+
+  MetricsPhase(METRICS_COMPUTE);
   Compute(outputName, outputWarpedName, outputCorrelationName);
+  METRICS_MARK(NULL);
+  if (t.split == SPLIT_NONE &&
+      !WriteDeps(depsName, depsParams, nDeps, depsInputs))
+    Log("Could not write dependency sidecar %s\n", depsName);
 
   if (initialMap != NULL)
     {
@@ -1942,14 +3694,22 @@ WorkerTask ()
 #if FOLDING
   free(idisc);
 #endif
+  for (imi = 0; imi < 2; ++imi)
+    if (UsePyramidCache())
+      StorePyramid(imi);
   for (level = 0; level < nLevels; ++level)
     {
       for (imi = 0; imi < 2; ++imi)
 	{
-	  free(images[imi][level]);
+	  if (!UsePyramidCache())
+	    {
+	      free(images[imi][level]);
+	      free(packedImages[imi][level]);
+	      packedImages[imi][level] = NULL;
 #if MASKING
-	  free(masks[imi][level]);
+	      free(masks[imi][level]);
 #endif
+	    }
 #if FOLDING
 	  free(imdisc[imi][level]);
 #endif
@@ -1961,76 +3721,1540 @@ WorkerTask ()
     }
 }
 
+/* PairRegion sets the bounds of image imi of pair p, in pixels, to
+   those given with the pair or else to the whole image; it returns 0
+   if the size of the image cannot be read */
 int
-Init ()
+PairRegion (Pair *p, int imi, int *minX, int *maxX, int *minY, int *maxY)
 {
-  int level;
-  unsigned int iw, ih;
-  float *image;
-  size_t imagePixels;
-  size_t ii;
-  int i;
-  int x, y;
-  size_t imbpl;
-  size_t ombpl;
-  int b;
-  int dx, dy;
-  unsigned char *iCount;
-  size_t impw, imph;
-  size_t impbpl;
-  int imi;
-  size_t maskCount;
+  char fn[PATH_MAX];
+  char errorMsg[PATH_MAX + 256];
+  int width, height;
+
+  width = height = 0;
+  if (p->imageMinX[imi] < 0 || p->imageMaxX[imi] < 0 ||
+      p->imageMinY[imi] < 0 || p->imageMaxY[imi] < 0)
+    {
+      sprintf(fn, "%s%s", c.imageBasename, p->imageName[imi]);
+      if (!ReadImageSize(fn, &width, &height, errorMsg))
+	return(0);
+    }
+  *minX = p->imageMinX[imi] >= 0 ? p->imageMinX[imi] : 0;
+  *maxX = p->imageMaxX[imi] >= 0 ? p->imageMaxX[imi] : width - 1;
+  *minY = p->imageMinY[imi] >= 0 ? p->imageMinY[imi] : 0;
+  *maxY = p->imageMaxY[imi] >= 0 ? p->imageMaxY[imi] : height - 1;
+  return(*maxX >= *minX && *maxY >= *minY);
+}
+
+/* SplitGrid sets the number of columns and rows of parts that the
+   image region minX..maxX, minY..maxY of a split pair is cut into */
+void
+SplitGrid (int minX, int maxX, int minY, int maxY, int *ntx, int *nty)
+{
+  *ntx = (maxX - minX + c.splitSize) / c.splitSize;
+  *nty = (maxY - minY + c.splitSize) / c.splitSize;
+}
+
+/* SplitWindow sets the window of part k of the image region minX..maxX,
+   minY..maxY of a split pair: its share of the region, widened by the
+   overlap on each side that does not lie on the edge of the region */
+void
+SplitWindow (int minX, int maxX, int minY, int maxY, int k,
+	     int *wMinX, int *wMaxX, int *wMinY, int *wMaxY)
+{
+  int ntx, nty;
+  int tx, ty;
+  long w, h;
+
+  SplitGrid(minX, maxX, minY, maxY, &ntx, &nty);
+  tx = k % ntx;
+  ty = k / ntx;
+  w = maxX - minX + 1;
+  h = maxY - minY + 1;
+  *wMinX = minX + (int) (tx * w / ntx) - c.splitOverlap;
+  *wMaxX = minX + (int) ((tx + 1) * w / ntx) - 1 + c.splitOverlap;
+  *wMinY = minY + (int) (ty * h / nty) - c.splitOverlap;
+  *wMaxY = minY + (int) ((ty + 1) * h / nty) - 1 + c.splitOverlap;
+  if (*wMinX < minX)
+    *wMinX = minX;
+  if (*wMaxX > maxX)
+    *wMaxX = maxX;
+  if (*wMinY < minY)
+    *wMinY = minY;
+  if (*wMaxY > maxY)
+    *wMaxY = maxY;
+}
+
+/* BeginSplitTask prepares the task of a split pair once it is known
+   to need computing.  The coarse pass registers the images reduced by
+   the split level, so the context is changed to match (WorkerTask
+   restores it).  A part registers its window of the image, and the
+   region of the reference that the coarse map takes the window to,
+   from the split level down, starting from the coarse map.  Both only
+   write their maps, under names of their own.  BeginSplitTask returns
+   0, leaving r set, if the task is not to be computed. */
+int
+BeginSplitTask (char *outputName, char *outputWarpedName,
+		char *outputCorrelationName, char *outputMaskName)
+{
+  char coarseName[PATH_MAX];
+  char fn[PATH_MAX];
+  char errorMsg[PATH_MAX + 256];
+  int factor;
   int minX, maxX, minY, maxY;
-  float *src_image;
-  int src_iw, src_ih;
-  int src_x, src_y;
-  unsigned char *src_mask;
-  int src_mbpl;
-  int delta_x, delta_y;
+  int wMinX, wMaxX, wMinY, wMaxY;
+  int rMinX, rMaxX, rMinY, rMaxY;
+  int margin;
+  int x, y;
   int ix, iy;
-  unsigned char *m;
-  int factor;
-  int mapMinX, mapMaxX, mapMinY, mapMaxY;
+  int imi;
+  double lx, hx, ly, hy;
+  MapElement *e;
 
-  memset(maps, 0, MAX_LEVELS * sizeof(MapElement*));
-  for (imi = 0; imi < 2; ++imi)
+  factor = 1 << t.splitLevel;
+  sprintf(coarseName, "%s.coarse", outputName);
+  outputWarpedName[0] = '\0';
+  outputCorrelationName[0] = '\0';
+  c.writeAllMaps = 0;
+  if (t.split == SPLIT_COARSE)
     {
-      imagePixels = ((size_t) imageWidth[imi][0]) * imageHeight[imi][0];
-      Log("iw[%d] = %d ih[%d] = %d pixels = %llu\n",
-	  imi, imageWidth[imi][0], imi, imageHeight[imi][0], imagePixels);
-
-      iw = imageWidth[imi][0];
-      ih = imageHeight[imi][0];
-      imbpl = (iw + 7) >> 3;
-#if MASKING
-      Log("maskcount = %ld\n", CountBits(masks[imi][0], ih * imbpl));
-#endif
+      levelShift = t.splitLevel;
+      c.outputLevel = 0;
+      if (c.startLevel >= 0)
+	c.startLevel -= t.splitLevel;
+      c.correspondenceThreshold /= factor;
+      c.constrainingThreshold /= factor;
+      c.roiMargin /= factor;
+      outputMaskName[0] = '\0';
+      strcpy(outputName, coarseName);
+      return(1);
     }
-  mapWidth[0] = imageWidth[0][0];
-  mapHeight[0] = imageHeight[0][0];
-  mapOffsetX[0] = imageOffsetX[0][0];
-  mapOffsetY[0] = imageOffsetY[0][0];
 
-  /* create hierarchical representations of images */
-  for (level = 1; mapWidth[level-1] > 2 || mapHeight[level-1] > 2; ++level)
+  c.startLevel = t.splitLevel;
+  sprintf(outputName + strlen(outputName), ".part%d", t.splitPart);
+  sprintf(fn, "%s.map", outputName);
+  unlink(fn);
+  if (!PairRegion(&t.pair, 0, &minX, &maxX, &minY, &maxY))
     {
-      Log("creating level %d\n", level);
-      factor = 1 << level;
-
-      mapMinX = imageOffsetX[0][0] / factor;
-      mapMaxX = (imageOffsetX[0][0] + imageWidth[0][0] - 1) / factor + 1;
-      mapMinY = imageOffsetY[0][0] / factor;
-      mapMaxY = (imageOffsetY[0][0] + imageHeight[0][0] - 1) / factor + 1;
-      mapWidth[level] = mapMaxX - mapMinX + 1;
-      mapHeight[level] = mapMaxY - mapMinY + 1;
-      mapOffsetX[level] = mapMinX;
-      mapOffsetY[level] = mapMinY;
-      Log("map dims: %d x %d + %d + %d\n", mapWidth[level], mapHeight[level],
-	  mapOffsetX[level], mapOffsetY[level]);
+      SetMessage("Could not read the size of image %s\n",
+		 t.pair.imageName[0]);
+      return(0);
+    }
+  SplitWindow(minX, maxX, minY, maxY, t.splitPart,
+	      &wMinX, &wMaxX, &wMinY, &wMaxY);
+
+  /* read the coarse map around the window (its first element gives
+     the offset of its grid); there is none if the coarse pass found
+     nothing to map */
+  sprintf(fn, "%s.map", coarseName);
+  if (access(fn, R_OK) == 0)
+    {
+      if (!ReadMapRegion(fn, &initialMap, &initialMapLevel, &mpwi, &mphi,
+			 &offxi, &offyi, NULL, NULL, 0, 0, 0, 0, errorMsg))
+	{
+	  SetMessage("Could not read coarse map %s:\n%s\n", fn, errorMsg);
+	  return(0);
+	}
+      free(initialMap);
+      initialMap = NULL;
+      if (!ReadMapRegion(fn, &initialMap, &initialMapLevel, &mpwi, &mphi,
+			 &offxi, &offyi, NULL, NULL,
+			 wMinX / factor - 4 - offxi, wMaxX / factor + 4 - offxi,
+			 wMinY / factor - 4 - offyi, wMaxY / factor + 4 - offyi,
+			 errorMsg))
+	initialMap = NULL;
+    }
 
+  /* the reference region holds where the coarse map takes the
+     window, widened by the overlap and two elements */
+  lx = ly = 1.0e30;
+  hx = hy = -1.0e30;
+  for (y = 0; initialMap != NULL && y < mphi; ++y)
+    for (x = 0; x < mpwi; ++x)
+      {
+	e = &MAP(initialMap, mpwi, x, y);
+	ix = (x + offxi) * factor;
+	iy = (y + offyi) * factor;
+	if (e->c <= 0.0 || ix < wMinX - factor || ix > wMaxX + factor ||
+	    iy < wMinY - factor || iy > wMaxY + factor)
+	  continue;
+	if (e->x < lx)
+	  lx = e->x;
+	if (e->x > hx)
+	  hx = e->x;
+	if (e->y < ly)
+	  ly = e->y;
+	if (e->y > hy)
+	  hy = e->y;
+      }
+  margin = c.splitOverlap + 2 * factor;
+  rMinX = rMaxX = rMinY = rMaxY = 0;
+  if (lx <= hx && PairRegion(&t.pair, 1, &rMinX, &rMaxX, &rMinY, &rMaxY))
+    {
+      if (rMinX < (int) floor(lx * factor) - margin)
+	rMinX = (int) floor(lx * factor) - margin;
+      if (rMaxX > (int) ceil(hx * factor) + margin)
+	rMaxX = (int) ceil(hx * factor) + margin;
+      if (rMinY < (int) floor(ly * factor) - margin)
+	rMinY = (int) floor(ly * factor) - margin;
+      if (rMaxY > (int) ceil(hy * factor) + margin)
+	rMaxY = (int) ceil(hy * factor) + margin;
+    }
+  if (lx > hx || rMaxX < rMinX || rMaxY < rMinY)
+    {
+      Log("WORKER TASK skipping part %d of %s since the coarse map has nothing there\n",
+	  t.splitPart, t.pair.pairName);
+      free(initialMap);
+      initialMap = NULL;
       for (imi = 0; imi < 2; ++imi)
 	{
-	  // calculate the ranges for level-1
+	  CopyString(&(r.pair.imageName[imi]), t.pair.imageName[imi]);
+	  r.pair.imageMinX[imi] = t.pair.imageMinX[imi];
+	  r.pair.imageMaxX[imi] = t.pair.imageMaxX[imi];
+	  r.pair.imageMinY[imi] = t.pair.imageMinY[imi];
+	  r.pair.imageMaxY[imi] = t.pair.imageMaxY[imi];
+	}
+      CopyString(&(r.pair.pairName), t.pair.pairName);
+      r.updated = 0;
+      r.correlation = 0.0;
+      r.distortion = 0.0;
+      r.correspondence = 0.0;
+      r.constraining = 0.0;
+      CopyString(&(r.message), NULL);
+      return(0);
+    }
+  t.pair.imageMinX[0] = wMinX;
+  t.pair.imageMaxX[0] = wMaxX;
+  t.pair.imageMinY[0] = wMinY;
+  t.pair.imageMaxY[0] = wMaxY;
+  t.pair.imageMinX[1] = rMinX;
+  t.pair.imageMaxX[1] = rMaxX;
+  t.pair.imageMinY[1] = rMinY;
+  t.pair.imageMaxY[1] = rMaxY;
+  Log("Part %d of %s registers %d-%d, %d-%d to %d-%d, %d-%d\n",
+      t.splitPart, t.pair.pairName, wMinX, wMaxX, wMinY, wMaxY,
+      rMinX, rMaxX, rMinY, rMaxY);
+  return(1);
+}
+
+/* StitchSplitPair makes the map of the split pair t.pair by blending
+   the maps of its parts: each point is the mean of the parts that
+   have it, weighted by its distance (up to the overlap) from the edges
+   of their windows that lie inside the image; the score is the mean
+   of the parts' scores, weighted alike.  The maps of the parts and
+   the coarse map are then removed. */
+void
+StitchSplitPair (char *outputName)
+{
+  char fn[PATH_MAX];
+  char errorMsg[PATH_MAX + 256];
+  int minX, maxX, minY, maxY;
+  int wMinX, wMaxX, wMinY, wMaxY;
+  int ntx, nty;
+  int k;
+  int level, factor;
+  int mpw, mph, mox, moy;
+  MapElement *map;
+  float *weight;
+  MapElement *pm;
+  int pl, pw, ph, px, py;
+  int x, y;
+  int gx, gy;
+  int ix, iy;
+  int d;
+  float w;
+  double partWeight, totalWeight;
+  double score[5], sum[5];
+  MapElement *e, *o;
+  FILE *f;
+  int imi;
+  int i;
+  size_t n, ii;
+  PendingOutput po;
+
+  for (imi = 0; imi < 2; ++imi)
+    {
+      CopyString(&(r.pair.imageName[imi]), t.pair.imageName[imi]);
+      r.pair.imageMinX[imi] = t.pair.imageMinX[imi];
+      r.pair.imageMaxX[imi] = t.pair.imageMaxX[imi];
+      r.pair.imageMinY[imi] = t.pair.imageMinY[imi];
+      r.pair.imageMaxY[imi] = t.pair.imageMaxY[imi];
+    }
+  CopyString(&(r.pair.pairName), t.pair.pairName);
+  r.updated = 1;
+  CopyString(&(r.message), NULL);
+
+  if (!PairRegion(&t.pair, 0, &minX, &maxX, &minY, &maxY))
+    {
+      SetMessage("Could not read the size of image %s\n",
+		 t.pair.imageName[0]);
+      return;
+    }
+
+  /* the grid of the map, as Init() would lay it out */
+  level = c.outputLevel;
+  factor = 1 << level;
+  mox = minX / factor;
+  moy = minY / factor;
+  mpw = (level > 0 ? maxX / factor + 1 : maxX) - mox + 1;
+  mph = (level > 0 ? maxY / factor + 1 : maxY) - moy + 1;
+  n = ((size_t) mpw) * mph;
+  map = (MapElement *) malloc(n * sizeof(MapElement));
+  weight = (float *) malloc(n * sizeof(float));
+  if (map == NULL || weight == NULL)
+    {
+      SetMessage("Could not allocate map of split pair %s\n",
+		 t.pair.pairName);
+      return;
+    }
+  memset(map, 0, n * sizeof(MapElement));
+  memset(weight, 0, n * sizeof(float));
+
+  SplitGrid(minX, maxX, minY, maxY, &ntx, &nty);
+  totalWeight = 0.0;
+  for (i = 0; i < 5; ++i)
+    sum[i] = 0.0;
+  for (k = 0; k < ntx * nty; ++k)
+    {
+      /* a part with nothing to register left no map */
+      sprintf(fn, "%s.part%d.map", outputName, k);
+      if (access(fn, R_OK) != 0)
+	continue;
+      if (!ReadMap(fn, &pm, &pl, &pw, &ph, &px, &py, NULL, NULL, errorMsg))
+	{
+	  SetMessage("Could not read map of part:\n%s\n", errorMsg);
+	  return;
+	}
+      if (pl != level)
+	{
+	  SetMessage("Map of part %s is at level %d instead of %d\n",
+		     fn, pl, level);
+	  return;
+	}
+      SplitWindow(minX, maxX, minY, maxY, k, &wMinX, &wMaxX, &wMinY, &wMaxY);
+      partWeight = 0.0;
+      for (y = 0; y < ph; ++y)
+	for (x = 0; x < pw; ++x)
+	  {
+	    e = &MAP(pm, pw, x, y);
+	    gx = x + px - mox;
+	    gy = y + py - moy;
+	    if (e->c <= 0.0 || gx < 0 || gx >= mpw || gy < 0 || gy >= mph)
+	      continue;
+	    ix = (x + px) * factor;
+	    iy = (y + py) * factor;
+	    d = c.splitOverlap;
+	    if (wMinX > minX && ix - wMinX < d)
+	      d = ix - wMinX;
+	    if (wMaxX < maxX && wMaxX - ix < d)
+	      d = wMaxX - ix;
+	    if (wMinY > minY && iy - wMinY < d)
+	      d = iy - wMinY;
+	    if (wMaxY < maxY && wMaxY - iy < d)
+	      d = wMaxY - iy;
+	    if (d < 0)
+	      continue;
+	    w = (d + 1.0) / (c.splitOverlap + 1.0);
+	    o = &MAP(map, mpw, gx, gy);
+	    o->x += w * e->x;
+	    o->y += w * e->y;
+	    o->c += w * e->c;
+	    weight[gy * (size_t) mpw + gx] += w;
+	    partWeight += w;
+	  }
+      free(pm);
+
+      sprintf(fn, "%s.part%d.score", outputName, k);
+      f = fopen(fn, "r");
+      if (f == NULL ||
+	  fscanf(f, "%lf%lf%lf%lf%lf", &score[0], &score[1], &score[2],
+		 &score[3], &score[4]) != 5)
+	{
+	  SetMessage("Could not read score of part %s\n", fn);
+	  return;
+	}
+      fclose(f);
+      for (i = 0; i < 5; ++i)
+	sum[i] += partWeight * score[i];
+      totalWeight += partWeight;
+    }
+  for (ii = 0; ii < n; ++ii)
+    if (weight[ii] > 0.0)
+      {
+	map[ii].x /= weight[ii];
+	map[ii].y /= weight[ii];
+	map[ii].c /= weight[ii];
+      }
+  free(weight);
+  if (totalWeight > 0.0)
+    for (i = 0; i < 5; ++i)
+      sum[i] /= totalWeight;
+
+  WriteOutputMap(outputName, level, map, mpw, mph, mox, moy);
+  free(map);
+  po.kind = OUTPUT_SCORE;
+  sprintf(po.fn, "%s.score", outputName);
+  po.data = malloc(256);
+  if (po.data == NULL)
+    Error("Could not allocate score text\n");
+  sprintf((char *) po.data, "%f %f %f %f %f\n",
+	  sum[0], sum[1], sum[2], sum[3], sum[4]);
+  QueueOutput(&po);
+  r.correlation = sum[1];
+  r.distortion = sum[2];
+  r.correspondence = sum[3];
+  r.constraining = sum[4];
+
+  for (k = 0; k < ntx * nty; ++k)
+    {
+      sprintf(fn, "%s.part%d.map", outputName, k);
+      unlink(fn);
+      sprintf(fn, "%s.part%d.score", outputName, k);
+      unlink(fn);
+    }
+  sprintf(fn, "%s.coarse.map", outputName);
+  unlink(fn);
+  sprintf(fn, "%s.coarse.score", outputName);
+  unlink(fn);
+}
+
+/* the worker-side pyramid cache; each entry holds all levels of one
+   image (after masking) so that consecutive tasks sharing a section
+   do not have to read and reduce it again */
+/* ComposeWarmMap reads the maps firstName, from the image of the pair
+   to an intermediate image, and secondName, from that image to the
+   reference, and makes their composition, on the grid and at the
+   level of the first, the initial map; it returns 0, with a message
+   in error, if either cannot be read or they do not overlap */
+int
+ComposeWarmMap (char *firstName, char *secondName, char *error)
+{
+  MapElement *a, *b;
+  int la, wa, ha, oxa, oya;
+  int lb, wb, hb, oxb, oyb;
+  int x, y, ix, iy;
+  int n;
+  float xv, yv, rrx, rry;
+  float rc;
+  MapElement *e, *b00, *b01, *b10, *b11;
+
+  if (!ReadMap(firstName, &a, &la, &wa, &ha, &oxa, &oya,
+	       NULL, NULL, error))
+    return(0);
+  if (!ReadMap(secondName, &b, &lb, &wb, &hb, &oxb, &oyb,
+	       NULL, NULL, error))
+    {
+      free(a);
+      return(0);
+    }
+
+  n = 0;
+  for (y = 0; y < ha; ++y)
+    for (x = 0; x < wa; ++x)
+      {
+	e = &a[y*wa+x];
+	if (e->c == 0.0)
+	  continue;
+	xv = e->x * (1 << la) / (1 << lb) - oxb;
+	yv = e->y * (1 << la) / (1 << lb) - oyb;
+	ix = (int) floor(xv);
+	iy = (int) floor(yv);
+	if (ix < 0 || ix >= wb-1 || iy < 0 || iy >= hb-1)
+	  {
+	    e->x = e->y = e->c = 0.0;
+	    continue;
+	  }
+	rrx = xv - ix;
+	rry = yv - iy;
+	b00 = &b[iy*wb+ix];
+	b01 = &b[(iy+1)*wb+ix];
+	b10 = &b[iy*wb+ix+1];
+	b11 = &b[(iy+1)*wb+ix+1];
+	rc = e->c;
+	if (b00->c < rc)
+	  rc = b00->c;
+	if (b01->c < rc)
+	  rc = b01->c;
+	if (b10->c < rc)
+	  rc = b10->c;
+	if (b11->c < rc)
+	  rc = b11->c;
+	if (rc <= 0.0)
+	  {
+	    e->x = e->y = e->c = 0.0;
+	    continue;
+	  }
+	xv = b00->x * (1.0 - rrx) * (1.0 - rry) +
+	  b01->x * (1.0 - rrx) * rry +
+	  b10->x * rrx * (1.0 - rry) +
+	  b11->x * rrx * rry;
+	yv = b00->y * (1.0 - rrx) * (1.0 - rry) +
+	  b01->y * (1.0 - rrx) * rry +
+	  b10->y * rrx * (1.0 - rry) +
+	  b11->y * rrx * rry;
+	e->x = xv * (1 << lb) / (1 << la);
+	e->y = yv * (1 << lb) / (1 << la);
+	e->c = rc;
+	++n;
+      }
+  free(b);
+  if (n == 0)
+    {
+      sprintf(error, "Maps %s and %s do not overlap\n",
+	      firstName, secondName);
+      free(a);
+      return(0);
+    }
+  initialMap = a;
+  initialMapLevel = la;
+  mpwi = wa;
+  mphi = ha;
+  offxi = oxa;
+  offyi = oya;
+  return(1);
+}
+
+void
+MakePyramidKey (PyramidKey *key, Pair *p, int imi,
+		char *imageName, char *maskName)
+{
+  struct stat sb;
+
+  memset(key, 0, sizeof(PyramidKey));
+  strcpy(key->imageName, imageName);
+  strcpy(key->maskName, maskName);
+  key->minX = p->imageMinX[imi];
+  key->maxX = p->imageMaxX[imi];
+  key->minY = p->imageMinY[imi];
+  key->maxY = p->imageMaxY[imi];
+  key->strictMasking = c.strictMasking;
+  key->bits = c.pyramidBits;
+  if (stat(imageName, &sb) == 0)
+    key->imageMTime = sb.st_mtime;
+  if (maskName[0] != '\0' && stat(maskName, &sb) == 0)
+    key->maskMTime = sb.st_mtime;
+}
+
+int
+SamePyramidKey (PyramidKey *a, PyramidKey *b)
+{
+  return(a->minX == b->minX && a->maxX == b->maxX &&
+	 a->minY == b->minY && a->maxY == b->maxY &&
+	 a->imageMTime == b->imageMTime && a->maskMTime == b->maskMTime &&
+	 a->strictMasking == b->strictMasking && a->bits == b->bits &&
+	 strcmp(a->imageName, b->imageName) == 0 &&
+	 strcmp(a->maskName, b->maskName) == 0);
+}
+
+/* LookupPyramid fills in images[imi][*] and masks[imi][*] from the
+   cache if an up-to-date pyramid of the image is present; it returns
+   the number of levels supplied (0 if there was no usable entry) */
+int
+LookupPyramid (int imi)
+{
+  int i;
+  int level;
+  PyramidCacheEntry *pe;
+
+  pyramidCacheIndex[imi] = -1;
+  for (i = 0; i < nPyramidCache; ++i)
+    {
+      pe = &pyramidCache[i];
+      if (pe->inUse || !SamePyramidKey(&pe->key, &pyramidKeys[imi]))
+	continue;
+      for (level = 0; level < pe->nLevels; ++level)
+	{
+	  images[imi][level] = pe->images[level];
+	  packedImages[imi][level] = pe->packed[level];
+	  imageScale[imi][level] = pe->scale[level];
+	  imageBias[imi][level] = pe->bias[level];
+	  masks[imi][level] = pe->masks[level];
+	  imageWidth[imi][level] = pe->width[level];
+	  imageHeight[imi][level] = pe->height[level];
+	  imageOffsetX[imi][level] = pe->offsetX[level];
+	  imageOffsetY[imi][level] = pe->offsetY[level];
+	}
+      pe->inUse = 1;
+      pe->lastUse = ++pyramidCacheClock;
+      pyramidCacheIndex[imi] = i;
+      Log("Pyramid cache hit for %s (%d levels)\n",
+	  pe->key.imageName, pe->nLevels);
+      return(pe->nLevels);
+    }
+  return(0);
+}
+
+/* StorePyramid hands images[imi][*] and masks[imi][*] over to the
+   cache at the end of a task, and then evicts the least recently
+   used pyramids until the cache fits within its budget */
+void
+StorePyramid (int imi)
+{
+  int i;
+  int level;
+  int nl;
+  PyramidCacheEntry *pe;
+
+  if (pyramidCacheIndex[imi] >= 0)
+    pe = &pyramidCache[pyramidCacheIndex[imi]];
+  else
+    {
+      /* the same pyramid may have been stored for the other image */
+      for (i = 0; i < nPyramidCache; ++i)
+	if (SamePyramidKey(&pyramidCache[i].key, &pyramidKeys[imi]))
+	  break;
+      if (i < nPyramidCache)
+	{
+	  for (level = 0; level < nLevels; ++level)
+	    {
+	      free(images[imi][level]);
+	      free(packedImages[imi][level]);
+	      packedImages[imi][level] = NULL;
+	      free(masks[imi][level]);
+	    }
+	  return;
+	}
+      pyramidCache = (PyramidCacheEntry *)
+	realloc(pyramidCache, (nPyramidCache + 1) * sizeof(PyramidCacheEntry));
+      pe = &pyramidCache[nPyramidCache++];
+      memset(pe, 0, sizeof(PyramidCacheEntry));
+      pe->key = pyramidKeys[imi];
+    }
+
+  /* levels already in the entry are the same arrays; only the levels
+     that were newly built by Init() are added */
+  nl = nLevels > pe->nLevels ? nLevels : pe->nLevels;
+  for (level = pe->nLevels; level < nl; ++level)
+    {
+      pe->images[level] = images[imi][level];
+      pe->packed[level] = packedImages[imi][level];
+      pe->scale[level] = imageScale[imi][level];
+      pe->bias[level] = imageBias[imi][level];
+      pe->masks[level] = masks[imi][level];
+      pe->width[level] = imageWidth[imi][level];
+      pe->height[level] = imageHeight[imi][level];
+      pe->offsetX[level] = imageOffsetX[imi][level];
+      pe->offsetY[level] = imageOffsetY[imi][level];
+      pe->bytes += ((size_t) pe->width[level]) * pe->height[level] *
+	(c.pyramidBits / 8) +
+	((size_t) pe->height[level]) * ((pe->width[level] + 7) >> 3);
+    }
+  pe->nLevels = nl;
+  pe->inUse = 0;
+  pe->lastUse = ++pyramidCacheClock;
+  pyramidCacheIndex[imi] = -1;
+  TrimPyramidCache();
+}
+
+/* UsePyramidCache returns whether the pyramids of the current task
+   go through the cache */
+int
+UsePyramidCache ()
+{
+  return(t.split == SPLIT_NONE &&
+	 (c.pyramidCacheSize > 0 || t.nGroup > 1));
+}
+
+void
+TrimPyramidCache ()
+{
+  int i;
+  int lru;
+  size_t total;
+
+  /* without -pyramid_cache, only a group's pyramids are held, and
+     KeepPyramidsFor() lets them go */
+  if (c.pyramidCacheSize == 0)
+    return;
+  for (;;)
+    {
+      total = 0;
+      lru = -1;
+      for (i = 0; i < nPyramidCache; ++i)
+	{
+	  total += pyramidCache[i].bytes;
+	  if (!pyramidCache[i].inUse &&
+	      (lru < 0 || pyramidCache[i].lastUse < pyramidCache[lru].lastUse))
+	    lru = i;
+	}
+      if (total <= ((size_t) c.pyramidCacheSize) << 20 || lru < 0)
+	break;
+      EvictPyramid(lru);
+    }
+}
+
+void
+EvictPyramid (int i)
+{
+  int imi;
+  int level;
+
+  Log("Evicting %s from pyramid cache (%zd bytes)\n",
+      pyramidCache[i].key.imageName, pyramidCache[i].bytes);
+  for (level = 0; level < pyramidCache[i].nLevels; ++level)
+    {
+      free(pyramidCache[i].images[level]);
+      free(pyramidCache[i].packed[level]);
+      free(pyramidCache[i].masks[level]);
+    }
+  pyramidCache[i] = pyramidCache[--nPyramidCache];
+  for (imi = 0; imi < 2; ++imi)
+    if (pyramidCacheIndex[imi] == nPyramidCache)
+      pyramidCacheIndex[imi] = i;
+}
+
+/* KeepPyramidsFor is called between the pairs of a group when there
+   is no -pyramid_cache; it evicts the pyramids of all images other
+   than those of p, or all of them if p is NULL */
+void
+KeepPyramidsFor (Pair *p)
+{
+  int i;
+  int imi;
+  int keep;
+  char fn[PATH_MAX];
+
+  if (c.pyramidCacheSize > 0)
+    return;
+  for (i = nPyramidCache - 1; i >= 0; --i)
+    {
+      keep = 0;
+      for (imi = 0; p != NULL && imi < 2; ++imi)
+	{
+	  sprintf(fn, "%s%s", c.imageBasename, p->imageName[imi]);
+	  if (strcmp(pyramidCache[i].key.imageName, fn) == 0)
+	    keep = 1;
+	}
+      if (!keep)
+	EvictPyramid(i);
+    }
+}
+
+/* GradientFeature returns the gradient magnitude of the w x h image
+   img, normalized as 255 |g| / (|g| + eps) with eps the mean magnitude
+   over the unmasked pixels, so that edges weigh the same whatever
+   their contrast; it returns NULL if there is no memory for it */
+float *
+GradientFeature (float *img, unsigned char *mask,
+		 int w, int h, size_t mbpl)
+{
+  int x, y;
+  int x0, x1, y0, y1;
+  float *f;
+  float gx, gy;
+  double sum;
+  size_t n;
+  float eps;
+
+  f = (float *) malloc(((size_t) w) * h * sizeof(float));
+  if (f == NULL)
+    return(NULL);
+  sum = 0.0;
+  n = 0;
+  for (y = 0; y < h; ++y)
+    {
+      y0 = y > 0 ? y - 1 : y;
+      y1 = y < h - 1 ? y + 1 : y;
+      for (x = 0; x < w; ++x)
+	{
+	  x0 = x > 0 ? x - 1 : x;
+	  x1 = x < w - 1 ? x + 1 : x;
+	  gx = IMAGE(img, w, x1, y) - IMAGE(img, w, x0, y);
+	  gy = IMAGE(img, w, x, y1) - IMAGE(img, w, x, y0);
+	  IMAGE(f, w, x, y) = sqrtf(gx * gx + gy * gy);
+	  if (mask == NULL || MASK(mask, mbpl, x, y))
+	    {
+	      sum += IMAGE(f, w, x, y);
+	      ++n;
+	    }
+	}
+    }
+  eps = n > 0 && sum > 0.0 ? sum / n : 1.0;
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      IMAGE(f, w, x, y) = 255.0 * IMAGE(f, w, x, y) /
+	(IMAGE(f, w, x, y) + eps);
+  return(f);
+}
+
+/* RankFeature returns the w x h image img histogram-equalized over
+   its unmasked pixels, i.e., each pixel replaced by 255 times the
+   fraction of pixels darker than it (counting ties as half), so that
+   the correlation becomes a rank correlation, unaffected by any
+   monotone change of contrast between the sections; it returns NULL if
+   there is no memory for it */
+float *
+RankFeature (float *img, unsigned char *mask,
+	     int w, int h, size_t mbpl)
+{
+  int x, y;
+  int b;
+  float *f;
+  size_t hist[256];
+  double rank[256];
+  size_t n, below;
+
+  f = (float *) malloc(((size_t) w) * h * sizeof(float));
+  if (f == NULL)
+    return(NULL);
+  memset(hist, 0, 256 * sizeof(size_t));
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      if (mask == NULL || MASK(mask, mbpl, x, y))
+	{
+	  b = (int) IMAGE(img, w, x, y);
+	  ++hist[b < 0 ? 0 : (b > 255 ? 255 : b)];
+	}
+  n = 0;
+  for (b = 0; b < 256; ++b)
+    n += hist[b];
+  below = 0;
+  for (b = 0; b < 256; ++b)
+    {
+      rank[b] = n > 0 ? 255.0 * (below + 0.5 * hist[b]) / n : b;
+      below += hist[b];
+    }
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      {
+	b = (int) IMAGE(img, w, x, y);
+	IMAGE(f, w, x, y) = rank[b < 0 ? 0 : (b > 255 ? 255 : b)];
+      }
+  return(f);
+}
+
+/* NgfField returns the normalized gradient field of the w x h image
+   img, two floats (x, y) per pixel, the gradient g (by central
+   differences) divided by sqrt(|g|^2 + edge^2), so that edges of any
+   contrast well above edge give unit vectors while noise and flat
+   areas give short ones; an edge of 0 is taken to be the mean
+   gradient magnitude over the unmasked pixels.  It returns NULL if
+   there is no memory for it. */
+float *
+NgfField (float *img, unsigned char *mask,
+	  int w, int h, size_t mbpl, double edge)
+{
+  int x, y;
+  int x0, x1, y0, y1;
+  float *f;
+  float *p;
+  double gx, gy;
+  double sum;
+  size_t n;
+  double e2;
+
+  f = (float *) malloc(2 * ((size_t) w) * h * sizeof(float));
+  if (f == NULL)
+    return(NULL);
+  sum = 0.0;
+  n = 0;
+  for (y = 0; y < h; ++y)
+    {
+      y0 = y > 0 ? y - 1 : y;
+      y1 = y < h - 1 ? y + 1 : y;
+      for (x = 0; x < w; ++x)
+	{
+	  x0 = x > 0 ? x - 1 : x;
+	  x1 = x < w - 1 ? x + 1 : x;
+	  gx = x1 > x0 ? (IMAGE(img, w, x1, y) - IMAGE(img, w, x0, y)) /
+	    (x1 - x0) : 0.0;
+	  gy = y1 > y0 ? (IMAGE(img, w, x, y1) - IMAGE(img, w, x, y0)) /
+	    (y1 - y0) : 0.0;
+	  p = &f[2 * (y * ((size_t) w) + x)];
+	  p[0] = gx;
+	  p[1] = gy;
+	  if (edge == 0.0 && (mask == NULL || MASK(mask, mbpl, x, y)))
+	    {
+	      sum += sqrt(gx * gx + gy * gy);
+	      ++n;
+	    }
+	}
+    }
+  if (edge == 0.0)
+    edge = n > 0 && sum > 0.0 ? sum / n : 1.0;
+  e2 = edge * edge;
+  for (p = f; p < f + 2 * ((size_t) w) * h; p += 2)
+    {
+      gx = p[0];
+      gy = p[1];
+      sum = 1.0 / sqrt(gx * gx + gy * gy + e2);
+      p[0] = gx * sum;
+      p[1] = gy * sum;
+    }
+  return(f);
+}
+
+/* NgfTerm returns the contribution to the NGF metric of image pixel
+   (x,y) mapped to reference point (irx + rrx, iry + rry): the square
+   of the dot product of the image's normalized gradient there and
+   the reference's, interpolated bilinearly.  The gradients are
+   compared in the frames of their own images, which assumes that the
+   map rotates the image only a little. */
+double
+NgfTerm (float *ingf, float *rngf, unsigned int iw, unsigned int rw,
+	 int x, int y, int irx, int iry, double rrx, double rry)
+{
+  float *p;
+  float *q;
+  double gx, gy;
+  double d;
+
+  p = &ingf[2 * (y * ((size_t) iw) + x)];
+  q = &rngf[2 * (iry * ((size_t) rw) + irx)];
+  gx = (1.0 - rrx) * (1.0 - rry) * q[0] + rrx * (1.0 - rry) * q[2] +
+    (1.0 - rrx) * rry * q[2*rw] + rrx * rry * q[2*rw+2];
+  gy = (1.0 - rrx) * (1.0 - rry) * q[1] + rrx * (1.0 - rry) * q[3] +
+    (1.0 - rrx) * rry * q[2*rw+1] + rrx * rry * q[2*rw+3];
+  d = p[0] * gx + p[1] * gy;
+  return(d * d);
+}
+
+/* NgfSimilarity returns the NGF metric of nPoints samples whose
+   NgfTerm()s sum to sg; if fewer than requiredPoints samples are
+   present, the missing ones count as 0, just as PaddedCorrelation
+   penalizes them */
+double
+NgfSimilarity (long nPoints, size_t requiredPoints, double sg)
+{
+  size_t effectivePoints;
+
+  effectivePoints = nPoints < (long) requiredPoints ?
+    requiredPoints : nPoints;
+  if (effectivePoints == 0)
+    return(-1000000.0);
+  return(sg / effectivePoints);
+}
+
+/* TallyHistogram records in d that n more (or, if n < 0, fewer)
+   samples of image intensity iv and reference intensity rv are in
+   the overlap */
+void
+TallyHistogram (HistogramDelta *d, double iv, double rv, int n)
+{
+  int bi, br;
+  int k;
+
+  bi = (int) (iv * (MI_BINS / 256.0));
+  bi = bi < 0 ? 0 : (bi >= MI_BINS ? MI_BINS - 1 : bi);
+  br = (int) (rv * (MI_BINS / 256.0));
+  br = br < 0 ? 0 : (br >= MI_BINS ? MI_BINS - 1 : br);
+  k = bi * MI_BINS + br;
+  if (!d->marked[k])
+    {
+      d->marked[k] = 1;
+      d->touched[d->nTouched++] = k;
+    }
+  d->joint[k] += n;
+  d->image[bi] += n;
+  d->ref[br] += n;
+  d->n += n;
+}
+
+/* ClearHistogramDelta undoes all the TallyHistogram()s made into d */
+void
+ClearHistogramDelta (HistogramDelta *d)
+{
+  int i;
+
+  for (i = 0; i < d->nTouched; ++i)
+    {
+      d->joint[d->touched[i]] = 0;
+      d->marked[d->touched[i]] = 0;
+    }
+  d->nTouched = 0;
+  memset(d->image, 0, MI_BINS * sizeof(int));
+  memset(d->ref, 0, MI_BINS * sizeof(int));
+  d->n = 0;
+}
+
+/* ApplyHistogramDelta makes the changes recorded in d to h, and then
+   clears d */
+void
+ApplyHistogramDelta (JointHistogram *h, HistogramDelta *d)
+{
+  int i;
+  int k;
+  long v;
+
+  for (i = 0; i < d->nTouched; ++i)
+    {
+      k = d->touched[i];
+      v = h->joint[k] + d->joint[k];
+      h->sJoint += HLOGH(v) - HLOGH(h->joint[k]);
+      h->joint[k] = v;
+    }
+  for (k = 0; k < MI_BINS; ++k)
+    {
+      if (d->image[k] != 0)
+	{
+	  v = h->image[k] + d->image[k];
+	  h->sImage += HLOGH(v) - HLOGH(h->image[k]);
+	  h->image[k] = v;
+	}
+      if (d->ref[k] != 0)
+	{
+	  v = h->ref[k] + d->ref[k];
+	  h->sRef += HLOGH(v) - HLOGH(h->ref[k]);
+	  h->ref[k] = v;
+	}
+    }
+  h->n += d->n;
+  ClearHistogramDelta(d);
+}
+
+/* SumHistogram recomputes the h log h sums of h from its bins */
+void
+SumHistogram (JointHistogram *h)
+{
+  int k;
+
+  h->sJoint = 0.0;
+  for (k = 0; k < MI_BINS * MI_BINS; ++k)
+    h->sJoint += HLOGH(h->joint[k]);
+  h->sImage = 0.0;
+  h->sRef = 0.0;
+  for (k = 0; k < MI_BINS; ++k)
+    {
+      h->sImage += HLOGH(h->image[k]);
+      h->sRef += HLOGH(h->ref[k]);
+    }
+}
+
+/* HistogramSimilarity returns the normalized mutual information
+   2 I(image;ref) / (H(image) + H(ref)), between 0 and 1, of the joint
+   histogram h with the changes in d (if not NULL); only the bins that
+   d touches are looked at.  If fewer than requiredPoints samples are
+   present, the missing ones are counted as black image pixels over
+   saturated reference pixels, as in PaddedCorrelation. */
+double
+HistogramSimilarity (JointHistogram *h, HistogramDelta *d,
+		     size_t requiredPoints)
+{
+  double n;
+  double sJoint, sImage, sRef;
+  double eJoint, eImage, eRef;
+  long v, w;
+  int i;
+  int k;
+
+  n = h->n;
+  sJoint = h->sJoint;
+  sImage = h->sImage;
+  sRef = h->sRef;
+  if (d != NULL)
+    {
+      n += d->n;
+      for (i = 0; i < d->nTouched; ++i)
+	{
+	  k = d->touched[i];
+	  v = h->joint[k] + d->joint[k];
+	  sJoint += HLOGH(v) - HLOGH(h->joint[k]);
+	}
+      for (k = 0; k < MI_BINS; ++k)
+	{
+	  if (d->image[k] != 0)
+	    {
+	      v = h->image[k] + d->image[k];
+	      sImage += HLOGH(v) - HLOGH(h->image[k]);
+	    }
+	  if (d->ref[k] != 0)
+	    {
+	      v = h->ref[k] + d->ref[k];
+	      sRef += HLOGH(v) - HLOGH(h->ref[k]);
+	    }
+	}
+    }
+  if (n < requiredPoints)
+    {
+      w = (long) (requiredPoints - n);
+      k = MI_BINS - 1;
+      v = h->joint[k] + (d != NULL ? d->joint[k] : 0);
+      sJoint += HLOGH(v + w) - HLOGH(v);
+      v = h->image[0] + (d != NULL ? d->image[0] : 0);
+      sImage += HLOGH(v + w) - HLOGH(v);
+      v = h->ref[MI_BINS - 1] + (d != NULL ? d->ref[MI_BINS - 1] : 0);
+      sRef += HLOGH(v + w) - HLOGH(v);
+      n = requiredPoints;
+    }
+  if (n <= 0.0)
+    return(-1000000.0);
+  eJoint = log(n) - sJoint / n;
+  eImage = log(n) - sImage / n;
+  eRef = log(n) - sRef / n;
+  if (eImage + eRef < 1.0e-9)
+    return(0.0);
+  return(2.0 * (eImage + eRef - eJoint) / (eImage + eRef));
+}
+
+/* TileImage returns a copy of the w x h image img laid out in tiles
+   for REF(), setting *tw to its width in tiles, or NULL if there is
+   no memory for it */
+float *
+TileImage (float *img, int w, int h, int *tw)
+{
+  int x, y;
+  int th;
+  float *t;
+
+  *tw = (w + TILE_MASK) >> TILE_SHIFT;
+  th = (h + TILE_MASK) >> TILE_SHIFT;
+  t = (float *) malloc((((size_t) *tw) * th << (2 * TILE_SHIFT)) *
+		       sizeof(float));
+  if (t == NULL)
+    return(NULL);
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      t[TILE_OFFSET(*tw, x, y)] = IMAGE(img, w, x, y);
+  return(t);
+}
+
+/* TileMask returns a copy of the w x h mask m laid out in tiles for
+   REFMASK(), or NULL if there is no memory for it */
+unsigned char *
+TileMask (unsigned char *m, int w, int h, size_t mbpl)
+{
+  int x, y;
+  int tw, th;
+  size_t n;
+  unsigned char *t;
+
+  tw = (w + TILE_MASK) >> TILE_SHIFT;
+  th = (h + TILE_MASK) >> TILE_SHIFT;
+  n = ((size_t) tw) * th << (2 * TILE_SHIFT - 3);
+  t = (unsigned char *) malloc(n);
+  if (t == NULL)
+    return(NULL);
+  memset(t, 0, n);
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      if (MASK(m, mbpl, x, y))
+	t[TILE_OFFSET(tw, x, y) >> 3] |= 0x80 >> (x & 7);
+  return(t);
+}
+
+/* PackLevel replaces images[imi][level] by its -pyramid_storage 8- or
+   16-bit codes, scaled to span the range of the level's pixels; a
+   level supplied by the pyramid cache already has them */
+int
+PackLevel (int imi, int level)
+{
+  size_t i, n;
+  float *img;
+  float minV, maxV;
+  double scale, inverse;
+  unsigned char *p8;
+  unsigned short *p16;
+  int maxCode;
+
+  img = images[imi][level];
+  images[imi][level] = NULL;
+  if (level < cachedLevels[imi])
+    {
+      free(img);
+      return(1);
+    }
+
+  n = ((size_t) imageWidth[imi][level]) * imageHeight[imi][level];
+  minV = maxV = n > 0 ? img[0] : 0.0;
+  for (i = 1; i < n; ++i)
+    if (img[i] < minV)
+      minV = img[i];
+    else if (img[i] > maxV)
+      maxV = img[i];
+  maxCode = (1 << c.pyramidBits) - 1;
+  scale = maxV > minV ? (maxV - minV) / maxCode : 1.0;
+  inverse = 1.0 / scale;
+  imageScale[imi][level] = scale;
+  imageBias[imi][level] = minV;
+
+  packedImages[imi][level] = malloc(n * (c.pyramidBits / 8));
+  if (packedImages[imi][level] == NULL)
+    {
+      SetMessage("Could not allocate packed image arrays (%zd)\n",
+		 n * (c.pyramidBits / 8));
+      free(img);
+      return(0);
+    }
+  if (c.pyramidBits == 8)
+    {
+      p8 = (unsigned char *) packedImages[imi][level];
+      for (i = 0; i < n; ++i)
+	p8[i] = (unsigned char) ((img[i] - minV) * inverse + 0.5);
+    }
+  else
+    {
+      p16 = (unsigned short *) packedImages[imi][level];
+      for (i = 0; i < n; ++i)
+	p16[i] = (unsigned short) ((img[i] - minV) * inverse + 0.5);
+    }
+  free(img);
+  return(1);
+}
+
+/* UnpackLevel returns a newly allocated float copy of a level stored
+   by PackLevel, or NULL if there is no memory for it */
+float *
+UnpackLevel (int imi, int level)
+{
+  size_t i, n;
+  float *img;
+  float scale, bias;
+  unsigned char *p8;
+  unsigned short *p16;
+
+  n = ((size_t) imageWidth[imi][level]) * imageHeight[imi][level];
+  img = (float *) malloc(n * sizeof(float));
+  if (img == NULL)
+    return(NULL);
+  scale = imageScale[imi][level];
+  bias = imageBias[imi][level];
+  if (c.pyramidBits == 8)
+    {
+      p8 = (unsigned char *) packedImages[imi][level];
+      for (i = 0; i < n; ++i)
+	img[i] = bias + scale * p8[i];
+    }
+  else
+    {
+      p16 = (unsigned short *) packedImages[imi][level];
+      for (i = 0; i < n; ++i)
+	img[i] = bias + scale * p16[i];
+    }
+  return(img);
+}
+
+/* ReleaseLevel frees the pixels of level of both images once no later
+   step of the task will read them, and, with releaseMasks, their
+   masks and the output mask of the level as well; it is only used
+   when the task does not hand its pyramids to the cache */
+void
+ReleaseLevel (int level, int releaseMasks)
+{
+  int imi;
+
+  for (imi = 0; imi < 2; ++imi)
+    {
+      if (images[imi][level] != NULL)
+	{
+	  free(images[imi][level]);
+	  images[imi][level] = NULL;
+	}
+      if (packedImages[imi][level] != NULL)
+	{
+	  free(packedImages[imi][level]);
+	  packedImages[imi][level] = NULL;
+	}
+#if MASKING
+      if (releaseMasks && masks[imi][level] != NULL)
+	{
+	  free(masks[imi][level]);
+	  masks[imi][level] = NULL;
+	}
+#endif
+    }
+#if MASKING
+  if (releaseMasks && outputMasks[level] != NULL)
+    {
+      free(outputMasks[level]);
+      outputMasks[level] = NULL;
+    }
+#endif
+}
+
+/* LowestComputeLevel returns the finest pyramid level whose pixels
+   Compute() will use, i.e. the cLevel of c.outputLevel, or -1 if
+   that cannot yet be told from the dimensions of levels 0 through
+   built */
+int
+LowestComputeLevel (int built)
+{
+  int cLevel;
+
+  cLevel = c.outputLevel - c.depth;
+  if (cLevel < 0)
+    cLevel = 0;
+  if (cLevel > built)
+    return(-1);
+  while (cLevel > 0 &&
+	 (imageWidth[0][cLevel] < c.minResolution ||
+	  imageHeight[0][cLevel] < c.minResolution))
+    --cLevel;
+  return(cLevel);
+}
+
+/* PrefetchTask is called by libpar when the worker's next task has
+   arrived before the current one is finished; it starts a thread
+   that reads the input images and masks of that task into memory so
+   that WorkerTask can take them from there instead of the filesystem */
+void
+PrefetchTask ()
+{
+  Pair p;
+  Task hdr;
+  PrefetchedTask *pt;
+  PyramidKey key;
+  int imi;
+  int i;
+
+  p.imageName[0] = NULL;
+  p.imageName[1] = NULL;
+  p.pairName = NULL;
+  p.warmName[0] = NULL;
+  p.warmName[1] = NULL;
+
+  /* the tasks of a split pair read reduced images or parts of them */
+  if (UnpackTaskHeader(&hdr) < 1 || hdr.split != SPLIT_NONE)
+    return;
+  UnpackPair(&p);
+
+  /* make room by dropping the oldest prefetched task */
+  if (nPrefetchedTasks == MAX_PREFETCHED_TASKS)
+    {
+      ReleasePrefetchedTask(prefetchedTasks[0]->pairName);
+      if (nPrefetchedTasks == MAX_PREFETCHED_TASKS)
+	Error("Could not release prefetched task\n");
+    }
+  pt = (PrefetchedTask *) malloc(sizeof(PrefetchedTask));
+  if (pt == NULL)
+    Error("Could not allocate prefetched task\n");
+  memset(pt, 0, sizeof(PrefetchedTask));
+  strcpy(pt->pairName, p.pairName);
+  for (imi = 0; imi < 2; ++imi)
+    {
+      sprintf(pt->images[imi].imageName, "%s%s",
+	      c.imageBasename, p.imageName[imi]);
+      if (c.maskBasename[0] != '\0')
+	sprintf(pt->images[imi].maskName, "%s%s",
+		c.maskBasename, p.imageName[imi]);
+      else
+	pt->images[imi].maskName[0] = '\0';
+      pt->images[imi].minX = p.imageMinX[imi];
+      pt->images[imi].maxX = p.imageMaxX[imi];
+      pt->images[imi].minY = p.imageMinY[imi];
+      pt->images[imi].maxY = p.imageMaxY[imi];
+      pt->images[imi].wanted = 1;
+
+      /* no need to read images that the pyramid cache already holds */
+      if (c.pyramidCacheSize > 0)
+	{
+	  MakePyramidKey(&key, &p, imi,
+			 pt->images[imi].imageName, pt->images[imi].maskName);
+	  for (i = 0; i < nPyramidCache; ++i)
+	    if (SamePyramidKey(&pyramidCache[i].key, &key))
+	      {
+		pt->images[imi].wanted = 0;
+		break;
+	      }
+	}
+    }
+  if (pthread_create(&pt->thread, NULL, PrefetchMain, pt) == 0)
+    {
+      Log("Prefetching input of %s\n", pt->pairName);
+      prefetchedTasks[nPrefetchedTasks++] = pt;
+    }
+  else
+    {
+      Log("Could not create prefetch thread for %s\n", pt->pairName);
+      free(pt);
+    }
+
+  for (imi = 0; imi < 2; ++imi)
+    {
+      free(p.imageName[imi]);
+      free(p.warmName[imi]);
+    }
+  free(p.pairName);
+}
+
+void *
+PrefetchMain (void *arg)
+{
+  PrefetchedTask *pt;
+  PrefetchedImage *pi;
+  int imi;
+  char errorMsg[PATH_MAX+256];
+
+  pt = (PrefetchedTask *) arg;
+  for (imi = 0; imi < 2; ++imi)
+    {
+      pi = &pt->images[imi];
+      if (!pi->wanted)
+	continue;
+      METRICS_RANGE_BEGIN("register prefetch");
+      pi->image = NULL;
+      pi->imageRead = ReadImage(pi->imageName, &pi->image,
+				&pi->width, &pi->height,
+				pi->minX, pi->maxX, pi->minY, pi->maxY,
+				errorMsg);
+      if (pi->maskName[0] != '\0')
+	{
+	  pi->mask = NULL;
+	  pi->maskRead = ReadBitmap(pi->maskName, &pi->mask,
+				    &pi->maskWidth, &pi->maskHeight,
+				    pi->minX, pi->maxX, pi->minY, pi->maxY,
+				    errorMsg);
+	}
+      METRICS_RANGE_END();
+    }
+  return(NULL);
+}
+
+/* TakePrefetchedImage hands over the prefetched copy of the given
+   image (if isMask is 0) or mask (if isMask is 1) of the current task,
+   waiting for the prefetch thread if necessary; it returns 0 if no
+   such prefetched copy is available */
+int
+TakePrefetchedImage (char *name, int isMask, int imi,
+		     unsigned char **pixels, int *width, int *height)
+{
+  int i, j;
+  PrefetchedTask *pt;
+  PrefetchedImage *pi;
+
+  for (i = 0; i < nPrefetchedTasks; ++i)
+    if (strcmp(prefetchedTasks[i]->pairName, t.pair.pairName) == 0)
+      break;
+  if (i >= nPrefetchedTasks)
+    return(0);
+  pt = prefetchedTasks[i];
+  if (!pt->joined)
+    {
+      if (pthread_join(pt->thread, NULL) != 0)
+	Error("Could not join prefetch thread\n");
+      pt->joined = 1;
+    }
+  for (j = 0; j < 2; ++j)
+    {
+      pi = &pt->images[j];
+      if (pi->minX != t.pair.imageMinX[imi] ||
+	  pi->maxX != t.pair.imageMaxX[imi] ||
+	  pi->minY != t.pair.imageMinY[imi] ||
+	  pi->maxY != t.pair.imageMaxY[imi])
+	continue;
+      if (!isMask && pi->imageRead && strcmp(pi->imageName, name) == 0)
+	{
+	  *pixels = pi->image;
+	  *width = pi->width;
+	  *height = pi->height;
+	  pi->image = NULL;
+	  pi->imageRead = 0;
+	  return(1);
+	}
+      if (isMask && pi->maskRead && strcmp(pi->maskName, name) == 0)
+	{
+	  *pixels = pi->mask;
+	  *width = pi->maskWidth;
+	  *height = pi->maskHeight;
+	  pi->mask = NULL;
+	  pi->maskRead = 0;
+	  return(1);
+	}
+    }
+  return(0);
+}
+
+/* ReleasePrefetchedTask frees whatever was prefetched for the named
+   pair and was not taken */
+void
+ReleasePrefetchedTask (char *pairName)
+{
+  int i, j;
+  PrefetchedTask *pt;
+
+  for (i = 0; i < nPrefetchedTasks; ++i)
+    if (strcmp(prefetchedTasks[i]->pairName, pairName) == 0)
+      break;
+  if (i >= nPrefetchedTasks)
+    return;
+  pt = prefetchedTasks[i];
+  if (!pt->joined && pthread_join(pt->thread, NULL) != 0)
+    Error("Could not join prefetch thread\n");
+  for (j = 0; j < 2; ++j)
+    {
+      if (pt->images[j].image != NULL)
+	free(pt->images[j].image);
+      if (pt->images[j].mask != NULL)
+	free(pt->images[j].mask);
+    }
+  free(pt);
+  for (++i; i < nPrefetchedTasks; ++i)
+    prefetchedTasks[i-1] = prefetchedTasks[i];
+  --nPrefetchedTasks;
+}
+
+int
+Init ()
+{
+  int level;
+  unsigned int iw, ih;
+  float *image;
+  size_t imagePixels;
+  size_t ii;
+  int i;
+  int x, y;
+  size_t imbpl;
+  size_t ombpl;
+  int b;
+  int dx, dy;
+#if FOLDING
+  unsigned char *iCount;
+#endif
+  size_t impw, imph;
+  size_t impbpl;
+  int imi;
+  size_t maskCount;
+  int minX, maxX, minY, maxY;
+  float *src_image;
+  int src_iw, src_ih;
+  int src_x, src_y;
+  unsigned char *src_mask;
+  int src_mbpl;
+  int delta_x, delta_y;
+  int ix, iy;
+  unsigned char *m;
+  int factor;
+  int mapMinX, mapMaxX, mapMinY, mapMaxY;
+  int lowest;
+
+  memset(maps, 0, MAX_LEVELS * sizeof(MapElement*));
+  for (imi = 0; imi < 2; ++imi)
+    {
+      imagePixels = ((size_t) imageWidth[imi][0]) * imageHeight[imi][0];
+      Log("iw[%d] = %d ih[%d] = %d pixels = %llu\n",
+	  imi, imageWidth[imi][0], imi, imageHeight[imi][0], imagePixels);
+
+      iw = imageWidth[imi][0];
+      ih = imageHeight[imi][0];
+      imbpl = (iw + 7) >> 3;
+#if MASKING
+      Log("maskcount = %ld\n", CountBits(masks[imi][0], ih * imbpl));
+#endif
+    }
+  mapWidth[0] = imageWidth[0][0];
+  mapHeight[0] = imageHeight[0][0];
+  mapOffsetX[0] = imageOffsetX[0][0];
+  mapOffsetY[0] = imageOffsetY[0][0];
+
+  /* create hierarchical representations of images */
+  for (level = 1; mapWidth[level-1] > 2 || mapHeight[level-1] > 2; ++level)
+    {
+      Log("creating level %d\n", level);
+      factor = 1 << level;
+
+      mapMinX = imageOffsetX[0][0] / factor;
+      mapMaxX = (imageOffsetX[0][0] + imageWidth[0][0] - 1) / factor + 1;
+      mapMinY = imageOffsetY[0][0] / factor;
+      mapMaxY = (imageOffsetY[0][0] + imageHeight[0][0] - 1) / factor + 1;
+      mapWidth[level] = mapMaxX - mapMinX + 1;
+      mapHeight[level] = mapMaxY - mapMinY + 1;
+      mapOffsetX[level] = mapMinX;
+      mapOffsetY[level] = mapMinY;
+      Log("map dims: %d x %d + %d + %d\n", mapWidth[level], mapHeight[level],
+	  mapOffsetX[level], mapOffsetY[level]);
+
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  // calculate the ranges for level-1
 	  minX = imageOffsetX[imi][level-1];
 	  maxX = minX + imageWidth[imi][level-1] - 1;
 	  minY = imageOffsetY[imi][level-1];
@@ -2057,6 +5281,10 @@ Init ()
 	  imph = ih + 1;
 	  impbpl = (impw  + 7) >> 3;
 
+	  /* this level was supplied by the pyramid cache */
+	  if (level < cachedLevels[imi])
+	    continue;
+
 	  Log("imagePixels = %d\n", imagePixels);
 	  images[imi][level] = (float*) malloc(imagePixels * sizeof(float));
 	  if (images[imi][level] == NULL)
@@ -2074,22 +5302,19 @@ Init ()
 			 ih * imbpl);
 	      return(0);
 	    }
+#endif
 
-	  iCount = (unsigned char*) malloc(imagePixels * sizeof(unsigned char));
-	  if (iCount == NULL)
+	  /* with -pyramid_storage 8 or 16, a level is only held as
+	     floats while the next one is reduced from it */
+	  if (c.pyramidBits < 32 && level-1 < cachedLevels[imi] &&
+	      (images[imi][level-1] = UnpackLevel(imi, level-1)) == NULL)
 	    {
-	      SetMessage("Could not allocate count arrays (%zd)\n",
-			 imagePixels * sizeof(unsigned char));
+	      SetMessage("Could not allocate image arrays (%zd)\n",
+			 ((size_t) imageWidth[imi][level-1]) *
+			 imageHeight[imi][level-1] * sizeof(float));
 	      return(0);
 	    }
-#endif
-
 	  image = images[imi][level];
-	  memset(image, 0, imagePixels * sizeof(float));
-#if MASKING
-	  memset(iCount, 0, imagePixels*sizeof(unsigned char));
-#endif
-
 	  src_image = images[imi][level-1];
 	  src_ih = imageHeight[imi][level-1];
 	  src_iw = imageWidth[imi][level-1];
@@ -2097,6 +5322,13 @@ Init ()
 	  src_mbpl = (src_iw + 7) >> 3;
 	  delta_x = 2*imageOffsetX[imi][level] - imageOffsetX[imi][level-1];
 	  delta_y = 2*imageOffsetY[imi][level] - imageOffsetY[imi][level-1];
+#if MASKING
+	  ReduceMaskedFloat2x2(src_image, src_iw, src_ih, src_mask,
+			       delta_x, delta_y,
+			       image, iw, ih, masks[imi][level],
+			       c.strictMasking);
+#else
+	  memset(image, 0, imagePixels * sizeof(float));
 	  for (y = 0; y < ih; ++y)
 	    {
 	      iy = 2*y + delta_y;
@@ -2114,41 +5346,14 @@ Init ()
 			  if (src_x < 0 || src_x >= src_iw)
 			    continue;
 			  IMAGE(image, iw, x, y) += IMAGE(src_image, src_iw, src_x, src_y);
-#if MASKING
-			  if (MASK(src_mask, src_mbpl, ix+dx, iy+dy))
-			    ++IMAGE(iCount, iw, x, y);
-#endif
 			}
 		    }
-#if MASKING
-		  if (IMAGE(iCount, iw, x, y) > 0)
-		    IMAGE(image, iw, x, y) *= 1.0 / IMAGE(iCount, iw, x, y);
-		  else
-		    IMAGE(image, iw, x, y) = 0.0;
-#else
 		  IMAGE(image, iw, x, y) *= 1.0 / 4.0;
-#endif		  
 		}
 	    }
-
-#if MASKING
-	  m = masks[imi][level];
-	  memset(m, 0, ih*imbpl);
-	  if (c.strictMasking)
-	    {
-	      for (y = 0; y < ih; ++y)
-		for (x = 0; x < iw; ++x)
-		  if (IMAGE(iCount, iw, x, y) == 4)
-		    SETMASKBIT(m, imbpl, x, y);
-	    }
-	  else
-	    {
-	      for (y = 0; y < ih; ++y)
-		for (x = 0; x < iw; ++x)
-		  if (IMAGE(iCount, iw, x, y) > 0)
-		    SETMASKBIT(m, imbpl, x, y);
-	    }
 #endif
+	  if (c.pyramidBits < 32 && !PackLevel(imi, level-1))
+	    return(0);
 
 #if FOLDING
 	  imdisc[imi][level] = (unsigned char*) malloc(imph * impbpl);
@@ -2229,10 +5434,6 @@ Init ()
 	      if (iCount[y * ((size_t) iw) + x] == 4)
 		idisc[level][y * imbpl + (x >> 3)] |= 0x80 >> (x & 7);
 #endif
-
-#if MASKING
-	  free(iCount);
-#endif
 	}
 
 #if MASKING      
@@ -2242,40 +5443,24 @@ Init ()
 	  ih = imageHeight[0][level];
 	  ombpl = (iw + 7) >> 3;
 	  outputMasks[level] = (unsigned char *) malloc(ih * ombpl);
-	  m = outputMasks[level];
-	  Log("Allocated outputMasks[%d] = %p of size %zd\n",
-	      level, m, ih * ombpl);
-	  memset(m, 0, ih * ombpl);
-	  src_ih = imageHeight[0][level-1];
-	  src_iw = imageWidth[0][level-1];
-	  src_mask = outputMasks[level-1];
-	  src_mbpl = (src_iw + 7) >> 3;
-	  Log("At level %d, next lower level output_mask contains %d bits.\n",
-	      level, CountBits(src_mask, src_ih * src_mbpl));
-	  delta_x = 2*imageOffsetX[0][level] - imageOffsetX[0][level-1];
-	  delta_y = 2*imageOffsetY[0][level] - imageOffsetY[0][level-1];
-	  Log("delta_x = %d  delta_y = %d\n", delta_x, delta_y);
-	  for (y = 0; y < ih; ++y)
-	    {
-	      iy = 2*y + delta_y;
-	      for (x = 0; x < iw; ++x)
-		{
-		  ix = 2 * x + delta_x;
-		  for (dy = 0; dy < 2; ++dy)
-		    {
-		      src_y = iy + dy;
-		      if (src_y < 0 || src_y >= src_ih)
-			continue;
-		      for (dx = 0; dx < 2; ++dx)
-			{
-			  src_x = ix + dx;
-			  if (src_x < 0 || src_x >= src_iw)
-			    continue;
-			  if (MASK(src_mask, src_mbpl, src_x, src_y))
-			    SETMASKBIT(m, ombpl, x, y);
-			}
-		    }
-		}
+	  m = outputMasks[level];
+	  Log("Allocated outputMasks[%d] = %p of size %zd\n",
+	      level, m, ih * ombpl);
+	  memset(m, 0, ih * ombpl);
+	  src_ih = imageHeight[0][level-1];
+	  src_iw = imageWidth[0][level-1];
+	  src_mask = outputMasks[level-1];
+	  src_mbpl = (src_iw + 7) >> 3;
+	  Log("At level %d, next lower level output_mask contains %d bits.\n",
+	      level, CountBits(src_mask, src_ih * src_mbpl));
+	  delta_x = 2*imageOffsetX[0][level] - imageOffsetX[0][level-1];
+	  delta_y = 2*imageOffsetY[0][level] - imageOffsetY[0][level-1];
+	  Log("delta_x = %d  delta_y = %d\n", delta_x, delta_y);
+	  if (!ReduceMaskOr2x2(src_mask, src_iw, src_ih, delta_x, delta_y,
+			       m, iw, ih))
+	    {
+	      SetMessage("Could not allocate mask reduction row\n");
+	      return(0);
 	    }
 	  Log("At level %d, output_mask contains %d ones.\n",
 	      level, CountBits(outputMasks[level], ih * ombpl));
@@ -2283,9 +5468,21 @@ Init ()
       else
 	outputMasks[level] = NULL;
 #endif
+
+      /* without the pyramid cache, the pixels of the levels finer
+	 than any that Compute() will use are only needed to reduce
+	 the next level from, and can go as soon as it has been */
+      if (!UsePyramidCache() &&
+	  (lowest = LowestComputeLevel(level)) >= 0)
+	for (i = 0; i < level && i < lowest; ++i)
+	  ReleaseLevel(i, 0);
     }
   nLevels = level;
   Log("nLevels = %d\n", nLevels);
+  if (c.pyramidBits < 32)
+    for (imi = 0; imi < 2; ++imi)
+      if (!PackLevel(imi, nLevels-1))
+	return(0);
 
   if (c.outputLevel < 0 || c.outputLevel >= nLevels)
     Error("outputLevel (%d) is invalid for image (nLevels = %d)\n",
@@ -2337,6 +5534,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   int i;
   size_t ii;
   int x, y;
+  int prevPhase;
   double x00, x01, x10, x11;
   double y00, y01, y10, y11;
   double c00, c01, c10, c11;
@@ -2407,12 +5605,23 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   double nc0, nc1, nc2, nc3;
   double narea;
   size_t moveCount, goalMoveCount, acceptedMoveCount;
+  size_t position;
+  size_t sweep;
+  int cMinX, cMaxX, cMinY, cMaxY;	/* the cells whose cpts a move changes */
+  int bx, by;
+  int ci;
+  char *rowActive;
+  size_t *rowMoves, *rowAccepted;
+  int focusing;
+  int converged;
+  double sweepEnergy;
   double l0, l1, l2, l3;
   double nl0, nl1, nl2, nl3;
   size_t imbpl, rmbpl;
   size_t ombpl;
   unsigned char *mask;
   int cLevel;
+  int rl;
   int nb;
   unsigned char *cimask, *crmask;
   size_t icmbpl, rcmbpl;
@@ -2455,11 +5664,32 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   double rc;
   double rc00, rc01, rc10, rc11;
   int multiplier;
+  int rMinX, rMaxX, rMinY, rMaxY;
+  int roiW, roiH;
+  size_t roiCells;
+  float *unpacked[2];
+  int unpackedLevel;
+  float *features[2];
+  int featureLevel;
+  double sg, dsg, newsg;
+  JointHistogram *hist;
+  HistogramDelta *hdelta;
+  float *vimage, *vref;
+  float *tref;
+  unsigned char *trmask;
+  unsigned char *trmask2;	/* trmask AND-ed with its shifts, for
+				   SAMPLE_MASKED() */
+  int rtw;
+#if TILED_REFERENCE
+  int tiledLevel;
+#endif
+  int mask2Level;
   int startLevel;
+  PendingOutput po;
   unsigned char *cidisc, *crdisc, *cirdisc;
   char fn[PATH_MAX];
   FILE *f;
-  float rnd;
+  double rnd;
   float logRadius;
   int ncc;
   float scc;
@@ -2501,10 +5731,18 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   double ntxd, ntyd;
   int imi;
   int dnx, dny;
+  int gx0, gy0;
+  int gix, giy;
   int immbpl;
   unsigned char *initialMapMask;
   float *initialMapDist;
   double lb;
+  MoveState ms;
+  MoveThread *mts;
+  int useThreads;
+  int useGpu;
+  double refinedEnergy;
+  char gpuMsg[PATH_MAX + 256];
 
   for (imi = 0; imi < 2; ++imi)
     {
@@ -2521,10 +5759,37 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   r.correspondence = 0.0;
   r.constraining = 0.0;
   CopyString(&(r.message), NULL);
+  SetMoveKey(t.pair.pairName != NULL ? t.pair.pairName : outputName);
 
   kFactor = 1.0 / sqrt((double) (((size_t) imageWidth[1][0]) * imageWidth[1][0] +
 	                         ((size_t) imageHeight[1][0]) * imageHeight[1][0]));
   mapCons = NULL;
+  unpacked[0] = NULL;
+  unpacked[1] = NULL;
+  unpackedLevel = -1;
+  features[0] = NULL;
+  features[1] = NULL;
+  featureLevel = -1;
+  hist = NULL;
+  hdelta = NULL;
+  if (c.metric == MI_METRIC)
+    {
+      hist = (JointHistogram *) malloc(sizeof(JointHistogram));
+      hdelta = (HistogramDelta *) calloc(1, sizeof(HistogramDelta));
+      if (hist == NULL || hdelta == NULL)
+	{
+	  SetMessage("Could not allocate joint histogram\n");
+	  return;
+	}
+    }
+  tref = NULL;
+  trmask = NULL;
+  rtw = 0;
+#if TILED_REFERENCE
+  tiledLevel = -1;
+#endif
+  trmask2 = NULL;
+  mask2Level = -1;
   Log("Warping started with %d total resolution levels\n", nLevels);
 
   if (c.startLevel >= 0)
@@ -2543,10 +5808,19 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
      }
   else
     startLevel = nLevels - 1;
+  if (startLevel > nLevels - 1)
+    startLevel = nLevels - 1;
 
   /* go down hierarchy one level at a time */
   for (level = startLevel; level >= c.outputLevel; --level)
     {
+      /* stop if a speculative copy of this task has already finished */
+      if (par_task_cancelled())
+	{
+	  SetMessage("Task cancelled by the master\n");
+	  return;
+	}
+      METRICS_MARK("register level");
       Log("Considering level %d\n", level);
       mpw = mapWidth[level];
       mph = mapHeight[level];
@@ -2578,13 +5852,138 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       refoy = imageOffsetY[1][cLevel];
       icmbpl = (iw + 7) >> 3;
       rcmbpl = (rw + 7) >> 3;
-      cimage = images[0][cLevel];
-      cref = images[1][cLevel];
+
+      /* the coarser levels have been used for the last time, their
+	 maps having been propagated to this one */
+      if (!UsePyramidCache())
+	for (rl = level + 1; rl < nLevels; ++rl)
+	  ReleaseLevel(rl, 1);
+
+      if (c.pyramidBits < 32)
+	{
+	  /* decode the images of this level from the compact pyramid,
+	     keeping them while the following levels use them */
+	  if (cLevel != unpackedLevel)
+	    {
+	      free(unpacked[0]);
+	      free(unpacked[1]);
+	      unpacked[0] = UnpackLevel(0, cLevel);
+	      unpacked[1] = UnpackLevel(1, cLevel);
+	      unpackedLevel = cLevel;
+	      if (unpacked[0] == NULL || unpacked[1] == NULL)
+		{
+		  SetMessage("Could not allocate unpacked image arrays\n");
+		  return;
+		}
+	    }
+	  cimage = unpacked[0];
+	  cref = unpacked[1];
+	}
+      else
+	{
+	  cimage = images[0][cLevel];
+	  cref = images[1][cLevel];
+	}
 #if MASKING
       cimask = masks[0][cLevel];
       crmask = masks[1][cLevel];
 #endif
 
+      /* with -metric, the energy is computed on the feature images of
+	 the level while vimage and vref keep the intensities for the
+	 warped and correlation output */
+      vimage = cimage;
+      vref = cref;
+      if (metricFeatures[c.metric] != NULL)
+	{
+	  if (cLevel != featureLevel)
+	    {
+	      free(features[0]);
+	      free(features[1]);
+	      features[0] = (*metricFeatures[c.metric])(cimage, cimask,
+							iw, ih, icmbpl);
+	      features[1] = (*metricFeatures[c.metric])(cref, crmask,
+							rw, rh, rcmbpl);
+	      featureLevel = cLevel;
+	      if (features[0] == NULL || features[1] == NULL)
+		{
+		  SetMessage("Could not allocate feature images\n");
+		  return;
+		}
+	    }
+	  cimage = features[0];
+	  cref = features[1];
+	}
+      else if (c.metric == NGF_METRIC && cLevel != featureLevel)
+	{
+	  /* the normalized gradient fields are sampled alongside the
+	     intensities, which still decide the overlap */
+	  free(features[0]);
+	  free(features[1]);
+	  features[0] = NgfField(cimage, cimask, iw, ih, icmbpl, c.ngfEdge);
+	  features[1] = NgfField(cref, crmask, rw, rh, rcmbpl, c.ngfEdge);
+	  featureLevel = cLevel;
+	  if (features[0] == NULL || features[1] == NULL)
+	    {
+	      SetMessage("Could not allocate gradient fields\n");
+	      return;
+	    }
+	}
+#if TILED_REFERENCE
+      if (cLevel != tiledLevel)
+	{
+	  free(tref);
+	  free(trmask);
+	  trmask = NULL;
+	  tref = TileImage(cref, rw, rh, &rtw);
+#if MASKING
+	  trmask = TileMask(crmask, rw, rh, rcmbpl);
+	  if (trmask == NULL)
+	    {
+	      SetMessage("Could not allocate tiled reference mask\n");
+	      return;
+	    }
+#endif
+	  tiledLevel = cLevel;
+	  if (tref == NULL)
+	    {
+	      SetMessage("Could not allocate tiled reference image\n");
+	      return;
+	    }
+	}
+#else
+      tref = cref;
+      trmask = crmask;
+      rtw = 0;
+#endif
+#if MASKING
+      if (cLevel != mask2Level)
+	{
+	  free(trmask2);
+	  trmask2 = (unsigned char *) malloc(((size_t) rh) * rcmbpl);
+	  if (trmask2 == NULL)
+	    {
+	      SetMessage("Could not allocate 2x2 reference mask\n");
+	      return;
+	    }
+	  AndMask2x2(crmask, rw, rh, trmask2);
+#if TILED_REFERENCE
+	  {
+	    unsigned char *untiled = trmask2;
+
+	    trmask2 = TileMask(untiled, rw, rh, rcmbpl);
+	    free(untiled);
+	  }
+	  if (trmask2 == NULL)
+	    {
+	      SetMessage("Could not allocate tiled 2x2 reference mask\n");
+	      return;
+	    }
+#endif
+	  mask2Level = cLevel;
+	}
+#endif
+
 #if 0
       // TEMPORARY
       if (level == 13)
@@ -2637,7 +6036,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	}
 
       if (level == startLevel)
-	if (initialMapFactor != 0 && nCpts < 2)
+	if (initialMapFactor != 0 && (nCpts < 2 || t.split == SPLIT_PART))
 	  {
 	    /* use the provided input map as the initial map */
 	    /* create an array with coverage corresponding to the
@@ -2647,10 +6046,14 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	     compute distance
 	     let the threshold be a factor from sqrt(2)/2 to sqrt(2)
 	    */
-	    dnx = (imageWidth[0][0] + lFactor - 1) / lFactor;
-	    dny = (imageHeight[0][0] + lFactor - 1) / lFactor;
-	    dnx = dnx * lFactor / initialMapFactor + 1;
-	    dny = dny * lFactor / initialMapFactor + 1;
+	    /* the mask covers the elements of the initial map that the
+	       points of this map fall between, from gx0, gy0 */
+	    gx0 = (int) floor(((double) mox) * lFactor / initialMapFactor);
+	    gy0 = (int) floor(((double) moy) * lFactor / initialMapFactor);
+	    dnx = (int) floor(((double) (mox + mpw - 1)) * lFactor /
+			      initialMapFactor) - gx0 + 1;
+	    dny = (int) floor(((double) (moy + mph - 1)) * lFactor /
+			      initialMapFactor) - gy0 + 1;
 	    immbpl = (dnx + 7) >> 3;
 	    initialMapMask = (unsigned char *) malloc(dny * immbpl);
 	    memset(initialMapMask, 0, dny * immbpl);
@@ -2658,15 +6061,16 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	      for (x = 0; x < mpwi; ++x)
 		if (initialMap[y*mpwi+x].c > 0.0)
 		  {
-		    ixv = x + offxi;
-		    iyv = y + offyi;
+		    ixv = x + offxi - gx0;
+		    iyv = y + offyi - gy0;
 		    if (ixv >= 0 && ixv < dnx &&
 			iyv >= 0 && iyv < dny)
 		      initialMapMask[iyv*immbpl+(ixv >> 3)] |= 0x80 >> (ixv & 7);
 		  }
 	    initialMapDist = (float *) malloc(dny * dnx * sizeof(float));
-	    computeDistance(CHESSBOARD_DISTANCE, dnx, dny,
-			    initialMapMask, initialMapDist);
+	    computeDistanceThreaded(CHESSBOARD_DISTANCE, dnx, dny,
+				    initialMapMask, initialMapDist,
+				    c.nThreads);
 	    
 	    for (y = 0; y < mph; ++y)
 	      for (x = 0; x < mpw; ++x)
@@ -2676,25 +6080,27 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		  yv = (y + moy) * lFactor;
 
 		  /* lookup in the map */
-		  xv = (xv / initialMapFactor) - offxi;
-		  yv = (yv / initialMapFactor) - offyi;
+		  xv = xv / initialMapFactor;
+		  yv = yv / initialMapFactor;
 		  ixv = (int) floor(xv);
 		  iyv = (int) floor(yv);
 		  rrx = xv - ixv;
 		  rry = yv - iyv;
-		  if (ixv < -1 || ixv > dnx ||
-		      iyv < -1 || iyv > dny)
+		  gix = ixv - gx0;
+		  giy = iyv - gy0;
+		  if (gix < -1 || gix > dnx ||
+		      giy < -1 || giy > dny)
 		    Error("ixv (%d) or iyv (%d) out-of-range during initial position computation.\n",
 			  ixv, iyv);
-		  if (ixv < 0)
-		    ixv = 0;
-		  else if (ixv >= dnx)
-		    ixv = dnx-1;
-		  if (iyv < 0)
-		    iyv = 0;
-		  else if (iyv >= dny)
-		    iyv = dny-1;
-		  threshold = initialMapDist[iyv*dnx+ixv] + 2.0;
+		  if (gix < 0)
+		    gix = 0;
+		  else if (gix >= dnx)
+		    gix = dnx-1;
+		  if (giy < 0)
+		    giy = 0;
+		  else if (giy >= dny)
+		    giy = dny-1;
+		  threshold = initialMapDist[giy*dnx+gix] + 2.0;
 		      
 		  ixv -= offxi;
 		  iyv -= offyi;
@@ -2992,14 +6398,15 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	 from an unmasked image pixel */
       nTrimmed = 0;
 #if MASKING
-      dist = (float *) malloc(((size_t) ih) * iw * sizeof(float));
+      dist = (float *) PoolAlloc(((size_t) ih) * iw * sizeof(float));
       if (dist == NULL)
 	{
 	  SetMessage("Could not allocate dist array (%zd)\n",
 		     ((size_t) ih) * iw * sizeof(float));
 	  return;
 	}
-      computeDistance(EUCLIDEAN_DISTANCE_SQUARED, iw, ih, cimask, dist);
+      computeDistanceThreaded(EUCLIDEAN_DISTANCE_SQUARED, iw, ih, cimask, dist,
+			      c.nThreads);
 
       threshold = 2.0 * factor * factor;
       for (y = 0; y < mph; ++y)
@@ -3026,7 +6433,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		}
 	    }
 	}
-      free(dist);
+      PoolFree(dist);
 #endif
       nValid -= nTrimmed;
       Log("Trimmed %d map points in stage 1; %d of %d remaining\n", nTrimmed, nValid, mph * mpw);
@@ -3042,7 +6449,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       rpbw = rw + 2 * border;
       rpbh = rh + 2 * border;
       rpbbpl = (rpbw + 7) >> 3;
-      rpbmask = (unsigned char *) malloc(rpbh * rpbbpl);
+      rpbmask = (unsigned char *) PoolAlloc(rpbh * rpbbpl);
       if (rpbmask == NULL)
 	{
 	  SetMessage("Could not allocate rpbmask array (%zd)\n",
@@ -3075,7 +6482,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	}
 #endif
 
-      dist = (float *) malloc(((size_t) rpbh) * rpbw * sizeof(float));
+      dist = (float *) PoolAlloc(((size_t) rpbh) * rpbw * sizeof(float));
       if (dist == NULL)
 	{
 	  SetMessage("Could not allocate dist array (rpbh=%d rpbw=%d)\n",
@@ -3083,7 +6490,8 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	  return;
 	}
 
-      computeDistance(EUCLIDEAN_DISTANCE_SQUARED, rpbw, rpbh, rpbmask, dist);
+      computeDistanceThreaded(EUCLIDEAN_DISTANCE_SQUARED, rpbw, rpbh, rpbmask,
+			      dist, c.nThreads);
       threshold = 4.0 * factor * factor;
 
 #if 0
@@ -3137,8 +6545,8 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		MAP(map, mpw, x, y).c = 0.0;
 	      }
 	  }
-      free(dist);
-      free(rpbmask);
+      PoolFree(dist);
+      PoolFree(rpbmask);
 #endif
       nValid -= nTrimmed;
       Log("Trimmed %d map points in stage 2; %d of %d remaining\n", nTrimmed, nValid, mph * mpw);
@@ -3268,13 +6676,13 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       Log("constraining map at this level has %d points\n", ncc);
 
       /* compute the nominal areas and lengths for measuring distortion */
-      nomArea = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
-      nomL0 = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
-      nomL1 = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
-      nomL2 = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
-      nomL3 = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
-      nomThetaX = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
-      nomThetaY = (double *) malloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomArea = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomL0 = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomL1 = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomL2 = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomL3 = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomThetaX = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
+      nomThetaY = (double *) PoolAlloc(mph_minus_1 * mpw_minus_1 * sizeof(double));
       for (y = 0; y < mph_minus_1; ++y)
 	for (x = 0; x < mpw_minus_1; ++x)
 	  {
@@ -3317,7 +6725,13 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       sr2 = 0.0;
       si = 0.0;
       sr = 0.0;
+      sg = 0.0;
       nPoints = 0;
+      if (c.metric == MI_METRIC)
+	{
+	  memset(hist, 0, sizeof(JointHistogram));
+	  ClearHistogramDelta(hdelta);
+	}
 
       for (y = 0; y < ih; ++y)
 	for (x = 0; x < iw; ++x)
@@ -3361,17 +6775,14 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	      continue;
 
 #if MASKING
-	    if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-		rrx > 0.0 && (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0 ||
-		rry > 0.0 && (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-		rrx > 0.0 && rry > 0.0 && (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0)
+	    if (SAMPLE_MASKED(trmask, trmask2, rtw, rcmbpl, irx, iry, rrx, rry))
 	      continue;
 #endif
 	    ++nPoints;
-	    r00 = IMAGE(cref, rw, irx, iry);
-	    r01 = IMAGE(cref, rw, irx, iry + 1);
-	    r10 = IMAGE(cref, rw, irx + 1, iry);
-	    r11 = IMAGE(cref, rw, irx + 1, iry + 1);
+	    r00 = REF(tref, rtw, rw, irx, iry);
+	    r01 = REF(tref, rtw, rw, irx, iry + 1);
+	    r10 = REF(tref, rtw, rw, irx + 1, iry);
+	    r11 = REF(tref, rtw, rw, irx + 1, iry + 1);
 
 	    rv = r00 * (rrx - 1.0) * (rry - 1.0)
 	      - r10 * rrx * (rry - 1.0) 
@@ -3386,7 +6797,17 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	    sr += rv;
 	    sr2 += rv * rv;
 	    sir += iv * rv;
+	    if (c.metric == NGF_METRIC)
+	      sg += NgfTerm(features[0], features[1], iw, rw,
+			    x, y, irx, iry, rrx, rry);
+	    else if (c.metric == MI_METRIC)
+	      TallyHistogram(hdelta, iv, rv, 1);
 	  }
+      if (c.metric == MI_METRIC)
+	{
+	  ApplyHistogramDelta(hist, hdelta);
+	  SumHistogram(hist);
+	}
 #if MASKING
       requiredPoints = (size_t) ceil(minMaskCount[cLevel] * c.minOverlap * 0.01);
 #else
@@ -3415,6 +6836,10 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	}
       else
 	corr = -1000000.0;
+      if (c.metric == NGF_METRIC)
+	corr = NgfSimilarity(nPoints, requiredPoints, sg);
+      else if (c.metric == MI_METRIC)
+	corr = HistogramSimilarity(hist, NULL, requiredPoints);
       correlation = corr;
       Log("Level %d map has initial correlation energy of %f\n",
 	     level, correlation);
@@ -3531,6 +6956,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	    cpts[i].energy = distance;
 	  correspondence += cpts[i].energy;
 	}
+      IndexCpts(mpw, mph, mox, moy, lFactor);
 
       /* contribution from constraining map */
       constraining = 0.0;
@@ -3567,7 +6993,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	  constraining * c.constraining);
 
       mSize = ((size_t) mph) * mpw;
-      prop = (MapElement*) malloc(mSize * sizeof(MapElement));
+      prop = (MapElement*) PoolAlloc(mSize * sizeof(MapElement));
       if (prop == NULL)
 	{
 	  SetMessage("Could not allocate prop array (%zd)\n",
@@ -3578,10 +7004,47 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       
       fflush(stdout);
 
+      /* with -roi, a level only moves the map points within the
+	 margin of the region of interest once the margin spans at
+	 least 4 of its map cells, so that the coarser levels still
+	 align the whole overlap */
+      rMinX = 0;
+      rMaxX = mpw - 1;
+      rMinY = 0;
+      rMaxY = mph - 1;
+      if (roiMinX >= 0 && 4 * lFactor <= c.roiMargin)
+	{
+	  rMinX = (int) floor((roiMinX - c.roiMargin) / lFactor) - mox;
+	  rMaxX = (int) ceil((roiMaxX + c.roiMargin) / lFactor) - mox;
+	  rMinY = (int) floor((roiMinY - c.roiMargin) / lFactor) - moy;
+	  rMaxY = (int) ceil((roiMaxY + c.roiMargin) / lFactor) - moy;
+	  if (rMinX < 0)
+	    rMinX = 0;
+	  if (rMaxX > mpw - 1)
+	    rMaxX = mpw - 1;
+	  if (rMinY < 0)
+	    rMinY = 0;
+	  if (rMaxY > mph - 1)
+	    rMaxY = mph - 1;
+	  Log("Level %d: moving only map points %d-%d, %d-%d of %dx%d\n",
+	      level, rMinX, rMaxX, rMinY, rMaxY, mpw, mph);
+	}
+      roiW = rMaxX >= rMinX ? rMaxX - rMinX + 1 : 0;
+      roiH = rMaxY >= rMinY ? rMaxY - rMinY + 1 : 0;
+      roiCells = ((size_t) roiW) * roiH;
+
       multiplier = 1 << level;
-      goalMoveCount = (size_t) ceil((c.quality * mpw) * mph * multiplier);
+      goalMoveCount = (size_t) ceil((c.quality * roiW) * roiH * multiplier);
+      /* with -preview_level, the finer levels only carry the map
+	 interpolated from the preview level down to the output level */
+      if (level < c.previewLevel)
+	{
+	  Log("Level %d: preview, no moves\n", level);
+	  goalMoveCount = 0;
+	}
       moveCount = 0;
       acceptedMoveCount = 0;
+      converged = 0;
 
       logMaxRadius = log(0.5);
       logMinRadius = log(0.02 / factor); /* no use going smaller than 2% of the pixel size */
@@ -3593,21 +7056,269 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       memset(statTheta, 0, 21*sizeof(size_t));
       memset(statDeltaE, 0, 21*sizeof(double));
 
-      while (moveCount < goalMoveCount)
+#if !FOLDING
+      useThreads = c.nThreads > 1 && roiCells >= 64 * (size_t) c.nThreads;
+
+      /* with -gpu, the random moves are evaluated on the GPU, which
+	 knows only the correlation metric and has no correspondence
+	 points; anything else stays on the CPU */
+      useGpu = 0;
+      if (c.gpu && goalMoveCount > 0)
+	{
+	  if (c.metric != CORRELATION_METRIC || nCpts > 0)
+	    Log("Level %d: moving on the CPU, as -gpu only handles -metric correlation without correspondence points\n",
+		level);
+	  else
+	    {
+	      if (gpuReady == 0)
+		{
+		  gpuReady = GpuMovesInit(gpuMsg) ? 1 : -1;
+		  if (gpuReady < 0)
+		    Log("WARNING: moving on the CPU, as the GPU can not be used:\n  %s",
+			gpuMsg);
+		}
+	      useGpu = gpuReady > 0;
+	    }
+	}
+
+      if ((useThreads || useGpu || c.refineSweeps > 0) && goalMoveCount > 0)
+	{
+	  /* let a team of threads (or the GPU) sweep over
+	     non-adjacent tiles of the map; they always perform at
+	     least goalMoveCount moves, so the serial loop below is
+	     skipped */
+	  ms.nThreads = useThreads ? c.nThreads : 1;
+	  ms.level = level;
+	  ms.factor = factor;
+	  ms.mpw = mpw;
+	  ms.mph = mph;
+	  ms.mox = mox;
+	  ms.moy = moy;
+	  ms.map = map;
+	  ms.prop = prop;
+	  ms.mapCons = mapCons;
+	  ms.cimage = cimage;
+	  ms.cref = cref;
+	  ms.tref = tref;
+	  ms.ingf = features[0];
+	  ms.rngf = features[1];
+	  ms.hist = hist;
+	  ms.trmask = trmask;
+	  ms.trmask2 = trmask2;
+	  ms.rtw = rtw;
+	  ms.cimask = cimask;
+	  ms.crmask = crmask;
+	  ms.icmbpl = icmbpl;
+	  ms.rcmbpl = rcmbpl;
+	  ms.iw = iw;
+	  ms.ih = ih;
+	  ms.rw = rw;
+	  ms.rh = rh;
+	  ms.imgox = imgox;
+	  ms.imgoy = imgoy;
+	  ms.refox = refox;
+	  ms.refoy = refoy;
+	  ms.nomL0 = nomL0;
+	  ms.nomL1 = nomL1;
+	  ms.nomL2 = nomL2;
+	  ms.nomL3 = nomL3;
+	  ms.nomThetaX = nomThetaX;
+	  ms.nomThetaY = nomThetaY;
+	  ms.lFactor = lFactor;
+	  ms.kFactor = kFactor;
+	  ms.requiredPoints = requiredPoints;
+	  ms.dPoints = dPoints;
+	  ms.logMinRadius = logMinRadius;
+	  ms.logRadiusRange = logRadiusRange;
+	  ms.udLimit = udLimit;
+	  ms.diagLimit = diagLimit;
+	  ms.rMinX = rMinX;
+	  ms.rMaxX = rMaxX;
+	  ms.rMinY = rMinY;
+	  ms.rMaxY = rMaxY;
+	  ms.nSweeps = (goalMoveCount + roiCells - 1) / roiCells;
+	  ms.focusing = 0;
+	  ms.sweepEnergy = energy;
+	  ms.refine = 0;
+
+	  /* the sums carried by the serial code include the padding
+	     for missing points; the threads keep them unpadded */
+	  ms.g.nPoints = nPoints;
+	  ms.g.si = si;
+	  ms.g.si2 = si2;
+	  ms.g.sr = sr;
+	  ms.g.sr2 = sr2;
+	  ms.g.sir = sir;
+	  ms.g.sg = sg;
+	  if (nPoints < requiredPoints)
+	    {
+	      ms.g.sr -= (requiredPoints - nPoints) * 255.0;
+	      ms.g.sr2 -= (requiredPoints - nPoints) * 255.0 * 255.0;
+	    }
+	  ms.g.distortion = distortion;
+	  ms.g.correspondence = correspondence;
+	  ms.g.constraining = constraining;
+	  ms.correlation = correlation;
+	  ms.energy = energy;
+
+	  mts = (MoveThread *) malloc(ms.nThreads * sizeof(MoveThread));
+	  if (mts == NULL)
+	    {
+	      SetMessage("Could not allocate move thread array\n");
+	      return;
+	    }
+
+	  /* with -refine, the map points are first moved down the
+	     gradient of the energy, and only a fraction of the move
+	     budget is then spent on random moves to polish the map */
+	  if (c.refineSweeps > 0)
+	    {
+	      ms.refine = 1;
+	      ms.nSweeps = c.refineSweeps;
+	      ms.refineStep = 0.25 / factor;
+	      ComputeThreadedMoves(&ms, mts);
+	      refinedEnergy = ms.energy;
+	      moveCount = 0;
+	      for (ii = 0; ii < ms.nThreads; ++ii)
+		{
+		  moveCount += mts[ii].moveCount;
+		  acceptedMoveCount += mts[ii].acceptedMoveCount;
+		}
+	      Log("Level %d: refined energy from %f to %f with %zd evaluations, %zd steps\n",
+		  level, energy, refinedEnergy, moveCount, acceptedMoveCount);
+	      acceptedMoveCount = 0;
+	      ms.refine = 0;
+	      goalMoveCount = (size_t) ceil(goalMoveCount * c.refinePolish);
+	      ms.nSweeps = (goalMoveCount + roiCells - 1) / roiCells;
+	      ms.focusing = 0;
+	      ms.sweepEnergy = ms.energy;
+	    }
+
+	  moveCount = 0;
+	  if (useGpu && goalMoveCount > 0)
+	    {
+	      if (!ComputeGpuMoves(&ms, mts, gpuMsg))
+		{
+		  /* the moves made so far stand; the sweeps the GPU did
+		     not finish are left to the threads, and the moves
+		     short of goalMoveCount to the serial loop (a level
+		     too large for the GPU is the usual cause, so the
+		     next one tries it again) */
+		  Log("WARNING: finishing level %d on the CPU, as the GPU failed after %zd of %zd sweeps:\n  %s",
+		      level, mts[0].sweep, ms.nSweeps, gpuMsg);
+		  useGpu = 0;
+		  if (mts[0].sweep < ms.nSweeps)
+		    ms.nSweeps -= mts[0].sweep;
+		  else
+		    ms.nSweeps = 0;
+		}
+	      moveCount += mts[0].moveCount;
+	      acceptedMoveCount += mts[0].acceptedMoveCount;
+	      for (i = 0; i < 21; ++i)
+		{
+		  statLogRadius[i] += mts[0].statLogRadius[i];
+		  statTheta[i] += mts[0].statTheta[i];
+		  statDeltaE[i] += mts[0].statDeltaE[i];
+		}
+	    }
+	  if (useThreads && !useGpu && goalMoveCount > 0 && ms.nSweeps > 0)
+	    {
+	      ComputeThreadedMoves(&ms, mts);
+	      for (ii = 0; ii < c.nThreads; ++ii)
+		{
+		  moveCount += mts[ii].moveCount;
+		  acceptedMoveCount += mts[ii].acceptedMoveCount;
+		  for (i = 0; i < 21; ++i)
+		    {
+		      statLogRadius[i] += mts[ii].statLogRadius[i];
+		      statTheta[i] += mts[ii].statTheta[i];
+		      statDeltaE[i] += mts[ii].statDeltaE[i];
+		    }
+		}
+	    }
+	  free(mts);
+
+	  nPoints = ms.g.nPoints;
+	  si = ms.g.si;
+	  si2 = ms.g.si2;
+	  sr = ms.g.sr;
+	  sr2 = ms.g.sr2;
+	  sir = ms.g.sir;
+	  sg = ms.g.sg;
+	  if (nPoints < requiredPoints)
+	    {
+	      sr += (requiredPoints - nPoints) * 255.0;
+	      sr2 += (requiredPoints - nPoints) * 255.0 * 255.0;
+	    }
+	  distortion = ms.g.distortion;
+	  correspondence = ms.g.correspondence;
+	  constraining = ms.g.constraining;
+	  correlation = ms.correlation;
+	  energy = ms.energy;
+	  displayLevel = level;
+
+	  /* without threads, the polish is left to the serial loop */
+	  converged = (useThreads || useGpu) && moveCount < goalMoveCount;
+	}
+#endif
+
+      /* with -stop_acceptance, the rows of the map are swept only
+	 while they keep accepting moves (see NextSweepRegions) */
+      rowActive = NULL;
+      rowMoves = NULL;
+      rowAccepted = NULL;
+      if (c.stopAcceptance > 0.0 && !converged && moveCount < goalMoveCount)
+	{
+	  rowActive = (char *) malloc(mph * sizeof(char));
+	  rowMoves = (size_t *) malloc(mph * sizeof(size_t));
+	  rowAccepted = (size_t *) malloc(mph * sizeof(size_t));
+	  if (rowActive == NULL || rowMoves == NULL || rowAccepted == NULL)
+	    {
+	      SetMessage("Could not allocate adaptive stopping arrays\n");
+	      return;
+	    }
+	  memset(rowActive, 1, mph * sizeof(char));
+	  memset(rowMoves, 0, mph * sizeof(size_t));
+	  memset(rowAccepted, 0, mph * sizeof(size_t));
+	}
+      focusing = 0;
+      sweepEnergy = energy;
+      position = 0;
+
+      METRICS_RANGE_BEGIN("register serial moves");
+      while (moveCount < goalMoveCount && !converged)
 	{
 #if GRAPHICS
 	  if (moveCount % (mpw * mph) == 0)
 	    displayLevel = level;
 #endif
+	  if (rowActive != NULL && position > 0 && position % roiCells == 0 &&
+	      NextSweepRegions(mph, rowMoves, rowAccepted, rowActive,
+			       &sweepEnergy, energy, &focusing) == 0)
+	    {
+	      converged = 1;
+	      break;
+	    }
 #if 1
 	  // go in sequential order for cache-friendliness
-	  icx = moveCount % mpw; 
-	  icy = (moveCount / mpw) % mph;
+	  icx = rMinX + position % roiW;
+	  icy = rMinY + (position / roiW) % roiH;
 #endif
 #if 0
 	  icx = (int) floor(drand48() * mpw);
 	  icy = (int) floor(drand48() * mph);
 #endif
+	  if (rowActive != NULL)
+	    {
+	      if (!rowActive[icy])
+		{
+		  position += roiW - (icx - rMinX);
+		  continue;
+		}
+	      ++rowMoves[icy];
+	    }
+	  sweep = position / roiCells;
+	  ++position;
 	  ++moveCount;
 
 	  // make sure (icx,icy) is in the trimmed subregion
@@ -3618,10 +7329,10 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	    Error("ISNAN cx %f cy %f\n", cx, cy);
 
 	  moveDebug = 0;
-	  rnd = drand48();
+	  MoveRandom(level, (sweep * mph + icy) * mpw + icx, &rnd, &theta);
 	  logRadius = rnd * logRadiusRange + logMinRadius;
 	  radius = exp(logRadius);
-	  theta = drand48() * 2.0 * M_PI;
+	  theta *= 2.0 * M_PI;
 	  cx += radius * cos(theta);
 	  cy += radius * sin(theta);
 #if DEBUG_MOVES
@@ -3746,7 +7457,10 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	  dsr = 0.0;
 	  dsi = 0.0;
 	  dsi2 = 0.0;
+	  dsg = 0.0;
 	  cPoints = 0;
+	  if (c.metric == MI_METRIC)
+	    ClearHistogramDelta(hdelta);
 	  sx = (changeMinX - 1 + mox) * factor - imgox;
 	  if (sx < 0)
 	    sx = 0;
@@ -3813,16 +7527,13 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		    if (irx >= 0 && irx < rw-1 && iry >= 0 && iry < rh-1)
 		      {
 #if MASKING
-			if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) != 0 &&
-			    ((rrx <= 0.0) || (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) != 0) &&
-			    ((rry <= 0.0) || (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) != 0) &&
-			    ((rrx <= 0.0) || (rry <= 0.0) || (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) != 0))
+			if (!SAMPLE_MASKED(trmask, trmask2, rtw, rcmbpl, irx, iry, rrx, rry))
 			  {
 #endif
-			    r00 = IMAGE(cref, rw, irx, iry);
-			    r01 = IMAGE(cref, rw, irx, iry + 1);
-			    r10 = IMAGE(cref, rw, irx + 1, iry);
-			    r11 = IMAGE(cref, rw, irx + 1, iry + 1);
+			    r00 = REF(tref, rtw, rw, irx, iry);
+			    r01 = REF(tref, rtw, rw, irx, iry + 1);
+			    r10 = REF(tref, rtw, rw, irx + 1, iry);
+			    r11 = REF(tref, rtw, rw, irx + 1, iry + 1);
 
 			    rv = r00 * (rrx - 1.0) * (rry - 1.0)
 			      - r10 * rrx * (rry - 1.0) 
@@ -3834,6 +7545,11 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 			    dsr2 -= rv * rv;
 			    dsr -= rv;
 			    cPoints -= 1;
+			    if (c.metric == NGF_METRIC)
+			      dsg -= NgfTerm(features[0], features[1], iw, rw,
+					     x, y, irx, iry, rrx, rry);
+			    else if (c.metric == MI_METRIC)
+			      TallyHistogram(hdelta, iv, rv, -1);
 #if MASKING
 			  }
 #endif
@@ -3881,16 +7597,13 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		//		printf("irx = %d iry = %d rw = %d rh = %d factor = %d ixv = %d iyv = %d\n",
 		//		       irx, iry, rw, rh, factor, ixv, iyv);
 #if MASKING
-		if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-		    rrx > 0.0 && (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0 ||
-		    rry > 0.0 && (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-		    rrx > 0.0 && rry > 0.0 && (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0)
+		if (SAMPLE_MASKED(trmask, trmask2, rtw, rcmbpl, irx, iry, rrx, rry))
 		  continue;
 #endif
-		r00 = IMAGE(cref, rw, irx, iry);
-		r01 = IMAGE(cref, rw, irx, iry + 1);
-		r10 = IMAGE(cref, rw, irx + 1, iry);
-		r11 = IMAGE(cref, rw, irx + 1, iry + 1);
+		r00 = REF(tref, rtw, rw, irx, iry);
+		r01 = REF(tref, rtw, rw, irx, iry + 1);
+		r10 = REF(tref, rtw, rw, irx + 1, iry);
+		r11 = REF(tref, rtw, rw, irx + 1, iry + 1);
 		    
 		rv = r00 * (rrx - 1.0) * (rry - 1.0)
 		  - r10 * rrx * (rry - 1.0) 
@@ -3902,6 +7615,11 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		dsr2 += rv * rv;
 		dsr += rv;
 		cPoints += 1;
+		if (c.metric == NGF_METRIC)
+		  dsg += NgfTerm(features[0], features[1], iw, rw,
+				 x, y, irx, iry, rrx, rry);
+		else if (c.metric == MI_METRIC)
+		  TallyHistogram(hdelta, iv, rv, 1);
 	      }
 
 	  if (nPoints < requiredPoints)
@@ -3940,6 +7658,11 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	    }
 	  else
 	    newCorr = -1000000.0;
+	  newsg = sg + dsg;
+	  if (c.metric == NGF_METRIC)
+	    newCorr = NgfSimilarity(newPoints, requiredPoints, newsg);
+	  else if (c.metric == MI_METRIC)
+	    newCorr = HistogramSimilarity(hist, hdelta, requiredPoints);
 	  newCorrelation = newCorr;
 	  if (newCorrelation > 1.1)
 	    {
@@ -4079,55 +7802,53 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	  // FIX to divide by adjusted dpoints
 	  newDistortion = distortion + de / dPoints;
 
-	  /* add in contribution from correspondence energy */
+	  /* add in contribution from correspondence energy; only the
+	     points in the cells around the change can move */
 	  ce = 0.0;
-	  for (i = 0; i < nCpts; ++i)
-	    {
-	      xv = cpts[i].ix / lFactor - mox;
-	      yv = cpts[i].iy / lFactor - moy;
-	      ixv = ((int) (xv + 2.0)) - 2;
-	      iyv = ((int) (yv + 2.0)) - 2;
-	      if (ixv < changeMinX-1 || ixv > changeMaxX ||
-		  iyv < changeMinY-1 || iyv > changeMaxY)
-		{
-		  cpts[i].newEnergy = cpts[i].energy;
-		  continue;
-		}
-	      rrx = xv - ixv;
-	      rry = yv - iyv;
-	      if (ixv < 0 || ixv >= mpw_minus_1 || iyv < 0 || iyv >= mph_minus_1)
+	  cMinX = changeMinX > 0 ? changeMinX - 1 : 0;
+	  cMaxX = changeMaxX < mpw_minus_1 ? changeMaxX : mpw_minus_1 - 1;
+	  cMinY = changeMinY > 0 ? changeMinY - 1 : 0;
+	  cMaxY = changeMaxY < mph_minus_1 ? changeMaxY : mph_minus_1 - 1;
+	  for (by = cMinY; by <= cMaxY && nCpts > 0; ++by)
+	    for (bx = cMinX; bx <= cMaxX; ++bx)
+	      for (ci = cptsCellStart[by * cptsCellWidth + bx];
+		   ci < cptsCellStart[by * cptsCellWidth + bx + 1]; ++ci)
 		{
-		  cpts[i].newEnergy = 1000000.0;
-		  continue;
+		  i = cptsCellPoint[ci];
+		  xv = cpts[i].ix / lFactor - mox;
+		  yv = cpts[i].iy / lFactor - moy;
+		  ixv = bx;
+		  iyv = by;
+		  rrx = xv - ixv;
+		  rry = yv - iyv;
+		  mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
+		  GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+		  mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
+		  GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+		  mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
+		  GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+		  mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
+		  GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+
+		  rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+		    - rx10 * rrx * (rry - 1.0) 
+		    - rx01 * (rrx - 1.0) * rry
+		    + rx11 * rrx * rry;
+		  ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+		    - ry10 * rrx * (rry - 1.0) 
+		    - ry01 * (rrx - 1.0) * rry
+		    + ry11 * rrx * rry;
+		  rx = lFactor * rx;
+		  ry = lFactor * ry;
+		  rrx = cpts[i].rx;
+		  rry = cpts[i].ry;
+		  distance = kFactor * (hypot(rrx-rx, rry-ry) - c.correspondenceThreshold);
+		  if (distance < 0.0)
+		    cpts[i].newEnergy = 0.0;
+		  else
+		    cpts[i].newEnergy = distance;
+		  ce += cpts[i].newEnergy - cpts[i].energy;
 		}
-	      mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
-	      mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
-	      mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
-	      mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
-
-	      rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-		- rx10 * rrx * (rry - 1.0) 
-		- rx01 * (rrx - 1.0) * rry
-		+ rx11 * rrx * rry;
-	      ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-		- ry10 * rrx * (rry - 1.0) 
-		- ry01 * (rrx - 1.0) * rry
-		+ ry11 * rrx * rry;
-	      rx = lFactor * rx;
-	      ry = lFactor * ry;
-	      rrx = cpts[i].rx;
-	      rry = cpts[i].ry;
-	      distance = kFactor * (hypot(rrx-rx, rry-ry) - c.correspondenceThreshold);
-	      if (distance < 0.0)
-		cpts[i].newEnergy = 0.0;
-	      else
-		cpts[i].newEnergy = distance;
-	      ce += cpts[i].newEnergy - cpts[i].energy;
-	    }
 	  newCorrespondence = correspondence + ce;
 
 	  /* add in contribution from constraining map */
@@ -4259,8 +7980,12 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 		}
 #endif	      
 
-	      for (i = 0; i < nCpts; ++i)
-		cpts[i].energy = cpts[i].newEnergy;
+	      for (by = cMinY; by <= cMaxY && nCpts > 0; ++by)
+		for (bx = cMinX; bx <= cMaxX; ++bx)
+		  for (ci = cptsCellStart[by * cptsCellWidth + bx];
+		       ci < cptsCellStart[by * cptsCellWidth + bx + 1]; ++ci)
+		    cpts[cptsCellPoint[ci]].energy =
+		      cpts[cptsCellPoint[ci]].newEnergy;
 
 	      nPoints = newPoints;
 	      si = newsi;
@@ -4268,17 +7993,32 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	      sr = newsr;
 	      sr2 = newsr2;
 	      sir = newsir;
+	      sg = newsg;
+	      if (c.metric == MI_METRIC)
+		ApplyHistogramDelta(hist, hdelta);
 	      correlation = newCorrelation;
 	      distortion = newDistortion;
 	      correspondence = newCorrespondence;
 	      constraining = newConstraining;
 	      energy = newEnergy;
 	      ++acceptedMoveCount;
+	      if (rowAccepted != NULL)
+		++rowAccepted[icy];
 	      displayLevel = level;
 	      //	      sleep(1);
 	    }
 	}
+      METRICS_RANGE_END();
 
+      if (rowActive != NULL)
+	{
+	  free(rowActive);
+	  free(rowMoves);
+	  free(rowAccepted);
+	}
+      if (converged)
+	Log("Level %d: converged, stopping after %zd of %zd moves\n",
+	    level, moveCount, goalMoveCount);
       Log("Level %d: after %d moves, and %d accepted moves...\n",
 	  level, moveCount, acceptedMoveCount);
       Log("          energy is %f\n", energy);
@@ -4296,132 +8036,1453 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	    statDeltaE[i]);
       Log("--- done with level %d ---\n", level);
       
-      free(prop);
-      free(nomArea);
-      free(nomL0);
-      free(nomL1);
-      free(nomL2);
-      free(nomL3);
-      free(nomThetaX);
-      free(nomThetaY);
+      PoolFree(prop);
+      PoolFree(nomArea);
+      PoolFree(nomL0);
+      PoolFree(nomL1);
+      PoolFree(nomL2);
+      PoolFree(nomL3);
+      PoolFree(nomThetaX);
+      PoolFree(nomThetaY);
 #if FOLDING
       free(cirdisc);
 #endif
 
-      if (level == c.outputLevel || c.writeAllMaps)
-	{
-	  Log("Going to write output map at level %d\n", level);
-	  count = 0;
-	  for (y = 0; y < mph; ++y)
-	    for (x = 0; x < mpw; ++x)
-	      if (MAP(map, mpw, x, y).c >= 0.001)
-		++count;
-	  Log("map initially has %d valid points of %d possible\n", count, mph * mpw);
-	  Log("mox = %d moy = %d imgox = %d imgoy = %d\n",
-	      mox, moy, imgox, imgoy);
-#if 1
-	  warpedArray = (float *) malloc(ih * iw * sizeof(float));
-	  validArray = (unsigned char *) malloc(iw * ih *
-						sizeof(unsigned char));
-	  ComputeWarpedImage(warpedArray, validArray,
-			     iw, ih,
-			     imgox, imgoy,
-			     cref, crmask,
-			     rw, rh,
-			     refox, refoy,
-			     map,
-			     factor, mpw, mph, mox, moy);
-
-	  correlationArray = (float *) malloc(ih * iw * sizeof(float));
-	  ComputeCorrelation(correlationArray,
-			     cimage, warpedArray, validArray,
-			     iw, ih,
-			     c.correlationHalfWidth);
+      if (level == c.outputLevel || c.writeAllMaps)
+	{
+	  Log("Going to write output map at level %d\n", level);
+	  count = 0;
+	  for (y = 0; y < mph; ++y)
+	    for (x = 0; x < mpw; ++x)
+	      if (MAP(map, mpw, x, y).c >= 0.001)
+		++count;
+	  Log("map initially has %d valid points of %d possible\n", count, mph * mpw);
+	  Log("mox = %d moy = %d imgox = %d imgoy = %d\n",
+	      mox, moy, imgox, imgoy);
+#if 1
+	  METRICS_RANGE_BEGIN("register warp");
+	  warpedArray = (float *) PoolAlloc(ih * iw * sizeof(float));
+	  validArray = (unsigned char *) PoolAlloc(iw * ih *
+						sizeof(unsigned char));
+	  if (!ComputeWarpedImage(warpedArray, validArray,
+				  iw, ih,
+				  imgox, imgoy,
+				  vref, crmask,
+				  rw, rh,
+				  refox, refoy,
+				  map,
+				  factor, mpw, mph, mox, moy))
+	    Error("Could not allocate span arrays in ComputeWarpedImage\n");
+	  METRICS_RANGE_END();
+
+	  METRICS_RANGE_BEGIN("register correlation");
+	  correlationArray = (float *) PoolAlloc(ih * iw * sizeof(float));
+	  if (c.correlationKernel == BOX_KERNEL)
+	    {
+	      if (!ComputeBoxCorrelation(correlationArray,
+					 vimage, warpedArray, validArray,
+					 iw, ih,
+					 c.correlationHalfWidth))
+		Error("Could not allocate column sums in ComputeBoxCorrelation\n");
+	    }
+	  else if (!ComputeCorrelation(correlationArray,
+				       vimage, warpedArray, validArray,
+				       iw, ih,
+				       c.correlationHalfWidth))
+	    Error("Could not allocate disc extents in ComputeCorrelation\n");
+	  METRICS_RANGE_END();
+
+	  // use the correlation as the confidence values
+	  //   for the map entries
+	  count1 = count2 = count3 = count4 = 0;
+	  for (y = 0; y < mph; ++y)
+	    for (x = 0; x < mpw; ++x)
+	      {
+		ixv = factor * (x + mox) - imgox;
+		iyv = factor * (y + moy) - imgoy;
+		if (ixv < 0 || ixv >= iw ||
+		    iyv < 0 || iyv >= ih)
+		  {
+		    if (MAP(map, mpw, x, y).c >= 0.001)
+		      {
+			++count1;
+			MAP(map, mpw, x, y).c = 0.001;
+		      }
+		    else
+		      {
+			++count2;
+			MAP(map, mpw, x, y).c = 0.0;
+		      }
+		  }
+		else
+		  {
+		    if (MAP(map, mpw, x, y).c >= 0.001)
+		      {
+			++count3;
+			MAP(map, mpw, x, y).c = correlationArray[iyv * iw + ixv];
+			if (MAP(map, mpw, x, y).c == 0.0)
+			  MAP(map, mpw, x, y).c = 0.001;
+		      }
+		    else
+		      {
+			++count4;
+			MAP(map, mpw, x, y).c = 0.0;
+		      }
+		  }
+	      }
+	  Log("map to be output stats: %d %d %d %d\n", count1, count2, count3, count4);
+#endif
+
+	  if (level == c.outputLevel)
+	    TrimOutputMap(map, mpw, mph, mox, moy,
+			  factor,
+			  iw, ih, imgox, imgoy,
+			  rw, rh, refox, refoy,
+			  cimask,
+			  crmask);
+
+	  prevPhase = MetricsPhase(METRICS_WRITE);
+	  WriteOutputMap(outputName, level, map, mpw, mph, mox, moy);
+	  if (outputWarpedName[0] != '\0')
+	    WriteOutputImage(outputWarpedName, c.outputLevel, warpedArray,
+			     iw, ih, 1.0);
+	  if (outputCorrelationName[0] != '\0')
+	    WriteOutputImage(outputCorrelationName, c.outputLevel, correlationArray,
+			     iw, ih, 256.0);
+	  MetricsPhase(prevPhase);
+	  
+#if 1
+	  PoolFree(warpedArray);
+	  PoolFree(validArray);
+	  PoolFree(correlationArray);
+#endif
+	}
+    }
+
+ writeScore:  
+  free(unpacked[0]);
+  free(unpacked[1]);
+  free(features[0]);
+  free(features[1]);
+  free(hist);
+  free(hdelta);
+#if TILED_REFERENCE
+  free(tref);
+  free(trmask);
+#endif
+  free(trmask2);
+
+  // write out the score for this mapping
+  po.kind = OUTPUT_SCORE;
+  sprintf(po.fn, "%s.score", outputName);
+  po.data = malloc(256);
+  if (po.data == NULL)
+    Error("Could not allocate score text\n");
+  sprintf((char *) po.data, "%f %f %f %f %f\n",
+	  correlation
+	  - c.distortion * distortion
+	  - c.correspondence * correspondence
+	  - c.constraining * constraining,
+	  correlation, distortion, correspondence, constraining);
+  QueueOutput(&po);
+
+  r.correlation = correlation;
+  r.distortion = distortion;
+  r.correspondence = correspondence;
+  r.constraining = constraining;
+}
+
+/* ComputeThreadedMoves runs the move loop of one level with
+   ms->nThreads threads.  The map is cut into square tiles which are
+   colored in a 2x2 checkerboard pattern; a move at map point (x,y)
+   only reads points within 1 of (x,y) and only changes the
+   correlation and distortion contributions of the cells adjacent to
+   (x,y), so tiles of the same color can be swept concurrently without
+   two threads touching the same cell.  Each thread evaluates its
+   moves against the global sums plus its own accepted deltas, and
+   the deltas are merged after every color phase. */
+void
+ComputeThreadedMoves (MoveState *ms, MoveThread *mts)
+{
+  int i;
+  int n;
+  int ts;
+
+  /* aim for about 16 tiles per thread, but never less than 2x2 */
+  ts = (int) floor(sqrt(((double) ms->mpw) * ms->mph /
+			(16.0 * ms->nThreads)));
+  if (ts < 2)
+    ts = 2;
+  METRICS_RANGE_BEGIN("register move batch");
+  ms->tileSize = ts;
+  ms->threads = mts;
+  ms->ntx = (ms->mpw + ts - 1) / ts;
+  ms->nty = (ms->mph + ts - 1) / ts;
+  if (c.metric == NGF_METRIC)
+    ms->correlation = NgfSimilarity(ms->g.nPoints, ms->requiredPoints,
+				    ms->g.sg);
+  else if (c.metric == MI_METRIC)
+    ms->correlation = HistogramSimilarity(ms->hist, NULL,
+					  ms->requiredPoints);
+  else
+    ms->correlation = PaddedCorrelation(ms->g.nPoints, ms->requiredPoints,
+					ms->g.si, ms->g.si2,
+					ms->g.sr, ms->g.sr2, ms->g.sir);
+  Log("Level %d: sweeping %zd times with %d threads over %dx%d tiles of size %d\n",
+      ms->level, ms->nSweeps, ms->nThreads, ms->ntx, ms->nty, ts);
+  ms->tileActive = NULL;
+  ms->tileMoves = NULL;
+  ms->tileAccepted = NULL;
+  if (c.stopAcceptance > 0.0 && !ms->refine)
+    {
+      n = ms->ntx * ms->nty;
+      ms->tileActive = (char *) malloc(n * sizeof(char));
+      ms->tileMoves = (size_t *) malloc(n * sizeof(size_t));
+      ms->tileAccepted = (size_t *) malloc(n * sizeof(size_t));
+      if (ms->tileActive == NULL || ms->tileMoves == NULL ||
+	  ms->tileAccepted == NULL)
+	Error("Could not allocate adaptive stopping arrays\n");
+      memset(ms->tileActive, 1, n * sizeof(char));
+      memset(ms->tileMoves, 0, n * sizeof(size_t));
+      memset(ms->tileAccepted, 0, n * sizeof(size_t));
+    }
+  ms->done = ms->nSweeps == 0;
+  ms->sweepAccepted = 0;
+
+  if (pthread_barrier_init(&ms->barrier, NULL, ms->nThreads) != 0)
+    Error("pthread_barrier_init failed\n");
+  for (i = 0; i < ms->nThreads; ++i)
+    {
+      memset(&mts[i], 0, sizeof(MoveThread));
+      mts[i].ms = ms;
+      mts[i].id = i;
+    }
+  for (i = 1; i < ms->nThreads; ++i)
+    if (pthread_create(&mts[i].thread, NULL, MoveThreadMain, &mts[i]) != 0)
+      Error("pthread_create failed\n");
+  (void) MoveThreadMain(&mts[0]);
+  for (i = 1; i < ms->nThreads; ++i)
+    if (pthread_join(mts[i].thread, NULL) != 0)
+      Error("pthread_join failed\n");
+  pthread_barrier_destroy(&ms->barrier);
+  if (ms->tileActive != NULL)
+    {
+      free(ms->tileActive);
+      free(ms->tileMoves);
+      free(ms->tileAccepted);
+    }
+  METRICS_RANGE_END();
+}
 
-	  // use the correlation as the confidence values
-	  //   for the map entries
-	  count1 = count2 = count3 = count4 = 0;
-	  for (y = 0; y < mph; ++y)
-	    for (x = 0; x < mpw; ++x)
+void *
+MoveThreadMain (void *arg)
+{
+  MoveThread *mt = (MoveThread *) arg;
+  MoveState *ms = mt->ms;
+  size_t sweep;
+  int color;
+  int tx, ty;
+  int x, y;
+  int minX, maxX, minY, maxY;
+  int tile;
+  int i;
+  int k;
+  size_t moves, accepted;
+  MoveSums *d;
+  JointHistogram *start;
+
+  par_pin_thread(mt->id);
+  for (sweep = 0; !ms->done; ++sweep)
+    for (color = 0; color < 4; ++color)
+      {
+	mt->sweep = sweep;
+	memset(&mt->d, 0, sizeof(MoveSums));
+	if (c.metric == MI_METRIC)
+	  mt->hist = *ms->hist;
+	mt->correlation = ms->correlation;
+	mt->energy = ms->energy;
+
+	/* deal out the tiles of this color round-robin */
+	tile = 0;
+	for (ty = color >> 1; ty < ms->nty; ty += 2)
+	  for (tx = color & 1; tx < ms->ntx; tx += 2)
+	    {
+	      k = ty * ms->ntx + tx;
+	      if (ms->tileActive != NULL && !ms->tileActive[k])
+		continue;
+	      minX = tx * ms->tileSize;
+	      maxX = minX + ms->tileSize - 1;
+	      if (minX < ms->rMinX)
+		minX = ms->rMinX;
+	      if (maxX > ms->rMaxX)
+		maxX = ms->rMaxX;
+	      minY = ty * ms->tileSize;
+	      maxY = minY + ms->tileSize - 1;
+	      if (minY < ms->rMinY)
+		minY = ms->rMinY;
+	      if (maxY > ms->rMaxY)
+		maxY = ms->rMaxY;
+	      if (minX > maxX || minY > maxY)
+		continue;
+	      if (tile++ % ms->nThreads != mt->id)
+		continue;
+	      moves = mt->moveCount;
+	      accepted = mt->acceptedMoveCount;
+	      for (y = minY; y <= maxY; ++y)
+		for (x = minX; x <= maxX; ++x)
+		  if (ms->refine)
+		    RefineMove(mt, x, y);
+		  else
+		    ThreadedMove(mt, x, y);
+	      if (ms->tileActive != NULL)
+		{
+		  ms->tileMoves[k] += mt->moveCount - moves;
+		  ms->tileAccepted[k] += mt->acceptedMoveCount - accepted;
+		}
+	    }
+
+	/* merge the deltas of all threads into the global sums */
+	pthread_barrier_wait(&ms->barrier);
+	if (mt->id == 0)
+	  {
+	    for (i = 0; i < ms->nThreads; ++i)
 	      {
-		ixv = factor * (x + mox) - imgox;
-		iyv = factor * (y + moy) - imgoy;
-		if (ixv < 0 || ixv >= iw ||
-		    iyv < 0 || iyv >= ih)
+		d = &ms->threads[i].d;
+		ms->g.nPoints += d->nPoints;
+		ms->g.si += d->si;
+		ms->g.si2 += d->si2;
+		ms->g.sr += d->sr;
+		ms->g.sr2 += d->sr2;
+		ms->g.sir += d->sir;
+		ms->g.sg += d->sg;
+		ms->g.distortion += d->distortion;
+		ms->g.correspondence += d->correspondence;
+		ms->g.constraining += d->constraining;
+	      }
+	    if (c.metric == NGF_METRIC)
+	      ms->correlation = NgfSimilarity(ms->g.nPoints,
+					      ms->requiredPoints,
+					      ms->g.sg);
+	    else if (c.metric == MI_METRIC)
+	      {
+		/* every thread started the phase from the global
+		   histogram, so the changes are its bins less those */
+		start = (JointHistogram *) malloc(sizeof(JointHistogram));
+		if (start == NULL)
+		  Error("Could not allocate joint histogram\n");
+		*start = *ms->hist;
+		for (i = 0; i < ms->nThreads; ++i)
 		  {
-		    if (MAP(map, mpw, x, y).c >= 0.001)
-		      {
-			++count1;
-			MAP(map, mpw, x, y).c = 0.001;
-		      }
-		    else
+		    for (k = 0; k < MI_BINS * MI_BINS; ++k)
+		      ms->hist->joint[k] += ms->threads[i].hist.joint[k] -
+			start->joint[k];
+		    for (k = 0; k < MI_BINS; ++k)
 		      {
-			++count2;
-			MAP(map, mpw, x, y).c = 0.0;
+			ms->hist->image[k] += ms->threads[i].hist.image[k] -
+			  start->image[k];
+			ms->hist->ref[k] += ms->threads[i].hist.ref[k] -
+			  start->ref[k];
 		      }
+		    ms->hist->n += ms->threads[i].hist.n - start->n;
+		  }
+		free(start);
+		SumHistogram(ms->hist);
+		ms->correlation = HistogramSimilarity(ms->hist, NULL,
+						      ms->requiredPoints);
+	      }
+	    else
+	      ms->correlation = PaddedCorrelation(ms->g.nPoints,
+						  ms->requiredPoints,
+						  ms->g.si, ms->g.si2,
+						  ms->g.sr, ms->g.sr2,
+						  ms->g.sir);
+	    ms->energy = ms->g.distortion * c.distortion - ms->correlation +
+	      ms->g.correspondence * c.correspondence +
+	      ms->g.constraining * c.constraining;
+
+	    /* decide whether to go on at the end of each sweep; with
+	       -stop_acceptance, the budget is the moves nSweeps full
+	       sweeps would make, spent on the tiles still improving */
+	    if (color == 3)
+	      {
+		if (ms->refine)
+		  {
+		    /* refinement stops early once a sweep takes no
+		       step */
+		    accepted = 0;
+		    for (i = 0; i < ms->nThreads; ++i)
+		      accepted += ms->threads[i].acceptedMoveCount;
+		    ms->done = sweep + 1 >= ms->nSweeps ||
+		      accepted == ms->sweepAccepted;
+		    ms->sweepAccepted = accepted;
 		  }
+		else if (ms->tileActive == NULL)
+		  ms->done = sweep + 1 >= ms->nSweeps;
 		else
 		  {
-		    if (MAP(map, mpw, x, y).c >= 0.001)
-		      {
-			++count3;
-			MAP(map, mpw, x, y).c = correlationArray[iyv * iw + ixv];
-			if (MAP(map, mpw, x, y).c == 0.0)
-			  MAP(map, mpw, x, y).c = 0.001;
-		      }
-		    else
+		    moves = 0;
+		    for (i = 0; i < ms->nThreads; ++i)
+		      moves += ms->threads[i].moveCount;
+		    ms->done = moves >= ms->nSweeps *
+		      ((size_t) (ms->rMaxX - ms->rMinX + 1)) *
+		      (ms->rMaxY - ms->rMinY + 1) ||
+		      NextSweepRegions(ms->ntx * ms->nty, ms->tileMoves,
+				       ms->tileAccepted, ms->tileActive,
+				       &ms->sweepEnergy, ms->energy,
+				       &ms->focusing) == 0;
+		  }
+	      }
+	  }
+	pthread_barrier_wait(&ms->barrier);
+      }
+  return(NULL);
+}
+
+/* ComputeGpuMoves makes the random moves of one level with the GPU,
+   for -gpu.  The map is cut into 2x2 tiles colored as in
+   ComputeThreadedMoves, and each batch takes the same point of every
+   active tile of one color; the GPU evaluates what each of these
+   moves would change in the correlation sums and the distortion, and
+   as the moves touch disjoint cells those changes are exact whichever
+   of the others are made.  The moves are then accepted here in order,
+   each against the energy with the ones before it made, as the
+   serial loop would, and the accepted ones are made in the map and
+   on the GPU.  The correspondence term is left to the CPU paths (see
+   Compute()).  It returns 0, with a message in error, if the GPU
+   fails, leaving ms consistent with the moves made so far and
+   mt->sweep at the number of sweeps finished. */
+int
+ComputeGpuMoves (MoveState *ms, MoveThread *mt, char *error)
+{
+  GpuMoveLevel gl;
+  GpuMove *moves;
+  GpuMoveDelta *deltas, *dl;
+  int *moveTile;
+  double *moveRnd, *moveTheta;
+  size_t sweep;
+  int color;
+  int b;
+  int tx, ty;
+  int x, y;
+  int i, k, n;
+  int nAccepted;
+  int ok;
+  int ts;
+  double cx, cy, cc;
+  double rnd, radius, theta;
+  double cth, distance;
+  double newCorrelation, newDistortion, newConstraining;
+  double newEnergy;
+  MapElement *e, *ec;
+
+  memset(mt, 0, sizeof(MoveThread));
+  mt->ms = ms;
+  ts = 2;
+  ms->tileSize = ts;
+  ms->threads = mt;
+  ms->ntx = (ms->mpw + ts - 1) / ts;
+  ms->nty = (ms->mph + ts - 1) / ts;
+  ms->correlation = PaddedCorrelation(ms->g.nPoints, ms->requiredPoints,
+				      ms->g.si, ms->g.si2,
+				      ms->g.sr, ms->g.sr2, ms->g.sir);
+
+  gl.mpw = ms->mpw;
+  gl.mph = ms->mph;
+  gl.mox = ms->mox;
+  gl.moy = ms->moy;
+  gl.factor = ms->factor;
+  gl.map = (float *) ms->map;
+  gl.image = ms->cimage;
+  gl.imageMask = ms->cimask;
+  gl.iw = ms->iw;
+  gl.ih = ms->ih;
+  gl.imbpl = ms->icmbpl;
+  gl.imgox = ms->imgox;
+  gl.imgoy = ms->imgoy;
+  gl.ref = ms->cref;
+  gl.refMask = ms->crmask;
+  gl.rw = ms->rw;
+  gl.rh = ms->rh;
+  gl.rmbpl = ms->rcmbpl;
+  gl.refox = ms->refox;
+  gl.refoy = ms->refoy;
+  gl.nomL0 = ms->nomL0;
+  gl.nomL1 = ms->nomL1;
+  gl.nomL2 = ms->nomL2;
+  gl.nomL3 = ms->nomL3;
+  gl.nomThetaX = ms->nomThetaX;
+  gl.nomThetaY = ms->nomThetaY;
+  if (!GpuMovesLoad(&gl, error))
+    return(0);
+
+  n = ((ms->ntx + 1) / 2) * ((ms->nty + 1) / 2);
+  moves = (GpuMove *) malloc(n * sizeof(GpuMove));
+  deltas = (GpuMoveDelta *) malloc(n * sizeof(GpuMoveDelta));
+  moveTile = (int *) malloc(n * sizeof(int));
+  moveRnd = (double *) malloc(n * sizeof(double));
+  moveTheta = (double *) malloc(n * sizeof(double));
+  if (moves == NULL || deltas == NULL || moveTile == NULL ||
+      moveRnd == NULL || moveTheta == NULL)
+    Error("Could not allocate GPU move batch\n");
+  ms->tileActive = NULL;
+  ms->tileMoves = NULL;
+  ms->tileAccepted = NULL;
+  if (c.stopAcceptance > 0.0)
+    {
+      k = ms->ntx * ms->nty;
+      ms->tileActive = (char *) malloc(k * sizeof(char));
+      ms->tileMoves = (size_t *) malloc(k * sizeof(size_t));
+      ms->tileAccepted = (size_t *) malloc(k * sizeof(size_t));
+      if (ms->tileActive == NULL || ms->tileMoves == NULL ||
+	  ms->tileAccepted == NULL)
+	Error("Could not allocate adaptive stopping arrays\n");
+      memset(ms->tileActive, 1, k * sizeof(char));
+      memset(ms->tileMoves, 0, k * sizeof(size_t));
+      memset(ms->tileAccepted, 0, k * sizeof(size_t));
+    }
+  Log("Level %d: sweeping %zd times on the GPU in batches of up to %d moves\n",
+      ms->level, ms->nSweeps, n);
+
+  METRICS_RANGE_BEGIN("register GPU moves");
+  ok = 1;
+  ms->done = ms->nSweeps == 0;
+  cth = c.constrainingThreshold / ms->lFactor;
+  for (sweep = 0; ok && !ms->done; ++sweep)
+    {
+      mt->sweep = sweep;
+      for (color = 0; ok && color < 4; ++color)
+	for (b = 0; ok && b < ts * ts; ++b)
+	  {
+	    /* propose the moves of the batch */
+	    n = 0;
+	    for (ty = color >> 1; ty < ms->nty; ty += 2)
+	      for (tx = color & 1; tx < ms->ntx; tx += 2)
+		{
+		  k = ty * ms->ntx + tx;
+		  if (ms->tileActive != NULL && !ms->tileActive[k])
+		    continue;
+		  x = tx * ts + b % ts;
+		  y = ty * ts + b / ts;
+		  if (x < ms->rMinX || x > ms->rMaxX ||
+		      y < ms->rMinY || y > ms->rMaxY)
+		    continue;
+		  ++mt->moveCount;
+		  if (ms->tileMoves != NULL)
+		    ++ms->tileMoves[k];
+		  GETMAP(ms->map, ms->mpw, x, y, &cx, &cy, &cc);
+		  if (cc == 0.0)
+		    continue;
+		  MoveRandom(ms->level, (sweep * ms->mph + y) * ms->mpw + x,
+			     &rnd, &theta);
+		  radius = exp(rnd * ms->logRadiusRange + ms->logMinRadius);
+		  theta *= 2.0 * M_PI;
+		  cx += radius * cos(theta);
+		  cy += radius * sin(theta);
+		  if (!GridAllows(ms, x, y, cx, cy))
+		    continue;
+		  moves[n].x = x;
+		  moves[n].y = y;
+		  moves[n].cx = cx;
+		  moves[n].cy = cy;
+		  moveTile[n] = k;
+		  moveRnd[n] = rnd;
+		  moveTheta[n] = theta;
+		  ++n;
+		}
+	    if (n == 0)
+	      continue;
+	    if (!GpuMovesEvaluate(n, moves, deltas, error))
+	      {
+		ok = 0;
+		break;
+	      }
+
+	    /* accept them in turn */
+	    nAccepted = 0;
+	    for (i = 0; i < n; ++i)
+	      {
+		dl = &deltas[i];
+		newCorrelation = PaddedCorrelation(ms->g.nPoints +
+						   (long) dl->points,
+						   ms->requiredPoints,
+						   ms->g.si + dl->si,
+						   ms->g.si2 + dl->si2,
+						   ms->g.sr + dl->sr,
+						   ms->g.sr2 + dl->sr2,
+						   ms->g.sir + dl->sir);
+		if (newCorrelation > 1.1)
+		  Error("Internal error: Level %d map has new correlation energy of %f\n",
+			ms->level, newCorrelation);
+		newDistortion = ms->g.distortion + dl->distortion / ms->dPoints;
+		newConstraining = ms->g.constraining;
+		if (constrainingMapFactor != 0)
+		  {
+		    e = &MAP(ms->map, ms->mpw, moves[i].x, moves[i].y);
+		    ec = &MAP(ms->mapCons, ms->mpw, moves[i].x, moves[i].y);
+		    if (ec->c >= c.constrainingConfidenceThreshold)
 		      {
-			++count4;
-			MAP(map, mpw, x, y).c = 0.0;
+			distance = hypot(moves[i].cx - ec->x,
+					 moves[i].cy - ec->y) - cth;
+			if (distance < 0.0)
+			  distance = 0.0;
+			newConstraining += distance / ms->mph / ms->mpw;
+			distance = hypot(e->x - ec->x, e->y - ec->y) - cth;
+			if (distance < 0.0)
+			  distance = 0.0;
+			newConstraining -= distance / ms->mph / ms->mpw;
 		      }
 		  }
+		newEnergy = newDistortion * c.distortion - newCorrelation +
+		  ms->g.correspondence * c.correspondence +
+		  newConstraining * c.constraining;
+		if (newEnergy >= ms->energy)
+		  continue;
+
+		SETMAP(ms->map, ms->mpw, moves[i].x, moves[i].y,
+		       moves[i].cx, moves[i].cy, 1.0);
+		ms->g.nPoints += (long) dl->points;
+		ms->g.si += dl->si;
+		ms->g.si2 += dl->si2;
+		ms->g.sr += dl->sr;
+		ms->g.sr2 += dl->sr2;
+		ms->g.sir += dl->sir;
+		ms->g.distortion = newDistortion;
+		ms->g.constraining = newConstraining;
+		rnd = moveRnd[i];
+		++mt->statLogRadius[(int) (20.0 * rnd)];
+		++mt->statTheta[(int) (20.0 * moveTheta[i] / (2.0 * M_PI))];
+		mt->statDeltaE[(int) (20.0 * rnd)] += ms->energy - newEnergy;
+		++mt->acceptedMoveCount;
+		if (ms->tileAccepted != NULL)
+		  ++ms->tileAccepted[moveTile[i]];
+		ms->correlation = newCorrelation;
+		ms->energy = newEnergy;
+		moves[nAccepted++] = moves[i];
 	      }
-	  Log("map to be output stats: %d %d %d %d\n", count1, count2, count3, count4);
+	    if (!GpuMovesCommit(nAccepted, moves, error))
+	      ok = 0;
+	  }
+      if (!ok)
+	break;
+
+      /* decide whether to go on, as MoveThreadMain does */
+      if (ms->tileActive == NULL)
+	ms->done = sweep + 1 >= ms->nSweeps;
+      else
+	ms->done = mt->moveCount >= ms->nSweeps *
+	  ((size_t) (ms->rMaxX - ms->rMinX + 1)) *
+	  (ms->rMaxY - ms->rMinY + 1) ||
+	  NextSweepRegions(ms->ntx * ms->nty, ms->tileMoves,
+			   ms->tileAccepted, ms->tileActive,
+			   &ms->sweepEnergy, ms->energy,
+			   &ms->focusing) == 0;
+    }
+  METRICS_RANGE_END();
+
+  free(moves);
+  free(deltas);
+  free(moveTile);
+  free(moveRnd);
+  free(moveTheta);
+  if (ms->tileActive != NULL)
+    {
+      free(ms->tileActive);
+      free(ms->tileMoves);
+      free(ms->tileAccepted);
+    }
+  return(ok);
+}
+
+/* IndexCpts sorts the correspondence points into buckets by the map
+   cell they fall in at the current level, so that a move need only
+   look at the points of the cells around it; points outside the map
+   keep their fixed penalty and are left out */
+void
+IndexCpts (int mpw, int mph, int mox, int moy, double lFactor)
+{
+  int i;
+  int k;
+  int nCells;
+  int ixv, iyv;
+  double xv, yv;
+
+  cptsCellWidth = mpw - 1;
+  nCells = (mpw - 1) * (mph - 1);
+  cptsCellStart = (int *) realloc(cptsCellStart, (nCells + 1) * sizeof(int));
+  cptsCellPoint = (int *) realloc(cptsCellPoint,
+				  (nCpts > 0 ? nCpts : 1) * sizeof(int));
+  if (cptsCellStart == NULL || cptsCellPoint == NULL)
+    Error("Could not allocate correspondence point index\n");
+  memset(cptsCellStart, 0, (nCells + 1) * sizeof(int));
+  for (i = 0; i < nCpts; ++i)
+    {
+      xv = cpts[i].ix / lFactor - mox;
+      yv = cpts[i].iy / lFactor - moy;
+      ixv = ((int) (xv + 2.0)) - 2;
+      iyv = ((int) (yv + 2.0)) - 2;
+      if (ixv < 0 || ixv >= mpw-1 || iyv < 0 || iyv >= mph-1)
+	continue;
+      ++cptsCellStart[iyv * cptsCellWidth + ixv + 1];
+    }
+  for (k = 0; k < nCells; ++k)
+    cptsCellStart[k+1] += cptsCellStart[k];
+  for (i = 0; i < nCpts; ++i)
+    {
+      xv = cpts[i].ix / lFactor - mox;
+      yv = cpts[i].iy / lFactor - moy;
+      ixv = ((int) (xv + 2.0)) - 2;
+      iyv = ((int) (yv + 2.0)) - 2;
+      if (ixv < 0 || ixv >= mpw-1 || iyv < 0 || iyv >= mph-1)
+	continue;
+      cptsCellPoint[cptsCellStart[iyv * cptsCellWidth + ixv]++] = i;
+    }
+  /* the fill above advanced each start to the next cell's */
+  for (k = nCells; k > 0; --k)
+    cptsCellStart[k] = cptsCellStart[k-1];
+  cptsCellStart[0] = 0;
+}
+
+/* SetMoveKey keys the generator of the random moves to a pair, so that
+   the moves made in registering it do not depend on which pairs the
+   worker happened to register before it */
+void
+SetMoveKey (char *name)
+{
+  uint64_t h;
+  char *cp;
+
+  /* FNV-1a */
+  h = 0xcbf29ce484222325ULL;
+  for (cp = name; *cp != '\0'; ++cp)
+    {
+      h ^= (unsigned char) *cp;
+      h *= 0x100000001b3ULL;
+    }
+  moveKey[0] = (uint32_t) h;
+  moveKey[1] = (uint32_t) (h >> 32);
+}
+
+/* MoveRandom returns in u0 and u1 two uniform deviates in [0,1)
+   (with 53 random bits, as from drand48) for move number index of the
+   given level.  It is the Philox4x32-10 counter-based generator of
+   Salmon et al. (SC11), with the pair's key and (index, level) as the
+   counter: the deviates are a pure function of these, so that the
+   moves may be drawn in any order, by any thread, with the same
+   result. */
+void
+MoveRandom (int level, size_t index, double *u0, double *u1)
+{
+  uint32_t x0, x1, x2, x3;
+  uint32_t k0, k1;
+  uint64_t p0, p1;
+  int i;
+
+  x0 = (uint32_t) index;
+  x1 = (uint32_t) (((uint64_t) index) >> 32);
+  x2 = (uint32_t) level;
+  x3 = 0;
+  k0 = moveKey[0];
+  k1 = moveKey[1];
+  for (i = 0; i < 10; ++i)
+    {
+      p0 = (uint64_t) 0xD2511F53 * x0;
+      p1 = (uint64_t) 0xCD9E8D57 * x2;
+      x0 = (uint32_t) (p1 >> 32) ^ x1 ^ k0;
+      x1 = (uint32_t) p1;
+      x2 = (uint32_t) (p0 >> 32) ^ x3 ^ k1;
+      x3 = (uint32_t) p0;
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+  *u0 = ((x0 >> 5) * 67108864.0 + (x1 >> 6)) * (1.0 / 9007199254740992.0);
+  *u1 = ((x2 >> 5) * 67108864.0 + (x3 >> 6)) * (1.0 / 9007199254740992.0);
+}
+
+/* NextSweepRegions is called at the end of each sweep of a level's
+   move loop when -stop_acceptance is given, with the moves tried and
+   accepted during the sweep in each of the n regions (rows or tiles)
+   of the map.  Once a sweep as a whole accepts less than the
+   -stop_acceptance fraction of its moves and lowers the energy by
+   less than the -stop_energy fraction, the level is converging, and
+   from then on the rest of its move budget is spent only on the
+   regions that still accept at least that fraction of their moves,
+   i.e., that are still far from a minimum.  active is updated to
+   the regions to sweep next and their counts are cleared; the
+   return value is the number of active regions, 0 meaning that the
+   level is done. */
+int
+NextSweepRegions (int n, size_t *moves, size_t *accepted, char *active,
+		  double *sweepEnergy, double energy, int *focusing)
+{
+  int i;
+  int nActive;
+  size_t totalMoves, totalAccepted;
+
+  totalMoves = 0;
+  totalAccepted = 0;
+  for (i = 0; i < n; ++i)
+    {
+      totalMoves += moves[i];
+      totalAccepted += accepted[i];
+    }
+  if (!*focusing &&
+      totalAccepted < c.stopAcceptance * totalMoves &&
+      *sweepEnergy - energy < c.stopEnergy * fabs(*sweepEnergy))
+    *focusing = 1;
+
+  nActive = 0;
+  for (i = 0; i < n; ++i)
+    {
+      if (*focusing)
+	active[i] = active[i] && moves[i] > 0 &&
+	  accepted[i] >= c.stopAcceptance * moves[i];
+      if (active[i])
+	++nActive;
+      moves[i] = 0;
+      accepted[i] = 0;
+    }
+  *sweepEnergy = energy;
+  return(nActive);
+}
+
+/* ThreadedMove proposes a single random move of map point (icx,icy)
+   and makes it if it lowers the energy; it mirrors the body of the
+   serial move loop in Compute() */
+void
+ThreadedMove (MoveThread *mt, int icx, int icy)
+{
+  MoveState *ms = mt->ms;
+  double cx, cy, cc;
+  double rnd, radius, theta;
+  double oldEnergy, newEnergy;
+
+  ++mt->moveCount;
+  GETMAP(ms->map, ms->mpw, icx, icy, &cx, &cy, &cc);
+  if (cc == 0.0)
+    return;
+
+  MoveRandom(ms->level, (mt->sweep * ms->mph + icy) * ms->mpw + icx,
+	     &rnd, &theta);
+  radius = exp(rnd * ms->logRadiusRange + ms->logMinRadius);
+  theta *= 2.0 * M_PI;
+  cx += radius * cos(theta);
+  cy += radius * sin(theta);
+
+  oldEnergy = mt->energy;
+  if (!TryMove(mt, icx, icy, cx, cy, 1, &newEnergy))
+    return;
+  ++mt->statLogRadius[(int) (20.0 * rnd)];
+  ++mt->statTheta[(int) (20.0 * theta / (2.0 * M_PI))];
+  mt->statDeltaE[(int) (20.0 * rnd)] += oldEnergy - newEnergy;
+  ++mt->acceptedMoveCount;
+}
+
+/* RefineMove moves map point (icx,icy) down the gradient of the
+   energy.  The gradient and the curvature along each axis come from
+   central differences of the energy, evaluated exactly as for a
+   random move; where both curvatures are positive the step is the
+   diagonal Newton step, and otherwise a short step along the negative
+   gradient.  Steps are limited to the largest random move and halved
+   until one lowers the energy; if none does, the best of the
+   difference points is taken if it lowers the energy.  Every
+   evaluation counts as a move, and every step taken as an accepted
+   one. */
+void
+RefineMove (MoveThread *mt, int icx, int icy)
+{
+  MoveState *ms = mt->ms;
+  double cx, cy, cc;
+  double h;
+  double e0;
+  double e[4];
+  double gx, gy, hxx, hyy;
+  double sx, sy, len, maxLen;
+  double bestEnergy;
+  int best;
+  int i;
+
+  GETMAP(ms->map, ms->mpw, icx, icy, &cx, &cy, &cc);
+  if (cc == 0.0)
+    return;
+
+  h = ms->refineStep;
+  e0 = mt->energy;
+  TryMove(mt, icx, icy, cx + h, cy, 0, &e[0]);
+  TryMove(mt, icx, icy, cx - h, cy, 0, &e[1]);
+  TryMove(mt, icx, icy, cx, cy + h, 0, &e[2]);
+  TryMove(mt, icx, icy, cx, cy - h, 0, &e[3]);
+  mt->moveCount += 4;
+
+  /* a point the grid check rejects on one side is differenced on the
+     other */
+  if (e[0] == HUGE_VAL && e[1] == HUGE_VAL)
+    gx = hxx = 0.0;
+  else if (e[0] == HUGE_VAL)
+    {
+      gx = (e0 - e[1]) / h;
+      hxx = 0.0;
+    }
+  else if (e[1] == HUGE_VAL)
+    {
+      gx = (e[0] - e0) / h;
+      hxx = 0.0;
+    }
+  else
+    {
+      gx = (e[0] - e[1]) / (2.0 * h);
+      hxx = (e[0] - 2.0 * e0 + e[1]) / (h * h);
+    }
+  if (e[2] == HUGE_VAL && e[3] == HUGE_VAL)
+    gy = hyy = 0.0;
+  else if (e[2] == HUGE_VAL)
+    {
+      gy = (e0 - e[3]) / h;
+      hyy = 0.0;
+    }
+  else if (e[3] == HUGE_VAL)
+    {
+      gy = (e[2] - e0) / h;
+      hyy = 0.0;
+    }
+  else
+    {
+      gy = (e[2] - e[3]) / (2.0 * h);
+      hyy = (e[2] - 2.0 * e0 + e[3]) / (h * h);
+    }
+
+  if (gx != 0.0 || gy != 0.0)
+    {
+      if (hxx > 0.0 && hyy > 0.0)
+	{
+	  sx = -gx / hxx;
+	  sy = -gy / hyy;
+	}
+      else
+	{
+	  len = hypot(gx, gy);
+	  sx = -4.0 * h * gx / len;
+	  sy = -4.0 * h * gy / len;
+	}
+      maxLen = exp(ms->logMinRadius + ms->logRadiusRange);
+      len = hypot(sx, sy);
+      if (len > maxLen)
+	{
+	  sx *= maxLen / len;
+	  sy *= maxLen / len;
+	}
+      for (i = 0; i < 4; ++i)
+	{
+	  ++mt->moveCount;
+	  if (TryMove(mt, icx, icy, cx + sx, cy + sy, 1, &bestEnergy))
+	    {
+	      ++mt->acceptedMoveCount;
+	      return;
+	    }
+	  sx *= 0.5;
+	  sy *= 0.5;
+	}
+    }
+
+  best = -1;
+  bestEnergy = e0;
+  for (i = 0; i < 4; ++i)
+    if (e[i] < bestEnergy)
+      {
+	best = i;
+	bestEnergy = e[i];
+      }
+  if (best < 0)
+    return;
+  ++mt->moveCount;
+  if (TryMove(mt, icx, icy,
+	      cx + (best == 0 ? h : (best == 1 ? -h : 0.0)),
+	      cy + (best == 2 ? h : (best == 3 ? -h : 0.0)),
+	      1, &bestEnergy))
+    ++mt->acceptedMoveCount;
+}
+
+/* TryMove evaluates the energy the map would have with point
+   (icx,icy) moved to (cx,cy), returning it in *energy (HUGE_VAL if
+   the move would distort the grid too much).  If commit is set and
+   the energy is lower than the thread's, the move is made and 1
+   returned. */
+int
+TryMove (MoveThread *mt, int icx, int icy, double cx, double cy,
+	 int commit, double *energy)
+{
+  MoveState *ms = mt->ms;
+  MapElement *map = ms->map;
+  MapElement *prop = ms->prop;
+  MapElement *mp;
+  MapElement *e, *ec, *ep;
+  int mpw = ms->mpw;
+  int mph = ms->mph;
+  int mpw_minus_1 = mpw - 1;
+  int mph_minus_1 = mph - 1;
+  int factor = ms->factor;
+  int mox = ms->mox;
+  int moy = ms->moy;
+  int sx, sy, ex, ey;
+  int x, y;
+  int i;
+  double xv, yv;
+  int ixv, iyv;
+  double rrx, rry;
+  double rx, ry;
+  int irx, iry;
+  double rx00, rx01, rx10, rx11, ry00, ry01, ry10, ry11;
+  double rc00, rc01, rc10, rc11;
+  double r00, r01, r10, r11;
+  double iv, rv;
+  double dsi, dsi2, dsr, dsr2, dsir;
+  double dsg;
+  long cPoints;
+  MoveSums cur;
+  double newCorrelation, newDistortion, newCorrespondence, newConstraining;
+  double newEnergy;
+  double de, ce;
+  int upd0, upd1, upd2, upd3;
+  double x0, x1, x2, x3, y0, y1, y2, y3, c0, c1, c2, c3;
+  double nx0, nx1, nx2, nx3, ny0, ny1, ny2, ny3, nc0, nc1, nc2, nc3;
+  double l0, l1, l2, l3, nl0, nl1, nl2, nl3;
+  double thetaX, thetaY, nThetaX, nThetaY;
+  double txd, tyd, ntxd, ntyd;
+  double ode, nde;
+  double distance, oldEnergy;
+  double cth;
+  size_t k;
+  unsigned char *trmask = ms->trmask;
+  unsigned char *trmask2 = ms->trmask2;
+#if TILED_REFERENCE
+  int rtw = ms->rtw;
+#endif
+  size_t rcmbpl = ms->rcmbpl;
+  unsigned int rw = ms->rw, rh = ms->rh;
+  int cMinX, cMaxX, cMinY, cMaxY;
+  int bx, by;
+  int ci;
+
+  *energy = HUGE_VAL;
+  if (!GridAllows(ms, icx, icy, cx, cy))
+    return(0);
+
+  SETMAP(prop, mpw, icx, icy, cx, cy, 1.0);
+
+  /* the state as seen by this thread */
+  cur = ms->g;
+  cur.nPoints += mt->d.nPoints;
+  cur.si += mt->d.si;
+  cur.si2 += mt->d.si2;
+  cur.sr += mt->d.sr;
+  cur.sr2 += mt->d.sr2;
+  cur.sir += mt->d.sir;
+  cur.sg += mt->d.sg;
+  cur.distortion += mt->d.distortion;
+  cur.correspondence += mt->d.correspondence;
+  cur.constraining += mt->d.constraining;
+
+  /* contribution from correlation */
+  dsir = 0.0;
+  dsr2 = 0.0;
+  dsr = 0.0;
+  dsi = 0.0;
+  dsi2 = 0.0;
+  dsg = 0.0;
+  cPoints = 0;
+  if (c.metric == MI_METRIC)
+    ClearHistogramDelta(&mt->hdelta);
+  sx = (icx - 1 + mox) * factor - ms->imgox;
+  if (sx < 0)
+    sx = 0;
+  ex = (icx + 1 + mox) * factor - 1 - ms->imgox;
+  if (ex >= ms->iw)
+    ex = ms->iw - 1;
+  sy = (icy - 1 + moy) * factor - ms->imgoy;
+  if (sy < 0)
+    sy = 0;
+  ey = (icy + 1 + moy) * factor - 1 - ms->imgoy;
+  if (ey >= ms->ih)
+    ey = ms->ih - 1;
+  for (y = sy; y <= ey; ++y)
+    for (x = sx; x <= ex; ++x)
+      {
+#if MASKING
+	if ((ms->cimask[y*ms->icmbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
+	  continue;
+#endif
+	xv = (x + 0.5 + ms->imgox) / factor - mox;
+	yv = (y + 0.5 + ms->imgoy) / factor - moy;
+	ixv = ((int) (xv + 2.0)) - 2;
+	iyv = ((int) (yv + 2.0)) - 2;
+	rrx = xv - ixv;
+	rry = yv - iyv;
+	if (ixv < 0 || ixv >= mpw_minus_1 ||
+	    iyv < 0 || iyv >= mph_minus_1)
+	  continue;
+	if (MAP(prop, mpw, ixv, iyv).c == 0.0 &&
+	    MAP(prop, mpw, ixv+1, iyv).c == 0.0 &&
+	    MAP(prop, mpw, ixv, iyv+1).c == 0.0 &&
+	    MAP(prop, mpw, ixv+1, iyv+1).c == 0.0)
+	  continue;
+
+	/* remove the old contribution */
+	iv = IMAGE(ms->cimage, ms->iw, x, y);
+	GETMAP(map, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+	GETMAP(map, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+	GETMAP(map, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+	GETMAP(map, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+	if (rc00 != 0.0 && rc01 != 0.0 && rc10 != 0.0 && rc11 != 0.0)
+	  {
+	    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	      - rx10 * rrx * (rry - 1.0) 
+	      - rx01 * (rrx - 1.0) * rry
+	      + rx11 * rrx * rry;
+	    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	      - ry10 * rrx * (rry - 1.0) 
+	      - ry01 * (rrx - 1.0) * rry
+	      + ry11 * rrx * rry;
+	    rx = factor * rx - 0.5 - ms->refox;
+	    ry = factor * ry - 0.5 - ms->refoy;
+	    irx = ((int) (rx + 1.0)) - 1;
+	    iry = ((int) (ry + 1.0)) - 1;
+	    rrx = rx - irx;
+	    rry = ry - iry;
+	    if (irx >= 0 && irx < rw-1 && iry >= 0 && iry < rh-1
+#if MASKING
+		&& !SAMPLE_MASKED(trmask, trmask2, rtw, rcmbpl, irx, iry, rrx, rry)
 #endif
+		)
+	      {
+		r00 = REF(ms->tref, rtw, rw, irx, iry);
+		r01 = REF(ms->tref, rtw, rw, irx, iry + 1);
+		r10 = REF(ms->tref, rtw, rw, irx + 1, iry);
+		r11 = REF(ms->tref, rtw, rw, irx + 1, iry + 1);
+		rv = r00 * (rrx - 1.0) * (rry - 1.0)
+		  - r10 * rrx * (rry - 1.0) 
+		  - r01 * (rrx - 1.0) * rry
+		  + r11 * rrx * rry;
+		dsi -= iv;
+		dsi2 -= iv * iv;
+		dsir -= iv * rv;
+		dsr2 -= rv * rv;
+		dsr -= rv;
+		cPoints -= 1;
+		if (c.metric == NGF_METRIC)
+		  dsg -= NgfTerm(ms->ingf, ms->rngf, ms->iw, rw,
+				 x, y, irx, iry, rrx, rry);
+		else if (c.metric == MI_METRIC)
+		  TallyHistogram(&mt->hdelta, iv, rv, -1);
+	      }
+	  }
 
-	  if (level == c.outputLevel)
-	    TrimOutputMap(map, mpw, mph, mox, moy,
-			  factor,
-			  iw, ih, imgox, imgoy,
-			  rw, rh, refox, refoy,
-			  cimask,
-			  crmask);
-
-	  WriteOutputMap(outputName, level, map, mpw, mph, mox, moy);
-	  if (outputWarpedName[0] != '\0')
-	    WriteOutputImage(outputWarpedName, c.outputLevel, warpedArray,
-			     iw, ih, 1.0);
-	  if (outputCorrelationName[0] != '\0')
-	    WriteOutputImage(outputCorrelationName, c.outputLevel, correlationArray,
-			     iw, ih, 256.0);
-	  
-#if 1
-	  free(warpedArray);
-	  free(validArray);
-	  free(correlationArray);
+	/* add in the new contribution */
+	mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+	mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+	mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+	mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+	if (rc00 == 0.0 || rc01 == 0.0 || rc10 == 0.0 || rc11 == 0.0)
+	  continue;
+	rrx = xv - ixv;
+	rry = yv - iyv;
+	rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	  - rx10 * rrx * (rry - 1.0) 
+	  - rx01 * (rrx - 1.0) * rry
+	  + rx11 * rrx * rry;
+	ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	  - ry10 * rrx * (rry - 1.0) 
+	  - ry01 * (rrx - 1.0) * rry
+	  + ry11 * rrx * rry;
+	rx = factor * rx - 0.5 - ms->refox;
+	ry = factor * ry - 0.5 - ms->refoy;
+	irx = ((int) (rx + 1.0)) - 1;
+	iry = ((int) (ry + 1.0)) - 1;
+	if (irx < 0 || irx >= rw-1 || iry < 0 || iry >= rh-1)
+	  continue;
+	rrx = rx - irx;
+	rry = ry - iry;
+#if MASKING
+	if (SAMPLE_MASKED(trmask, trmask2, rtw, rcmbpl, irx, iry, rrx, rry))
+	  continue;
 #endif
+	r00 = REF(ms->tref, rtw, rw, irx, iry);
+	r01 = REF(ms->tref, rtw, rw, irx, iry + 1);
+	r10 = REF(ms->tref, rtw, rw, irx + 1, iry);
+	r11 = REF(ms->tref, rtw, rw, irx + 1, iry + 1);
+	rv = r00 * (rrx - 1.0) * (rry - 1.0)
+	  - r10 * rrx * (rry - 1.0) 
+	  - r01 * (rrx - 1.0) * rry
+	  + r11 * rrx * rry;
+	dsi += iv;
+	dsi2 += iv * iv;
+	dsir += iv * rv;
+	dsr2 += rv * rv;
+	dsr += rv;
+	cPoints += 1;
+	if (c.metric == NGF_METRIC)
+	  dsg += NgfTerm(ms->ingf, ms->rngf, ms->iw, rw,
+			 x, y, irx, iry, rrx, rry);
+	else if (c.metric == MI_METRIC)
+	  TallyHistogram(&mt->hdelta, iv, rv, 1);
+      }
+  if (c.metric == NGF_METRIC)
+    newCorrelation = NgfSimilarity(cur.nPoints + cPoints, ms->requiredPoints,
+				   cur.sg + dsg);
+  else if (c.metric == MI_METRIC)
+    newCorrelation = HistogramSimilarity(&mt->hist, &mt->hdelta,
+					 ms->requiredPoints);
+  else
+    newCorrelation = PaddedCorrelation(cur.nPoints + cPoints,
+				       ms->requiredPoints,
+				       cur.si + dsi, cur.si2 + dsi2,
+				       cur.sr + dsr, cur.sr2 + dsr2,
+				       cur.sir + dsir);
+  if (newCorrelation > 1.1)
+    Error("Internal error: Level %d map has new correlation energy of %f\n",
+	  ms->level, newCorrelation);
+
+  /* contribution from distortion */
+  de = 0.0;
+  for (y = icy - 1; y <= icy; ++y)
+    {
+      if (y < 0 || y >= mph_minus_1)
+	continue;
+      for (x = icx - 1; x <= icx; ++x)
+	{
+	  if (x < 0 || x >= mpw_minus_1)
+	    continue;
+	  upd0 = MAP(prop, mpw, x, y).c != 0.0;
+	  upd1 = MAP(prop, mpw, x, y+1).c != 0.0;
+	  upd2 = MAP(prop, mpw, x+1, y+1).c != 0.0;
+	  upd3 = MAP(prop, mpw, x+1, y).c != 0.0;
+	  if (!upd0 && !upd1 && !upd2 && !upd3)
+	    continue;
+	  GETMAP(map, mpw, x, y, &x0, &y0, &c0);
+	  GETMAP(map, mpw, x, y+1, &x1, &y1, &c1);
+	  GETMAP(map, mpw, x+1, y+1, &x2, &y2, &c2);
+	  GETMAP(map, mpw, x+1, y, &x3, &y3, &c3);
+	  if (c0 == 0.0 || c1 == 0.0 || c2 == 0.0 || c3 == 0.0)
+	    continue;
+	  nx0 = x0; ny0 = y0; nc0 = c0;
+	  nx1 = x1; ny1 = y1; nc1 = c1;
+	  nx2 = x2; ny2 = y2; nc2 = c2;
+	  nx3 = x3; ny3 = y3; nc3 = c3;
+	  if (upd0)
+	    GETMAP(prop, mpw, x, y, &nx0, &ny0, &nc0);
+	  if (upd1)
+	    GETMAP(prop, mpw, x, y+1, &nx1, &ny1, &nc1);
+	  if (upd2)
+	    GETMAP(prop, mpw, x+1, y+1, &nx2, &ny2, &nc2);
+	  if (upd3)
+	    GETMAP(prop, mpw, x+1, y, &nx3, &ny3, &nc3);
+
+	  k = y * mpw_minus_1 + x;
+	  l0 = sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+	  l1 = sqrt((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
+	  l2 = sqrt((x3 - x2) * (x3 - x2) + (y3 - y2) * (y3 - y2));
+	  l3 = sqrt((x0 - x3) * (x0 - x3) + (y0 - y3) * (y0 - y3));
+	  thetaX = atan2(y3 - y0, x3 - x0);
+	  thetaY = atan2(y1 - y0, x1 - x0);
+	  txd = fabs(fmod(ms->nomThetaX[k] - thetaX + 3.0*M_PI,
+			  2.0*M_PI) - M_PI);
+	  tyd = fabs(fmod(ms->nomThetaY[k] - thetaY + 3.0*M_PI,
+			  2.0*M_PI) - M_PI);
+	  nl0 = sqrt((nx1 - nx0) * (nx1 - nx0) + (ny1 - ny0) * (ny1 - ny0));
+	  nl1 = sqrt((nx2 - nx1) * (nx2 - nx1) + (ny2 - ny1) * (ny2 - ny1));
+	  nl2 = sqrt((nx3 - nx2) * (nx3 - nx2) + (ny3 - ny2) * (ny3 - ny2));
+	  nl3 = sqrt((nx0 - nx3) * (nx0 - nx3) + (ny0 - ny3) * (ny0 - ny3));
+	  nThetaX = atan2(ny3 - ny0, nx3 - nx0);
+	  nThetaY = atan2(ny1 - ny0, nx1 - nx0);
+	  ntxd = fabs(fmod(ms->nomThetaX[k] - nThetaX + 3.0*M_PI,
+			   2.0*M_PI) - M_PI);
+	  ntyd = fabs(fmod(ms->nomThetaY[k] - nThetaY + 3.0*M_PI,
+			   2.0*M_PI) - M_PI);
+	  ode = txd * txd + tyd * tyd +
+	    (l0 - ms->nomL0[k]) * (l0 - ms->nomL0[k]) +
+	    (l1 - ms->nomL1[k]) * (l1 - ms->nomL1[k]) +
+	    (l2 - ms->nomL2[k]) * (l2 - ms->nomL2[k]) +
+	    (l3 - ms->nomL3[k]) * (l3 - ms->nomL3[k]);
+	  nde = ntxd * ntxd + ntyd * ntyd +
+	    (nl0 - ms->nomL0[k]) * (nl0 - ms->nomL0[k]) +
+	    (nl1 - ms->nomL1[k]) * (nl1 - ms->nomL1[k]) +
+	    (nl2 - ms->nomL2[k]) * (nl2 - ms->nomL2[k]) +
+	    (nl3 - ms->nomL3[k]) * (nl3 - ms->nomL3[k]);
+	  de += nde - ode;
+	}
+    }
+  newDistortion = cur.distortion + de / ms->dPoints;
+
+  /* contribution from correspondence points; only the points
+     within the cells adjacent to (icx,icy) can change, and those
+     belong to this thread for the duration of the phase */
+  ce = 0.0;
+  cMinX = icx > 0 ? icx - 1 : 0;
+  cMaxX = icx < mpw_minus_1 ? icx : mpw_minus_1 - 1;
+  cMinY = icy > 0 ? icy - 1 : 0;
+  cMaxY = icy < mph_minus_1 ? icy : mph_minus_1 - 1;
+  for (by = cMinY; by <= cMaxY && nCpts > 0; ++by)
+    for (bx = cMinX; bx <= cMaxX; ++bx)
+      for (ci = cptsCellStart[by * cptsCellWidth + bx];
+	   ci < cptsCellStart[by * cptsCellWidth + bx + 1]; ++ci)
+	{
+	  i = cptsCellPoint[ci];
+	  xv = cpts[i].ix / ms->lFactor - mox;
+	  yv = cpts[i].iy / ms->lFactor - moy;
+	  ixv = bx;
+	  iyv = by;
+	  rrx = xv - ixv;
+	  rry = yv - iyv;
+	  mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+	  mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+	  mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+	  mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+	  rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	    - rx10 * rrx * (rry - 1.0) 
+	    - rx01 * (rrx - 1.0) * rry
+	    + rx11 * rrx * rry;
+	  ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	    - ry10 * rrx * (rry - 1.0) 
+	    - ry01 * (rrx - 1.0) * rry
+	    + ry11 * rrx * rry;
+	  rx = ms->lFactor * rx;
+	  ry = ms->lFactor * ry;
+	  distance = ms->kFactor * (hypot(cpts[i].rx - rx, cpts[i].ry - ry) -
+				    c.correspondenceThreshold);
+	  if (distance < 0.0)
+	    cpts[i].newEnergy = 0.0;
+	  else
+	    cpts[i].newEnergy = distance;
+	  ce += cpts[i].newEnergy - cpts[i].energy;
+	}
+  newCorrespondence = cur.correspondence + ce;
+
+  /* contribution from constraining map */
+  de = 0.0;
+  if (constrainingMapFactor != 0)
+    {
+      cth = c.constrainingThreshold / ms->lFactor;
+      e = &MAP(map, mpw, icx, icy);
+      ec = &MAP(ms->mapCons, mpw, icx, icy);
+      ep = &MAP(prop, mpw, icx, icy);
+      if (e->c != 0.0 && ec->c >= c.constrainingConfidenceThreshold)
+	{
+	  distance = hypot(e->x - ec->x, e->y - ec->y) - cth;
+	  if (distance < 0.0)
+	    distance = 0.0;
+	  oldEnergy = distance;
+	  distance = hypot(ep->x - ec->x, ep->y - ec->y) - cth;
+	  if (distance < 0.0)
+	    distance = 0.0;
+	  de = distance - oldEnergy;
 	}
     }
+  newConstraining = cur.constraining + de / mph / mpw;
 
- writeScore:  
-  // write out the score for this mapping
-  sprintf(fn, "%s.score", outputName);
-  f = fopen(fn, "w");
-  fprintf(f, "%f %f %f %f %f\n",
-	  correlation
-	  - c.distortion * distortion
-	  - c.correspondence * correspondence
-	  - c.constraining * constraining,
-	  correlation, distortion, correspondence, constraining);
-  fclose(f);
+  newEnergy = newDistortion * c.distortion - newCorrelation +
+    newCorrespondence * c.correspondence + newConstraining * c.constraining;
 
-  r.correlation = correlation;
-  r.distortion = distortion;
-  r.correspondence = correspondence;
-  r.constraining = constraining;
+  /* accept or reject move */
+  MAP(prop, mpw, icx, icy).c = 0;
+  *energy = newEnergy;
+  if (!commit || newEnergy >= mt->energy)
+    return(0);
+
+  GETMAP(prop, mpw, icx, icy, &rx00, &ry00, &rc00);
+  SETMAP(map, mpw, icx, icy, rx00, ry00, 1.0);
+  for (by = cMinY; by <= cMaxY && nCpts > 0; ++by)
+    for (bx = cMinX; bx <= cMaxX; ++bx)
+      for (ci = cptsCellStart[by * cptsCellWidth + bx];
+	   ci < cptsCellStart[by * cptsCellWidth + bx + 1]; ++ci)
+	cpts[cptsCellPoint[ci]].energy = cpts[cptsCellPoint[ci]].newEnergy;
+
+  mt->d.nPoints += cPoints;
+  mt->d.si += dsi;
+  mt->d.si2 += dsi2;
+  mt->d.sr += dsr;
+  mt->d.sr2 += dsr2;
+  mt->d.sir += dsir;
+  mt->d.sg += dsg;
+  if (c.metric == MI_METRIC)
+    ApplyHistogramDelta(&mt->hist, &mt->hdelta);
+  mt->d.distortion = newDistortion - ms->g.distortion;
+  mt->d.correspondence = newCorrespondence - ms->g.correspondence;
+  mt->d.constraining = newConstraining - ms->g.constraining;
+  mt->correlation = newCorrelation;
+  mt->energy = newEnergy;
+  return(1);
+}
+
+/* GridAllows checks that moving map point (icx,icy) to (cx,cy) will
+   not distort the grid too much */
+int
+GridAllows (MoveState *ms, int icx, int icy, double cx, double cy)
+{
+  MapElement *e;
+  int nx, ny;
+  double dx, dy, d2;
+
+  for (ny = icy - 1; ny <= icy + 1; ++ny)
+    for (nx = icx - 1; nx <= icx + 1; ++nx)
+      {
+	if (nx < 0 || nx >= ms->mpw || ny < 0 || ny >= ms->mph ||
+	    (nx == icx && ny == icy))
+	  continue;
+	e = &MAP(ms->map, ms->mpw, nx, ny);
+	if (e->c == 0.0)
+	  continue;
+	dx = e->x - cx;
+	dy = e->y - cy;
+	d2 = dx*dx + dy*dy;
+	if (d2 < ((nx != icx && ny != icy) ? ms->diagLimit : ms->udLimit))
+	  return(0);
+      }
+  return(1);
+}
+
+/* PaddedCorrelation computes the correlation of the image and
+   reference samples summarized by the given sums; if fewer than
+   requiredPoints samples are present, the missing ones are treated
+   as saturated (255.0) reference pixels, as in Compute() */
+double
+PaddedCorrelation (long nPoints, size_t requiredPoints,
+		   double si, double si2, double sr, double sr2, double sir)
+{
+  size_t effectivePoints;
+  double mi, mr;
+  double denom;
+
+  if (nPoints < (long) requiredPoints)
+    {
+      sr += (requiredPoints - nPoints) * 255.0;
+      sr2 += (requiredPoints - nPoints) * 255.0 * 255.0;
+      effectivePoints = requiredPoints;
+    }
+  else
+    effectivePoints = nPoints;
+  if (effectivePoints == 0)
+    return(-1000000.0);
+  mi = si / effectivePoints;
+  mr = sr / effectivePoints;
+  denom = (si2 - 2.0 * mi * si + effectivePoints * mi * mi) *
+    (sr2 - 2.0 * mr * sr + effectivePoints * mr * mr);
+  if (denom < 0.001)
+    return(-1000000.0);
+  return((sir - mi * sr - mr * si + effectivePoints * mi * mr) / sqrt(denom));
 }
 
 
+/* TrimOutputMap invalidates the map points for which no adjoining
+   quadrilateral covers enough valid pixels in the image and the
+   reference; after the previously trimmed points are taken out, the
+   rows of quadrilaterals, and then the rows of points, are divided
+   into bands, each handled by its own thread */
 void
 TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 	       int factor,
@@ -4431,20 +9492,12 @@ TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 	       unsigned char *crmask)
 {
   int x, y;
-  int ixv, iyv;
-  int ix, iy;
-  float total;
-  int nInside;
   unsigned char *validArray;
-  size_t icmbpl, rcmbpl;
-  float rx00, rx01, rx10, rx11;
-  float ry00, ry01, ry10, ry11;
-  float rc00, rc01, rc10, rc11;
-  float x00, y00, x01, y01, x11, y11, x10, y10;
-  float ix00, iy00, ix01, iy01, ix11, iy11, ix10, iy10;
-  int minX, maxX, minY, maxY;
-  float xv, yv;
-  int inside0, inside1, inside2, inside3;
+  TrimBand *bands;
+  int nBands;
+  int b;
+  int pass;
+  int rows;
 
   // the validArray contains a 1 for every valid map quadrilateral;
   //  note the the mph-1 row and mpw-1 column are unused, but
@@ -4452,8 +9505,7 @@ TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
   validArray = (unsigned char *) malloc(mpw * mph * sizeof(unsigned char));
   memset(validArray, 0x00, mpw * mph * sizeof(unsigned char));
   for (y = 0; y < mph-1; ++y)
-    for (x = 0; x < mpw-1; ++x)
-      MAP(validArray, mpw, x, y) = 1;
+    memset(&MAP(validArray, mpw, 0, y), 1, mpw-1);
 
   // first trim out map quadrilaterals that have previously been trimmed
   for (y = 0; y < mph; ++y)
@@ -4469,42 +9521,162 @@ TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 	    MAP(validArray, mpw, x-1, y-1) = 0;
 	}
 
-  // then trim map quadrilaterals that don't contain sufficient valid pixels in
-  //   the source image
+  nBands = c.nThreads;
+  if (nBands > mph / 4)
+    nBands = mph / 4;
+  if (nBands < 1)
+    nBands = 1;
+  bands = (TrimBand *) malloc(nBands * sizeof(TrimBand));
+  if (bands == NULL)
+    Error("Could not allocate trimming bands\n");
+  for (pass = 0; pass < 2; ++pass)
+    {
+      rows = pass == 0 ? mph-1 : mph;
+      for (b = 0; b < nBands; ++b)
+	{
+	  bands[b].pass = pass;
+	  bands[b].y0 = (int) (((long long) rows) * b / nBands);
+	  bands[b].y1 = (int) (((long long) rows) * (b + 1) / nBands);
+	  bands[b].map = map;
+	  bands[b].validArray = validArray;
+	  bands[b].mpw = mpw;
+	  bands[b].mph = mph;
+	  bands[b].mox = mox;
+	  bands[b].moy = moy;
+	  bands[b].factor = factor;
+	  bands[b].iw = iw;
+	  bands[b].ih = ih;
+	  bands[b].imgox = imgox;
+	  bands[b].imgoy = imgoy;
+	  bands[b].rw = rw;
+	  bands[b].rh = rh;
+	  bands[b].refox = refox;
+	  bands[b].refoy = refoy;
+	  bands[b].cimask = cimask;
+	  bands[b].crmask = crmask;
+	}
+      for (b = 1; b < nBands; ++b)
+	{
+	  bands[b].started = pthread_create(&bands[b].thread, NULL,
+					    TrimThreadMain, &bands[b]) == 0;
+	  if (!bands[b].started)
+	    TrimThreadMain(&bands[b]);
+	}
+      TrimThreadMain(&bands[0]);
+      for (b = 1; b < nBands; ++b)
+	if (bands[b].started)
+	  pthread_join(bands[b].thread, NULL);
+
+#if 0
+      if (pass == 0)
+	{
+	  char out[4096];
+
+	  Log("VALID ARRAY:\n");
+	  for (y = 0; y < mph; ++y)
+	    {
+	      memset(out, 0, 4096);
+	      for (x = 0; x < mpw; ++x)
+		sprintf(&out[2*x], "%d ", MAP(validArray, mpw, x, y));
+	      Log("    %s\n", out);
+	    }
+	}
+#endif
+    }
+  free(bands);
+
+#if 0
+  {
+    char out[4096];
+    int len;
+
+    Log("CONF ARRAY:\n");
+    for (y = 0; y < mph; ++y)
+      {
+	memset(out, 0, 4096);
+	len = 0;
+	for (x = 0; x < mpw; ++x)
+	  len += sprintf(&out[len], "%f ", MAP(map, mpw, x, y).c);
+	Log("    %s\n", out);
+      }
+  }
+#endif
+
+  free(validArray);
+}
+
+void *
+TrimThreadMain (void *arg)
+{
+  TrimBand *tb = (TrimBand *) arg;
+  MapElement *map = tb->map;
+  unsigned char *validArray = tb->validArray;
+  int mpw = tb->mpw, mph = tb->mph;
+  int factor = tb->factor;
+  unsigned int iw = tb->iw, ih = tb->ih;
+  unsigned int rw = tb->rw, rh = tb->rh;
+  int refox = tb->refox, refoy = tb->refoy;
+  int x, y;
+  int ixv, iyv;
+  int ix, iy;
+  int ix0, ix1;
+  float total;
+  int nInside;
+  size_t icmbpl, rcmbpl;
+  float rx00, rx01, rx10, rx11;
+  float ry00, ry01, ry10, ry11;
+  float rc00, rc01, rc10, rc11;
+  float x00, y00, x01, y01, x11, y11, x10, y10;
+  float ix00, iy00, ix01, iy01, ix11, iy11, ix10, iy10;
+  int minX, maxX, minY, maxY;
+  float xv, yv;
+  int inside0, inside1, inside2, inside3;
+
+  // mark map nodes as invalid if no quadrilateral containing them is valid
+  if (tb->pass == 1)
+    {
+      for (y = tb->y0; y < tb->y1; ++y)
+	for (x = 0; x < mpw; ++x)
+	  if (!(x < mpw-1 && y < mph-1 && MAP(validArray, mpw, x, y) ||
+		x > 0 && y < mph-1 && MAP(validArray, mpw, x-1, y) ||
+		x < mpw-1 && y > 0 && MAP(validArray, mpw, x, y-1) ||
+		x > 0 && y > 0 && MAP(validArray, mpw, x-1, y-1)))
+	    MAP(map, mpw, x, y).c = 0.0;
+      return(NULL);
+    }
+
   icmbpl = (iw + 7) >> 3;
-  for (y = 0; y < mph-1; ++y)
+  rcmbpl = (rw + 7) >> 3;
+  total = 0.0;
+  nInside = 0;
+  for (y = tb->y0; y < tb->y1; ++y)
     {
-      iyv = factor * (y + moy) - imgoy;
+      // trim map quadrilaterals that don't contain sufficient valid
+      //   pixels in the source image, counting the pixels of each
+      //   row of the quadrilateral's block a byte of the mask at a time
+      iyv = factor * (y + tb->moy) - tb->imgoy;
       for (x = 0; x < mpw-1; ++x)
 	{
 	  if (MAP(validArray, mpw, x, y) == 0)
 	    continue;
 	  total = 0.0;
-	  ixv = factor * (x + mox) - imgox;
+	  ixv = factor * (x + tb->mox) - tb->imgox;
+	  ix0 = ixv < 0 ? 0 : ixv;
+	  ix1 = ixv + factor > (int) iw ? (int) iw : ixv + factor;
 	  for (iy = iyv; iy < iyv+factor; ++iy)
 	    {
-	      if (iy < 0 || iy >= ih)
+	      if (iy < 0 || iy >= ih || ix1 <= ix0)
 		continue;
-	      for (ix = ixv; ix < ixv+factor; ++ix)
-		{
-		  if (ix < 0 || ix >= iw)
-		    continue;
 #if MASKING
-		  if ((cimask[iy*icmbpl + (ix >> 3)] & (0x80 >> (ix & 7))) == 0)
-		    continue;
+	      total += CountMaskRun(&tb->cimask[iy*icmbpl], ix0, ix1);
+#else
+	      total += ix1 - ix0;
 #endif
-		  total += 1.0;
-		}
 	    }
 	  if (100.0 * total / (factor*factor) <= c.trimMapSourceThreshold)
 	    MAP(validArray, mpw, x, y) = 0;
 	}
-    }
 
-  rcmbpl = (rw + 7) >> 3;
-  for (y = 0; y < mph-1; ++y)
-    {
-      iyv = factor * (y + moy) - imgoy;
       for (x = 0; x < mpw-1; ++x)
 	{
 	  if (MAP(validArray, mpw, x, y) == 0)
@@ -4531,14 +9703,6 @@ TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 	  iy11 = (int) floor(y11 - refoy);
 	  ix10 = (int) floor(x10 - refox);
 	  iy10 = (int) floor(y10 - refoy);
-	  ix00 = (int) floor(x00 - refox);
-	  iy00 = (int) floor(y00 - refoy);
-	  ix01 = (int) floor(x01 - refox);
-	  iy01 = (int) floor(y01 - refoy);
-	  ix11 = (int) floor(x11 - refox);
-	  iy11 = (int) floor(y11 - refoy);
-	  ix10 = (int) floor(x10 - refox);
-	  iy10 = (int) floor(y10 - refoy);
 	  
 	  // get limits in reference space
 	  minX = ix00;
@@ -4576,75 +9740,35 @@ TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 	  for (iy = minY; iy <= maxY; ++iy)
 	    for (ix = minX; ix <= maxX; ++ix)
 	      {
-		// find pixel center
-		xv = ix + refox + 0.5;
-		yv = iy + refoy + 0.5;
-
-		// check if it is inside map element quadrilateral
-		inside0 = (x01 - x00)*(yv - y00) - (y01 - y00)*(xv - x00) < 0.0;
-		inside1 = (x11 - x01)*(yv - y01) - (y11 - y01)*(xv - x01) < 0.0;
-		inside2 = (x10 - x11)*(yv - y11) - (y10 - y11)*(xv - x11) < 0.0;
-		inside3 = (x00 - x10)*(yv - y10) - (y00 - y10)*(xv - x10) < 0.0;
-		if (!inside0 || !inside1 || !inside2 || !inside3)
-		  continue;
-		++nInside;
-
-		// check if pixel is marked as valid
-		if (ix < 0 || ix >= rw || iy < 0 || iy >= rh)
-		  continue;
-#if MASKING
-		if ((crmask[iy*rcmbpl + (ix >> 3)] & (0x80 >> (ix & 7))) == 0)
-		    continue;
-#endif		  
-		total += 1.0;
-	      }
-	}
-      if (nInside == 0 || 100.0 * total / nInside <= c.trimMapTargetThreshold)
-	MAP(validArray, mpw, x, y) = 0;
-    }
-
-  // mark map nodes as invalid if no quadrilateral containing them is valid
-#if 0
-  {
-    char out[4096];
-
-    Log("VALID ARRAY:\n");
-    for (y = 0; y < mph; ++y)
-      {
-	memset(out, 0, 4096);
-	for (x = 0; x < mpw; ++x)
-	  sprintf(&out[2*x], "%d ", MAP(validArray, mpw, x, y));
-	Log("    %s\n", out);
-      }
-  }
-#endif
-
-  for (y = 0; y < mph; ++y)
-    for (x = 0; x < mpw; ++x)
-      if (!(x < mpw-1 && y < mph-1 && MAP(validArray, mpw, x, y) ||
-	    x > 0 && y < mph-1 && MAP(validArray, mpw, x-1, y) ||
-	    x < mpw-1 && y > 0 && MAP(validArray, mpw, x, y-1) ||
-	    x > 0 && y > 0 && MAP(validArray, mpw, x-1, y-1)))
-	MAP(map, mpw, x, y).c = 0.0;
-
-#if 0
-  {
-    char out[4096];
-    int len;
+		// find pixel center
+		xv = ix + refox + 0.5;
+		yv = iy + refoy + 0.5;
 
-    Log("CONF ARRAY:\n");
-    for (y = 0; y < mph; ++y)
-      {
-	memset(out, 0, 4096);
-	len = 0;
-	for (x = 0; x < mpw; ++x)
-	  len += sprintf(&out[len], "%f ", MAP(map, mpw, x, y).c);
-	Log("    %s\n", out);
-      }
-  }
-#endif
+		// check if it is inside map element quadrilateral
+		inside0 = (x01 - x00)*(yv - y00) - (y01 - y00)*(xv - x00) < 0.0;
+		inside1 = (x11 - x01)*(yv - y01) - (y11 - y01)*(xv - x01) < 0.0;
+		inside2 = (x10 - x11)*(yv - y11) - (y10 - y11)*(xv - x11) < 0.0;
+		inside3 = (x00 - x10)*(yv - y10) - (y00 - y10)*(xv - x10) < 0.0;
+		if (!inside0 || !inside1 || !inside2 || !inside3)
+		  continue;
+		++nInside;
 
-  free(validArray);
+		// check if pixel is marked as valid
+		if (ix < 0 || ix >= rw || iy < 0 || iy >= rh)
+		  continue;
+#if MASKING
+		if ((tb->crmask[iy*rcmbpl + (ix >> 3)] & (0x80 >> (ix & 7))) == 0)
+		    continue;
+#endif		  
+		total += 1.0;
+	      }
+	}
+      /* FIX: this test is outside the loop over x, so it only ever
+	 applies to the unused last column */
+      if (nInside == 0 || 100.0 * total / nInside <= c.trimMapTargetThreshold)
+	MAP(validArray, mpw, x, y) = 0;
+    }
+  return(NULL);
 }
 
 void
@@ -4659,8 +9783,8 @@ WriteOutputMap (char *outputName, int level, MapElement *map,
   int minX, maxX, minY, maxY;
   int nx, ny;
   MapElement *outMap;
-  char msg[PATH_MAX+256];
   int count;
+  PendingOutput po;
 
   count = 0;
   for (y = 0; y < mph; ++y)
@@ -4685,726 +9809,1389 @@ WriteOutputMap (char *outputName, int level, MapElement *map,
     }
   for (maxX = mpw-1; maxX >= minX; --maxX)
     {
-      for (y = 0; y < mph; ++y)
-	if (MAP(map, mpw, maxX, y).c != 0.0)
-	  break;
-      if (y < mph)
-	break;
+      for (y = 0; y < mph; ++y)
+	if (MAP(map, mpw, maxX, y).c != 0.0)
+	  break;
+      if (y < mph)
+	break;
+    }
+  for (minY = 0; minY < mph; ++minY)
+    {
+      for (x = 0; x < mpw; ++x)
+	if (MAP(map, mpw, x, minY).c != 0.0)
+	  break;
+      if (x < mpw)
+	break;
+    }
+  for (maxY = mph-1; maxY >= minY; --maxY)
+    {
+      for (x = 0; x < mpw; ++x)
+	if (MAP(map, mpw, x, maxY).c != 0.0)
+	  break;
+      if (x < mpw)
+	break;
+    }
+  nx = maxX - minX + 1;
+  ny = maxY - minY + 1;
+
+  /* write out resultant map */
+  if (level > c.outputLevel)
+    sprintf(fn, "%s.%.2d.map", outputName, level);
+  else
+    sprintf(fn, "%s.map", outputName);
+
+  outMap = (MapElement*) malloc(nx * ny * sizeof(MapElement));
+  if (outMap == NULL)
+    {
+      SetMessage("Could not allocate outMap array (%zd)\n",
+		 ((size_t) nx) * ny * sizeof(MapElement));
+      return;
+    }
+  for (y = 0; y < ny; ++y)
+    for (x = 0; x < nx; ++x)
+      {
+	GETMAP(map, mpw, minX + x, minY + y, &rx, &ry, &rc);
+	SETMAP(outMap, nx, x, y, rx, ry, rc);
+    }
+  po.kind = OUTPUT_MAP;
+  strcpy(po.fn, fn);
+  po.data = outMap;
+  po.level = level + levelShift;
+  po.width = nx;
+  po.height = ny;
+  po.xMin = minX + mox;
+  po.yMin = minY + moy;
+  po.previewLevel = level < c.previewLevel ? c.previewLevel : -1;
+  strcpy(po.imageName, t.pair.imageName[0]);
+  strcpy(po.referenceName, t.pair.imageName[1]);
+  QueueOutput(&po);
+}
+
+
+int
+WriteOutputImage (char *outputName, int level, float *output,
+		  int w, int h, float scale)
+{
+  int x, y;
+  int bv;
+  unsigned char *image;
+  char fn[PATH_MAX];
+  char extension[8];
+  PendingOutput po;
+
+  /* write out the output image */
+  if (c.type == 't')
+    strcpy(extension, "tif");
+  else
+    strcpy(extension, "pgm");
+
+  if (level > c.outputLevel)
+    sprintf(fn, "%s.%.2d.%s", outputName, level, extension);
+  else
+    sprintf(fn, "%s.%s", outputName, extension);
+  image = (unsigned char *) malloc(w * h * sizeof(unsigned char));
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      {
+	if (output[y * w + x] <= 0.0)
+	  bv = 0;
+	else
+	  {
+	    bv = (int) floor(output[y * w + x] * scale);
+	    if (bv > 255)
+	      bv = 255;
+	  }
+	image[y * w + x] = bv;
+      }
+  po.kind = OUTPUT_IMAGE;
+  strcpy(po.fn, fn);
+  po.data = image;
+  po.width = w;
+  po.height = h;
+  QueueOutput(&po);
+  return(1);
+}
+
+/* QueueOutput hands an output file to the background writer thread,
+   starting it if need be, so that the worker can go on with its next
+   task; it blocks while c.writeQueue outputs are already pending, and
+   with -write_queue 0 it writes the file itself */
+void
+QueueOutput (PendingOutput *po)
+{
+  if (c.writeQueue == 0)
+    {
+      WriteOutput(po);
+      return;
+    }
+  pthread_mutex_lock(&outputLock);
+  if (!outputWriterRunning)
+    {
+      outputWriterStop = 0;
+      if (pthread_create(&outputWriter, NULL, OutputWriterMain, NULL) != 0)
+	{
+	  pthread_mutex_unlock(&outputLock);
+	  Log("Could not create output writer thread; writing synchronously\n");
+	  WriteOutput(po);
+	  return;
+	}
+      outputWriterRunning = 1;
+    }
+  while (nPendingOutputs >= c.writeQueue)
+    pthread_cond_wait(&outputSpace, &outputLock);
+  pendingOutputs[(firstPendingOutput + nPendingOutputs) % MAX_WRITE_QUEUE] =
+    *po;
+  ++nPendingOutputs;
+  pthread_cond_signal(&outputReady);
+  pthread_mutex_unlock(&outputLock);
+}
+
+/* OutputWriterMain writes the pending outputs in the order they were
+   queued; an output stays in the queue until it is written so that
+   StopOutputWriter can wait for the queue to drain */
+void *
+OutputWriterMain (void *arg)
+{
+  PendingOutput *po;
+
+  pthread_mutex_lock(&outputLock);
+  for (;;)
+    {
+      while (nPendingOutputs == 0 && !outputWriterStop)
+	pthread_cond_wait(&outputReady, &outputLock);
+      if (nPendingOutputs == 0)
+	break;
+      po = &pendingOutputs[firstPendingOutput];
+      pthread_mutex_unlock(&outputLock);
+      WriteOutput(po);
+      pthread_mutex_lock(&outputLock);
+      firstPendingOutput = (firstPendingOutput + 1) % MAX_WRITE_QUEUE;
+      --nPendingOutputs;
+      pthread_cond_broadcast(&outputSpace);
+    }
+  pthread_mutex_unlock(&outputLock);
+  return(NULL);
+}
+
+void
+WriteOutput (PendingOutput *po)
+{
+  FILE *f;
+  char msg[PATH_MAX+256];
+
+  switch (po->kind)
+    {
+    case OUTPUT_MAP:
+      if (!WritePreviewMap(po->fn, (MapElement *) po->data, po->level,
+			   po->width, po->height,
+			   po->xMin, po->yMin,
+			   po->imageName, po->referenceName,
+			   po->previewLevel,
+			   (enum MapCompression) c.mapCompression,
+			   msg))
+	Error("Could not write output map %s :\n%s\n",
+	      po->fn, msg);
+      break;
+    case OUTPUT_IMAGE:
+      if (!WriteImage(po->fn, (unsigned char *) po->data,
+		      po->width, po->height, UncompressedImage, msg))
+	Error("Could not write output image %s:\n%s", po->fn, msg);
+      break;
+    case OUTPUT_SCORE:
+      f = fopen(po->fn, "w");
+      if (f == NULL)
+	Error("Could not open score file %s\n", po->fn);
+      fputs((char *) po->data, f);
+      fclose(f);
+      break;
+    }
+  free(po->data);
+  po->data = NULL;
+}
+
+/* StopOutputWriter waits until all pending outputs have been written
+   and ends the writer thread */
+void
+StopOutputWriter ()
+{
+  pthread_mutex_lock(&outputLock);
+  if (!outputWriterRunning)
+    {
+      pthread_mutex_unlock(&outputLock);
+      return;
+    }
+  outputWriterStop = 1;
+  pthread_cond_signal(&outputReady);
+  pthread_mutex_unlock(&outputLock);
+  pthread_join(outputWriter, NULL);
+  outputWriterRunning = 0;
+}
+
+void
+WorkerFinalize ()
+{
+  StopOutputWriter();
+  if (gpuReady > 0)
+    GpuMovesFinish();
+}
+
+void
+PackContext ()
+{
+  int i;
+
+  par_pkbyte((unsigned char) c.type);
+  par_pkstr(c.imageBasename);
+  par_pkstr(c.maskBasename);
+  par_pkstr(c.discontinuityBasename);
+  par_pkint(c.strictMasking);
+
+  par_pkstr(c.cptsName);
+  par_pkstr(c.roiName);
+
+  par_pkstr(c.initialMapName);
+  par_pkstr(c.constrainingMapName);
+
+  par_pkstr(c.outputMapBasename);
+  par_pkstr(c.outputWarpedBasename);
+  par_pkstr(c.outputCorrelationBasename);
+  par_pkstr(c.outputMaskBasename);
+  par_pkstr(c.outputPairwiseMaskBasename);
+
+  par_pkstr(c.logBasename);
+
+  par_pkint(c.startLevel);
+
+  par_pkint(c.outputLevel);
+  par_pkint(c.previewLevel);
+  par_pkint(c.minResolution);
+  par_pkint(c.depth);
+  par_pkint(c.cptsMethod);
+  par_pkdouble(c.distortion);
+  par_pkdouble(c.correspondence);
+  par_pkdouble(c.correspondenceThreshold);
+  par_pkdouble(c.constraining);
+  par_pkdouble(c.constrainingThreshold);
+  par_pkdouble(c.constrainingConfidenceThreshold);
+  par_pkdouble(c.quality);
+  par_pkdouble(c.minOverlap);
+  par_pkdouble(c.trimMapSourceThreshold);
+  par_pkdouble(c.trimMapTargetThreshold);
+  par_pkdouble(c.stopAcceptance);
+  par_pkdouble(c.stopEnergy);
+  par_pkint(c.refineSweeps);
+  par_pkdouble(c.refinePolish);
+  par_pkint(c.roiMargin);
+  par_pkint(c.correlationHalfWidth);
+  par_pkint(c.correlationKernel);
+  par_pkint(c.metric);
+  par_pkdouble(c.ngfEdge);
+  par_pkint(c.writeAllMaps);
+  par_pkint(c.update);
+  par_pkint(c.partial);
+  par_pkint(c.nWorkers);
+  par_pkint(c.nThreads);
+  par_pkint(c.gpu);
+  par_pkint(c.writeQueue);
+  par_pkint(c.mapCompression);
+  par_pkint(c.mapLevels);
+  par_pkint(c.pyramidCacheSize);
+  par_pkint(c.pyramidBits);
+  par_pkint(c.splitSize);
+  par_pkint(c.splitOverlap);
+  par_pkdouble(c.adaptiveCorrelation);
+  par_pkint(c.adaptiveDepth);
+  par_pkdouble(c.adaptiveQuality);
+  par_pkint(c.adaptiveWarm);
+  par_pkint(c.memoryBudget);
+}
+
+void
+UnpackContext ()
+{
+  c.type = (char) par_upkbyte();
+  par_upkstr(c.imageBasename);
+  par_upkstr(c.maskBasename);
+  par_upkstr(c.discontinuityBasename);
+  c.strictMasking = par_upkint();
+
+  par_upkstr(c.cptsName);
+  par_upkstr(c.roiName);
+
+  par_upkstr(c.initialMapName);
+  par_upkstr(c.constrainingMapName);
+
+  par_upkstr(c.outputMapBasename);
+  par_upkstr(c.outputWarpedBasename);
+  par_upkstr(c.outputCorrelationBasename);
+  par_upkstr(c.outputMaskBasename);
+  par_upkstr(c.outputPairwiseMaskBasename);
+
+  par_upkstr(c.logBasename);
+
+  c.startLevel = par_upkint();
+  c.outputLevel = par_upkint();
+  c.previewLevel = par_upkint();
+  c.minResolution = par_upkint();
+  c.depth = par_upkint();
+  c.cptsMethod = par_upkint();
+  c.distortion = par_upkdouble();
+  c.correspondence = par_upkdouble();
+  c.correspondenceThreshold = par_upkdouble();
+  c.constraining = par_upkdouble();
+  c.constrainingThreshold = par_upkdouble();
+  c.constrainingConfidenceThreshold = par_upkdouble();
+  c.quality = par_upkdouble();
+  c.minOverlap = par_upkdouble();
+  c.trimMapSourceThreshold = par_upkdouble();
+  c.trimMapTargetThreshold = par_upkdouble();
+  c.stopAcceptance = par_upkdouble();
+  c.stopEnergy = par_upkdouble();
+  c.refineSweeps = par_upkint();
+  c.refinePolish = par_upkdouble();
+  c.roiMargin = par_upkint();
+
+  c.correlationHalfWidth = par_upkint();
+  c.correlationKernel = par_upkint();
+  c.metric = par_upkint();
+  c.ngfEdge = par_upkdouble();
+  c.writeAllMaps = par_upkint();
+  c.update = par_upkint();
+  c.partial = par_upkint();
+  c.nWorkers = par_upkint();
+  c.nThreads = par_upkint();
+  c.gpu = par_upkint();
+  c.writeQueue = par_upkint();
+  c.mapCompression = par_upkint();
+  c.mapLevels = par_upkint();
+  c.pyramidCacheSize = par_upkint();
+  c.pyramidBits = par_upkint();
+  c.splitSize = par_upkint();
+  c.splitOverlap = par_upkint();
+  c.adaptiveCorrelation = par_upkdouble();
+  c.adaptiveDepth = par_upkint();
+  c.adaptiveQuality = par_upkdouble();
+  c.adaptiveWarm = par_upkint();
+  c.memoryBudget = par_upkint();
+}
+
+void
+PackPair (Pair *p)
+{
+  int imi;
+
+  for (imi = 0; imi < 2; ++imi)
+    {
+      par_pkstr(p->imageName[imi]);
+      par_pkint(p->imageMinX[imi]);
+      par_pkint(p->imageMaxX[imi]);
+      par_pkint(p->imageMinY[imi]);
+      par_pkint(p->imageMaxY[imi]);
     }
-  for (minY = 0; minY < mph; ++minY)
+  par_pkstr(p->pairName);
+  for (imi = 0; imi < 2; ++imi)
+    par_pkstr(p->warmName[imi] != NULL ? p->warmName[imi] : "");
+}
+
+void
+UnpackPair (Pair *p)
+{
+  char s[PATH_MAX];
+  int imi;
+
+  for (imi = 0; imi < 2; ++imi)
     {
-      for (x = 0; x < mpw; ++x)
-	if (MAP(map, mpw, x, minY).c != 0.0)
-	  break;
-      if (x < mpw)
-	break;
+      par_upkstr(s);
+      CopyString(&(p->imageName[imi]), s);
+      
+      p->imageMinX[imi] = par_upkint();
+      p->imageMaxX[imi] = par_upkint();
+      p->imageMinY[imi] = par_upkint();
+      p->imageMaxY[imi] = par_upkint();
     }
-  for (maxY = mph-1; maxY >= minY; --maxY)
+
+  par_upkstr(s);
+  CopyString(&(p->pairName), s);
+  for (imi = 0; imi < 2; ++imi)
     {
-      for (x = 0; x < mpw; ++x)
-	if (MAP(map, mpw, x, maxY).c != 0.0)
-	  break;
-      if (x < mpw)
-	break;
+      par_upkstr(s);
+      CopyString(&(p->warmName[imi]), s[0] != '\0' ? s : NULL);
     }
-  nx = maxX - minX + 1;
-  ny = maxY - minY + 1;
+}
 
-  /* write out resultant map */
-  if (level > c.outputLevel)
-    sprintf(fn, "%s.%.2d.map", outputName, level);
-  else
-    sprintf(fn, "%s.map", outputName);
+void
+CopyPair (Pair *dst, Pair *src)
+{
+  int imi;
 
-  outMap = (MapElement*) malloc(nx * ny * sizeof(MapElement));
-  if (outMap == NULL)
+  for (imi = 0; imi < 2; ++imi)
     {
-      SetMessage("Could not allocate outMap array (%zd)\n",
-		 ((size_t) nx) * ny * sizeof(MapElement));
-      return;
+      CopyString(&(dst->imageName[imi]), src->imageName[imi]);
+      dst->imageMinX[imi] = src->imageMinX[imi];
+      dst->imageMaxX[imi] = src->imageMaxX[imi];
+      dst->imageMinY[imi] = src->imageMinY[imi];
+      dst->imageMaxY[imi] = src->imageMaxY[imi];
     }
-  for (y = 0; y < ny; ++y)
-    for (x = 0; x < nx; ++x)
-      {
-	GETMAP(map, mpw, minX + x, minY + y, &rx, &ry, &rc);
-	SETMAP(outMap, nx, x, y, rx, ry, rc);
-    }
-  if (!WriteMap(fn, outMap, level,
-		nx, ny,
-		minX + mox, minY + moy,
-		t.pair.imageName[0], t.pair.imageName[1],
-		UncompressedMap,
-		msg))
-    Error("Could not write output map %s :\n%s\n",
-	  fn, msg);
-
-  free(outMap);
+  CopyString(&(dst->pairName), src->pairName);
+  for (imi = 0; imi < 2; ++imi)
+    CopyString(&(dst->warmName[imi]), src->warmName[imi]);
 }
 
+/* FindWarmMaps looks for two finished maps that chain the image of
+   pair p through some intermediate image to its reference, taken from
+   the results of this run or, if warmMaps is given, from the maps of
+   the pairs in the list that an earlier run left there; if there is
+   such a chain, the pair's warmName[] are set to the two map files */
+void
+FindWarmMaps (Pair *p, Pair *pairs, int nPairs, char *warmMaps)
+{
+  int src, i;
+  Pair *q;
+  char *prefix;
+  char fn[PATH_MAX], second[PATH_MAX];
+
+  CopyString(&(p->warmName[0]), NULL);
+  CopyString(&(p->warmName[1]), NULL);
+  for (src = 0; src < 2; ++src)
+    {
+      if (src == 1 &&
+	  (warmMaps[0] == '\0' || strcmp(warmMaps, c.outputMapBasename) == 0))
+	break;
+      prefix = src == 0 ? c.outputMapBasename : warmMaps;
+      for (i = (src == 0 ? nKeptResults : nPairs) - 1; i >= 0; --i)
+	{
+	  q = src == 0 ? &(results[i].pair) : &pairs[i];
+	  if (strcmp(q->imageName[0], p->imageName[0]) != 0 ||
+	      strcmp(q->imageName[1], p->imageName[1]) == 0)
+	    continue;
+	  sprintf(fn, "%s%s.map", prefix, q->pairName);
+	  if (src == 1 && access(fn, R_OK) != 0)
+	    continue;
+	  if (FinishedMap(q->imageName[1], p->imageName[1],
+			  pairs, nPairs, warmMaps, second))
+	    {
+	      CopyString(&(p->warmName[0]), fn);
+	      CopyString(&(p->warmName[1]), second);
+	      return;
+	    }
+	}
+    }
+}
 
+/* FinishedMap looks, in the same places as FindWarmMaps, for a
+   finished map from image from to image to, and if there is one
+   returns 1 with its file in mapName */
 int
-WriteOutputImage (char *outputName, int level, float *output,
-		  int w, int h, float scale)
+FinishedMap (char *from, char *to, Pair *pairs, int nPairs,
+	     char *warmMaps, char *mapName)
 {
-  int x, y;
-  int bv;
-  unsigned char *image;
-  char fn[PATH_MAX];
-  char extension[8];
-  char msg[PATH_MAX+256];
-
-  /* write out the output image */
-  if (c.type == 't')
-    strcpy(extension, "tif");
-  else
-    strcpy(extension, "pgm");
+  int i;
 
-  if (level > c.outputLevel)
-    sprintf(fn, "%s.%.2d.%s", outputName, level, extension);
-  else
-    sprintf(fn, "%s.%s", outputName, extension);
-  image = (unsigned char *) malloc(w * h * sizeof(unsigned char));
-  for (y = 0; y < h; ++y)
-    for (x = 0; x < w; ++x)
+  for (i = nKeptResults - 1; i >= 0; --i)
+    if (strcmp(results[i].pair.imageName[0], from) == 0 &&
+	strcmp(results[i].pair.imageName[1], to) == 0)
       {
-	if (output[y * w + x] <= 0.0)
-	  bv = 0;
-	else
-	  {
-	    bv = (int) floor(output[y * w + x] * scale);
-	    if (bv > 255)
-	      bv = 255;
-	  }
-	image[y * w + x] = bv;
+	sprintf(mapName, "%s%s.map", c.outputMapBasename,
+		results[i].pair.pairName);
+	return(1);
       }
-  if (!WriteImage(fn, image, w, h, UncompressedImage, msg))
-    Error("Could not write output image %s:\n%s", fn, msg);
-  free(image);
-  return(1);
+  if (warmMaps[0] == '\0' || strcmp(warmMaps, c.outputMapBasename) == 0)
+    return(0);
+  for (i = nPairs - 1; i >= 0; --i)
+    if (strcmp(pairs[i].imageName[0], from) == 0 &&
+	strcmp(pairs[i].imageName[1], to) == 0)
+      {
+	sprintf(mapName, "%s%s.map", warmMaps, pairs[i].pairName);
+	if (access(mapName, R_OK) == 0)
+	  return(1);
+      }
+  return(0);
 }
 
-void
-ComputeWarpedImage (float *warped, unsigned char *valid,
-		    int w, int h,           /* of the warped reference */
-		    int imgox, int imgoy,   /* of the warped reference */
-		    float *image, unsigned char *mask,
-		    int iw, int ih,         /* of the reference (image & mask) */
-		    int refox, int refoy,   /* of the reference (image & mask) */
-		    MapElement *map,
-		    int mapFactor,
-		    int mpw, int mph,
-		    int mox, int moy)
+/* SharesImage returns whether pairs p and q have an image in common */
+int
+SharesImage (Pair *p, Pair *q)
 {
-  float xv, yv;
-  int ixv, iyv;
-  int irx, iry;
-  float rrx, rry;
-  float r00, r01, r10, r11;
-  float rv;
-  float rx00, rx01, rx10, rx11;
-  float ry00, ry01, ry10, ry11;
-  float rc00, rc01, rc10, rc11;
-  float rx, ry, rc;
-  int x, y;
-  int bv;
-  int mbpl;
-  unsigned char msg[PATH_MAX];
-  size_t count1, count2, count3, count4, count5;
+  int i, j;
 
-  mbpl = (iw + 7) >> 3;
-  memset(valid, 0, w * h * sizeof(unsigned char));
+  for (i = 0; i < 2; ++i)
+    for (j = 0; j < 2; ++j)
+      if (strcmp(p->imageName[i], q->imageName[j]) == 0)
+	return(1);
+  return(0);
+}
 
-  count1 = count2 = count3 = count4 = count5 = 0;
-  for (y = 0; y < h; ++y)
-    for (x = 0; x < w; ++x)
-      {
-	// use bilinear interpolation to find value                                   
-	xv = (x + 0.5 + imgox) / mapFactor - mox;
-	yv = (y + 0.5 + imgoy) / mapFactor - moy;
-	ixv = ((int) (xv + 2.0)) - 2;
-	iyv = ((int) (yv + 2.0)) - 2;
-	rrx = xv - ixv;
-	rry = yv - iyv;
-	if (ixv < 0 || ixv >= mpw-1 ||
-	    iyv < 0 || iyv >= mph-1)
-	  {
-	    ++count1;
-	    warped[y * w + x] = 0.0;
-	    continue;
-	  }
+/* SeparateSplitPairs moves the pairs whose image (or its bounds) is
+   wider or higher than -split allows, and that have levels finer than
+   the split level to register, from pairs to splitPairs, keeping the
+   order of the rest; it returns the number of pairs left */
+int
+SeparateSplitPairs (Pair *pairs, int nPairs)
+{
+  int pn;
+  int n;
+  int level;
+  int minX, maxX, minY, maxY;
+  int ntx, nty;
+  SplitPair *sp;
 
-	GETMAP(map, mpw, ixv, iyv, &rx00, &ry00, &rc00);
-	GETMAP(map, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
-	GETMAP(map, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
-	GETMAP(map, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+  n = 0;
+  for (pn = 0; pn < nPairs; ++pn)
+    {
+      /* the split level is the finest at which the whole image fits */
+      level = 0;
+      if (c.previewLevel < 0 &&
+	  PairRegion(&pairs[pn], 0, &minX, &maxX, &minY, &maxY))
+	while (((maxX - minX + 1) >> level) > c.splitSize ||
+	       ((maxY - minY + 1) >> level) > c.splitSize)
+	  ++level;
+      if (level <= c.outputLevel ||
+	  (c.startLevel >= 0 && c.startLevel < level))
+	{
+	  if (n != pn)
+	    pairs[n] = pairs[pn];
+	  ++n;
+	  continue;
+	}
+      splitPairs = (SplitPair *) realloc(splitPairs,
+					 (nSplitPairs + 1) * sizeof(SplitPair));
+      if (splitPairs == NULL)
+	Error("Could not allocate split pairs\n");
+      sp = &splitPairs[nSplitPairs++];
+      sp->pair = pairs[pn];
+      sp->level = level;
+      sp->size = c.splitSize;
+      sp->overlap = c.splitOverlap;
+      SplitGrid(minX, maxX, minY, maxY, &ntx, &nty);
+      sp->nParts = ntx * nty;
+      sp->current = 0;
+      Log("Splitting pair %s at level %d into %d parts\n",
+	  sp->pair.pairName, level, sp->nParts);
+    }
+  return(n);
+}
 
-	if (rc00 == 0.0 || rc01 == 0.0 || rc10 == 0.0 || rc11 == 0.0)
-	  {
-	    ++count2;
-	    warped[y * w + x] = 0.0;
-	    continue;
-	  }
+/* RegisterSplitPairs registers the pairs in splitPairs in three rounds,
+   each waiting for the one before to finish: the coarse pass of every
+   pair, the parts of those whose maps were not found up-to-date, and
+   the blending of the maps of their parts; pairs are the other pairs
+   of the batch, for -warm_start */
+void
+RegisterSplitPairs (Pair *pairs, int nPairs, int warmStart, char *warmMaps)
+{
+  int i, k;
+  int imi;
+  SplitPair *sp;
+  char fn[PATH_MAX];
 
-	rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-	  - rx10 * rrx * (rry - 1.0)
-	  - rx01 * (rrx - 1.0) * rry
-	  + rx11 * rrx * rry;
-	ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-	  - ry10 * rrx * (rry - 1.0)
-	  - ry01 * (rrx - 1.0) * rry
-	  + ry11 * rrx * rry;
-	rx = mapFactor * rx - 0.5 - refox;
-	ry = mapFactor * ry - 0.5 - refoy;
-	irx = ((int) floor(rx + 1.0)) - 1;
-	iry = ((int) floor(ry + 1.0)) - 1;
-	if (irx < 0 || irx >= iw - 1 ||
-	    iry < 0 || iry >= ih - 1)
-	  {
-	    ++count3;
-	    warped[y * w + x] = 0.0;
-	    continue;
-	  }
-	rrx = rx - irx;
-	rry = ry - iry;
+  for (i = 0; i < nSplitPairs; ++i)
+    {
+      sp = &splitPairs[i];
+      sprintf(fn, "%s%s.map", c.outputMapBasename, sp->pair.pairName);
+      if (!CreateDirectories(fn))
+	{
+	  sp->current = 1;
+	  continue;
+	}
+      if (warmStart)
+	FindWarmMaps(&sp->pair, pairs, nPairs, warmMaps);
+      DelegateSplitTask(sp, SPLIT_COARSE, 0);
+    }
+  while (par_tasks_outstanding() > 0)
+    par_wait(1.0);
+
+  for (i = 0; i < nSplitPairs; ++i)
+    if (!splitPairs[i].current)
+      for (k = 0; k < splitPairs[i].nParts; ++k)
+	DelegateSplitTask(&splitPairs[i], SPLIT_PART, k);
+  while (par_tasks_outstanding() > 0)
+    par_wait(1.0);
+
+  for (i = 0; i < nSplitPairs; ++i)
+    if (!splitPairs[i].current)
+      DelegateSplitTask(&splitPairs[i], SPLIT_STITCH, 0);
+  t.split = SPLIT_NONE;
+  t.nGroup = 0;
+
+  for (i = 0; i < nSplitPairs; ++i)
+    {
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  free(splitPairs[i].pair.imageName[imi]);
+	  free(splitPairs[i].pair.warmName[imi]);
+	}
+      free(splitPairs[i].pair.pairName);
+    }
+  free(splitPairs);
+  splitPairs = NULL;
+  nSplitPairs = 0;
+}
 
-#if MASKING
-	if ((mask[iry*mbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-	    rrx > 0.0 && (mask[iry*mbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0 ||
-	    rry > 0.0 && (mask[(iry+1)*mbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-	    rrx > 0.0 && rry > 0.0 && (mask[(iry+1)*mbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0)
-	  {
-	    ++count4;
-	    warped[y * w + x] = 0.0;
-	    continue;
-	  }
-#endif
+/* DelegateSplitTask delegates the task of stage split (and, for
+   SPLIT_PART, part) of split pair sp */
+void
+DelegateSplitTask (SplitPair *sp, int split, int part)
+{
+  char fn[PATH_MAX];
+  char *hints[2];
+
+  t.split = split;
+  t.splitLevel = sp->level;
+  t.splitPart = part;
+  t.splitSize = sp->size;
+  t.splitOverlap = sp->overlap;
+  t.pass = PASS_FULL;
+  t.nGroup = 1;
+  CopyPair(&t.group[0], &sp->pair);
+
+  /* the parts start from the coarse map instead */
+  if (split == SPLIT_PART)
+    {
+      CopyString(&(t.group[0].warmName[0]), NULL);
+      CopyString(&(t.group[0].warmName[1]), NULL);
+    }
 
-	r00 = image[iry * iw + irx];
-	r01 = image[(iry + 1) * iw + irx];
-	r10 = image[iry * iw + (irx + 1)];
-	r11 = image[(iry + 1) * iw + irx + 1];
-	rv = r00 * (rrx - 1.0) * (rry - 1.0)
-	  - r10 * rrx * (rry - 1.0)
-	  - r01 * (rrx - 1.0) * rry
-	  + r11 * rrx * rry;
-	++count5;
-	warped[y * w + x] = rv;
-	valid[y * w + x] = 1;
-      }
-  Log("ComputeWarpedImage: %zd %zd %zd %zd %zd\n",
-      count1, count2, count3, count4, count5);
+  sprintf(fn, "%s%s.map", c.outputMapBasename, sp->pair.pairName);
+  if (split == SPLIT_COARSE)
+    strcat(fn, "+coarse");
+  else if (split == SPLIT_PART)
+    sprintf(fn + strlen(fn), "+part%d", part);
+  Log("Delegating stage %d (part %d) of split pair %s\n",
+      split, part, sp->pair.pairName);
+  hints[0] = sp->pair.imageName[0];
+  hints[1] = sp->pair.imageName[1];
+  par_set_task_key(fn);
+  par_delegate_task_hint(2, hints);
 }
 
+/* AddRetryPair adds p, whose cheap pass fell short of -adaptive, to
+   the pairs that RetryAdaptivePairs registers again */
 void
-ComputeCorrelation (float *correlation,
-		    float *a, float *b,
-		    unsigned char *valid,
-		    int w, int h,
-		    int hw)
+AddRetryPair (Pair *p)
 {
-  int startN;
-  double startSumA, startSumA2, startSumB, startSumB2, startSumAB;
-  int n;
-  double sumA, sumA2, sumB, sumB2, sumAB;
-  double meanA, meanB;
-  double denom;
-  double av, bv;
-  int x, y;
-  int xc, yc;
-  int i;
-  int *lim;
-  double checkSumA, checkSumA2, checkSumB, checkSumB2, checkSumAB;
-  int checkN;
-  int dx, dy, cx, cy;
-  double checkCorr;
-  int minimumSamples;
-  size_t count1, count2, count3;
-
-  // find the extents of one quadrant of a circle of the desired half-width;
-  // also, let the minimum number of samples be about one-quarter of the
-  //   the potential samples
-  lim = (int*) malloc((hw+1) * sizeof(int));
-  minimumSamples = 1;
-  for (x = 0; x <= hw; ++x)
-    {
-      lim[x] = (int) floor(sqrt((hw + 0.5) * (hw + 0.5) - x * x));
-      if (x > 0)
-	minimumSamples += (lim[x] + 1);
-    }
-  Log("ComputeCorrelation: minimumSamples = %d\n", minimumSamples);
-
-  // first compute the sums for (-1, -1)
-  startSumA = 0.0;
-  startSumB = 0.0;
-  startSumA2 = 0.0;
-  startSumB2 = 0.0;
-  startSumAB = 0.0;
-  startN = 0;
-  for (y = 0; y < hw; ++y)
-    for (x = 0; x < lim[y+1]; ++x)
-      {
-	if (x >= w || y >= h || !valid[y*w+x])
-	  continue;
-	av = a[y*w+x];
-	bv = b[y*w+x];
-	startSumA += av;
-	startSumA2 += av * av;
-	startSumB += bv;
-	startSumB2 += bv * bv;
-	startSumAB += av * bv;
-	++startN;
-	//	printf("INCR %0.4d %0.4d ADD\n", x, y);
-      }
-  count1 = count2 = count3 = 0;
-  // go through y
-  for (yc = 0; yc < h; ++yc)
-    {
-      for (i = 1; i <= hw; ++i)
-	{
-	  // subtract old top
-	  x = i - 1;
-	  y = yc - lim[i] - 1;
-	  if (y >= 0 && y < h && x < w && valid[y*w+x])
-	    {
-	      av = a[y*w+x];
-	      bv = b[y*w+x];
-	      startSumA -= av;
-	      startSumA2 -= av * av;
-	      startSumB -= bv;
-	      startSumB2 -= bv * bv;
-	      startSumAB -= av * bv;
-	      --startN;
-	      //	      printf("INCR %0.4d %0.4d DROP\n", x, y);
-	    }
+  retryPairs = (Pair *) realloc(retryPairs,
+				(nRetryPairs + 1) * sizeof(Pair));
+  if (retryPairs == NULL)
+    Error("Could not allocate retry pairs\n");
+  memset(&retryPairs[nRetryPairs], 0, sizeof(Pair));
+  CopyPair(&retryPairs[nRetryPairs], p);
+  CopyString(&(retryPairs[nRetryPairs].warmName[0]), NULL);
+  CopyString(&(retryPairs[nRetryPairs].warmName[1]), NULL);
+  ++nRetryPairs;
+}
 
-	  // add new bottom
-	  y = yc + lim[i];
-	  if (y < h && x < w && valid[y*w+x])
-	    {
-	      av = a[y*w+x];
-	      bv = b[y*w+x];
-	      startSumA += av;
-	      startSumA2 += av * av;
-	      startSumB += bv;
-	      startSumB2 += bv * bv;
-	      startSumAB += av * bv;
-	      ++startN;
-	      //	      printf("INCR %0.4d %0.4d ADD\n", x, y);
-	    }
-	}
+/* RetryAdaptivePairs waits for the cheap pass of the batch to finish
+   and then registers again, at -depth and -quality, the pairs it left
+   in retryPairs, one per task; pairs are the other pairs of the
+   batch, for -warm_start */
+void
+RetryAdaptivePairs (Pair *pairs, int nPairs, int warmStart, char *warmMaps)
+{
+  int i;
+  int imi;
+  char fn[PATH_MAX];
+  char *hints[2];
 
-      sumA = startSumA;
-      sumA2 = startSumA2;
-      sumB = startSumB;
-      sumB2 = startSumB2;
-      sumAB = startSumAB;
-      n = startN;
+  while (par_tasks_outstanding() > 0)
+    par_wait(1.0);
 
-      for (xc = 0; xc < w; ++xc)
-	{
-#if 0
-	  checkSumA = 0.0;
-	  checkSumA2 = 0.0;
-	  checkSumB = 0.0;
-	  checkSumB2 = 0.0;
-	  checkSumAB = 0.0;
-	  checkN = 0;
-	  for (dy = -31; dy <= 31; ++dy)
-	    for (dx = -31; dx <= 31; ++dx)
-	      {
-		cx = xc + dx;
-		cy = yc + dy;
-		if (cx < 0 || cx >= w ||
-		    cy < 0 || cy >= h)
-		  continue;
-		if ((dx * dx + dy * dy) > ((hw + 0.5) * (hw + 0.5)))
-		  continue;
-		if (!valid[cy*w+cx])
-		  continue;
-		av = a[cy*w+cx];
-		bv = b[cy*w+cx];
-		checkSumA += av;
-		checkSumA2 += av * av;
-		checkSumB += bv;
-		checkSumB2 += bv * bv;
-		checkSumAB += av * bv;
-		//		printf("CHECK %0.4d %0.4d ADD\n", cx, cy);
-		++checkN;
-	      }
+  t.split = SPLIT_NONE;
+  t.pass = PASS_RETRY;
+  t.nGroup = 1;
+  for (i = 0; i < nRetryPairs; ++i)
+    {
+      CopyPair(&t.group[0], &retryPairs[i]);
+
+      /* with -adaptive_warm, the map of the cheap pass takes the
+	 place of the warm start */
+      if (warmStart && !c.adaptiveWarm)
+	FindWarmMaps(&t.group[0], pairs, nPairs, warmMaps);
+      Log("Registering pair %s again at depth %d and quality %f\n",
+	  retryPairs[i].pairName, c.depth, c.quality);
+      hints[0] = retryPairs[i].imageName[0];
+      hints[1] = retryPairs[i].imageName[1];
+      sprintf(fn, "%s%s.map+retry", c.outputMapBasename,
+	      retryPairs[i].pairName);
+      par_set_task_key(fn);
+      SetTaskNeeds();
+      par_delegate_task_hint(2, hints);
+      ++nRetried;
+    }
+  t.pass = PASS_FULL;
+  t.nGroup = 0;
 
-	  if (checkN >= minimumSamples)
-	    {
-	      meanA = checkSumA / checkN;
-	      meanB = checkSumB / checkN;
-	      denom = (checkSumA2 - 2.0 * meanA * checkSumA + checkN * meanA * meanA) *
-		(checkSumB2 - 2.0 * meanB * checkSumB + checkN * meanB * meanB);
-	      if (denom < 0.001)
-		checkCorr = 0.0;
-	      else
-		checkCorr = (checkSumAB - meanA * checkSumB - meanB * checkSumA + checkN * meanA * meanB) / sqrt(denom);
-	    }
-	  else
-	    checkCorr = 0.0;
-#endif
-#if 0
-	  sumA = checkSumA;
-	  sumA2 = checkSumA2;
-	  sumB = checkSumB;
-	  sumB2 = checkSumB2;
-	  sumAB = checkSumAB;
-	  n = checkN;
-#endif
+  for (i = 0; i < nRetryPairs; ++i)
+    {
+      for (imi = 0; imi < 2; ++imi)
+	free(retryPairs[i].imageName[imi]);
+      free(retryPairs[i].pairName);
+    }
+  free(retryPairs);
+  retryPairs = NULL;
+  nRetryPairs = 0;
+}
 
-#if 1
-	  // subtract old left
-	  x = xc - lim[0] - 1;
-	  if (x >= 0 && x < w && valid[yc*w+x])
-	    {
-	      av = a[yc*w+x];
-	      bv = b[yc*w+x];
-	      sumA -= av;
-	      sumA2 -= av * av;
-	      sumB -= bv;
-	      sumB2 -= bv * bv;
-	      sumAB -= av * bv;
-	      --n;
-	      //	      printf("INCR %0.4d %0.4d DROP\n", x, y);
-	    }
+/* ScanPairImages reads the sizes of the images of the pairs that are
+   not given bounds all at once (see ScanImageSizes), so that those
+   looked up while the pairs are delegated or planned are at hand */
+void
+ScanPairImages (Pair *pairs, int nPairs)
+{
+  int pn, imi;
+  int n;
+  char **names;
+  char errorMsg[PATH_MAX + 256];
 
-	  // add new right
-	  x = xc + lim[0];
-	  if (x >= 0 && x < w && valid[yc*w+x])
-	    {
-	      av = a[yc*w+x];
-	      bv = b[yc*w+x];
-	      sumA += av;
-	      sumA2 += av * av;
-	      sumB += bv;
-	      sumB2 += bv * bv;
-	      sumAB += av * bv;
-	      ++n;
-	      //	      printf("INCR %0.4d %0.4d ADD\n", x, y);
-	    }
+  names = (char **) malloc(2 * nPairs * sizeof(char *));
+  if (names == NULL)
+    Error("Could not allocate image names\n");
+  n = 0;
+  for (pn = 0; pn < nPairs; ++pn)
+    for (imi = 0; imi < 2; ++imi)
+      if (pairs[pn].imageMinX[imi] < 0)
+	{
+	  names[n] = (char *) malloc(strlen(c.imageBasename) +
+				     strlen(pairs[pn].imageName[imi]) + 1);
+	  if (names[n] == NULL)
+	    Error("Could not allocate image names\n");
+	  sprintf(names[n], "%s%s", c.imageBasename,
+		  pairs[pn].imageName[imi]);
+	  ++n;
+	}
+  if (n > 0 && !ScanImageSizes(n, names, errorMsg))
+    Error("%s", errorMsg);
+  while (--n >= 0)
+    free(names[n]);
+  free(names);
+}
 
-	  for (i = 1; i <= hw; ++i)
-	    {
-	      // subtract old left
-	      x = xc - lim[i] - 1;
-	      if (x >= 0)
-		{
-		  y = yc - i;
-		  if (y >= 0 && valid[y*w+x])
-		    {
-		      av = a[y*w+x];
-		      bv = b[y*w+x];
-		      sumA -= av;
-		      sumA2 -= av * av;
-		      sumB -= bv;
-		      sumB2 -= bv * bv;
-		      sumAB -= av * bv;
-		      --n;
-		      //		      printf("INCR %0.4d %0.4d DROP\n", x, y);
-		    }
-		  y = yc + i;
-		  if (y < h && valid[y*w+x])
-		    {
-		      av = a[y*w+x];
-		      bv = b[y*w+x];
-		      sumA -= av;
-		      sumA2 -= av * av;
-		      sumB -= bv;
-		      sumB2 -= bv * bv;
-		      sumAB -= av * bv;
-		      --n;
-		      //		      printf("INCR %0.4d %0.4d DROP\n", x, y);
-		    }
-		}
+/* PlanTasks reports, without registering anything, the tasks that the
+   pairs would be delegated as, with -group, and for each an estimate
+   of the peak memory of its worker and of its work in pyramid
+   megapixels; the sizes come from the image headers, or from the
+   pair's bounds, and the estimate counts, for each distinct image of
+   the task, the 8-bit image as read and its float copy, the stored
+   pyramid and masks, and for the largest pair its maps down to
+   -output_level */
+void
+PlanTasks (Pair *pairs, int nPairs, int groupSize)
+{
+  int pn, first, g, h;
+  int imi, imj;
+  int width, height;
+  int nTasks;
+  double pixels, mapPixels;
+  double taskMemory, taskMaps, taskWork;
+  double peak, work;
+  double imageBytes;
+  int n;
+  char fn[PATH_MAX];
+  char errorMsg[PATH_MAX + 256];
 
-	      // add new right
-	      x = xc + lim[i];
-	      if (x < w)
-		{
-		  y = yc - i;
-		  if (y >= 0 && valid[y*w+x])
-		    {
-		      av = a[y*w+x];
-		      bv = b[y*w+x];
-		      sumA += av;
-		      sumA2 += av * av;
-		      sumB += bv;
-		      sumB2 += bv * bv;
-		      sumAB += av * bv;
-		      ++n;
-		      //		      printf("INCR %0.4d %0.4d ADD\n", x, y);
-		    }
-		  y = yc + i;
-		  if (y < h && valid[y*w+x])
-		    {
-		      av = a[y*w+x];
-		      bv = b[y*w+x];
-		      sumA += av;
-		      sumA2 += av * av;
-		      sumB += bv;
-		      sumB2 += bv * bv;
-		      sumAB += av * bv;
-		      ++n;
-		      //		      printf("INCR %0.4d %0.4d ADD\n", x, y);
-		    }
-		}
-	    }
-#endif
+  imageBytes = PixelBytes(c.pyramidBits);
 
-	  // calculate the correlation for the disk surrounding (xc, yc)
-	  if (n >= minimumSamples)
+  nTasks = 0;
+  peak = 0.0;
+  work = 0.0;
+  for (first = 0; first < nPairs; first = pn)
+    {
+      /* the pairs of the task are chosen as MasterTask chooses them */
+      for (pn = first + 1;
+	   pn - first < groupSize && pn < nPairs &&
+	     SharesImage(&pairs[pn-1], &pairs[pn]);
+	   ++pn) ;
+
+      taskMemory = 0.0;
+      taskMaps = 0.0;
+      taskWork = 0.0;
+      for (g = first; g < pn; ++g)
+	{
+	  mapPixels = 0.0;
+	  for (imi = 0; imi < 2; ++imi)
 	    {
-	      meanA = sumA / n;
-	      meanB = sumB / n;
-	      denom = (sumA2 - 2.0 * meanA * sumA + n * meanA * meanA) *
-		(sumB2 - 2.0 * meanB * sumB + n * meanB * meanB);
-	      if (denom < 0.001)
+	      if (pairs[g].imageMinX[imi] >= 0)
 		{
-		  correlation[yc*w+xc] = 0.0;
-		  ++count1;
+		  width = pairs[g].imageMaxX[imi] - pairs[g].imageMinX[imi] + 1;
+		  height = pairs[g].imageMaxY[imi] - pairs[g].imageMinY[imi] + 1;
 		}
 	      else
 		{
-		  correlation[yc*w+xc] = (sumAB - meanA * sumB - meanB * sumA + n * meanA * meanB) / sqrt(denom);
-		  ++count2;
+		  sprintf(fn, "%s%s", c.imageBasename, pairs[g].imageName[imi]);
+		  if (!ReadImageSize(fn, &width, &height, errorMsg))
+		    Error("Could not read the size of image %s:\n%s\n",
+			  fn, errorMsg);
 		}
-	    }
-	  else
-	    {
-	      correlation[yc*w+xc] = 0.0;
-	      ++count3;
+	      pixels = ((double) width) * height;
+	      taskWork += 4.0 / 3.0 * pixels;
+	      if (imi == 0)
+		mapPixels = MapBytes(width, height);
+
+	      /* an image shared with an earlier pair of the task has its
+		 pyramid built only once */
+	      for (h = first; h < g; ++h)
+		{
+		  for (imj = 0; imj < 2; ++imj)
+		    if (strcmp(pairs[h].imageName[imj],
+			       pairs[g].imageName[imi]) == 0)
+		      break;
+		  if (imj < 2)
+		    break;
+		}
+	      if (h >= g)
+		taskMemory += imageBytes * pixels;
 	    }
 
-#if 0
-	  if (fabs(correlation[yc*w+xc] - checkCorr) / checkCorr > 0.001)
-	    Error("mismatch at %d %d %f %f\n(%f %f %f %f %f %d)\n(%f %f %f %f %f %d)\n",
-		  xc, yc, checkCorr, correlation[yc*w+xc],
-		  checkSumA, checkSumA2, checkSumB, checkSumB2, checkSumAB, checkN,
-		  sumA, sumA2, sumB, sumB2, sumAB, n);
-#endif
+	  if (mapPixels > taskMaps)
+	    taskMaps = mapPixels;
 	}
+      taskMemory += taskMaps;
+
+      printf("Plan for %s%s: %d pair%s, peak %.1f MB, %.1f megapixels%s\n",
+	     pairs[first].pairName, pn - first > 1 ? " and on" : "",
+	     pn - first, pn - first > 1 ? "s" : "",
+	     taskMemory / 1000000.0, taskWork / 1000000.0,
+	     c.memoryBudget > 0 &&
+	     taskMemory > 1000000.0 * (c.memoryBudget - c.pyramidCacheSize) ?
+	     " (over -memory)" : "");
+      ++nTasks;
+      if (taskMemory > peak)
+	peak = taskMemory;
+      work += taskWork;
     }
-  Log("ComputeCorrelation: %zd %zd %zd\n", count1, count2, count3);
-  free(lim);
-}
 
+  n = par_processes();
+  if (n < 2)
+    n = 2;
+  printf("\nPlan: %d pairs in %d tasks\n", nPairs, nTasks);
+  printf("Predicted peak memory per worker: %.1f MB", peak / 1000000.0);
+  if (c.pyramidCacheSize > 0)
+    printf(" plus up to %d MB of pyramid cache", c.pyramidCacheSize);
+  printf(" (%d threads)\n", c.nThreads);
+  printf("Tasks per worker with %d worker%s: %.1f\n",
+	 n - 1, n > 2 ? "s" : "", ((double) nTasks) / (n - 1));
+  printf("Estimated work: %.1f megapixels of pyramid to build and register\n",
+	 work / 1000000.0);
+}
 
+/* AddOversizedPair adds p, which a worker handed back as needing
+   memoryNeeded MB, more than -memory allows, to the pairs that
+   RegisterOversizedPairs registers by parts */
+void
+AddOversizedPair (Pair *p, double memoryNeeded)
+{
+  oversizedPairs = (Pair *) realloc(oversizedPairs,
+				    (nOversizedPairs + 1) * sizeof(Pair));
+  oversizedMemory = (double *) realloc(oversizedMemory,
+				       (nOversizedPairs + 1) * sizeof(double));
+  if (oversizedPairs == NULL || oversizedMemory == NULL)
+    Error("Could not allocate oversized pairs\n");
+  memset(&oversizedPairs[nOversizedPairs], 0, sizeof(Pair));
+  CopyPair(&oversizedPairs[nOversizedPairs], p);
+  CopyString(&(oversizedPairs[nOversizedPairs].warmName[0]), NULL);
+  CopyString(&(oversizedPairs[nOversizedPairs].warmName[1]), NULL);
+  oversizedMemory[nOversizedPairs] = memoryNeeded;
+  Log("Pair %s needs %.1f MB, more than -memory allows\n",
+      p->pairName, memoryNeeded);
+  ++nOversizedPairs;
+}
 
+/* RegisterOversizedPairs waits for the tasks of the batch to finish
+   and then registers the pairs in oversizedPairs as split pairs, with
+   parts small enough for both of their windows and the map to fit in
+   -memory; a pair that cannot be cut that finely, or split at all, is
+   reported and left unregistered.  pairs are the other pairs of the
+   batch, for -warm_start. */
 void
-PackContext ()
+RegisterOversizedPairs (Pair *pairs, int nPairs, int warmStart,
+			char *warmMaps)
 {
   int i;
+  int imi;
+  int level;
+  int size, overlap, window;
+  int savedSize;
+  int minX, maxX, minY, maxY;
+  int ntx, nty;
+  double budget;
+  SplitPair *sp;
 
-  par_pkbyte((unsigned char) c.type);
-  par_pkstr(c.imageBasename);
-  par_pkstr(c.maskBasename);
-  par_pkstr(c.discontinuityBasename);
-  par_pkint(c.strictMasking);
+  while (par_tasks_outstanding() > 0)
+    par_wait(1.0);
+  if (nOversizedPairs == 0)
+    return;
 
-  par_pkstr(c.cptsName);
+  budget = 1000000.0 * (c.memoryBudget - c.pyramidCacheSize);
+  for (i = 0; i < nOversizedPairs; ++i)
+    {
+      level = -1;
+      size = overlap = 0;
+      if (c.previewLevel < 0 &&
+	  PairRegion(&oversizedPairs[i], 0, &minX, &maxX, &minY, &maxY))
+	{
+	  /* halve the parts until a part fits, as the workers
+	     estimate it, but not below the smallest -split */
+	  size = (maxX - minX > maxY - minY ? maxX - minX : maxY - minY) / 2;
+	  for (;;)
+	    {
+	      overlap = c.splitOverlap >= 0 ? c.splitOverlap : size / 8;
+	      window = size + 2 * overlap;
+	      if (2.0 * PixelBytes(c.pyramidBits) * window * window +
+		  MapBytes(window, window) <= budget ||
+		  size / 2 < 1024)
+		break;
+	      size /= 2;
+	    }
+	  if (size >= 1024 &&
+	      2.0 * PixelBytes(c.pyramidBits) * window * window +
+	      MapBytes(window, window) <= budget)
+	    {
+	      level = 0;
+	      while (((maxX - minX + 1) >> level) > size ||
+		     ((maxY - minY + 1) >> level) > size)
+		++level;
+	    }
+	}
+      if (level <= c.outputLevel ||
+	  (c.startLevel >= 0 && c.startLevel < level))
+	{
+	  Log("WARNING: pair %s needs %.1f MB and cannot be split into parts that fit in -memory; it is not registered\n",
+	      oversizedPairs[i].pairName, oversizedMemory[i]);
+	  printf("WARNING: pair %s needs %.1f MB and cannot be split into parts that fit in -memory; it is not registered\n",
+		 oversizedPairs[i].pairName, oversizedMemory[i]);
+	  ++nUnregistered;
+	  for (imi = 0; imi < 2; ++imi)
+	    free(oversizedPairs[i].imageName[imi]);
+	  free(oversizedPairs[i].pairName);
+	  continue;
+	}
 
-  par_pkstr(c.initialMapName);
-  par_pkstr(c.constrainingMapName);
+      splitPairs = (SplitPair *) realloc(splitPairs,
+					 (nSplitPairs + 1) * sizeof(SplitPair));
+      if (splitPairs == NULL)
+	Error("Could not allocate split pairs\n");
+      sp = &splitPairs[nSplitPairs++];
+      sp->pair = oversizedPairs[i];
+      sp->level = level;
+      sp->size = size;
+      sp->overlap = overlap;
+      savedSize = c.splitSize;
+      c.splitSize = size;
+      SplitGrid(minX, maxX, minY, maxY, &ntx, &nty);
+      c.splitSize = savedSize;
+      sp->nParts = ntx * nty;
+      sp->current = 0;
+      Log("Splitting oversized pair %s at level %d into %d parts of %d pixels\n",
+	  sp->pair.pairName, level, sp->nParts, size);
+    }
+  free(oversizedPairs);
+  free(oversizedMemory);
+  oversizedPairs = NULL;
+  oversizedMemory = NULL;
+  nOversizedPairs = 0;
+
+  if (nSplitPairs > 0)
+    RegisterSplitPairs(pairs, nPairs, warmStart, warmMaps);
+}
 
-  par_pkstr(c.outputMapBasename);
-  par_pkstr(c.outputWarpedBasename);
-  par_pkstr(c.outputCorrelationBasename);
-  par_pkstr(c.outputMaskBasename);
-  par_pkstr(c.outputPairwiseMaskBasename);
+/* PixelBytes returns the bytes per pixel of level 0 that a worker
+   holds for an image whose pyramid is stored in bits bits per pixel:
+   the 8-bit image as read, the float copy it is converted into, which
+   a packed pyramid is built from and so is held beside it, and the
+   stored pyramid levels with their masks */
+double
+PixelBytes (int bits)
+{
+  return(1.0 + (bits < 32 ? 4.0 : 0.0) + 4.0 / 3.0 * (bits / 8.0 + 1.0 / 8.0));
+}
 
-  par_pkstr(c.logBasename);
+/* MapBytes returns the bytes of the maps of an image of width x height
+   pixels down to -output_level: the map of each level, and the
+   constraining or initial map that may accompany it */
+double
+MapBytes (int width, int height)
+{
+  return(((double) ((width >> c.outputLevel) + 2)) *
+	 ((height >> c.outputLevel) + 2) *
+	 2.0 * 4.0 / 3.0 * sizeof(MapElement));
+}
 
-  par_pkint(c.startLevel);
+/* TaskMemory estimates, as PlanTasks does, the bytes a worker needs
+   to register pair p; it returns 0 if the size of an image cannot be
+   read, which is then reported when the image is */
+double
+TaskMemory (Pair *p)
+{
+  int imi;
+  int minX, maxX, minY, maxY;
+  int width, height;
+  double bytes;
 
-  par_pkint(c.outputLevel);
-  par_pkint(c.minResolution);
-  par_pkint(c.depth);
-  par_pkint(c.cptsMethod);
-  par_pkdouble(c.distortion);
-  par_pkdouble(c.correspondence);
-  par_pkdouble(c.correspondenceThreshold);
-  par_pkdouble(c.constraining);
-  par_pkdouble(c.constrainingThreshold);
-  par_pkdouble(c.constrainingConfidenceThreshold);
-  par_pkdouble(c.quality);
-  par_pkdouble(c.minOverlap);
-  par_pkdouble(c.trimMapSourceThreshold);
-  par_pkdouble(c.trimMapTargetThreshold);
-  par_pkint(c.correlationHalfWidth);
-  par_pkint(c.writeAllMaps);
-  par_pkint(c.update);
-  par_pkint(c.partial);
-  par_pkint(c.nWorkers);
+  bytes = 0.0;
+  for (imi = 0; imi < 2; ++imi)
+    {
+      if (!PairRegion(p, imi, &minX, &maxX, &minY, &maxY))
+	return(0.0);
+      width = (maxX - minX + 1) >> levelShift;
+      height = (maxY - minY + 1) >> levelShift;
+      bytes += PixelBytes(c.pyramidBits) * width * height;
+      if (imi == 0)
+	bytes += MapBytes(width, height);
+    }
+  return(bytes);
 }
 
+/* SetTaskNeeds tells libpar, with -memory, how much memory the task
+   of the pairs in t.group needs if that is more than -memory gives a
+   worker, so that it goes to a worker that advertised enough with
+   -PAR_MEMORY, if there is one */
 void
-UnpackContext ()
+SetTaskNeeds ()
 {
-  c.type = (char) par_upkbyte();
-  par_upkstr(c.imageBasename);
-  par_upkstr(c.maskBasename);
-  par_upkstr(c.discontinuityBasename);
-  c.strictMasking = par_upkint();
-
-  par_upkstr(c.cptsName);
-
-  par_upkstr(c.initialMapName);
-  par_upkstr(c.constrainingMapName);
-
-  par_upkstr(c.outputMapBasename);
-  par_upkstr(c.outputWarpedBasename);
-  par_upkstr(c.outputCorrelationBasename);
-  par_upkstr(c.outputMaskBasename);
-  par_upkstr(c.outputPairwiseMaskBasename);
-
-  par_upkstr(c.logBasename);
+  int g;
+  double m, needed;
 
-  c.startLevel = par_upkint();
-  c.outputLevel = par_upkint();
-  c.minResolution = par_upkint();
-  c.depth = par_upkint();
-  c.cptsMethod = par_upkint();
-  c.distortion = par_upkdouble();
-  c.correspondence = par_upkdouble();
-  c.correspondenceThreshold = par_upkdouble();
-  c.constraining = par_upkdouble();
-  c.constrainingThreshold = par_upkdouble();
-  c.constrainingConfidenceThreshold = par_upkdouble();
-  c.quality = par_upkdouble();
-  c.minOverlap = par_upkdouble();
-  c.trimMapSourceThreshold = par_upkdouble();
-  c.trimMapTargetThreshold = par_upkdouble();
-
-  c.correlationHalfWidth = par_upkint();
-  c.writeAllMaps = par_upkint();
-  c.update = par_upkint();
-  c.partial = par_upkint();
-  c.nWorkers = par_upkint();
+  if (c.memoryBudget <= 0)
+    return;
+  needed = 0.0;
+  for (g = 0; g < t.nGroup; ++g)
+    {
+      m = TaskMemory(&t.group[g]) / 1000000.0 + c.pyramidCacheSize;
+      if (m > needed)
+	needed = m;
+    }
+  if (needed > c.memoryBudget)
+    {
+      Log("Task of pair %s needs %.1f MB\n", t.group[0].pairName, needed);
+      par_set_task_needs(needed, 0);
+    }
 }
 
-void
-PackPair (Pair *p)
+/* FitMemoryBudget checks the estimated footprint of the task against
+   -memory, or what this worker advertised with -PAR_MEMORY if that is
+   more, less the pyramid cache.  A pair that does not fit is
+   cropped to the overlap of its images if its initial map (mapName,
+   if not empty) shows that to be enough; otherwise it is handed back
+   to the master to be registered by parts, with r set and 0
+   returned.  A stage of a split pair, which the master already cut to
+   fit, goes ahead with a warning. */
+int
+FitMemoryBudget (char *mapName)
 {
+  int megabytes;
+  double budget;
+  double needed;
   int imi;
+  int bounds[2][4];
+
+  megabytes = par_worker_memory() > c.memoryBudget ?
+    par_worker_memory() : c.memoryBudget;
+  budget = 1000000.0 * (megabytes - c.pyramidCacheSize);
+  needed = TaskMemory(&t.pair);
+  if (needed <= budget)
+    return(1);
+  if (t.split != SPLIT_NONE)
+    {
+      Log("WARNING: stage %d of split pair %s is estimated to need %.1f MB, more than -memory allows\n",
+	  t.split, t.pair.pairName, needed / 1000000.0);
+      return(1);
+    }
 
   for (imi = 0; imi < 2; ++imi)
     {
-      par_pkstr(p->imageName[imi]);
-      par_pkint(p->imageMinX[imi]);
-      par_pkint(p->imageMaxX[imi]);
-      par_pkint(p->imageMinY[imi]);
-      par_pkint(p->imageMaxY[imi]);
+      bounds[imi][0] = t.pair.imageMinX[imi];
+      bounds[imi][1] = t.pair.imageMaxX[imi];
+      bounds[imi][2] = t.pair.imageMinY[imi];
+      bounds[imi][3] = t.pair.imageMaxY[imi];
     }
-  par_pkstr(p->pairName);
+  if (CropToOverlap(mapName))
+    {
+      if (TaskMemory(&t.pair) <= budget)
+	{
+	  Log("WORKER TASK cropped %s to fit in %d MB (%.1f MB estimated)\n",
+	      t.pair.pairName, megabytes, TaskMemory(&t.pair) / 1000000.0);
+	  MetricsCount("memory_cropped_tasks", 1);
+	  return(1);
+	}
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  t.pair.imageMinX[imi] = bounds[imi][0];
+	  t.pair.imageMaxX[imi] = bounds[imi][1];
+	  t.pair.imageMinY[imi] = bounds[imi][2];
+	  t.pair.imageMaxY[imi] = bounds[imi][3];
+	}
+    }
+
+  Log("WORKER TASK handing back %s since it is estimated to need %.1f MB, more than the %d MB it may use\n",
+      t.pair.pairName, needed / 1000000.0, megabytes);
+  MetricsCount("memory_oversized_tasks", 1);
+  for (imi = 0; imi < 2; ++imi)
+    {
+      CopyString(&(r.pair.imageName[imi]), t.pair.imageName[imi]);
+      r.pair.imageMinX[imi] = t.pair.imageMinX[imi];
+      r.pair.imageMaxX[imi] = t.pair.imageMaxX[imi];
+      r.pair.imageMinY[imi] = t.pair.imageMinY[imi];
+      r.pair.imageMaxY[imi] = t.pair.imageMaxY[imi];
+    }
+  CopyString(&(r.pair.pairName), t.pair.pairName);
+  r.updated = 0;
+  r.correlation = 0.0;
+  r.distortion = 0.0;
+  r.correspondence = 0.0;
+  r.constraining = 0.0;
+  r.memoryNeeded = needed / 1000000.0;
+  CopyString(&(r.message), NULL);
+  return(0);
 }
 
-void
-UnpackPair (Pair *p)
+/* CropToOverlap narrows the bounds of t.pair to the points of each
+   image that the map in mapName takes into the other (the image
+   points to those that land in the reference, and the reference to
+   where they land), counting the map elements whose cells reach into
+   the images, and widened by two elements and a sixteenth of the
+   image; it returns 0, leaving the bounds as they were, if there is
+   no such map or the bounds would not be narrowed */
+int
+CropToOverlap (char *mapName)
 {
-  char s[PATH_MAX];
+  MapElement *map;
+  MapElement *e;
+  int level;
+  int mw, mh;
+  int ox, oy;
+  int factor;
+  int x, y;
+  int ix, iy;
+  double rx, ry;
+  int minX[2], maxX[2], minY[2], maxY[2];
+  int ilx, ihx, ily, ihy;
+  double rlx, rhx, rly, rhy;
+  int margin;
+  int narrowed;
   int imi;
+  char errorMsg[PATH_MAX + 256];
 
+  if (mapName[0] == '\0' || access(mapName, R_OK) != 0)
+    return(0);
   for (imi = 0; imi < 2; ++imi)
+    if (!PairRegion(&t.pair, imi, &minX[imi], &maxX[imi],
+		    &minY[imi], &maxY[imi]))
+      return(0);
+  map = NULL;
+  if (!ReadMap(mapName, &map, &level, &mw, &mh, &ox, &oy,
+	       NULL, NULL, errorMsg))
     {
-      par_upkstr(s);
-      CopyString(&(p->imageName[imi]), s);
-      
-      p->imageMinX[imi] = par_upkint();
-      p->imageMaxX[imi] = par_upkint();
-      p->imageMinY[imi] = par_upkint();
-      p->imageMaxY[imi] = par_upkint();
+      Log("Could not read %s to crop the pair:\n%s\n", mapName, errorMsg);
+      return(0);
     }
+  factor = 1 << level;
+  ilx = ily = INT_MAX;
+  ihx = ihy = INT_MIN;
+  rlx = rly = 1.0e30;
+  rhx = rhy = -1.0e30;
+  for (y = 0; y < mh; ++y)
+    for (x = 0; x < mw; ++x)
+      {
+	e = &MAP(map, mw, x, y);
+	ix = (x + ox) * factor;
+	iy = (y + oy) * factor;
+	rx = e->x * factor;
+	ry = e->y * factor;
+	if (e->c <= 0.0 ||
+	    ix <= minX[0] - factor || ix >= maxX[0] + factor ||
+	    iy <= minY[0] - factor || iy >= maxY[0] + factor ||
+	    rx <= minX[1] - factor || rx >= maxX[1] + factor ||
+	    ry <= minY[1] - factor || ry >= maxY[1] + factor)
+	  continue;
+	if (ix < ilx)
+	  ilx = ix;
+	if (ix > ihx)
+	  ihx = ix;
+	if (iy < ily)
+	  ily = iy;
+	if (iy > ihy)
+	  ihy = iy;
+	if (rx < rlx)
+	  rlx = rx;
+	if (rx > rhx)
+	  rhx = rx;
+	if (ry < rly)
+	  rly = ry;
+	if (ry > rhy)
+	  rhy = ry;
+      }
+  free(map);
+  if (ilx > ihx)
+    return(0);
 
-  par_upkstr(s);
-  CopyString(&(p->pairName), s);
+  margin = 2 * factor +
+    ((maxX[0] - minX[0] > maxY[0] - minY[0] ?
+      maxX[0] - minX[0] : maxY[0] - minY[0]) + 1) / 16;
+  if (minX[0] < ilx - margin)
+    minX[0] = ilx - margin;
+  if (maxX[0] > ihx + margin)
+    maxX[0] = ihx + margin;
+  if (minY[0] < ily - margin)
+    minY[0] = ily - margin;
+  if (maxY[0] > ihy + margin)
+    maxY[0] = ihy + margin;
+  if (minX[1] < (int) floor(rlx) - margin)
+    minX[1] = (int) floor(rlx) - margin;
+  if (maxX[1] > (int) ceil(rhx) + margin)
+    maxX[1] = (int) ceil(rhx) + margin;
+  if (minY[1] < (int) floor(rly) - margin)
+    minY[1] = (int) floor(rly) - margin;
+  if (maxY[1] > (int) ceil(rhy) + margin)
+    maxY[1] = (int) ceil(rhy) + margin;
+  narrowed = 0;
+  for (imi = 0; imi < 2; ++imi)
+    {
+      if (!PairRegion(&t.pair, imi, &ilx, &ihx, &ily, &ihy))
+	return(0);
+      if (minX[imi] > ilx || maxX[imi] < ihx ||
+	  minY[imi] > ily || maxY[imi] < ihy)
+	narrowed = 1;
+    }
+  if (!narrowed)
+    return(0);
+  for (imi = 0; imi < 2; ++imi)
+    {
+      t.pair.imageMinX[imi] = minX[imi];
+      t.pair.imageMaxX[imi] = maxX[imi];
+      t.pair.imageMinY[imi] = minY[imi];
+      t.pair.imageMaxY[imi] = maxY[imi];
+    }
+  Log("WORKER TASK cropping %s to its overlap: %d-%d, %d-%d to %d-%d, %d-%d\n",
+      t.pair.pairName, minX[0], maxX[0], minY[0], maxY[0],
+      minX[1], maxX[1], minY[1], maxY[1]);
+  return(1);
 }
 
+/* PrefetchTask depends on the group's first pair being packed right
+   after its count; the fields ahead of it are read back by
+   UnpackTaskHeader */
 void
 PackTask ()
 {
-  PackPair(&(t.pair));
+  int g;
+
+  par_pkint(t.split);
+  par_pkint(t.splitLevel);
+  par_pkint(t.splitPart);
+  par_pkint(t.splitSize);
+  par_pkint(t.splitOverlap);
+  par_pkint(t.pass);
+  par_pkint(t.nGroup);
+  for (g = 0; g < t.nGroup; ++g)
+    PackPair(&(t.group[g]));
 }
 
 void
 UnpackTask ()
 {
-  UnpackPair(&(t.pair));
+  static int nAllocated = 0;
+  int g;
+  int n;
+
+  n = UnpackTaskHeader(&t);
+  if (n > nAllocated)
+    {
+      t.group = (Pair *) realloc(t.group, n * sizeof(Pair));
+      if (t.group == NULL)
+	Error("Could not allocate task group\n");
+      memset(&t.group[nAllocated], 0, (n - nAllocated) * sizeof(Pair));
+      nAllocated = n;
+    }
+  t.nGroup = n;
+  for (g = 0; g < n; ++g)
+    UnpackPair(&(t.group[g]));
 }
 
-void
-PackResult ()
+/* UnpackTaskHeader unpacks what PackTask packs ahead of the pairs
+   into tp, returning the number of pairs that follow; UnpackTask and
+   PrefetchTask both read the header through it */
+int
+UnpackTaskHeader (Task *tp)
 {
-  PackPair(&(r.pair));
-  par_pkint(r.updated);
-  par_pkdouble(r.distortion);
-  par_pkdouble(r.correlation);
-  par_pkdouble(r.correspondence);
-  par_pkdouble(r.constraining);
-  if (r.message != NULL)
-    par_pkstr(r.message);
-  else
-    par_pkstr("");
+  tp->split = par_upkint();
+  tp->splitLevel = par_upkint();
+  tp->splitPart = par_upkint();
+  tp->splitSize = par_upkint();
+  tp->splitOverlap = par_upkint();
+  tp->pass = par_upkint();
+  return(par_upkint());
 }
 
+/* AllocateGroupResults makes room for n results, keeping the strings
+   of the entries already there for CopyString() to reuse */
 void
-UnpackResult ()
+AllocateGroupResults (int n)
 {
-  char s[PATH_MAX];
+  static int nAllocated = 0;
 
-  UnpackPair(&(r.pair));
-  r.updated = par_upkint();
-  r.distortion = par_upkdouble();
-  r.correlation = par_upkdouble();
-  r.correspondence = par_upkdouble();
-  r.constraining = par_upkdouble();
-  par_upkstr(s);
-  if (s[0] != '\0')
-    CopyString(&(r.message), s);
-  else
-    CopyString(&(r.message), NULL);
+  if (n <= nAllocated)
+    return;
+  groupResults = (Result *) realloc(groupResults, n * sizeof(Result));
+  if (groupResults == NULL)
+    Error("Could not allocate task results\n");
+  memset(&groupResults[nAllocated], 0, (n - nAllocated) * sizeof(Result));
+  nAllocated = n;
 }
 
-size_t
-CountBits (unsigned char *p, size_t n)
+void
+PackResult ()
 {
-  size_t ii;
-  unsigned char b;
-  size_t sum = 0;
+  int i;
+  Result *rp;
 
-  for (ii = 0; ii < n; ++ii)
+  par_pkint(resultSplit);
+  par_pkint(nGroupResults);
+  for (i = 0; i < nGroupResults; ++i)
     {
-      b = *p++;
-      while (b != 0)
-	{
-	  if (b & 1)
-	    ++sum;
-	  b >>= 1;
-	}
+      rp = &groupResults[i];
+      PackPair(&(rp->pair));
+      par_pkint(rp->updated);
+      par_pkdouble(rp->distortion);
+      par_pkdouble(rp->correlation);
+      par_pkdouble(rp->correspondence);
+      par_pkdouble(rp->constraining);
+      par_pkint(rp->pass);
+      par_pkdouble(rp->memoryNeeded);
+      if (rp->message != NULL)
+	par_pkstr(rp->message);
+      else
+	par_pkstr("");
     }
-  return(sum);
 }
 
-size_t
-CountIntersectionBits (unsigned char *p, unsigned char *q, size_t n)
+void
+UnpackResult ()
 {
-  size_t ii;
-  unsigned char b;
-  size_t sum = 0;
+  char s[PATH_MAX];
+  int i;
+  int n;
+  Result *rp;
 
-  for (ii = 0; ii < n; ++ii)
+  resultSplit = par_upkint();
+  n = par_upkint();
+  AllocateGroupResults(n);
+  nGroupResults = n;
+  for (i = 0; i < n; ++i)
     {
-      b = (*p++) & (*q++);
-      while (b != 0)
-	{
-	  if (b & 1)
-	    ++sum;
-	  b >>= 1;
-	}
+      rp = &groupResults[i];
+      UnpackPair(&(rp->pair));
+      rp->updated = par_upkint();
+      rp->distortion = par_upkdouble();
+      rp->correlation = par_upkdouble();
+      rp->correspondence = par_upkdouble();
+      rp->constraining = par_upkdouble();
+      rp->pass = par_upkint();
+      rp->memoryNeeded = par_upkdouble();
+      par_upkstr(s);
+      if (s[0] != '\0')
+	CopyString(&(rp->message), s);
+      else
+	CopyString(&(rp->message), NULL);
     }
-  return(sum);
 }
 
 int
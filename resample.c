@@ -0,0 +1,304 @@
+/*
+ * resample.c -- bilinear evaluation of maps
+ *
+ *  Copyright (c) 2026 Pittsburgh Supercomputing Center,
+ *                     Carnegie Mellon University
+ *
+ *  This file is part of AlignTK.
+ *
+ *  AlignTK is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  AlignTK is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with AlignTK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  HISTORY
+ *    2026     Written, from the interpolation of ComposeMaps
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "resample.h"
+
+/* the points i0..i1 (or rows i0..i1 of omap) done by one thread */
+typedef struct ResampleBand
+{
+  pthread_t thread;
+  int i0, i1;
+  MapElement *map;
+  int mLevel, mw, mh;
+  int mxMin, myMin;
+  float *px, *py;		/* if not NULL, the points to evaluate */
+  MapElement *omap;		/* the values at the points, or the grid */
+  int oLevel, ow;
+  int oxMin, oyMin;
+  int failed;			/* if 1, the band met a negative confidence, */
+  char error[128];		/* described here */
+} ResampleBand;
+
+static int RunBands (ResampleBand *proto, int n, int nThreads, char *error);
+static void *ResampleThreadMain (void *arg);
+static void ResampleBandItems (ResampleBand *b);
+
+int
+SampleMap (MapElement *map, int mw, int mh, int mxMin, int myMin,
+	   float x, float y, MapElement *result)
+{
+  int ix, iy;
+  float rx, ry, rc;
+  float rx00, rx01, rx10, rx11;
+  float ry00, ry01, ry10, ry11;
+  float rc00, rc01, rc10, rc11;
+  float rrx, rry;
+
+  ix = ((int) floor(x)) - mxMin;
+  iy = ((int) floor(y)) - myMin;
+  rrx = x - (mxMin + ix);
+  rry = y - (myMin + iy);
+
+  if (ix < -1 || (ix == -1 && rrx < 0.999) ||
+      (ix == mw-1 && rrx > 0.001) || ix >= mw ||
+      iy < -1 || (iy == -1 && rry < 0.999) ||
+      (iy == mh-1 && rry > 0.001) || iy >= mh ||
+      mw < 2 || mh < 2)
+    {
+      result->x = 0.0;
+      result->y = 0.0;
+      result->c = 0.0;
+      return(0);
+    }
+
+  while (ix < 0)
+    {
+      ++ix;
+      rrx -= 1.0;
+    }
+  while (iy < 0)
+    {
+      ++iy;
+      rry -= 1.0;
+    }
+  while (ix >= mw-1)
+    {
+      --ix;
+      rrx += 1.0;
+    }
+  while (iy >= mh-1)
+    {
+      --iy;
+      rry += 1.0;
+    }
+
+  rx00 = map[iy*mw+ix].x;
+  ry00 = map[iy*mw+ix].y;
+  rc00 = map[iy*mw+ix].c;
+  rx01 = map[(iy+1)*mw+ix].x;
+  ry01 = map[(iy+1)*mw+ix].y;
+  rc01 = map[(iy+1)*mw+ix].c;
+  rx10 = map[iy*mw+ix+1].x;
+  ry10 = map[iy*mw+ix+1].y;
+  rc10 = map[iy*mw+ix+1].c;
+  rx11 = map[(iy+1)*mw+ix+1].x;
+  ry11 = map[(iy+1)*mw+ix+1].y;
+  rc11 = map[(iy+1)*mw+ix+1].c;
+
+  rc = rc00;
+  if (rc01 < rc)
+    rc = rc01;
+  if (rc10 < rc)
+    rc = rc10;
+  if (rc11 < rc)
+    rc = rc11;
+  if (rc <= 0.0)
+    {
+      result->x = 0.0;
+      result->y = 0.0;
+      result->c = rc < 0.0 ? rc : 0.0;
+      return(rc < 0.0 ? -1 : 0);
+    }
+
+  rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+    - rx10 * rrx * (rry - 1.0)
+    - rx01 * (rrx - 1.0) * rry
+    + rx11 * rrx * rry;
+  ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+    - ry10 * rrx * (rry - 1.0)
+    - ry01 * (rrx - 1.0) * rry
+    + ry11 * rrx * rry;
+  result->x = rx;
+  result->y = ry;
+  result->c = rc;
+  return(1);
+}
+
+int
+SampleMapPoints (MapElement *map, int mw, int mh, int mxMin, int myMin,
+		 int n, float *px, float *py,
+		 MapElement *out, int nThreads, char *error)
+{
+  ResampleBand proto;
+
+  memset(&proto, 0, sizeof(proto));
+  proto.map = map;
+  proto.mw = mw;
+  proto.mh = mh;
+  proto.mxMin = mxMin;
+  proto.myMin = myMin;
+  proto.px = px;
+  proto.py = py;
+  proto.omap = out;
+  return(RunBands(&proto, n, nThreads, error));
+}
+
+int
+ResampleMap (MapElement *map, int mLevel, int mw, int mh,
+	     int mxMin, int myMin,
+	     MapElement *omap, int oLevel, int ow, int oh,
+	     int oxMin, int oyMin,
+	     int nThreads, char *error)
+{
+  ResampleBand proto;
+
+  memset(&proto, 0, sizeof(proto));
+  proto.map = map;
+  proto.mLevel = mLevel;
+  proto.mw = mw;
+  proto.mh = mh;
+  proto.mxMin = mxMin;
+  proto.myMin = myMin;
+  proto.omap = omap;
+  proto.oLevel = oLevel;
+  proto.ow = ow;
+  proto.oxMin = oxMin;
+  proto.oyMin = oyMin;
+  return(RunBands(&proto, oh, nThreads, error));
+}
+
+/* RunBands splits the n items of proto (points, or rows of the grid)
+   into bands, and runs them on up to nThreads threads */
+static int
+RunBands (ResampleBand *proto, int n, int nThreads, char *error)
+{
+  ResampleBand *bands;
+  int nBands;
+  int nStarted;
+  int i;
+  int result;
+
+  if (n <= 0)
+    return(1);
+  nBands = nThreads;
+  if (nBands > n)
+    nBands = n;
+  if (nBands < 1)
+    nBands = 1;
+  bands = (ResampleBand *) malloc(nBands * sizeof(ResampleBand));
+  if (bands == NULL)
+    {
+      sprintf(error, "Could not allocate %d resample bands\n", nBands);
+      return(0);
+    }
+  for (i = 0; i < nBands; ++i)
+    {
+      bands[i] = *proto;
+      bands[i].i0 = (int) (((long long) n * i) / nBands);
+      bands[i].i1 = (int) (((long long) n * (i+1)) / nBands) - 1;
+    }
+
+  result = 1;
+  if (nBands == 1)
+    ResampleBandItems(&bands[0]);
+  else
+    {
+      for (nStarted = 0; nStarted < nBands; ++nStarted)
+	if (pthread_create(&bands[nStarted].thread, NULL,
+			   ResampleThreadMain, &bands[nStarted]) != 0)
+	  {
+	    sprintf(error, "Could not create resample thread.\n");
+	    result = 0;
+	    break;
+	  }
+      for (i = 0; i < nStarted; ++i)
+	pthread_join(bands[i].thread, NULL);
+    }
+
+  /* report the failure of the first band that had one */
+  for (i = 0; result && i < nBands; ++i)
+    if (bands[i].failed)
+      {
+	sprintf(error, "%s", bands[i].error);
+	result = 0;
+      }
+  free(bands);
+  return(result);
+}
+
+static void *
+ResampleThreadMain (void *arg)
+{
+  ResampleBandItems((ResampleBand *) arg);
+  return(NULL);
+}
+
+static void
+ResampleBandItems (ResampleBand *b)
+{
+  MapElement *map = b->map;
+  int mw = b->mw;
+  int mh = b->mh;
+  int mxMin = b->mxMin;
+  int myMin = b->myMin;
+  MapElement *omap = b->omap;
+  int ow = b->ow;
+  int i, x;
+  float toMap, fromMap;
+  float yv;
+  MapElement *row;
+
+  if (b->px != NULL)
+    {
+      for (i = b->i0; i <= b->i1; ++i)
+	if (SampleMap(map, mw, mh, mxMin, myMin,
+		      b->px[i], b->py[i], &omap[i]) < 0)
+	  {
+	    sprintf(b->error, "Negative confidence in map near (%f,%f).\n",
+		    b->px[i], b->py[i]);
+	    b->failed = 1;
+	    return;
+	  }
+      return;
+    }
+
+  /* the levels are powers of 2 apart, so these steps are exact */
+  toMap = ((float) (1 << b->oLevel)) / (1 << b->mLevel);
+  fromMap = ((float) (1 << b->mLevel)) / (1 << b->oLevel);
+  for (i = b->i0; i <= b->i1; ++i)
+    {
+      yv = (b->oyMin + i) * toMap;
+      row = &omap[(size_t) i * ow];
+      for (x = 0; x < ow; ++x)
+	{
+	  if (SampleMap(map, mw, mh, mxMin, myMin,
+			(b->oxMin + x) * toMap, yv, &row[x]) < 0)
+	    {
+	      sprintf(b->error, "Negative confidence in map near (%d,%d).\n",
+		      b->oxMin + x, b->oyMin + i);
+	      b->failed = 1;
+	      return;
+	    }
+	  row[x].x *= fromMap;
+	  row[x].y *= fromMap;
+	}
+    }
+}
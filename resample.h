@@ -0,0 +1,54 @@
+//
+// resample.h - bilinear evaluation of maps, at single points, at
+//              lists of points and over regular grids, shared by the
+//              tools that read one map through another
+//
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "imio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SampleMap evaluates map (mw x mh, offset by mxMin, myMin) at the
+   point (x, y), given in units of the map spacing, setting result to
+   the bilinear interpolation of the four elements around the point
+   and to the least of their confidences.  A point within 0.001 of the
+   edge of the map, inside or out, is taken from the cell on the edge,
+   as ComposeMaps has always done.  It returns 1 if the point could be
+   evaluated, and otherwise sets result to 0 and returns 0 if the point
+   is off the map or any of the four elements has zero confidence, or
+   -1 if one of them has a negative confidence, which no valid map
+   holds. */
+int SampleMap (MapElement *map, int mw, int mh, int mxMin, int myMin,
+	       float x, float y, MapElement *result);
+
+/* SampleMapPoints evaluates map, as SampleMap does, at the n points
+   (px[i], py[i]), setting out[i], with the points split into bands
+   done by up to nThreads threads.  It returns 0, with a message in
+   error, if a thread could not be started or the map holds a negative
+   confidence. */
+int SampleMapPoints (MapElement *map, int mw, int mh, int mxMin, int myMin,
+		     int n, float *px, float *py,
+		     MapElement *out, int nThreads, char *error);
+
+/* ResampleMap evaluates map (mw x mh at mLevel, offset by mxMin, myMin)
+   at each point of the grid of omap (ow x oh at oLevel, offset by
+   oxMin, oyMin), as SampleMap does, leaving the values of omap in units
+   of its own spacing; with oLevel below mLevel this is the upsampling
+   of a map from one level of the pyramid to the next.  The rows of
+   omap are split into bands done by up to nThreads threads.  It
+   returns 0, with a message in error, as SampleMapPoints does. */
+int ResampleMap (MapElement *map, int mLevel, int mw, int mh,
+		 int mxMin, int myMin,
+		 MapElement *omap, int oLevel, int ow, int oh,
+		 int oxMin, int oyMin,
+		 int nThreads, char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RESAMPLE_H */
@@ -37,9 +37,14 @@
 #include <unistd.h>
 #include <limits.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "imio.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #define SHIFT   0
 #define CROP    1
 #define ROTATE  2
@@ -48,6 +53,11 @@
 #define SIZE    5
 #define RESIZE  6
 
+/* interpolation kernels */
+#define NEAREST  0
+#define BILINEAR 1
+#define BICUBIC  2
+
 typedef struct Op
 {
   int type;
@@ -65,9 +75,51 @@ typedef struct Constraint
   double c;
 } Constraint;
 
+/* the subsamples of the output, laid out as rows of
+   outputWidth*osf sample columns, and what they are taken from;
+   everything in here is shared by the threads and only read */
+typedef struct Resampler
+{
+  int kernel;			/* NEAREST, BILINEAR, or BICUBIC */
+  int osf;			/* subsamples per output pixel along x and y */
+  double t[2][3];		/* output to input transform */
+  int nConstraints;
+  Constraint *constraints;
+  int w, h;
+  unsigned char *image;
+  unsigned char *mask;		/* NULL if every input pixel is valid */
+  int mbpl;
+  int outputWidth;
+  unsigned char *output;
+  unsigned char *outputMask;
+  int ombpl;
+  int nSamples;			/* outputWidth * osf */
+  double *px;			/* x of each sample column */
+  double *tx0, *tx1;		/* t[0][0]*px and t[1][0]*px */
+  int separable;		/* 1 if input x depends only on output x
+				   and input y only on output y */
+  int *nx, *ix;			/* if separable, the input column of each */
+  float *fx;			/*   sample column (see SampleCoordinates) */
+} Resampler;
+
+/* the output rows y0..y1 computed by one thread */
+typedef struct ResampleBand
+{
+  pthread_t thread;
+  Resampler *r;
+  int y0, y1;
+  int ok;			/* 0 if the band could not be computed */
+} ResampleBand;
+
 /* FORWARD DECLARATIONS */
 void ApplyTransform(double m[2][3], double t[2][3], int n, Constraint *con);
 int Compare (const void *x, const void *y);
+void *ResampleThreadMain (void *arg);
+int ResampleRows (Resampler *r, int y0, int y1);
+void SampleRange (Resampler *r, double py, int *s0, int *s1);
+void SampleCoordinates (double *a, double b, double c, int s0, int s1,
+			int kernel, int *n, int *i, float *f);
+void KernelWeights (int kernel, float f, float *wt);
 
 int
 main (int argc, char **argv)
@@ -90,12 +142,18 @@ main (int argc, char **argv)
   char maskName[PATH_MAX];
   char outputName[PATH_MAX];
   char outputMaskName[PATH_MAX];
+  char outputTransformName[PATH_MAX];
+  FILE *f;
   int oversamplingFactor;
+  int kernel;
+  int nThreads;
+  int nBands;
+  ResampleBand *bands;
+  Resampler res;
   int nOps;
   Op* ops;
-  int v;
-  int x, y;
-  int dx, dy;
+  int x;
+  int dx;
   unsigned char *image;
   unsigned char *mask;
   unsigned char *output;
@@ -109,12 +167,7 @@ main (int argc, char **argv)
   int maskPresent;
   int mbpl, ombpl;
   int outputWidth, outputHeight;
-  int valid;
-  int nx, ny;
-  int sum;
-  double px, py;
-  int outside;
-  int osf, osf2;
+  int osf;
   char msg[PATH_MAX+256];
 
   error = 0;
@@ -124,7 +177,10 @@ main (int argc, char **argv)
   maskName[0] = '\0';
   outputName[0] = '\0';
   outputMaskName[0] = '\0';
+  outputTransformName[0] = '\0';
   oversamplingFactor = 16;
+  kernel = NEAREST;
+  nThreads = 1;
   nOps = 0;
   ops = NULL;
   for (i = 1; i < argc; ++i)
@@ -186,6 +242,16 @@ main (int argc, char **argv)
 	  }
 	strcpy(outputMaskName, argv[i]);
       }
+    else if (strcmp(argv[i], "-output_transform") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-output_transform error\n");
+	    break;
+	  }
+	strcpy(outputTransformName, argv[i]);
+      }
     else if (strcmp(argv[i], "-shift") == 0)
       {
 	if (i+2 >= argc ||
@@ -324,13 +390,47 @@ main (int argc, char **argv)
       }
     else if (strcmp(argv[i], "-oversampling") == 0)
       {
-	if (i+1 > argc ||
-	    sscanf(argv[i+1], "%d", &oversamplingFactor) != 1)
+	if (i+1 >= argc ||
+	    sscanf(argv[i+1], "%d", &oversamplingFactor) != 1 ||
+	    oversamplingFactor < 1)
 	  {
 	    error = 1;
 	    fprintf(stderr, "-oversampling error\n");
 	    break;
 	  }
+	i += 1;
+      }
+    else if (strcmp(argv[i], "-interpolation") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-interpolation error\n");
+	    break;
+	  }
+	if (strcmp(argv[i], "nearest") == 0)
+	  kernel = NEAREST;
+	else if (strcmp(argv[i], "bilinear") == 0)
+	  kernel = BILINEAR;
+	else if (strcmp(argv[i], "bicubic") == 0)
+	  kernel = BICUBIC;
+	else
+	  {
+	    error = 1;
+	    fprintf(stderr, "-interpolation nearest|bilinear|bicubic error\n");
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &nThreads) != 1 ||
+	    nThreads < 1)
+	  {
+	    error = 1;
+	    fprintf(stderr, "-threads error\n");
+	    break;
+	  }
       }
     else
       {
@@ -346,13 +446,17 @@ main (int argc, char **argv)
       fprintf(stderr, "             [-mask directory_prefix]\n");
       fprintf(stderr, "              -output file_prefix\n");
       fprintf(stderr, "             [-output_mask file_prefix]\n");
+      fprintf(stderr, "             [-output_transform file]\n");
       fprintf(stderr, "             [-shift shift_x shift_y]\n");
       fprintf(stderr, "             [-crop min_x max_x min_y max_y]\n");
       fprintf(stderr, "             [-rotate theta_degrees_ccw]\n");
       fprintf(stderr, "             [-scale scale]\n");
       fprintf(stderr, "             [-stretch scale_x scale_y]\n");
-      fprintf(stderr, "             [-size width height]");
-      fprintf(stderr, "             [-resize width height]");
+      fprintf(stderr, "             [-size width height]\n");
+      fprintf(stderr, "             [-resize width height]\n");
+      fprintf(stderr, "             [-oversampling factor]\n");
+      fprintf(stderr, "             [-interpolation nearest|bilinear|bicubic]\n");
+      fprintf(stderr, "             [-threads number_of_threads]\n");
       exit(1);
     }
 
@@ -420,8 +524,7 @@ main (int argc, char **argv)
   if (!maskPresent)
     {
       mbpl = (w + 7) >> 3;
-      mask = (unsigned char *) malloc(h * mbpl);
-      memset(mask, 0xff, h*mbpl);
+      mask = NULL;
     }
 
   osf = 1;
@@ -576,48 +679,95 @@ main (int argc, char **argv)
   memset(outputMask, 0, outputHeight*ombpl);
 
   /* compute the output image */
-  osf2 = osf * osf;
-  for (y = 0; y < outputHeight; ++y)
-    for (x = 0; x < outputWidth; ++x)
-      {
-	sum = 0;
-	valid = 1;
-	for (dy = 0; dy < osf; ++dy)
-	  {
-	    py = y + (((double) dy) + 0.5) / osf;
-	    for (dx = 0; dx < osf; ++dx)
-	      {
-		px = x + (((double) dy) + 0.5) / osf;
-		outside = 0;
-		for (i = 0; i < nConstraints; ++i)
-		  if (constraints[i].a * px +
-		      constraints[i].b * py +
-		      constraints[i].c <= 0.0)
-		    {
-		      outside = 1;
-		      valid = 0;
-		      break;
-		    }
-		if (!outside)
-		  {
-		    nx = floor(t[0][0] * px + t[0][1] * py + t[0][2]);
-		    ny = floor(t[1][0] * px + t[1][1] * py + t[1][2]);
-		    if (nx >= 0 && nx < w &&
-			ny >= 0 && ny < h)
-		      {
-			sum += image[ny*w + nx];
-			if ((mask[ny*mbpl + (nx >> 3)] & (0x80 >> (nx & 7))) == 0)
-			  valid = 0;
-		      }
-		    else
-		      valid = 0;
-		  }
-	      }
-	  }
-	output[y*outputWidth+x] = (sum + (osf2 >> 1)) / osf2;
-	if (valid)
-	  outputMask[y*ombpl + (x >> 3)] |= 0x80 >> (x & 7);
-      }
+  res.kernel = kernel;
+  res.osf = osf;
+  for (i = 0; i < 2; ++i)
+    for (j = 0; j < 3; ++j)
+      res.t[i][j] = t[i][j];
+  res.nConstraints = nConstraints;
+  res.constraints = constraints;
+  res.w = w;
+  res.h = h;
+  res.image = image;
+  res.mask = mask;
+  res.mbpl = mbpl;
+  res.outputWidth = outputWidth;
+  res.output = output;
+  res.outputMask = outputMask;
+  res.ombpl = ombpl;
+  res.nSamples = outputWidth * osf;
+  res.px = (double *) malloc(res.nSamples * sizeof(double));
+  res.tx0 = (double *) malloc(res.nSamples * sizeof(double));
+  res.tx1 = (double *) malloc(res.nSamples * sizeof(double));
+  for (x = 0; x < outputWidth; ++x)
+    for (dx = 0; dx < osf; ++dx)
+      res.px[x*osf+dx] = x + (((double) dx) + 0.5) / osf;
+  for (i = 0; i < res.nSamples; ++i)
+    {
+      res.tx0[i] = t[0][0] * res.px[i];
+      res.tx1[i] = t[1][0] * res.px[i];
+    }
+  res.separable = t[0][1] == 0.0 && t[1][0] == 0.0;
+  res.nx = NULL;
+  res.ix = NULL;
+  res.fx = NULL;
+  if (res.separable)
+    {
+      /* the input column of a sample does not depend on its row */
+      res.nx = (int *) malloc(res.nSamples * sizeof(int));
+      res.ix = (int *) malloc(res.nSamples * sizeof(int));
+      res.fx = (float *) malloc(res.nSamples * sizeof(float));
+      SampleCoordinates(res.tx0, 0.0, t[0][2], 0, res.nSamples,
+			kernel, res.nx, res.ix, res.fx);
+    }
+
+  nBands = nThreads;
+  if (nBands > outputHeight)
+    nBands = outputHeight;
+  error = 0;
+  if (nBands <= 1)
+    error = !ResampleRows(&res, 0, outputHeight - 1);
+  else
+    {
+      bands = (ResampleBand *) malloc(nBands * sizeof(ResampleBand));
+      for (i = 0; i < nBands; ++i)
+	{
+	  bands[i].r = &res;
+	  bands[i].y0 = (int) (((long long) outputHeight * i) / nBands);
+	  bands[i].y1 = (int) (((long long) outputHeight * (i+1)) / nBands) - 1;
+	  if (pthread_create(&bands[i].thread, NULL,
+			     ResampleThreadMain, &bands[i]) != 0)
+	    {
+	      fprintf(stderr, "Could not create resampling thread.\n");
+	      exit(1);
+	    }
+	}
+      for (i = 0; i < nBands; ++i)
+	{
+	  if (pthread_join(bands[i].thread, NULL) != 0)
+	    {
+	      fprintf(stderr, "Could not join resampling thread.\n");
+	      exit(1);
+	    }
+	  if (!bands[i].ok)
+	    error = 1;
+	}
+      free(bands);
+    }
+  if (error)
+    {
+      fprintf(stderr, "Could not allocate the resampling buffers.\n");
+      exit(1);
+    }
+  free(res.px);
+  free(res.tx0);
+  free(res.tx1);
+  if (res.separable)
+    {
+      free(res.nx);
+      free(res.ix);
+      free(res.fx);
+    }
 
   /* write out the output image */
   if (!WriteImage(outputName, output,
@@ -642,8 +792,27 @@ main (int argc, char **argv)
 	}
     }
 
+  /* write out the transform from output to input coordinates, so
+     that apply_map -pre_transforms can render from the input image
+     with maps computed on the output */
+  if (outputTransformName[0] != '\0')
+    {
+      f = fopen(outputTransformName, "w");
+      if (f == NULL ||
+	  fprintf(f, "%.17g %.17g %.17g\n%.17g %.17g %.17g\n",
+		  t[0][0], t[0][1], t[0][2],
+		  t[1][0], t[1][1], t[1][2]) < 0 ||
+	  fclose(f) != 0)
+	{
+	  fprintf(stderr, "Could not write transform %s\n",
+		  outputTransformName);
+	  exit(1);
+	}
+    }
+
   free(image);
-  free(mask);
+  if (mask != NULL)
+    free(mask);
   free(output);
   free(outputMask);
   free(constraints);
@@ -694,3 +863,350 @@ ApplyTransform(double m[2][3], double t[2][3], int n, Constraint *con)
     }
 }
 
+
+void *
+ResampleThreadMain (void *arg)
+{
+  ResampleBand *b = (ResampleBand *) arg;
+
+  b->ok = ResampleRows(b->r, b->y0, b->y1);
+  return(NULL);
+}
+
+/* ResampleRows computes output rows y0..y1: each output pixel is the
+   average of osf x osf subsamples of the input, and is valid only if
+   all of its subsamples satisfy the constraints and fall on valid
+   input pixels.  The constraints and transform are affine, so along a
+   row of subsamples the ones inside the constraints form a single
+   interval, and the input coordinates only need an add per sample
+   once the terms that depend on the row have been computed.
+   It returns 0 if its buffers could not be allocated. */
+int
+ResampleRows (Resampler *r, int y0, int y1)
+{
+  int osf = r->osf;
+  int osf2 = osf * osf;
+  int w = r->w;
+  int h = r->h;
+  int width = r->outputWidth;
+  int kernel = r->kernel;
+  int nTaps, tapOffset;
+  int x, y, dy;
+  int s, s0, s1, se;
+  int k, l;
+  int xx, yy;
+  int v;
+  double py;
+  int *isum;
+  float *fsum;
+  unsigned char *valid;
+  int *nx, *ix, *ny, *iy;
+  float *fx, *fy;
+  int vn, vi;
+  float vf;
+  float wx[4], wy[4];
+  float value, rowValue;
+  unsigned char *row;
+  unsigned char *mask = r->mask;
+  int mbpl = r->mbpl;
+  unsigned char *outputMask;
+
+  if (width <= 0 || y0 > y1)
+    return(1);
+  nTaps = kernel == BICUBIC ? 4 : 2;
+  tapOffset = kernel == BICUBIC ? -1 : 0;
+  isum = (int *) malloc((size_t) width * sizeof(int));
+  fsum = (float *) malloc((size_t) width * sizeof(float));
+  valid = (unsigned char *) malloc((size_t) width);
+  nx = ix = ny = iy = NULL;
+  fx = fy = NULL;
+  if (isum == NULL || fsum == NULL || valid == NULL)
+    {
+      free(isum);
+      free(fsum);
+      free(valid);
+      return(0);
+    }
+  vn = vi = 0;
+  vf = 0.0;
+  if (r->separable)
+    {
+      nx = r->nx;
+      ix = r->ix;
+      fx = r->fx;
+    }
+  else
+    {
+      nx = (int *) malloc(r->nSamples * sizeof(int));
+      ny = (int *) malloc(r->nSamples * sizeof(int));
+      if (kernel != NEAREST)
+	{
+	  ix = (int *) malloc(r->nSamples * sizeof(int));
+	  iy = (int *) malloc(r->nSamples * sizeof(int));
+	  fx = (float *) malloc(r->nSamples * sizeof(float));
+	  fy = (float *) malloc(r->nSamples * sizeof(float));
+	}
+      if (nx == NULL || ny == NULL ||
+	  (kernel != NEAREST &&
+	   (ix == NULL || iy == NULL || fx == NULL || fy == NULL)))
+	{
+	  free(isum);
+	  free(fsum);
+	  free(valid);
+	  free(nx);
+	  free(ny);
+	  free(ix);
+	  free(iy);
+	  free(fx);
+	  free(fy);
+	  return(0);
+	}
+    }
+
+  for (y = y0; y <= y1; ++y)
+    {
+      memset(isum, 0, (size_t) width * sizeof(int));
+      for (x = 0; x < width; ++x)
+	fsum[x] = 0.0;
+      memset(valid, 1, (size_t) width);
+      for (dy = 0; dy < osf; ++dy)
+	{
+	  py = y + (((double) dy) + 0.5) / osf;
+	  SampleRange(r, py, &s0, &s1);
+
+	  /* pixels with a subsample outside the constraints are invalid */
+	  for (x = 0; x < width && x * osf < s0; ++x)
+	    valid[x] = 0;
+	  for (x = s1 / osf; x < width; ++x)
+	    valid[x] = 0;
+	  if (s0 >= s1)
+	    continue;
+
+	  if (r->separable)
+	    {
+	      SampleCoordinates(r->tx1 + s0, r->t[1][1] * py, r->t[1][2],
+				0, 1, kernel, &vn, &vi, &vf);
+	      if (kernel != NEAREST)
+		KernelWeights(kernel, vf, wy);
+	    }
+	  else
+	    {
+	      SampleCoordinates(r->tx0, r->t[0][1] * py, r->t[0][2],
+				s0, s1, kernel, nx, ix, fx);
+	      SampleCoordinates(r->tx1, r->t[1][1] * py, r->t[1][2],
+				s0, s1, kernel, ny, iy, fy);
+	    }
+
+	  s = s0;
+	  x = s0 / osf;
+	  while (s < s1)
+	    {
+	      se = (x + 1) * osf;
+	      if (se > s1)
+		se = s1;
+	      for (; s < se; ++s)
+		{
+		  if (!r->separable)
+		    {
+		      vn = ny[s];
+		      if (kernel != NEAREST)
+			{
+			  vi = iy[s];
+			  KernelWeights(kernel, fy[s], wy);
+			}
+		    }
+		  if (nx[s] < 0 || nx[s] >= w ||
+		      vn < 0 || vn >= h)
+		    {
+		      valid[x] = 0;
+		      continue;
+		    }
+		  if (mask != NULL &&
+		      (mask[(size_t) vn*mbpl + (nx[s] >> 3)] &
+		       (0x80 >> (nx[s] & 7))) == 0)
+		    valid[x] = 0;
+		  if (kernel == NEAREST)
+		    {
+		      isum[x] += r->image[(size_t) vn*w + nx[s]];
+		      continue;
+		    }
+
+		  KernelWeights(kernel, fx[s], wx);
+		  value = 0.0;
+		  for (l = 0; l < nTaps; ++l)
+		    {
+		      yy = vi + tapOffset + l;
+		      if (yy < 0)
+			yy = 0;
+		      else if (yy >= h)
+			yy = h - 1;
+		      row = r->image + (size_t) yy * w;
+		      rowValue = 0.0;
+		      for (k = 0; k < nTaps; ++k)
+			{
+			  xx = ix[s] + tapOffset + k;
+			  if (xx < 0)
+			    xx = 0;
+			  else if (xx >= w)
+			    xx = w - 1;
+			  rowValue += wx[k] * row[xx];
+			}
+		      value += wy[l] * rowValue;
+		    }
+		  fsum[x] += value;
+		}
+	      ++x;
+	    }
+	}
+
+      outputMask = r->outputMask + (size_t) y * r->ombpl;
+      for (x = 0; x < width; ++x)
+	{
+	  if (kernel == NEAREST)
+	    v = (isum[x] + (osf2 >> 1)) / osf2;
+	  else
+	    {
+	      value = fsum[x] / osf2 + 0.5;
+	      v = value <= 0.0 ? 0 : (value >= 255.0 ? 255 : (int) value);
+	    }
+	  r->output[(size_t) y * width + x] = v;
+	  if (valid[x])
+	    outputMask[x >> 3] |= 0x80 >> (x & 7);
+	}
+    }
+
+  free(isum);
+  free(fsum);
+  free(valid);
+  if (!r->separable)
+    {
+      free(nx);
+      free(ny);
+      if (kernel != NEAREST)
+	{
+	  free(ix);
+	  free(iy);
+	  free(fx);
+	  free(fy);
+	}
+    }
+  return(1);
+}
+
+/* SampleRange finds the sample columns s0 <= s < s1 of the subsample
+   row at py that satisfy all the constraints; each constraint is
+   monotonic along the row, so a binary search finds where it starts
+   or stops being satisfied */
+void
+SampleRange (Resampler *r, double py, int *s0, int *s1)
+{
+  int i;
+  int lo, hi;
+  int l, u, m;
+  double a, k, c;
+  double *px = r->px;
+
+  lo = 0;
+  hi = r->nSamples;
+  for (i = 0; i < r->nConstraints && lo < hi; ++i)
+    {
+      a = r->constraints[i].a;
+      k = r->constraints[i].b * py;
+      c = r->constraints[i].c;
+      l = lo;
+      u = hi;
+      if (a >= 0.0)
+	{
+	  /* satisfied from some column on */
+	  while (l < u)
+	    {
+	      m = (l + u) >> 1;
+	      if (a * px[m] + k + c <= 0.0)
+		l = m + 1;
+	      else
+		u = m;
+	    }
+	  lo = l;
+	}
+      else
+	{
+	  /* satisfied up to some column */
+	  while (l < u)
+	    {
+	      m = (l + u) >> 1;
+	      if (a * px[m] + k + c <= 0.0)
+		u = m;
+	      else
+		l = m + 1;
+	    }
+	  hi = l;
+	}
+    }
+  *s0 = lo;
+  *s1 = hi;
+}
+
+/* SampleCoordinates computes the input coordinates u = a[s] + b + c of
+   samples s0 <= s < s1; n[s] is the input pixel containing u, and for
+   the interpolating kernels i[s] is the pixel whose center is at or just
+   before u and f[s] the fraction of the way to the next one */
+void
+SampleCoordinates (double *a, double b, double c, int s0, int s1,
+		   int kernel, int *n, int *i, float *f)
+{
+  int s;
+  double u, uh, fl;
+
+  s = s0;
+#if defined(__AVX2__)
+  {
+    __m256d bv = _mm256_set1_pd(b);
+    __m256d cv = _mm256_set1_pd(c);
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d uv, hv, flv;
+
+    for (; s + 4 <= s1; s += 4)
+      {
+	uv = _mm256_add_pd(_mm256_add_pd(_mm256_loadu_pd(a + s), bv), cv);
+	_mm_storeu_si128((__m128i *) (n + s),
+			 _mm256_cvttpd_epi32(_mm256_floor_pd(uv)));
+	if (kernel != NEAREST)
+	  {
+	    hv = _mm256_sub_pd(uv, half);
+	    flv = _mm256_floor_pd(hv);
+	    _mm_storeu_si128((__m128i *) (i + s), _mm256_cvttpd_epi32(flv));
+	    _mm_storeu_ps(f + s, _mm256_cvtpd_ps(_mm256_sub_pd(hv, flv)));
+	  }
+      }
+  }
+#endif
+  for (; s < s1; ++s)
+    {
+      u = a[s] + b + c;
+      n[s] = floor(u);
+      if (kernel != NEAREST)
+	{
+	  uh = u - 0.5;
+	  fl = floor(uh);
+	  i[s] = fl;
+	  f[s] = uh - fl;
+	}
+    }
+}
+
+/* KernelWeights sets the weights of the 2 (BILINEAR) or 4 (BICUBIC,
+   Catmull-Rom) taps for a sample f of the way past the first center */
+void
+KernelWeights (int kernel, float f, float *wt)
+{
+  if (kernel == BILINEAR)
+    {
+      wt[0] = 1.0 - f;
+      wt[1] = f;
+      return;
+    }
+  wt[0] = ((-0.5 * f + 1.0) * f - 0.5) * f;
+  wt[1] = (1.5 * f - 2.5) * f * f + 1.0;
+  wt[2] = ((-1.5 * f + 2.0) * f + 0.5) * f;
+  wt[3] = (0.5 * f - 0.5) * f * f;
+}